@@ -0,0 +1,57 @@
+//
+//  AccessibilityTextModel.h
+//  iTerm
+//
+//  The text of a session as exposed to accessibility clients.
+//
+
+#import <Foundation/Foundation.h>
+#import "PTYTextViewDataSource.h"
+
+// Keeps the text of every line in a data source along with a table of where each line ends, so
+// accessibility queries don't rebuild the whole buffer and can map between offsets and lines with
+// a binary search. An update re-expands only lines that changed since the previous update: lines
+// that may still change (those on the screen) are compared against a copy of their cells, and
+// lines that have reached the scrollback are only looked at once more.
+@interface AccessibilityTextModel : NSObject {
+    NSMutableString *text_;
+
+    // One entry per line of the data source, starting with absolute line number firstLine_.
+    struct AccessibilityTextLine *lines_;
+    int count_;
+    int capacity_;
+
+    // Lines [0, numStable_) are in the scrollback and won't change.
+    int numStable_;
+
+    // An entry's end minus base_ is its offset in text_. base_ is the length of text dropped from
+    // the start as lines scrolled out of the scrollback.
+    NSUInteger base_;
+
+    long long firstLine_;
+    long long scrollbackEnd_;  // Absolute line number just after the scrollback at the last update.
+    int width_;
+    BOOL needsUpdate_;
+}
+
+// Marks the model as out of date. The next call to -updateWithDataSource: will bring it up to date.
+// Calling this many times between updates costs nothing extra.
+- (void)setNeedsUpdate;
+
+// Syncs with the data source if -setNeedsUpdate was called since the last update.
+- (void)updateWithDataSource:(id<PTYTextViewDataSource>)dataSource;
+
+// All lines joined, with newlines after hard line breaks.
+- (NSString *)text;
+
+- (int)numberOfLines;
+
+// Offset in -text of the start of a line and the range of a line, including its newline.
+- (NSUInteger)offsetOfLine:(int)lineNumber;
+- (NSRange)rangeOfLine:(int)lineNumber;
+
+// Index of the line containing an offset in -text. Returns numberOfLines for offsets at or past
+// the end of the text.
+- (int)lineNumberOfOffset:(NSUInteger)offset;
+
+@end
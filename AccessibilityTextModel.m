@@ -0,0 +1,245 @@
+//
+//  AccessibilityTextModel.m
+//  iTerm
+//
+
+#import "AccessibilityTextModel.h"
+
+struct AccessibilityTextLine {
+    NSUInteger end;         // Offset just past this line (and its newline) in text_, plus base_.
+    screen_char_t *chars;   // Copy of the line's width + 1 cells if it may still change, else NULL.
+};
+
+@implementation AccessibilityTextModel
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        text_ = [[NSMutableString alloc] init];
+        needsUpdate_ = YES;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self _removeAllLines];
+    free(lines_);
+    [text_ release];
+    [super dealloc];
+}
+
+- (void)setNeedsUpdate
+{
+    needsUpdate_ = YES;
+}
+
+- (NSString *)text
+{
+    return text_;
+}
+
+- (int)numberOfLines
+{
+    return count_;
+}
+
+- (NSUInteger)_endOfLine:(int)i
+{
+    return lines_[i].end - base_;
+}
+
+- (NSUInteger)offsetOfLine:(int)lineNumber
+{
+    if (lineNumber <= 0 || count_ == 0) {
+        return 0;
+    }
+    return [self _endOfLine:MIN(lineNumber, count_) - 1];
+}
+
+- (NSRange)rangeOfLine:(int)lineNumber
+{
+    NSUInteger start = [self offsetOfLine:lineNumber];
+    if (lineNumber < 0 || lineNumber >= count_) {
+        return NSMakeRange(start, [text_ length] - start);
+    }
+    return NSMakeRange(start, [self _endOfLine:lineNumber] - start);
+}
+
+- (int)lineNumberOfOffset:(NSUInteger)offset
+{
+    // Find the first line that ends after offset.
+    NSUInteger target = offset + base_;
+    int lo = 0;
+    int hi = count_;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (lines_[mid].end > target) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+#pragma mark - Updating
+
+- (void)_removeAllLines
+{
+    for (int i = 0; i < count_; i++) {
+        free(lines_[i].chars);
+    }
+    count_ = 0;
+    numStable_ = 0;
+    base_ = 0;
+    [text_ setString:@""];
+}
+
+// Forgets lines that scrolled out of the scrollback since the last update.
+- (void)_dropLinesBefore:(long long)firstLine
+{
+    int n = (int)MIN(firstLine - firstLine_, (long long)count_);
+    if (n > 0) {
+        NSUInteger length = [self _endOfLine:n - 1];
+        [text_ deleteCharactersInRange:NSMakeRange(0, length)];
+        base_ += length;
+        for (int i = 0; i < n; i++) {
+            free(lines_[i].chars);
+        }
+        memmove(lines_, lines_ + n, (count_ - n) * sizeof(*lines_));
+        count_ -= n;
+        numStable_ = MAX(0, numStable_ - n);
+    }
+    firstLine_ = firstLine;
+}
+
+- (void)_truncateToCount:(int)count
+{
+    if (count >= count_) {
+        return;
+    }
+    NSUInteger length = [self offsetOfLine:count];
+    [text_ deleteCharactersInRange:NSMakeRange(length, [text_ length] - length)];
+    for (int i = count; i < count_; i++) {
+        free(lines_[i].chars);
+    }
+    count_ = count;
+    numStable_ = MIN(numStable_, count_);
+}
+
+// Replaces the text of line i (which may be one past the last line) with the contents of line.
+- (void)_setLine:(int)i
+              to:(screen_char_t *)line
+         mutable:(BOOL)mutable
+          buffer:(unichar *)buffer
+{
+    if (i == count_) {
+        if (count_ == capacity_) {
+            capacity_ = MAX(256, capacity_ * 2);
+            lines_ = realloc(lines_, capacity_ * sizeof(*lines_));
+        }
+        lines_[count_].end = base_ + [text_ length];
+        lines_[count_].chars = NULL;
+        count_++;
+    }
+
+    int lastCell;
+    for (lastCell = width_ - 1; lastCell >= 0; lastCell--) {
+        if (line[lastCell].code) {
+            break;
+        }
+    }
+    int o = 0;
+    for (int j = 0; j <= lastCell; j++) {
+        if (line[j].complexChar) {
+            o += ExpandScreenChar(&line[j], buffer + o);
+        } else if (line[j].code >= 0xf000) {
+            // Don't output private range chars to accessibility.
+            buffer[o++] = 0;
+        } else {
+            buffer[o++] = line[j].code;
+        }
+    }
+    if (line[width_].code == EOL_HARD) {
+        buffer[o++] = '\n';
+    }
+
+    NSRange oldRange = [self rangeOfLine:i];
+    NSString *string = [[NSString alloc] initWithCharactersNoCopy:buffer
+                                                           length:o
+                                                     freeWhenDone:NO];
+    [text_ replaceCharactersInRange:oldRange withString:string];
+    [string release];
+
+    NSInteger delta = (NSInteger)o - (NSInteger)oldRange.length;
+    if (delta) {
+        for (int j = i; j < count_; j++) {
+            lines_[j].end += delta;
+        }
+    }
+
+    const size_t size = (width_ + 1) * sizeof(screen_char_t);
+    if (mutable) {
+        if (!lines_[i].chars) {
+            lines_[i].chars = malloc(size);
+        }
+        memcpy(lines_[i].chars, line, size);
+    } else {
+        free(lines_[i].chars);
+        lines_[i].chars = NULL;
+    }
+}
+
+- (void)updateWithDataSource:(id<PTYTextViewDataSource>)dataSource
+{
+    if (!needsUpdate_) {
+        return;
+    }
+    needsUpdate_ = NO;
+
+    int width = [dataSource width];
+    int numberOfLines = [dataSource numberOfLines];
+    int numberOfScrollbackLines = [dataSource numberOfScrollbackLines];
+    long long overflow = [dataSource totalScrollbackOverflow];
+    if (width != width_ ||
+        overflow < firstLine_ ||
+        overflow + numberOfScrollbackLines < scrollbackEnd_) {
+        // Resizing reflows the scrollback and clearing it reuses line numbers, so start over.
+        [self _removeAllLines];
+        width_ = width;
+        firstLine_ = overflow;
+    }
+    scrollbackEnd_ = overflow + numberOfScrollbackLines;
+    [self _dropLinesBefore:overflow];
+    [self _truncateToCount:numberOfLines];
+
+    screen_char_t *lineBuffer = malloc((width + 1) * sizeof(screen_char_t));
+    unichar *buffer = malloc((width * kMaxParts + 1) * sizeof(unichar));
+    for (int i = numStable_; i < numberOfLines; i++) {
+        screen_char_t *line = [dataSource getLineAtIndex:i withBuffer:lineBuffer];
+        BOOL mutable = (i >= numberOfScrollbackLines);
+        if (i < count_) {
+            if (!lines_[i].chars) {
+                continue;
+            }
+            if (!memcmp(lines_[i].chars, line, (width + 1) * sizeof(screen_char_t))) {
+                if (!mutable) {
+                    free(lines_[i].chars);
+                    lines_[i].chars = NULL;
+                }
+                continue;
+            }
+        }
+        [self _setLine:i to:line mutable:mutable buffer:buffer];
+    }
+    free(buffer);
+    free(lineBuffer);
+
+    while (numStable_ < count_ && !lines_[numStable_].chars) {
+        numStable_++;
+    }
+}
+
+@end
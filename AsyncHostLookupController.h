@@ -8,18 +8,22 @@
 
 #import <Foundation/Foundation.h>
 
-// Verify whether host names are valid. Runs in a separate thread and provides asynchronous results.
-// Caches very aggressively.
+// Verify whether host names are valid. Shared by all sessions. Up to four lookups run at once on
+// background threads and provide asynchronous results on the main thread. Requests for a
+// hostname that's already being looked up share its lookup. Results are cached for ten minutes,
+// or thirty seconds if the host didn't resolve.
 @interface AsyncHostLookupController : NSObject
 
 + (instancetype)sharedInstance;
 
 // Calls back to completion indicating whether |host| is an extant hostname. The BOOL is YES if the
-// hostname resolves. |host| is passed as the second argument to completion. Does not block.
+// hostname resolves. |host| is passed as the second argument to completion. Does not block, but
+// calls completion right away if the result is cached.
 - (void)getAddressForHost:(NSString *)host
                completion:(void (^)(BOOL, NSString*))completion;
 
-// Cancels the lookup for |hostname|.
+// Cancels a request for |hostname|. The lookup is skipped or its result isn't reported once every
+// request for the hostname has been cancelled.
 - (void)cancelRequestForHostname:(NSString *)hostname;
 
 @end
@@ -10,15 +10,62 @@
 #import "DebugLogging.h"
 #include <netdb.h>
 
+// Most lookups that may be in progress at once.
+static const int kMaxConcurrentLookups = 4;
+
+// How long a result is trusted. Hosts that didn't resolve are retried sooner, since that's often
+// because the network was down.
+static const NSTimeInterval kSuccessfulLookupTimeToLive = 10 * 60;
+static const NSTimeInterval kFailedLookupTimeToLive = 30;
+
+// A result in the cache.
+@interface AsyncHostLookupResult : NSObject {
+@public
+    BOOL ok;
+    NSTimeInterval expiration;
+}
+@end
+
+@implementation AsyncHostLookupResult
+@end
+
+// A hostname that hasn't been looked up yet or is being looked up.
+@interface AsyncHostLookupRequest : NSObject {
+@public
+    NSMutableArray *completions;
+    int interest;  // Number of calls to -getAddressForHost: not yet cancelled.
+    BOOL started;
+}
+@end
+
+@implementation AsyncHostLookupRequest
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        completions = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [completions release];
+    [super dealloc];
+}
+
+@end
+
 @implementation AsyncHostLookupController {
-    // Created at initialization and used to perform blocking gethostbyname calls.
-    dispatch_queue_t _queue;
+    // Maps hostname -> AsyncHostLookupRequest for hosts waiting for or in the middle of a lookup.
+    NSMutableDictionary *_pending;
+
+    // Hostnames in _pending that haven't started, oldest first.
+    NSMutableArray *_queued;
 
-    // Set of hostnames waiting to be looked up. If a hostname is removed from
-    // this set then it won't be looked up when its turn comes around.
-    NSMutableSet *_pending;
+    // Number of lookups running on background threads.
+    int _numberOfRunningLookups;
 
-    // Maps hostname -> @YES or @NO, indicating if it resolved.
+    // Maps hostname -> AsyncHostLookupResult.
     NSMutableDictionary *_cache;
 }
 
@@ -34,16 +81,15 @@
 - (id)init {
     self = [super init];
     if (self) {
-        _queue = dispatch_queue_create("AsyncHostLookupControllerQueue", NULL);
-        _pending = [[NSMutableSet alloc] init];
+        _pending = [[NSMutableDictionary alloc] init];
+        _queued = [[NSMutableArray alloc] init];
         _cache = [[NSMutableDictionary alloc] init];
     }
     return self;
 }
 
 - (void)dealloc {
-    // The logic for cleaning up the dispatch queue isn't written, so just make sure the singleton
-    // never gets dealloced.
+    // Lookups in progress refer to self, so just make sure the singleton never gets dealloced.
     assert(false);
     [super dealloc];
 }
@@ -51,53 +97,93 @@
 - (void)getAddressForHost:(NSString *)hostname
                completion:(void (^)(BOOL, NSString *))completion {
     NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    AsyncHostLookupResult *result;
     @synchronized(self) {
-        if ([_pending containsObject:hostname]) {
-            DLog(@"Already pending %@", hostname);
-            return;
+        result = [[_cache[hostname] retain] autorelease];
+        if (result && result->expiration < start) {
+            [_cache removeObjectForKey:hostname];
+            result = nil;
         }
-        NSNumber *okNumber = _cache[hostname];
-        if (okNumber) {
-            completion([okNumber boolValue], hostname);
-            return;
-        }
-        [_pending addObject:hostname];
-    }
-    dispatch_async(_queue, ^() {
-        @synchronized(self) {
-            if (![_pending containsObject:hostname]) {
-                DLog(@"Abort nslookup for %@", hostname);
-                return;
+        if (!result) {
+            AsyncHostLookupRequest *request = _pending[hostname];
+            if (request) {
+                DLog(@"Already pending %@", hostname);
+            } else {
+                request = [[[AsyncHostLookupRequest alloc] init] autorelease];
+                _pending[hostname] = request;
+                [_queued addObject:hostname];
             }
+            request->interest++;
+            [request->completions addObject:[[completion copy] autorelease]];
+            [self startQueuedLookups];
         }
-        
-        struct hostent *hbuf;
-        // On Mac OS this is thread-safe (it uses TLS for the hostent), and gethostbyname_r is not
-        // defined.
-        hbuf = gethostbyname([hostname UTF8String]);
-        BOOL ok = (hbuf != NULL);
-        @synchronized(self) {
-            _cache[hostname] = @(ok);
-        }
-        dispatch_async(dispatch_get_main_queue(), ^() {
-            @synchronized(self) {
-                if (![_pending containsObject:hostname]) {
-                    DLog(@"Finished nslookup but don't call block for %@", hostname);
-                    return;
-                }
-                [_pending removeObject:hostname];
-            }
-            DLog(@"Host %@: %@", hostname, ok ? @"Ok" : @"Unknown");
-            completion(ok, hostname);
-        });
-    });
+    }
+    if (result) {
+        completion(result->ok, hostname);
+    }
     DLog(@"Blocked main thread for %f sec", [NSDate timeIntervalSinceReferenceDate] - start);
 }
 
 - (void)cancelRequestForHostname:(NSString *)hostname {
     @synchronized(self) {
-        [_pending removeObject:hostname];
+        AsyncHostLookupRequest *request = _pending[hostname];
+        if (request && --request->interest == 0 && !request->started) {
+            DLog(@"Abort nslookup for %@", hostname);
+            [_queued removeObject:hostname];
+            [_pending removeObjectForKey:hostname];
+        }
     }
 }
 
+#pragma mark - Private
+
+// Must be called while synchronized on self.
+- (void)startQueuedLookups {
+    while ([_queued count] && _numberOfRunningLookups < kMaxConcurrentLookups) {
+        NSString *hostname = [[[_queued objectAtIndex:0] retain] autorelease];
+        [_queued removeObjectAtIndex:0];
+        ((AsyncHostLookupRequest *)_pending[hostname])->started = YES;
+        _numberOfRunningLookups++;
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^() {
+            [self lookUpHostname:hostname];
+        });
+    }
+}
+
+// Runs on a background queue.
+- (void)lookUpHostname:(NSString *)hostname {
+    struct addrinfo hints = { 0 };
+    hints.ai_family = PF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses = NULL;
+    BOOL ok = (getaddrinfo([hostname UTF8String], NULL, &hints, &addresses) == 0);
+    if (addresses) {
+        freeaddrinfo(addresses);
+    }
+
+    AsyncHostLookupResult *result = [[[AsyncHostLookupResult alloc] init] autorelease];
+    result->ok = ok;
+    result->expiration = ([NSDate timeIntervalSinceReferenceDate] +
+                          (ok ? kSuccessfulLookupTimeToLive : kFailedLookupTimeToLive));
+    NSArray *completions;
+    @synchronized(self) {
+        _cache[hostname] = result;
+        AsyncHostLookupRequest *request = _pending[hostname];
+        completions = [[request->completions copy] autorelease];
+        if (!request->interest) {
+            DLog(@"Finished nslookup but don't call blocks for %@", hostname);
+            completions = @[];
+        }
+        [_pending removeObjectForKey:hostname];
+        _numberOfRunningLookups--;
+        [self startQueuedLookups];
+    }
+    dispatch_async(dispatch_get_main_queue(), ^() {
+        DLog(@"Host %@: %@", hostname, ok ? @"Ok" : @"Unknown");
+        for (void (^completion)(BOOL, NSString *) in completions) {
+            completion(ok, hostname);
+        }
+    });
+}
+
 @end
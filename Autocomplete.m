@@ -1,5 +1,6 @@
 #include <wctype.h>
 #import "Autocomplete.h"
+#import "AutocompleteIndex.h"
 #import "LineBuffer.h"
 #import "PTYTextView.h"
 #import "PasteboardHistory.h"
@@ -14,6 +15,10 @@
 const int kMaxQueryContextWords = 4;
 const int kMaxResultContextWords = 4;
 
+// Words from the scrollback index are scored as though they were found after this many matches
+// from the search, since they're usually further back and have no context.
+const int kIndexedWordResultNumberOffset = 8;
+
 @implementation AutocompleteView
 {
     // Table view that displays choices.
@@ -216,12 +221,12 @@ const int kMaxResultContextWords = 4;
             // score.
             double distance = (abs(i - j) + 1) * lengthFactor;
 
-            if ([qs localizedCompare:rs] == NSOrderedSame) {
+            if ([qs isEqualToString:rs]) {
                 AcLog(@"  Exact match %@ = %@. Incr similarity by %lf", rs, qs, (1.0/distance));
                 similarity += 1.0 / distance;
                 [scratch replaceObjectAtIndex:j withObject:@""];
                 break;
-            } else if ([qs localizedCaseInsensitiveCompare:rs] == NSOrderedSame) {
+            } else if ([qs caseInsensitiveCompare:rs] == NSOrderedSame) {
                 AcLog(@"  Approximate match of %@ = %@. Incr similarity by %lf", rs, qs, (0.9/distance));
                 similarity += 0.9 / distance;
                 [scratch replaceObjectAtIndex:j withObject:@""];
@@ -291,6 +296,34 @@ const int kMaxResultContextWords = 4;
     }
 }
 
+// Adds the most frequent and recent words in the scrollback index that complete the prefix. This
+// is fast, so they're in the first results shown, while the search for matches with context goes
+// on. They take up at most half the entries.
+- (void)_processIndexedWords
+{
+    AutocompleteIndex *index = [[[self delegate] popupVT100Screen] autocompleteIndex];
+    if (!index || whitespaceBeforeCursor_ || ![prefix_ length]) {
+        return;
+    }
+    NSArray *words = [index wordsWithPrefix:prefix_ maxWords:[AutocompleteView maxOptions] / 2];
+    for (int i = 0; i < [words count]; i++) {
+        NSString *value = [words objectAtIndex:i];
+        NSRange range = [value rangeOfString:prefix_ options:(NSCaseInsensitiveSearch | NSAnchoredSearch)];
+        if (range.location == NSNotFound || range.length == [value length]) {
+            continue;
+        }
+        NSString *word = [value substringFromIndex:range.length];
+        double score = [self scoreResultNumber:i + kIndexedWordResultNumberOffset
+                                  queryContext:context_
+                                 resultContext:[NSArray array]
+                           joiningPrefixLength:[prefix_ length]
+                                          word:word];
+        PopupEntry *e = [PopupEntry entryWithString:word score:score];
+        [e setPrefix:prefix_];
+        [[self unfilteredModel] addHit:e];
+    }
+}
+
 - (void)refresh
 {
     [[self unfilteredModel] removeAllObjects];
@@ -301,6 +334,7 @@ const int kMaxResultContextWords = 4;
     y_ = startY_ - [screen scrollbackOverflow];
 
     [self _processPasteboardHistory];
+    [self _processIndexedWords];
 
     AcLog(@"Searching for '%@'", prefix_);
     matchCount_ = 0;
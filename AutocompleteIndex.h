@@ -0,0 +1,52 @@
+//
+//  AutocompleteIndex.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+#include <libkern/OSAtomic.h>
+
+// Counts the words of a session's scrollback as its blocks fill up, so that autocomplete can
+// offer the most frequent and recent words with a prefix without searching the scrollback for
+// them. Words are split out and ranked on a private queue, which publishes an immutable snapshot
+// of the ranked words at most once a second. Lookups on the main thread only binary search the
+// latest snapshot.
+//
+// A word is a run of alphanumeric chars and chars from the "characters considered part of a word"
+// preference as it was when the index was made. At most 20,000 words are kept; the ones seen
+// least recently are forgotten first.
+@interface AutocompleteIndex : NSObject {
+    dispatch_queue_t queue_;
+    NSCharacterSet *wordChars_;
+
+    // Used only on queue_. Case-folded word -> AutocompleteIndexEntry.
+    NSMutableDictionary *entries_;
+    // Incremented by each call to -addText:. Words remember the value when last seen.
+    long long generation_;
+    BOOL snapshotScheduled_;
+
+    // The latest snapshot: case-folded words, literally sorted, and for each one the word as it
+    // was last seen and its score, a float. Guarded by lock_.
+    OSSpinLock lock_;
+    NSArray *snapshotKeys_;
+    NSArray *snapshotWords_;
+    NSData *snapshotScores_;
+}
+
+// |wordChars| are chars besides alphanumerics that may be part of a word.
+- (id)initWithWordChars:(NSString *)wordChars;
+
+// Adds the words in |text|. Returns right away; the words are counted on the index's queue.
+- (void)addText:(NSString *)text;
+
+// Forgets every word, as when scrollback is cleared.
+- (void)removeAllWords;
+
+// Up to |maxWords| longer words starting with |prefix|, ignoring case, best first. Uses the
+// latest snapshot, so words added in the last second may be missing.
+- (NSArray *)wordsWithPrefix:(NSString *)prefix maxWords:(int)maxWords;
+
+// Waits for the words added so far and publishes a snapshot with them. For tests.
+- (void)flush;
+
+@end
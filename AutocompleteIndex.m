@@ -0,0 +1,263 @@
+//
+//  AutocompleteIndex.m
+//  iTerm
+//
+
+#import "AutocompleteIndex.h"
+#import "DebugLogging.h"
+
+// Shorter words aren't worth completing, and longer ones are usually hashes or base64.
+static const NSUInteger kAutocompleteIndexMinWordLength = 3;
+static const NSUInteger kAutocompleteIndexMaxWordLength = 64;
+
+// When there are more words than this, the least recently seen quarter is forgotten.
+static const NSUInteger kAutocompleteIndexMaxWords = 20000;
+
+// How long new words may wait to be published in a snapshot.
+static const NSTimeInterval kAutocompleteIndexSnapshotDelay = 1;
+
+// A word last seen this many calls to -addText: ago scores half as much as one seen in the last.
+static const double kAutocompleteIndexRecencyScale = 8;
+
+static NSString *AutocompleteIndexFold(NSString *string) {
+    return [string stringByFoldingWithOptions:NSCaseInsensitiveSearch locale:nil];
+}
+
+static int AutocompleteIndexCompareGenerations(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+@interface AutocompleteIndexEntry : NSObject {
+@public
+    NSString *word;
+    int count;
+    long long lastSeen;
+}
+@end
+
+@implementation AutocompleteIndexEntry
+
+- (void)dealloc
+{
+    [word release];
+    [super dealloc];
+}
+
+@end
+
+@implementation AutocompleteIndex
+
+- (id)initWithWordChars:(NSString *)wordChars
+{
+    self = [super init];
+    if (self) {
+        NSMutableCharacterSet *set = [[[NSCharacterSet alphanumericCharacterSet] mutableCopy] autorelease];
+        if (wordChars) {
+            [set addCharactersInString:wordChars];
+        }
+        wordChars_ = [set copy];
+        entries_ = [[NSMutableDictionary alloc] init];
+        lock_ = OS_SPINLOCK_INIT;
+        snapshotKeys_ = [[NSArray alloc] init];
+        snapshotWords_ = [[NSArray alloc] init];
+        snapshotScores_ = [[NSData alloc] init];
+        queue_ = dispatch_queue_create("com.googlecode.iterm2.autocomplete-index", DISPATCH_QUEUE_SERIAL);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    dispatch_release(queue_);
+    [wordChars_ release];
+    [entries_ release];
+    [snapshotKeys_ release];
+    [snapshotWords_ release];
+    [snapshotScores_ release];
+    [super dealloc];
+}
+
+- (void)addText:(NSString *)text
+{
+    dispatch_async(queue_, ^{
+        @autoreleasepool {
+            [self _addWordsInText:text];
+        }
+        if (!snapshotScheduled_) {
+            snapshotScheduled_ = YES;
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, kAutocompleteIndexSnapshotDelay * NSEC_PER_SEC),
+                           queue_,
+                           ^{
+                               [self _publishSnapshot];
+                           });
+        }
+    });
+}
+
+- (void)removeAllWords
+{
+    dispatch_async(queue_, ^{
+        [entries_ removeAllObjects];
+        [self _publishSnapshot];
+    });
+}
+
+- (void)flush
+{
+    dispatch_sync(queue_, ^{
+        [self _publishSnapshot];
+    });
+}
+
+- (NSArray *)wordsWithPrefix:(NSString *)prefix maxWords:(int)maxWords
+{
+    OSSpinLockLock(&lock_);
+    NSArray *keys = [snapshotKeys_ retain];
+    NSArray *words = [snapshotWords_ retain];
+    NSData *scoreData = [snapshotScores_ retain];
+    OSSpinLockUnlock(&lock_);
+
+    NSString *folded = AutocompleteIndexFold(prefix);
+    const float *scores = [scoreData bytes];
+
+    // Find the first key not less than |folded|.
+    int lo = 0;
+    int hi = [keys count];
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2;
+        if ([[keys objectAtIndex:mid] compare:folded options:NSLiteralSearch] == NSOrderedAscending) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // Keep the indices of the best |maxWords| keys with the prefix, best first.
+    NSMutableArray *best = [NSMutableArray arrayWithCapacity:maxWords];
+    for (int i = lo; i < [keys count]; i++) {
+        NSString *key = [keys objectAtIndex:i];
+        if (![key hasPrefix:folded]) {
+            break;
+        }
+        if ([key length] == [folded length]) {
+            continue;
+        }
+        int j = [best count];
+        while (j > 0 && scores[[[best objectAtIndex:j - 1] intValue]] < scores[i]) {
+            j--;
+        }
+        if (j < maxWords) {
+            [best insertObject:@(i) atIndex:j];
+            if ([best count] > maxWords) {
+                [best removeLastObject];
+            }
+        }
+    }
+
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity:[best count]];
+    for (NSNumber *n in best) {
+        [result addObject:[words objectAtIndex:[n intValue]]];
+    }
+    [keys release];
+    [words release];
+    [scoreData release];
+    return result;
+}
+
+#pragma mark - Private
+
+// Runs on queue_.
+- (void)_addWordsInText:(NSString *)text
+{
+    const NSUInteger length = [text length];
+    unichar *chars = malloc(MAX(length, 1) * sizeof(unichar));
+    [text getCharacters:chars range:NSMakeRange(0, length)];
+    generation_++;
+
+    NSUInteger start = 0;
+    for (NSUInteger i = 0; i <= length; i++) {
+        if (i < length && [wordChars_ characterIsMember:chars[i]]) {
+            continue;
+        }
+        const NSUInteger wordLength = i - start;
+        if (wordLength >= kAutocompleteIndexMinWordLength &&
+            wordLength <= kAutocompleteIndexMaxWordLength) {
+            NSString *word = [[NSString alloc] initWithCharacters:chars + start length:wordLength];
+            NSString *key = AutocompleteIndexFold(word);
+            AutocompleteIndexEntry *entry = [entries_ objectForKey:key];
+            if (!entry) {
+                entry = [[[AutocompleteIndexEntry alloc] init] autorelease];
+                [entries_ setObject:entry forKey:key];
+            }
+            [entry->word release];
+            entry->word = word;
+            entry->count++;
+            entry->lastSeen = generation_;
+        }
+        start = i + 1;
+    }
+    free(chars);
+
+    if ([entries_ count] > kAutocompleteIndexMaxWords) {
+        [self _forgetOldWords];
+    }
+}
+
+// Runs on queue_. Removes the least recently seen quarter of the words.
+- (void)_forgetOldWords
+{
+    const NSUInteger count = [entries_ count];
+    long long *generations = malloc(count * sizeof(long long));
+    NSUInteger i = 0;
+    for (AutocompleteIndexEntry *entry in [entries_ objectEnumerator]) {
+        generations[i++] = entry->lastSeen;
+    }
+    qsort(generations, count, sizeof(long long), AutocompleteIndexCompareGenerations);
+    const long long threshold = generations[count / 4];
+    free(generations);
+
+    NSMutableArray *oldKeys = [NSMutableArray array];
+    for (NSString *key in entries_) {
+        AutocompleteIndexEntry *entry = [entries_ objectForKey:key];
+        if (entry->lastSeen <= threshold) {
+            [oldKeys addObject:key];
+        }
+    }
+    [entries_ removeObjectsForKeys:oldKeys];
+    DLog(@"Autocomplete index forgot %d words", (int)[oldKeys count]);
+}
+
+// Runs on queue_.
+- (void)_publishSnapshot
+{
+    snapshotScheduled_ = NO;
+    NSArray *keys = [[[entries_ allKeys] sortedArrayUsingComparator:^NSComparisonResult(id a, id b) {
+        return [a compare:b options:NSLiteralSearch];
+    }] retain];
+    NSMutableArray *words = [[NSMutableArray alloc] initWithCapacity:[keys count]];
+    NSMutableData *scoreData = [[NSMutableData alloc] initWithLength:[keys count] * sizeof(float)];
+    float *scores = [scoreData mutableBytes];
+    for (int i = 0; i < [keys count]; i++) {
+        AutocompleteIndexEntry *entry = [entries_ objectForKey:[keys objectAtIndex:i]];
+        [words addObject:entry->word];
+        const double age = generation_ - entry->lastSeen;
+        scores[i] = entry->count / (1.0 + age / kAutocompleteIndexRecencyScale);
+    }
+
+    OSSpinLockLock(&lock_);
+    NSArray *oldKeys = snapshotKeys_;
+    NSArray *oldWords = snapshotWords_;
+    NSData *oldScores = snapshotScores_;
+    snapshotKeys_ = keys;
+    snapshotWords_ = words;
+    snapshotScores_ = scoreData;
+    OSSpinLockUnlock(&lock_);
+
+    [oldKeys release];
+    [oldWords release];
+    [oldScores release];
+}
+
+@end
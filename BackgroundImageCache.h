@@ -0,0 +1,27 @@
+//
+//  BackgroundImageCache.h
+//  iTerm
+//
+//  Background images shared by every session. An image file is decoded once however many sessions
+//  use it, and it's rendered once for each size it's shown at, scaled or tiled, into a premultiplied
+//  bitmap. Filling a cell's background is then a 1:1 copy out of that bitmap instead of a scaled
+//  composite from the original image. Main thread only.
+//
+
+#import <Cocoa/Cocoa.h>
+
+@interface BackgroundImageCache : NSObject
+
+// The image at |path|, decoded again only if the file has been modified since. Returns nil if it
+// can't be read.
++ (NSImage *)imageWithContentsOfFile:(NSString *)path;
+
+// |image| scaled to fill |size| points, or tiled over it with |alpha| applied, at |scale| pixels
+// per point. A few recently used renderings are kept, so sessions of the same size share one.
++ (NSImage *)renderedImage:(NSImage *)image
+                      size:(NSSize)size
+                     scale:(CGFloat)scale
+                     tiled:(BOOL)tiled
+                     alpha:(CGFloat)alpha;
+
+@end
@@ -0,0 +1,153 @@
+//
+//  BackgroundImageCache.m
+//  iTerm
+//
+
+#import "BackgroundImageCache.h"
+#import "DebugLogging.h"
+
+// Decoded images are kept for this many files...
+static const NSUInteger kMaxImages = 8;
+// ...and renderings for this many sizes. A full-screen rendering on a Retina display is about 40MB,
+// but it's freed only when no session is still using it.
+static const NSUInteger kMaxRenderedImages = 4;
+
+@interface BackgroundImageCacheEntry : NSObject {
+  @public
+    NSImage *image_;
+    NSDate *modificationDate_;
+}
+@end
+
+@implementation BackgroundImageCacheEntry
+
+- (void)dealloc
+{
+    [image_ release];
+    [modificationDate_ release];
+    [super dealloc];
+}
+
+@end
+
+// Least recently used last.
+static NSMutableArray *gImagePaths;
+static NSMutableDictionary *gImages;  // NSString (path) -> BackgroundImageCacheEntry
+static NSMutableArray *gRenderedKeys;
+static NSMutableDictionary *gRenderedImages;  // NSArray (key) -> NSImage
+
+static void BackgroundImageCacheTouch(NSMutableArray *keys, id key, NSMutableDictionary *values,
+                                      NSUInteger maxCount) {
+    [keys removeObject:key];
+    [keys insertObject:key atIndex:0];
+    while ([keys count] > maxCount) {
+        [values removeObjectForKey:[keys lastObject]];
+        [keys removeLastObject];
+    }
+}
+
+@implementation BackgroundImageCache
+
++ (void)initialize
+{
+    if (self == [BackgroundImageCache class]) {
+        gImagePaths = [[NSMutableArray alloc] init];
+        gImages = [[NSMutableDictionary alloc] init];
+        gRenderedKeys = [[NSMutableArray alloc] init];
+        gRenderedImages = [[NSMutableDictionary alloc] init];
+    }
+}
+
++ (NSImage *)imageWithContentsOfFile:(NSString *)path
+{
+    if (!path) {
+        return nil;
+    }
+    NSDictionary *attributes = [[NSFileManager defaultManager] attributesOfItemAtPath:path
+                                                                                error:NULL];
+    NSDate *modificationDate = [attributes fileModificationDate];
+    BackgroundImageCacheEntry *entry = [gImages objectForKey:path];
+    if (!entry || ![entry->modificationDate_ isEqualToDate:modificationDate]) {
+        NSImage *image = [[[NSImage alloc] initWithContentsOfFile:path] autorelease];
+        if (!image) {
+            [gImages removeObjectForKey:path];
+            [gImagePaths removeObject:path];
+            return nil;
+        }
+        DLog(@"Decoded background image %@", path);
+        entry = [[[BackgroundImageCacheEntry alloc] init] autorelease];
+        entry->image_ = [image retain];
+        entry->modificationDate_ = [modificationDate retain];
+        [gImages setObject:entry forKey:path];
+    }
+    BackgroundImageCacheTouch(gImagePaths, path, gImages, kMaxImages);
+    return entry->image_;
+}
+
++ (NSImage *)renderedImage:(NSImage *)image
+                      size:(NSSize)size
+                     scale:(CGFloat)scale
+                     tiled:(BOOL)tiled
+                     alpha:(CGFloat)alpha
+{
+    if (!image || size.width < 1 || size.height < 1) {
+        return nil;
+    }
+    // The key holds the source image, so its address can't be reused by another image while the
+    // rendering is cached. Alpha is only drawn into tiled renderings.
+    NSArray *key = [NSArray arrayWithObjects:
+                       image,
+                       [NSValue valueWithSize:size],
+                       [NSNumber numberWithDouble:scale],
+                       [NSNumber numberWithBool:tiled],
+                       [NSNumber numberWithDouble:tiled ? alpha : 1],
+                       nil];
+    NSImage *rendered = [gRenderedImages objectForKey:key];
+    if (!rendered) {
+        rendered = [self newRenderingOfImage:image size:size scale:scale tiled:tiled alpha:alpha];
+        [gRenderedImages setObject:rendered forKey:key];
+        [rendered release];
+    }
+    BackgroundImageCacheTouch(gRenderedKeys, key, gRenderedImages, kMaxRenderedImages);
+    return rendered;
+}
+
++ (NSImage *)newRenderingOfImage:(NSImage *)image
+                            size:(NSSize)size
+                           scale:(CGFloat)scale
+                           tiled:(BOOL)tiled
+                           alpha:(CGFloat)alpha
+{
+    DLog(@"Rendering background image at %@ x%0.1f", NSStringFromSize(size), scale);
+    NSBitmapImageRep *rep =
+        [[[NSBitmapImageRep alloc] initWithBitmapDataPlanes:NULL
+                                                 pixelsWide:ceil(size.width * scale)
+                                                 pixelsHigh:ceil(size.height * scale)
+                                              bitsPerSample:8
+                                            samplesPerPixel:4
+                                                   hasAlpha:YES
+                                                   isPlanar:NO
+                                             colorSpaceName:NSCalibratedRGBColorSpace
+                                                bytesPerRow:0
+                                               bitsPerPixel:0] autorelease];
+    [rep setSize:size];
+
+    [NSGraphicsContext saveGraphicsState];
+    [NSGraphicsContext setCurrentContext:[NSGraphicsContext graphicsContextWithBitmapImageRep:rep]];
+    const NSRect rect = NSMakeRect(0, 0, size.width, size.height);
+    if (tiled) {
+        NSColor *pattern = [NSColor colorWithPatternImage:image];
+        [[pattern colorWithAlphaComponent:alpha] set];
+        [pattern drawSwatchInRect:rect];
+    } else {
+        [[NSGraphicsContext currentContext] setImageInterpolation:NSImageInterpolationHigh];
+        [image drawInRect:rect fromRect:NSZeroRect operation:NSCompositeCopy fraction:1];
+    }
+    [NSGraphicsContext restoreGraphicsState];
+
+    NSImage *rendered = [[NSImage alloc] initWithSize:size];
+    [rendered addRepresentation:rep];
+    return rendered;
+}
+
+@end
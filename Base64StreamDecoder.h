@@ -0,0 +1,31 @@
+//
+//  Base64StreamDecoder.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+// Decodes base64 that arrives in pieces split at arbitrary points, so a large payload can be
+// written out as it comes in rather than collected and decoded at the end. Whitespace is skipped.
+// Decoding ends at padding; a final group without padding is completed by -finishIntoData:.
+@interface Base64StreamDecoder : NSObject {
+    uint32_t bits_;  // Sextets of the group in progress, oldest in the most significant bits.
+    int numberOfChars_;  // Chars in the group in progress, 0 to 3.
+    BOOL sawPadding_;
+    BOOL invalid_;
+    long long decodedLength_;
+}
+
+// Total bytes produced so far.
+@property(nonatomic, readonly) long long decodedLength;
+
+// Appends the bytes decoded from |length| chars of base64 to |output|. Returns NO, now and on
+// every later call, once a char that isn't base64, whitespace or padding is seen, or a char
+// follows padding.
+- (BOOL)decodeChars:(const char *)chars length:(NSUInteger)length intoData:(NSMutableData *)output;
+
+// Appends the bytes of a final group that had no padding. Returns NO if the input was invalid or
+// ended with a single char of a group, which can't be decoded.
+- (BOOL)finishIntoData:(NSMutableData *)output;
+
+@end
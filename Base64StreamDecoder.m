@@ -0,0 +1,150 @@
+//
+//  Base64StreamDecoder.m
+//  iTerm
+//
+
+#import "Base64StreamDecoder.h"
+
+// Values for chars that aren't sextets.
+enum {
+    kBase64Invalid = 0xff,
+    kBase64Whitespace = 0xfe,
+    kBase64Padding = 0xfd
+};
+
+static unsigned char gBase64Values[256];
+
+@implementation Base64StreamDecoder
+
+@synthesize decodedLength = decodedLength_;
+
++ (void)initialize
+{
+    if (self != [Base64StreamDecoder class]) {
+        return;
+    }
+    memset(gBase64Values, kBase64Invalid, sizeof(gBase64Values));
+    const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (int i = 0; i < 64; i++) {
+        gBase64Values[(unsigned char)alphabet[i]] = i;
+    }
+    gBase64Values['\n'] = kBase64Whitespace;
+    gBase64Values['\r'] = kBase64Whitespace;
+    gBase64Values['\t'] = kBase64Whitespace;
+    gBase64Values[' '] = kBase64Whitespace;
+    gBase64Values['='] = kBase64Padding;
+}
+
+- (BOOL)decodeChars:(const char *)chars length:(NSUInteger)length intoData:(NSMutableData *)output
+{
+    if (invalid_) {
+        return NO;
+    }
+    const NSUInteger initialLength = [output length];
+    [output setLength:initialLength + (length / 4 + 1) * 3];
+    unsigned char *out = (unsigned char *)[output mutableBytes] + initialLength;
+    unsigned char *const start = out;
+    const unsigned char *in = (const unsigned char *)chars;
+    const unsigned char *const end = in + length;
+
+    while (in < end) {
+        // The usual case: a whole group of four sextets, decoded without looking at each char's
+        // kind separately.
+        if (numberOfChars_ == 0 && !sawPadding_) {
+            while (end - in >= 4) {
+                const unsigned char a = gBase64Values[in[0]];
+                const unsigned char b = gBase64Values[in[1]];
+                const unsigned char c = gBase64Values[in[2]];
+                const unsigned char d = gBase64Values[in[3]];
+                if ((a | b | c | d) & 0xc0) {
+                    break;
+                }
+                const uint32_t group = (a << 18) | (b << 12) | (c << 6) | d;
+                out[0] = group >> 16;
+                out[1] = group >> 8;
+                out[2] = group;
+                out += 3;
+                in += 4;
+            }
+            if (in == end) {
+                break;
+            }
+        }
+
+        const unsigned char value = gBase64Values[*in++];
+        if (value == kBase64Whitespace) {
+            continue;
+        } else if (value == kBase64Padding) {
+            if (!sawPadding_) {
+                sawPadding_ = YES;
+                out += [self flushGroupInto:out];
+                if (invalid_) {
+                    break;
+                }
+            }
+        } else if (value == kBase64Invalid || sawPadding_) {
+            invalid_ = YES;
+            break;
+        } else {
+            bits_ = (bits_ << 6) | value;
+            if (++numberOfChars_ == 4) {
+                out[0] = bits_ >> 16;
+                out[1] = bits_ >> 8;
+                out[2] = bits_;
+                out += 3;
+                bits_ = 0;
+                numberOfChars_ = 0;
+            }
+        }
+    }
+
+    [output setLength:initialLength + (out - start)];
+    decodedLength_ += out - start;
+    return !invalid_;
+}
+
+- (BOOL)finishIntoData:(NSMutableData *)output
+{
+    if (invalid_) {
+        return NO;
+    }
+    unsigned char bytes[2];
+    const int n = [self flushGroupInto:bytes];
+    if (invalid_) {
+        return NO;
+    }
+    [output appendBytes:bytes length:n];
+    decodedLength_ += n;
+    return YES;
+}
+
+#pragma mark - Private
+
+// Writes the bytes of a partial group to |out| and returns how many there were, at most 2.
+- (int)flushGroupInto:(unsigned char *)out
+{
+    int n;
+    switch (numberOfChars_) {
+        case 0:
+            n = 0;
+            break;
+        case 2:
+            out[0] = bits_ >> 4;
+            n = 1;
+            break;
+        case 3:
+            out[0] = bits_ >> 10;
+            out[1] = bits_ >> 2;
+            n = 2;
+            break;
+        default:
+            invalid_ = YES;
+            n = 0;
+            break;
+    }
+    bits_ = 0;
+    numberOfChars_ = 0;
+    return n;
+}
+
+@end
@@ -0,0 +1,82 @@
+//
+//  BinaryLog.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+// A log cheap enough to leave on while waiting for a rare bug. Each thread appends fixed-size
+// records to its own preallocated ring, without locks or allocation: a timestamp, the address of
+// the format string, the file, line and function, and up to six raw arguments. Nothing is
+// formatted until the log is dumped. When a ring is full its oldest records are overwritten, so a
+// dump has the last few thousand records of each thread.
+//
+// Arguments are stored as 64-bit integers, so formats may use only integer, char and pointer
+// conversions (%d, %x, %c, %p and so on, with any length modifier). The format must be a string
+// literal, since only its address is kept.
+//
+// Records are kept only for the categories in gBinaryLogCategories, which come from the
+// BinaryLogCategories user default and include everything while debug logging is on.
+
+typedef enum {
+    kBinaryLogCategoryParser = 1 << 0,
+    kBinaryLogCategorySession = 1 << 1,
+    kBinaryLogCategoryInput = 1 << 2,
+    kBinaryLogCategoryScreen = 1 << 3,
+    kBinaryLogCategoryDrawing = 1 << 4,
+    kBinaryLogCategoryFileTransfer = 1 << 5,
+
+    kBinaryLogAllCategories = 0xffffffff
+} BinaryLogCategory;
+
+// Records kept for each thread.
+#define kBinaryLogRecordsPerThread 4096
+
+extern volatile uint32_t gBinaryLogCategories;
+
+#define BLOG_NARGS(args...) BLOG_NARGS_(0, ##args, 6, 5, 4, 3, 2, 1, 0)
+#define BLOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, n, ...) n
+
+#define BLOG_ARGS_0()
+#define BLOG_ARGS_1(a) (uint64_t)(a)
+#define BLOG_ARGS_2(a, b) BLOG_ARGS_1(a), (uint64_t)(b)
+#define BLOG_ARGS_3(a, b, c) BLOG_ARGS_2(a, b), (uint64_t)(c)
+#define BLOG_ARGS_4(a, b, c, d) BLOG_ARGS_3(a, b, c), (uint64_t)(d)
+#define BLOG_ARGS_5(a, b, c, d, e) BLOG_ARGS_4(a, b, c, d), (uint64_t)(e)
+#define BLOG_ARGS_6(a, b, c, d, e, f) BLOG_ARGS_5(a, b, c, d, e), (uint64_t)(f)
+#define BLOG_CONCAT(a, b) BLOG_CONCAT_(a, b)
+#define BLOG_CONCAT_(a, b) a##b
+
+// Usage: BLog(kBinaryLogCategoryParser, "token type %d length %d", type, length);
+#define BLog(category, format, args...) \
+    do { \
+        if (gBinaryLogCategories & (category)) { \
+            const uint64_t blogArgs_[] = { 0, BLOG_CONCAT(BLOG_ARGS_, BLOG_NARGS(args))(args) }; \
+            BinaryLogAppend((category), format, __FILE__, __LINE__, __FUNCTION__, \
+                            blogArgs_ + 1, BLOG_NARGS(args)); \
+        } \
+    } while (0)
+
+// Reads the BinaryLogCategories user default. Call once at launch.
+void BinaryLogInitialize(void);
+
+// Sets the categories to record. Pass 0 to record nothing.
+void BinaryLogSetCategories(uint32_t categories);
+
+// The categories from the user default.
+uint32_t BinaryLogDefaultCategories(void);
+
+// Use BLog instead.
+void BinaryLogAppend(uint32_t category,
+                     const char *format,
+                     const char *file,
+                     int line,
+                     const char *function,
+                     const uint64_t *args,
+                     int numberOfArgs);
+
+// Formats every record in every thread's ring, oldest first, one per line.
+NSString *BinaryLogFormattedRecords(void);
+
+// Writes BinaryLogFormattedRecords() to |fd| as UTF-8.
+void BinaryLogWriteToFile(int fd);
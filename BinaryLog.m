@@ -0,0 +1,276 @@
+//
+//  BinaryLog.m
+//  iTerm
+//
+
+#import "BinaryLog.h"
+#include <libkern/OSAtomic.h>
+#include <mach/mach_time.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+// Most threads that can have a ring at once. A thread that exits gives its ring to the next new
+// thread, so this bounds the number of threads logging at the same time, not in total.
+#define kBinaryLogMaxRings 64
+
+#define kBinaryLogMaxArgs 6
+
+// Longest formatted record. Longer ones are truncated.
+static const size_t kBinaryLogMaxLineLength = 1024;
+
+typedef struct {
+    // 0 while the record is being written. Otherwise its position in its ring's sequence.
+    volatile uint64_t sequence;
+    uint64_t time;  // mach_absolute_time()
+    const char *format;
+    const char *file;
+    const char *function;
+    int line;
+    int numberOfArgs;
+    uint64_t args[kBinaryLogMaxArgs];
+} BinaryLogRecord;
+
+typedef struct {
+    volatile int32_t inUse;
+    int threadNumber;
+    uint64_t lastSequence;  // Written only by the ring's thread.
+    BinaryLogRecord records[kBinaryLogRecordsPerThread];
+} BinaryLogRing;
+
+volatile uint32_t gBinaryLogCategories;
+
+static BinaryLogRing *gRings[kBinaryLogMaxRings];
+static OSSpinLock gRingsLock = OS_SPINLOCK_INIT;
+static int gNextThreadNumber;
+static pthread_key_t gRingKey;
+static pthread_once_t gRingKeyOnce = PTHREAD_ONCE_INIT;
+
+// Maps mach_absolute_time() to wall clock time for dumps.
+static mach_timebase_info_data_t gTimebase;
+static uint64_t gStartMachTime;
+static struct timeval gStartTime;
+
+static void BinaryLogReleaseRing(void *ring) {
+    OSAtomicCompareAndSwap32Barrier(1, 0, &((BinaryLogRing *)ring)->inUse);
+}
+
+static void BinaryLogCreateRingKey(void) {
+    pthread_key_create(&gRingKey, BinaryLogReleaseRing);
+    mach_timebase_info(&gTimebase);
+    gStartMachTime = mach_absolute_time();
+    gettimeofday(&gStartTime, NULL);
+}
+
+// Returns the calling thread's ring, claiming one the first time. Returns NULL if every ring is
+// in use.
+static BinaryLogRing *BinaryLogCurrentRing(void) {
+    pthread_once(&gRingKeyOnce, BinaryLogCreateRingKey);
+    BinaryLogRing *ring = pthread_getspecific(gRingKey);
+    if (ring) {
+        return ring;
+    }
+    OSSpinLockLock(&gRingsLock);
+    for (int i = 0; i < kBinaryLogMaxRings && !ring; i++) {
+        if (!gRings[i]) {
+            gRings[i] = calloc(1, sizeof(BinaryLogRing));
+        }
+        if (OSAtomicCompareAndSwap32Barrier(0, 1, &gRings[i]->inUse)) {
+            ring = gRings[i];
+            ring->threadNumber = gNextThreadNumber++;
+        }
+    }
+    OSSpinLockUnlock(&gRingsLock);
+    if (ring) {
+        pthread_setspecific(gRingKey, ring);
+    }
+    return ring;
+}
+
+void BinaryLogInitialize(void) {
+    BinaryLogSetCategories(BinaryLogDefaultCategories());
+}
+
+void BinaryLogSetCategories(uint32_t categories) {
+    gBinaryLogCategories = categories;
+}
+
+uint32_t BinaryLogDefaultCategories(void) {
+    return (uint32_t)[[NSUserDefaults standardUserDefaults] integerForKey:@"BinaryLogCategories"];
+}
+
+void BinaryLogAppend(uint32_t category,
+                     const char *format,
+                     const char *file,
+                     int line,
+                     const char *function,
+                     const uint64_t *args,
+                     int numberOfArgs) {
+    BinaryLogRing *ring = BinaryLogCurrentRing();
+    if (!ring) {
+        return;
+    }
+    const uint64_t sequence = ++ring->lastSequence;
+    BinaryLogRecord *record = &ring->records[sequence % kBinaryLogRecordsPerThread];
+
+    // A dump that reads the record while it's being written sees a sequence that doesn't match
+    // the one it read first and skips it.
+    record->sequence = 0;
+    OSMemoryBarrier();
+    record->time = mach_absolute_time();
+    record->format = format;
+    record->file = file;
+    record->line = line;
+    record->function = function;
+    record->numberOfArgs = MIN(numberOfArgs, kBinaryLogMaxArgs);
+    memcpy(record->args, args, record->numberOfArgs * sizeof(uint64_t));
+    OSMemoryBarrier();
+    record->sequence = sequence;
+}
+
+// Formats |record|'s format and arguments into |buffer|, which has |size| bytes. Conversions
+// without an argument or of an unsupported type come out as "?".
+static void BinaryLogFormatArguments(const BinaryLogRecord *record, char *buffer, size_t size) {
+    size_t length = 0;
+    int argIndex = 0;
+    for (const char *p = record->format; *p && length + 1 < size; p++) {
+        if (*p != '%') {
+            buffer[length++] = *p;
+            continue;
+        }
+        if (p[1] == '%') {
+            buffer[length++] = '%';
+            p++;
+            continue;
+        }
+
+        // Copy flags, width and precision into a spec of our own, and skip the length modifier so
+        // the 64-bit argument can be formatted with "ll".
+        char spec[32] = "%";
+        size_t specLength = 1;
+        p++;
+        while (*p && strchr("-+ #0123456789.", *p) && specLength < sizeof(spec) - 4) {
+            spec[specLength++] = *p++;
+        }
+        while (*p && strchr("hlqjztL", *p)) {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+        const char conversion = *p;
+        int written;
+        if (argIndex >= record->numberOfArgs) {
+            written = snprintf(buffer + length, size - length, "?");
+        } else if (strchr("diouxX", conversion)) {
+            spec[specLength++] = 'l';
+            spec[specLength++] = 'l';
+            spec[specLength++] = conversion;
+            spec[specLength] = '\0';
+            written = snprintf(buffer + length, size - length, spec, (long long)record->args[argIndex++]);
+        } else if (conversion == 'c') {
+            spec[specLength++] = 'c';
+            spec[specLength] = '\0';
+            written = snprintf(buffer + length, size - length, spec, (int)record->args[argIndex++]);
+        } else if (conversion == 'p') {
+            spec[specLength++] = 'p';
+            spec[specLength] = '\0';
+            written = snprintf(buffer + length, size - length, spec,
+                               (void *)(uintptr_t)record->args[argIndex++]);
+        } else {
+            argIndex++;
+            written = snprintf(buffer + length, size - length, "?");
+        }
+        if (written > 0) {
+            length = MIN(length + written, size - 1);
+        }
+    }
+    buffer[length] = '\0';
+}
+
+typedef struct {
+    BinaryLogRecord record;
+    int threadNumber;
+} BinaryLogDumpedRecord;
+
+static int BinaryLogCompareDumpedRecords(const void *a, const void *b) {
+    const BinaryLogDumpedRecord *x = a;
+    const BinaryLogDumpedRecord *y = b;
+    if (x->record.time != y->record.time) {
+        return x->record.time < y->record.time ? -1 : 1;
+    }
+    if (x->threadNumber != y->threadNumber) {
+        return x->threadNumber < y->threadNumber ? -1 : 1;
+    }
+    return x->record.sequence < y->record.sequence ? -1 : (x->record.sequence > y->record.sequence);
+}
+
+NSString *BinaryLogFormattedRecords(void) {
+    pthread_once(&gRingKeyOnce, BinaryLogCreateRingKey);
+    BinaryLogRing *rings[kBinaryLogMaxRings];
+    OSSpinLockLock(&gRingsLock);
+    memcpy(rings, gRings, sizeof(rings));
+    OSSpinLockUnlock(&gRingsLock);
+
+    // Copy out every complete record.
+    int count = 0;
+    for (int i = 0; i < kBinaryLogMaxRings; i++) {
+        if (rings[i]) {
+            count += kBinaryLogRecordsPerThread;
+        }
+    }
+    BinaryLogDumpedRecord *dumped = malloc(MAX(count, 1) * sizeof(BinaryLogDumpedRecord));
+    int n = 0;
+    for (int i = 0; i < kBinaryLogMaxRings; i++) {
+        BinaryLogRing *ring = rings[i];
+        if (!ring) {
+            continue;
+        }
+        for (int j = 0; j < kBinaryLogRecordsPerThread; j++) {
+            const uint64_t sequence = ring->records[j].sequence;
+            if (!sequence) {
+                continue;
+            }
+            OSMemoryBarrier();
+            dumped[n].record = ring->records[j];
+            dumped[n].threadNumber = ring->threadNumber;
+            OSMemoryBarrier();
+            if (ring->records[j].sequence == sequence && dumped[n].record.sequence == sequence) {
+                n++;
+            }
+        }
+    }
+    qsort(dumped, n, sizeof(BinaryLogDumpedRecord), BinaryLogCompareDumpedRecords);
+
+    NSMutableString *result = [NSMutableString string];
+    char message[kBinaryLogMaxLineLength];
+    for (int i = 0; i < n; i++) {
+        const BinaryLogRecord *record = &dumped[i].record;
+        const uint64_t elapsedMicros =
+            (record->time - gStartMachTime) * gTimebase.numer / gTimebase.denom / 1000;
+        const long long micros = gStartTime.tv_usec + elapsedMicros;
+        BinaryLogFormatArguments(record, message, sizeof(message));
+        [result appendFormat:@"%lld.%06lld [%d] %s:%d (%s): %s\n",
+            (long long)gStartTime.tv_sec + micros / 1000000,
+            micros % 1000000,
+            dumped[i].threadNumber,
+            record->file,
+            record->line,
+            record->function,
+            message];
+    }
+    free(dumped);
+    return result;
+}
+
+void BinaryLogWriteToFile(int fd) {
+    NSData *data = [BinaryLogFormattedRecords() dataUsingEncoding:NSUTF8StringEncoding];
+    const char *bytes = [data bytes];
+    size_t offset = 0;
+    while (offset < [data length]) {
+        ssize_t written = write(fd, bytes + offset, [data length] - offset);
+        if (written <= 0) {
+            break;
+        }
+        offset += written;
+    }
+}
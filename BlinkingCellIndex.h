@@ -0,0 +1,46 @@
+//
+//  BlinkingCellIndex.h
+//  iTerm
+//
+//  Tracks which visible cells blink so the text view doesn't have to look for them.
+//
+
+#import <Foundation/Foundation.h>
+#import "PTYTextViewDataSource.h"
+#import "VT100GridTypes.h"
+
+// For each visible line that has blinking characters, remembers the span of columns from the first
+// to the last of them. An update rescans only lines that were marked dirty or that just became
+// visible, so an idle screen with blinking text costs nothing to check and only the blinking cells
+// need to be redrawn when the blink state flips.
+@interface BlinkingCellIndex : NSObject {
+    // Absolute line number -> NSValue with a VT100GridRange of columns.
+    NSMutableDictionary *lines_;
+
+    // Absolute line numbers to rescan on the next update.
+    NSMutableIndexSet *dirtyLines_;
+
+    // Absolute line numbers that were visible, and so scanned, as of the last update.
+    long long firstLine_;
+    long long endLine_;
+
+    int width_;
+    BOOL needsUpdate_;
+}
+
+// The contents of an absolute line changed.
+- (void)setLineDirty:(long long)absoluteLine;
+
+// Forget everything and rescan all visible lines on the next update.
+- (void)setNeedsUpdate;
+
+// Brings the index up to date for |visibleLines|, given in data source line numbers.
+- (void)updateWithDataSource:(id<PTYTextViewDataSource>)dataSource
+                visibleLines:(VT100GridRange)visibleLines;
+
+- (BOOL)hasBlinkingCells;
+
+// NSValues with VT100GridRects in data source coordinates covering every blinking cell.
+- (NSArray *)blinkingCellRectsWithTotalScrollbackOverflow:(long long)totalScrollbackOverflow;
+
+@end
@@ -0,0 +1,118 @@
+//
+//  BlinkingCellIndex.m
+//  iTerm
+//
+
+#import "BlinkingCellIndex.h"
+
+@implementation BlinkingCellIndex
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        lines_ = [[NSMutableDictionary alloc] init];
+        dirtyLines_ = [[NSMutableIndexSet alloc] init];
+        needsUpdate_ = YES;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [lines_ release];
+    [dirtyLines_ release];
+    [super dealloc];
+}
+
+- (void)setLineDirty:(long long)absoluteLine
+{
+    if (absoluteLine >= 0) {
+        [dirtyLines_ addIndex:absoluteLine];
+    }
+}
+
+- (void)setNeedsUpdate
+{
+    needsUpdate_ = YES;
+}
+
+- (void)scanLine:(screen_char_t *)line width:(int)width absoluteLine:(long long)absoluteLine
+{
+    int first = -1;
+    int last = -1;
+    for (int x = 0; x < width; x++) {
+        if (line[x].blink) {
+            if (first < 0) {
+                first = x;
+            }
+            last = x;
+        }
+    }
+    NSNumber *key = [NSNumber numberWithLongLong:absoluteLine];
+    if (first < 0) {
+        [lines_ removeObjectForKey:key];
+    } else {
+        // Include the next cell, which may be the right half of a double-width character.
+        VT100GridRange range = VT100GridRangeMake(first, MIN(width, last + 2) - first);
+        [lines_ setObject:[NSValue valueWithGridRange:range] forKey:key];
+    }
+}
+
+- (void)updateWithDataSource:(id<PTYTextViewDataSource>)dataSource
+                visibleLines:(VT100GridRange)visibleLines
+{
+    const long long overflow = [dataSource totalScrollbackOverflow];
+    const int width = [dataSource width];
+    const long long first = visibleLines.location + overflow;
+    const long long end = first + visibleLines.length;
+    if (width != width_) {
+        needsUpdate_ = YES;
+    }
+    if (needsUpdate_) {
+        [lines_ removeAllObjects];
+    } else {
+        for (NSNumber *key in [lines_ allKeys]) {
+            long long line = [key longLongValue];
+            if (line < first || line >= end) {
+                [lines_ removeObjectForKey:key];
+            }
+        }
+    }
+
+    for (long long line = first; line < end; line++) {
+        BOOL scanned = !needsUpdate_ && line >= firstLine_ && line < endLine_;
+        if (!scanned || [dirtyLines_ containsIndex:line]) {
+            [self scanLine:[dataSource getLineAtIndex:(int)(line - overflow)]
+                     width:width
+              absoluteLine:line];
+        }
+    }
+
+    [dirtyLines_ removeAllIndexes];
+    firstLine_ = first;
+    endLine_ = end;
+    width_ = width;
+    needsUpdate_ = NO;
+}
+
+- (BOOL)hasBlinkingCells
+{
+    return [lines_ count] > 0;
+}
+
+- (NSArray *)blinkingCellRectsWithTotalScrollbackOverflow:(long long)totalScrollbackOverflow
+{
+    NSMutableArray *rects = [NSMutableArray arrayWithCapacity:[lines_ count]];
+    for (NSNumber *key in lines_) {
+        VT100GridRange range = [[lines_ objectForKey:key] gridRangeValue];
+        VT100GridRect rect = VT100GridRectMake(range.location,
+                                               (int)([key longLongValue] - totalScrollbackOverflow),
+                                               range.length,
+                                               1);
+        [rects addObject:[NSValue valueWithGridRect:rect]];
+    }
+    return rects;
+}
+
+@end
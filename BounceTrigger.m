@@ -20,6 +20,11 @@
     return NO;
 }
 
+- (BOOL)isIdempotent
+{
+    return YES;
+}
+
 - (void)performActionWithValues:(NSArray *)values inSession:(PTYSession *)aSession
 {
     [NSApp requestUserAttention:NSCriticalRequest];
@@ -12,8 +12,11 @@
 #import "ScreenChar.h"
 
 @class CRunSet;
+typedef struct CRun CRun;
 
-// Backing storage for CRuns.
+// Backing storage for CRuns. Owns the runs themselves as well as their codes, glyphs, and
+// advances. A single instance may be reused indefinitely by calling -reset between uses; once the
+// arrays have grown to fit the widest line no further allocations are made.
 @interface CRunStorage : NSObject {
 	// There are |capacity_| elements in each of these, of which |used_|
 	// elements are in use. They are malloc()ed in -init, possibly realloc()ed
@@ -25,6 +28,12 @@
     int capacity_;  // Number of elements allocated
     int used_;  // Number of elements in use.
 
+    // Runs are allocated in fixed-size blocks so that pointers to them stay valid as more are
+    // added. There are |numRunBlocks_| blocks, and the first |runsUsed_| runs are in use.
+    CRun **runBlocks_;
+    int numRunBlocks_;
+    int runsUsed_;
+
     // Like an autorelease pool, but avoids multiple retain/release's per object.
     CRunSet *colors_;
 }
@@ -32,6 +41,15 @@
 // Create a new CRunStorage with space preallocated for |capacity| characters.
 + (CRunStorage *)cRunStorageWithCapacity:(int)capacity;
 
+- (id)initWithCapacity:(int)capacity;
+
+// Returns an uninitialized run whose lifetime is that of the storage (or until the next -reset).
+- (CRun *)allocateRun;
+
+// Releases everything the runs retain and makes all runs, codes, glyphs, and advances available for
+// reuse. Pointers to previously allocated runs become invalid.
+- (void)reset;
+
 // Returns codes/glyphs/advances starting at a given |index|.
 - (unichar *)codesFromIndex:(int)index;
 - (CGGlyph *)glyphsFromIndex:(int)index;
@@ -59,8 +77,6 @@ typedef struct {
     PTYFontInfo *fontInfo;    // Font to use. WEAK.
 } CAttrs;
 
-typedef struct CRun CRun;
-
 // A node in a linked list of |CRun|s. All the characters in a single CRun
 // have the same CAttrs. A CRun may contain either an array of |codes| with
 // |length| elements, or else a single character in |string| which may include
@@ -73,7 +89,7 @@ struct CRun {
     NSString *string;         // If set then there are no codes or glyphs, but may be advances.
     int key;                  // For complex chars, this is the key that gives the sting.
     BOOL terminated;          // No more appends allowed (will go into |next|)
-    CRunStorage *storage;     // Backing store for codes, glyphs, and advances.
+    CRunStorage *storage;     // Backing store for codes, glyphs, and advances. Owns this run. WEAK.
     CRun *next;               // Next run in linked list.
 };
 
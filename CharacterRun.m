@@ -17,6 +17,7 @@
 - (void)addObject:(NSObject *)object;
 - (BOOL)containsObject:(NSObject *)object;
 - (NSArray *)values;
+- (void)removeAllObjects;
 
 @end
 
@@ -53,8 +54,15 @@
     return [dict_ allValues];
 }
 
+- (void)removeAllObjects {
+    [dict_ removeAllObjects];
+}
+
 @end
 
+// Number of runs in each of CRunStorage's run blocks.
+static const int kRunsPerBlock = 64;
+
 @implementation CRunStorage : NSObject
 
 + (CRunStorage *)cRunStorageWithCapacity:(int)capacity {
@@ -76,6 +84,11 @@
 }
 
 - (void)dealloc {
+    [self reset];
+    for (int i = 0; i < numRunBlocks_; i++) {
+        free(runBlocks_[i]);
+    }
+    free(runBlocks_);
     free(codes_);
     free(glyphs_);
     free(advances_);
@@ -121,6 +134,28 @@
     [colors_ addObject:color];
 }
 
+- (CRun *)allocateRun {
+    int block = runsUsed_ / kRunsPerBlock;
+    if (block == numRunBlocks_) {
+        runBlocks_ = realloc(runBlocks_, sizeof(CRun *) * (numRunBlocks_ + 1));
+        runBlocks_[numRunBlocks_++] = malloc(sizeof(CRun) * kRunsPerBlock);
+    }
+    CRun *run = &runBlocks_[block][runsUsed_++ % kRunsPerBlock];
+    run->string = nil;
+    return run;
+}
+
+- (void)reset {
+    for (int i = 0; i < runsUsed_; i++) {
+        CRun *run = &runBlocks_[i / kRunsPerBlock][i % kRunsPerBlock];
+        [run->string release];
+        run->string = nil;
+    }
+    runsUsed_ = 0;
+    used_ = 0;
+    [colors_ removeAllObjects];
+}
+
 @end
 
 static void CRunDumpWithIndex(CRun *run, int offset) {
@@ -2,7 +2,7 @@
 // #define CRUN_INLINE
 #define CRUN_INLINE static
 
-// Initialize the state of a new run, whether it is on the stack or malloc'ed.
+// Initialize the state of a new run allocated from |storage|.
 CRUN_INLINE void CRunInitialize(CRun *run,
                                 CAttrs *attrs,
                                 CRunStorage *storage,
@@ -25,18 +25,12 @@ CRUN_INLINE CRun *CRunAppendString(CRun *run,
                                    CGFloat advance,
                                    CGFloat x);
 
-// Release the storage from a run and its successors in the run list.
-CRUN_INLINE void CRunDestroy(CRun *run);
-
-// Destroy and free() the run.
-CRUN_INLINE void CRunFree(CRun *run);
-
 // Move the start of the run past |offset| codes. Only valid if run->codes is
 // non-null.
 CRUN_INLINE void CRunAdvance(CRun *run, int offset);
 
 // Advance past the first |newStart| characters. Split the next character into
-// a CRun with a string and return that, which the caller must free. The
+// a CRun with a string and return that, which is owned by |run|'s storage. The
 // remainder of the run remains in |run|. This is used when the |newStart|th
 // character has a missing glyph.
 CRUN_INLINE CRun *CRunSplit(CRun *run, int newStart);
@@ -64,7 +58,7 @@ CRUN_INLINE void CRunInitialize(CRun *run,
     run->next = NULL;
     run->string = nil;
     run->terminated = NO;
-    run->storage = [storage retain];
+    run->storage = storage;
 }
 
 // Append codes to an existing run. It must not have a complex string already set.
@@ -102,7 +96,7 @@ CRUN_INLINE CRun *CRunAppendNew(CRun *run,
                                 unichar code,
                                 CGFloat advance) {
     assert(!run->next);
-    CRun *newRun = malloc(sizeof(CRun));
+    CRun *newRun = [run->storage allocateRun];
     CRunInitialize(newRun, attrs, run->storage, x);
     CRunAppendSelf(newRun, code, advance);
     run->next = newRun;
@@ -118,7 +112,7 @@ CRUN_INLINE CRun *CRunAppendNewString(CRun *run,
                                       int key,
                                       CGFloat advance) {
     assert(!run->next);
-    CRun *newRun = malloc(sizeof(CRun));
+    CRun *newRun = [run->storage allocateRun];
     CRunInitialize(newRun, attrs, run->storage, x);
     CRunAppendSelfString(newRun, string, key, advance);
     run->next = newRun;
@@ -159,21 +153,6 @@ CRUN_INLINE CRun *CRunAppendString(CRun *run,
     }
 }
 
-CRUN_INLINE void CRunDestroy(CRun *run) {
-    [run->string release];
-    [run->storage release];
-    if (run->next) {
-        CRunDestroy(run->next);
-        free(run->next);
-        run->next = NULL;
-    }
-}
-
-CRUN_INLINE void CRunFree(CRun *run) {
-    CRunDestroy(run);
-    free(run);
-}
-
 CRUN_INLINE void CRunAdvance(CRun *run, int offset) {
     assert(!run->string);
     assert(run->length >= offset);
@@ -190,7 +169,7 @@ CRUN_INLINE CRun *CRunSplit(CRun *run, int newStart) {
         return nil;
     }
     assert(newStart < run->length);
-    CRun *newRun = malloc(sizeof(CRun));
+    CRun *newRun = [run->storage allocateRun];
 
     // Skip past |newStart| chars
     CRunAdvance(run, newStart);
@@ -219,10 +198,9 @@ CRUN_INLINE CGGlyph *CRunGetGlyphs(CRun *run, int *firstMissingGlyph) {
         return nil;
     }
     CGGlyph *glyphs = [run->storage glyphsFromIndex:run->index];
-    BOOL foundAllGlyphs = CTFontGetGlyphsForCharacters((CTFontRef)run->attrs.fontInfo.font,
-                                                       [run->storage codesFromIndex:run->index],
-                                                       glyphs,
-                                                       run->length);
+    BOOL foundAllGlyphs = [run->attrs.fontInfo getGlyphs:glyphs
+                                           forCharacters:[run->storage codesFromIndex:run->index]
+                                                   count:run->length];
     if (!foundAllGlyphs) {
         for (int i = 0; i < run->length; i++) {
             if (!glyphs[i]) {
@@ -0,0 +1,46 @@
+//
+//  ColorCache.h
+//  iTerm
+//
+//  Resolved colors for PTYTextView, so that drawing a run doesn't create NSColors.
+//
+
+#import <Cocoa/Cocoa.h>
+
+// Number of keys accepted by -dimmedColorForKey:. PTYTextView builds keys from an 8-bit color
+// index and three flags.
+#define kColorCacheNumberOfDimmedKeys 2048
+
+// Holds the colors PTYTextView computes while drawing: dimmed palette colors in a flat table,
+// 24-bit colors (plain and dimmed) in a small direct-mapped table, and contrast-adjusted colors
+// keyed by the components of the color and the color it's drawn against. Each entry is retained
+// until -removeAllColors, which the view calls whenever the palette, dimming, or minimum contrast
+// changes, so the same inputs give the same pointer and consecutive characters can share a run.
+// Not thread-safe.
+@interface ColorCache : NSObject {
+    NSColor *dimmedColors_[kColorCacheNumberOfDimmedKeys];
+    struct ColorCacheTrueColorEntry *trueColors_;
+    struct ColorCacheContrastEntry *contrastingColors_;
+}
+
+// Returns a previously stored dimmed color, or nil.
+- (NSColor *)dimmedColorForKey:(int)key;
+- (void)setDimmedColor:(NSColor *)color forKey:(int)key;
+
+// Returns an opaque calibrated color with 8-bit components; the same object each time while it
+// stays cached.
+- (NSColor *)colorWithRed:(int)red green:(int)green blue:(int)blue;
+
+// Returns a previously stored dimmed version of the 24-bit color, or nil.
+- (NSColor *)dimmedColorWithRed:(int)red green:(int)green blue:(int)blue;
+- (void)setDimmedColor:(NSColor *)color red:(int)red green:(int)green blue:(int)blue;
+
+// |main| has four components (rgba) and |other| has three (rgb). Returns nil on a miss.
+- (NSColor *)contrastingColorForMain:(const double *)main other:(const double *)other;
+- (void)setContrastingColor:(NSColor *)color
+                    forMain:(const double *)main
+                      other:(const double *)other;
+
+- (void)removeAllColors;
+
+@end
@@ -0,0 +1,155 @@
+//
+//  ColorCache.m
+//  iTerm
+//
+
+#import "ColorCache.h"
+
+// Sizes of the direct-mapped tables. Must be powers of 2.
+static const int kTrueColorCacheSize = 256;
+static const int kContrastCacheSize = 256;
+
+struct ColorCacheTrueColorEntry {
+    int rgb;  // -1 if unused
+    NSColor *color;
+    NSColor *dimmedColor;
+};
+
+struct ColorCacheContrastEntry {
+    double main[4];
+    double other[3];
+    NSColor *color;  // nil if unused
+};
+
+static int ColorCachePackRGB(int red, int green, int blue) {
+    return ((red & 0xff) << 16) | ((green & 0xff) << 8) | (blue & 0xff);
+}
+
+static int ColorCacheTrueColorSlot(int rgb) {
+    return (rgb ^ (rgb >> 8) ^ (rgb >> 16)) & (kTrueColorCacheSize - 1);
+}
+
+static int ColorCacheContrastSlot(const double *main, const double *other) {
+    int hash = 0;
+    for (int i = 0; i < 3; i++) {
+        hash = hash * 31 + (int)(main[i] * 255);
+        hash = hash * 31 + (int)(other[i] * 255);
+    }
+    return hash & (kContrastCacheSize - 1);
+}
+
+@implementation ColorCache
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        trueColors_ = calloc(kTrueColorCacheSize, sizeof(struct ColorCacheTrueColorEntry));
+        for (int i = 0; i < kTrueColorCacheSize; i++) {
+            trueColors_[i].rgb = -1;
+        }
+        contrastingColors_ = calloc(kContrastCacheSize, sizeof(struct ColorCacheContrastEntry));
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self removeAllColors];
+    free(trueColors_);
+    free(contrastingColors_);
+    [super dealloc];
+}
+
+- (NSColor *)dimmedColorForKey:(int)key
+{
+    assert(key >= 0 && key < kColorCacheNumberOfDimmedKeys);
+    return dimmedColors_[key];
+}
+
+- (void)setDimmedColor:(NSColor *)color forKey:(int)key
+{
+    assert(key >= 0 && key < kColorCacheNumberOfDimmedKeys);
+    [dimmedColors_[key] autorelease];
+    dimmedColors_[key] = [color retain];
+}
+
+- (struct ColorCacheTrueColorEntry *)trueColorEntryWithRed:(int)red green:(int)green blue:(int)blue
+{
+    int rgb = ColorCachePackRGB(red, green, blue);
+    struct ColorCacheTrueColorEntry *entry = &trueColors_[ColorCacheTrueColorSlot(rgb)];
+    if (entry->rgb != rgb) {
+        // A caller may still be using the evicted colors.
+        [entry->color autorelease];
+        [entry->dimmedColor autorelease];
+        entry->rgb = rgb;
+        entry->color = [[NSColor colorWithCalibratedRed:red / 255.0
+                                                  green:green / 255.0
+                                                   blue:blue / 255.0
+                                                  alpha:1] retain];
+        entry->dimmedColor = nil;
+    }
+    return entry;
+}
+
+- (NSColor *)colorWithRed:(int)red green:(int)green blue:(int)blue
+{
+    return [self trueColorEntryWithRed:red green:green blue:blue]->color;
+}
+
+- (NSColor *)dimmedColorWithRed:(int)red green:(int)green blue:(int)blue
+{
+    int rgb = ColorCachePackRGB(red, green, blue);
+    struct ColorCacheTrueColorEntry *entry = &trueColors_[ColorCacheTrueColorSlot(rgb)];
+    return entry->rgb == rgb ? entry->dimmedColor : nil;
+}
+
+- (void)setDimmedColor:(NSColor *)color red:(int)red green:(int)green blue:(int)blue
+{
+    struct ColorCacheTrueColorEntry *entry = [self trueColorEntryWithRed:red green:green blue:blue];
+    [entry->dimmedColor autorelease];
+    entry->dimmedColor = [color retain];
+}
+
+- (NSColor *)contrastingColorForMain:(const double *)main other:(const double *)other
+{
+    struct ColorCacheContrastEntry *entry = &contrastingColors_[ColorCacheContrastSlot(main, other)];
+    if (entry->color &&
+        !memcmp(entry->main, main, sizeof(entry->main)) &&
+        !memcmp(entry->other, other, sizeof(entry->other))) {
+        return entry->color;
+    }
+    return nil;
+}
+
+- (void)setContrastingColor:(NSColor *)color
+                    forMain:(const double *)main
+                      other:(const double *)other
+{
+    struct ColorCacheContrastEntry *entry = &contrastingColors_[ColorCacheContrastSlot(main, other)];
+    [entry->color autorelease];
+    entry->color = [color retain];
+    memmove(entry->main, main, sizeof(entry->main));
+    memmove(entry->other, other, sizeof(entry->other));
+}
+
+- (void)removeAllColors
+{
+    for (int i = 0; i < kColorCacheNumberOfDimmedKeys; i++) {
+        [dimmedColors_[i] release];
+        dimmedColors_[i] = nil;
+    }
+    for (int i = 0; i < kTrueColorCacheSize; i++) {
+        [trueColors_[i].color release];
+        [trueColors_[i].dimmedColor release];
+        trueColors_[i].color = nil;
+        trueColors_[i].dimmedColor = nil;
+        trueColors_[i].rgb = -1;
+    }
+    for (int i = 0; i < kContrastCacheSize; i++) {
+        [contrastingColors_[i].color release];
+        contrastingColors_[i].color = nil;
+    }
+}
+
+@end
@@ -0,0 +1,64 @@
+//
+//  CompiledRegex.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+typedef enum {
+    // LinearRegex, which can't be made to take more than linear time by a badly written pattern.
+    kCompiledRegexEngineLinear,
+
+    // ICU's backtracking engine, for patterns that use what LinearRegex doesn't support.
+    kCompiledRegexEngineICU
+} CompiledRegexEngine;
+
+// A regex for search, triggers and smart selection. Patterns use ICU syntax and are compiled with
+// LinearRegex when it supports them, or ICU otherwise, and both find the same matches. The linear
+// engine can be turned off with the DisableLinearRegex user default.
+//
+// Compiled regexes are cached by pattern, immutable, and safe to use from any thread.
+@interface CompiledRegex : NSObject {
+    NSString *pattern_;
+    CompiledRegexEngine engine_;
+    NSString *fallbackReason_;
+    int numberOfGroups_;
+    struct LinearRegex *linear_;
+    NSRegularExpression *icu_;
+}
+
+@property(nonatomic, readonly) NSString *pattern;
+@property(nonatomic, readonly) CompiledRegexEngine engine;
+
+// Why ICU is used, or nil if it isn't.
+@property(nonatomic, readonly) NSString *fallbackReason;
+
+// Capturing groups, not counting the whole match.
+@property(nonatomic, readonly) int numberOfGroups;
+
+// Returns nil if |pattern| isn't a valid regex.
++ (CompiledRegex *)regexWithPattern:(NSString *)pattern caseInsensitive:(BOOL)caseInsensitive;
+
+// A sentence for the UI saying which engine |pattern| would use.
++ (NSString *)engineDescriptionForPattern:(NSString *)pattern caseInsensitive:(BOOL)caseInsensitive;
+
+// The first match within |range|, whose ends count as the start and end of the text for ^ and $.
+// Returns {NSNotFound, 0} if there is none.
+- (NSRange)rangeOfFirstMatchInString:(NSString *)string range:(NSRange)range;
+
+// Calls |block| with the ranges of each match within |range| and its groups, in order. A group
+// that didn't take part has a location of NSNotFound. Gives up and returns NO once
+// [NSDate timeIntervalSinceReferenceDate] passes |deadline|, unless it is 0.
+- (BOOL)enumerateMatchesInString:(NSString *)string
+                           range:(NSRange)range
+                        deadline:(NSTimeInterval)deadline
+                      usingBlock:(void (^)(const NSRange *ranges, int count, BOOL *stop))block;
+
+// The strings captured by the first match and its groups, with @"" for groups that didn't take
+// part, or an empty array if there's no match. Like RegexKitLite's captureComponentsMatchedByRegex:.
+- (NSArray *)captureComponentsInString:(NSString *)string;
+
+// The capture components of every match. Like RegexKitLite's arrayOfCaptureComponentsMatchedByRegex:.
+- (NSArray *)arrayOfCaptureComponentsInString:(NSString *)string;
+
+@end
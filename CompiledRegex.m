@@ -0,0 +1,254 @@
+//
+//  CompiledRegex.m
+//  iTerm
+//
+
+#import "CompiledRegex.h"
+#import "DebugLogging.h"
+#import "LinearRegex.h"
+#include <libkern/OSAtomic.h>
+
+// Patterns cached for each case sensitivity. The cache is emptied when it fills up.
+static const NSUInteger kMaxCachedRegexes = 100;
+
+// Index 0 is case sensitive and 1 insensitive. Maps a pattern to its CompiledRegex, or to NSNull
+// if it isn't valid.
+static NSMutableDictionary *gCaches[2];
+static OSSpinLock gCacheLock = OS_SPINLOCK_INIT;
+
+static NSArray *CaptureComponents(NSString *string, const NSRange *ranges, int count) {
+    NSMutableArray *components = [NSMutableArray arrayWithCapacity:count];
+    for (int i = 0; i < count; i++) {
+        if (ranges[i].location == NSNotFound) {
+            [components addObject:@""];
+        } else {
+            [components addObject:[string substringWithRange:ranges[i]]];
+        }
+    }
+    return components;
+}
+
+@implementation CompiledRegex
+
+@synthesize pattern = pattern_;
+@synthesize engine = engine_;
+@synthesize fallbackReason = fallbackReason_;
+@synthesize numberOfGroups = numberOfGroups_;
+
++ (CompiledRegex *)regexWithPattern:(NSString *)pattern caseInsensitive:(BOOL)caseInsensitive
+{
+    if (!pattern) {
+        return nil;
+    }
+    const int cacheIndex = caseInsensitive ? 1 : 0;
+    OSSpinLockLock(&gCacheLock);
+    id cached = [[gCaches[cacheIndex] objectForKey:pattern] retain];
+    OSSpinLockUnlock(&gCacheLock);
+    if (cached) {
+        [cached autorelease];
+        return (cached == [NSNull null]) ? nil : cached;
+    }
+
+    // Compiled outside the lock since a long pattern takes a while. If another thread compiled it
+    // in the meantime, this one replaces it, which is harmless.
+    CompiledRegex *regex = [[[CompiledRegex alloc] initWithPattern:pattern
+                                                   caseInsensitive:caseInsensitive] autorelease];
+    OSSpinLockLock(&gCacheLock);
+    if (!gCaches[cacheIndex]) {
+        gCaches[cacheIndex] = [[NSMutableDictionary alloc] init];
+    }
+    if ([gCaches[cacheIndex] count] >= kMaxCachedRegexes) {
+        [gCaches[cacheIndex] removeAllObjects];
+    }
+    [gCaches[cacheIndex] setObject:regex ? (id)regex : (id)[NSNull null] forKey:pattern];
+    OSSpinLockUnlock(&gCacheLock);
+    return regex;
+}
+
++ (NSString *)engineDescriptionForPattern:(NSString *)pattern caseInsensitive:(BOOL)caseInsensitive
+{
+    CompiledRegex *regex = [self regexWithPattern:pattern caseInsensitive:caseInsensitive];
+    if (!regex) {
+        return @"This isn't a valid regular expression.";
+    }
+    if (regex.engine == kCompiledRegexEngineLinear) {
+        return @"Matched with the linear-time regex engine.";
+    }
+    return [NSString stringWithFormat:@"Matched with ICU, which can be slow on long lines. %@",
+               regex.fallbackReason];
+}
+
+- (id)initWithPattern:(NSString *)pattern caseInsensitive:(BOOL)caseInsensitive
+{
+    self = [super init];
+    if (self) {
+        pattern_ = [pattern copy];
+        const BOOL disabled = [[NSUserDefaults standardUserDefaults] boolForKey:@"DisableLinearRegex"];
+        const char *reason = NULL;
+        if (!disabled) {
+            const int length = [pattern length];
+            unichar *chars = malloc(MAX(1, length) * sizeof(unichar));
+            [pattern getCharacters:chars range:NSMakeRange(0, length)];
+            linear_ = LinearRegexCreate(chars, length, caseInsensitive, &reason);
+            free(chars);
+        }
+        if (linear_) {
+            engine_ = kCompiledRegexEngineLinear;
+            numberOfGroups_ = LinearRegexNumberOfGroups(linear_);
+        } else {
+            NSRegularExpressionOptions options =
+                caseInsensitive ? NSRegularExpressionCaseInsensitive : 0;
+            icu_ = [[NSRegularExpression alloc] initWithPattern:pattern options:options error:NULL];
+            if (!icu_) {
+                DLog(@"Invalid regex %@", pattern);
+                [self release];
+                return nil;
+            }
+            engine_ = kCompiledRegexEngineICU;
+            numberOfGroups_ = [icu_ numberOfCaptureGroups];
+            if (disabled) {
+                fallbackReason_ = [@"The linear-time engine is turned off." retain];
+            } else {
+                fallbackReason_ = [[NSString alloc] initWithFormat:
+                                      @"The linear-time engine doesn't support %s.",
+                                      reason ? reason : "this pattern"];
+            }
+        }
+        DLog(@"Compiled regex %@ with %@",
+             pattern, engine_ == kCompiledRegexEngineLinear ? @"the linear engine" : fallbackReason_);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [pattern_ release];
+    [fallbackReason_ release];
+    LinearRegexFree(linear_);
+    [icu_ release];
+    [super dealloc];
+}
+
+- (NSRange)rangeOfFirstMatchInString:(NSString *)string range:(NSRange)range
+{
+    if (icu_) {
+        return [icu_ rangeOfFirstMatchInString:string options:0 range:range];
+    }
+    __block NSRange result = NSMakeRange(NSNotFound, 0);
+    [self enumerateMatchesInString:string
+                             range:range
+                          deadline:0
+                        usingBlock:^(const NSRange *ranges, int count, BOOL *stop) {
+                            result = ranges[0];
+                            *stop = YES;
+                        }];
+    return result;
+}
+
+- (BOOL)enumerateMatchesInString:(NSString *)string
+                           range:(NSRange)range
+                        deadline:(NSTimeInterval)deadline
+                      usingBlock:(void (^)(const NSRange *ranges, int count, BOOL *stop))block
+{
+    const int count = numberOfGroups_ + 1;
+    NSRange *ranges = malloc(count * sizeof(NSRange));
+    __block BOOL finished = YES;
+    if (icu_) {
+        [icu_ enumerateMatchesInString:string
+                               options:deadline ? NSMatchingReportProgress : 0
+                                 range:range
+                            usingBlock:^(NSTextCheckingResult *result,
+                                         NSMatchingFlags flags,
+                                         BOOL *stop) {
+                                if (result) {
+                                    for (int i = 0; i < count; i++) {
+                                        ranges[i] = [result rangeAtIndex:i];
+                                    }
+                                    block(ranges, count, stop);
+                                }
+                                if (deadline && [NSDate timeIntervalSinceReferenceDate] > deadline) {
+                                    finished = NO;
+                                    *stop = YES;
+                                }
+                            }];
+        free(ranges);
+        return finished;
+    }
+
+    const int length = range.length;
+    const unichar *characters = CFStringGetCharactersPtr((CFStringRef)string);
+    unichar *buffer = NULL;
+    if (characters) {
+        characters += range.location;
+    } else {
+        buffer = malloc(MAX(1, length) * sizeof(unichar));
+        [string getCharacters:buffer range:range];
+        characters = buffer;
+    }
+    int *captures = malloc(2 * count * sizeof(int));
+    BOOL stop = NO;
+    int start = 0;
+    while (!stop && start <= length) {
+        const LinearRegexResult result =
+            LinearRegexSearch(linear_, characters, length, start, captures, deadline);
+        if (result == kLinearRegexTimedOut) {
+            finished = NO;
+            break;
+        }
+        if (result == kLinearRegexNoMatch) {
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (captures[2 * i] < 0) {
+                ranges[i] = NSMakeRange(NSNotFound, 0);
+            } else {
+                ranges[i] = NSMakeRange(range.location + captures[2 * i],
+                                        captures[2 * i + 1] - captures[2 * i]);
+            }
+        }
+        block(ranges, count, &stop);
+
+        // Like ICU, look for the next match where this one ended, or a character later if it was
+        // empty.
+        start = captures[1];
+        if (captures[1] == captures[0]) {
+            start++;
+            if (start < length &&
+                CFStringIsSurrogateHighCharacter(characters[start - 1]) &&
+                CFStringIsSurrogateLowCharacter(characters[start])) {
+                start++;
+            }
+        }
+    }
+    free(captures);
+    free(buffer);
+    free(ranges);
+    return finished;
+}
+
+- (NSArray *)captureComponentsInString:(NSString *)string
+{
+    __block NSArray *components = [NSArray array];
+    [self enumerateMatchesInString:string
+                             range:NSMakeRange(0, [string length])
+                          deadline:0
+                        usingBlock:^(const NSRange *ranges, int count, BOOL *stop) {
+                            components = CaptureComponents(string, ranges, count);
+                            *stop = YES;
+                        }];
+    return components;
+}
+
+- (NSArray *)arrayOfCaptureComponentsInString:(NSString *)string
+{
+    NSMutableArray *matches = [NSMutableArray array];
+    [self enumerateMatchesInString:string
+                             range:NSMakeRange(0, [string length])
+                          deadline:0
+                        usingBlock:^(const NSRange *ranges, int count, BOOL *stop) {
+                            [matches addObject:CaptureComponents(string, ranges, count)];
+                        }];
+    return matches;
+}
+
+@end
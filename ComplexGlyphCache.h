@@ -0,0 +1,33 @@
+//
+//  ComplexGlyphCache.h
+//  iTerm
+//
+//  CoreText layouts of the complex characters drawn by -[PTYTextView _advancedDrawRun:at:].
+//
+
+#import <Cocoa/Cocoa.h>
+
+// Laying out a complex character (one with combining marks, or outside the BMP like most emoji)
+// means resolving fallback fonts, which is slow to do for every cell on every frame. Lines are
+// cached by the character's string and the font in a direct-mapped table, so a character that
+// appears again draws from its cached glyph runs. Keying by the string rather than the complex char
+// key means keys recycled by the complex char table can't pick up the wrong layout. Lines have no
+// color; the caller sets the fill color and draws the glyphs with CTFontDrawGlyphs. Call
+// -removeAllLines when the fonts change. Not thread-safe.
+@interface ComplexGlyphCache : NSObject {
+    struct ComplexGlyphCacheEntry *entries_;
+    int hits_;
+    int misses_;
+}
+
+// Returns a line laying out |string| in |font|, creating it if needed. It belongs to the cache and
+// is valid until the next call.
+- (CTLineRef)lineForString:(NSString *)string font:(NSFont *)font;
+
+- (void)removeAllLines;
+
+// Lookups since the last -removeAllLines, for debugging.
+@property(nonatomic, readonly) int hits;
+@property(nonatomic, readonly) int misses;
+
+@end
@@ -0,0 +1,82 @@
+//
+//  ComplexGlyphCache.m
+//  iTerm
+//
+
+#import "ComplexGlyphCache.h"
+
+// Size of the direct-mapped table. Must be a power of 2.
+static const int kComplexGlyphCacheSize = 1024;
+
+struct ComplexGlyphCacheEntry {
+    NSString *string;  // nil if unused
+    NSFont *font;      // Retained so another font can't take its address.
+    CTLineRef line;
+};
+
+@implementation ComplexGlyphCache
+
+@synthesize hits = hits_;
+@synthesize misses = misses_;
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        entries_ = calloc(kComplexGlyphCacheSize, sizeof(struct ComplexGlyphCacheEntry));
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self removeAllLines];
+    free(entries_);
+    [super dealloc];
+}
+
+- (CTLineRef)lineForString:(NSString *)string font:(NSFont *)font
+{
+    const NSUInteger hash = [string hash] ^ ((uintptr_t)font >> 4);
+    struct ComplexGlyphCacheEntry *entry = &entries_[hash & (kComplexGlyphCacheSize - 1)];
+    if (entry->font == font && [entry->string isEqualToString:string]) {
+        hits_++;
+        return entry->line;
+    }
+
+    misses_++;
+    NSAttributedString *attributedString =
+        [[[NSAttributedString alloc] initWithString:string
+                                         attributes:@{ NSFontAttributeName: font }] autorelease];
+    CTLineRef line = CTLineCreateWithAttributedString((CFAttributedStringRef)attributedString);
+    [self removeEntry:entry];
+    entry->string = [string copy];
+    entry->font = [font retain];
+    entry->line = line;
+    return line;
+}
+
+- (void)removeAllLines
+{
+    for (int i = 0; i < kComplexGlyphCacheSize; i++) {
+        [self removeEntry:&entries_[i]];
+    }
+    hits_ = 0;
+    misses_ = 0;
+}
+
+#pragma mark - Private
+
+- (void)removeEntry:(struct ComplexGlyphCacheEntry *)entry
+{
+    [entry->string release];
+    entry->string = nil;
+    [entry->font release];
+    entry->font = nil;
+    if (entry->line) {
+        CFRelease(entry->line);
+        entry->line = NULL;
+    }
+}
+
+@end
@@ -0,0 +1,51 @@
+//
+//  ContentsChangeFeed.h
+//  iTerm
+//
+//  Tells interested objects which sessions' contents changed, without waking them on every update.
+//
+
+#import <Foundation/Foundation.h>
+
+// What changed between two deliveries to a subscriber.
+@interface ContentsChangeSummary : NSObject {
+    NSMutableArray *sessions_;
+    NSMutableArray *lineRanges_;  // NSValue NSRange for each of sessions_.
+    long long fromGeneration_;
+    long long toGeneration_;
+}
+
+// Sessions whose contents changed, each listed once.
+@property(nonatomic, readonly) NSArray *sessions;
+
+// Changes after |fromGeneration| up to and including |toGeneration| are summarized.
+@property(nonatomic, readonly) long long fromGeneration;
+@property(nonatomic, readonly) long long toGeneration;
+
+- (BOOL)containsSession:(id)session;
+
+// The smallest range of absolute line numbers holding every line of |session| that changed, or
+// {NSNotFound, 0} if it didn't change.
+- (NSRange)changedLinesForSession:(id)session;
+
+@end
+
+// Sessions report changes as their views update. Each subscriber picks the most deliveries per
+// second it wants, and everything reported in between is merged into one summary. No subscriber
+// gets more than one delivery per frame (1/60 of a second). Main thread only.
+@interface ContentsChangeFeed : NSObject {
+    NSMutableArray *subscriptions_;
+    long long generation_;  // Incremented for each reported change.
+}
+
++ (ContentsChangeFeed *)sharedInstance;
+
+// |selector| is performed on |subscriber| with a ContentsChangeSummary. |subscriber| isn't
+// retained and must be removed before it's deallocated.
+- (void)addSubscriber:(id)subscriber selector:(SEL)selector maximumRate:(double)deliveriesPerSecond;
+- (void)removeSubscriber:(id)subscriber;
+
+// Called when lines of |session| in the range of absolute line numbers |lines| have changed.
+- (void)session:(id)session didChangeLines:(NSRange)lines;
+
+@end
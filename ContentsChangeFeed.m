@@ -0,0 +1,166 @@
+//
+//  ContentsChangeFeed.m
+//  iTerm
+//
+
+#import "ContentsChangeFeed.h"
+
+// Deliveries are at least this far apart no matter what rate is asked for.
+static const NSTimeInterval kContentsChangeFeedFrameInterval = 1.0 / 60.0;
+
+@interface ContentsChangeSummary ()
+- (id)initWithGeneration:(long long)generation;
+- (void)addLines:(NSRange)lines ofSession:(id)session generation:(long long)generation;
+@end
+
+@implementation ContentsChangeSummary
+
+@synthesize sessions = sessions_;
+@synthesize fromGeneration = fromGeneration_;
+@synthesize toGeneration = toGeneration_;
+
+- (id)initWithGeneration:(long long)generation
+{
+    self = [super init];
+    if (self) {
+        sessions_ = [[NSMutableArray alloc] init];
+        lineRanges_ = [[NSMutableArray alloc] init];
+        fromGeneration_ = generation;
+        toGeneration_ = generation;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [sessions_ release];
+    [lineRanges_ release];
+    [super dealloc];
+}
+
+- (BOOL)containsSession:(id)session
+{
+    return [sessions_ indexOfObjectIdenticalTo:session] != NSNotFound;
+}
+
+- (NSRange)changedLinesForSession:(id)session
+{
+    NSUInteger i = [sessions_ indexOfObjectIdenticalTo:session];
+    if (i == NSNotFound) {
+        return NSMakeRange(NSNotFound, 0);
+    }
+    return [[lineRanges_ objectAtIndex:i] rangeValue];
+}
+
+- (void)addLines:(NSRange)lines ofSession:(id)session generation:(long long)generation
+{
+    toGeneration_ = generation;
+    NSUInteger i = [sessions_ indexOfObjectIdenticalTo:session];
+    if (i == NSNotFound) {
+        [sessions_ addObject:session];
+        [lineRanges_ addObject:[NSValue valueWithRange:lines]];
+    } else {
+        NSRange merged = NSUnionRange([[lineRanges_ objectAtIndex:i] rangeValue], lines);
+        [lineRanges_ replaceObjectAtIndex:i withObject:[NSValue valueWithRange:merged]];
+    }
+}
+
+@end
+
+@interface ContentsChangeSubscription : NSObject {
+@public
+    id subscriber_;  // weak
+    SEL selector_;
+    NSTimeInterval interval_;
+    NSTimeInterval lastDelivery_;
+    ContentsChangeSummary *pending_;  // nil if nothing has changed since the last delivery.
+}
+@end
+
+@implementation ContentsChangeSubscription
+
+- (void)dealloc
+{
+    [NSObject cancelPreviousPerformRequestsWithTarget:self];
+    [pending_ release];
+    [super dealloc];
+}
+
+- (void)deliver
+{
+    ContentsChangeSummary *summary = [pending_ autorelease];
+    pending_ = nil;
+    lastDelivery_ = [NSDate timeIntervalSinceReferenceDate];
+    [subscriber_ performSelector:selector_ withObject:summary];
+}
+
+@end
+
+@implementation ContentsChangeFeed
+
++ (ContentsChangeFeed *)sharedInstance
+{
+    static ContentsChangeFeed *instance;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        instance = [[ContentsChangeFeed alloc] init];
+    });
+    return instance;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        subscriptions_ = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [subscriptions_ release];
+    [super dealloc];
+}
+
+- (void)addSubscriber:(id)subscriber selector:(SEL)selector maximumRate:(double)deliveriesPerSecond
+{
+    ContentsChangeSubscription *subscription = [[[ContentsChangeSubscription alloc] init] autorelease];
+    subscription->subscriber_ = subscriber;
+    subscription->selector_ = selector;
+    subscription->interval_ = MAX(kContentsChangeFeedFrameInterval, 1.0 / deliveriesPerSecond);
+    [subscriptions_ addObject:subscription];
+}
+
+- (void)removeSubscriber:(id)subscriber
+{
+    for (ContentsChangeSubscription *subscription in [[subscriptions_ copy] autorelease]) {
+        if (subscription->subscriber_ == subscriber) {
+            [NSObject cancelPreviousPerformRequestsWithTarget:subscription];
+            subscription->subscriber_ = nil;
+            [subscriptions_ removeObjectIdenticalTo:subscription];
+        }
+    }
+}
+
+- (void)session:(id)session didChangeLines:(NSRange)lines
+{
+    if (![subscriptions_ count]) {
+        return;
+    }
+    generation_++;
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    for (ContentsChangeSubscription *subscription in subscriptions_) {
+        if (!subscription->pending_) {
+            subscription->pending_ = [[ContentsChangeSummary alloc] initWithGeneration:generation_ - 1];
+            // Whatever else changes before the delivery joins this summary.
+            NSTimeInterval delay = subscription->lastDelivery_ + subscription->interval_ - now;
+            [subscription performSelector:@selector(deliver)
+                               withObject:nil
+                               afterDelay:MAX(0, delay)];
+        }
+        [subscription->pending_ addLines:lines ofSession:session generation:generation_];
+    }
+}
+
+@end
@@ -8,12 +8,16 @@
 
 #import <Cocoa/Cocoa.h>
 
+@class WriteQueue;
+
 @interface Coprocess : NSObject {
     pid_t pid_;  // -1 after termination
     int outputFd_;
     int inputFd_;
-    NSMutableData *outputBuffer_;
-    NSMutableData *inputBuffer_;
+
+    // Data waiting to be written to the coprocess, as it was read from the session.
+    NSMutableArray *outputQueue_;
+    size_t outputOffset_;  // Bytes of the first item already written
     BOOL eof_;
     BOOL mute_;
 }
@@ -21,8 +25,6 @@
 @property (nonatomic, assign) pid_t pid;
 @property (nonatomic, assign) int outputFd;  // for writing
 @property (nonatomic, assign) int inputFd;  // for reading
-@property (nonatomic, readonly) NSMutableData *outputBuffer;
-@property (nonatomic, readonly) NSMutableData *inputBuffer;
 @property (nonatomic, assign) BOOL eof;
 @property (nonatomic, assign) BOOL mute;
 
@@ -35,11 +37,15 @@
 						 inputFd:(int)inputFd;
 + (NSArray *)mostRecentlyUsedCommands;
 
-// Write from outputBuffer
+// Queues |data| to be written to the coprocess. It's retained rather than copied, so it must not
+// be changed afterwards.
+- (void)enqueueOutput:(NSData *)data;
+
+// Writes as much of the queued output as the coprocess will take with one writev().
 - (int)write;
 
-// Read to end of inputBuffer
-- (int)read;
+// Reads what the coprocess wrote straight into |queue| with one readv().
+- (int)readIntoWriteQueue:(WriteQueue *)queue;
 - (BOOL)wantToRead;
 - (BOOL)wantToWrite;
 - (void)mainProcessDidTerminate;
@@ -7,9 +7,14 @@
 //
 
 #import "Coprocess.h"
+#import "WriteQueue.h"
+#include <sys/uio.h>
 
-const int kMaxInputBufferSize = 1024;
-const int kMaxOutputBufferSize = 1024;
+// Most bytes to read from the coprocess at once.
+static const size_t kMaxReadSize = 64 * 1024;
+
+// Most queued items handed to a single writev().
+static const int kMaxOutputIovecs = 16;
 
 static NSString *kCoprocessMruKey = @"Coprocess MRU";
 
@@ -18,8 +23,6 @@ static NSString *kCoprocessMruKey = @"Coprocess MRU";
 @synthesize pid = pid_;
 @synthesize outputFd = outputFd_;
 @synthesize inputFd = inputFd_;
-@synthesize inputBuffer = inputBuffer_;
-@synthesize outputBuffer = outputBuffer_;
 @synthesize eof = eof_;
 @synthesize mute = mute_;
 
@@ -117,78 +120,88 @@ static NSString *kCoprocessMruKey = @"Coprocess MRU";
 {
     self = [super init];
     if (self) {
-        inputBuffer_ = [[NSMutableData alloc] init];
-        outputBuffer_ = [[NSMutableData alloc] init];
+        outputQueue_ = [[NSMutableArray alloc] init];
     }
     return self;
 }
 
 - (void)dealloc
 {
-    [inputBuffer_ release];
-    [outputBuffer_ release];
+    [outputQueue_ release];
     [super dealloc];
 }
 
+- (void)enqueueOutput:(NSData *)data
+{
+    if ([data length]) {
+        [outputQueue_ addObject:data];
+    }
+}
+
 - (int)write
 {
     if (self.pid < 0) {
         return -1;
     }
+    struct iovec iov[kMaxOutputIovecs];
+    int count = 0;
+    for (NSData *data in outputQueue_) {
+        if (count == kMaxOutputIovecs) {
+            break;
+        }
+        const size_t offset = count ? 0 : outputOffset_;
+        iov[count].iov_base = (char *)[data bytes] + offset;
+        iov[count].iov_len = [data length] - offset;
+        count++;
+    }
+    if (!count) {
+        return 0;
+    }
     int fd = [self writeFileDescriptor];
-    int n = write(fd, [outputBuffer_ bytes], [outputBuffer_ length]);
+    ssize_t n = writev(fd, iov, count);
 
     if (n < 0 && (!(errno == EAGAIN || errno == EINTR))) {
         eof_ = YES;
     } else if (n == 0) {
         eof_ = YES;
     } else if (n > 0) {
-        [outputBuffer_ replaceBytesInRange:NSMakeRange(0, n)
-                                 withBytes:""
-                                    length:0];
+        size_t remaining = n;
+        while (remaining > 0) {
+            const size_t available = [[outputQueue_ objectAtIndex:0] length] - outputOffset_;
+            if (remaining < available) {
+                outputOffset_ += remaining;
+                break;
+            }
+            remaining -= available;
+            outputOffset_ = 0;
+            [outputQueue_ removeObjectAtIndex:0];
+        }
     }
     return n;
 }
 
-- (int)read
+- (int)readIntoWriteQueue:(WriteQueue *)queue
 {
     if (self.pid < 0) {
         return -1;
     }
-    int rc = 0;
-    int fd = [self readFileDescriptor];
-    while (inputBuffer_.length < kMaxInputBufferSize) {
-        char buffer[1024];
-        int n = read(fd, buffer, sizeof(buffer));
-        if (n == 0) {
-            rc = 0;
-            eof_ = YES;
-            break;
-        } else if (n < 0) {
-            if (errno != EAGAIN && errno != EINTR) {
-                eof_ = YES;
-                rc = n;
-                break;
-            }
-        } else {
-            rc += n;
-            [inputBuffer_ appendBytes:buffer length:n];
-        }
-        if (n < sizeof(buffer)) {
-            break;
-        }
+    ssize_t n = [queue appendFromFileDescriptor:[self readFileDescriptor] maxLength:kMaxReadSize];
+    if (n == 0) {
+        eof_ = YES;
+    } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+        eof_ = YES;
     }
-    return rc;
+    return n;
 }
 
 - (BOOL)wantToRead
 {
-    return self.pid >= 0 && !eof_ && (inputBuffer_.length < kMaxInputBufferSize);
+    return self.pid >= 0 && !eof_;
 }
 
 - (BOOL)wantToWrite
 {
-    return self.pid >= 0 && !eof_ && (outputBuffer_.length > 0);
+    return self.pid >= 0 && !eof_ && [outputQueue_ count] > 0;
 }
 
 - (void)mainProcessDidTerminate
@@ -32,26 +32,64 @@
 #import "DVRDecoder.h"
 #import "DVREncoder.h"
 
+@class DVRFileWriter;
+
 @interface DVR : NSObject
 {
     DVRBuffer* buffer_;
     int capacity_;
     NSMutableArray* decoders_;
-    DVREncoder* encoder_;
+    DVREncoder* encoder_;  // nil if the DVR plays back a file
+    DVRFileWriter* fileWriter_;
+
+    // Frames passed to -appendChangedLines:ranges:info: are encoded on this queue. The buffer and
+    // the decoders are shared with the main thread, so they're used while synchronized on buffer_.
+    dispatch_queue_t queue_;
+
+    // Only accessed on queue_. The full screen as of the last frame handed off, one NSMutableData
+    // per line.
+    NSMutableArray* lines_;
 }
 
-// Allocates a circular buffer of the given size in bytes to store screen
-// contents. Somewhat more memory is used because there's some per-frame
-// storage, but it should be small in comparison.
+// Allocates a circular buffer to store screen contents that grows as frames arrive, up to the
+// given size in bytes, while DVRBudget allows. Somewhat more memory is used because there's some
+// per-frame storage, but it should be small in comparison. Main thread.
 - (id)initWithBufferCapacity:(int)bytes;
+
+// Plays back a file recorded with -startRecordingToFile:. Frames can't be appended. Returns nil if
+// the file can't be read.
+- (id)initWithContentsOfFile:(NSString *)path;
 - (void)dealloc;
 
+// Also write every frame to a file on disk, in the background. Returns NO if the file can't be
+// created. Once the file reaches the buffer's capacity it's moved to path.1 and a new one started.
+- (BOOL)startRecordingToFile:(NSString *)path;
+
 // Save the screen state into the DVR.
 //   frameLines: An array of screen lines that DVREncoder understands.
 //   length: Number of bytes in buffer.
 //   info: Metadata for the frame.
 - (void)appendFrame:(NSArray*)frameLines length:(int)length info:(DVRFrameInfo*)info;
 
+// Like -appendFrame:length:info:, but only the screen_char_ts in dirtyRanges[i] of line i may
+// differ from the previous frame. Everything else is assumed unchanged and isn't compared.
+// dirtyRanges has one element per line.
+- (void)appendFrame:(NSArray*)frameLines
+             length:(int)length
+        dirtyRanges:(NSRange *)dirtyRanges
+               info:(DVRFrameInfo*)info;
+
+// Save the screen state into the DVR in the background. Only the chars that changed since the last
+// call need to be provided:
+//   changedLines: For each line, an NSData holding the screen_char_ts in that line's range.
+//   ranges: One range of screen_char_t indexes per line (each line has width + 1 of them). After
+//     a change of size or for the first frame every range must cover its whole line.
+//   info: Metadata for the frame. If info->timestamp is nonzero it's used as the frame's time.
+- (void)appendChangedLines:(NSArray *)changedLines ranges:(NSRange *)ranges info:(DVRFrameInfo *)info;
+
+// Blocks until frames passed to -appendChangedLines:ranges:info: have been encoded.
+- (void)waitForPendingFrames;
+
 // allocate a new decoder. Use -[releaseDecoder:] when you're done with it.
 - (DVRDecoder*)getDecoder;
 
@@ -62,4 +100,20 @@
 - (long long)lastTimeStamp;
 - (long long)firstTimeStamp;
 
+// Bytes allocated for the circular buffer, the bytes of it holding frames, and the most it may
+// grow to.
+- (long long)bufferCapacity;
+- (long long)bufferUsedBytes;
+- (long long)maximumBufferCapacity;
+
+// Called by DVRBudget on the main thread to give back about |bytes| by dropping the oldest frames.
+// Returns the number of bytes freed. A DVR that's being played back isn't shrunk.
+- (long long)shrinkBy:(long long)bytes;
+
+// Seconds of recorded history per megabyte of buffer used.
+- (double)secondsOfHistoryPerMegabyte;
+
+// Describes compression and encoding cost for debug logging.
+- (NSString *)statisticsDescription;
+
 @end
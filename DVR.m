@@ -28,27 +28,62 @@
  */
 
 #import "DVR.h"
+#import "DVRBudget.h"
+#import "DVRFileWriter.h"
 #import "DVRIndexEntry.h"
 #include <sys/time.h>
 
+// Buffers start this small, and aren't shrunk below it.
+static const long long kDVRMinimumCapacity = 256 * 1024;
+
 @implementation DVR
 
 - (id)initWithBufferCapacity:(int)bytes
 {
     self = [super init];
     if (self) {
-        buffer_ = [DVRBuffer alloc];
-        [buffer_ initWithBufferCapacity:bytes];
+        buffer_ = [[DVRBuffer alloc] initWithInitialCapacity:kDVRMinimumCapacity
+                                             maximumCapacity:bytes];
         capacity_ = bytes;
         decoders_ = [[NSMutableArray alloc] init];
         encoder_ = [DVREncoder alloc];
         [encoder_ initWithBuffer:buffer_];
+        queue_ = dispatch_queue_create("com.googlecode.iterm2.dvr", DISPATCH_QUEUE_SERIAL);
+        lines_ = [[NSMutableArray alloc] init];
+        [[DVRBudget sharedInstance] addDVR:self];
+    }
+    return self;
+}
+
+- (id)initWithContentsOfFile:(NSString *)path
+{
+    self = [super init];
+    if (self) {
+        buffer_ = [[DVRBuffer alloc] initWithContentsOfFile:path];
+        if (!buffer_) {
+            [self release];
+            return nil;
+        }
+        capacity_ = [buffer_ capacity];
+        decoders_ = [[NSMutableArray alloc] init];
     }
     return self;
 }
 
 - (void)dealloc
 {
+    if (encoder_) {
+        [[DVRBudget sharedInstance] removeDVR:self];
+    }
+    // Blocks on queue_ don't retain self, so let them finish first.
+    [self waitForPendingFrames];
+    if (queue_) {
+        dispatch_release(queue_);
+    }
+    [lines_ release];
+    [encoder_ setFileWriter:nil];
+    [fileWriter_ close];
+    [fileWriter_ release];
     [decoders_ release];
     [encoder_ release];
     [buffer_ release];
@@ -57,52 +92,205 @@
 
 - (void)appendFrame:(NSArray*)frameLines length:(int)length info:(DVRFrameInfo*)info
 {
-    if (length > [buffer_ capacity] / 2) {
-        // Protect the buffer from overflowing if you have a really big window.
+    [self appendFrame:frameLines length:length dirtyRanges:NULL info:info];
+}
+
+- (void)appendFrame:(NSArray*)frameLines
+             length:(int)length
+        dirtyRanges:(NSRange *)dirtyRanges
+               info:(DVRFrameInfo*)info
+{
+    if (!encoder_) {
+        // Playing back a file.
         return;
     }
-    int prevFirst = [buffer_ firstKey];
-    if ([encoder_ reserve:length]) {
-        // Leading frames were freed. Invalidate them in all decoders.
-        for (DVRDecoder* decoder in decoders_) {
-            int newFirst = [buffer_ firstKey];
-            for (int i = prevFirst; i < newFirst; ++i) {
-                [decoder invalidateIndex:i];
+    @synchronized(buffer_) {
+        if (![buffer_ canHoldBlockOfLength:length]) {
+            // Protect the buffer from overflowing if you have a really big window.
+            return;
+        }
+        long long prevFirst = [buffer_ firstKey];
+        if ([encoder_ reserve:length]) {
+            // Leading frames were freed. Invalidate them in all decoders.
+            for (DVRDecoder* decoder in decoders_) {
+                long long newFirst = [buffer_ firstKey];
+                for (long long i = prevFirst; i < newFirst; ++i) {
+                    [decoder invalidateIndex:i];
+                }
             }
         }
+        [encoder_ appendFrame:frameLines length:length dirtyRanges:dirtyRanges info:info];
     }
-    [encoder_ appendFrame:frameLines length:length info:info];
+}
+
+- (void)appendChangedLines:(NSArray *)changedLines ranges:(NSRange *)ranges info:(DVRFrameInfo *)info
+{
+    if (!encoder_) {
+        return;
+    }
+    const int height = info->height;
+    NSMutableData *rangeData = [NSMutableData dataWithBytes:ranges length:height * sizeof(NSRange)];
+    DVRFrameInfo frameInfo = *info;
+    changedLines = [[changedLines copy] autorelease];
+    __block DVR *unretainedSelf = self;
+    dispatch_async(queue_, ^{
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        [unretainedSelf _applyChangedLines:changedLines
+                                    ranges:[rangeData mutableBytes]
+                                      info:frameInfo];
+        [pool drain];
+    });
+}
+
+- (void)waitForPendingFrames
+{
+    if (queue_) {
+        dispatch_sync(queue_, ^{ });
+    }
+}
+
+// Runs on queue_. Updates lines_ and encodes it.
+- (void)_applyChangedLines:(NSArray *)changedLines ranges:(NSRange *)ranges info:(DVRFrameInfo)info
+{
+    const int lineLength = (info.width + 1) * sizeof(screen_char_t);
+    if ([lines_ count] != info.height ||
+        ([lines_ count] && [[lines_ objectAtIndex:0] length] != lineLength)) {
+        [lines_ removeAllObjects];
+        for (int y = 0; y < info.height; y++) {
+            [lines_ addObject:[NSMutableData dataWithLength:lineLength]];
+        }
+    }
+    for (int y = 0; y < info.height; y++) {
+        NSData *changed = [changedLines objectAtIndex:y];
+        NSMutableData *line = [lines_ objectAtIndex:y];
+        memcpy((char *)[line mutableBytes] + ranges[y].location * sizeof(screen_char_t),
+               [changed bytes],
+               [changed length]);
+    }
+    [self appendFrame:lines_
+               length:lineLength * info.height
+          dirtyRanges:ranges
+                 info:&info];
+}
+
+- (BOOL)startRecordingToFile:(NSString *)path
+{
+    if (!encoder_) {
+        return NO;
+    }
+    const int kMaxPendingBytes = 8 * 1024 * 1024;
+    DVRFileWriter *writer = [[[DVRFileWriter alloc] initWithPath:path
+                                                    maxFileBytes:capacity_
+                                                 maxPendingBytes:kMaxPendingBytes] autorelease];
+    if (!writer) {
+        return NO;
+    }
+    dispatch_sync(queue_, ^{
+        [fileWriter_ close];
+        [fileWriter_ release];
+        fileWriter_ = [writer retain];
+        [encoder_ setFileWriter:fileWriter_];
+    });
+    return YES;
 }
 
 - (DVRDecoder*)getDecoder
 {
+    // Include everything captured so far.
+    [self waitForPendingFrames];
     DVRDecoder* decoder = [[DVRDecoder alloc] initWithBuffer:buffer_];
-    [decoders_ addObject:decoder];
+    @synchronized(buffer_) {
+        [decoders_ addObject:decoder];
+    }
     [decoder release];
     return decoder;
 }
 
 - (void)releaseDecoder:(DVRDecoder*)decoder
 {
-    [decoders_ removeObject:decoder];
+    @synchronized(buffer_) {
+        [decoders_ removeObject:decoder];
+    }
 }
 
 - (long long)lastTimeStamp
 {
-    DVRIndexEntry* entry = [buffer_ entryForKey:[buffer_ lastKey]];
-    if (!entry) {
-        return 0;
+    @synchronized(buffer_) {
+        DVRIndexEntry* entry = [buffer_ entryForKey:[buffer_ lastKey]];
+        if (!entry) {
+            return 0;
+        }
+        return entry->info.timestamp;
     }
-    return entry->info.timestamp;
 }
 
 - (long long)firstTimeStamp
 {
-    DVRIndexEntry* entry = [buffer_ entryForKey:[buffer_ firstKey]];
-    if (!entry) {
-        return 0;
+    @synchronized(buffer_) {
+        DVRIndexEntry* entry = [buffer_ entryForKey:[buffer_ firstKey]];
+        if (!entry) {
+            return 0;
+        }
+        return entry->info.timestamp;
+    }
+}
+
+- (long long)bufferCapacity
+{
+    @synchronized(buffer_) {
+        return [buffer_ capacity];
+    }
+}
+
+- (long long)maximumBufferCapacity
+{
+    return capacity_;
+}
+
+- (long long)shrinkBy:(long long)bytes
+{
+    @synchronized(buffer_) {
+        if (!encoder_ || [decoders_ count]) {
+            return 0;
+        }
+        const long long capacity = MAX(kDVRMinimumCapacity, [buffer_ capacity] - bytes);
+        const long long freed = [buffer_ shrinkToCapacity:capacity];
+        if (freed) {
+            // The last key frame may be gone, so the next frame mustn't be a diff.
+            [encoder_ forgetLastFrame];
+        }
+        return freed;
+    }
+}
+
+- (long long)bufferUsedBytes
+{
+    @synchronized(buffer_) {
+        return [buffer_ usedBytes];
     }
-    return entry->info.timestamp;
+}
+
+- (double)secondsOfHistoryPerMegabyte
+{
+    @synchronized(buffer_) {
+        long long used = [buffer_ usedBytes];
+        if (!used) {
+            return 0;
+        }
+        double seconds = ([self lastTimeStamp] - [self firstTimeStamp]) / 1000000.0;
+        return seconds / (used / 1048576.0);
+    }
+}
+
+- (NSString *)statisticsDescription
+{
+    [self waitForPendingFrames];
+    return [NSString stringWithFormat:@"%lld frames in %lld bytes, %.1f sec/MB, compression %.2fx, %.0f us/frame",
+            [buffer_ lastKey] - [buffer_ firstKey] + 1,
+            [buffer_ usedBytes],
+            [self secondsOfHistoryPerMegabyte],
+            [encoder_ compressionRatio],
+            [encoder_ averageEncodingTime]];
 }
 
 @end
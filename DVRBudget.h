@@ -0,0 +1,49 @@
+//
+//  DVRBudget.h
+//  iTerm
+//
+//  Caps the memory used by all sessions' instant replay buffers together.
+//
+
+#import <Foundation/Foundation.h>
+#include <libkern/OSAtomic.h>
+
+@class DVR;
+
+// Instant replay buffers start small and grow as frames arrive, up to the per-session size in
+// preferences, so an idle session costs little. Growth is granted from a total shared by every
+// buffer, set in megabytes by the hidden InstantReplayMemoryBudget preference. When a buffer is
+// refused, the DVRs that have gone longest without a frame are shrunk (their oldest frames
+// dropped) to make room for the next attempt.
+@interface DVRBudget : NSObject {
+    volatile int64_t allocatedBytes_;
+    long long limit_;
+
+    // Bytes of the last growth that was refused, and whether a trim is on its way to the main
+    // thread.
+    volatile int64_t shortfall_;
+    volatile int32_t trimScheduled_;
+
+    // Unretained DVRs that may be shrunk. Main thread only.
+    NSMutableArray *dvrs_;
+}
+
++ (DVRBudget *)sharedInstance;
+
+// Total bytes all buffers may hold.
+@property(nonatomic, readonly) long long limit;
+
+- (long long)allocatedBytes;
+
+// Any thread. Returns NO and schedules a trim if |bytes| more would go over the limit.
+- (BOOL)reserveBytes:(long long)bytes;
+
+// Any thread. Takes bytes regardless of the limit, for a buffer's initial allocation.
+- (void)addBytes:(long long)bytes;
+- (void)releaseBytes:(long long)bytes;
+
+// Main thread. A registered DVR may be asked to -shrinkBy: until it's removed.
+- (void)addDVR:(DVR *)dvr;
+- (void)removeDVR:(DVR *)dvr;
+
+@end
@@ -0,0 +1,136 @@
+//
+//  DVRBudget.m
+//  iTerm
+//
+
+#import "DVRBudget.h"
+#import "DebugLogging.h"
+#import "DVR.h"
+#include <sys/time.h>
+
+static const long long kDVRBudgetDefaultLimit = 256 * 1024 * 1024;
+
+// A DVR that got a frame more recently than this is in use and isn't shrunk.
+static const long long kDVRBudgetIdleMicroseconds = 10 * 1000000LL;
+
+@implementation DVRBudget
+
+@synthesize limit = limit_;
+
++ (DVRBudget *)sharedInstance
+{
+    static DVRBudget *instance;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        instance = [[DVRBudget alloc] init];
+    });
+    return instance;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        NSInteger megabytes =
+            [[NSUserDefaults standardUserDefaults] integerForKey:@"InstantReplayMemoryBudget"];
+        limit_ = megabytes > 0 ? (long long)megabytes * 1024 * 1024 : kDVRBudgetDefaultLimit;
+        dvrs_ = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [dvrs_ release];
+    [super dealloc];
+}
+
+- (long long)allocatedBytes
+{
+    return allocatedBytes_;
+}
+
+- (BOOL)reserveBytes:(long long)bytes
+{
+    while (1) {
+        const int64_t allocated = allocatedBytes_;
+        if (allocated + bytes > limit_) {
+            shortfall_ = bytes;
+            [self scheduleTrim];
+            return NO;
+        }
+        if (OSAtomicCompareAndSwap64Barrier(allocated, allocated + bytes, &allocatedBytes_)) {
+            return YES;
+        }
+    }
+}
+
+- (void)addBytes:(long long)bytes
+{
+    OSAtomicAdd64Barrier(bytes, &allocatedBytes_);
+}
+
+- (void)releaseBytes:(long long)bytes
+{
+    OSAtomicAdd64Barrier(-bytes, &allocatedBytes_);
+}
+
+- (void)addDVR:(DVR *)dvr
+{
+    [dvrs_ addObject:[NSValue valueWithNonretainedObject:dvr]];
+}
+
+- (void)removeDVR:(DVR *)dvr
+{
+    [dvrs_ removeObject:[NSValue valueWithNonretainedObject:dvr]];
+}
+
+#pragma mark - Private
+
+- (void)scheduleTrim
+{
+    if (!OSAtomicCompareAndSwap32Barrier(0, 1, &trimScheduled_)) {
+        return;
+    }
+    dispatch_async(dispatch_get_main_queue(), ^{
+        trimScheduled_ = 0;
+        [self trim];
+    });
+}
+
+// Frees at least the last shortfall, if it's over the limit, from the idlest DVRs.
+- (void)trim
+{
+    const long long need = allocatedBytes_ + shortfall_ - limit_;
+    if (need <= 0) {
+        return;
+    }
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    const long long idleBefore = now.tv_sec * 1000000LL + now.tv_usec - kDVRBudgetIdleMicroseconds;
+
+    NSMutableArray *idle = [NSMutableArray array];
+    for (NSValue *value in dvrs_) {
+        DVR *dvr = [value nonretainedObjectValue];
+        if ([dvr lastTimeStamp] < idleBefore) {
+            [idle addObject:dvr];
+        }
+    }
+    [idle sortUsingComparator:^NSComparisonResult(DVR *a, DVR *b) {
+        const long long ta = [a lastTimeStamp];
+        const long long tb = [b lastTimeStamp];
+        return ta < tb ? NSOrderedAscending : ta > tb ? NSOrderedDescending : NSOrderedSame;
+    }];
+
+    long long freed = 0;
+    for (DVR *dvr in idle) {
+        if (freed >= need) {
+            break;
+        }
+        freed += [dvr shrinkBy:need - freed];
+    }
+    DLog(@"Instant replay budget: needed %lld bytes, freed %lld from %d idle of %d DVRs",
+         need, freed, (int)[idle count], (int)[dvrs_ count]);
+}
+
+@end
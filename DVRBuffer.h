@@ -56,9 +56,20 @@ typedef enum {
     // Total size of storage in bytes.
     long long capacity_;
 
-    // Maps a frame key number to DVRIndexEntry*.
-    NSMutableDictionary* index_;
-    
+    // Storage grows on demand up to this size. Bytes beyond the initial capacity come from
+    // DVRBudget, as do all bytes if budgeted_ is set.
+    long long maximumCapacity_;
+    BOOL budgeted_;
+
+    // If set, store_ is a read-only mapping of a DVR file.
+    BOOL mapped_;
+
+    // Ring of index entries for keys firstKey_ ..< nextKey_. The entry for key k is at
+    // entries_[(entriesStart_ + k - firstKey_) % entriesCapacity_].
+    DVRIndexEntry* entries_;
+    long long entriesCapacity_;
+    long long entriesStart_;
+
     // First key in index.
     long long firstKey_;
 
@@ -76,12 +87,19 @@ typedef enum {
 
     // Non-inclusive end of circular buffer's used regino.
     long long end_;
-
-    // this must always equal index_.
-    id sanityCheck;  // TODO(georgen): remove this after the source of corruption of index_ is found
 }
 
+// A buffer of fixed size, outside DVRBudget.
 - (id)initWithBufferCapacity:(long long)capacity;
+
+// A buffer that starts with |initialCapacity| bytes and grows, as the budget allows, up to
+// |maximumCapacity|. Frames are only freed to make room once it can't grow.
+- (id)initWithInitialCapacity:(long long)initialCapacity
+              maximumCapacity:(long long)maximumCapacity;
+
+// Maps a file written by DVRFileWriter. The buffer is read-only: frames can be looked up but not
+// added. Returns nil if the file can't be read.
+- (id)initWithContentsOfFile:(NSString *)path;
 - (void)dealloc;
 
 // Reserve a chunk of memory. Returns true if blocks had to be freed to make room.
@@ -102,15 +120,33 @@ typedef enum {
 // Returns true if there's enough free space without deallocating a block.
 - (BOOL)hasSpaceAvailable:(long long)length;
 
+// Grows the storage if needed so a block of |length| bytes is no more than half of it. Returns NO
+// if that isn't possible, in which case the block shouldn't be added.
+- (BOOL)canHoldBlockOfLength:(long long)length;
+
+// Drops the oldest frames, and any diff frames left before the first key frame, until what
+// remains fits in |capacity| bytes, then moves them into storage of that size. Returns the bytes
+// given back to the budget.
+- (long long)shrinkToCapacity:(long long)capacity;
+
 // Returns first/last used keys.
 - (long long)firstKey;
 - (long long)lastKey;
 
-// Look up an index entry by key.
+// Look up an index entry by key. Returns NULL if the key doesn't exist. The pointer is valid until
+// the next call to -allocateBlock: or -deallocateBlock.
 - (DVRIndexEntry*)entryForKey:(long long)key;
 
-// Total size of storage.
+// Returns the first key whose timestamp is at least |timestamp|, or -1 if there is none. Frame
+// timestamps never decrease, so this is a binary search.
+- (long long)firstKeyWithTimestampAtLeast:(long long)timestamp;
+
+// Total size of storage now, and the most it may grow to.
 - (long long)capacity;
+- (long long)maximumCapacity;
+
+// Number of bytes of storage holding frames.
+- (long long)usedBytes;
 
 // Are there no frames?
 - (BOOL)isEmpty;
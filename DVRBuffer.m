@@ -27,18 +27,27 @@
  */
 
 #import "DVRBuffer.h"
-
+#import "DVRBudget.h"
+#import "DVRFileWriter.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 @implementation DVRBuffer
 
+static const long long kInitialIndexCapacity = 256;
+
 - (id)initWithBufferCapacity:(long long)maxsize
 {
     self = [super init];
     if (self) {
         capacity_ = maxsize;
+        maximumCapacity_ = maxsize;
         store_ = malloc(maxsize);
-        index_ = [[NSMutableDictionary alloc] init];
-        sanityCheck = index_;
+        entriesCapacity_ = kInitialIndexCapacity;
+        entries_ = malloc(entriesCapacity_ * sizeof(DVRIndexEntry));
+        entriesStart_ = 0;
         firstKey_ = 0;
         nextKey_ = 0;
         begin_ = 0;
@@ -47,21 +56,144 @@
     return self;
 }
 
+- (id)initWithInitialCapacity:(long long)initialCapacity
+              maximumCapacity:(long long)maximumCapacity
+{
+    self = [self initWithBufferCapacity:MIN(initialCapacity, maximumCapacity)];
+    if (self) {
+        maximumCapacity_ = maximumCapacity;
+        budgeted_ = YES;
+        [[DVRBudget sharedInstance] addBytes:capacity_];
+    }
+    return self;
+}
+
+- (id)initWithContentsOfFile:(NSString *)path
+{
+    self = [super init];
+    if (self) {
+        entriesCapacity_ = kInitialIndexCapacity;
+        entries_ = malloc(entriesCapacity_ * sizeof(DVRIndexEntry));
+        if (![self _mapFile:path]) {
+            [self release];
+            return nil;
+        }
+    }
+    return self;
+}
+
 - (void)dealloc
 {
-    assert(index_ == sanityCheck);
-    [index_ release];
-    index_ = nil;
-    sanityCheck = nil;
-    free(store_);
+    free(entries_);
+    if (mapped_) {
+        munmap(store_, capacity_);
+    } else {
+        free(store_);
+    }
+    if (budgeted_) {
+        [[DVRBudget sharedInstance] releaseBytes:capacity_];
+    }
     [super dealloc];
 }
 
+- (BOOL)_mapFile:(NSString *)path
+{
+    int fd = open([path fileSystemRepresentation], O_RDONLY);
+    if (fd < 0) {
+        return NO;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < sizeof(DVRFileHeader)) {
+        close(fd);
+        return NO;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NO;
+    }
+    store_ = map;
+    capacity_ = st.st_size;
+    maximumCapacity_ = capacity_;
+    mapped_ = YES;
+
+    const DVRFileHeader *header = (const DVRFileHeader *)store_;
+    if (memcmp(header->magic, kDVRFileMagic, sizeof(header->magic)) ||
+        header->version != kDVRFileVersion) {
+        return NO;
+    }
+
+    // Use the index if the file was closed properly. Otherwise walk the frames.
+    const DVRFileTrailer *trailer = (const DVRFileTrailer *)(store_ + capacity_ - sizeof(DVRFileTrailer));
+    if (capacity_ >= sizeof(DVRFileHeader) + sizeof(DVRFileTrailer) &&
+        !memcmp(trailer->magic, kDVRFileMagic, sizeof(trailer->magic)) &&
+        trailer->numFrames >= 0 &&
+        trailer->indexOffset + trailer->numFrames * sizeof(DVRFileIndexEntry) + sizeof(DVRFileTrailer) == capacity_) {
+        const DVRFileIndexEntry *index = (const DVRFileIndexEntry *)(store_ + trailer->indexOffset);
+        for (long long i = 0; i < trailer->numFrames; i++) {
+            if (![self _addMappedFrameAtOffset:index[i].offset limit:trailer->indexOffset]) {
+                return NO;
+            }
+        }
+    } else {
+        long long offset = sizeof(DVRFileHeader);
+        while ([self _addMappedFrameAtOffset:offset limit:capacity_]) {
+            offset = [self entryForKey:nextKey_ - 1]->position + [self entryForKey:nextKey_ - 1]->frameLength;
+        }
+    }
+    begin_ = 0;
+    end_ = capacity_;
+    return YES;
+}
+
+// Adds an index entry for the frame whose header is at offset. Returns NO if it doesn't fit before
+// limit (e.g., it was cut off by a crash).
+- (BOOL)_addMappedFrameAtOffset:(long long)offset limit:(long long)limit
+{
+    if (offset < sizeof(DVRFileHeader) || offset + sizeof(DVRFileFrameHeader) > limit) {
+        return NO;
+    }
+    const DVRFileFrameHeader *header = (const DVRFileFrameHeader *)(store_ + offset);
+    if (header->frameLength < 0 ||
+        offset + sizeof(DVRFileFrameHeader) + header->frameLength > limit) {
+        return NO;
+    }
+    [self _growIndexIfNeeded];
+    long long key = nextKey_++;
+    DVRIndexEntry* entry = [self entryForKey:key];
+    entry->info = header->info;
+    entry->position = offset + sizeof(DVRFileFrameHeader);
+    entry->frameLength = header->frameLength;
+    entry->decodedLength = header->decodedLength;
+    entry->compressed = header->compressed;
+    return YES;
+}
+
+- (void)_growIndexIfNeeded
+{
+    long long count = nextKey_ - firstKey_;
+    if (count == entriesCapacity_) {
+        // Grow the ring, unrolling it so the first key is at the start.
+        long long newCapacity = entriesCapacity_ * 2;
+        DVRIndexEntry* newEntries = malloc(newCapacity * sizeof(DVRIndexEntry));
+        long long headCount = MIN(count, entriesCapacity_ - entriesStart_);
+        memcpy(newEntries, entries_ + entriesStart_, headCount * sizeof(DVRIndexEntry));
+        memcpy(newEntries + headCount, entries_, (count - headCount) * sizeof(DVRIndexEntry));
+        free(entries_);
+        entries_ = newEntries;
+        entriesCapacity_ = newCapacity;
+        entriesStart_ = 0;
+    }
+}
+
 - (BOOL)reserve:(long long)length
 {
-    assert(index_ == sanityCheck);
+    assert(!mapped_);
     BOOL hadToFree = NO;
     while (![self hasSpaceAvailable:length]) {
+        if ([self _grow]) {
+            continue;
+        }
         assert(nextKey_ > firstKey_);
         [self deallocateBlock];
         hadToFree = YES;
@@ -75,50 +207,45 @@
     } else {
         scratch_ = store_ + end_;
     }
-    assert(index_ == sanityCheck);
     return hadToFree;
 }
 
 - (long long)allocateBlock:(long long)length
 {
-    assert(index_ == sanityCheck);
+    assert(!mapped_);
     assert([self hasSpaceAvailable:length]);
-    DVRIndexEntry* entry = [[DVRIndexEntry alloc] init];
+    [self _growIndexIfNeeded];
+
+    long long key = nextKey_++;
+    DVRIndexEntry* entry = [self entryForKey:key];
+    memset(entry, 0, sizeof(*entry));
     entry->position = scratch_ - store_;
     end_ = entry->position + length;
     entry->frameLength = length;
+    entry->decodedLength = length;
     scratch_ = 0;
 
-    long long key = nextKey_++;
-    [index_ setObject:entry forKey:[NSNumber numberWithLongLong:key]];
-    [entry release];
-    assert(index_ == sanityCheck);
-
     return key;
 }
 
 - (void)deallocateBlock
 {
-    assert(index_ == sanityCheck);
-    long long key = firstKey_++;
-    DVRIndexEntry* entry = [self entryForKey:key];
+    DVRIndexEntry* entry = [self entryForKey:firstKey_];
+    assert(entry);
     begin_ = entry->position + entry->frameLength;
-    [index_ removeObjectForKey:[NSNumber numberWithLongLong:key]];
-    assert(index_ == sanityCheck);
+    firstKey_++;
+    entriesStart_ = (entriesStart_ + 1) % entriesCapacity_;
 }
 
 - (void*)blockForKey:(long long)key
 {
-    assert(index_ == sanityCheck);
     DVRIndexEntry* entry = [self entryForKey:key];
     assert(entry);
-    assert(index_ == sanityCheck);
     return store_ + entry->position;
 }
 
 - (BOOL)hasSpaceAvailable:(long long)length
 {
-    assert(index_ == sanityCheck);
     if (begin_ <= end_) {
         // ---begin*******end-----
         if (capacity_ - end_ > length) {
@@ -138,41 +265,129 @@
     }
 }
 
+- (BOOL)canHoldBlockOfLength:(long long)length
+{
+    while (length > capacity_ / 2) {
+        if (![self _grow]) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+- (long long)shrinkToCapacity:(long long)capacity
+{
+    assert(!mapped_);
+    if (capacity >= capacity_) {
+        return 0;
+    }
+    while (![self isEmpty] && [self usedBytes] >= capacity) {
+        [self deallocateBlock];
+    }
+    while (![self isEmpty] && [self entryForKey:firstKey_]->info.frameType != DVRFrameTypeKeyFrame) {
+        [self deallocateBlock];
+    }
+    const long long freed = capacity_ - capacity;
+    [self _moveToStoreOfCapacity:capacity];
+    if (budgeted_) {
+        [[DVRBudget sharedInstance] releaseBytes:freed];
+    }
+    return freed;
+}
+
+// Doubles the storage, if it's allowed to grow and the budget has room.
+- (BOOL)_grow
+{
+    if (mapped_ || capacity_ >= maximumCapacity_) {
+        return NO;
+    }
+    const long long newCapacity = MIN(maximumCapacity_, capacity_ * 2);
+    if (budgeted_ && ![[DVRBudget sharedInstance] reserveBytes:newCapacity - capacity_]) {
+        return NO;
+    }
+    [self _moveToStoreOfCapacity:newCapacity];
+    return YES;
+}
+
+// Copies the frames, oldest first, to the start of new storage, which must be large enough.
+- (void)_moveToStoreOfCapacity:(long long)capacity
+{
+    char *store = malloc(capacity);
+    long long offset = 0;
+    for (long long key = firstKey_; key < nextKey_; key++) {
+        DVRIndexEntry *entry = [self entryForKey:key];
+        memcpy(store + offset, store_ + entry->position, entry->frameLength);
+        entry->position = offset;
+        offset += entry->frameLength;
+    }
+    assert(offset <= capacity);
+    free(store_);
+    store_ = store;
+    capacity_ = capacity;
+    begin_ = 0;
+    end_ = offset;
+}
+
 - (long long)firstKey
 {
-    assert(index_ == sanityCheck);
     return firstKey_;
 }
 
 - (long long)lastKey
 {
-    assert(index_ == sanityCheck);
     return nextKey_ - 1;
 }
 
 - (DVRIndexEntry*)entryForKey:(long long)key
 {
-    assert(index_ == sanityCheck);
-    assert(index_);
-    return [index_ objectForKey:[NSNumber numberWithLongLong:key]];
+    if (key < firstKey_ || key >= nextKey_) {
+        return NULL;
+    }
+    return entries_ + (entriesStart_ + key - firstKey_) % entriesCapacity_;
+}
+
+- (long long)firstKeyWithTimestampAtLeast:(long long)timestamp
+{
+    long long lo = firstKey_;
+    long long hi = nextKey_;
+    while (lo < hi) {
+        long long mid = lo + (hi - lo) / 2;
+        if ([self entryForKey:mid]->info.timestamp < timestamp) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < nextKey_ ? lo : -1;
 }
 
 - (char*)scratch
 {
-    assert(index_ == sanityCheck);
     return scratch_;
 }
 
 - (long long)capacity
 {
-    assert(index_ == sanityCheck);
     return capacity_;
 }
 
+- (long long)maximumCapacity
+{
+    return maximumCapacity_;
+}
+
+- (long long)usedBytes
+{
+    if (begin_ <= end_) {
+        return end_ - begin_;
+    } else {
+        return capacity_ - begin_ + end_;
+    }
+}
+
 - (BOOL)isEmpty
 {
-    assert(index_ == sanityCheck);
-    return [index_ count] == 0;
+    return nextKey_ == firstKey_;
 }
 
 
@@ -31,6 +31,18 @@
 #import <Cocoa/Cocoa.h>
 #import "DVRBuffer.h"
 
+// Number of reconstructed frames a decoder remembers.
+#define kDVRDecoderCacheSize 8
+
+// A reconstructed frame kept so that seeking back to it is cheap.
+typedef struct {
+    long long key;  // -1 if unused
+    char* frame;
+    int length;
+    DVRFrameInfo info;
+    long long lastUse;
+} DVRDecoderCachedFrame;
+
 @interface DVRDecoder : NSObject
 {
     // Circular buffer not owned by us.
@@ -45,8 +57,16 @@
     // Length of frame.
     int length_;
 
+    // Compressed frames are inflated into this buffer.
+    char* inflated_;
+    int inflatedCapacity_;
+
     // Most recent frame's key (not timestamp).
     long long key_;
+
+    // Recently reconstructed diff frames.
+    DVRDecoderCachedFrame cache_[kDVRDecoderCacheSize];
+    long long useCount_;
 }
 
 - (id)initWithBuffer:(DVRBuffer*)buffer;
@@ -68,16 +88,28 @@
 // Advance to previous frame.
 - (BOOL)prev;
 
-// Called when frame index key i is freed.
+// Called when frame index key i is freed. The caller must be synchronized on the buffer.
 - (void)invalidateIndex:(long long)i;
 
 @end
 
 @interface DVRDecoder (Private)
 
-// Seek directly to a particular key.
+// -next without synchronizing on the buffer.
+- (BOOL)_next;
+
+// Seek directly to a particular key. The caller must be synchronized on the buffer.
 - (void)_seekToEntryWithKey:(long long)key;
 
+// Returns the cached frame with the largest key in [minKey, maxKey], or NULL.
+- (DVRDecoderCachedFrame *)_cachedFrameBetween:(long long)minKey and:(long long)maxKey;
+
+// Saves the current frame in the cache, replacing the least recently used one.
+- (void)_cacheCurrentFrame;
+
+// Returns the decompressed contents of a frame. Valid until the next call.
+- (char *)_dataForEntry:(DVRIndexEntry *)entry key:(long long)key;
+
 // Load a key or diff frame from a particular key.
 - (void)_loadKeyFrameWithKey:(long long)key;
 - (void)_loadDiffFrameWithKey:(long long)key;
@@ -30,6 +30,7 @@
 #import "DVRDecoder.h"
 #import "DVRIndexEntry.h"
 #import "LineBuffer.h"
+#include <zlib.h>
 
 @implementation DVRDecoder
 
@@ -41,6 +42,9 @@
         frame_ = 0;
         length_ = 0;
         key_ = -1;
+        for (int i = 0; i < kDVRDecoderCacheSize; i++) {
+            cache_[i].key = -1;
+        }
     }
     return self;
 }
@@ -50,21 +54,23 @@
     if (frame_) {
         free(frame_);
     }
+    free(inflated_);
+    for (int i = 0; i < kDVRDecoderCacheSize; i++) {
+        free(cache_[i].frame);
+    }
     [super dealloc];
 }
 
 - (BOOL)seek:(long long)timestamp
 {
-    // TODO(georgen): Do a binary search
-    long long lastKey = [buffer_ lastKey];
-    for (long long key = [buffer_ firstKey]; key <= lastKey; ++key) {
-        DVRIndexEntry* entry = [buffer_ entryForKey:key];
-        if (entry->info.timestamp >= timestamp) {
-            [self _seekToEntryWithKey:key];
-            return YES;
+    @synchronized(buffer_) {
+        long long key = [buffer_ firstKeyWithTimestampAtLeast:timestamp];
+        if (key < 0) {
+            return NO;
         }
+        [self _seekToEntryWithKey:key];
+        return YES;
     }
-    return NO;
 }
 
 - (char*)decodedFrame
@@ -78,6 +84,13 @@
 }
 
 - (BOOL)next
+{
+    @synchronized(buffer_) {
+        return [self _next];
+    }
+}
+
+- (BOOL)_next
 {
     long long newKey;
     if (key_ == -1) {
@@ -96,11 +109,13 @@
 
 - (BOOL)prev
 {
-    if (key_ <= [buffer_ firstKey]) {
-        return NO;
+    @synchronized(buffer_) {
+        if (key_ <= [buffer_ firstKey]) {
+            return NO;
+        }
+        [self _seekToEntryWithKey:key_ - 1];
+        return YES;
     }
-    [self _seekToEntryWithKey:key_ - 1];
-    return YES;
 }
 
 - (long long)timestamp
@@ -113,6 +128,11 @@
     if (i == key_) {
         key_ = - 1;
     }
+    for (int j = 0; j < kDVRDecoderCacheSize; j++) {
+        if (cache_[j].key == i) {
+            cache_[j].key = -1;
+        }
+    }
 }
 
 - (DVRFrameInfo)info
@@ -177,11 +197,29 @@
         --j;
     }
 
-    [self _loadKeyFrameWithKey:j];
+    // Start from whichever reconstructed frame is closest to key without passing it: the current
+    // frame, a cached frame, or the key frame.
+    DVRDecoderCachedFrame *cached = [self _cachedFrameBetween:j and:key];
+    if (key_ >= j && key_ <= key && (!cached || cached->key <= key_)) {
+        j = key_;
+    } else if (cached) {
+        if (length_ != cached->length) {
+            free(frame_);
+            frame_ = malloc(cached->length);
+            length_ = cached->length;
+        }
+        memcpy(frame_, cached->frame, length_);
+        info_ = cached->info;
+        cached->lastUse = ++useCount_;
+        j = cached->key;
+    } else {
+        [self _loadKeyFrameWithKey:j];
+    }
 
 #ifdef DVRDEBUG
-    [self debug:@"Key frame:" buffer:frame_ length:length_];
+    [self debug:@"Starting frame:" buffer:frame_ length:length_];
 #endif
+    const long long start = j;
 
     // Apply all the diff frames up to key.
     while (j != key) {
@@ -192,25 +230,92 @@
 #endif
     }
     key_ = j;
+    if (j - start > 1) {
+        [self _cacheCurrentFrame];
+    }
 #ifdef DVRDEBUG
-    NSLog(@"end seek to %d", i);
+    NSLog(@"end seek to %lld", key_);
 #endif
 }
 
+- (DVRDecoderCachedFrame *)_cachedFrameBetween:(long long)minKey and:(long long)maxKey
+{
+    DVRDecoderCachedFrame *best = NULL;
+    for (int i = 0; i < kDVRDecoderCacheSize; i++) {
+        DVRDecoderCachedFrame *candidate = &cache_[i];
+        if (candidate->key >= minKey && candidate->key <= maxKey && (!best || candidate->key > best->key)) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+- (void)_cacheCurrentFrame
+{
+    DVRDecoderCachedFrame *victim = &cache_[0];
+    for (int i = 0; i < kDVRDecoderCacheSize; i++) {
+        if (cache_[i].key == key_) {
+            cache_[i].lastUse = ++useCount_;
+            return;
+        }
+        if (cache_[i].key == -1) {
+            victim = &cache_[i];
+            break;
+        }
+        if (cache_[i].lastUse < victim->lastUse) {
+            victim = &cache_[i];
+        }
+    }
+    if (victim->length != length_) {
+        free(victim->frame);
+        victim->frame = malloc(length_);
+        victim->length = length_;
+    }
+    memcpy(victim->frame, frame_, length_);
+    victim->key = key_;
+    victim->info = info_;
+    victim->lastUse = ++useCount_;
+}
+
+- (char *)_dataForEntry:(DVRIndexEntry *)entry key:(long long)key
+{
+    char* data = [buffer_ blockForKey:key];
+    if (!entry->compressed) {
+        return data;
+    }
+    if (inflatedCapacity_ < entry->decodedLength) {
+        inflatedCapacity_ = entry->decodedLength;
+        inflated_ = realloc(inflated_, inflatedCapacity_);
+    }
+    uLongf size = entry->decodedLength;
+    int rc = uncompress((Bytef *)inflated_, &size, (const Bytef *)data, entry->frameLength);
+    assert(rc == Z_OK && size == entry->decodedLength);
+    return inflated_;
+}
+
 - (void)_loadKeyFrameWithKey:(long long)key
 {
     DVRIndexEntry* entry = [buffer_ entryForKey:key];
-    if (length_ != entry->frameLength && frame_) {
+    if (length_ != entry->decodedLength && frame_) {
         free(frame_);
         frame_ = 0;
     }
-    length_ = entry->frameLength;
+    length_ = entry->decodedLength;
     if (!frame_) {
         frame_ = malloc(length_);
     }
-    char* data = [buffer_ blockForKey:key];
+    char* data = [self _dataForEntry:entry key:key];
     info_ = entry->info;
-    memcpy(frame_,  data, length_);
+
+    // Undo the encoder's grouping of screen_char_t bytes.
+    const int numCells = length_ / sizeof(screen_char_t);
+    for (int b = 0; b < sizeof(screen_char_t); b++) {
+        const char *source = data + b * numCells;
+        char *dest = frame_ + b;
+        for (int i = 0; i < numCells; i++) {
+            dest[i * sizeof(screen_char_t)] = source[i];
+        }
+    }
 }
 
 - (void)_loadDiffFrameWithKey:(long long)key
@@ -220,9 +325,9 @@
 #endif
     DVRIndexEntry* entry = [buffer_ entryForKey:key];
     info_ = entry->info;
-    char* diff = [buffer_ blockForKey:key];
+    char* diff = [self _dataForEntry:entry key:key];
     int o = 0;
-    for (int i = 0; i < entry->frameLength; ) {
+    for (int i = 0; i < entry->decodedLength; ) {
         int n;
         switch (diff[i++]) {
             case kSameSequence:
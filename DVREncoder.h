@@ -30,28 +30,44 @@
 #import <Cocoa/Cocoa.h>
 #import "DVRBuffer.h"
 
+@class DVRFileWriter;
+
 @interface DVREncoder : NSObject
 {
     // Underlying buffer to write to. Not owned by us.
     DVRBuffer* buffer_;
 
-    // The last encoded frame.
+    // The last encoded frame. Diff frames update it in place.
     NSMutableData* lastFrame_;
 
     // Info from the last frame.
     DVRFrameInfo lastInfo_;
 
-    // Number of frames. Used to ensure key frames are encoded every so often.
-    int count_;
-
     // Used to ensure that reserve is called before appendFrame.
     BOOL haveReservation_;
 
     // Used to ensure a key frame is encoded before the circular buffer wraps.
     long long bytesSinceLastKeyFrame_;
 
+    // Estimated work for a decoder to apply every diff since the last key frame, in bytes. A new
+    // key frame is encoded when this exceeds the cost of loading a key frame.
+    long long decodeCostSinceLastKeyFrame_;
+
     // Number of bytes reserved.
     int reservation_;
+
+    // Frames are built here and then compressed into the DVRBuffer's scratch space.
+    char* staging_;
+    int stagingCapacity_;
+
+    // Statistics over all frames encoded.
+    long long framesEncoded_;
+    long long bytesBeforeCompression_;
+    long long bytesAfterCompression_;
+    long long encodingTime_;  // in microseconds
+
+    // If set, every frame is also written here.
+    DVRFileWriter* fileWriter_;
 }
 
 - (id)initWithBuffer:(DVRBuffer*)buffer;
@@ -63,11 +79,30 @@
 //   info: screen state.
 - (void)appendFrame:(NSArray *)frameLines length:(int)length info:(DVRFrameInfo*)info;
 
+// Encodes a frame in which only the screen_char_ts in dirtyRanges[i] of line i may have changed
+// since the last frame. If dirtyRanges is NULL all of every line is compared.
+- (void)appendFrame:(NSArray *)frameLines
+             length:(int)length
+        dirtyRanges:(NSRange *)dirtyRanges
+               info:(DVRFrameInfo*)info;
+
+// Also write frames to a file. Pass nil to stop.
+- (void)setFileWriter:(DVRFileWriter *)fileWriter;
+
+// Encoded bytes before compression divided by bytes stored.
+- (double)compressionRatio;
+
+// Average time to encode a frame, in microseconds.
+- (double)averageEncodingTime;
+
 // Allocate some number of bytes for an upcoming appendFrame call.
 // Returns true if some frames were freed to make room. The caller should
 // invalidate nonexistent leading frames in all decoders.
 - (BOOL)reserve:(int)length;
 
+// Makes the next frame a key frame, for when the buffer's frames were dropped behind its back.
+- (void)forgetLastFrame;
+
 @end
 
 @interface DVREncoder (Private)
@@ -75,15 +110,22 @@
 - (void)_appendKeyFrame:(NSArray *)frameLines length:(int)length info:(DVRFrameInfo*)info;
 
 // Save a diff frame into DVRBuffer.
-- (void)_appendDiffFrame:(NSArray *)frameLine length:(int)length info:(DVRFrameInfo*)info;
+- (void)_appendDiffFrame:(NSArray *)frameLine
+                  length:(int)length
+             dirtyRanges:(NSRange *)dirtyRanges
+                    info:(DVRFrameInfo*)info;
 
-// Save a frame into DVRBuffer.
+// Compress a frame from the staging buffer and save it into DVRBuffer.
 - (void)_appendFrameImpl:(char *)buffer length:(int)length type:(DVRFrameType)type info:(DVRFrameInfo*)info;
 
-// Calculate the diff between buffer,length and the previous frame. Saves results into
-// scratch. Won't use more than maxSize bytes in scratch. Returns number of bytes used or
-// -1 if the diff was larger than maxSize.
-- (int)_computeDiff:(NSArray *)frameLines length:(int)length dest:(char*)scratch maxSize:(int)maxSize;
+// Calculate the diff between buffer,length and the previous frame, looking only at dirtyRanges
+// (if not NULL). Saves results into scratch. Won't use more than maxSize bytes in scratch.
+// Returns number of bytes used or -1 if the diff was larger than maxSize.
+- (int)_computeDiff:(NSArray *)frameLines
+             length:(int)length
+        dirtyRanges:(NSRange *)dirtyRanges
+               dest:(char*)scratch
+            maxSize:(int)maxSize;
 
 @end
 
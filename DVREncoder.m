@@ -27,8 +27,12 @@
  */
 
 #import "DVREncoder.h"
+#import "DVRFileWriter.h"
 #import "DVRIndexEntry.h"
+#import "ScreenChar.h"
+#import "Signposts.h"
 #include <sys/time.h>
+#include <zlib.h>
 #include "LineBuffer.h"
 //#define DVRDEBUG
 
@@ -51,7 +55,6 @@ static long long now()
     if (self) {
         buffer_ = [buffer retain];
         lastFrame_ = nil;
-        count_ = 0;
         haveReservation_ = NO;
     }
     return self;
@@ -61,6 +64,8 @@ static long long now()
 {
     [lastFrame_ release];
     [buffer_ release];
+    [fileWriter_ release];
+    free(staging_);
     [super dealloc];
 }
 
@@ -79,24 +84,69 @@ static long long now()
 
 - (void)appendFrame:(NSArray *)frameLines length:(int)length info:(DVRFrameInfo*)info
 {
+    [self appendFrame:frameLines length:length dirtyRanges:NULL info:info];
+}
+
+- (void)appendFrame:(NSArray *)frameLines
+             length:(int)length
+        dirtyRanges:(NSRange *)dirtyRanges
+               info:(DVRFrameInfo*)info
+{
+    long long start = now();
+    SignpostBegin("DVR encode", nil, length);
+    if (stagingCapacity_ < reservation_) {
+        stagingCapacity_ = reservation_;
+        staging_ = realloc(staging_, stagingCapacity_);
+    }
+
     BOOL eligibleForDiff;
     if (lastFrame_ &&
         length == [lastFrame_ length] &&
         info->width == lastInfo_.width &&
         info->height == lastInfo_.height &&
-        bytesSinceLastKeyFrame_ < [buffer_ capacity] / 2) {
+        bytesSinceLastKeyFrame_ < [buffer_ capacity] / 2 &&
+        decodeCostSinceLastKeyFrame_ < length) {
         eligibleForDiff = YES;
     } else {
         eligibleForDiff = NO;
     }
 
-    const int kKeyFrameFrequency = 100;
-
-    if (!eligibleForDiff || count_++ % kKeyFrameFrequency == 0) {
+    if (!eligibleForDiff) {
         [self _appendKeyFrame:frameLines length:length info:info];
     } else {
-        [self _appendDiffFrame:frameLines length:length info:info];
+        [self _appendDiffFrame:frameLines length:length dirtyRanges:dirtyRanges info:info];
+    }
+    ++framesEncoded_;
+    encodingTime_ += now() - start;
+    SignpostEnd("DVR encode", nil, length);
+}
+
+- (void)forgetLastFrame
+{
+    [lastFrame_ release];
+    lastFrame_ = nil;
+}
+
+- (void)setFileWriter:(DVRFileWriter *)fileWriter
+{
+    [fileWriter_ autorelease];
+    fileWriter_ = [fileWriter retain];
+}
+
+- (double)compressionRatio
+{
+    if (!bytesAfterCompression_) {
+        return 1;
+    }
+    return (double)bytesBeforeCompression_ / (double)bytesAfterCompression_;
+}
+
+- (double)averageEncodingTime
+{
+    if (!framesEncoded_) {
+        return 0;
     }
+    return (double)encodingTime_ / (double)framesEncoded_;
 }
 
 - (BOOL)reserve:(int)length
@@ -141,31 +191,48 @@ static long long now()
 #endif
 }
 
-- (NSMutableData *)combinedFrameLines:(NSArray *)frameLines {
-    NSMutableData *data = [[[NSMutableData alloc] init] autorelease];
+- (void)_appendKeyFrame:(NSArray *)frameLines length:(int)length info:(DVRFrameInfo*)info
+{
+    // Copy the lines into lastFrame_, reusing its storage.
+    if (!lastFrame_) {
+        lastFrame_ = [[NSMutableData alloc] initWithLength:length];
+    } else {
+        [lastFrame_ setLength:length];
+    }
+    char* last = [lastFrame_ mutableBytes];
+    int o = 0;
     for (NSData *line in frameLines) {
-        [data appendData:line];
+        memcpy(last + o, [line bytes], [line length]);
+        o += [line length];
     }
-    return data;
-}
+    assert(o == length);
 
-- (void)_appendKeyFrame:(NSArray *)frameLines length:(int)length info:(DVRFrameInfo*)info
-{
-    [lastFrame_ release];
-    lastFrame_ = [[self combinedFrameLines:frameLines] retain];
-    assert(lastFrame_.length == length);
-    char* scratch = [buffer_ scratch];
-    memcpy(scratch, [lastFrame_ mutableBytes], length);
-    [self _appendFrameImpl:scratch length:length type:DVRFrameTypeKeyFrame info:info];
+    // Key frames are stored with byte k of every screen_char_t grouped together (all the low bytes
+    // of code, then the next byte of code, ..., then all the flag bytes). Neighboring cells mostly
+    // share colors and attributes so this gives zlib long runs to work with.
+    const int numCells = length / sizeof(screen_char_t);
+    assert(numCells * sizeof(screen_char_t) == length);
+    for (int b = 0; b < sizeof(screen_char_t); b++) {
+        char *dest = staging_ + b * numCells;
+        const char *source = last + b;
+        for (int i = 0; i < numCells; i++) {
+            dest[i] = source[i * sizeof(screen_char_t)];
+        }
+    }
+    [self _appendFrameImpl:staging_ length:length type:DVRFrameTypeKeyFrame info:info];
     bytesSinceLastKeyFrame_ = 0;
+    decodeCostSinceLastKeyFrame_ = 0;
 }
 
-- (void)_appendDiffFrame:(NSArray *)frameLines length:(int)length info:(DVRFrameInfo*)info
+- (void)_appendDiffFrame:(NSArray *)frameLines
+                  length:(int)length
+             dirtyRanges:(NSRange *)dirtyRanges
+                    info:(DVRFrameInfo*)info
 {
-    char* scratch = [buffer_ scratch];
     int diffBytes = [self _computeDiff:frameLines
                                 length:length
-                                  dest:scratch
+                           dirtyRanges:dirtyRanges
+                                  dest:staging_
                                maxSize:reservation_];
     if (diffBytes < 0) {
         // Diff ended up being larger than a key frame would be.
@@ -175,34 +242,99 @@ static long long now()
 
 #ifdef DVRDEBUG2
     int i;
-    screen_char_t* s = scratch;
     for (i = 0; i < diffBytes; ++i) {
-        NSLog(@"Offset %d: %d (%c)", i, (int)scratch[i], scratch[i]);
+        NSLog(@"Offset %d: %d (%c)", i, (int)staging_[i], staging_[i]);
     }
 #endif
-    [self _appendFrameImpl:scratch length:diffBytes type:DVRFrameTypeDiffFrame info:info];
+    [self _appendFrameImpl:staging_ length:diffBytes type:DVRFrameTypeDiffFrame info:info];
+    // Applying a diff costs about as much as its decoded size, plus a fixed overhead for fetching and
+    // inflating the block. Once the sum passes the frame size it's cheaper to seek from a new key
+    // frame, so seeking anywhere costs at most about two key frames' worth of work.
+    const int kPerFrameDecodeCost = 256;
     bytesSinceLastKeyFrame_ += diffBytes;
+    decodeCostSinceLastKeyFrame_ += diffBytes + kPerFrameDecodeCost;
 }
 
-- (void)_appendFrameImpl:(char*)dest length:(int)length type:(DVRFrameType)type info:(DVRFrameInfo*)info
+- (void)_appendFrameImpl:(char*)source length:(int)length type:(DVRFrameType)type info:(DVRFrameInfo*)info
 {
     assert(haveReservation_);
     haveReservation_ = NO;
 
+    // Deflate into the reserved space. If it doesn't fit or doesn't help, store it as-is.
+    char* scratch = [buffer_ scratch];
+    uLongf storedLength = reservation_;
+    int rc = compress2((Bytef *)scratch, &storedLength, (const Bytef *)source, length, Z_BEST_SPEED);
+    BOOL compressed = (rc == Z_OK && storedLength < (uLongf)length);
+    if (!compressed) {
+        memcpy(scratch, source, length);
+        storedLength = length;
+    }
+    bytesBeforeCompression_ += length;
+    bytesAfterCompression_ += storedLength;
+
 #ifdef DVRDEBUG
-    NSLog(@"Append frame of type %d starting at %x length %d at index %d", (int)type, dest, length, [buffer_ lastKey]+1);
+    NSLog(@"Append frame of type %d starting at %x length %d (%d stored) at index %d",
+          (int)type, scratch, length, (int)storedLength, [buffer_ lastKey]+1);
 #endif
 
     lastInfo_ = *info;
 
-    long long key = [buffer_ allocateBlock:length];
+    long long key = [buffer_ allocateBlock:storedLength];
     DVRIndexEntry* entry = [buffer_ entryForKey:key];
+    entry->decodedLength = length;
+    entry->compressed = compressed;
+    DVRIndexEntry* previousEntry = [buffer_ entryForKey:key - 1];
     entry->info = *info;
-    entry->info.timestamp = now();
+    // The buffer binary searches on timestamps so don't let them go backwards if the clock does.
+    long long timestamp = info->timestamp ? info->timestamp : now();
+    entry->info.timestamp = previousEntry ? MAX(timestamp, previousEntry->info.timestamp) : timestamp;
     entry->info.frameType = type;
+    [fileWriter_ appendFrame:scratch entry:entry];
+}
+
+// Writes a kSameSequence record for |*sameCount| bytes, if there are any. Returns NO if it didn't fit.
+static BOOL DVREncoderFlushSame(char *scratch, int *o, int maxBytes, int *sameCount)
+{
+    if (*sameCount == 0) {
+        return YES;
+    }
+    if (*o + 1 + sizeof(*sameCount) > maxBytes) {
+        return NO;
+    }
+    scratch[(*o)++] = kSameSequence;
+    memcpy(scratch + *o, sameCount, sizeof(*sameCount));
+    *o += sizeof(*sameCount);
+#ifdef DVRDEBUG
+    NSLog(@"%d the same", *sameCount);
+#endif
+    *sameCount = 0;
+    return YES;
+}
+
+// Writes a kDiffSequence record with the |*diffCount| bytes at startDiff, if there are any.
+// Returns NO if it didn't fit.
+static BOOL DVREncoderFlushDiff(char *scratch, int *o, int maxBytes, int *diffCount, char *startDiff)
+{
+    if (*diffCount == 0) {
+        return YES;
+    }
+    if (*o + 1 + sizeof(*diffCount) + *diffCount > maxBytes) {
+        return NO;
+    }
+    scratch[(*o)++] = kDiffSequence;
+    memcpy(scratch + *o, diffCount, sizeof(*diffCount));
+    *o += sizeof(*diffCount);
+    memcpy(scratch + *o, startDiff, *diffCount);
+    *o += *diffCount;
+    *diffCount = 0;
+    return YES;
 }
 
-- (int)_computeDiff:(NSArray *)frameLines length:(int)length dest:(char*)scratch maxSize:(int)maxBytes
+- (int)_computeDiff:(NSArray *)frameLines
+             length:(int)length
+        dirtyRanges:(NSRange *)dirtyRanges
+               dest:(char*)scratch
+            maxSize:(int)maxBytes
 {
     assert(length == [lastFrame_ length]);
     char* other = [lastFrame_ mutableBytes];
@@ -215,75 +347,52 @@ static long long now()
 
     // TODO(georgen): Implement a better diff
     int numLines = [frameLines count];
-    int i = 0;
+    int i = 0;  // Offset of the start of line y in other.
     for (int y = 0; y < numLines; y++) {
         NSMutableData *lineData = [frameLines objectAtIndex:y];
         char *frameLine = [lineData mutableBytes];
-        const int numChars = lineData.length;
-        for (int x = 0; x < numChars; x++, i++) {
+        const int numBytes = lineData.length;
+
+        // Only bytes in [begin, end) can differ from the last frame.
+        int begin = 0;
+        int end = numBytes;
+        if (dirtyRanges) {
+            begin = MIN(numBytes, dirtyRanges[y].location * sizeof(screen_char_t));
+            end = MIN(numBytes, NSMaxRange(dirtyRanges[y]) * sizeof(screen_char_t));
+            end = MAX(begin, end);
+        }
+        sameCount += begin;
+        for (int x = begin; x < end; x++) {
             // TODO: This should be a screen_char_t-wise comparison, not bytewise
-            if (frameLine[x] == other[i]) {
-                if (diffCount > 0) {
-                    if (o + 1 + sizeof(diffCount) + diffCount > maxBytes) {
-                        // Diff is too big.
-                        return -1;
-                    }
-                    scratch[o++] = kDiffSequence;
-                    memcpy(scratch + o, &diffCount, sizeof(diffCount));
-                    o += sizeof(diffCount);
-                    memcpy(scratch + o, startDiff, diffCount);
-                    o += diffCount;
-                    [self debug:@"diff " buffer:startDiff length:diffCount];
-                    diffCount = 0;
+            if (frameLine[x] == other[i + x]) {
+                if (!DVREncoderFlushDiff(scratch, &o, maxBytes, &diffCount, startDiff)) {
+                    // Diff is too big.
+                    return -1;
                 }
                 ++sameCount;
             } else {
-                if (sameCount > 0) {
-                    if (o + 1 + sizeof(sameCount) > maxBytes) {
-                        // Diff is too big.
-                        return -1;
-                    }
-                    scratch[o++] = kSameSequence;
-                    memcpy(scratch + o, &sameCount, sizeof(sameCount));
-                    o += sizeof(sameCount);
-    #ifdef DVRDEBUG
-                    NSLog(@"%d the same", sameCount);
-    #endif
-                    sameCount = 0;
+                if (!DVREncoderFlushSame(scratch, &o, maxBytes, &sameCount)) {
+                    return -1;
                 }
                 if (!diffCount) {
                     startDiff = frameLine + x;
                 }
-                other[i] = frameLine[x];
+                other[i + x] = frameLine[x];
                 ++diffCount;
             }
         }
+        // A diff sequence points into this line's data so it can't continue onto the next line.
         if (diffCount > 0) {
-            if (o + 1 + sizeof(diffCount) + diffCount > maxBytes) {
-                // Diff is too big.
-                return -1;
-            }
-            scratch[o++] = kDiffSequence;
-            memcpy(scratch + o, &diffCount, sizeof(diffCount));
-            o += sizeof(diffCount);
-            memcpy(scratch + o, startDiff, diffCount);
-            o += diffCount;
             [self debug:@"diff " buffer:startDiff length:diffCount];
-            diffCount = 0;
         }
-        if (sameCount > 0) {
-            if (o + 1 + sizeof(sameCount) > maxBytes) {
-                // Diff is too big.
-                return -1;
-            }
-            scratch[o++] = kSameSequence;
-            memcpy(scratch + o, &sameCount, sizeof(sameCount));
-            o += sizeof(sameCount);
-#ifdef DVRDEBUG
-            NSLog(@"%d the same", sameCount);
-#endif
-            sameCount = 0;
+        if (!DVREncoderFlushDiff(scratch, &o, maxBytes, &diffCount, startDiff)) {
+            return -1;
         }
+        sameCount += numBytes - end;
+        i += numBytes;
+    }
+    if (!DVREncoderFlushSame(scratch, &o, maxBytes, &sameCount)) {
+        return -1;
     }
     return o;
 }
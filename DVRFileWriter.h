@@ -0,0 +1,74 @@
+#import <Foundation/Foundation.h>
+#import "DVRIndexEntry.h"
+
+// On-disk instant replay stream. A file holds the same key and diff frames as a DVRBuffer, in order:
+//
+//   DVRFileHeader
+//   For each frame: DVRFileFrameHeader, then frameLength bytes of the block as stored in DVRBuffer
+//   One DVRFileIndexEntry per frame
+//   DVRFileTrailer
+//
+// The index and trailer are written when the file is closed. If they're missing (the app crashed)
+// readers recover the index by walking the frame headers. Every file begins with a key frame.
+
+#define kDVRFileMagic "iTermDVR"
+#define kDVRFileVersion 1
+
+typedef struct {
+    char magic[8];
+    int version;
+    int reserved;
+} DVRFileHeader;
+
+typedef struct {
+    DVRFrameInfo info;
+    int frameLength;
+    int decodedLength;
+    int compressed;
+    int reserved;
+} DVRFileFrameHeader;
+
+typedef struct {
+    long long offset;  // Offset of the frame's DVRFileFrameHeader.
+} DVRFileIndexEntry;
+
+typedef struct {
+    long long indexOffset;
+    long long numFrames;
+    char magic[8];
+} DVRFileTrailer;
+
+// Appends frames to a DVR file from a background queue. At most maxPendingBytes of frames wait to
+// be written; if the disk falls behind, frames are dropped until the next key frame so the file
+// stays decodable. When the file grows past maxFileBytes it's closed and renamed to path + ".1"
+// (replacing any older one) and a new file is started at the next key frame, so the two files
+// together hold the most recent history.
+@interface DVRFileWriter : NSObject {
+    dispatch_queue_t queue_;
+    NSString *path_;
+    long long maxFileBytes_;
+    int32_t maxPendingBytes_;
+    volatile int32_t pendingBytes_;
+
+    // Only accessed by the thread appending frames.
+    BOOL droppingUntilKeyFrame_;
+
+    // Only accessed on queue_.
+    int fd_;
+    long long length_;
+    NSMutableData *offsets_;  // long longs: offset of each frame's header
+    BOOL rotatePending_;
+}
+
+// Returns nil if the file can't be created.
+- (id)initWithPath:(NSString *)path
+      maxFileBytes:(long long)maxFileBytes
+   maxPendingBytes:(int)maxPendingBytes;
+
+// Queues a frame for writing. bytes holds entry->frameLength bytes as stored in the DVRBuffer.
+- (void)appendFrame:(const char *)bytes entry:(DVRIndexEntry *)entry;
+
+// Waits for queued frames to be written, then writes the index and closes the file.
+- (void)close;
+
+@end
@@ -0,0 +1,151 @@
+#import "DVRFileWriter.h"
+#import "DVRBuffer.h"
+#import "DebugLogging.h"
+#include <fcntl.h>
+#include <libkern/OSAtomic.h>
+#include <unistd.h>
+
+@implementation DVRFileWriter
+
+- (id)initWithPath:(NSString *)path
+      maxFileBytes:(long long)maxFileBytes
+   maxPendingBytes:(int)maxPendingBytes
+{
+    self = [super init];
+    if (self) {
+        path_ = [path copy];
+        maxFileBytes_ = maxFileBytes;
+        maxPendingBytes_ = maxPendingBytes;
+        offsets_ = [[NSMutableData alloc] init];
+        if (![self _openFile]) {
+            [self release];
+            return nil;
+        }
+        queue_ = dispatch_queue_create("com.googlecode.iterm2.dvr-writer", DISPATCH_QUEUE_SERIAL);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (fd_ >= 0) {
+        [self _finishFile];
+    }
+    if (queue_) {
+        dispatch_release(queue_);
+    }
+    [path_ release];
+    [offsets_ release];
+    [super dealloc];
+}
+
+- (void)appendFrame:(const char *)bytes entry:(DVRIndexEntry *)entry
+{
+    BOOL isKeyFrame = (entry->info.frameType == DVRFrameTypeKeyFrame);
+    if (droppingUntilKeyFrame_ && !isKeyFrame) {
+        return;
+    }
+    int32_t size = sizeof(DVRFileFrameHeader) + entry->frameLength;
+    if (pendingBytes_ + size > maxPendingBytes_) {
+        // The writer is behind. Diffs after a dropped frame would be garbage, so wait for a key frame.
+        DLog(@"DVR writer dropping frames for %@", path_);
+        droppingUntilKeyFrame_ = YES;
+        return;
+    }
+    droppingUntilKeyFrame_ = NO;
+
+    NSMutableData *data = [NSMutableData dataWithLength:size];
+    DVRFileFrameHeader *header = [data mutableBytes];
+    header->info = entry->info;
+    header->frameLength = entry->frameLength;
+    header->decodedLength = entry->decodedLength;
+    header->compressed = entry->compressed;
+    memcpy(header + 1, bytes, entry->frameLength);
+
+    OSAtomicAdd32(size, &pendingBytes_);
+    [self retain];
+    dispatch_async(queue_, ^{
+        [self _writeFrame:data isKeyFrame:isKeyFrame];
+        OSAtomicAdd32(-size, &pendingBytes_);
+        [self release];
+    });
+}
+
+- (void)close
+{
+    dispatch_sync(queue_, ^{
+        if (fd_ >= 0) {
+            [self _finishFile];
+        }
+    });
+}
+
+#pragma mark - Private
+
+- (BOOL)_openFile
+{
+    fd_ = open([path_ fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd_ < 0) {
+        return NO;
+    }
+    DVRFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kDVRFileMagic, sizeof(header.magic));
+    header.version = kDVRFileVersion;
+    if (write(fd_, &header, sizeof(header)) != sizeof(header)) {
+        close(fd_);
+        fd_ = -1;
+        return NO;
+    }
+    length_ = sizeof(header);
+    [offsets_ setLength:0];
+    return YES;
+}
+
+// Writes the index and trailer and closes the file.
+- (void)_finishFile
+{
+    DVRFileTrailer trailer;
+    trailer.indexOffset = length_;
+    trailer.numFrames = [offsets_ length] / sizeof(DVRFileIndexEntry);
+    memcpy(trailer.magic, kDVRFileMagic, sizeof(trailer.magic));
+    write(fd_, [offsets_ bytes], [offsets_ length]);
+    write(fd_, &trailer, sizeof(trailer));
+    close(fd_);
+    fd_ = -1;
+}
+
+// Runs on queue_.
+- (void)_writeFrame:(NSData *)data isKeyFrame:(BOOL)isKeyFrame
+{
+    if (rotatePending_ && isKeyFrame) {
+        rotatePending_ = NO;
+        [self _finishFile];
+        NSString *previous = [path_ stringByAppendingString:@".1"];
+        rename([path_ fileSystemRepresentation], [previous fileSystemRepresentation]);
+        [self _openFile];
+    }
+    if (fd_ < 0) {
+        return;
+    }
+    if (length_ == sizeof(DVRFileHeader) && !isKeyFrame) {
+        // A file must begin with a key frame.
+        return;
+    }
+    if (write(fd_, [data bytes], [data length]) != [data length]) {
+        DLog(@"Write to %@ failed: %s", path_, strerror(errno));
+        // Drop the partial frame so the index goes where the trailer says it is.
+        ftruncate(fd_, length_);
+        lseek(fd_, length_, SEEK_SET);
+        [self _finishFile];
+        return;
+    }
+    DVRFileIndexEntry indexEntry = { .offset = length_ };
+    [offsets_ appendBytes:&indexEntry length:sizeof(indexEntry)];
+    length_ += [data length];
+    if (length_ >= maxFileBytes_) {
+        rotatePending_ = YES;
+    }
+}
+
+@end
@@ -43,9 +43,9 @@ typedef struct {
     int frameType;
 } DVRFrameInfo;
 
-@interface DVRIndexEntry : NSObject
-{
-@public
+// An element of DVRBuffer's index. Entries are held by value in a ring array, so a pointer to one is
+// only valid until the next block is allocated or freed.
+typedef struct {
     // Frame metadata.
     DVRFrameInfo info;
 
@@ -54,5 +54,10 @@ typedef struct {
 
     // Number of bytes in buffer.
     int frameLength;
-}
-@end
+
+    // Number of bytes after inflating. Equals frameLength if the block isn't compressed.
+    int decodedLength;
+
+    // Is the block deflated with zlib?
+    BOOL compressed;
+} DVRIndexEntry;
@@ -7,6 +7,7 @@
 //
 
 #import "DebugLogging.h"
+#import "BinaryLog.h"
 #import "NSView+RecursiveDescription.h"
 #import <Cocoa/Cocoa.h>
 
@@ -103,12 +104,20 @@ void ToggleDebugLogging() {
         gDebugLogStr = [[NSMutableString alloc] init];
         gDebugLogStr2 = [[NSMutableString alloc] init];
         gDebugLogging = !gDebugLogging;
+        BinaryLogSetCategories(kBinaryLogAllCategories);
     } else {
         gDebugLogging = !gDebugLogging;
         SwapDebugLog();
         FlushDebugLog();
         SwapDebugLog();
         FlushDebugLog();
+
+        // Includes whatever the categories in the BinaryLogCategories default recorded before
+        // debug logging was turned on.
+        const char *binaryLogHeader = "------ BEGIN BINARY LOG ------\n";
+        write(gDebugLogFile, binaryLogHeader, strlen(binaryLogHeader));
+        BinaryLogWriteToFile(gDebugLogFile);
+        BinaryLogSetCategories(BinaryLogDefaultCategories());
         WriteDebugLogFooter();
 
         close(gDebugLogFile);
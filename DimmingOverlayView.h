@@ -0,0 +1,22 @@
+//
+//  DimmingOverlayView.h
+//  iTerm
+//
+
+#import <Cocoa/Cocoa.h>
+
+// A translucent gray layer over a session's scrollview that dims it. Compositing it over the
+// text looks the same as blending each color halfway to gray, which is what the text view does
+// when only text is dimmed, but changing its opacity doesn't redraw anything. It ignores the
+// mouse.
+@interface DimmingOverlayView : NSView {
+    double dimmingAmount_;
+}
+
+// 0 for no dimming up to 1 for solid gray.
+@property(nonatomic, readonly) double dimmingAmount;
+
+// Core Animation fades to the new amount when |animated| is set.
+- (void)setDimmingAmount:(double)dimmingAmount animated:(BOOL)animated;
+
+@end
@@ -0,0 +1,71 @@
+//
+//  DimmingOverlayView.m
+//  iTerm
+//
+
+#import "DimmingOverlayView.h"
+#import <QuartzCore/QuartzCore.h>
+
+// The gray the text view blends colors toward.
+static const CGFloat kDimmingGray = 0.5;
+static const NSTimeInterval kDimmingAnimationDuration = 0.1;
+
+@implementation DimmingOverlayView
+
+@synthesize dimmingAmount = dimmingAmount_;
+
+- (id)initWithFrame:(NSRect)frame
+{
+    self = [super initWithFrame:frame];
+    if (self) {
+        // A layer-hosting view, so the layer's properties can be animated directly.
+        CALayer *layer = [CALayer layer];
+        CGColorRef gray = CGColorCreateGenericGray(kDimmingGray, 1);
+        layer.backgroundColor = gray;
+        CGColorRelease(gray);
+        layer.opacity = 0;
+        [self setLayer:layer];
+        [self setWantsLayer:YES];
+        [self setHidden:YES];
+    }
+    return self;
+}
+
+- (BOOL)isOpaque
+{
+    return NO;
+}
+
+- (NSView *)hitTest:(NSPoint)aPoint
+{
+    return nil;
+}
+
+- (void)setDimmingAmount:(double)dimmingAmount animated:(BOOL)animated
+{
+    if (dimmingAmount == dimmingAmount_) {
+        return;
+    }
+    dimmingAmount_ = dimmingAmount;
+    if (dimmingAmount_ > 0) {
+        [self setHidden:NO];
+    }
+    [CATransaction begin];
+    if (animated) {
+        [CATransaction setAnimationDuration:kDimmingAnimationDuration];
+    } else {
+        [CATransaction setDisableActions:YES];
+    }
+    if (dimmingAmount_ == 0) {
+        // Hidden views cost nothing to composite.
+        [CATransaction setCompletionBlock:^{
+            if (dimmingAmount_ == 0) {
+                [self setHidden:YES];
+            }
+        }];
+    }
+    self.layer.opacity = dimmingAmount_;
+    [CATransaction commit];
+}
+
+@end
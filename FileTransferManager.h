@@ -9,6 +9,7 @@
 #import <Cocoa/Cocoa.h>
 #import "TransferrableFile.h"
 
+@class NMSSHSession;
 @class TransferrableFileMenuItemViewController;
 
 @interface FileTransferManager : NSObject
@@ -35,6 +36,10 @@
 // Number of bytes transferred has changed or total size has been discovered.
 - (void)transferrableFileProgressDidChange:(TransferrableFile *)transferrableFile;
 
+// Like -transferrableFileProgressDidChange: but may be called on any thread. Updates are coalesced
+// so each file's menu item is redrawn at most a few times a second.
+- (void)transferrableFileProgressDidChangeInBackground:(TransferrableFile *)transferrableFile;
+
 // |error| is nil on success
 - (void)transferrableFile:(TransferrableFile *)transferrableFile
     didFinishTransmissionWithError:(NSError *)error;
@@ -48,4 +53,27 @@
 - (BOOL)transferrableFile:(TransferrableFile *)transferrableFile
            confirmMessage:(NSString *)message;
 
+#pragma mark - Scheduling transfers
+
+// Transfers to the same host are run in the order they're scheduled. Until a session to the host
+// has authenticated without asking the user anything, they run one at a time so the user is
+// prompted only once; after that up to four run at once, each with its own session. Finished
+// transfers check their sessions back in so the next transfer to the host can start without
+// connecting or authenticating again. Idle sessions are disconnected after a while.
+//
+// |host| identifies the account, like user@hostname:port. |block| runs on a background queue.
+- (void)scheduleTransferToHost:(NSString *)host block:(void (^)(void))block;
+
+// Returns an idle, authorized session to |host| or nil if there is none. The caller owns it until
+// it is checked in. May be called on any thread.
+- (NMSSHSession *)checkOutSessionForHost:(NSString *)host;
+
+// Makes |session| available to later transfers to |host|. Pass only sessions that are connected,
+// authorized, and not in the middle of a transfer. May be called on any thread.
+- (void)checkInSession:(NMSSHSession *)session forHost:(NSString *)host;
+
+// Called when a new session to |host| has authenticated. |interactively| is YES if the user had to
+// answer a prompt, in which case transfers to the host keep sharing one session.
+- (void)sessionDidAuthenticateForHost:(NSString *)host interactively:(BOOL)interactively;
+
 @end
@@ -7,13 +7,54 @@
 //
 
 #import "FileTransferManager.h"
+#import "DebugLogging.h"
 #import "iTermApplicationDelegate.h"
+#import "NMSSH.framework/Headers/NMSSH.h"
 #import "TransferrableFileMenuItemViewController.h"
 
 // Finished downloads will be automatically removed from the downloads menu after this number of
 // seconds.
 static const NSTimeInterval kMaximumTimeToKeepFinishedDownload = 24 * 60 * 60;
 
+// Most transfers to one host that may run at once once sessions to it authenticate silently.
+static const int kMaximumConcurrentTransfersPerHost = 4;
+
+// Sessions unused for this many seconds are disconnected.
+static const NSTimeInterval kIdleSessionTimeout = 30;
+
+// Progress of a transfer is shown at most this often.
+static const NSTimeInterval kProgressUpdateInterval = 0.25;
+
+// Scheduling state for the transfers to one host. Used only on FileTransferManager's _queue.
+@interface FileTransferHost : NSObject {
+@public
+    NSMutableArray *pendingBlocks;
+    int numberOfRunningTransfers;
+    NSMutableArray *idleSessions;
+    NSTimeInterval timeOfLastCheckIn;
+    BOOL authenticatesSilently;
+}
+@end
+
+@implementation FileTransferHost
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        pendingBlocks = [[NSMutableArray alloc] init];
+        idleSessions = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [pendingBlocks release];
+    [idleSessions release];
+    [super dealloc];
+}
+
+@end
+
 @interface FileTransferManager ()
 @property(nonatomic, retain) NSMutableArray *files;
 @end
@@ -21,6 +62,12 @@ static const NSTimeInterval kMaximumTimeToKeepFinishedDownload = 24 * 60 * 60;
 @implementation FileTransferManager {
     NSMutableArray *_viewControllers;
     NSTimer *_timer;  // cleanUpMenus timer. weak reference.
+
+    // Guards the scheduler state below.
+    dispatch_queue_t _queue;
+    NSMutableDictionary *_hosts;  // host -> FileTransferHost
+    NSMutableSet *_filesWithPendingProgress;
+    BOOL _progressUpdateScheduled;
 }
 
 + (instancetype)sharedInstance {
@@ -37,6 +84,9 @@ static const NSTimeInterval kMaximumTimeToKeepFinishedDownload = 24 * 60 * 60;
     if (self) {
         _files = [[NSMutableArray alloc] init];
         _viewControllers = [[NSMutableArray alloc] init];
+        _queue = dispatch_queue_create("com.googlecode.iterm2.file-transfer-scheduler", DISPATCH_QUEUE_SERIAL);
+        _hosts = [[NSMutableDictionary alloc] init];
+        _filesWithPendingProgress = [[NSMutableSet alloc] init];
         _timer = [NSTimer scheduledTimerWithTimeInterval:60 * 10
                                                   target:self
                                                 selector:@selector(cleanUpMenus)
@@ -50,6 +100,9 @@ static const NSTimeInterval kMaximumTimeToKeepFinishedDownload = 24 * 60 * 60;
     [[NSNotificationCenter defaultCenter] removeObserver:self];
     [_files release];
     [_viewControllers release];
+    dispatch_release(_queue);
+    [_hosts release];
+    [_filesWithPendingProgress release];
     [super dealloc];
 }
 
@@ -300,6 +353,37 @@ static const NSTimeInterval kMaximumTimeToKeepFinishedDownload = 24 * 60 * 60;
     [controller update];
 }
 
+- (void)transferrableFileProgressDidChangeInBackground:(TransferrableFile *)transferrableFile {
+    dispatch_async(_queue, ^{
+        [_filesWithPendingProgress addObject:transferrableFile];
+        if (_progressUpdateScheduled) {
+            return;
+        }
+        _progressUpdateScheduled = YES;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, kProgressUpdateInterval * NSEC_PER_SEC),
+                       dispatch_get_main_queue(),
+                       ^{
+                           [self updatePendingProgress];
+                       });
+    });
+}
+
+- (void)updatePendingProgress {
+    __block NSSet *files;
+    dispatch_sync(_queue, ^{
+        files = [_filesWithPendingProgress copy];
+        [_filesWithPendingProgress removeAllObjects];
+        _progressUpdateScheduled = NO;
+    });
+    for (TransferrableFile *file in files) {
+        // A stopped or finished file has already been updated for the last time.
+        if (file.status == kTransferrableFileStatusTransferring) {
+            [self transferrableFileProgressDidChange:file];
+        }
+    }
+    [files release];
+}
+
 // |error| is nil on success
 - (void)transferrableFile:(TransferrableFile *)transferrableFile
     didFinishTransmissionWithError:(NSError *)error {
@@ -373,4 +457,99 @@ static const NSTimeInterval kMaximumTimeToKeepFinishedDownload = 24 * 60 * 60;
     [_viewControllers removeObject:viewController];
 }
 
+#pragma mark - Scheduling transfers
+
+- (void)scheduleTransferToHost:(NSString *)host block:(void (^)(void))block {
+    void (^copiedBlock)(void) = [[block copy] autorelease];
+    dispatch_async(_queue, ^{
+        [[self stateForHost:host]->pendingBlocks addObject:copiedBlock];
+        [self startPendingTransfersToHost:host];
+    });
+}
+
+- (NMSSHSession *)checkOutSessionForHost:(NSString *)host {
+    __block NMSSHSession *session = nil;
+    dispatch_sync(_queue, ^{
+        NSMutableArray *idleSessions = [self stateForHost:host]->idleSessions;
+        if ([idleSessions count]) {
+            session = [[idleSessions lastObject] retain];
+            [idleSessions removeLastObject];
+        }
+    });
+    return [session autorelease];
+}
+
+- (void)checkInSession:(NMSSHSession *)session forHost:(NSString *)host {
+    dispatch_async(_queue, ^{
+        FileTransferHost *state = [self stateForHost:host];
+        [state->idleSessions addObject:session];
+        state->timeOfLastCheckIn = [NSDate timeIntervalSinceReferenceDate];
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, kIdleSessionTimeout * NSEC_PER_SEC),
+                       _queue,
+                       ^{
+                           [self disconnectIdleSessionsToHost:host];
+                       });
+    });
+}
+
+- (void)sessionDidAuthenticateForHost:(NSString *)host interactively:(BOOL)interactively {
+    dispatch_async(_queue, ^{
+        FileTransferHost *state = [self stateForHost:host];
+        if (!interactively && !state->authenticatesSilently) {
+            DLog(@"Sessions to %@ authenticate silently; allowing concurrent transfers", host);
+            state->authenticatesSilently = YES;
+            [self startPendingTransfersToHost:host];
+        }
+    });
+}
+
+// Runs on _queue.
+- (FileTransferHost *)stateForHost:(NSString *)host {
+    FileTransferHost *state = [_hosts objectForKey:host];
+    if (!state) {
+        state = [[[FileTransferHost alloc] init] autorelease];
+        [_hosts setObject:state forKey:host];
+    }
+    return state;
+}
+
+// Runs on _queue.
+- (void)startPendingTransfersToHost:(NSString *)host {
+    FileTransferHost *state = [self stateForHost:host];
+    const int limit = state->authenticatesSilently ? kMaximumConcurrentTransfersPerHost : 1;
+    while ([state->pendingBlocks count] && state->numberOfRunningTransfers < limit) {
+        void (^block)(void) = [[[state->pendingBlocks objectAtIndex:0] retain] autorelease];
+        [state->pendingBlocks removeObjectAtIndex:0];
+        state->numberOfRunningTransfers++;
+        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+            @autoreleasepool {
+                block();
+            }
+            dispatch_async(_queue, ^{
+                [self stateForHost:host]->numberOfRunningTransfers--;
+                [self startPendingTransfersToHost:host];
+            });
+        });
+    }
+}
+
+// Runs on _queue.
+- (void)disconnectIdleSessionsToHost:(NSString *)host {
+    FileTransferHost *state = [self stateForHost:host];
+    const NSTimeInterval idleTime =
+        [NSDate timeIntervalSinceReferenceDate] - state->timeOfLastCheckIn;
+    // A later check-in scheduled another call for when its session times out.
+    if (![state->idleSessions count] || idleTime < kIdleSessionTimeout) {
+        return;
+    }
+    NSArray *sessions = [[state->idleSessions copy] autorelease];
+    [state->idleSessions removeAllObjects];
+    DLog(@"Disconnecting %d idle sessions to %@", (int)[sessions count], host);
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        for (NMSSHSession *session in sessions) {
+            [session disconnect];
+        }
+    });
+}
+
 @end
@@ -8,6 +8,8 @@
 
 #import <Foundation/Foundation.h>
 
+@class LineBufferSearch;
+
 #define FindOptCaseInsensitive (1 << 0)
 #define FindOptBackwards       (1 << 1)
 #define FindOptRegex           (1 << 2)
@@ -28,9 +30,10 @@ typedef enum {
     int stopAt_;
     FindContextStatus status_;
     int matchLength_;
-    NSMutableArray* results_;
+    NSMutableData *results_;
     BOOL hasWrapped_;
     NSTimeInterval maxTime_;
+    LineBufferSearch *backgroundSearch_;
 };
 
 // Current absolute block number being searched.
@@ -60,14 +63,18 @@ typedef enum {
 @property(nonatomic, assign) FindContextStatus status;
 @property(nonatomic, assign) int matchLength;
 
-// used for multiple results
-@property(nonatomic, retain) NSMutableArray *results;
+// ResultRanges (see LineBufferHelpers.h) found in the last block searched.
+@property(nonatomic, retain) NSMutableData *results;
 
 // for client use. Not read or written by LineBuffer.
 @property(nonatomic, assign) BOOL hasWrapped;
 
 @property(nonatomic, assign) NSTimeInterval maxTime;
 
+// For multiple-results searches, the search running in the background. Setting it or calling reset
+// cancels the old one. Not copied by copyFromFindContext:.
+@property(nonatomic, retain) LineBufferSearch *backgroundSearch;
+
 - (void)copyFromFindContext:(FindContext *)other;
 
 - (void)reset;
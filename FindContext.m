@@ -7,6 +7,7 @@
 //
 
 #import "FindContext.h"
+#import "LineBufferSearch.h"
 
 // Default max time per iteration of search.
 static const NSTimeInterval kDefaultMaxTime = 0.1;
@@ -24,6 +25,7 @@ static const NSTimeInterval kDefaultMaxTime = 0.1;
 @synthesize results = results_;
 @synthesize hasWrapped = hasWrapped_;
 @synthesize maxTime = maxTime_;
+@synthesize backgroundSearch = backgroundSearch_;
 
 - (id)init {
     self = [super init];
@@ -34,6 +36,8 @@ static const NSTimeInterval kDefaultMaxTime = 0.1;
 }
 
 - (void)dealloc {
+    [backgroundSearch_ cancel];
+    [backgroundSearch_ release];
     [results_ release];
     [substring_ release];
     [super dealloc];
@@ -53,9 +57,18 @@ static const NSTimeInterval kDefaultMaxTime = 0.1;
     self.maxTime = other.maxTime;
 }
 
+- (void)setBackgroundSearch:(LineBufferSearch *)backgroundSearch {
+    if (backgroundSearch != backgroundSearch_) {
+        [backgroundSearch_ cancel];
+        [backgroundSearch_ release];
+        backgroundSearch_ = [backgroundSearch retain];
+    }
+}
+
 - (void)reset {
     self.substring = nil;
     self.results = nil;
+    self.backgroundSearch = nil;
 }
 
 @end
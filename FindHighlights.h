@@ -0,0 +1,43 @@
+//
+//  FindHighlights.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+// Cells highlighted by Find, from (startX, absStartY) to (endX, absEndY) inclusive.
+typedef struct {
+    long long absStartY;
+    long long absEndY;
+    int startX;
+    int endX;
+} FindHighlight;
+
+// The highlights of a Find, sorted by where they begin. A search for a common word in a long
+// scrollback can have millions of results, so instead of keeping a bitmap for each line with one,
+// the cells to highlight are worked out for lines as they're drawn.
+typedef struct {
+    FindHighlight *highlights;
+    int count;
+    int capacity;
+    long long maxExtraLines;  // The most lines any highlight continues onto after its first.
+} FindHighlights;
+
+// Adds |count| highlights, which may be in any order. Ones that are already present are skipped.
+void FindHighlightsAdd(FindHighlights *highlights, const FindHighlight *added, int count);
+
+// Removes the highlights that touch any line from |firstLine| to |lastLine|, inclusive.
+void FindHighlightsRemoveLines(FindHighlights *highlights, long long firstLine, long long lastLine);
+
+// Returns YES if any highlight touches |line|.
+BOOL FindHighlightsTouchLine(const FindHighlights *highlights, long long line);
+
+// Sets the bit for each highlighted cell of |line| in |bitmap|, which must be zeroed and have room
+// for |width| bits (cell i is bit i % 8 of byte i / 8). Returns YES if any were set.
+BOOL FindHighlightsGetBitmap(const FindHighlights *highlights,
+                             long long line,
+                             int width,
+                             unsigned char *bitmap);
+
+void FindHighlightsRemoveAll(FindHighlights *highlights);
+void FindHighlightsFree(FindHighlights *highlights);
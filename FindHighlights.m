@@ -0,0 +1,164 @@
+//
+//  FindHighlights.m
+//  iTerm
+//
+
+#import "FindHighlights.h"
+
+static int CompareHighlights(const FindHighlight *a, const FindHighlight *b) {
+    if (a->absStartY != b->absStartY) {
+        return a->absStartY < b->absStartY ? -1 : 1;
+    }
+    if (a->startX != b->startX) {
+        return a->startX < b->startX ? -1 : 1;
+    }
+    if (a->absEndY != b->absEndY) {
+        return a->absEndY < b->absEndY ? -1 : 1;
+    }
+    if (a->endX != b->endX) {
+        return a->endX < b->endX ? -1 : 1;
+    }
+    return 0;
+}
+
+static int CompareHighlightsForSort(const void *a, const void *b) {
+    return CompareHighlights(a, b);
+}
+
+// Index of the first highlight that doesn't sort before |key|.
+static int LowerBound(const FindHighlights *highlights, const FindHighlight *key) {
+    int low = 0;
+    int high = highlights->count;
+    while (low < high) {
+        const int mid = low + (high - low) / 2;
+        if (CompareHighlights(&highlights->highlights[mid], key) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Index of the first highlight that begins on or after |line|.
+static int FirstBeginningOnOrAfter(const FindHighlights *highlights, long long line) {
+    const FindHighlight key = { line, line, INT_MIN, INT_MIN };
+    return LowerBound(highlights, &key);
+}
+
+void FindHighlightsAdd(FindHighlights *highlights, const FindHighlight *added, int count) {
+    if (count == 0) {
+        return;
+    }
+    FindHighlight *sorted = malloc(sizeof(FindHighlight) * count);
+    memcpy(sorted, added, sizeof(FindHighlight) * count);
+    for (int i = 1; i < count; i++) {
+        if (CompareHighlights(&sorted[i - 1], &sorted[i]) > 0) {
+            qsort(sorted, count, sizeof(FindHighlight), CompareHighlightsForSort);
+            break;
+        }
+    }
+    int numAdded = 0;
+    for (int i = 0; i < count; i++) {
+        if (numAdded == 0 || CompareHighlights(&sorted[numAdded - 1], &sorted[i]) != 0) {
+            sorted[numAdded++] = sorted[i];
+            highlights->maxExtraLines = MAX(highlights->maxExtraLines,
+                                            sorted[i].absEndY - sorted[i].absStartY);
+        }
+    }
+
+    if (highlights->count + numAdded > highlights->capacity) {
+        highlights->capacity = MAX(highlights->count + numAdded, highlights->capacity * 2);
+        highlights->highlights = realloc(highlights->highlights,
+                                         sizeof(FindHighlight) * highlights->capacity);
+    }
+
+    // Only the highlights from where the first new one goes onward have to move. Tail find adds
+    // results after all the others, so it usually appends.
+    const int first = LowerBound(highlights, &sorted[0]);
+    const int numMoved = highlights->count - first;
+    FindHighlight *moved = malloc(sizeof(FindHighlight) * MAX(1, numMoved));
+    memcpy(moved, highlights->highlights + first, sizeof(FindHighlight) * numMoved);
+    int i = 0;
+    int j = 0;
+    int k = first;
+    while (i < numMoved || j < numAdded) {
+        int order;
+        if (i == numMoved) {
+            order = 1;
+        } else if (j == numAdded) {
+            order = -1;
+        } else {
+            order = CompareHighlights(&moved[i], &sorted[j]);
+        }
+        if (order <= 0) {
+            highlights->highlights[k++] = moved[i++];
+            if (order == 0) {
+                j++;
+            }
+        } else {
+            highlights->highlights[k++] = sorted[j++];
+        }
+    }
+    highlights->count = k;
+    free(moved);
+    free(sorted);
+}
+
+void FindHighlightsRemoveLines(FindHighlights *highlights, long long firstLine, long long lastLine) {
+    const int begin = FirstBeginningOnOrAfter(highlights, firstLine - highlights->maxExtraLines);
+    const int end = FirstBeginningOnOrAfter(highlights, lastLine + 1);
+    int kept = begin;
+    for (int i = begin; i < end; i++) {
+        if (highlights->highlights[i].absEndY < firstLine) {
+            highlights->highlights[kept++] = highlights->highlights[i];
+        }
+    }
+    if (kept < end) {
+        memmove(highlights->highlights + kept,
+                highlights->highlights + end,
+                sizeof(FindHighlight) * (highlights->count - end));
+        highlights->count -= end - kept;
+    }
+}
+
+BOOL FindHighlightsTouchLine(const FindHighlights *highlights, long long line) {
+    const int end = FirstBeginningOnOrAfter(highlights, line + 1);
+    for (int i = FirstBeginningOnOrAfter(highlights, line - highlights->maxExtraLines); i < end; i++) {
+        if (highlights->highlights[i].absEndY >= line) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+BOOL FindHighlightsGetBitmap(const FindHighlights *highlights,
+                             long long line,
+                             int width,
+                             unsigned char *bitmap) {
+    BOOL any = NO;
+    const int end = FirstBeginningOnOrAfter(highlights, line + 1);
+    for (int i = FirstBeginningOnOrAfter(highlights, line - highlights->maxExtraLines); i < end; i++) {
+        const FindHighlight *highlight = &highlights->highlights[i];
+        if (highlight->absEndY < line) {
+            continue;
+        }
+        const int lineStartX = (highlight->absStartY == line) ? MAX(0, highlight->startX) : 0;
+        const int lineEndX = (highlight->absEndY == line) ? MIN(highlight->endX + 1, width) : width;
+        for (int x = lineStartX; x < lineEndX; x++) {
+            bitmap[x / 8] |= 1 << (x & 7);
+            any = YES;
+        }
+    }
+    return any;
+}
+
+void FindHighlightsRemoveAll(FindHighlights *highlights) {
+    highlights->count = 0;
+    highlights->maxExtraLines = 0;
+}
+
+void FindHighlightsFree(FindHighlights *highlights) {
+    free(highlights->highlights);
+    memset(highlights, 0, sizeof(*highlights));
+}
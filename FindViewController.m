@@ -27,6 +27,7 @@
  */
 
 #import "FindViewController.h"
+#import "CompiledRegex.h"
 #import "iTermApplication.h"
 
 static const float FINDVIEW_DURATION = 0.075;
@@ -243,6 +244,19 @@ static NSString *gSearchString;
     [self _setSearchString:[findBarTextField_ stringValue]];
     [self _setIgnoreCase:ignoreCase_];
     [self _setRegex:regex_];
+    [self _updateToolTip];
+}
+
+// Says which regex engine the search uses, since ICU can be slow on some patterns.
+- (void)_updateToolTip
+{
+    NSString *string = [findBarTextField_ stringValue];
+    if (regex_ && [string length]) {
+        [findBarTextField_ setToolTip:[CompiledRegex engineDescriptionForPattern:string
+                                                                 caseInsensitive:ignoreCase_]];
+    } else {
+        [findBarTextField_ setToolTip:nil];
+    }
 }
 
 - (BOOL)findSubString:(NSString *)subString
@@ -313,12 +327,14 @@ static NSString *gSearchString;
 {
     ignoreCase_ = !ignoreCase_;
     [self _setIgnoreCase:ignoreCase_];
+    [self _updateToolTip];
 }
 
 - (IBAction)toggleRegex:(id)sender
 {
     regex_ = !regex_;
     [self _setRegex:regex_];
+    [self _updateToolTip];
 }
 
 - (void)_loadFindStringIntoSharedPasteboard
@@ -45,6 +45,16 @@
 
 + (id)fontSizeEstimatorForFont:(NSFont *)aFont
 {
+    // Font -> estimator. Measuring is the same for every session that uses a font.
+    static NSMutableDictionary *estimators;
+    if (!estimators) {
+        estimators = [[NSMutableDictionary alloc] init];
+    }
+    NSString *key = [NSString stringWithFormat:@"%@ %f", [aFont fontName], [aFont pointSize]];
+    FontSizeEstimator *cached = [estimators objectForKey:key];
+    if (cached) {
+        return cached;
+    }
     FontSizeEstimator* fse = [[[FontSizeEstimator alloc] init] autorelease];
     if (fse) {
         NSMutableDictionary *dic = [NSMutableDictionary dictionary];
@@ -73,6 +83,7 @@
         double baseline = -(floorf([aFont leading]) - floorf([aFont descender]));
         fse.size = size;
         fse.baseline = baseline;
+        [estimators setObject:fse forKey:key];
     }
     return fse;
 }
@@ -0,0 +1,65 @@
+//
+//  FrameProfiler.h
+//  iTerm
+//
+//  Per-frame timing of the stages of getting output onto the screen.
+//
+
+#import <Foundation/Foundation.h>
+
+typedef enum {
+    kFrameProfilerStageParse,          // Parsing and executing output (PTYSession).
+    kFrameProfilerStageRefresh,        // -[PTYTextView refresh]
+    kFrameProfilerStageDrawRect,       // -[PTYTextView drawRect:] as a whole, including the below.
+    kFrameProfilerStageConstructRuns,  // -[PTYTextView _constructRuns:...]
+    kFrameProfilerStageSimpleRuns,     // -[PTYTextView _drawSimpleRun:...]
+    kFrameProfilerStageAdvancedRuns,   // -[PTYTextView _advancedDrawRun:...]
+    kFrameProfilerStageBackground,     // Background fills.
+    kFrameProfilerStageCursor,         // -[PTYTextView _drawCursorTo:]
+    kFrameProfilerNumberOfStages
+} FrameProfilerStage;
+
+typedef enum {
+    kFrameProfilerCounterDirtyLines,   // Rows found dirty by -[PTYTextView updateDirtyRects].
+    kFrameProfilerCounterRuns,         // Runs drawn.
+    kFrameProfilerCounterBytesParsed,  // Bytes of output handled.
+    kFrameProfilerCounterEchoFastPaths,  // Echoes drawn right away (PTYSession).
+    kFrameProfilerNumberOfCounters
+} FrameProfilerCounter;
+
+// Accumulates time spent in each stage and some counts between frames. At the end of each frame
+// the totals are folded into a MovingAverage per stage and optionally appended to a log file as
+// one line of tab-separated values. Main thread only. PTYTextView creates one when the hidden
+// ShowFrameProfiler (HUD) or FrameProfilerLogPath preference is set.
+@interface FrameProfiler : NSObject {
+    uint64_t stageStart_[kFrameProfilerNumberOfStages];
+    uint64_t stageTotal_[kFrameProfilerNumberOfStages];
+    double lastFrameMilliseconds_[kFrameProfilerNumberOfStages];
+    long long counters_[kFrameProfilerNumberOfCounters];
+    NSArray *stageAverages_;    // MovingAverage per stage, in ms.
+    NSArray *counterAverages_;  // MovingAverage per counter.
+    FILE *log_;
+    long long frameNumber_;
+    double nanosecondsPerTick_;
+}
+
+// If logPath is not nil, each frame is appended to that file.
+- (id)initWithLogPath:(NSString *)logPath;
+
+- (void)beginStage:(FrameProfilerStage)stage;
+- (void)endStage:(FrameProfilerStage)stage;
+- (void)addToCounter:(FrameProfilerCounter)counter amount:(long long)amount;
+
+// Closes out the current frame.
+- (void)endFrame;
+
+// Time spent in |stage| during the frame closed out by the last call to -endFrame.
+- (double)millisecondsInLastFrameForStage:(FrameProfilerStage)stage;
+
+// Short name of |stage|, as used in the log's header.
++ (NSString *)nameOfStage:(FrameProfilerStage)stage;
+
+// Multi-line description of the smoothed readings, for the HUD.
+- (NSString *)summary;
+
+@end
@@ -0,0 +1,147 @@
+//
+//  FrameProfiler.m
+//  iTerm
+//
+
+#import "FrameProfiler.h"
+#import "MovingAverage.h"
+#include <mach/mach_time.h>
+
+static NSString *const kStageNames[kFrameProfilerNumberOfStages] = {
+    @"parse",
+    @"refresh",
+    @"drawRect",
+    @"constructRuns",
+    @"simpleRuns",
+    @"advancedRuns",
+    @"background",
+    @"cursor"
+};
+
+static NSString *const kCounterNames[kFrameProfilerNumberOfCounters] = {
+    @"dirtyLines",
+    @"runs",
+    @"bytesParsed",
+    @"echoFastPaths"
+};
+
+@implementation FrameProfiler
+
+- (id)initWithLogPath:(NSString *)logPath
+{
+    self = [super init];
+    if (self) {
+        mach_timebase_info_data_t timebase;
+        mach_timebase_info(&timebase);
+        nanosecondsPerTick_ = (double)timebase.numer / (double)timebase.denom;
+
+        NSMutableArray *stageAverages = [NSMutableArray array];
+        for (int i = 0; i < kFrameProfilerNumberOfStages; i++) {
+            [stageAverages addObject:[[[MovingAverage alloc] init] autorelease]];
+        }
+        stageAverages_ = [stageAverages retain];
+        NSMutableArray *counterAverages = [NSMutableArray array];
+        for (int i = 0; i < kFrameProfilerNumberOfCounters; i++) {
+            [counterAverages addObject:[[[MovingAverage alloc] init] autorelease]];
+        }
+        counterAverages_ = [counterAverages retain];
+
+        if (logPath) {
+            log_ = fopen([[logPath stringByExpandingTildeInPath] fileSystemRepresentation], "a");
+            if (log_) {
+                NSMutableArray *columns = [NSMutableArray arrayWithObjects:@"frame", @"time", nil];
+                for (int i = 0; i < kFrameProfilerNumberOfStages; i++) {
+                    [columns addObject:[kStageNames[i] stringByAppendingString:@"Ms"]];
+                }
+                for (int i = 0; i < kFrameProfilerNumberOfCounters; i++) {
+                    [columns addObject:kCounterNames[i]];
+                }
+                fprintf(log_, "%s\n", [[columns componentsJoinedByString:@"\t"] UTF8String]);
+            } else {
+                NSLog(@"Couldn't open frame profiler log %@", logPath);
+            }
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (log_) {
+        fclose(log_);
+    }
+    [stageAverages_ release];
+    [counterAverages_ release];
+    [super dealloc];
+}
+
+- (void)beginStage:(FrameProfilerStage)stage
+{
+    stageStart_[stage] = mach_absolute_time();
+}
+
+- (void)endStage:(FrameProfilerStage)stage
+{
+    if (stageStart_[stage]) {
+        stageTotal_[stage] += mach_absolute_time() - stageStart_[stage];
+        stageStart_[stage] = 0;
+    }
+}
+
+- (void)addToCounter:(FrameProfilerCounter)counter amount:(long long)amount
+{
+    counters_[counter] += amount;
+}
+
+- (void)endFrame
+{
+    double ms[kFrameProfilerNumberOfStages];
+    for (int i = 0; i < kFrameProfilerNumberOfStages; i++) {
+        ms[i] = stageTotal_[i] * nanosecondsPerTick_ / 1000000.0;
+        lastFrameMilliseconds_[i] = ms[i];
+        [[stageAverages_ objectAtIndex:i] addValue:ms[i]];
+        stageTotal_[i] = 0;
+    }
+    for (int i = 0; i < kFrameProfilerNumberOfCounters; i++) {
+        [[counterAverages_ objectAtIndex:i] addValue:counters_[i]];
+    }
+    if (log_) {
+        fprintf(log_, "%lld\t%.6f", frameNumber_, [NSDate timeIntervalSinceReferenceDate]);
+        for (int i = 0; i < kFrameProfilerNumberOfStages; i++) {
+            fprintf(log_, "\t%.3f", ms[i]);
+        }
+        for (int i = 0; i < kFrameProfilerNumberOfCounters; i++) {
+            fprintf(log_, "\t%lld", counters_[i]);
+        }
+        fprintf(log_, "\n");
+        fflush(log_);
+    }
+    memset(counters_, 0, sizeof(counters_));
+    frameNumber_++;
+}
+
+- (double)millisecondsInLastFrameForStage:(FrameProfilerStage)stage
+{
+    return lastFrameMilliseconds_[stage];
+}
+
++ (NSString *)nameOfStage:(FrameProfilerStage)stage
+{
+    return kStageNames[stage];
+}
+
+- (NSString *)summary
+{
+    NSMutableString *summary = [NSMutableString stringWithFormat:@"frame %lld\n", frameNumber_];
+    for (int i = 0; i < kFrameProfilerNumberOfStages; i++) {
+        [summary appendFormat:@"%@: %.2f ms\n",
+            kStageNames[i], [(MovingAverage *)[stageAverages_ objectAtIndex:i] value]];
+    }
+    for (int i = 0; i < kFrameProfilerNumberOfCounters; i++) {
+        [summary appendFormat:@"%@: %.0f\n",
+            kCounterNames[i], [(MovingAverage *)[counterAverages_ objectAtIndex:i] value]];
+    }
+    return summary;
+}
+
+@end
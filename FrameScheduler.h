@@ -0,0 +1,40 @@
+//
+//  FrameScheduler.h
+//  iTerm
+//
+//  Drives display refreshes for all sessions from a single display link. Instead of each session
+//  running its own NSTimer, a session asks to be refreshed after some delay, and on each frame the
+//  scheduler refreshes every client whose delay has elapsed in one main-thread pass. When nothing
+//  is scheduled the display link is stopped, so idle sessions cost no wakeups at all.
+//
+
+#import <Foundation/Foundation.h>
+
+@protocol FrameSchedulerClient <NSObject>
+// Called on the main thread on the first frame after the requested delay has passed. The client
+// is unscheduled before this is called, so it may reschedule itself.
+- (void)frameSchedulerRefresh;
+@end
+
+@interface FrameScheduler : NSObject
+
++ (instancetype)sharedInstance;
+
+// Request a refresh of |client| no sooner than |delay| seconds from now. If the client is already
+// scheduled to refresh sooner, the earlier time is kept. The client is retained until it is
+// refreshed or unscheduled. Must be called on the main thread.
+- (void)scheduleClient:(id<FrameSchedulerClient>)client after:(NSTimeInterval)delay;
+
+// Cancels a pending refresh. Must be called on the main thread.
+- (void)unscheduleClient:(id<FrameSchedulerClient>)client;
+
+- (BOOL)isClientScheduled:(id<FrameSchedulerClient>)client;
+
+// Counters for tuning. Keys:
+//   "frames": Frames that refreshed at least one client.
+//   "skipped": Display link ticks dropped because the main thread hadn't finished the last frame.
+//   "refreshes": Total client refreshes.
+//   "latency": Moving average of seconds between a client's deadline and its refresh.
+- (NSDictionary *)statistics;
+
+@end
@@ -0,0 +1,211 @@
+//
+//  FrameScheduler.m
+//  iTerm
+//
+
+#import "FrameScheduler.h"
+#import "DebugLogging.h"
+#import "MovingAverage.h"
+#import <QuartzCore/QuartzCore.h>
+#include <libkern/OSAtomic.h>
+
+// Used when no display link could be created (e.g., no displays are attached).
+static const NSTimeInterval kFallbackFrameInterval = 1.0 / 60.0;
+
+@interface FrameScheduler ()
+- (void)displayLinkDidFire;
+@end
+
+static CVReturn FrameSchedulerDisplayLinkCallback(CVDisplayLinkRef displayLink,
+                                                  const CVTimeStamp *now,
+                                                  const CVTimeStamp *outputTime,
+                                                  CVOptionFlags flagsIn,
+                                                  CVOptionFlags *flagsOut,
+                                                  void *context) {
+    [(FrameScheduler *)context displayLinkDidFire];
+    return kCVReturnSuccess;
+}
+
+@implementation FrameScheduler {
+    // Client -> NSNumber with the NSTimeInterval (since reference date) at which it wants a refresh.
+    NSMapTable *deadlines_;
+
+    CVDisplayLinkRef displayLink_;
+    NSTimer *fallbackTimer_;
+    BOOL running_;
+
+    // Earliest deadline in |deadlines_|. Read on the display link thread so it can avoid waking the
+    // main thread when no client is due yet.
+    volatile NSTimeInterval nextDeadline_;
+
+    // Set on the display link thread when a frame has been dispatched to the main thread, cleared
+    // on the main thread when it's done.
+    volatile int32_t framePending_;
+
+    // Statistics.
+    long long frames_;
+    volatile int64_t skipped_;
+    long long refreshes_;
+    MovingAverage *latency_;
+}
+
++ (instancetype)sharedInstance {
+    static id instance;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        instance = [[self alloc] init];
+    });
+    return instance;
+}
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        deadlines_ = [[NSMapTable mapTableWithStrongToStrongObjects] retain];
+        latency_ = [[MovingAverage alloc] init];
+        nextDeadline_ = DBL_MAX;
+        if (CVDisplayLinkCreateWithActiveCGDisplays(&displayLink_) == kCVReturnSuccess) {
+            CVDisplayLinkSetOutputCallback(displayLink_, FrameSchedulerDisplayLinkCallback, self);
+        } else {
+            displayLink_ = NULL;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [self stop];
+    if (displayLink_) {
+        CVDisplayLinkRelease(displayLink_);
+    }
+    [deadlines_ release];
+    [latency_ release];
+    [super dealloc];
+}
+
+#pragma mark - APIs
+
+- (void)scheduleClient:(id<FrameSchedulerClient>)client after:(NSTimeInterval)delay {
+    NSTimeInterval deadline = [NSDate timeIntervalSinceReferenceDate] + delay;
+    NSNumber *existing = [deadlines_ objectForKey:client];
+    if (existing && [existing doubleValue] <= deadline) {
+        // A refresh at least this soon is already scheduled. Don't push it back.
+        return;
+    }
+    [deadlines_ setObject:[NSNumber numberWithDouble:deadline] forKey:client];
+    if (deadline < nextDeadline_) {
+        nextDeadline_ = deadline;
+    }
+    [self start];
+}
+
+- (void)unscheduleClient:(id<FrameSchedulerClient>)client {
+    if ([deadlines_ objectForKey:client]) {
+        [deadlines_ removeObjectForKey:client];
+        [self updateNextDeadline];
+    }
+}
+
+- (BOOL)isClientScheduled:(id<FrameSchedulerClient>)client {
+    return [deadlines_ objectForKey:client] != nil;
+}
+
+- (NSDictionary *)statistics {
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+               [NSNumber numberWithLongLong:frames_], @"frames",
+               [NSNumber numberWithLongLong:OSAtomicAdd64Barrier(0, &skipped_)], @"skipped",
+               [NSNumber numberWithLongLong:refreshes_], @"refreshes",
+               [NSNumber numberWithDouble:latency_.value], @"latency",
+               nil];
+}
+
+- (NSString *)description {
+    return [NSString stringWithFormat:@"<%@: %p clients=%d stats=%@>",
+               [self class], self, (int)[deadlines_ count], [self statistics]];
+}
+
+#pragma mark - Private
+
+- (void)start {
+    if (running_) {
+        return;
+    }
+    running_ = YES;
+    if (displayLink_) {
+        CVDisplayLinkStart(displayLink_);
+    } else {
+        fallbackTimer_ = [[NSTimer scheduledTimerWithTimeInterval:kFallbackFrameInterval
+                                                           target:self
+                                                         selector:@selector(frame)
+                                                         userInfo:nil
+                                                          repeats:YES] retain];
+    }
+}
+
+- (void)stop {
+    if (!running_) {
+        return;
+    }
+    running_ = NO;
+    if (displayLink_) {
+        CVDisplayLinkStop(displayLink_);
+    }
+    [fallbackTimer_ invalidate];
+    [fallbackTimer_ release];
+    fallbackTimer_ = nil;
+}
+
+- (void)updateNextDeadline {
+    NSTimeInterval earliest = DBL_MAX;
+    for (id client in deadlines_) {
+        earliest = MIN(earliest, [[deadlines_ objectForKey:client] doubleValue]);
+    }
+    nextDeadline_ = earliest;
+    if (earliest == DBL_MAX) {
+        [self stop];
+    }
+}
+
+// Runs on the display link's thread.
+- (void)displayLinkDidFire {
+    if ([NSDate timeIntervalSinceReferenceDate] < nextDeadline_) {
+        return;
+    }
+    if (!OSAtomicCompareAndSwap32Barrier(0, 1, &framePending_)) {
+        // The main thread is still busy with the last frame.
+        OSAtomicIncrement64Barrier(&skipped_);
+        return;
+    }
+    [self performSelectorOnMainThread:@selector(frame) withObject:nil waitUntilDone:NO];
+}
+
+// Runs on the main thread.
+- (void)frame {
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    NSMutableArray *due = [NSMutableArray array];
+    for (id client in deadlines_) {
+        NSTimeInterval deadline = [[deadlines_ objectForKey:client] doubleValue];
+        if (deadline <= now) {
+            [due addObject:client];
+            [latency_ addValue:now - deadline];
+        }
+    }
+    for (id client in due) {
+        [deadlines_ removeObjectForKey:client];
+    }
+
+    if ([due count]) {
+        frames_++;
+        refreshes_ += [due count];
+        for (id<FrameSchedulerClient> client in due) {
+            [client frameSchedulerRefresh];
+        }
+    }
+
+    // Clients usually reschedule themselves while refreshing, so only now is it known whether the
+    // display link can be stopped.
+    [self updateNextDeadline];
+    OSAtomicCompareAndSwap32Barrier(1, 0, &framePending_);
+}
+
+@end
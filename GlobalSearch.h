@@ -39,6 +39,7 @@
 
 @class iTermSearchField;
 @class PTYSession;
+@class TimerWheelTimer;
 
 @protocol GlobalSearchDelegate
 
@@ -53,7 +54,7 @@
 {
     IBOutlet iTermSearchField* searchField_;
     IBOutlet NSTableView* tableView_;
-    NSTimer* timer_;
+    TimerWheelTimer* timer_;
     NSMutableArray* searches_;
     NSMutableArray* combinedResults_;
     id<GlobalSearchDelegate> delegate_;
@@ -32,6 +32,7 @@
 #import "PTYTextView.h"
 #import "PseudoTerminal.h"
 #import "SearchResult.h"
+#import "TimerWheel.h"
 #import "VT100Screen.h"
 #import "iTermController.h"
 #import "iTermExpose.h"
@@ -39,12 +40,14 @@
 
 const double GLOBAL_SEARCH_MARGIN = 10;
 
+// Only the best results are kept in the table.
+static const int kMaxGlobalSearchResults = 1000;
+
 @interface GlobalSearchInstance : NSObject
 {
     PTYTextView* textView_;
     id<PTYTextViewDataSource> textViewDataSource_;
     PTYSession* theSession_;
-    NSMutableArray* results_;
     BOOL more_;
     NSString* findString_;
     NSString* label_;
@@ -57,7 +60,7 @@ const double GLOBAL_SEARCH_MARGIN = 10;
                 label:(NSString*)label;
 - (void)dealloc;
 - (BOOL)more;
-- (NSArray*)results;
+- (NSArray*)doSearch;
 - (NSString*)label;
 - (PTYTextView*)textView;
 - (PTYSession*)session;
@@ -73,12 +76,29 @@ const double GLOBAL_SEARCH_MARGIN = 10;
     int endX_;
     long long absY_;
     long long absEndY_;
+    BOOL exactCase_;
+    long long linesFromBottom_;
+    NSArray* matchRanges_;
+    NSAttributedString* snippet_;
+    CGFloat snippetWidth_;
+    BOOL snippetSelected_;
 }
 
 - (id)initWithInstance:(GlobalSearchInstance*)instance context:(NSString*)theContext x:(int)x absY:(long long)absY endX:(int)endX y:(long long)absEndY findString:(NSString*)findString;
 - (void)dealloc;
 - (NSString*)context;
 - (NSString*)findString;
+// Ranks results matching the find string's case first, and then those nearest the bottom of their
+// session when they were found.
+- (void)setExactCase:(BOOL)exactCase linesFromBottom:(long long)linesFromBottom;
+- (NSComparisonResult)compareRank:(GlobalSearchResult*)other;
+// NSValue ranges of the find string in the context, or nil until they've been computed.
+- (NSArray*)matchRanges;
+- (void)setMatchRanges:(NSArray*)matchRanges;
+// The snippet last made for the table, or nil from the getter if it was made for a different
+// width or selection state.
+- (NSAttributedString*)snippetForWidth:(CGFloat)width isSelected:(BOOL)isSelected;
+- (void)setSnippet:(NSAttributedString*)snippet width:(CGFloat)width isSelected:(BOOL)isSelected;
 - (GlobalSearchInstance*)instance;
 - (int)x;
 - (int)endX;
@@ -114,6 +134,8 @@ const double GLOBAL_SEARCH_MARGIN = 10;
     [instance_ release];
     [context_ release];
     [findString_ release];
+    [matchRanges_ release];
+    [snippet_ release];
     [super dealloc];
 }
 
@@ -133,6 +155,52 @@ const double GLOBAL_SEARCH_MARGIN = 10;
     return instance_;
 }
 
+- (void)setExactCase:(BOOL)exactCase linesFromBottom:(long long)linesFromBottom
+{
+    exactCase_ = exactCase;
+    linesFromBottom_ = linesFromBottom;
+}
+
+- (NSComparisonResult)compareRank:(GlobalSearchResult*)other
+{
+    if (exactCase_ != other->exactCase_) {
+        return exactCase_ ? NSOrderedAscending : NSOrderedDescending;
+    }
+    if (linesFromBottom_ != other->linesFromBottom_) {
+        return linesFromBottom_ < other->linesFromBottom_ ? NSOrderedAscending : NSOrderedDescending;
+    }
+    return NSOrderedSame;
+}
+
+- (NSArray*)matchRanges
+{
+    return matchRanges_;
+}
+
+- (void)setMatchRanges:(NSArray*)matchRanges
+{
+    [matchRanges_ autorelease];
+    matchRanges_ = [matchRanges copy];
+    [snippet_ release];
+    snippet_ = nil;
+}
+
+- (NSAttributedString*)snippetForWidth:(CGFloat)width isSelected:(BOOL)isSelected
+{
+    if (width == snippetWidth_ && isSelected == snippetSelected_) {
+        return snippet_;
+    }
+    return nil;
+}
+
+- (void)setSnippet:(NSAttributedString*)snippet width:(CGFloat)width isSelected:(BOOL)isSelected
+{
+    [snippet_ autorelease];
+    snippet_ = [snippet retain];
+    snippetWidth_ = width;
+    snippetSelected_ = isSelected;
+}
+
 - (int)x
 {
     return x_;
@@ -175,7 +243,6 @@ const double GLOBAL_SEARCH_MARGIN = 10;
     assert(label);
     self = [super init];
     if (self) {
-        results_ = [[NSMutableArray alloc] init];
         findString_ = [findString copy];
         more_ = YES;
         textView_ = [session TEXTVIEW];
@@ -191,7 +258,7 @@ const double GLOBAL_SEARCH_MARGIN = 10;
                                startingAtY:(long long)([textViewDataSource_ numberOfLines] + 1) + [textViewDataSource_ totalScrollbackOverflow]
                                 withOffset:0  // 1?
                                  inContext:findContext_
-                           multipleResults:NO];
+                           multipleResults:YES];
         matchLocations_ = [[NSMutableSet alloc] init];
         findContext_.maxTime = 0.01;
         findContext_.hasWrapped = YES;
@@ -202,7 +269,6 @@ const double GLOBAL_SEARCH_MARGIN = 10;
 - (void)dealloc
 {
     [matchLocations_ release];
-    [results_ release];
     [findString_ release];
     [label_ release];
     [findContext_ release];
@@ -214,22 +280,17 @@ const double GLOBAL_SEARCH_MARGIN = 10;
     return more_;
 }
 
-- (NSArray*)results
-{
-    return results_;
-}
-
 - (NSString*)label
 {
     return label_;
 }
 
-- (BOOL)_emitResultFromX:(int)startX absY:(int)absY toX:(int)endX absY:(int)absEndY
+- (GlobalSearchResult*)_resultFromX:(int)startX absY:(int)absY toX:(int)endX absY:(int)absEndY
 {
     // Don't add the same line twice.
     NSNumber* setObj = [NSNumber numberWithLongLong:absY];
     if ([matchLocations_ containsObject:setObj]) {
-        return NO;
+        return nil;
     }
     [matchLocations_ addObject:setObj];
 
@@ -242,25 +303,37 @@ const double GLOBAL_SEARCH_MARGIN = 10;
                             trimTrailingWhitespace:YES];
     theContext = [theContext stringByReplacingOccurrencesOfString:@"\n"
                                                        withString:@" "];
-    [results_ addObject:[[[GlobalSearchResult alloc] initWithInstance:self
-                                                              context:theContext
-                                                                    x:startX
-                                                                 absY:absY
-                                                                 endX:endX
-                                                                    y:absEndY
-                                                           findString:findString_] autorelease]];
-    return YES;
-}
-
-- (int)doSearch
+    GlobalSearchResult* result = [[[GlobalSearchResult alloc] initWithInstance:self
+                                                                       context:theContext
+                                                                             x:startX
+                                                                          absY:absY
+                                                                          endX:endX
+                                                                             y:absEndY
+                                                                    findString:findString_] autorelease];
+    long long bottom = [textViewDataSource_ numberOfLines] + [textViewDataSource_ totalScrollbackOverflow];
+    [result setExactCase:[theContext rangeOfString:findString_].location != NSNotFound
+         linesFromBottom:bottom - absY];
+    return result;
+}
+
+// Collects the results that the background search has found so far. The search itself runs on a
+// concurrent queue against a snapshot of the session's scrollback, so this only blocks for as long
+// as findContext_.maxTime.
+- (NSArray*)doSearch
 {
     NSMutableArray *results = [NSMutableArray array];
     more_ = [textViewDataSource_ continueFindAllResults:results inContext:findContext_];
+    NSMutableArray *newResults = [NSMutableArray arrayWithCapacity:results.count];
     for (SearchResult *result in results) {
-        [self _emitResultFromX:result->startX absY:result->absStartY toX:result->endX absY:result->absEndY];
+        GlobalSearchResult *globalResult = [self _resultFromX:result->startX
+                                                         absY:result->absStartY
+                                                          toX:result->endX
+                                                         absY:result->absEndY];
+        if (globalResult) {
+            [newResults addObject:globalResult];
+        }
     }
-    // TODO Test this! It used to use the deprecated API.
-    return results.count;
+    return newResults;
 }
 
 - (PTYTextView*)textView
@@ -404,64 +477,115 @@ const double GLOBAL_SEARCH_MARGIN = 10;
     [combinedResults_ removeAllObjects];
     [self _resizeView];
     [tableView_ reloadData];
-    timer_ = [NSTimer scheduledTimerWithTimeInterval:0.2
-                                              target:self
-                                            selector:@selector(_continueSearch)
-                                            userInfo:nil
-                                             repeats:NO];
-}
-
-- (void)_addResult:(GlobalSearchResult*)result
-{
-    int j = [combinedResults_ count];
-    for (int i = [combinedResults_ count] - 1; i >= 0; i--) {
-        GlobalSearchResult* current = [combinedResults_ objectAtIndex:i];
-        if ([current instance] == [result instance]) {
-            j = i;
+    // Wait briefly in case the user is still typing.
+    timer_ = [TimerWheel scheduledTimerWithTimeInterval:0.05
+                                                 leeway:0
+                                                 target:self
+                                               selector:@selector(_continueSearch)
+                                               userInfo:nil
+                                                repeats:NO
+                                               category:@"GlobalSearch"];
+}
+
+// Returns the ranges of findString in context, the way the snippet highlights them.
+static NSArray* MatchRangesInContext(NSString* context, NSString* findString)
+{
+    NSMutableArray* ranges = [NSMutableArray array];
+    NSRange searchRange = NSMakeRange(0, [context length]);
+    while (searchRange.length > 0) {
+        NSRange match = [context rangeOfString:findString
+                                       options:(NSCaseInsensitiveSearch | NSDiacriticInsensitiveSearch | NSWidthInsensitiveSearch)
+                                         range:searchRange];
+        if (match.location == NSNotFound || match.length == 0) {
             break;
         }
+        [ranges addObject:[NSValue valueWithRange:match]];
+        searchRange = NSMakeRange(NSMaxRange(match), [context length] - NSMaxRange(match));
     }
-    [combinedResults_ insertObject:result atIndex:j];
+    return ranges;
+}
+
+// Finds the matches in the result's context on a background queue and redraws its row once
+// they're known.
+- (void)_computeMatchRangesForResult:(GlobalSearchResult*)result
+{
+    NSString* context = [result context];
+    NSString* findString = [result findString];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSArray* ranges = MatchRangesInContext(context, findString);
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [result setMatchRanges:ranges];
+            NSUInteger row = [combinedResults_ indexOfObjectIdenticalTo:result];
+            if (row != NSNotFound) {
+                [tableView_ reloadDataForRowIndexes:[NSIndexSet indexSetWithIndex:row]
+                                      columnIndexes:[NSIndexSet indexSetWithIndex:1]];
+            }
+        });
+    });
 }
 
-- (void)_addLastResultsToTable:(int)n fromInstance:(GlobalSearchInstance*)inst
+// Inserts the result in rank order, after results of equal rank, and drops the lowest-ranked
+// result if the table is full. Returns NO if the result didn't rank high enough to be kept.
+- (BOOL)_addResult:(GlobalSearchResult*)result
 {
-    NSArray* results = [inst results];
-    for (int i = [results count] - n; i < [results count]; i++) {
-        [self _addResult:[results objectAtIndex:i]];
+    int lo = 0;
+    int hi = [combinedResults_ count];
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if ([result compareRank:[combinedResults_ objectAtIndex:mid]] == NSOrderedAscending) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
     }
-    [self _resizeView];
-    [tableView_ reloadData];
+    if (lo >= kMaxGlobalSearchResults) {
+        return NO;
+    }
+    [combinedResults_ insertObject:result atIndex:lo];
+    if ([combinedResults_ count] > kMaxGlobalSearchResults) {
+        [combinedResults_ removeLastObject];
+    }
+    return YES;
 }
 
+// Collects what each session's background search has found and streams it into the table. The
+// searches run concurrently; this only gathers finished results on the main thread.
 - (void)_continueSearch
 {
     NSDate* begin = [NSDate date];
-    const float kMaxTime = 0.1;
-    while ([searches_ count]) {
-        GlobalSearchInstance* inst = [searches_ objectAtIndex:0];
-        [inst retain];
+    const float kMaxTime = 0.05;
+    BOOL changed = NO;
+    const int numSearches = [searches_ count];
+    for (int i = 0; i < numSearches && [searches_ count]; i++) {
+        GlobalSearchInstance* inst = [[[searches_ objectAtIndex:0] retain] autorelease];
         [searches_ removeObjectAtIndex:0];
-        int newResults = [inst doSearch];
+        for (GlobalSearchResult* result in [inst doSearch]) {
+            if ([self _addResult:result]) {
+                [self _computeMatchRangesForResult:result];
+                changed = YES;
+            }
+        }
         if ([inst more]) {
-            [searches_ addObject:inst]; 
+            [searches_ addObject:inst];
         }
-        [self _addLastResultsToTable:newResults fromInstance:inst];
-        [inst release];
-        
-        NSDate* now = [NSDate date];
-        if ([now timeIntervalSinceDate:begin] > kMaxTime) {
+        if ([[NSDate date] timeIntervalSinceDate:begin] > kMaxTime) {
             break;
         }
     }
+    if (changed) {
+        [self _resizeView];
+        [tableView_ reloadData];
+    }
     if (![searches_ count]) {
         timer_ = nil;
     } else {
-        timer_ = [NSTimer scheduledTimerWithTimeInterval:0.1
-                                                  target:self
-                                                selector:@selector(_continueSearch)
-                                                userInfo:nil
-                                                 repeats:NO];
+        timer_ = [TimerWheel scheduledTimerWithTimeInterval:0.02
+                                                     leeway:0
+                                                     target:self
+                                                   selector:@selector(_continueSearch)
+                                                   userInfo:nil
+                                                    repeats:NO
+                                                   category:@"GlobalSearch"];
     }        
 }
 
@@ -572,6 +696,10 @@ const double GLOBAL_SEARCH_MARGIN = 10;
 
 - (NSAttributedString*)_snippetForResult:(GlobalSearchResult*)theResult isSelected:(BOOL)isSelected maxWidth:(CGFloat)maxWidth
 {
+    NSAttributedString* cached = [theResult snippetForWidth:maxWidth isSelected:isSelected];
+    if (cached) {
+        return cached;
+    }
     NSMutableAttributedString* as = [[[NSMutableAttributedString alloc] init] autorelease];
     NSColor* textColor;
     if (isSelected) {
@@ -592,7 +720,15 @@ const double GLOBAL_SEARCH_MARGIN = 10;
     
     NSString* findString = [theResult findString];
     assert(findString);
-    NSMutableString* contextTail = [NSMutableString stringWithString:[theResult context]];
+    NSString* context = [theResult context];
+    NSArray* matchRanges = [theResult matchRanges];
+    if (!matchRanges) {
+        // The matches haven't been found yet. The row is redrawn when they are.
+        return [self _attributedSubstringOf:[[[NSAttributedString alloc] initWithString:context
+                                                                             attributes:plainAttributes] autorelease]
+                               narrowerThan:maxWidth
+                                   wantHead:YES];
+    }
     
     NSAttributedString* matchStr = [[[NSAttributedString alloc] initWithString:findString attributes:boldAttributes] autorelease];
     CGFloat matchLen = [matchStr size].width;
@@ -601,24 +737,25 @@ const double GLOBAL_SEARCH_MARGIN = 10;
         maxPrefixWidth = maxWidth * 0.2;
     }
 
-    while ([contextTail length]) {
-        int end;
-        NSRange match = [contextTail rangeOfString:findString
-                                           options:(NSCaseInsensitiveSearch | NSDiacriticInsensitiveSearch | NSWidthInsensitiveSearch)];
+    NSUInteger start = 0;
+    NSUInteger nextMatch = 0;
+    while (start < [context length]) {
+        NSUInteger end;
         NSString* plainPart;
         NSString* matchPart;
-        if (match.location != NSNotFound) {
-            if (match.location > 0) {
-                plainPart = [contextTail substringWithRange:NSMakeRange(0, match.location)];
+        if (nextMatch < [matchRanges count]) {
+            NSRange match = [[matchRanges objectAtIndex:nextMatch++] rangeValue];
+            if (match.location > start) {
+                plainPart = [context substringWithRange:NSMakeRange(start, match.location - start)];
             } else {
                 plainPart = nil;
             }
-            matchPart = [contextTail substringWithRange:match];
-            end = match.location + match.length;
+            matchPart = [context substringWithRange:match];
+            end = NSMaxRange(match);
         } else {
-            plainPart = contextTail;
+            plainPart = [context substringFromIndex:start];
             matchPart = nil;
-            end = [contextTail length];
+            end = [context length];
         }
         if (plainPart) {
             NSAttributedString* substr = [[[NSAttributedString alloc] initWithString:plainPart
@@ -637,12 +774,14 @@ const double GLOBAL_SEARCH_MARGIN = 10;
             [as appendAttributedString:[[[NSAttributedString alloc] initWithString:matchPart
                                                                         attributes:boldAttributes] autorelease]];
         }
-        [contextTail deleteCharactersInRange:NSMakeRange(0, end)];
+        start = end;
     }
     
-    return [self _attributedSubstringOf:as 
-                           narrowerThan:maxWidth
-                               wantHead:YES];
+    NSAttributedString* snippet = [self _attributedSubstringOf:as
+                                                  narrowerThan:maxWidth
+                                                      wantHead:YES];
+    [theResult setSnippet:snippet width:maxWidth isSelected:isSelected];
+    return snippet;
 }
 
 - (int)numResults
@@ -0,0 +1,44 @@
+//
+//  GlyphAtlas.h
+//  iTerm
+//
+//  Glyphs rasterized once and drawn as images.
+//
+
+#import <Cocoa/Cocoa.h>
+
+// Remembers a bitmap of each glyph drawn, keyed by font, glyph, color, fake bold/italic,
+// anti-aliasing, and backing scale, so redrawing text is a series of image blits instead of glyph
+// rasterization. Glyphs are rendered with grayscale anti-aliasing since they're drawn onto
+// transparent bitmaps. Fonts are identified by pointer, so call -removeAllGlyphs when fonts
+// change. Used for simple runs only when the hidden UseGlyphAtlas preference is on.
+@interface GlyphAtlas : NSObject {
+    NSMutableDictionary *entries_;  // NSData (struct GlyphAtlasKey) -> GlyphAtlasEntry
+    CGColorSpaceRef colorSpace_;
+}
+
+// Draws glyphs with the given advances with the first glyph's origin at x and the baseline at y in
+// ctx, which must be flipped. boldOffset is how far to the right the second copy of a fake-bold
+// glyph is drawn.
+- (void)drawGlyphs:(const CGGlyph *)glyphs
+          advances:(const NSSize *)advances
+             count:(size_t)count
+              font:(NSFont *)font
+             color:(NSColor *)color
+          fakeBold:(BOOL)fakeBold
+        boldOffset:(CGFloat)boldOffset
+        fakeItalic:(BOOL)fakeItalic
+         antiAlias:(BOOL)antiAlias
+             scale:(CGFloat)scale
+                 x:(CGFloat)x
+                 y:(CGFloat)y
+         inContext:(CGContextRef)ctx;
+
+- (void)removeAllGlyphs;
+
+- (int)numberOfGlyphs;
+
+// Bytes of pixels in the glyph images.
+- (long long)imageBytes;
+
+@end
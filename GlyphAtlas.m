@@ -0,0 +1,207 @@
+//
+//  GlyphAtlas.m
+//  iTerm
+//
+
+#import "GlyphAtlas.h"
+
+// Fake italic text is sheared by this much, as in -[PTYTextView _drawSimpleRun:ctx:initialPoint:].
+static const CGFloat kFakeItalicSkew = 0.2;
+
+// The cache is emptied when it grows past this many glyphs, which only happens with many colors.
+static const int kMaxGlyphAtlasEntries = 8192;
+
+struct GlyphAtlasKey {
+    void *font;
+    uint32_t rgba;
+    float scale;
+    float boldOffset;
+    CGGlyph glyph;
+    unsigned char fakeBold;
+    unsigned char fakeItalic;
+    unsigned char antiAlias;
+};
+
+@interface GlyphAtlasEntry : NSObject {
+@public
+    CGImageRef image_;  // NULL for glyphs that draw nothing, like space.
+    CGRect rect_;       // Where image_ goes relative to the glyph's origin, with y going up.
+}
+@end
+
+@implementation GlyphAtlasEntry
+
+- (void)dealloc
+{
+    CGImageRelease(image_);
+    [super dealloc];
+}
+
+@end
+
+@implementation GlyphAtlas
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        entries_ = [[NSMutableDictionary alloc] init];
+        colorSpace_ = CGColorSpaceCreateWithName(kCGColorSpaceGenericRGB);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [entries_ release];
+    CGColorSpaceRelease(colorSpace_);
+    [super dealloc];
+}
+
+- (void)removeAllGlyphs
+{
+    [entries_ removeAllObjects];
+}
+
+- (int)numberOfGlyphs
+{
+    return [entries_ count];
+}
+
+- (long long)imageBytes
+{
+    long long total = 0;
+    for (GlyphAtlasEntry *entry in [entries_ objectEnumerator]) {
+        if (entry->image_) {
+            total += (long long)CGImageGetBytesPerRow(entry->image_) * CGImageGetHeight(entry->image_);
+        }
+    }
+    return total;
+}
+
+- (GlyphAtlasEntry *)_newEntryForKey:(const struct GlyphAtlasKey *)key
+                                font:(NSFont *)font
+                          components:(const CGFloat *)components
+{
+    GlyphAtlasEntry *entry = [[GlyphAtlasEntry alloc] init];
+    CGGlyph glyph = key->glyph;
+    CGRect bounds;
+    CTFontGetBoundingRectsForGlyphs((CTFontRef)font, kCTFontDefaultOrientation, &glyph, &bounds, 1);
+    if (CGRectIsEmpty(bounds)) {
+        return entry;
+    }
+    CGFloat minX = CGRectGetMinX(bounds);
+    CGFloat maxX = CGRectGetMaxX(bounds);
+    const CGFloat skew = key->fakeItalic ? kFakeItalicSkew : 0;
+    minX += skew * CGRectGetMinY(bounds);
+    maxX += skew * CGRectGetMaxY(bounds);
+    if (key->fakeBold) {
+        maxX += key->boldOffset;
+    }
+    // Leave room for anti-aliasing on every side.
+    CGRect rect = CGRectIntegral(CGRectMake(minX - 1,
+                                            CGRectGetMinY(bounds) - 1,
+                                            maxX - minX + 2,
+                                            bounds.size.height + 2));
+    const CGFloat scale = key->scale;
+    CGContextRef bitmap = CGBitmapContextCreate(NULL,
+                                                ceil(rect.size.width * scale),
+                                                ceil(rect.size.height * scale),
+                                                8,
+                                                0,
+                                                colorSpace_,
+                                                kCGImageAlphaPremultipliedFirst | kCGBitmapByteOrder32Host);
+    if (!bitmap) {
+        return entry;
+    }
+    CGContextScaleCTM(bitmap, scale, scale);
+    CGContextTranslateCTM(bitmap, -rect.origin.x, -rect.origin.y);
+    CGContextSetShouldAntialias(bitmap, key->antiAlias);
+    CGContextSetShouldSmoothFonts(bitmap, NO);
+    CGContextSetFillColorSpace(bitmap, colorSpace_);
+    CGContextSetFillColor(bitmap, components);
+    CGContextSetTextDrawingMode(bitmap, kCGTextFill);
+    CGContextSetTextMatrix(bitmap, CGAffineTransformMake(1, 0, skew, 1, 0, 0));
+
+    CGPoint position = CGPointZero;
+    CTFontDrawGlyphs((CTFontRef)font, &glyph, &position, 1, bitmap);
+    if (key->fakeBold) {
+        // Same as the regular path: a second copy a little to the right.
+        position.x = key->boldOffset;
+        CTFontDrawGlyphs((CTFontRef)font, &glyph, &position, 1, bitmap);
+    }
+
+    entry->image_ = CGBitmapContextCreateImage(bitmap);
+    entry->rect_ = rect;
+    CGContextRelease(bitmap);
+    return entry;
+}
+
+- (void)drawGlyphs:(const CGGlyph *)glyphs
+          advances:(const NSSize *)advances
+             count:(size_t)count
+              font:(NSFont *)font
+             color:(NSColor *)color
+          fakeBold:(BOOL)fakeBold
+        boldOffset:(CGFloat)boldOffset
+        fakeItalic:(BOOL)fakeItalic
+         antiAlias:(BOOL)antiAlias
+             scale:(CGFloat)scale
+                 x:(CGFloat)x
+                 y:(CGFloat)y
+         inContext:(CGContextRef)ctx
+{
+    // Quantize the color to 8 bits per component so it can be part of the key, and draw with the
+    // quantized value so cached and fresh glyphs look the same.
+    NSColor *rgbColor = [color colorUsingColorSpaceName:NSCalibratedRGBColorSpace];
+    CGFloat components[4] = { 0, 0, 0, 1 };
+    [rgbColor getRed:&components[0] green:&components[1] blue:&components[2] alpha:&components[3]];
+    uint32_t rgba = 0;
+    for (int i = 0; i < 4; i++) {
+        int value = round(MAX(0, MIN(1, components[i])) * 255);
+        rgba = (rgba << 8) | value;
+        components[i] = value / 255.0;
+    }
+
+    struct GlyphAtlasKey key;
+    memset(&key, 0, sizeof(key));
+    key.font = font;
+    key.rgba = rgba;
+    key.scale = scale;
+    key.boldOffset = fakeBold ? boldOffset : 0;
+    key.fakeBold = fakeBold;
+    key.fakeItalic = fakeItalic;
+    key.antiAlias = antiAlias;
+
+    if ([entries_ count] > kMaxGlyphAtlasEntries) {
+        [entries_ removeAllObjects];
+    }
+
+    // Images are drawn right side up, so undo the view's flip around the baseline. Snap the
+    // baseline to a device pixel so the bitmaps aren't resampled.
+    CGContextSaveGState(ctx);
+    CGContextTranslateCTM(ctx, x, round(y * scale) / scale);
+    CGContextScaleCTM(ctx, 1, -1);
+    CGContextSetInterpolationQuality(ctx, kCGInterpolationNone);
+    CGFloat penX = 0;
+    for (size_t i = 0; i < count; i++) {
+        key.glyph = glyphs[i];
+        NSData *keyData = [[NSData alloc] initWithBytesNoCopy:&key length:sizeof(key) freeWhenDone:NO];
+        GlyphAtlasEntry *entry = [entries_ objectForKey:keyData];
+        if (!entry) {
+            entry = [self _newEntryForKey:&key font:font components:components];
+            NSData *storedKey = [[NSData alloc] initWithBytes:&key length:sizeof(key)];
+            [entries_ setObject:entry forKey:storedKey];
+            [storedKey release];
+            [entry release];
+        }
+        [keyData release];
+        if (entry->image_) {
+            CGContextDrawImage(ctx, CGRectOffset(entry->rect_, penX, 0), entry->image_);
+        }
+        penX += advances[i].width;
+    }
+    CGContextRestoreGState(ctx);
+}
+
+@end
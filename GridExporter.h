@@ -0,0 +1,82 @@
+//
+//  GridExporter.h
+//  iTerm
+//
+//  Mirrors a session's visible grid into a memory-mapped file so other processes (test automation,
+//  screen readers) can read the screen without AppleScript or any work on our main thread.
+//
+//  Turned on for all sessions by setting the GridExportDirectory user default to an existing
+//  directory. Each session then maps <GridExportDirectory>/<tty name>.grid (e.g., ttys003.grid),
+//  which is removed when the session ends. The file is laid out as:
+//
+//    GridExportHeader
+//    uint64_t dirtyRows[(height + 63) / 64]    Bit y % 64 of word y / 64 is set if row y changed
+//                                              in the latest generation.
+//    GridExportCell cells[height][width]       Row-major, top row first.
+//
+//  All fields are little-endian. The header's generation is odd while an update is being written
+//  and even otherwise. A reader should read the generation, copy what it wants, and start over if
+//  the generation was odd or has since changed. If width or height has changed the file size has
+//  too and the reader must remap it.
+//
+
+#import <Foundation/Foundation.h>
+#import "ScreenChar.h"
+
+#define kGridExportMagic 0x78475469  // "iTGx"
+#define kGridExportVersion 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint32_t cellSize;       // sizeof(GridExportCell)
+    uint32_t cursorX;        // Zero-based.
+    uint32_t cursorY;
+    uint32_t reserved;
+    volatile uint64_t generation;
+} GridExportHeader;
+
+// Attribute bits of GridExportCell.
+enum {
+    kGridExportCellBold = 1,
+    kGridExportCellItalic = 2,
+    kGridExportCellBlink = 4,
+    kGridExportCellUnderline = 8,
+    kGridExportCellCombined = 16,  // codePoint is only the first of several (e.g., combining marks).
+};
+
+typedef struct {
+    uint32_t codePoint;        // 0 if nothing was ever written to the cell.
+    uint8_t foreground[3];     // Color index (or red, green, blue for 24-bit color).
+    uint8_t background[3];
+    uint8_t colorModes;        // screen_char_t foregroundColorMode | backgroundColorMode << 2
+    uint8_t attributes;        // kGridExportCell...
+} GridExportCell;
+
+@interface GridExporter : NSObject {
+    NSString *path_;
+    int fd_;
+    void *map_;
+    size_t mapLength_;
+    int width_;
+    int height_;
+    screen_char_t *mirror_;    // The rows as of the last export, to find which have changed.
+}
+
+// Returns nil if the file can't be created.
+- (id)initWithPath:(NSString *)path;
+
+// Copies changed rows into the file and starts a new generation if any changed. |lines| returns
+// the screen line (at least |width| chars) for each row in [0, height).
+- (void)exportWidth:(int)width
+             height:(int)height
+            cursorX:(int)cursorX
+            cursorY:(int)cursorY
+              lines:(screen_char_t *(^)(int y))lines;
+
+// Unmaps and deletes the file.
+- (void)close;
+
+@end
@@ -0,0 +1,169 @@
+//
+//  GridExporter.m
+//  iTerm
+//
+
+#import "GridExporter.h"
+#import "DebugLogging.h"
+#include <libkern/OSAtomic.h>
+#include <sys/mman.h>
+
+static size_t GridExportDirtyWords(int height) {
+    return (height + 63) / 64;
+}
+
+static size_t GridExportLength(int width, int height) {
+    return sizeof(GridExportHeader) +
+           GridExportDirtyWords(height) * sizeof(uint64_t) +
+           (size_t)width * height * sizeof(GridExportCell);
+}
+
+static void GridExportCopyLine(GridExportCell *dest, screen_char_t *src, int width) {
+    for (int x = 0; x < width; x++) {
+        const screen_char_t c = src[x];
+        GridExportCell *cell = &dest[x];
+        cell->codePoint = c.code ? CharToLongChar(c.code, c.complexChar) : 0;
+        cell->foreground[0] = c.foregroundColor;
+        cell->foreground[1] = c.fgGreen;
+        cell->foreground[2] = c.fgBlue;
+        cell->background[0] = c.backgroundColor;
+        cell->background[1] = c.bgGreen;
+        cell->background[2] = c.bgBlue;
+        cell->colorModes = c.foregroundColorMode | (c.backgroundColorMode << 2);
+        cell->attributes = ((c.bold ? kGridExportCellBold : 0) |
+                            (c.italic ? kGridExportCellItalic : 0) |
+                            (c.blink ? kGridExportCellBlink : 0) |
+                            (c.underline ? kGridExportCellUnderline : 0));
+        if (c.complexChar && [ComplexCharToStr(c.code) length] > (cell->codePoint > 0xffff ? 2 : 1)) {
+            cell->attributes |= kGridExportCellCombined;
+        }
+    }
+}
+
+@implementation GridExporter
+
+- (id)initWithPath:(NSString *)path
+{
+    self = [super init];
+    if (self) {
+        path_ = [path copy];
+        fd_ = open([path_ fileSystemRepresentation], O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd_ < 0) {
+            NSLog(@"Couldn't create grid export file %@: %s", path_, strerror(errno));
+            [self release];
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self close];
+    [path_ release];
+    [super dealloc];
+}
+
+- (void)exportWidth:(int)width
+             height:(int)height
+            cursorX:(int)cursorX
+            cursorY:(int)cursorY
+              lines:(screen_char_t *(^)(int y))lines
+{
+    if (fd_ < 0) {
+        return;
+    }
+    BOOL resized = NO;
+    if (width != width_ || height != height_ || !map_) {
+        if (![self mapWidth:width height:height]) {
+            return;
+        }
+        resized = YES;
+    }
+
+    GridExportHeader *header = map_;
+    uint64_t *dirtyRows = (uint64_t *)(header + 1);
+    GridExportCell *cells = (GridExportCell *)(dirtyRows + GridExportDirtyWords(height));
+
+    // Find the changed rows first so nothing is written when nothing changed.
+    BOOL anyChanged = resized;
+    BOOL changed[height];
+    for (int y = 0; y < height; y++) {
+        changed[y] = resized || memcmp(lines(y), mirror_ + y * width, width * sizeof(screen_char_t));
+        anyChanged |= changed[y];
+    }
+    if (!anyChanged && header->cursorX == cursorX && header->cursorY == cursorY) {
+        return;
+    }
+
+    // Odd while writing. A new mapping starts out odd.
+    if (!resized) {
+        header->generation++;
+    }
+    OSMemoryBarrier();
+    memset(dirtyRows, 0, GridExportDirtyWords(height) * sizeof(uint64_t));
+    for (int y = 0; y < height; y++) {
+        if (!changed[y]) {
+            continue;
+        }
+        screen_char_t *line = lines(y);
+        memcpy(mirror_ + y * width, line, width * sizeof(screen_char_t));
+        GridExportCopyLine(cells + y * width, line, width);
+        dirtyRows[y / 64] |= 1ULL << (y % 64);
+    }
+    header->cursorX = cursorX;
+    header->cursorY = cursorY;
+    OSMemoryBarrier();
+    header->generation++;
+}
+
+- (void)close
+{
+    if (map_) {
+        munmap(map_, mapLength_);
+        map_ = NULL;
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+        unlink([path_ fileSystemRepresentation]);
+    }
+    free(mirror_);
+    mirror_ = NULL;
+}
+
+#pragma mark - Private
+
+- (BOOL)mapWidth:(int)width height:(int)height
+{
+    uint64_t generation = map_ ? ((GridExportHeader *)map_)->generation : 0;
+    if (map_) {
+        munmap(map_, mapLength_);
+        map_ = NULL;
+    }
+    mapLength_ = GridExportLength(width, height);
+    if (ftruncate(fd_, mapLength_) ||
+        (map_ = mmap(NULL, mapLength_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0)) == MAP_FAILED) {
+        DLog(@"Couldn't map grid export file %@: %s", path_, strerror(errno));
+        map_ = NULL;
+        return NO;
+    }
+    width_ = width;
+    height_ = height;
+    free(mirror_);
+    mirror_ = calloc((size_t)width * height, sizeof(screen_char_t));
+
+    GridExportHeader *header = map_;
+    // Keep counting from where the old mapping left off so readers see a change, and mark it as
+    // being written until the first export into it is done.
+    header->generation = generation | 1;
+    OSMemoryBarrier();
+    header->magic = kGridExportMagic;
+    header->version = kGridExportVersion;
+    header->width = width;
+    header->height = height;
+    header->cellSize = sizeof(GridExportCell);
+    return YES;
+}
+
+@end
@@ -337,6 +337,12 @@ enum {
     return nil;
 }
 
+// The action highlights every match on the screen, not just the one that fired it.
+- (BOOL)isIdempotent
+{
+    return YES;
+}
+
 - (void)performActionWithValues:(NSArray *)values inSession:(PTYSession *)aSession
 {
     [[aSession SCREEN] highlightTextMatchingRegex:self.regex
@@ -3,6 +3,7 @@
 
 @class PseudoTerminal;
 @class GTMCarbonHotKey;
+@class MovingAverage;
 
 @interface HotkeyWindowController : NSObject {
     // Set while window is appearing.
@@ -23,6 +24,13 @@
     // When using an event tap, these will be set:
     CFMachPortRef machPortRef_;
     CFRunLoopSourceRef eventSrc_;
+
+    // Show latency: from the hotkey being handled to the window being ordered front.
+    NSTimeInterval showStart_;  // 0 if not showing.
+    NSTimeInterval lastShowLatency_;
+    MovingAverage *showLatency_;
+    long long numberOfShows_;
+    long long numberOfWarmShows_;  // Shows of a window that already existed.
 }
 
 + (id)sharedInstance;
@@ -41,4 +49,17 @@
 - (void)beginRemappingModifiers;
 - (void)stopEventTap;
 
+// If the PrewarmHotkeyWindow user default is set, the hotkey window is created hidden when the
+// app starts instead of on the first press of the hotkey, and its sessions are kept drawn while
+// it's hidden so that showing it doesn't wait for a redraw.
+- (BOOL)prewarmsHotkeyWindow;
+- (void)prewarmHotkeyWindowIfNeeded;
+
+// Counters for tuning. Keys:
+//   "shows": Times the hotkey window was shown.
+//   "warmShows": Shows of a window that already existed.
+//   "lastShowLatency": Seconds from the hotkey to ordering the window front, last time.
+//   "showLatency": Moving average of the above.
+- (NSDictionary *)statistics;
+
 @end
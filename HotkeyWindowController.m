@@ -6,6 +6,7 @@
 #import "iTermApplicationDelegate.h"
 #import "iTermController.h"
 #import "iTermKeyBindingMgr.h"
+#import "MovingAverage.h"
 #import "PseudoTerminal.h"
 #import "PTYTab.h"
 #import "SBSystemPreferences.h"
@@ -14,6 +15,10 @@
 
 #define HKWLog DLog
 
+@interface HotkeyWindowController ()
+- (void)hotkeyWindowDidOrderFront;
+@end
+
 @implementation HotkeyWindowController
 
 + (HotkeyWindowController *)sharedInstance {
@@ -25,6 +30,21 @@
     return instance;
 }
 
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        showLatency_ = [[MovingAverage alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [showLatency_ release];
+    [super dealloc];
+}
+
 static PseudoTerminal* GetHotkeyWindow()
 {
     iTermController* cont = [iTermController sharedInstance];
@@ -55,6 +75,7 @@ static void RollInHotkeyTerm(PseudoTerminal* term)
     [NSApp activateIgnoringOtherApps:YES];
     [[term window] setFrame:rect display:YES];
     [[term window] makeKeyAndOrderFront:nil];
+    [[HotkeyWindowController sharedInstance] hotkeyWindowDidOrderFront];
     switch ([term windowType]) {
         case WINDOW_TYPE_NORMAL:
             rect.origin.x = -rect.size.width;
@@ -121,9 +142,21 @@ static void RollInHotkeyTerm(PseudoTerminal* term)
     [[term window] makeFirstResponder:[[term currentSession] TEXTVIEW]];
 }
 
-static BOOL OpenHotkeyWindow()
+- (void)hotkeyWindowDidOrderFront
+{
+    if (!showStart_) {
+        return;
+    }
+    lastShowLatency_ = [NSDate timeIntervalSinceReferenceDate] - showStart_;
+    showStart_ = 0;
+    [showLatency_ addValue:lastShowLatency_];
+    HKWLog(@"Hotkey window ordered front %0.1fms after the hotkey", lastShowLatency_ * 1000);
+}
+
+// Creates the hotkey window, placed offscreen (or transparent, for full screen) so it can be rolled
+// in. Returns nil if there's no hotkey profile.
+static PseudoTerminal *CreateHotkeyWindow(BOOL makeKey)
 {
-    HKWLog(@"Open hotkey window");
     iTermController* cont = [iTermController sharedInstance];
     Profile* bookmark = [[PreferencePanel sharedInstance] hotkeyBookmark];
     if (bookmark) {
@@ -139,7 +172,7 @@ static BOOL OpenHotkeyWindow()
                                         inTerminal:nil
                                            withURL:nil
                                           isHotkey:YES
-                                           makeKey:YES];
+                                           makeKey:makeKey];
         PseudoTerminal* term = [[iTermController sharedInstance] terminalWithSession:session];
         [term setIsHotKeyWindow:YES];
 
@@ -161,10 +194,57 @@ static BOOL OpenHotkeyWindow()
             }
             [[term window] setCollectionBehavior:[[term window] collectionBehavior] & ~NSWindowCollectionBehaviorFullScreenPrimary];
         }
-        RollInHotkeyTerm(term);
-        return YES;
+        return term;
+    }
+    return nil;
+}
+
+static BOOL OpenHotkeyWindow()
+{
+    HKWLog(@"Open hotkey window");
+    PseudoTerminal *term = CreateHotkeyWindow(YES);
+    if (!term) {
+        return NO;
+    }
+    RollInHotkeyTerm(term);
+    return YES;
+}
+
+- (BOOL)prewarmsHotkeyWindow
+{
+    return [[NSUserDefaults standardUserDefaults] boolForKey:@"PrewarmHotkeyWindow"];
+}
+
+- (void)prewarmHotkeyWindowIfNeeded
+{
+    PreferencePanel *prefPanel = [PreferencePanel sharedInstance];
+    if (![self prewarmsHotkeyWindow] ||
+        ![prefPanel hotkey] ||
+        ![prefPanel hotkeyTogglesWindow] ||
+        GetHotkeyWindow()) {
+        return;
+    }
+    HKWLog(@"Prewarm hotkey window");
+    PseudoTerminal *term = CreateHotkeyWindow(NO);
+    if (!term) {
+        return;
     }
-    return NO;
+    // Hidden the same way as after it's rolled out, so the hotkey shows it as an existing window.
+    BOOL temp = [term isHotKeyWindow];
+    [term setIsHotKeyWindow:NO];
+    [[term window] setAlphaValue:0];
+    [[term window] orderOut:nil];
+    [term setIsHotKeyWindow:temp];
+}
+
+- (NSDictionary *)statistics
+{
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+               [NSNumber numberWithLongLong:numberOfShows_], @"shows",
+               [NSNumber numberWithLongLong:numberOfWarmShows_], @"warmShows",
+               [NSNumber numberWithDouble:lastShowLatency_], @"lastShowLatency",
+               [NSNumber numberWithDouble:showLatency_.value], @"showLatency",
+               nil];
 }
 
 - (void)showNonHotKeyWindowsAndSetAlphaTo:(float)a
@@ -277,11 +357,14 @@ static void RollOutHotkeyTerm(PseudoTerminal* term, BOOL itermWasActiveWhenHotke
 
 - (void)showHotKeyWindow
 {
+    showStart_ = [NSDate timeIntervalSinceReferenceDate];
+    numberOfShows_++;
     [[iTermController sharedInstance] storePreviouslyActiveApp];
     itermWasActiveWhenHotkeyOpened_ = [NSApp isActive];
     PseudoTerminal* hotkeyTerm = GetHotkeyWindow();
     if (hotkeyTerm) {
         HKWLog(@"Showing existing hotkey window");
+        numberOfWarmShows_++;
         int i = 0;
         [[iTermController sharedInstance] setKeyWindowIndexMemo:-1];
         for (PseudoTerminal* term in [[iTermController sharedInstance] terminals]) {
@@ -0,0 +1,59 @@
+//
+//  InputLatencyProfiler.h
+//  iTerm
+//
+//  Times the stages between a keystroke and the drawing of its echo.
+//
+
+#import <Foundation/Foundation.h>
+#include <libkern/OSAtomic.h>
+
+// The stages are reached in this order. Each is stamped for the first time it happens after the
+// one before it.
+typedef enum {
+    kInputLatencyStageKeyDown,       // -[PTYTextView keyDown:]
+    kInputLatencyStageSessionWrite,  // PTYSession queued the bytes for its task.
+    kInputLatencyStagePtyWrite,      // -[PTYTask processWrite] wrote to the pty.
+    kInputLatencyStagePtyRead,       // -[PTYTask processRead] next read output.
+    kInputLatencyStageParsed,        // PTYSession handled that output.
+    kInputLatencyStageDrawn,         // -[PTYTextView drawRect:] finished.
+    kInputLatencyNumberOfStages
+} InputLatencyStage;
+
+#define kInputLatencyProfilerHistorySize 256
+
+// Follows one keystroke at a time through the stages, starting with the first keystroke after the
+// last one finished or was abandoned. A keystroke whose echo isn't drawn within a second is
+// abandoned. Each finished sample adds the time between consecutive stages to a history, and every
+// 32 samples the 50th, 90th, and 99th percentiles are logged with DLog. PtyWrite to PtyRead is the
+// round trip through the program (and the network, for ssh). The other intervals are local.
+//
+// Sampling is on when debug logging is or the hidden "ProfileInputLatency" preference is set.
+// May be used from any thread. Sessions are compared by pointer only and are never retained.
+@interface InputLatencyProfiler : NSObject {
+    OSSpinLock lock_;
+    BOOL enabledByPreference_;
+
+    // The sample in progress. session_ is nil when there isn't one.
+    volatile id session_;
+    InputLatencyStage nextStage_;
+    NSTimeInterval times_[kInputLatencyNumberOfStages];
+
+    // Ring buffer of durations between stage i and i+1, in seconds.
+    NSTimeInterval history_[kInputLatencyNumberOfStages - 1][kInputLatencyProfilerHistorySize];
+    NSTimeInterval totalHistory_[kInputLatencyProfilerHistorySize];
+    long long numSamples_;
+}
+
++ (InputLatencyProfiler *)sharedInstance;
+
+// Starts a sample for a keystroke in |session| unless one is in progress or sampling is off.
+- (void)keyDownInSession:(id)session;
+
+// Stamps |stage| if it's next for the sample in progress in |session|. Cheap when there's none.
+- (void)recordStage:(InputLatencyStage)stage forSession:(id)session;
+
+// Multi-line description of the percentiles.
+- (NSString *)summary;
+
+@end
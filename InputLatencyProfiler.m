@@ -0,0 +1,132 @@
+//
+//  InputLatencyProfiler.m
+//  iTerm
+//
+
+#import "InputLatencyProfiler.h"
+#import "DebugLogging.h"
+
+// A sample that hasn't been drawn after this long is dropped.
+static const NSTimeInterval kInputLatencyProfilerTimeout = 1;
+
+// Percentiles are logged after every this many samples.
+static const int kInputLatencyProfilerLogInterval = 32;
+
+// Name of the interval that ends at each stage.
+static NSString *const kIntervalNames[kInputLatencyNumberOfStages - 1] = {
+    @"keyDown->write",
+    @"write->pty",
+    @"pty->read",
+    @"read->parsed",
+    @"parsed->drawn"
+};
+
+static int InputLatencyCompareTimes(const void *a, const void *b) {
+    NSTimeInterval x = *(const NSTimeInterval *)a;
+    NSTimeInterval y = *(const NSTimeInterval *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+@implementation InputLatencyProfiler
+
++ (InputLatencyProfiler *)sharedInstance
+{
+    static InputLatencyProfiler *instance;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        instance = [[InputLatencyProfiler alloc] init];
+    });
+    return instance;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        lock_ = OS_SPINLOCK_INIT;
+        enabledByPreference_ =
+            [[NSUserDefaults standardUserDefaults] boolForKey:@"ProfileInputLatency"];
+    }
+    return self;
+}
+
+- (void)keyDownInSession:(id)session
+{
+    if (!gDebugLogging && !enabledByPreference_) {
+        return;
+    }
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    OSSpinLockLock(&lock_);
+    if (!session_ || now - times_[kInputLatencyStageKeyDown] > kInputLatencyProfilerTimeout) {
+        session_ = session;
+        times_[kInputLatencyStageKeyDown] = now;
+        nextStage_ = kInputLatencyStageSessionWrite;
+    }
+    OSSpinLockUnlock(&lock_);
+}
+
+- (void)recordStage:(InputLatencyStage)stage forSession:(id)session
+{
+    if (session_ != session || !session) {
+        return;
+    }
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    BOOL shouldLog = NO;
+    OSSpinLockLock(&lock_);
+    if (session_ == session && nextStage_ == stage) {
+        times_[stage] = now;
+        if (stage == kInputLatencyStageDrawn) {
+            const int index = numSamples_ % kInputLatencyProfilerHistorySize;
+            for (int i = 0; i < kInputLatencyNumberOfStages - 1; i++) {
+                history_[i][index] = times_[i + 1] - times_[i];
+            }
+            totalHistory_[index] = now - times_[kInputLatencyStageKeyDown];
+            numSamples_++;
+            shouldLog = (numSamples_ % kInputLatencyProfilerLogInterval) == 0;
+            session_ = nil;
+        } else {
+            nextStage_ = stage + 1;
+        }
+    }
+    OSSpinLockUnlock(&lock_);
+
+    if (shouldLog) {
+        DLog(@"Input latency:\n%@", [self summary]);
+    }
+}
+
+// Must be called with lock_ held.
+- (NSString *)_percentilesOfTimes:(const NSTimeInterval *)times count:(int)count
+{
+    NSTimeInterval *sorted = malloc(count * sizeof(NSTimeInterval));
+    memcpy(sorted, times, count * sizeof(NSTimeInterval));
+    qsort(sorted, count, sizeof(NSTimeInterval), InputLatencyCompareTimes);
+    NSString *result = [NSString stringWithFormat:@"%7.1f %7.1f %7.1f",
+                        sorted[count * 50 / 100] * 1000,
+                        sorted[count * 90 / 100] * 1000,
+                        sorted[count * 99 / 100] * 1000];
+    free(sorted);
+    return result;
+}
+
+- (NSString *)summary
+{
+    OSSpinLockLock(&lock_);
+    const int count = (int)MIN(numSamples_, kInputLatencyProfilerHistorySize);
+    NSMutableString *summary =
+        [NSMutableString stringWithFormat:@"%-14s %7s %7s %7s (ms, %d samples)\n",
+         "", "p50", "p90", "p99", count];
+    if (count > 0) {
+        for (int i = 0; i < kInputLatencyNumberOfStages - 1; i++) {
+            [summary appendFormat:@"%-14s %@\n",
+             [kIntervalNames[i] UTF8String],
+             [self _percentilesOfTimes:history_[i] count:count]];
+        }
+        [summary appendFormat:@"%-14s %@", "total", [self _percentilesOfTimes:totalHistory_
+                                                                           count:count]];
+    }
+    OSSpinLockUnlock(&lock_);
+    return summary;
+}
+
+@end
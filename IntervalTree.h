@@ -1,5 +1,4 @@
 #import <Foundation/Foundation.h>
-#import "AATree.h"
 
 @class IntervalTreeEntry;
 
@@ -29,27 +28,45 @@
 + (IntervalTreeEntry *)entryWithInterval:(Interval *)interval object:(id<IntervalTreeObject>)object;
 @end
 
-@interface IntervalTreeValue : NSObject
-@property(nonatomic, assign) long long maxLimitAtSubtree;
-@property(nonatomic, retain) NSMutableArray *entries;
+// Entries are kept in two flat arrays, one sorted by location and one sorted by limit, so nothing
+// has to be allocated to search them. A segment tree over the first holds the largest limit under
+// each node, for finding the entries that intersect an interval. Adding an entry at the end, as
+// marks usually are, updates it in place; other changes rebuild it the next time it's needed.
+@interface IntervalTree : NSObject {
+    // Sorted by location, then by when they were added. Each holds a reference to its entry.
+    struct IntervalTreeSlot *_byLocation;
 
-// Largest limit of all entries
-- (long long)maxLimit;
+    // The same entries sorted by limit, then by when they were added.
+    struct IntervalTreeSlot *_byLimit;
 
-// Interval including intervals of all entries at this entry exactly
-- (Interval *)spanningInterval;
+    int _count;
+    int _capacity;  // A power of two.
 
-@end
+    // Node i covers nodes 2i and 2i+1. Leaf _capacity + j is _byLocation[j].limit.
+    long long *_maxLimits;
+    BOOL _maxLimitsValid;
 
-@interface IntervalTree : NSObject <AATreeDelegate> {
-    AATree *_tree;
-    int _count;
+    long long _generation;
 }
 
+// Changes whenever an object is added or removed. No two trees ever have the same generation, so
+// it identifies the tree's contents for caching what was found in it.
+@property(nonatomic, readonly) long long generation;
+
 // |object| should implement -hash.
 - (void)addObject:(id<IntervalTreeObject>)object withInterval:(Interval *)interval;
 - (void)removeObject:(id<IntervalTreeObject>)object;
+
+// Removes every object whose interval ends at or before |location| in one pass. Returns the
+// IntervalTreeEntry each one had, which still has its interval and object.
+- (NSArray *)removeObjectsBefore:(long long)location;
 - (NSArray *)objectsInInterval:(Interval *)interval;
+
+// Calls |block| with each object that intersects |interval|, in order of location. Allocates
+// nothing, so it's fine to use while drawing. The tree must not be changed from |block|.
+- (void)enumerateObjectsInInterval:(Interval *)interval
+                        usingBlock:(void (^)(id<IntervalTreeObject> object, BOOL *stop))block;
+
 - (NSArray *)allObjects;
 - (NSInteger)count;
 - (BOOL)containsObject:(id<IntervalTreeObject>)object;
@@ -3,6 +3,89 @@
 static const long long kMinLocation = LLONG_MIN / 2;
 static const long long kMaxLimit = kMinLocation + LLONG_MAX;
 
+struct IntervalTreeSlot {
+    long long location;
+    long long limit;
+    IntervalTreeEntry *entry;
+    id<IntervalTreeObject> object;  // Same as entry.object
+};
+
+// Returns the index of the first slot whose location (or limit, if |byLimit|) is at least |key|, or
+// is greater than |key| if |strictly|.
+static int IntervalTreeSearch(const struct IntervalTreeSlot *slots,
+                              int count,
+                              BOOL byLimit,
+                              long long key,
+                              BOOL strictly) {
+    int lo = 0;
+    int hi = count;
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2;
+        const long long value = byLimit ? slots[mid].limit : slots[mid].location;
+        if (value < key || (strictly && value == key)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Returns the index of the slot holding |entry|, whose location (or limit) is |key|, or -1.
+static int IntervalTreeIndexOfEntry(const struct IntervalTreeSlot *slots,
+                                    int count,
+                                    BOOL byLimit,
+                                    long long key,
+                                    IntervalTreeEntry *entry) {
+    for (int i = IntervalTreeSearch(slots, count, byLimit, key, NO); i < count; i++) {
+        if ((byLimit ? slots[i].limit : slots[i].location) != key) {
+            break;
+        }
+        if (slots[i].entry == entry) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void IntervalTreeSetMaxLimit(long long *maxLimits, int capacity, int index, long long limit) {
+    int node = capacity + index;
+    maxLimits[node] = limit;
+    for (node /= 2; node >= 1; node /= 2) {
+        maxLimits[node] = MAX(maxLimits[2 * node], maxLimits[2 * node + 1]);
+    }
+}
+
+// Calls |block| with each slot under |node|, which covers slots [nodeStart, nodeEnd), that comes
+// before |end| and intersects [location, limit). Returns NO if |block| asked to stop.
+static BOOL IntervalTreeEnumerateNode(const struct IntervalTreeSlot *slots,
+                                      const long long *maxLimits,
+                                      int node,
+                                      int nodeStart,
+                                      int nodeEnd,
+                                      int end,
+                                      long long location,
+                                      long long limit,
+                                      void (^block)(id<IntervalTreeObject> object, BOOL *stop)) {
+    if (nodeStart >= end || maxLimits[node] <= location) {
+        return YES;
+    }
+    if (nodeEnd - nodeStart == 1) {
+        const struct IntervalTreeSlot *slot = &slots[nodeStart];
+        if (MAX(slot->location, location) < MIN(slot->limit, limit)) {
+            BOOL stop = NO;
+            block(slot->object, &stop);
+            return !stop;
+        }
+        return YES;
+    }
+    const int middle = nodeStart + (nodeEnd - nodeStart) / 2;
+    return (IntervalTreeEnumerateNode(slots, maxLimits, 2 * node, nodeStart, middle, end,
+                                      location, limit, block) &&
+            IntervalTreeEnumerateNode(slots, maxLimits, 2 * node + 1, middle, nodeEnd, end,
+                                      location, limit, block));
+}
+
 @interface IntervalTreeForwardLimitEnumerator : NSEnumerator {
     long long previousLimit_;
     IntervalTree *tree_;
@@ -29,8 +112,8 @@ static const long long kMaxLimit = kMinLocation + LLONG_MAX;
 
 - (NSArray *)allObjects {
     NSMutableArray *result = [NSMutableArray array];
-    NSObject *o = [self nextObject];
-    while (o) {
+    NSObject *o;
+    while ((o = [self nextObject])) {
         [result addObject:o];
     }
     return result;
@@ -83,8 +166,8 @@ static const long long kMaxLimit = kMinLocation + LLONG_MAX;
 
 - (NSArray *)allObjects {
     NSMutableArray *result = [NSMutableArray array];
-    NSObject *o = [self nextObject];
-    while (o) {
+    NSObject *o;
+    while ((o = [self nextObject])) {
         [result addObject:o];
     }
     return result;
@@ -179,210 +262,149 @@ static const long long kMaxLimit = kMinLocation + LLONG_MAX;
 }
 @end
 
-@implementation IntervalTreeValue
-
-- (NSString *)description {
-    NSMutableString *entriesString = [NSMutableString string];
-    for (IntervalTreeEntry *entry in _entries) {
-        [entriesString appendFormat:@"%@, ", entry];
-    }
-    return [NSString stringWithFormat:@"<%@: %p maxLimitAtSubtree=%lld entries=[%@]>",
-            self.class,
-            self,
-            self.maxLimitAtSubtree,
-            entriesString];
-}
-
-- (id)init {
-    self = [super init];
-    if (self) {
-        _entries = [[NSMutableArray alloc] init];
-    }
-    return self;
-}
-
-- (void)dealloc {
-    [_entries release];
-    [super dealloc];
-}
-
-- (long long)maxLimit {
-    long long max = -1;
-    for (IntervalTreeEntry *entry in _entries) {
-        max = MAX(max, [entry.interval limit]);
-    }
-    return max;
-}
-
-- (long long)location {
-    long long location = ((IntervalTreeEntry *)_entries[0]).interval.location;
-    return location;
-}
-
-- (Interval *)spanningInterval {
-    return [Interval intervalWithLocation:self.location length:[self maxLimit] - self.location];
-}
-
-@end
+// The last generation given to any tree.
+static long long gIntervalTreeGeneration;
 
 @implementation IntervalTree
 
+@synthesize generation = _generation;
+
 - (id)init {
     self = [super init];
     if (self) {
-        _tree = [[AATree alloc] initWithKeyComparator:^(NSNumber *key1, NSNumber *key2) {
-            return [key1 compare:key2];
-        }];
-        assert(_tree);
-        _tree.delegate = self;
+        _generation = ++gIntervalTreeGeneration;
     }
     return self;
 }
 
 - (void)dealloc {
-    for (id<IntervalTreeObject> obj in [self objectsInInterval:[Interval maxInterval]]) {
-        obj.entry = nil;
+    for (int i = 0; i < _count; i++) {
+        _byLocation[i].object.entry = nil;
+        [_byLocation[i].entry release];
     }
-    _tree.delegate = nil;
-    [_tree release];
+    free(_byLocation);
+    free(_byLimit);
+    free(_maxLimits);
     [super dealloc];
 }
 
 - (void)addObject:(id<IntervalTreeObject>)object withInterval:(Interval *)interval {
     [interval boundsCheck];
     assert(object.entry == nil);  // Object must not belong to another tree
-    IntervalTreeEntry *entry = [IntervalTreeEntry entryWithInterval:interval
-                                                             object:object];
-    IntervalTreeValue *value = [_tree objectForKey:@(interval.location)];
-    if (!value) {
-        IntervalTreeValue *value = [[[IntervalTreeValue alloc] init] autorelease];
-        [value.entries addObject:entry];
-        [_tree setObject:value forKey:@(interval.location)];
+    if (_count == _capacity) {
+        [self growCapacity];
+    }
+    IntervalTreeEntry *entry = [[IntervalTreeEntry entryWithInterval:interval
+                                                              object:object] retain];
+    struct IntervalTreeSlot slot = {
+        .location = interval.location,
+        .limit = interval.limit,
+        .entry = entry,
+        .object = object
+    };
+    const int i = IntervalTreeSearch(_byLocation, _count, NO, slot.location, YES);
+    memmove(_byLocation + i + 1, _byLocation + i, (_count - i) * sizeof(slot));
+    _byLocation[i] = slot;
+    const int j = IntervalTreeSearch(_byLimit, _count, YES, slot.limit, YES);
+    memmove(_byLimit + j + 1, _byLimit + j, (_count - j) * sizeof(slot));
+    _byLimit[j] = slot;
+    ++_count;
+
+    if (_maxLimitsValid && i == _count - 1) {
+        IntervalTreeSetMaxLimit(_maxLimits, _capacity, i, slot.limit);
     } else {
-        [value.entries addObject:entry];
-        [_tree notifyValueChangedForKey:@(interval.location)];
+        _maxLimitsValid = NO;
     }
     object.entry = entry;
-    ++_count;
+    _generation = ++gIntervalTreeGeneration;
 }
 
 - (void)removeObject:(id<IntervalTreeObject>)object {
-    Interval *interval = object.entry.interval;
-    long long theLocation = interval.location;
-    IntervalTreeValue *value = [_tree objectForKey:@(interval.location)];
-    NSMutableArray *entries = value.entries;
-    IntervalTreeEntry *entry = nil;
-    int i;
-    for (i = 0; i < entries.count; i++) {
-        if ([((IntervalTreeEntry *)entries[i]).object isEqual:object]) {
-            entry = entries[i];
-            break;
-        }
-    }
-    if (entry) {
-        assert(object.entry == entry);  // Was object added to another tree before being removed from this one?
-        object.entry = nil;
-        [entries removeObjectAtIndex:i];
-        if (entries.count == 0) {
-            [_tree removeObjectForKey:@(theLocation)];
-        } else {
-            [_tree notifyValueChangedForKey:@(theLocation)];
-        }
-        --_count;
-    }
-}
-
-#pragma mark - Private
-
-- (void)recalculateMaxLimitInSubtreeAtNode:(AATreeNode *)node
-                     removeFromToVisitList:(NSMutableSet *)toVisit {
-    IntervalTreeValue *value = (IntervalTreeValue *)node.data;
-    if (![toVisit containsObject:node]) {
+    IntervalTreeEntry *entry = object.entry;
+    if (!entry) {
         return;
     }
-    
-    [toVisit removeObject:node];
-    long long max = [value maxLimit];
-    if (node.left) {
-        if ([toVisit containsObject:node.left]) {
-            [self recalculateMaxLimitInSubtreeAtNode:node.left
-                               removeFromToVisitList:toVisit];
-        }
-        IntervalTreeValue *leftValue = (IntervalTreeValue *)node.left.data;
-        max = MAX(max, leftValue.maxLimitAtSubtree);
+    const int i = IntervalTreeIndexOfEntry(_byLocation, _count, NO, entry.interval.location, entry);
+    if (i < 0) {
+        return;
     }
-    if (node.right) {
-        if ([toVisit containsObject:node.right]) {
-            [self recalculateMaxLimitInSubtreeAtNode:node.right
-                               removeFromToVisitList:toVisit];
-        }
-        IntervalTreeValue *rightValue = (IntervalTreeValue *)node.right.data;
-        max = MAX(max, rightValue.maxLimitAtSubtree);
+    const int j = IntervalTreeIndexOfEntry(_byLimit, _count, YES, _byLocation[i].limit, entry);
+    assert(j >= 0);
+    --_count;
+    memmove(_byLocation + i, _byLocation + i + 1, (_count - i) * sizeof(*_byLocation));
+    memmove(_byLimit + j, _byLimit + j + 1, (_count - j) * sizeof(*_byLimit));
+
+    if (_maxLimitsValid && i == _count) {
+        IntervalTreeSetMaxLimit(_maxLimits, _capacity, i, LLONG_MIN);
+    } else {
+        _maxLimitsValid = NO;
     }
-    value.maxLimitAtSubtree = max;
+    object.entry = nil;
+    [entry release];
+    _generation = ++gIntervalTreeGeneration;
 }
 
-#pragma mark - AATreeDelegate
+- (NSArray *)removeObjectsBefore:(long long)location {
+    // The objects to remove are a prefix of _byLimit.
+    const int numRemoved = IntervalTreeSearch(_byLimit, _count, YES, location, YES);
+    if (!numRemoved) {
+        return @[];
+    }
+    NSMutableArray *removed = [NSMutableArray arrayWithCapacity:numRemoved];
+    for (int i = 0; i < numRemoved; i++) {
+        [removed addObject:_byLimit[i].entry];
+    }
+    memmove(_byLimit, _byLimit + numRemoved, (_count - numRemoved) * sizeof(*_byLimit));
 
-- (void)aaTree:(AATree *)tree didChangeSubtreesAtNodes:(NSSet *)changedNodes {
-    NSMutableSet *toVisit = [[changedNodes mutableCopy] autorelease];
-    for (AATreeNode *node in changedNodes) {
-        if ([toVisit containsObject:node]) {
-            [self recalculateMaxLimitInSubtreeAtNode:node
-                               removeFromToVisitList:toVisit];
+    // They all start at or before |location| too, so only that part of _byLocation needs
+    // compacting.
+    const int end = IntervalTreeSearch(_byLocation, _count, NO, location, YES);
+    int kept = 0;
+    for (int i = 0; i < end; i++) {
+        if (_byLocation[i].limit > location) {
+            _byLocation[kept++] = _byLocation[i];
+        } else {
+            _byLocation[i].object.entry = nil;
+            [_byLocation[i].entry release];
         }
     }
-}
+    assert(kept == end - numRemoved);
+    memmove(_byLocation + kept, _byLocation + end, (_count - end) * sizeof(*_byLocation));
+    _count -= numRemoved;
 
-- (void)aaTree:(AATree *)tree didChangeValueAtNode:(AATreeNode *)node {
-    NSArray *parents = [tree pathFromNode:node];
-    NSMutableSet *parentSet = [NSMutableSet setWithArray:parents];
-    for (AATreeNode *node in parents) {
-        [self recalculateMaxLimitInSubtreeAtNode:node
-                           removeFromToVisitList:parentSet];
-    }
+    _maxLimitsValid = NO;
+    _generation = ++gIntervalTreeGeneration;
+    return removed;
 }
 
-- (void)addObjectsInInterval:(Interval *)interval
-                     toArray:(NSMutableArray *)result
-                    fromNode:(AATreeNode *)node {
-    IntervalTreeValue *nodeValue = (IntervalTreeValue *)node.data;
-    if (nodeValue.maxLimitAtSubtree <= interval.location) {
-        // The whole subtree has intervals that end before the requested |interval|.
+- (void)enumerateObjectsInInterval:(Interval *)interval
+                        usingBlock:(void (^)(id<IntervalTreeObject> object, BOOL *stop))block {
+    if (!_count) {
         return;
     }
-    
-    Interval *nodeInterval = [nodeValue spanningInterval];
-    if ([nodeInterval intersects:interval]) {
-        // An entry at this node could possibly intersect the desired interval.
-        for (IntervalTreeEntry *entry in nodeValue.entries) {
-            if ([entry.interval intersects:interval]) {
-                [result addObject:entry.object];
-            }
-        }
-    }
-    if (node.left) {
-        // The requested interval includes points before this node's interval so we must search
-        // intervals that start before this node.
-        [self addObjectsInInterval:interval
-                           toArray:result
-                          fromNode:node.left];
-    }
-    if (interval.limit > nodeInterval.location && node.right) {
-        [self addObjectsInInterval:interval
-                           toArray:result
-                          fromNode:node.right];
-    }
+    [self updateMaxLimitsIfNeeded];
+    const long long location = interval.location;
+    const long long limit = interval.limit;
+    // Only slots before |end| start before |limit|.
+    const int end = IntervalTreeSearch(_byLocation, _count, NO, limit, NO);
+    IntervalTreeEnumerateNode(_byLocation, _maxLimits, 1, 0, _capacity, end, location, limit, block);
 }
 
 - (NSArray *)objectsInInterval:(Interval *)interval {
     NSMutableArray *array = [NSMutableArray array];
-    [self addObjectsInInterval:interval toArray:array fromNode:_tree.root];
+    [self enumerateObjectsInInterval:interval
+                          usingBlock:^(id<IntervalTreeObject> object, BOOL *stop) {
+                              [array addObject:object];
+                          }];
     return array;
 }
 
 - (NSArray *)allObjects {
-    return [self objectsInInterval:[Interval maxInterval]];
+    NSMutableArray *array = [NSMutableArray arrayWithCapacity:_count];
+    for (int i = 0; i < _count; i++) {
+        [array addObject:_byLocation[i].object];
+    }
+    return array;
 }
 
 - (NSInteger)count {
@@ -390,290 +412,31 @@ static const long long kMaxLimit = kMinLocation + LLONG_MAX;
 }
 
 - (NSString *)description {
-    return [NSString stringWithFormat:@"<%@: %p tree=%@>", self.class, self, _tree];
+    return [NSString stringWithFormat:@"<%@: %p count=%d>", self.class, self, _count];
 }
 
 - (BOOL)containsObject:(id<IntervalTreeObject>)object {
-    IntervalTreeValue *value = [_tree objectForKey:@(object.entry.interval.location)];
-    for (IntervalTreeEntry *entry in value.entries) {
-        if (entry.object == object) {
-            return YES;
-        }
+    IntervalTreeEntry *entry = object.entry;
+    if (!entry) {
+        return NO;
     }
-    return NO;
-}
-
-- (NSArray *)objectsWithLargestLimitFromNode:(AATreeNode *)node {
-    if (!node) {
-        return nil;
-    }
-    long long myMaxLimit = ((IntervalTreeValue *)node.data).maxLimit;
-    long long leftMaxLimit = ((IntervalTreeValue *)node.left.data).maxLimitAtSubtree;
-    long long rightMaxLimit = ((IntervalTreeValue *)node.right.data).maxLimitAtSubtree;
-    long long bestLimit = MAX(MAX(myMaxLimit, leftMaxLimit), rightMaxLimit);
-
-    NSMutableArray *objects = [NSMutableArray array];
-    if (myMaxLimit == bestLimit) {
-        IntervalTreeValue *value = node.data;
-        long long maxLimit = LLONG_MIN;
-        for (IntervalTreeEntry *entry in value.entries) {
-            if (entry.interval.limit > maxLimit) {
-                [objects removeAllObjects];
-                [objects addObject:entry.object];
-                maxLimit = entry.interval.limit;
-            } else if (entry.interval.limit == maxLimit) {
-                [objects addObject:entry.object];
-            }
-        }
-    }
-    if (leftMaxLimit == bestLimit) {
-        [objects addObjectsFromArray:[self objectsWithLargestLimitFromNode:node.left]];
-    }
-    if (rightMaxLimit == bestLimit) {
-        [objects addObjectsFromArray:[self objectsWithLargestLimitFromNode:node.right]];
-    }
-    return objects.count ? objects : nil;
-}
-
-- (NSArray *)objectsWithSmallestLimitFromNode:(AATreeNode *)node {
-    if (!node) {
-        return nil;
-    }
-    // Searching for the smallest limit among node, node.left subtree, and node.right subtree
-    // If node's key >= node.left's first object, don't search right subtree
-
-    NSArray *objectsFromLeft = nil;
-    if (node.left) {
-        objectsFromLeft = [self objectsWithSmallestLimitFromNode:node.left];
-    }
-    
-    Interval *nodeInterval = nil;
-    NSMutableArray *myObjects = [NSMutableArray array];
-    // Set nodeInterval to the best interval in this node's value.
-    IntervalTreeValue *nodeValue = (IntervalTreeValue *)node.data;
-    for (IntervalTreeEntry *entry in nodeValue.entries) {
-        if (!nodeInterval) {
-            [myObjects addObject:entry.object];
-            nodeInterval = entry.interval;
-        } else if (entry.interval.limit < nodeInterval.limit) {
-            [myObjects removeAllObjects];
-            [myObjects addObject:entry.object];
-            nodeInterval = entry.interval;
-        } else if (nodeInterval && entry.interval.limit == nodeInterval.limit) {
-            [myObjects addObject:entry.object];
-        }
-    }
-    
-    NSArray *objectsFromRight = nil;
-    id<IntervalTreeObject> leftValue = objectsFromLeft[0];
-    if (node.right &&
-        (!objectsFromLeft.count || nodeInterval.location < leftValue.entry.interval.limit)) {
-        objectsFromRight = [self objectsWithSmallestLimitFromNode:node.right];
-    }
-    
-    id<IntervalTreeObject> rightValue = objectsFromRight[0];
-    long long selfLimit = LLONG_MAX, leftLimit = LLONG_MAX, rightLimit = LLONG_MAX;
-    if (nodeInterval) {
-        selfLimit = nodeInterval.limit;
-    }
-    if (objectsFromLeft) {
-        leftLimit = leftValue.entry.interval.limit;
-    }
-    if (objectsFromRight) {
-        rightLimit = rightValue.entry.interval.limit;
-    }
-    long long bestLimit = MIN(MIN(selfLimit, leftLimit), rightLimit);
-    NSMutableArray *result = [NSMutableArray array];
-    if (selfLimit == bestLimit) {
-        [result addObjectsFromArray:myObjects];
-    }
-    if (leftLimit == bestLimit) {
-        [result addObjectsFromArray:objectsFromLeft];
-    }
-    if (rightLimit == bestLimit) {
-        [result addObjectsFromArray:objectsFromRight];
-    }
-    return result.count ? result : nil;
+    return IntervalTreeIndexOfEntry(_byLocation, _count, NO, entry.interval.location, entry) >= 0;
 }
 
 - (NSArray *)objectsWithSmallestLimit {
-    return [self objectsWithSmallestLimitFromNode:_tree.root];
+    return [self objectsWithSameLimitAsSlotAtIndex:0];
 }
 
 - (NSArray *)objectsWithLargestLimit {
-    return [self objectsWithLargestLimitFromNode:_tree.root];
-}
-
-- (NSArray *)objectsWithSmallestLimitAfter:(long long)bound fromNode:(AATreeNode *)node {
-    if (!node) {
-        return nil;
-    }
-    // we can ignore all subtrees whose maxLimitAtSubtree is <= bound
-    Interval *nodeInterval = nil;
-    // Set nodeInterval to the best interval in this node's value.
-    IntervalTreeValue *nodeValue = (IntervalTreeValue *)node.data;
-    NSMutableArray *myObjects = nil;
-    for (IntervalTreeEntry *entry in nodeValue.entries) {
-        if (entry.interval.limit > bound && (!nodeInterval ||
-                                             entry.interval.limit < nodeInterval.limit)) {
-            if (myObjects) {
-                [myObjects removeAllObjects];
-            } else {
-                myObjects = [NSMutableArray array];
-            }
-            nodeInterval = entry.interval;
-            [myObjects addObject:entry.object];
-        } else if (nodeInterval && entry.interval.limit == nodeInterval.limit) {
-            [myObjects addObject:entry.object];
-        }
-    }
-    
-    
-    NSArray *leftObjects = nil;
-    NSArray *rightObjects = nil;
-    
-    IntervalTreeValue *leftValue = (IntervalTreeValue *)node.left.data;
-    IntervalTreeValue *rightValue = (IntervalTreeValue *)node.right.data;
-    
-    if (node.left && leftValue.maxLimitAtSubtree > bound) {
-        leftObjects = [self objectsWithSmallestLimitAfter:bound fromNode:node.left];
-    }
-    
-    long long thisLocation = [node.key longLongValue];
-    
-    // ignore right subtree if node's location > left subtree's smallest limit and left subtree's
-    // smallest limit < bound (because every interval in the right subtree will have a limit larger
-    // than this node's location, and the left subtree has an interval that ends before that
-    // location).
-    id<IntervalTreeObject> bestLeft = leftObjects[0];
-    const BOOL thisNodesLocationIsAfterLeftSubtreesSmallestLimitAfterBound =
-        (bestLeft &&
-         thisLocation > bestLeft.entry.interval.limit &&
-         bestLeft.entry.interval.limit > bound);
-    if (node.right &&
-        rightValue.maxLimitAtSubtree > bound &&
-        !thisNodesLocationIsAfterLeftSubtreesSmallestLimitAfterBound) {
-        rightObjects = [self objectsWithSmallestLimitAfter:bound fromNode:node.right];
-    }
-    
-    id<IntervalTreeObject> bestRight = rightObjects[0];
-    long long selfLimit = LLONG_MAX, leftLimit = LLONG_MAX, rightLimit = LLONG_MAX;
-    if (nodeInterval) {
-        selfLimit = nodeInterval.limit;
-    }
-    if (bestLeft) {
-        leftLimit = bestLeft.entry.interval.limit;
-    }
-    if (bestRight) {
-        rightLimit = bestRight.entry.interval.limit;
-    }
-    long long bestLimit = MIN(MIN(selfLimit, leftLimit), rightLimit);
-    NSMutableArray *result = [NSMutableArray array];
-    if (selfLimit == bestLimit) {
-        [result addObjectsFromArray:myObjects];
-    }
-    if (leftLimit == bestLimit) {
-        [result addObjectsFromArray:leftObjects];
-    }
-    if (rightLimit == bestLimit) {
-        [result addObjectsFromArray:rightObjects];
-    }
-
-    return result.count ? result : nil;
-}
-
-- (NSArray *)objectsWithLargestLimitBelow:(long long)bound fromNode:(AATreeNode *)node {
-    if (!node) {
-        return nil;
-    }
-    Interval *nodeInterval = nil;
-    long long thisLocation = [node.key longLongValue];
-    
-    // Set nodeInterval to the best interval in this node's value.
-    IntervalTreeValue *nodeValue = (IntervalTreeValue *)node.data;
-    NSMutableArray *myObjects = nil;
-    for (IntervalTreeEntry *entry in nodeValue.entries) {
-        if (entry.interval.limit < bound && (!nodeInterval ||
-                                             entry.interval.limit > nodeInterval.limit)) {
-            if (myObjects) {
-                [myObjects removeAllObjects];
-            } else {
-                myObjects = [NSMutableArray array];
-            }
-            nodeInterval = entry.interval;
-            [myObjects addObject:entry.object];
-        } else if (nodeInterval &&
-                   entry.interval.limit == nodeInterval.limit) {
-            [myObjects addObject:entry.object];
-        }
-    }
-    
-    NSArray *leftObjects = nil;
-    NSArray *rightObjects = nil;
-    IntervalTreeValue *leftValue = (IntervalTreeValue *)node.left.data;
-    IntervalTreeValue *rightValue = (IntervalTreeValue *)node.right.data;
-
-    if (node.left) {
-        // Try to eliminate the left subtree from consideration if this node or the right subtree
-        // is superior to it.
-        const BOOL thisNodeBeatsWholeLeftSubtree = (nodeInterval &&
-                                                    nodeInterval.limit < bound &&
-                                                    nodeInterval.limit > leftValue.maxLimitAtSubtree);
-        const BOOL rightSubtreeBeatsWholeLeftSubtree = (rightValue.maxLimitAtSubtree < bound &&
-                                                        rightValue.maxLimitAtSubtree > leftValue.maxLimitAtSubtree);
-        if (!thisNodeBeatsWholeLeftSubtree && !rightSubtreeBeatsWholeLeftSubtree) {
-            leftObjects = [self objectsWithLargestLimitBelow:bound fromNode:node.left];
-        }
-    }
-    id<IntervalTreeObject> bestLeft = leftObjects[0];
-    if (thisLocation < bound && node.right) {
-        // Try to eliminate the right subtree from consideration if this node or the left subtree
-        // is superior to it.
-        const BOOL thisNodeBeatsWholeRightSubtree = (nodeInterval &&
-                                                     nodeInterval.limit < bound &&
-                                                     nodeInterval.limit > rightValue.maxLimitAtSubtree);
-        const BOOL leftSubtreeBeatsWholeRightSubtree = (leftValue &&
-                                                        leftValue.maxLimitAtSubtree < bound &&
-                                                        leftValue.maxLimitAtSubtree > rightValue.maxLimitAtSubtree);
-        if (!thisNodeBeatsWholeRightSubtree && !leftSubtreeBeatsWholeRightSubtree) {
-            rightObjects = [self objectsWithLargestLimitBelow:bound fromNode:node.right];
-        }
-    }
-    id<IntervalTreeObject> bestRight = rightObjects[0];
-
-    long long myLimit = LLONG_MIN;
-    long long leftLimit = LLONG_MIN;
-    long long rightLimit = LLONG_MIN;
-    if (bestLeft) {
-        leftLimit = bestLeft.entry.interval.limit;
-    }
-    if (bestRight) {
-        rightLimit = bestRight.entry.interval.limit;
-    }
-    if (nodeInterval && bound > nodeInterval.limit) {
-        myLimit = nodeInterval.limit;
-    }
-    long long bestLimit = MAX(MAX(leftLimit, rightLimit), myLimit);
-    
-    NSMutableArray *result = [NSMutableArray array];
-    if (myLimit == bestLimit) {
-        [result addObjectsFromArray:myObjects];
-    }
-    if (leftLimit == bestLimit) {
-        [result addObjectsFromArray:leftObjects];
-    }
-    if (rightLimit == bestLimit) {
-        [result addObjectsFromArray:rightObjects];
-    }
-    return result.count ? result : nil;
+    return [self objectsWithSameLimitAsSlotAtIndex:_count - 1];
 }
 
 - (NSArray *)objectsWithLargestLimitBefore:(long long)limit {
-    return [self objectsWithLargestLimitBelow:limit fromNode:_tree.root];
+    return [self objectsWithSameLimitAsSlotAtIndex:IntervalTreeSearch(_byLimit, _count, YES, limit, NO) - 1];
 }
 
 - (NSArray *)objectsWithSmallestLimitAfter:(long long)limit {
-    return [self objectsWithSmallestLimitAfter:limit fromNode:_tree.root];
+    return [self objectsWithSameLimitAsSlotAtIndex:IntervalTreeSearch(_byLimit, _count, YES, limit, YES)];
 }
 
 - (NSEnumerator *)reverseLimitEnumeratorAt:(long long)start {
@@ -700,51 +463,74 @@ static const long long kMaxLimit = kMinLocation + LLONG_MAX;
     return [[[IntervalTreeForwardLimitEnumerator alloc] initWithTree:self] autorelease];
 }
 
-- (long long)bruteForceMaxLimitAtSubtree:(AATreeNode *)node {
-    IntervalTreeValue *value = node.data;
-    long long result = LLONG_MIN;
-    for (IntervalTreeEntry *entry in value.entries) {
-        result = MAX(result, entry.interval.limit);
-    }
-    if (node.left) {
-        result = MAX([self bruteForceMaxLimitAtSubtree:node.left], result);
+- (void)sanityCheck {
+    for (int i = 0; i < _count; i++) {
+        assert(_byLocation[i].location == _byLocation[i].entry.interval.location);
+        assert(_byLocation[i].limit == _byLocation[i].entry.interval.limit);
+        assert(_byLocation[i].object.entry == _byLocation[i].entry);
+        assert(_byLimit[i].limit == _byLimit[i].entry.interval.limit);
+        if (i > 0) {
+            assert(_byLocation[i - 1].location <= _byLocation[i].location);
+            assert(_byLimit[i - 1].limit <= _byLimit[i].limit);
+        }
     }
-    if (node.right) {
-        result = MAX([self bruteForceMaxLimitAtSubtree:node.right], result);
+    if (_maxLimitsValid) {
+        for (int i = 0; i < _capacity; i++) {
+            assert(_maxLimits[_capacity + i] == (i < _count ? _byLocation[i].limit : LLONG_MIN));
+        }
+        for (int node = 1; node < _capacity; node++) {
+            assert(_maxLimits[node] == MAX(_maxLimits[2 * node], _maxLimits[2 * node + 1]));
+        }
     }
-    return result;
 }
 
-- (void)sanityCheckAtNode:(AATreeNode *)node {
-    IntervalTreeValue *value = node.data;
-    long long location = [(NSNumber *)node.key longLongValue];
-    assert(value.maxLimitAtSubtree = [self bruteForceMaxLimitAtSubtree:node]);
-    IntervalTreeValue *leftValue = node.left.data;
-    IntervalTreeValue *rightValue = node.right.data;
-    if (leftValue) {
-        assert([(NSNumber *)node.left.key longLongValue] < location);
-    }
-    if (rightValue) {
-        assert([(NSNumber *)node.right.key longLongValue] > location);
+- (NSString *)debugString {
+    NSMutableString *string = [NSMutableString string];
+    for (int i = 0; i < _count; i++) {
+        [string appendFormat:@"[%lld, %lld) %@\n",
+            _byLocation[i].location, _byLocation[i].limit, _byLocation[i].object];
     }
-    for (IntervalTreeEntry *entry in value.entries) {
-        assert(entry.interval.location == location);
-        assert(entry.interval.limit <= value.maxLimitAtSubtree);
+    return string;
+}
+
+#pragma mark - Private
+
+- (void)growCapacity {
+    _capacity = MAX(16, _capacity * 2);
+    _byLocation = realloc(_byLocation, _capacity * sizeof(*_byLocation));
+    _byLimit = realloc(_byLimit, _capacity * sizeof(*_byLimit));
+    _maxLimits = realloc(_maxLimits, 2 * _capacity * sizeof(*_maxLimits));
+    _maxLimitsValid = NO;
+}
+
+- (void)updateMaxLimitsIfNeeded {
+    if (_maxLimitsValid) {
+        return;
     }
-    
-    if (node.left) {
-        [self sanityCheckAtNode:node.left];
+    for (int i = 0; i < _capacity; i++) {
+        _maxLimits[_capacity + i] = i < _count ? _byLocation[i].limit : LLONG_MIN;
     }
-    if (node.right) {
-        [self sanityCheckAtNode:node.right];
+    for (int node = _capacity - 1; node >= 1; node--) {
+        _maxLimits[node] = MAX(_maxLimits[2 * node], _maxLimits[2 * node + 1]);
     }
-}
-- (void)sanityCheck {
-    [self sanityCheckAtNode:_tree.root];
+    _maxLimitsValid = YES;
 }
 
-- (NSString *)debugString {
-    return [_tree description];
+// Returns the objects whose limit equals that of _byLimit[index], or nil if |index| is out of range.
+- (NSArray *)objectsWithSameLimitAsSlotAtIndex:(int)index {
+    if (index < 0 || index >= _count) {
+        return nil;
+    }
+    const long long limit = _byLimit[index].limit;
+    int start = index;
+    while (start > 0 && _byLimit[start - 1].limit == limit) {
+        start--;
+    }
+    NSMutableArray *objects = [NSMutableArray array];
+    for (int i = start; i < _count && _byLimit[i].limit == limit; i++) {
+        [objects addObject:_byLimit[i].object];
+    }
+    return objects;
 }
 
 @end
@@ -0,0 +1,49 @@
+//
+//  LaunchScheduler.h
+//  iTerm
+//
+//  Runs the work done at launch in phases so the first window appears sooner, and times it.
+//
+
+#import <Foundation/Foundation.h>
+
+typedef enum {
+    // Needed to show the first window. Runs right away.
+    kLaunchPhaseBeforeFirstWindow,
+
+    // Runs on the main thread once the first window is up, one task per pass through the run loop
+    // so the window can draw in between.
+    kLaunchPhaseAfterFirstWindow,
+
+    // Runs on a background queue once the first window is up. Mustn't touch the UI.
+    kLaunchPhaseBackground,
+
+    kLaunchPhaseCount
+} LaunchPhase;
+
+// Each task's duration is logged with DLog. With the LogLaunchTimes user default set, a report of
+// all of them and the time to the first window is logged too once everything has run. Main thread
+// only.
+@interface LaunchScheduler : NSObject {
+    NSTimeInterval launchTime_;
+    NSTimeInterval firstWindowTime_;
+    BOOL firstWindowIsUp_;
+    NSMutableArray *deferredTasks_;   // Tasks for kLaunchPhaseAfterFirstWindow, in order.
+    NSMutableArray *timings_;         // Strings describing tasks that have run.
+    int backgroundTasksRunning_;
+}
+
++ (LaunchScheduler *)sharedInstance;
+
+// Runs |block| in |phase|, or right away if it's later than that already. |name| appears in the
+// report.
+- (void)addTaskNamed:(NSString *)name phase:(LaunchPhase)phase block:(void (^)(void))block;
+
+// Call once the first window has been opened (or it's been decided that there won't be one) to
+// start the deferred tasks. Calls after the first do nothing.
+- (void)firstWindowDidAppear;
+
+// One line per task that has run so far, with how long it took.
+- (NSString *)report;
+
+@end
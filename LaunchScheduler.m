@@ -0,0 +1,172 @@
+//
+//  LaunchScheduler.m
+//  iTerm
+//
+
+#import "LaunchScheduler.h"
+#import "DebugLogging.h"
+
+static NSString *const kLaunchPhaseNames[kLaunchPhaseCount] = {
+    @"before first window",
+    @"after first window",
+    @"background"
+};
+
+@interface LaunchSchedulerTask : NSObject {
+@public
+    NSString *name_;
+    LaunchPhase phase_;
+    void (^block_)(void);
+}
+@end
+
+@implementation LaunchSchedulerTask
+
+- (void)dealloc
+{
+    [name_ release];
+    [block_ release];
+    [super dealloc];
+}
+
+@end
+
+@implementation LaunchScheduler
+
++ (LaunchScheduler *)sharedInstance
+{
+    static LaunchScheduler *instance;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        instance = [[LaunchScheduler alloc] init];
+    });
+    return instance;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        // Close enough to when launch began, since this is made first thing.
+        launchTime_ = [NSDate timeIntervalSinceReferenceDate];
+        deferredTasks_ = [[NSMutableArray alloc] init];
+        timings_ = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [deferredTasks_ release];
+    [timings_ release];
+    [super dealloc];
+}
+
+- (void)addTaskNamed:(NSString *)name phase:(LaunchPhase)phase block:(void (^)(void))block
+{
+    if (phase == kLaunchPhaseBeforeFirstWindow ||
+        (phase == kLaunchPhaseAfterFirstWindow && firstWindowIsUp_ && ![deferredTasks_ count])) {
+        [self runTaskNamed:name phase:phase block:block];
+        return;
+    }
+    if (phase == kLaunchPhaseBackground && firstWindowIsUp_) {
+        [self runInBackgroundTaskNamed:name block:block];
+        return;
+    }
+    LaunchSchedulerTask *task = [[[LaunchSchedulerTask alloc] init] autorelease];
+    task->name_ = [name copy];
+    task->phase_ = phase;
+    task->block_ = [block copy];
+    [deferredTasks_ addObject:task];
+}
+
+- (void)firstWindowDidAppear
+{
+    if (firstWindowIsUp_) {
+        return;
+    }
+    firstWindowIsUp_ = YES;
+    firstWindowTime_ = [NSDate timeIntervalSinceReferenceDate];
+    DLog(@"First window up %.1f ms after launch began", (firstWindowTime_ - launchTime_) * 1000);
+
+    // Background tasks are all started now; the rest take turns on the main thread.
+    NSMutableArray *mainThreadTasks = [NSMutableArray array];
+    for (LaunchSchedulerTask *task in deferredTasks_) {
+        if (task->phase_ == kLaunchPhaseBackground) {
+            [self runInBackgroundTaskNamed:task->name_ block:task->block_];
+        } else {
+            [mainThreadTasks addObject:task];
+        }
+    }
+    [deferredTasks_ setArray:mainThreadTasks];
+    [self performSelector:@selector(runNextDeferredTask) withObject:nil afterDelay:0];
+}
+
+- (NSString *)report
+{
+    NSMutableString *report = [NSMutableString string];
+    if (firstWindowIsUp_) {
+        [report appendFormat:@"First window: %.1f ms\n", (firstWindowTime_ - launchTime_) * 1000];
+    }
+    for (NSString *line in timings_) {
+        [report appendFormat:@"%@\n", line];
+    }
+    return report;
+}
+
+#pragma mark - Private
+
+- (void)recordTaskNamed:(NSString *)name phase:(LaunchPhase)phase duration:(NSTimeInterval)duration
+{
+    NSString *line = [NSString stringWithFormat:@"%@ (%@): %.1f ms",
+                         name, kLaunchPhaseNames[phase], duration * 1000];
+    DLog(@"Launch task %@", line);
+    [timings_ addObject:line];
+}
+
+- (void)runTaskNamed:(NSString *)name phase:(LaunchPhase)phase block:(void (^)(void))block
+{
+    const NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    block();
+    [self recordTaskNamed:name phase:phase duration:[NSDate timeIntervalSinceReferenceDate] - start];
+}
+
+- (void)runInBackgroundTaskNamed:(NSString *)name block:(void (^)(void))block
+{
+    backgroundTasksRunning_++;
+    name = [[name copy] autorelease];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
+        const NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+        block();
+        const NSTimeInterval duration = [NSDate timeIntervalSinceReferenceDate] - start;
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self recordTaskNamed:name phase:kLaunchPhaseBackground duration:duration];
+            backgroundTasksRunning_--;
+            [self logReportIfDone];
+        });
+    });
+}
+
+- (void)runNextDeferredTask
+{
+    if (![deferredTasks_ count]) {
+        [self logReportIfDone];
+        return;
+    }
+    LaunchSchedulerTask *task = [[[deferredTasks_ objectAtIndex:0] retain] autorelease];
+    [deferredTasks_ removeObjectAtIndex:0];
+    [self runTaskNamed:task->name_ phase:kLaunchPhaseAfterFirstWindow block:task->block_];
+    [self performSelector:@selector(runNextDeferredTask) withObject:nil afterDelay:0];
+}
+
+- (void)logReportIfDone
+{
+    if ([deferredTasks_ count] || backgroundTasksRunning_) {
+        return;
+    }
+    if ([[NSUserDefaults standardUserDefaults] boolForKey:@"LogLaunchTimes"]) {
+        NSLog(@"Launch times:\n%@", [self report]);
+    }
+}
+
+@end
@@ -0,0 +1,63 @@
+//
+//  LegacyEncodingTable.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+// Value of a table entry for bytes that don't decode to a character.
+#define kLegacyEncodingInvalid 0
+
+// Maps the characters of a legacy single- or double-byte encoding (GB, Big5, EUC-JP, Shift-JIS,
+// EUC-KR, Latin-1 and so on) straight to UTF-16, so the parser can decode them without making a
+// string per token. Each entry holds the UTF-16 code unit of a character, or both halves of its
+// surrogate pair with the high one in the low 16 bits, or kLegacyEncodingInvalid. Entries come
+// from the system's converter: single bytes when the table is made, and double-byte sequences a
+// lead byte's row at a time, the first time that lead byte is seen. Tables are shared and safe to use from any thread.
+@interface LegacyEncodingTable : NSObject {
+@public
+    NSStringEncoding encoding_;
+    BOOL singleByte_;  // Whether the encoding uses at most one byte per character.
+    uint32_t singleBytes_[128];  // Bytes 0x80 to 0xff on their own.
+    uint32_t *volatile rows_[128];  // Two-byte sequences by lead byte 0x80 to 0xff; NULL until used.
+}
+
+// Returns the shared table for |encoding|.
++ (LegacyEncodingTable *)tableForEncoding:(NSStringEncoding)encoding;
+
+// Converts a sequence that isn't in the tables, like GB18030's four-byte sequences and EUC-JP's
+// three-byte ones, into the same form as a table entry.
+- (uint32_t)entryForBytes:(const unsigned char *)bytes length:(int)length;
+
+// Use LegacyEncodingTableDoubleByte instead.
+- (uint32_t *)_rowForLeadByte:(unsigned char)lead;
+
+@end
+
+static inline uint32_t LegacyEncodingTableSingleByte(LegacyEncodingTable *table, unsigned char c) {
+    return c >= 0x80 ? table->singleBytes_[c - 0x80] : c;
+}
+
+static inline uint32_t LegacyEncodingTableDoubleByte(LegacyEncodingTable *table,
+                                                     unsigned char lead,
+                                                     unsigned char trail) {
+    if (lead < 0x80) {
+        return kLegacyEncodingInvalid;
+    }
+    uint32_t *row = table->rows_[lead - 0x80];
+    if (!row) {
+        row = [table _rowForLeadByte:lead];
+    }
+    return row[trail];
+}
+
+// Appends the code units of |entry|, which must not be kLegacyEncodingInvalid, to |output| and
+// returns how many there were.
+static inline int LegacyEncodingTableAppendEntry(uint32_t entry, unichar *output) {
+    output[0] = entry & 0xffff;
+    if (entry >> 16) {
+        output[1] = entry >> 16;
+        return 2;
+    }
+    return 1;
+}
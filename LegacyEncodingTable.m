@@ -0,0 +1,118 @@
+//
+//  LegacyEncodingTable.m
+//  iTerm
+//
+
+#import "LegacyEncodingTable.h"
+#include <libkern/OSAtomic.h>
+
+static NSMutableDictionary *gTables;  // NSNumber (encoding) -> LegacyEncodingTable
+static OSSpinLock gTablesLock = OS_SPINLOCK_INIT;
+
+// The table returned last, which saves a lookup since sessions rarely change encodings. Tables
+// are never freed, so it's safe to read without the lock.
+static LegacyEncodingTable *volatile gLastTable;
+
+// Packs a single character into a table entry. Anything else is invalid, including a sequence the
+// converter rejected and one it decoded as more than one character (such as a valid lead byte
+// followed by an ASCII char that isn't a valid trail byte).
+static uint32_t LegacyEncodingEntryForString(CFStringRef string) {
+    if (!string) {
+        return kLegacyEncodingInvalid;
+    }
+    uint32_t entry = kLegacyEncodingInvalid;
+    const CFIndex length = CFStringGetLength(string);
+    if (length == 1) {
+        entry = CFStringGetCharacterAtIndex(string, 0);
+    } else if (length == 2 &&
+               CFStringIsSurrogateHighCharacter(CFStringGetCharacterAtIndex(string, 0)) &&
+               CFStringIsSurrogateLowCharacter(CFStringGetCharacterAtIndex(string, 1))) {
+        entry = CFStringGetCharacterAtIndex(string, 0) | (CFStringGetCharacterAtIndex(string, 1) << 16);
+    }
+    CFRelease(string);
+    return entry;
+}
+
+@implementation LegacyEncodingTable
+
++ (LegacyEncodingTable *)tableForEncoding:(NSStringEncoding)encoding
+{
+    LegacyEncodingTable *lastTable = gLastTable;
+    if (lastTable && lastTable->encoding_ == encoding) {
+        return lastTable;
+    }
+    NSNumber *key = [NSNumber numberWithUnsignedInteger:encoding];
+    OSSpinLockLock(&gTablesLock);
+    LegacyEncodingTable *table = [gTables objectForKey:key];
+    OSSpinLockUnlock(&gTablesLock);
+    if (table) {
+        gLastTable = table;
+        return table;
+    }
+
+    // Made outside the lock since converting the single bytes takes a while. If another thread
+    // made one in the meantime, that one wins.
+    LegacyEncodingTable *newTable = [[[LegacyEncodingTable alloc] initWithEncoding:encoding] autorelease];
+    OSSpinLockLock(&gTablesLock);
+    if (!gTables) {
+        gTables = [[NSMutableDictionary alloc] init];
+    }
+    table = [gTables objectForKey:key];
+    if (!table) {
+        table = newTable;
+        [gTables setObject:table forKey:key];
+    }
+    OSSpinLockUnlock(&gTablesLock);
+    gLastTable = table;
+    return table;
+}
+
+- (id)initWithEncoding:(NSStringEncoding)encoding
+{
+    self = [super init];
+    if (self) {
+        encoding_ = encoding;
+        const CFStringEncoding cfEncoding = CFStringConvertNSStringEncodingToEncoding(encoding);
+        singleByte_ = (cfEncoding != kCFStringEncodingInvalidId &&
+                       CFStringGetMaximumSizeForEncoding(1, cfEncoding) == 1);
+        for (int i = 0; i < 128; i++) {
+            const unsigned char c = 0x80 + i;
+            singleBytes_[i] = [self entryForBytes:&c length:1];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    for (int i = 0; i < 128; i++) {
+        free(rows_[i]);
+    }
+    [super dealloc];
+}
+
+- (uint32_t)entryForBytes:(const unsigned char *)bytes length:(int)length
+{
+    return LegacyEncodingEntryForString(
+        CFStringCreateWithBytes(kCFAllocatorDefault,
+                                bytes,
+                                length,
+                                CFStringConvertNSStringEncodingToEncoding(encoding_),
+                                false));
+}
+
+- (uint32_t *)_rowForLeadByte:(unsigned char)lead
+{
+    uint32_t *row = malloc(256 * sizeof(uint32_t));
+    for (int trail = 0; trail < 256; trail++) {
+        const unsigned char bytes[2] = { lead, trail };
+        row[trail] = [self entryForBytes:bytes length:2];
+    }
+    if (!OSAtomicCompareAndSwapPtrBarrier(NULL, row, (void *volatile *)&rows_[lead - 0x80])) {
+        // Another thread filled in the row first.
+        free(row);
+    }
+    return rows_[lead - 0x80];
+}
+
+@end
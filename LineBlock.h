@@ -7,12 +7,45 @@
 //
 
 #import <Foundation/Foundation.h>
+#import "LineBlockTimestamps.h"
 #import "ScreenChar.h"
 
+@class LineBlockPayload;
+@class LineBlockSpillFile;
+
+// How a block is stored in a scrollback archive (see LineBufferArchive.h). It's followed by
+// numEntries cumulative line lengths, numEntries timestamps, and storageLength bytes of the
+// serialized compact arrays, deflated if |deflated| is set.
+typedef struct {
+    int bufferSize;
+    int startOffset;
+    int firstEntry;
+    int numEntries;
+    int isPartial;
+    int wideCodesCount;
+    int runsCount;
+    int hasDwc;
+    int storageLength;
+    int deflated;
+} LineBlockArchiveHeader;
+
+// A run of consecutive chars in a compact LineBlock that share the same colors and style.
+typedef struct {
+    int length;
+    screen_char_t attributes;  // The code and complexChar fields are not used.
+} LineBlockAttributeRun;
+
+// A char in a compact LineBlock that doesn't fit in one byte.
+typedef struct {
+    unichar code;
+    BOOL complexChar;
+} LineBlockWideCode;
+
 // LineBlock represents an ordered collection of lines of text. It stores them contiguously
 // in a buffer.
 @interface LineBlock : NSObject {
-    // The raw lines, end-to-end. There is no delimiter between each line.
+    // The raw lines, end-to-end. There is no delimiter between each line. Reference counted and
+    // possibly shared with copies of this block, so don't change it without making it writable.
     screen_char_t* raw_buffer;
     screen_char_t* buffer_start;  // usable start of buffer (stuff before this is dropped)
     
@@ -26,7 +59,7 @@
     // The ith value is the length of the ith line plus the value of
     // cumulative_line_lengths[i-1] for i>0 or 0 for i==0.
     int* cumulative_line_lengths;
-    NSTimeInterval *timestamps_;
+    LineBlockTimestamps timestamps_;  // One per entry in cumulative_line_lengths.
     
     // The number of elements allocated for cumulative_line_lengths.
     int cll_capacity;
@@ -43,9 +76,63 @@
     // This is -1 if the cache is invalid; otherwise it specifies the width for which
     // cached_numlines is correct.
     int cached_numlines_width;
+
+    // The number of wrapped lines at wrapped_line_index_width before each raw line from
+    // first_entry on, so a wrapped line can be found without walking every raw line before it.
+    // Nothing in it depends on the last raw line, which may still grow, so appending just extends
+    // it; the next lookup fills in the new entries. NULL if it hasn't been built.
+    int *wrapped_line_index;
+    int wrapped_line_index_width;
+    int wrapped_line_index_count;
+    int wrapped_line_index_capacity;
+    int wrapped_line_index_hint;  // Entry of the last lookup, since rows are usually read in order.
+
+    // While a block is compact raw_buffer is NULL and its chars from start_offset on are stored in
+    // these instead. See -compact.
+    unsigned char *compact_codes;  // One byte per char, or kLineBlockWideCode.
+    LineBlockWideCode *compact_wide_codes;  // One per kLineBlockWideCode in compact_codes.
+    LineBlockAttributeRun *compact_runs;
+    int compact_wide_codes_count;
+    int compact_runs_count;
+    BOOL compact_has_dwc;  // Any DWC_RIGHT in the block? If not counting lines needs no chars.
+    // If the compact arrays came from the LineBlockPayloadStore, they belong to this and may be
+    // shared with identical blocks in other buffers.
+    LineBlockPayload *compact_payload;
+
+    // A compressed block has neither a raw buffer nor compact arrays. The compact arrays are
+    // concatenated and deflated into this. See -compress.
+    unsigned char *compressed_buffer;
+    int compressed_size;  // Also the number of bytes written to spill_file.
+
+    // A spilled block keeps its compact or compressed form in spill_file instead of in memory.
+    LineBlockSpillFile *spill_file;
+    long long spill_offset;
+    BOOL spill_deflated;  // Is the spilled or archived data compressed?
+
+    // A block restored from a scrollback archive keeps its chars in the mapped archive until
+    // they're read. compressed_size and spill_deflated describe the data as for a spilled block.
+    NSData *archive_data;
+    long long archive_offset;
+
+    // Set once the block is referenced by more than one LineBuffer. See -markShared.
+    BOOL is_shared;
+
+    // Bitmap of hashed ASCII-case-folded trigrams in the block, or NULL if it isn't indexed. See
+    // -buildNgramIndex.
+    unsigned char *ngram_index;
+    BOOL ngram_index_has_non_ascii;  // Any chars that couldn't be indexed?
 }
 
 - (LineBlock*) initWithRawBufferSize: (int) size;
+
+// Restores a block from a record made by -newArchiveRecord that starts at |offset| in |data|,
+// which is usually a mapped file. Returns nil if the record is malformed. Only the line lengths
+// and timestamps are copied; the chars are read from |data| when they're first needed.
+- (LineBlock *)initWithArchiveData:(NSData *)data offset:(long long)offset length:(int)length;
+
+// The copy shares the raw buffer with the receiver; whichever block next appends or resizes gets
+// its own buffer first. So copying costs the line lengths but not the chars, and a copy may be read
+// on another thread while the receiver keeps appending.
 - (LineBlock *)copy;
 
 - (void) dealloc;
@@ -114,6 +201,62 @@
 // Remove extra space from the end of the buffer. Future appends will fail.
 - (void)shrinkToFit;
 
+// Frees the raw buffer, keeping its contents in a compact form: one byte per char for ASCII text
+// plus runs of shared colors and styles. Methods that need the chars expand it again on demand, so
+// this is invisible to callers except that pointers into the block are invalidated.
+- (void)compact;
+
+// Returns YES if the block is compact and will need to be expanded to read its chars.
+- (BOOL)isCompact;
+
+// Blocks held by more than one LineBuffer (see -[LineBuffer newAppendOnlyCopy]) must not have
+// their lines changed. A LineBuffer replaces a shared block with a copy before modifying it.
+// Changes in how a shared block is stored are safe: -compact, -compress, -spillToFile:, and
+// reading it take a lock that -findSubstring:... also holds, so blocks of a copy may be searched on
+// a background thread while the main thread uses the original buffer.
+- (void)markShared;
+- (BOOL)isShared;
+
+// Compacts the block and then deflates the compact form. Like -compact this is invisible to
+// callers except that reading chars is slower the first time. Returns NO if compression did not
+// save space, in which case the block is left compact.
+- (BOOL)compress;
+
+// Returns YES if the block is compressed and in memory.
+- (BOOL)isCompressed;
+
+// Moves the block's compressed or compact form to the file. Reading chars brings it back into
+// memory and frees its space in the file. Returns NO if the file couldn't be written.
+- (BOOL)spillToFile:(LineBlockSpillFile *)file;
+
+// Returns YES if the block is in a spill file or still in the archive it was restored from.
+- (BOOL)isSpilled;
+
+// Returns a LineBlockArchiveHeader followed by the line lengths, timestamps, and chars of the
+// block, not yet deflated unless the block was already compressed. Copies only what's needed to
+// be safe to deflate and write on another thread.
+- (NSMutableData *)newArchiveRecord;
+
+// Drops the chars before |startOffset|, which begins within raw line |firstEntry|, as
+// -dropLines:withWidth:chars: did to the block after it was archived.
+- (void)setStartOffset:(int)startOffset firstEntry:(int)firstEntry;
+
+// Bytes of char storage held in memory by the block in whatever form it's currently in, or 0 if
+// it's spilled. Bookkeeping like line lengths and timestamps isn't counted.
+- (long long)residentBytes;
+
+// Indexes the block's trigrams in a fixed-size bitmap so -findSubstring:... can skip the block
+// without reading its chars when the substring can't be in it. Appending a line discards the
+// index, so call this once a block is full.
+- (void)buildNgramIndex;
+
+// Bytes used by the trigram index, or 0 if there isn't one.
+- (long long)ngramIndexBytes;
+
+// Returns the text of the block's lines, each followed by a newline unless it's partial. Complex
+// chars and tab fillers become spaces and the right halves of double-width chars are left out.
+- (NSString *)newPlainText;
+
 // Append a value to cumulativeLineLengths.
 - (void)_appendCumulativeLineLength:(int)cumulativeLength
                           timestamp:(NSTimeInterval)timestamp;
@@ -136,11 +279,11 @@
 // Returns the total number of lines, including dropped lines.
 - (int)numEntries;
 
-// Searches for a substring, populating results with ResultRange objects.
+// Searches for a substring, appending ResultRanges to results.
 - (void)findSubstring:(NSString*)substring
               options:(int)options
              atOffset:(int)offset
-              results:(NSMutableArray*)results
+              results:(NSMutableData *)results
       multipleResults:(BOOL)multipleResults;
 
 // Tries to convert a byte offset into the block to an x,y coordinate relative to the first char
@@ -185,4 +328,8 @@ int NumberOfFullLines(screen_char_t* buffer, int length, int width);
 // |XXzzzz|
 int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width);
 
+// Builds the tables that fold text for searches that aren't regexes, which are otherwise made by
+// the first such search. Takes long enough to do in the background at launch. Any thread.
+void LineBlockPrepareSearchTables(void);
+
 @end
@@ -7,9 +7,81 @@
 //
 
 #import "LineBlock.h"
+#import <zlib.h>
+#import "CompiledRegex.h"
 #import "FindContext.h"
+#import "LineBlockPayloadStore.h"
+#import "LineBlockSpillFile.h"
 #import "LineBufferHelpers.h"
-#import "RegexKitLite/RegexKitLite.h"
+#include <libkern/OSAtomic.h>
+
+// Raw buffers are reference counted so that a copy of a block can share its chars until one of
+// them is changed. The count lives in a header just before the chars.
+typedef struct {
+    volatile int32_t refCount;
+    int32_t unused[3];  // Keeps the chars 16-byte aligned like malloc's.
+} LineBlockRawBufferHeader;
+
+static LineBlockRawBufferHeader *LineBlockRawBufferGetHeader(screen_char_t *buffer) {
+    return ((LineBlockRawBufferHeader *)buffer) - 1;
+}
+
+// Returns a new raw buffer of |count| chars with a reference count of 1.
+static screen_char_t *LineBlockAllocateRawBuffer(int count) {
+    LineBlockRawBufferHeader *header =
+        malloc(sizeof(LineBlockRawBufferHeader) + sizeof(screen_char_t) * MAX(1, count));
+    header->refCount = 1;
+    return (screen_char_t *)(header + 1);
+}
+
+static screen_char_t *LineBlockRetainRawBuffer(screen_char_t *buffer) {
+    OSAtomicIncrement32Barrier(&LineBlockRawBufferGetHeader(buffer)->refCount);
+    return buffer;
+}
+
+static void LineBlockReleaseRawBuffer(screen_char_t *buffer) {
+    if (buffer && OSAtomicDecrement32Barrier(&LineBlockRawBufferGetHeader(buffer)->refCount) == 0) {
+        free(LineBlockRawBufferGetHeader(buffer));
+    }
+}
+
+static BOOL LineBlockRawBufferIsShared(screen_char_t *buffer) {
+    return LineBlockRawBufferGetHeader(buffer)->refCount > 1;
+}
+
+// Marks a char in compact_codes that is stored in compact_wide_codes.
+static const unsigned char kLineBlockWideCode = 0x80;
+
+// Size of the trigram bitmap. A full block of 8k chars of text has a few thousand distinct
+// trigrams, which leaves most bits clear.
+static const int kNgramIndexBitsLog2 = 14;
+static const int kNgramIndexBytes = (1 << kNgramIndexBitsLog2) / 8;
+
+@interface LineBlock ()
+- (void)_expandIfNeeded;
+- (void)_invalidateWrappedLineIndex;
+- (int)_rawLineContainingWrappedLine:(int *)lineNum width:(int)width;
+- (void)_makeRawBufferWritable;
+- (void)_freeCompactStorage;
+- (int)_compactSize;
+- (unsigned char *)_newSerializedCompactStorage;
+- (screen_char_t *)_newRawBufferFromSerializedCompactStorage:(const unsigned char *)buffer;
+- (void)_inflateBytes:(const unsigned char *)bytes
+               length:(int)length
+                 into:(unsigned char *)destination;
+- (screen_char_t *)_newRawBufferFromCodes:(const unsigned char *)codes
+                                wideCodes:(const LineBlockWideCode *)wideCodes
+                                     runs:(const LineBlockAttributeRun *)runs;
+- (screen_char_t *)_newRawBuffer;
+- (BOOL)_compress;
+- (void)_compact;
+- (void)_findSubstring:(NSString*)substring
+               options:(int)options
+              atOffset:(int)offset
+               results:(NSMutableData *)results
+       multipleResults:(BOOL)multipleResults
+             rawBuffer:(screen_char_t *)rawBuffer;
+@end
 
 @implementation LineBlock
 
@@ -17,7 +89,7 @@
 {
     self = [super init];
     if (self) {
-        raw_buffer = (screen_char_t*) malloc(sizeof(screen_char_t) * size);
+        raw_buffer = LineBlockAllocateRawBuffer(size);
         buffer_start = raw_buffer;
         start_offset = 0;
         first_entry = 0;
@@ -26,31 +98,99 @@
         cll_capacity = 1 + size/80;
         cll_entries = 0;
         cumulative_line_lengths = (int*) malloc(sizeof(int) * cll_capacity);
-        timestamps_ = (NSTimeInterval *)malloc(sizeof(NSTimeInterval) * cll_capacity);
         is_partial = NO;
         cached_numlines_width = -1;
     }
     return self;
 }
 
+- (LineBlock *)initWithArchiveData:(NSData *)data offset:(long long)offset length:(int)length
+{
+    LineBlockArchiveHeader header;
+    if (offset < 0 || length < sizeof(header) || offset + length > [data length]) {
+        [self release];
+        return nil;
+    }
+    const unsigned char *bytes = (const unsigned char *)[data bytes] + offset;
+    memcpy(&header, bytes, sizeof(header));
+    const long long expectedLength = ((long long)sizeof(header) +
+                                      (long long)header.numEntries * (sizeof(int) +
+                                                                     sizeof(NSTimeInterval)) +
+                                      header.storageLength);
+    if (header.numEntries < 0 ||
+        header.storageLength < 0 ||
+        header.wideCodesCount < 0 ||
+        header.runsCount < 0 ||
+        header.firstEntry < 0 ||
+        header.firstEntry > header.numEntries ||
+        expectedLength != length) {
+        [self release];
+        return nil;
+    }
+
+    self = [super init];
+    if (self) {
+        buffer_size = header.bufferSize;
+        start_offset = header.startOffset;
+        first_entry = header.firstEntry;
+        cll_entries = header.numEntries;
+        cll_capacity = MAX(1, cll_entries);
+        cumulative_line_lengths = malloc(sizeof(int) * cll_capacity);
+        bytes += sizeof(header);
+        memcpy(cumulative_line_lengths, bytes, sizeof(int) * cll_entries);
+        bytes += sizeof(int) * cll_entries;
+        for (int i = 0; i < cll_entries; i++) {
+            NSTimeInterval timestamp;
+            memcpy(&timestamp, bytes, sizeof(timestamp));
+            LineBlockTimestampsAppend(&timestamps_, timestamp);
+            bytes += sizeof(timestamp);
+        }
+        is_partial = header.isPartial;
+        cached_numlines_width = -1;
+        compact_wide_codes_count = header.wideCodesCount;
+        compact_runs_count = header.runsCount;
+        compact_has_dwc = header.hasDwc;
+
+        const int rawSpaceUsed = [self rawSpaceUsed];
+        if (start_offset < 0 ||
+            start_offset > rawSpaceUsed ||
+            buffer_size < rawSpaceUsed ||
+            (!header.deflated && header.storageLength != [self _compactSize])) {
+            [self release];
+            return nil;
+        }
+        archive_data = [data retain];
+        archive_offset = bytes - (const unsigned char *)[data bytes];
+        compressed_size = header.storageLength;
+        spill_deflated = header.deflated;
+    }
+    return self;
+}
+
 - (void) dealloc
 {
-    if (raw_buffer) {
-        free(raw_buffer);
+    LineBlockReleaseRawBuffer(raw_buffer);
+    [self _freeCompactStorage];
+    free(compressed_buffer);
+    if (spill_file) {
+        [spill_file freeOffset:spill_offset length:compressed_size];
+        [spill_file release];
     }
+    [archive_data release];
     if (cumulative_line_lengths) {
         free(cumulative_line_lengths);
     }
-    if (timestamps_) {
-        free(timestamps_);
-    }
+    LineBlockTimestampsFree(&timestamps_);
+    free(ngram_index);
+    free(wrapped_line_index);
     [super dealloc];
 }
 
 - (LineBlock *)copy {
+    [self _expandIfNeeded];
     LineBlock *theCopy = [[LineBlock alloc] init];
-    theCopy->raw_buffer = (screen_char_t*) malloc(sizeof(screen_char_t) * buffer_size);
-    memmove(theCopy->raw_buffer, raw_buffer, sizeof(screen_char_t) * buffer_size);
+    // The chars are shared until either block appends to or resizes its buffer.
+    theCopy->raw_buffer = LineBlockRetainRawBuffer(raw_buffer);
     size_t bufferStartOffset = (buffer_start - raw_buffer);
     theCopy->buffer_start = theCopy->raw_buffer + bufferStartOffset;
     theCopy->start_offset = start_offset;
@@ -59,13 +199,17 @@
     size_t cll_size = sizeof(int) * cll_capacity;
     theCopy->cumulative_line_lengths = (int*) malloc(cll_size);
     memmove(theCopy->cumulative_line_lengths, cumulative_line_lengths, cll_size);
-    theCopy->timestamps_ = (NSTimeInterval *) malloc(sizeof(NSTimeInterval) * cll_capacity);
-    memmove(theCopy->timestamps_, timestamps_, sizeof(NSTimeInterval) * cll_capacity);
+    LineBlockTimestampsCopy(&theCopy->timestamps_, &timestamps_);
     theCopy->cll_capacity = cll_capacity;
     theCopy->cll_entries = cll_entries;
     theCopy->is_partial = is_partial;
     theCopy->cached_numlines = cached_numlines;
     theCopy->cached_numlines_width = cached_numlines_width;
+    if (ngram_index) {
+        theCopy->ngram_index = malloc(kNgramIndexBytes);
+        memmove(theCopy->ngram_index, ngram_index, kNgramIndexBytes);
+        theCopy->ngram_index_has_non_ascii = ngram_index_has_non_ascii;
+    }
     
     return theCopy;
 }
@@ -85,10 +229,9 @@
         cll_capacity *= 2;
         cll_capacity = MAX(1, cll_capacity);
         cumulative_line_lengths = (int*) realloc((void*) cumulative_line_lengths, cll_capacity * sizeof(int));
-        timestamps_ = (NSTimeInterval *)realloc((void *)timestamps_, cll_capacity * sizeof(NSTimeInterval));
     }
     cumulative_line_lengths[cll_entries] = cumulativeLength;
-    timestamps_[cll_entries] = timestamp;
+    LineBlockTimestampsAppend(&timestamps_, timestamp);
     ++cll_entries;
 }
 
@@ -105,6 +248,7 @@ static char* formatsct(screen_char_t* src, int len, char* dest) {
 
 - (void)appendToDebugString:(NSMutableString *)s
 {
+    [self _expandIfNeeded];
     char temp[1000];
     int i;
     int prev;
@@ -127,6 +271,7 @@ static char* formatsct(screen_char_t* src, int len, char* dest) {
 
 - (void)dump:(int)rawOffset
 {
+    [self _expandIfNeeded];
     char temp[1000];
     int i;
     int prev;
@@ -175,11 +320,15 @@ int NumberOfFullLines(screen_char_t* buffer, int length, int width)
              width:(int)width
          timestamp:(NSTimeInterval)timestamp
 {
+    [self _expandIfNeeded];
     const int space_used = [self rawSpaceUsed];
     const int free_space = buffer_size - space_used - start_offset;
     if (length > free_space) {
         return NO;
     }
+    free(ngram_index);
+    ngram_index = NULL;
+    [self _makeRawBufferWritable];
     memcpy(raw_buffer + space_used, buffer, sizeof(screen_char_t) * length);
     // There's an edge case here. In the else clause, the line buffer looks like this originally:
     //   |xxxx| EOL_SOFT
@@ -207,7 +356,7 @@ int NumberOfFullLines(screen_char_t* buffer, int length, int width)
         }
         
         cumulative_line_lengths[cll_entries - 1] += length;
-        timestamps_[cll_entries - 1] = timestamp;
+        LineBlockTimestampsSetLast(&timestamps_, timestamp);
 #ifdef TEST_LINEBUFFER_SANITY
         [self checkAndResetCachedNumlines:@"appendLine partial case" width: width];
 #endif
@@ -234,6 +383,7 @@ int NumberOfFullLines(screen_char_t* buffer, int length, int width)
                  yOffset:(int *)yOffsetPtr
                  extends:(BOOL *)extendsPtr
 {
+    [self _expandIfNeeded];
     int length;
     int eol;
     screen_char_t* p = [self getWrappedLineWithWrapWidth:width
@@ -274,23 +424,90 @@ int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
 
 - (NSTimeInterval)timestampForLineNumber:(int)lineNum width:(int)width
 {
-    int prev = 0;
-    int length;
-    int i;
-    for (i = first_entry; i < cll_entries; ++i) {
-        int cll = cumulative_line_lengths[i] - start_offset;
-        length = cll - prev;
-        int spans = NumberOfFullLines(buffer_start + prev, length, width);
-        if (lineNum > spans) {
-            // Consume the entire raw line and keep looking for more.
-            int consume = spans + 1;
-            lineNum -= consume;
-        } else {  // *lineNum <= spans
-            return timestamps_[i];
+    [self _expandIfNeeded];
+    const int i = [self _rawLineContainingWrappedLine:&lineNum width:width];
+    return i < 0 ? 0 : LineBlockTimestampsGet(&timestamps_, i);
+}
+
+- (void)_invalidateWrappedLineIndex
+{
+    free(wrapped_line_index);
+    wrapped_line_index = NULL;
+}
+
+// The raw buffer must be expanded. Returns the raw line that contains wrapped line *lineNum and
+// sets *lineNum to the wrapped line's number within it. If there are fewer wrapped lines, returns
+// -1 and decrements *lineNum by the number of wrapped lines in the block.
+- (int)_rawLineContainingWrappedLine:(int *)lineNum width:(int)width
+{
+    const int count = cll_entries - first_entry;
+    if (count == 0) {
+        return -1;
+    }
+    if (wrapped_line_index && wrapped_line_index_width != width) {
+        [self _invalidateWrappedLineIndex];
+    }
+    if (!wrapped_line_index) {
+        wrapped_line_index_width = width;
+        wrapped_line_index_count = 0;
+        wrapped_line_index_capacity = count;
+        wrapped_line_index_hint = 0;
+        wrapped_line_index = malloc(sizeof(int) * wrapped_line_index_capacity);
+    } else if (count > wrapped_line_index_capacity) {
+        wrapped_line_index_capacity = MAX(count, wrapped_line_index_capacity * 2);
+        wrapped_line_index = realloc(wrapped_line_index, sizeof(int) * wrapped_line_index_capacity);
+    }
+    int *index = wrapped_line_index;
+    for (int k = wrapped_line_index_count; k < count; k++) {
+        if (k == 0) {
+            index[k] = 0;
+        } else {
+            const int i = first_entry + k - 1;
+            const int prev = i > first_entry ? cumulative_line_lengths[i - 1] - start_offset : 0;
+            const int length = cumulative_line_lengths[i] - start_offset - prev;
+            index[k] = index[k - 1] + NumberOfFullLines(buffer_start + prev, length, width) + 1;
+        }
+    }
+    wrapped_line_index_count = count;
+
+    const int n = *lineNum;
+    int k;
+    if (n >= index[count - 1]) {
+        // The last raw line's length isn't in the index.
+        k = count - 1;
+        const int i = first_entry + k;
+        const int prev = i > first_entry ? cumulative_line_lengths[i - 1] - start_offset : 0;
+        const int length = cumulative_line_lengths[i] - start_offset - prev;
+        const int total = index[k] + NumberOfFullLines(buffer_start + prev, length, width) + 1;
+        if (n >= total) {
+            *lineNum -= total;
+            return -1;
+        }
+    } else {
+        // Here n < index[count - 1], so the answer is an entry before the last one. Try the last
+        // lookup's entry and the one after it before searching.
+        k = wrapped_line_index_hint;
+        if (k + 1 < count && index[k] <= n && n < index[k + 1]) {
+            // Same raw line as last time.
+        } else if (k + 2 < count && index[k + 1] <= n && n < index[k + 2]) {
+            ++k;
+        } else {
+            int lo = 0;
+            int hi = count - 2;
+            while (lo < hi) {
+                const int mid = (lo + hi + 1) / 2;
+                if (index[mid] <= n) {
+                    lo = mid;
+                } else {
+                    hi = mid - 1;
+                }
+            }
+            k = lo;
         }
-        prev = cll;
     }
-    return 0;
+    wrapped_line_index_hint = k;
+    *lineNum = n - index[k];
+    return first_entry + k;
 }
 
 - (screen_char_t*)getWrappedLineWithWrapWidth:(int)width
@@ -311,62 +528,55 @@ int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
                             includesEndOfLine:(int*)includesEndOfLine
                                       yOffset:(int*)yOffsetPtr
 {
-    int prev = 0;
-    int length;
-    int i;
-    int numEmptyLines = 0;
-    for (i = first_entry; i < cll_entries; ++i) {
-        int cll = cumulative_line_lengths[i] - start_offset;
-        length = cll - prev;
-        if (length == 0) {
-            ++numEmptyLines;
+    [self _expandIfNeeded];
+    const int i = [self _rawLineContainingWrappedLine:lineNum width:width];
+    if (i < 0) {
+        return NULL;
+    }
+    const int prev = i > first_entry ? cumulative_line_lengths[i - 1] - start_offset : 0;
+    const int length = cumulative_line_lengths[i] - start_offset - prev;
+    // We found the raw line that inclues the wrapped line we're searching for.
+    // eat up *lineNum many width-sized wrapped lines from this start of the current full line
+    int offset = OffsetOfWrappedLine(buffer_start + prev,
+                                     *lineNum,
+                                     length,
+                                     width);
+    *lineNum = 0;
+    // offset: the relevant part of the raw line begins at this offset into it
+    *lineLength = length - offset;  // the length of the suffix of the raw line, beginning at the wrapped line we want
+    if (*lineLength > width) {
+        // return an infix of the full line
+        if (buffer_start[prev + offset + width].code == DWC_RIGHT) {
+            // Result would end with the first half of a double-width character
+            *lineLength = width - 1;
+            *includesEndOfLine = EOL_DWC;
         } else {
-            numEmptyLines = 0;
+            *lineLength = width;
+            *includesEndOfLine = EOL_SOFT;
         }
-        int spans = NumberOfFullLines(buffer_start + prev, length, width);
-        if (*lineNum > spans) {
-            // Consume the entire raw line and keep looking for more.
-            int consume = spans + 1;
-            *lineNum -= consume;
-        } else {  // *lineNum <= spans
-            // We found the raw line that inclues the wrapped line we're searching for.
-            // eat up *lineNum many width-sized wrapped lines from this start of the current full line
-            int offset = OffsetOfWrappedLine(buffer_start + prev,
-                                             *lineNum,
-                                             length,
-                                             width);
-            *lineNum = 0;
-            // offset: the relevant part of the raw line begins at this offset into it
-            *lineLength = length - offset;  // the length of the suffix of the raw line, beginning at the wrapped line we want
-            if (*lineLength > width) {
-                // return an infix of the full line
-                if (buffer_start[prev + offset + width].code == DWC_RIGHT) {
-                    // Result would end with the first half of a double-width character
-                    *lineLength = width - 1;
-                    *includesEndOfLine = EOL_DWC;
-                } else {
-                    *lineLength = width;
-                    *includesEndOfLine = EOL_SOFT;
-                }
-            } else {
-                // return a suffix of the full line
-                if (i == cll_entries - 1 && is_partial) {
-                    // If this is the last line and it's partial then it doesn't have an end-of-line.
-                    *includesEndOfLine = EOL_SOFT;
-                } else {
-                    *includesEndOfLine = EOL_HARD;
-                }
-            }
-            if (yOffsetPtr) {
-                // Set *yOffsetPtr to the number of consecutive empty lines just before the requested
-                // line.
-                *yOffsetPtr = numEmptyLines;
+    } else {
+        // return a suffix of the full line
+        if (i == cll_entries - 1 && is_partial) {
+            // If this is the last line and it's partial then it doesn't have an end-of-line.
+            *includesEndOfLine = EOL_SOFT;
+        } else {
+            *includesEndOfLine = EOL_HARD;
+        }
+    }
+    if (yOffsetPtr) {
+        // Set *yOffsetPtr to the number of consecutive empty lines just before the requested
+        // line.
+        int numEmptyLines = 0;
+        for (int j = i; j >= first_entry; j--) {
+            const int start = j > first_entry ? cumulative_line_lengths[j - 1] - start_offset : 0;
+            if (cumulative_line_lengths[j] - start_offset != start) {
+                break;
             }
-            return buffer_start + prev + offset;
+            ++numEmptyLines;
         }
-        prev = cll;
+        *yOffsetPtr = numEmptyLines;
     }
-    return NULL;
+    return buffer_start + prev + offset;
 }
 
 - (int) getNumLinesWithWrapWidth: (int) width
@@ -378,6 +588,21 @@ int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
     int count = 0;
     int prev = 0;
     int i;
+    if ([self isCompact] && !compact_has_dwc) {
+        // Without double-width chars the count depends only on line lengths, so there's no need
+        // to expand the block.
+        for (i = first_entry; i < cll_entries; ++i) {
+            int cll = cumulative_line_lengths[i] - start_offset;
+            int length = cll - prev;
+            count += (length > width ? (length - 1) / width : 0) + 1;
+            prev = cll;
+        }
+        cached_numlines_width = width;
+        cached_numlines = count;
+        return count;
+    }
+    [self _expandIfNeeded];
+
     // Count the number of wrapped lines in the block by computing the sum of the number
     // of wrapped lines each raw line would use.
     for (i = first_entry; i < cll_entries; ++i) {
@@ -405,6 +630,7 @@ int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
               upToWidth:(int)width
               timestamp:(NSTimeInterval *)timestampPtr
 {
+    [self _expandIfNeeded];
     if (cll_entries == first_entry) {
         // There is no last line to pop.
         return NO;
@@ -416,7 +642,7 @@ int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
         start = cumulative_line_lengths[cll_entries - 2] - start_offset;
     }
     if (timestampPtr) {
-        *timestampPtr = timestamps_[cll_entries - 1];
+        *timestampPtr = LineBlockTimestampsGet(&timestamps_, cll_entries - 1);
     }
 
     const int end = cumulative_line_lengths[cll_entries - 1] - start_offset;
@@ -443,6 +669,7 @@ int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
         *length = available_len;
         *ptr = buffer_start + start;
         --cll_entries;
+        LineBlockTimestampsRemoveLast(&timestamps_);
         is_partial = NO;
     }
     
@@ -452,9 +679,11 @@ int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
         start_offset = 0;
         first_entry = 0;
         cll_entries = 0;
+        LineBlockTimestampsRemoveAll(&timestamps_);
     }
     // refresh cache
     cached_numlines_width = -1;
+    [self _invalidateWrappedLineIndex];
     return YES;
 }
 
@@ -492,6 +721,7 @@ int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
 
 - (screen_char_t*)rawLine:(int)linenum
 {
+    [self _expandIfNeeded];
     int start;
     if (linenum == 0) {
         start = 0;
@@ -503,9 +733,20 @@ int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
 
 - (void)changeBufferSize:(int)capacity
 {
+    [self _expandIfNeeded];
     NSAssert(capacity >= [self rawSpaceUsed], @"Truncating used space");
     capacity = MAX(1, capacity);
-    raw_buffer = (screen_char_t*) realloc((void*) raw_buffer, sizeof(screen_char_t) * capacity);
+    if (LineBlockRawBufferIsShared(raw_buffer)) {
+        screen_char_t *newBuffer = LineBlockAllocateRawBuffer(capacity);
+        memcpy(newBuffer, raw_buffer, sizeof(screen_char_t) * [self rawSpaceUsed]);
+        LineBlockReleaseRawBuffer(raw_buffer);
+        raw_buffer = newBuffer;
+    } else {
+        LineBlockRawBufferHeader *header =
+            realloc(LineBlockRawBufferGetHeader(raw_buffer),
+                    sizeof(LineBlockRawBufferHeader) + sizeof(screen_char_t) * capacity);
+        raw_buffer = (screen_char_t *)(header + 1);
+    }
     buffer_start = raw_buffer + start_offset;
     buffer_size = capacity;
     cached_numlines_width = -1;
@@ -526,14 +767,470 @@ int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
     [self changeBufferSize: [self rawSpaceUsed]];
 }
 
+- (void)markShared
+{
+    is_shared = YES;
+}
+
+- (BOOL)isShared
+{
+    return is_shared;
+}
+
+- (BOOL)isCompact
+{
+    return (compact_codes != NULL ||
+            compressed_buffer != NULL ||
+            spill_file != nil ||
+            archive_data != nil);
+}
+
+- (BOOL)isCompressed
+{
+    return compressed_buffer != NULL;
+}
+
+- (long long)residentBytes
+{
+    if (raw_buffer) {
+        return (long long)buffer_size * sizeof(screen_char_t);
+    } else if (spill_file || archive_data) {
+        return 0;
+    } else if (compressed_buffer) {
+        return compressed_size;
+    } else {
+        return [self _compactSize];
+    }
+}
+
+// Number of bytes in the three compact arrays.
+- (int)_compactSize
+{
+    return ([self rawSpaceUsed] - start_offset +
+            compact_wide_codes_count * sizeof(LineBlockWideCode) +
+            compact_runs_count * sizeof(LineBlockAttributeRun));
+}
+
+- (BOOL)_compress
+{
+    if (compressed_buffer) {
+        return YES;
+    }
+    if (spill_file || archive_data) {
+        return NO;
+    }
+    [self _compact];
+    if (!compact_codes) {
+        return NO;
+    }
+    const int size = [self _compactSize];
+    unsigned char *source = [self _newSerializedCompactStorage];
+    uLongf destinationSize = compressBound(size);
+    unsigned char *destination = malloc(destinationSize);
+    int rc = compress2(destination, &destinationSize, source, size, Z_BEST_SPEED);
+    free(source);
+    if (rc != Z_OK || destinationSize >= size) {
+        free(destination);
+        return NO;
+    }
+
+    [self _freeCompactStorage];
+    compressed_buffer = realloc(destination, destinationSize);
+    compressed_size = (int)destinationSize;
+    return YES;
+}
+
+- (BOOL)isSpilled
+{
+    return spill_file != nil || archive_data != nil;
+}
+
+- (BOOL)_spillToFile:(LineBlockSpillFile *)file
+{
+    if (spill_file || archive_data) {
+        return YES;
+    }
+    [self _compress];
+    const unsigned char *bytes;
+    unsigned char *serialized = NULL;
+    int length;
+    if (compressed_buffer) {
+        bytes = compressed_buffer;
+        length = compressed_size;
+    } else if (compact_codes) {
+        serialized = [self _newSerializedCompactStorage];
+        bytes = serialized;
+        length = [self _compactSize];
+    } else {
+        return NO;
+    }
+    long long offset = [file writeBytes:bytes length:length];
+    free(serialized);
+    if (offset < 0) {
+        return NO;
+    }
+
+    spill_deflated = (compressed_buffer != NULL);
+    free(compressed_buffer);
+    compressed_buffer = NULL;
+    [self _freeCompactStorage];
+    spill_file = [file retain];
+    spill_offset = offset;
+    compressed_size = length;
+    return YES;
+}
+
+// Returns a malloc'ed buffer of _compactSize bytes holding the three compact arrays back to back.
+- (unsigned char *)_newSerializedCompactStorage
+{
+    const int n = [self rawSpaceUsed] - start_offset;
+    const int wideSize = compact_wide_codes_count * sizeof(LineBlockWideCode);
+    const int runsSize = compact_runs_count * sizeof(LineBlockAttributeRun);
+    unsigned char *buffer = malloc(MAX(1, [self _compactSize]));
+    memcpy(buffer, compact_codes, n);
+    memcpy(buffer + n, compact_wide_codes, wideSize);
+    memcpy(buffer + n + wideSize, compact_runs, runsSize);
+    return buffer;
+}
+
+// The inverse of _newSerializedCompactStorage: copies each array out of the serialized form so it's
+// properly aligned, then decodes them.
+- (screen_char_t *)_newRawBufferFromSerializedCompactStorage:(const unsigned char *)buffer
+{
+    const int n = [self rawSpaceUsed] - start_offset;
+    const int wideSize = compact_wide_codes_count * sizeof(LineBlockWideCode);
+    const int runsSize = compact_runs_count * sizeof(LineBlockAttributeRun);
+    LineBlockWideCode *wideCodes = malloc(MAX(1, wideSize));
+    LineBlockAttributeRun *runs = malloc(MAX(1, runsSize));
+    memcpy(wideCodes, buffer + n, wideSize);
+    memcpy(runs, buffer + n + wideSize, runsSize);
+    screen_char_t *result = [self _newRawBufferFromCodes:buffer wideCodes:wideCodes runs:runs];
+    free(wideCodes);
+    free(runs);
+    return result;
+}
+
+// Inflates the serialized compact arrays from deflated bytes into a buffer of _compactSize bytes.
+- (void)_inflateBytes:(const unsigned char *)bytes
+               length:(int)length
+                 into:(unsigned char *)destination
+{
+    uLongf size = [self _compactSize];
+    int rc = uncompress(destination, &size, bytes, length);
+    assert(rc == Z_OK && size == [self _compactSize]);
+}
+
+// Returns a new raw buffer of buffer_size chars decoded from the compact arrays. Release it with
+// LineBlockReleaseRawBuffer().
+- (screen_char_t *)_newRawBufferFromCodes:(const unsigned char *)codes
+                                wideCodes:(const LineBlockWideCode *)wideCodes
+                                     runs:(const LineBlockAttributeRun *)runs
+{
+    screen_char_t *buffer = LineBlockAllocateRawBuffer(buffer_size);
+    screen_char_t *start = buffer + start_offset;
+    int i = 0;
+    int w = 0;
+    for (int r = 0; r < compact_runs_count; r++) {
+        screen_char_t c = runs[r].attributes;
+        const int end = i + runs[r].length;
+        for (; i < end; i++) {
+            if (codes[i] == kLineBlockWideCode) {
+                c.code = wideCodes[w].code;
+                c.complexChar = wideCodes[w].complexChar;
+                ++w;
+            } else {
+                c.code = codes[i];
+                c.complexChar = NO;
+            }
+            start[i] = c;
+        }
+    }
+    return buffer;
+}
+
+// Returns a new raw buffer decoded from the block's compact, compressed, or spilled form without
+// changing how the block is stored. The lock must be held. Release it with
+// LineBlockReleaseRawBuffer().
+- (screen_char_t *)_newRawBuffer
+{
+    if (compact_codes) {
+        return [self _newRawBufferFromCodes:compact_codes
+                                  wideCodes:compact_wide_codes
+                                       runs:compact_runs];
+    }
+    __block unsigned char *serialized = malloc(MAX(1, [self _compactSize]));
+    if (compressed_buffer) {
+        [self _inflateBytes:compressed_buffer length:compressed_size into:serialized];
+    } else if (archive_data) {
+        const unsigned char *bytes = (const unsigned char *)[archive_data bytes] + archive_offset;
+        if (spill_deflated) {
+            [self _inflateBytes:bytes length:compressed_size into:serialized];
+        } else {
+            memcpy(serialized, bytes, compressed_size);
+        }
+    } else {
+        assert(spill_file);
+        BOOL ok = [spill_file readOffset:spill_offset
+                                  length:compressed_size
+                               withBlock:^(const unsigned char *bytes) {
+                                   if (spill_deflated) {
+                                       [self _inflateBytes:bytes
+                                                    length:compressed_size
+                                                      into:serialized];
+                                   } else {
+                                       memcpy(serialized, bytes, compressed_size);
+                                   }
+                               }];
+        assert(ok);
+    }
+    screen_char_t *result = [self _newRawBufferFromSerializedCompactStorage:serialized];
+    free(serialized);
+    return result;
+}
+
+- (BOOL)compress
+{
+    @synchronized(self) {
+        return [self _compress];
+    }
+}
+
+- (BOOL)spillToFile:(LineBlockSpillFile *)file
+{
+    @synchronized(self) {
+        return [self _spillToFile:file];
+    }
+}
+
+- (void)compact
+{
+    @synchronized(self) {
+        [self _compact];
+    }
+}
+
+- (NSMutableData *)newArchiveRecord
+{
+    @synchronized(self) {
+        LineBlock *source = self;
+        if (raw_buffer) {
+            // Compact a copy, which shares the chars, so the receiver is left as it was.
+            source = [[self copy] autorelease];
+            [source _compact];
+        }
+
+        LineBlockArchiveHeader header;
+        memset(&header, 0, sizeof(header));
+        header.bufferSize = buffer_size;
+        header.startOffset = start_offset;
+        header.firstEntry = first_entry;
+        header.numEntries = cll_entries;
+        header.isPartial = is_partial;
+        header.wideCodesCount = source->compact_wide_codes_count;
+        header.runsCount = source->compact_runs_count;
+        header.hasDwc = source->compact_has_dwc;
+
+        const int linesLength = (sizeof(int) + sizeof(NSTimeInterval)) * cll_entries;
+        const int maxStorageLength = MAX([source _compactSize], source->compressed_size);
+        NSMutableData *record =
+            [[NSMutableData alloc] initWithCapacity:sizeof(header) + linesLength + maxStorageLength];
+        [record appendBytes:&header length:sizeof(header)];
+        [record appendBytes:cumulative_line_lengths length:sizeof(int) * cll_entries];
+        NSTimeInterval *timestamps = malloc(sizeof(NSTimeInterval) * MAX(1, cll_entries));
+        LineBlockTimestampsGetAll(&timestamps_, timestamps);
+        [record appendBytes:timestamps length:sizeof(NSTimeInterval) * cll_entries];
+        free(timestamps);
+
+        if (source->compact_codes) {
+            unsigned char *serialized = [source _newSerializedCompactStorage];
+            header.storageLength = [source _compactSize];
+            [record appendBytes:serialized length:header.storageLength];
+            free(serialized);
+        } else if (source->compressed_buffer) {
+            header.storageLength = compressed_size;
+            header.deflated = YES;
+            [record appendBytes:compressed_buffer length:compressed_size];
+        } else if (archive_data) {
+            header.storageLength = compressed_size;
+            header.deflated = spill_deflated;
+            [record appendBytes:(const unsigned char *)[archive_data bytes] + archive_offset
+                         length:compressed_size];
+        } else {
+            assert(spill_file);
+            header.storageLength = compressed_size;
+            header.deflated = spill_deflated;
+            BOOL ok = [spill_file readOffset:spill_offset
+                                      length:compressed_size
+                                   withBlock:^(const unsigned char *bytes) {
+                                       [record appendBytes:bytes length:compressed_size];
+                                   }];
+            assert(ok);
+        }
+        [record replaceBytesInRange:NSMakeRange(0, sizeof(header)) withBytes:&header];
+        return record;
+    }
+}
+
+- (void)setStartOffset:(int)startOffset firstEntry:(int)firstEntry
+{
+    if (startOffset <= start_offset ||
+        startOffset > [self rawSpaceUsed] ||
+        firstEntry < first_entry ||
+        firstEntry >= cll_entries) {
+        return;
+    }
+    // The compact arrays only hold chars from start_offset on, so moving it needs the raw buffer.
+    [self _expandIfNeeded];
+    start_offset = startOffset;
+    buffer_start = raw_buffer + start_offset;
+    first_entry = firstEntry;
+    cached_numlines_width = -1;
+    [self _invalidateWrappedLineIndex];
+}
+
+- (void)_compact
+{
+    if (!raw_buffer) {
+        return;
+    }
+    const int n = [self rawSpaceUsed] - start_offset;
+
+    // Count the wide codes and attribute runs so each array is allocated once at its exact size.
+    int numWideCodes = 0;
+    int numRuns = 0;
+    BOOL hasDwc = NO;
+    screen_char_t previousAttributes;
+    for (int i = 0; i < n; i++) {
+        screen_char_t c = buffer_start[i];
+        if (c.complexChar || c.code >= kLineBlockWideCode) {
+            ++numWideCodes;
+            hasDwc = hasDwc || (!c.complexChar && c.code == DWC_RIGHT);
+        }
+        c.code = 0;
+        c.complexChar = 0;
+        if (i == 0 || memcmp(&c, &previousAttributes, sizeof(c))) {
+            ++numRuns;
+            previousAttributes = c;
+        }
+    }
+
+    unsigned char *codes = malloc(MAX(1, n));
+    // Zeroed so the padding in each wide code is too, since the payload store compares the bytes.
+    LineBlockWideCode *wideCodes = calloc(MAX(1, numWideCodes), sizeof(LineBlockWideCode));
+    LineBlockAttributeRun *runs = malloc(MAX(1, numRuns) * sizeof(LineBlockAttributeRun));
+    int w = 0;
+    int r = -1;
+    for (int i = 0; i < n; i++) {
+        screen_char_t c = buffer_start[i];
+        if (c.complexChar || c.code >= kLineBlockWideCode) {
+            codes[i] = kLineBlockWideCode;
+            wideCodes[w].code = c.code;
+            wideCodes[w].complexChar = c.complexChar;
+            ++w;
+        } else {
+            codes[i] = c.code;
+        }
+        c.code = 0;
+        c.complexChar = 0;
+        if (r < 0 || memcmp(&c, &runs[r].attributes, sizeof(c))) {
+            ++r;
+            runs[r].length = 0;
+            runs[r].attributes = c;
+        }
+        ++runs[r].length;
+    }
+
+    if ([LineBlockPayloadStore isEnabled]) {
+        // Identical blocks in other buffers end up sharing one copy.
+        compact_payload = [[LineBlockPayloadStore sharedInstance] payloadWithCodes:codes
+                                                                        codesCount:n
+                                                                         wideCodes:wideCodes
+                                                                    wideCodesCount:numWideCodes
+                                                                              runs:runs
+                                                                         runsCount:numRuns
+                                                                            hasDwc:hasDwc];
+        codes = compact_payload->codes;
+        wideCodes = compact_payload->wideCodes;
+        runs = compact_payload->runs;
+    }
+
+    LineBlockReleaseRawBuffer(raw_buffer);
+    raw_buffer = NULL;
+    buffer_start = NULL;
+    compact_codes = codes;
+    compact_wide_codes = wideCodes;
+    compact_runs = runs;
+    compact_wide_codes_count = numWideCodes;
+    compact_runs_count = numRuns;
+    compact_has_dwc = hasDwc;
+}
+
+// Rebuilds the raw buffer of a block that isn't expanded.
+- (void)_expandIfNeeded
+{
+    // Only the main thread changes how a block is stored, so on the main thread an expanded block
+    // stays expanded without taking the lock. Background searches take it while they read.
+    if (raw_buffer) {
+        return;
+    }
+    @synchronized(self) {
+        screen_char_t *buffer = [self _newRawBuffer];
+        [self _freeCompactStorage];
+        free(compressed_buffer);
+        compressed_buffer = NULL;
+        if (spill_file) {
+            [spill_file freeOffset:spill_offset length:compressed_size];
+            [spill_file release];
+            spill_file = nil;
+        }
+        [archive_data release];
+        archive_data = nil;
+        compressed_size = 0;
+        raw_buffer = buffer;
+        buffer_start = raw_buffer + start_offset;
+    }
+}
+
+// Gives the block its own copy of a raw buffer that it shares with a copy of the block. Call this
+// before changing the buffer's contents.
+- (void)_makeRawBufferWritable
+{
+    if (!LineBlockRawBufferIsShared(raw_buffer)) {
+        return;
+    }
+    screen_char_t *newBuffer = LineBlockAllocateRawBuffer(buffer_size);
+    memcpy(newBuffer, raw_buffer, sizeof(screen_char_t) * [self rawSpaceUsed]);
+    LineBlockReleaseRawBuffer(raw_buffer);
+    raw_buffer = newBuffer;
+    buffer_start = raw_buffer + start_offset;
+}
+
+// Frees the compact arrays but not their counts, which a compressed block still needs.
+- (void)_freeCompactStorage
+{
+    if (compact_payload) {
+        [[LineBlockPayloadStore sharedInstance] releasePayload:compact_payload];
+        compact_payload = nil;
+    } else {
+        free(compact_codes);
+        free(compact_wide_codes);
+        free(compact_runs);
+    }
+    compact_codes = NULL;
+    compact_wide_codes = NULL;
+    compact_runs = NULL;
+}
+
 - (int)dropLines:(int)n withWidth:(int)width chars:(int *)charsDropped;
 {
+    [self _expandIfNeeded];
     int orig_n = n;
     int prev = 0;
     int length;
     int i;
     *charsDropped = 0;
     int initialOffset = start_offset;
+    [self _invalidateWrappedLineIndex];
     for (i = first_entry; i < cll_entries; ++i) {
         int cll = cumulative_line_lengths[i] - start_offset;
         length = cll - prev;
@@ -573,6 +1270,7 @@ int OffsetOfWrappedLine(screen_char_t* p, int n, int length, int width) {
     // Consumed the whole buffer.
     cached_numlines_width = -1;
     cll_entries = 0;
+    LineBlockTimestampsRemoveAll(&timestamps_);
     buffer_start = raw_buffer;
     start_offset = 0;
     first_entry = 0;
@@ -656,6 +1354,27 @@ static NSString* RewrittenRegex(NSString* originalRegex) {
     return rewritten;
 }
 
+// Returns |chars| wrapped in the kPrefixChar and kSuffixChar markers that RewrittenRegex() turns
+// ^ and $ into. Literal markers in the text are replaced so they can't match.
+static NSString *RegexSandwich(const unichar *chars, int length, BOOL hasPrefix, BOOL hasSuffix) {
+    unichar *sandwich = malloc(sizeof(unichar) * (length + 2));
+    int o = 0;
+    if (hasPrefix) {
+        sandwich[o++] = kPrefixChar;
+    }
+    for (int i = 0; i < length; i++) {
+        unichar c = chars[i];
+        sandwich[o++] = (c == kPrefixChar || c == kSuffixChar) ? 3 : c;
+    }
+    if (hasSuffix) {
+        sandwich[o++] = kSuffixChar;
+    }
+    return [[[NSString alloc] initWithCharactersNoCopy:sandwich
+                                                length:o
+                                          freeWhenDone:YES] autorelease];
+}
+
+// For FindOptRegex, |needle| must already have been passed through RewrittenRegex().
 static int CoreSearch(NSString* needle, screen_char_t* rawline, int raw_line_length, int start, int end,
                       int options, int* resultLength, NSString* haystack, unichar* charHaystack,
                       int* deltas, int deltaOffset)
@@ -673,61 +1392,48 @@ static int CoreSearch(NSString* needle, screen_char_t* rawline, int raw_line_len
         if (options & FindOptBackwards) {
             backwards = YES;
         }
-        if (options & FindOptCaseInsensitive) {
-            apiOptions |= RKLCaseless;
-        }
-        
-        NSError* regexError = nil;
-        NSRange temp;
-        NSString* rewrittenRegex = RewrittenRegex(needle);
-        NSString* sanitizedHaystack = [haystack stringByReplacingOccurrencesOfString:[NSString stringWithFormat:@"%c", kPrefixChar]
-                                                                          withString:[NSString stringWithFormat:@"%c", 3]];
-        sanitizedHaystack = [sanitizedHaystack stringByReplacingOccurrencesOfString:[NSString stringWithFormat:@"%c", kSuffixChar]
-                                                                         withString:[NSString stringWithFormat:@"%c", 3]];
-        
-        NSString* sandwich;
-        BOOL hasPrefix = YES;
-        BOOL hasSuffix = YES;
-        if (end == raw_line_length) {
-            if (start == 0) {
-                sandwich = [NSString stringWithFormat:@"%C%@%C", kPrefixChar, sanitizedHaystack, kSuffixChar];
-            } else {
-                hasPrefix = NO;
-                sandwich = [NSString stringWithFormat:@"%@%C", sanitizedHaystack, kSuffixChar];
-            }
-        } else {
-            hasSuffix = NO;
-            sandwich = [NSString stringWithFormat:@"%C%@", kPrefixChar, sanitizedHaystack];
+        CompiledRegex *compiledRegex =
+            [CompiledRegex regexWithPattern:needle
+                            caseInsensitive:(options & FindOptCaseInsensitive) != 0];
+        if (!compiledRegex) {
+            NSLog(@"Invalid regex: %@", needle);
+            return -1;
         }
-        
-        temp = [sandwich rangeOfRegex:rewrittenRegex
-                              options:apiOptions
-                              inRange:NSMakeRange(0, [sandwich length])
-                              capture:0
-                                error:&regexError];
-        range = temp;
+
+        const BOOL hasSuffix = (end == raw_line_length);
+        const BOOL hasPrefix = (start == 0 || !hasSuffix);
+        NSString* sandwich = RegexSandwich(charHaystack, [haystack length], hasPrefix, hasSuffix);
+        const NSUInteger sandwichLength = [sandwich length];
         
         if (backwards) {
-            int locationAdjustment = hasSuffix ? 1 : 0;
-            // keep searching from one char after the start of the match until we don't find anything.
-            // regexes aren't good at searching backwards.
-            while (!regexError && temp.location != NSNotFound && temp.location+locationAdjustment < [sandwich length]) {
-                if (temp.length != 0) {
-                    range = temp;
-                }
-                temp.location += MAX(1, temp.length);
-                temp = [sandwich rangeOfRegex:rewrittenRegex
-                                      options:apiOptions
-                                      inRange:NSMakeRange(temp.location, [sandwich length] - temp.location)
-                                      capture:0
-                                        error:&regexError];
-            }
+            // Regexes aren't good at searching backwards, so make one forward pass and keep the
+            // last nonempty match. A match that begins on the suffix char only matched $.
+            const int locationAdjustment = hasSuffix ? 1 : 0;
+            __block NSRange lastMatch = NSMakeRange(NSNotFound, 0);
+            [compiledRegex enumerateMatchesInString:sandwich
+                                              range:NSMakeRange(0, sandwichLength)
+                                           deadline:0
+                                         usingBlock:^(const NSRange *ranges, int count, BOOL *stop) {
+                                             NSRange match = ranges[0];
+                                             if (lastMatch.location == NSNotFound) {
+                                                 lastMatch = match;
+                                             }
+                                             if (match.location + locationAdjustment >= sandwichLength) {
+                                                 *stop = YES;
+                                             } else if (match.length != 0) {
+                                                 lastMatch = match;
+                                             }
+                                         }];
+            range = lastMatch;
+        } else {
+            range = [compiledRegex rangeOfFirstMatchInString:sandwich
+                                                       range:NSMakeRange(0, sandwichLength)];
         }
         if (range.length == 0) {
             range.location = NSNotFound;
         }
-        if (!regexError && range.location != NSNotFound) {
-            if (hasSuffix && range.location + range.length == [sandwich length]) {
+        if (range.location != NSNotFound) {
+            if (hasSuffix && range.location + range.length == sandwichLength) {
                 // match includes $
                 --range.length;
                 if (range.length == 0) {
@@ -745,11 +1451,6 @@ static int CoreSearch(NSString* needle, screen_char_t* rawline, int raw_line_len
             // match on ^ or $
             range.location = NSNotFound;
         }
-        if (regexError) {
-            NSLog(@"regex error: %@", regexError);
-            range.length = 0;
-            range.location = NSNotFound;
-        }
     } else {
         if (options & FindOptBackwards) {
             apiOptions |= NSBackwardsSearch;
@@ -772,6 +1473,182 @@ static int CoreSearch(NSString* needle, screen_char_t* rawline, int raw_line_len
     return result;
 }
 
+// Needles longer than this always take the NSString path.
+static const int kMaxPlainNeedleLength = 256;
+
+// In a search table, code units that don't fold to exactly one character of their own map to
+// kUnfoldableCode, which sends the search down the NSString path. DWC_RIGHT maps to kSkippedCode:
+// it's not part of the text, so matches step over it.
+static const unichar kUnfoldableCode = 0xffff;
+static const unichar kSkippedCode = 0xfffe;
+
+// Returns YES if |c| can't be compared on its own because Foundation would treat it as part of
+// the character before it or together with its neighbors.
+static BOOL CodeUnitNeedsContext(int c, NSCharacterSet *marks) {
+    if (IsHighSurrogate(c) || IsLowSurrogate(c) || c == UNICODE_REPLACEMENT_CHAR || c >= 0xfffe) {
+        return YES;
+    }
+    // Conjoining jamo compose with each other into syllables.
+    if ((c >= 0x1100 && c <= 0x11ff) || (c >= 0xa960 && c <= 0xa97f) || (c >= 0xd7b0 && c <= 0xd7ff)) {
+        return YES;
+    }
+    return [marks characterIsMember:c];
+}
+
+// Fills |table| with what each code unit is compared as: its canonical form for a case-sensitive
+// search, or for a case-insensitive one the same case, diacritic, and width folding that
+// rangeOfString: does with NSCaseInsensitiveSearch | NSDiacriticInsensitiveSearch |
+// NSWidthInsensitiveSearch. ASCII is done by hand; the rest is asked of Foundation one code unit
+// at a time, so this takes a while.
+static void BuildSearchTable(unichar *table, BOOL caseInsensitive) {
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    NSCharacterSet *marks = [[NSCharacterSet nonBaseCharacterSet] retain];
+    for (int c = 0; c < 0x80; c++) {
+        table[c] = (caseInsensitive && c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
+    }
+    for (int c = 0x80; c < 65536; c++) {
+        if (c >= ITERM2_PRIVATE_BEGIN && c <= ITERM2_PRIVATE_END) {
+            // Never in a needle (see GetPlainNeedle), so these never match.
+            table[c] = c;
+            continue;
+        }
+        if (CodeUnitNeedsContext(c, marks)) {
+            table[c] = kUnfoldableCode;
+            continue;
+        }
+        unichar ch = c;
+        NSString *string = [[NSString alloc] initWithCharacters:&ch length:1];
+        NSString *folded;
+        if (caseInsensitive) {
+            folded = [string stringByFoldingWithOptions:(NSCaseInsensitiveSearch |
+                                                         NSDiacriticInsensitiveSearch |
+                                                         NSWidthInsensitiveSearch)
+                                                 locale:nil];
+        } else {
+            folded = [string precomposedStringWithCanonicalMapping];
+        }
+        table[c] = ([folded length] == 1) ? [folded characterAtIndex:0] : kUnfoldableCode;
+        [string release];
+        if ((c & 0xfff) == 0) {
+            [pool drain];
+            pool = [[NSAutoreleasePool alloc] init];
+        }
+    }
+    table[DWC_RIGHT] = kSkippedCode;
+    [marks release];
+    [pool drain];
+}
+
+// Each table is made the first time it's needed.
+static const unichar *SearchTable(BOOL caseInsensitive) {
+    static unichar caseSensitiveTable[65536];
+    static unichar caseInsensitiveTable[65536];
+    static dispatch_once_t caseSensitiveOnce;
+    static dispatch_once_t caseInsensitiveOnce;
+    if (caseInsensitive) {
+        dispatch_once(&caseInsensitiveOnce, ^{
+            BuildSearchTable(caseInsensitiveTable, YES);
+        });
+        return caseInsensitiveTable;
+    } else {
+        dispatch_once(&caseSensitiveOnce, ^{
+            BuildSearchTable(caseSensitiveTable, NO);
+        });
+        return caseSensitiveTable;
+    }
+}
+
+void LineBlockPrepareSearchTables(void) {
+    SearchTable(YES);
+    SearchTable(NO);
+}
+
+// Fills |buffer| with the needle's characters passed through the search table for |options| and
+// returns the table if the needle can be matched cell-for-cell against text that folds through it.
+// That is the case when it is not a regex, is nonempty, and every character folds to one of its
+// own. Then rangeOfString:'s case, diacritic, and width insensitivity reduce to comparing folded
+// code units. Returns NULL otherwise.
+static const unichar *GetPlainNeedle(NSString *needle, int options, unichar *buffer, int *length) {
+    if (options & FindOptRegex) {
+        return NULL;
+    }
+    int n = [needle length];
+    if (n == 0 || n > kMaxPlainNeedleLength) {
+        return NULL;
+    }
+    const unichar *table = SearchTable((options & FindOptCaseInsensitive) != 0);
+    [needle getCharacters:buffer range:NSMakeRange(0, n)];
+    for (int i = 0; i < n; i++) {
+        unichar c = buffer[i];
+        if (c >= ITERM2_PRIVATE_BEGIN && c <= ITERM2_PRIVATE_END) {
+            return NULL;
+        }
+        c = table[c];
+        if (c == kUnfoldableCode || c == kSkippedCode) {
+            return NULL;
+        }
+        buffer[i] = c;
+    }
+    *length = n;
+    return table;
+}
+
+// Returns YES if every cell in [start, end) can be compared on its own through |table|: none is a
+// complex char and each folds to one character (or is the right half of a double-width one).
+static BOOL RangeIsFoldable(screen_char_t *rawline, int start, int end, const unichar *table) {
+    for (int i = start; i < end; i++) {
+        if (rawline[i].complexChar || table[rawline[i].code] == kUnfoldableCode) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+// Finds |needle|, already folded through |table|, among the cells in [start, end) without building
+// a string. Returns the cell offset of the first match, or of the last when searching backwards,
+// or -1 if there is none. A match's length in cells goes in |resultLength|; it includes any
+// DWC_RIGHTs within it or right after it, as the NSString path's would. The first needle
+// character is scanned for on its own and only candidate positions are compared in full.
+static int PlainSearch(const unichar *needle,
+                       int needleLength,
+                       screen_char_t *rawline,
+                       int start,
+                       int end,
+                       int options,
+                       const unichar *table,
+                       int *resultLength) {
+    const int last = end - needleLength;
+    const unichar first = needle[0];
+    const int step = (options & FindOptBackwards) ? -1 : 1;
+    int i = (step > 0) ? start : last;
+    for (; i >= start && i <= last; i += step) {
+        if (table[rawline[i].code] != first) {
+            continue;
+        }
+        int j = 1;
+        int k = i + 1;
+        while (j < needleLength && k < end) {
+            const unichar c = table[rawline[k].code];
+            if (c == kSkippedCode) {
+                k++;
+            } else if (c == needle[j]) {
+                j++;
+                k++;
+            } else {
+                break;
+            }
+        }
+        if (j == needleLength) {
+            while (k < end && rawline[k].code == DWC_RIGHT) {
+                k++;
+            }
+            *resultLength = k - i;
+            return i;
+        }
+    }
+    return -1;
+}
+
 static int Search(NSString* needle,
                   screen_char_t* rawline,
                   int raw_line_length,
@@ -780,6 +1657,14 @@ static int Search(NSString* needle,
                   int options,
                   int* resultLength)
 {
+    unichar plainNeedle[kMaxPlainNeedleLength];
+    int plainNeedleLength;
+    const unichar *table = GetPlainNeedle(needle, options, plainNeedle, &plainNeedleLength);
+    if (table && RangeIsFoldable(rawline, start, end, table)) {
+        return PlainSearch(plainNeedle, plainNeedleLength, rawline, start, end, options, table,
+                           resultLength);
+    }
+
     NSString* haystack;
     unichar* charHaystack;
     int* deltas;
@@ -803,9 +1688,10 @@ static int Search(NSString* needle,
                    skip:(int) skip
                  length:(int) raw_line_length
         multipleResults:(BOOL)multipleResults
-                results:(NSMutableArray*)results
+                results:(NSMutableData *)results
+              rawBuffer:(screen_char_t *)rawBuffer
 {
-    screen_char_t* rawline = raw_buffer + [self _lineRawOffset:entry];
+    screen_char_t* rawline = rawBuffer + [self _lineRawOffset:entry];
     if (skip > raw_line_length) {
         skip = raw_line_length;
     }
@@ -845,9 +1731,9 @@ static int Search(NSString* needle,
         // to add to the haystack in the worst localized case. With decomposed
         // diacriticals, the upper bound is unclear.
         //
-        // I'm going to err on the side of correctness over performance. I'm
-        // sure this could be improved if needed. One obvious
-        // approach is to use the naïve algorithm when the text is all ASCII.
+        // I'm going to err on the side of correctness over performance. When
+        // every character of the needle and the line folds to exactly one
+        // character none of this applies, so cells are matched directly.
         //
         // Thus, the algorithm is to do a reverse search until a hit is found
         // that begins not before 'skip', which is the leftmost acceptable
@@ -857,6 +1743,22 @@ static int Search(NSString* needle,
         int tempResultLength;
         int tempPosition;
         
+        unichar plainNeedle[kMaxPlainNeedleLength];
+        int plainNeedleLength;
+        const unichar *table = GetPlainNeedle(needle, options, plainNeedle, &plainNeedleLength);
+        if (table && RangeIsFoldable(rawline, 0, raw_line_length, table)) {
+            do {
+                tempPosition = PlainSearch(plainNeedle, plainNeedleLength, rawline, 0, limit,
+                                           options, table, &tempResultLength);
+                // As below, the next haystack ends just before the last cell of this match.
+                limit = tempPosition + tempResultLength - 1;
+                if (tempPosition != -1 && tempPosition <= skip) {
+                    ResultRangeAppend(results, tempPosition, tempResultLength);
+                }
+            } while (tempPosition != -1 && (multipleResults || tempPosition > skip));
+            return;
+        }
+
         NSString* haystack;
         unichar* charHaystack;
         int* deltas;
@@ -884,10 +1786,7 @@ static int Search(NSString* needle,
                 --numUnichars;
             }
             if (tempPosition != -1 && tempPosition <= skip) {
-                ResultRange* r = [[[ResultRange alloc] init] autorelease];
-                r->position = tempPosition;
-                r->length = tempResultLength;
-                [results addObject:r];
+                ResultRangeAppend(results, tempPosition, tempResultLength);
             }
         } while (tempPosition != -1 && (multipleResults || tempPosition > skip));
         free(deltas);
@@ -901,10 +1800,7 @@ static int Search(NSString* needle,
             tempPosition = Search(needle, rawline, raw_line_length, skip, raw_line_length,
                                   options, &tempResultLength);
             if (tempPosition != -1) {
-                ResultRange* r = [[[ResultRange alloc] init] autorelease];
-                r->position = tempPosition;
-                r->length = tempResultLength;
-                [results addObject:r];
+                ResultRangeAppend(results, tempPosition, tempResultLength);
                 if (!multipleResults) {
                     break;
                 }
@@ -942,11 +1838,162 @@ static int Search(NSString* needle,
     return -1;
 }
 
+// Returns the index key of a char: its code with ASCII letters folded to lowercase, or -1 if it
+// isn't plain ASCII.
+static inline int NgramKey(unichar code, BOOL complexChar) {
+    if (code >= 0x80 || complexChar) {
+        return -1;
+    }
+    return (code >= 'A' && code <= 'Z') ? (code | 0x20) : code;
+}
+
+static inline void NgramBit(int a, int b, int c, int *byte, unsigned char *mask) {
+    const uint32_t trigram = (a << 14) | (b << 7) | c;
+    const uint32_t bit = (trigram * 2654435761u) >> (32 - kNgramIndexBitsLog2);
+    *byte = bit >> 3;
+    *mask = 1 << (bit & 7);
+}
+
+- (void)buildNgramIndex
+{
+    @synchronized(self) {
+        [self _expandIfNeeded];
+        if (!ngram_index) {
+            ngram_index = malloc(kNgramIndexBytes);
+        }
+        memset(ngram_index, 0, kNgramIndexBytes);
+        ngram_index_has_non_ascii = NO;
+        // Trigrams that span two lines are indexed too. That only adds false positives.
+        const int n = [self rawSpaceUsed] - start_offset;
+        int a = -1;
+        int b = -1;
+        for (int i = 0; i < n; i++) {
+            const int c = NgramKey(buffer_start[i].code, buffer_start[i].complexChar);
+            if (c < 0) {
+                ngram_index_has_non_ascii = YES;
+                a = b = -1;
+                continue;
+            }
+            if (a >= 0) {
+                int byte;
+                unsigned char mask;
+                NgramBit(a, b, c, &byte, &mask);
+                ngram_index[byte] |= mask;
+            }
+            a = b;
+            b = c;
+        }
+    }
+}
+
+- (long long)ngramIndexBytes
+{
+    return ngram_index ? kNgramIndexBytes : 0;
+}
+
+- (NSString *)newPlainText
+{
+    @synchronized(self) {
+        [self _expandIfNeeded];
+        const int n = [self rawSpaceUsed] - start_offset;
+        unichar *chars = malloc(MAX(1, n + cll_entries) * sizeof(unichar));
+        int length = 0;
+        int prev = first_entry > 0 ? cumulative_line_lengths[first_entry - 1] : 0;
+        for (int i = first_entry; i < cll_entries; i++) {
+            for (int j = MAX(prev, start_offset); j < cumulative_line_lengths[i]; j++) {
+                const screen_char_t c = buffer_start[j - start_offset];
+                if (c.code == DWC_RIGHT && !c.complexChar) {
+                    continue;
+                }
+                if (c.complexChar || !c.code || c.code == TAB_FILLER) {
+                    chars[length++] = ' ';
+                } else {
+                    chars[length++] = c.code;
+                }
+            }
+            if (i < cll_entries - 1 || !is_partial) {
+                chars[length++] = '\n';
+            }
+            prev = cumulative_line_lengths[i];
+        }
+        return [[NSString alloc] initWithCharactersNoCopy:chars length:length freeWhenDone:YES];
+    }
+}
+
+// Returns NO if the trigram index proves that no line in the block contains |substring|. Only
+// plain ASCII substrings of three or more chars can be ruled out. A case-sensitive search can't
+// match ASCII to other chars, so those merely break up the indexed trigrams. A case-insensitive
+// search is also diacritic- and width-insensitive, so a block with any non-ASCII chars is always a
+// candidate.
+- (BOOL)_ngramIndexMayContain:(NSString *)substring options:(int)options
+{
+    if (!ngram_index || (options & FindOptRegex)) {
+        return YES;
+    }
+    if ((options & FindOptCaseInsensitive) && ngram_index_has_non_ascii) {
+        return YES;
+    }
+    const int n = [substring length];
+    if (n < 3) {
+        return YES;
+    }
+    int a = -1;
+    int b = -1;
+    for (int i = 0; i < n; i++) {
+        const int c = NgramKey([substring characterAtIndex:i], NO);
+        if (c < 0) {
+            return YES;
+        }
+        if (a >= 0) {
+            int byte;
+            unsigned char mask;
+            NgramBit(a, b, c, &byte, &mask);
+            if (!(ngram_index[byte] & mask)) {
+                return NO;
+            }
+        }
+        a = b;
+        b = c;
+    }
+    return YES;
+}
+
 - (void)findSubstring:(NSString*)substring
               options:(int)options
              atOffset:(int)offset
-              results:(NSMutableArray*)results
+              results:(NSMutableData *)results
       multipleResults:(BOOL)multipleResults
+{
+    @synchronized(self) {
+        if (![self _ngramIndexMayContain:substring options:options]) {
+            return;
+        }
+    }
+    // Rewrite the regex once for the whole block rather than once per line. CompiledRegex caches
+    // the compiled pattern by its string.
+    if (options & FindOptRegex) {
+        substring = RewrittenRegex(substring);
+    }
+    // This may run on a background thread, so rather than expanding the block it decodes it into a
+    // temporary buffer.
+    @synchronized(self) {
+        screen_char_t *decoded = raw_buffer ? NULL : [self _newRawBuffer];
+        [self _findSubstring:substring
+                     options:options
+                    atOffset:offset
+                     results:results
+             multipleResults:multipleResults
+                   rawBuffer:decoded ? decoded : raw_buffer];
+        LineBlockReleaseRawBuffer(decoded);
+    }
+}
+
+- (void)_findSubstring:(NSString*)substring
+               options:(int)options
+              atOffset:(int)offset
+               results:(NSMutableData *)results
+       multipleResults:(BOOL)multipleResults
+             rawBuffer:(screen_char_t *)rawBuffer
 {
     if (offset == -1) {
         offset = [self rawSpaceUsed] - 1;
@@ -973,19 +2020,21 @@ static int Search(NSString* needle,
         if (skipped < 0) {
             skipped = 0;
         }
-        NSMutableArray* newResults = [NSMutableArray arrayWithCapacity:1];
+        const int firstNewResult = ResultRangeCount(results);
         [self _findInRawLine:entry
                       needle:substring
                      options:options
                         skip:skipped
                       length:[self _lineLength: entry]
              multipleResults:multipleResults
-                     results:newResults];
-        for (ResultRange* r in newResults) {
-            r->position += line_raw_offset;
-            [results addObject:r];
+                     results:results
+                   rawBuffer:rawBuffer];
+        const int numResults = ResultRangeCount(results);
+        ResultRange *newResults = [results mutableBytes];
+        for (int i = firstNewResult; i < numResults; i++) {
+            newResults[i].position += line_raw_offset;
         }
-        if ([newResults count] && !multipleResults) {
+        if (numResults > firstNewResult && !multipleResults) {
             return;
         }
         entry += dir;
@@ -998,6 +2047,7 @@ static int Search(NSString* needle,
                     toX:(int*)x
                     toY:(int*)y
 {
+    [self _expandIfNeeded];
     int i;
     *x = 0;
     *y = 0;
@@ -0,0 +1,62 @@
+//
+//  LineBlockPayloadStore.h
+//  iTerm
+//
+//  Shares the compact chars of identical full LineBlocks between all the LineBuffers in the process.
+//  When many sessions get the same output (broadcast input, or the same log tailed from the start)
+//  their full blocks are identical, so the chars are kept once however many blocks have them.
+//
+
+#import <Foundation/Foundation.h>
+#import "LineBlock.h"
+
+@class MemoryReport;
+
+// The compact arrays of a block (see -[LineBlock compact]). Immutable once it's in the store.
+@interface LineBlockPayload : NSObject {
+@public
+    unsigned char *codes;
+    LineBlockWideCode *wideCodes;
+    LineBlockAttributeRun *runs;
+    int codesCount;
+    int wideCodesCount;
+    int runsCount;
+    BOOL hasDwc;
+
+    uint64_t hash_;
+    int users_;  // Blocks using this payload. Guarded by the store's lock.
+}
+@end
+
+// Thread safe, since blocks may be freed on a background thread.
+@interface LineBlockPayloadStore : NSObject {
+    NSMutableDictionary *payloadsByHash_;  // NSNumber hash -> NSMutableArray of LineBlockPayload
+    long long storedBytes_;   // Bytes of the distinct payloads in the store.
+    long long sharedBytes_;   // Bytes the blocks using them would take with their own copies.
+    long long hits_;          // Payloads that turned out to be already in the store.
+}
+
++ (LineBlockPayloadStore *)sharedInstance;
+
+// Set the DisableScrollbackDeduplication user default to keep every block's chars to itself.
++ (BOOL)isEnabled;
+
+// Takes ownership of the malloced arrays. If an identical payload is already in the store they're
+// freed and that one is returned instead. Either way the caller must pass the result to
+// -releasePayload: when it's done with it.
+- (LineBlockPayload *)payloadWithCodes:(unsigned char *)codes
+                            codesCount:(int)codesCount
+                             wideCodes:(LineBlockWideCode *)wideCodes
+                        wideCodesCount:(int)wideCodesCount
+                                  runs:(LineBlockAttributeRun *)runs
+                             runsCount:(int)runsCount
+                                hasDwc:(BOOL)hasDwc;
+
+- (void)releasePayload:(LineBlockPayload *)payload;
+
+// Bytes used by blocks' compact chars divided by the bytes actually stored. 1 if nothing is shared.
+- (double)deduplicationRatio;
+
+- (void)addToMemoryReport:(MemoryReport *)report;
+
+@end
@@ -0,0 +1,184 @@
+//
+//  LineBlockPayloadStore.m
+//  iTerm
+//
+
+#import "LineBlockPayloadStore.h"
+#import "MemoryReport.h"
+
+static uint64_t LineBlockPayloadHashBytes(uint64_t hash, const void *bytes, size_t length) {
+    // FNV-1a
+    const unsigned char *p = bytes;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+@implementation LineBlockPayload
+
+- (void)dealloc
+{
+    free(codes);
+    free(wideCodes);
+    free(runs);
+    [super dealloc];
+}
+
+- (long long)bytes
+{
+    return (codesCount +
+            (long long)wideCodesCount * sizeof(LineBlockWideCode) +
+            (long long)runsCount * sizeof(LineBlockAttributeRun));
+}
+
+- (BOOL)isEqualToPayload:(LineBlockPayload *)other
+{
+    return (hash_ == other->hash_ &&
+            codesCount == other->codesCount &&
+            wideCodesCount == other->wideCodesCount &&
+            runsCount == other->runsCount &&
+            hasDwc == other->hasDwc &&
+            !memcmp(codes, other->codes, codesCount) &&
+            !memcmp(wideCodes, other->wideCodes, wideCodesCount * sizeof(LineBlockWideCode)) &&
+            !memcmp(runs, other->runs, runsCount * sizeof(LineBlockAttributeRun)));
+}
+
+@end
+
+@implementation LineBlockPayloadStore
+
++ (LineBlockPayloadStore *)sharedInstance
+{
+    static LineBlockPayloadStore *instance;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        instance = [[LineBlockPayloadStore alloc] init];
+    });
+    return instance;
+}
+
++ (BOOL)isEnabled
+{
+    static BOOL enabled;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        enabled = ![[NSUserDefaults standardUserDefaults] boolForKey:@"DisableScrollbackDeduplication"];
+    });
+    return enabled;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        payloadsByHash_ = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [payloadsByHash_ release];
+    [super dealloc];
+}
+
+- (LineBlockPayload *)payloadWithCodes:(unsigned char *)codes
+                            codesCount:(int)codesCount
+                             wideCodes:(LineBlockWideCode *)wideCodes
+                        wideCodesCount:(int)wideCodesCount
+                                  runs:(LineBlockAttributeRun *)runs
+                             runsCount:(int)runsCount
+                                hasDwc:(BOOL)hasDwc
+{
+    LineBlockPayload *payload = [[LineBlockPayload alloc] init];
+    payload->codes = codes;
+    payload->codesCount = codesCount;
+    payload->wideCodes = wideCodes;
+    payload->wideCodesCount = wideCodesCount;
+    payload->runs = runs;
+    payload->runsCount = runsCount;
+    payload->hasDwc = hasDwc;
+
+    // Hashing happens outside the lock since it reads the whole block.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = LineBlockPayloadHashBytes(hash, codes, codesCount);
+    hash = LineBlockPayloadHashBytes(hash, wideCodes, wideCodesCount * sizeof(LineBlockWideCode));
+    hash = LineBlockPayloadHashBytes(hash, runs, runsCount * sizeof(LineBlockAttributeRun));
+    payload->hash_ = hash;
+
+    NSNumber *key = @(hash);
+    @synchronized(self) {
+        NSMutableArray *candidates = [payloadsByHash_ objectForKey:key];
+        for (LineBlockPayload *existing in candidates) {
+            if ([existing isEqualToPayload:payload]) {
+                existing->users_++;
+                sharedBytes_ += [existing bytes];
+                hits_++;
+                [payload release];
+                return [existing retain];
+            }
+        }
+        if (!candidates) {
+            candidates = [NSMutableArray array];
+            [payloadsByHash_ setObject:candidates forKey:key];
+        }
+        payload->users_ = 1;
+        [candidates addObject:payload];
+        storedBytes_ += [payload bytes];
+        sharedBytes_ += [payload bytes];
+    }
+    return payload;
+}
+
+- (void)releasePayload:(LineBlockPayload *)payload
+{
+    @synchronized(self) {
+        sharedBytes_ -= [payload bytes];
+        if (--payload->users_ == 0) {
+            storedBytes_ -= [payload bytes];
+            NSNumber *key = @(payload->hash_);
+            NSMutableArray *candidates = [payloadsByHash_ objectForKey:key];
+            [candidates removeObjectIdenticalTo:payload];
+            if (![candidates count]) {
+                [payloadsByHash_ removeObjectForKey:key];
+            }
+        }
+    }
+    [payload release];
+}
+
+- (double)deduplicationRatio
+{
+    @synchronized(self) {
+        return storedBytes_ ? (double)sharedBytes_ / storedBytes_ : 1;
+    }
+}
+
+- (void)addToMemoryReport:(MemoryReport *)report
+{
+    long long stored;
+    long long shared;
+    long long hits;
+    int count;
+    @synchronized(self) {
+        stored = storedBytes_;
+        shared = sharedBytes_;
+        hits = hits_;
+        count = 0;
+        for (NSArray *candidates in [payloadsByHash_ allValues]) {
+            count += [candidates count];
+        }
+    }
+    // Blocks' compact chars are counted in each session's section already, so only the savings
+    // are shown here.
+    [report addUncountedBytes:stored forCategory:@"Deduplicated scrollback (stored)"];
+    [report addCount:count forCategory:@"Deduplicated scrollback blocks"];
+    [report addUncountedBytes:shared - stored
+                  forCategory:[NSString stringWithFormat:@"Deduplicated scrollback (saved, ratio %.2f)",
+                                  stored ? (double)shared / stored : 1.0]];
+    [report addCount:hits forCategory:@"Deduplicated scrollback hits"];
+}
+
+@end
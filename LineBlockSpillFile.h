@@ -0,0 +1,31 @@
+#import <Foundation/Foundation.h>
+
+// A scratch file that LineBlocks write their contents to so scrollback can exceed RAM. The file is
+// created in the user's private temporary directory and unlinked immediately, so it's readable only
+// by this process and disappears when it exits. Space freed by blocks is reused by later writes.
+// All methods are thread-safe because blocks may be released on a background thread.
+@interface LineBlockSpillFile : NSObject {
+    int fd_;
+    long long length_;  // Bytes allocated in the file so far.
+    NSMutableIndexSet *free_;  // Byte offsets below length_ not used by any block.
+}
+
+// Returns nil if the file can't be created.
+- (id)init;
+
+// Writes bytes to an unused range of the file and returns its offset, or -1 on failure.
+- (long long)writeBytes:(const void *)bytes length:(int)length;
+
+// Maps a range previously returned by writeBytes:length: and passes it to the block. The OS pages
+// it in on demand. Returns NO if the range could not be mapped.
+- (BOOL)readOffset:(long long)offset
+            length:(int)length
+         withBlock:(void (^)(const unsigned char *bytes))block;
+
+// Makes a range available for reuse.
+- (void)freeOffset:(long long)offset length:(int)length;
+
+// Bytes in use by blocks.
+- (long long)bytesUsed;
+
+@end
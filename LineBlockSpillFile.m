@@ -0,0 +1,97 @@
+#import "LineBlockSpillFile.h"
+#include <sys/mman.h>
+#include <unistd.h>
+
+@implementation LineBlockSpillFile
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        NSString *template =
+            [NSTemporaryDirectory() stringByAppendingPathComponent:@"iTerm2-scrollback.XXXXXX"];
+        char *path = strdup([template fileSystemRepresentation]);
+        fd_ = mkstemp(path);
+        if (fd_ >= 0) {
+            unlink(path);
+        }
+        free(path);
+        if (fd_ < 0) {
+            [self release];
+            return nil;
+        }
+        free_ = [[NSMutableIndexSet alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+    [free_ release];
+    [super dealloc];
+}
+
+- (long long)writeBytes:(const void *)bytes length:(int)length
+{
+    @synchronized(self) {
+        __block long long offset = -1;
+        [free_ enumerateRangesUsingBlock:^(NSRange range, BOOL *stop) {
+            if (range.length >= length) {
+                offset = range.location;
+                *stop = YES;
+            }
+        }];
+        BOOL append = (offset < 0);
+        if (append) {
+            offset = length_;
+        }
+        if (pwrite(fd_, bytes, length, offset) != length) {
+            return -1;
+        }
+        if (append) {
+            length_ += length;
+        } else {
+            [free_ removeIndexesInRange:NSMakeRange(offset, length)];
+        }
+        return offset;
+    }
+}
+
+- (BOOL)readOffset:(long long)offset
+            length:(int)length
+         withBlock:(void (^)(const unsigned char *bytes))block
+{
+    // mmap needs a page-aligned offset, so map from the start of the page holding offset.
+    static long long pageSize;
+    if (!pageSize) {
+        pageSize = sysconf(_SC_PAGESIZE);
+    }
+    const long long mapOffset = offset - (offset % pageSize);
+    const size_t mapLength = (size_t)(offset - mapOffset + length);
+    void *map = mmap(NULL, mapLength, PROT_READ, MAP_SHARED, fd_, mapOffset);
+    if (map == MAP_FAILED) {
+        return NO;
+    }
+    block((const unsigned char *)map + (offset - mapOffset));
+    munmap(map, mapLength);
+    return YES;
+}
+
+- (void)freeOffset:(long long)offset length:(int)length
+{
+    @synchronized(self) {
+        [free_ addIndexesInRange:NSMakeRange(offset, length)];
+    }
+}
+
+- (long long)bytesUsed
+{
+    @synchronized(self) {
+        return length_ - [free_ count];
+    }
+}
+
+@end
@@ -0,0 +1,45 @@
+//
+//  LineBlockTimestamps.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+// Lines between checkpoints in LineBlockTimestamps.
+#define kLineBlockTimestampsCheckpointInterval 64
+
+// The timestamps of a LineBlock's raw lines, kept to the second. Each line's time is stored as a
+// varint of how far it is from the line before it, which for scrollback written in bursts is
+// usually a single byte. The time of every kLineBlockTimestampsCheckpointInterval-th line is kept
+// in full with the offset of the deltas after it, so a lookup decodes at most that many deltas.
+// The last line's time isn't encoded since appending to a partial line changes it.
+typedef struct {
+    unsigned char *deltas;
+    int deltasLength;
+    int deltasCapacity;
+    long long *checkpointTimes;  // Seconds since the reference date.
+    int *checkpointOffsets;  // Where in |deltas| the line after each checkpoint begins.
+    int checkpointsCapacity;
+    int count;  // Number of lines, including the last.
+    long long previous;  // Time of the line before the last.
+    long long last;
+} LineBlockTimestamps;
+
+void LineBlockTimestampsAppend(LineBlockTimestamps *timestamps, NSTimeInterval timestamp);
+
+// Changes the time of the last line.
+void LineBlockTimestampsSetLast(LineBlockTimestamps *timestamps, NSTimeInterval timestamp);
+
+// Returns the time of line |i|, which must be less than timestamps->count.
+NSTimeInterval LineBlockTimestampsGet(const LineBlockTimestamps *timestamps, int i);
+
+// Fills in |output|, which has room for timestamps->count values, with the time of every line.
+void LineBlockTimestampsGetAll(const LineBlockTimestamps *timestamps, NSTimeInterval *output);
+
+void LineBlockTimestampsRemoveLast(LineBlockTimestamps *timestamps);
+void LineBlockTimestampsRemoveAll(LineBlockTimestamps *timestamps);
+
+// |destination| must not hold anything that needs to be freed.
+void LineBlockTimestampsCopy(LineBlockTimestamps *destination, const LineBlockTimestamps *source);
+
+void LineBlockTimestampsFree(LineBlockTimestamps *timestamps);
@@ -0,0 +1,162 @@
+//
+//  LineBlockTimestamps.m
+//  iTerm
+//
+
+#import "LineBlockTimestamps.h"
+#include <math.h>
+
+// Longest varint of a 64-bit value.
+static const int kMaxVarintLength = 10;
+
+static inline unsigned long long ZigZag(long long value) {
+    return ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63);
+}
+
+static inline long long UnZigZag(unsigned long long value) {
+    return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+static inline long long ReadDelta(const unsigned char *deltas, int *offset) {
+    unsigned long long value = 0;
+    int shift = 0;
+    unsigned char byte;
+    do {
+        byte = deltas[(*offset)++];
+        value |= (unsigned long long)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return UnZigZag(value);
+}
+
+static void WriteDelta(LineBlockTimestamps *timestamps, long long delta) {
+    if (timestamps->deltasLength + kMaxVarintLength > timestamps->deltasCapacity) {
+        timestamps->deltasCapacity = MAX(64, timestamps->deltasCapacity * 2);
+        timestamps->deltas = realloc(timestamps->deltas, timestamps->deltasCapacity);
+    }
+    unsigned long long value = ZigZag(delta);
+    do {
+        unsigned char byte = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            byte |= 0x80;
+        }
+        timestamps->deltas[timestamps->deltasLength++] = byte;
+    } while (value);
+}
+
+// Encodes the last line's time now that it can't change.
+static void FinishLastLine(LineBlockTimestamps *timestamps) {
+    const int line = timestamps->count - 1;
+    if (line % kLineBlockTimestampsCheckpointInterval == 0) {
+        const int checkpoint = line / kLineBlockTimestampsCheckpointInterval;
+        if (checkpoint >= timestamps->checkpointsCapacity) {
+            timestamps->checkpointsCapacity = MAX(4, timestamps->checkpointsCapacity * 2);
+            timestamps->checkpointTimes = realloc(timestamps->checkpointTimes,
+                                                  sizeof(long long) * timestamps->checkpointsCapacity);
+            timestamps->checkpointOffsets = realloc(timestamps->checkpointOffsets,
+                                                    sizeof(int) * timestamps->checkpointsCapacity);
+        }
+        timestamps->checkpointTimes[checkpoint] = timestamps->last;
+        timestamps->checkpointOffsets[checkpoint] = timestamps->deltasLength;
+    } else {
+        WriteDelta(timestamps, timestamps->last - timestamps->previous);
+    }
+    timestamps->previous = timestamps->last;
+}
+
+void LineBlockTimestampsAppend(LineBlockTimestamps *timestamps, NSTimeInterval timestamp) {
+    if (timestamps->count > 0) {
+        FinishLastLine(timestamps);
+    }
+    timestamps->last = llround(timestamp);
+    ++timestamps->count;
+}
+
+void LineBlockTimestampsSetLast(LineBlockTimestamps *timestamps, NSTimeInterval timestamp) {
+    timestamps->last = llround(timestamp);
+}
+
+NSTimeInterval LineBlockTimestampsGet(const LineBlockTimestamps *timestamps, int i) {
+    if (i == timestamps->count - 1) {
+        return timestamps->last;
+    }
+    const int checkpoint = i / kLineBlockTimestampsCheckpointInterval;
+    long long time = timestamps->checkpointTimes[checkpoint];
+    int offset = timestamps->checkpointOffsets[checkpoint];
+    for (int line = checkpoint * kLineBlockTimestampsCheckpointInterval + 1; line <= i; line++) {
+        time += ReadDelta(timestamps->deltas, &offset);
+    }
+    return time;
+}
+
+void LineBlockTimestampsGetAll(const LineBlockTimestamps *timestamps, NSTimeInterval *output) {
+    long long time = 0;
+    int offset = 0;
+    for (int line = 0; line < timestamps->count - 1; line++) {
+        if (line % kLineBlockTimestampsCheckpointInterval == 0) {
+            time = timestamps->checkpointTimes[line / kLineBlockTimestampsCheckpointInterval];
+        } else {
+            time += ReadDelta(timestamps->deltas, &offset);
+        }
+        output[line] = time;
+    }
+    if (timestamps->count > 0) {
+        output[timestamps->count - 1] = timestamps->last;
+    }
+}
+
+void LineBlockTimestampsRemoveLast(LineBlockTimestamps *timestamps) {
+    if (timestamps->count <= 1) {
+        LineBlockTimestampsRemoveAll(timestamps);
+        return;
+    }
+    // The line before the last one becomes the last, so its time is decoded and its delta removed.
+    const int line = timestamps->count - 2;
+    const int checkpoint = line / kLineBlockTimestampsCheckpointInterval;
+    long long time = timestamps->checkpointTimes[checkpoint];
+    int offset = timestamps->checkpointOffsets[checkpoint];
+    if (line % kLineBlockTimestampsCheckpointInterval == 0) {
+        timestamps->previous = line > 0 ? LineBlockTimestampsGet(timestamps, line - 1) : 0;
+    } else {
+        long long previousTime = time;
+        int start = offset;
+        for (int i = checkpoint * kLineBlockTimestampsCheckpointInterval + 1; i <= line; i++) {
+            previousTime = time;
+            start = offset;
+            time += ReadDelta(timestamps->deltas, &offset);
+        }
+        offset = start;
+        timestamps->previous = previousTime;
+    }
+    timestamps->deltasLength = offset;
+    timestamps->last = time;
+    --timestamps->count;
+}
+
+void LineBlockTimestampsRemoveAll(LineBlockTimestamps *timestamps) {
+    timestamps->count = 0;
+    timestamps->deltasLength = 0;
+}
+
+void LineBlockTimestampsCopy(LineBlockTimestamps *destination, const LineBlockTimestamps *source) {
+    *destination = *source;
+    destination->deltas = malloc(MAX(1, source->deltasCapacity));
+    memcpy(destination->deltas, source->deltas, source->deltasLength);
+    destination->checkpointTimes = malloc(sizeof(long long) * MAX(1, source->checkpointsCapacity));
+    destination->checkpointOffsets = malloc(sizeof(int) * MAX(1, source->checkpointsCapacity));
+    // Only lines before the last have been encoded.
+    const int checkpoints =
+        source->count > 1 ? (source->count - 2) / kLineBlockTimestampsCheckpointInterval + 1 : 0;
+    if (checkpoints > 0) {
+        memcpy(destination->checkpointTimes, source->checkpointTimes, sizeof(long long) * checkpoints);
+        memcpy(destination->checkpointOffsets, source->checkpointOffsets, sizeof(int) * checkpoints);
+    }
+}
+
+void LineBlockTimestampsFree(LineBlockTimestamps *timestamps) {
+    free(timestamps->deltas);
+    free(timestamps->checkpointTimes);
+    free(timestamps->checkpointOffsets);
+    memset(timestamps, 0, sizeof(*timestamps));
+}
@@ -33,6 +33,11 @@
 #import "LineBufferHelpers.h"
 #import "VT100GridTypes.h"
 
+@class AutocompleteIndex;
+@class LineBlockSpillFile;
+@class LineBufferArchive;
+@class LineBufferArchiveReader;
+
 // A LineBuffer represents an ordered collection of strings of screen_char_t. Each string forms a
 // logical line of text plus color information. Logic is provided for the following major functions:
 //   - If the lines are wrapped onto a screen of some width, find the Nth wrapped line
@@ -68,6 +73,38 @@
 
     // Number of char that have been dropped
     long long droppedChars;
+
+    // If positive, blocks are compressed to keep residentBytes under this.
+    long long resident_budget;
+
+    // If set, blocks over the resident budget are moved to this file instead of being compressed
+    // in memory.
+    LineBlockSpillFile *spill_file;
+
+    // If set, each block gets a trigram index when it fills up. See -setUsesNgramIndex:.
+    BOOL uses_ngram_index;
+
+    // Index of wrapped line counts at block_index_width for finding the block holding a wrapped
+    // line by binary search. block_line_ends[i] - block_index_bias is the number of wrapped lines in
+    // blocks 0 through i. Only the first block_index_valid blocks are indexed, and never the last
+    // one, since its count changes with every append.
+    int *block_line_ends;
+    int block_index_capacity;
+    int block_index_valid;
+    int block_index_width;
+    int block_index_bias;
+
+    // The block found by the last lookup. Rows are usually fetched in order, so it's checked first.
+    int last_lookup_block;
+
+    // If set, blocks are written to this as they fill up. See -setArchive:.
+    LineBufferArchive *archive;
+
+    // If set, the text of each block is added to this as it fills up.
+    AutocompleteIndex *autocomplete_index;
+
+    // When lines were last read for drawing or searched. See -lastReadTime.
+    NSTimeInterval last_read_time;
 }
 
 - (LineBuffer*) initWithBlockSize: (int) bs;
@@ -75,14 +112,78 @@
 - (LineBuffer*) init;
 
 // Returns a copy of this buffer that can be appended to but that you must not
-// pop lines from. Only the last block is deep-copied; references are held to
-// all earlier blocks.
+// pop lines from. References are held to all blocks but the last, which is
+// copied; its chars are copy-on-write, so no chars are copied and the cost is
+// O(blocks). The copy stays consistent while the original keeps appending.
 - (LineBuffer *)newAppendOnlyCopy;
 
 // Call this immediately after init. Otherwise the buffer will hold unlimited lines (until you
 // run out of memory).
 - (void) setMaxLines: (int) maxLines;
 
+// Sets the number of bytes of chars to keep uncompressed. Older blocks that haven't been read since
+// the last block was added get compressed when this is exceeded. 0 (the default) means no limit.
+- (void)setResidentBudget:(long long)bytes;
+
+// If enabled, blocks over the resident budget are written to a private scratch file and paged
+// back in when read, so scrollback isn't limited by RAM. Only line lengths and timestamps stay in
+// memory for spilled blocks. Has no effect without a resident budget.
+- (void)setSpillsToDisk:(BOOL)spillsToDisk;
+
+// Bytes of chars held in uncompressed blocks, in compressed blocks, and in the spill file.
+- (long long)residentBytes;
+- (long long)compressedBytes;
+- (long long)spilledBytes;
+
+// Bytes of chars holding lines, however their blocks are stored. The difference from
+// residentBytes is space allocated in uncompressed blocks but not yet filled.
+- (long long)usedBytes;
+
+- (int)numberOfBlocks;
+
+// When the buffer's lines were last read to be shown or searched, or when it was made if they
+// haven't been. ScrollbackBudget frees memory from the buffers read longest ago first.
+- (NSTimeInterval)lastReadTime;
+
+// Compresses blocks, or spills them if the buffer spills to disk, oldest first, until
+// residentBytes + compressedBytes is at most |bytes| or no block is left to shrink. The first and
+// last blocks are left alone. Returns the bytes still held in memory.
+- (long long)reduceMemoryUsageTo:(long long)bytes;
+
+// Drops whole blocks from the start of the buffer, never the last one, until they held at least
+// |bytes| in memory. Returns the number of wrapped lines dropped. Call this only when memory is
+// short, since it ignores the buffer's max lines.
+- (int)dropOldestBlocksToFreeBytes:(long long)bytes width:(int)width;
+
+// If enabled, blocks are given a small trigram index as they fill up. Searches for plain
+// substrings skip blocks whose index rules them out without reading their chars, which matters
+// most for compressed and spilled blocks. Each index costs a fixed 2k per block and goes away with
+// its block. Only blocks filled after this is enabled are indexed.
+- (void)setUsesNgramIndex:(BOOL)usesNgramIndex;
+
+// Bytes used by trigram indexes.
+- (long long)ngramIndexBytes;
+
+// Adds the words of each block that fills up from now on to |index|. Pass nil to stop. Copies
+// don't add to the index.
+- (void)setAutocompleteIndex:(AutocompleteIndex *)index;
+
+// Starts writing the buffer to |archive|, replacing whatever it held: the full blocks are written
+// now and each later block is written once it fills up, in the background. The partial last block
+// is left out until -writeSnapshotToArchive: is called. Pass nil to stop.
+- (void)setArchive:(LineBufferArchive *)archive;
+
+// Writes the blocks that |archive| doesn't have yet, including the partial last block, so the
+// archive holds all of this buffer. Usually called on a copy made by -newAppendOnlyCopy of the
+// buffer that owns the archive, with the screen appended to it. The blocks aren't treated as
+// archived, so the owner rewrites them when they fill up.
+- (void)writeSnapshotToArchive:(LineBufferArchive *)archive;
+
+// Replaces the lines of the buffer with the ones in an archive. This doesn't read any chars; blocks
+// read them from the mapped archive when they're first needed. Returns NO if it had no blocks.
+// Call dropExcessLinesWithWidth: afterwards.
+- (BOOL)loadArchive:(LineBufferArchiveReader *)reader;
+
 // Add a line to the buffer. Set partial to true if there's more coming for this line:
 // that is to say, this buffer contains only a prefix or infix of the entire line.
 //
@@ -117,6 +218,14 @@
 // mutate.
 - (ScreenCharArray *)wrappedLineAtIndex:(int)lineNum width:(int)width;
 
+// Like wrappedLineAtIndex:width: but without making an object. Returns a pointer to the line's
+// chars in its block, which is good until the buffer next changes, or NULL if there's no such
+// line.
+- (const screen_char_t *)charsOfWrappedLineAtIndex:(int)lineNum
+                                             width:(int)width
+                                            length:(int *)lengthPtr
+                                               eol:(int *)eolPtr;
+
 // Copy up to width chars from the last line into *ptr. The last line will be removed or
 // truncated from the buffer. Sets *includesEndOfLine to true if this line should have a
 // continuation marker.
@@ -151,12 +260,23 @@
 // the FindContext prior to calling this.
 - (void)findSubstring:(FindContext*)context stopAt:(int)stopAt;
 
+// For LineBufferSearch, which searches the blocks of a copy made with newAppendOnlyCopy on
+// background threads. Don't modify the blocks. A context's absBlockNum minus numDroppedBlocks is an
+// index into the blocks.
+- (NSArray *)blocksForSearch;
+- (int)numDroppedBlocks;
+
 // Convert a position (as returned by findSubstring) into an x,y position.
 // Returns TRUE if the conversion was successful, false if the position was out of bounds.
 - (BOOL) convertPosition: (int) position withWidth: (int) width toX: (int*) x toY: (int*) y;
 
-// Returns an array of XYRange values
-- (NSArray*)convertPositions:(NSArray*)resultRanges withWidth:(int)width;
+// Converts |count| ResultRanges to coordinates in a single pass over the blocks, writing them to
+// |xyRanges| in the same order. Ranges that aren't in the buffer are left out, so it returns the
+// number written.
+- (int)convertResultRanges:(const ResultRange *)ranges
+                     count:(int)count
+                 withWidth:(int)width
+                toXYRanges:(XYRange *)xyRanges;
 
 - (LineBufferPosition *)positionForCoordinate:(VT100GridCoord)coord width:(int)width offset:(int)offset;
 - (VT100GridCoord)coordinateForPosition:(LineBufferPosition *)position width:(int)width ok:(BOOL *)ok;
@@ -29,21 +29,302 @@
 
 #import "LineBuffer.h"
 
+#import "AutocompleteIndex.h"
 #import "BackgroundThread.h"
 #import "LineBlock.h"
+#import "LineBlockSpillFile.h"
+#import "LineBufferArchive.h"
 #import "RegexKitLite/RegexKitLite.h"
+#import "Signposts.h"
+
+// The first or last cell of a ResultRange being converted to coordinates.
+typedef struct {
+    int position;
+    int index;  // Twice the range's index, plus one for its last cell.
+} ResultRangeEndpoint;
+
+static int CompareResultRangeEndpoints(const void *a, const void *b) {
+    const int positionA = ((const ResultRangeEndpoint *)a)->position;
+    const int positionB = ((const ResultRangeEndpoint *)b)->position;
+    return (positionA > positionB) - (positionA < positionB);
+}
 
 @implementation LineBuffer
 
+// Returns the block at an index, first replacing it with a private copy if it's shared with
+// another buffer. Call this before changing a block's lines.
+- (LineBlock *)_unsharedBlockAtIndex:(int)i
+{
+    LineBlock *block = [blocks objectAtIndex:i];
+    if ([block isShared]) {
+        block = [[block copy] autorelease];
+        [blocks replaceObjectAtIndex:i withObject:block];
+    }
+    return block;
+}
+
 // Append a block
 - (LineBlock*) _addBlockOfSize: (int) size
 {
+    // The current last block won't be appended to any more, so store it compactly. Blocks that
+    // were expanded to be read since the last time this happened are compacted again. The first
+    // block is left alone since it's the one lines get dropped from. Blocks that were read recently
+    // are the last to be compressed if the buffer is over its resident budget.
+    NSMutableArray *recentlyRead = [NSMutableArray array];
+    if (uses_ngram_index) {
+        [[blocks lastObject] buildNgramIndex];
+    }
+    if (autocomplete_index && [blocks count]) {
+        NSString *text = [[blocks lastObject] newPlainText];
+        [autocomplete_index addText:text];
+        [text release];
+    }
+    for (int i = 1; i < [blocks count]; i++) {
+        LineBlock *block = [blocks objectAtIndex:i];
+        if (![block isCompact] && i < [blocks count] - 1) {
+            [recentlyRead addObject:block];
+        }
+        [block compact];
+    }
+    [self _compressBlocksToFitBudgetSparing:recentlyRead];
+    [self _archiveBlocksBefore:[blocks count]];
     LineBlock* block = [[LineBlock alloc] initWithRawBufferSize: size];
     [blocks addObject:block];
     [block release];
     return block;
 }
 
+// Compresses the oldest blocks until the resident budget is met. Blocks in |spared| are compressed
+// only if nothing else is left.
+- (void)_compressBlocksToFitBudgetSparing:(NSArray *)spared
+{
+    if (resident_budget <= 0) {
+        return;
+    }
+    // Compressed blocks count against the budget if they can be spilled.
+    long long resident = [self residentBytes] + (spill_file ? [self compressedBytes] : 0);
+    for (int pass = 0; pass < 2 && resident > resident_budget; pass++) {
+        for (int i = 1; i < [blocks count] && resident > resident_budget; i++) {
+            LineBlock *block = [blocks objectAtIndex:i];
+            if ([block isSpilled] ||
+                ([block isCompressed] && !spill_file) ||
+                (pass == 0 && [spared indexOfObjectIdenticalTo:block] != NSNotFound)) {
+                continue;
+            }
+            long long before = [block residentBytes];
+            if (spill_file ? [block spillToFile:spill_file] : [block compress]) {
+                resident -= before - (spill_file ? 0 : [block residentBytes]);
+            }
+        }
+    }
+}
+
+// Writes blocks before |end| that haven't been archived, followed by the buffer's state. They must
+// be full, since archived blocks aren't written again until they change.
+- (void)_archiveBlocksBefore:(int)end
+{
+    if (!archive) {
+        return;
+    }
+    if ([archive needsReset]) {
+        [archive reset];
+    }
+    for (long long n = MAX([archive numArchivedBlocks], num_dropped_blocks);
+         n < num_dropped_blocks + end;
+         n++) {
+        [archive appendBlock:[blocks objectAtIndex:n - num_dropped_blocks] number:n];
+    }
+    [archive setNumArchivedBlocks:MAX([archive numArchivedBlocks], num_dropped_blocks + end)];
+    [self _appendStateToArchive:archive];
+}
+
+- (void)_appendStateToArchive:(LineBufferArchive *)theArchive
+{
+    LineBufferArchiveState state;
+    memset(&state, 0, sizeof(state));
+    state.firstBlockNumber = num_dropped_blocks;
+    state.numBlocks = [blocks count];
+    state.droppedChars = droppedChars;
+    state.blockSize = block_size;
+    if ([blocks count]) {
+        LineBlock *firstBlock = [blocks objectAtIndex:0];
+        state.firstBlockStartOffset = [firstBlock startOffset];
+        state.firstBlockFirstEntry = [firstBlock numEntries] - [firstBlock numRawLines];
+    }
+    [theArchive appendState:&state];
+}
+
+- (void)setArchive:(LineBufferArchive *)theArchive
+{
+    [archive autorelease];
+    archive = [theArchive retain];
+    [archive reset];
+    [self _archiveBlocksBefore:(int)[blocks count] - 1];
+}
+
+- (void)writeSnapshotToArchive:(LineBufferArchive *)theArchive
+{
+    for (long long n = MAX([theArchive numArchivedBlocks], num_dropped_blocks);
+         n < num_dropped_blocks + [blocks count];
+         n++) {
+        [theArchive appendBlock:[blocks objectAtIndex:n - num_dropped_blocks] number:n];
+    }
+    [self _appendStateToArchive:theArchive];
+}
+
+- (BOOL)loadArchive:(LineBufferArchiveReader *)reader
+{
+    NSArray *offsets = [reader blockOffsets];
+    NSArray *lengths = [reader blockLengths];
+    NSMutableArray *loadedBlocks = [NSMutableArray array];
+    for (int i = 0; i < [offsets count]; i++) {
+        LineBlock *block =
+            [[[LineBlock alloc] initWithArchiveData:[reader data]
+                                             offset:[[offsets objectAtIndex:i] longLongValue]
+                                             length:[[lengths objectAtIndex:i] intValue]] autorelease];
+        if (!block) {
+            break;
+        }
+        if (i == 0) {
+            LineBufferArchiveState state = [reader state];
+            [block setStartOffset:state.firstBlockStartOffset
+                       firstEntry:state.firstBlockFirstEntry];
+        }
+        // Only the last block may be empty.
+        if (![block isEmpty]) {
+            [loadedBlocks addObject:block];
+        }
+    }
+    if (![loadedBlocks count]) {
+        return NO;
+    }
+    [blocks setArray:loadedBlocks];
+    num_wrapped_lines_width = -1;
+    block_index_width = -1;
+    block_index_valid = 0;
+    block_index_bias = 0;
+    last_lookup_block = 0;
+    if (archive) {
+        [self setArchive:archive];
+    }
+    return YES;
+}
+
+- (void)setResidentBudget:(long long)bytes
+{
+    resident_budget = bytes;
+}
+
+- (void)setSpillsToDisk:(BOOL)spillsToDisk
+{
+    if (spillsToDisk && !spill_file) {
+        spill_file = [[LineBlockSpillFile alloc] init];
+    } else if (!spillsToDisk) {
+        [spill_file release];
+        spill_file = nil;
+    }
+}
+
+- (void)setUsesNgramIndex:(BOOL)usesNgramIndex
+{
+    uses_ngram_index = usesNgramIndex;
+}
+
+- (void)setAutocompleteIndex:(AutocompleteIndex *)index
+{
+    [autocomplete_index autorelease];
+    autocomplete_index = [index retain];
+}
+
+- (long long)ngramIndexBytes
+{
+    long long total = 0;
+    for (LineBlock *block in blocks) {
+        total += [block ngramIndexBytes];
+    }
+    return total;
+}
+
+- (long long)usedBytes
+{
+    long long total = 0;
+    for (LineBlock *block in blocks) {
+        total += (long long)([block rawSpaceUsed] - [block startOffset]) * sizeof(screen_char_t);
+    }
+    return total;
+}
+
+- (int)numberOfBlocks
+{
+    return [blocks count];
+}
+
+- (NSTimeInterval)lastReadTime
+{
+    return last_read_time;
+}
+
+- (long long)reduceMemoryUsageTo:(long long)bytes
+{
+    long long used = [self residentBytes] + [self compressedBytes];
+    for (int i = 1; i + 1 < [blocks count] && used > bytes; i++) {
+        LineBlock *block = [blocks objectAtIndex:i];
+        if ([block isSpilled] || ([block isCompressed] && !spill_file)) {
+            continue;
+        }
+        long long before = [block residentBytes];
+        if (spill_file ? [block spillToFile:spill_file] : [block compress]) {
+            used -= before - [block residentBytes];
+        }
+    }
+    return used;
+}
+
+- (int)dropOldestBlocksToFreeBytes:(long long)bytes width:(int)width
+{
+    // Spilled blocks free nothing in memory but are dropped along with the blocks around them.
+    int lines = 0;
+    long long freed = 0;
+    for (int i = 0; i + 1 < [blocks count] && freed < bytes; i++) {
+        LineBlock *block = [blocks objectAtIndex:i];
+        freed += [block residentBytes];
+        lines += [block getNumLinesWithWrapWidth:width];
+    }
+    if (lines == 0) {
+        return 0;
+    }
+    const int before = RawNumLines(self, width);
+    [self _dropLines:lines width:width];
+    return before - RawNumLines(self, width);
+}
+
+- (long long)spilledBytes
+{
+    return [spill_file bytesUsed];
+}
+
+- (long long)residentBytes
+{
+    long long total = 0;
+    for (LineBlock *block in blocks) {
+        if (![block isCompressed]) {
+            total += [block residentBytes];
+        }
+    }
+    return total;
+}
+
+- (long long)compressedBytes
+{
+    long long total = 0;
+    for (LineBlock *block in blocks) {
+        if ([block isCompressed]) {
+            total += [block residentBytes];
+        }
+    }
+    return total;
+}
+
 // The designated initializer. We prefer not to explose the notion of block sizes to
 // clients, so this is internal.
 - (LineBuffer*)initWithBlockSize:(int)bs
@@ -56,6 +337,8 @@
         max_lines = -1;
         num_wrapped_lines_width = -1;
         num_dropped_blocks = 0;
+        block_index_width = -1;
+        last_read_time = [NSDate timeIntervalSinceReferenceDate];
     }
     return self;
 }
@@ -70,19 +353,104 @@
                  withObject:nil
               waitUntilDone:NO];
     [blocks release];
+    [spill_file release];
+    [archive release];
+    [autocomplete_index release];
+    free(block_line_ends);
     [super dealloc];
 }
 
+// Brings the block line count index up to date for |width|, indexing every block but the last.
+static void UpdateBlockIndex(LineBuffer *buffer, int width) {
+    if (buffer->block_index_width != width) {
+        buffer->block_index_width = width;
+        buffer->block_index_valid = 0;
+        buffer->block_index_bias = 0;
+    }
+    const int numBlocks = (int)[buffer->blocks count];
+    if (numBlocks - 1 > buffer->block_index_capacity) {
+        buffer->block_index_capacity = MAX(numBlocks * 2, 16);
+        buffer->block_line_ends = realloc(buffer->block_line_ends,
+                                          sizeof(int) * buffer->block_index_capacity);
+    }
+    for (int i = buffer->block_index_valid; i < numBlocks - 1; i++) {
+        int previous = i ? buffer->block_line_ends[i - 1] : buffer->block_index_bias;
+        LineBlock *block = [buffer->blocks objectAtIndex:i];
+        buffer->block_line_ends[i] = previous + [block getNumLinesWithWrapWidth:width];
+    }
+    buffer->block_index_valid = MAX(0, numBlocks - 1);
+}
+
+// Number of wrapped lines in blocks before |blockNum|. The index must be up to date.
+static int LinesBeforeBlock(LineBuffer *buffer, int blockNum) {
+    if (blockNum == 0) {
+        return 0;
+    }
+    return buffer->block_line_ends[blockNum - 1] - buffer->block_index_bias;
+}
+
+// Returns the index of the block holding wrapped line |lineNum| and sets *lineInBlock to the line
+// number within that block. Returns -1 if lineNum is past the end.
+static int BlockContainingLine(LineBuffer *buffer, int lineNum, int width, int *lineInBlock) {
+    UpdateBlockIndex(buffer, width);
+    const int numBlocks = (int)[buffer->blocks count];
+    if (numBlocks == 0 || lineNum < 0) {
+        return -1;
+    }
+
+    int blockNum = -1;
+    const int hint = buffer->last_lookup_block;
+    for (int i = hint; i < MIN(hint + 2, numBlocks - 1); i++) {
+        if (lineNum >= LinesBeforeBlock(buffer, i) && lineNum < LinesBeforeBlock(buffer, i + 1)) {
+            blockNum = i;
+            break;
+        }
+    }
+    if (blockNum < 0 && lineNum >= LinesBeforeBlock(buffer, numBlocks - 1)) {
+        blockNum = numBlocks - 1;
+    }
+    if (blockNum < 0) {
+        // Binary search for the first block whose end is past lineNum.
+        int low = 0;
+        int high = numBlocks - 1;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (LinesBeforeBlock(buffer, mid + 1) > lineNum) {
+                high = mid;
+            } else {
+                low = mid + 1;
+            }
+        }
+        blockNum = low;
+    }
+
+    *lineInBlock = lineNum - LinesBeforeBlock(buffer, blockNum);
+    if (blockNum == numBlocks - 1 &&
+        *lineInBlock >= [[buffer->blocks lastObject] getNumLinesWithWrapWidth:width]) {
+        return -1;
+    }
+    buffer->last_lookup_block = blockNum;
+    return blockNum;
+}
+
+// Call after blocks are removed from the end of the buffer.
+static void TruncateBlockIndex(LineBuffer *buffer) {
+    buffer->block_index_valid = MIN(buffer->block_index_valid,
+                                    MAX(0, (int)[buffer->blocks count] - 1));
+    buffer->last_lookup_block = 0;
+}
+
 // This is called a lot so it's a C function to avoid obj_msgSend
 static int RawNumLines(LineBuffer* buffer, int width) {
     if (buffer->num_wrapped_lines_width == width) {
         return buffer->num_wrapped_lines_cache;
     }
     int count = 0;
-    int i;
-    for (i = 0; i < [buffer->blocks count]; ++i) {
-        LineBlock* block = [buffer->blocks objectAtIndex: i];
-        count += [block getNumLinesWithWrapWidth: width];
+    if ([buffer->blocks count]) {
+        UpdateBlockIndex(buffer, width);
+        const int lastBlock = (int)[buffer->blocks count] - 1;
+        count = (LinesBeforeBlock(buffer, lastBlock) +
+                 [[buffer->blocks lastObject] getNumLinesWithWrapWidth:width]);
     }
     buffer->num_wrapped_lines_width = width;
     buffer->num_wrapped_lines_cache = count;
@@ -98,11 +466,21 @@ static int RawNumLines(LineBuffer* buffer, int width) {
     }
 
     int total_lines = RawNumLines(self, width);
-    while (total_lines > max_lines) {
-        int extra_lines = total_lines - max_lines;
+    if (total_lines > max_lines) {
+        [self _dropLines:total_lines - max_lines width:width];
+    }
+}
+
+// Drops the first |n| wrapped lines.
+- (void)_dropLines:(int)n width:(int)width
+{
+    int total_lines = RawNumLines(self, width);
+    const int target = total_lines - MIN(n, total_lines);
+    while (total_lines > target) {
+        int extra_lines = total_lines - target;
 
         NSAssert([blocks count] > 0, @"No blocks");
-        LineBlock* block = [blocks objectAtIndex: 0];
+        LineBlock* block = [self _unsharedBlockAtIndex:0];
         int block_lines = [block getNumLinesWithWrapWidth: width];
         NSAssert(block_lines > 0, @"Empty leading block");
         int toDrop = block_lines;
@@ -112,9 +490,20 @@ static int RawNumLines(LineBuffer* buffer, int width) {
         int charsDropped;
         int dropped = [block dropLines:toDrop withWidth:width chars:&charsDropped];
         droppedChars += charsDropped;
+        if (block_index_width == width) {
+            // Every indexed block's end moves back by the number of lines dropped.
+            block_index_bias += dropped;
+        } else {
+            block_index_valid = 0;
+        }
         if ([block isEmpty]) {
             [blocks removeObjectAtIndex:0];
             ++num_dropped_blocks;
+            if (block_index_valid > 0) {
+                --block_index_valid;
+                memmove(block_line_ends, block_line_ends + 1, sizeof(int) * block_index_valid);
+            }
+            last_lookup_block = 0;
         }
         total_lines -= dropped;
     }
@@ -207,11 +596,12 @@ static int RawNumLines(LineBuffer* buffer, int width) {
         NSLog(@"Append: %s\n", a);
     }
 #endif
+    SignpostBegin("appendLine", nil, length);
     if ([blocks count] == 0) {
         [self _addBlockOfSize: block_size];
     }
 
-    LineBlock* block = [blocks objectAtIndex: ([blocks count] - 1)];
+    LineBlock* block = [self _unsharedBlockAtIndex:[blocks count] - 1];
 
     int beforeLines = [block getNumLinesWithWrapWidth:width];
     if (![block appendLine:buffer length:length partial:partial width:width timestamp:timestamp]) {
@@ -278,28 +668,17 @@ static int RawNumLines(LineBuffer* buffer, int width) {
         // Width change. Invalidate the wrapped lines cache.
         num_wrapped_lines_width = -1;
     }
+    SignpostEnd("appendLine", nil, length);
 }
 
 - (NSTimeInterval)timestampForLineNumber:(int)lineNum width:(int)width
 {
-    int line = lineNum;
-    int i;
-    for (i = 0; i < [blocks count]; ++i) {
-        LineBlock* block = [blocks objectAtIndex:i];
-        NSAssert(block, @"Null block");
-        
-        // getNumLinesWithWrapWidth caches its result for the last-used width so
-        // this is usually faster than calling getWrappedLineWithWrapWidth since
-        // most calls to the latter will just decrement line and return NULL.
-        int block_lines = [block getNumLinesWithWrapWidth:width];
-        if (block_lines < line) {
-            line -= block_lines;
-            continue;
-        }
-        
-        return [block timestampForLineNumber:line width:width];
+    int line;
+    int i = BlockContainingLine(self, lineNum, width, &line);
+    if (i < 0) {
+        return 0;
     }
-    return 0;
+    return [[blocks objectAtIndex:i] timestampForLineNumber:line width:width];
 }
 
 // Copy a line into the buffer. If the line is shorter than 'width' then only
@@ -307,21 +686,11 @@ static int RawNumLines(LineBuffer* buffer, int width) {
 // 0 <= lineNum < numLinesWithWidth:width
 - (int) copyLineToBuffer: (screen_char_t*) buffer width: (int) width lineNum: (int) lineNum
 {
-    int line = lineNum;
-    int i;
-    for (i = 0; i < [blocks count]; ++i) {
+    last_read_time = [NSDate timeIntervalSinceReferenceDate];
+    int line;
+    int i = BlockContainingLine(self, lineNum, width, &line);
+    if (i >= 0) {
         LineBlock* block = [blocks objectAtIndex: i];
-        NSAssert(block, @"Null block");
-
-        // getNumLinesWithWrapWidth caches its result for the last-used width so
-        // this is usually faster than calling getWrappedLineWithWrapWidth since
-        // most calls to the latter will just decrement line and return NULL.
-        int block_lines = [block getNumLinesWithWrapWidth:width];
-        if (block_lines < line) {
-            line -= block_lines;
-            continue;
-        }
-
         int length;
         int eol;
         screen_char_t* p = [block getWrappedLineWithWrapWidth: width
@@ -341,36 +710,45 @@ static int RawNumLines(LineBuffer* buffer, int width) {
 
 - (ScreenCharArray *)wrappedLineAtIndex:(int)lineNum width:(int)width
 {
-    int line = lineNum;
-    int i;
+    int length, eol;
+    const screen_char_t *chars = [self charsOfWrappedLineAtIndex:lineNum
+                                                           width:width
+                                                          length:&length
+                                                             eol:&eol];
+    if (!chars) {
+        return nil;
+    }
     ScreenCharArray *result = [[[ScreenCharArray alloc] init] autorelease];
-    for (i = 0; i < [blocks count]; ++i) {
-        LineBlock* block = [blocks objectAtIndex:i];
-
-        // getNumLinesWithWrapWidth caches its result for the last-used width so
-        // this is usually faster than calling getWrappedLineWithWrapWidth since
-        // most calls to the latter will just decrement line and return NULL.
-        int block_lines = [block getNumLinesWithWrapWidth:width];
-        if (block_lines < line) {
-            line -= block_lines;
-            continue;
-        }
+    result.line = (screen_char_t *)chars;
+    result.length = length;
+    result.eol = eol;
+    return result;
+}
 
-        int length, eol;
-        result.line = [block getWrappedLineWithWrapWidth:width
-                                                 lineNum:&line
-                                              lineLength:&length
-                                       includesEndOfLine:&eol];
-        if (result.line) {
-            result.length = length;
-            result.eol = eol;
-            NSAssert(result.length <= width, @"Length too long");
-            return result;
+- (const screen_char_t *)charsOfWrappedLineAtIndex:(int)lineNum
+                                             width:(int)width
+                                            length:(int *)lengthPtr
+                                               eol:(int *)eolPtr
+{
+    last_read_time = [NSDate timeIntervalSinceReferenceDate];
+    int line;
+    int i = BlockContainingLine(self, lineNum, width, &line);
+    if (i >= 0) {
+        LineBlock* block = [blocks objectAtIndex:i];
+        screen_char_t *chars = [block getWrappedLineWithWrapWidth:width
+                                                          lineNum:&line
+                                                       lineLength:lengthPtr
+                                                includesEndOfLine:eolPtr];
+        if (chars) {
+            NSAssert(*lengthPtr <= width, @"Length too long");
+            return chars;
         }
     }
     NSLog(@"Couldn't find line %d", lineNum);
     NSAssert(NO, @"Tried to get non-existant line");
-    return nil;
+    *lengthPtr = 0;
+    *eolPtr = EOL_HARD;
+    return NULL;
 }
 
 - (int) numLinesWithWidth: (int) width
@@ -388,7 +766,7 @@ static int RawNumLines(LineBuffer* buffer, int width) {
     }
     num_wrapped_lines_width = -1;
 
-    LineBlock* block = [blocks lastObject];
+    LineBlock* block = [self _unsharedBlockAtIndex:[blocks count] - 1];
 
     // If the line is partial the client will want to add a continuation marker so
     // tell him there's no EOL in that case.
@@ -412,6 +790,10 @@ static int RawNumLines(LineBuffer* buffer, int width) {
     // to this function would not work correctly.
     if ([block isEmpty]) {
         [blocks removeLastObject];
+        TruncateBlockIndex(self);
+        // The new last block may lose lines, so it's written again once it's full.
+        [archive setNumArchivedBlocks:MIN([archive numArchivedBlocks],
+                                          num_dropped_blocks + (int)[blocks count] - 1)];
     }
 
 #ifdef LOG_MUTATIONS
@@ -527,11 +909,12 @@ static int RawNumLines(LineBuffer* buffer, int width) {
     } else {
         context.status = NotFound;
     }
-    context.results = [NSMutableArray array];
+    context.results = [NSMutableData data];
 }
 
 - (void)findSubstring:(FindContext*)context stopAt:(int)stopAt
 {
+    last_read_time = [NSDate timeIntervalSinceReferenceDate];
     if (context.dir > 0) {
         // Search forwards
         if (context.absBlockNum < num_dropped_blocks) {
@@ -581,23 +964,26 @@ static int RawNumLines(LineBuffer* buffer, int width) {
                 atOffset:context.offset
                  results:context.results
          multipleResults:((context.options & FindMultipleResults) != 0)];
-    NSMutableArray* filtered = [NSMutableArray arrayWithCapacity:[context.results count]];
+    ResultRange *ranges = [context.results mutableBytes];
+    const int numResults = ResultRangeCount(context.results);
+    int numFiltered = 0;
     BOOL haveOutOfRangeResults = NO;
     int blockPosition = [self _blockPosition:context.absBlockNum - num_dropped_blocks];
-    for (ResultRange* range in context.results) {
-        range->position += blockPosition;
-        if (context.dir * (range->position - stopAt) > 0 ||
-            context.dir * (range->position + context.matchLength - stopAt) > 0) {
+    for (int i = 0; i < numResults; i++) {
+        ResultRange range = ranges[i];
+        range.position += blockPosition;
+        if (context.dir * (range.position - stopAt) > 0 ||
+            context.dir * (range.position + context.matchLength - stopAt) > 0) {
             // result was outside the range to be searched
             haveOutOfRangeResults = YES;
         } else {
             // Found a good result.
             context.status = Matched;
-            [filtered addObject:range];
+            ranges[numFiltered++] = range;
         }
     }
-    context.results = filtered;
-    if ([filtered count] == 0 && haveOutOfRangeResults) {
+    [context.results setLength:numFiltered * sizeof(ResultRange)];
+    if (numFiltered == 0 && haveOutOfRangeResults) {
         context.status = NotFound;
     }
 
@@ -610,85 +996,96 @@ static int RawNumLines(LineBuffer* buffer, int width) {
     context.absBlockNum = context.absBlockNum + context.dir;
 }
 
-// Returns an array of XRange values
-- (NSArray*)convertPositions:(NSArray*)resultRanges withWidth:(int)width
+- (NSArray *)blocksForSearch
+{
+    return blocks;
+}
+
+- (int)numDroppedBlocks
 {
-    // Create sorted array of all positions to convert.
-    NSMutableArray* unsortedPositions = [NSMutableArray arrayWithCapacity:[resultRanges count] * 2];
-    for (ResultRange* rr in resultRanges) {
-        [unsortedPositions addObject:[NSNumber numberWithInt:rr->position]];
-        [unsortedPositions addObject:[NSNumber numberWithInt:rr->position + rr->length - 1]];
+    return num_dropped_blocks;
+}
+
+- (int)convertResultRanges:(const ResultRange *)ranges
+                     count:(int)count
+                 withWidth:(int)width
+                toXYRanges:(XYRange *)xyRanges
+{
+    // Sort the first and last cells of all the ranges so the blocks can be walked just once. A
+    // forward search finds them in order already.
+    const int numEndpoints = count * 2;
+    ResultRangeEndpoint *endpoints = malloc(sizeof(ResultRangeEndpoint) * MAX(1, numEndpoints));
+    BOOL sorted = YES;
+    for (int i = 0; i < numEndpoints; i++) {
+        const ResultRange *range = &ranges[i / 2];
+        endpoints[i].position = (i & 1) ? range->position + range->length - 1 : range->position;
+        endpoints[i].index = i;
+        if (i > 0 && endpoints[i].position < endpoints[i - 1].position) {
+            sorted = NO;
+        }
+    }
+    if (!sorted) {
+        qsort(endpoints, numEndpoints, sizeof(ResultRangeEndpoint), CompareResultRangeEndpoints);
     }
 
-    // Walk blocks and positions in parallel, converting each position in order. Store in
-    // intermediate dict, mapping position->NSPoint(x,y)
-    NSArray *positionsArray = [unsortedPositions sortedArrayUsingSelector:@selector(compare:)];
+    // Number of endpoints of each range that were converted.
+    unsigned char *converted = calloc(MAX(1, count), 1);
     int i = 0;
     int yoffset = 0;
-    int numBlocks = [blocks count];
+    const int numBlocks = [blocks count];
     int passed = 0;
-    LineBlock *block = [blocks objectAtIndex:0];
+    LineBlock *block = numBlocks ? [blocks objectAtIndex:0] : nil;
     int used = [block rawSpaceUsed];
-    NSMutableDictionary* intermediate = [NSMutableDictionary dictionaryWithCapacity:[resultRanges count] * 2];
     int prev = -1;
-    for (NSNumber* positionNum in positionsArray) {
-        int position = [positionNum intValue];
-        if (position == prev) {
-            continue;
-        }
-        prev = position;
-
-        // Advance block until it includes this position
-        while (position >= passed + used && i < numBlocks) {
-            passed += used;
-            yoffset += [block getNumLinesWithWrapWidth:width];
-            i++;
-            if (i < numBlocks) {
-                block = [blocks objectAtIndex:i];
-                used = [block rawSpaceUsed];
+    BOOL prevOk = NO;
+    int x = 0;
+    int y = 0;
+    for (int e = 0; e < numEndpoints; e++) {
+        const int position = endpoints[e].position;
+        if (position != prev) {
+            prev = position;
+
+            // Advance block until it includes this position
+            while (position >= passed + used && i < numBlocks) {
+                passed += used;
+                yoffset += [block getNumLinesWithWrapWidth:width];
+                i++;
+                if (i < numBlocks) {
+                    block = [blocks objectAtIndex:i];
+                    used = [block rawSpaceUsed];
+                }
             }
+            prevOk = (i < numBlocks &&
+                      position >= passed &&
+                      [block convertPosition:position - passed
+                                   withWidth:width
+                                         toX:&x
+                                         toY:&y]);
+            assert(prevOk);
+            y += yoffset;
         }
-        if (i < numBlocks) {
-            int x, y;
-            assert(position >= passed);
-            assert(position < passed + used);
-            assert(used == [block rawSpaceUsed]);
-            BOOL isOk = [block convertPosition:position - passed
-                                     withWidth:width
-                                           toX:&x
-                                           toY:&y];
-            assert(x < 2000);
-            if (isOk) {
-                y += yoffset;
-                [intermediate setObject:[NSValue valueWithPoint:NSMakePoint(x, y)]
-                                 forKey:positionNum];
+        if (prevOk) {
+            XYRange *xyRange = &xyRanges[endpoints[e].index / 2];
+            if (endpoints[e].index & 1) {
+                xyRange->xEnd = x;
+                xyRange->yEnd = y;
             } else {
-                assert(false);
+                xyRange->xStart = x;
+                xyRange->yStart = y;
             }
+            converted[endpoints[e].index / 2]++;
         }
     }
 
-    // Walk the positions array and populate results by looking up points in intermediate dict.
-    NSMutableArray* result = [NSMutableArray arrayWithCapacity:[resultRanges count]];
-    for (ResultRange* rr in resultRanges) {
-        NSValue *start = [intermediate objectForKey:[NSNumber numberWithInt:rr->position]];
-        NSValue *end = [intermediate objectForKey:[NSNumber numberWithInt:rr->position + rr->length - 1]];
-        if (start && end) {
-            XYRange *xyrange = [[[XYRange alloc] init] autorelease];
-            NSPoint startPoint = [start pointValue];
-            NSPoint endPoint = [end pointValue];
-            xyrange->xStart = startPoint.x;
-            xyrange->yStart = startPoint.y;
-            xyrange->xEnd = endPoint.x;
-            xyrange->yEnd = endPoint.y;
-            [result addObject:xyrange];
-        } else {
-            assert(false);
-            [result addObject:[NSNull null]];
+    int numConverted = 0;
+    for (int r = 0; r < count; r++) {
+        if (converted[r] == 2) {
+            xyRanges[numConverted++] = xyRanges[r];
         }
     }
-
-    return result;
+    free(converted);
+    free(endpoints);
+    return numConverted;
 }
 
 // Returns YES if the position is valid.
@@ -932,12 +1329,16 @@ static int RawNumLines(LineBuffer* buffer, int width) {
 
 - (LineBuffer *)newAppendOnlyCopy {
     LineBuffer *theCopy = [[LineBuffer alloc] init];
+    [theCopy->blocks release];
     theCopy->blocks = [[NSMutableArray alloc] initWithArray:blocks];
     LineBlock *lastBlock = [blocks lastObject];
     if (lastBlock) {
         [theCopy->blocks removeLastObject];
         [theCopy->blocks addObject:[[lastBlock copy] autorelease]];
     }
+    for (int i = 0; i < (int)[blocks count] - 1; i++) {
+        [[blocks objectAtIndex:i] markShared];
+    }
     theCopy->block_size = block_size;
     theCopy->cursor_x = cursor_x;
     theCopy->cursor_rawline = cursor_rawline;
@@ -946,6 +1347,9 @@ static int RawNumLines(LineBuffer* buffer, int width) {
     theCopy->num_wrapped_lines_cache = num_wrapped_lines_cache;
     theCopy->num_wrapped_lines_width = num_wrapped_lines_width;
     theCopy->droppedChars = droppedChars;
+    theCopy->resident_budget = resident_budget;
+    theCopy->spill_file = [spill_file retain];
+    theCopy->uses_ngram_index = uses_ngram_index;
 
     return theCopy;
 }
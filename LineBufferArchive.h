@@ -0,0 +1,131 @@
+#import <Foundation/Foundation.h>
+
+@class LineBlock;
+
+// A scrollback archive lets a session's LineBuffer and marks outlive the app. It's written
+// incrementally: each block is appended once it fills, so quitting only has to write the last
+// block, the screen, and the marks. The file holds:
+//
+//   LineBufferArchiveHeader
+//   Records, each a LineBufferArchiveRecordHeader followed by |length| bytes:
+//     Block: a LineBlockArchiveHeader and the rest of a -[LineBlock newArchiveRecord].
+//     State: a LineBufferArchiveState listing the blocks that make up the buffer.
+//     Marks: a binary property list of the marks and notes, whose positions are LineBuffer
+//            absolute positions. See -[VT100Screen flushScrollbackArchive].
+//
+// Records are only appended. A block record replaces earlier records with the same number. Readers
+// use the last state record, each of whose blocks is the latest record for its number written
+// before it. A truncated record at the end (the app crashed while writing) is ignored.
+
+#define kLineBufferArchiveMagic "iTermSBK"
+#define kLineBufferArchiveVersion 1
+
+typedef struct {
+    char magic[8];
+    int version;
+    int reserved;
+} LineBufferArchiveHeader;
+
+typedef enum {
+    LineBufferArchiveRecordTypeBlock = 1,
+    LineBufferArchiveRecordTypeState = 2,
+    LineBufferArchiveRecordTypeMarks = 3
+} LineBufferArchiveRecordType;
+
+typedef struct {
+    int type;
+    int length;  // Bytes following this header.
+    long long number;  // Block number for block records; otherwise 0.
+} LineBufferArchiveRecordHeader;
+
+typedef struct {
+    long long firstBlockNumber;
+    long long numBlocks;
+
+    // LineBufferPosition absolute positions in marks records are relative to this.
+    long long droppedChars;
+    int blockSize;
+
+    // Lines dropped from the first block since it was written. See -[LineBlock
+    // setStartOffset:firstEntry:].
+    int firstBlockStartOffset;
+    int firstBlockFirstEntry;
+    int reserved;
+} LineBufferArchiveState;
+
+// Appends records to an archive file from a background queue, deflating blocks on the way.
+// Methods must be called on the main thread.
+@interface LineBufferArchive : NSObject
+{
+    dispatch_queue_t queue_;
+    NSString *path_;
+
+    // Blocks numbered below this were written by the LineBuffer the archive belongs to and haven't
+    // changed since.
+    long long numArchivedBlocks_;
+
+    // Set on queue_ once most of the file is records that have been replaced or dropped.
+    volatile BOOL needsReset_;
+
+    // Only accessed on queue_.
+    int fd_;
+    long long length_;
+    long long liveBytes_;  // Bytes of the latest record of each block at or after firstLiveBlock_.
+    long long firstLiveBlock_;
+    NSMutableDictionary *recordLengths_;  // Block number -> bytes of its latest record
+}
+
+@property(nonatomic, readonly) NSString *path;
+@property(nonatomic, assign) long long numArchivedBlocks;
+@property(nonatomic, readonly) BOOL needsReset;
+
+// Creates a new, empty archive. An existing file at |path| is unlinked first, so a reader that
+// still has it mapped is unaffected. Returns nil if the file can't be created.
+- (id)initWithPath:(NSString *)path;
+
+// Queues a block to be written. The block's contents are copied before this returns.
+- (void)appendBlock:(LineBlock *)block number:(long long)number;
+
+- (void)appendState:(LineBufferArchiveState *)state;
+
+// |marks| must be a property list.
+- (void)appendMarks:(NSArray *)marks;
+
+// Discards everything written so far and sets numArchivedBlocks to 0.
+- (void)reset;
+
+// Waits for queued records to be written.
+- (void)synchronize;
+
+// Waits for queued records to be written and closes the file. Nothing more can be appended.
+- (void)close;
+
+@end
+
+// Maps an archive and finds the records that make it up, as of the last complete state record.
+@interface LineBufferArchiveReader : NSObject
+{
+    NSData *data_;
+    LineBufferArchiveState state_;
+    NSMutableArray *blockOffsets_;
+    NSMutableArray *blockLengths_;
+    NSArray *marks_;
+}
+
+// The mapped file.
+@property(nonatomic, readonly) NSData *data;
+
+// NSNumbers with the offset in |data| of each block's LineBlockArchiveHeader and the length of its
+// record, oldest block first. If a block listed by the state is missing, the blocks from it on are
+// left out.
+@property(nonatomic, readonly) NSArray *blockOffsets;
+@property(nonatomic, readonly) NSArray *blockLengths;
+@property(nonatomic, readonly) LineBufferArchiveState state;
+
+// The property list from the last marks record, or nil if there was none.
+@property(nonatomic, readonly) NSArray *marks;
+
+// Returns nil if the file can't be mapped, isn't an archive, or has no state record.
+- (id)initWithPath:(NSString *)path;
+
+@end
@@ -0,0 +1,339 @@
+#import "LineBufferArchive.h"
+#import <zlib.h>
+#import "DebugLogging.h"
+#import "LineBlock.h"
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// The file is started over once records that have been replaced or dropped take more than this
+// and more than the live records.
+static const long long kLineBufferArchiveMinimumWaste = 4 * 1024 * 1024;
+
+// Deflates the chars of a block record in place unless they're already deflated or don't shrink.
+static void LineBufferArchiveDeflateBlockRecord(NSMutableData *record) {
+    LineBlockArchiveHeader *header = [record mutableBytes];
+    const int storageLength = header->storageLength;
+    if (header->deflated || storageLength == 0) {
+        return;
+    }
+    const NSUInteger storageOffset = [record length] - storageLength;
+    uLongf size = compressBound(storageLength);
+    unsigned char *deflated = malloc(size);
+    int rc = compress2(deflated,
+                       &size,
+                       (const Bytef *)[record bytes] + storageOffset,
+                       storageLength,
+                       Z_BEST_SPEED);
+    if (rc == Z_OK && size < storageLength) {
+        header->storageLength = (int)size;
+        header->deflated = YES;
+        [record replaceBytesInRange:NSMakeRange(storageOffset, storageLength)
+                          withBytes:deflated
+                             length:size];
+    }
+    free(deflated);
+}
+
+@implementation LineBufferArchive
+
+@synthesize path = path_;
+@synthesize numArchivedBlocks = numArchivedBlocks_;
+@synthesize needsReset = needsReset_;
+
+- (id)initWithPath:(NSString *)path
+{
+    self = [super init];
+    if (self) {
+        path_ = [path copy];
+        unlink([path_ fileSystemRepresentation]);
+        fd_ = open([path_ fileSystemRepresentation], O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd_ < 0) {
+            [self release];
+            return nil;
+        }
+        LineBufferArchiveHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, kLineBufferArchiveMagic, sizeof(header.magic));
+        header.version = kLineBufferArchiveVersion;
+        if (write(fd_, &header, sizeof(header)) != sizeof(header)) {
+            [self release];
+            return nil;
+        }
+        length_ = sizeof(header);
+        recordLengths_ = [[NSMutableDictionary alloc] init];
+        queue_ = dispatch_queue_create("com.googlecode.iterm2.scrollback-archive",
+                                       DISPATCH_QUEUE_SERIAL);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (queue_) {
+        dispatch_release(queue_);
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+    [path_ release];
+    [recordLengths_ release];
+    [super dealloc];
+}
+
+- (void)appendBlock:(LineBlock *)block number:(long long)number
+{
+    NSMutableData *record = [block newArchiveRecord];
+    dispatch_async(queue_, ^{
+        LineBufferArchiveDeflateBlockRecord(record);
+        if ([self _writeRecordOfType:LineBufferArchiveRecordTypeBlock
+                              number:number
+                               bytes:[record bytes]
+                              length:[record length]]) {
+            const long long size = sizeof(LineBufferArchiveRecordHeader) + [record length];
+            NSNumber *key = @(number);
+            if (number >= firstLiveBlock_) {
+                liveBytes_ += size - [[recordLengths_ objectForKey:key] longLongValue];
+                [recordLengths_ setObject:@(size) forKey:key];
+            }
+        }
+        [record release];
+    });
+}
+
+- (void)appendState:(LineBufferArchiveState *)state
+{
+    LineBufferArchiveState copy = *state;
+    dispatch_async(queue_, ^{
+        [self _writeRecordOfType:LineBufferArchiveRecordTypeState
+                          number:0
+                           bytes:&copy
+                          length:sizeof(copy)];
+        // Blocks before the first one were dropped from the buffer, so their records are waste.
+        for (long long i = firstLiveBlock_; i < copy.firstBlockNumber; i++) {
+            NSNumber *key = @(i);
+            liveBytes_ -= [[recordLengths_ objectForKey:key] longLongValue];
+            [recordLengths_ removeObjectForKey:key];
+        }
+        firstLiveBlock_ = MAX(firstLiveBlock_, copy.firstBlockNumber);
+        const long long waste = length_ - liveBytes_;
+        needsReset_ = (waste > kLineBufferArchiveMinimumWaste && waste > liveBytes_);
+    });
+}
+
+- (void)appendMarks:(NSArray *)marks
+{
+    NSData *data = [NSPropertyListSerialization dataWithPropertyList:marks
+                                                              format:NSPropertyListBinaryFormat_v1_0
+                                                             options:0
+                                                               error:NULL];
+    if (!data) {
+        return;
+    }
+    dispatch_async(queue_, ^{
+        [self _writeRecordOfType:LineBufferArchiveRecordTypeMarks
+                          number:0
+                           bytes:[data bytes]
+                          length:[data length]];
+    });
+}
+
+- (void)reset
+{
+    numArchivedBlocks_ = 0;
+    needsReset_ = NO;
+    dispatch_async(queue_, ^{
+        if (fd_ < 0) {
+            return;
+        }
+        length_ = sizeof(LineBufferArchiveHeader);
+        ftruncate(fd_, length_);
+        lseek(fd_, length_, SEEK_SET);
+        liveBytes_ = 0;
+        firstLiveBlock_ = 0;
+        [recordLengths_ removeAllObjects];
+        needsReset_ = NO;
+    });
+}
+
+- (void)synchronize
+{
+    dispatch_sync(queue_, ^{ });
+}
+
+- (void)close
+{
+    dispatch_sync(queue_, ^{
+        if (fd_ >= 0) {
+            close(fd_);
+            fd_ = -1;
+        }
+    });
+}
+
+#pragma mark - Private
+
+// Runs on queue_. Returns NO if the record couldn't be written, in which case the archive stops
+// taking records and ends with the last complete one.
+- (BOOL)_writeRecordOfType:(LineBufferArchiveRecordType)type
+                    number:(long long)number
+                     bytes:(const void *)bytes
+                    length:(NSUInteger)length
+{
+    if (fd_ < 0) {
+        return NO;
+    }
+    LineBufferArchiveRecordHeader header = {
+        .type = type,
+        .length = (int)length,
+        .number = number
+    };
+    struct iovec vectors[2] = {
+        { &header, sizeof(header) },
+        { (void *)bytes, length }
+    };
+    const ssize_t expected = sizeof(header) + length;
+    if (writev(fd_, vectors, 2) != expected) {
+        DLog(@"Write to %@ failed: %s", path_, strerror(errno));
+        ftruncate(fd_, length_);
+        close(fd_);
+        fd_ = -1;
+        return NO;
+    }
+    length_ += expected;
+    return YES;
+}
+
+@end
+
+@implementation LineBufferArchiveReader
+
+@synthesize data = data_;
+@synthesize blockOffsets = blockOffsets_;
+@synthesize blockLengths = blockLengths_;
+@synthesize state = state_;
+@synthesize marks = marks_;
+
+- (id)initWithPath:(NSString *)path
+{
+    self = [super init];
+    if (self) {
+        data_ = [[NSData alloc] initWithContentsOfFile:path
+                                               options:NSDataReadingMappedAlways
+                                                 error:NULL];
+        blockOffsets_ = [[NSMutableArray alloc] init];
+        blockLengths_ = [[NSMutableArray alloc] init];
+        if (!data_ || ![self _parse]) {
+            [self release];
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [data_ release];
+    [blockOffsets_ release];
+    [blockLengths_ release];
+    [marks_ release];
+    [super dealloc];
+}
+
+#pragma mark - Private
+
+// Calls |block| with each complete record in order and stops early if it returns NO.
+- (void)_enumerateRecordsWithBlock:(BOOL (^)(LineBufferArchiveRecordHeader *header,
+                                             long long offset))block
+{
+    const unsigned char *bytes = [data_ bytes];
+    const long long length = [data_ length];
+    long long offset = sizeof(LineBufferArchiveHeader);
+    while (offset + (long long)sizeof(LineBufferArchiveRecordHeader) <= length) {
+        LineBufferArchiveRecordHeader header;
+        memcpy(&header, bytes + offset, sizeof(header));
+        const long long payloadOffset = offset + sizeof(header);
+        if (header.length < 0 || payloadOffset + header.length > length) {
+            break;
+        }
+        if (!block(&header, payloadOffset)) {
+            break;
+        }
+        offset = payloadOffset + header.length;
+    }
+}
+
+- (BOOL)_parse
+{
+    LineBufferArchiveHeader header;
+    if ([data_ length] < sizeof(header)) {
+        return NO;
+    }
+    memcpy(&header, [data_ bytes], sizeof(header));
+    if (memcmp(header.magic, kLineBufferArchiveMagic, sizeof(header.magic)) ||
+        header.version != kLineBufferArchiveVersion) {
+        return NO;
+    }
+
+    // Find the last state record and the last marks record.
+    __block long long stateOffset = -1;
+    __block long long marksOffset = -1;
+    __block int marksLength = 0;
+    [self _enumerateRecordsWithBlock:^BOOL(LineBufferArchiveRecordHeader *recordHeader,
+                                           long long offset) {
+        if (recordHeader->type == LineBufferArchiveRecordTypeState &&
+            recordHeader->length == sizeof(LineBufferArchiveState)) {
+            stateOffset = offset;
+        } else if (recordHeader->type == LineBufferArchiveRecordTypeMarks) {
+            marksOffset = offset;
+            marksLength = recordHeader->length;
+        }
+        return YES;
+    }];
+    if (stateOffset < 0) {
+        return NO;
+    }
+    memcpy(&state_, (const unsigned char *)[data_ bytes] + stateOffset, sizeof(state_));
+    if (state_.firstBlockNumber < 0 || state_.numBlocks < 0) {
+        return NO;
+    }
+
+    // Find the latest record for each block written before the state.
+    NSMutableDictionary *offsets = [NSMutableDictionary dictionary];
+    NSMutableDictionary *lengths = [NSMutableDictionary dictionary];
+    [self _enumerateRecordsWithBlock:^BOOL(LineBufferArchiveRecordHeader *recordHeader,
+                                           long long offset) {
+        if (offset >= stateOffset) {
+            return NO;
+        }
+        if (recordHeader->type == LineBufferArchiveRecordTypeBlock) {
+            NSNumber *key = @(recordHeader->number);
+            [offsets setObject:@(offset) forKey:key];
+            [lengths setObject:@(recordHeader->length) forKey:key];
+        }
+        return YES;
+    }];
+    for (long long i = 0; i < state_.numBlocks; i++) {
+        NSNumber *key = @(state_.firstBlockNumber + i);
+        NSNumber *offset = [offsets objectForKey:key];
+        if (!offset) {
+            break;
+        }
+        [blockOffsets_ addObject:offset];
+        [blockLengths_ addObject:[lengths objectForKey:key]];
+    }
+
+    if (marksOffset >= 0) {
+        NSData *plist = [data_ subdataWithRange:NSMakeRange(marksOffset, marksLength)];
+        id marks = [NSPropertyListSerialization propertyListWithData:plist
+                                                             options:NSPropertyListImmutable
+                                                              format:NULL
+                                                               error:NULL];
+        if ([marks isKindOfClass:[NSArray class]]) {
+            marks_ = [marks retain];
+        }
+    }
+    return YES;
+}
+
+@end
@@ -8,24 +8,24 @@
 
 #import <Foundation/Foundation.h>
 
-// When receiving search results, you'll get an array of this class. Positions
-// can be converted to x,y coordinates with -convertPosition:withWidth:toX:toY.
-// length gives the number of screen_char_t elements matching the search (which
-// may differ from the number of code points in the search string because of
-// the vagueries of unicode, or more obviously, for regex searches).
-@interface ResultRange : NSObject {
-@public
+// Search results are kept in NSMutableData arrays of ResultRange since a search for a common word
+// can find millions of them. Positions can be converted to x,y coordinates with
+// -convertPosition:withWidth:toX:toY, or many at once with -convertResultRanges:count:withWidth:
+// toXYRanges:. length gives the number of screen_char_t elements matching the search (which may
+// differ from the number of code points in the search string because of the vagueries of unicode,
+// or more obviously, for regex searches).
+typedef struct {
     int position;
     int length;
-}
-@end
+} ResultRange;
 
-@interface XYRange : NSObject {
-@public
+// The coordinates of the first and last cells of a ResultRange.
+typedef struct {
     int xStart;
     int yStart;
     int xEnd;
     int yEnd;
-}
-@end
+} XYRange;
 
+int ResultRangeCount(NSData *results);
+void ResultRangeAppend(NSMutableData *results, int position, int length);
@@ -8,9 +8,11 @@
 
 #import "LineBufferHelpers.h"
 
-@implementation ResultRange
-@end
-
-@implementation XYRange
-@end
+int ResultRangeCount(NSData *results) {
+    return [results length] / sizeof(ResultRange);
+}
 
+void ResultRangeAppend(NSMutableData *results, int position, int length) {
+    ResultRange range = { position, length };
+    [results appendBytes:&range length:sizeof(range)];
+}
@@ -0,0 +1,55 @@
+//
+//  LineBufferSearch.h
+//  iTerm
+//
+//  Finds all the results of a FindContext in a snapshot of a LineBuffer on background threads.
+//
+
+#import <Foundation/Foundation.h>
+
+@class FindContext;
+@class LineBuffer;
+
+@interface LineBufferSearch : NSObject {
+    LineBuffer *lineBuffer_;  // A copy from newAppendOnlyCopy. Never modified.
+    NSArray *blocks_;
+    int *blockPositions_;  // Position of each block's first char in lineBuffer_.
+    NSString *substring_;
+    int options_;
+    int dir_;
+    int firstBlock_;  // Index of the block the search begins in.
+    int firstOffset_;  // Offset in the first block to begin at, or -1 for its end.
+    int stopAt_;
+    int numBlocksToSearch_;
+
+    // NSData of the ResultRanges in the nth block searched (in search order), or NSNull if it hasn't
+    // been searched yet.
+    // Guarded by condition_, which is signaled when a block is done.
+    NSMutableArray *blockResults_;
+    NSCondition *condition_;
+    volatile int32_t *claimed_;  // Nonzero once a thread has begun searching the nth block.
+    int nextBlockToCollect_;
+    volatile int32_t cancelled_;
+}
+
+// The snapshot must have been made when context was prepared (it should be positioned on one of the
+// snapshot's blocks) and must not be modified afterwards. context must be a multiple-results search.
+- (id)initWithLineBuffer:(LineBuffer *)snapshot context:(FindContext *)context;
+
+// Starts searching on a concurrent queue.
+- (void)start;
+
+// Stops searching as soon as possible. Searches of blocks that are in progress are finished.
+- (void)cancel;
+
+// Moves results to |results| in the order a single-threaded search would produce them. The next
+// block's results are always collected, searching it on the calling thread if no worker has begun
+// it. After that, blocks that are done are collected until maxTime passes. Positions are converted
+// to positions in lineBuffer, which must be the buffer that the snapshot was made from; results
+// that have since been dropped are skipped. Returns NO if there is nothing left to collect and
+// nothing was collected by this call.
+- (BOOL)collectResults:(NSMutableData *)results
+         forLineBuffer:(LineBuffer *)lineBuffer
+               maxTime:(NSTimeInterval)maxTime;
+
+@end
@@ -0,0 +1,197 @@
+//
+//  LineBufferSearch.m
+//  iTerm
+//
+
+#import "LineBufferSearch.h"
+#import "FindContext.h"
+#import "LineBlock.h"
+#import "LineBuffer.h"
+#import "LineBufferHelpers.h"
+#include <libkern/OSAtomic.h>
+
+// Each task searches this many blocks before the next task takes over, so results near the start
+// of the search are reported first.
+static const int kBlocksPerTask = 16;
+
+@implementation LineBufferSearch
+
+- (id)initWithLineBuffer:(LineBuffer *)snapshot context:(FindContext *)context
+{
+    self = [super init];
+    if (self) {
+        assert(context.options & FindMultipleResults);
+        lineBuffer_ = [snapshot retain];
+        blocks_ = [[snapshot blocksForSearch] copy];
+        substring_ = [context.substring copy];
+        options_ = context.options;
+        dir_ = context.dir;
+        firstBlock_ = context.absBlockNum - [snapshot numDroppedBlocks];
+        firstOffset_ = context.offset;
+        stopAt_ = (dir_ > 0) ? [snapshot lastPos] : [snapshot firstPos];
+
+        const int numBlocks = (int)[blocks_ count];
+        blockPositions_ = malloc(sizeof(int) * MAX(1, numBlocks));
+        int position = 0;
+        for (int i = 0; i < numBlocks; i++) {
+            blockPositions_[i] = position;
+            position += [[blocks_ objectAtIndex:i] rawSpaceUsed];
+        }
+
+        if (context.status != Searching || firstBlock_ >= numBlocks) {
+            numBlocksToSearch_ = 0;
+        } else if (firstBlock_ < 0) {
+            // The first block was dropped. A forward search skips ahead and a backward one is done.
+            numBlocksToSearch_ = (dir_ > 0) ? numBlocks : 0;
+            firstBlock_ = 0;
+            firstOffset_ = 0;
+        } else {
+            numBlocksToSearch_ = (dir_ > 0) ? numBlocks - firstBlock_ : firstBlock_ + 1;
+        }
+        condition_ = [[NSCondition alloc] init];
+        claimed_ = calloc(MAX(1, numBlocksToSearch_), sizeof(int32_t));
+        blockResults_ = [[NSMutableArray alloc] initWithCapacity:numBlocksToSearch_];
+        for (int i = 0; i < numBlocksToSearch_; i++) {
+            [blockResults_ addObject:[NSNull null]];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [lineBuffer_ release];
+    [blocks_ release];
+    free(blockPositions_);
+    [substring_ release];
+    [blockResults_ release];
+    [condition_ release];
+    free((void *)claimed_);
+    [super dealloc];
+}
+
+- (void)start
+{
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    for (int first = 0; first < numBlocksToSearch_; first += kBlocksPerTask) {
+        const int last = MIN(first + kBlocksPerTask, numBlocksToSearch_);
+        dispatch_async(queue, ^{
+            for (int n = first; n < last && !cancelled_; n++) {
+                if (OSAtomicCompareAndSwap32Barrier(0, 1, &claimed_[n])) {
+                    [self _searchNthBlock:n];
+                }
+            }
+        });
+    }
+}
+
+- (void)cancel
+{
+    OSAtomicCompareAndSwap32Barrier(0, 1, &cancelled_);
+}
+
+// Searches the nth block in search order, which the caller must have claimed.
+- (void)_searchNthBlock:(int)n
+{
+    NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+    NSData *results = [self _resultsOfSearchingBlock:firstBlock_ + dir_ * n];
+    [condition_ lock];
+    [blockResults_ replaceObjectAtIndex:n withObject:results];
+    [condition_ broadcast];
+    [condition_ unlock];
+    [pool drain];
+}
+
+// Searches one block. Returns ResultRanges with positions in lineBuffer_.
+- (NSData *)_resultsOfSearchingBlock:(int)i
+{
+    LineBlock *block = [blocks_ objectAtIndex:i];
+    int offset;
+    if (i == firstBlock_) {
+        offset = firstOffset_;
+    } else {
+        offset = (dir_ > 0) ? 0 : -1;
+    }
+    if (i == 0 && offset != -1 && offset < [block startOffset]) {
+        if (dir_ < 0) {
+            // The search began in a part of the block that has been dropped.
+            return [NSData data];
+        }
+        offset = [block startOffset];
+    }
+
+    NSMutableData *results = [NSMutableData data];
+    [block findSubstring:substring_
+                 options:options_
+                atOffset:offset
+                 results:results
+         multipleResults:YES];
+    ResultRange *ranges = [results mutableBytes];
+    const int numResults = ResultRangeCount(results);
+    int numFiltered = 0;
+    for (int j = 0; j < numResults; j++) {
+        ResultRange range = ranges[j];
+        range.position += blockPositions_[i];
+        if (dir_ * (range.position - stopAt_) <= 0) {
+            ranges[numFiltered++] = range;
+        }
+    }
+    [results setLength:numFiltered * sizeof(ResultRange)];
+    return results;
+}
+
+- (BOOL)collectResults:(NSMutableData *)results
+         forLineBuffer:(LineBuffer *)lineBuffer
+               maxTime:(NSTimeInterval)maxTime
+{
+    NSDate *start = [NSDate date];
+    const int firstValidPosition = [lineBuffer firstPos];
+    BOOL found = NO;
+    BOOL first = YES;
+    while (!cancelled_ && nextBlockToCollect_ < numBlocksToSearch_) {
+        const int n = nextBlockToCollect_;
+        [condition_ lock];
+        BOOL done = ([blockResults_ objectAtIndex:n] != [NSNull null]);
+        [condition_ unlock];
+        if (!done) {
+            if (!first) {
+                break;
+            }
+            if (OSAtomicCompareAndSwap32Barrier(0, 1, &claimed_[n])) {
+                // No worker has gotten to it yet, so search it here rather than wait.
+                [self _searchNthBlock:n];
+            }
+        }
+
+        [condition_ lock];
+        while ([blockResults_ objectAtIndex:n] == [NSNull null]) {
+            [condition_ wait];
+        }
+        NSData *blockResults = [[[blockResults_ objectAtIndex:n] retain] autorelease];
+        // The caller owns the results now, so don't hold on to them.
+        [blockResults_ replaceObjectAtIndex:n withObject:[NSData data]];
+        [condition_ unlock];
+        ++nextBlockToCollect_;
+        first = NO;
+
+        const ResultRange *ranges = [blockResults bytes];
+        const int numResults = ResultRangeCount(blockResults);
+        for (int i = 0; i < numResults; i++) {
+            long long absPosition = [lineBuffer_ absPositionForPosition:ranges[i].position];
+            int position = [lineBuffer positionForAbsPosition:absPosition];
+            if (position < firstValidPosition ||
+                [lineBuffer absPositionForPosition:position] != absPosition) {
+                // Scrolled off since the search began.
+                continue;
+            }
+            ResultRangeAppend(results, position, ranges[i].length);
+            found = YES;
+        }
+        if ([[NSDate date] timeIntervalSinceDate:start] >= maxTime) {
+            break;
+        }
+    }
+    return found || (!cancelled_ && nextBlockToCollect_ < numBlocksToSearch_);
+}
+
+@end
@@ -0,0 +1,29 @@
+//
+//  LineObjectIndex.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+// Objects sorted by the absolute line they're on, so the one on or before a line can be found
+// with a binary search instead of by enumerating an interval tree. Lines are usually added in
+// increasing order, which just appends.
+@interface LineObjectIndex : NSObject {
+    NSMutableArray *objects_;
+    NSMutableData *lines_;  // long long for each object in objects_, ascending.
+}
+
+- (NSUInteger)count;
+
+// Objects on the same line are kept in the order they were added.
+- (void)addObject:(id)object onLine:(long long)line;
+
+// Removes |object|, which was added on |line|. Does nothing if it isn't there.
+- (void)removeObject:(id)object onLine:(long long)line;
+
+- (void)removeAllObjects;
+
+// The object added last on the greatest line that is less than |line|, or nil.
+- (id)objectBeforeLine:(long long)line;
+
+@end
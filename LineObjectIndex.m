@@ -0,0 +1,93 @@
+//
+//  LineObjectIndex.m
+//  iTerm
+//
+
+#import "LineObjectIndex.h"
+
+@implementation LineObjectIndex
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        objects_ = [[NSMutableArray alloc] init];
+        lines_ = [[NSMutableData alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [objects_ release];
+    [lines_ release];
+    [super dealloc];
+}
+
+- (NSUInteger)count
+{
+    return [objects_ count];
+}
+
+// Returns the index of the first object on a line greater than |line|, or on a line not less than
+// it if |inclusive| is NO.
+- (NSUInteger)indexAfterLine:(long long)line inclusive:(BOOL)inclusive
+{
+    const long long *lines = [lines_ bytes];
+    NSUInteger lo = 0;
+    NSUInteger hi = [objects_ count];
+    while (lo < hi) {
+        const NSUInteger mid = lo + (hi - lo) / 2;
+        if (lines[mid] < line || (inclusive && lines[mid] == line)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+- (void)addObject:(id)object onLine:(long long)line
+{
+    const NSUInteger count = [objects_ count];
+    const long long *lines = [lines_ bytes];
+    if (!count || lines[count - 1] <= line) {
+        [objects_ addObject:object];
+        [lines_ appendBytes:&line length:sizeof(line)];
+        return;
+    }
+    const NSUInteger index = [self indexAfterLine:line inclusive:YES];
+    [objects_ insertObject:object atIndex:index];
+    [lines_ replaceBytesInRange:NSMakeRange(index * sizeof(line), 0)
+                      withBytes:&line
+                         length:sizeof(line)];
+}
+
+- (void)removeObject:(id)object onLine:(long long)line
+{
+    const long long *lines = [lines_ bytes];
+    const NSUInteger count = [objects_ count];
+    for (NSUInteger i = [self indexAfterLine:line inclusive:NO]; i < count && lines[i] == line; i++) {
+        if ([objects_ objectAtIndex:i] == object) {
+            [objects_ removeObjectAtIndex:i];
+            [lines_ replaceBytesInRange:NSMakeRange(i * sizeof(line), sizeof(line))
+                              withBytes:NULL
+                                 length:0];
+            return;
+        }
+    }
+}
+
+- (void)removeAllObjects
+{
+    [objects_ removeAllObjects];
+    [lines_ setLength:0];
+}
+
+- (id)objectBeforeLine:(long long)line
+{
+    const NSUInteger index = [self indexAfterLine:line inclusive:NO];
+    return index > 0 ? [objects_ objectAtIndex:index - 1] : nil;
+}
+
+@end
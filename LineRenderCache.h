@@ -0,0 +1,45 @@
+//
+//  LineRenderCache.h
+//  iTerm
+//
+//  Rendered rows of a PTYTextView, reused while their contents don't change.
+//
+
+#import <Cocoa/Cocoa.h>
+
+// Holds one CGLayer per absolute line number along with the key it was rendered with: the line's
+// cells plus whatever else affects how it's drawn (selection, find matches, etc.). A row whose key
+// is unchanged can be composited from its layer instead of being drawn again. Used only when the
+// hidden UseLineRenderCache preference is on.
+@interface LineRenderCache : NSObject {
+    NSMutableDictionary *entries_;  // NSNumber (absolute line) -> LineRenderCacheEntry
+    // Layers for the grid that isn't showing, kept across switches to and from the alternate screen.
+    NSMutableDictionary *savedEntries_;
+}
+
+// Returns a layer for the line. If it was last rendered with an identical key, *needsRender is set
+// to NO and the layer can be drawn as is. Otherwise *needsRender is YES and the caller must draw
+// the line into the layer, which is size points large and compatible with ctx.
+- (CGLayerRef)layerForLine:(long long)absoluteLineNumber
+                       key:(NSData *)key
+                      size:(CGSize)size
+                   context:(CGContextRef)ctx
+               needsRender:(BOOL *)needsRender;
+
+// Discards layers for lines outside [first, first + count).
+- (void)removeLayersOutsideLines:(long long)first count:(int)count;
+
+// Removes every layer, including the saved ones.
+- (void)removeAllLayers;
+
+// Exchanges the layers in use with the saved ones. Call when the screen switches between its
+// primary and alternate grids, so that each grid's rows are composited from what was drawn for them
+// the last time they were shown.
+- (void)swapWithSavedLayers;
+
+- (int)numberOfLayers;
+
+// Bytes of pixels in the layers, assuming 4 bytes per pixel at |scale| pixels per point.
+- (long long)estimatedBytesWithScale:(CGFloat)scale;
+
+@end
@@ -0,0 +1,118 @@
+//
+//  LineRenderCache.m
+//  iTerm
+//
+
+#import "LineRenderCache.h"
+
+@interface LineRenderCacheEntry : NSObject {
+@public
+    CGLayerRef layer_;
+    NSData *key_;
+}
+@end
+
+@implementation LineRenderCacheEntry
+
+- (void)dealloc
+{
+    CGLayerRelease(layer_);
+    [key_ release];
+    [super dealloc];
+}
+
+@end
+
+@implementation LineRenderCache
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        entries_ = [[NSMutableDictionary alloc] init];
+        savedEntries_ = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [entries_ release];
+    [savedEntries_ release];
+    [super dealloc];
+}
+
+- (int)numberOfLayers
+{
+    return [entries_ count] + [savedEntries_ count];
+}
+
+- (long long)estimatedBytesWithScale:(CGFloat)scale
+{
+    long long total = 0;
+    for (NSDictionary *entries in @[ entries_, savedEntries_ ]) {
+        for (LineRenderCacheEntry *entry in [entries objectEnumerator]) {
+            if (entry->layer_) {
+                const CGSize size = CGLayerGetSize(entry->layer_);
+                total += (long long)(size.width * scale) * (long long)(size.height * scale) * 4;
+            }
+        }
+    }
+    return total;
+}
+
+- (CGLayerRef)layerForLine:(long long)absoluteLineNumber
+                       key:(NSData *)key
+                      size:(CGSize)size
+                   context:(CGContextRef)ctx
+               needsRender:(BOOL *)needsRender
+{
+    NSNumber *lineNumber = [NSNumber numberWithLongLong:absoluteLineNumber];
+    LineRenderCacheEntry *entry = [entries_ objectForKey:lineNumber];
+    if (!entry) {
+        entry = [[[LineRenderCacheEntry alloc] init] autorelease];
+        [entries_ setObject:entry forKey:lineNumber];
+    }
+    if (entry->layer_ && !CGSizeEqualToSize(CGLayerGetSize(entry->layer_), size)) {
+        CGLayerRelease(entry->layer_);
+        entry->layer_ = NULL;
+    }
+    if (entry->layer_ && [entry->key_ isEqualToData:key]) {
+        *needsRender = NO;
+        return entry->layer_;
+    }
+    if (!entry->layer_) {
+        entry->layer_ = CGLayerCreateWithContext(ctx, size, NULL);
+    }
+    [entry->key_ release];
+    entry->key_ = [key copy];
+    *needsRender = YES;
+    return entry->layer_;
+}
+
+- (void)removeLayersOutsideLines:(long long)first count:(int)count
+{
+    NSMutableArray *keysToRemove = [NSMutableArray array];
+    for (NSNumber *lineNumber in entries_) {
+        long long line = [lineNumber longLongValue];
+        if (line < first || line >= first + count) {
+            [keysToRemove addObject:lineNumber];
+        }
+    }
+    [entries_ removeObjectsForKeys:keysToRemove];
+}
+
+- (void)removeAllLayers
+{
+    [entries_ removeAllObjects];
+    [savedEntries_ removeAllObjects];
+}
+
+- (void)swapWithSavedLayers
+{
+    NSMutableDictionary *temp = entries_;
+    entries_ = savedEntries_;
+    savedEntries_ = temp;
+}
+
+@end
@@ -0,0 +1,52 @@
+//
+//  LinearRegex.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+// A regex engine that takes time linear in the length of the text, however the pattern is
+// written. The pattern is compiled to a program for a Pike VM, which runs every way the pattern
+// could match side by side, one character at a time, instead of backtracking. Matches are the
+// same ones ICU finds: the leftmost, preferring earlier alternatives and greedy or lazy
+// repetition as written.
+//
+// It understands the common subset of ICU syntax: literals and escapes, ., character classes with
+// ranges and negation, \d \w \s and their negations, ^ $ \A \z \Z \b \B, capturing and (?:)
+// groups, | and the greedy and lazy forms of * + ? and {m,n}. ^ and $ mean the start and end of
+// the text. Anything else yields NULL so the caller can use ICU instead: backreferences,
+// lookaround, inline options, possessive quantifiers, Unicode properties, set operations and
+// patterns that aren't valid at all. Case-insensitive matching folds ASCII letters only, so a
+// case-insensitive pattern with other letters is also rejected.
+//
+// A compiled regex is never modified, so it may be used from any thread.
+typedef struct LinearRegex LinearRegex;
+
+// Returns NULL if the pattern can't be compiled. When it returns NULL and |reason| isn't NULL,
+// *reason is set to a short description of what wasn't supported.
+LinearRegex *LinearRegexCreate(const unichar *pattern,
+                               int length,
+                               BOOL caseInsensitive,
+                               const char **reason);
+void LinearRegexFree(LinearRegex *regex);
+
+// Number of capturing groups, not counting the whole match.
+int LinearRegexNumberOfGroups(const LinearRegex *regex);
+
+typedef enum {
+    kLinearRegexNoMatch,
+    kLinearRegexMatch,
+    kLinearRegexTimedOut
+} LinearRegexResult;
+
+// Finds the first match in |text| that begins at or after |start|. The whole text is used to
+// evaluate ^, $ and \b. On a match, |captures| gets the start and end of the match followed by
+// those of each group, or -1 for a group that didn't take part; it must have room for
+// 2 * (LinearRegexNumberOfGroups() + 1) ints. Gives up if CFAbsoluteTimeGetCurrent() passes
+// |deadline|, unless it is 0.
+LinearRegexResult LinearRegexSearch(const LinearRegex *regex,
+                                    const unichar *text,
+                                    int length,
+                                    int start,
+                                    int *captures,
+                                    NSTimeInterval deadline);
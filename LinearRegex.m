@@ -0,0 +1,1134 @@
+//
+//  LinearRegex.m
+//  iTerm
+//
+
+#import "LinearRegex.h"
+
+// Programs longer than this are left to ICU. Counted repetition copies its operand, so this also
+// bounds how far x{m,n} may expand.
+static const int kMaxInstructions = 20000;
+static const int kMaxRepetitionCount = 1000;
+static const int kMaxGroupDepth = 200;
+
+// Characters matched between checks of the deadline.
+static const int kDeadlineCheckInterval = 4096;
+
+typedef enum {
+    kOpChar,  // Matches c.
+    kOpAny,  // Matches anything but a line terminator.
+    kOpClass,  // Matches classes[x].
+    kOpSplit,  // Continues at x and, with lower priority, at y.
+    kOpJump,  // Continues at x.
+    kOpSave,  // Records the position in capture slot x.
+    kOpAssert,  // Continues if assertion x holds.
+    kOpMatch
+} LinearRegexOp;
+
+typedef enum {
+    kAssertStartOfText,
+    kAssertEndOfText,
+    kAssertEndOfLine,  // The end of the text or just before a line terminator that ends it.
+    kAssertWordBoundary,
+    kAssertNotWordBoundary
+} LinearRegexAssertion;
+
+// Builtin sets that a class may include.
+enum {
+    kSetDigit = 1 << 0,
+    kSetNotDigit = 1 << 1,
+    kSetWord = 1 << 2,
+    kSetNotWord = 1 << 3,
+    kSetSpace = 1 << 4,
+    kSetNotSpace = 1 << 5
+};
+
+typedef struct {
+    uint32_t *ranges;  // Pairs of first and last code points.
+    int numRanges;
+    int sets;
+    BOOL negated;
+} LinearRegexClass;
+
+typedef struct {
+    LinearRegexOp op;
+    int x;
+    int y;
+    uint32_t c;
+} LinearRegexInstruction;
+
+struct LinearRegex {
+    LinearRegexInstruction *program;
+    int length;
+    LinearRegexClass *classes;
+    int numClasses;
+    int numGroups;
+    BOOL caseInsensitive;
+
+    // The code unit every match begins with, or -1 if there isn't one. Lets a search skip ahead
+    // while it has nothing in progress.
+    int firstChar;
+};
+
+#pragma mark - Characters
+
+static inline uint32_t CodePointAt(const unichar *text, int length, int i, int *width) {
+    const unichar c = text[i];
+    if (CFStringIsSurrogateHighCharacter(c) &&
+        i + 1 < length &&
+        CFStringIsSurrogateLowCharacter(text[i + 1])) {
+        *width = 2;
+        return CFStringGetLongCharacterForSurrogatePair(c, text[i + 1]);
+    }
+    *width = 1;
+    return c;
+}
+
+static inline uint32_t CodePointBefore(const unichar *text, int i) {
+    const unichar c = text[i - 1];
+    if (CFStringIsSurrogateLowCharacter(c) &&
+        i >= 2 &&
+        CFStringIsSurrogateHighCharacter(text[i - 2])) {
+        return CFStringGetLongCharacterForSurrogatePair(text[i - 2], c);
+    }
+    return c;
+}
+
+static inline uint32_t Fold(uint32_t c, BOOL caseInsensitive) {
+    if (caseInsensitive && c >= 'A' && c <= 'Z') {
+        return c | 0x20;
+    }
+    return c;
+}
+
+static inline BOOL IsASCIILetter(uint32_t c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static inline BOOL IsLineTerminator(uint32_t c) {
+    return (c >= 0x0a && c <= 0x0d) || c == 0x85 || c == 0x2028 || c == 0x2029;
+}
+
+static BOOL IsInPredefinedSet(uint32_t c, CFCharacterSetPredefinedSet set) {
+    return CFCharacterSetIsLongCharacterMember(CFCharacterSetGetPredefined(set), c);
+}
+
+static inline BOOL IsDigit(uint32_t c) {
+    if (c < 0x80) {
+        return c >= '0' && c <= '9';
+    }
+    return IsInPredefinedSet(c, kCFCharacterSetDecimalDigit);
+}
+
+static inline BOOL IsWordChar(uint32_t c) {
+    if (c < 0x80) {
+        return IsASCIILetter(c) || (c >= '0' && c <= '9') || c == '_';
+    }
+    return IsInPredefinedSet(c, kCFCharacterSetAlphaNumeric);
+}
+
+static inline BOOL IsSpace(uint32_t c) {
+    if (c < 0x80) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+    return IsInPredefinedSet(c, kCFCharacterSetWhitespaceAndNewline);
+}
+
+// Whether |c| has another case that an ASCII-only fold would miss.
+static BOOL IsCasedNonASCII(uint32_t c) {
+    return c >= 0x80 && (IsInPredefinedSet(c, kCFCharacterSetLowercaseLetter) ||
+                         IsInPredefinedSet(c, kCFCharacterSetUppercaseLetter) ||
+                         IsInPredefinedSet(c, kCFCharacterSetCapitalizedLetter));
+}
+
+static BOOL ClassContains(const LinearRegexClass *cls, uint32_t c) {
+    for (int i = 0; i < cls->numRanges; i++) {
+        if (c >= cls->ranges[2 * i] && c <= cls->ranges[2 * i + 1]) {
+            return YES;
+        }
+    }
+    const int sets = cls->sets;
+    return (((sets & kSetDigit) && IsDigit(c)) ||
+            ((sets & kSetNotDigit) && !IsDigit(c)) ||
+            ((sets & kSetWord) && IsWordChar(c)) ||
+            ((sets & kSetNotWord) && !IsWordChar(c)) ||
+            ((sets & kSetSpace) && IsSpace(c)) ||
+            ((sets & kSetNotSpace) && !IsSpace(c)));
+}
+
+static inline BOOL ClassMatches(const LinearRegexClass *cls, uint32_t c, BOOL caseInsensitive) {
+    BOOL contains = ClassContains(cls, c);
+    if (!contains && caseInsensitive && IsASCIILetter(c)) {
+        contains = ClassContains(cls, c ^ 0x20);
+    }
+    return contains != cls->negated;
+}
+
+#pragma mark - Parsing
+
+typedef enum {
+    kNodeEmpty,
+    kNodeChar,
+    kNodeAny,
+    kNodeClass,
+    kNodeAssert,
+    kNodeConcat,
+    kNodeAlternate,
+    kNodeRepeat,
+    kNodeGroup
+} LinearRegexNodeType;
+
+typedef struct {
+    LinearRegexNodeType type;
+    uint32_t c;
+    int index;  // Of the class, assertion or group.
+    int left;
+    int right;
+    int min;
+    int max;  // -1 for no limit
+    BOOL greedy;
+    BOOL nullable;  // Whether it can match without consuming anything.
+} LinearRegexNode;
+
+typedef struct {
+    const unichar *pattern;
+    int length;
+    int i;
+    BOOL caseInsensitive;
+    const char *error;
+    int depth;
+    LinearRegexNode *nodes;
+    int numNodes;
+    LinearRegexClass *classes;
+    int numClasses;
+    int numGroups;
+} LinearRegexParser;
+
+typedef enum {
+    kEscapeChar,
+    kEscapeSet,
+    kEscapeAssertion,
+    kEscapeUnsupported
+} LinearRegexEscape;
+
+static int Fail(LinearRegexParser *p, const char *error) {
+    if (!p->error) {
+        p->error = error;
+    }
+    return -1;
+}
+
+static int AddNode(LinearRegexParser *p, LinearRegexNodeType type, int left, int right) {
+    p->nodes = realloc(p->nodes, (p->numNodes + 1) * sizeof(LinearRegexNode));
+    LinearRegexNode *node = &p->nodes[p->numNodes];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    switch (type) {
+        case kNodeEmpty:
+        case kNodeAssert:
+            node->nullable = YES;
+            break;
+        case kNodeConcat:
+            node->nullable = p->nodes[left].nullable && p->nodes[right].nullable;
+            break;
+        case kNodeAlternate:
+            node->nullable = p->nodes[left].nullable || p->nodes[right].nullable;
+            break;
+        case kNodeGroup:
+        case kNodeRepeat:
+            node->nullable = p->nodes[left].nullable;
+            break;
+        default:
+            break;
+    }
+    return p->numNodes++;
+}
+
+static BOOL AtChar(LinearRegexParser *p, unichar c) {
+    return p->i < p->length && p->pattern[p->i] == c;
+}
+
+static int HexValue(unichar c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Reads exactly |count| hex digits, or up to |count| if |count| is negative.
+static BOOL ReadHex(LinearRegexParser *p, int count, uint32_t *value) {
+    const int limit = count < 0 ? -count : count;
+    int n = 0;
+    *value = 0;
+    while (n < limit && p->i < p->length && HexValue(p->pattern[p->i]) >= 0) {
+        *value = *value * 16 + HexValue(p->pattern[p->i++]);
+        n++;
+    }
+    return n > 0 && (count < 0 || n == count) && *value <= 0x10ffff;
+}
+
+// Reads the escape at p->i, which is a backslash. Sets *value to the character, set or assertion.
+static LinearRegexEscape ReadEscape(LinearRegexParser *p, uint32_t *value) {
+    p->i++;
+    if (p->i >= p->length) {
+        Fail(p, "a trailing backslash");
+        return kEscapeUnsupported;
+    }
+    const unichar c = p->pattern[p->i++];
+    switch (c) {
+        case 'd':
+            *value = kSetDigit;
+            return kEscapeSet;
+        case 'D':
+            *value = kSetNotDigit;
+            return kEscapeSet;
+        case 'w':
+            *value = kSetWord;
+            return kEscapeSet;
+        case 'W':
+            *value = kSetNotWord;
+            return kEscapeSet;
+        case 's':
+            *value = kSetSpace;
+            return kEscapeSet;
+        case 'S':
+            *value = kSetNotSpace;
+            return kEscapeSet;
+        case 'b':
+            *value = kAssertWordBoundary;
+            return kEscapeAssertion;
+        case 'B':
+            *value = kAssertNotWordBoundary;
+            return kEscapeAssertion;
+        case 'A':
+            *value = kAssertStartOfText;
+            return kEscapeAssertion;
+        case 'z':
+            *value = kAssertEndOfText;
+            return kEscapeAssertion;
+        case 'Z':
+            *value = kAssertEndOfLine;
+            return kEscapeAssertion;
+        case 't':
+            *value = '\t';
+            return kEscapeChar;
+        case 'n':
+            *value = '\n';
+            return kEscapeChar;
+        case 'r':
+            *value = '\r';
+            return kEscapeChar;
+        case 'f':
+            *value = '\f';
+            return kEscapeChar;
+        case 'a':
+            *value = '\a';
+            return kEscapeChar;
+        case 'e':
+            *value = 0x1b;
+            return kEscapeChar;
+        case 'x':
+            if (AtChar(p, '{')) {
+                p->i++;
+                if (ReadHex(p, -6, value) && AtChar(p, '}')) {
+                    p->i++;
+                    return kEscapeChar;
+                }
+            } else if (ReadHex(p, 2, value)) {
+                return kEscapeChar;
+            }
+            Fail(p, "malformed character codes");
+            return kEscapeUnsupported;
+        case 'u':
+            if (ReadHex(p, 4, value)) {
+                return kEscapeChar;
+            }
+            Fail(p, "malformed character codes");
+            return kEscapeUnsupported;
+        case 'U':
+            if (ReadHex(p, 8, value)) {
+                return kEscapeChar;
+            }
+            Fail(p, "malformed character codes");
+            return kEscapeUnsupported;
+        case '0':
+            *value = 0;
+            for (int n = 0; n < 3 && p->i < p->length; n++) {
+                const unichar digit = p->pattern[p->i];
+                if (digit < '0' || digit > '7' || *value * 8 + (digit - '0') > 0377) {
+                    break;
+                }
+                *value = *value * 8 + (digit - '0');
+                p->i++;
+            }
+            return kEscapeChar;
+    }
+    if (c >= '1' && c <= '9') {
+        Fail(p, "backreferences");
+        return kEscapeUnsupported;
+    }
+    if (c == 'p' || c == 'P' || c == 'N') {
+        Fail(p, "Unicode properties and names");
+        return kEscapeUnsupported;
+    }
+    if (c < 0x80 && (IsASCIILetter(c) || (c >= '0' && c <= '9'))) {
+        Fail(p, "escapes other than \\d \\w \\s \\b and character codes");
+        return kEscapeUnsupported;
+    }
+    int width;
+    p->i--;
+    *value = CodePointAt(p->pattern, p->length, p->i, &width);
+    p->i += width;
+    return kEscapeChar;
+}
+
+static int AddRange(LinearRegexClass *cls, uint32_t first, uint32_t last) {
+    cls->ranges = realloc(cls->ranges, (cls->numRanges + 1) * 2 * sizeof(uint32_t));
+    cls->ranges[2 * cls->numRanges] = first;
+    cls->ranges[2 * cls->numRanges + 1] = last;
+    return cls->numRanges++;
+}
+
+// Reads one end of a range in a class into |value|. Returns NO and sets p->error on failure.
+static BOOL ReadClassChar(LinearRegexParser *p, uint32_t *value, int *sets) {
+    if (p->pattern[p->i] == '\\') {
+        switch (ReadEscape(p, value)) {
+            case kEscapeChar:
+                return YES;
+            case kEscapeSet:
+                if (sets) {
+                    *sets = *value;
+                    return YES;
+                }
+                Fail(p, "ranges that end in \\d \\w or \\s");
+                return NO;
+            case kEscapeAssertion:
+                Fail(p, "assertions in character classes");
+                return NO;
+            case kEscapeUnsupported:
+                return NO;
+        }
+    }
+    if (p->pattern[p->i] == '[') {
+        Fail(p, "nested character classes and [:name:]");
+        return NO;
+    }
+    int width;
+    *value = CodePointAt(p->pattern, p->length, p->i, &width);
+    p->i += width;
+    return YES;
+}
+
+static int ParseClass(LinearRegexParser *p) {
+    LinearRegexClass cls = { NULL, 0, 0, NO };
+    p->i++;
+    if (AtChar(p, '^')) {
+        cls.negated = YES;
+        p->i++;
+    }
+    if (AtChar(p, ']')) {
+        return Fail(p, "character classes that begin with ]");
+    }
+    while (1) {
+        if (p->i >= p->length) {
+            free(cls.ranges);
+            return Fail(p, "unterminated character classes");
+        }
+        const unichar c = p->pattern[p->i];
+        if (c == ']') {
+            p->i++;
+            break;
+        }
+        if ((c == '&' || c == '-') && p->i + 1 < p->length && p->pattern[p->i + 1] == c) {
+            free(cls.ranges);
+            return Fail(p, "character class operations");
+        }
+        uint32_t first;
+        int sets = 0;
+        if (!ReadClassChar(p, &first, &sets)) {
+            free(cls.ranges);
+            return -1;
+        }
+        if (sets) {
+            cls.sets |= sets;
+            continue;
+        }
+        uint32_t last = first;
+        if (p->i + 1 < p->length && p->pattern[p->i] == '-' && p->pattern[p->i + 1] != ']') {
+            p->i++;
+            if (!ReadClassChar(p, &last, NULL)) {
+                free(cls.ranges);
+                return -1;
+            }
+            if (last < first) {
+                free(cls.ranges);
+                return Fail(p, "backwards ranges");
+            }
+        }
+        if (p->caseInsensitive &&
+            last >= 0x80 &&
+            (first != last || IsCasedNonASCII(first))) {
+            free(cls.ranges);
+            return Fail(p, "case-insensitive non-ASCII letters");
+        }
+        AddRange(&cls, first, last);
+    }
+    p->classes = realloc(p->classes, (p->numClasses + 1) * sizeof(LinearRegexClass));
+    p->classes[p->numClasses] = cls;
+    const int node = AddNode(p, kNodeClass, -1, -1);
+    p->nodes[node].index = p->numClasses++;
+    return node;
+}
+
+static int ParseAlternation(LinearRegexParser *p);
+
+static int ParseAtom(LinearRegexParser *p) {
+    const unichar c = p->pattern[p->i];
+    int node;
+    uint32_t value;
+    switch (c) {
+        case '(': {
+            p->i++;
+            int group = -1;
+            if (AtChar(p, '?')) {
+                if (p->i + 1 < p->length && p->pattern[p->i + 1] == ':') {
+                    p->i += 2;
+                } else {
+                    return Fail(p, "lookaround, named groups and inline options");
+                }
+            } else {
+                group = ++p->numGroups;
+            }
+            if (++p->depth > kMaxGroupDepth) {
+                return Fail(p, "deeply nested groups");
+            }
+            const int child = ParseAlternation(p);
+            p->depth--;
+            if (child < 0) {
+                return -1;
+            }
+            if (!AtChar(p, ')')) {
+                return Fail(p, "unbalanced parentheses");
+            }
+            p->i++;
+            if (group < 0) {
+                return child;
+            }
+            node = AddNode(p, kNodeGroup, child, -1);
+            p->nodes[node].index = group;
+            return node;
+        }
+
+        case '[':
+            return ParseClass(p);
+
+        case '.':
+            p->i++;
+            return AddNode(p, kNodeAny, -1, -1);
+
+        case '^':
+        case '$':
+            p->i++;
+            node = AddNode(p, kNodeAssert, -1, -1);
+            p->nodes[node].index = (c == '^') ? kAssertStartOfText : kAssertEndOfLine;
+            return node;
+
+        case '\\':
+            switch (ReadEscape(p, &value)) {
+                case kEscapeChar:
+                    break;
+                case kEscapeSet:
+                    p->classes = realloc(p->classes, (p->numClasses + 1) * sizeof(LinearRegexClass));
+                    p->classes[p->numClasses].ranges = NULL;
+                    p->classes[p->numClasses].numRanges = 0;
+                    p->classes[p->numClasses].sets = value;
+                    p->classes[p->numClasses].negated = NO;
+                    node = AddNode(p, kNodeClass, -1, -1);
+                    p->nodes[node].index = p->numClasses++;
+                    return node;
+                case kEscapeAssertion:
+                    node = AddNode(p, kNodeAssert, -1, -1);
+                    p->nodes[node].index = value;
+                    return node;
+                case kEscapeUnsupported:
+                    return -1;
+            }
+            break;
+
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+            return Fail(p, "a quantifier with nothing to repeat");
+
+        case ']':
+        case '}':
+            return Fail(p, "unescaped ] and }");
+
+        default: {
+            int width;
+            value = CodePointAt(p->pattern, p->length, p->i, &width);
+            p->i += width;
+            break;
+        }
+    }
+    if (p->caseInsensitive && IsCasedNonASCII(value)) {
+        return Fail(p, "case-insensitive non-ASCII letters");
+    }
+    node = AddNode(p, kNodeChar, -1, -1);
+    p->nodes[node].c = value;
+    return node;
+}
+
+static BOOL ReadCount(LinearRegexParser *p, int *count) {
+    int n = 0;
+    *count = 0;
+    while (p->i < p->length && p->pattern[p->i] >= '0' && p->pattern[p->i] <= '9') {
+        const int digit = p->pattern[p->i++] - '0';
+        *count = MIN(*count * 10 + digit, kMaxRepetitionCount + 1);
+        n++;
+    }
+    return n > 0;
+}
+
+static int ParseQuantifier(LinearRegexParser *p, int atom) {
+    if (p->i >= p->length) {
+        return atom;
+    }
+    int min;
+    int max;
+    switch (p->pattern[p->i]) {
+        case '*':
+            p->i++;
+            min = 0;
+            max = -1;
+            break;
+        case '+':
+            p->i++;
+            min = 1;
+            max = -1;
+            break;
+        case '?':
+            p->i++;
+            min = 0;
+            max = 1;
+            break;
+        case '{':
+            p->i++;
+            if (!ReadCount(p, &min)) {
+                return Fail(p, "this form of {m,n}");
+            }
+            max = min;
+            if (AtChar(p, ',')) {
+                p->i++;
+                if (!ReadCount(p, &max)) {
+                    max = -1;
+                }
+            }
+            if (!AtChar(p, '}') || (max >= 0 && max < min)) {
+                return Fail(p, "this form of {m,n}");
+            }
+            p->i++;
+            if (min > kMaxRepetitionCount || max > kMaxRepetitionCount) {
+                return Fail(p, "repetition counts over 1000");
+            }
+            break;
+        default:
+            return atom;
+    }
+    if (p->nodes[atom].type == kNodeAssert) {
+        return Fail(p, "quantified assertions");
+    }
+    if (p->nodes[atom].nullable && (max < 0 || max > 1)) {
+        // Backtracking engines stop repeating once an iteration matches nothing, which a Pike VM
+        // can't mimic exactly.
+        return Fail(p, "repeating something that can match nothing");
+    }
+    BOOL greedy = YES;
+    if (AtChar(p, '?')) {
+        greedy = NO;
+        p->i++;
+    } else if (AtChar(p, '+')) {
+        return Fail(p, "possessive quantifiers");
+    }
+    if (AtChar(p, '*') || AtChar(p, '+') || AtChar(p, '?') || AtChar(p, '{')) {
+        return Fail(p, "repeated quantifiers");
+    }
+    const int node = AddNode(p, kNodeRepeat, atom, -1);
+    p->nodes[node].min = min;
+    p->nodes[node].max = max;
+    p->nodes[node].greedy = greedy;
+    p->nodes[node].nullable = p->nodes[atom].nullable || min == 0;
+    return node;
+}
+
+static int ParseConcatenation(LinearRegexParser *p) {
+    int result = AddNode(p, kNodeEmpty, -1, -1);
+    while (p->i < p->length && p->pattern[p->i] != '|' && p->pattern[p->i] != ')') {
+        int atom = ParseAtom(p);
+        if (atom >= 0) {
+            atom = ParseQuantifier(p, atom);
+        }
+        if (atom < 0) {
+            return -1;
+        }
+        result = AddNode(p, kNodeConcat, result, atom);
+    }
+    return result;
+}
+
+static int ParseAlternation(LinearRegexParser *p) {
+    int result = ParseConcatenation(p);
+    while (result >= 0 && AtChar(p, '|')) {
+        p->i++;
+        const int right = ParseConcatenation(p);
+        if (right < 0) {
+            return -1;
+        }
+        result = AddNode(p, kNodeAlternate, result, right);
+    }
+    return result;
+}
+
+#pragma mark - Compiling
+
+typedef struct {
+    LinearRegexInstruction *program;
+    int length;
+    int capacity;
+    BOOL overflow;
+} LinearRegexEmitter;
+
+// Returns the index of the new instruction, or -1 if the program is too long.
+static int Emit(LinearRegexEmitter *e, LinearRegexOp op, int x, uint32_t c) {
+    if (e->length >= kMaxInstructions) {
+        e->overflow = YES;
+        return -1;
+    }
+    if (e->length == e->capacity) {
+        e->capacity = MAX(16, e->capacity * 2);
+        e->program = realloc(e->program, e->capacity * sizeof(LinearRegexInstruction));
+    }
+    LinearRegexInstruction *instruction = &e->program[e->length];
+    instruction->op = op;
+    instruction->x = x;
+    instruction->y = 0;
+    instruction->c = c;
+    return e->length++;
+}
+
+static void SetSplit(LinearRegexEmitter *e, int split, int preferred, int other) {
+    e->program[split].x = preferred;
+    e->program[split].y = other;
+}
+
+// Concatenation and alternation are parsed into chains that grow to the left. Returns the operands
+// of the chain at node |n| in order, so they can be compiled without recursing down the chain.
+static int *NewOperandList(const LinearRegexParser *p, int n, int *count) {
+    const LinearRegexNodeType type = p->nodes[n].type;
+    *count = 1;
+    for (int i = n; p->nodes[i].type == type; i = p->nodes[i].left) {
+        ++*count;
+    }
+    int *operands = malloc(*count * sizeof(int));
+    int j = *count - 1;
+    int i;
+    for (i = n; p->nodes[i].type == type; i = p->nodes[i].left) {
+        operands[j--] = p->nodes[i].right;
+    }
+    operands[j] = i;
+    return operands;
+}
+
+static void Compile(const LinearRegexParser *p, int n, LinearRegexEmitter *e) {
+    if (e->overflow) {
+        return;
+    }
+    const LinearRegexNode *node = &p->nodes[n];
+    switch (node->type) {
+        case kNodeEmpty:
+            break;
+
+        case kNodeChar:
+            Emit(e, kOpChar, 0, Fold(node->c, p->caseInsensitive));
+            break;
+
+        case kNodeAny:
+            Emit(e, kOpAny, 0, 0);
+            break;
+
+        case kNodeClass:
+            Emit(e, kOpClass, node->index, 0);
+            break;
+
+        case kNodeAssert:
+            Emit(e, kOpAssert, node->index, 0);
+            break;
+
+        case kNodeConcat: {
+            int count;
+            int *operands = NewOperandList(p, n, &count);
+            for (int i = 0; i < count; i++) {
+                Compile(p, operands[i], e);
+            }
+            free(operands);
+            break;
+        }
+
+        case kNodeAlternate: {
+            // Each alternative but the last is preceded by a split to the next one and followed by a
+            // jump to the end.
+            int count;
+            int *operands = NewOperandList(p, n, &count);
+            int *jumps = malloc(count * sizeof(int));
+            for (int i = 0; i < count && !e->overflow; i++) {
+                const int split = (i + 1 < count) ? Emit(e, kOpSplit, 0, 0) : -1;
+                Compile(p, operands[i], e);
+                if (i + 1 < count) {
+                    jumps[i] = Emit(e, kOpJump, 0, 0);
+                    if (!e->overflow) {
+                        SetSplit(e, split, split + 1, e->length);
+                    }
+                }
+            }
+            if (!e->overflow) {
+                for (int i = 0; i + 1 < count; i++) {
+                    e->program[jumps[i]].x = e->length;
+                }
+            }
+            free(jumps);
+            free(operands);
+            break;
+        }
+
+        case kNodeGroup:
+            Emit(e, kOpSave, 2 * node->index, 0);
+            Compile(p, node->left, e);
+            Emit(e, kOpSave, 2 * node->index + 1, 0);
+            break;
+
+        case kNodeRepeat: {
+            for (int i = 0; i < node->min; i++) {
+                Compile(p, node->left, e);
+            }
+            if (node->max < 0) {
+                const int split = Emit(e, kOpSplit, 0, 0);
+                Compile(p, node->left, e);
+                Emit(e, kOpJump, split, 0);
+                if (e->overflow) {
+                    return;
+                }
+                if (node->greedy) {
+                    SetSplit(e, split, split + 1, e->length);
+                } else {
+                    SetSplit(e, split, e->length, split + 1);
+                }
+            } else {
+                // x{2,4} becomes xx(x(x)?)? with every split leaving to the same place.
+                const int numOptional = node->max - node->min;
+                int *splits = malloc(MAX(1, numOptional) * sizeof(int));
+                for (int i = 0; i < numOptional; i++) {
+                    splits[i] = Emit(e, kOpSplit, 0, 0);
+                    Compile(p, node->left, e);
+                }
+                if (!e->overflow) {
+                    for (int i = 0; i < numOptional; i++) {
+                        if (node->greedy) {
+                            SetSplit(e, splits[i], splits[i] + 1, e->length);
+                        } else {
+                            SetSplit(e, splits[i], e->length, splits[i] + 1);
+                        }
+                    }
+                }
+                free(splits);
+            }
+            break;
+        }
+    }
+}
+
+static void FreeClasses(LinearRegexClass *classes, int numClasses) {
+    for (int i = 0; i < numClasses; i++) {
+        free(classes[i].ranges);
+    }
+    free(classes);
+}
+
+LinearRegex *LinearRegexCreate(const unichar *pattern,
+                               int length,
+                               BOOL caseInsensitive,
+                               const char **reason) {
+    LinearRegexParser parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.pattern = pattern;
+    parser.length = length;
+    parser.caseInsensitive = caseInsensitive;
+    int root = ParseAlternation(&parser);
+    if (root >= 0 && parser.i < length) {
+        root = Fail(&parser, "unbalanced parentheses");
+    }
+
+    LinearRegex *regex = NULL;
+    if (root >= 0) {
+        LinearRegexEmitter emitter;
+        memset(&emitter, 0, sizeof(emitter));
+        Emit(&emitter, kOpSave, 0, 0);
+        Compile(&parser, root, &emitter);
+        Emit(&emitter, kOpSave, 1, 0);
+        Emit(&emitter, kOpMatch, 0, 0);
+        if (emitter.overflow) {
+            Fail(&parser, "patterns this long once repetition is expanded");
+            free(emitter.program);
+        } else {
+            regex = calloc(1, sizeof(LinearRegex));
+            regex->program = realloc(emitter.program, emitter.length * sizeof(LinearRegexInstruction));
+            regex->length = emitter.length;
+            regex->classes = parser.classes;
+            regex->numClasses = parser.numClasses;
+            regex->numGroups = parser.numGroups;
+            regex->caseInsensitive = caseInsensitive;
+            regex->firstChar = -1;
+            int pc = 1;
+            while (regex->program[pc].op == kOpSave) {
+                pc++;
+            }
+            if (regex->program[pc].op == kOpChar &&
+                regex->program[pc].c < 0x10000 &&
+                !CFStringIsSurrogateHighCharacter(regex->program[pc].c)) {
+                regex->firstChar = regex->program[pc].c;
+            }
+        }
+    }
+    if (!regex) {
+        FreeClasses(parser.classes, parser.numClasses);
+        if (reason) {
+            *reason = parser.error;
+        }
+    }
+    free(parser.nodes);
+    return regex;
+}
+
+void LinearRegexFree(LinearRegex *regex) {
+    if (!regex) {
+        return;
+    }
+    free(regex->program);
+    FreeClasses(regex->classes, regex->numClasses);
+    free(regex);
+}
+
+int LinearRegexNumberOfGroups(const LinearRegex *regex) {
+    return regex->numGroups;
+}
+
+#pragma mark - Matching
+
+// The threads waiting to match the character at one position, highest priority first. No two
+// are at the same instruction, so there are never more threads than instructions.
+typedef struct {
+    int *pcs;
+    int *captures;  // numSlots for each thread
+    int count;
+} LinearRegexThreadList;
+
+// Work left while adding a thread: either an instruction to follow, or a capture slot to put
+// back once every thread that saw the new value has been added.
+typedef struct {
+    int pc;
+    int slot;  // -1 for an instruction
+    int value;
+} LinearRegexJob;
+
+static BOOL AssertionHolds(LinearRegexAssertion assertion, const unichar *text, int length, int pos) {
+    int width;
+    switch (assertion) {
+        case kAssertStartOfText:
+            return pos == 0;
+        case kAssertEndOfText:
+            return pos == length;
+        case kAssertEndOfLine:
+            return (pos == length ||
+                    (pos == length - 1 && IsLineTerminator(text[pos])) ||
+                    (pos == length - 2 && text[pos] == '\r' && text[pos + 1] == '\n'));
+        case kAssertWordBoundary:
+        case kAssertNotWordBoundary: {
+            const BOOL before = pos > 0 && IsWordChar(CodePointBefore(text, pos));
+            const BOOL after = pos < length && IsWordChar(CodePointAt(text, length, pos, &width));
+            return (before != after) == (assertion == kAssertWordBoundary);
+        }
+    }
+    return NO;
+}
+
+// Follows every path from |pc| that doesn't consume a character, adding a thread to |list| for
+// each instruction it reaches that does, and for each match. Paths are followed in priority order
+// so the threads end up in it. |captures| holds the path's captures and is restored on return.
+static void AddThread(const LinearRegex *regex,
+                      LinearRegexThreadList *list,
+                      int *marks,
+                      int mark,
+                      LinearRegexJob *stack,
+                      int pc,
+                      int *captures,
+                      int numSlots,
+                      const unichar *text,
+                      int length,
+                      int pos) {
+    int top = 0;
+    stack[top].pc = pc;
+    stack[top].slot = -1;
+    top++;
+    while (top > 0) {
+        const LinearRegexJob job = stack[--top];
+        if (job.slot >= 0) {
+            captures[job.slot] = job.value;
+            continue;
+        }
+        pc = job.pc;
+        BOOL follow = YES;
+        while (follow && marks[pc] != mark) {
+            marks[pc] = mark;
+            const LinearRegexInstruction *instruction = &regex->program[pc];
+            switch (instruction->op) {
+                case kOpJump:
+                    pc = instruction->x;
+                    break;
+                case kOpSplit:
+                    stack[top].pc = instruction->y;
+                    stack[top].slot = -1;
+                    top++;
+                    pc = instruction->x;
+                    break;
+                case kOpSave:
+                    stack[top].slot = instruction->x;
+                    stack[top].value = captures[instruction->x];
+                    top++;
+                    captures[instruction->x] = pos;
+                    pc++;
+                    break;
+                case kOpAssert:
+                    follow = AssertionHolds(instruction->x, text, length, pos);
+                    pc++;
+                    break;
+                default:
+                    list->pcs[list->count] = pc;
+                    memcpy(list->captures + list->count * numSlots, captures, numSlots * sizeof(int));
+                    list->count++;
+                    follow = NO;
+                    break;
+            }
+        }
+    }
+}
+
+static inline BOOL InstructionMatches(const LinearRegex *regex,
+                                      const LinearRegexInstruction *instruction,
+                                      uint32_t c) {
+    switch (instruction->op) {
+        case kOpChar:
+            return Fold(c, regex->caseInsensitive) == instruction->c;
+        case kOpAny:
+            return !IsLineTerminator(c);
+        case kOpClass:
+            return ClassMatches(&regex->classes[instruction->x], c, regex->caseInsensitive);
+        default:
+            return NO;
+    }
+}
+
+LinearRegexResult LinearRegexSearch(const LinearRegex *regex,
+                                    const unichar *text,
+                                    int length,
+                                    int start,
+                                    int *captures,
+                                    NSTimeInterval deadline) {
+    const int numSlots = 2 * (regex->numGroups + 1);
+    const int n = regex->length;
+    LinearRegexThreadList lists[2];
+    for (int i = 0; i < 2; i++) {
+        lists[i].pcs = malloc(n * sizeof(int));
+        lists[i].captures = malloc(n * numSlots * sizeof(int));
+        lists[i].count = 0;
+    }
+    int *marks = malloc(n * sizeof(int));
+    memset(marks, 0xff, n * sizeof(int));
+    LinearRegexJob *stack = malloc((n + 1) * sizeof(LinearRegexJob));
+    int *working = malloc(numSlots * sizeof(int));
+
+    LinearRegexThreadList *current = &lists[0];
+    LinearRegexThreadList *next = &lists[1];
+    int mark = 0;
+    int currentMark = mark;
+    BOOL matched = NO;
+    LinearRegexResult result = kLinearRegexNoMatch;
+    int pos = start;
+    int steps = 0;
+    while (1) {
+        if (!matched) {
+            if (current->count == 0 && regex->firstChar >= 0) {
+                while (pos < length && Fold(text[pos], regex->caseInsensitive) != regex->firstChar) {
+                    pos++;
+                }
+                if (pos >= length) {
+                    break;
+                }
+            }
+            // A match that begins here has lower priority than those already under way.
+            for (int i = 0; i < numSlots; i++) {
+                working[i] = -1;
+            }
+            AddThread(regex, current, marks, currentMark, stack, 0, working, numSlots, text, length, pos);
+        }
+
+        int width = 1;
+        const uint32_t c = pos < length ? CodePointAt(text, length, pos, &width) : 0;
+        next->count = 0;
+        const int nextMark = ++mark;
+        for (int t = 0; t < current->count; t++) {
+            const LinearRegexInstruction *instruction = &regex->program[current->pcs[t]];
+            int *threadCaptures = current->captures + t * numSlots;
+            if (instruction->op == kOpMatch) {
+                matched = YES;
+                memcpy(captures, threadCaptures, numSlots * sizeof(int));
+                // The threads after this one have lower priority.
+                break;
+            }
+            if (pos < length && InstructionMatches(regex, instruction, c)) {
+                memcpy(working, threadCaptures, numSlots * sizeof(int));
+                AddThread(regex, next, marks, nextMark, stack, current->pcs[t] + 1, working,
+                          numSlots, text, length, pos + width);
+            }
+        }
+        if (pos >= length || (matched && next->count == 0)) {
+            break;
+        }
+        LinearRegexThreadList *temp = current;
+        current = next;
+        next = temp;
+        currentMark = nextMark;
+        pos += width;
+        if (deadline && ++steps % kDeadlineCheckInterval == 0 && CFAbsoluteTimeGetCurrent() > deadline) {
+            result = kLinearRegexTimedOut;
+            break;
+        }
+    }
+    if (result != kLinearRegexTimedOut && matched) {
+        result = kLinearRegexMatch;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        free(lists[i].pcs);
+        free(lists[i].captures);
+    }
+    free(marks);
+    free(stack);
+    free(working);
+    return result;
+}
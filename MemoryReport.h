@@ -0,0 +1,43 @@
+//
+//  MemoryReport.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+// Tallies the memory held by each session, broken down by the subsystem that holds it, along with
+// totals across sessions. Sessions add their parts with -addBytes:forCategory: and friends after
+// -beginSectionWithName:. Sizes are what the owning objects know they allocated (char buffers,
+// tables, layers), so malloc overhead, Cocoa objects and shared frameworks aren't included; the
+// report shows where the sessions' own memory goes, not the process's footprint.
+@interface MemoryReport : NSObject {
+    NSMutableArray *sections_;  // MemoryReportSection
+    NSMutableArray *totals_;  // MemoryReportRow, one per category, in the order first added
+    NSMutableDictionary *totalsByCategory_;  // NSString -> MemoryReportRow
+}
+
+// Starts a section. Rows added afterwards belong to it until the next call.
+- (void)beginSectionWithName:(NSString *)name;
+
+// Adds a row to the current section and its bytes to the category's total.
+- (void)addBytes:(long long)bytes forCategory:(NSString *)category;
+
+// As above, also showing the number of items (blocks, entries, layers) the bytes are held in.
+- (void)addBytes:(long long)bytes count:(long long)count forCategory:(NSString *)category;
+
+// For things counted but not sized, like interval tree entries.
+- (void)addCount:(long long)count forCategory:(NSString *)category;
+
+// For bytes that are part of another row, like the used part of a buffer, or that aren't in
+// memory. They're shown and totaled by category but left out of the overall totals.
+- (void)addUncountedBytes:(long long)bytes forCategory:(NSString *)category;
+
+// Total bytes over all sections, or for one category. Uncounted bytes are included only in their
+// own category's total.
+- (long long)totalBytes;
+- (long long)totalBytesForCategory:(NSString *)category;
+
+// Each section's rows followed by the totals, as plain text.
+- (NSString *)formattedReport;
+
+@end
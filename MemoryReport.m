@@ -0,0 +1,213 @@
+//
+//  MemoryReport.m
+//  iTerm
+//
+
+#import "MemoryReport.h"
+
+// Width of the category column in -formattedReport.
+static const NSUInteger kMemoryReportCategoryWidth = 36;
+
+static NSString *MemoryReportFormatBytes(long long bytes) {
+    if (bytes < 1024) {
+        return [NSString stringWithFormat:@"%lld B", bytes];
+    } else if (bytes < 1024 * 1024) {
+        return [NSString stringWithFormat:@"%.1f KB", bytes / 1024.0];
+    } else if (bytes < 1024LL * 1024 * 1024) {
+        return [NSString stringWithFormat:@"%.1f MB", bytes / (1024.0 * 1024)];
+    } else {
+        return [NSString stringWithFormat:@"%.2f GB", bytes / (1024.0 * 1024 * 1024)];
+    }
+}
+
+@interface MemoryReportRow : NSObject {
+@public
+    NSString *category;
+    long long bytes;
+    long long count;
+    BOOL hasBytes;
+    BOOL hasCount;
+    BOOL uncounted;
+}
+@end
+
+@implementation MemoryReportRow
+
+- (void)dealloc
+{
+    [category release];
+    [super dealloc];
+}
+
+- (NSString *)formattedLine
+{
+    NSMutableString *line = [NSMutableString stringWithString:@"  "];
+    [line appendString:[category stringByPaddingToLength:kMemoryReportCategoryWidth
+                                              withString:@" "
+                                         startingAtIndex:0]];
+    if (hasBytes) {
+        [line appendString:MemoryReportFormatBytes(bytes)];
+    }
+    if (hasCount) {
+        [line appendFormat:hasBytes ? @" (%lld)" : @"%lld", count];
+    }
+    if (uncounted) {
+        [line appendString:@" *"];
+    }
+    return line;
+}
+
+@end
+
+@interface MemoryReportSection : NSObject {
+@public
+    NSString *name;
+    NSMutableArray *rows;
+}
+@end
+
+@implementation MemoryReportSection
+
+- (void)dealloc
+{
+    [name release];
+    [rows release];
+    [super dealloc];
+}
+
+@end
+
+@implementation MemoryReport
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        sections_ = [[NSMutableArray alloc] init];
+        totals_ = [[NSMutableArray alloc] init];
+        totalsByCategory_ = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [sections_ release];
+    [totals_ release];
+    [totalsByCategory_ release];
+    [super dealloc];
+}
+
+- (void)beginSectionWithName:(NSString *)name
+{
+    MemoryReportSection *section = [[[MemoryReportSection alloc] init] autorelease];
+    section->name = [name copy];
+    section->rows = [[NSMutableArray alloc] init];
+    [sections_ addObject:section];
+}
+
+- (void)addBytes:(long long)bytes forCategory:(NSString *)category
+{
+    [self _addBytes:bytes hasBytes:YES count:0 hasCount:NO uncounted:NO forCategory:category];
+}
+
+- (void)addBytes:(long long)bytes count:(long long)count forCategory:(NSString *)category
+{
+    [self _addBytes:bytes hasBytes:YES count:count hasCount:YES uncounted:NO forCategory:category];
+}
+
+- (void)addCount:(long long)count forCategory:(NSString *)category
+{
+    [self _addBytes:0 hasBytes:NO count:count hasCount:YES uncounted:NO forCategory:category];
+}
+
+- (void)addUncountedBytes:(long long)bytes forCategory:(NSString *)category
+{
+    [self _addBytes:bytes hasBytes:YES count:0 hasCount:NO uncounted:YES forCategory:category];
+}
+
+- (long long)totalBytes
+{
+    long long total = 0;
+    for (MemoryReportRow *row in totals_) {
+        if (!row->uncounted) {
+            total += row->bytes;
+        }
+    }
+    return total;
+}
+
+- (long long)totalBytesForCategory:(NSString *)category
+{
+    MemoryReportRow *row = [totalsByCategory_ objectForKey:category];
+    return row ? row->bytes : 0;
+}
+
+- (NSString *)formattedReport
+{
+    NSMutableString *report = [NSMutableString string];
+    for (MemoryReportSection *section in sections_) {
+        long long sectionBytes = 0;
+        [report appendFormat:@"%@\n", section->name];
+        for (MemoryReportRow *row in section->rows) {
+            [report appendFormat:@"%@\n", [row formattedLine]];
+            if (!row->uncounted) {
+                sectionBytes += row->bytes;
+            }
+        }
+        [report appendFormat:@"  %@%@\n\n",
+            [@"Total" stringByPaddingToLength:kMemoryReportCategoryWidth
+                                   withString:@" "
+                              startingAtIndex:0],
+            MemoryReportFormatBytes(sectionBytes)];
+    }
+    [report appendString:@"All sessions\n"];
+    for (MemoryReportRow *row in totals_) {
+        [report appendFormat:@"%@\n", [row formattedLine]];
+    }
+    [report appendFormat:@"  %@%@\n",
+        [@"Total" stringByPaddingToLength:kMemoryReportCategoryWidth
+                               withString:@" "
+                          startingAtIndex:0],
+        MemoryReportFormatBytes([self totalBytes])];
+    [report appendString:@"\n* Part of another row or not in memory. Not included in totals.\n"];
+    return report;
+}
+
+#pragma mark - Private
+
+- (void)_addBytes:(long long)bytes
+         hasBytes:(BOOL)hasBytes
+            count:(long long)count
+         hasCount:(BOOL)hasCount
+        uncounted:(BOOL)uncounted
+      forCategory:(NSString *)category
+{
+    if (![sections_ count]) {
+        [self beginSectionWithName:@"Shared"];
+    }
+    MemoryReportSection *section = [sections_ lastObject];
+    MemoryReportRow *row = [[[MemoryReportRow alloc] init] autorelease];
+    row->category = [category copy];
+    row->bytes = bytes;
+    row->count = count;
+    row->hasBytes = hasBytes;
+    row->hasCount = hasCount;
+    row->uncounted = uncounted;
+    [section->rows addObject:row];
+
+    MemoryReportRow *total = [totalsByCategory_ objectForKey:category];
+    if (!total) {
+        total = [[[MemoryReportRow alloc] init] autorelease];
+        total->category = [category copy];
+        total->uncounted = uncounted;
+        [totals_ addObject:total];
+        [totalsByCategory_ setObject:total forKey:category];
+    }
+    total->bytes += bytes;
+    total->count += count;
+    total->hasBytes |= hasBytes;
+    total->hasCount |= hasCount;
+}
+
+@end
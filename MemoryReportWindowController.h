@@ -0,0 +1,17 @@
+//
+//  MemoryReportWindowController.h
+//  iTerm
+//
+
+#import <Cocoa/Cocoa.h>
+
+// A panel showing -[iTermController memoryReport], refreshed every couple of seconds while it's
+// open.
+@interface MemoryReportWindowController : NSWindowController <NSWindowDelegate> {
+    NSTextView *textView_;
+    NSTimer *refreshTimer_;
+}
+
++ (MemoryReportWindowController *)sharedInstance;
+
+@end
@@ -0,0 +1,91 @@
+//
+//  MemoryReportWindowController.m
+//  iTerm
+//
+
+#import "MemoryReportWindowController.h"
+#import "MemoryReport.h"
+#import "iTermController.h"
+
+// Measuring walks every scrollback block of every session, so don't do it too often.
+static const NSTimeInterval kMemoryReportRefreshInterval = 2;
+
+@implementation MemoryReportWindowController
+
++ (MemoryReportWindowController *)sharedInstance
+{
+    static MemoryReportWindowController *instance;
+    if (!instance) {
+        instance = [[MemoryReportWindowController alloc] init];
+    }
+    return instance;
+}
+
+- (id)init
+{
+    NSPanel *panel = [[[NSPanel alloc] initWithContentRect:NSMakeRect(0, 0, 600, 500)
+                                                 styleMask:(NSTitledWindowMask |
+                                                            NSClosableWindowMask |
+                                                            NSResizableWindowMask |
+                                                            NSUtilityWindowMask)
+                                                   backing:NSBackingStoreBuffered
+                                                     defer:YES] autorelease];
+    self = [super initWithWindow:panel];
+    if (self) {
+        [panel setTitle:@"Memory Report"];
+        [panel setReleasedWhenClosed:NO];
+        [panel setHidesOnDeactivate:NO];
+        [panel setDelegate:self];
+
+        NSScrollView *scrollView =
+            [[[NSScrollView alloc] initWithFrame:[[panel contentView] bounds]] autorelease];
+        [scrollView setHasVerticalScroller:YES];
+        [scrollView setHasHorizontalScroller:YES];
+        [scrollView setAutoresizingMask:NSViewWidthSizable | NSViewHeightSizable];
+
+        textView_ = [[NSTextView alloc] initWithFrame:[[scrollView contentView] bounds]];
+        [textView_ setEditable:NO];
+        [textView_ setFont:[NSFont userFixedPitchFontOfSize:11]];
+        [textView_ setAutoresizingMask:NSViewWidthSizable];
+        [scrollView setDocumentView:textView_];
+        [panel setContentView:scrollView];
+        [panel center];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [refreshTimer_ invalidate];
+    [textView_ release];
+    [super dealloc];
+}
+
+- (void)showWindow:(id)sender
+{
+    [super showWindow:sender];
+    [self refresh];
+    if (!refreshTimer_) {
+        refreshTimer_ = [NSTimer scheduledTimerWithTimeInterval:kMemoryReportRefreshInterval
+                                                         target:self
+                                                       selector:@selector(refresh)
+                                                       userInfo:nil
+                                                        repeats:YES];
+    }
+}
+
+- (void)refresh
+{
+    [textView_ setString:[[[iTermController sharedInstance] memoryReport] formattedReport]];
+    [textView_ setFont:[NSFont userFixedPitchFontOfSize:11]];
+}
+
+#pragma mark - NSWindowDelegate
+
+- (void)windowWillClose:(NSNotification *)notification
+{
+    [refreshTimer_ invalidate];
+    refreshTimer_ = nil;
+}
+
+@end
@@ -0,0 +1,51 @@
+//
+//  MetricsExporter.h
+//  iTerm
+//
+//  Publishes performance counters in the Prometheus text format on a Unix domain socket, for
+//  monitoring many machines. Set the hidden MetricsSocketPath preference to turn it on.
+//
+
+#import <Foundation/Foundation.h>
+
+// Set once the exporter has started. The counting functions below do nothing until then.
+extern BOOL gMetricsExporterEnabled;
+
+// Bytes read from a pty. Any thread.
+void MetricsExporterAddBytesRead(int count);
+
+// Bytes parsed and executed. Any thread.
+void MetricsExporterAddBytesParsed(int count);
+
+// A session's text view drew a frame that took |duration|. Main thread only.
+void MetricsExporterAddFrame(NSTimeInterval duration);
+
+// Once a second the main thread takes a snapshot built from the counters above and the same
+// sources as the debug panels: session activity (parse rate, trigger time), the scrollback budget,
+// instant replay buffers and the TaskNotifier threads. Main-thread stalls are measured by how late
+// the snapshot timer fires. Each connection to the socket is sent the latest snapshot as a minimal
+// HTTP/1.0 response and closed, so for example `curl --unix-socket <path> http://localhost/` reads
+// it.
+@interface MetricsExporter : NSObject {
+    NSString *socketPath_;
+    int listenFd_;
+    dispatch_source_t acceptSource_;
+    NSString *snapshot_;  // @synchronized(self)
+
+    NSTimeInterval nextSampleTime_;
+    double stallSeconds_;
+    long long stalls_;
+}
+
++ (MetricsExporter *)sharedInstance;
+
+// YES if MetricsSocketPath is set.
++ (BOOL)isEnabled;
+
+// Starts listening and sampling. Main thread only.
+- (void)start;
+
+// The text the socket serves, made now. Main thread only.
+- (NSString *)currentMetrics;
+
+@end
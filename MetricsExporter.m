@@ -0,0 +1,340 @@
+//
+//  MetricsExporter.m
+//  iTerm
+//
+
+#import "MetricsExporter.h"
+#import "DVR.h"
+#import "DebugLogging.h"
+#import "PTYSession.h"
+#import "PseudoTerminal.h"
+#import "ScrollbackBudget.h"
+#import "SessionActivity.h"
+#import "TaskNotifier.h"
+#import "VT100Screen.h"
+#import "iTermController.h"
+#include <libkern/OSAtomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const NSTimeInterval kMetricsSampleInterval = 1;
+
+// A sample this late means the main thread was stuck.
+static const NSTimeInterval kMetricsStallThreshold = 0.05;
+
+// Upper bounds of the frame time histogram's buckets, in seconds. There's also an infinite one.
+static const double kFrameTimeBuckets[] = {
+    0.002, 0.004, 0.008, 0.016, 0.033, 0.066, 0.133, 0.266, 0.533
+};
+#define kNumFrameTimeBuckets (sizeof(kFrameTimeBuckets) / sizeof(*kFrameTimeBuckets))
+
+BOOL gMetricsExporterEnabled;
+
+static volatile int64_t gBytesRead;
+static volatile int64_t gBytesParsed;
+
+// Main thread only.
+static long long gFrameCounts[kNumFrameTimeBuckets + 1];
+static long long gFrames;
+static double gFrameSeconds;
+
+void MetricsExporterAddBytesRead(int count)
+{
+    if (gMetricsExporterEnabled) {
+        OSAtomicAdd64(count, &gBytesRead);
+    }
+}
+
+void MetricsExporterAddBytesParsed(int count)
+{
+    if (gMetricsExporterEnabled) {
+        OSAtomicAdd64(count, &gBytesParsed);
+    }
+}
+
+void MetricsExporterAddFrame(NSTimeInterval duration)
+{
+    if (!gMetricsExporterEnabled) {
+        return;
+    }
+    int bucket = 0;
+    while (bucket < kNumFrameTimeBuckets && duration > kFrameTimeBuckets[bucket]) {
+        bucket++;
+    }
+    gFrameCounts[bucket]++;
+    gFrames++;
+    gFrameSeconds += duration;
+}
+
+@implementation MetricsExporter
+
++ (MetricsExporter *)sharedInstance
+{
+    static MetricsExporter *instance;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        instance = [[MetricsExporter alloc] init];
+    });
+    return instance;
+}
+
++ (BOOL)isEnabled
+{
+    return [[[NSUserDefaults standardUserDefaults] stringForKey:@"MetricsSocketPath"] length] > 0;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        listenFd_ = -1;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (acceptSource_) {
+        dispatch_source_cancel(acceptSource_);
+        dispatch_release(acceptSource_);
+    }
+    [socketPath_ release];
+    [snapshot_ release];
+    [super dealloc];
+}
+
+- (void)start
+{
+    if (gMetricsExporterEnabled || ![MetricsExporter isEnabled]) {
+        return;
+    }
+    socketPath_ = [[[[NSUserDefaults standardUserDefaults] stringForKey:@"MetricsSocketPath"]
+                       stringByExpandingTildeInPath] copy];
+    if (![self listen]) {
+        NSLog(@"Couldn't export metrics on %@: %s", socketPath_, strerror(errno));
+        return;
+    }
+    gMetricsExporterEnabled = YES;
+    nextSampleTime_ = [NSDate timeIntervalSinceReferenceDate] + kMetricsSampleInterval;
+    [self performSelector:@selector(sample) withObject:nil afterDelay:kMetricsSampleInterval];
+}
+
+- (NSString *)currentMetrics
+{
+    NSMutableString *text = [NSMutableString string];
+    [self appendMetric:@"iterm_read_bytes_total"
+                  type:@"counter"
+                  help:@"Bytes read from ptys."
+                 value:gBytesRead
+                    to:text];
+    [self appendMetric:@"iterm_parsed_bytes_total"
+                  type:@"counter"
+                  help:@"Bytes of output parsed and executed."
+                 value:gBytesParsed
+                    to:text];
+
+    double bytesPerSecond = 0;
+    double triggerCpu = 0;
+    double parseCpu = 0;
+    long long dvrBytes = 0;
+    int numSessions = 0;
+    for (PseudoTerminal *term in [[iTermController sharedInstance] terminals]) {
+        for (PTYSession *session in [term allSessions]) {
+            SessionActivity *activity = [session activity];
+            bytesPerSecond += [activity bytesPerSecond];
+            triggerCpu += [activity cpuFractionOfStage:kSessionActivityStageTriggers];
+            parseCpu += [activity cpuFractionOfStage:kSessionActivityStageParse];
+            dvrBytes += [[[session SCREEN] dvr] bufferCapacity];
+            numSessions++;
+        }
+    }
+    [self appendMetric:@"iterm_sessions"
+                  type:@"gauge"
+                  help:@"Open sessions."
+                 value:numSessions
+                    to:text];
+    [self appendMetric:@"iterm_parsed_bytes_per_second"
+                  type:@"gauge"
+                  help:@"Output handled per second over the last few seconds, summed over sessions."
+                 value:bytesPerSecond
+                    to:text];
+    [self appendMetric:@"iterm_parse_cpu_fraction"
+                  type:@"gauge"
+                  help:@"Fraction of a CPU spent parsing output, summed over sessions."
+                 value:parseCpu
+                    to:text];
+    [self appendMetric:@"iterm_trigger_cpu_fraction"
+                  type:@"gauge"
+                  help:@"Fraction of a CPU spent on triggers, summed over sessions."
+                 value:triggerCpu
+                    to:text];
+
+    [text appendString:@"# HELP iterm_frame_seconds Time taken to draw a frame.\n"
+                       @"# TYPE iterm_frame_seconds histogram\n"];
+    long long cumulative = 0;
+    for (int i = 0; i < kNumFrameTimeBuckets; i++) {
+        cumulative += gFrameCounts[i];
+        [text appendFormat:@"iterm_frame_seconds_bucket{le=\"%g\"} %lld\n", kFrameTimeBuckets[i], cumulative];
+    }
+    [text appendFormat:@"iterm_frame_seconds_bucket{le=\"+Inf\"} %lld\n", gFrames];
+    [text appendFormat:@"iterm_frame_seconds_sum %g\n", gFrameSeconds];
+    [text appendFormat:@"iterm_frame_seconds_count %lld\n", gFrames];
+
+    [self appendMetric:@"iterm_main_thread_stall_seconds_total"
+                  type:@"counter"
+                  help:@"Time the main thread was too busy to run timers, in stalls over 50 ms."
+                 value:stallSeconds_
+                    to:text];
+    [self appendMetric:@"iterm_main_thread_stalls_total"
+                  type:@"counter"
+                  help:@"Number of main thread stalls over 50 ms."
+                 value:stalls_
+                    to:text];
+
+    [self appendMetric:@"iterm_scrollback_bytes"
+                  type:@"gauge"
+                  help:@"Memory used by scrollback in all sessions."
+                 value:[[ScrollbackBudget sharedInstance] totalBytes]
+                    to:text];
+    [self appendMetric:@"iterm_instant_replay_bytes"
+                  type:@"gauge"
+                  help:@"Memory allocated for instant replay buffers."
+                 value:dvrBytes
+                    to:text];
+
+    NSTimeInterval busyTime;
+    long long wakeups;
+    double utilization;
+    [[TaskNotifier sharedInstance] getBusyTime:&busyTime wakeups:&wakeups highestUtilization:&utilization];
+    [self appendMetric:@"iterm_notifier_busy_seconds_total"
+                  type:@"counter"
+                  help:@"Time the I/O threads spent handling events. Divide by wakeups for loop latency."
+                 value:busyTime
+                    to:text];
+    [self appendMetric:@"iterm_notifier_wakeups_total"
+                  type:@"counter"
+                  help:@"Times the I/O threads woke up to handle events."
+                 value:wakeups
+                    to:text];
+    [self appendMetric:@"iterm_notifier_utilization"
+                  type:@"gauge"
+                  help:@"Recent fraction of time the busiest I/O thread spent handling events."
+                 value:utilization
+                    to:text];
+    return text;
+}
+
+#pragma mark - Private
+
+- (void)appendMetric:(NSString *)name
+                type:(NSString *)type
+                help:(NSString *)help
+               value:(double)value
+                  to:(NSMutableString *)text
+{
+    [text appendFormat:@"# HELP %@ %@\n# TYPE %@ %@\n%@ %.17g\n", name, help, name, type, name, value];
+}
+
+- (void)sample
+{
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    const NSTimeInterval lateness = now - nextSampleTime_;
+    if (lateness > kMetricsStallThreshold) {
+        stallSeconds_ += lateness;
+        stalls_++;
+    }
+    NSString *snapshot = [self currentMetrics];
+    @synchronized(self) {
+        [snapshot_ autorelease];
+        snapshot_ = [snapshot copy];
+    }
+    nextSampleTime_ = now + kMetricsSampleInterval;
+    [self performSelector:@selector(sample) withObject:nil afterDelay:kMetricsSampleInterval];
+}
+
+- (BOOL)listen
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    const char *path = [socketPath_ fileSystemRepresentation];
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NO;
+    }
+    strlcpy(address.sun_path, path, sizeof(address.sun_path));
+    unlink(path);
+
+    listenFd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd_ < 0) {
+        return NO;
+    }
+    if (bind(listenFd_, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(listenFd_, 8) < 0) {
+        close(listenFd_);
+        listenFd_ = -1;
+        return NO;
+    }
+    // Only this user can read it.
+    chmod(path, 0600);
+
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0);
+    acceptSource_ = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, listenFd_, 0, queue);
+    dispatch_source_set_event_handler(acceptSource_, ^{
+        @autoreleasepool {
+            [self acceptConnection];
+        }
+    });
+    const int fd = listenFd_;
+    dispatch_source_set_cancel_handler(acceptSource_, ^{
+        close(fd);
+    });
+    dispatch_resume(acceptSource_);
+    DLog(@"Exporting metrics on %@", socketPath_);
+    return YES;
+}
+
+// Runs on a background queue. Writes the latest snapshot and hangs up.
+- (void)acceptConnection
+{
+    int connection = accept(listenFd_, NULL, NULL);
+    if (connection < 0) {
+        return;
+    }
+    int noSigPipe = 1;
+    setsockopt(connection, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+    // The request doesn't matter, but it's read so hanging up doesn't reset the connection before
+    // an HTTP client has read the response. A client that sends nothing waits briefly.
+    struct timeval timeout = { 0, 100000 };
+    setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char request[4096];
+    read(connection, request, sizeof(request));
+    NSString *snapshot;
+    @synchronized(self) {
+        snapshot = [[snapshot_ retain] autorelease];
+    }
+    NSData *body = [(snapshot ?: @"") dataUsingEncoding:NSUTF8StringEncoding];
+    // Enough of an HTTP response for scrapers; nc shows it as a header before the metrics.
+    NSString *header = [NSString stringWithFormat:@"HTTP/1.0 200 OK\r\n"
+                                                  @"Content-Type: text/plain; version=0.0.4\r\n"
+                                                  @"Content-Length: %lu\r\n\r\n",
+                                                  (unsigned long)[body length]];
+    NSData *headerData = [header dataUsingEncoding:NSUTF8StringEncoding];
+    if (write(connection, [headerData bytes], [headerData length]) == [headerData length]) {
+        const char *bytes = [body bytes];
+        size_t remaining = [body length];
+        while (remaining > 0) {
+            ssize_t n = write(connection, bytes, remaining);
+            if (n <= 0) {
+                break;
+            }
+            bytes += n;
+            remaining -= n;
+        }
+    }
+    close(connection);
+}
+
+@end
@@ -51,6 +51,10 @@ int decode_utf8_char(const unsigned char * restrict datap,
                      int datalen,
                      int * restrict result);
 
+// Searches the East Asian width ranges that +isDoubleWidthCharacter:ambiguousIsDoubleWidth:'s
+// lookup table is built from. Much slower than the table; for tests and benchmarks.
+BOOL IsDoubleWidthCharacterBySearching(int unicode, BOOL ambiguousIsDoubleWidth);
+
 @interface NSString (iTerm)
 
 + (NSString *)stringWithInt:(int)num;
@@ -59,126 +59,156 @@ static const int ambiguous_chars[] = {
     0x2640, 0x2642, 0x2660, 0x2661, 0x2663, 0x2664, 0x2665, 0x2667, 0x2668, 0x2669,
     0x266a, 0x266c, 0x266d, 0x266f, 0x269e, 0x269f, 0x26be, 0x26bf, 0x26e3, 0x273d,
     0x2757, 0x2b55, 0x2b56, 0x2b57, 0x2b58, 0x2b59, 0xfffd
-    // This is not a complete list - there are also several large ranges that
-    // are found in the code.
+    // This is not a complete list - there are also several large ranges in
+    // kAmbiguousRanges.
 };
 
+typedef struct {
+    int first;
+    int last;
+} UnicodeRange;
+
+// This list of fullwidth and wide characters comes from Unicode 6.0:
+// http://www.unicode.org/Public/6.0.0/ucd/EastAsianWidth.txt
+static const UnicodeRange kWideRanges[] = {
+    { 0x1100, 0x115f }, { 0x11a3, 0x11a7 }, { 0x11fa, 0x11ff }, { 0x2329, 0x232a },
+    { 0x2e80, 0x2e99 }, { 0x2e9b, 0x2ef3 }, { 0x2f00, 0x2fd5 }, { 0x2ff0, 0x2ffb },
+    { 0x3000, 0x303e }, { 0x3041, 0x3096 }, { 0x3099, 0x30ff }, { 0x3105, 0x312d },
+    { 0x3131, 0x318e }, { 0x3190, 0x31ba }, { 0x31c0, 0x31e3 }, { 0x31f0, 0x321e },
+    { 0x3220, 0x3247 }, { 0x3250, 0x32fe }, { 0x3300, 0x4dbf }, { 0x4e00, 0xa48c },
+    { 0xa490, 0xa4c6 }, { 0xa960, 0xa97c }, { 0xac00, 0xd7a3 }, { 0xd7b0, 0xd7c6 },
+    { 0xd7cb, 0xd7fb }, { 0xf900, 0xfaff }, { 0xfe10, 0xfe19 }, { 0xfe30, 0xfe52 },
+    { 0xfe54, 0xfe66 }, { 0xfe68, 0xfe6b }, { 0xff01, 0xff60 }, { 0xffe0, 0xffe6 },
+    { 0x1b000, 0x1b001 }, { 0x1f200, 0x1f202 }, { 0x1f210, 0x1f23a }, { 0x1f240, 0x1f248 },
+    { 0x1f250, 0x1f251 }, { 0x20000, 0x2fffd }, { 0x30000, 0x3fffd }
+};
 
-@implementation NSString (iTerm)
+// Ranges of consecutive ambiguous-width characters (ibid.). This keeps
+// ambiguous_chars from being absurdly large.
+static const UnicodeRange kAmbiguousRanges[] = {
+    { 0x300, 0x36f }, { 0x391, 0x3a1 }, { 0x3b1, 0x3c1 }, { 0x410, 0x44f }, { 0x2160, 0x216b },
+    { 0x2170, 0x2179 }, { 0x2190, 0x2199 }, { 0x2460, 0x24e9 }, { 0x24eb, 0x254b },
+    { 0x2550, 0x2573 }, { 0x2580, 0x258f }, { 0x26c4, 0x26cd }, { 0x26cf, 0x26e1 },
+    { 0x26e8, 0x26ff }, { 0x2776, 0x277f }, { 0x3248, 0x324f }, { 0xe000, 0xf8ff },
+    { 0xfe00, 0xfe0f }, { 0x1f100, 0x1f10a }, { 0x1f110, 0x1f12d }, { 0x1f130, 0x1f169 },
+    { 0x1f170, 0x1f19a }, { 0xe0100, 0xe01ef }, { 0xf0000, 0xffffd }, { 0x100000, 0x10fffd }
+};
 
-+ (NSString *)stringWithInt:(int)num
-{
-    return [NSString stringWithFormat:@"%d", num];
-}
+#define NUM_WIDE_RANGES (sizeof(kWideRanges) / sizeof(UnicodeRange))
+#define NUM_AMBIGUOUS_RANGES (sizeof(kAmbiguousRanges) / sizeof(UnicodeRange))
 
-+ (BOOL)isDoubleWidthCharacter:(int)unicode
-        ambiguousIsDoubleWidth:(BOOL)ambiguousIsDoubleWidth
-{
-    if (unicode <= 0xa0 ||
-        (unicode > 0x452 && unicode < 0x1100)) {
-        // Quickly cover the common cases.
-        return NO;
+// Bits of the East Asian width lookup table.
+enum {
+    kEastAsianWidthWide = 1,
+    kEastAsianWidthAmbiguous = 2
+};
+
+// Code points with the same high bits share a block of 256 entries in the
+// lookup table. Most blocks are all zeros or all wide, so identical blocks are
+// stored once. There are fewer than 256 distinct blocks (35 for Unicode 6.0).
+#define EAST_ASIAN_WIDTH_BLOCK_SIZE 256
+#define EAST_ASIAN_WIDTH_NUM_CODE_POINTS 0x110000
+#define EAST_ASIAN_WIDTH_NUM_BLOCKS (EAST_ASIAN_WIDTH_NUM_CODE_POINTS / EAST_ASIAN_WIDTH_BLOCK_SIZE)
+
+static unsigned char gEastAsianWidthBlockIndex[EAST_ASIAN_WIDTH_NUM_BLOCKS];
+static unsigned char (*gEastAsianWidthBlocks)[EAST_ASIAN_WIDTH_BLOCK_SIZE];
+
+static void BuildEastAsianWidthTable(void) {
+    unsigned char *bits = calloc(EAST_ASIAN_WIDTH_NUM_CODE_POINTS, 1);
+    for (int i = 0; i < NUM_WIDE_RANGES; i++) {
+        for (int c = kWideRanges[i].first; c <= kWideRanges[i].last; c++) {
+            bits[c] |= kEastAsianWidthWide;
+        }
+    }
+    for (int i = 0; i < NUM_AMBIGUOUS_RANGES; i++) {
+        for (int c = kAmbiguousRanges[i].first; c <= kAmbiguousRanges[i].last; c++) {
+            bits[c] |= kEastAsianWidthAmbiguous;
+        }
+    }
+    for (int i = 0; i < AMB_CHAR_NUMBER; i++) {
+        bits[ambiguous_chars[i]] |= kEastAsianWidthAmbiguous;
     }
 
-    // This list of fullwidth and wide characters comes from Unicode 6.0:
-    // http://www.unicode.org/Public/6.0.0/ucd/EastAsianWidth.txt
-    if ((unicode >= 0x1100 && unicode <= 0x115f) ||
-        (unicode >= 0x11a3 && unicode <= 0x11a7) ||
-        (unicode >= 0x11fa && unicode <= 0x11ff) ||
-        (unicode >= 0x2329 && unicode <= 0x232a) ||
-        (unicode >= 0x2e80 && unicode <= 0x2e99) ||
-        (unicode >= 0x2e9b && unicode <= 0x2ef3) ||
-        (unicode >= 0x2f00 && unicode <= 0x2fd5) ||
-        (unicode >= 0x2ff0 && unicode <= 0x2ffb) ||
-        (unicode >= 0x3000 && unicode <= 0x303e) ||
-        (unicode >= 0x3041 && unicode <= 0x3096) ||
-        (unicode >= 0x3099 && unicode <= 0x30ff) ||
-        (unicode >= 0x3105 && unicode <= 0x312d) ||
-        (unicode >= 0x3131 && unicode <= 0x318e) ||
-        (unicode >= 0x3190 && unicode <= 0x31ba) ||
-        (unicode >= 0x31c0 && unicode <= 0x31e3) ||
-        (unicode >= 0x31f0 && unicode <= 0x321e) ||
-        (unicode >= 0x3220 && unicode <= 0x3247) ||
-        (unicode >= 0x3250 && unicode <= 0x32fe) ||
-        (unicode >= 0x3300 && unicode <= 0x4dbf) ||
-        (unicode >= 0x4e00 && unicode <= 0xa48c) ||
-        (unicode >= 0xa490 && unicode <= 0xa4c6) ||
-        (unicode >= 0xa960 && unicode <= 0xa97c) ||
-        (unicode >= 0xac00 && unicode <= 0xd7a3) ||
-        (unicode >= 0xd7b0 && unicode <= 0xd7c6) ||
-        (unicode >= 0xd7cb && unicode <= 0xd7fb) ||
-        (unicode >= 0xf900 && unicode <= 0xfaff) ||
-        (unicode >= 0xfe10 && unicode <= 0xfe19) ||
-        (unicode >= 0xfe30 && unicode <= 0xfe52) ||
-        (unicode >= 0xfe54 && unicode <= 0xfe66) ||
-        (unicode >= 0xfe68 && unicode <= 0xfe6b) ||
-        (unicode >= 0xff01 && unicode <= 0xff60) ||
-        (unicode >= 0xffe0 && unicode <= 0xffe6) ||
-        (unicode >= 0x1b000 && unicode <= 0x1b001) ||
-        (unicode >= 0x1f200 && unicode <= 0x1f202) ||
-        (unicode >= 0x1f210 && unicode <= 0x1f23a) ||
-        (unicode >= 0x1f240 && unicode <= 0x1f248) ||
-        (unicode >= 0x1f250 && unicode <= 0x1f251) ||
-        (unicode >= 0x20000 && unicode <= 0x2fffd) ||
-        (unicode >= 0x30000 && unicode <= 0x3fffd)) {
-        return YES;
+    // Store each distinct block once.
+    unsigned char (*blocks)[EAST_ASIAN_WIDTH_BLOCK_SIZE] = malloc(256 * EAST_ASIAN_WIDTH_BLOCK_SIZE);
+    int numBlocks = 0;
+    for (int i = 0; i < EAST_ASIAN_WIDTH_NUM_BLOCKS; i++) {
+        const unsigned char *block = bits + i * EAST_ASIAN_WIDTH_BLOCK_SIZE;
+        int j;
+        for (j = 0; j < numBlocks; j++) {
+            if (!memcmp(blocks[j], block, EAST_ASIAN_WIDTH_BLOCK_SIZE)) {
+                break;
+            }
+        }
+        if (j == numBlocks) {
+            assert(numBlocks < 256);
+            memcpy(blocks[numBlocks++], block, EAST_ASIAN_WIDTH_BLOCK_SIZE);
+        }
+        gEastAsianWidthBlockIndex[i] = j;
     }
+    free(bits);
+    gEastAsianWidthBlocks = realloc(blocks, numBlocks * EAST_ASIAN_WIDTH_BLOCK_SIZE);
+}
 
-    // These are the ambiguous-width characters (ibid.)
-    if (ambiguousIsDoubleWidth) {
-        // First check if the character falls in any range of consecutive
-        // ambiguous-width characters before performing the binary search.
-        // This keeps the list from being absurdly large.
-        if ((unicode >= 0x300 && unicode <= 0x36f) ||
-            (unicode >= 0x391 && unicode <= 0x3a1) ||
-            (unicode >= 0x3b1 && unicode <= 0x3c1) ||
-            (unicode >= 0x410 && unicode <= 0x44f) ||
-            (unicode >= 0x2160 && unicode <= 0x216b) ||
-            (unicode >= 0x2170 && unicode <= 0x2179) ||
-            (unicode >= 0x2190 && unicode <= 0x2199) ||
-            (unicode >= 0x2460 && unicode <= 0x24e9) ||
-            (unicode >= 0x24eb && unicode <= 0x254b) ||
-            (unicode >= 0x2550 && unicode <= 0x2573) ||
-            (unicode >= 0x2580 && unicode <= 0x258f) ||
-            (unicode >= 0x26c4 && unicode <= 0x26cd) ||
-            (unicode >= 0x26cf && unicode <= 0x26e1) ||
-            (unicode >= 0x26e8 && unicode <= 0x26ff) ||
-            (unicode >= 0x2776 && unicode <= 0x277f) ||
-            (unicode >= 0x3248 && unicode <= 0x324f) ||
-            (unicode >= 0xe000 && unicode <= 0xf8ff) ||
-            (unicode >= 0xfe00 && unicode <= 0xfe0f) ||
-            (unicode >= 0x1f100 && unicode <= 0x1f10a) ||
-            (unicode >= 0x1f110 && unicode <= 0x1f12d) ||
-            (unicode >= 0x1f130 && unicode <= 0x1f169) ||
-            (unicode >= 0x1f170 && unicode <= 0x1f19a) ||
-            (unicode >= 0xe0100 && unicode <= 0xe01ef) ||
-            (unicode >= 0xf0000 && unicode <= 0xffffd) ||
-            (unicode >= 0x100000 && unicode <= 0x10fffd)) {
+BOOL IsDoubleWidthCharacterBySearching(int unicode, BOOL ambiguousIsDoubleWidth) {
+    for (int i = 0; i < NUM_WIDE_RANGES; i++) {
+        if (unicode >= kWideRanges[i].first && unicode <= kWideRanges[i].last) {
             return YES;
         }
+    }
+
+    if (ambiguousIsDoubleWidth) {
+        for (int i = 0; i < NUM_AMBIGUOUS_RANGES; i++) {
+            if (unicode >= kAmbiguousRanges[i].first && unicode <= kAmbiguousRanges[i].last) {
+                return YES;
+            }
+        }
 
-        // Now do a binary search of the individual ambiguous width code points
-        // in the array above.
-        int ind = AMB_CHAR_NUMBER / 2;
+        // Binary search the individual ambiguous width code points.
         int start = 0;
         int end = AMB_CHAR_NUMBER;
         while (start < end) {
+            const int ind = (start + end) / 2;
             if (ambiguous_chars[ind] == unicode) {
                 return YES;
             } else if (ambiguous_chars[ind] < unicode) {
                 start = ind + 1;
-                ind = (start + end) / 2;
             } else {
                 end = ind;
-                ind = (start + end) / 2;
             }
         }
-        // Fall through if not in ambiguous character list.
     }
 
     return NO;
 }
 
+@implementation NSString (iTerm)
+
++ (NSString *)stringWithInt:(int)num
+{
+    return [NSString stringWithFormat:@"%d", num];
+}
+
++ (BOOL)isDoubleWidthCharacter:(int)unicode
+        ambiguousIsDoubleWidth:(BOOL)ambiguousIsDoubleWidth
+{
+    if (unicode <= 0xa0) {
+        // Quickly cover the common case.
+        return NO;
+    }
+    if (unicode >= EAST_ASIAN_WIDTH_NUM_CODE_POINTS) {
+        return NO;
+    }
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        BuildEastAsianWidthTable();
+    });
+    const unsigned char bits =
+        gEastAsianWidthBlocks[gEastAsianWidthBlockIndex[unicode / EAST_ASIAN_WIDTH_BLOCK_SIZE]][unicode % EAST_ASIAN_WIDTH_BLOCK_SIZE];
+    return ((bits & kEastAsianWidthWide) ||
+            (ambiguousIsDoubleWidth && (bits & kEastAsianWidthAmbiguous)));
+}
+
 //
 // Replace Substring
 //
@@ -0,0 +1,55 @@
+//
+//  NotificationBatcher.h
+//  iTerm
+//
+//  Collapses bursts of Growl/Notification Center alerts.
+//
+
+#import <Foundation/Foundation.h>
+
+@protocol NotificationBatcherDelegate <NSObject>
+// Called on the main thread for each notification that should be shown.
+- (void)notificationBatcherDeliverTitle:(NSString *)title
+                            description:(NSString *)description
+                           notification:(NSString *)notification
+                                context:(NSDictionary *)context;
+@end
+
+// Notifications are batched by key (usually the kind of notification plus the session it came
+// from). The first one with a key is delivered right away. Any more with that key in the next
+// kNotificationBatchInterval seconds are held, and when the interval ends the latest of them is
+// delivered with a count of how many it stands for. A global rate limit drops notifications
+// beyond kNotificationBatchMaxPerInterval per interval so that, say, 30 sessions going idle at once
+// don't post 30 alerts. Main thread only.
+@interface NotificationBatcher : NSObject {
+    id<NotificationBatcherDelegate> delegate_;  // weak
+    NSMutableDictionary *batches_;  // key -> NotificationBatch
+    BOOL flushScheduled_;
+
+    // Start of the current rate limiting interval and how many were delivered in it.
+    NSTimeInterval rateIntervalStart_;
+    int deliveredInRateInterval_;
+
+    int coalescedCount_;
+    int suppressedCount_;
+}
+
+@property(nonatomic, assign) id<NotificationBatcherDelegate> delegate;
+
+// Number of notifications folded into a later one with the same key.
+@property(nonatomic, readonly) int coalescedCount;
+
+// Number of notifications dropped by the rate limit.
+@property(nonatomic, readonly) int suppressedCount;
+
+- (void)addNotificationWithTitle:(NSString *)title
+                     description:(NSString *)description
+                    notification:(NSString *)notification
+                         context:(NSDictionary *)context
+                             key:(NSString *)key;
+
+// Delivers held notifications whose interval has ended by |now|. Called from a timer; exposed for
+// tests.
+- (void)flushBatchesAtTime:(NSTimeInterval)now;
+
+@end
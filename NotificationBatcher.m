@@ -0,0 +1,185 @@
+//
+//  NotificationBatcher.m
+//  iTerm
+//
+
+#import "NotificationBatcher.h"
+#import "DebugLogging.h"
+
+// How long notifications with the same key are held before being delivered as one.
+static const NSTimeInterval kNotificationBatchInterval = 2;
+
+// Most notifications delivered, with any key, per kNotificationBatchInterval.
+static const int kNotificationBatchMaxPerInterval = 5;
+
+@interface NotificationBatch : NSObject {
+@public
+    NSTimeInterval start_;
+    int heldCount_;  // Notifications received since start_ that haven't been delivered.
+    NSString *title_;
+    NSString *description_;
+    NSString *notification_;
+    NSDictionary *context_;
+}
+@end
+
+@implementation NotificationBatch
+
+- (void)dealloc
+{
+    [title_ release];
+    [description_ release];
+    [notification_ release];
+    [context_ release];
+    [super dealloc];
+}
+
+- (void)setTitle:(NSString *)title
+     description:(NSString *)description
+    notification:(NSString *)notification
+         context:(NSDictionary *)context
+{
+    [title_ autorelease];
+    title_ = [title copy];
+    [description_ autorelease];
+    description_ = [description copy];
+    [notification_ autorelease];
+    notification_ = [notification copy];
+    [context_ autorelease];
+    context_ = [context retain];
+}
+
+@end
+
+@implementation NotificationBatcher
+
+@synthesize delegate = delegate_;
+@synthesize coalescedCount = coalescedCount_;
+@synthesize suppressedCount = suppressedCount_;
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        batches_ = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [NSObject cancelPreviousPerformRequestsWithTarget:self];
+    [batches_ release];
+    [super dealloc];
+}
+
+- (void)addNotificationWithTitle:(NSString *)title
+                     description:(NSString *)description
+                    notification:(NSString *)notification
+                         context:(NSDictionary *)context
+                             key:(NSString *)key
+{
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    NotificationBatch *batch = [batches_ objectForKey:key];
+    if (batch) {
+        // Hold it until the batch's interval ends.
+        if (batch->heldCount_) {
+            coalescedCount_++;
+        }
+        batch->heldCount_++;
+        [batch setTitle:title description:description notification:notification context:context];
+        return;
+    }
+
+    batch = [[[NotificationBatch alloc] init] autorelease];
+    batch->start_ = now;
+    [batches_ setObject:batch forKey:key];
+    [self scheduleFlush];
+    [self deliverTitle:title description:description notification:notification context:context atTime:now];
+}
+
+- (void)flushBatchesAtTime:(NSTimeInterval)now
+{
+    for (NSString *key in [batches_ allKeys]) {
+        NotificationBatch *batch = [batches_ objectForKey:key];
+        if (now - batch->start_ < kNotificationBatchInterval) {
+            continue;
+        }
+        if (!batch->heldCount_) {
+            // Quiet for a whole interval, so the next one can be delivered right away.
+            [batches_ removeObjectForKey:key];
+            continue;
+        }
+        NSString *description = batch->description_;
+        if (batch->heldCount_ > 1) {
+            description = [NSString stringWithFormat:@"%@ (%d similar alerts)",
+                              description ? description : @"", batch->heldCount_];
+        }
+        [self deliverTitle:batch->title_
+               description:description
+              notification:batch->notification_
+                   context:batch->context_
+                    atTime:now];
+        // Keep the batch open so a steady stream gets one alert per interval.
+        batch->start_ = now;
+        batch->heldCount_ = 0;
+    }
+}
+
+#pragma mark - Private
+
+- (void)deliverTitle:(NSString *)title
+         description:(NSString *)description
+        notification:(NSString *)notification
+             context:(NSDictionary *)context
+              atTime:(NSTimeInterval)now
+{
+    if (now - rateIntervalStart_ >= kNotificationBatchInterval) {
+        rateIntervalStart_ = now;
+        deliveredInRateInterval_ = 0;
+    }
+    if (deliveredInRateInterval_ >= kNotificationBatchMaxPerInterval) {
+        suppressedCount_++;
+        DLog(@"Suppressed notification %@ (%d suppressed so far)", title, suppressedCount_);
+        return;
+    }
+    deliveredInRateInterval_++;
+    [delegate_ notificationBatcherDeliverTitle:title
+                                   description:description
+                                  notification:notification
+                                       context:context];
+}
+
+- (void)scheduleFlushAfterDelay:(NSTimeInterval)delay
+{
+    if (flushScheduled_) {
+        return;
+    }
+    flushScheduled_ = YES;
+    [self performSelector:@selector(flushTimerDidFire)
+               withObject:nil
+               afterDelay:delay];
+}
+
+- (void)scheduleFlush
+{
+    [self scheduleFlushAfterDelay:kNotificationBatchInterval];
+}
+
+- (void)flushTimerDidFire
+{
+    flushScheduled_ = NO;
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    [self flushBatchesAtTime:now];
+    if (![batches_ count]) {
+        return;
+    }
+    // Wake up when the oldest remaining batch's interval ends.
+    NSTimeInterval earliestStart = now;
+    for (NotificationBatch *batch in [batches_ allValues]) {
+        earliestStart = MIN(earliestStart, batch->start_);
+    }
+    [self scheduleFlushAfterDelay:MAX(0, earliestStart + kNotificationBatchInterval - now)];
+}
+
+@end
@@ -282,7 +282,7 @@
     }*/
 
     // the label
-    resultWidth += [[cell attributedStringValue] size].width;
+    resultWidth += [cell stringSize].width;
 
     // object counter?
     // we don't make more room for the object counter in this style
@@ -302,7 +302,7 @@ static CGImageRef CGImageCreateWithNSImage(NSImage *image, CGRect sourceRect) {
         resultWidth += kPSMTabBarIconWidth + kPSMTabBarCellPadding;
 
     // the label
-    resultWidth += [[cell attributedStringValue] size].width;
+    resultWidth += [cell stringSize].width;
 
     // object counter?
     if([cell count] > 0)
@@ -251,7 +251,7 @@
         resultWidth += kPSMTabBarIconWidth + kPSMTabBarCellPadding;
 
     // the label
-    resultWidth += [[cell attributedStringValue] size].width;
+    resultWidth += [cell stringSize].width;
 
     // object counter?
     if([cell count] > 0)
@@ -21,6 +21,7 @@
     // sizing
     NSRect              _frame;
     NSSize              _stringSize;
+    float               _desiredWidth;             // as of the last call to -desiredWidthOfCell
     int                 _currentStep;
     BOOL                _isPlaceholder;
     
@@ -42,6 +43,12 @@
     NSColor             *_tabColor;
     NSString            *_modifierString;
 
+    // -attributedStringValue is drawn and measured for every cell on every layout, so it's kept
+    // until the title, label color, style, or the state it depends on changes.
+    NSAttributedString  *_cachedAttributedString;
+    id                  _cachedAttributedStringStyle;  // weak
+    int                 _cachedAttributedStringState;
+
     BOOL _isLast;
 }
 
@@ -95,6 +102,8 @@
 - (NSRect)closeButtonRectForFrame:(NSRect)cellFrame;
 - (float)minimumWidthOfCell;
 - (float)desiredWidthOfCell;
+// The width returned by the last call to -desiredWidthOfCell, which was made by the last layout.
+- (float)lastDesiredWidthOfCell;
 
 // drawing
 - (void)drawWithFrame:(NSRect)cellFrame inView:(NSView *)controlView;
@@ -16,6 +16,11 @@
 @interface PSMTabBarControl (Private)
 - (void)update;
 - (void)update:(BOOL)animate;
+- (void)updateCell:(PSMTabBarCell *)cell animate:(BOOL)animate;
+@end
+
+@interface PSMTabBarCell (Private)
+- (void)_invalidateAttributedString;
 @end
 
 @implementation PSMTabBarCell
@@ -83,6 +88,7 @@
 - (void)dealloc
 {
     [_modifierString release];
+    [_cachedAttributedString release];
     [_indicator release];
     if (_labelColor)
         [_labelColor release];
@@ -152,28 +158,54 @@
 
 - (void)setStringValue:(NSString *)aString
 {
+    if ([aString isEqualToString:[self stringValue]]) {
+        return;
+    }
     [super setStringValue:aString];
-    _stringSize = [[self attributedStringValue] size];
+    [self _invalidateAttributedString];
     // need to redisplay now - binding observation was too quick.
-    [_controlView update:[[self controlView] automaticallyAnimates]];
+    [_controlView updateCell:self animate:[[self controlView] automaticallyAnimates]];
 }
 
 - (NSSize)stringSize
 {
+    // Brings _stringSize up to date.
+    [self attributedStringValue];
     return _stringSize;
 }
 
 - (NSAttributedString *)attributedStringValue
 {
-    NSMutableAttributedString *aString = [[[NSMutableAttributedString alloc] initWithAttributedString:[(id <PSMTabStyle>)[(PSMTabBarControl *)_controlView style] attributedStringValueForTabCell:self]] autorelease];
+    id <PSMTabStyle> style = [(PSMTabBarControl *)_controlView style];
+    // The Metal style's shadow depends on whether the cell is selected or highlighted.
+    int state = ([self state] == NSOnState ? 1 : 0) | ([self isHighlighted] ? 2 : 0);
+    if (_cachedAttributedString &&
+        _cachedAttributedStringStyle == style &&
+        _cachedAttributedStringState == state) {
+        return _cachedAttributedString;
+    }
+
+    NSMutableAttributedString *aString = [[NSMutableAttributedString alloc] initWithAttributedString:[style attributedStringValueForTabCell:self]];
 
     if (_labelColor) {
         [aString addAttribute:NSForegroundColorAttributeName value:_labelColor range:NSMakeRange(0, [aString length])];
     }
 
+    [_cachedAttributedString release];
+    _cachedAttributedString = aString;
+    _cachedAttributedStringStyle = style;
+    _cachedAttributedStringState = state;
+    _stringSize = [aString size];
+
     return aString;
 }
 
+- (void)_invalidateAttributedString
+{
+    [_cachedAttributedString release];
+    _cachedAttributedString = nil;
+}
+
 - (int)tabState
 {
     return _tabState;
@@ -247,7 +279,7 @@
 - (void)setHasIcon:(BOOL)value
 {
     _hasIcon = value;
-    [_controlView update:[[self controlView] automaticallyAnimates]]; // binding notice is too fast
+    [_controlView updateCell:self animate:[[self controlView] automaticallyAnimates]]; // binding notice is too fast
 }
 
 - (int)count
@@ -258,7 +290,7 @@
 - (void)setCount:(int)value
 {
     _count = value;
-    [_controlView update:[[self controlView] automaticallyAnimates]]; // binding notice is too fast
+    [_controlView updateCell:self animate:[[self controlView] automaticallyAnimates]]; // binding notice is too fast
 }
 
 - (BOOL)isPlaceholder
@@ -304,7 +336,7 @@
 - (void)observeValueForKeyPath:(NSString *)keyPath ofObject:(id)object change:(NSDictionary *)change context:(void *)context
 {
     // the progress indicator, label, icon, or count has changed - redraw the control view
-    [_controlView update:[[self controlView] automaticallyAnimates]];
+    [_controlView updateCell:self animate:[[self controlView] automaticallyAnimates]];
 }
 
 #pragma mark -
@@ -327,7 +359,13 @@
 
 - (float)desiredWidthOfCell
 {
-    return [(id <PSMTabStyle>)[(PSMTabBarControl *)_controlView style] desiredWidthOfTabCell:self];
+    _desiredWidth = [(id <PSMTabStyle>)[(PSMTabBarControl *)_controlView style] desiredWidthOfTabCell:self];
+    return _desiredWidth;
+}
+
+- (float)lastDesiredWidthOfCell
+{
+    return _desiredWidth;
 }
 
 #pragma mark -
@@ -559,6 +597,7 @@
             [_labelColor release];
         }
         _labelColor = aColor ? [aColor retain] : nil;
+        [self _invalidateAttributedString];
     }
 }
 
@@ -153,6 +153,8 @@ enum {
     BOOL                        _automaticallyAnimates;
     NSTimer                     *_animationTimer;
     float                       _animationDelta;
+    BOOL                        _updatePending;             // see -updateCell:animate:
+    BOOL                        _pendingUpdateAnimates;
 
     // behavior
     BOOL                        _allowsBackgroundTabClosing;
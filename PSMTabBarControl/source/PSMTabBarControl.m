@@ -39,6 +39,7 @@
 
     // draw
 - (void)update:(BOOL)animate;
+- (void)updateCell:(PSMTabBarCell *)cell animate:(BOOL)animate;
 - (void)_removeCellTrackingRects;
 - (void)_finishCellUpdate:(NSArray *)newWidths;
 - (NSMenu *)_setupCells:(NSArray *)newWidths;
@@ -1094,6 +1095,48 @@
 
 }
 
+// Called when something about one cell, like its title or color, has changed. Laying out every
+// cell and rebuilding every tracking rect is slow with hundreds of tabs, so as long as the cell
+// keeps its width this only redraws it. Otherwise the layout is done once on the next pass of the
+// run loop no matter how many cells change before then.
+- (void)updateCell:(PSMTabBarCell *)cell animate:(BOOL)animate
+{
+    if (_updatePending) {
+        _pendingUpdateAnimates |= animate;
+        return;
+    }
+    if ([tabView numberOfTabViewItems] != [_cells count]) {
+        return;
+    }
+    float oldWidth = [cell lastDesiredWidthOfCell];
+    BOOL widthMatters = (_sizeCellsToFit && [self orientation] == PSMTabBarHorizontalOrientation);
+    if (_animationTimer ||
+        [cell isInOverflowMenu] ||
+        NSIsEmptyRect([cell frame]) ||
+        (widthMatters && [cell desiredWidthOfCell] != oldWidth)) {
+        _updatePending = YES;
+        _pendingUpdateAnimates = animate;
+        [self performSelector:@selector(_performPendingUpdate) withObject:nil afterDelay:0];
+        return;
+    }
+
+    NSRect cellFrame = [cell frame];
+    if (![[cell indicator] isHidden] && !_hideIndicators) {
+        [[cell indicator] setFrame:[cell indicatorRectForFrame:cellFrame]];
+        if (![[self subviews] containsObject:[cell indicator]]) {
+            [self addSubview:[cell indicator]];
+            [[cell indicator] startAnimation:self];
+        }
+    }
+    [self setNeedsDisplayInRect:NSInsetRect(cellFrame, -2, -2)];
+}
+
+- (void)_performPendingUpdate
+{
+    _updatePending = NO;
+    [self update:_pendingUpdateAnimates];
+}
+
 - (void)_removeCellTrackingRects
 {
     // size all cells appropriately and create tracking rects
@@ -2307,40 +2350,30 @@
 
 - (void)setLabelColor:(NSColor *)aColor forTabViewItem:(NSTabViewItem *) tabViewItem
 {
-    BOOL updated = NO;
-
     NSEnumerator *e = [_cells objectEnumerator];
     PSMTabBarCell *cell;
     while ( (cell = [e nextObject])) {
         if ([cell representedObject] == tabViewItem) {
             if ([cell labelColor] != aColor) {
-                updated = YES;
                 [cell setLabelColor: aColor];
+                [self updateCell:cell animate:NO];
             }
         }
     }
-
-    if (updated) [self update: NO];
 }
 
 - (void)setTabColor:(NSColor *)aColor forTabViewItem:(NSTabViewItem *) tabViewItem
 {
-    BOOL updated = NO;
-
     NSEnumerator *e = [_cells objectEnumerator];
     PSMTabBarCell *cell;
     while ( (cell = [e nextObject])) {
         if ([cell representedObject] == tabViewItem) {
             if ([cell tabColor] != aColor) {
-                updated = YES;
                 [cell setTabColor: aColor];
+                [self updateCell:cell animate:NO];
             }
         }
     }
-
-    if (updated) {
-        [self update: NO];
-    }
 }
 
 - (NSColor*)tabColorForTabViewItem:(NSTabViewItem*)tabViewItem
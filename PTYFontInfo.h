@@ -8,12 +8,32 @@
 
 #import <Cocoa/Cocoa.h>
 
+// One slot of PTYFontInfo's glyph cache. A slot with |valid| set and a zero |glyph| records that
+// the font has no glyph for |code|.
+typedef struct {
+    unichar code;
+    CGGlyph glyph;
+    BOOL valid;
+} PTYFontGlyphCacheEntry;
+
 // A collection of data about a font.
 @interface PTYFontInfo : NSObject {
     NSFont *font_;
     double baselineOffset_;
     PTYFontInfo *boldVersion_;
     PTYFontInfo *italicVersion_;
+    PTYFontInfo *boldItalicVersion_;
+
+    // Glyphs for ASCII are indexed directly by code. Other characters go in a direct-mapped table
+    // that is allocated on first use.
+    PTYFontGlyphCacheEntry asciiGlyphs_[128];
+    PTYFontGlyphCacheEntry *glyphCache_;
+
+    // Memoized results of -fontForBold:italic:fakeBold:fakeItalic:, indexed by bold * 2 + italic.
+    PTYFontInfo *styleVariants_[4];  // WEAK
+    BOOL styleVariantFakeBold_[4];
+    BOOL styleVariantFakeItalic_[4];
+    BOOL styleVariantsValid_;
 }
 
 @property (nonatomic, retain) NSFont *font;
@@ -24,6 +44,15 @@
 
 + (PTYFontInfo *)fontInfoWithFont:(NSFont *)font baseline:(double)baseline;
 
+// Gets font infos for text drawn in |font| for ASCII and |nonAsciiFont| otherwise, with their bold
+// and italic versions, all using |baseline|. They're made the first time a pair of fonts is used
+// and shared by every text view that uses it after that, so they must not be changed.
++ (void)getSharedFontInfoForFont:(NSFont *)font
+                    nonAsciiFont:(NSFont *)nonAsciiFont
+                        baseline:(double)baseline
+                         primary:(PTYFontInfo **)primary
+                       secondary:(PTYFontInfo **)secondary;
+
 // Returns a new autorelased PTYFontInfo with a bold version of this font (or
 // nil if none is available).
 - (PTYFontInfo *)computedBoldVersion;
@@ -37,4 +66,15 @@
 // is available).
 - (PTYFontInfo *)computedBoldItalicVersion;
 
+// Fills in |glyphs| for |count| characters in |codes|, like CTFontGetGlyphsForCharacters but
+// remembering the results. Missing glyphs are set to 0. Returns YES if every glyph was found.
+- (BOOL)getGlyphs:(CGGlyph *)glyphs forCharacters:(const unichar *)codes count:(int)count;
+
+// Returns the variant of this font to use for text with the given style. If there is no such font
+// then *fakeBold and/or *fakeItalic are set to indicate how it should be simulated.
+- (PTYFontInfo *)fontForBold:(BOOL)bold
+                      italic:(BOOL)italic
+                    fakeBold:(BOOL *)fakeBold
+                  fakeItalic:(BOOL *)fakeItalic;
+
 @end
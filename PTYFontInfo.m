@@ -8,12 +8,21 @@
 
 #import "PTYFontInfo.h"
 
+// Number of slots in the glyph cache for non-ASCII characters. Must be a power of 2.
+static const int kGlyphCacheSize = 1024;
+
+// Describes a font in a key of the shared font info cache.
+static NSString *PTYFontInfoKeyForFont(NSFont *font) {
+    return [NSString stringWithFormat:@"%@ %f", [font fontName], [font pointSize]];
+}
+
 @implementation PTYFontInfo
 
 @synthesize font = font_;
 @synthesize baselineOffset = baselineOffset_;
 @synthesize boldVersion = boldVersion_;
 @synthesize italicVersion = italicVersion_;
+@synthesize boldItalicVersion = boldItalicVersion_;
 
 + (PTYFontInfo *)fontInfoWithFont:(NSFont *)font baseline:(double)baseline {
     PTYFontInfo *fontInfo = [[[PTYFontInfo alloc] init] autorelease];
@@ -22,13 +31,90 @@
     return fontInfo;
 }
 
++ (void)getSharedFontInfoForFont:(NSFont *)font
+                    nonAsciiFont:(NSFont *)nonAsciiFont
+                        baseline:(double)baseline
+                         primary:(PTYFontInfo **)primary
+                       secondary:(PTYFontInfo **)secondary {
+    // Key -> [primary, secondary]. Text views use a handful of fonts, so it's never emptied.
+    static NSMutableDictionary *sharedFontInfos;
+    if (!sharedFontInfos) {
+        sharedFontInfos = [[NSMutableDictionary alloc] init];
+    }
+    NSString *key = [NSString stringWithFormat:@"%@|%@|%f",
+                     PTYFontInfoKeyForFont(font),
+                     PTYFontInfoKeyForFont(nonAsciiFont),
+                     baseline];
+    NSArray *pair = [sharedFontInfos objectForKey:key];
+    if (!pair) {
+        PTYFontInfo *primaryFont = [PTYFontInfo fontInfoWithFont:font baseline:baseline];
+        primaryFont.boldVersion = [primaryFont computedBoldVersion];
+        primaryFont.italicVersion = [primaryFont computedItalicVersion];
+        primaryFont.boldItalicVersion = [primaryFont computedBoldItalicVersion];
+
+        PTYFontInfo *secondaryFont = [PTYFontInfo fontInfoWithFont:nonAsciiFont baseline:baseline];
+        secondaryFont.boldVersion = [secondaryFont computedBoldVersion];
+        secondaryFont.italicVersion = [secondaryFont computedItalicVersion];
+        secondaryFont.boldItalicVersion = [secondaryFont computedBoldItalicVersion];
+
+        // Force the secondary font to use the same baseline as the primary font.
+        if (secondaryFont.boldVersion) {
+            if (primaryFont.boldVersion) {
+                secondaryFont.boldVersion.baselineOffset = primaryFont.boldVersion.baselineOffset;
+            } else {
+                secondaryFont.boldVersion.baselineOffset = secondaryFont.baselineOffset;
+            }
+        }
+        if (secondaryFont.italicVersion) {
+            if (primaryFont.italicVersion) {
+                secondaryFont.italicVersion.baselineOffset = primaryFont.italicVersion.baselineOffset;
+            } else {
+                secondaryFont.italicVersion.baselineOffset = secondaryFont.baselineOffset;
+            }
+        }
+        pair = [NSArray arrayWithObjects:primaryFont, secondaryFont, nil];
+        [sharedFontInfos setObject:pair forKey:key];
+    }
+    *primary = [pair objectAtIndex:0];
+    *secondary = [pair objectAtIndex:1];
+}
+
 - (void)dealloc {
     [font_ release];
     [boldVersion_ release];
     [italicVersion_ release];
+    [boldItalicVersion_ release];
+    free(glyphCache_);
     [super dealloc];
 }
 
+- (void)setFont:(NSFont *)font {
+    [font_ autorelease];
+    font_ = [font retain];
+    memset(asciiGlyphs_, 0, sizeof(asciiGlyphs_));
+    if (glyphCache_) {
+        memset(glyphCache_, 0, sizeof(PTYFontGlyphCacheEntry) * kGlyphCacheSize);
+    }
+}
+
+- (void)setBoldVersion:(PTYFontInfo *)boldVersion {
+    [boldVersion_ autorelease];
+    boldVersion_ = [boldVersion retain];
+    styleVariantsValid_ = NO;
+}
+
+- (void)setItalicVersion:(PTYFontInfo *)italicVersion {
+    [italicVersion_ autorelease];
+    italicVersion_ = [italicVersion retain];
+    styleVariantsValid_ = NO;
+}
+
+- (void)setBoldItalicVersion:(PTYFontInfo *)boldItalicVersion {
+    [boldItalicVersion_ autorelease];
+    boldItalicVersion_ = [boldItalicVersion retain];
+    styleVariantsValid_ = NO;
+}
+
 - (PTYFontInfo *)computedBoldVersion {
     NSFontManager* fontManager = [NSFontManager sharedFontManager];
     NSFont* boldFont = [fontManager convertFont:font_ toHaveTrait:NSBoldFontMask];
@@ -54,4 +140,93 @@
     return [temp computedItalicVersion];
 }
 
+- (PTYFontGlyphCacheEntry *)glyphCacheEntryForCode:(unichar)code {
+    if (code < 128) {
+        return &asciiGlyphs_[code];
+    }
+    if (!glyphCache_) {
+        glyphCache_ = calloc(kGlyphCacheSize, sizeof(PTYFontGlyphCacheEntry));
+    }
+    return &glyphCache_[code & (kGlyphCacheSize - 1)];
+}
+
+- (BOOL)getGlyphs:(CGGlyph *)glyphs forCharacters:(const unichar *)codes count:(int)count {
+    BOOL foundAll = YES;
+    for (int i = 0; i < count; i++) {
+        unichar code = codes[i];
+        if (CFStringIsSurrogateHighCharacter(code) || CFStringIsSurrogateLowCharacter(code)) {
+            // Surrogate pairs map to a glyph and a padding 0, which doesn't fit in the cache.
+            return CTFontGetGlyphsForCharacters((CTFontRef)font_, codes, glyphs, count);
+        }
+        PTYFontGlyphCacheEntry *entry = [self glyphCacheEntryForCode:code];
+        if (!entry->valid || entry->code != code) {
+            CGGlyph glyph = 0;
+            if (!CTFontGetGlyphsForCharacters((CTFontRef)font_, &code, &glyph, 1)) {
+                glyph = 0;
+            }
+            entry->code = code;
+            entry->glyph = glyph;
+            entry->valid = YES;
+        }
+        glyphs[i] = entry->glyph;
+        if (!entry->glyph) {
+            foundAll = NO;
+        }
+    }
+    return foundAll;
+}
+
+- (void)computeStyleVariants {
+    for (int i = 0; i < 4; i++) {
+        BOOL bold = (i & 2) != 0;
+        BOOL italic = (i & 1) != 0;
+        PTYFontInfo *font = self;
+        BOOL fakeBold = NO;
+        BOOL fakeItalic = NO;
+        if (bold && italic) {
+            if (boldItalicVersion_) {
+                font = boldItalicVersion_;
+            } else if (boldVersion_) {
+                font = boldVersion_;
+                fakeItalic = YES;
+            } else if (italicVersion_) {
+                font = italicVersion_;
+                fakeBold = YES;
+            } else {
+                fakeBold = YES;
+                fakeItalic = YES;
+            }
+        } else if (bold) {
+            if (boldVersion_) {
+                font = boldVersion_;
+            } else {
+                fakeBold = YES;
+            }
+        } else if (italic) {
+            if (italicVersion_) {
+                font = italicVersion_;
+            } else {
+                fakeItalic = YES;
+            }
+        }
+        styleVariants_[i] = font;
+        styleVariantFakeBold_[i] = fakeBold;
+        styleVariantFakeItalic_[i] = fakeItalic;
+    }
+    styleVariantsValid_ = YES;
+}
+
+- (PTYFontInfo *)fontForBold:(BOOL)bold
+                      italic:(BOOL)italic
+                    fakeBold:(BOOL *)fakeBold
+                  fakeItalic:(BOOL *)fakeItalic {
+    if (!styleVariantsValid_) {
+        [self computeStyleVariants];
+    }
+    int i = (bold ? 2 : 0) + (italic ? 1 : 0);
+    *fakeBold = styleVariantFakeBold_[i];
+    *fakeItalic = styleVariantFakeItalic_[i];
+    return styleVariants_[i];
+}
+
 @end
@@ -39,6 +39,7 @@ extern NSString * const PTYNoteViewControllerShouldUpdatePosition;
 - (void)beginEditing;
 - (BOOL)isEmpty;
 - (void)setString:(NSString *)string;
+- (NSString *)string;
 - (void)setNoteHidden:(BOOL)hidden;
 - (BOOL)isNoteHidden;
 - (void)sizeToFit;
@@ -168,6 +168,10 @@ NSString * const PTYNoteViewControllerShouldUpdatePosition = @"PTYNoteViewContro
     textView_.string = string;
 }
 
+- (NSString *)string {
+    return textView_.string;
+}
+
 - (BOOL)isNoteHidden {
     return hidden_;
 }
@@ -0,0 +1,99 @@
+//
+//  PTYRecorder.h
+//  iTerm
+//
+//  Records what a session's pty sends, exactly as it was read and when, so a slow case can be
+//  replayed somewhere else. Set the hidden PTYRecordingDirectory preference to record every new
+//  session.
+//
+
+#import <Foundation/Foundation.h>
+#include <libkern/OSAtomic.h>
+
+// A recording is the magic "iTPR", a version byte, and then one event after another:
+//   a type byte,
+//   a varint of the microseconds since the previous event (or since recording began),
+//   for kPTYRecordingEventRead a varint length and that many bytes, as one read() delivered them,
+//   for kPTYRecordingEventResize a varint width and a varint height.
+// Varints are little-endian base 128. The first event is always the size when recording began.
+typedef enum {
+    kPTYRecordingEventRead = 1,
+    kPTYRecordingEventResize = 2
+} PTYRecordingEventType;
+
+// Writes a recording from its own queue, like SessionLogger. If the writer falls so far behind
+// that too much is waiting, the recording stops there rather than leave a hole in it, so what's on
+// disk is always a faithful prefix. Any thread.
+@interface PTYRecorder : NSObject {
+    NSString *path_;
+
+    // Protects lastEventTime_, pending_, flushScheduled_, and closed_.
+    OSSpinLock lock_;
+    uint64_t lastEventTime_;  // mach_absolute_time() of the last event.
+    NSMutableData *pending_;
+    BOOL flushScheduled_;
+    BOOL closed_;
+
+    // Only used on queue_.
+    dispatch_queue_t queue_;
+    int fd_;
+
+    volatile int64_t bytesRecorded_;
+    volatile BOOL truncated_;
+}
+
+@property(nonatomic, readonly) NSString *path;
+
+// Bytes of pty output recorded so far.
+@property(nonatomic, readonly) long long bytesRecorded;
+
+// YES if recording stopped early because the disk couldn't keep up.
+@property(nonatomic, readonly) BOOL truncated;
+
+// Creates or truncates |path|. Returns nil if it can't be opened.
+- (id)initWithPath:(NSString *)path width:(int)width height:(int)height;
+
+- (void)recordRead:(const char *)bytes length:(int)length;
+- (void)recordResizeToWidth:(int)width height:(int)height;
+
+// Writes what's queued and closes the file in the background. Later events are ignored.
+- (void)close;
+
+@end
+
+// A recording read back from disk. The events are indexed up front and their bytes stay in the
+// (mapped) file.
+@interface PTYRecording : NSObject {
+    NSData *contents_;
+    struct PTYRecordingEvent *events_;
+    int numberOfEvents_;
+    long long numberOfBytes_;
+}
+
+// Number of bytes of pty output in all the read events together.
+@property(nonatomic, readonly) long long numberOfBytes;
+
+// Returns nil if |path| isn't a recording. A recording cut off mid-event (say, because iTerm2
+// crashed) is kept up to the last whole event.
+- (id)initWithPath:(NSString *)path;
+
+- (int)numberOfEvents;
+- (PTYRecordingEventType)typeOfEventAtIndex:(int)i;
+
+// Seconds from the start of the recording.
+- (NSTimeInterval)timeOfEventAtIndex:(int)i;
+
+// For read events, the bytes read. The data borrows the recording's buffer.
+- (NSData *)dataOfEventAtIndex:(int)i;
+
+// For resize events.
+- (int)widthOfEventAtIndex:(int)i;
+- (int)heightOfEventAtIndex:(int)i;
+
+// The output of every read event, one after another.
+- (NSData *)allData;
+
+// Seconds from the first event to the last.
+- (NSTimeInterval)duration;
+
+@end
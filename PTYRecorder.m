@@ -0,0 +1,346 @@
+//
+//  PTYRecorder.m
+//  iTerm
+//
+
+#import "PTYRecorder.h"
+#import "DebugLogging.h"
+#include <fcntl.h>
+#include <mach/mach_time.h>
+#include <unistd.h>
+
+static const char kPTYRecordingMagic[4] = { 'i', 'T', 'P', 'R' };
+static const unsigned char kPTYRecordingVersion = 1;
+
+// Once this many bytes are waiting to be written the recording stops.
+static const NSUInteger kPTYRecorderMaxQueuedBytes = 32 * 1024 * 1024;
+
+// How long events may wait so that more can be written with them.
+static const NSTimeInterval kPTYRecorderFlushDelay = 0.1;
+
+struct PTYRecordingEvent {
+    PTYRecordingEventType type;
+    uint64_t time;  // Microseconds from the start.
+    NSUInteger offset;  // Of the bytes of a read in contents_.
+    int length;
+    int width;
+    int height;
+};
+
+static void PTYRecordingAppendVarint(NSMutableData *data, uint64_t value) {
+    unsigned char buffer[10];
+    int length = 0;
+    do {
+        buffer[length] = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            buffer[length] |= 0x80;
+        }
+        length++;
+    } while (value);
+    [data appendBytes:buffer length:length];
+}
+
+// Returns NO if the varint runs past |end|.
+static BOOL PTYRecordingReadVarint(const unsigned char **p, const unsigned char *end, uint64_t *value) {
+    uint64_t result = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        const unsigned char c = *(*p)++;
+        result |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *value = result;
+            return YES;
+        }
+    }
+    return NO;
+}
+
+static uint64_t PTYRecorderMicroseconds(uint64_t machTime) {
+    static mach_timebase_info_data_t timebase;
+    if (!timebase.denom) {
+        mach_timebase_info(&timebase);
+    }
+    return machTime * timebase.numer / timebase.denom / 1000;
+}
+
+@implementation PTYRecorder
+
+@synthesize path = path_;
+
+- (id)initWithPath:(NSString *)path width:(int)width height:(int)height
+{
+    self = [super init];
+    if (self) {
+        path_ = [[path stringByStandardizingPath] copy];
+        fd_ = open([path_ fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0) {
+            DLog(@"Can't open pty recording %@: %s", path_, strerror(errno));
+            [self release];
+            return nil;
+        }
+        lock_ = OS_SPINLOCK_INIT;
+        pending_ = [[NSMutableData alloc] init];
+        [pending_ appendBytes:kPTYRecordingMagic length:sizeof(kPTYRecordingMagic)];
+        [pending_ appendBytes:&kPTYRecordingVersion length:1];
+        lastEventTime_ = mach_absolute_time();
+        queue_ = dispatch_queue_create("com.googlecode.iterm2.pty-recorder", DISPATCH_QUEUE_SERIAL);
+        [self recordResizeToWidth:width height:height];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+    if (queue_) {
+        dispatch_release(queue_);
+    }
+    [path_ release];
+    [pending_ release];
+    [super dealloc];
+}
+
+- (long long)bytesRecorded
+{
+    return bytesRecorded_;
+}
+
+- (BOOL)truncated
+{
+    return truncated_;
+}
+
+- (void)recordRead:(const char *)bytes length:(int)length
+{
+    if (length <= 0) {
+        return;
+    }
+    if ([self _appendEventOfType:kPTYRecordingEventRead first:length second:-1 bytes:bytes]) {
+        OSAtomicAdd64(length, &bytesRecorded_);
+    }
+}
+
+- (void)recordResizeToWidth:(int)width height:(int)height
+{
+    [self _appendEventOfType:kPTYRecordingEventResize first:width second:height bytes:NULL];
+}
+
+- (void)close
+{
+    OSSpinLockLock(&lock_);
+    closed_ = YES;
+    OSSpinLockUnlock(&lock_);
+    dispatch_async(queue_, ^{
+        [self _flush];
+        close(fd_);
+        fd_ = -1;
+        DLog(@"Closed pty recording %@: %lld bytes%@",
+             path_, bytesRecorded_, truncated_ ? @", truncated" : @"");
+    });
+}
+
+#pragma mark - Private
+
+// Read events have a length of |first| followed by |bytes|; resize events have |first| and
+// |second|. Returns NO if the recording has stopped.
+- (BOOL)_appendEventOfType:(PTYRecordingEventType)type
+                     first:(int)first
+                    second:(int)second
+                     bytes:(const char *)bytes
+{
+    BOOL accepted = NO;
+    BOOL schedule = NO;
+    OSSpinLockLock(&lock_);
+    if (!closed_ && [pending_ length] + first <= kPTYRecorderMaxQueuedBytes) {
+        const uint64_t now = mach_absolute_time();
+        const unsigned char typeByte = type;
+        [pending_ appendBytes:&typeByte length:1];
+        PTYRecordingAppendVarint(pending_, PTYRecorderMicroseconds(now - lastEventTime_));
+        PTYRecordingAppendVarint(pending_, first);
+        if (bytes) {
+            [pending_ appendBytes:bytes length:first];
+        } else {
+            PTYRecordingAppendVarint(pending_, second);
+        }
+        lastEventTime_ = now;
+        accepted = YES;
+        schedule = !flushScheduled_;
+        flushScheduled_ = YES;
+    } else if (!closed_) {
+        closed_ = YES;
+        truncated_ = YES;
+    }
+    OSSpinLockUnlock(&lock_);
+
+    if (schedule) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, kPTYRecorderFlushDelay * NSEC_PER_SEC),
+                       queue_,
+                       ^{
+                           [self _flush];
+                       });
+    }
+    return accepted;
+}
+
+// Runs on queue_. Writes everything that's waiting in one go.
+- (void)_flush
+{
+    OSSpinLockLock(&lock_);
+    NSMutableData *data = pending_;
+    pending_ = [[NSMutableData alloc] init];
+    flushScheduled_ = NO;
+    OSSpinLockUnlock(&lock_);
+
+    const char *bytes = [data bytes];
+    NSUInteger length = [data length];
+    while (length > 0 && fd_ >= 0) {
+        ssize_t n = write(fd_, bytes, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DLog(@"Can't write pty recording %@: %s", path_, strerror(errno));
+            truncated_ = YES;
+            close(fd_);
+            fd_ = -1;
+            break;
+        }
+        bytes += n;
+        length -= n;
+    }
+    [data release];
+}
+
+@end
+
+@implementation PTYRecording
+
+@synthesize numberOfBytes = numberOfBytes_;
+
+- (id)initWithPath:(NSString *)path
+{
+    self = [super init];
+    if (self) {
+        contents_ = [[NSData alloc] initWithContentsOfFile:path
+                                                   options:NSDataReadingMappedIfSafe
+                                                     error:NULL];
+        if (![self _index]) {
+            [self release];
+            return nil;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    free(events_);
+    [contents_ release];
+    [super dealloc];
+}
+
+- (int)numberOfEvents
+{
+    return numberOfEvents_;
+}
+
+- (PTYRecordingEventType)typeOfEventAtIndex:(int)i
+{
+    return events_[i].type;
+}
+
+- (NSTimeInterval)timeOfEventAtIndex:(int)i
+{
+    return events_[i].time / 1000000.0;
+}
+
+- (NSData *)dataOfEventAtIndex:(int)i
+{
+    return [NSData dataWithBytesNoCopy:(char *)[contents_ bytes] + events_[i].offset
+                                length:events_[i].length
+                          freeWhenDone:NO];
+}
+
+- (int)widthOfEventAtIndex:(int)i
+{
+    return events_[i].width;
+}
+
+- (int)heightOfEventAtIndex:(int)i
+{
+    return events_[i].height;
+}
+
+- (NSData *)allData
+{
+    NSMutableData *data = [NSMutableData dataWithCapacity:numberOfBytes_];
+    const char *bytes = [contents_ bytes];
+    for (int i = 0; i < numberOfEvents_; i++) {
+        if (events_[i].type == kPTYRecordingEventRead) {
+            [data appendBytes:bytes + events_[i].offset length:events_[i].length];
+        }
+    }
+    return data;
+}
+
+- (NSTimeInterval)duration
+{
+    return numberOfEvents_ ? [self timeOfEventAtIndex:numberOfEvents_ - 1] : 0;
+}
+
+#pragma mark - Private
+
+- (BOOL)_index
+{
+    const NSUInteger headerLength = sizeof(kPTYRecordingMagic) + 1;
+    const unsigned char *start = [contents_ bytes];
+    if ([contents_ length] < headerLength ||
+        memcmp(start, kPTYRecordingMagic, sizeof(kPTYRecordingMagic)) ||
+        start[sizeof(kPTYRecordingMagic)] != kPTYRecordingVersion) {
+        return NO;
+    }
+    const unsigned char *end = start + [contents_ length];
+    const unsigned char *p = start + headerLength;
+    int capacity = 0;
+    uint64_t time = 0;
+    while (p < end) {
+        struct PTYRecordingEvent event = { 0 };
+        event.type = *p++;
+        uint64_t delta, first, second = 0;
+        if (!PTYRecordingReadVarint(&p, end, &delta) ||
+            !PTYRecordingReadVarint(&p, end, &first)) {
+            break;
+        }
+        if (event.type == kPTYRecordingEventRead) {
+            if (first > INT_MAX || first > end - p) {
+                break;
+            }
+            event.offset = p - start;
+            event.length = (int)first;
+            p += first;
+            numberOfBytes_ += first;
+        } else if (event.type == kPTYRecordingEventResize) {
+            if (!PTYRecordingReadVarint(&p, end, &second)) {
+                break;
+            }
+            event.width = (int)first;
+            event.height = (int)second;
+        } else {
+            DLog(@"Unknown pty recording event type %d", (int)event.type);
+            break;
+        }
+        time += delta;
+        event.time = time;
+
+        if (numberOfEvents_ == capacity) {
+            capacity = MAX(capacity * 2, 256);
+            events_ = realloc(events_, capacity * sizeof(*events_));
+        }
+        events_[numberOfEvents_++] = event;
+    }
+    return YES;
+}
+
+@end
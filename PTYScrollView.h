@@ -49,9 +49,11 @@
 
 @interface PTYScrollView : NSScrollView
 {
-    NSImage *backgroundImage;
-    // If the pattern is set, the backgroundImage is a cached rendered version of it.
-    NSColor *backgroundPattern;
+    NSImage *backgroundImage;  // Shared with other sessions, so it must not be modified.
+    BOOL backgroundTiled_;
+    // backgroundImage scaled or tiled to the visible size, from BackgroundImageCache.
+    NSImage *renderedBackground_;
+    CGFloat renderedScale_;
     float transparency;
 
     // Used for working around Lion bug described in setHasVerticalScroller:inInit:
@@ -33,6 +33,7 @@
 
 #import "iTerm.h"
 #import "PTYScrollView.h"
+#import "BackgroundImageCache.h"
 #import "FutureMethods.h"
 #import "PTYTextView.h"
 #import "PreferencePanel.h"
@@ -152,7 +153,7 @@
 - (void)dealloc
 {
     [backgroundImage release];
-    [backgroundPattern release];
+    [renderedBackground_ release];
     [creationDate_ release];
     [timer_ invalidate];
     timer_ = nil;
@@ -177,21 +178,22 @@
     NSRect srcRect;
 
     float alpha = useTransparency ? (1.0 - [self transparency]) : 1;
-    // resize/create image if we need to
-    if ((!backgroundImage && backgroundPattern) ||
-        !NSEqualSizes(backgroundImage.size, self.documentVisibleRect.size)) {
-        if (backgroundPattern) {
-            [backgroundImage release];
-            backgroundImage = [[NSImage alloc] initWithSize:self.documentVisibleRect.size];
-            [backgroundImage lockFocus];
-            [[backgroundPattern colorWithAlphaComponent:alpha] set];
-            [backgroundPattern drawSwatchInRect:NSMakeRect(0,
-                                                           0,
-                                                           self.documentVisibleRect.size.width,
-                                                           self.documentVisibleRect.size.height)];
-            [backgroundImage unlockFocus];
-        } else {
-            [backgroundImage setSize:[self documentVisibleRect].size];
+    // Get a rendering at the visible size if the size changed. A tiled one has the alpha of the
+    // first draw at that size drawn into it.
+    const NSSize size = [self documentVisibleRect].size;
+    const CGFloat scale = [[self window] backingScaleFactor] ?: 1;
+    if (!renderedBackground_ ||
+        !NSEqualSizes([renderedBackground_ size], size) ||
+        renderedScale_ != scale) {
+        [renderedBackground_ release];
+        renderedBackground_ = [[BackgroundImageCache renderedImage:backgroundImage
+                                                              size:size
+                                                             scale:scale
+                                                             tiled:backgroundTiled_
+                                                             alpha:alpha] retain];
+        renderedScale_ = scale;
+        if (!renderedBackground_) {
+            return;
         }
     }
 
@@ -199,10 +201,10 @@
     // normalize to origin of visible rectangle
     srcRect.origin.y -= [self documentVisibleRect].origin.y;
     // do a vertical flip of coordinates
-    srcRect.origin.y = [backgroundImage size].height - srcRect.origin.y - srcRect.size.height - VMARGIN;
+    srcRect.origin.y = [renderedBackground_ size].height - srcRect.origin.y - srcRect.size.height - VMARGIN;
 
-    // draw the image rect
-    [backgroundImage compositeToPoint:dest
+    // draw the image rect, which is the same size in the rendering, so it's a plain copy
+    [renderedBackground_ compositeToPoint:dest
                              fromRect:srcRect
                             operation:NSCompositeCopy
                              fraction:alpha];
@@ -237,7 +239,7 @@
 }
 
 - (BOOL)hasBackgroundImage {
-    return backgroundImage != nil || backgroundPattern != nil;
+    return backgroundImage != nil;
 }
 
 - (void)setBackgroundImage:(NSImage *)anImage
@@ -247,19 +249,11 @@
 
 - (void)setBackgroundImage:(NSImage *)anImage asPattern:(BOOL)asPattern
 {
-    [backgroundPattern release];
-    backgroundPattern = nil;
     [backgroundImage autorelease];
-    backgroundImage = nil;
-    if (asPattern) {
-        if (anImage) {
-            backgroundPattern = [[NSColor colorWithPatternImage:anImage] retain];
-        }
-    } else {
-        backgroundImage = [anImage retain];
-        [backgroundImage setScalesWhenResized:YES];
-        [backgroundImage setSize:[self documentVisibleRect].size];
-    }
+    backgroundImage = [anImage retain];
+    backgroundTiled_ = asPattern;
+    [renderedBackground_ release];
+    renderedBackground_ = nil;
 }
 
 - (float)transparency
@@ -0,0 +1,45 @@
+//
+//  PTYServerClient.h
+//  iTerm
+//
+//  The app's side of the PTY server (see pty_server.h), which keeps shells running while the app
+//  restarts. Off unless the KeepSessionsAliveAcrossRestarts user default is set.
+//
+
+#import <Foundation/Foundation.h>
+
+// A child the server held on to for us.
+@interface PTYServerChildInfo : NSObject {
+@public
+    int fd_;             // The pty master. -1 once it's been handed to a PTYTask.
+    pid_t pid_;
+    NSString *tty_;
+    NSData *output_;     // What the child wrote while the app was away.
+}
+@end
+
+// Sessions are matched up with the children they had before the restart by -[PTYSession
+// serverKey], which is saved in window arrangements. Restored sessions whose child is gone launch
+// a new shell as usual. Main thread only.
+@interface PTYServerClient : NSObject {
+    NSMutableDictionary *children_;  // Server key -> PTYServerChildInfo, waiting to be taken.
+}
+
++ (BOOL)isEnabled;
++ (PTYServerClient *)sharedInstance;
+
+// Takes back the children held by a server left by the last run, if there is one. Call at launch
+// before windows are restored.
+- (void)claimChildren;
+
+// Removes and returns the child for |key|, or nil if there isn't one.
+- (PTYServerChildInfo *)takeChildWithKey:(NSString *)key;
+
+// Hangs up on children that no restored session took. Call once windows have been restored.
+- (void)endUnclaimedChildren;
+
+// Starts a server and hands it the children of |sessions| (PTYSessions), which let go of them. Call
+// as the app quits, after window state has been saved.
+- (void)handOffSessions:(NSArray *)sessions;
+
+@end
@@ -0,0 +1,246 @@
+//
+//  PTYServerClient.m
+//  iTerm
+//
+
+#import "PTYServerClient.h"
+#import "DebugLogging.h"
+#import "PTYSession.h"
+#import "PTYTask.h"
+#include "pty_server.h"
+#include <signal.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static NSString *const kPTYServerSocketPath = @"~/Library/Application Support/iTerm/ptyserver.socket";
+
+// How long to wait for a newly spawned server to start listening.
+static const useconds_t kPTYServerStartupTimeoutMicroseconds = 2000000;
+static const useconds_t kPTYServerStartupPollMicroseconds = 10000;
+
+// So a wedged server can't hang launch.
+static const int kPTYServerReceiveTimeoutSeconds = 2;
+
+@implementation PTYServerChildInfo
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        fd_ = -1;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+    [tty_ release];
+    [output_ release];
+    [super dealloc];
+}
+
+@end
+
+@implementation PTYServerClient
+
++ (BOOL)isEnabled
+{
+    static BOOL enabled;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        enabled = [[NSUserDefaults standardUserDefaults] boolForKey:@"KeepSessionsAliveAcrossRestarts"];
+    });
+    return enabled;
+}
+
++ (PTYServerClient *)sharedInstance
+{
+    static PTYServerClient *instance;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        instance = [[PTYServerClient alloc] init];
+    });
+    return instance;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        children_ = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [children_ release];
+    [super dealloc];
+}
+
+- (void)claimChildren
+{
+    int socketFd = [self connectToServer];
+    if (socketFd < 0) {
+        return;
+    }
+    struct timeval timeout = { kPTYServerReceiveTimeoutSeconds, 0 };
+    setsockopt(socketFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    PTYServerMessage message;
+    memset(&message, 0, sizeof(message));
+    message.type = kPTYServerMessageClaim;
+    if (pty_server_send_message(socketFd, &message, -1)) {
+        close(socketFd);
+        return;
+    }
+    int fd;
+    while (!pty_server_receive_message(socketFd, &message, &fd) &&
+           message.type == kPTYServerMessageChild) {
+        PTYServerChildInfo *child = [[[PTYServerChildInfo alloc] init] autorelease];
+        child->fd_ = fd;
+        child->pid_ = message.pid;
+        child->tty_ = [[NSString alloc] initWithUTF8String:message.tty];
+        NSMutableData *output = [NSMutableData dataWithLength:MAX(0, message.length)];
+        if (pty_server_read_fully(socketFd, [output mutableBytes], [output length])) {
+            // The rest of the stream is unusable. This child is closed by dealloc.
+            break;
+        }
+        child->output_ = [output retain];
+        if (fd >= 0) {
+            NSString *key = [NSString stringWithUTF8String:message.key];
+            DLog(@"Claimed child %d on %@ with %d bytes of output", (int)child->pid_, key, message.length);
+            [children_ setObject:child forKey:key];
+        }
+    }
+    close(socketFd);
+}
+
+- (PTYServerChildInfo *)takeChildWithKey:(NSString *)key
+{
+    if (!key) {
+        return nil;
+    }
+    PTYServerChildInfo *child = [[[children_ objectForKey:key] retain] autorelease];
+    if (child) {
+        [children_ removeObjectForKey:key];
+    }
+    return child;
+}
+
+- (void)endUnclaimedChildren
+{
+    for (PTYServerChildInfo *child in [children_ allValues]) {
+        DLog(@"Ending unclaimed child %d", (int)child->pid_);
+        killpg(child->pid_, SIGHUP);
+    }
+    // Closes the fds.
+    [children_ removeAllObjects];
+}
+
+- (void)handOffSessions:(NSArray *)sessions
+{
+    NSMutableArray *sessionsWithChildren = [NSMutableArray array];
+    for (PTYSession *session in sessions) {
+        if ([[session SHELL] pid] > 0 && [[session SHELL] fd] >= 0) {
+            [sessionsWithChildren addObject:session];
+        }
+    }
+    if (![sessionsWithChildren count] || ![self spawnServer]) {
+        return;
+    }
+    int socketFd = -1;
+    for (useconds_t waited = 0;
+         waited < kPTYServerStartupTimeoutMicroseconds;
+         waited += kPTYServerStartupPollMicroseconds) {
+        socketFd = [self connectToServer];
+        if (socketFd >= 0) {
+            break;
+        }
+        usleep(kPTYServerStartupPollMicroseconds);
+    }
+    if (socketFd < 0) {
+        NSLog(@"Couldn't connect to the PTY server; sessions will end.");
+        return;
+    }
+
+    for (PTYSession *session in sessionsWithChildren) {
+        PTYTask *task = [session SHELL];
+        PTYServerMessage message;
+        memset(&message, 0, sizeof(message));
+        message.type = kPTYServerMessageAdopt;
+        message.pid = [task pid];
+        strlcpy(message.tty, [[task tty] UTF8String], sizeof(message.tty));
+        strlcpy(message.key, [[session serverKey] UTF8String], sizeof(message.key));
+        if (pty_server_send_message(socketFd, &message, [task fd])) {
+            break;
+        }
+        // The server has its own copy of the fd now.
+        [session handOffToServer];
+    }
+    close(socketFd);
+}
+
+#pragma mark - Private
+
+- (NSString *)socketPath
+{
+    return [kPTYServerSocketPath stringByExpandingTildeInPath];
+}
+
+// Returns a socket connected to the server, or -1 if none is listening.
+- (int)connectToServer
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    const char *path = [[self socketPath] fileSystemRepresentation];
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strlcpy(address.sun_path, path, sizeof(address.sun_path));
+
+    int socketFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socketFd < 0) {
+        return -1;
+    }
+    if (connect(socketFd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(socketFd);
+        return -1;
+    }
+    return socketFd;
+}
+
+// Runs this executable as `--pty_server <socket path>`. None of the app's fds are inherited, or
+// the ptys of sessions that weren't handed off would be kept open.
+- (BOOL)spawnServer
+{
+    const char *executable = [[[NSBundle mainBundle] executablePath] fileSystemRepresentation];
+    const char *socketPath = [[self socketPath] fileSystemRepresentation];
+    char *const argv[] = { (char *)executable, "--pty_server", (char *)socketPath, NULL };
+
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_CLOEXEC_DEFAULT | POSIX_SPAWN_SETSIGMASK);
+    sigset_t noSignals;
+    sigemptyset(&noSignals);
+    posix_spawnattr_setsigmask(&attributes, &noSignals);
+
+    extern char **environ;
+    pid_t serverPid;
+    int rc = posix_spawn(&serverPid, executable, NULL, &attributes, argv, environ);
+    posix_spawnattr_destroy(&attributes);
+    if (rc) {
+        NSLog(@"Couldn't start the PTY server: %s", strerror(rc));
+        return NO;
+    }
+    DLog(@"Started PTY server with pid %d", (int)serverPid);
+    return YES;
+}
+
+@end
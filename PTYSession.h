@@ -2,6 +2,7 @@
 
 #import "DVR.h"
 #import "FindViewController.h"
+#import "FrameScheduler.h"
 #import "ITAddressBookMgr.h"
 #import "LineBuffer.h"
 #import "PTYTask.h"
@@ -13,6 +14,7 @@
 #import "TmuxController.h"
 #import "TmuxGateway.h"
 #import "VT100Screen.h"
+#import "VT100ParseQueue.h"
 #import "VT100ScreenMark.h"
 #import "WindowControllerInterface.h"
 #import <AppKit/AppKit.h>
@@ -22,12 +24,18 @@
 // Posted when the tmux font changes. Window layouts will need to be updated.
 extern NSString *const kPTYSessionTmuxFontDidChange;
 
+// During a live resize or split pane drag, sessions and tmux learn the new size at most this often.
+extern const NSTimeInterval kLiveResizeUpdateInterval;
+
 @class FakeWindow;
+@class MemoryReport;
+@class PTYRecording;
 @class PTYScrollView;
 @class PTYTask;
 @class PTYTextView;
 @class PasteContext;
 @class PreferencePanel;
+@class SessionActivity;
 @class VT100Screen;
 @class VT100Terminal;
 @class iTermController;
@@ -53,11 +61,13 @@ typedef enum {
 @class SessionView;
 @interface PTYSession : NSResponder <
     FindViewControllerDelegate,
+    FrameSchedulerClient,
     PasteViewControllerDelegate,
     PopupDelegate,
     PTYTaskDelegate,
     PTYTextViewDelegate,
     TmuxGatewayDelegate,
+    VT100ParseQueueDelegate,
     VT100ScreenDelegate>
 
 @property(nonatomic, assign) BOOL alertOnNextMark;
@@ -119,9 +129,17 @@ typedef enum {
 // Set rows, columns from arrangement.
 - (void)resizeFromArrangement:(NSDictionary *)arrangement;
 
+// Returns YES if the session already has the arrangement's rows and columns.
+- (BOOL)sizeMatchesArrangement:(NSDictionary *)arrangement;
+
 - (void)runCommandWithOldCwd:(NSString*)oldCWD
                forObjectType:(iTermObjectType)objectType;
 
+// Whether the session was restored and hasn't started its command yet.
+- (BOOL)hasDeferredLaunch;
+// Starts the command of a restored session if it hasn't yet.
+- (void)launchDeferredProgramIfNeeded;
+
 - (void)startProgram:(NSString *)program
            arguments:(NSArray *)prog_argv
          environment:(NSDictionary *)prog_env
@@ -168,7 +186,12 @@ typedef enum {
 - (NSSize)idealScrollViewSizeWithStyle:(NSScrollerStyle)scrollerStyle;
 
 // misc
+// While a window live resize or split pane drag is in progress the new size is only remembered,
+// since reflowing a long scrollback and sending the job SIGWINCH on every step of the drag is
+// slow, and a full-screen app redraws everything on each SIGWINCH. The latest size is applied every
+// kLiveResizeUpdateInterval until the drag ends. Call applyDeferredResize when it does.
 - (void)setWidth:(int)width height:(int)height;
+- (void)applyDeferredResize;
 
 // Do we need to prompt on close for this session?
 - (BOOL)promptOnClose;
@@ -214,6 +237,17 @@ typedef enum {
 - (void)popIconTitle;
 - (PTYTask *)SHELL;
 - (void)setSHELL: (PTYTask *)theSHELL;
+// Identifies the session's child to the PTY server (see PTYServerClient.h). Nil if it has none.
+- (NSString *)serverKey;
+// Lets go of the child once the PTY server has it.
+- (void)handOffToServer;
+
+// Feeds the output in a pty recording (see PTYRecorder.h) through readTask:, with each read as
+// it was recorded, and applies its resizes to the window. At the original speed the reads are
+// spaced as they were when recorded; otherwise they come as fast as they can be handled.
+- (void)replayPtyRecording:(PTYRecording *)recording atOriginalSpeed:(BOOL)originalSpeed;
+- (BOOL)isReplayingPtyRecording;
+- (void)stopReplayingPtyRecording;
 - (VT100Terminal *)TERMINAL;
 - (NSString *)TERM_VALUE;
 - (void)setTERM_VALUE: (NSString *)theTERM_VALUE;
@@ -245,6 +279,32 @@ typedef enum {
 - (void)setAddressBookEntry:(NSDictionary*)entry;
 - (NSString *)tty;
 - (NSString *)contents;
+
+// For scripts that poll the contents. See -[VT100Screen contentGeneration].
+- (NSNumber *)contentGeneration;
+
+// What this session has cost lately, for finding the one that's making the machine hot.
+- (SessionActivity *)activity;
+
+// For scripts: percent of one CPU and a short description of the activity.
+- (NSNumber *)cpuUsage;
+- (NSString *)activityDescription;
+
+// The most times a second the session may be drawn now. Lower in low power mode (see PowerManager).
+- (double)effectiveFramesPerSecond;
+
+// For scripts.
+- (NSNumber *)frameRateLimit;
+
+// Absolute number of the oldest line still in scrollback, and of the line after the last.
+- (NSNumber *)firstLineNumber;
+- (NSNumber *)endLineNumber;
+
+// Adds a section for this session to |report|.
+- (void)addToMemoryReport:(MemoryReport *)report;
+
+// This session's section of a memory report, as text. Used by AppleScript.
+- (NSString *)memoryReport;
 - (iTermGrowlDelegate*)growlDelegate;
 
 
@@ -296,6 +356,13 @@ typedef enum {
 
 // Display timer stuff
 - (void)updateDisplay;
+
+// Can this session's contents currently be seen? As of the last call to -updateVisibility.
+- (BOOL)isVisible;
+
+// Recomputes -isVisible from tab selection and window visibility, minimization, and occlusion.
+// When the session becomes visible after updates were skipped, redraws it from the grid.
+- (void)updateVisibility;
 - (void)doAntiIdle;
 - (NSString*)ansiColorsMatchingForeground:(NSDictionary*)fg andBackground:(NSDictionary*)bg inBookmark:(Profile*)aDict;
 - (void)updateScroll;
@@ -348,6 +415,10 @@ typedef enum {
 // Bitmap of how the session looks.
 - (NSImage *)imageOfSession:(BOOL)flip;
 
+// A cheap picture of the visible part of the session with a block of color for each cell, the same
+// size as -imageOfSession:'s. It's remade only if the session changed since the last call.
+- (NSImage *)thumbnail;
+
 // Image for dragging one session.
 - (NSImage *)dragImage;
 
@@ -391,5 +462,10 @@ typedef enum {
 -(void)handleWriteScriptCommand: (NSScriptCommand *)command;
 -(void)handleClearScriptCommand: (NSScriptCommand *)command;
 
+// Returns the text of a range of absolute line numbers. Arguments, all optional: from (defaults to
+// the first line), to (inclusive, defaults to the last line), and ifChangedSince, a content
+// generation; if the session hasn't changed since then the result is empty.
+- (id)handleReadLinesScriptCommand:(NSScriptCommand *)command;
+
 @end
 
@@ -1,29 +1,45 @@
 #import "PTYSession.h"
 
+#import "BackgroundImageCache.h"
+#import "BinaryLog.h"
+#import "ContentsChangeFeed.h"
 #import "Coprocess.h"
 #import "FakeWindow.h"
 #import "FileTransferManager.h"
+#import "FrameProfiler.h"
+#import "GridExporter.h"
 #import "HotkeyWindowController.h"
 #import "ITAddressBookMgr.h"
+#import "InputLatencyProfiler.h"
+#import "MemoryReport.h"
+#import "MetricsExporter.h"
 #import "MovePaneController.h"
 #import "MovePaneController.h"
 #import "NSDictionary+iTerm.h"
 #import "NSStringITerm.h"
 #import "NSView+RecursiveDescription.h"
+#import "PTYRecorder.h"
 #import "PTYScrollView.h"
+#import "PTYServerClient.h"
 #import "PTYTab.h"
 #import "PTYTask.h"
 #import "PTYTextView.h"
 #import "PasteContext.h"
 #import "PasteEvent.h"
+#import "PasteStream.h"
 #import "PasteViewController.h"
+#import "PowerManager.h"
 #import "PreferencePanel.h"
 #import "ProcessCache.h"
 #import "SCPFile.h"
 #import "SCPPath.h"
 #import "SearchResult.h"
+#import "SessionActivity.h"
 #import "SessionView.h"
+#import "ShellLaunchPool.h"
+#import "Signposts.h"
 #import "TerminalFile.h"
+#import "TimerWheel.h"
 #import "TmuxController.h"
 #import "TmuxControllerRegistry.h"
 #import "TmuxGateway.h"
@@ -31,6 +47,8 @@
 #import "TmuxStateParser.h"
 #import "TmuxWindowOpener.h"
 #import "Trigger.h"
+#import "TriggerProfiler.h"
+#import "TriggerSet.h"
 #import "VT100Screen.h"
 #import "VT100ScreenMark.h"
 #import "VT100Terminal.h"
@@ -38,9 +56,11 @@
 #import "iTerm.h"
 #import "iTermApplicationDelegate.h"
 #import "iTermController.h"
+#import "iTermExpose.h"
 #import "iTermGrowlDelegate.h"
 #import "iTermKeyBindingMgr.h"
 
+#include <libkern/OSAtomic.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <sys/wait.h>
@@ -51,6 +71,7 @@
 static NSString *const kAskAboutOutdatedKeyMappingKeyFormat = @"AskAboutOutdatedKeyMappingForGuid%@";
 
 NSString *const kPTYSessionTmuxFontDidChange = @"kPTYSessionTmuxFontDidChange";
+const NSTimeInterval kLiveResizeUpdateInterval = 0.1;
 
 static NSString *TERM_ENVNAME = @"TERM";
 static NSString *COLORFGBG_ENVNAME = @"COLORFGBG";
@@ -67,9 +88,55 @@ static NSString* SESSION_ARRANGEMENT_TMUX_PANE = @"Tmux Pane";
 static NSString* SESSION_ARRANGEMENT_TMUX_HISTORY = @"Tmux History";
 static NSString* SESSION_ARRANGEMENT_TMUX_ALT_HISTORY = @"Tmux AltHistory";
 static NSString* SESSION_ARRANGEMENT_TMUX_STATE = @"Tmux State";
+static NSString* SESSION_ARRANGEMENT_SCROLLBACK_ARCHIVE = @"Scrollback Archive";
+static NSString* SESSION_ARRANGEMENT_SERVER_KEY = @"PTY Server Key";
 
 static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
 
+// Lines that complete while this many are waiting to be matched against triggers aren't matched,
+// so output that outruns a slow trigger doesn't back up without bound.
+static const int32_t kMaxPendingTriggerLines = 256;
+
+// Matching has a time budget (see TriggerSet), so long lines are fine. This only keeps output that
+// never ends a line from using unbounded memory; the start of such a line is still matched.
+static const int kMaxTriggerLineLength = 1024 * 1024;
+
+// A flow-controlled paste keeps about this many bytes waiting in the task's write buffer.
+static const NSUInteger kPasteWriteBufferTarget = 64 * 1024;
+
+// Pastes expected to take longer than this many seconds show their progress.
+static const NSTimeInterval kPasteUIMinimumDuration = 3;
+
+// Output this short that arrives this soon after a keystroke is assumed to be its echo and may be
+// drawn right away (see -drawEchoImmediatelyIfPossible).
+static const int kEchoFastPathMaxLength = 64;
+static const NSTimeInterval kEchoFastPathWindow = 0.1;
+
+// Output held for a session that can't be seen in low power mode is handled right away once there's
+// this much of it, on the thread that read it, so a flood of output still has back pressure.
+static const NSUInteger kMaxHiddenOutput = 1024 * 1024;
+
+// Flood mode begins when output arrives at more than FloodModeScreensPerSecond screenfuls a second
+// (measured every kFloodModeSampleInterval seconds) and ends once it has stayed under a quarter of
+// that for kFloodModeExitDelay seconds. Meanwhile the session is drawn at kFloodModeFramesPerSecond.
+static const double kDefaultFloodModeScreensPerSecond = 200;
+static const NSTimeInterval kFloodModeSampleInterval = 0.25;
+static const NSTimeInterval kFloodModeExitDelay = 1;
+static const double kFloodModeFramesPerSecond = 4;
+
+// In a thumbnail a cell with a visible character mixes this much of its foreground color into its
+// background color.
+static const CGFloat kThumbnailInkFraction = 0.4;
+
+// A pty recording replayed at full speed gives the run loop a turn after this long.
+static const NSTimeInterval kPtyReplayTimeSlice = 0.05;
+static const int kThumbnailColorMemoSize = 64;
+
+typedef struct {
+    uint32_t key;  // 0 for an empty slot.
+    unsigned char rgb[3];
+} PTYSessionThumbnailColor;
+
 @interface PTYSession ()
 @property(nonatomic, retain) Interval *currentMarkOrNotePosition;
 @property(nonatomic, retain) TerminalFile *download;
@@ -135,10 +202,9 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     
     // This timer fires periodically to redraw TEXTVIEW, update the scroll position, tab appearance,
     // etc.
-    NSTimer *updateTimer;
     
     // Anti-idle timer that sends a character every so often to the host.
-    NSTimer* antiIdleTimer;
+    TimerWheelTimer* antiIdleTimer;
     
     // The code to send in the anti idle timer.
     char ai_code;
@@ -173,6 +239,38 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     
     // Status reporting
     struct timeval lastInput, lastOutput;
+
+    // Set by a keystroke and cleared by the first output after it, which may be drawn right away.
+    BOOL echoFastPathArmed_;
+    int numEchoFastPaths_;
+
+    // A session restored from an arrangement doesn't run its command until its tab is first shown
+    // or it gets input. These are the arguments to -runCommandWithOldCwd:forObjectType: until then.
+    BOOL launchDeferred_;
+    NSString *deferredLaunchCwd_;
+    iTermObjectType deferredLaunchObjectType_;
+
+    // Set once the child has been handed to the PTY server, so the arrangement saved after that
+    // still names it.
+    NSString *handedOffServerKey_;
+
+    // The last result of -arrangement. It's returned again while nothing in it has changed, which
+    // lets the tab reuse its own arrangement.
+    NSDictionary *arrangement_;
+
+    // A pty recording being fed to readTask: (see -replayPtyRecording:atOriginalSpeed:). The next
+    // event to replay is at replayIndex_.
+    PTYRecording *replayRecording_;
+    int replayIndex_;
+    BOOL replayAtOriginalSpeed_;
+    NSTimeInterval replayStartTime_;
+
+    // Bumped when output is handled or the profile is applied. The thumbnail is remade when it's
+    // out of date or the visible part of the session changed.
+    unsigned int contentGeneration_;
+    NSImage *thumbnail_;
+    unsigned int thumbnailGeneration_;
+    NSRect thumbnailRect_;
     
     // Time that the tab label was last updated.
     struct timeval lastUpdate;
@@ -180,6 +278,12 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     // Does the session have new output? Used by -[PTYTab setLabelAttributes] to color the tab's title
     // appropriately.
     BOOL newOutput;
+
+    // Can the session's contents be seen? Recomputed by -updateVisibility. While NO the text view
+    // isn't refreshed, and needsRefreshWhenVisible_ is set if anything was skipped so that the
+    // view can be rebuilt from the grid in one pass when it's shown again.
+    BOOL visible_;
+    BOOL needsRefreshWhenVisible_;
     
     // Is the session idle? Used by setLableAttribute to send a growl message when processing ends.
     BOOL growlIdle;
@@ -200,21 +304,45 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     // Set only if this is not a live session (we are showing instant replay). Is a pointer to the
     // hidden live session while looking at the past.
     PTYSession* liveSession_;
+
+    // Non-nil if output is tokenized off the main thread. Read on the TaskNotifier thread, but
+    // only assigned in init and dealloc.
+    VT100ParseQueue *parseQueue_;
+
+    // Client-side flow control for a tmux pane. While the parse queue is backlogged, new output
+    // is dropped instead of queued behind it; once the backlog clears, the screen is repainted
+    // from a capture of the pane. Output is dropped while the capture is outstanding too, since
+    // the capture includes it. tmuxPaneBacklogged_ is set on the parse queue's threads.
+    volatile BOOL tmuxPaneBacklogged_;
+    BOOL tmuxOutputDropped_;
+    BOOL tmuxRepaintPending_;
     
-    // Is the update timer's callback currently running?
-    BOOL timerRunning_;
-    
-    // Paste from the head of this string from a timer until it's empty.
-    NSMutableString* slowPasteBuffer;
-    NSTimer* slowPasteTimer;
+    // Makes the bytes of the paste in progress as they're sent. Nil when not pasting.
+    PasteStream *pasteStream_;
+
+    // A paced paste sends a chunk each time this fires.
+    TimerWheelTimer* slowPasteTimer;
+
+    // A flow-controlled paste keeps the task's write buffer full and sends more when it drains.
+    BOOL pasteIsFlowControlled_;
+    BOOL pasteWaitingForRoom_;
     
     // The name of the foreground job at the moment as best we can tell.
     NSString* jobName_;
+
+    // Mirrors the screen into a file when the GridExportDirectory default is set. See GridExporter.h.
+    GridExporter *gridExporter_;
+    BOOL gridExportFailed_;
     
     // Ignore resize notifications. This would be set because the session's size musn't be changed
     // due to temporary changes in the window size, as code later on may need to know the session's
     // size to set the window size properly.
     BOOL ignoreResizeNotifications_;
+
+    // Size to apply when the live resize or split pane drag in progress ends, or when the next
+    // periodic update during the drag happens.
+    BOOL hasDeferredSize_;
+    VT100GridSize deferredSize_;
     
     // Last time this session became active
     NSDate* lastActiveAt_;
@@ -234,14 +362,49 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     // The current line of text, for checking against triggers if any.
     NSMutableString *triggerLine_;
     
-    // The current triggers.
-    NSMutableArray *triggers_;
+    // The current triggers. Only rebuilt when the profile's triggers change.
+    TriggerSet *triggerSet_;
+
+    // Completed lines are matched against triggers on this queue so a slow regex doesn't slow
+    // down output.
+    dispatch_queue_t triggerQueue_;
+
+    // Lines queued on triggerQueue_ that haven't been matched yet.
+    volatile int32_t pendingTriggerLines_;
+
+    // Matches waiting for their actions to be performed on the main thread. Each is an array of
+    // the Trigger and its capture components. Nil if none are waiting.
+    NSMutableArray *pendingTriggerMatches_;
+
+    // Bytes, tokens, redraws and time spent on this session's output.
+    SessionActivity *activity_;
+
+    // When -updateDisplay last ran, for limiting the frame rate in low power and flood mode.
+    NSTimeInterval lastUpdateDisplayTime_;
+
+    // In flood mode output arrives faster than it could be drawn. Lines that would scroll off
+    // before being seen skip the screen, and the frame rate drops. See -updateFloodMode.
+    BOOL floodMode_;
+    int floodBytes_;  // Handled since floodSampleTime_.
+    NSTimeInterval floodSampleTime_;
+    NSTimeInterval floodCalmSince_;  // When output fell below the exit rate in flood mode, or 0.
+    TimerWheelTimer *floodTimer_;  // Ends flood mode if output stops.
+
+    // In low power mode, output to a session that can't be seen is held here by the TaskNotifier
+    // thread and handled in a batch on the main thread every hiddenOutputInterval_ seconds. While
+    // anything is held, new output is held after it so output stays in order. hiddenOutput_ and
+    // hiddenOutputFlushScheduled_ are guarded by hiddenOutputLock_.
+    volatile BOOL batchHiddenOutput_;
+    volatile NSTimeInterval hiddenOutputInterval_;
+    OSSpinLock hiddenOutputLock_;
+    NSMutableData *hiddenOutput_;
+    BOOL hiddenOutputFlushScheduled_;
     
     // Does the terminal think this session is focused?
     BOOL focused_;
     
+    // Searches output as it arrives for the find bar's query while the find bar is open.
     FindContext *tailFindContext_;
-    NSTimer *tailFindTimer_;
     
     enum {
         TMUX_NONE,
@@ -271,12 +434,16 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
         // mode.
         [[MovePaneController sharedInstance] exitMovePaneMode];
         triggerLine_ = [[NSMutableString alloc] init];
+        triggerQueue_ = dispatch_queue_create("com.googlecode.iterm2.triggers",
+                                              DISPATCH_QUEUE_SERIAL);
+        activity_ = [[SessionActivity alloc] init];
+        hiddenOutputLock_ = OS_SPINLOCK_INIT;
+        hiddenOutput_ = [[NSMutableData alloc] init];
         isDivorced = NO;
         gettimeofday(&lastInput, NULL);
         lastOutput = lastInput;
         lastUpdate = lastInput;
         EXIT=NO;
-        updateTimer = nil;
         antiIdleTimer = nil;
         addressBookEntry = nil;
         windowTitleStack = nil;
@@ -288,12 +455,17 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
         TERMINAL = [[VT100Terminal alloc] init];
         SCREEN = [[VT100Screen alloc] initWithTerminal:TERMINAL];
         NSParameterAssert(SHELL != nil && TERMINAL != nil && SCREEN != nil);
+        if ([[NSUserDefaults standardUserDefaults] boolForKey:@"ParseOutputInBackground"]) {
+            parseQueue_ = [[VT100ParseQueue alloc] initWithTerminal:TERMINAL];
+            parseQueue_.delegate = self;
+            [parseQueue_ setTerminalHeight:[SCREEN height]
+                     useColumnScrollRegion:[SCREEN terminalUseColumnScrollRegion]];
+        }
 
         // Need Growl plist stuff
         gd = [iTermGrowlDelegate sharedInstance];
         growlIdle = growlNewOutput = NO;
 
-        slowPasteBuffer = [[NSMutableString alloc] init];
         creationDate_ = [[NSDate date] retain];
         tmuxSecureLogging_ = NO;
         tailFindContext_ = [[FindContext alloc] init];
@@ -305,14 +477,14 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
                                                  selector:@selector(coprocessChanged)
                                                      name:@"kCoprocessStatusChangeNotification"
                                                    object:nil];
-        [[NSNotificationCenter defaultCenter] addObserver:self
-                                                 selector:@selector(sessionContentsChanged:)
-                                                     name:@"iTermTabContentsChanged"
-                                                   object:nil];
         [[NSNotificationCenter defaultCenter] addObserver:self
                                                  selector:@selector(synchronizeTmuxFonts:)
                                                      name:kTmuxFontChanged
                                                    object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(lowPowerModeDidChange:)
+                                                     name:kPowerManagerLowPowerModeDidChangeNotification
+                                                   object:nil];
     }
     return self;
 }
@@ -321,10 +493,20 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
 {
     [self stopTailFind];  // This frees the substring in the tail find context, if needed.
     [triggerLine_ release];
-    [triggers_ release];
+    [triggerSet_ release];
+    dispatch_release(triggerQueue_);
+    [pendingTriggerMatches_ release];
+    [activity_ release];
+    [hiddenOutput_ release];
     [pasteboard_ release];
     [pbtext_ release];
-    [slowPasteBuffer release];
+    [pasteStream_ release];
+    [deferredLaunchCwd_ release];
+    [handedOffServerKey_ release];
+    [arrangement_ release];
+    [replayRecording_ release];
+    [gridExporter_ release];
+    [thumbnail_ release];
     if (slowPasteTimer) {
         [slowPasteTimer invalidate];
     }
@@ -343,10 +525,12 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     [backgroundImagePath release];
     [antiIdleTimer invalidate];
     [antiIdleTimer release];
-    [updateTimer invalidate];
-    [updateTimer release];
+    [floodTimer_ invalidate];
+    [floodTimer_ release];
     [originalAddressBookEntry release];
     [liveSession_ release];
+    [parseQueue_ invalidate];
+    [parseQueue_ release];
     [tmuxGateway_ release];
     [tmuxController_ release];
     [sendModifiers_ release];
@@ -383,8 +567,9 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
 - (void)cancelTimers
 {
     [view cancelTimers];
-    [updateTimer invalidate];
+    [[FrameScheduler sharedInstance] unscheduleClient:self];
     [antiIdleTimer invalidate];
+    [floodTimer_ invalidate];
 }
 
 - (void)setDvr:(DVR*)dvr liveSession:(PTYSession*)liveSession
@@ -536,9 +721,30 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     }
     [aSession setTab:theTab];
     NSNumber *n = [arrangement objectForKey:SESSION_ARRANGEMENT_TMUX_PANE];
+    NSString *archivePath = [arrangement objectForKey:SESSION_ARRANGEMENT_SCROLLBACK_ARCHIVE];
+    if (!n && archivePath && ![PTYSession _scrollbackArchiveIsInUse:archivePath]) {
+        if ([[aSession SCREEN] restoreScrollbackFromArchiveAtPath:archivePath]) {
+            // The restored blocks keep the file mapped, so it can be removed now. The session
+            // archives to a new file from here on.
+            unlink([archivePath fileSystemRepresentation]);
+        }
+    }
+    PTYServerChildInfo *serverChild = nil;
     if (!n) {
-        [aSession runCommandWithOldCwd:[arrangement objectForKey:SESSION_ARRANGEMENT_WORKING_DIRECTORY]
-                         forObjectType:objectType];
+        serverChild = [[PTYServerClient sharedInstance]
+                          takeChildWithKey:[arrangement objectForKey:SESSION_ARRANGEMENT_SERVER_KEY]];
+    }
+    if (serverChild) {
+        // The shell outlived the last run of the app, so pick up where it left off.
+        [aSession _attachToServerChild:serverChild];
+    } else if (!n) {
+        // The command runs when the tab is first selected (see -[PseudoTerminal loadArrangement:]).
+        // Archiving starts now so the restored scrollback is saved even if it never is.
+        [aSession _startArchivingScrollbackIfNeeded];
+        aSession->launchDeferred_ = YES;
+        aSession->deferredLaunchCwd_ =
+            [[arrangement objectForKey:SESSION_ARRANGEMENT_WORKING_DIRECTORY] copy];
+        aSession->deferredLaunchObjectType_ = objectType;
     } else {
         NSString *title = [state objectForKey:@"title"];
         if (title) {
@@ -553,13 +759,13 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     if (n) {
         [aSession setTmuxPane:[n intValue]];
     }
-    NSArray *history = [arrangement objectForKey:SESSION_ARRANGEMENT_TMUX_HISTORY];
+    LineBuffer *history = [arrangement objectForKey:SESSION_ARRANGEMENT_TMUX_HISTORY];
     if (history) {
-        [[aSession SCREEN] setHistory:history];
+        [[aSession SCREEN] setHistoryFromLineBuffer:history];
     }
-    history = [arrangement objectForKey:SESSION_ARRANGEMENT_TMUX_ALT_HISTORY];
-    if (history) {
-        [[aSession SCREEN] setAltScreen:history];
+    NSArray *altHistory = [arrangement objectForKey:SESSION_ARRANGEMENT_TMUX_ALT_HISTORY];
+    if (altHistory) {
+        [[aSession SCREEN] setAltScreen:altHistory];
     }
     if (state) {
         [[aSession SCREEN] setTmuxState:state];
@@ -671,6 +877,23 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     return YES;
 }
 
+- (BOOL)hasDeferredLaunch
+{
+    return launchDeferred_;
+}
+
+- (void)launchDeferredProgramIfNeeded
+{
+    if (!launchDeferred_ || EXIT) {
+        return;
+    }
+    launchDeferred_ = NO;
+    DLog(@"Launch deferred program for %@", self);
+    [self runCommandWithOldCwd:deferredLaunchCwd_ forObjectType:deferredLaunchObjectType_];
+    [deferredLaunchCwd_ release];
+    deferredLaunchCwd_ = nil;
+}
+
 - (void)runCommandWithOldCwd:(NSString*)oldCWD
                forObjectType:(iTermObjectType)objectType
 {
@@ -708,6 +931,37 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
 }
 
 - (void)setWidth:(int)width height:(int)height
+{
+    if ([[self view] inLiveResize] || [tab_ isDraggingSplit]) {
+        DLog(@"Defer resizing session %@ to %dx%d until the drag ends", self, width, height);
+        if (!hasDeferredSize_) {
+            // The text view keeps drawing the old grid, clipped or padded, until this fires or the
+            // drag ends.
+            [self performSelector:@selector(applyDeferredResize)
+                       withObject:nil
+                       afterDelay:kLiveResizeUpdateInterval];
+        }
+        hasDeferredSize_ = YES;
+        deferredSize_ = VT100GridSizeMake(width, height);
+        return;
+    }
+    hasDeferredSize_ = NO;
+    [self resizeToWidth:width height:height];
+}
+
+- (void)applyDeferredResize
+{
+    [NSObject cancelPreviousPerformRequestsWithTarget:self
+                                             selector:@selector(applyDeferredResize)
+                                               object:nil];
+    if (!hasDeferredSize_) {
+        return;
+    }
+    hasDeferredSize_ = NO;
+    [self resizeToWidth:deferredSize_.width height:deferredSize_.height];
+}
+
+- (void)resizeToWidth:(int)width height:(int)height
 {
     DLog(@"Set session %@ to %dx%d", self, width, height);
     [SCREEN resizeWidth:width height:height];
@@ -754,16 +1008,20 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
 
 - (NSArray *)childJobNames
 {
-    int skip = 0;
+    ProcessTreeSnapshot *snapshot = [[ProcessCache sharedInstance] snapshot];
     pid_t thePid = [SHELL pid];
-    if ([[[ProcessCache sharedInstance] getNameOfPid:thePid isForeground:nil] isEqualToString:@"login"]) {
-        skip = 1;
-    }
+    // Under login, the shell itself isn't a job.
+    BOOL skipChildren = [[snapshot nameOfPid:thePid inTreeOfRoot:thePid] isEqualToString:@"login"];
     NSMutableArray *names = [NSMutableArray array];
-    for (NSNumber *n in [[ProcessCache sharedInstance] childrenOfPid:thePid levelsToSkip:skip]) {
+    for (NSNumber *n in [snapshot descendantsOfRoot:thePid]) {
         pid_t pid = [n intValue];
-        NSDictionary *info = [[ProcessCache sharedInstance] dictionaryOfTaskInfoForPid:pid];
-        [names addObject:[info objectForKey:PID_INFO_NAME]];
+        if (skipChildren && [snapshot parentOfPid:pid inTreeOfRoot:thePid] == thePid) {
+            continue;
+        }
+        NSString *name = [snapshot nameOfPid:pid inTreeOfRoot:thePid];
+        if (name) {
+            [names addObject:name];
+        }
     }
     return names;
 }
@@ -855,6 +1113,113 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
             (int)arc4random()];
 }
 
+- (NSString *)_instantReplayRecordingFilenameForTermId:(NSString *)termid
+{
+    // $(InstantReplayRecordingDirectory)/YYYYMMDD_HHMMSS.wNtNpN.$(PID).$(RANDOM).itermdvr
+    NSString *directory =
+        [[NSUserDefaults standardUserDefaults] stringForKey:@"InstantReplayRecordingDirectory"];
+    if (![directory length]) {
+        return nil;
+    }
+    return [NSString stringWithFormat:@"%@/%@.%@.%d.%0x.itermdvr",
+            [directory stringByExpandingTildeInPath],
+            [[NSDate date] descriptionWithCalendarFormat:@"%Y%m%d_%H%M%S"
+                                                timeZone:nil
+                                                  locale:nil],
+            termid,
+            (int)getpid(),
+            (int)arc4random()];
+}
+
+- (NSString *)_scrollbackArchiveFilename
+{
+    // $(ScrollbackArchiveDirectory)/$(PID).$(RANDOM).itermscrollback
+    NSString *directory =
+        [[NSUserDefaults standardUserDefaults] stringForKey:@"ScrollbackArchiveDirectory"];
+    if (![directory length]) {
+        return nil;
+    }
+    return [NSString stringWithFormat:@"%@/%d.%0x.itermscrollback",
+            [directory stringByExpandingTildeInPath],
+            (int)getpid(),
+            (int)arc4random()];
+}
+
+- (NSString *)_ptyRecordingFilenameForTermId:(NSString *)termid
+{
+    // $(PTYRecordingDirectory)/YYYYMMDD_HHMMSS.wNtNpN.$(PID).$(RANDOM).itermrec
+    NSString *directory =
+        [[NSUserDefaults standardUserDefaults] stringForKey:@"PTYRecordingDirectory"];
+    if (![directory length]) {
+        return nil;
+    }
+    return [NSString stringWithFormat:@"%@/%@.%@.%d.%0x.itermrec",
+            [directory stringByExpandingTildeInPath],
+            [[NSDate date] descriptionWithCalendarFormat:@"%Y%m%d_%H%M%S"
+                                                timeZone:nil
+                                                  locale:nil],
+            termid,
+            (int)getpid(),
+            (int)arc4random()];
+}
+
+- (void)_startArchivingScrollbackIfNeeded
+{
+    if ([SCREEN scrollbackArchivePath]) {
+        return;
+    }
+    NSString *archivePath = [self _scrollbackArchiveFilename];
+    if (archivePath && ![SCREEN startArchivingScrollbackToFile:archivePath]) {
+        NSLog(@"Couldn't archive scrollback to %@", archivePath);
+    }
+}
+
+// Takes over a child kept alive by the PTY server instead of launching one. What it wrote while
+// the app was away is read as though it had just arrived.
+- (void)_attachToServerChild:(PTYServerChildInfo *)child
+{
+    [SHELL attachToFileDescriptor:child->fd_ pid:child->pid_ tty:child->tty_];
+    child->fd_ = -1;
+    [self _startArchivingScrollbackIfNeeded];
+    [SHELL startIO];
+    [SHELL setWidth:[SCREEN width] height:[SCREEN height]];
+    if ([child->output_ length]) {
+        [self readTask:child->output_];
+    }
+}
+
+- (void)handOffToServer
+{
+    [handedOffServerKey_ release];
+    handedOffServerKey_ = [[self serverKey] copy];
+    [SHELL detachFromChild];
+}
+
+- (NSString *)serverKey
+{
+    if (handedOffServerKey_) {
+        return handedOffServerKey_;
+    }
+    if ([SHELL pid] <= 0 || ![SHELL tty]) {
+        return nil;
+    }
+    return [NSString stringWithFormat:@"%@ %d", [SHELL tty], (int)[SHELL pid]];
+}
+
+// Is a live session writing to the archive at |path|? It might be if a saved arrangement is opened
+// while the session it was saved from is still around.
++ (BOOL)_scrollbackArchiveIsInUse:(NSString *)path
+{
+    for (PseudoTerminal *term in [[iTermController sharedInstance] terminals]) {
+        for (PTYSession *session in [term sessions]) {
+            if ([[[session SCREEN] scrollbackArchivePath] isEqualToString:path]) {
+                return YES;
+            }
+        }
+    }
+    return NO;
+}
+
 - (BOOL)shouldSetCtype {
     return ![[NSUserDefaults standardUserDefaults] boolForKey:@"DoNotSetCtype"];
 }
@@ -911,15 +1276,40 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     if ([addressBookEntry objectForKey:KEY_NAME]) {
         [env setObject:[addressBookEntry objectForKey:KEY_NAME] forKey:@"ITERM_PROFILE"];
     }
+    PTYTask *pooledTask = [[ShellLaunchPool sharedInstance] taskForPath:path
+                                                              arguments:argv
+                                                            environment:env
+                                                                  width:[SCREEN width]
+                                                                 height:[SCREEN height]
+                                                                 isUTF8:isUTF8];
+    if (pooledTask) {
+        [pooledTask setDelegate:self];
+        [self setSHELL:pooledTask];
+    }
     if ([[addressBookEntry objectForKey:KEY_AUTOLOG] boolValue]) {
         [SHELL loggingStartWithPath:[self _autoLogFilenameForTermId:itermId]];
     }
-    [SHELL launchWithPath:path
-                arguments:argv
-              environment:env
-                    width:[SCREEN width]
-                   height:[SCREEN height]
-                   isUTF8:isUTF8];
+    NSString *dvrPath = [self _instantReplayRecordingFilenameForTermId:itermId];
+    if (dvrPath && [SCREEN dvr] && ![[SCREEN dvr] startRecordingToFile:dvrPath]) {
+        NSLog(@"Couldn't record instant replay to %@", dvrPath);
+    }
+    NSString *recordingPath = [self _ptyRecordingFilenameForTermId:itermId];
+    if (recordingPath && ![SHELL startRecordingToPath:recordingPath
+                                                width:[SCREEN width]
+                                               height:[SCREEN height]]) {
+        NSLog(@"Couldn't record pty output to %@", recordingPath);
+    }
+    [self _startArchivingScrollbackIfNeeded];
+    if (pooledTask) {
+        [SHELL startIO];
+    } else {
+        [SHELL launchWithPath:path
+                    arguments:argv
+                  environment:env
+                        width:[SCREEN width]
+                       height:[SCREEN height]
+                       isUTF8:isUTF8];
+    }
     NSString *initialText = [addressBookEntry objectForKey:KEY_INITIAL_TEXT];
     if ([initialText length]) {
         [SHELL writeTask:[initialText dataUsingEncoding:[self encoding]]];
@@ -987,6 +1377,7 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     if ([[self TEXTVIEW] isFindingCursor]) {
         [[self TEXTVIEW] endFindCursor];
     }
+    [gridExporter_ close];
     if (EXIT) {
         [self _maybeWarnAboutShortLivedSessions];
     }
@@ -1028,7 +1419,10 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     }
 
     EXIT = YES;
+    [self stopReplayingPtyRecording];
+    [parseQueue_ invalidate];
     [SHELL stop];
+    [SCREEN discardScrollbackArchive];
 
     // final update of display
     [self updateDisplay];
@@ -1048,13 +1442,14 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
         [[view findViewController] setDelegate:nil];
     }
 
-    [updateTimer invalidate];
-    [updateTimer release];
-    updateTimer = nil;
+    [[FrameScheduler sharedInstance] unscheduleClient:self];
 
-    if (slowPasteTimer) {
+    if ([self isPasting]) {
         [slowPasteTimer invalidate];
         slowPasteTimer = nil;
+        pasteWaitingForRoom_ = NO;
+        [pasteStream_ release];
+        pasteStream_ = nil;
         [eventQueue_ removeAllObjects];
     }
     
@@ -1071,6 +1466,8 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
         debugKeyDown = [[[NSUserDefaults standardUserDefaults] objectForKey:@"DebugKeyDown"] boolValue];
         checkedDebug = YES;
     }
+    BLog(kBinaryLogCategoryInput, "writeTask %p: %d bytes, first %02x",
+         self, (int)[data length], [data length] ? ((const unsigned char *)[data bytes])[0] : 0);
     if (debugKeyDown || gDebugLogging) {
         NSArray *stack = [NSThread callStackSymbols];
         if (debugKeyDown) {
@@ -1097,6 +1494,8 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
             [self setBell:NO];
             PTYScroller* ptys = (PTYScroller*)[SCROLLVIEW verticalScroller];
             [SHELL writeTask:data];
+            [[InputLatencyProfiler sharedInstance] recordStage:kInputLatencyStageSessionWrite
+                                                    forSession:self];
             [ptys setUserScroll:NO];
         }
     } else {
@@ -1166,10 +1565,78 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
         }
         return;
     }
+    [self launchDeferredProgramIfNeeded];
     self.currentMarkOrNotePosition = nil;
     [self writeTaskImpl:data];
 }
 
+- (void)replayPtyRecording:(PTYRecording *)recording atOriginalSpeed:(BOOL)originalSpeed
+{
+    [self stopReplayingPtyRecording];
+    DLog(@"Replay pty recording of %d events, %lld bytes, %.1f s %@",
+         [recording numberOfEvents], [recording numberOfBytes], [recording duration],
+         originalSpeed ? @"at its original speed" : @"as fast as possible");
+    replayRecording_ = [recording retain];
+    replayIndex_ = 0;
+    replayAtOriginalSpeed_ = originalSpeed;
+    replayStartTime_ = [NSDate timeIntervalSinceReferenceDate];
+    [self _replayNextPtyRecordingEvents];
+}
+
+- (BOOL)isReplayingPtyRecording
+{
+    return replayRecording_ != nil;
+}
+
+- (void)stopReplayingPtyRecording
+{
+    [NSObject cancelPreviousPerformRequestsWithTarget:self
+                                             selector:@selector(_replayNextPtyRecordingEvents)
+                                               object:nil];
+    [replayRecording_ release];
+    replayRecording_ = nil;
+}
+
+// Replays the events that are due, then schedules itself for the next one. At full speed events
+// are replayed for kPtyReplayTimeSlice at a time, so the session draws between slices as it would
+// while reading a flood of output.
+- (void)_replayNextPtyRecordingEvents
+{
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    const int numberOfEvents = [replayRecording_ numberOfEvents];
+    while (!EXIT && replayIndex_ < numberOfEvents) {
+        NSTimeInterval delay = -1;
+        if (replayAtOriginalSpeed_) {
+            delay = replayStartTime_ + [replayRecording_ timeOfEventAtIndex:replayIndex_] - now;
+        } else if ([NSDate timeIntervalSinceReferenceDate] - now > kPtyReplayTimeSlice) {
+            delay = 0;
+        }
+        if (delay >= 0) {
+            [self performSelector:@selector(_replayNextPtyRecordingEvents)
+                       withObject:nil
+                       afterDelay:delay];
+            return;
+        }
+
+        const int i = replayIndex_++;
+        if ([replayRecording_ typeOfEventAtIndex:i] == kPTYRecordingEventRead) {
+            [self readTask:[replayRecording_ dataOfEventAtIndex:i]];
+        } else {
+            const int width = [replayRecording_ widthOfEventAtIndex:i];
+            const int height = [replayRecording_ heightOfEventAtIndex:i];
+            if (width != [SCREEN width] || height != [SCREEN height]) {
+                [[[self tab] realParentWindow] sessionInitiatedResize:self
+                                                                width:width
+                                                               height:height];
+            }
+        }
+    }
+    DLog(@"Finished replaying pty recording in %.1f s",
+         [NSDate timeIntervalSinceReferenceDate] - replayStartTime_);
+    [replayRecording_ release];
+    replayRecording_ = nil;
+}
+
 - (void)readTask:(NSData*)data
 {
     if ([data length] == 0 || EXIT) {
@@ -1178,6 +1645,8 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     if ([SHELL hasMuteCoprocess]) {
         return;
     }
+    BLog(kBinaryLogCategorySession, "readTask %p: %d bytes, last %02x",
+         self, (int)[data length], ((const unsigned char *)[data bytes])[[data length] - 1]);
     if (gDebugLogging) {
       const char* bytes = [data bytes];
       int length = [data length];
@@ -1187,32 +1656,72 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
         if (tmuxLogging_) {
             [self printTmuxCommandOutputToScreen:[[[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] autorelease]];
         }
+        const int length = [data length];
         data = [tmuxGateway_ readTask:data];
+        [activity_ addBytes:length - [data length]];
         if (!data) {
             // All data was consumed.
             return;
         }
     }
 
-    [TERMINAL putStreamData:data];
+    // The parser reads straight out of |data|, which may be one of PTYTask's reusable read
+    // buffers, so it must stop borrowing it before this method returns.
+    VT100Terminal *terminal = [[TERMINAL retain] autorelease];
+    [terminal putStreamDataWithoutCopying:data];
 
     // while loop to process all the tokens we can get
+    [[TEXTVIEW frameProfiler] beginStage:kFrameProfilerStageParse];
+    const NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    SignpostBegin("parse", [SHELL tty], [data length]);
+    int numTokens = 0;
     while (!EXIT &&
            TERMINAL &&
            tmuxMode_ != TMUX_GATEWAY &&
            [TERMINAL parseNextToken]) {
         // process token
         [TERMINAL executeToken];
+        numTokens++;
     }
+    [activity_ addDuration:[NSDate timeIntervalSinceReferenceDate] - start
+                   toStage:kSessionActivityStageParse];
+    [activity_ addTokens:numTokens];
+    SignpostEnd("parse", [SHELL tty], numTokens);
+    [[TEXTVIEW frameProfiler] endStage:kFrameProfilerStageParse];
+    [terminal stopBorrowingStreamData];
 
+    [self didHandleOutputOfLength:[data length]];
+}
+
+// Called on the main thread after output has been parsed and executed.
+- (void)didHandleOutputOfLength:(int)length
+{
     gettimeofday(&lastOutput, NULL);
     newOutput = YES;
+    contentGeneration_++;
+    [activity_ addBytes:length];
+    MetricsExporterAddBytesParsed(length);
+    floodBytes_ += length;
+    [self updateFloodMode];
+    [[TEXTVIEW frameProfiler] addToCounter:kFrameProfilerCounterBytesParsed amount:length];
+    [[InputLatencyProfiler sharedInstance] recordStage:kInputLatencyStageParsed forSession:self];
 
     // Make sure the screen gets redrawn soonish
     [updateDisplayUntil_ release];
     updateDisplayUntil_ = [[NSDate dateWithTimeIntervalSinceNow:10] retain];
-    if ([[[self tab] parentWindow] currentTab] == [self tab]) {
-        if ([data length] < 1024) {
+    if (![self windowIsShowing]) {
+        if ([self keepsCurrentWhileHidden]) {
+            [self scheduleUpdateIn:kBackgroundSessionIntervalSec];
+        } else {
+            // Nothing to draw into and no tab label to update. -updateVisibility catches up once
+            // the window is shown.
+            needsRefreshWhenVisible_ = YES;
+        }
+    } else if ([[[self tab] parentWindow] currentTab] == [self tab]) {
+        if (length < 1024) {
+            if (length <= kEchoFastPathMaxLength) {
+                [self drawEchoImmediatelyIfPossible];
+            }
             [self scheduleUpdateIn:kFastTimerIntervalSec];
         } else {
             [self scheduleUpdateIn:kSlowTimerIntervalSec];
@@ -1220,27 +1729,314 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     } else {
         [self scheduleUpdateIn:kBackgroundSessionIntervalSec];
     }
-    [[ProcessCache sharedInstance] notifyNewOutput];
+    [[ProcessCache sharedInstance] notifyNewOutputForPid:[SHELL pid]];
+}
+
+// The echo of a keystroke is drawn without waiting for the update timer, as long as it only
+// changed the cursor's line. That keeps the cost bounded: one line, at most once per keystroke.
+- (void)drawEchoImmediatelyIfPossible
+{
+    if (!echoFastPathArmed_) {
+        return;
+    }
+    echoFastPathArmed_ = NO;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    const NSTimeInterval sinceInput =
+        (now.tv_sec - lastInput.tv_sec) + (now.tv_usec - lastInput.tv_usec) / 1000000.0;
+    if (!visible_ ||
+        sinceInput > kEchoFastPathWindow ||
+        [[[self tab] realParentWindow] inInstantReplay]) {
+        return;
+    }
+    if ([TEXTVIEW drawCursorLineImmediatelyIfOnlyChange]) {
+        numEchoFastPaths_++;
+        DLog(@"Drew echo %0.1fms after keystroke (%d times in %@)",
+             sinceInput * 1000, numEchoFastPaths_, self);
+    }
+}
+
+// Runs on the TaskNotifier thread.
+- (BOOL)tryToHandleReadInBackground:(NSData *)data
+{
+    if (EXIT) {
+        return NO;
+    }
+    // Held output is processed as readTask: would, so once some is held the rest must follow it
+    // whatever mode the session is in now. Muted output is thrown away, so its order doesn't matter.
+    if (![SHELL hasMuteCoprocess] && [self holdHiddenOutput:data]) {
+        return YES;
+    }
+    if (!parseQueue_ || [SHELL hasMuteCoprocess] || tmuxMode_ == TMUX_GATEWAY) {
+        return NO;
+    }
+    [parseQueue_ addData:data];
+    return YES;
+}
+
+// Runs on the TaskNotifier thread. Returns NO if |data| should be handled as usual.
+- (BOOL)holdHiddenOutput:(NSData *)data
+{
+    OSSpinLockLock(&hiddenOutputLock_);
+    if (!batchHiddenOutput_ && ![hiddenOutput_ length]) {
+        OSSpinLockUnlock(&hiddenOutputLock_);
+        return NO;
+    }
+    [hiddenOutput_ appendData:data];
+    if ([hiddenOutput_ length] >= kMaxHiddenOutput) {
+        NSData *held = hiddenOutput_;
+        hiddenOutput_ = [[NSMutableData alloc] init];
+        if (parseQueue_) {
+            // Added with the lock held so nothing read later can get in ahead of it.
+            [parseQueue_ addData:held];
+            OSSpinLockUnlock(&hiddenOutputLock_);
+        } else {
+            // Nothing else is read until this returns, so it stays in order.
+            OSSpinLockUnlock(&hiddenOutputLock_);
+            [self performSelectorOnMainThread:@selector(readTask:)
+                                   withObject:held
+                                waitUntilDone:YES];
+        }
+        [held release];
+        return YES;
+    }
+    if (!hiddenOutputFlushScheduled_) {
+        hiddenOutputFlushScheduled_ = YES;
+        [self retain];
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, hiddenOutputInterval_ * NSEC_PER_SEC),
+                       dispatch_get_main_queue(), ^{
+                           [self flushHiddenOutput];
+                           [self release];
+                       });
+    }
+    OSSpinLockUnlock(&hiddenOutputLock_);
+    return YES;
+}
+
+// Handles the output held by -holdHiddenOutput:. Main thread only.
+- (void)flushHiddenOutput
+{
+    OSSpinLockLock(&hiddenOutputLock_);
+    hiddenOutputFlushScheduled_ = NO;
+    NSData *held = nil;
+    if ([hiddenOutput_ length]) {
+        held = hiddenOutput_;
+        hiddenOutput_ = [[NSMutableData alloc] init];
+        if (parseQueue_) {
+            [parseQueue_ addData:held];
+            [held release];
+            held = nil;
+        }
+    }
+    OSSpinLockUnlock(&hiddenOutputLock_);
+    if (held) {
+        // Output read after the lock was released waits for this on the main thread.
+        [self readTask:held];
+        [held release];
+    }
+}
+
+- (void)updateHiddenOutputBatching
+{
+    const NSTimeInterval interval = [[PowerManager sharedInstance] hiddenOutputInterval];
+    const BOOL batch = (!visible_ && tmuxMode_ == TMUX_NONE && interval > 0);
+    hiddenOutputInterval_ = interval;
+    if (batch != batchHiddenOutput_) {
+        batchHiddenOutput_ = batch;
+        if (!batch) {
+            [self flushHiddenOutput];
+        }
+    }
+}
+
+- (void)lowPowerModeDidChange:(NSNotification *)notification
+{
+    [self updateVisibility];
+    [self scheduleUpdateIn:kFastTimerIntervalSec];
+}
+
+- (void)taskWriteBufferHasRoom
+{
+    if (pasteWaitingForRoom_) {
+        [self _pasteAgain];
+    }
+}
+
+#pragma mark - VT100ParseQueueDelegate
+
+- (void)parseQueue:(VT100ParseQueue *)parseQueue didProduceTokenBatch:(VT100TokenBatch *)batch
+{
+    if (!EXIT) {
+        // Apply the whole batch in one pass.
+        VT100Terminal *terminal = [[TERMINAL retain] autorelease];
+        [[TEXTVIEW frameProfiler] beginStage:kFrameProfilerStageParse];
+        const NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+        for (int i = 0; i < batch.numberOfTokens; i++) {
+            if (EXIT || !TERMINAL || tmuxMode_ == TMUX_GATEWAY) {
+                break;
+            }
+            if (floodMode_) {
+                i = [terminal fastForwardTokensInBatch:batch fromIndex:i];
+                if (i == batch.numberOfTokens) {
+                    break;
+                }
+            }
+            [terminal executeTokenAtIndex:i inBatch:batch];
+        }
+        [activity_ addDuration:[NSDate timeIntervalSinceReferenceDate] - start
+                       toStage:kSessionActivityStageApply];
+        [activity_ addDuration:batch.parseDuration toStage:kSessionActivityStageParse];
+        [activity_ addTokens:batch.numberOfTokens];
+        [[TEXTVIEW frameProfiler] endStage:kFrameProfilerStageParse];
+        if (batch.unparsedData) {
+            // tmux took over partway through the batch.
+            [self readTask:batch.unparsedData];
+        }
+        [self didHandleOutputOfLength:batch.numberOfBytesConsumed];
+        [parseQueue setTerminalHeight:[SCREEN height]
+                useColumnScrollRegion:[SCREEN terminalUseColumnScrollRegion]];
+    }
+}
+
+- (void)parseQueue:(VT100ParseQueue *)parseQueue didReceiveUnparsedData:(NSData *)data
+{
+    [self readTask:data];
+}
+
+// May run on the TaskNotifier thread, the parse queue or the main thread.
+- (void)parseQueue:(VT100ParseQueue *)parseQueue setReadingPaused:(BOOL)paused
+{
+    // A tmux pane has no pty of its own. Pausing the gateway would stall every other pane, so a
+    // backlogged tmux pane drops its output instead and catches up with a capture afterwards.
+    if (tmuxMode_ != TMUX_CLIENT) {
+        [SHELL setReadingPaused:paused];
+        return;
+    }
+    tmuxPaneBacklogged_ = paused;
+    if (!paused) {
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self tmuxBacklogDidClear];
+        });
+    }
+}
+
+- (void)tmuxBacklogDidClear
+{
+    if (EXIT || tmuxPaneBacklogged_ || !tmuxOutputDropped_ || tmuxRepaintPending_) {
+        return;
+    }
+    DLog(@"Repainting tmux pane %d after dropping its output", tmuxPane_);
+    tmuxOutputDropped_ = NO;
+    tmuxRepaintPending_ = YES;
+    [tmuxController_ captureRepaintOfWindowPane:tmuxPane_ completion:^(NSData *repaint) {
+        tmuxRepaintPending_ = NO;
+        if (repaint) {
+            // Goes through the parse queue so it lands after the output queued before the drop.
+            [self tmuxReadTask:repaint];
+        }
+    }];
 }
 
 - (void)checkTriggers
 {
-    for (Trigger *trigger in triggers_) {
-        [trigger tryString:triggerLine_ inSession:self];
+    if (pendingTriggerLines_ >= kMaxPendingTriggerLines) {
+        DLog(@"Trigger matching is behind in %@; skipping a line", self);
+        return;
+    }
+    OSAtomicIncrement32(&pendingTriggerLines_);
+    NSString *line = [[triggerLine_ copy] autorelease];
+    TriggerSet *triggerSet = triggerSet_;
+    SessionActivity *activity = activity_;
+    NSString *tty = [SHELL tty];
+    dispatch_async(triggerQueue_, ^{
+        @autoreleasepool {
+            const NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+            SignpostBegin("triggers", tty, [line length]);
+            __block NSMutableArray *matches = nil;
+            [triggerSet enumerateMatchesInString:line
+                                      usingBlock:^(Trigger *trigger, NSArray *values) {
+                                          if (!matches) {
+                                              matches = [NSMutableArray array];
+                                          }
+                                          [matches addObject:@[ trigger, values ]];
+                                      }];
+            SignpostEnd("triggers", tty, [matches count]);
+            [activity addDuration:[NSDate timeIntervalSinceReferenceDate] - start
+                          toStage:kSessionActivityStageTriggers];
+            OSAtomicDecrement32(&pendingTriggerLines_);
+            if (matches) {
+                dispatch_async(dispatch_get_main_queue(), ^{
+                    [self enqueueTriggerMatches:matches];
+                });
+            }
+        }
+    });
+}
+
+// Matches from lines that complete close together are performed together, so a trigger whose
+// action doesn't depend on the match (see -[Trigger isIdempotent]) is performed once for all of
+// them.
+- (void)enqueueTriggerMatches:(NSArray *)matches
+{
+    if (!pendingTriggerMatches_) {
+        pendingTriggerMatches_ = [[NSMutableArray alloc] init];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [self performPendingTriggerActions];
+        });
+    }
+    [pendingTriggerMatches_ addObjectsFromArray:matches];
+}
+
+- (void)performPendingTriggerActions
+{
+    NSArray *matches = [pendingTriggerMatches_ autorelease];
+    pendingTriggerMatches_ = nil;
+    if (EXIT) {
+        return;
+    }
+    TriggerProfiler *profiler = [TriggerProfiler sharedInstance];
+    NSMutableSet *performed = [NSMutableSet set];
+    for (NSArray *match in matches) {
+        Trigger *trigger = [match objectAtIndex:0];
+        if ([trigger isIdempotent]) {
+            if ([performed containsObject:trigger]) {
+                continue;
+            }
+            [performed addObject:trigger];
+        }
+        NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+        [trigger performActionWithValues:[match objectAtIndex:1] inSession:self];
+        const NSTimeInterval duration = [NSDate timeIntervalSinceReferenceDate] - start;
+        [profiler recordActionOfTriggerWithKey:trigger.profileKey duration:duration];
+        [activity_ addDuration:duration toStage:kSessionActivityStageTriggers];
     }
 }
 
 - (void)appendStringToTriggerLine:(NSString *)s
 {
-    const int kMaxTriggerLineLength = 1024;
-    if ([triggers_ count] && [triggerLine_ length] + [s length] < kMaxTriggerLineLength) {
+    if ([[triggerSet_ triggers] count] &&
+        [triggerLine_ length] + [s length] < kMaxTriggerLineLength) {
         [triggerLine_ appendString:s];
     }
 }
 
+- (void)appendAsciiBytesToTriggerLine:(const unsigned char *)bytes length:(int)length
+{
+    // Most sessions have no triggers, so don't make a string unless it'll be kept.
+    if ([[triggerSet_ triggers] count] &&
+        [triggerLine_ length] + length < kMaxTriggerLineLength) {
+        NSString *string = [[NSString alloc] initWithBytesNoCopy:(void *)bytes
+                                                          length:length
+                                                        encoding:NSASCIIStringEncoding
+                                                    freeWhenDone:NO];
+        [triggerLine_ appendString:string];
+        [string release];
+    }
+}
+
 - (void)clearTriggerLine
 {
-    if ([triggers_ count]) {
+    if ([[triggerSet_ triggers] count]) {
         [self checkTriggers];
         [triggerLine_ setString:@""];
     }
@@ -1574,9 +2370,13 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     }
 }
 
+- (NSUInteger)remainingPasteLength {
+    return [pasteStream_ remainingLength];
+}
+
 - (void)showPasteUI {
     pasteViewController_ = [[PasteViewController alloc] initWithContext:pasteContext_
-                                                                 length:slowPasteBuffer.length];
+                                                                 length:[self remainingPasteLength]];
     pasteViewController_.delegate = self;
     pasteViewController_.view.frame = NSMakeRect(20,
                                                  view.frame.size.height - pasteViewController_.view.frame.size.height,
@@ -1593,60 +2393,73 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
 }
 
 - (void)updatePasteUI {
-    [pasteViewController_ setRemainingLength:slowPasteBuffer.length];
-}
-
-- (NSData *)dataByRemovingControlCodes:(NSData *)data {
-    NSMutableData *output = [NSMutableData dataWithCapacity:[data length]];
-    const unsigned char *p = data.bytes;
-    int start = 0;
-    int i = 0;
-    for (i = 0; i < data.length; i++) {
-        if (p[i] < ' ' && p[i] != '\n' && p[i] != '\r' && p[i] != '\t' && p[i] != 12) {
-            if (i > start) {
-                [output appendBytes:p + start length:i - start];
-            }
-            start = i + 1;
+    if (!pasteViewController_ && pasteIsFlowControlled_) {
+        // Show progress once the program has shown how fast it reads and the rest looks like it
+        // will take a while.
+        const double rate = [pasteContext_ measuredRate];
+        if (rate > 0 && [self remainingPasteLength] / rate > kPasteUIMinimumDuration) {
+            [self showPasteUI];
         }
     }
-    if (i > start) {
-        [output appendBytes:p + start length:i - start];
-    }
-    return output;
+    [pasteViewController_ setRemainingLength:[self remainingPasteLength]];
 }
 
-- (void)_pasteStringImmediately:(NSString*)aString
+// Adds |aString| to the end of what remains to be pasted. It's converted to bytes a chunk at a
+// time as it's sent.
+- (void)_appendToPasteBuffer:(NSString *)aString escapingShellCharacters:(BOOL)escape
 {
-    if ([aString length] > 0) {
-        NSData *data = [aString dataUsingEncoding:[TERMINAL encoding]
-                             allowLossyConversion:YES];
-        NSData *safeData = [self dataByRemovingControlCodes:data];
-        [self writeTask:safeData];
-
+    if (!pasteStream_) {
+        pasteStream_ = [[PasteStream alloc] initWithEncoding:[TERMINAL encoding]];
     }
+    [pasteStream_ appendString:aString escapingShellCharacters:escape];
 }
 
 - (void)_pasteAgain {
-    NSRange range;
-    range.location = 0;
-    range.length = MIN(pasteContext_.bytesPerCall, [slowPasteBuffer length]);
-    [self _pasteStringImmediately:[slowPasteBuffer substringWithRange:range]];
-    [slowPasteBuffer deleteCharactersInRange:range];
+    slowPasteTimer = nil;
+    pasteWaitingForRoom_ = NO;
+    if (pasteIsFlowControlled_ && [pasteContext_ hasCustomRate]) {
+        // The user picked a rate from the paste view.
+        pasteIsFlowControlled_ = NO;
+    }
+
+    NSUInteger length;
+    if (pasteIsFlowControlled_) {
+        const NSUInteger queued = [SHELL writeBufferLength];
+        length = queued < kPasteWriteBufferTarget ? kPasteWriteBufferTarget - queued : 0;
+    } else {
+        length = pasteContext_.bytesPerCall;
+    }
+    if (length > 0) {
+        NSData *data = [pasteStream_ readDataOfMaxLength:length];
+        if ([data length]) {
+            [self writeTask:data];
+            [pasteContext_ didSendBytes:[data length]];
+        }
+    }
     [self updatePasteUI];
-    if ([slowPasteBuffer length] > 0) {
-        [pasteContext_ updateValues];
-        slowPasteTimer = [NSTimer scheduledTimerWithTimeInterval:pasteContext_.delayBetweenCalls
-                                                          target:self
-                                                        selector:@selector(_pasteAgain)
-                                                        userInfo:nil
-                                                         repeats:NO];
+
+    if ([self remainingPasteLength] > 0) {
+        if (pasteIsFlowControlled_) {
+            pasteWaitingForRoom_ = YES;
+            [SHELL notifyWhenWriteBufferIsShorterThan:kPasteWriteBufferTarget / 2];
+        } else {
+            [pasteContext_ updateValues];
+            slowPasteTimer = [TimerWheel scheduledTimerWithTimeInterval:pasteContext_.delayBetweenCalls
+                                                                 leeway:0
+                                                                 target:self
+                                                               selector:@selector(_pasteAgain)
+                                                               userInfo:nil
+                                                                repeats:NO
+                                                               category:@"Paste"];
+        }
     } else {
         if ([TERMINAL bracketedPasteMode]) {
             [self writeTask:[[NSString stringWithFormat:@"%c[201~", 27]
                              dataUsingEncoding:[TERMINAL encoding]
                              allowLossyConversion:YES]];
         }
-        slowPasteTimer = nil;
+        [pasteStream_ release];
+        pasteStream_ = nil;
         [self hidePasteUI];
         [pasteContext_ release];
         pasteContext_ = nil;
@@ -1654,18 +2467,27 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     }
 }
 
+// A paced paste sends bytesPerCall bytes every delayBetweenCalls seconds. Otherwise the paste is
+// flow-controlled unless the user has set a rate, or there's no write buffer to watch because the
+// bytes go to tmux or to every session.
 - (void)_pasteWithBytePerCallPrefKey:(NSString*)bytesPerCallKey
                         defaultValue:(int)bytesPerCallDefault
             delayBetweenCallsPrefKey:(NSString*)delayBetweenCallsKey
                         defaultValue:(float)delayBetweenCallsDefault
+                               paced:(BOOL)paced
 {
     [pasteContext_ release];
     pasteContext_ = [[PasteContext alloc] initWithBytesPerCallPrefKey:bytesPerCallKey
                                                          defaultValue:bytesPerCallDefault
                                              delayBetweenCallsPrefKey:delayBetweenCallsKey
                                                          defaultValue:delayBetweenCallsDefault];
-    const int kPasteBytesPerSecond = 10000;  // This is a wild-ass guess.
-    if (pasteContext_.delayBetweenCalls * slowPasteBuffer.length / pasteContext_.bytesPerCall + slowPasteBuffer.length / kPasteBytesPerSecond > 3) {
+    pasteIsFlowControlled_ = (!paced &&
+                              ![pasteContext_ hasCustomRate] &&
+                              tmuxMode_ != TMUX_CLIENT &&
+                              ![[[self tab] realParentWindow] broadcastInputToSession:self]);
+    if (!pasteIsFlowControlled_ &&
+        pasteContext_.delayBetweenCalls * [self remainingPasteLength] / pasteContext_.bytesPerCall >
+            kPasteUIMinimumDuration) {
         [self showPasteUI];
     }
 
@@ -1679,7 +2501,8 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     [self _pasteWithBytePerCallPrefKey:@"SlowPasteBytesPerCall"
                           defaultValue:16
               delayBetweenCallsPrefKey:@"SlowPasteDelayBetweenCalls"
-                          defaultValue:0.125];
+                          defaultValue:0.125
+                                 paced:YES];
 }
 
 - (void)_pasteStringMore
@@ -1687,16 +2510,17 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     [self _pasteWithBytePerCallPrefKey:@"QuickPasteBytesPerCall"
                           defaultValue:1024
               delayBetweenCallsPrefKey:@"QuickPasteDelayBetweenCalls"
-                          defaultValue:0.01];
+                          defaultValue:0.01
+                                 paced:NO];
 }
 
-- (void)_pasteString:(NSString *)aString
+- (void)_pasteString:(NSString *)aString escapingShellCharacters:(BOOL)escape
 {
     if ([aString length] > 0) {
         // This is the "normal" way of pasting. It's fast but tends not to
         // outrun a shell's ability to read from its buffer. Why this crazy
         // thing? See bug 1031.
-        [slowPasteBuffer appendString:[aString stringWithLinefeedNewlines]];
+        [self _appendToPasteBuffer:aString escapingShellCharacters:escape];
         [self _pasteStringMore];
     } else {
         NSBeep();
@@ -1713,7 +2537,7 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
                          dataUsingEncoding:[TERMINAL encoding]
                          allowLossyConversion:YES]];
     }
-    [self _pasteString:aString];
+    [self _pasteString:aString escapingShellCharacters:NO];
 }
 
 - (void)deleteBackward:(id)sender
@@ -1746,6 +2570,11 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     return [SHELL hasCoprocess];
 }
 
+- (BOOL)textViewIsFastForwarding
+{
+    return floodMode_;
+}
+
 - (void) textViewResized:(NSNotification *) aNotification;
 {
     int w;
@@ -1838,6 +2667,7 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     int i;
     NSDictionary *aDict;
 
+    contentGeneration_++;
     aDict = aePrefs;
     if (aDict == nil) {
         aDict = [[ProfileModel sharedInstance] defaultBookmark];
@@ -1933,13 +2763,13 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     } else {
         nonasciiAA = [[aDict objectForKey:KEY_ANTI_ALIASING] boolValue];
     }
-    [triggers_ release];
-    triggers_ = [[NSMutableArray alloc] init];
-    for (NSDictionary *triggerDict in [aDict objectForKey:KEY_TRIGGERS]) {
-        Trigger *trigger = [Trigger triggerFromDict:triggerDict];
-        if (trigger) {
-            [triggers_ addObject:trigger];
-        }
+    NSArray *triggerDicts = [aDict objectForKey:KEY_TRIGGERS];
+    if (!triggerDicts) {
+        triggerDicts = [NSArray array];
+    }
+    if (![[triggerSet_ dictionaries] isEqualToArray:triggerDicts]) {
+        [triggerSet_ release];
+        triggerSet_ = [[TriggerSet alloc] initWithDictionaries:triggerDicts];
     }
     [TEXTVIEW setSmartSelectionRules:[aDict objectForKey:KEY_SMART_SELECTION_RULES]];
     [TEXTVIEW setTrouterPrefs:[aDict objectForKey:KEY_TROUTER]];
@@ -2136,11 +2966,16 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     [[self tab] nameOfSession:self didChangeTo:[self name]];
     [self setBell:NO];
 
-    // get the session submenu to be rebuilt
+    // get the session submenu to be rebuilt, just once for a burst of name changes
     if ([[iTermController sharedInstance] currentTerminal] == [[self tab] parentWindow]) {
-        [[NSNotificationCenter defaultCenter] postNotificationName:@"iTermNameOfSessionDidChange"
-                                                            object:[[self tab] parentWindow]
-                                                          userInfo:nil];
+        NSNotification *notification =
+            [NSNotification notificationWithName:@"iTermNameOfSessionDidChange"
+                                          object:[[self tab] parentWindow]];
+        [[NSNotificationQueue defaultQueue] enqueueNotification:notification
+                                                   postingStyle:NSPostASAP
+                                                   coalesceMask:(NSNotificationCoalescingOnName |
+                                                                 NSNotificationCoalescingOnSender)
+                                                       forModes:nil];
     }
 }
 
@@ -2322,6 +3157,132 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     return [TEXTVIEW content];
 }
 
+- (NSNumber *)contentGeneration
+{
+    return @([SCREEN contentGeneration]);
+}
+
+- (SessionActivity *)activity
+{
+    return activity_;
+}
+
+- (NSNumber *)cpuUsage
+{
+    return @(activity_.cpuFraction * 100);
+}
+
+- (NSString *)activityDescription
+{
+    return [activity_ shortDescription];
+}
+
+// 0 if there's no limit beyond the usual update intervals.
+- (double)maximumFramesPerSecond
+{
+    const BOOL keyWindow = [[[[self tab] realParentWindow] window] isKeyWindow];
+    const double limit = [[PowerManager sharedInstance] maximumFramesPerSecondInKeyWindow:keyWindow];
+    if (floodMode_ && (limit == 0 || limit > kFloodModeFramesPerSecond)) {
+        return kFloodModeFramesPerSecond;
+    }
+    return limit;
+}
+
+- (double)floodModeScreensPerSecond
+{
+    NSNumber *value =
+        [[NSUserDefaults standardUserDefaults] objectForKey:@"FloodModeScreensPerSecond"];
+    return value ? [value doubleValue] : kDefaultFloodModeScreensPerSecond;
+}
+
+// Called as output is handled, and by floodTimer_ in flood mode.
+- (void)updateFloodMode
+{
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    const NSTimeInterval elapsed = now - floodSampleTime_;
+    if (elapsed < kFloodModeSampleInterval) {
+        return;
+    }
+    const int screenSize = MAX(1, [SCREEN width] * [SCREEN height]);
+    const double screensPerSecond = floodBytes_ / elapsed / screenSize;
+    floodBytes_ = 0;
+    floodSampleTime_ = now;
+
+    const double threshold = [self floodModeScreensPerSecond];
+    if (!floodMode_) {
+        if (threshold > 0 && screensPerSecond > threshold) {
+            [self setFloodMode:YES];
+        }
+    } else if (threshold > 0 && screensPerSecond >= threshold / 4) {
+        floodCalmSince_ = 0;
+    } else if (!floodCalmSince_) {
+        floodCalmSince_ = now;
+    } else if (now - floodCalmSince_ >= kFloodModeExitDelay) {
+        [self setFloodMode:NO];
+    }
+}
+
+- (void)setFloodMode:(BOOL)floodMode
+{
+    DLog(@"%@ flood mode for %@", floodMode ? @"Begin" : @"End", self);
+    floodMode_ = floodMode;
+    floodCalmSince_ = 0;
+    [floodTimer_ invalidate];
+    [floodTimer_ release];
+    floodTimer_ = nil;
+    if (floodMode) {
+        floodTimer_ = [[TimerWheel scheduledTimerWithTimeInterval:kFloodModeSampleInterval
+                                                           leeway:kFloodModeSampleInterval / 4
+                                                           target:self
+                                                         selector:@selector(updateFloodMode)
+                                                         userInfo:nil
+                                                          repeats:YES
+                                                         category:@"FloodMode"] retain];
+    }
+    // Show or hide the indicator, and catch up on the rows that went by.
+    [TEXTVIEW setNeedsDisplay:YES];
+    [self scheduleUpdateIn:kFastTimerIntervalSec];
+}
+
+- (double)effectiveFramesPerSecond
+{
+    const double maximumFramesPerSecond = [self maximumFramesPerSecond];
+    return maximumFramesPerSecond > 0 ? maximumFramesPerSecond : 1.0 / kFastTimerIntervalSec;
+}
+
+- (NSNumber *)frameRateLimit
+{
+    return @([self effectiveFramesPerSecond]);
+}
+
+- (NSNumber *)firstLineNumber
+{
+    return @([SCREEN totalScrollbackOverflow]);
+}
+
+- (NSNumber *)endLineNumber
+{
+    return @([SCREEN totalScrollbackOverflow] + [SCREEN numberOfLines]);
+}
+
+- (void)addToMemoryReport:(MemoryReport *)report
+{
+    NSString *tty = [self tty];
+    [report beginSectionWithName:tty ? [NSString stringWithFormat:@"%@ (%@)", [self name], tty]
+                                     : [self name]];
+    [SCREEN addToMemoryReport:report];
+    [TEXTVIEW addToMemoryReport:report];
+    [report addBytes:[SHELL writeBufferLength] forCategory:@"Pending writes"];
+    [report addBytes:[pasteStream_ memoryUsage] forCategory:@"Paste in progress"];
+}
+
+- (NSString *)memoryReport
+{
+    MemoryReport *report = [[[MemoryReport alloc] init] autorelease];
+    [self addToMemoryReport:report];
+    return [report formattedReport];
+}
+
 - (BOOL)backgroundImageTiled
 {
     return backgroundImageTiled;
@@ -2353,11 +3314,11 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
         } else {
             backgroundImagePath = imageFilePath;
         }
-        NSImage *anImage = [[NSImage alloc] initWithContentsOfFile:backgroundImagePath];
+        // Sessions with the same image share one copy of it.
+        NSImage *anImage = [BackgroundImageCache imageWithContentsOfFile:backgroundImagePath];
         if (anImage != nil) {
             [SCROLLVIEW setDrawsBackground:NO];
             [SCROLLVIEW setBackgroundImage:anImage asPattern:[self backgroundImageTiled]];
-            [anImage release];
         } else {
             [SCROLLVIEW setDrawsBackground:YES];
             [backgroundImagePath release];
@@ -2522,11 +3483,14 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     }
 
     if (set) {
-        antiIdleTimer = [[NSTimer scheduledTimerWithTimeInterval:30
-                                                          target:self
-                                                        selector:@selector(doAntiIdle)
-                                                        userInfo:nil
-                repeats:YES] retain];
+        // Nobody minds if a keep-alive is a second late.
+        antiIdleTimer = [[TimerWheel scheduledTimerWithTimeInterval:30
+                                                             leeway:1
+                                                             target:self
+                                                           selector:@selector(doAntiIdle)
+                                                           userInfo:nil
+                                                            repeats:YES
+                                                           category:@"AntiIdle"] retain];
     } else {
         [antiIdleTimer invalidate];
         [antiIdleTimer release];
@@ -2714,16 +3678,44 @@ static NSString *kTmuxFontChanged = @"kTmuxFontChanged";
     }
 }
 
+static BOOL PTYSessionObjectsEqual(id a, id b) {
+    return a == b || [a isEqual:b];
+}
+
 - (NSDictionary*)arrangement
 {
+    NSString* pwd = launchDeferred_ ? deferredLaunchCwd_ : [SHELL getWorkingDirectory];
+    if (!pwd) {
+        pwd = @"";
+    }
+    NSString *archivePath = [SCREEN scrollbackArchivePath];
+    NSString *serverKey = [PTYServerClient isEnabled] ? [self serverKey] : nil;
+    if (arrangement_ &&
+        [arrangement_[SESSION_ARRANGEMENT_COLUMNS] intValue] == [SCREEN width] &&
+        [arrangement_[SESSION_ARRANGEMENT_ROWS] intValue] == [SCREEN height] &&
+        arrangement_[SESSION_ARRANGEMENT_BOOKMARK] == addressBookEntry &&
+        PTYSessionObjectsEqual(arrangement_[SESSION_ARRANGEMENT_BOOKMARK_NAME], bookmarkName) &&
+        [arrangement_[SESSION_ARRANGEMENT_WORKING_DIRECTORY] isEqualToString:pwd] &&
+        PTYSessionObjectsEqual(arrangement_[SESSION_ARRANGEMENT_SCROLLBACK_ARCHIVE], archivePath) &&
+        PTYSessionObjectsEqual(arrangement_[SESSION_ARRANGEMENT_SERVER_KEY], serverKey)) {
+        return [[arrangement_ retain] autorelease];
+    }
+
     NSMutableDictionary* result = [NSMutableDictionary dictionaryWithCapacity:3];
     [result setObject:[NSNumber numberWithInt:[SCREEN width]] forKey:SESSION_ARRANGEMENT_COLUMNS];
     [result setObject:[NSNumber numberWithInt:[SCREEN height]] forKey:SESSION_ARRANGEMENT_ROWS];
     [result setObject:addressBookEntry forKey:SESSION_ARRANGEMENT_BOOKMARK];
     result[SESSION_ARRANGEMENT_BOOKMARK_NAME] = bookmarkName;
-    NSString* pwd = [SHELL getWorkingDirectory];
-    [result setObject:pwd ? pwd : @"" forKey:SESSION_ARRANGEMENT_WORKING_DIRECTORY];
-    return result;
+    [result setObject:pwd forKey:SESSION_ARRANGEMENT_WORKING_DIRECTORY];
+    if (archivePath) {
+        [result setObject:archivePath forKey:SESSION_ARRANGEMENT_SCROLLBACK_ARCHIVE];
+    }
+    if (serverKey) {
+        result[SESSION_ARRANGEMENT_SERVER_KEY] = serverKey;
+    }
+    [arrangement_ release];
+    arrangement_ = [result copy];
+    return [[arrangement_ retain] autorelease];
 }
 
 + (NSDictionary *)arrangementFromTmuxParsedLayout:(NSDictionary *)parseNode
@@ -2764,9 +3756,59 @@ static long long timeInTenthsOfSeconds(struct timeval t)
     return t.tv_sec * 10 + t.tv_usec / 100000;
 }
 
+- (void)frameSchedulerRefresh
+{
+    [self updateDisplay];
+}
+
+// Is this session's window onscreen and not hidden, minimized, or completely covered? Says nothing
+// about whether this session's tab is selected.
+- (BOOL)windowIsShowing
+{
+    NSWindow *window = [[[self tab] realParentWindow] window];
+    if (!window || ![window isVisible] || [window isMiniaturized]) {
+        return NO;
+    }
+#if MAC_OS_X_VERSION_MAX_ALLOWED >= 1090
+    if ([window respondsToSelector:@selector(occlusionState)] &&
+        !([window occlusionState] & NSWindowOcclusionStateVisible)) {
+        return NO;
+    }
+#endif
+    return YES;
+}
+
+- (BOOL)isVisible
+{
+    return visible_;
+}
+
+// A prewarmed hotkey window is drawn while it's hidden, at the background rate and only when there
+// was output, so showing it is just ordering it front.
+- (BOOL)keepsCurrentWhileHidden
+{
+    HotkeyWindowController *hotkeyWindowController = [HotkeyWindowController sharedInstance];
+    return ([hotkeyWindowController prewarmsHotkeyWindow] &&
+            [[self tab] realParentWindow] == [hotkeyWindowController hotKeyWindow]);
+}
+
+- (void)updateVisibility
+{
+    BOOL wasVisible = visible_;
+    visible_ = ([[iTermExpose sharedInstance] isVisible] ||
+                ([[self tab] isForegroundTab] && [self windowIsShowing]));
+    [self updateHiddenOutputBatching];
+    if (visible_ && !wasVisible && needsRefreshWhenVisible_) {
+        needsRefreshWhenVisible_ = NO;
+        [TEXTVIEW setNeedsDisplay:YES];
+        [self refreshAndStartTimerIfNeeded];
+    }
+}
+
 - (void)updateDisplay
 {
-    timerRunning_ = YES;
+    lastUpdateDisplayTime_ = [NSDate timeIntervalSinceReferenceDate];
+    [self updateVisibility];
     BOOL anotherUpdateNeeded = [NSApp isActive];
     if (!anotherUpdateNeeded &&
         updateDisplayUntil_ &&
@@ -2809,24 +3851,62 @@ static long long timeInTenthsOfSeconds(struct timeval t)
         }
     }
 
-    anotherUpdateNeeded |= [TEXTVIEW refresh];
+    if (visible_) {
+        anotherUpdateNeeded |= [TEXTVIEW refresh];
+    } else if ([[self tab] isForegroundTab] && ![self windowIsShowing] && [self keepsCurrentWhileHidden]) {
+        // The window keeps its backing store while ordered out, so this draws into it.
+        [TEXTVIEW refresh];
+        [TEXTVIEW displayIfNeeded];
+    } else {
+        needsRefreshWhenVisible_ = YES;
+    }
     anotherUpdateNeeded |= [[[self tab] parentWindow] tempTitle];
+    [self exportGrid];
 
-    if (anotherUpdateNeeded) {
+    // Timers for hidden windows would do nothing useful. The window's delegate calls
+    // -updateDisplay again when it's shown.
+    if (anotherUpdateNeeded && [self windowIsShowing]) {
         if ([[[self tab] parentWindow] currentTab] == [self tab]) {
             [self scheduleUpdateIn:[[PreferencePanel sharedInstance] timeBetweenBlinks]];
         } else {
             [self scheduleUpdateIn:kBackgroundSessionIntervalSec];
         }
-    } else {
-        [updateTimer release];
-        updateTimer = nil;
     }
 
-    if (tailFindTimer_ && [[[view findViewController] view] isHidden]) {
+    if (tailFindContext_.substring && [[[view findViewController] view] isHidden]) {
         [self stopTailFind];
     }
-    timerRunning_ = NO;
+}
+
+- (void)exportGrid
+{
+    static NSString *directory;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        directory = [[[NSUserDefaults standardUserDefaults] stringForKey:@"GridExportDirectory"] copy];
+    });
+    if (!directory || gridExportFailed_ || EXIT) {
+        return;
+    }
+    if (!gridExporter_) {
+        if (![self tty]) {
+            return;
+        }
+        NSString *filename = [[[self tty] lastPathComponent] stringByAppendingPathExtension:@"grid"];
+        gridExporter_ = [[GridExporter alloc] initWithPath:[directory stringByAppendingPathComponent:filename]];
+        if (!gridExporter_) {
+            gridExportFailed_ = YES;
+            return;
+        }
+    }
+    VT100Screen *screen = SCREEN;
+    [gridExporter_ exportWidth:[screen width]
+                        height:[screen height]
+                       cursorX:[screen cursorX] - 1
+                       cursorY:[screen cursorY] - 1
+                         lines:^screen_char_t *(int y) {
+                             return [screen getLineAtScreenIndex:y];
+                         }];
 }
 
 - (void)refreshAndStartTimerIfNeeded
@@ -2841,23 +3921,16 @@ static long long timeInTenthsOfSeconds(struct timeval t)
     if (EXIT) {
         return;
     }
-    float kEpsilon = 0.001;
-    if (!timerRunning_ &&
-        [updateTimer isValid] &&
-        [[updateTimer userInfo] floatValue] - (float)timeout < kEpsilon) {
-        // An update of at least the current frequency is already scheduled. Let
-        // it run to avoid pushing it back repeatedly (which prevents it from firing).
-        return;
+    const double maximumFramesPerSecond = [self maximumFramesPerSecond];
+    if (maximumFramesPerSecond > 0) {
+        const NSTimeInterval sinceLastUpdate =
+            [NSDate timeIntervalSinceReferenceDate] - lastUpdateDisplayTime_;
+        timeout = MAX(timeout, 1.0 / maximumFramesPerSecond - sinceLastUpdate);
     }
-
-    [updateTimer invalidate];
-    [updateTimer release];
-
-    updateTimer = [[NSTimer scheduledTimerWithTimeInterval:timeout
-                                                    target:self
-                                                  selector:@selector(updateDisplay)
-                                                  userInfo:[NSNumber numberWithFloat:(float)timeout]
-                                                   repeats:NO] retain];
+    // If an update at least this soon is already scheduled, the frame scheduler lets it run to
+    // avoid pushing it back repeatedly (which would prevent it from firing). All sessions share
+    // its display link, so any number of pending updates costs at most one wakeup per frame.
+    [[FrameScheduler sharedInstance] scheduleClient:self after:timeout];
 }
 
 - (void)doAntiIdle
@@ -3252,6 +4325,128 @@ static long long timeInTenthsOfSeconds(struct timeval t)
     return textviewImage;
 }
 
+// Gets the color for a cell's foreground or background, remembering it in |memo|, which has
+// kThumbnailColorMemoSize entries, since most cells share a few colors.
+- (void)_getThumbnailColor:(unsigned char *)rgb
+                   forCode:(int)code
+                     green:(int)green
+                      blue:(int)blue
+                      mode:(ColorMode)mode
+                      bold:(BOOL)bold
+              isBackground:(BOOL)isBackground
+                      memo:(PTYSessionThumbnailColor *)memo
+{
+    const uint32_t key = (1U << 31) | (code << 20) | (green << 12) | (blue << 4) | (mode << 2) |
+                         (bold << 1) | isBackground;
+    PTYSessionThumbnailColor *entry = &memo[(key ^ (key >> 12)) % kThumbnailColorMemoSize];
+    if (entry->key != key) {
+        NSColor *color = [[TEXTVIEW colorForCode:code
+                                           green:green
+                                            blue:blue
+                                       colorMode:mode
+                                            bold:bold
+                                    isBackground:isBackground]
+                             colorUsingColorSpaceName:NSCalibratedRGBColorSpace];
+        entry->key = key;
+        entry->rgb[0] = [color redComponent] * 255;
+        entry->rgb[1] = [color greenComponent] * 255;
+        entry->rgb[2] = [color blueComponent] * 255;
+    }
+    memcpy(rgb, entry->rgb, 3);
+}
+
+- (NSImage *)thumbnail
+{
+    NSRect theRect = [SCROLLVIEW documentVisibleRect];
+    if (thumbnail_ &&
+        thumbnailGeneration_ == contentGeneration_ &&
+        NSEqualRects(theRect, thumbnailRect_)) {
+        return thumbnail_;
+    }
+
+    // One pixel per cell, which NSImage stretches to the size of the session when it's drawn.
+    const int width = [SCREEN width];
+    const int height = [SCREEN height];
+    NSBitmapImageRep *rep =
+        [[[NSBitmapImageRep alloc] initWithBitmapDataPlanes:NULL
+                                                 pixelsWide:MAX(1, width)
+                                                 pixelsHigh:MAX(1, height)
+                                              bitsPerSample:8
+                                            samplesPerPixel:3
+                                                   hasAlpha:NO
+                                                   isPlanar:NO
+                                             colorSpaceName:NSCalibratedRGBColorSpace
+                                                bytesPerRow:0
+                                               bitsPerPixel:24] autorelease];
+    unsigned char *pixels = [rep bitmapData];
+    const NSInteger bytesPerRow = [rep bytesPerRow];
+    PTYSessionThumbnailColor memo[kThumbnailColorMemoSize];
+    memset(memo, 0, sizeof(memo));
+    unsigned char defaultBackground[3];
+    [self _getThumbnailColor:defaultBackground
+                     forCode:ALTSEM_BG_DEFAULT
+                       green:0
+                        blue:0
+                        mode:ColorModeAlternate
+                        bold:NO
+                isBackground:YES
+                        memo:memo];
+
+    const double lineHeight = [TEXTVIEW lineHeight];
+    const int firstLine = lineHeight > 0 ? theRect.origin.y / lineHeight : 0;
+    const int numberOfLines = [SCREEN numberOfLines];
+    screen_char_t buffer[width + 1];
+    for (int y = 0; y < height; y++) {
+        unsigned char *row = pixels + y * bytesPerRow;
+        if (firstLine + y >= numberOfLines) {
+            for (int x = 0; x < width; x++) {
+                memcpy(row + x * 3, defaultBackground, 3);
+            }
+            continue;
+        }
+        screen_char_t *line = [SCREEN getLineAtIndex:firstLine + y withBuffer:buffer];
+        for (int x = 0; x < width; x++) {
+            const screen_char_t c = line[x];
+            unsigned char *pixel = row + x * 3;
+            [self _getThumbnailColor:pixel
+                             forCode:c.backgroundColor
+                               green:c.bgGreen
+                                blue:c.bgBlue
+                                mode:c.backgroundColorMode
+                                bold:NO
+                        isBackground:YES
+                                memo:memo];
+            const BOOL hasInk = (c.complexChar ||
+                                 (c.code > ' ' &&
+                                  c.code != DWC_SKIP &&
+                                  c.code != TAB_FILLER &&
+                                  c.code != DWC_RIGHT));
+            if (hasInk) {
+                unsigned char foreground[3];
+                [self _getThumbnailColor:foreground
+                                 forCode:c.foregroundColor
+                                   green:c.fgGreen
+                                    blue:c.fgBlue
+                                    mode:c.foregroundColorMode
+                                    bold:c.bold
+                            isBackground:NO
+                                    memo:memo];
+                for (int i = 0; i < 3; i++) {
+                    pixel[i] += (foreground[i] - pixel[i]) * kThumbnailInkFraction;
+                }
+            }
+        }
+    }
+
+    NSImage *image = [[[NSImage alloc] initWithSize:theRect.size] autorelease];
+    [image addRepresentation:rep];
+    [thumbnail_ release];
+    thumbnail_ = [image retain];
+    thumbnailGeneration_ = contentGeneration_;
+    thumbnailRect_ = theRect;
+    return thumbnail_;
+}
+
 - (void)setPasteboard:(NSString *)pbName
 {
     if (pbName) {
@@ -3314,10 +4509,9 @@ static long long timeInTenthsOfSeconds(struct timeval t)
 - (BOOL)wantsContentChangedNotification
 {
     // We want a content change notification if it's worth doing a tail find.
-    // That means the find window is open, we're not already doing a tail find,
-    // and a search was performed in the find window (vs select+cmd-e+cmd-f).
-    return !tailFindTimer_ &&
-           ![[[view findViewController] view] isHidden] &&
+    // That means the find window is open and a search was performed in the
+    // find window (vs select+cmd-e+cmd-f).
+    return ![[[view findViewController] view] isHidden] &&
            [TEXTVIEW initialFindContext].substring != nil;
 }
 
@@ -3397,6 +4591,14 @@ static long long timeInTenthsOfSeconds(struct timeval t)
 {
     tmuxPane_ = windowPane;
     tmuxMode_ = TMUX_CLIENT;
+    // Output for every pane arrives through the gateway on the main thread. Tokenizing each pane
+    // on its own queue keeps one busy pane from holding up the others.
+    if (!parseQueue_) {
+        parseQueue_ = [[VT100ParseQueue alloc] initWithTerminal:TERMINAL];
+        parseQueue_.delegate = self;
+        [parseQueue_ setTerminalHeight:[SCREEN height]
+                 useColumnScrollRegion:[SCREEN terminalUseColumnScrollRegion]];
+    }
 }
 
 - (void)setTmuxController:(TmuxController *)tmuxController
@@ -3411,6 +4613,12 @@ static long long timeInTenthsOfSeconds(struct timeval t)
             height:[[arrangement objectForKey:SESSION_ARRANGEMENT_ROWS] intValue]];
 }
 
+- (BOOL)sizeMatchesArrangement:(NSDictionary *)arrangement
+{
+    return ([SCREEN width] == [[arrangement objectForKey:SESSION_ARRANGEMENT_COLUMNS] intValue] &&
+            [SCREEN height] == [[arrangement objectForKey:SESSION_ARRANGEMENT_ROWS] intValue]);
+}
+
 - (BOOL)isCompatibleWith:(PTYSession *)otherSession
 {
     if (tmuxMode_ != TMUX_CLIENT && otherSession->tmuxMode_ != TMUX_CLIENT) {
@@ -3643,9 +4851,21 @@ static long long timeInTenthsOfSeconds(struct timeval t)
 
 - (void)tmuxReadTask:(NSData *)data
 {
+    if (tmuxRepaintPending_) {
+        return;
+    }
+    if (tmuxPaneBacklogged_) {
+        tmuxOutputDropped_ = YES;
+        return;
+    }
     if (!EXIT) {
         [SHELL logData:data];
-        [self readTask:data];
+        if (parseQueue_ && ![SHELL hasMuteCoprocess]) {
+            // |data| is the gateway's reusable decode buffer; the parse queue copies it.
+            [parseQueue_ addData:data];
+        } else {
+            [self readTask:data];
+        }
     }
 }
 
@@ -3692,8 +4912,9 @@ static long long timeInTenthsOfSeconds(struct timeval t)
     [self hidePasteUI];
     [slowPasteTimer invalidate];
     slowPasteTimer = nil;
-    [slowPasteBuffer release];
-    slowPasteBuffer = [[NSMutableString alloc] init];
+    pasteWaitingForRoom_ = NO;
+    [pasteStream_ release];
+    pasteStream_ = nil;
     [self emptyEventQueue];
 }
 
@@ -3745,7 +4966,7 @@ static long long timeInTenthsOfSeconds(struct timeval t)
 }
 
 - (BOOL)isPasting {
-    return slowPasteTimer != nil;
+    return pasteStream_ != nil;
 }
 
 - (void)queueKeyDown:(NSEvent *)event {
@@ -3782,6 +5003,7 @@ static long long timeInTenthsOfSeconds(struct timeval t)
     NSLog(@"PTYSession keyDown modflag=%d keystr=%@ unmodkeystr=%@ unicode=%d unmodunicode=%d", (int)modflag, keystr, unmodkeystr, (int)unicode, (int)unmodunicode);
   }
   gettimeofday(&lastInput, NULL);
+  echoFastPathArmed_ = YES;
 
   if ([[[self tab] realParentWindow] inInstantReplay]) {
     if (debugKeyDown) {
@@ -4294,16 +5516,27 @@ static long long timeInTenthsOfSeconds(struct timeval t)
         return YES;
     }
     
-    if ([string rangeOfString:@"\n"].length == 0) {
+    NSRange newline = [string rangeOfString:@"\n"];
+    if (newline.length == 0) {
         return YES;
     }
-    
+
+    // Count lines without splitting a possibly huge string into an array of them.
+    int lines = 1;
+    while (newline.length) {
+        lines++;
+        const NSUInteger next = NSMaxRange(newline);
+        newline = [string rangeOfString:@"\n"
+                                options:NSLiteralSearch
+                                  range:NSMakeRange(next, [string length] - next)];
+    }
+
     switch (NSRunAlertPanel(@"Confirm Multi-Line Paste",
                             @"Ok to paste %d lines?",
                             @"Yes",
                             @"No",
                             @"Yes and don‘t ask again",
-                            (int)[[string componentsSeparatedByString:@"\n"] count])) {
+                            lines)) {
         case NSAlertDefaultReturn:
             return YES;
         case NSAlertAlternateReturn:
@@ -4324,20 +5557,18 @@ static long long timeInTenthsOfSeconds(struct timeval t)
     if (![self maybeWarnAboutMultiLinePaste:str]) {
         return;
     }
-    if (flags & 1) {
-        // paste escaping special characters
-        str = [str stringWithEscapedShellCharacters];
-    }
+    // Bit 0 of the flags escapes special characters.
+    const BOOL escape = (flags & 1) != 0;
     if ([TERMINAL bracketedPasteMode]) {
         [self writeTask:[[NSString stringWithFormat:@"%c[200~", 27]
                          dataUsingEncoding:[TERMINAL encoding]
                          allowLossyConversion:YES]];
     }
     if (flags & 2) {
-        [slowPasteBuffer appendString:[str stringWithLinefeedNewlines]];
+        [self _appendToPasteBuffer:str escapingShellCharacters:escape];
         [self _pasteSlowly:nil];
     } else {
-        [self _pasteString:str];
+        [self _pasteString:str escapingShellCharacters:escape];
     }
 }
 
@@ -4365,11 +5596,12 @@ static long long timeInTenthsOfSeconds(struct timeval t)
     }
 }
 
-- (void)textViewPostTabContentsChangedNotification
+- (void)textViewContentsDidChangeInLines:(NSRange)lines
 {
-    [[NSNotificationCenter defaultCenter] postNotificationName:@"iTermTabContentsChanged"
-                                                        object:self
-                                                      userInfo:nil];
+    if ([[tab_ realParentWindow] currentTab] == tab_) {
+        [self updateTailFind];
+    }
+    [[ContentsChangeFeed sharedInstance] session:self didChangeLines:lines];
 }
 
 - (void)textViewBeginDrag
@@ -4387,6 +5619,13 @@ static long long timeInTenthsOfSeconds(struct timeval t)
     return [self encoding];
 }
 
+- (void)textViewDidDrawWithDuration:(NSTimeInterval)duration
+{
+    [activity_ addDuration:duration toStage:kSessionActivityStageRender];
+    [activity_ addRedraw];
+    MetricsExporterAddFrame(duration);
+}
+
 - (void)textViewWillNeedUpdateForBlink
 {
     [self scheduleUpdateIn:[[PreferencePanel sharedInstance] timeBetweenBlinks]];
@@ -4569,7 +5808,6 @@ static long long timeInTenthsOfSeconds(struct timeval t)
 
 - (void)uploadFiles:(NSArray *)localFilenames toPath:(SCPPath *)destinationPath
 {
-    SCPFile *previous = nil;
     for (NSString *file in localFilenames) {
         SCPFile *scpFile = [[[SCPFile alloc] init] autorelease];
         scpFile.path = [[[SCPPath alloc] init] autorelease];
@@ -4578,11 +5816,6 @@ static long long timeInTenthsOfSeconds(struct timeval t)
         NSString *filename = [file lastPathComponent];
         scpFile.path.path = [destinationPath.path stringByAppendingPathComponent:filename];
         scpFile.localPath = file;
-
-        if (previous) {
-            previous.successor = scpFile;
-        }
-        previous = scpFile;
         [scpFile upload];
     }
 }
@@ -4651,29 +5884,21 @@ static long long timeInTenthsOfSeconds(struct timeval t)
 
 - (void)continueTailFind
 {
+    [NSObject cancelPreviousPerformRequestsWithTarget:self
+                                             selector:@selector(continueTailFind)
+                                               object:nil];
     NSMutableArray *results = [NSMutableArray array];
     BOOL more;
-    more = [SCREEN continueFindAllResults:results
-                                inContext:tailFindContext_];
-    for (SearchResult *r in results) {
-        [TEXTVIEW addResultFromX:r->startX
-                            absY:r->absStartY
-                             toX:r->endX
-                          toAbsY:r->absEndY];
-    }
+    more = [SCREEN continueTailFindResults:results
+                                 inContext:tailFindContext_];
+    [TEXTVIEW addSearchResults:results];
     if ([results count]) {
         [TEXTVIEW setNeedsDisplay:YES];
     }
     if (more) {
-        tailFindTimer_ = [NSTimer scheduledTimerWithTimeInterval:0.01
-                                                          target:self
-                                                        selector:@selector(continueTailFind)
-                                                        userInfo:nil
-                                                         repeats:NO];
-    } else {
-        // Update the saved position to just before the screen.
-        [SCREEN storeLastPositionInLineBufferAsFindContextSavedPosition];
-        tailFindTimer_ = nil;
+        // A burst of output left more than one pass's worth to search. Finish it when the run
+        // loop is next idle rather than waiting for more output.
+        [self performSelector:@selector(continueTailFind) withObject:nil afterDelay:0];
     }
 }
 
@@ -4696,26 +5921,30 @@ static long long timeInTenthsOfSeconds(struct timeval t)
     // Set the starting position to the block & offset that the backward search
     // began at. Do a forward search from that location.
     [SCREEN restoreSavedPositionToFindContext:tailFindContext_];
-    [self continueTailFind];
 }
 
-- (void)sessionContentsChanged:(NSNotification *)notification
+// Called when the screen's contents change. The query is only prepared again when the find bar's
+// query changes; otherwise just the output added since the last pass is searched.
+- (void)updateTailFind
 {
-    if (!tailFindTimer_ &&
-        [notification object] == self &&
-        [[tab_ realParentWindow] currentTab] == tab_) {
+    FindContext *initialFindContext = [TEXTVIEW initialFindContext];
+    if (!initialFindContext.substring) {
+        return;
+    }
+    const int queryOptions = FindOptCaseInsensitive | FindOptRegex;
+    if (![tailFindContext_.substring isEqualToString:initialFindContext.substring] ||
+        (tailFindContext_.options & queryOptions) != (initialFindContext.options & queryOptions)) {
         [self beginTailFind];
     }
+    [self continueTailFind];
 }
 
 - (void)stopTailFind
 {
-    if (tailFindTimer_) {
-        tailFindContext_.substring = nil;
-        tailFindContext_.results = nil;
-        [tailFindTimer_ invalidate];
-        tailFindTimer_ = nil;
-    }
+    [NSObject cancelPreviousPerformRequestsWithTarget:self
+                                             selector:@selector(continueTailFind)
+                                               object:nil];
+    [tailFindContext_ reset];
 }
 
 - (void)printTmuxMessage:(NSString *)message
@@ -4765,6 +5994,12 @@ static long long timeInTenthsOfSeconds(struct timeval t)
 
 #pragma mark - VT100ScreenDelegate
 
+- (void)screenDidSwitchGrids {
+    [self refreshAndStartTimerIfNeeded];
+    [TEXTVIEW updateNoteViewFrames];
+    [TEXTVIEW screenDidSwitchGrids];
+}
+
 - (void)screenNeedsRedraw {
     [self refreshAndStartTimerIfNeeded];
     [TEXTVIEW updateNoteViewFrames];
@@ -4799,6 +6034,10 @@ static long long timeInTenthsOfSeconds(struct timeval t)
     [self appendStringToTriggerLine:string];
 }
 
+- (void)screenDidAppendAsciiBytesToCurrentLine:(const unsigned char *)bytes length:(int)length {
+    [self appendAsciiBytesToTriggerLine:bytes length:length];
+}
+
 - (void)screenSetCursorType:(ITermCursorType)type {
     [[self TEXTVIEW] setCursorType:type];
 }
@@ -5390,6 +6629,20 @@ static long long timeInTenthsOfSeconds(struct timeval t)
     }
 }
 
+- (id)handleReadLinesScriptCommand:(NSScriptCommand *)command
+{
+    NSDictionary *args = [command evaluatedArguments];
+    NSNumber *sinceGeneration = [args objectForKey:@"ifChangedSince"];
+    if (sinceGeneration && [sinceGeneration longLongValue] == [SCREEN contentGeneration]) {
+        return @"";
+    }
+    NSNumber *from = [args objectForKey:@"from"];
+    NSNumber *to = [args objectForKey:@"to"];
+    const long long first = from ? [from longLongValue] : [SCREEN totalScrollbackOverflow];
+    const long long last = to ? [to longLongValue] : [[self endLineNumber] longLongValue] - 1;
+    return [SCREEN contentsOfAbsoluteLinesFrom:first to:last];
+}
+
 - (void)handleTerminateScriptCommand:(NSScriptCommand *)command
 {
     [[self tab] closeSession:self];
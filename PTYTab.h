@@ -7,11 +7,13 @@
 #import "PTYSplitView.h"
 #import "FutureMethods.h"
 
+@class DVR;
 @class PTYSession;
 @class FakeWindow;
 @class SessionView;
 @class TmuxController;
 @class SolidColorView;
+@class TimerWheelTimer;
 
 // This implements NSSplitViewDelegate but it was an informal protocol in 10.5. If 10.5 support
 // is eventually dropped, change this to make it official.
@@ -96,6 +98,24 @@
 
 	// This tab broadcasts to all its sessions?
 	BOOL broadcasting_;
+
+    // True while the user drags a split pane divider. Sessions defer resizing until it ends.
+    BOOL draggingSplit_;
+
+    // Keeps the CPU usage in the label current while it's shown. See -_labelForActiveSession.
+    TimerWheelTimer *activityLabelTimer_;
+
+    // The last result of -arrangement, with the session arrangements (in -sessions order) and tab
+    // color it was built from. It's reused while those are the same objects and the splitters
+    // haven't moved. Nil after a layout change.
+    NSDictionary *arrangementCache_;
+    NSArray *arrangementCacheSessions_;
+    NSString *arrangementCacheColor_;
+
+    // While positive, splitter frames are changing as part of one layout operation. Sessions are
+    // fit to their views once when it ends instead of on each frame change along the way.
+    int layoutTransactionDepth_;
+    BOOL layoutChangedInTransaction_;
 }
 
 @property(nonatomic, assign, getter=isBroadcasting) BOOL broadcasting;
@@ -166,6 +186,8 @@
 - (NSArray*)sessionViews;
 - (BOOL)allSessionsExited;
 - (void)setDvrInSession:(PTYSession*)newSession;
+// Like setDvrInSession: but plays back |dvr| instead of the active session's.
+- (void)setDvr:(DVR *)dvr inSession:(PTYSession*)newSession;
 - (void)showLiveSession:(PTYSession*)liveSession inPlaceOf:(PTYSession*)replaySession;
 - (BOOL)hasMultipleSessions;
 - (NSSize)size;
@@ -179,6 +201,8 @@
 - (PTYSession*)sessionBelow:(PTYSession*)session;
 - (BOOL)canSplitVertically:(BOOL)isVertical withSize:(NSSize)newSessionSize;
 - (NSImage*)image:(BOOL)withSpaceForFrame;
+// Like -image: but with sessions drawn from their -thumbnail, for when the result will be small.
+- (NSImage*)image:(BOOL)withSpaceForFrame thumbnails:(BOOL)thumbnails;
 - (bool)blur;
 - (double)blurRadius;
 - (void)recheckBlur;
@@ -206,6 +230,10 @@
 - (void)updateFlexibleViewColors;
 - (NSDictionary*)arrangement;
 
+// The layout of the tab has changed: forget the cached arrangement and ask the window to save its
+// restorable state again.
+- (void)invalidateArrangement;
+
 - (void)notifyWindowChanged;
 - (BOOL)hasMaximizedPane;
 - (void)maximize;
@@ -218,7 +246,8 @@
 - (void)numberOfSessionsDidChange;
 - (BOOL)updatePaneTitles;
 
-- (void)resizeViewsInViewHierarchy:(NSView *)view
+// Returns YES if any view or session had to be resized.
+- (BOOL)resizeViewsInViewHierarchy:(NSView *)view
                       forNewLayout:(NSMutableDictionary *)parseTree;
 - (void)reloadTmuxLayout;
 + (PTYTab *)openTabWithTmuxLayout:(NSMutableDictionary *)parseTree
@@ -239,6 +268,7 @@
 
 - (int)tmuxWindow;
 - (BOOL)isTmuxTab;
+- (BOOL)isDraggingSplit;
 - (void)setTmuxLayout:(NSMutableDictionary *)parseTree
        tmuxController:(TmuxController *)tmuxController;
 // Returns true if the tmux layout is too large for the window to accommodate.
@@ -15,6 +15,8 @@
 #import "ProfileModel.h"
 #import "IntervalMap.h"
 #import "TmuxDashboardController.h"
+#import "SessionActivity.h"
+#import "TimerWheel.h"
 
 #define PtyLog DLog
 
@@ -39,6 +41,10 @@ static NSColor *deadStateColor;
 
 static NSImage *warningImage;
 
+// The tab's CPU usage is shown in its label once it's at least this much of one CPU.
+static const double kMinimumActivityShownInLabel = 0.01;
+static const NSTimeInterval kActivityLabelUpdateInterval = 2;
+
 // Constants for saved window arrangement keys.
 static NSString* TAB_ARRANGEMENT_ROOT = @"Root";
 static NSString* TAB_ARRANGEMENT_VIEW_TYPE = @"View Type";
@@ -107,7 +113,7 @@ static const BOOL USE_THIN_SPLITTERS = YES;
     if ([self updatePaneTitles] && [self isTmuxTab]) {
         [tmuxController_ windowDidResize:realParentWindow_];
     }
-    [realParentWindow_ invalidateRestorableState];
+    [self invalidateArrangement];
 }
 
 - (void)appendSessionViewToViewOrder:(SessionView*)sessionView
@@ -222,6 +228,9 @@ static const BOOL USE_THIN_SPLITTERS = YES;
     [icon_ release];
     [idMap_ release];
     [savedArrangement_ release];
+    [arrangementCache_ release];
+    [arrangementCacheSessions_ release];
+    [arrangementCacheColor_ release];
     [tmuxController_ release];
     [parseTree_ release];
     [hiddenLiveViews_ release];
@@ -239,7 +248,7 @@ static const BOOL USE_THIN_SPLITTERS = YES;
 
 - (void)_refreshLabels:(id)sender
 {
-    [tabViewItem_ setLabel:[[self activeSession] name]];
+    [tabViewItem_ setLabel:[self _labelForActiveSession]];
     [parentWindow_ setWindowTitle];
 }
 
@@ -261,7 +270,59 @@ static const BOOL USE_THIN_SPLITTERS = YES;
 - (void)nameOfSession:(PTYSession*)session didChangeTo:(NSString*)newName
 {
     if ([self activeSession] == session) {
-        [tabViewItem_ setLabel:newName];
+        NSString *label = [self _labelForActiveSession];
+        if (![[tabViewItem_ label] isEqualToString:label]) {
+            [tabViewItem_ setLabel:label];
+        }
+    }
+}
+
+// The active session's name. If the hidden ShowSessionActivityInTabs preference is on and the
+// tab's sessions are using a noticeable amount of CPU, the percentage follows it.
+- (NSString *)_labelForActiveSession
+{
+    NSString *name = [[self activeSession] name];
+    if (!name || ![[NSUserDefaults standardUserDefaults] boolForKey:@"ShowSessionActivityInTabs"]) {
+        return name;
+    }
+    double cpuFraction = 0;
+    for (PTYSession *session in [self sessions]) {
+        cpuFraction += [[session activity] cpuFraction];
+    }
+    if (cpuFraction < kMinimumActivityShownInLabel) {
+        return name;
+    }
+    return [NSString stringWithFormat:@"%@ (%.0f%%)", name, cpuFraction * 100];
+}
+
+// Output stops updating the label a while after it stops, so while the label shows the CPU usage
+// a timer keeps it up to date until it falls off.
+- (void)_updateActivityLabel
+{
+    if (!tabViewItem_ || ![self activeSession]) {
+        return;
+    }
+    NSString *label = [self _labelForActiveSession];
+    if (![[tabViewItem_ label] isEqualToString:label]) {
+        [tabViewItem_ setLabel:label];
+    }
+    if (!activityLabelTimer_ && ![label isEqualToString:[[self activeSession] name]]) {
+        activityLabelTimer_ =
+            [TimerWheel scheduledTimerWithTimeInterval:kActivityLabelUpdateInterval
+                                                leeway:kActivityLabelUpdateInterval / 4
+                                                target:self
+                                              selector:@selector(_activityLabelTimerDidFire:)
+                                              userInfo:nil
+                                               repeats:NO
+                                              category:@"PTYTabActivity"];
+    }
+}
+
+- (void)_activityLabelTimerDidFire:(id)sender
+{
+    activityLabelTimer_ = nil;
+    if (![[self activeSession] exited]) {
+        [self _updateActivityLabel];
     }
 }
 
@@ -296,7 +357,7 @@ static const BOOL USE_THIN_SPLITTERS = YES;
     }
     if (changed) {
         [parentWindow_ setWindowTitle];
-        [tabViewItem_ setLabel:[[self activeSession] name]];
+        [tabViewItem_ setLabel:[self _labelForActiveSession]];
         if ([realParentWindow_ currentTab] == self) {
             // If you set a textview in a non-current tab to the first responder and
             // then close that tab, it crashes with NSTextInput caling
@@ -329,7 +390,7 @@ static const BOOL USE_THIN_SPLITTERS = YES;
     }
 
     --preserveOrder_;
-    [realParentWindow_ invalidateRestorableState];
+    [self invalidateArrangement];
 }
 
 - (void)setActiveSession:(PTYSession*)session
@@ -532,7 +593,7 @@ static const BOOL USE_THIN_SPLITTERS = YES;
     if (theTabViewItem != nil) {
         // While Lion-restoring windows, there may be no active session.
         if ([self activeSession]) {
-            [tabViewItem_ setLabel:[[self activeSession] name]];
+            [tabViewItem_ setLabel:[self _labelForActiveSession]];
         } else {
             [tabViewItem_ setLabel:@""];
         }
@@ -753,7 +814,11 @@ static NSString* FormatRect(NSRect r) {
         // Session has terminated.
         [self _setLabelAttributesForDeadSession];
         return NO;
-    } else if ([[tabViewItem_ tabView] selectedTabViewItem] != [self tabViewItem]) {
+    }
+    if ([[NSUserDefaults standardUserDefaults] boolForKey:@"ShowSessionActivityInTabs"]) {
+        [self _updateActivityLabel];
+    }
+    if ([[tabViewItem_ tabView] selectedTabViewItem] != [self tabViewItem]) {
         // We are not the foreground tab.
         if (now.tv_sec > [[self activeSession] lastOutput].tv_sec+2) {
             // At least two seconds have passed since the last call.
@@ -860,7 +925,12 @@ static NSString* FormatRect(NSRect r) {
 
 - (void)setDvrInSession:(PTYSession*)newSession
 {
-    PtyLog(@"PTYTab setDvrInSession:%p", newSession);
+    [self setDvr:[[[self activeSession] SCREEN] dvr] inSession:newSession];
+}
+
+- (void)setDvr:(DVR *)dvr inSession:(PTYSession*)newSession
+{
+    PtyLog(@"PTYTab setDvr:%p inSession:%p", dvr, newSession);
     PTYSession* oldSession = [self activeSession];
     assert(oldSession != newSession);
 
@@ -877,7 +947,7 @@ static NSString* FormatRect(NSRect r) {
     // Put the new session in DVR mode and pass it the old session, which it
     // keeps a reference to.
 
-    [newSession setDvr:[[oldSession SCREEN] dvr] liveSession:oldSession];
+    [newSession setDvr:dvr liveSession:oldSession];
 
     activeSession_ = newSession;
 
@@ -1126,6 +1196,7 @@ static NSString* FormatRect(NSRect r) {
 
 - (void)removeSession:(PTYSession*)aSession
 {
+    [self beginLayoutTransaction];
     if (idMap_) {
         [self unmaximize];
     }
@@ -1170,6 +1241,7 @@ static NSString* FormatRect(NSRect r) {
     if ([self isTmuxTab]) {
         [self fitSubviewsToRoot];
     }
+    [self endLayoutTransaction];
     [self numberOfSessionsDidChange];
 }
 
@@ -1221,6 +1293,24 @@ static NSString* FormatRect(NSRect r) {
     }
 }
 
+// Nested splitters each report their own resize while a change ripples down the tree, and fitting
+// sessions at every report resizes panes to in-between sizes (and redraws them) several times over.
+// Between these calls the reports only mark the layout changed; at the end every pane is fit once
+// to its final frame, which resizes only those whose rows or columns differ.
+- (void)beginLayoutTransaction
+{
+    ++layoutTransactionDepth_;
+}
+
+- (void)endLayoutTransaction
+{
+    assert(layoutTransactionDepth_ > 0);
+    if (--layoutTransactionDepth_ == 0 && layoutChangedInTransaction_) {
+        layoutChangedInTransaction_ = NO;
+        [self _splitViewDidResizeSubviews:root_];
+    }
+}
+
 - (void)adjustSubviewsOf:(NSSplitView*)split
 {
     PtyLog(@"--- adjust ---");
@@ -1234,6 +1324,7 @@ static NSString* FormatRect(NSRect r) {
                          before:(BOOL)before
                   targetSession:(PTYSession*)targetSession
 {
+    [self beginLayoutTransaction];
     if (isMaximized_) {
         [self unmaximize];
     }
@@ -1299,6 +1390,7 @@ static NSString* FormatRect(NSRect r) {
     [self dump];
 
     [self appendSessionViewToViewOrder:newView];
+    [self endLayoutTransaction];
 
     return newView;
 }
@@ -1547,16 +1639,21 @@ static NSString* FormatRect(NSRect r) {
     } else {
         PtyLog(@"PTYTab setSize:%fx%f", (float)newSize.width, (float)newSize.height);
         [self dumpSubviewsOf:root_];
+        [self beginLayoutTransaction];
         [root_ setFrameSize:newSize];
         //[root_ adjustSubviews];
         [self adjustSubviewsOf:root_];
         [self _splitViewDidResizeSubviews:root_];
+        [self endLayoutTransaction];
     }
 }
 
-- (void)_drawSession:(PTYSession*)session inImage:(NSImage*)viewImage atOrigin:(NSPoint)origin
+- (void)_drawSession:(PTYSession*)session
+             inImage:(NSImage*)viewImage
+            atOrigin:(NSPoint)origin
+           thumbnail:(BOOL)thumbnail
 {
-    NSImage *textviewImage = [session imageOfSession:YES];
+    NSImage *textviewImage = thumbnail ? [session thumbnail] : [session imageOfSession:YES];
 
     origin.y = [viewImage size].height - [textviewImage size].height - origin.y;
     [viewImage lockFocus];
@@ -1564,7 +1661,10 @@ static NSString* FormatRect(NSRect r) {
     [viewImage unlockFocus];
 }
 
-- (void)_recursiveDrawSplit:(NSSplitView*)splitView inImage:(NSImage*)viewImage atOrigin:(NSPoint)splitOrigin
+- (void)_recursiveDrawSplit:(NSSplitView*)splitView
+                    inImage:(NSImage*)viewImage
+                   atOrigin:(NSPoint)splitOrigin
+                 thumbnails:(BOOL)thumbnails
 {
     NSPoint origin = splitOrigin;
     CGFloat myHeight = [viewImage size].height;
@@ -1600,13 +1700,18 @@ static NSString* FormatRect(NSRect r) {
         }
 
         if ([subview isKindOfClass:[NSSplitView class]]) {
-            [self _recursiveDrawSplit:(NSSplitView*)subview inImage:viewImage atOrigin:origin];
+            [self _recursiveDrawSplit:(NSSplitView*)subview
+                              inImage:viewImage
+                             atOrigin:origin
+                           thumbnails:thumbnails];
         } else {
             SessionView* sessionView = (SessionView*)subview;
             // flip the y coordinate for drawing
             CGFloat y = myHeight - origin.y - [subview frame].size.height;
-            [self _drawSession:[sessionView session] inImage:viewImage atOrigin:NSMakePoint(origin.x,
-                                                                                            y)];
+            [self _drawSession:[sessionView session]
+                       inImage:viewImage
+                      atOrigin:NSMakePoint(origin.x, y)
+                     thumbnail:thumbnails];
         }
         if ([splitView isVertical]) {
             origin.x += [subview frame].size.width;
@@ -1617,6 +1722,11 @@ static NSString* FormatRect(NSRect r) {
 }
 
 - (NSImage*)image:(BOOL)withSpaceForFrame
+{
+    return [self image:withSpaceForFrame thumbnails:NO];
+}
+
+- (NSImage*)image:(BOOL)withSpaceForFrame thumbnails:(BOOL)thumbnails
 {
     PtyLog(@"PTYTab image");
     NSRect tabFrame = [[realParentWindow_ tabBarControl] frame];
@@ -1637,7 +1747,10 @@ static NSString* FormatRect(NSRect r) {
         yOrigin += tabFrame.size.height;
     }
 
-    [self _recursiveDrawSplit:root_ inImage:viewImage atOrigin:NSMakePoint(0, yOrigin)];
+    [self _recursiveDrawSplit:root_
+                      inImage:viewImage
+                     atOrigin:NSMakePoint(0, yOrigin)
+                   thumbnails:thumbnails];
 
     // Draw over where the tab bar would usually be
     [viewImage lockFocus];
@@ -2213,9 +2326,62 @@ static NSString* FormatRect(NSRect r) {
     return result;
 }
 
+// Window restoration asks for every tab's arrangement often, and building one from the view
+// hierarchy (unmaximizing and remaximizing a maximized tab to do it) is expensive. Sessions return
+// the same arrangement object while nothing in it has changed, so comparing them by identity, plus
+// the tab color and the splitter layout, tells whether the last one is still good.
 - (NSDictionary*)arrangement
 {
-    return [self arrangementWithMap:nil];
+    NSColor *color = [[realParentWindow_ tabBarControl] tabColorForTabViewItem:tabViewItem_];
+    NSString *colorName = color ? [[self class] htmlNameForColor:color] : nil;
+    NSMutableArray *sessionArrangements = [NSMutableArray array];
+    if (!isMaximized_) {
+        // The hidden panes of a maximized tab can't change, and the visible one invalidates the
+        // arrangement when it's resized.
+        for (PTYSession *aSession in [self sessions]) {
+            [sessionArrangements addObject:[aSession arrangement]];
+        }
+    }
+    if (arrangementCache_ &&
+        (colorName == arrangementCacheColor_ || [colorName isEqualToString:arrangementCacheColor_]) &&
+        [self _arrangements:sessionArrangements areIdenticalTo:arrangementCacheSessions_]) {
+        return [[arrangementCache_ retain] autorelease];
+    }
+
+    // Building a maximized tab's arrangement invalidates it, so the cache is set afterwards.
+    NSDictionary *arrangement = [self arrangementWithMap:nil];
+    [arrangementCache_ release];
+    arrangementCache_ = [arrangement retain];
+    [arrangementCacheSessions_ release];
+    arrangementCacheSessions_ = [sessionArrangements retain];
+    [arrangementCacheColor_ release];
+    arrangementCacheColor_ = [colorName copy];
+    return arrangement;
+}
+
+- (BOOL)_arrangements:(NSArray *)arrangements areIdenticalTo:(NSArray *)others
+{
+    if ([arrangements count] != [others count]) {
+        return NO;
+    }
+    for (NSUInteger i = 0; i < [arrangements count]; i++) {
+        if ([arrangements objectAtIndex:i] != [others objectAtIndex:i]) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+- (void)_discardArrangementCache
+{
+    [arrangementCache_ release];
+    arrangementCache_ = nil;
+}
+
+- (void)invalidateArrangement
+{
+    [self _discardArrangementCache];
+    [realParentWindow_ invalidateRestorableState];
 }
 
 + (NSSize)_recursiveSetSizesInTmuxParseTree:(NSMutableDictionary *)parseTree
@@ -2354,6 +2520,11 @@ static NSString* FormatRect(NSRect r) {
     return tmuxController_ != nil;
 }
 
+- (BOOL)isDraggingSplit
+{
+    return draggingSplit_;
+}
+
 - (int)tmuxWindow
 {
     return tmuxWindow_;
@@ -2682,7 +2853,10 @@ static NSString* FormatRect(NSRect r) {
         return NO;
     }
     if (typeOfView == kLeafLayoutNode) {
-        return YES;
+        // A pane that moved to another leaf needs its session moved too, which only replacing the
+        // view hierarchy does.
+        SessionView *sv = (SessionView *)view;
+        return [[sv session] tmuxPane] == [[parseTree objectForKey:kLayoutDictWindowPaneKey] intValue];
     }
 
     NSArray *treeChildren = [parseTree objectForKey:kLayoutDictChildrenKey];
@@ -2705,7 +2879,9 @@ static NSString* FormatRect(NSRect r) {
 }
 
 // NOTE: This is only called on tmux tabs.
-- (void)_recursiveResizeViewsInViewHierarchy:(NSView *)view
+// Only views whose frame or grid size differs from the arrangement are touched, so a layout change
+// that resizes one pane leaves the rest alone. Returns YES if anything changed.
+- (BOOL)_recursiveResizeViewsInViewHierarchy:(NSView *)view
                               forArrangement:(NSDictionary *)arrangement
 {
     assert(arrangement);
@@ -2716,24 +2892,33 @@ static NSString* FormatRect(NSRect r) {
         frameDict = [arrangement objectForKey:TAB_ARRANGEMENT_SESSIONVIEW_FRAME];
     }
     NSRect frame = [PTYTab dictToFrame:frameDict];
-    [view setFrame:frame];
-    [view setNeedsDisplay:YES];
+    BOOL changed = !NSEqualRects([view frame], frame);
+    if (changed) {
+        [view setFrame:frame];
+        [view setNeedsDisplay:YES];
+    }
     if ([view isKindOfClass:[NSSplitView class]]) {
         int i = 0;
         NSArray *subarrangements = [arrangement objectForKey:SUBVIEWS];
         for (NSView *child in [view subviews]) {
-            [self _recursiveResizeViewsInViewHierarchy:child
-                                        forArrangement:[subarrangements objectAtIndex:i]];
+            if ([self _recursiveResizeViewsInViewHierarchy:child
+                                            forArrangement:[subarrangements objectAtIndex:i]]) {
+                changed = YES;
+            }
             i++;
         }
     } else {
         SessionView *sv = (SessionView *)view;
         PTYSession *theSession = [sv session];
-        [theSession resizeFromArrangement:[arrangement objectForKey:TAB_ARRANGEMENT_SESSION]];
-        assert([arrangement objectForKey:TAB_ARRANGEMENT_SESSIONVIEW_FRAME]);
+        NSDictionary *sessionArrangement = [arrangement objectForKey:TAB_ARRANGEMENT_SESSION];
+        if (!changed && [theSession sizeMatchesArrangement:sessionArrangement]) {
+            return NO;
+        }
+        [theSession resizeFromArrangement:sessionArrangement];
+        changed = YES;
 
-        NSRect aFrame = [PTYTab dictToFrame:[arrangement objectForKey:TAB_ARRANGEMENT_SESSIONVIEW_FRAME]];
-        [sv setFrame:aFrame];
+        // Resizing the session can change the view's frame, so set it again.
+        [sv setFrame:frame];
         NSSize theSize = [theSession idealScrollViewSizeWithStyle:[parentWindow_ scrollerStyle]];
         [[theSession SCROLLVIEW] setFrame:NSMakeRect(0,
                                                      0,
@@ -2742,9 +2927,10 @@ static NSString* FormatRect(NSRect r) {
         [[theSession view] setAutoresizesSubviews:NO];
         [[theSession view] updateTitleFrame];
     }
+    return changed;
 }
 
-- (void)resizeViewsInViewHierarchy:(NSView *)view forNewLayout:(NSMutableDictionary *)parseTree
+- (BOOL)resizeViewsInViewHierarchy:(NSView *)view forNewLayout:(NSMutableDictionary *)parseTree
 {
     Profile *bookmark = [[ProfileModel sharedInstance] defaultBookmark];
     NSDictionary *arrangement = [PTYTab _recursiveArrangementForDecoratedTmuxParseTree:parseTree
@@ -2753,12 +2939,17 @@ static NSString* FormatRect(NSRect r) {
                                                                       activeWindowPane:[activeSession_ tmuxPane]];
     ++tmuxOriginatedResizeInProgress_;
     [realParentWindow_ beginTmuxOriginatedResize];
-    [self _recursiveResizeViewsInViewHierarchy:view forArrangement:arrangement];
-    [realParentWindow_ tmuxTabLayoutDidChange:NO];
+    BOOL changed = [self _recursiveResizeViewsInViewHierarchy:view forArrangement:arrangement];
+    if (changed) {
+        [realParentWindow_ tmuxTabLayoutDidChange:NO];
+    }
     [realParentWindow_ endTmuxOriginatedResize];
     --tmuxOriginatedResizeInProgress_;
-    [root_ setNeedsDisplay:YES];
-    [flexibleView_ setNeedsDisplay:YES];
+    if (changed) {
+        [root_ setNeedsDisplay:YES];
+        [flexibleView_ setNeedsDisplay:YES];
+    }
+    return changed;
 }
 
 - (void)setRoot:(NSSplitView *)newRoot
@@ -2866,8 +3057,10 @@ static NSString* FormatRect(NSRect r) {
     [PTYTab setSizesInTmuxParseTree:parseTree
                          inTerminal:realParentWindow_];
     if ([self parseTree:parseTree matchesViewHierarchy:root_]) {
-        [self resizeViewsInViewHierarchy:root_ forNewLayout:parseTree];
-        [self fitSubviewsToRoot];
+        // Same splits and panes as before, so only sizes changed (if anything did).
+        if ([self resizeViewsInViewHierarchy:root_ forNewLayout:parseTree]) {
+            [self fitSubviewsToRoot];
+        }
     } else {
         if ([[self realParentWindow] inInstantReplay]) {
             [[self realParentWindow] showHideInstantReplay];
@@ -2903,6 +3096,7 @@ static NSString* FormatRect(NSRect r) {
     assert(!idMap_);
     assert(!isMaximized_);
 
+    [self beginLayoutTransaction];
     SessionView* temp = [activeSession_ view];
     savedSize_ = [temp frame].size;
 
@@ -2921,9 +3115,10 @@ static NSString* FormatRect(NSRect r) {
     [temp removeFromSuperview];
     [root_ addSubview:temp];
     [temp release];
+    [self endLayoutTransaction];
 
     [[root_ window] makeFirstResponder:[activeSession_ TEXTVIEW]];
-    [realParentWindow_ invalidateRestorableState];
+    [self invalidateArrangement];
 }
 
 - (void)unmaximize
@@ -2931,6 +3126,7 @@ static NSString* FormatRect(NSRect r) {
     assert(savedArrangement_);
     assert(idMap_);
     assert(isMaximized_);
+    [self beginLayoutTransaction];
 
     // Pull the formerly maximized sessionview out of the old root.
     assert([[root_ subviews] count] == 1);
@@ -2954,9 +3150,10 @@ static NSString* FormatRect(NSRect r) {
     [savedArrangement_ release];
     savedArrangement_ = nil;
     isMaximized_ = NO;
+    [self endLayoutTransaction];
 
     [[root_ window] makeFirstResponder:[activeSession_ TEXTVIEW]];
-    [realParentWindow_ invalidateRestorableState];
+    [self invalidateArrangement];
 }
 
 - (BOOL)promptOnClose
@@ -2973,6 +3170,8 @@ static NSString* FormatRect(NSRect r) {
 
 - (void)splitView:(PTYSplitView *)splitView draggingWillBeginOfSplit:(int)splitterIndex
 {
+    // PTYSplitView doesn't send draggingDidEnd if no splitter was clicked.
+    draggingSplit_ = (splitterIndex >= 0);
     if (![self isTmuxTab]) {
         // Don't care for non-tmux tabs.
         return;
@@ -2985,6 +3184,11 @@ static NSString* FormatRect(NSRect r) {
 
 - (void)splitView:(PTYSplitView *)splitView draggingDidEndOfSplit:(int)splitterIndex pixels:(NSSize)pxMoved
 {
+    draggingSplit_ = NO;
+    // Reflow each session once for its final size rather than on every step of the drag.
+    for (PTYSession *aSession in [self sessions]) {
+        [aSession applyDeferredResize];
+    }
     if (![self isTmuxTab]) {
         // Don't care for non-tmux tabs.
         return;
@@ -3632,7 +3836,11 @@ static void SetAgainstGrainDim(BOOL isVertical, NSSize* dest, CGFloat value)
     SetAgainstGrainDim(isVertical, &frame.size, AgainstGrainDim(isVertical, [splitView frame].size));
     for (int i = 0; i < [sizes count]; ++i) {
         SetWithGrainDim(isVertical, &frame.size, [[sizes objectAtIndex:i] doubleValue]);
-        [[[splitView subviews] objectAtIndex:i] setFrame:frame];
+        NSView *subview = [[splitView subviews] objectAtIndex:i];
+        if (!NSEqualRects([subview frame], frame)) {
+            // An unchanged subtree needn't be laid out again.
+            [subview setFrame:frame];
+        }
         if (isVertical) {
             frame.origin.x += frame.size.width + [splitView dividerThickness];
         } else {
@@ -3662,6 +3870,12 @@ static void SetAgainstGrainDim(BOOL isVertical, NSSize* dest, CGFloat value)
 - (void)_splitViewDidResizeSubviews:(NSSplitView*)splitView
 {
     PtyLog(@"_splitViewDidResizeSubviews running");
+    // Splitter frames are part of the arrangement.
+    [self _discardArrangementCache];
+    if (layoutTransactionDepth_) {
+        layoutChangedInTransaction_ = YES;
+        return;
+    }
     for (NSView* subview in [splitView subviews]) {
         if ([subview isKindOfClass:[SessionView class]]) {
             PTYSession* session = [(SessionView*)subview session];
@@ -6,10 +6,22 @@ extern NSString *kCoprocessStatusChangeNotification;
 
 @class Coprocess;
 @class PTYTab;
+@class PTYRecorder;
+@class SessionLogger;
 
 @protocol PTYTaskDelegate <NSObject>
+// Called on the main thread. |data| is only valid for the duration of the call because its
+// buffer is recycled for subsequent reads.
 - (void)readTask:(NSData *)data;
 - (void)brokenPipe;
+
+@optional
+// Called on the TaskNotifier thread with newly read data. Return YES to take care of it right
+// there, in which case readTask: is not called. |data| must be copied if it's kept.
+- (BOOL)tryToHandleReadInBackground:(NSData *)data;
+// Called on the main thread after -notifyWhenWriteBufferIsShorterThan: once the write buffer
+// drains enough.
+- (void)taskWriteBufferHasRoom;
 @end
 
 @interface PTYTask : NSObject
@@ -24,6 +36,23 @@ extern NSString *kCoprocessStatusChangeNotification;
                  width:(int)width
                 height:(int)height
                 isUTF8:(BOOL)isUTF8;
+// Like -launchWithPath:arguments:environment:width:height:isUTF8:, but nothing is read from or
+// written to the task until -startIO is called, so its output waits in the pty. Returns NO if the
+// fork failed. Used by ShellLaunchPool to start shells before they're needed.
+- (BOOL)prelaunchWithPath:(NSString*)progpath
+                arguments:(NSArray*)args
+              environment:(NSDictionary*)env
+                    width:(int)width
+                   height:(int)height
+                   isUTF8:(BOOL)isUTF8;
+// Begins I/O for a task made with -prelaunchWithPath:arguments:environment:width:height:isUTF8:.
+- (void)startIO;
+// Takes over a child started by an earlier run of the app and kept alive by the PTY server, in
+// place of launching one. |masterFd| is owned by the task from now on. Call -startIO afterwards.
+- (void)attachToFileDescriptor:(int)masterFd pid:(pid_t)childPid tty:(NSString *)ttyPath;
+// Lets go of the child without hanging up on it, once the PTY server has its own copy of the fd.
+// Afterwards the task is as good as stopped.
+- (void)detachFromChild;
 
 - (NSString*)currentJob:(BOOL)forceRefresh;
 
@@ -31,6 +60,9 @@ extern NSString *kCoprocessStatusChangeNotification;
 - (id<PTYTaskDelegate>)delegate;
 - (void)readTask:(NSData*)data;
 - (void)writeTask:(NSData*)data;
+// Queues |data| for every task in |tasks| with one wakeup of the I/O thread. Large data is shared
+// among their write queues rather than copied into each.
++ (void)writeData:(NSData *)data toTasks:(NSArray *)tasks;
 
 - (void)sendSignal:(int)signo;
 - (void)setWidth:(int)width height:(int)height;
@@ -41,14 +73,29 @@ extern NSString *kCoprocessStatusChangeNotification;
 - (int)status;
 - (NSString*)tty;
 - (NSString*)path;
+// Usually answered from a cache kept up to date in the background, so it's cheap. Any thread.
 - (NSString*)getWorkingDirectory;
 - (NSString*)description;
 
 - (BOOL)loggingStartWithPath:(NSString*)path;
 - (void)loggingStop;
 - (BOOL)logging;
+// The session log, for its metrics. Nil if not logging.
+- (SessionLogger *)logger;
+
+// Records every read and resize from now on, with their timing, for replaying later. See
+// PTYRecorder.h. |width| and |height| are the size to start with, since the pty may not be open
+// yet. Returns NO if |path| can't be written.
+- (BOOL)startRecordingToPath:(NSString *)path width:(int)width height:(int)height;
+- (void)stopRecording;
+// Nil if not recording.
+- (PTYRecorder *)recorder;
 - (BOOL)hasOutput;
 
+// While paused, the fd is not read from, so output backs up in the kernel (and eventually the
+// child blocks). Used for backpressure.
+- (void)setReadingPaused:(BOOL)paused;
+
 - (BOOL)wantsRead;
 - (BOOL)wantsWrite;
 - (void)brokenPipe;
@@ -58,6 +105,14 @@ extern NSString *kCoprocessStatusChangeNotification;
 - (void)setCoprocess:(Coprocess *)coprocess;
 - (Coprocess *)coprocess;
 - (BOOL)writeBufferHasRoom;
+// Number of bytes waiting to be written to the pty. Safe to call from any thread.
+- (NSUInteger)writeBufferLength;
+// Asks for one call to the delegate's -taskWriteBufferHasRoom once fewer than |length| bytes are
+// waiting to be written, which may be right away. Call it again for another.
+- (void)notifyWhenWriteBufferIsShorterThan:(NSUInteger)length;
+// Moves what the coprocess wrote into the queue of bytes to write to the pty. Called on the
+// TaskNotifier thread.
+- (void)readFromCoprocess:(Coprocess *)coprocess;
 - (BOOL)hasCoprocess;
 - (BOOL)hasMuteCoprocess;
 - (void)stopCoprocess;
@@ -4,14 +4,36 @@
 // Use this instead to debug this module:
 // #define PtyTaskDebugLog NSLog
 
-#define MAXRW 1024
+// Bounds for the adaptive read size. Reads start at kMinReadSize and double each time a read
+// fills the whole buffer, so a busy task quickly ends up draining the pty in a few syscalls.
+static const int kMinReadSize = 4096;
+static const int kMaxReadSize = 1024 * 1024;
+
+// Number of read buffers that PTYTask cycles through.
+#define kNumReadBuffers 4
+
+// How long after output the working directory is looked up again, so a burst of output causes
+// one lookup.
+static const NSTimeInterval kWorkingDirectoryRefreshDelay = 0.25;
+
+// How old a cached working directory may be before -getWorkingDirectory looks it up itself, when
+// there has been output since it was cached and when there hasn't.
+static const NSTimeInterval kWorkingDirectoryMaxAge = 1;
+static const NSTimeInterval kWorkingDirectoryMaxAgeWithoutOutput = 30;
 
 #import "PTYTask.h"
 #import "Coprocess.h"
+#import "InputLatencyProfiler.h"
+#import "MetricsExporter.h"
 #import "PreferencePanel.h"
 #import "ProcessCache.h"
+#import "PTYRecorder.h"
+#import "SessionLogger.h"
+#import "Signposts.h"
 #import "TaskNotifier.h"
+#import "WriteQueue.h"
 #include <dlfcn.h>
+#include <libkern/OSAtomic.h>
 #include <libproc.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -82,13 +104,31 @@ setup_tty_param(struct termios* term,
     NSString* path;
     BOOL hasOutput;
 
-    NSLock* writeLock;  // protects writeBuffer
-    NSMutableData* writeBuffer;
+    // Bytes waiting to be written to fd. Filled by the main thread (and the TaskNotifier thread for
+    // coprocess input) and drained by the TaskNotifier thread.
+    WriteQueue *writeQueue_;
+
+    // Reusable read buffers. Only accessed on the TaskNotifier thread.
+    NSMutableData *readBuffers_[kNumReadBuffers];
+    int nextReadBuffer_;
+    int readSize_;  // Number of bytes to try to read per readiness event.
+    volatile BOOL readingPaused_;
 
-    NSString* logPath;
-    NSFileHandle* logHandle;
+    // If positive, the delegate wants -taskWriteBufferHasRoom once fewer than this many bytes are
+    // waiting to be written.
+    volatile int64_t roomNotificationThreshold_;
+
+    SessionLogger *logger_;  // synchronized (self)
+    PTYRecorder *recorder_;  // synchronized (self)
 
     Coprocess *coprocess_;  // synchronized (self)
+
+    // Last known working directory of the child and when it was looked up. synchronized (self)
+    NSString *workingDirectory_;
+    NSTimeInterval workingDirectoryTime_;  // 0 if it hasn't been looked up.
+    BOOL outputSinceWorkingDirectoryLookup_;
+    BOOL workingDirectoryRefreshScheduled_;
+
     BOOL brokenPipe_;
 	NSString *command_;  // Command that was run if launchWithPath:arguments:etc was called
 }
@@ -102,14 +142,10 @@ setup_tty_param(struct termios* term,
         delegate = nil;
         fd = -1;
         tty = nil;
-        logPath = nil;
-        @synchronized(logHandle) {
-            logHandle = nil;
-        }
         hasOutput = NO;
 
-        writeBuffer = [[NSMutableData alloc] init];
-        writeLock = [[NSLock alloc] init];
+        writeQueue_ = [[WriteQueue alloc] init];
+        readSize_ = kMinReadSize;
     }
     return self;
 }
@@ -119,6 +155,7 @@ setup_tty_param(struct termios* term,
     [[TaskNotifier sharedInstance] deregisterTask:self];
 
     if (pid > 0) {
+        [[ProcessCache sharedInstance] untrackPid:pid];
         killpg(pid, SIGHUP);
     }
 
@@ -127,10 +164,17 @@ setup_tty_param(struct termios* term,
         close(fd);
     }
 
-    [writeLock release];
-    [writeBuffer release];
+    [logger_ close];
+    [logger_ release];
+    [recorder_ close];
+    [recorder_ release];
+    [writeQueue_ release];
+    for (int i = 0; i < kNumReadBuffers; i++) {
+        [readBuffers_[i] release];
+    }
     [tty release];
     [path release];
+    [workingDirectory_ release];
         [command_ release];
 
     @synchronized (self) {
@@ -153,7 +197,7 @@ static void reapchild(int n)
   // Safari control which uses some buggy Netscape code that calls wait()
   // until it succeeds. If we wait() on its pid, that process locks because
   // it doesn't check if wait()'s failure is ECHLD. Instead of wait()ing here,
-  // we reap our children when our select() loop sees that a pipes is broken.
+  // we reap our children when our kqueue loop sees that a pipes is broken.
 }
 
 - (NSString *)command
@@ -167,6 +211,29 @@ static void reapchild(int n)
                  width:(int)width
                 height:(int)height
                 isUTF8:(BOOL)isUTF8
+{
+    if (![self prelaunchWithPath:progpath
+                       arguments:args
+                     environment:env
+                           width:width
+                          height:height
+                          isUTF8:isUTF8]) {
+        NSRunCriticalAlertPanel(@"Unable to Fork!",
+                                @"iTerm cannot launch the program for this session.",
+                                @"Ok",
+                                nil,
+                                nil);
+        return;
+    }
+    [self startIO];
+}
+
+- (BOOL)prelaunchWithPath:(NSString*)progpath
+                arguments:(NSArray*)args
+              environment:(NSDictionary*)env
+                    width:(int)width
+                   height:(int)height
+                   isUTF8:(BOOL)isUTF8
 {
     struct termios term;
     struct winsize win;
@@ -237,108 +304,194 @@ static void reapchild(int n)
         _exit(-1);
     } else if (pid < (pid_t)0) {
         PtyTaskDebugLog(@"%@ %s", progpath, strerror(errno));
-        NSRunCriticalAlertPanel(@"Unable to Fork!",
-                                @"iTerm cannot launch the program for this session.",
-                                @"Ok",
-                                nil,
-                                nil);
-        return;
+        return NO;
     }
 
     tty = [[NSString stringWithUTF8String:theTtyname] retain];
     NSParameterAssert(tty != nil);
 
     fcntl(fd,F_SETFL,O_NONBLOCK);
+    [[ProcessCache sharedInstance] trackPid:pid];
+    return YES;
+}
+
+- (void)startIO
+{
     [[TaskNotifier sharedInstance] registerTask:self];
 }
 
+- (void)attachToFileDescriptor:(int)masterFd pid:(pid_t)childPid tty:(NSString *)ttyPath
+{
+    fd = masterFd;
+    pid = childPid;
+    [tty release];
+    tty = [ttyPath copy];
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    [[ProcessCache sharedInstance] trackPid:pid];
+}
+
+- (void)detachFromChild
+{
+    [self loggingStop];
+    if (pid > 0) {
+        [[ProcessCache sharedInstance] untrackPid:pid];
+    }
+    pid = (pid_t)-1;
+    if (fd >= 0) {
+        close(fd);
+    }
+    fd = -1;
+    [[TaskNotifier sharedInstance] unblockTask:self];
+}
+
+- (void)setReadingPaused:(BOOL)paused
+{
+    readingPaused_ = paused;
+    [[TaskNotifier sharedInstance] unblockTask:self];
+}
+
 - (BOOL)wantsRead
 {
-    return YES;
+    return !readingPaused_;
 }
 
 - (BOOL)wantsWrite
 {
-    [writeLock lock];
-    BOOL wantsWrite = [writeBuffer length] > 0;
-    [writeLock unlock];
-    return wantsWrite;
+    return [writeQueue_ length] > 0;
 }
 
 - (BOOL)writeBufferHasRoom
 {
     const int kMaxWriteBufferSize = 1024 * 10;
-    [writeLock lock];
-    BOOL hasRoom = [writeBuffer length] < kMaxWriteBufferSize;
-    [writeLock unlock];
-    return hasRoom;
+    return [writeQueue_ length] < kMaxWriteBufferSize;
+}
+
+- (NSUInteger)writeBufferLength
+{
+    return [writeQueue_ length];
+}
+
+- (void)notifyWhenWriteBufferIsShorterThan:(NSUInteger)length
+{
+    roomNotificationThreshold_ = length;
+    OSMemoryBarrier();
+    [self sendRoomNotificationIfNeeded];
+}
+
+// Called on either thread. Only one of them gets to send the notification.
+- (void)sendRoomNotificationIfNeeded
+{
+    const int64_t threshold = roomNotificationThreshold_;
+    if (threshold > 0 &&
+        [writeQueue_ length] < threshold &&
+        OSAtomicCompareAndSwap64Barrier(threshold, 0, &roomNotificationThreshold_) &&
+        [delegate respondsToSelector:@selector(taskWriteBufferHasRoom)]) {
+        NSObject *delegateObj = delegate;
+        [delegateObj performSelectorOnMainThread:@selector(taskWriteBufferHasRoom)
+                                      withObject:nil
+                                   waitUntilDone:NO];
+    }
+}
+
+// Returns a read buffer with room for at least |capacity| bytes. Buffers are reused round-robin
+// to avoid a malloc per readiness event. The delegate is done with a buffer when readTask: returns
+// (it runs synchronously on the main thread), but if anybody kept a reference to it anyway, it is
+// abandoned to them and a fresh one takes its place.
+- (NSMutableData *)nextReadBufferWithCapacity:(int)capacity
+{
+    NSMutableData *buffer = readBuffers_[nextReadBuffer_];
+    if (!buffer || [buffer retainCount] > 1) {
+        [buffer release];
+        buffer = [[NSMutableData alloc] initWithLength:capacity];
+        readBuffers_[nextReadBuffer_] = buffer;
+    } else if ([buffer length] < capacity) {
+        [buffer setLength:capacity];
+    }
+    nextReadBuffer_ = (nextReadBuffer_ + 1) % kNumReadBuffers;
+    return buffer;
+}
+
+// Grow the read size when reads fill the buffer and shrink it when they come up well short, so
+// chatty tasks read in big gulps and idle ones don't hold on to big buffers.
+- (void)adjustReadSizeAfterReading:(int)bytesRead
+{
+    if (bytesRead == readSize_) {
+        readSize_ = MIN(kMaxReadSize, readSize_ * 2);
+    } else if (bytesRead < readSize_ / 4) {
+        readSize_ = MAX(kMinReadSize, readSize_ / 2);
+    }
 }
 
 - (void)processRead
 {
-    int iterations = 10;
+    const int capacity = readSize_;
     int bytesRead = 0;
+    SignpostBegin("read", tty, capacity);
 
-    NSMutableData* data = [NSMutableData dataWithLength:MAXRW * iterations];
-    for (int i = 0; i < iterations; ++i) {
-        // Only read up to MAXRW*iterations bytes, then release control
-        ssize_t n = read(fd, [data mutableBytes] + bytesRead, MAXRW);
+    NSMutableData *data = [self nextReadBufferWithCapacity:capacity];
+    char *bytes = [data mutableBytes];
+    while (bytesRead < capacity) {
+        // Only read up to |capacity| bytes, then release control.
+        ssize_t n = read(fd, bytes + bytesRead, capacity - bytesRead);
         if (n < 0) {
             // There was a read error.
             if (errno != EAGAIN && errno != EINTR) {
                 // It was a serious error.
                 [self brokenPipe];
+                SignpostEnd("read", tty, bytesRead);
                 return;
-            } else {
-                // We could read again in the case of EINTR but it would
-                // complicate the code with little advantage. Just bail out.
-                n = 0;
             }
-        }
-        bytesRead += n;
-        if (n < MAXRW) {
-            // If we read fewer bytes than expected, return. For some apparently
-            // undocumented reason, read() never returns more than 1024 bytes
-            // (at least on OS 10.6), so that's what MAXRW is set to. If that
-            // ever goes down this'll break.
+            // We could read again in the case of EINTR but it would
+            // complicate the code with little advantage. Just bail out.
+            break;
+        } else if (n == 0) {
             break;
         }
+        // read() from a pty may return less than was asked for even though more is available,
+        // so keep going until it says there's nothing left.
+        bytesRead += n;
     }
+    [self adjustReadSizeAfterReading:bytesRead];
 
     [data setLength:bytesRead];
     hasOutput = YES;
+    if (bytesRead > 0) {
+        [[InputLatencyProfiler sharedInstance] recordStage:kInputLatencyStagePtyRead
+                                                forSession:delegate];
+    }
 
-    // Send data to the terminal
+    SignpostEnd("read", tty, bytesRead);
+    MetricsExporterAddBytesRead(bytesRead);
+    if (bytesRead > 0) {
+        [self recordRead:bytes length:bytesRead];
+        [self workingDirectoryMayHaveChanged];
+    }
+
+    // Send data to the terminal. The delegate must not hold on to |data| since it gets reused.
     [self readTask:data];
 }
 
 - (void)processWrite
 {
     // Retain to prevent the object from being released during this method
-    // Lock to protect the writeBuffer from the main thread
     [self retain];
-    [writeLock lock];
 
-    // Only write up to MAXRW bytes, then release control
-    char* ptr = [writeBuffer mutableBytes];
-    unsigned int length = [writeBuffer length];
-    if (length > MAXRW) {
-        length = MAXRW;
-    }
-    ssize_t written = write(fd, [writeBuffer mutableBytes], length);
+    // Write as much of the queue as the pty will take with one writev(). This never blocks the
+    // main thread, which may be appending to the queue at the same time.
+    SignpostBegin("write", tty, [writeQueue_ length]);
+    ssize_t written = [writeQueue_ writeToFileDescriptor:fd];
+    SignpostEnd("write", tty, written);
 
-    // No data?
     if ((written < 0) && (!(errno == EAGAIN || errno == EINTR))) {
         [self brokenPipe];
-    } else if (written > 0) {
-        // Shrink the writeBuffer
-        length = [writeBuffer length] - written;
-        memmove(ptr, ptr+written, length);
-        [writeBuffer setLength:length];
+    } else {
+        if (written > 0) {
+            [[InputLatencyProfiler sharedInstance] recordStage:kInputLatencyStagePtyWrite
+                                                    forSession:delegate];
+        }
+        [self sendRoomNotificationIfNeeded];
     }
 
-    // Clean up locks
-    [writeLock unlock];
     [self autorelease];
 }
 
@@ -358,11 +511,12 @@ static void reapchild(int n)
 }
 
 - (void)logData:(NSData *)data {
-    @synchronized(logHandle) {
-        if ([self logging]) {
-            [logHandle writeData:data];
-        }
+    SessionLogger *logger;
+    @synchronized(self) {
+        logger = [logger_ retain];
     }
+    [logger appendData:data];
+    [logger release];
 }
 
 // The bytes in data were just read from the fd.
@@ -371,7 +525,10 @@ static void reapchild(int n)
     [self logData:data];
 
     // forward the data to our delegate
-    if ([delegate respondsToSelector:@selector(readTask:)]) {
+    if ([delegate respondsToSelector:@selector(tryToHandleReadInBackground:)] &&
+        [delegate tryToHandleReadInBackground:data]) {
+        // The delegate took care of it on this thread.
+    } else if ([delegate respondsToSelector:@selector(readTask:)]) {
         // This waitsUntilDone because otherwise we can read data from a child process faster than
         // we can parse it. The main thread will quickly end up overloaded with calls to readTask:,
         // never catching up, and never having a chance to draw or respond to input.
@@ -382,18 +539,36 @@ static void reapchild(int n)
     }
 
     @synchronized (self) {
-        [coprocess_.outputBuffer appendData:data];
+        // The coprocess holds on to |data| instead of copying it, which keeps it from being reused
+        // as a read buffer until it's been written.
+        [coprocess_ enqueueOutput:data];
     }
 }
 
+- (void)readFromCoprocess:(Coprocess *)coprocess
+{
+    // Straight into the write queue without copying. The TaskNotifier calls this on its own
+    // thread and updates its interest in the pty afterwards, so there's no need to unblock it.
+    [coprocess readIntoWriteQueue:writeQueue_];
+}
+
 - (void)writeTask:(NSData*)data
 {
-    // Write as much as we can now through the non-blocking pipe
-    // Lock to protect the writeBuffer from the IO thread
-    [writeLock lock];
-    [writeBuffer appendData:data];
-    [[TaskNotifier sharedInstance] unblock];
-    [writeLock unlock];
+    // Queue the data for the IO thread, which writes it through the non-blocking pipe.
+    [writeQueue_ appendData:data];
+    [[TaskNotifier sharedInstance] unblockTask:self];
+}
+
++ (void)writeData:(NSData *)data toTasks:(NSArray *)tasks
+{
+    if (![tasks count]) {
+        return;
+    }
+    NSData *shared = [[data copy] autorelease];
+    for (PTYTask *task in tasks) {
+        [task->writeQueue_ appendSharedData:shared];
+        [[TaskNotifier sharedInstance] unblockTask:task];
+    }
 }
 
 - (void)brokenPipe
@@ -429,6 +604,12 @@ static void reapchild(int n)
         winsize.ws_col = width;
         winsize.ws_row = height;
         ioctl(fd, TIOCSWINSZ, &winsize);
+        PTYRecorder *recorder;
+        @synchronized(self) {
+            recorder = [recorder_ retain];
+        }
+        [recorder recordResizeToWidth:width height:height];
+        [recorder release];
     }
 }
 
@@ -445,16 +626,21 @@ static void reapchild(int n)
 - (void)stop
 {
     [self loggingStop];
+    [self stopRecording];
     [self sendSignal:SIGHUP];
 
     if (fd >= 0) {
         close(fd);
     }
-    // This isn't an atomic update, but select() should be resilient to
-    // being passed a half-broken fd. We must change it because after this
+    // This isn't an atomic update, but the kqueue loop is resilient to
+    // a half-broken fd. We must change it because after this
     // function returns, a new task may be created with this fd and then
-    // the select thread wouldn't know which task a fd belongs to.
+    // the notifier thread wouldn't know which task a fd belongs to.
     fd = -1;
+
+    // Closing the fd silently removes it from the kqueue, so wake the notifier thread up to notice
+    // that this task is dead.
+    [[TaskNotifier sharedInstance] unblockTask:self];
 }
 
 - (int)status
@@ -474,116 +660,158 @@ static void reapchild(int n)
 
 - (BOOL)loggingStartWithPath:(NSString*)aPath
 {
-    BOOL rc;
-    @synchronized(logHandle) {
-        [logPath autorelease];
-        logPath = [[aPath stringByStandardizingPath] copy];
-
-        [logHandle autorelease];
-        logHandle = [NSFileHandle fileHandleForWritingAtPath:logPath];
-        if (logHandle == nil) {
-            NSFileManager* fm = [NSFileManager defaultManager];
-            [fm createFileAtPath:logPath contents:nil attributes:nil];
-            logHandle = [NSFileHandle fileHandleForWritingAtPath:logPath];
-        }
-        [logHandle retain];
-        [logHandle seekToEndOfFile];
-
-        rc = (logHandle == nil ? NO : YES);
+    SessionLogger *logger = [[SessionLogger alloc] initWithPath:aPath];
+    SessionLogger *oldLogger;
+    @synchronized(self) {
+        oldLogger = logger_;
+        logger_ = logger;
     }
-    return rc;
+    [oldLogger close];
+    [oldLogger release];
+    return logger != nil;
 }
 
 - (void)loggingStop
 {
-    @synchronized(logHandle) {
-        [logHandle closeFile];
-
-        [logPath autorelease];
-        [logHandle autorelease];
-        logPath = nil;
-        logHandle = nil;
+    SessionLogger *logger;
+    @synchronized(self) {
+        logger = logger_;
+        logger_ = nil;
     }
+    [logger close];
+    [logger release];
 }
 
 - (BOOL)logging
 {
-    BOOL rc;
-    @synchronized(logHandle) {
-        rc = (logHandle == nil ? NO : YES);
+    @synchronized(self) {
+        return logger_ != nil;
     }
-    return rc;
 }
 
-- (NSString*)description
+- (SessionLogger *)logger
 {
-    return [NSString stringWithFormat:@"PTYTask(pid %d, fildes %d)", pid, fd];
+    @synchronized(self) {
+        return [[logger_ retain] autorelease];
+    }
 }
 
-// This is a stunningly brittle hack. Find the child of parentPid with the
-// oldest start time. This relies on undocumented APIs, but short of forking
-// ps, I can't see another way to do it.
-
-- (pid_t)getFirstChildOfPid:(pid_t)parentPid
+- (BOOL)startRecordingToPath:(NSString *)aPath width:(int)width height:(int)height
 {
-    int numBytes;
-    numBytes = proc_listpids(PROC_ALL_PIDS, 0, NULL, 0);
-    if (numBytes <= 0) {
-        return -1;
+    PTYRecorder *recorder = [[PTYRecorder alloc] initWithPath:aPath width:width height:height];
+    PTYRecorder *oldRecorder;
+    @synchronized(self) {
+        oldRecorder = recorder_;
+        recorder_ = recorder;
     }
+    [oldRecorder close];
+    [oldRecorder release];
+    return recorder != nil;
+}
 
-    int* pids = (int*) malloc(numBytes+sizeof(int));
-    // Save a magic int at the end to be sure that the buffer isn't overrun.
-    const int PID_MAGIC = 0xdeadbeef;
-    int magicIndex = numBytes/sizeof(int);
-    pids[magicIndex] = PID_MAGIC;
-    numBytes = proc_listpids(PROC_ALL_PIDS, 0, pids, numBytes);
-    assert(pids[magicIndex] == PID_MAGIC);
-    if (numBytes <= 0) {
-        free(pids);
-        return -1;
+- (void)stopRecording
+{
+    PTYRecorder *recorder;
+    @synchronized(self) {
+        recorder = recorder_;
+        recorder_ = nil;
     }
+    [recorder close];
+    [recorder release];
+}
 
-    int numPids = numBytes / sizeof(int);
-
-    long long oldestTime = 0;
-    pid_t oldestPid = -1;
-    for (int i = 0; i < numPids; ++i) {
-        struct proc_taskallinfo taskAllInfo;
-        int rc = proc_pidinfo(pids[i],
-                              PROC_PIDTASKALLINFO,
-                              0,
-                              &taskAllInfo,
-                              sizeof(taskAllInfo));
-        if (rc <= 0) {
-            continue;
-        }
+- (PTYRecorder *)recorder
+{
+    @synchronized(self) {
+        return [[recorder_ retain] autorelease];
+    }
+}
 
-        pid_t ppid = taskAllInfo.pbsd.pbi_ppid;
-        if (ppid == parentPid) {
-            long long birthday = taskAllInfo.pbsd.pbi_start_tvsec * 1000000 + taskAllInfo.pbsd.pbi_start_tvusec;
-            if (birthday < oldestTime || oldestTime == 0) {
-                oldestTime = birthday;
-                oldestPid = pids[i];
-            }
+// Called on the TaskNotifier thread with each read's bytes.
+- (void)recordRead:(const char *)bytes length:(int)length
+{
+    PTYRecorder *recorder;
+    @synchronized(self) {
+        if (!recorder_) {
+            return;
         }
+        recorder = [recorder_ retain];
     }
+    [recorder recordRead:bytes length:length];
+    [recorder release];
+}
 
-    assert(pids[magicIndex] == PID_MAGIC);
-    free(pids);
-    return oldestPid;
+- (NSString*)description
+{
+    return [NSString stringWithFormat:@"PTYTask(pid %d, fildes %d)", pid, fd];
 }
 
 // Get the name of this task's current job. It is quite approximate! Any
 // arbitrary tty-controller in the tty's pgid that has this task as an ancestor
-// may be chosen. This function also implements a chache to avoid doing the
-// potentially expensive system calls too often.
+// may be chosen. It comes from ProcessCache's latest snapshot, so it's cheap.
 - (NSString*)currentJob:(BOOL)forceRefresh
 {
     return [[ProcessCache sharedInstance] jobNameWithPid:pid];
 }
 
+// Returns the last directory found by -lookUpWorkingDirectory if it can still be trusted, and
+// otherwise looks it up now. Output from the child schedules a lookup in the background, so an
+// active session rarely waits. A shell can't change directory without running a command, which
+// makes output, so a value looked up since the last output is good for much longer.
 - (NSString*)getWorkingDirectory
+{
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    @synchronized(self) {
+        if (workingDirectoryTime_ > 0) {
+            const NSTimeInterval age = now - workingDirectoryTime_;
+            if (age < kWorkingDirectoryMaxAge ||
+                (!outputSinceWorkingDirectoryLookup_ && age < kWorkingDirectoryMaxAgeWithoutOutput)) {
+                return [[workingDirectory_ retain] autorelease];
+            }
+        }
+    }
+    return [self refreshWorkingDirectory];
+}
+
+// Called on the TaskNotifier thread when the child produces output.
+- (void)workingDirectoryMayHaveChanged
+{
+    @synchronized(self) {
+        outputSinceWorkingDirectoryLookup_ = YES;
+        if (workingDirectoryRefreshScheduled_) {
+            return;
+        }
+        workingDirectoryRefreshScheduled_ = YES;
+    }
+    [self retain];
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, kWorkingDirectoryRefreshDelay * NSEC_PER_SEC),
+                   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0),
+                   ^{
+                       @synchronized(self) {
+                           workingDirectoryRefreshScheduled_ = NO;
+                       }
+                       [self refreshWorkingDirectory];
+                       [self release];
+                   });
+}
+
+// Any thread.
+- (NSString *)refreshWorkingDirectory
+{
+    @synchronized(self) {
+        // Output that arrives during the lookup will make it stale again.
+        outputSinceWorkingDirectoryLookup_ = NO;
+    }
+    NSString *workingDirectory = [self lookUpWorkingDirectory];
+    @synchronized(self) {
+        [workingDirectory_ autorelease];
+        workingDirectory_ = [workingDirectory copy];
+        workingDirectoryTime_ = [NSDate timeIntervalSinceReferenceDate];
+    }
+    return workingDirectory;
+}
+
+- (NSString *)lookUpWorkingDirectory
 {
     struct proc_vnodepathinfo vpi;
     int ret;
@@ -592,7 +820,7 @@ static void reapchild(int n)
     if (ret <= 0) {
         // The child was probably owned by root (which is expected if it's
         // a login shell. Use the cwd of its oldest child instead.
-        pid_t childPid = [self getFirstChildOfPid:pid];
+        pid_t childPid = [[[ProcessCache sharedInstance] snapshot] oldestChildOfRoot:pid];
         if (childPid > 0) {
             ret = proc_pidinfo(childPid, PROC_PIDVNODEPATHINFO, 0, &vpi, sizeof(vpi));
         }
@@ -634,7 +862,7 @@ static void reapchild(int n)
         [coprocess_ autorelease];
         coprocess_ = [coprocess retain];
     }
-    [[TaskNotifier sharedInstance] unblock];
+    [[TaskNotifier sharedInstance] unblockTask:self];
 }
 
 - (Coprocess *)coprocess
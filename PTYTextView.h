@@ -1,5 +1,6 @@
 #import <Cocoa/Cocoa.h>
 #import "CharacterRun.h"
+#import "FrameScheduler.h"
 #import "LineBuffer.h"
 #import "PTYFontInfo.h"
 #import "PointerController.h"
@@ -11,6 +12,8 @@
 
 @class CRunStorage;
 @class FindCursorView;
+@class FrameProfiler;
+@class MemoryReport;
 @class MovingAverage;
 @class PTYScrollView;
 @class PTYScroller;
@@ -108,14 +111,23 @@ typedef enum {
 - (BOOL)textViewAmbiguousWidthCharsAreDoubleWidth;
 - (PTYScroller *)textViewVerticalScroller;
 - (BOOL)textViewHasCoprocess;
-- (void)textViewPostTabContentsChangedNotification;
+
+// Output is arriving too fast to draw, so rows are skipped and few frames drawn.
+- (BOOL)textViewIsFastForwarding;
+// Lines in the range of absolute line numbers |lines| changed. Only called when the data source's
+// -shouldSendContentsChangedNotification is true.
+- (void)textViewContentsDidChangeInLines:(NSRange)lines;
 - (void)textViewBeginDrag;
 - (void)textViewMovePane;
 - (NSStringEncoding)textViewEncoding;
 
+// Called at the end of -drawRect: with how long it took.
+- (void)textViewDidDrawWithDuration:(NSTimeInterval)duration;
+
 @end
 
 @interface PTYTextView : NSView <
+  FrameSchedulerClient,
   NSDraggingDestination,
   NSTextInput,
   PointerControllerDelegate,
@@ -136,7 +148,6 @@ typedef enum {
 - (void)setDelegate:(id)delegate;
 
 // Sets the "changed since last Exposé" flag to NO and returns its original value.
-- (BOOL)getAndResetChangedSinceLastExpose;
 
 // Draw the given rect. If toOrigin is not NULL, then the NSPoint it points at is used as an origin
 // for all drawing.
@@ -293,6 +304,21 @@ typedef enum {
 // onscreen is blinking.
 - (BOOL)refresh;
 
+// If nothing but the cursor's line has changed, refreshes and draws it right away instead of
+// waiting for the next update and returns YES. Otherwise does nothing and returns NO.
+- (BOOL)drawCursorLineImmediatelyIfOnlyChange;
+
+// Records per-frame timings if the hidden ShowFrameProfiler or FrameProfilerLogPath preference is
+// set, otherwise nil.
+- (FrameProfiler *)frameProfiler;
+
+// Replaces the frame profiler, for benchmarks that want stage timings without the preferences.
+- (void)setFrameProfiler:(FrameProfiler *)frameProfiler;
+
+// Mouse motion reports that weren't sent because they were to the cell last reported or were
+// replaced by later motion in the same frame.
+- (long long)numberOfSuppressedMouseReports;
+
 // Change visibility of cursor
 - (void)showCursor;
 - (void)hideCursor;
@@ -363,6 +389,9 @@ typedef enum {
 // Returns an absolute scroll position which won't change as lines in history are dropped.
 - (long long)absoluteScrollPosition;
 
+// Adds the memory held by the view's render caches to the current section of |report|.
+- (void)addToMemoryReport:(MemoryReport *)report;
+
 // Returns true if any character in the buffer is selected.
 - (BOOL)isAnyCharSelected;
 
@@ -396,11 +425,8 @@ typedef enum {
 // Draws a dotted outline (or just the top of the outline) if there is a maximized pane.
 - (void)drawOutlineInRect:(NSRect)rect topOnly:(BOOL)topOnly;
 
-// Add a search result for highlighting in yellow.
-- (void)addResultFromX:(int)resStartX
-                  absY:(long long)absStartY
-                   toX:(int)resEndX
-                toAbsY:(long long)absEndY;
+// Add SearchResults for highlighting in yellow.
+- (void)addSearchResults:(NSArray *)results;
 
 // When a new note is created, call this to add a view for it.
 - (void)addViewForNote:(PTYNoteViewController *)note;
@@ -408,6 +434,10 @@ typedef enum {
 // Makes sure not view frames are in the right places (e.g., after a resize).
 - (void)updateNoteViewFrames;
 
+// Redraws everything, keeping the rows drawn for the grid that was showing so they can be reused
+// when it's shown again.
+- (void)screenDidSwitchGrids;
+
 // Show a visual highlight of a mark on the given line number.
 - (void)highlightMarkOnLine:(int)line;
 
@@ -1,12 +1,23 @@
+#import "AccessibilityTextModel.h"
 #import "AsyncHostLookupController.h"
+#import "BlinkingCellIndex.h"
 #import "CharacterRun.h"
 #import "CharacterRunInline.h"
+#import "ColorCache.h"
+#import "CompiledRegex.h"
+#import "ComplexGlyphCache.h"
 #import "FileTransferManager.h"
 #import "FindCursorView.h"
+#import "FindHighlights.h"
 #import "FontSizeEstimator.h"
+#import "FrameProfiler.h"
 #import "FutureMethods.h"
 #import "FutureMethods.h"
+#import "GlyphAtlas.h"
 #import "ITAddressBookMgr.h"
+#import "InputLatencyProfiler.h"
+#import "LineRenderCache.h"
+#import "MemoryReport.h"
 #import "MovePaneController.h"
 #import "MovingAverage.h"
 #import "NSMutableAttributedString+iTerm.h"
@@ -20,14 +31,20 @@
 #import "PasteboardHistory.h"
 #import "PointerController.h"
 #import "PointerPrefsController.h"
+#import "PowerManager.h"
 #import "PreferencePanel.h"
 #import "RegexKitLite/RegexKitLite.h"
 #import "SCPPath.h"
+#import "SelectionTextWriter.h"
+#import "ScreenCharStringCache.h"
+#import "Signposts.h"
 #import "SmartMatch.h"
 #import "SearchResult.h"
 #import "SmartSelectionController.h"
+#import "SmartSelectionRuleSet.h"
 #import "SolidColorView.h"
 #import "ThreeFingerTapGestureRecognizer.h"
+#import "TimestampRenderer.h"
 #import "URLAction.h"
 #import "VT100RemoteHost.h"
 #import "charmaps.h"
@@ -42,6 +59,9 @@
 static const int kMaxSelectedTextLengthForCustomActions = 8192;
 static const int kMaxSelectedTextLinesForCustomActions = 100;
 
+// Selections of more lines than this are copied on a background queue.
+static const int kMinSelectedLinesToCopyInBackground = 10000;
+
 // This defines the fraction of a character's width on its right side that is used to
 // select the NEXT character.
 //        |   A rightward drag beginning left of the bar selects G.
@@ -93,6 +113,11 @@ static const double kBackgroundConsideredDarkThreshold = 0.5;
 static const int kBroadcastMargin = 4;
 static const int kCoprocessMargin = 4;
 static const int kAlertMargin = 4;
+static const int kFastForwardMargin = 4;
+
+// Lines whose Find match bitmaps are kept. The bitmaps are all thrown out when there are more, since
+// only the lines on screen will be drawn again soon.
+static const NSUInteger kMaxMatchBitmaps = 1000;
 
 static NSCursor* textViewCursor;
 static NSCursor* xmrCursor;
@@ -107,6 +132,34 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     return (RED_COEFFICIENT * r) + (GREEN_COEFFICIENT * g) + (BLUE_COEFFICIENT * b);
 }
 
+// Everything other than a line's cells that affects how -_drawLine:... renders it, for the line
+// render cache. Selection and underline coordinates are only filled in for lines they touch.
+typedef struct {
+    double y;
+    CGFloat width;
+    double charWidth;
+    double lineHeight;
+    void *selectionColor;
+    int selection[5];
+    int underline[4];
+    BOOL blinkShow;
+    BOOL reversed;
+    BOOL hasMark;
+} PTYLineRenderKeyHeader;
+
+// A run of cells in a line that share a background, collected by -_drawLine:... so the
+// backgrounds of the whole line can be filled before any text is drawn.
+typedef struct {
+    int start;
+    int end;
+    int bgColor;
+    int bgGreen;
+    int bgBlue;
+    ColorMode bgColorMode;
+    BOOL selected;
+    BOOL isMatch;
+} PTYBackgroundSpan;
+
 @interface PTYTextView ()
 // Set the hostname this view is currently waiting for AsyncHostLookupController to finish looking
 // up.
@@ -116,6 +169,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
 - (URLAction *)urlActionForClickAtX:(int)x
                                   y:(int)y
              respectingHardNewlines:(BOOL)respectHardNewlines;
+- (SmartSelectionRuleSet *)smartSelectionRuleSet;
 @end
 
 
@@ -201,6 +255,18 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     BOOL mouseDownOnSelection;
     NSEvent *mouseDownEvent;
     int lastReportedX_, lastReportedY_;
+
+    // Mouse motion waiting to be reported at the next frame. Motion within a frame is coalesced
+    // into its last position; presses and releases send whatever is pending first.
+    BOOL hasPendingMouseMotion_;
+    int pendingMouseMotionButton_;
+    unsigned int pendingMouseMotionModifiers_;
+    int pendingMouseMotionX_, pendingMouseMotionY_;
+    long long numberOfSuppressedMouseReports_;
+
+    // Scroll wheel movement waiting for the next frame, in points (positive scrolls down). What's
+    // left after snapping to a line is kept for the next frame.
+    CGFloat pendingScrollDelta_;
     
     //find support
     int lastFindStartX, lastFindEndX;
@@ -229,19 +295,14 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     // Previous tracking rect to avoid expensive calls to addTrackingRect.
     NSRect _trackingRect;
     
-    // Maps a NSNumber int consisting of color index, alternate fg semantics
-    // flag, bold flag, and background flag to NSColor*s.
-    NSMutableDictionary* dimmedColorCache_;
+    // Dimmed colors keyed by an int consisting of color index, alternate fg semantics flag, bold
+    // flag, and background flag, plus 24-bit and contrast-adjusted colors.
+    ColorCache *colorCache_;
     
     // Dimmed background color with alpha.
     NSColor *cachedBackgroundColor_;
     double cachedBackgroundColorAlpha_;  // cached alpha value (comparable to another double)
     
-    // Previuos contrasting color returned
-    NSColor *memoizedContrastingColor_;
-    double memoizedMainRGB_[4];  // rgba for "main" color memoized.
-    double memoizedOtherRGB_[3];  // rgb for "other" color memoized.
-    
     // Indicates if a selection that scrolls the window is in progress.
     // Negative value: scroll up.
     // Positive value: scroll down.
@@ -269,7 +330,6 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     double strokeThickness;
     double minimumContrast_;
     
-    BOOL changedSinceLastExpose_;
     
     double dimmingAmount_;
     
@@ -286,8 +346,13 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     // True if a result has been highlighted & scrolled to.
     BOOL foundResult_;
     
+    // The cells of search results to highlight.
+    FindHighlights findHighlights_;
+
     // Maps an absolute line number (NSNumber longlong) to an NSData bit array
-    // with one bit per cell indicating whether that cell is a match.
+    // with one bit per cell indicating whether that cell is a match, or to
+    // NSNull if it has none. Made from findHighlights_ for lines as they're
+    // drawn (see -_matchesOnLine:).
     NSMutableDictionary* resultMap_;
     
     // True if the last search was forward, flase if backward.
@@ -295,6 +360,15 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     
     // Offset value for last search.
     int findOffset_;
+
+    // Notes whose views are subviews, which are only those near the visible lines. The rest have
+    // no view in the text view until they're scrolled to.
+    NSMutableSet *notesWithViews_;
+    int noteViewsFirstLine_;
+    int noteViewsLastLine_;
+
+    // Value of totalScrollbackOverflow when notes that scrolled off the top were last removed.
+    long long noteCleanupOverflow_;
     
     // True if trying to find a result before/after current selection to
     // highlight.
@@ -330,13 +404,18 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     // selection.
     int firstMouseEventNumber_;
     
-    // For accessibility. This is a giant string with the entire scrollback buffer plus screen concatenated with newlines for hard eol's.
-    NSMutableString* allText_;
-    // For accessibility. This is the indices at which soft newlines occur in allText_, ignoring multi-char compositing characters.
-    NSMutableArray* lineBreakIndexOffsets_;
-    // For accessibility. This is the actual indices at which soft newlines occcur in allText_.
-    NSMutableArray* lineBreakCharOffsets_;
+    // For accessibility. The entire scrollback buffer plus screen concatenated with newlines for
+    // hard eol's, and where each line starts in it. Brought up to date lazily, at most once per
+    // refresh.
+    AccessibilityTextModel *accessibilityTextModel_;
+
+    // Set when the contents changed since accessibility clients were last notified.
+    BOOL accessibilityValueChanged_;
     
+    // Lines recently converted to strings for smart selection and URL detection, which look at
+    // the same few lines on every mouse move.
+    ScreenCharStringCache *lineStringCache_;
+
     // Brightness of background color
     double backgroundBrightness_;
     
@@ -365,8 +444,9 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     // Time the selection last changed at or 0 if there's no selection.
     NSTimeInterval selectionTime_;
     
-    // Dictionaries with a regex and a priority.
-    NSArray *smartSelectionRules_;
+    // Dictionaries with a regex and a priority, compiled. Created from the default rules on first
+    // use if none were set.
+    SmartSelectionRuleSet *smartSelectionRules_;
     
     // Show a background indicator when in broadcast input mode
     BOOL useBackgroundIndicator_;
@@ -389,6 +469,19 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     int prevCursorX, prevCursorY;
     
     MovingAverage *drawRectDuration_, *drawRectInterval_;
+
+    // Per-stage frame timings. Drawn over the top right of the view if showFrameProfiler_ is set.
+    FrameProfiler *frameProfiler_;
+    BOOL showFrameProfiler_;
+
+    // Reused for the runs of every line drawn so that drawing doesn't allocate.
+    CRunStorage *runStorage_;
+
+    // Maps box drawing character codes to paths for the current cell size.
+    NSMutableDictionary *boxDrawingPaths_;
+
+    // Where the visible blinking characters are.
+    BlinkingCellIndex *blinkingCellIndex_;
         // Current font. Only valid for the duration of a single drawing context.
     NSFont *selectedFont_;
     
@@ -398,12 +491,45 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     
     // If set, the last-modified time of each line on the screen is shown on the right side of the display.
     BOOL showTimestamps_;
+    TimestampRenderer *timestampRenderer_;  // Made the first time timestamps are shown.
     float _antiAliasedShift;  // Amount to shift anti-aliased text by horizontally to simulate bold
+
+    // If set, simple runs are drawn from cached glyph bitmaps instead of with
+    // CGContextShowGlyphsWithAdvances.
+    GlyphAtlas *glyphAtlas_;
+
+    // Layouts of complex characters, so they don't go through CoreText on every frame.
+    ComplexGlyphCache *complexGlyphCache_;
+
+    // If set, rows are rendered into layers and composited while their contents don't change.
+    LineRenderCache *lineRenderCache_;
     NSImage *markImage_;
+
+    // While -drawRect:to: runs, the ranges of cells with notes on each line it draws and the offsets
+    // of the lines with marks, starting with firstDrawnAnnotatedLine_.
+    NSArray *noteRangesForDrawnLines_;
+    NSIndexSet *marksForDrawnLines_;
+    int firstDrawnAnnotatedLine_;
     
     // Point clicked, valid only during -validateMenuItem and calls made from
     // the context menu and if x and y are nonnegative.
     VT100GridCoord validationClickPoint_;
+
+    // Writes the text of a big selection that was copied. Until it's done, the pasteboard has a
+    // promise of the text from this view, which declared its type at pendingCopyChangeCount_.
+    SelectionTextWriter *pendingCopyWriter_;
+    NSInteger pendingCopyChangeCount_;
+
+    // If set, pendingCopyWriter_ hasn't started and only writes when something pastes.
+    BOOL pendingCopyIsLazy_;
+
+    // Looks for filenames under the mouse pointer with trouter so stat calls don't block the main
+    // thread.
+    dispatch_queue_t semanticHistoryQueue_;
+
+    // Incremented when the underline is removed or the mouse moves to look for a new one, so an
+    // answer from semanticHistoryQueue_ for an old position is ignored.
+    int underlineGeneration_;
 }
 
 
@@ -478,7 +604,9 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     if (self) {
         firstMouseEventNumber_ = -1;
 
-        dimmedColorCache_ = [[NSMutableDictionary alloc] init];
+        colorCache_ = [[ColorCache alloc] init];
+        lineStringCache_ = [[ScreenCharStringCache alloc] initWithCapacity:16];
+        accessibilityTextModel_ = [[AccessibilityTextModel alloc] init];
         [self updateMarkedTextAttributes];
         CURSOR=YES;
         lastFindStartX = lastFindEndX = oldStartX = startX = -1;
@@ -502,6 +630,10 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
                                                  selector:@selector(_settingsChanged:)
                                                      name:@"iTermRefreshTerminal"
                                                    object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(_lowPowerModeDidChange:)
+                                                     name:kPowerManagerLowPowerModeDidChangeNotification
+                                                   object:nil];
         [[NSNotificationCenter defaultCenter] addObserver:self
                                                  selector:@selector(_pointerSettingsChanged:)
                                                      name:kPointerPrefsChangedNotification
@@ -523,10 +655,13 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
         strokeThickness = [[PreferencePanel sharedInstance] strokeThickness];
         imeOffset = 0;
         resultMap_ = [[NSMutableDictionary alloc] init];
+        notesWithViews_ = [[NSMutableSet alloc] init];
 
         trouter = [[Trouter alloc] init];
         trouter.delegate = self;
         trouterDragged = NO;
+        semanticHistoryQueue_ = dispatch_queue_create("com.googlecode.iterm2.semantic-history",
+                                                      DISPATCH_QUEUE_SERIAL);
 
         pointer_ = [[PointerController alloc] init];
         pointer_.delegate = self;
@@ -549,6 +684,22 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
             drawRectDuration_ = [[MovingAverage alloc] init];
             drawRectInterval_ = [[MovingAverage alloc] init];
         }
+        runStorage_ = [[CRunStorage alloc] initWithCapacity:256];
+        boxDrawingPaths_ = [[NSMutableDictionary alloc] init];
+        complexGlyphCache_ = [[ComplexGlyphCache alloc] init];
+        blinkingCellIndex_ = [[BlinkingCellIndex alloc] init];
+        showFrameProfiler_ = [[NSUserDefaults standardUserDefaults] boolForKey:@"ShowFrameProfiler"];
+        NSString *frameProfilerLogPath =
+            [[NSUserDefaults standardUserDefaults] stringForKey:@"FrameProfilerLogPath"];
+        if (showFrameProfiler_ || frameProfilerLogPath) {
+            frameProfiler_ = [[FrameProfiler alloc] initWithLogPath:frameProfilerLogPath];
+        }
+        if ([[NSUserDefaults standardUserDefaults] boolForKey:@"UseGlyphAtlas"]) {
+            glyphAtlas_ = [[GlyphAtlas alloc] init];
+        }
+        if ([[NSUserDefaults standardUserDefaults] boolForKey:@"UseLineRenderCache"]) {
+            lineRenderCache_ = [[LineRenderCache alloc] init];
+        }
         [self viewDidChangeBackingProperties];
         markImage_ = [NSImage imageNamed:@"mark"];
     }
@@ -559,6 +710,11 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
 {
     [drawRectDuration_ release];
     [drawRectInterval_ release];
+    [frameProfiler_ release];
+    [timestampRenderer_ release];
+    [runStorage_ release];
+    [boxDrawingPaths_ release];
+    [blinkingCellIndex_ release];
     
     [smartSelectionRules_ release];
     int i;
@@ -576,14 +732,20 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     }
     
     [[NSNotificationCenter defaultCenter] removeObserver:self];
-    [dimmedColorCache_ release];
-    [memoizedContrastingColor_ release];
+    [colorCache_ release];
+    [lineStringCache_ release];
+    [glyphAtlas_ release];
+    [complexGlyphCache_ release];
+    [lineRenderCache_ release];
+    [accessibilityTextModel_ release];
     for (i = 0; i < 256; i++) {
         [colorTable[i] release];
     }
     [lastFlashUpdate_ release];
     [cachedBackgroundColor_ release];
     [resultMap_ release];
+    [notesWithViews_ release];
+    FindHighlightsFree(&findHighlights_);
     [findResults_ release];
     [findString_ release];
     [defaultFGColor release];
@@ -602,6 +764,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     [selectionScrollTimer release];
     
     [trouter release];
+    dispatch_release(semanticHistoryQueue_);
     
     [pointer_ release];
     [cursor_ release];
@@ -609,6 +772,8 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     [threeFingerTapGestureRecognizer_ release];
     
     [initialFindContext_ release];
+    [pendingCopyWriter_ cancel];
+    [pendingCopyWriter_ release];
     if (self.currentUnderlineHostname) {
         [[AsyncHostLookupController sharedInstance] cancelRequestForHostname:self.currentUnderlineHostname];
     }
@@ -633,6 +798,23 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
 
 - (void)viewDidChangeBackingProperties {
     _antiAliasedShift = [[[self window] screen] backingScaleFactor] > 1 ? 0.5 : 0;
+    // Layers are tied to the resolution of the context they were made for.
+    [lineRenderCache_ removeAllLayers];
+}
+
+- (void)setNeedsDisplay:(BOOL)flag {
+    // Everything that changes appearance for the whole view (colors, fonts, dimming, transparency)
+    // redraws all of it, so that's when cached rows go stale.
+    if (flag) {
+        [lineRenderCache_ removeAllLayers];
+    }
+    [super setNeedsDisplay:flag];
+}
+
+- (void)screenDidSwitchGrids {
+    [lineRenderCache_ swapWithSavedLayers];
+    // Every row changed, but not its appearance, so the swapped-in layers stay.
+    [super setNeedsDisplay:YES];
 }
 
 - (void)updateMarkedTextAttributes {
@@ -720,6 +902,88 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     [super viewWillMoveToWindow:win];
 }
 
+- (void)viewWillMoveToSuperview:(NSView *)newSuperview
+{
+    NSView *superview = [self superview];
+    if ([superview isKindOfClass:[NSClipView class]]) {
+        [[NSNotificationCenter defaultCenter] removeObserver:self
+                                                        name:NSViewBoundsDidChangeNotification
+                                                      object:superview];
+    }
+    if ([newSuperview isKindOfClass:[NSClipView class]]) {
+        // Scrolling brings different notes into view.
+        [newSuperview setPostsBoundsChangedNotifications:YES];
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(clipViewBoundsDidChange:)
+                                                     name:NSViewBoundsDidChangeNotification
+                                                   object:newSuperview];
+    }
+    [super viewWillMoveToSuperview:newSuperview];
+}
+
+- (void)clipViewBoundsDidChange:(NSNotification *)notification
+{
+    int firstLine;
+    int lastLine;
+    [self getNoteViewsFirstLine:&firstLine lastLine:&lastLine];
+    if (firstLine != noteViewsFirstLine_ || lastLine != noteViewsLastLine_) {
+        [self updateNoteViewFrames];
+    }
+}
+
+#pragma mark - Mouse reporting
+
+// Queues a motion report for the next frame. Motion to the cell last reported is dropped, as is
+// a pending report that's replaced before it's sent.
+- (void)reportMouseMotion:(int)button
+                modifiers:(unsigned int)modifiers
+                        x:(int)x
+                        y:(int)y
+{
+    if (x == lastReportedX_ && y == lastReportedY_) {
+        numberOfSuppressedMouseReports_++;
+        return;
+    }
+    lastReportedX_ = x;
+    lastReportedY_ = y;
+    if (hasPendingMouseMotion_) {
+        if (pendingMouseMotionButton_ != button || pendingMouseMotionModifiers_ != modifiers) {
+            [self flushPendingMouseMotion];
+        } else {
+            numberOfSuppressedMouseReports_++;
+        }
+    }
+    hasPendingMouseMotion_ = YES;
+    pendingMouseMotionButton_ = button;
+    pendingMouseMotionModifiers_ = modifiers;
+    pendingMouseMotionX_ = x;
+    pendingMouseMotionY_ = y;
+    [[FrameScheduler sharedInstance] scheduleClient:self after:0];
+}
+
+- (void)flushPendingMouseMotion
+{
+    if (!hasPendingMouseMotion_) {
+        return;
+    }
+    hasPendingMouseMotion_ = NO;
+    [_delegate writeTask:[[dataSource terminal] mouseMotion:pendingMouseMotionButton_
+                                              withModifiers:pendingMouseMotionModifiers_
+                                                        atX:pendingMouseMotionX_
+                                                          Y:pendingMouseMotionY_]];
+}
+
+- (long long)numberOfSuppressedMouseReports
+{
+    return numberOfSuppressedMouseReports_;
+}
+
+- (void)frameSchedulerRefresh
+{
+    [self flushPendingMouseMotion];
+    [self applyPendingScroll];
+}
+
 - (void)viewDidMoveToWindow
 {
     [self updateTrackingAreas];
@@ -783,7 +1047,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
 - (void)setUseBoldFont:(BOOL)boldFlag
 {
     useBoldFont = boldFlag;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [self setNeedsDisplay:YES];
 }
 
@@ -802,7 +1066,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
 - (void)setUseBrightBold:(BOOL)flag
 {
     useBrightBold = flag;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [self setNeedsDisplay:YES];
 }
 
@@ -821,6 +1085,25 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     blinkAllowed_ = value;
 }
 
+// Nothing blinks in low power mode, so it doesn't cost a redraw twice a second.
+- (BOOL)_textBlinkingAllowed
+{
+    return blinkAllowed_ && ![[PowerManager sharedInstance] lowPowerModeEnabled];
+}
+
+- (BOOL)_cursorBlinkingAllowed
+{
+    return blinkingCursor && ![[PowerManager sharedInstance] lowPowerModeEnabled];
+}
+
+- (void)_lowPowerModeDidChange:(NSNotification *)notification
+{
+    // Whatever was blinked out when blinking was suspended must reappear.
+    blinkShow = YES;
+    [self setNeedsDisplay:YES];
+    [_delegate refreshAndStartTimerIfNeeded];
+}
+
 - (void)setCursorNeedsDisplay {
     int lineStart = [dataSource numberOfLines] - [dataSource height];
     int cursorX = [dataSource cursorX] - 1;
@@ -842,7 +1125,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
 - (void)setDimOnlyText:(BOOL)value
 {
     dimOnlyText_ = value;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [[self superview] setNeedsDisplay:YES];
 }
 
@@ -907,7 +1190,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     [defaultFGColor release];
     [color retain];
     defaultFGColor = color;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [self setNeedsDisplay:YES];
 }
 
@@ -925,7 +1208,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     defaultBGColor = color;
     backgroundBrightness_ = PerceivedBrightness([color redComponent], [color greenComponent], [color blueComponent]);
     [self updateScrollerForBackgroundColor];
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [cachedBackgroundColor_ release];
     cachedBackgroundColor_ = nil;
     [self setNeedsDisplay:YES];
@@ -936,7 +1219,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     [defaultBoldColor release];
     [color retain];
     defaultBoldColor = color;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [self setNeedsDisplay:YES];
 }
 
@@ -945,7 +1228,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     [defaultCursorColor release];
     [color retain];
     defaultCursorColor = color;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [self setNeedsDisplay:YES];
 }
 
@@ -954,7 +1237,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     [selectedTextColor release];
     [aColor retain];
     selectedTextColor = aColor;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [self setNeedsDisplay:YES];
 }
 
@@ -963,7 +1246,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     [cursorTextColor release];
     [aColor retain];
     cursorTextColor = aColor;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [self setNeedsDisplay:YES];
 }
 
@@ -1003,7 +1286,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     [colorTable[theIndex] release];
     [theColor retain];
     colorTable[theIndex] = theColor;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [self setNeedsDisplay:YES];
 }
 
@@ -1120,15 +1403,19 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
         return theColor;
     }
 
-    // 24-bit colors are not cached, as they could increase cache size
-    // nontrivially up to to 2^27
+    // 24-bit colors have their own small cache, as there could be up to 2^24 of them.
     if (theMode == ColorMode24bit) {
-        NSColor *theColor = [self _colorForCode:theIndex
-                                          green:green
-                                           blue:blue
-                                      colorMode:theMode
-                                           bold:isBold];
-        return [self _dimmedColorFrom:theColor];
+        NSColor *dimmedColor = [colorCache_ dimmedColorWithRed:theIndex green:green blue:blue];
+        if (!dimmedColor) {
+            NSColor *theColor = [self _colorForCode:theIndex
+                                              green:green
+                                               blue:blue
+                                          colorMode:theMode
+                                               bold:isBold];
+            dimmedColor = [self _dimmedColorFrom:theColor];
+            [colorCache_ setDimmedColor:dimmedColor red:theIndex green:green blue:blue];
+        }
+        return dimmedColor;
     }
 
     // Dimming is on. See if the dimmed version of the color is cached.
@@ -1138,8 +1425,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
                ((theMode == ColorModeAlternate ? 1 : 0) << 2) |
                ((isBold ? 1 : 0) << 1) |
                ((isBackground ? 1 : 0) << 0));
-    NSNumber *numKey = [NSNumber numberWithInt:key];
-    NSColor *cacheEntry = [dimmedColorCache_ objectForKey:numKey];
+    NSColor *cacheEntry = [colorCache_ dimmedColorForKey:key];
     if (cacheEntry) {
         return cacheEntry;
     } else {
@@ -1149,7 +1435,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
                                       colorMode:theMode
                                            bold:isBold];
         NSColor *dimmedColor = [self _dimmedColorFrom:theColor];
-        [dimmedColorCache_ setObject:dimmedColor forKey:numKey];
+        [colorCache_ setDimmedColor:dimmedColor forKey:key];
         return dimmedColor;
     }
 }
@@ -1182,10 +1468,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
                     green:(int)green
                      blue:(int)blue
 {
-    return [NSColor colorWithCalibratedRed:red/255.0
-                                     green:green/255.0
-                                      blue:blue/255.0
-                                     alpha:1];
+    return [colorCache_ colorWithRed:red green:green blue:blue];
 }
 
 - (NSColor *)selectionColor
@@ -1219,7 +1502,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
                                                           blue:(b + 1) / 3
                                                          alpha:1] retain];
 
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [self setNeedsDisplay:YES];
 }
 
@@ -1270,6 +1553,13 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
                            horizontalSpacing:1.0
                              verticalSpacing:1.0
                                     baseline:&baseline];
+    PTYFontInfo *newPrimaryFont;
+    PTYFontInfo *newSecondaryFont;
+    [PTYFontInfo getSharedFontInfoForFont:aFont
+                             nonAsciiFont:naFont
+                                 baseline:baseline
+                                  primary:&newPrimaryFont
+                                secondary:&newSecondaryFont];
 
     charWidthWithoutSpacing = sz.width;
     charHeightWithoutSpacing = sz.height;
@@ -1278,34 +1568,13 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
     charWidth = ceil(charWidthWithoutSpacing * horizontalSpacing);
     lineHeight = ceil(charHeightWithoutSpacing * verticalSpacing);
 
-    primaryFont.font = aFont;
-    primaryFont.baselineOffset = baseline;
-    primaryFont.boldVersion = [primaryFont computedBoldVersion];
-    primaryFont.italicVersion = [primaryFont computedItalicVersion];
-    primaryFont.boldItalicVersion = [primaryFont computedBoldItalicVersion];
-    
-    secondaryFont.font = naFont;
-    secondaryFont.baselineOffset = baseline;
-    secondaryFont.boldVersion = [secondaryFont computedBoldVersion];
-    secondaryFont.italicVersion = [secondaryFont computedItalicVersion];
-    secondaryFont.boldItalicVersion = [secondaryFont computedBoldItalicVersion];
-
-    // Force the secondary font to use the same baseline as the primary font.
-    secondaryFont.baselineOffset = primaryFont.baselineOffset;
-    if (secondaryFont.boldVersion) {
-        if (primaryFont.boldVersion) {
-            secondaryFont.boldVersion.baselineOffset = primaryFont.boldVersion.baselineOffset;
-        } else {
-            secondaryFont.boldVersion.baselineOffset = secondaryFont.baselineOffset;
-        }
-    }
-    if (secondaryFont.italicVersion) {
-        if (primaryFont.italicVersion) {
-            secondaryFont.italicVersion.baselineOffset = primaryFont.italicVersion.baselineOffset;
-        } else {
-            secondaryFont.italicVersion.baselineOffset = secondaryFont.baselineOffset;
-        }
-    }
+    [glyphAtlas_ removeAllGlyphs];
+    [complexGlyphCache_ removeAllLines];
+    [boxDrawingPaths_ removeAllObjects];
+    [primaryFont autorelease];
+    primaryFont = [newPrimaryFont retain];
+    [secondaryFont autorelease];
+    secondaryFont = [newSecondaryFont retain];
 
     [self updateMarkedTextAttributes];
     [self setNeedsDisplay:YES];
@@ -1354,6 +1623,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
 - (void)setLineHeight:(double)aLineHeight
 {
     lineHeight = aLineHeight;
+    [boxDrawingPaths_ removeAllObjects];
 }
 
 - (double)charWidth
@@ -1364,6 +1634,7 @@ static CGFloat PerceivedBrightness(CGFloat r, CGFloat g, CGFloat b) {
 - (void)setCharWidth:(double)width
 {
     charWidth = width;
+    [boxDrawingPaths_ removeAllObjects];
 }
 
 - (void)toggleShowTimestamps
@@ -1515,50 +1786,24 @@ NSMutableArray* screens=0;
             nil];
 }
 
-// Range in allText_ of the given line.
+// Range in the accessibility text of the given line.
 - (NSRange)_rangeOfLine:(NSUInteger)lineNumber
 {
-    NSRange range;
-    [self _allText];  // Refresh lineBreakCharOffsets_
-    if (lineNumber == 0) {
-        range.location = 0;
-    } else {
-        range.location = [[lineBreakCharOffsets_ objectAtIndex:lineNumber-1] unsignedLongValue];
-    }
-    if (lineNumber >= [lineBreakCharOffsets_ count]) {
-        range.length = [allText_ length] - range.location;
-    } else {
-        range.length = [[lineBreakCharOffsets_ objectAtIndex:lineNumber] unsignedLongValue] - range.location;
-    }
-    return range;
+    [self _allText];  // Refresh line offsets
+    return [accessibilityTextModel_ rangeOfLine:lineNumber];
 }
 
-// Range in allText_ of the given index.
+// Line number of an index in the accessibility text. Complex chars are expanded when the text is
+// built, so indexes and char locations are the same.
 - (NSUInteger)_lineNumberOfIndex:(NSUInteger)theIndex
 {
-    NSUInteger lineNum = 0;
-    for (NSNumber* n in lineBreakIndexOffsets_) {
-        NSUInteger offset = [n unsignedLongValue];
-        if (offset > theIndex) {
-            break;
-        }
-        lineNum++;
-    }
-    return lineNum;
+    return [accessibilityTextModel_ lineNumberOfOffset:theIndex];
 }
 
-// Line number of a location (respecting compositing chars) in allText_.
+// Line number of a location (respecting compositing chars) in the accessibility text.
 - (NSUInteger)_lineNumberOfChar:(NSUInteger)location
 {
-    NSUInteger lineNum = 0;
-    for (NSNumber* n in lineBreakCharOffsets_) {
-        NSUInteger offset = [n unsignedLongValue];
-        if (offset > location) {
-            break;
-        }
-        lineNum++;
-    }
-    return lineNum;
+    return [accessibilityTextModel_ lineNumberOfOffset:location];
 }
 
 // Number of unichar a character uses (normally 1 in English).
@@ -1567,17 +1812,14 @@ NSMutableArray* screens=0;
     return [ScreenCharToStr(&sct) length];
 }
 
-// Position, respecting compositing chars, in allText_ of a line.
+// Position, respecting compositing chars, in the accessibility text of a line.
 - (NSUInteger)_offsetOfLine:(NSUInteger)lineNum
 {
-    if (lineNum == 0) {
-        return 0;
-    }
-    assert(lineNum < [lineBreakCharOffsets_ count] + 1);
-    return [[lineBreakCharOffsets_ objectAtIndex:lineNum - 1] unsignedLongValue];
+    assert(lineNum < [accessibilityTextModel_ numberOfLines] + 1);
+    return [accessibilityTextModel_ offsetOfLine:lineNum];
 }
 
-// Onscreen X-position of a location (respecting compositing chars) in allText_.
+// Onscreen X-position of a location (respecting compositing chars) in the accessibility text.
 - (NSUInteger)_columnOfChar:(NSUInteger)location inLine:(NSUInteger)lineNum
 {
     NSUInteger lineStart = [self _offsetOfLine:lineNum];
@@ -1591,19 +1833,13 @@ NSMutableArray* screens=0;
     return i;
 }
 
-// Index (ignoring compositing chars) of a line in allText_.
+// Index of the first char of a line in the accessibility text.
 - (NSUInteger)_startingIndexOfLineNumber:(NSUInteger)lineNumber
 {
-    if (lineNumber < [lineBreakIndexOffsets_ count]) {
-        return [[lineBreakCharOffsets_ objectAtIndex:lineNumber] unsignedLongValue];
-    } else if ([lineBreakIndexOffsets_ count] > 0) {
-        return [[lineBreakIndexOffsets_ lastObject] unsignedLongValue];
-    } else {
-        return 0;
-    }
+    return [accessibilityTextModel_ offsetOfLine:lineNumber];
 }
 
-// Range in allText_ of an index (ignoring compositing chars).
+// Range in the accessibility text of an index (ignoring compositing chars).
 - (NSRange)_rangeOfIndex:(NSUInteger)theIndex
 {
     NSUInteger lineNumber = [self _lineNumberOfIndex:theIndex];
@@ -1656,9 +1892,8 @@ NSMutableArray* screens=0;
  *
  * Index                   012 34
  * Char                    012345
- * allText_              = xba´ry
- * lineBreakCharOffests_ = [1, 4]
- * lineBreakInexOffsets_ = [1, 3]
+ * text                  = xba´ry
+ * line ends             = [1, 4]
  */
 - (id)_accessibilityAttributeValue:(NSString *)attribute forParameter:(id)parameter
 {
@@ -1669,7 +1904,7 @@ NSMutableArray* screens=0;
     } else if ([attribute isEqualToString:NSAccessibilityRangeForLineParameterizedAttribute]) {
         //(NSValue *)  - (rangeValue) range of line; param:(NSNumber *)
         NSUInteger lineNumber = [(NSNumber*)parameter unsignedLongValue];
-        if (lineNumber >= [lineBreakIndexOffsets_ count]) {
+        if (lineNumber >= [accessibilityTextModel_ numberOfLines]) {
             return [NSValue valueWithRange:NSMakeRange(NSNotFound, 0)];
         } else {
             return [NSValue valueWithRange:[self _rangeOfLine:lineNumber]];
@@ -1677,7 +1912,7 @@ NSMutableArray* screens=0;
     } else if ([attribute isEqualToString:NSAccessibilityStringForRangeParameterizedAttribute]) {
         //(NSString *) - substring; param:(NSValue * - rangeValue)
         NSRange range = [(NSValue*)parameter rangeValue];
-        return [allText_ substringWithRange:range];
+        return [[accessibilityTextModel_ text] substringWithRange:range];
     } else if ([attribute isEqualToString:NSAccessibilityRangeForPositionParameterizedAttribute]) {
         //(NSValue *)  - (rangeValue) composed char range; param:(NSValue * - pointValue)
         NSPoint screenPosition = [(NSValue*)parameter pointValue];
@@ -1729,7 +1964,7 @@ NSMutableArray* screens=0;
         if (range.location == NSNotFound) {
             return nil;
         } else {
-            NSString *theString = [allText_ substringWithRange:range];
+            NSString *theString = [[accessibilityTextModel_ text] substringWithRange:range];
             NSAttributedString *attributedString = [[[NSAttributedString alloc] initWithString:theString] autorelease];
             return attributedString;
         }
@@ -1747,63 +1982,12 @@ NSMutableArray* screens=0;
     return result;
 }
 
-// TODO(georgen): Speed this up! This code is dreadfully slow but it's only used
-// when accessibility is on, and it might be faster than voiceover for reasonable
-// amounts of text.
+// Brings the accessibility text up to date if the screen was refreshed since it was last built.
+// Only lines that changed are expanded again.
 - (NSString*)_allText
 {
-    [allText_ release];
-    [lineBreakCharOffsets_ release];
-    [lineBreakIndexOffsets_ release];
-
-    allText_ = [[NSMutableString alloc] init];
-    lineBreakCharOffsets_ = [[NSMutableArray alloc] init];
-    lineBreakIndexOffsets_ = [[NSMutableArray alloc] init];
-
-    int width = [dataSource width];
-    unichar chars[width * kMaxParts];
-    int offset = 0;
-    for (int i = 0; i < [dataSource numberOfLines]; i++) {
-        screen_char_t* line = [dataSource getLineAtIndex:i];
-        int k;
-        // Get line width, store it in k
-        for (k = width - 1; k >= 0; k--) {
-            if (line[k].code) {
-                break;
-            }
-        }
-        int o = 0;
-        // Add first width-k chars to the 'chars' array, expanding complex chars.
-        for (int j = 0; j <= k; j++) {
-            if (line[j].complexChar) {
-                NSString* cs = ComplexCharToStr(line[j].code);
-                for (int l = 0; l < [cs length]; ++l) {
-                    chars[o++] = [cs characterAtIndex:l];
-                }
-            } else {
-                if (line[j].code >= 0xf000) {
-                    // Don't output private range chars to accessibility.
-                    chars[o++] = 0;
-                } else {
-                    chars[o++] = line[j].code;
-                }
-            }
-        }
-        // Append this line to allText_.
-        offset += o;
-        if (k >= 0) {
-            [allText_ appendString:[NSString stringWithCharacters:chars length:o]];
-        }
-        if (line[width].code == EOL_HARD) {
-            // Add a newline and update offsets arrays that track line break locations.
-            [allText_ appendString:@"\n"];
-            ++offset;
-        }
-        [lineBreakCharOffsets_ addObject:[NSNumber numberWithUnsignedLong:[allText_ length]]];
-        [lineBreakIndexOffsets_ addObject:[NSNumber numberWithUnsignedLong:offset]];
-    }
-
-    return allText_;
+    [accessibilityTextModel_ updateWithDataSource:dataSource];
+    return [accessibilityTextModel_ text];
 }
 
 - (id)_accessibilityAttributeValue:(NSString *)attribute
@@ -1828,7 +2012,7 @@ NSMutableArray* screens=0;
         int x = [dataSource cursorX] - 1;
         int y = [dataSource numberOfLines] - [dataSource height] + [dataSource cursorY] - 1;
         // quick fix for ZoomText for Mac - it does not query AXValue or other
-        // attributes that (re)generate allText_ and especially lineBreak{Char,Index}Offsets_
+        // attributes that bring the accessibility text and its line offsets up to date,
         // which are needed for _rangeOfCharAtX:y:
         [self _allText];
         NSRange range = [self _rangeOfCharAtX:x y:y];
@@ -1880,7 +2064,7 @@ NSMutableArray* screens=0;
 
 - (BOOL)_isCursorBlinking
 {
-    if ([self blinkingCursor] &&
+    if ([self _cursorBlinkingAllowed] &&
         [self isInKeyWindow] &&
         [_delegate textViewIsActiveSession]) {
         return YES;
@@ -1891,12 +2075,12 @@ NSMutableArray* screens=0;
 
 - (BOOL)_charBlinks:(screen_char_t)sct
 {
-    return blinkAllowed_ && sct.blink;
+    return [self _textBlinkingAllowed] && sct.blink;
 }
 
-- (BOOL)_isTextBlinking
+// Lines that are at least partly visible.
+- (VT100GridRange)_visibleLineRange
 {
-    int width = [dataSource width];
     int lineStart = ([self visibleRect].origin.y + VMARGIN) / lineHeight;  // add VMARGIN because stuff under top margin isn't visible.
     int lineEnd = ceil(([self visibleRect].origin.y + [self visibleRect].size.height - [self excess]) / lineHeight);
     if (lineStart < 0) {
@@ -1905,24 +2089,67 @@ NSMutableArray* screens=0;
     if (lineEnd > [dataSource numberOfLines]) {
         lineEnd = [dataSource numberOfLines];
     }
-    for (int y = lineStart; y < lineEnd; y++) {
-        screen_char_t* theLine = [dataSource getLineAtIndex:y];
-        for (int x = 0; x < width; x++) {
-            if (theLine[x].blink) {
-                return YES;
-            }
-        }
-    }
+    return VT100GridRangeMake(lineStart, MAX(0, lineEnd - lineStart));
+}
 
-    return NO;
+- (BOOL)_isTextBlinking
+{
+    [blinkingCellIndex_ updateWithDataSource:dataSource visibleLines:[self _visibleLineRange]];
+    return [blinkingCellIndex_ hasBlinkingCells];
 }
 
 - (BOOL)_isAnythingBlinking
 {
-    return [self _isCursorBlinking] || (blinkAllowed_ && [self _isTextBlinking]);
+    return [self _isCursorBlinking] || ([self _textBlinkingAllowed] && [self _isTextBlinking]);
+}
+
+- (FrameProfiler *)frameProfiler
+{
+    return frameProfiler_;
+}
+
+- (void)setFrameProfiler:(FrameProfiler *)frameProfiler
+{
+    [frameProfiler_ autorelease];
+    frameProfiler_ = [frameProfiler retain];
 }
 
 - (BOOL)refresh
+{
+    [frameProfiler_ beginStage:kFrameProfilerStageRefresh];
+    SignpostBegin("refresh", [[_delegate SHELL] tty], 0);
+    BOOL result = [self _refresh];
+    SignpostEnd("refresh", [[_delegate SHELL] tty], result);
+    [frameProfiler_ endStage:kFrameProfilerStageRefresh];
+    if (showFrameProfiler_) {
+        [self setNeedsDisplayInRect:[self _frameProfilerRect]];
+    }
+    return result;
+}
+
+- (BOOL)drawCursorLineImmediatelyIfOnlyChange
+{
+    if (!dataSource || [dataSource isAllDirty] || [dataSource scrollDamageDistance] != 0) {
+        return NO;
+    }
+    // If the cursor moved to another line, the line it left would need to be drawn too.
+    const int cursorY = [dataSource cursorY] - 1;
+    if (cursorY != prevCursorY) {
+        return NO;
+    }
+    for (NSValue *value in [dataSource dirtyRects]) {
+        VT100GridRect rect = [value gridRectValue];
+        if (rect.origin.y != cursorY || rect.size.height != 1) {
+            return NO;
+        }
+    }
+    [frameProfiler_ addToCounter:kFrameProfilerCounterEchoFastPaths amount:1];
+    [self refresh];
+    [self displayIfNeeded];
+    return YES;
+}
+
+- (BOOL)_refresh
 {
     DebugLog(@"PTYTextView refresh called");
     if (dataSource == nil) {
@@ -1946,6 +2173,7 @@ NSMutableArray* screens=0;
         [[self superview] setFrame:frame];
         frame.size.height -= VMARGIN;
         NSAccessibilityPostNotification(self, NSAccessibilityRowCountChangedNotification);
+        accessibilityValueChanged_ = YES;
     } else if (scrollbackOverflow > 0) {
         // Some number of lines were lost from the head of the buffer.
 
@@ -2019,6 +2247,7 @@ NSMutableArray* screens=0;
         [self updateNoteViewFrames];
 
         NSAccessibilityPostNotification(self, NSAccessibilityRowCountChangedNotification);
+        accessibilityValueChanged_ = YES;
     }
 
     // Scroll to the bottom if needed.
@@ -2026,7 +2255,6 @@ NSMutableArray* screens=0;
     if (!userScroll) {
         [self scrollEnd];
     }
-    NSAccessibilityPostNotification(self, NSAccessibilityValueChangedNotification);
     long long absCursorY = [dataSource cursorY] + [dataSource numberOfLines] + [dataSource totalScrollbackOverflow] - [dataSource height];
     if ([dataSource cursorX] != accX ||
         absCursorY != accY) {
@@ -2053,7 +2281,16 @@ NSMutableArray* screens=0;
         }
     }
 
-    return [self updateDirtyRects] || [self _isCursorBlinking];
+    BOOL anythingIsBlinking = [self updateDirtyRects];
+
+    // Tell accessibility clients about changes at most once per refresh, and only if there were
+    // any. They'll ask for the text again, which updates just the lines that changed.
+    if (accessibilityValueChanged_) {
+        accessibilityValueChanged_ = NO;
+        [accessibilityTextModel_ setNeedsUpdate];
+        NSAccessibilityPostNotification(self, NSAccessibilityValueChangedNotification);
+    }
+    return anythingIsBlinking || [self _isCursorBlinking];
 }
 
 // Overrides an NSView method.
@@ -2129,6 +2366,22 @@ NSMutableArray* screens=0;
     return localOffset + [dataSource totalScrollbackOverflow];
 }
 
+- (void)addToMemoryReport:(MemoryReport *)report
+{
+    const CGFloat scale = [[self window] backingScaleFactor] ?: 1;
+    if (lineRenderCache_) {
+        [report addBytes:[lineRenderCache_ estimatedBytesWithScale:scale]
+                   count:[lineRenderCache_ numberOfLayers]
+             forCategory:@"Line render cache"];
+    }
+    if (glyphAtlas_) {
+        [report addBytes:[glyphAtlas_ imageBytes]
+                   count:[glyphAtlas_ numberOfGlyphs]
+             forCategory:@"Glyph atlas"];
+    }
+    [report addBytes:[lineStringCache_ estimatedBytes] forCategory:@"Line string cache"];
+}
+
 - (void)scrollToAbsoluteOffset:(long long)absOff height:(int)height
 {
     NSRect aFrame;
@@ -2156,7 +2409,27 @@ NSMutableArray* screens=0;
   int currentCursorX = [dataSource cursorX] - 1;
   int currentCursorY = [dataSource cursorY] - 1;
   DLog(@"Mark cursor position %d,%d dirty", prevCursorX, prevCursorY);
-  [dataSource setCharDirtyAtCursorX:currentCursorX Y:currentCursorY];
+  [self _setNeedsDisplayForCursorAtX:currentCursorX y:currentCursorY];
+}
+
+// The cursor is drawn over the grid but isn't part of it. Redrawing the cells under it here,
+// rather than marking them dirty in the grid, keeps a cursor move or hide from counting as a change
+// to the contents: those lines' find highlights, blink index, accessibility value and contents
+// change notification are all left alone. Two cells are redrawn in case it's on a double-width
+// character.
+- (void)_setNeedsDisplayForCursorAtX:(int)x y:(int)y
+{
+    const int width = [dataSource width];
+    const int height = [dataSource height];
+    if (x == width && y < height - 1) {
+        x = 0;
+        y++;
+    }
+    if (x < 0 || y < 0 || x >= width || y >= height) {
+        return;
+    }
+    const int lineStart = [dataSource numberOfLines] - height;
+    [self setNeedsDisplayInGridRect:VT100GridRectMake(x, lineStart + y, MIN(2, width - x), 1)];
 }
 
 - (void)hideCursor
@@ -2181,6 +2454,8 @@ NSMutableArray* screens=0;
     // and they're guaranteed to be disjoint. So draw each of them individually.
     const NSRect *rectArray;
     NSInteger rectCount;
+    const NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    [frameProfiler_ beginStage:kFrameProfilerStageDrawRect];
     if (drawRectDuration_) {
         [drawRectDuration_ startTimer];
         NSTimeInterval interval = [drawRectInterval_ timeSinceTimerStarted];
@@ -2192,7 +2467,9 @@ NSMutableArray* screens=0;
     [self getRectsBeingDrawn:&rectArray count:&rectCount];
     for (int i = 0; i < rectCount; i++) {
         DLog(@"drawRect - draw sub rectangle %@", [NSValue valueWithRect:rectArray[i]]);
+        SignpostBegin("draw", [[_delegate SHELL] tty], rectArray[i].size.height / lineHeight);
         [self drawRect:rectArray[i] to:nil];
+        SignpostEnd("draw", [[_delegate SHELL] tty], rectArray[i].size.height / lineHeight);
     }
     if (drawRectDuration_) {
         [drawRectDuration_ addValue:[drawRectDuration_ timeSinceTimerStarted]];
@@ -2228,6 +2505,19 @@ NSMutableArray* screens=0;
                           operation:NSCompositeSourceOver
                            fraction:0.5];
     }
+    if ([_delegate textViewIsFastForwarding]) {
+        NSDictionary *attributes = @{ NSFontAttributeName: [NSFont systemFontOfSize:10],
+                                      NSForegroundColorAttributeName: [NSColor whiteColor] };
+        NSString *label = @"Fast-forwarding";
+        NSSize size = [label sizeWithAttributes:attributes];
+        NSRect rect = NSMakeRect(0, frame.origin.y + kFastForwardMargin,
+                                 size.width + 8, size.height + 4);
+        x -= rect.size.width + kFastForwardMargin;
+        rect.origin.x = x;
+        [[NSColor colorWithCalibratedWhite:0 alpha:0.7] set];
+        NSRectFillUsingOperation(rect, NSCompositeSourceOver);
+        [label drawAtPoint:NSMakePoint(x + 4, rect.origin.y + 2) withAttributes:attributes];
+    }
 
     if (flashing_ > 0) {
         NSImage* image = nil;
@@ -2266,89 +2556,68 @@ NSMutableArray* screens=0;
         [self drawTimestamps];
     }
 
+    [frameProfiler_ endStage:kFrameProfilerStageDrawRect];
+    [frameProfiler_ endFrame];
+    [_delegate textViewDidDrawWithDuration:[NSDate timeIntervalSinceReferenceDate] - start];
+    [[InputLatencyProfiler sharedInstance] recordStage:kInputLatencyStageDrawn
+                                            forSession:_delegate];
+    if (showFrameProfiler_) {
+        [self _drawFrameProfiler];
+    }
+
     // Not sure why this is needed, but for some reason this view draws over its subviews.
     for (NSView *subview in [self subviews]) {
         [subview setNeedsDisplay:YES];
     }
 }
 
+// Top right corner of the visible area, where the frame profiler HUD goes.
+- (NSRect)_frameProfilerRect
+{
+    const CGFloat kWidth = 180;
+    const CGFloat kHeight = 14 * (kFrameProfilerNumberOfStages + kFrameProfilerNumberOfCounters + 1) + 8;
+    NSRect visibleRect = [self visibleRect];
+    return NSMakeRect(NSMaxX(visibleRect) - kWidth - kBroadcastMargin,
+                      visibleRect.origin.y + kBroadcastMargin,
+                      kWidth,
+                      kHeight);
+}
+
+- (void)_drawFrameProfiler
+{
+    NSRect rect = [self _frameProfilerRect];
+    [[NSColor colorWithCalibratedWhite:0 alpha:0.7] set];
+    NSRectFillUsingOperation(rect, NSCompositeSourceOver);
+    NSDictionary *attributes = @{ NSFontAttributeName: [NSFont userFixedPitchFontOfSize:10],
+                                  NSForegroundColorAttributeName: [NSColor whiteColor] };
+    [[frameProfiler_ summary] drawInRect:NSInsetRect(rect, 4, 4) withAttributes:attributes];
+}
+
 - (void)drawTimestamps
 {
     NSRect visibleRect = [[self enclosingScrollView] documentVisibleRect];
-
-    for (int y = visibleRect.origin.y / lineHeight;
+    const int firstLine = visibleRect.origin.y / lineHeight;
+    NSMutableArray *timestamps = [NSMutableArray array];
+    for (int y = firstLine;
          y < (visibleRect.origin.y + visibleRect.size.height) / lineHeight && y < [dataSource numberOfLines];
          y++) {
-        [self drawTimestampForLine:y];
-    }
-}
-
-- (void)drawTimestampForLine:(int)line
-{
-    NSDate *timestamp = [dataSource timestampForLine:line];
-    NSDateFormatter *fmt = [[[NSDateFormatter alloc] init] autorelease];
-    const NSTimeInterval day = -86400;
-    const NSTimeInterval timeDelta = [timestamp timeIntervalSinceNow];
-    if (timeDelta < day * 365) {
-        // More than a year ago: include year
-        [fmt setDateFormat:[NSDateFormatter dateFormatFromTemplate:@"yyyyMMMd hh:mm:ss"
-                                                           options:0
-                                                            locale:[NSLocale currentLocale]]];
-    } else if (timeDelta < day * 7) {
-        // 1 week to 1 year ago: include date without year
-        [fmt setDateFormat:[NSDateFormatter dateFormatFromTemplate:@"MMMd hh:mm:ss"
-                                                           options:0
-                                                            locale:[NSLocale currentLocale]]];
-    } else if (timeDelta < day) {
-        // 1 day to 1 week ago: include day of week
-        [fmt setDateFormat:[NSDateFormatter dateFormatFromTemplate:@"EEE hh:mm:ss"
-                                                           options:0
-                                                            locale:[NSLocale currentLocale]]];
-        
-    } else {
-        // In last 24 hours, just show time
-        [fmt setDateFormat:[NSDateFormatter dateFormatFromTemplate:@"hh:mm:ss"
-                                                           options:0
-                                                            locale:[NSLocale currentLocale]]];
+        NSDate *timestamp = [dataSource timestampForLine:y];
+        [timestamps addObject:timestamp ? (id)timestamp : (id)[NSNull null]];
     }
-        
-    NSString *s = [fmt stringFromDate:timestamp];
 
-    NSSize size = [s sizeWithAttributes:@{ NSFontAttributeName: [NSFont systemFontOfSize:10] }];
-    int w = size.width + MARGIN;
-    int x = MAX(0, self.frame.size.width - w);
-    CGFloat y = line * lineHeight;
-    NSColor *bgColor = defaultBGColor;
-    NSColor *fgColor = defaultFGColor;
-    BOOL isDark = ([self perceivedBrightness:defaultFGColor] < kBackgroundConsideredDarkThreshold);
-    NSColor *shadowColor;
-    if (isDark) {
-        shadowColor = [NSColor whiteColor];
-    } else {
-        shadowColor = [NSColor blackColor];
+    if (!timestampRenderer_) {
+        timestampRenderer_ = [[TimestampRenderer alloc] init];
     }
-
-    const CGFloat alpha = 0.75;
-    NSGradient *gradient =
-        [[[NSGradient alloc] initWithStartingColor:[bgColor colorWithAlphaComponent:0]
-                                       endingColor:[bgColor colorWithAlphaComponent:alpha]] autorelease];
-    [[NSGraphicsContext currentContext] setCompositingOperation:NSCompositeSourceOver];
-    [gradient drawInRect:NSMakeRect(x - 20, y, 20, lineHeight) angle:0];
-
-    [[bgColor colorWithAlphaComponent:alpha] set];
-    [[NSGraphicsContext currentContext] setCompositingOperation:NSCompositeSourceOver];
-    NSRectFillUsingOperation(NSMakeRect(x, y, w, lineHeight), NSCompositeSourceOver);
-
-    NSShadow *shadow = [[[NSShadow alloc] init] autorelease];
-    shadow.shadowColor = shadowColor;
-    shadow.shadowBlurRadius = 0.2f;
-    shadow.shadowOffset = CGSizeMake(0.5, -0.5);
-
-    NSDictionary *attributes = @{ NSFontAttributeName: [NSFont systemFontOfSize:10],
-                                  NSForegroundColorAttributeName: fgColor,
-                                  NSShadowAttributeName: shadow };
-    CGFloat offset = (lineHeight - size.height) / 2;
-    [s drawAtPoint:NSMakePoint(x, y + offset) withAttributes:attributes];
+    BOOL isDark = ([self perceivedBrightness:defaultFGColor] < kBackgroundConsideredDarkThreshold);
+    [timestampRenderer_ setBackgroundColor:defaultBGColor
+                                 textColor:defaultFGColor
+                               shadowColor:isDark ? [NSColor whiteColor] : [NSColor blackColor]];
+    [timestampRenderer_ drawTimestamps:timestamps
+                     firstAbsoluteLine:firstLine + [dataSource totalScrollbackOverflow]
+                                   atY:firstLine * lineHeight
+                            lineHeight:lineHeight
+                             rightEdge:self.frame.size.width
+                                margin:MARGIN];
 }
 
 - (void)drawOutlineInRect:(NSRect)rect topOnly:(BOOL)topOnly
@@ -2476,6 +2745,18 @@ NSMutableArray* screens=0;
     BOOL anyBlinking = NO;
 
     CGContextRef ctx = (CGContextRef)[[NSGraphicsContext currentContext] graphicsPort];
+    // Rows drawn at an offset or over a background image depend on more than their contents.
+    const BOOL useLineRenderCache = (lineRenderCache_ &&
+                                     !toOrigin &&
+                                     ![(PTYScrollView *)[self enclosingScrollView] hasBackgroundImage] &&
+                                     !(useBackgroundIndicator_ && [_delegate textViewSessionIsBroadcastingInput]));
+
+    // Get the marks and notes on all the lines to draw at once rather than searching once per line.
+    firstDrawnAnnotatedLine_ = MAX(lineStart, overflow) - overflow;
+    const VT100GridRange annotatedLines =
+        VT100GridRangeMake(firstDrawnAnnotatedLine_, lineEnd - MAX(lineStart, overflow));
+    noteRangesForDrawnLines_ = [[dataSource charactersWithNotesOnLines:annotatedLines] retain];
+    marksForDrawnLines_ = [[dataSource linesWithMarksInRange:annotatedLines] retain];
 
     for (int line = lineStart; line < lineEnd; line++) {
         NSRect lineRect = [self visibleRect];
@@ -2496,11 +2777,17 @@ NSMutableArray* screens=0;
                     const CGFloat offsetFromTopOfScreen = y - initialY;
                     temp = NSMakePoint(toOrigin->x, toOrigin->y + offsetFromTopOfScreen);
                 }
-                anyBlinking |= [self _drawLine:line-overflow
-                                           AtY:y
-                                       toPoint:toOrigin ? &temp : nil
-                                     charRange:charRange
-                                       context:ctx];
+                if (useLineRenderCache) {
+                    anyBlinking |= [self _drawLineUsingRenderCache:line-overflow
+                                                               AtY:y
+                                                           context:ctx];
+                } else {
+                    anyBlinking |= [self _drawLine:line-overflow
+                                               AtY:y
+                                           toPoint:toOrigin ? &temp : nil
+                                         charRange:charRange
+                                           context:ctx];
+                }
             }
 #ifdef DEBUG_DRAWING
             // if overflow > line then the requested line cannot be drawn
@@ -2534,9 +2821,18 @@ NSMutableArray* screens=0;
         }
         y += lineHeight;
     }
+    [noteRangesForDrawnLines_ release];
+    noteRangesForDrawnLines_ = nil;
+    [marksForDrawnLines_ release];
+    marksForDrawnLines_ = nil;
 #ifdef DEBUG_DRAWING
     [self appendDebug:lineDebug];
 #endif
+    if (useLineRenderCache) {
+        // Keep rows that are onscreen plus a screenful on either side for scrolling back and forth.
+        [lineRenderCache_ removeLayersOutsideLines:firstVisibleRow - visibleRows - overflow + [dataSource totalScrollbackOverflow]
+                                             count:visibleRows * 3];
+    }
     NSRect excessRect;
     if (imeOffset) {
         // Draw a default-color rectangle from below the last line of text to
@@ -2620,7 +2916,9 @@ NSMutableArray* screens=0;
                                height:[dataSource height]
                          cursorHeight:[self cursorHeight]
                                   ctx:ctx];
+    [frameProfiler_ beginStage:kFrameProfilerStageCursor];
     [self _drawCursorTo:toOrigin];
+    [frameProfiler_ endStage:kFrameProfilerStageCursor];
     anyBlinking |= [self _isCursorBlinking];
 
 #ifdef DEBUG_DRAWING
@@ -2686,13 +2984,12 @@ NSMutableArray* screens=0;
                 continue;
             }
         }
-        unichar* backingStore;
-        int* deltas;
-        NSString* string = ScreenCharArrayToString(theLine,
-                                                   xMin,
-                                                   MIN(EffectiveLineLength(theLine, width), xMax),
-                                                   &backingStore,
-                                                   &deltas);
+        const int* deltas;
+        NSString* string = [lineStringCache_ stringForLine:theLine
+                                        absoluteLineNumber:i + [dataSource totalScrollbackOverflow]
+                                                     start:xMin
+                                                       end:MIN(EffectiveLineLength(theLine, width), xMax)
+                                                    deltas:&deltas];
         int o = 0;
         for (int k = 0; k < [string length]; k++) {
             o = k + deltas[k];
@@ -2702,8 +2999,6 @@ NSMutableArray* screens=0;
             [coords addObject:[NSValue valueWithGridCoord:VT100GridCoordMake(o, i)]];
         }
         [joinedLines appendString:string];
-        free(deltas);
-        free(backingStore);
 
         j++;
         o++;
@@ -2739,8 +3034,8 @@ NSMutableArray* screens=0;
                                         coords:coords
                               ignoringNewlines:ignoringNewlines];
 
-    NSArray* rulesArray = smartSelectionRules_ ? smartSelectionRules_ : [SmartSelectionController defaultRules];
-    const int numRules = [rulesArray count];
+    SmartSelectionRuleSet *ruleSet = [self smartSelectionRuleSet];
+    const int numRules = [ruleSet count];
 
     NSMutableDictionary* matches = [NSMutableDictionary dictionaryWithCapacity:13];
     int numCoords = [coords count];
@@ -2750,51 +3045,35 @@ NSMutableArray* screens=0;
         NSLog(@"Perform smart selection on text: %@", textWindow);
     }
     for (int j = 0; j < numRules; j++) {
-        NSDictionary *rule = [rulesArray objectAtIndex:j];
-        if (actionRequred && [[SmartSelectionController actionsInRule:rule] count] == 0) {
+        NSDictionary *rule = [ruleSet ruleAtIndex:j];
+        if (actionRequred && ![ruleSet ruleHasActionsAtIndex:j]) {
             DLog(@"Ignore smart selection rule because it has no action: %@", rule);
             continue;
         }
-        NSString *regex = [SmartSelectionController regexInRule:rule];
-        double precision = [SmartSelectionController precisionInRule:rule];
+        double precision = [ruleSet precisionOfRuleAtIndex:j];
         if (debug) {
-            NSLog(@"Try regex %@", regex);
-        }
-        for (int i = 0; i <= targetOffset; i++) {
-            NSString* substring = [textWindow substringWithRange:NSMakeRange(i, [textWindow length] - i)];
-            NSError* regexError = nil;
-            NSRange temp = [substring rangeOfRegex:regex
-                                           options:0
-                                           inRange:NSMakeRange(0, [substring length])
-                                           capture:0
-                                             error:&regexError];
-            if (temp.location != NSNotFound) {
-                if (i + temp.location <= targetOffset && i + temp.location + temp.length > targetOffset) {
-                    NSString* result = [substring substringWithRange:temp];
-                    double score = precision * (double) temp.length;
-                    SmartMatch* oldMatch = [matches objectForKey:result];
-                    if (!oldMatch || score > oldMatch.score) {
-                        SmartMatch* match = [[[SmartMatch alloc] init] autorelease];
-                        match.score = score;
-                        VT100GridCoord startCoord = [[coords objectAtIndex:i + temp.location] gridCoordValue];
-                        VT100GridCoord endCoord = [[coords objectAtIndex:MIN(numCoords - 1, i + temp.location + temp.length)] gridCoordValue];
-                        match.startX = startCoord.x;
-                        match.absStartY = startCoord.y + [dataSource totalScrollbackOverflow];
-                        match.endX = endCoord.x;
-                        match.absEndY = endCoord.y + [dataSource totalScrollbackOverflow];
-                        match.rule = rule;
-                        [matches setObject:match forKey:result];
-
-                        if (debug) {
-                            NSLog(@"Add result %@ at %d,%lld -> %d,%lld with score %lf", result, match.startX, match.absStartY, match.endX, match.absEndY, match.score);
-                        }
-                    }
-                    i += temp.location + temp.length - 1;
-                } else {
-                    i += temp.location;
+            NSLog(@"Try regex %@", [SmartSelectionController regexInRule:rule]);
+        }
+        NSRange temp = [ruleSet rangeOfRule:j inText:textWindow containingOffset:targetOffset];
+        if (temp.location != NSNotFound) {
+            NSString* result = [textWindow substringWithRange:temp];
+            double score = precision * (double) temp.length;
+            SmartMatch* oldMatch = [matches objectForKey:result];
+            if (!oldMatch || score > oldMatch.score) {
+                SmartMatch* match = [[[SmartMatch alloc] init] autorelease];
+                match.score = score;
+                VT100GridCoord startCoord = [[coords objectAtIndex:temp.location] gridCoordValue];
+                VT100GridCoord endCoord = [[coords objectAtIndex:MIN(numCoords - 1, temp.location + temp.length)] gridCoordValue];
+                match.startX = startCoord.x;
+                match.absStartY = startCoord.y + [dataSource totalScrollbackOverflow];
+                match.endX = endCoord.x;
+                match.absEndY = endCoord.y + [dataSource totalScrollbackOverflow];
+                match.rule = rule;
+                [matches setObject:match forKey:result];
+
+                if (debug) {
+                    NSLog(@"Add result %@ at %d,%lld -> %d,%lld with score %lf", result, match.startX, match.absStartY, match.endX, match.absEndY, match.score);
                 }
-            } else {
-                break;
             }
         }
     }
@@ -2886,6 +3165,7 @@ NSMutableArray* screens=0;
     }
     DebugLog(@"PTYTextView keyDown");
     id delegate = [self delegate];
+    [[InputLatencyProfiler sharedInstance] keyDownInSession:delegate];
     if ([delegate isPasting]) {
         [delegate queueKeyDown:event];
         return;
@@ -3073,6 +3353,7 @@ NSMutableArray* screens=0;
             case MOUSE_REPORTING_BUTTON_MOTION:
             case MOUSE_REPORTING_ALL_MOTION:
                 reportingMouseDown = YES;
+                [self flushPendingMouseMotion];
                 [_delegate writeTask:[terminal mousePress:buttonNumber
                                             withModifiers:[event modifierFlags]
                                                       atX:rx
@@ -3120,6 +3401,7 @@ NSMutableArray* screens=0;
             case MOUSE_REPORTING_NORMAL:
             case MOUSE_REPORTING_BUTTON_MOTION:
             case MOUSE_REPORTING_ALL_MOTION:
+                [self flushPendingMouseMotion];
                 [_delegate writeTask:[terminal mouseRelease:buttonNumber
                                              withModifiers:[event modifierFlags]
                                                        atX:rx
@@ -3173,10 +3455,10 @@ NSMutableArray* screens=0;
             case MOUSE_REPORTING_NORMAL:
             case MOUSE_REPORTING_BUTTON_MOTION:
             case MOUSE_REPORTING_ALL_MOTION:
-                [_delegate writeTask:[terminal mouseMotion:buttonNumber
-                                            withModifiers:[event modifierFlags]
-                                                      atX:rx
-                                                        Y:ry]];
+                [self reportMouseMotion:buttonNumber
+                              modifiers:[event modifierFlags]
+                                      x:rx
+                                      y:ry];
                 return;
                 break;
 
@@ -3217,6 +3499,7 @@ NSMutableArray* screens=0;
             case MOUSE_REPORTING_BUTTON_MOTION:
             case MOUSE_REPORTING_ALL_MOTION:
                 reportingMouseDown = YES;
+                [self flushPendingMouseMotion];
                 [_delegate writeTask:[terminal mousePress:MOUSE_BUTTON_RIGHT
                                            withModifiers:[event modifierFlags]
                                                      atX:rx
@@ -3266,6 +3549,7 @@ NSMutableArray* screens=0;
             case MOUSE_REPORTING_NORMAL:
             case MOUSE_REPORTING_BUTTON_MOTION:
             case MOUSE_REPORTING_ALL_MOTION:
+                [self flushPendingMouseMotion];
                 [_delegate writeTask:[terminal mouseRelease:MOUSE_BUTTON_RIGHT
                                              withModifiers:[event modifierFlags]
                                                        atX:rx
@@ -3308,10 +3592,10 @@ NSMutableArray* screens=0;
             case MOUSE_REPORTING_NORMAL:
             case MOUSE_REPORTING_BUTTON_MOTION:
             case MOUSE_REPORTING_ALL_MOTION:
-                [_delegate writeTask:[terminal mouseMotion:MOUSE_BUTTON_RIGHT
-                                            withModifiers:[event modifierFlags]
-                                                      atX:rx
-                                                        Y:ry]];
+                [self reportMouseMotion:MOUSE_BUTTON_RIGHT
+                              modifiers:[event modifierFlags]
+                                      x:rx
+                                      y:ry];
                 return;
                 break;
 
@@ -3357,6 +3641,7 @@ NSMutableArray* screens=0;
             case MOUSE_REPORTING_BUTTON_MOTION:
             case MOUSE_REPORTING_ALL_MOTION:
                 if ([event deltaY] != 0) {
+                    [self flushPendingMouseMotion];
                     [_delegate writeTask:[terminal mousePress:buttonNumber
                                                withModifiers:[event modifierFlags]
                                                          atX:rx
@@ -3371,7 +3656,96 @@ NSMutableArray* screens=0;
         }
     }
 
-    [super scrollWheel:event];
+    if ([event deltaY] == 0) {
+        [super scrollWheel:event];
+        return;
+    }
+    // Momentum scrolling sends several events per frame. Scroll once per frame by their sum.
+    pendingScrollDelta_ -= [event deltaY] * [[self enclosingScrollView] verticalLineScroll];
+    [[FrameScheduler sharedInstance] scheduleClient:self after:0];
+}
+
+// Can pixels already drawn be moved when the view scrolls? Not if anything is drawn at a fixed
+// place in the visible rect other than the margins, or if there's drawing still to be done.
+- (BOOL)canMovePixelsWhenScrolling
+{
+    return (![self needsDisplay] &&
+            ![[self superview] needsDisplay] &&
+            ![(PTYScrollView *)[self enclosingScrollView] hasBackgroundImage] &&
+            ![self useTransparency] &&
+            !showTimestamps_ &&
+            !showFrameProfiler_ &&
+            ![self hasMarkedText] &&
+            ![_delegate textViewSessionIsBroadcastingInput] &&
+            ![_delegate textViewHasCoprocess] &&
+            [[self subviews] count] == 0);
+}
+
+// Scrolls by the wheel movement accumulated since the last frame. Rows that stay in view are moved
+// rather than redrawn, so only the lines scrolled into view are fetched and drawn.
+- (void)applyPendingScroll
+{
+    if (pendingScrollDelta_ == 0) {
+        return;
+    }
+    PTYScrollView *scrollView = (PTYScrollView *)[self enclosingScrollView];
+    const BOOL canMovePixels = [self canMovePixelsWhenScrolling];
+    const NSRect before = [self visibleRect];
+    NSRect scrollRect = [scrollView documentVisibleRect];
+    scrollRect.origin.y += pendingScrollDelta_;
+    [[scrollView documentView] scrollRectToVisible:scrollRect];
+    [scrollView detectUserScroll];
+
+    const NSRect after = [self visibleRect];
+    const CGFloat distance = after.origin.y - before.origin.y;
+    const CGFloat remainder = pendingScrollDelta_ - distance;
+    // Less than a line is left over from snapping; more means it hit the top or bottom.
+    pendingScrollDelta_ = fabs(remainder) < lineHeight ? remainder : 0;
+    if (distance == 0) {
+        return;
+    }
+    if (!canMovePixels ||
+        fabs(distance) >= after.size.height ||
+        after.size.height != before.size.height) {
+        return;
+    }
+
+    // The clip view doesn't copy on scroll, so it invalidated everything. The pixels of the rows
+    // that are still visible are in the window at their old place; move them to their new one.
+    NSView *wrapper = [self superview];
+    [wrapper setNeedsDisplay:NO];
+    [self setNeedsDisplay:NO];
+    NSRect sourceRect = NSIntersectionRect(after, NSOffsetRect(after, 0, distance));
+    [self scrollRect:sourceRect by:NSMakeSize(0, -distance)];
+
+    // Draw the rows scrolled into view, and the margins both where they belong and where their old
+    // pixels were moved to.
+    NSRect exposedRect = after;
+    exposedRect.size.height = fabs(distance);
+    if (distance > 0) {
+        exposedRect.origin.y = NSMaxY(after) - distance;
+    }
+    NSRect topMargin = after;
+    topMargin.size.height = VMARGIN;
+    NSRect bottomMargin = after;
+    bottomMargin.size.height = [self excess];
+    bottomMargin.origin.y = NSMaxY(after) - bottomMargin.size.height;
+    NSRect rects[] = {
+        exposedRect,
+        topMargin,
+        NSOffsetRect(topMargin, 0, -distance),
+        bottomMargin,
+        NSOffsetRect(bottomMargin, 0, -distance),
+    };
+    for (int i = 0; i < sizeof(rects) / sizeof(*rects); i++) {
+        NSRect rect = NSIntersectionRect(rects[i], after);
+        if (!NSIsEmptyRect(rect)) {
+            [wrapper setNeedsDisplayInRect:[self convertRect:rect toView:wrapper]];
+        }
+    }
+    // The cursor's line is always redrawn in case it's blinking.
+    [self setNeedsDisplayOnLine:[dataSource numberOfLines] - [dataSource height] + [dataSource cursorY] - 1
+                        inRange:VT100GridRangeMake(0, [dataSource width])];
 }
 
 - (BOOL)setCursor:(NSCursor *)cursor
@@ -3410,6 +3784,7 @@ NSMutableArray* screens=0;
 // Reset underlined chars indicating cmd-clicakble url.
 - (void)removeUnderline
 {
+    underlineGeneration_++;
     _underlineStartX = _underlineStartY = _underlineEndX = _underlineEndY = -1;
     if (self.currentUnderlineHostname) {
         [[AsyncHostLookupController sharedInstance] cancelRequestForHostname:self.currentUnderlineHostname];
@@ -3482,52 +3857,58 @@ NSMutableArray* screens=0;
         int y = viewPoint.y;
         if (y < 0) {
             [self removeUnderline];
-            return;
         } else {
-            URLAction *action = [self urlActionForClickAtX:x
-                                                         y:y
-                                    respectingHardNewlines:[self respectHardNewlinesForURLs]];
-            if (action) {
-                _underlineStartX = action.range.start.x;
-                _underlineStartY = action.range.start.y;
-                _underlineEndX = action.range.end.x;
-                _underlineEndY = action.range.end.y;
-                
-                if (action.actionType == kURLActionOpenURL) {
-                    NSURL *url = [NSURL URLWithString:action.string];
-                    if (![url.host isEqualToString:self.currentUnderlineHostname]) {
-                        if (self.currentUnderlineHostname) {
-                            [[AsyncHostLookupController sharedInstance] cancelRequestForHostname:self.currentUnderlineHostname];
-                        }
-                        if (url && url.host) {
-                            self.currentUnderlineHostname = url.host;
-                            [[AsyncHostLookupController sharedInstance] getAddressForHost:url.host
-                                                                               completion:^(BOOL ok, NSString *hostname) {
-                                                                                   if (!ok) {
-                                                                                       [[NSNotificationCenter defaultCenter] postNotificationName:kHostnameLookupFailed
-                                                                                                                                           object:hostname];
-                                                                                   } else {
-                                                                                       [[NSNotificationCenter defaultCenter] postNotificationName:kHostnameLookupSucceeded
-                                                                                                                                           object:hostname];
-                                                                                   }
-                                                                               }];
-                        }
-                    }
-                } else {
-                    if (self.currentUnderlineHostname) {
-                        [[AsyncHostLookupController sharedInstance] cancelRequestForHostname:self.currentUnderlineHostname];
-                    }
-                    self.currentUnderlineHostname = nil;
-                }
-            } else {
-                [self removeUnderline];
-                return;
-            }
+            // Looking for a filename can be slow, so the underline is updated when it's done.
+            [self urlActionForClickAtX:x
+                                     y:y
+                respectingHardNewlines:[self respectHardNewlinesForURLs]
+                            generation:++underlineGeneration_
+                            completion:^(URLAction *action) {
+                                [self underlineURLAction:action];
+                            }];
         }
     } else {
         [self removeUnderline];
+    }
+}
+
+- (void)underlineURLAction:(URLAction *)action
+{
+    if (!action) {
+        [self removeUnderline];
         return;
     }
+    _underlineStartX = action.range.start.x;
+    _underlineStartY = action.range.start.y;
+    _underlineEndX = action.range.end.x;
+    _underlineEndY = action.range.end.y;
+
+    if (action.actionType == kURLActionOpenURL) {
+        NSURL *url = [NSURL URLWithString:action.string];
+        if (![url.host isEqualToString:self.currentUnderlineHostname]) {
+            if (self.currentUnderlineHostname) {
+                [[AsyncHostLookupController sharedInstance] cancelRequestForHostname:self.currentUnderlineHostname];
+            }
+            if (url && url.host) {
+                self.currentUnderlineHostname = url.host;
+                [[AsyncHostLookupController sharedInstance] getAddressForHost:url.host
+                                                                   completion:^(BOOL ok, NSString *hostname) {
+                                                                       if (!ok) {
+                                                                           [[NSNotificationCenter defaultCenter] postNotificationName:kHostnameLookupFailed
+                                                                                                                               object:hostname];
+                                                                       } else {
+                                                                           [[NSNotificationCenter defaultCenter] postNotificationName:kHostnameLookupSucceeded
+                                                                                                                               object:hostname];
+                                                                       }
+                                                                   }];
+            }
+        }
+    } else {
+        if (self.currentUnderlineHostname) {
+            [[AsyncHostLookupController sharedInstance] cancelRequestForHostname:self.currentUnderlineHostname];
+        }
+        self.currentUnderlineHostname = nil;
+    }
 
     [self setNeedsDisplay:YES];  // It would be better to just display the underlined/formerly underlined area.
     [self updateTrackingAreas];  // Cause mouseMoved to be (not) called on movement if cmd is down (up).
@@ -3784,11 +4165,8 @@ NSMutableArray* screens=0;
     locationInTextView = [self convertPoint: locationInWindow fromView: nil];
 
     if (numTouches_ <= 1) {
-        for (NSView *view in [self subviews]) {
-            if ([view isKindOfClass:[PTYNoteView class]]) {
-                PTYNoteView *noteView = (PTYNoteView *)view;
-                [noteView.delegate.noteViewController setNoteHidden:YES];
-            }
+        for (PTYNoteViewController *note in notesWithViews_) {
+            [note setNoteHidden:YES];
         }
     }
 
@@ -3818,6 +4196,7 @@ NSMutableArray* screens=0;
             case MOUSE_REPORTING_ALL_MOTION:
                 DebugLog(@"Do xterm mouse reporting");
                 reportingMouseDown = YES;
+                [self flushPendingMouseMotion];
                 [_delegate writeTask:[terminal mousePress:MOUSE_BUTTON_LEFT
                                             withModifiers:[event modifierFlags]
                                                       atX:rx
@@ -4050,6 +4429,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
             case MOUSE_REPORTING_NORMAL:
             case MOUSE_REPORTING_BUTTON_MOTION:
             case MOUSE_REPORTING_ALL_MOTION:
+                [self flushPendingMouseMotion];
                 [_delegate writeTask:[terminal mouseRelease:MOUSE_BUTTON_LEFT
                                               withModifiers:[event modifierFlags]
                                                         atX:rx
@@ -4178,14 +4558,10 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     if (ry < 0) {
         ry = -1;
     }
-    if (rx != lastReportedX_ || ry != lastReportedY_) {
-        lastReportedX_ = rx;
-        lastReportedY_ = ry;
-        [_delegate writeTask:[terminal mouseMotion:MOUSE_BUTTON_NONE
-                                     withModifiers:[event modifierFlags]
-                                               atX:rx
-                                                 Y:ry]];
-    }
+    [self reportMouseMotion:MOUSE_BUTTON_NONE
+                  modifiers:[event modifierFlags]
+                          x:rx
+                          y:ry];
 }
 
 - (void)mouseDragged:(NSEvent *)event
@@ -4251,17 +4627,15 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
             ry = -1;
         }
         if (rx != lastReportedX_ || ry != lastReportedY_) {
-            lastReportedX_ = rx;
-            lastReportedY_ = ry;
             VT100Terminal *terminal = [dataSource terminal];
 
             switch ([terminal mouseMode]) {
                 case MOUSE_REPORTING_BUTTON_MOTION:
                 case MOUSE_REPORTING_ALL_MOTION:
-                    [_delegate writeTask:[terminal mouseMotion:MOUSE_BUTTON_LEFT
-                                                 withModifiers:[event modifierFlags]
-                                                           atX:rx
-                                                             Y:ry]];
+                    [self reportMouseMotion:MOUSE_BUTTON_LEFT
+                                  modifiers:[event modifierFlags]
+                                          x:rx
+                                          y:ry];
                 case MOUSE_REPORTING_NORMAL:
                     DebugLog([NSString stringWithFormat:@"Mouse drag. startx=%d starty=%d, endx=%d, endy=%d", startX, startY, endX, endY]);
                     return;
@@ -4979,8 +5353,6 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 {
     // Make sure scrollback overflow is reset.
     [self refresh];
-    [note.view removeFromSuperview];
-    [self addSubview:note.view];
     [self updateNoteViewFrames];
     [note setNoteHidden:NO];
 }
@@ -4994,8 +5366,6 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
         
         // Make sure scrollback overflow is reset.
         [self refresh];
-        [note.view removeFromSuperview];
-        [self addSubview:note.view];
         [self updateNoteViewFrames];
         [note setNoteHidden:NO];
         [note beginEditing];
@@ -5050,21 +5420,48 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     }
 }
 
+// The lines whose notes get views. A note's view hangs below or above the end of its range, so
+// this goes a screenful past the visible lines in each direction.
+- (void)getNoteViewsFirstLine:(int *)firstLine lastLine:(int *)lastLine
+{
+    NSRect visibleRect = [self visibleRect];
+    const int visibleLines = ceil(visibleRect.size.height / lineHeight);
+    *firstLine = MAX(0, (int)(visibleRect.origin.y / lineHeight) - visibleLines);
+    *lastLine = (int)(NSMaxY(visibleRect) / lineHeight) + visibleLines;
+}
+
 - (void)updateNoteViewFrames
 {
-    for (NSView *view in [self subviews]) {
-        if ([view isKindOfClass:[PTYNoteView class]]) {
-            PTYNoteView *noteView = (PTYNoteView *)view;
-            PTYNoteViewController *note =
-                (PTYNoteViewController *)noteView.delegate.noteViewController;
-            VT100GridCoordRange coordRange = [dataSource coordRangeOfNote:note];
-            if (coordRange.end.y >= 0) {
-                [note setAnchor:NSMakePoint(coordRange.end.x * charWidth + MARGIN,
-                                            (1 + coordRange.end.y) * lineHeight)];
-            }
+    const long long overflow = [dataSource totalScrollbackOverflow];
+    if (overflow != noteCleanupOverflow_) {
+        [dataSource removeInaccessibleNotes];
+        noteCleanupOverflow_ = overflow;
+    }
+
+    [self getNoteViewsFirstLine:&noteViewsFirstLine_ lastLine:&noteViewsLastLine_];
+    NSArray *notes = [dataSource notesInRange:VT100GridCoordRangeMake(0,
+                                                                      noteViewsFirstLine_,
+                                                                      [dataSource width],
+                                                                      noteViewsLastLine_)];
+    NSMutableSet *notesWithViews = [NSMutableSet setWithArray:notes];
+    for (PTYNoteViewController *note in notesWithViews_) {
+        if (![notesWithViews containsObject:note]) {
+            [note.view removeFromSuperview];
+        }
+    }
+    [notesWithViews_ setSet:notesWithViews];
+
+    for (PTYNoteViewController *note in notes) {
+        if ([note.view superview] != self) {
+            [note.view removeFromSuperview];
+            [self addSubview:note.view];
+        }
+        VT100GridCoordRange coordRange = [dataSource coordRangeOfNote:note];
+        if (coordRange.end.y >= 0) {
+            [note setAnchor:NSMakePoint(coordRange.end.x * charWidth + MARGIN,
+                                        (1 + coordRange.end.y) * lineHeight)];
         }
     }
-    [dataSource removeInaccessibleNotes];
 }
 
 - (void)editTextViewSession:(id)sender
@@ -5082,29 +5479,144 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     [_delegate textViewCloseWithConfirmation];
 }
 
-- (void)copySelectionAccordingToUserPreferences
+- (void)copySelectionAccordingToUserPreferences
+{
+    if (startX > -1 &&
+        selectMode != SELECT_BOX &&
+        endY - startY >= kMinSelectedLinesToCopyInBackground) {
+        // This runs after every drag and most selections are never pasted, so a big one is only
+        // promised and its text isn't written until something asks for it. There are no styles,
+        // since they would have to be read from the live screen.
+        [self copySelectionInBackgroundToPasteboard:[NSPasteboard generalPasteboard] lazily:YES];
+        return;
+    }
+    if ([[NSUserDefaults standardUserDefaults] boolForKey:@"CopyWithStylesByDefault"]) {
+        [self copyWithStyles:self];
+    } else {
+        [self copy:self];
+    }
+}
+
+- (void)copy:(id)sender
+{
+    NSPasteboard *pboard = [NSPasteboard generalPasteboard];
+    NSString *copyString;
+
+    DLog(@"-[PTYTextView copy:] called");
+    if (startX > -1 &&
+        selectMode != SELECT_BOX &&
+        endY - startY >= kMinSelectedLinesToCopyInBackground) {
+        [self copySelectionInBackgroundToPasteboard:pboard lazily:NO];
+        return;
+    }
+    copyString = [self selectedText];
+    DLog(@"Have selected text of length %d. startX=%d, startY=%d, endX=%d, endY=%d", (int)[copyString length], startX, startY, endX, endY);
+    if (copyString) {
+        [pboard declareTypes:[NSArray arrayWithObject:NSStringPboardType] owner:self];
+        [pboard setString:copyString forType:NSStringPboardType];
+    }
+
+    [[PasteboardHistory sharedInstance] save:copyString];
+}
+
+// Promises the selected text, as of now, to the pasteboard and writes it on a background queue, at
+// once or, if |lazily| is set, when something pastes it. The text isn't added to the paste
+// history, which is no place for something so big.
+- (void)copySelectionInBackgroundToPasteboard:(NSPasteboard *)pboard lazily:(BOOL)lazily
+{
+    [pendingCopyWriter_ cancel];
+    [pendingCopyWriter_ release];
+    pendingCopyWriter_ =
+        [self newTextWriterFromX:startX
+                               Y:startY
+                             ToX:endX
+                               Y:endY
+                             pad:NO
+              includeLastNewline:[[PreferencePanel sharedInstance] copyLastNewline]
+          trimTrailingWhitespace:[[PreferencePanel sharedInstance] trimTrailingWhitespace]];
+    pendingCopyChangeCount_ = [pboard declareTypes:[NSArray arrayWithObject:NSStringPboardType]
+                                             owner:self];
+    pendingCopyIsLazy_ = lazily;
+    DLog(@"Copying %d lines in the background%@", endY - startY + 1, lazily ? @" lazily" : @"");
+    if (lazily) {
+        return;
+    }
+
+    SelectionTextWriter *writer = pendingCopyWriter_;
+    [writer writeToDataWithCompletion:^(NSData *data) {
+        if (writer != pendingCopyWriter_) {
+            return;
+        }
+        if (data && [pboard changeCount] == pendingCopyChangeCount_) {
+            [pboard setData:data forType:NSStringPboardType];
+        }
+        [pendingCopyWriter_ release];
+        pendingCopyWriter_ = nil;
+    }];
+}
+
+// Called when something pastes the promised text before it has been written.
+- (void)pasteboard:(NSPasteboard *)sender provideDataForType:(NSString *)type
 {
-    if ([[NSUserDefaults standardUserDefaults] boolForKey:@"CopyWithStylesByDefault"]) {
-        [self copyWithStyles:self];
-    } else {
-        [self copy:self];
+    if (pendingCopyIsLazy_) {
+        DLog(@"Writing lazily copied text for a paste");
+        [pendingCopyWriter_ writeToDataWithCompletion:^(NSData *data) { }];
+    }
+    NSData *data = [pendingCopyWriter_ waitForData];
+    if (data) {
+        [sender setData:data forType:type];
+    }
+    if (pendingCopyIsLazy_) {
+        // The pasteboard has the data now.
+        [pendingCopyWriter_ release];
+        pendingCopyWriter_ = nil;
+        pendingCopyIsLazy_ = NO;
     }
 }
 
-- (void)copy:(id)sender
+- (void)pasteboardChangedOwner:(NSPasteboard *)sender
 {
-    NSPasteboard *pboard = [NSPasteboard generalPasteboard];
-    NSString *copyString;
-
-    DLog(@"-[PTYTextView copy:] called");
-    copyString = [self selectedText];
-    DLog(@"Have selected text of length %d. startX=%d, startY=%d, endX=%d, endY=%d", (int)[copyString length], startX, startY, endX, endY);
-    if (copyString) {
-        [pboard declareTypes:[NSArray arrayWithObject:NSStringPboardType] owner:self];
-        [pboard setString:copyString forType:NSStringPboardType];
+    if ([sender changeCount] != pendingCopyChangeCount_) {
+        [pendingCopyWriter_ cancel];
+        [pendingCopyWriter_ release];
+        pendingCopyWriter_ = nil;
     }
+}
 
-    [[PasteboardHistory sharedInstance] save:copyString];
+// Makes a writer for a range of text like the one -contentFromX:Y:ToX:Y:pad:includeLastNewline:
+// trimTrailingWhitespace: returns. The lines are snapshotted now.
+- (SelectionTextWriter *)newTextWriterFromX:(int)startx
+                                          Y:(int)starty
+                                        ToX:(int)nonInclusiveEndx
+                                          Y:(int)endy
+                                        pad:(BOOL)pad
+                         includeLastNewline:(BOOL)includeLastNewline
+                     trimTrailingWhitespace:(BOOL)trimSelectionTrailingSpaces
+{
+    const int width = [dataSource width];
+    const int height = [dataSource height];
+    NSMutableData *screenLines =
+        [NSMutableData dataWithLength:height * (width + 1) * sizeof(screen_char_t)];
+    screen_char_t *lines = [screenLines mutableBytes];
+    for (int i = 0; i < height; i++) {
+        memcpy(lines + i * (width + 1),
+               [dataSource getLineAtScreenIndex:i],
+               (width + 1) * sizeof(screen_char_t));
+    }
+    LineBuffer *snapshot = [dataSource newScrollbackSnapshot];
+    SelectionTextWriter *writer =
+        [[SelectionTextWriter alloc] initWithScrollback:snapshot
+                                            screenLines:screenLines
+                                                  width:width
+                                                  range:VT100GridCoordRangeMake(startx,
+                                                                                starty,
+                                                                                nonInclusiveEndx,
+                                                                                endy)
+                                                    pad:pad
+                                     includeLastNewline:includeLastNewline
+                                 trimTrailingWhitespace:trimSelectionTrailingSpaces];
+    [snapshot release];
+    return writer;
 }
 
 - (IBAction)copyWithStyles:(id)sender
@@ -5157,6 +5669,24 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     return result;
 }
 
+// Returns YES if -charAttributes: gives the same dictionary for |a| and |b|. The font of a
+// non-ASCII char depends on the char, so only ASCII chars are compared.
+static BOOL ScreenCharsHaveSameAttributes(screen_char_t a, screen_char_t b) {
+    return (!a.complexChar && a.code < 128 &&
+            !b.complexChar && b.code < 128 &&
+            a.foregroundColor == b.foregroundColor &&
+            a.fgGreen == b.fgGreen &&
+            a.fgBlue == b.fgBlue &&
+            a.backgroundColor == b.backgroundColor &&
+            a.bgGreen == b.bgGreen &&
+            a.bgBlue == b.bgBlue &&
+            a.foregroundColorMode == b.foregroundColorMode &&
+            a.backgroundColorMode == b.backgroundColorMode &&
+            a.bold == b.bold &&
+            a.italic == b.italic &&
+            a.underline == b.underline);
+}
+
 // Returns a dictionary to pass to NSAttributedString.
 - (NSDictionary *)charAttributes:(screen_char_t)c
 {
@@ -5203,6 +5733,25 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     BOOL endOfLine;
     int i;
 
+    // Cells are appended a run at a time, and each run gets one attributes dictionary.
+    NSMutableString *runString = [NSMutableString string];
+    __block screen_char_t runChar;
+    void (^flushRun)(void) = ^{
+        if ([runString length]) {
+            [result iterm_appendString:runString withAttributes:[self charAttributes:runChar]];
+            [runString setString:@""];
+        }
+    };
+    void (^append)(NSString *, screen_char_t) = ^(NSString *string, screen_char_t c) {
+        if ([runString length] && !ScreenCharsHaveSameAttributes(runChar, c)) {
+            flushRun();
+        }
+        if (![runString length]) {
+            runChar = c;
+        }
+        [runString appendString:string];
+    };
+
     for (y = starty; y <= endy; y++) {
         theLine = [dataSource getLineAtIndex:y];
 
@@ -5214,7 +5763,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                 // Convert orphan tab fillers (those without a subsequent
                 // tab character) into spaces.
                 if ([self isTabFillerOrphanAtX:x1 Y:y]) {
-                    [result iterm_appendString:@" " withAttributes:[self charAttributes:c]];
+                    append(@" ", c);
                 }
             } else if (c.code != DWC_RIGHT &&
                        c.code != DWC_SKIP) {
@@ -5229,35 +5778,31 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                     if (endOfLine) {
                         if (pad) {
                             for (i = x1; i <= x2; i++) {
-                                [result iterm_appendString:@" "
-                                            withAttributes:[self charAttributes:theLine[i]]];
+                                append(@" ", theLine[i]);
                             }
                         }
                         if (y < endy && theLine[width].code == EOL_HARD) {
-                            [result iterm_appendString:@"\n"
-                                        withAttributes:[self charAttributes:theLine[width - 1]]];
+                            append(@"\n", theLine[width - 1]);
                         }
                         break;
                     } else {
                         // replace mid-line null char with space
-                        [result iterm_appendString:@" " withAttributes:[self charAttributes:c]];
+                        append(@" ", c);
                     }
                 } else if (x1 == x2 &&
                            y < endy &&
                            theLine[width].code == EOL_HARD) {
                     // Hard line break
-                    [result iterm_appendString:ScreenCharToStr(&c)
-                                withAttributes:[self charAttributes:c]];
-                    [result iterm_appendString:@"\n"
-                                withAttributes:[self charAttributes:theLine[width - 1]]];
+                    append(ScreenCharToStr(&c), c);
+                    append(@"\n", theLine[width - 1]);
                 } else {
                     // Normal character
-                    [result iterm_appendString:ScreenCharToStr(&c)
-                                withAttributes:[self charAttributes:c]];
+                    append(ScreenCharToStr(&c), c);
                 }
             }
         }
     }
+    flushRun();
 
     return result;
 }
@@ -5378,7 +5923,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 - (BOOL)addCustomActionsToMenu:(NSMenu *)theMenu matchingText:(NSString *)textWindow
 {
     BOOL didAdd = NO;
-    NSArray* rulesArray = smartSelectionRules_ ? smartSelectionRules_ : [SmartSelectionController defaultRules];
+    NSArray* rulesArray = [[self smartSelectionRuleSet] rules];
     const int numRules = [rulesArray count];
 
     for (int j = 0; j < numRules; j++) {
@@ -5386,11 +5931,8 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
         NSString *regex = [SmartSelectionController regexInRule:rule];
         for (int i = 0; i <= textWindow.length; i++) {
             NSString* substring = [textWindow substringWithRange:NSMakeRange(i, [textWindow length] - i)];
-            NSError* regexError = nil;
-            NSArray *components = [substring captureComponentsMatchedByRegex:regex
-                                                                     options:0
-                                                                       range:NSMakeRange(0, [substring length])
-                                                                       error:&regexError];
+            NSArray *components = [[CompiledRegex regexWithPattern:regex caseInsensitive:NO]
+                                      captureComponentsInString:substring];
             if (components.count) {
                 NSLog(@"Components for %@ are %@", regex, components);
                 NSArray *actions = [SmartSelectionController actionsInRule:rule];
@@ -5849,18 +6391,33 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 // Save method
 - (void)saveDocumentAs:(id)sender
 {
-    NSData *aData;
+    NSData *aData = nil;
     NSSavePanel *aSavePanel;
-    NSString *aString;
 
-    // We get our content of the textview or selection, if any
-    aString = [self selectedText];
-    if (!aString) {
-        aString = [self content];
+    // We get our content of the textview or selection, if any. Unless it's a box, it's written on a
+    // background queue from a snapshot taken now.
+    SelectionTextWriter *writer = nil;
+    if (startX <= -1) {
+        writer = [self newTextWriterFromX:0
+                                        Y:0
+                                      ToX:[dataSource width]
+                                        Y:[dataSource numberOfLines] - 1
+                                      pad:NO
+                       includeLastNewline:YES
+                   trimTrailingWhitespace:NO];
+    } else if (selectMode != SELECT_BOX) {
+        writer = [self newTextWriterFromX:startX
+                                        Y:startY
+                                      ToX:endX
+                                        Y:endY
+                                      pad:NO
+                       includeLastNewline:[[PreferencePanel sharedInstance] copyLastNewline]
+                   trimTrailingWhitespace:[[PreferencePanel sharedInstance] trimTrailingWhitespace]];
+    } else {
+        aData = [[self selectedText] dataUsingEncoding:[_delegate textViewEncoding]
+                                  allowLossyConversion:YES];
     }
-
-    aData = [aString dataUsingEncoding:[_delegate textViewEncoding]
-                  allowLossyConversion:YES];
+    [writer autorelease];
 
     // initialize a save panel
     aSavePanel = [NSSavePanel savePanel];
@@ -5879,7 +6436,15 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                                                              locale:[[NSUserDefaults standardUserDefaults] dictionaryRepresentation]];
 
     if ([aSavePanel legacyRunModalForDirectory:path file:nowStr] == NSFileHandlingPanelOKButton) {
-        if (![aData writeToFile:[aSavePanel legacyFilename] atomically:YES]) {
+        if (writer) {
+            [writer writeToFile:[aSavePanel legacyFilename]
+                       encoding:[_delegate textViewEncoding]
+                     completion:^(BOOL ok) {
+                         if (!ok) {
+                             NSBeep();
+                         }
+                     }];
+        } else if (![aData writeToFile:[aSavePanel legacyFilename] atomically:YES]) {
             NSBeep();
         }
     }
@@ -6147,7 +6712,15 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 - (void)setSmartSelectionRules:(NSArray *)rules
 {
     [smartSelectionRules_ autorelease];
-    smartSelectionRules_ = [rules copy];
+    smartSelectionRules_ = [[SmartSelectionRuleSet alloc] initWithRules:rules ? rules : [SmartSelectionController defaultRules]];
+}
+
+- (SmartSelectionRuleSet *)smartSelectionRuleSet
+{
+    if (!smartSelectionRules_) {
+        [self setSmartSelectionRules:nil];
+    }
+    return smartSelectionRules_;
 }
 
 - (BOOL)growSelectionLeft
@@ -6228,42 +6801,61 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     [_delegate refreshAndStartTimerIfNeeded];
 }
 
-// Add a match to resultMap_
-- (void)addResultFromX:(int)resStartX
-                  absY:(long long)absStartY
-                   toX:(int)resEndX
-                toAbsY:(long long)absEndY
+- (void)addSearchResults:(NSArray *)results
 {
-    int width = [dataSource width];
-    for (long long y = absStartY; y <= absEndY; y++) {
-        NSNumber* key = [NSNumber numberWithLongLong:y];
-        NSMutableData* data = [resultMap_ objectForKey:key];
-        BOOL set = NO;
-        if (!data) {
-            data = [NSMutableData dataWithLength:(width / 8 + 1)];
-            char* b = [data mutableBytes];
-            memset(b, 0, (width / 8) + 1);
-            set = YES;
-        }
-        char* b = [data mutableBytes];
-        int lineEndX = MIN(resEndX + 1, width);
-        int lineStartX = resStartX;
-        if (absEndY > y) {
-            lineEndX = width;
-        }
-        if (y > absStartY) {
-            lineStartX = 0;
-        }
-        for (int i = lineStartX; i < lineEndX; i++) {
-            const int byteIndex = i/8;
-            const int bit = 1 << (i & 7);
-            if (byteIndex < [data length]) {
-                b[byteIndex] |= bit;
-            }
+    const int count = [results count];
+    if (!count) {
+        return;
+    }
+    FindHighlight *highlights = malloc(sizeof(FindHighlight) * count);
+    int i = 0;
+    for (SearchResult *result in results) {
+        highlights[i].absStartY = result->absStartY;
+        highlights[i].absEndY = result->absEndY;
+        highlights[i].startX = result->startX;
+        highlights[i].endX = result->endX;
+        i++;
+    }
+    FindHighlightsAdd(&findHighlights_, highlights, count);
+    free(highlights);
+    [resultMap_ removeAllObjects];
+}
+
+// Returns the bit array of Find matches in a line, or nil if it has none.
+- (NSData *)_matchesOnLine:(long long)absoluteLine
+{
+    if (!findHighlights_.count) {
+        return nil;
+    }
+    NSNumber *key = [NSNumber numberWithLongLong:absoluteLine];
+    id matches = [resultMap_ objectForKey:key];
+    if (!matches) {
+        const int width = [dataSource width];
+        NSMutableData *bitmap = [NSMutableData dataWithLength:width / 8 + 1];
+        if (FindHighlightsGetBitmap(&findHighlights_, absoluteLine, width, [bitmap mutableBytes])) {
+            matches = bitmap;
+        } else {
+            matches = [NSNull null];
         }
-        if (set) {
-            [resultMap_ setObject:data forKey:key];
+        if ([resultMap_ count] >= kMaxMatchBitmaps) {
+            [resultMap_ removeAllObjects];
         }
+        [resultMap_ setObject:matches forKey:key];
+    }
+    return (matches == [NSNull null]) ? nil : matches;
+}
+
+// Drops the highlights of results on lines that have changed.
+- (void)_removeHighlightsFromLine:(long long)firstLine toLine:(long long)lastLine
+{
+    if (!findHighlights_.count) {
+        return;
+    }
+    const long long maxExtraLines = findHighlights_.maxExtraLines;
+    FindHighlightsRemoveLines(&findHighlights_, firstLine, lastLine);
+    // A result that was removed may have continued onto lines around these.
+    for (long long y = firstLine - maxExtraLines; y <= lastLine + maxExtraLines; y++) {
+        [resultMap_ removeObjectForKey:[NSNumber numberWithLongLong:y]];
     }
 }
 
@@ -6367,7 +6959,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 // continueFind is called by a timer in the client until it returns NO. It does
 // two things:
 // 1. If _findInProgress is true, search for more results in the dataSource and
-//   call _addResultFromX:absY:toX:toAbsY: for each.
+//   highlight them with addSearchResults:.
 // 2. If searchingForNextResult_ is true, highlight the next result before/after
 //   the current selection and flip searchingForNextResult_ to false.
 - (BOOL)continueFind
@@ -6378,19 +6970,18 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     assert([self findInProgress]);
     if (_findInProgress) {
         // Collect more results.
+        SignpostBegin("find", [[_delegate SHELL] tty], [findResults_ count]);
         more = [dataSource continueFindAllResults:findResults_
                                         inContext:[dataSource findContext]];
+        SignpostEnd("find", [[_delegate SHELL] tty], [findResults_ count]);
     }
     if (!more) {
         _findInProgress = NO;
     }
-    // Add new results to map.
-    for (int i = nextOffset_; i < [findResults_ count]; i++) {
-        SearchResult* r = [findResults_ objectAtIndex:i];
-        [self addResultFromX:r->startX
-                        absY:r->absStartY
-                         toX:r->endX
-                      toAbsY:r->absEndY];
+    // Highlight the new results.
+    if (nextOffset_ < [findResults_ count]) {
+        NSRange range = NSMakeRange(nextOffset_, [findResults_ count] - nextOffset_);
+        [self addSearchResults:[findResults_ subarrayWithRange:range]];
         redraw = YES;
     }
     nextOffset_ = [findResults_ count];
@@ -6483,6 +7074,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     findResults_ = nil;
     nextOffset_ = 0;
     foundResult_ = NO;
+    FindHighlightsRemoveAll(&findHighlights_);
     [resultMap_ removeAllObjects];
     searchingForNextResult_ = NO;
 }
@@ -6496,7 +7088,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 - (void)setTransparency:(double)fVal
 {
     transparency = fVal;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [self setNeedsDisplay:YES];
 }
 
@@ -6508,30 +7100,32 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 - (void)setBlend:(double)fVal
 {
     blend = MIN(MAX(0.3, fVal), 1);
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [self setNeedsDisplay:YES];
 }
 
 - (void)setSmartCursorColor:(BOOL)value
 {
     colorInvertedCursor = value;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
 }
 
 - (void)setMinimumContrast:(double)value
 {
     minimumContrast_ = value;
-    [memoizedContrastingColor_ release];
-    memoizedContrastingColor_ = nil;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
+    [lineRenderCache_ removeAllLayers];
 }
 
 - (void)setDimmingAmount:(double)value
 {
+    if (value == dimmingAmount_) {
+        return;
+    }
     dimmingAmount_ = value;
     [cachedBackgroundColor_ release];
     cachedBackgroundColor_ = nil;
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [[self superview] setNeedsDisplay:YES];
 }
 
@@ -6910,12 +7504,6 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     }
 }
 
-- (BOOL)getAndResetChangedSinceLastExpose
-{
-    BOOL temp = changedSinceLastExpose_;
-    changedSinceLastExpose_ = NO;
-    return temp;
-}
 
 - (BOOL)isAnyCharSelected
 {
@@ -7090,42 +7678,13 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 {
     BOOL isBold = *renderBold && useBoldFont;
     BOOL isItalic = *renderItalic && useItalicFont;
-    *renderBold = NO;
-    *renderItalic = NO;
-    PTYFontInfo* theFont;
     BOOL usePrimary = !useNonAsciiFont_ || (!complex && (ch < 128));
 
     PTYFontInfo *rootFontInfo = usePrimary ? primaryFont : secondaryFont;
-    theFont = rootFontInfo;
-
-    if (isBold && isItalic) {
-        theFont = rootFontInfo.boldItalicVersion;
-        if (!theFont && rootFontInfo.boldVersion) {
-            theFont = rootFontInfo.boldVersion;
-            *renderItalic = YES;
-        } else if (!theFont && rootFontInfo.italicVersion) {
-            theFont = rootFontInfo.italicVersion;
-            *renderBold = YES;
-        } else if (!theFont) {
-            theFont = rootFontInfo;
-            *renderBold = YES;
-            *renderItalic = YES;
-        }
-    } else if (isBold) {
-        theFont = rootFontInfo.boldVersion;
-        if (!theFont) {
-            theFont = rootFontInfo;
-            *renderBold = YES;
-        }
-    } else if (isItalic) {
-        theFont = rootFontInfo.italicVersion;
-        if (!theFont) {
-            theFont = rootFontInfo;
-            *renderItalic = YES;
-        }
-    }
-
-    return theFont;
+    return [rootFontInfo fontForBold:isBold
+                              italic:isItalic
+                            fakeBold:renderBold
+                          fakeItalic:renderItalic];
 }
 
 // Returns true if the sequence of characters starting at (x, y) is not repeated
@@ -7303,23 +7862,145 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     orgb[1] = [otherColor greenComponent];
     orgb[2] = [otherColor blueComponent];
 
-    if (!memoizedContrastingColor_ ||
-        memcmp(rgb, memoizedMainRGB_, sizeof(rgb)) ||
-        memcmp(orgb, memoizedOtherRGB_, sizeof(orgb))) {
-        // We memoize the last returned value not so much for performance as for
-        // consistency. It ensures that two consecutive calls for the same color
-        // will return the same pointer. See the note at the call site in
-        // _constructRuns:theLine:...matches:.
-        [memoizedContrastingColor_ release];
-        memoizedContrastingColor_ = [[self computeColorWithComponents:rgb
-                                        withContrastAgainstComponents:orgb] retain];
-        if (!memoizedContrastingColor_) {
-            memoizedContrastingColor_ = [mainColor retain];
+    // We memoize returned values not only for performance but for consistency. It ensures that
+    // two calls for the same color will return the same pointer. See the note at the call site in
+    // _constructRuns:theLine:...matches:.
+    NSColor *contrastingColor = [colorCache_ contrastingColorForMain:rgb other:orgb];
+    if (!contrastingColor) {
+        contrastingColor = [self computeColorWithComponents:rgb
+                              withContrastAgainstComponents:orgb];
+        if (!contrastingColor) {
+            contrastingColor = mainColor;
+        }
+        [colorCache_ setContrastingColor:contrastingColor forMain:rgb other:orgb];
+    }
+    return contrastingColor;
+}
+
+// Returns YES if none of the per-character special cases of -_constructRuns:... apply to |row|:
+// selection, find matches, the underlined URL, minimum contrast, hidden blinking text, reverse
+// video and the non-ASCII font.
+- (BOOL)_canConstructPlainRunsForRow:(int)row
+                            reversed:(BOOL)reversed
+                          bgselected:(BOOL)bgselected
+                             matches:(NSData *)matches
+{
+    return (!bgselected &&
+            !matches &&
+            !reversed &&
+            !useNonAsciiFont_ &&
+            minimumContrast_ <= 0.001 &&
+            (blinkShow || ![self _textBlinkingAllowed]) &&
+            (_underlineStartX < 0 || row < _underlineStartY || row > _underlineEndY));
+}
+
+// -_constructRuns:... for a row that passes -_canConstructPlainRunsForRow:.... With only the
+// primary font, a char's font depends on nothing but its bold and italic bits, so the four
+// possibilities are looked up once per row.
+- (CRun *)_constructPlainRunsForLine:(screen_char_t *)theLine
+                               width:(const int)width
+                          indexRange:(NSRange)indexRange
+                             storage:(CRunStorage *)storage
+{
+    CRun *firstRun = NULL;
+    CRun *currentRun = NULL;
+    CAttrs attrs;
+    attrs.antiAlias = asciiAntiAlias;
+    attrs.color = nil;
+    int lastForegroundColor = -1;
+    int lastFgGreen = -1;
+    int lastFgBlue = -1;
+    int lastForegroundColorMode = -1;
+    int lastBold = 2;  // Bold is a one-bit field so it can never equal 2.
+    PTYFontInfo *fontInfos[4] = { nil, nil, nil, nil };  // Indexed by bold + 2 * italic.
+    BOOL fakeBolds[4];
+    BOOL fakeItalics[4];
+    CGFloat curX = 0;
+    const int limit = indexRange.location + indexRange.length;
+    for (int i = indexRange.location; i < limit; i++) {
+        const screen_char_t c = theLine[i];
+        if (c.code == DWC_RIGHT) {
+            continue;
+        }
+        const BOOL doubleWidth = i < width - 1 && (theLine[i + 1].code == DWC_RIGHT);
+        const CGFloat thisCharAdvance = doubleWidth ? charWidth * 2 : charWidth;
+
+        NSString *thisCharString = nil;
+        BOOL drawable;
+        if (c.complexChar) {
+            thisCharString = ComplexCharToStr(c.code);
+            drawable = (thisCharString != nil);
+            if (!drawable) {
+                NSLog(@"No complex char for code %d", (int)c.code);
+                thisCharString = @"";
+            }
+        } else {
+            drawable = (c.code != 0 &&
+                        c.code != '\t' &&
+                        !(c.code >= ITERM2_PRIVATE_BEGIN && c.code <= ITERM2_PRIVATE_END));
+        }
+        if (!drawable && !c.underline) {
+            if (currentRun) {
+                CRunTerminate(currentRun);
+            }
+            curX += thisCharAdvance;
+            continue;
+        }
+
+        if (c.foregroundColor != lastForegroundColor ||
+            c.fgGreen != lastFgGreen ||
+            c.fgBlue != lastFgBlue ||
+            c.foregroundColorMode != lastForegroundColorMode ||
+            c.bold != lastBold) {
+            lastForegroundColor = c.foregroundColor;
+            lastFgGreen = c.fgGreen;
+            lastFgBlue = c.fgBlue;
+            lastForegroundColorMode = c.foregroundColorMode;
+            lastBold = c.bold;
+            CRunAttrsSetColor(&attrs,
+                              storage,
+                              [self colorForCode:c.foregroundColor
+                                           green:c.fgGreen
+                                            blue:c.fgBlue
+                                       colorMode:c.foregroundColorMode
+                                            bold:c.bold
+                                    isBackground:NO]);
+        }
+        const int fontIndex = c.bold + 2 * c.italic;
+        if (!fontInfos[fontIndex]) {
+            fakeBolds[fontIndex] = c.bold;
+            fakeItalics[fontIndex] = c.italic;
+            fontInfos[fontIndex] = [self getFontForChar:c.code
+                                              isComplex:c.complexChar
+                                             renderBold:&fakeBolds[fontIndex]
+                                           renderItalic:&fakeItalics[fontIndex]];
+        }
+        attrs.fontInfo = fontInfos[fontIndex];
+        attrs.fakeBold = fakeBolds[fontIndex];
+        attrs.fakeItalic = fakeItalics[fontIndex];
+        attrs.underline = c.underline;
+        if (!currentRun) {
+            firstRun = currentRun = [storage allocateRun];
+            CRunInitialize(currentRun, &attrs, storage, curX);
+        }
+        if (thisCharString) {
+            currentRun = CRunAppendString(currentRun,
+                                          &attrs,
+                                          thisCharString,
+                                          c.code,
+                                          thisCharAdvance,
+                                          curX);
+        } else {
+            // An underlined blank is drawn as a 0, as in -_constructRuns:....
+            currentRun = CRunAppend(currentRun,
+                                    &attrs,
+                                    drawable ? c.code : 0,
+                                    thisCharAdvance,
+                                    curX);
         }
-        memmove(memoizedMainRGB_, rgb, sizeof(rgb));
-        memmove(memoizedOtherRGB_, orgb, sizeof(orgb));
+        curX += thisCharAdvance;
     }
-    return memoizedContrastingColor_;
+    return firstRun;
 }
 
 - (CRun *)_constructRuns:(NSPoint)initialPoint
@@ -7333,6 +8014,15 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                  matches:(NSData*)matches
                  storage:(CRunStorage *)storage
 {
+    if ([self _canConstructPlainRunsForRow:row
+                                  reversed:reversed
+                                bgselected:bgselected
+                                   matches:matches]) {
+        return [self _constructPlainRunsForLine:theLine
+                                          width:width
+                                     indexRange:indexRange
+                                        storage:storage];
+    }
     BOOL inUnderlinedRange = NO;
     CRun *firstRun = NULL;
     CAttrs attrs;
@@ -7508,7 +8198,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                 attrs.color = [NSColor colorWithCalibratedRed:0.023 green:0.270 blue:0.678 alpha:1];
             }
             if (!currentRun) {
-                firstRun = currentRun = malloc(sizeof(CRun));
+                firstRun = currentRun = [storage allocateRun];
                 CRunInitialize(currentRun, &attrs, storage, curX);
             }
             if (thisCharString) {
@@ -7564,6 +8254,27 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     if (firstMissingGlyph >= 0) {
         length = firstMissingGlyph;
     }
+    double y = initialPoint.y + lineHeight + currentRun->attrs.fontInfo.baselineOffset;
+    int x = initialPoint.x + currentRun->x;
+    void *advances = CRunGetAdvances(currentRun);
+
+    if (glyphAtlas_) {
+        [glyphAtlas_ drawGlyphs:glyphs
+                       advances:advances
+                          count:length
+                           font:currentRun->attrs.fontInfo.font
+                          color:currentRun->attrs.color
+                       fakeBold:currentRun->attrs.fakeBold
+                     boldOffset:currentRun->attrs.antiAlias ? _antiAliasedShift : 1
+                     fakeItalic:currentRun->attrs.fakeItalic
+                      antiAlias:currentRun->attrs.antiAlias
+                          scale:[[self window] backingScaleFactor] ?: 1
+                              x:x
+                              y:y
+                      inContext:ctx];
+        return firstMissingGlyph;
+    }
+
     [self selectFont:currentRun->attrs.fontInfo.font inContext:ctx];
     CGContextSetFillColorSpace(ctx, [[currentRun->attrs.color colorSpace] CGColorSpace]);
     int componentCount = [currentRun->attrs.color numberOfComponents];
@@ -7572,8 +8283,6 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     [currentRun->attrs.color getComponents:components];
     CGContextSetFillColor(ctx, components);
 
-    double y = initialPoint.y + lineHeight + currentRun->attrs.fontInfo.baselineOffset;
-    int x = initialPoint.x + currentRun->x;
     // Flip vertically and translate to (x, y).
     CGFloat m21 = 0.0;
     if (currentRun->attrs.fakeItalic) {
@@ -7583,7 +8292,6 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                                                       m21, -1.0,
                                                       x, y));
 
-    void *advances = CRunGetAdvances(currentRun);
     CGContextShowGlyphsWithAdvances(ctx, glyphs, advances, length);
 
     if (currentRun->attrs.fakeBold) {
@@ -7609,7 +8317,15 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     return (CGColorRef)[(id)CGColorCreate(colorSpace, components) autorelease];
 }
 
+// Returns a path for a box drawing character that fills a cell whose top left is at the origin.
+// Paths are cached until the cell size changes.
 - (NSBezierPath *)bezierPathForBoxDrawingCode:(int)code {
+    NSNumber *key = @(code);
+    NSBezierPath *cachedPath = [boxDrawingPaths_ objectForKey:key];
+    if (cachedPath) {
+        return cachedPath;
+    }
+
     //  0 1 2
     //  3 4 5
     //  6 7 8
@@ -7668,6 +8384,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
             [path lineToPoint:p];
         }
     }
+    [boxDrawingPaths_ setObject:path forKey:key];
     return path;
 }
 
@@ -7690,9 +8407,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
         case ITERM_BOX_DRAWINGS_LIGHT_VERTICAL: {
             NSBezierPath *path = [self bezierPathForBoxDrawingCode:complexRun->key];
             [ctx saveGraphicsState];
-            NSAffineTransform *transform = [NSAffineTransform transform];
-            [transform translateXBy:pos.x yBy:pos.y];
-            [transform concat];
+            CGContextTranslateCTM((CGContextRef)[ctx graphicsPort], pos.x, pos.y);
             [color set];
             [path stroke];
             [ctx restoreGraphicsState];
@@ -7708,90 +8423,46 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     BOOL fakeItalic = complexRun->attrs.fakeItalic;
     BOOL antiAlias = complexRun->attrs.antiAlias;
 
-    NSDictionary* attrs;
-    attrs = [NSDictionary dictionaryWithObjectsAndKeys:
-                fontInfo.font, NSFontAttributeName,
-                color, NSForegroundColorAttributeName,
-                nil];
     [ctx saveGraphicsState];
     [ctx setCompositingOperation:NSCompositeSourceOver];
-    if (StringContainsCombiningMark(str)) {
-      // This renders characters with combining marks better but is slower.
-      NSMutableAttributedString* attributedString =
-          [[[NSMutableAttributedString alloc] initWithString:str
-                                                  attributes:attrs] autorelease];
-      // This code used to use -[NSAttributedString drawWithRect:options] but
-      // it does a lousy job rendering multiple combining marks. This is close
-      // to what WebKit does and appears to be the highest quality text
-      // rendering available. However, this path is only available in 10.7+.
-
-      CTLineRef lineRef = CTLineCreateWithAttributedString((CFAttributedStringRef)attributedString);
-      CFArrayRef runs = CTLineGetGlyphRuns(lineRef);
-      CGContextRef cgContext = (CGContextRef) [ctx graphicsPort];
-      CGContextSetFillColorWithColor(cgContext, [self cgColorForColor:color]);
-      CGContextSetStrokeColorWithColor(cgContext, [self cgColorForColor:color]);
-
-      CGFloat m21 = 0.0;
-      if (fakeItalic) {
-          m21 = 0.2;
-      }
-
-      CGAffineTransform textMatrix = CGAffineTransformMake(1.0,  0.0,
-                                                           m21, -1.0,
-                                                           pos.x, pos.y + fontInfo.baselineOffset + lineHeight);
-      CGContextSetTextMatrix(cgContext, textMatrix);
-
-      for (CFIndex j = 0; j < CFArrayGetCount(runs); j++) {
-          CTRunRef run = CFArrayGetValueAtIndex(runs, j);
-          CFRange range;
-          range.length = 0;
-          range.location = 0;
-          size_t length = CTRunGetGlyphCount(run);
-          const CGGlyph *buffer = CTRunGetGlyphsPtr(run);
-          const CGPoint *positions = CTRunGetPositionsPtr(run);
-          CTFontRef runFont = CFDictionaryGetValue(CTRunGetAttributes(run), kCTFontAttributeName);
-          CTFontDrawGlyphs(runFont, buffer, (NSPoint *)positions, length, cgContext);
-          if (fakeBold) {
-              CGContextTranslateCTM(cgContext, antiAlias ? _antiAliasedShift : 1, 0);
-              CTFontDrawGlyphs(runFont, buffer, (NSPoint *)positions, length, cgContext);
-              CGContextTranslateCTM(cgContext, antiAlias ? -_antiAliasedShift : -1, 0);
-          }
-      }
-      CFRelease(lineRef);
-    } else {
-        CGFloat width = CRunGetAdvances(complexRun)[0].width;
-        NSMutableAttributedString* attributedString =
-            [[[NSMutableAttributedString alloc] initWithString:str
-                                                    attributes:attrs] autorelease];
-        // Note that drawInRect doesn't use the right baseline, but drawWithRect
-        // does.
-        //
-        // This technique was picked because it can find glyphs that aren't in the
-        // selected font (e.g., tests/radical.txt). It does a fairly nice job on
-        // laying out combining marks. For now, it fails in two known cases:
-        // 1. Enclosing marks (q in a circle shows as a q)
-        // 2. U+239d, a part of a paren for graphics drawing, doesn't quite render
-        //    right (though it appears to need to render in another char's cell).
-        // Other rejected approaches included using CTFontGetGlyphsForCharacters+
-        // CGContextShowGlyphsWithAdvances, which doesn't render thai characters
-        // correctly in UTF-8-demo.txt.
-        //
-        // We use width*2 so that wide characters that are not double width chars
-        // render properly. These are font-dependent. See tests/suits.txt for an
-        // example.
-        [attributedString drawWithRect:NSMakeRect(pos.x,
-                                                  pos.y + fontInfo.baselineOffset + lineHeight,
-                                                  width*2,
-                                                  lineHeight)
-                               options:0];  // NSStringDrawingUsesLineFragmentOrigin
+
+    // Characters with combining marks and ones outside the BMP (most emoji) are laid out with
+    // CoreText, which finds glyphs that aren't in the selected font (e.g., tests/radical.txt) and
+    // positions multiple combining marks well; this is close to what WebKit does. The layout,
+    // including font fallback, is the slow part, so it comes from a cache and only the glyphs are
+    // drawn here. Lines aren't clipped, so wide characters that are not double width chars still
+    // render fully (see tests/suits.txt). Known failures are enclosing marks (q in a circle shows as
+    // a q) and U+239d, a part of a paren for graphics drawing, which appears to need to render in
+    // another char's cell.
+    CTLineRef lineRef = [complexGlyphCache_ lineForString:str font:fontInfo.font];
+    CFArrayRef runs = CTLineGetGlyphRuns(lineRef);
+    CGContextRef cgContext = (CGContextRef) [ctx graphicsPort];
+    CGContextSetFillColorWithColor(cgContext, [self cgColorForColor:color]);
+    CGContextSetStrokeColorWithColor(cgContext, [self cgColorForColor:color]);
+
+    CGFloat m21 = 0.0;
+    if (fakeItalic) {
+        m21 = 0.2;
+    }
+
+    CGAffineTransform textMatrix = CGAffineTransformMake(1.0,  0.0,
+                                                         m21, -1.0,
+                                                         pos.x, pos.y + fontInfo.baselineOffset + lineHeight);
+    CGContextSetTextMatrix(cgContext, textMatrix);
+
+    for (CFIndex j = 0; j < CFArrayGetCount(runs); j++) {
+        CTRunRef run = CFArrayGetValueAtIndex(runs, j);
+        size_t length = CTRunGetGlyphCount(run);
+        const CGGlyph *buffer = CTRunGetGlyphsPtr(run);
+        const CGPoint *positions = CTRunGetPositionsPtr(run);
+        CTFontRef runFont = CFDictionaryGetValue(CTRunGetAttributes(run), kCTFontAttributeName);
+        CTFontDrawGlyphs(runFont, buffer, (NSPoint *)positions, length, cgContext);
         if (fakeBold) {
-            // If anti-aliased, drawing twice at the same position makes the strokes thicker.
-            // If not anti-alised, draw one pixel to the right.
-            [attributedString drawWithRect:NSMakeRect(pos.x + (antiAlias ? 0 : 1),
-                                                      pos.y + fontInfo.baselineOffset + lineHeight,
-                                                      width*2,
-                                                      lineHeight)
-                                   options:0];  // NSStringDrawingUsesLineFragmentOrigin
+            // If anti-aliased, drawing twice at nearly the same position makes the strokes
+            // thicker. If not anti-alised, draw one pixel to the right.
+            CGContextTranslateCTM(cgContext, antiAlias ? _antiAliasedShift : 1, 0);
+            CTFontDrawGlyphs(runFont, buffer, (NSPoint *)positions, length, cgContext);
+            CGContextTranslateCTM(cgContext, antiAlias ? -_antiAliasedShift : -1, 0);
         }
     }
     [ctx restoreGraphicsState];
@@ -7818,21 +8489,26 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     if (!currentRun->string) {
         // Non-complex, except for glyphs we can't find.
         while (currentRun->length) {
+            [frameProfiler_ beginStage:kFrameProfilerStageSimpleRuns];
             int firstComplexGlyph = [self _drawSimpleRun:currentRun
                                                      ctx:ctx
                                             initialPoint:initialPoint];
+            [frameProfiler_ endStage:kFrameProfilerStageSimpleRuns];
             if (firstComplexGlyph < 0) {
                 break;
             }
             CRun *complexRun = CRunSplit(currentRun, firstComplexGlyph);
+            [frameProfiler_ beginStage:kFrameProfilerStageAdvancedRuns];
             [self _advancedDrawRun:complexRun
                                 at:NSMakePoint(initialPoint.x + complexRun->x, initialPoint.y)];
-            CRunFree(complexRun);
+            [frameProfiler_ endStage:kFrameProfilerStageAdvancedRuns];
         }
     } else {
         // Complex
+        [frameProfiler_ beginStage:kFrameProfilerStageAdvancedRuns];
         [self _advancedDrawRun:currentRun
                             at:NSMakePoint(initialPoint.x + currentRun->x, initialPoint.y)];
+        [frameProfiler_ endStage:kFrameProfilerStageAdvancedRuns];
     }
 
     // Draw underline
@@ -7852,6 +8528,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 {
     CGContextSetTextDrawingMode(ctx, kCGTextFill);
     while (run) {
+        [frameProfiler_ addToCounter:kFrameProfilerCounterRuns amount:1];
         [self drawRun:run ctx:ctx initialPoint:initialPoint storage:storage];
         run = run->next;
     }
@@ -7868,7 +8545,9 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                       context:(CGContextRef)ctx
 {
     const int width = [dataSource width];
-    CRunStorage *storage = [CRunStorage cRunStorageWithCapacity:width];
+    CRunStorage *storage = runStorage_;
+    [storage reset];
+    [frameProfiler_ beginStage:kFrameProfilerStageConstructRuns];
     CRun *run = [self _constructRuns:initialPoint
                              theLine:theLine
                                  row:row
@@ -7879,10 +8558,10 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                              bgColor:bgColor
                              matches:matches
                              storage:storage];
+    [frameProfiler_ endStage:kFrameProfilerStageConstructRuns];
 
     if (run) {
         [self _drawRunsAt:initialPoint run:run storage:storage context:ctx];
-        CRunFree(run);
     }
 }
 
@@ -7937,6 +8616,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                        context:(CGContextRef)ctx       // Graphics context
 {
     NSColor *aColor = *defaultBgColorPtr;
+    [frameProfiler_ beginStage:kFrameProfilerStageBackground];
 
     NSRect bgRect = NSMakeRect(floor(MARGIN + firstIndex * charWidth),
                                yOrigin,
@@ -7962,31 +8642,13 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
         // We are not drawing an unmolested background image. Some
         // background fill must be drawn. If there is a background image
         // it will be blended with the bg color.
-
-        if (isMatch && !bgselected) {
-            aColor = [NSColor colorWithCalibratedRed:1 green:1 blue:0 alpha:1];
-        } else if (bgselected) {
-            aColor = [self selectionColorForCurrentFocus];
-        } else {
-            if (reversed && bgColor == ALTSEM_BG_DEFAULT && bgColorMode == ColorModeAlternate) {
-                // Reverse video is only applied to default background-
-                // color chars.
-                aColor = [self colorForCode:ALTSEM_FG_DEFAULT
-                                      green:0
-                                       blue:0
-                                  colorMode:ColorModeAlternate
-                                       bold:NO
-                               isBackground:NO];
-            } else {
-                // Use the regular background color.
-                aColor = [self colorForCode:bgColor
-                                      green:bgGreen
-                                       blue:bgBlue
-                                  colorMode:bgColorMode
-                                       bold:NO
-                               isBackground:(bgColor == ALTSEM_BG_DEFAULT)];
-            }
-        }
+        aColor = [self _backgroundColorForBgColor:bgColor
+                                          bgGreen:bgGreen
+                                           bgBlue:bgBlue
+                                      bgColorMode:bgColorMode
+                                         reversed:reversed
+                                       bgselected:bgselected
+                                          isMatch:isMatch];
         aColor = [aColor colorWithAlphaComponent:alphaIfTransparencyInUse];
         [aColor set];
         if (toPoint) {
@@ -8009,6 +8671,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
         NSRectFillUsingOperation(bgRect, NSCompositeSourceOver);
     }
     *defaultBgColorPtr = aColor;
+    [frameProfiler_ endStage:kFrameProfilerStageBackground];
 
     // Draw red stripes in the background if sending input to all sessions
     if (stripes) {
@@ -8034,6 +8697,244 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                         context:ctx];
 }
 
+// Returns the color to fill a run's background with, before transparency is applied.
+- (NSColor *)_backgroundColorForBgColor:(int)bgColor
+                                bgGreen:(int)bgGreen
+                                 bgBlue:(int)bgBlue
+                            bgColorMode:(ColorMode)bgColorMode
+                               reversed:(BOOL)reversed
+                             bgselected:(BOOL)bgselected
+                                isMatch:(BOOL)isMatch
+{
+    if (isMatch && !bgselected) {
+        return [NSColor colorWithCalibratedRed:1 green:1 blue:0 alpha:1];
+    } else if (bgselected) {
+        return [self selectionColorForCurrentFocus];
+    } else if (reversed && bgColor == ALTSEM_BG_DEFAULT && bgColorMode == ColorModeAlternate) {
+        // Reverse video is only applied to default background-
+        // color chars.
+        return [self colorForCode:ALTSEM_FG_DEFAULT
+                            green:0
+                             blue:0
+                        colorMode:ColorModeAlternate
+                             bold:NO
+                     isBackground:NO];
+    } else {
+        // Use the regular background color.
+        return [self colorForCode:bgColor
+                            green:bgGreen
+                             blue:bgBlue
+                        colorMode:bgColorMode
+                             bold:NO
+                     isBackground:(bgColor == ALTSEM_BG_DEFAULT)];
+    }
+}
+
+// Fills the backgrounds of |spans| with one CGContextFillRects per distinct color, then draws
+// their text. Spans with the default background color are skipped because the caller has already
+// filled the whole line with it. Only valid without a background image, since fills replace what's
+// underneath.
+- (void)_drawBackgroundSpans:(PTYBackgroundSpan *)spans
+                       count:(int)count
+                         row:(int)row
+                     yOrigin:(double)yOrigin
+              defaultBgColor:(NSColor *)defaultBgColor
+    alphaIfTransparencyInUse:(double)alphaIfTransparencyInUse
+                    reversed:(BOOL)reversed
+                     stripes:(BOOL)stripes
+                        line:(screen_char_t *)theLine
+                     matches:(NSData *)matches
+                     context:(CGContextRef)ctx
+{
+    if (count == 0) {
+        return;
+    }
+    [frameProfiler_ beginStage:kFrameProfilerStageBackground];
+    NSColor *colors[count];
+    CGRect rects[count];
+    BOOL filled[count];
+    for (int i = 0; i < count; i++) {
+        colors[i] = [self _backgroundColorForBgColor:spans[i].bgColor
+                                             bgGreen:spans[i].bgGreen
+                                              bgBlue:spans[i].bgBlue
+                                         bgColorMode:spans[i].bgColorMode
+                                            reversed:reversed
+                                          bgselected:spans[i].selected
+                                             isMatch:spans[i].isMatch];
+        rects[i] = CGRectMake(floor(MARGIN + spans[i].start * charWidth),
+                              yOrigin,
+                              ceil((spans[i].end - spans[i].start) * charWidth),
+                              lineHeight);
+        filled[i] = (colors[i] == defaultBgColor);
+    }
+
+    CGContextSaveGState(ctx);
+    CGContextSetBlendMode(ctx, kCGBlendModeCopy);
+    CGRect batch[count];
+    for (int i = 0; i < count; i++) {
+        if (filled[i]) {
+            continue;
+        }
+        int n = 0;
+        for (int j = i; j < count; j++) {
+            if (!filled[j] && colors[j] == colors[i]) {
+                batch[n++] = rects[j];
+                filled[j] = YES;
+            }
+        }
+        [[colors[i] colorWithAlphaComponent:alphaIfTransparencyInUse] set];
+        CGContextFillRects(ctx, batch, n);
+    }
+    CGContextRestoreGState(ctx);
+    [frameProfiler_ endStage:kFrameProfilerStageBackground];
+
+    // Draw red stripes in the background if sending input to all sessions
+    if (stripes) {
+        [self _drawStripesInRect:NSRectFromCGRect(CGRectUnion(rects[0], rects[count - 1]))];
+    }
+
+    for (int i = 0; i < count; i++) {
+        [self _drawCharactersInLine:theLine
+                                row:row
+                            inRange:NSMakeRange(spans[i].start, spans[i].end - spans[i].start)
+                    startingAtPoint:NSMakePoint(MARGIN + spans[i].start * charWidth, yOrigin)
+                         bgselected:spans[i].selected
+                           reversed:reversed
+                            bgColor:[colors[i] colorWithAlphaComponent:alphaIfTransparencyInUse]
+                            matches:matches
+                            context:ctx];
+    }
+}
+
+// Returns the ranges of cells with notes on |line|, as found for all the lines at once when called
+// from -drawRect:to:.
+- (NSArray *)_charactersWithNotesOnLine:(int)line
+{
+    const int i = line - firstDrawnAnnotatedLine_;
+    if (noteRangesForDrawnLines_ && i >= 0 && i < [noteRangesForDrawnLines_ count]) {
+        return [noteRangesForDrawnLines_ objectAtIndex:i];
+    }
+    return [dataSource charactersWithNotesOnLine:line];
+}
+
+- (BOOL)_hasMarkOnLine:(int)line
+{
+    if (marksForDrawnLines_) {
+        const int i = line - firstDrawnAnnotatedLine_;
+        if (i >= 0 && i < [noteRangesForDrawnLines_ count]) {
+            return [marksForDrawnLines_ containsIndex:i];
+        }
+    }
+    return [dataSource hasMarkOnLine:line];
+}
+
+// Draws a line from lineRenderCache_, rendering it into its layer first if anything that affects
+// its appearance changed. Returns YES if the line contains blinking text.
+- (BOOL)_drawLineUsingRenderCache:(int)line
+                              AtY:(double)curY
+                          context:(CGContextRef)ctx
+{
+    const int width = [dataSource width];
+    // The key is made from a view of the line so scrollback lines aren't copied for lines whose
+    // layer is still good. The line is copied only if it has to be rendered again.
+    const ScreenCharLineView view = [dataSource lineViewAtIndex:line];
+    BOOL hasBlink = (view.length < width && view.padding.blink);
+    for (int i = 0; i < view.length && !hasBlink; i++) {
+        if (view.chars[i].blink) {
+            hasBlink = YES;
+        }
+    }
+
+    PTYLineRenderKeyHeader header;
+    memset(&header, 0, sizeof(header));
+    header.y = curY;
+    header.width = [self visibleRect].size.width;
+    header.charWidth = charWidth;
+    header.lineHeight = lineHeight;
+    header.selectionColor = (void *)[self selectionColorForCurrentFocus];
+    header.selection[0] = -1;
+    if (startX >= 0 && line >= MIN(startY, endY) && line <= MAX(startY, endY)) {
+        header.selection[0] = startX;
+        header.selection[1] = startY;
+        header.selection[2] = endX;
+        header.selection[3] = endY;
+        header.selection[4] = selectMode;
+    }
+    header.underline[0] = -1;
+    if (_underlineStartX >= 0 && line >= _underlineStartY && line <= _underlineEndY) {
+        header.underline[0] = _underlineStartX;
+        header.underline[1] = _underlineStartY;
+        header.underline[2] = _underlineEndX;
+        header.underline[3] = _underlineEndY;
+    }
+    header.blinkShow = hasBlink && blinkShow;
+    header.reversed = [[dataSource terminal] screenMode];
+    header.hasMark = [self _hasMarkOnLine:line];
+
+    const long long absoluteLine = line + [dataSource totalScrollbackOverflow];
+    NSMutableData *key = [NSMutableData dataWithBytes:&header length:sizeof(header)];
+    [key appendBytes:&view.length length:sizeof(view.length)];
+    [key appendBytes:&view.eol length:sizeof(view.eol)];
+    [key appendBytes:&view.padding length:sizeof(view.padding)];
+    [key appendBytes:view.chars length:view.length * sizeof(screen_char_t)];
+    NSData *matches = [self _matchesOnLine:absoluteLine];
+    if (matches) {
+        [key appendData:matches];
+    }
+    for (NSValue *value in [self _charactersWithNotesOnLine:line]) {
+        VT100GridRange range = [value gridRangeValue];
+        [key appendBytes:&range length:sizeof(range)];
+    }
+
+    BOOL needsRender;
+    CGSize size = CGSizeMake(header.width, lineHeight);
+    CGLayerRef layer = [lineRenderCache_ layerForLine:absoluteLine
+                                                  key:key
+                                                 size:size
+                                              context:ctx
+                                          needsRender:&needsRender];
+    if (!layer) {
+        return [self _drawLine:line
+                           AtY:curY
+                       toPoint:nil
+                     charRange:NSMakeRange(0, width)
+                       context:ctx];
+    }
+    if (needsRender) {
+        // Draw the whole line into the layer with the same flipped coordinates the view uses.
+        CGContextRef layerContext = CGLayerGetContext(layer);
+        CGContextSaveGState(layerContext);
+        CGContextTranslateCTM(layerContext, 0, lineHeight);
+        CGContextScaleCTM(layerContext, 1, -1);
+        CGContextTranslateCTM(layerContext, 0, -curY);
+        [NSGraphicsContext saveGraphicsState];
+        NSGraphicsContext *graphicsContext = [NSGraphicsContext graphicsContextWithGraphicsPort:layerContext
+                                                                                        flipped:YES];
+        [NSGraphicsContext setCurrentContext:graphicsContext];
+        [graphicsContext setCompositingOperation:NSCompositeCopy];
+        [selectedFont_ release];
+        selectedFont_ = nil;
+        [self _drawLine:line
+                    AtY:curY
+                toPoint:nil
+              charRange:NSMakeRange(0, width)
+                context:layerContext];
+        [selectedFont_ release];
+        selectedFont_ = nil;
+        [NSGraphicsContext restoreGraphicsState];
+        CGContextRestoreGState(layerContext);
+    }
+
+    CGContextSaveGState(ctx);
+    CGContextSetBlendMode(ctx, kCGBlendModeCopy);
+    CGContextTranslateCTM(ctx, 0, curY + lineHeight);
+    CGContextScaleCTM(ctx, 1, -1);
+    CGContextDrawLayerAtPoint(ctx, CGPointZero, layer);
+    CGContextRestoreGState(ctx);
+
+    return [self _textBlinkingAllowed] && hasBlink;
+}
+
 - (BOOL)_drawLine:(int)line
               AtY:(double)curY
           toPoint:(NSPoint*)toPoint
@@ -8121,16 +9022,26 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                 NSRectFillUsingOperation(leftMargin, NSCompositeSourceOver);
                 NSRectFillUsingOperation(rightMargin, NSCompositeSourceOver);
             } else {
+                // Fill the margins and every cell being drawn with the default background at once.
+                // Only cells with some other background color get filled again below.
                 aColor = [aColor colorWithAlphaComponent:alphaIfTransparencyInUse];
                 [aColor set];
-                NSRectFill(leftMargin);
-                NSRectFill(rightMargin);
+                const CGFloat cellsX = floor(MARGIN + charRange.location * charWidth);
+                CGRect rects[3] = {
+                    NSRectToCGRect(leftMargin),
+                    CGRectMake(cellsX, curY, ceil(charRange.length * charWidth), lineHeight),
+                    NSRectToCGRect(rightMargin)
+                };
+                CGContextSaveGState(ctx);
+                CGContextSetBlendMode(ctx, kCGBlendModeCopy);
+                CGContextFillRects(ctx, rects, 3);
+                CGContextRestoreGState(ctx);
             }
         }
     }
 
     // Indicate marks in margin --
-    if ([dataSource hasMarkOnLine:line]) {
+    if ([self _hasMarkOnLine:line]) {
         CGFloat offset = (lineHeight - markImage_.size.height) / 2.0;
         [markImage_ drawAtPoint:NSMakePoint(leftMargin.origin.x,
                                             leftMargin.origin.y + offset)
@@ -8149,9 +9060,22 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     ColorMode bgColorMode = ColorModeNormal;
     BOOL bgselected = NO;
     BOOL isMatch = NO;
-    NSData* matches = [resultMap_ objectForKey:[NSNumber numberWithLongLong:line + [dataSource totalScrollbackOverflow]]];
+    NSData* matches = [self _matchesOnLine:line + [dataSource totalScrollbackOverflow]];
     const char* matchBytes = [matches bytes];
 
+    // Without a background image or offset, runs are collected and their backgrounds filled
+    // together by -_drawBackgroundSpans:... once the whole line has been scanned.
+    const BOOL batchBackgrounds = !hasBGImage && !toPoint;
+    PTYBackgroundSpan spans[batchBackgrounds ? MAX(1, charRange.length) : 1];
+    int numSpans = 0;
+
+    // Asked once for the line rather than for each char.
+    const BOOL textBlinkingAllowed = [self _textBlinkingAllowed];
+    const VT100GridRange selectedColumns = [self _selectedColumnsOnRow:line
+                                                                 width:WIDTH
+                                                              checkOld:NO];
+    const int selectedLimit = VT100GridRangeMax(selectedColumns);
+
     // Iterate over each character in the line.
     // Go one past where we really need to go to simplify the code.  // TODO(georgen): Fix that.
     int limit = charRange.location + charRange.length;
@@ -8161,23 +9085,19 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
             j++;
             continue;
         }
-        if (blinkAllowed_ && theLine[j].blink) {
+        if (textBlinkingAllowed && theLine[j].blink) {
             anyBlinking = YES;
         }
 
         BOOL selected;
-        if (theLine[j].code == DWC_SKIP) {
+        if (!selectedColumns.length || theLine[j].code == DWC_SKIP) {
             selected = NO;
-        } else if (theLine[j].code == TAB_FILLER) {
-            if ([self isTabFillerOrphanAtX:j Y:line]) {
-                // Treat orphaned tab fillers like spaces.
-                selected = [self _isCharSelectedInRow:line col:j checkOld:NO];
-            } else {
-                // Select all leading tab fillers iff the tab is selected.
-                selected = [self isFutureTabSelectedAfterX:j Y:line];
-            }
+        } else if (theLine[j].code == TAB_FILLER && ![self isTabFillerOrphanAtX:j Y:line]) {
+            // Select all leading tab fillers iff the tab is selected.
+            selected = [self isFutureTabSelectedAfterX:j Y:line];
         } else {
-            selected = [self _isCharSelectedInRow:line col:j checkOld:NO];
+            // Orphaned tab fillers are treated like spaces.
+            selected = (j >= selectedColumns.location && j < selectedLimit);
         }
         BOOL double_width = j < WIDTH - 1 && (theLine[j+1].code == DWC_RIGHT);
         BOOL match = NO;
@@ -8208,6 +9128,11 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
             match == isMatch) {
             // Continue the run
             j += (double_width ? 2 : 1);
+        } else if (bgstart >= 0 && batchBackgrounds) {
+            // This run is finished, draw it with the others later.
+            PTYBackgroundSpan span = { bgstart, j, bgColor, bgGreen, bgBlue, bgColorMode, bgselected, isMatch };
+            spans[numSpans++] = span;
+            bgstart = -1;
         } else if (bgstart >= 0) {
             // This run is finished, draw it
 
@@ -8238,7 +9163,10 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
             j += (double_width ? 2 : 1);
         }
     }
-    if (bgstart >= 0) {
+    if (bgstart >= 0 && batchBackgrounds) {
+        PTYBackgroundSpan span = { bgstart, j, bgColor, bgGreen, bgBlue, bgColorMode, bgselected, isMatch };
+        spans[numSpans++] = span;
+    } else if (bgstart >= 0) {
         // Draw last run, if necesary.
         [self drawRunStartingAtIndex:bgstart
                                  row:line
@@ -8260,8 +9188,27 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                              matches:matches
                              context:ctx];
     }
-
-    NSArray *noteRanges = [dataSource charactersWithNotesOnLine:line];
+    if (batchBackgrounds) {
+        NSColor *defaultBgColor = [self colorForCode:ALTSEM_BG_DEFAULT
+                                               green:0
+                                                blue:0
+                                           colorMode:ColorModeAlternate
+                                                bold:NO
+                                        isBackground:YES];
+        [self _drawBackgroundSpans:spans
+                             count:numSpans
+                               row:line
+                           yOrigin:curY
+                    defaultBgColor:defaultBgColor
+          alphaIfTransparencyInUse:alphaIfTransparencyInUse
+                          reversed:reversed
+                           stripes:stripes
+                              line:theLine
+                           matches:matches
+                           context:ctx];
+    }
+
+    NSArray *noteRanges = [self _charactersWithNotesOnLine:line];
     if (noteRanges.count) {
         for (NSValue *value in noteRanges) {
             VT100GridRange range = [value gridRangeValue];
@@ -8301,7 +9248,8 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     temp.foregroundColorMode = fgColorMode;
     temp.bold = fgBold;
 
-    CRunStorage *storage = [CRunStorage cRunStorageWithCapacity:1];
+    CRunStorage *storage = runStorage_;
+    [storage reset];
     // Draw the characters.
     CRun *run = [self _constructRuns:NSMakePoint(X, Y)
                              theLine:&temp
@@ -8323,7 +9271,6 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
             }
         }
         [self _drawRunsAt:NSMakePoint(X, Y) run:head storage:storage context:ctx];
-        CRunFree(head);
     }
 
     // draw underline
@@ -8450,7 +9397,8 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
             NSRectFill(r);
 
             // Draw the characters.
-            CRunStorage *storage = [CRunStorage cRunStorageWithCapacity:charsInLine];
+            CRunStorage *storage = runStorage_;
+            [storage reset];
             CRun *run = [self _constructRuns:NSMakePoint(x, y)
                                      theLine:buf
                                          row:y
@@ -8463,7 +9411,6 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                                      storage:storage];
             if (run) {
                 [self _drawRunsAt:NSMakePoint(x, y) run:run storage:storage context:ctx];
-                CRunFree(run);
             }
 
             // Draw an underline.
@@ -8671,7 +9618,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     if (x1 != oldCursorX || yStart != oldCursorY) {
         lastTimeCursorMoved_ = now;
     }
-    if ([self blinkingCursor] &&
+    if ([self _cursorBlinkingAllowed] &&
         [self isInKeyWindow] &&
         [_delegate textViewIsActiveSession] &&
         now - lastTimeCursorMoved_ > 0.5) {
@@ -9101,6 +10048,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 // afterString could be "cation Support/Screen Sharing foo bar baz". This searches outward from
 // the point between beforeString and afterString to find a valid path, and would return
 // "~/Library/Application Support/Screen sharing" if such a file exists.
+// This uses only trouter, so it's safe to call on semanticHistoryQueue_.
 - (NSMutableString *)_bruteforcePathFromBeforeString:(NSMutableString *)beforeString
                                          afterString:(NSMutableString *)afterString
                                     workingDirectory:(NSString *)workingDirectory
@@ -9384,24 +10332,88 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 {
     NSString *prefix = [self wrappedStringAtX:x y:y dir:-1 respectHardNewlines:respectHardNewlines];
     NSString *suffix = [self wrappedStringAtX:x y:y dir:1 respectHardNewlines:respectHardNewlines];
-    NSString *possibleFilePart1 = [self stringInString:prefix
-                                       includingOffset:[prefix length] - 1
-                                      fromCharacterSet:[PTYTextView filenameCharacterSet]
-                                  charsTakenFromPrefix:NULL];
-    NSString *possibleFilePart2 = [self stringInString:suffix
-                                       includingOffset:0
-                                      fromCharacterSet:[PTYTextView filenameCharacterSet]
-                                   charsTakenFromPrefix:NULL];
-
     int fileCharsTaken = 0;
 
     NSString *workingDirectory = [dataSource workingDirectoryOnLine:y];
     // First, try to locate an existing filename at this location.
-    NSString *filename = [self _bruteforcePathFromBeforeString:[[possibleFilePart1 mutableCopy] autorelease]
-                                                   afterString:[[possibleFilePart2 mutableCopy] autorelease]
+    NSString *filename = [self _bruteforcePathFromBeforeString:[self possibleFilenamePrefixInString:prefix]
+                                                   afterString:[self possibleFilenameSuffixInString:suffix]
                                               workingDirectory:workingDirectory
                                           charsTakenFromPrefix:&fileCharsTaken];
+    return [self urlActionForClickAtX:x
+                                    y:y
+                               prefix:prefix
+                               suffix:suffix
+                     workingDirectory:workingDirectory
+                     existingFilename:filename
+                       fileCharsTaken:fileCharsTaken];
+}
+
+// Like -urlActionForClickAtX:y:respectingHardNewlines: but looks for a filename on
+// semanticHistoryQueue_ and calls |completion| on the main thread when done. Nothing is done once
+// underlineGeneration_ no longer equals |generation|.
+- (void)urlActionForClickAtX:(int)x
+                           y:(int)y
+      respectingHardNewlines:(BOOL)respectHardNewlines
+                  generation:(int)generation
+                  completion:(void (^)(URLAction *action))completion
+{
+    NSString *prefix = [self wrappedStringAtX:x y:y dir:-1 respectHardNewlines:respectHardNewlines];
+    NSString *suffix = [self wrappedStringAtX:x y:y dir:1 respectHardNewlines:respectHardNewlines];
+    NSMutableString *possibleFilePart1 = [self possibleFilenamePrefixInString:prefix];
+    NSMutableString *possibleFilePart2 = [self possibleFilenameSuffixInString:suffix];
+    NSString *workingDirectory = [dataSource workingDirectoryOnLine:y];
+    completion = [[completion copy] autorelease];
+    dispatch_async(semanticHistoryQueue_, ^{
+        if (generation != underlineGeneration_) {
+            return;
+        }
+        int fileCharsTaken = 0;
+        NSString *filename = [self _bruteforcePathFromBeforeString:possibleFilePart1
+                                                       afterString:possibleFilePart2
+                                                  workingDirectory:workingDirectory
+                                              charsTakenFromPrefix:&fileCharsTaken];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            if (generation != underlineGeneration_) {
+                return;
+            }
+            completion([self urlActionForClickAtX:x
+                                                y:y
+                                           prefix:prefix
+                                           suffix:suffix
+                                 workingDirectory:workingDirectory
+                                 existingFilename:filename
+                                   fileCharsTaken:fileCharsTaken]);
+        });
+    });
+}
+
+- (NSMutableString *)possibleFilenamePrefixInString:(NSString *)prefix
+{
+    return [[[self stringInString:prefix
+                  includingOffset:[prefix length] - 1
+                 fromCharacterSet:[PTYTextView filenameCharacterSet]
+             charsTakenFromPrefix:NULL] mutableCopy] autorelease];
+}
+
+- (NSMutableString *)possibleFilenameSuffixInString:(NSString *)suffix
+{
+    return [[[self stringInString:suffix
+                  includingOffset:0
+                 fromCharacterSet:[PTYTextView filenameCharacterSet]
+             charsTakenFromPrefix:NULL] mutableCopy] autorelease];
+}
 
+// |filename| is an existing file found in |prefix| and |suffix|, the text before and after x,y,
+// or nil.
+- (URLAction *)urlActionForClickAtX:(int)x
+                                  y:(int)y
+                             prefix:(NSString *)prefix
+                             suffix:(NSString *)suffix
+                   workingDirectory:(NSString *)workingDirectory
+                   existingFilename:(NSString *)filename
+                     fileCharsTaken:(int)fileCharsTaken
+{
     // Don't consider / to be a valid filename because it's useless and single/double slashes are
     // pretty common.
     if (filename && ![[filename stringByReplacingOccurrencesOfString:@"//" withString:@"/"] isEqualToString:@"/"]) {
@@ -9438,11 +10450,9 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
                         trimTrailingWhitespace:NO];
         URLAction *action = [URLAction urlActionToPerformSmartSelectionRule:rule onString:content];
         action.range = VT100GridCoordRangeMake(tx1, ty1, tx2, ty2);
-        NSError *regexError;
-        NSArray *components = [content captureComponentsMatchedByRegex:[SmartSelectionController regexInRule:rule]
-                                                               options:0
-                                                                 range:NSMakeRange(0, content.length)
-                                                                 error:&regexError];
+        CompiledRegex *regex = [CompiledRegex regexWithPattern:[SmartSelectionController regexInRule:rule]
+                                               caseInsensitive:NO];
+        NSArray *components = [regex captureComponentsInString:content];
         action.selector = [self selectorForSmartSelectionAction:actions[0]];
         action.representedObject = [ContextMenuActionPrefsController parameterForActionDict:actions[0]
                                                                       withCaptureComponents:components];
@@ -9905,7 +10915,10 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     }
 }
 
-- (BOOL)_isCharSelectedInRow:(int)row col:(int)col checkOld:(BOOL)old
+// The columns of |row| selected by the current selection, or the old one if |old| is set, clipped
+// to |width|. In every mode the selection covers one contiguous span of each row, so finding it is
+// constant time and a char can then be tested with a range check.
+- (VT100GridRange)_selectedColumnsOnRow:(int)row width:(int)width checkOld:(BOOL)old
 {
     int tempStartX;
     int tempStartY;
@@ -9928,7 +10941,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     }
 
     if (tempStartX <= -1 || (tempStartY == tempEndY && tempStartX == tempEndX)) {
-        return NO;
+        return VT100GridRangeMake(0, 0);
     }
     if (tempStartY > tempEndY || (tempStartY == tempEndY && tempStartX > tempEndX)) {
         int t;
@@ -9941,20 +10954,39 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
         tempStartX = tempEndX;
         tempEndX = t;
     }
+
+    int first;
+    int limit;
     if (tempSelectMode == SELECT_BOX) {
-        return (row >= tempStartY && row < tempEndY) && (col >= tempStartX && col < tempEndX);
-    }
-    if (row == tempStartY && tempStartY == tempEndY) {
-        return (col >= tempStartX && col < tempEndX);
-    } else if (row == tempStartY && col >= tempStartX) {
-        return YES;
-    } else if (row == tempEndY && col < tempEndX) {
-        return YES;
-    } else if (row > tempStartY && row < tempEndY) {
-        return YES;
+        if (row < tempStartY || row >= tempEndY) {
+            return VT100GridRangeMake(0, 0);
+        }
+        first = tempStartX;
+        limit = tempEndX;
+    } else if (row < tempStartY || row > tempEndY) {
+        return VT100GridRangeMake(0, 0);
     } else {
+        first = (row == tempStartY) ? tempStartX : 0;
+        limit = (row == tempEndY) ? tempEndX : width;
+    }
+    first = MAX(0, first);
+    limit = MIN(width, limit);
+    if (limit <= first) {
+        return VT100GridRangeMake(0, 0);
+    }
+    return VT100GridRangeMake(first, limit - first);
+}
+
+- (BOOL)_isCharSelectedInRow:(int)row col:(int)col checkOld:(BOOL)old
+{
+    if (col < 0) {
         return NO;
     }
+    // Past the end of a row counts as selected when the selection runs on to the next row.
+    VT100GridRange range = [self _selectedColumnsOnRow:row
+                                                 width:MAX([dataSource width], col + 1)
+                                              checkOld:old];
+    return col >= range.location && col < VT100GridRangeMax(range);
 }
 
 - (void)_pointerSettingsChanged:(NSNotification *)notification
@@ -9978,7 +11010,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 {
     advancedFontRendering = [[PreferencePanel sharedInstance] advancedFontRendering];
     strokeThickness = [[PreferencePanel sharedInstance] strokeThickness];
-    [dimmedColorCache_ removeAllObjects];
+    [colorCache_ removeAllColors];
     [self setNeedsDisplay:YES];
     [self setDimOnlyText:[[PreferencePanel sharedInstance] dimOnlyText]];
 }
@@ -10015,6 +11047,83 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     [self setNeedsDisplayInRect:dirtyRect];
 }
 
+// If a region of the grid scrolled since the last update, move the pixels already drawn for it
+// instead of redrawing them. The lines that scrolled in are dirty in the grid and get drawn normally.
+// When the pixels can't be reused, the region is marked dirty instead. Returns YES if pixels moved.
+- (BOOL)_moveScrollDamagedPixels
+{
+    int distance = [dataSource scrollDamageDistance];
+    if (distance == 0) {
+        return NO;
+    }
+    VT100GridRect rect = [dataSource scrollDamageRect];
+    int lineStart = [dataSource numberOfLines] - [dataSource height];
+    // Whether or not the pixels get moved, the lines' contents did.
+    for (int y = rect.origin.y; y < rect.origin.y + rect.size.height; y++) {
+        [blinkingCellIndex_ setLineDirty:lineStart + y + [dataSource totalScrollbackOverflow]];
+    }
+    NSRect damagedRect = NSMakeRect(0,
+                                    (lineStart + rect.origin.y) * lineHeight,
+                                    [self frame].size.width,
+                                    rect.size.height * lineHeight);
+    BOOL canMove = (![self isAnyCharSelected] &&
+                    !showTimestamps_ &&
+                    ![self needsDisplay] &&
+                    ![(PTYScrollView *)[self enclosingScrollView] hasBackgroundImage] &&
+                    NSContainsRect([self visibleRect], damagedRect));
+    long long totalScrollbackOverflow = [dataSource totalScrollbackOverflow];
+    for (int y = rect.origin.y; canMove && y < rect.origin.y + rect.size.height; y++) {
+        // Search results are drawn into the pixels but belong to absolute lines.
+        if (FindHighlightsTouchLine(&findHighlights_, lineStart + y + totalScrollbackOverflow)) {
+            canMove = NO;
+        }
+    }
+    if (!canMove) {
+        [dataSource markScrollDamageDirty];
+        return NO;
+    }
+
+    NSRect sourceRect = damagedRect;
+    sourceRect.size.height = (rect.size.height - abs(distance)) * lineHeight;
+    if (distance < 0) {
+        sourceRect.origin.y -= distance * lineHeight;
+    }
+    DLog(@"Move %@ by %d lines", [NSValue valueWithRect:sourceRect], distance);
+    [self scrollRect:sourceRect by:NSMakeSize(0, distance * lineHeight)];
+
+    // The cursor was drawn into the pixels that moved, and the current cursor is always drawn.
+    const int movedCursorY = prevCursorY + distance;
+    if (prevCursorY >= rect.origin.y && prevCursorY < rect.origin.y + rect.size.height &&
+        movedCursorY >= rect.origin.y && movedCursorY < rect.origin.y + rect.size.height) {
+        [self _setNeedsDisplayForCursorAtX:MIN([dataSource width] - 1, prevCursorX) y:movedCursorY];
+    }
+    [self _setNeedsDisplayForCursorAtX:MIN([dataSource width] - 1, [dataSource cursorX] - 1)
+                                     y:[dataSource cursorY] - 1];
+    return YES;
+}
+
+// Like setNeedsDisplayOnLine:inRange: but for a rectangle of lines sharing the same range.
+- (void)setNeedsDisplayInGridRect:(VT100GridRect)rect
+{
+    NSRect dirtyRect;
+    dirtyRect.origin.x = MARGIN + rect.origin.x * charWidth;
+    dirtyRect.origin.y = rect.origin.y * lineHeight;
+    dirtyRect.size.width = rect.size.width * charWidth;
+    dirtyRect.size.height = rect.size.height * lineHeight;
+
+    if (showTimestamps_) {
+        dirtyRect.size.width = self.visibleRect.size.width - dirtyRect.origin.x;
+    }
+    // Add a character on either side for glyphs that render unexpectedly wide.
+    dirtyRect.origin.x -= charWidth;
+    dirtyRect.size.width += 2 * charWidth;
+    DLog(@"Lines %d-%d are dirty from %d to %d, set rect %@ dirty",
+         rect.origin.y, rect.origin.y + rect.size.height - 1,
+         rect.origin.x, rect.origin.x + rect.size.width - 1,
+         [NSValue valueWithRect:dirtyRect]);
+    [self setNeedsDisplayInRect:dirtyRect];
+}
+
 // WARNING: Do not call this function directly. Call
 // -[refresh] instead, as it ensures scrollback overflow
 // is dealt with so that this function can dereference
@@ -10031,6 +11140,9 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     DebugLog(@"updateDirtyRects called");
 #endif
 
+    // Move pixels for lines the grid scrolled before anything else is invalidated.
+    foundDirty = [self _moveScrollDamagedPixels];
+
     // Check each line for dirty selected text
     // If any is found then deselect everything
     [self _deselectDirtySelectedText];
@@ -10042,7 +11154,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 
     // Any characters that changed selection status since the last update or
     // are blinking should be set dirty.
-    anythingIsBlinking = [self _markChangedSelectionAndBlinkDirty:redrawBlink width:WIDTH];
+    [self _markChangedSelectionAndBlinkDirty:redrawBlink width:WIDTH];
 
     // Copy selection position to detect change in selected chars next call.
     oldStartX = startX;
@@ -10068,17 +11180,20 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     long long totalScrollbackOverflow = [dataSource totalScrollbackOverflow];
     int allDirty = [dataSource isAllDirty] ? 1 : 0;
     [dataSource resetAllDirty];
+    // Range of screen lines found dirty, for the contents change feed.
+    int firstDirtyLine = INT_MAX;
+    int lastDirtyLine = -1;
 
     int currentCursorX = [dataSource cursorX] - 1;
     int currentCursorY = [dataSource cursorY] - 1;
-    if (prevCursorX != currentCursorX ||
-        prevCursorY != currentCursorY) {
-        // Mark previous and current cursor position dirty
+    const BOOL cursorMoved = (prevCursorX != currentCursorX || prevCursorY != currentCursorY);
+    if (cursorMoved) {
+        // Redraw the previous and current cursor position
         DLog(@"Mark previous cursor position %d,%d dirty", prevCursorX, prevCursorY);
         int maxX = [dataSource width] - 1;
-        [dataSource setCharDirtyAtCursorX:MIN(maxX, prevCursorX) Y:prevCursorY];
+        [self _setNeedsDisplayForCursorAtX:MIN(maxX, prevCursorX) y:prevCursorY];
         DLog(@"Mark current cursor position %d,%d dirty", currentCursorX, currentCursorY);
-        [dataSource setCharDirtyAtCursorX:MIN(maxX, currentCursorX) Y:currentCursorY];
+        [self _setNeedsDisplayForCursorAtX:MIN(maxX, currentCursorX) y:currentCursorY];
 
         // Set prevCursor[XY] to new cursor position
         prevCursorX = currentCursorX;
@@ -10088,27 +11203,36 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     // Remove results from dirty lines and mark parts of the view as needing display.
     if (allDirty) {
         foundDirty = YES;
-        for (int y = lineStart; y < lineEnd; y++) {
-            [resultMap_ removeObjectForKey:[NSNumber numberWithLongLong:y + totalScrollbackOverflow]];
-        }
+        [blinkingCellIndex_ setNeedsUpdate];
+        [frameProfiler_ addToCounter:kFrameProfilerCounterDirtyLines amount:lineEnd - lineStart];
+        [self _removeHighlightsFromLine:lineStart + totalScrollbackOverflow
+                                 toLine:lineEnd - 1 + totalScrollbackOverflow];
         [self setNeedsDisplayInRect:[self gridRect]];
 #ifdef DEBUG_DRAWING
         NSLog(@"allDirty is set, redraw the whole view");
 #endif
     } else {
-        for (int y = lineStart; y < lineEnd; y++) {
-            VT100GridRange range = [dataSource dirtyRangeForLine:y - lineStart];
-            if (range.length > 0) {
-                foundDirty = YES;
-                [resultMap_ removeObjectForKey:[NSNumber numberWithLongLong:y + totalScrollbackOverflow]];
-                [self setNeedsDisplayOnLine:y inRange:range];
+        for (NSValue *value in [dataSource dirtyRects]) {
+            VT100GridRect rect = [value gridRectValue];
+            foundDirty = YES;
+            firstDirtyLine = MIN(firstDirtyLine, rect.origin.y);
+            lastDirtyLine = MAX(lastDirtyLine, rect.origin.y + rect.size.height - 1);
+            [frameProfiler_ addToCounter:kFrameProfilerCounterDirtyLines amount:rect.size.height];
+            [self _removeHighlightsFromLine:rect.origin.y + lineStart + totalScrollbackOverflow
+                                     toLine:rect.origin.y + rect.size.height - 1 + lineStart + totalScrollbackOverflow];
+            for (int y = rect.origin.y; y < rect.origin.y + rect.size.height; y++) {
+                [blinkingCellIndex_ setLineDirty:y + lineStart + totalScrollbackOverflow];
+            }
+            rect.origin.y += lineStart;
+            [self setNeedsDisplayInGridRect:rect];
 #ifdef DEBUG_DRAWING
-                NSLog(@"line %d has dirty characters", y);
+            NSLog(@"lines %d-%d have dirty characters", rect.origin.y, rect.origin.y + rect.size.height - 1);
 #endif
-            }
         }
     }
 
+    anythingIsBlinking = [self _textBlinkingAllowed] && [self _isTextBlinking];
+
     // Always mark the IME as needing to be drawn to keep things simple.
     if ([self hasMarkedText]) {
         [self invalidateInputMethodEditorRect];
@@ -10119,15 +11243,26 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 #ifdef DEBUG_DRAWING
     [self appendDebug:dirtyDebug];
 #endif
+    // The DVR only looks at dirty chars, so save before they're reset. It also records the cursor
+    // position, which can change without any.
+    if (irEnabled && (foundDirty || cursorMoved || [dataSource hasPendingDvrFrame])) {
+        [dataSource saveToDvr];
+    }
     [dataSource resetDirty];
 
-    if (irEnabled && foundDirty) {
-        [dataSource saveToDvr];
+    if (foundDirty) {
+        accessibilityValueChanged_ = YES;
     }
 
     if (foundDirty && [dataSource shouldSendContentsChangedNotification]) {
-        changedSinceLastExpose_ = YES;
-        [_delegate textViewPostTabContentsChangedNotification];
+        if (allDirty || lastDirtyLine < 0) {
+            // Everything, or only lines moved by scrolling, which aren't tracked.
+            firstDirtyLine = 0;
+            lastDirtyLine = [dataSource height] - 1;
+        }
+        long long firstAbsLine = firstDirtyLine + lineStart + totalScrollbackOverflow;
+        [_delegate textViewContentsDidChangeInLines:NSMakeRange(firstAbsLine,
+                                                                lastDirtyLine - firstDirtyLine + 1)];
     }
 
     if (foundDirty && gDebugLogging) {
@@ -10135,7 +11270,7 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
         DebugLog([dataSource debugString]);
     }
 
-    return blinkAllowed_ && anythingIsBlinking;
+    return [self _textBlinkingAllowed] && anythingIsBlinking;
 }
 
 - (void)invalidateInputMethodEditorRect
@@ -10329,10 +11464,17 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     int cursorX = [dataSource cursorX] - 1;
     int cursorY = [dataSource cursorY] + [dataSource numberOfLines] - [dataSource height] - 1;
     for (int y = lineStart; y < lineEnd && startX > -1; y++) {
-        for (int x = 0; x < width; x++) {
-            BOOL isSelected = [self _isCharSelectedInRow:y col:x checkOld:NO];
+        VT100GridRange range = [dataSource dirtyRangeForLine:y - lineStart];
+        if (range.length <= 0) {
+            continue;
+        }
+        // Only dirty chars that are also selected matter.
+        VT100GridRange selected = [self _selectedColumnsOnRow:y width:width checkOld:NO];
+        const int minX = MAX(range.location, selected.location);
+        const int maxX = MIN(MIN(width, VT100GridRangeMax(range)), VT100GridRangeMax(selected));
+        for (int x = minX; x < maxX; x++) {
             BOOL isCursor = (x == cursorX && y == cursorY);
-            if ([dataSource isDirtyAtX:x Y:y-lineStart] && isSelected && !isCursor) {
+            if ([dataSource isDirtyAtX:x Y:y-lineStart] && !isCursor) {
                 // Don't call [self deselect] as it would recurse back here
                 startX = -1;
                 [self setSelectionTime];
@@ -10351,7 +11493,8 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
     gettimeofday(&now, NULL);
     double timeDelta = now.tv_sec - lastBlink.tv_sec;
     timeDelta += (now.tv_usec - lastBlink.tv_usec) / 1000000.0;
-    if (timeDelta >= [[PreferencePanel sharedInstance] timeBetweenBlinks]) {
+    if (timeDelta >= [[PreferencePanel sharedInstance] timeBetweenBlinks] &&
+        ![[PowerManager sharedInstance] lowPowerModeEnabled]) {
         blinkShow = !blinkShow;
         lastBlink = now;
         redrawBlink = YES;
@@ -10368,57 +11511,33 @@ static double EuclideanDistance(NSPoint p1, NSPoint p2) {
 
 - (BOOL)_markChangedSelectionAndBlinkDirty:(BOOL)redrawBlink width:(int)width
 {
-    BOOL anyBlinkers = NO;
-    // Visible chars that have changed selection status are dirty
-    // Also mark blinking text as dirty if needed
-    int lineStart = ([self visibleRect].origin.y + VMARGIN) / lineHeight;  // add VMARGIN because stuff under top margin isn't visible.
-    int lineEnd = ceil(([self visibleRect].origin.y + [self visibleRect].size.height - [self excess]) / lineHeight);
-    if (lineStart < 0) {
-        lineStart = 0;
-    }
-    if (lineEnd > [dataSource numberOfLines]) {
-        lineEnd = [dataSource numberOfLines];
-    }
-    if ([self isAnyCharSelected] || [self _wasAnyCharSelected]) {
-        // Mark blinking or selection-changed characters as dirty
-        for (int y = lineStart; y < lineEnd; y++) {
-            screen_char_t* theLine = [dataSource getLineAtIndex:y];
-            for (int x = 0; x < width; x++) {
-                BOOL isSelected = [self _isCharSelectedInRow:y col:x checkOld:NO];
-                BOOL wasSelected = [self _isCharSelectedInRow:y col:x checkOld:YES];
-                BOOL charBlinks = [self _charBlinks:theLine[x]];
-                anyBlinkers |= charBlinks;
-                BOOL blinked = redrawBlink && charBlinks;
-                if (isSelected != wasSelected || blinked) {
-                    NSRect dirtyRect = [self visibleRect];
-                    dirtyRect.origin.y = y*lineHeight;
-                    dirtyRect.size.height = lineHeight;
-                    if (gDebugLogging) {
-                        DebugLog([NSString stringWithFormat:@"found selection change/blink at %d,%d", x, y]);
-                    }
-                    [self setNeedsDisplayInRect:dirtyRect];
-                    break;
-                }
+    // Only the blinking cells themselves need to be redrawn when the blink state flips.
+    BOOL anyBlinkers = [self _textBlinkingAllowed] && [self _isTextBlinking];
+    if (redrawBlink && anyBlinkers) {
+        long long totalScrollbackOverflow = [dataSource totalScrollbackOverflow];
+        for (NSValue *value in [blinkingCellIndex_ blinkingCellRectsWithTotalScrollbackOverflow:totalScrollbackOverflow]) {
+            if (gDebugLogging) {
+                DebugLog([NSString stringWithFormat:@"found blink at %@", value]);
             }
+            [self setNeedsDisplayInGridRect:[value gridRectValue]];
         }
-    } else {
-        // Mark blinking text as dirty
-        for (int y = lineStart; y < lineEnd; y++) {
-            screen_char_t* theLine = [dataSource getLineAtIndex:y];
-            for (int x = 0; x < width; x++) {
-                BOOL charBlinks = [self _charBlinks:theLine[x]];
-                anyBlinkers |= charBlinks;
-                BOOL blinked = redrawBlink && charBlinks;
-                if (blinked) {
-                    NSRect dirtyRect = [self visibleRect];
-                    dirtyRect.origin.y = y*lineHeight;
-                    dirtyRect.size.height = lineHeight;
-                    if (gDebugLogging) {
-                        DebugLog([NSString stringWithFormat:@"found selection change/blink at %d,%d", x, y]);
-                    }
-                    [self setNeedsDisplayInRect:dirtyRect];
-                    break;
+    }
+
+    if ([self isAnyCharSelected] || [self _wasAnyCharSelected]) {
+        // Visible chars that have changed selection status are dirty
+        VT100GridRange lines = [self _visibleLineRange];
+        for (int y = lines.location; y < lines.location + lines.length; y++) {
+            VT100GridRange isSelected = [self _selectedColumnsOnRow:y width:width checkOld:NO];
+            VT100GridRange wasSelected = [self _selectedColumnsOnRow:y width:width checkOld:YES];
+            if (isSelected.location != wasSelected.location ||
+                isSelected.length != wasSelected.length) {
+                NSRect dirtyRect = [self visibleRect];
+                dirtyRect.origin.y = y*lineHeight;
+                dirtyRect.size.height = lineHeight;
+                if (gDebugLogging) {
+                    DebugLog([NSString stringWithFormat:@"found selection change on line %d", y]);
                 }
+                [self setNeedsDisplayInRect:dirtyRect];
             }
         }
     }
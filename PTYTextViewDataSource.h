@@ -35,7 +35,13 @@ typedef enum {
 
 // Provide a buffer as large as sizeof(screen_char_t*) * ([SCREEN width] + 1)
 - (screen_char_t *)getLineAtIndex:(int)theIndex withBuffer:(screen_char_t*)buffer;
+// Like getLineAtIndex:withBuffer:, but scrollback lines aren't copied or padded. Cheaper when
+// a line is only compared or scanned.
+- (ScreenCharLineView)lineViewAtIndex:(int)theIndex;
 - (int)numberOfScrollbackLines;
+// A copy of the scrollback, without the screen, that may be read on another thread. See
+// -[LineBuffer newAppendOnlyCopy].
+- (LineBuffer *)newScrollbackSnapshot;
 - (int)scrollbackOverflow;
 - (void)resetScrollbackOverflow;
 - (long long)totalScrollbackOverflow;
@@ -73,17 +79,30 @@ typedef enum {
 - (BOOL)isDirtyAtX:(int)x Y:(int)y;
 - (void)resetDirty;
 
-// Save the current state to a new frame in the dvr.
+// Save the current state to a new frame in the dvr. Frames may be throttled, in which case the
+// changes are saved with a later frame.
 - (void)saveToDvr;
 
-// If this returns true then the textview will broadcast iTermTabContentsChanged
-// when a dirty char is found.
+// Are there changes that a throttled saveToDvr hasn't recorded yet?
+- (BOOL)hasPendingDvrFrame;
+
+// If this returns true then the textview will tell its delegate which lines changed (for the
+// ContentsChangeFeed) when a dirty char is found.
 - (BOOL)shouldSendContentsChangedNotification;
 
 // Smallest range that contains all dirty chars for a line at a screen location.
 // NOTE: y is a grid index and cannot refer to scrollback history.
 - (VT100GridRange)dirtyRangeForLine:(int)y;
 
+// Coalesced NSValue-wrapped VT100GridRects covering all dirty chars on the screen.
+- (NSArray *)dirtyRects;
+
+// Lines in scrollDamageRect moved down by scrollDamageDistance (up if negative) since the last
+// resetDirty without being marked dirty. The distance is 0 if there is nothing to move.
+- (VT100GridRect)scrollDamageRect;
+- (int)scrollDamageDistance;
+- (void)markScrollDamageDirty;
+
 // Returns the last modified date for a given line.
 - (NSDate *)timestampForLine:(int)y;
 
@@ -95,7 +114,13 @@ typedef enum {
 
 - (VT100GridCoordRange)coordRangeOfNote:(PTYNoteViewController *)note;
 - (NSArray *)charactersWithNotesOnLine:(int)line;
+// Returns one array for each line in |lines|, as from -charactersWithNotesOnLine:. The result is
+// kept until the notes change, so drawing the same lines again doesn't search for them.
+- (NSArray *)charactersWithNotesOnLines:(VT100GridRange)lines;
 - (BOOL)hasMarkOnLine:(int)line;
+// Returns the offset from |lines.location| of each line in |lines| that has a mark. Kept along
+// with the result of -charactersWithNotesOnLines:.
+- (NSIndexSet *)linesWithMarksInRange:(VT100GridRange)lines;
 - (NSString *)workingDirectoryOnLine:(int)line;
 - (SCPPath *)scpPathForFile:(NSString *)filename onLine:(int)line;
 
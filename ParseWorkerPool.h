@@ -0,0 +1,41 @@
+//
+//  ParseWorkerPool.h
+//  iTerm
+//
+//  Threads shared by every session for parsing output, so a hundred sessions don't need a hundred
+//  queues and one busy session doesn't hold up the rest. Each worker has its own deque of jobs. A
+//  worker runs its own jobs oldest first, and when it runs out it steals the newest job from
+//  another worker, so a burst of output that piles up behind one busy job spreads over the idle
+//  workers. A job runs where it was submitted when it can: the worker paired with the
+//  TaskNotifier thread that read the data, or the worker that ran it last. Idle workers sleep, and
+//  a session with nothing to parse has no job queued at all.
+//
+//  The number of workers is the ParseWorkerThreads preference, or half the cores by default.
+//
+
+#import <Foundation/Foundation.h>
+
+@protocol ParseWorkerJob <NSObject>
+
+// Called on a worker thread.
+- (void)runParseWorkerJob;
+
+@end
+
+@interface ParseWorkerPool : NSObject
+
++ (ParseWorkerPool *)sharedInstance;
+
+// Pairs the calling thread with a worker, so jobs it submits go to that worker first. |index| may
+// be larger than the number of workers.
++ (void)setPreferredWorkerForCurrentThread:(int)index;
+
+// Runs |job| once on some worker and retains it until then. A job submitted twice may run on two
+// workers at once, so a job that has to run serially, like a session's parser, must not be
+// submitted again until its last run is over.
+- (void)submitJob:(id<ParseWorkerJob>)job;
+
+// One line per worker with how many jobs it ran and stole.
+- (NSString *)summary;
+
+@end
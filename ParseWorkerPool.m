@@ -0,0 +1,274 @@
+//
+//  ParseWorkerPool.m
+//  iTerm
+//
+
+#import "ParseWorkerPool.h"
+#import "DebugLogging.h"
+#include <libkern/OSAtomic.h>
+#include <pthread.h>
+
+static const int kMaxWorkers = 16;
+
+// Holds the preferred worker's index plus one, so that 0 means none.
+static pthread_key_t gPreferredWorkerKey;
+
+@class ParseWorker;
+
+@interface ParseWorkerPool ()
+- (id<ParseWorkerJob>)stealJobForWorker:(ParseWorker *)thief;
+@end
+
+@interface ParseWorker : NSObject {
+    int index_;
+    ParseWorkerPool *pool_;  // Not retained; the pool lives forever.
+
+    // Guards jobs_.
+    OSSpinLock lock_;
+    NSMutableArray *jobs_;  // Oldest first.
+
+    // Guards wakeRequested_. The worker sleeps on it when there's nothing to run or steal.
+    NSCondition *condition_;
+    BOOL wakeRequested_;
+    volatile BOOL idle_;
+
+    // Statistics.
+    volatile int64_t numRun_;
+    volatile int64_t numStolen_;
+}
+
+@property(nonatomic, readonly) int index;
+@property(nonatomic, readonly) BOOL idle;
+
+- (id)initWithIndex:(int)index pool:(ParseWorkerPool *)pool;
+- (void)addJob:(id<ParseWorkerJob>)job;
+- (id<ParseWorkerJob>)stealJob;
+- (void)wake;
+- (void)run;
+- (NSString *)summary;
+
+@end
+
+@implementation ParseWorker
+
+@synthesize index = index_;
+@synthesize idle = idle_;
+
+- (id)initWithIndex:(int)index pool:(ParseWorkerPool *)pool
+{
+    self = [super init];
+    if (self) {
+        index_ = index;
+        pool_ = pool;
+        lock_ = OS_SPINLOCK_INIT;
+        jobs_ = [[NSMutableArray alloc] init];
+        condition_ = [[NSCondition alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [jobs_ release];
+    [condition_ release];
+    [super dealloc];
+}
+
+- (void)addJob:(id<ParseWorkerJob>)job
+{
+    OSSpinLockLock(&lock_);
+    [jobs_ addObject:job];
+    OSSpinLockUnlock(&lock_);
+}
+
+// Returns a retained job, or nil.
+- (id<ParseWorkerJob>)popJob
+{
+    id<ParseWorkerJob> job = nil;
+    OSSpinLockLock(&lock_);
+    if ([jobs_ count]) {
+        job = [[jobs_ objectAtIndex:0] retain];
+        [jobs_ removeObjectAtIndex:0];
+    }
+    OSSpinLockUnlock(&lock_);
+    return job;
+}
+
+// Takes the newest job, which the owner would have reached last. Returns a retained job, or nil.
+- (id<ParseWorkerJob>)stealJob
+{
+    id<ParseWorkerJob> job = nil;
+    OSSpinLockLock(&lock_);
+    if ([jobs_ count]) {
+        job = [[jobs_ lastObject] retain];
+        [jobs_ removeLastObject];
+    }
+    OSSpinLockUnlock(&lock_);
+    return job;
+}
+
+- (void)wake
+{
+    [condition_ lock];
+    wakeRequested_ = YES;
+    [condition_ signal];
+    [condition_ unlock];
+}
+
+- (void)run
+{
+    NSAutoreleasePool *outerPool = [[NSAutoreleasePool alloc] init];
+    [[NSThread currentThread] setName:[NSString stringWithFormat:@"Parse worker %d", index_]];
+    pthread_setspecific(gPreferredWorkerKey, (void *)(intptr_t)(index_ + 1));
+    [outerPool drain];
+
+    for (;;) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        id<ParseWorkerJob> job = [self popJob];
+        if (!job) {
+            job = [pool_ stealJobForWorker:self];
+            if (job) {
+                OSAtomicIncrement64(&numStolen_);
+            }
+        }
+        if (job) {
+            [job runParseWorkerJob];
+            [job release];
+            OSAtomicIncrement64(&numRun_);
+        } else {
+            // A job submitted after the checks above sets wakeRequested_ first, so it's never
+            // slept through.
+            [condition_ lock];
+            idle_ = YES;
+            while (!wakeRequested_) {
+                [condition_ wait];
+            }
+            wakeRequested_ = NO;
+            idle_ = NO;
+            [condition_ unlock];
+        }
+        [pool drain];
+    }
+}
+
+- (NSString *)summary
+{
+    OSSpinLockLock(&lock_);
+    const int queued = [jobs_ count];
+    OSSpinLockUnlock(&lock_);
+    return [NSString stringWithFormat:@"Parse worker %d: %d queued, %lld run, %lld stolen%@",
+               index_, queued, numRun_, numStolen_, idle_ ? @", idle" : @""];
+}
+
+@end
+
+@implementation ParseWorkerPool {
+    NSArray *workers_;
+    volatile int32_t nextWorker_;  // Round robin for threads that aren't paired with a worker.
+}
+
++ (ParseWorkerPool *)sharedInstance
+{
+    static id instance;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        pthread_key_create(&gPreferredWorkerKey, NULL);
+        instance = [[self alloc] init];
+    });
+    return instance;
+}
+
++ (void)setPreferredWorkerForCurrentThread:(int)index
+{
+    // Makes sure the key exists.
+    [self sharedInstance];
+    pthread_setspecific(gPreferredWorkerKey, (void *)(intptr_t)(index + 1));
+}
+
+// The ParseWorkerThreads preference, or half the cores if it isn't set.
++ (int)numberOfWorkers
+{
+    NSInteger count = [[NSUserDefaults standardUserDefaults] integerForKey:@"ParseWorkerThreads"];
+    if (count <= 0) {
+        count = [[NSProcessInfo processInfo] activeProcessorCount] / 2;
+    }
+    return MAX(1, MIN(kMaxWorkers, count));
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        const int numWorkers = [ParseWorkerPool numberOfWorkers];
+        NSMutableArray *workers = [NSMutableArray arrayWithCapacity:numWorkers];
+        for (int i = 0; i < numWorkers; i++) {
+            [workers addObject:[[[ParseWorker alloc] initWithIndex:i pool:self] autorelease]];
+        }
+        workers_ = [workers copy];
+        DLog(@"Starting %d parse workers", numWorkers);
+        for (ParseWorker *worker in workers_) {
+            [NSThread detachNewThreadSelector:@selector(run)
+                                     toTarget:worker
+                                   withObject:nil];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [workers_ release];
+    [super dealloc];
+}
+
+- (void)submitJob:(id<ParseWorkerJob>)job
+{
+    const int count = [workers_ count];
+    const intptr_t preferred = (intptr_t)pthread_getspecific(gPreferredWorkerKey);
+    int index;
+    if (preferred > 0) {
+        index = (preferred - 1) % count;
+    } else {
+        index = (OSAtomicIncrement32(&nextWorker_) & INT32_MAX) % count;
+    }
+    ParseWorker *worker = [workers_ objectAtIndex:index];
+    const BOOL wasIdle = worker.idle;
+    [worker addJob:job];
+    [worker wake];
+    if (wasIdle) {
+        return;
+    }
+
+    // The worker is busy, so let an idle one steal the job if the worker doesn't get to it first.
+    for (int i = 1; i < count; i++) {
+        ParseWorker *other = [workers_ objectAtIndex:(index + i) % count];
+        if (other.idle) {
+            [other wake];
+            return;
+        }
+    }
+}
+
+- (id<ParseWorkerJob>)stealJobForWorker:(ParseWorker *)thief
+{
+    const int count = [workers_ count];
+    for (int i = 1; i < count; i++) {
+        ParseWorker *victim = [workers_ objectAtIndex:(thief.index + i) % count];
+        id<ParseWorkerJob> job = [victim stealJob];
+        if (job) {
+            return job;
+        }
+    }
+    return nil;
+}
+
+- (NSString *)summary
+{
+    NSMutableArray *lines = [NSMutableArray arrayWithCapacity:[workers_ count]];
+    for (ParseWorker *worker in workers_) {
+        [lines addObject:[worker summary]];
+    }
+    return [lines componentsJoinedByString:@"\n"];
+}
+
+@end
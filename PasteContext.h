@@ -13,6 +13,10 @@
     int bytesPerCall_;
     NSString *delayBetweenCallsKey_;
     float delayBetweenCalls_;
+
+    // For measuring how fast the program reading the paste consumes it.
+    NSTimeInterval startTime_;
+    NSUInteger bytesSent_;
 }
 
 - (id)initWithBytesPerCallPrefKey:(NSString*)bytesPerCallKey
@@ -26,4 +30,14 @@
 - (void)setDelayBetweenCalls:(float)newDelayBetweenCalls;
 - (void)updateValues;
 
+// YES if the user has set either pref, which asks for pacing at that rate instead of as fast as
+// the program takes it.
+- (BOOL)hasCustomRate;
+
+// Call after each write of pasted bytes to the task.
+- (void)didSendBytes:(NSUInteger)length;
+
+// Bytes per second consumed since the first write, or 0 if it's too soon to tell.
+- (double)measuredRate;
+
 @end
@@ -35,6 +35,28 @@
     }
 }
 
+- (BOOL)hasCustomRate {
+    NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+    return ([defaults objectForKey:bytesPerCallKey_] != nil ||
+            [defaults objectForKey:delayBetweenCallsKey_] != nil);
+}
+
+- (void)didSendBytes:(NSUInteger)length {
+    if (!bytesSent_) {
+        startTime_ = [NSDate timeIntervalSinceReferenceDate];
+    }
+    bytesSent_ += length;
+}
+
+- (double)measuredRate {
+    const NSTimeInterval kMinimumMeasurementTime = 0.25;
+    NSTimeInterval elapsed = [NSDate timeIntervalSinceReferenceDate] - startTime_;
+    if (!bytesSent_ || elapsed < kMinimumMeasurementTime) {
+        return 0;
+    }
+    return bytesSent_ / elapsed;
+}
+
 - (int)bytesPerCall {
     return bytesPerCall_;
 }
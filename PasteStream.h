@@ -0,0 +1,44 @@
+//
+//  PasteStream.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+// The bytes of a paste in progress, made from the pasted strings a chunk at a time as the paste
+// engine asks for them instead of converting everything up front. Each chunk goes through the
+// same stages a paste always has, in order: shell characters are escaped if asked for, newlines
+// become carriage returns (CRLF becoming a single CR), the text is encoded lossily, and control
+// codes other than newline, tab and form feed are removed. Only a chunk's worth of bytes is held
+// beyond the strings themselves, so the first bytes can be sent right away however big the paste.
+@interface PasteStream : NSObject {
+    NSStringEncoding encoding_;
+
+    // Strings not yet fully converted, with NSNumbers saying whether to escape each one.
+    NSMutableArray *strings_;
+    NSMutableArray *escapes_;
+    NSUInteger offset_;  // Characters of the first string already converted.
+    NSUInteger unconvertedLength_;  // Characters left in all of strings_.
+    BOOL previousWasCR_;
+
+    // Converted bytes not yet read. Bytes before bufferOffset_ have been read.
+    NSMutableData *buffer_;
+    NSUInteger bufferOffset_;
+}
+
+- (id)initWithEncoding:(NSStringEncoding)encoding;
+
+// Adds |string| to the end of what remains to be read.
+- (void)appendString:(NSString *)string escapingShellCharacters:(BOOL)escape;
+
+// Returns up to |maxLength| of the next bytes, or empty data when there are no more.
+- (NSData *)readDataOfMaxLength:(NSUInteger)maxLength;
+
+// Bytes left to read. Text not converted yet is counted as a byte per character, so this is an
+// estimate that is exact for ASCII.
+- (NSUInteger)remainingLength;
+
+// Bytes held by the strings and buffered output.
+- (NSUInteger)memoryUsage;
+
+@end
@@ -0,0 +1,170 @@
+//
+//  PasteStream.m
+//  iTerm
+//
+
+#import "PasteStream.h"
+
+// Characters converted at a time.
+static const NSUInteger kPasteStreamChunkLength = 64 * 1024;
+
+// Prefixes \ to each char that's special to the shell. |output| must have room for twice |length|.
+static NSUInteger PasteStreamEscapeShellCharacters(const unichar *input,
+                                                   NSUInteger length,
+                                                   unichar *output) {
+    static const char kCharsToEscape[] = "\\ ()\"&'!$<>;|*?[]#`";
+    NSUInteger o = 0;
+    for (NSUInteger i = 0; i < length; i++) {
+        if (input[i] < 128 && input[i] && strchr(kCharsToEscape, input[i])) {
+            output[o++] = '\\';
+        }
+        output[o++] = input[i];
+    }
+    return o;
+}
+
+// Turns CRLF and LF into CR in place, like -stringWithLinefeedNewlines. |*previousWasCR| carries
+// the state across chunks.
+static NSUInteger PasteStreamConvertNewlines(unichar *chars, NSUInteger length, BOOL *previousWasCR) {
+    NSUInteger o = 0;
+    BOOL wasCR = *previousWasCR;
+    for (NSUInteger i = 0; i < length; i++) {
+        const unichar c = chars[i];
+        if (c == '\n') {
+            if (!wasCR) {
+                chars[o++] = '\r';
+            }
+        } else {
+            chars[o++] = c;
+        }
+        wasCR = (c == '\r');
+    }
+    *previousWasCR = wasCR;
+    return o;
+}
+
+// Removes control codes other than newline, tab and form feed from the end of |data|, starting at
+// |start|.
+static void PasteStreamRemoveControlCodes(NSMutableData *data, NSUInteger start) {
+    unsigned char *p = [data mutableBytes];
+    const NSUInteger length = [data length];
+    NSUInteger o = start;
+    for (NSUInteger i = start; i < length; i++) {
+        if (p[i] >= ' ' || p[i] == '\n' || p[i] == '\r' || p[i] == '\t' || p[i] == 12) {
+            p[o++] = p[i];
+        }
+    }
+    [data setLength:o];
+}
+
+@implementation PasteStream
+
+- (id)initWithEncoding:(NSStringEncoding)encoding
+{
+    self = [super init];
+    if (self) {
+        encoding_ = encoding;
+        strings_ = [[NSMutableArray alloc] init];
+        escapes_ = [[NSMutableArray alloc] init];
+        buffer_ = [[NSMutableData alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [strings_ release];
+    [escapes_ release];
+    [buffer_ release];
+    [super dealloc];
+}
+
+- (void)appendString:(NSString *)string escapingShellCharacters:(BOOL)escape
+{
+    if (![string length]) {
+        return;
+    }
+    [strings_ addObject:[[string copy] autorelease]];
+    [escapes_ addObject:[NSNumber numberWithBool:escape]];
+    unconvertedLength_ += [string length];
+}
+
+- (NSData *)readDataOfMaxLength:(NSUInteger)maxLength
+{
+    while ([buffer_ length] - bufferOffset_ < maxLength && [strings_ count]) {
+        [self _convertChunk];
+    }
+    const NSUInteger length = MIN(maxLength, [buffer_ length] - bufferOffset_);
+    NSData *data = [NSData dataWithBytes:(const char *)[buffer_ bytes] + bufferOffset_
+                                  length:length];
+    bufferOffset_ += length;
+    if (bufferOffset_ == [buffer_ length]) {
+        [buffer_ setLength:0];
+        bufferOffset_ = 0;
+    } else if (bufferOffset_ > kPasteStreamChunkLength) {
+        // Drop what's been read so the buffer doesn't grow with the paste.
+        [buffer_ replaceBytesInRange:NSMakeRange(0, bufferOffset_) withBytes:NULL length:0];
+        bufferOffset_ = 0;
+    }
+    return data;
+}
+
+- (NSUInteger)remainingLength
+{
+    return [buffer_ length] - bufferOffset_ + unconvertedLength_;
+}
+
+- (NSUInteger)memoryUsage
+{
+    NSUInteger bytes = [buffer_ length];
+    for (NSString *string in strings_) {
+        bytes += [string length] * sizeof(unichar);
+    }
+    return bytes;
+}
+
+#pragma mark - Private
+
+// Runs the next chunk of the first string through the stages and appends it to buffer_.
+- (void)_convertChunk
+{
+    NSString *string = [strings_ objectAtIndex:0];
+    const BOOL escape = [[escapes_ objectAtIndex:0] boolValue];
+    const NSUInteger stringLength = [string length];
+    NSRange range = NSMakeRange(offset_, MIN(kPasteStreamChunkLength, stringLength - offset_));
+    if (NSMaxRange(range) < stringLength) {
+        // Don't split a surrogate pair or a composed character between chunks.
+        range = [string rangeOfComposedCharacterSequencesForRange:range];
+    }
+
+    unichar *chars = malloc(MAX(1, range.length) * sizeof(unichar) * (escape ? 3 : 1));
+    [string getCharacters:chars range:range];
+    NSUInteger length = range.length;
+    if (escape) {
+        unichar *escaped = chars + range.length;
+        length = PasteStreamEscapeShellCharacters(chars, length, escaped);
+        memmove(chars, escaped, length * sizeof(unichar));
+    }
+    length = PasteStreamConvertNewlines(chars, length, &previousWasCR_);
+
+    NSString *chunk = [[NSString alloc] initWithCharactersNoCopy:chars
+                                                          length:length
+                                                    freeWhenDone:YES];
+    NSData *encoded = [chunk dataUsingEncoding:encoding_ allowLossyConversion:YES];
+    const NSUInteger start = [buffer_ length];
+    [buffer_ appendData:encoded];
+    PasteStreamRemoveControlCodes(buffer_, start);
+    [chunk release];
+
+    offset_ = NSMaxRange(range);
+    unconvertedLength_ -= range.length;
+    if (offset_ == stringLength) {
+        // Each string's newlines are converted on their own.
+        [strings_ removeObjectAtIndex:0];
+        [escapes_ removeObjectAtIndex:0];
+        offset_ = 0;
+        previousWasCR_ = NO;
+    }
+}
+
+@end
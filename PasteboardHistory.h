@@ -46,10 +46,18 @@
 
 @end
 
+// The history is saved in a log that each copied value is appended to in the background, and
+// it's read the first time the entries are needed. Saving the same value again moves it to the end.
 @interface PasteboardHistory : NSObject {
     NSMutableArray* entries_;
+    // Value -> entry in entries_.
+    NSMutableDictionary *entriesByValue_;
     int maxEntries_;
-    NSString* path_;
+    NSString* path_;  // History saved by older versions
+    NSString *logPath_;
+    dispatch_queue_t queue_;  // Writes the log
+    BOOL loaded_;
+    int numLogRecords_;  // Since the log was last rewritten. Only known once loaded.
 }
 
 + (PasteboardHistory*)sharedInstance;
@@ -64,6 +72,7 @@
 // Erases in-memory history but not persistent copy.
 - (void)clear;
 
+- (void)_loadHistoryIfNeeded;
 - (void)_loadHistoryFromDisk;
 - (void)_writeHistoryToDisk;
 
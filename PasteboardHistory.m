@@ -32,11 +32,24 @@
 #import "PopupModel.h"
 #import "PreferencePanel.h"
 #import "iTermController.h"
+#include <fcntl.h>
+#include <unistd.h>
 
+// Keys of the history saved by older versions, which is read once and replaced by the log.
 #define PBHKEY_ENTRIES @"Entries"
 #define PBHKEY_VALUE @"Value"
 #define PBHKEY_TIMESTAMP @"Timestamp"
 
+// The log is a sequence of records, each a header followed by the UTF-8 value.
+typedef struct {
+    uint32_t length;
+    NSTimeInterval timestamp;  // since the reference date
+} PasteboardHistoryLogRecordHeader;
+
+// The log is rewritten with just the current entries once it has this many records or twice the
+// maximum number of entries, whichever is more.
+static const int kPasteboardHistoryMinRecordsToCompact = 64;
+
 @implementation PasteboardEntry
 
 + (PasteboardEntry*)entryWithString:(NSString *)s score:(double)score
@@ -90,43 +103,35 @@
     if (self) {
         maxEntries_ = maxEntries;
         entries_ = [[NSMutableArray alloc] init];
+        entriesByValue_ = [[NSMutableDictionary alloc] init];
 
-
-        path_ = [NSSearchPathForDirectoriesInDomains(NSApplicationSupportDirectory, NSUserDomainMask, YES) lastObject];
+        NSString *directory = [NSSearchPathForDirectoriesInDomains(NSApplicationSupportDirectory, NSUserDomainMask, YES) lastObject];
         NSString *appname = [[NSBundle mainBundle] objectForInfoDictionaryKey:(NSString *)kCFBundleNameKey];
-        path_ = [path_ stringByAppendingPathComponent:appname];
-        [[NSFileManager defaultManager] createDirectoryAtPath:path_ withIntermediateDirectories:YES attributes:nil error:NULL];
-        path_ = [[path_ stringByAppendingPathComponent:@"pbhistory.plist"] copyWithZone:[self zone]];
-
-        [self _loadHistoryFromDisk];
+        directory = [directory stringByAppendingPathComponent:appname];
+        [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:NULL];
+        path_ = [[directory stringByAppendingPathComponent:@"pbhistory.plist"] copy];
+        logPath_ = [[directory stringByAppendingPathComponent:@"pbhistory.log"] copy];
+        queue_ = dispatch_queue_create("com.googlecode.iterm2.paste-history", DISPATCH_QUEUE_SERIAL);
     }
     return self;
 }
 
 - (void)dealloc
 {
+    dispatch_release(queue_);
     [path_ release];
+    [logPath_ release];
     [entries_ release];
+    [entriesByValue_ release];
     [super dealloc];
 }
 
 - (NSArray*)entries
 {
+    [self _loadHistoryIfNeeded];
     return entries_;
 }
 
-- (NSDictionary*)_entriesToDict
-{
-    NSMutableArray* a = [[[NSMutableArray alloc] init] autorelease];
-
-    for (PasteboardEntry* entry in entries_) {
-        [a addObject:[NSDictionary dictionaryWithObjectsAndKeys:[entry mainValue], PBHKEY_VALUE,
-                      [NSNumber numberWithDouble:[entry->timestamp timeIntervalSinceReferenceDate]], PBHKEY_TIMESTAMP,
-                      nil]];
-    }
-    return [NSDictionary dictionaryWithObject:a forKey:PBHKEY_ENTRIES];
-}
-
 - (void)_addDictToEntries:(NSDictionary*)dict
 {
     NSArray* a = [dict objectForKey:PBHKEY_ENTRIES];
@@ -135,46 +140,157 @@
         PasteboardEntry* entry = [PasteboardEntry entryWithString:[d objectForKey:PBHKEY_VALUE] score:timestamp];
         entry->timestamp = [[NSDate alloc] initWithTimeIntervalSinceReferenceDate:timestamp];
         [entries_ addObject:entry];
+        [entriesByValue_ setObject:entry forKey:[entry mainValue]];
     }
 }
 
 - (void)clear
 {
+    // Don't bring back the saved history later.
+    loaded_ = YES;
     [entries_ removeAllObjects];
+    [entriesByValue_ removeAllObjects];
 }
 
 - (void)eraseHistory
 {
-    [[NSFileManager defaultManager] removeItemAtPath:path_ error:NULL];
+    numLogRecords_ = 0;
+    NSString *path = path_;
+    NSString *logPath = logPath_;
+    dispatch_async(queue_, ^{
+        [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+        [[NSFileManager defaultManager] removeItemAtPath:logPath error:NULL];
+    });
 }
 
+// Appends a log record for |value|.
+static void PasteboardHistoryAppendRecord(NSMutableData *data, NSString *value, NSTimeInterval timestamp) {
+    NSData *utf8 = [value dataUsingEncoding:NSUTF8StringEncoding];
+    PasteboardHistoryLogRecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.length = (uint32_t)[utf8 length];
+    header.timestamp = timestamp;
+    [data appendBytes:&header length:sizeof(header)];
+    [data appendData:utf8];
+}
+
+// Replaces the log with one record for each entry, which is all it takes to load them again.
 - (void)_writeHistoryToDisk
 {
-    if ([[PreferencePanel sharedInstance] savePasteHistory]) {
-        [NSKeyedArchiver archiveRootObject:[self _entriesToDict] toFile:path_];
+    if (![[PreferencePanel sharedInstance] savePasteHistory]) {
+        return;
+    }
+    NSMutableData *data = [NSMutableData data];
+    for (PasteboardEntry *entry in entries_) {
+        PasteboardHistoryAppendRecord(data, [entry mainValue], [entry->timestamp timeIntervalSinceReferenceDate]);
     }
+    numLogRecords_ = [entries_ count];
+    NSString *path = path_;
+    NSString *logPath = logPath_;
+    dispatch_async(queue_, ^{
+        [data writeToFile:logPath atomically:YES];
+        // The log supersedes the history saved by older versions.
+        [[NSFileManager defaultManager] removeItemAtPath:path error:NULL];
+    });
 }
 
-- (void)_loadHistoryFromDisk
+- (void)_appendToLog:(NSString *)value timestamp:(NSTimeInterval)timestamp
 {
-    [entries_ removeAllObjects];
-    [self _addDictToEntries:[NSKeyedUnarchiver unarchiveObjectWithFile:path_]];
+    if (![[PreferencePanel sharedInstance] savePasteHistory]) {
+        return;
+    }
+    if (loaded_ && numLogRecords_ >= MAX(kPasteboardHistoryMinRecordsToCompact, maxEntries_ * 2)) {
+        // The entry was already added, so this writes its record too.
+        [self _writeHistoryToDisk];
+        return;
+    }
+    NSMutableData *data = [NSMutableData data];
+    PasteboardHistoryAppendRecord(data, value, timestamp);
+    numLogRecords_++;
+    NSString *logPath = logPath_;
+    dispatch_async(queue_, ^{
+        int fd = open([logPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_APPEND, 0600);
+        if (fd < 0) {
+            return;
+        }
+        NSUInteger offset = 0;
+        while (offset < [data length]) {
+            ssize_t written = write(fd, (const char *)[data bytes] + offset, [data length] - offset);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                break;
+            }
+            offset += written;
+        }
+        close(fd);
+    });
 }
 
-- (void)save:(NSString*)value
+- (void)_loadHistoryIfNeeded
 {
-    value = [value stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
-    if (![value length]) {
-        return;
+    if (!loaded_) {
+        loaded_ = YES;
+        [self _loadHistoryFromDisk];
     }
+}
 
-    // Remove existing duplicate value.
-    for (int i = 0; i < [entries_ count]; ++i) {
-        PasteboardEntry* entry = [entries_ objectAtIndex:i];
-        if ([[entry mainValue] isEqualToString:value]) {
-            [entries_ removeObjectAtIndex:i];
+- (void)_loadHistoryFromDisk
+{
+    [entries_ removeAllObjects];
+    [entriesByValue_ removeAllObjects];
+
+    // Wait for pending writes.
+    __block NSData *log = nil;
+    NSString *logPath = logPath_;
+    dispatch_sync(queue_, ^{
+        log = [[NSData alloc] initWithContentsOfFile:logPath
+                                             options:NSDataReadingMappedIfSafe
+                                               error:NULL];
+    });
+
+    // History saved by older versions comes before anything in the log.
+    BOOL hadPlist = [[NSFileManager defaultManager] fileExistsAtPath:path_];
+    if (hadPlist) {
+        [self _addDictToEntries:[NSKeyedUnarchiver unarchiveObjectWithFile:path_]];
+    }
+
+    // A truncated last record is ignored.
+    numLogRecords_ = 0;
+    const char *bytes = [log bytes];
+    NSUInteger offset = 0;
+    while (offset + sizeof(PasteboardHistoryLogRecordHeader) <= [log length]) {
+        PasteboardHistoryLogRecordHeader header;
+        memcpy(&header, bytes + offset, sizeof(header));
+        offset += sizeof(header);
+        if (offset + header.length > [log length]) {
             break;
         }
+        NSString *value = [[[NSString alloc] initWithBytes:bytes + offset
+                                                    length:header.length
+                                                  encoding:NSUTF8StringEncoding] autorelease];
+        offset += header.length;
+        numLogRecords_++;
+        if (value) {
+            [self _addValue:value timestamp:header.timestamp score:header.timestamp];
+        }
+    }
+    [log release];
+
+    if (hadPlist || numLogRecords_ >= MAX(kPasteboardHistoryMinRecordsToCompact, maxEntries_ * 2)) {
+        [self _writeHistoryToDisk];
+    }
+}
+
+// Adds an entry for |value| as the most recent one, removing an older one with the same value.
+- (void)_addValue:(NSString *)value timestamp:(NSTimeInterval)timestamp score:(double)score
+{
+    // Remove existing duplicate value.
+    PasteboardEntry *duplicate = [entriesByValue_ objectForKey:value];
+    if (duplicate) {
+        [entries_ removeObjectIdenticalTo:duplicate];
+        [entriesByValue_ removeObjectForKey:value];
     }
 
     // If the last value is a prefix of this value then remove it. This prevents
@@ -184,19 +300,37 @@
     if ([entries_ count] > 0) {
         lastEntry = [entries_ objectAtIndex:[entries_ count] - 1];
         if ([value hasPrefix:[lastEntry mainValue]]) {
+            [entriesByValue_ removeObjectForKey:[lastEntry mainValue]];
             [entries_ removeObjectAtIndex:[entries_ count] - 1];
         }
     }
 
     // Append this value.
-    PasteboardEntry* entry = [PasteboardEntry entryWithString:value score:[[NSDate date] timeIntervalSince1970]];
-    entry->timestamp = [[NSDate alloc] init];
+    PasteboardEntry* entry = [PasteboardEntry entryWithString:value score:score];
+    entry->timestamp = [[NSDate alloc] initWithTimeIntervalSinceReferenceDate:timestamp];
     [entries_ addObject:entry];
+    [entriesByValue_ setObject:entry forKey:value];
     if ([entries_ count] > maxEntries_) {
+        [entriesByValue_ removeObjectForKey:[[entries_ objectAtIndex:0] mainValue]];
         [entries_ removeObjectAtIndex:0];
     }
+}
 
-    [self _writeHistoryToDisk];
+- (void)save:(NSString*)value
+{
+    value = [value stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+    if (![value length]) {
+        return;
+    }
+
+    // Until the history is first needed, a saved value only goes in the log, which is replayed
+    // when loading.
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    if (loaded_ || ![[PreferencePanel sharedInstance] savePasteHistory]) {
+        [self _loadHistoryIfNeeded];
+        [self _addValue:value timestamp:now score:[[NSDate date] timeIntervalSince1970]];
+    }
+    [self _appendToLog:value timestamp:now];
 
     [[NSNotificationCenter defaultCenter] postNotificationName:kPasteboardHistoryDidChange
                                                         object:self];
@@ -39,6 +39,11 @@
     
     // True while reloading data.
     BOOL reloading_;
+
+    // The filter model_ was made with and the unfilteredModel_ generation at the time. When the
+    // filter is only extended, what didn't match before still won't, so just model_ is refiltered.
+    NSString* modelFilter_;
+    NSUInteger modelGeneration_;
 }
 
 - (id)initWithWindowNibName:(NSString*)nibName tablePtr:(NSTableView**)table model:(PopupModel*)model;
@@ -63,6 +68,7 @@
     [selectionMainValue_ release];
     [unfilteredModel_ release];
     [substring_ release];
+    [modelFilter_ release];
     [model_ release];
     [tableView_ release];
     [super dealloc];
@@ -126,13 +132,26 @@
 
 - (void)reloadData:(BOOL)canChangeSide
 {
-    [model_ removeAllObjects];
     [unfilteredModel_ sortByScore];
-    for (PopupEntry* s in unfilteredModel_) {
-        if ([self _word:[s mainValue] matchesFilter:substring_]) {
-            [model_ addObject:s];
+    if (modelFilter_ &&
+        modelGeneration_ == [unfilteredModel_ generation] &&
+        [substring_ hasPrefix:modelFilter_]) {
+        if (![substring_ isEqualToString:modelFilter_]) {
+            [model_ keepObjectsPassingTest:^BOOL(PopupEntry *entry) {
+                return [self _word:[entry mainValue] matchesFilter:substring_];
+            }];
+        }
+    } else {
+        [model_ removeAllObjects];
+        for (PopupEntry* s in unfilteredModel_) {
+            if ([self _word:[s mainValue] matchesFilter:substring_]) {
+                [model_ addObject:s];
+            }
         }
     }
+    [modelFilter_ release];
+    modelFilter_ = [substring_ copy];
+    modelGeneration_ = [unfilteredModel_ generation];
     BOOL oldReloading = reloading_;
     reloading_ = YES;
     [tableView_ reloadData];
@@ -334,15 +353,20 @@
 
 - (BOOL)_word:(NSString*)temp matchesFilter:(NSString*)filter
 {
+    // Search the rest of |temp| in place rather than making a substring for each char.
+    const NSUInteger length = [temp length];
+    NSUInteger start = 0;
     for (int i = 0; i < [filter length]; ++i) {
         unichar wantChar = [filter characterAtIndex:i];
-        NSRange r = [temp rangeOfString:[NSString stringWithCharacters:&wantChar length:1] options:NSCaseInsensitiveSearch];
+        NSString* want = [[NSString alloc] initWithCharacters:&wantChar length:1];
+        NSRange r = [temp rangeOfString:want
+                                options:NSCaseInsensitiveSearch
+                                  range:NSMakeRange(start, length - start)];
+        [want release];
         if (r.location == NSNotFound) {
             return NO;
         }
-        r.length = [temp length] - r.location - 1;
-        ++r.location;
-        temp = [temp substringWithRange:r];
+        start = r.location + 1;
     }
     return YES;
 }
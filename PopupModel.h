@@ -22,7 +22,12 @@
 - (id)objectAtIndex:(NSUInteger)index;
 - (NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(id *)stackbuf count:(NSUInteger)len;
 - (NSUInteger)indexOfObject:(id)o;
+// Does nothing if the entries haven't changed since they were last sorted.
 - (void)sortByScore;
 - (int)indexOfObjectWithMainValue:(NSString*)value;
+// Removes entries for which |block| returns NO, keeping the rest in order.
+- (void)keepObjectsPassingTest:(BOOL (^)(PopupEntry *entry))block;
+// Changes whenever an entry is added or removed or a score changes.
+- (NSUInteger)generation;
 
 @end
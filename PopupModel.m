@@ -15,6 +15,14 @@
 @implementation PopupModel {
     NSMutableArray* values_;
     int maxEntries_;
+
+    // Maps main value to the first entry having it. Built on the first call to -addHit:, since
+    // models that are only added to don't need it.
+    NSMutableDictionary* entriesByValue_;
+
+    // True if values_ is known to be in descending order by score.
+    BOOL sorted_;
+    NSUInteger generation_;
 }
 
 - (id)init
@@ -23,6 +31,7 @@
     if (self) {
         maxEntries_ = -1;
         values_ = [[NSMutableArray alloc] init];
+        sorted_ = YES;
     }
     return self;
 }
@@ -33,6 +42,7 @@
     if (self) {
         maxEntries_ = maxEntries;
         values_ = [[NSMutableArray alloc] init];
+        sorted_ = YES;
     }
     return self;
 }
@@ -40,6 +50,7 @@
 - (void)dealloc
 {
     [values_ release];
+    [entriesByValue_ release];
     [super dealloc];
 }
 
@@ -51,21 +62,32 @@
 - (void)removeAllObjects
 {
     [values_ removeAllObjects];
+    [entriesByValue_ removeAllObjects];
+    sorted_ = YES;
+    generation_++;
 }
 
 - (void)addObject:(id)object
 {
     [values_ addObject:object];
+    if (entriesByValue_ && ![entriesByValue_ objectForKey:[object mainValue]]) {
+        [entriesByValue_ setObject:object forKey:[object mainValue]];
+    }
+    sorted_ = NO;
+    generation_++;
 }
 
 - (PopupEntry*)entryEqualTo:(PopupEntry*)entry
 {
-    for (PopupEntry* candidate in values_) {
-        if ([candidate isEqual:entry]) {
-            return candidate;
+    if (!entriesByValue_) {
+        entriesByValue_ = [[NSMutableDictionary alloc] initWithCapacity:[values_ count]];
+        for (PopupEntry* candidate in values_) {
+            if (![entriesByValue_ objectForKey:[candidate mainValue]]) {
+                [entriesByValue_ setObject:candidate forKey:[candidate mainValue]];
+            }
         }
     }
-    return nil;
+    return [entriesByValue_ objectForKey:[entry mainValue]];
 }
 
 - (void)addHit:(PopupEntry*)object
@@ -73,6 +95,8 @@
     PopupEntry* entry = [self entryEqualTo:object];
     if (entry) {
         [entry setScore:[entry score] + [object score] * [entry advanceHitMult]];
+        sorted_ = NO;
+        generation_++;
         PopLog(@"Add additional hit for %@ bringing score to %lf", [entry mainValue], [entry score]);
     } else if (maxEntries_ < 0 || [self count] < maxEntries_) {
         [self addObject:object];
@@ -99,14 +123,23 @@
 
 - (void)sortByScore
 {
-    NSSortDescriptor *sortDescriptor;
-    sortDescriptor = [[[NSSortDescriptor alloc] initWithKey:@"score"
-                                                  ascending:NO] autorelease];
-    NSArray *sortDescriptors = [NSArray arrayWithObject:sortDescriptor];
-    NSArray *sortedArray;
-    sortedArray = [values_ sortedArrayUsingDescriptors:sortDescriptors];
-    [values_ release];
-    values_ = [[NSMutableArray arrayWithArray:sortedArray] retain];
+    if (sorted_) {
+        return;
+    }
+    // Stable, so entries with equal scores keep the order they were added in.
+    [values_ sortWithOptions:NSSortStable
+             usingComparator:^NSComparisonResult(id a, id b) {
+                 double scoreA = [a score];
+                 double scoreB = [b score];
+                 if (scoreA > scoreB) {
+                     return NSOrderedAscending;
+                 } else if (scoreA < scoreB) {
+                     return NSOrderedDescending;
+                 } else {
+                     return NSOrderedSame;
+                 }
+             }];
+    sorted_ = YES;
 }
 
 - (int)indexOfObjectWithMainValue:(NSString*)value
@@ -120,4 +153,22 @@
     return -1;
 }
 
+- (void)keepObjectsPassingTest:(BOOL (^)(PopupEntry *entry))block
+{
+    NSIndexSet *failures = [values_ indexesOfObjectsPassingTest:^BOOL(id obj, NSUInteger idx, BOOL *stop) {
+        return !block(obj);
+    }];
+    if ([failures count]) {
+        [values_ removeObjectsAtIndexes:failures];
+        [entriesByValue_ release];
+        entriesByValue_ = nil;
+        generation_++;
+    }
+}
+
+- (NSUInteger)generation
+{
+    return generation_;
+}
+
 @end
@@ -0,0 +1,49 @@
+//
+//  PowerManager.h
+//  iTerm
+//
+//  Decides when to trade smoothness for battery life.
+//
+
+#import <Foundation/Foundation.h>
+
+// Posted when -lowPowerModeEnabled changes.
+extern NSString *const kPowerManagerLowPowerModeDidChangeNotification;
+
+typedef enum {
+    kLowPowerModeAutomatic = 0,  // On while running on battery.
+    kLowPowerModeAlways = 1,
+    kLowPowerModeNever = 2
+} LowPowerModeSetting;
+
+// Low power mode is chosen by the hidden LowPowerMode preference, a LowPowerModeSetting. While it's
+// on:
+//   - Sessions are drawn at most LowPowerModeMaxFPS (15) times a second, or
+//     LowPowerModeBackgroundMaxFPS (5) times when their window isn't key.
+//   - Cursors and text don't blink.
+//   - Instant replay doesn't record.
+//   - Output to sessions that can't be seen is handled in batches every
+//     LowPowerModeHiddenOutputInterval (1) seconds.
+// Main thread only.
+@interface PowerManager : NSObject {
+    CFRunLoopSourceRef runLoopSource_;
+    LowPowerModeSetting setting_;
+    BOOL onBattery_;
+    BOOL lowPowerModeEnabled_;
+    double maxFramesPerSecond_;
+    double backgroundMaxFramesPerSecond_;
+    NSTimeInterval hiddenOutputInterval_;
+}
+
+@property(nonatomic, readonly) BOOL onBattery;
+@property(nonatomic, readonly) BOOL lowPowerModeEnabled;
+
+// Seconds between batches of output for a session that can't be seen, or 0 not to batch it.
+@property(nonatomic, readonly) NSTimeInterval hiddenOutputInterval;
+
++ (PowerManager *)sharedInstance;
+
+// The most times a second a session should be drawn, or 0 if there's no limit.
+- (double)maximumFramesPerSecondInKeyWindow:(BOOL)keyWindow;
+
+@end
@@ -0,0 +1,134 @@
+//
+//  PowerManager.m
+//  iTerm
+//
+
+#import "PowerManager.h"
+#import "DebugLogging.h"
+#import <IOKit/ps/IOPowerSources.h>
+#import <IOKit/ps/IOPSKeys.h>
+
+NSString *const kPowerManagerLowPowerModeDidChangeNotification =
+    @"kPowerManagerLowPowerModeDidChangeNotification";
+
+static const double kDefaultMaxFramesPerSecond = 15;
+static const double kDefaultBackgroundMaxFramesPerSecond = 5;
+static const NSTimeInterval kDefaultHiddenOutputInterval = 1;
+
+@interface PowerManager ()
+- (void)powerSourcesDidChange;
+@end
+
+static void PowerSourcesDidChange(void *context)
+{
+    [(PowerManager *)context powerSourcesDidChange];
+}
+
+static double DoubleFromUserDefaults(NSString *key, double defaultValue)
+{
+    NSNumber *value = [[NSUserDefaults standardUserDefaults] objectForKey:key];
+    return value ? [value doubleValue] : defaultValue;
+}
+
+@implementation PowerManager
+
+@synthesize onBattery = onBattery_;
+@synthesize lowPowerModeEnabled = lowPowerModeEnabled_;
+
++ (PowerManager *)sharedInstance
+{
+    static PowerManager *instance;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        instance = [[PowerManager alloc] init];
+    });
+    return instance;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+        setting_ = (LowPowerModeSetting)[defaults integerForKey:@"LowPowerMode"];
+        maxFramesPerSecond_ = DoubleFromUserDefaults(@"LowPowerModeMaxFPS",
+                                                     kDefaultMaxFramesPerSecond);
+        backgroundMaxFramesPerSecond_ = DoubleFromUserDefaults(@"LowPowerModeBackgroundMaxFPS",
+                                                               kDefaultBackgroundMaxFramesPerSecond);
+        hiddenOutputInterval_ = DoubleFromUserDefaults(@"LowPowerModeHiddenOutputInterval",
+                                                       kDefaultHiddenOutputInterval);
+
+        // Nothing to watch if the setting doesn't depend on the power source.
+        if (setting_ == kLowPowerModeAutomatic) {
+            runLoopSource_ = IOPSNotificationCreateRunLoopSource(PowerSourcesDidChange, self);
+            if (runLoopSource_) {
+                CFRunLoopAddSource(CFRunLoopGetMain(), runLoopSource_, kCFRunLoopDefaultMode);
+            }
+        }
+        onBattery_ = [self isOnBattery];
+        lowPowerModeEnabled_ = [self shouldEnableLowPowerMode];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    if (runLoopSource_) {
+        CFRunLoopRemoveSource(CFRunLoopGetMain(), runLoopSource_, kCFRunLoopDefaultMode);
+        CFRelease(runLoopSource_);
+    }
+    [super dealloc];
+}
+
+- (BOOL)isOnBattery
+{
+    CFTypeRef info = IOPSCopyPowerSourcesInfo();
+    if (!info) {
+        return NO;
+    }
+    CFStringRef type = IOPSGetProvidingPowerSourceType(info);
+    const BOOL result = (type && CFStringCompare(type, CFSTR(kIOPSBatteryPowerValue), 0) == kCFCompareEqualTo);
+    CFRelease(info);
+    return result;
+}
+
+- (BOOL)shouldEnableLowPowerMode
+{
+    switch (setting_) {
+        case kLowPowerModeAlways:
+            return YES;
+        case kLowPowerModeNever:
+            return NO;
+        case kLowPowerModeAutomatic:
+            break;
+    }
+    return onBattery_;
+}
+
+- (void)powerSourcesDidChange
+{
+    onBattery_ = [self isOnBattery];
+    const BOOL enabled = [self shouldEnableLowPowerMode];
+    if (enabled != lowPowerModeEnabled_) {
+        DLog(@"Low power mode %@", enabled ? @"on" : @"off");
+        lowPowerModeEnabled_ = enabled;
+        [[NSNotificationCenter defaultCenter]
+            postNotificationName:kPowerManagerLowPowerModeDidChangeNotification
+                          object:self];
+    }
+}
+
+- (NSTimeInterval)hiddenOutputInterval
+{
+    return lowPowerModeEnabled_ ? hiddenOutputInterval_ : 0;
+}
+
+- (double)maximumFramesPerSecondInKeyWindow:(BOOL)keyWindow
+{
+    if (!lowPowerModeEnabled_) {
+        return 0;
+    }
+    return keyWindow ? maxFramesPerSecond_ : backgroundMaxFramesPerSecond_;
+}
+
+@end
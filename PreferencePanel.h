@@ -58,6 +58,9 @@
 #define OPEN_TMUX_WINDOWS_IN_WINDOWS 0
 #define OPEN_TMUX_WINDOWS_IN_TABS 1
 
+// Posted when modifier remapping or the modifiers that switch tabs and windows may have changed.
+extern NSString *const kPreferencePanelKeyboardSettingsDidChangeNotification;
+
 @class iTermController;
 @class TriggerController;
 @class SmartSelectionController;
@@ -584,6 +587,22 @@
     IBOutlet NSButton* globalAddNewMapping;
 
     IBOutlet WindowArrangements *arrangements_;
+
+    // Settings with no UI. They're asked for often (e.g., on each step of the hotkey window's
+    // animation and each time tabs are laid out) so they're read once and then again only when
+    // user defaults change.
+    BOOL defaultUseUnevenTabs;
+    int defaultMinTabWidth;
+    int defaultMinCompactTabWidth;
+    int defaultOptimumTabWidth;
+    BOOL defaultTraditionalVisualBell;
+    float defaultHotkeyTermAnimationDuration;
+    NSString *defaultSearchCommand;
+    BOOL defaultDockIconTogglesWindow;
+
+    // Profile edits waiting to be applied to sessions and written to user defaults.
+    BOOL sessionUpdatePending_;
+    BOOL profileSavePending_;
 }
 
 void LoadPrefsFromCustomFolder(void);
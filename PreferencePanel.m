@@ -51,6 +51,11 @@ static NSString * const kCustomColorPresetsKey = @"Custom Color Presets";
 static NSString * const kHotkeyWindowGeneratedProfileNameKey = @"Hotkey Window";
 static NSString * const kDeleteKeyString = @"0x7f-0x0";
 static NSString * const kRebuildColorPresetsMenuNotification = @"kRebuildColorPresetsMenuNotification";
+NSString *const kPreferencePanelKeyboardSettingsDidChangeNotification =
+    @"kPreferencePanelKeyboardSettingsDidChangeNotification";
+
+// Profile edits are written to user defaults at most this often.
+static const NSTimeInterval kProfileSaveDelay = 0.5;
 
 @implementation PreferencePanel
 
@@ -161,6 +166,16 @@ static NSString * const kRebuildColorPresetsMenuNotification = @"kRebuildColorPr
                                                  selector:@selector(rebuildColorPresetsMenu)
                                                      name:kRebuildColorPresetsMenuNotification
                                                    object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(_applicationWillTerminate:)
+                                                     name:NSApplicationWillTerminateNotification
+                                                   object:nil];
+        if (prefs) {
+            [[NSNotificationCenter defaultCenter] addObserver:self
+                                                     selector:@selector(_userDefaultsDidChange:)
+                                                         name:NSUserDefaultsDidChangeNotification
+                                                       object:prefs];
+        }
         oneBookmarkMode = obMode;
     }
     return self;
@@ -406,6 +421,7 @@ static NSString * const kRebuildColorPresetsMenuNotification = @"kRebuildColorPr
 
 - (void)windowWillClose:(NSNotification *)aNotification
 {
+    [self _flushProfileChanges];
     [self settingChanged:nil];
     [self savePreferences];
 }
@@ -636,6 +652,8 @@ static NSString * const kRebuildColorPresetsMenuNotification = @"kRebuildColorPr
         ([self isAnyModifierRemapped] && ![[HotkeyWindowController sharedInstance] haveEventTap])) {
         [[HotkeyWindowController sharedInstance] beginRemappingModifiers];
     }
+    [[NSNotificationCenter defaultCenter] postNotificationName:kPreferencePanelKeyboardSettingsDidChangeNotification
+                                                        object:nil];
 
     int rowIndex = [globalKeyMappings selectedRow];
     if (rowIndex >= 0) {
@@ -1029,17 +1047,64 @@ static NSString * const kRebuildColorPresetsMenuNotification = @"kRebuildColorPr
     // Selectively update form fields.
     [self updateShortcutTitles];
 
-    // Update existing sessions
-    int n = [[iTermController sharedInstance] numberOfTerminals];
-    for (int i = 0; i < n; ++i) {
-        PseudoTerminal* pty = [[iTermController sharedInstance] terminalAtIndex:i];
-        [pty reloadBookmarks];
+    [self _scheduleProfileChanges];
+}
+
+// Sliders and text fields send an action for every step of a drag or every keystroke. Sessions are
+// updated once per pass through the run loop and the profiles are saved after a short delay,
+// however many changes were made in the meantime.
+- (void)_scheduleProfileChanges
+{
+    if (!sessionUpdatePending_) {
+        sessionUpdatePending_ = YES;
+        [self performSelector:@selector(_updateSessionsWithChangedProfiles)
+                   withObject:nil
+                   afterDelay:0];
     }
-    if (prefs) {
-        [prefs setObject:[dataSource rawData] forKey: @"New Bookmarks"];
+    if (!profileSavePending_ && prefs) {
+        profileSavePending_ = YES;
+        [self performSelector:@selector(_saveChangedProfiles)
+                   withObject:nil
+                   afterDelay:kProfileSaveDelay];
     }
 }
 
+- (void)_updateSessionsWithChangedProfiles
+{
+    if (!sessionUpdatePending_) {
+        return;
+    }
+    sessionUpdatePending_ = NO;
+    [NSObject cancelPreviousPerformRequestsWithTarget:self
+                                             selector:@selector(_updateSessionsWithChangedProfiles)
+                                               object:nil];
+    // Only sessions whose profile differs from their copy of it are updated.
+    [[iTermController sharedInstance] reloadAllBookmarks];
+}
+
+- (void)_saveChangedProfiles
+{
+    if (!profileSavePending_) {
+        return;
+    }
+    profileSavePending_ = NO;
+    [NSObject cancelPreviousPerformRequestsWithTarget:self
+                                             selector:@selector(_saveChangedProfiles)
+                                               object:nil];
+    [prefs setObject:[dataSource rawData] forKey: @"New Bookmarks"];
+}
+
+- (void)_flushProfileChanges
+{
+    [self _updateSessionsWithChangedProfiles];
+    [self _saveChangedProfiles];
+}
+
+- (void)_applicationWillTerminate:(NSNotification *)notification
+{
+    [self _flushProfileChanges];
+}
+
 - (void)connectBookmarkWithGuid:(NSString*)guid toScheme:(NSString*)scheme
 {
     NSURL *appURL = nil;
@@ -2518,6 +2583,9 @@ static NSString * const kRebuildColorPresetsMenuNotification = @"kRebuildColorPr
     }
     defaultSwitchTabModifier = [prefs objectForKey:@"SwitchTabModifier"] ? [[prefs objectForKey:@"SwitchTabModifier"] intValue] : MOD_TAG_ANY_COMMAND;
     defaultSwitchWindowModifier = [prefs objectForKey:@"SwitchWindowModifier"] ? [[prefs objectForKey:@"SwitchWindowModifier"] intValue] : MOD_TAG_CMD_OPT;
+    [[NSNotificationCenter defaultCenter] postNotificationName:kPreferencePanelKeyboardSettingsDidChangeNotification
+                                                        object:nil];
+    [self _readHiddenPreferences];
 
     NSString *appCast = defaultCheckTestRelease ?
         [[NSBundle mainBundle] objectForInfoDictionaryKey:@"SUFeedURLForTesting"] :
@@ -2566,6 +2634,7 @@ static NSString * const kRebuildColorPresetsMenuNotification = @"kRebuildColorPr
 
 - (void)savePreferences
 {
+    [self _flushProfileChanges];
     if (!prefs) {
         // In one-bookmark mode there are no prefs but this function doesn't
         // affect bookmarks.
@@ -3422,43 +3491,43 @@ static NSString * const kRebuildColorPresetsMenuNotification = @"kRebuildColorPr
 - (BOOL)useUnevenTabs
 {
     assert(prefs);
-    return [prefs objectForKey:@"UseUnevenTabs"] ? [[prefs objectForKey:@"UseUnevenTabs"] boolValue] : NO;
+    return defaultUseUnevenTabs;
 }
 
 - (int) minTabWidth
 {
     assert(prefs);
-    return [prefs objectForKey:@"MinTabWidth"] ? [[prefs objectForKey:@"MinTabWidth"] intValue] : 75;
+    return defaultMinTabWidth;
 }
 
 - (int) minCompactTabWidth
 {
     assert(prefs);
-    return [prefs objectForKey:@"MinCompactTabWidth"] ? [[prefs objectForKey:@"MinCompactTabWidth"] intValue] : 60;
+    return defaultMinCompactTabWidth;
 }
 
 - (int) optimumTabWidth
 {
     assert(prefs);
-    return [prefs objectForKey:@"OptimumTabWidth"] ? [[prefs objectForKey:@"OptimumTabWidth"] intValue] : 175;
+    return defaultOptimumTabWidth;
 }
 
 - (BOOL) traditionalVisualBell
 {
     assert(prefs);
-    return [prefs objectForKey:@"TraditionalVisualBell"] ? [[prefs objectForKey:@"TraditionalVisualBell"] boolValue] : NO;
+    return defaultTraditionalVisualBell;
 }
 
 - (float) hotkeyTermAnimationDuration
 {
     assert(prefs);
-    return [prefs objectForKey:@"HotkeyTermAnimationDuration"] ? [[prefs objectForKey:@"HotkeyTermAnimationDuration"] floatValue] : 0.25;
+    return defaultHotkeyTermAnimationDuration;
 }
 
 - (NSString *) searchCommand
 {
     assert(prefs);
-    return [prefs objectForKey:@"SearchCommand"] ? [prefs objectForKey:@"SearchCommand"] : @"http://google.com/search?q=%@";
+    return defaultSearchCommand;
 }
 
 - (BOOL)hotkeyTogglesWindow
@@ -3469,7 +3538,26 @@ static NSString * const kRebuildColorPresetsMenuNotification = @"kRebuildColorPr
 - (BOOL)dockIconTogglesWindow
 {
     assert(prefs);
-    return [prefs boolForKey:@"dockIconTogglesWindow"];
+    return defaultDockIconTogglesWindow;
+}
+
+- (void)_readHiddenPreferences
+{
+    defaultUseUnevenTabs = [prefs objectForKey:@"UseUnevenTabs"] ? [[prefs objectForKey:@"UseUnevenTabs"] boolValue] : NO;
+    defaultMinTabWidth = [prefs objectForKey:@"MinTabWidth"] ? [[prefs objectForKey:@"MinTabWidth"] intValue] : 75;
+    defaultMinCompactTabWidth = [prefs objectForKey:@"MinCompactTabWidth"] ? [[prefs objectForKey:@"MinCompactTabWidth"] intValue] : 60;
+    defaultOptimumTabWidth = [prefs objectForKey:@"OptimumTabWidth"] ? [[prefs objectForKey:@"OptimumTabWidth"] intValue] : 175;
+    defaultTraditionalVisualBell = [prefs objectForKey:@"TraditionalVisualBell"] ? [[prefs objectForKey:@"TraditionalVisualBell"] boolValue] : NO;
+    defaultHotkeyTermAnimationDuration = [prefs objectForKey:@"HotkeyTermAnimationDuration"] ? [[prefs objectForKey:@"HotkeyTermAnimationDuration"] floatValue] : 0.25;
+    NSString *searchCommand = [prefs objectForKey:@"SearchCommand"];
+    [defaultSearchCommand release];
+    defaultSearchCommand = [(searchCommand ? searchCommand : @"http://google.com/search?q=%@") copy];
+    defaultDockIconTogglesWindow = [prefs boolForKey:@"dockIconTogglesWindow"];
+}
+
+- (void)_userDefaultsDidChange:(NSNotification *)notification
+{
+    [self _readHiddenPreferences];
 }
 
 - (NSTimeInterval)timeBetweenBlinks
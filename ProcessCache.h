@@ -8,8 +8,8 @@
  **
  **  Project: iTerm2
  **
- **  Description: Keeps an ancestorPid->foregroundJobName map and refreshes it
- **               in a separate thread.
+ **  Description: Keeps a rootPid->foregroundJobName map for the pids of
+ **               sessions' tasks and refreshes it in a separate thread.
  **
  **  This program is free software; you can redistribute it and/or modify
  **  it under the terms of the GNU General Public License as published by
@@ -29,22 +29,63 @@
 
 #import <Cocoa/Cocoa.h>
 
-extern NSString *PID_INFO_IS_FOREGROUND;
-extern NSString *PID_INFO_NAME;
+// An immutable picture of the tracked process trees. ProcessCache's thread makes a new one each
+// time a tree changes, with a larger version, so a consumer can remember the version it last used
+// and skip its work until the version changes. Lookups are constant time. Roots that aren't
+// tracked, or whose tree hasn't been scanned yet, have no children, job, or names.
+@interface ProcessTreeSnapshot : NSObject {
+    long long version_;
+    NSDictionary *trees_;  // Root pid -> ProcessTree
+}
+
+@property(nonatomic, readonly) long long version;
+
+// Name of the foreground job in |root|'s tree, or nil.
+- (NSString *)jobNameForRoot:(pid_t)root;
+
+// Pids of the processes under |root|, not counting it, in ascending order.
+- (NSArray *)descendantsOfRoot:(pid_t)root;
 
+// |pid| must be |root| or one of its descendants.
+- (NSString *)nameOfPid:(pid_t)pid inTreeOfRoot:(pid_t)root;
+- (pid_t)parentOfPid:(pid_t)pid inTreeOfRoot:(pid_t)root;
+
+// The child of |root| that started first, or -1 if it has none.
+- (pid_t)oldestChildOfRoot:(pid_t)root;
+
+@end
+
+// Only the process trees under tracked pids are watched. A kqueue reports forks, execs, and exits
+// in them, and only the tree an event came from is rescanned. Output in a session also rescans its
+// tree (at most every half second) since a change of foreground job makes no event.
 @interface ProcessCache : NSObject {
-    NSMutableDictionary* pidInfoCache_;
-    BOOL newOutput_;
-    NSLock* lock_;
+    // Guarded by @synchronized ([ProcessCache class]).
+    ProcessTreeSnapshot *snapshot_;
+    NSMutableSet *roots_;
+    NSMutableSet *rootsNeedingRescan_;
+
+    // Only accessed on the cache's thread.
+    int kq_;
+    NSMutableDictionary *trackedParents_;  // Pid watched by the kqueue -> parent pid (0 for roots)
+    NSMutableDictionary *trees_;  // Root pid -> ProcessTree
+    long long version_;
 }
 
 + (ProcessCache*)sharedInstance;
-- (NSSet *)childrenOfPid:(pid_t)thePid levelsToSkip:(int)skip;
+
+// The latest snapshot. Cheap to call.
+- (ProcessTreeSnapshot *)snapshot;
+
+// Starts or stops keeping the foreground job name of a task's process tree.
+- (void)trackPid:(pid_t)pid;
+- (void)untrackPid:(pid_t)pid;
+
 - (NSString*)getNameOfPid:(pid_t)thePid isForeground:(BOOL*)isForeground;
-- (NSDictionary *)dictionaryOfTaskInfoForPid:(pid_t)thePid;
 
-// Get the name of the foreground job owned by pid.
+// Get the name of the foreground job owned by pid, which must be tracked.
 - (NSString*)jobNameWithPid:(int)pid;
-- (void)notifyNewOutput;
+
+// Call when the task with a tracked pid produces output.
+- (void)notifyNewOutputForPid:(pid_t)pid;
 
 @end
@@ -67,12 +67,103 @@
 #import "ProcessCache.h"
 #import "iTerm.h"
 #include <libproc.h>
+#include <sys/event.h>
 #include <sys/sysctl.h>
 
 // Singleton of this class.
 static ProcessCache* instance;
-NSString *PID_INFO_IS_FOREGROUND = @"foreground";
-NSString *PID_INFO_NAME = @"name";
+
+// One tracked root's tree, as of its last scan. Immutable once made.
+@interface ProcessTree : NSObject {
+@public
+    NSString *jobName;
+    NSArray *descendants;  // Sorted NSNumbers, not including the root
+    NSDictionary *names;  // Pid -> name, including the root
+    NSDictionary *parents;  // Pid -> parent pid, not including the root
+    pid_t oldestChild;
+}
+@end
+
+@implementation ProcessTree
+
+- (void)dealloc
+{
+    [jobName release];
+    [descendants release];
+    [names release];
+    [parents release];
+    [super dealloc];
+}
+
+- (BOOL)isEqualToTree:(ProcessTree *)other
+{
+    if (!other) {
+        return NO;
+    }
+    return ((jobName == other->jobName || [jobName isEqualToString:other->jobName]) &&
+            oldestChild == other->oldestChild &&
+            [names isEqualToDictionary:other->names] &&
+            [parents isEqualToDictionary:other->parents]);
+}
+
+@end
+
+@implementation ProcessTreeSnapshot
+
+@synthesize version = version_;
+
+- (id)initWithVersion:(long long)version trees:(NSDictionary *)trees
+{
+    self = [super init];
+    if (self) {
+        version_ = version;
+        trees_ = [trees copy];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [trees_ release];
+    [super dealloc];
+}
+
+- (ProcessTree *)_treeForRoot:(pid_t)root
+{
+    return [trees_ objectForKey:[NSNumber numberWithInt:root]];
+}
+
+- (NSString *)jobNameForRoot:(pid_t)root
+{
+    ProcessTree *tree = [self _treeForRoot:root];
+    return tree ? tree->jobName : nil;
+}
+
+- (NSArray *)descendantsOfRoot:(pid_t)root
+{
+    ProcessTree *tree = [self _treeForRoot:root];
+    return tree ? tree->descendants : [NSArray array];
+}
+
+- (NSString *)nameOfPid:(pid_t)pid inTreeOfRoot:(pid_t)root
+{
+    ProcessTree *tree = [self _treeForRoot:root];
+    return tree ? [tree->names objectForKey:[NSNumber numberWithInt:pid]] : nil;
+}
+
+- (pid_t)parentOfPid:(pid_t)pid inTreeOfRoot:(pid_t)root
+{
+    ProcessTree *tree = [self _treeForRoot:root];
+    return tree ? [[tree->parents objectForKey:[NSNumber numberWithInt:pid]] intValue] : 0;
+}
+
+- (pid_t)oldestChildOfRoot:(pid_t)root
+{
+    ProcessTree *tree = [self _treeForRoot:root];
+    return tree ? tree->oldestChild : -1;
+}
+
+@end
 
 @implementation ProcessCache
 
@@ -90,7 +181,16 @@ NSString *PID_INFO_NAME = @"name";
 {
     self = [super init];
     if (self) {
-        pidInfoCache_ = [[NSMutableDictionary alloc] init];
+        snapshot_ = [[ProcessTreeSnapshot alloc] initWithVersion:0
+                                                           trees:[NSDictionary dictionary]];
+        roots_ = [[NSMutableSet alloc] init];
+        rootsNeedingRescan_ = [[NSMutableSet alloc] init];
+        trackedParents_ = [[NSMutableDictionary alloc] init];
+        trees_ = [[NSMutableDictionary alloc] init];
+        kq_ = kqueue();
+        struct kevent kev;
+        EV_SET(&kev, 0, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        kevent(kq_, &kev, 1, NULL, 0, NULL);
     }
     return self;
 }
@@ -110,6 +210,14 @@ NSString *PID_INFO_NAME = @"name";
 // If a + occurs in the STAT column then it is considered to be a foreground
 // job.
 - (NSString*)getNameOfPid:(pid_t)thePid isForeground:(BOOL*)isForeground
+{
+    return [self _getNameOfPid:thePid isForeground:isForeground startTime:NULL];
+}
+
+// Also gets the process's start time in microseconds if |startTime| isn't NULL.
+- (NSString*)_getNameOfPid:(pid_t)thePid
+              isForeground:(BOOL*)isForeground
+                 startTime:(long long *)startTime
 {
     int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, thePid };
     struct kinfo_proc kp;
@@ -128,6 +236,10 @@ NSString *PID_INFO_NAME = @"name";
         *isForeground = ((kp.kp_proc.p_flag & P_CONTROLT) &&
                          kp.kp_eproc.e_pgid == kp.kp_eproc.e_tpgid);
     }
+    if (startTime) {
+        *startTime = ((long long)kp.kp_proc.p_starttime.tv_sec * 1000000 +
+                      kp.kp_proc.p_starttime.tv_usec);
+    }
     
     if (kp.kp_proc.p_comm[0]) {
         return [NSString stringWithUTF8String:kp.kp_proc.p_comm];
@@ -136,237 +248,259 @@ NSString *PID_INFO_NAME = @"name";
     }
 }
 
-+ (NSArray *)allPids
+// Returns the pids whose parent is |ppid|.
++ (NSArray *)childPidsOfPid:(pid_t)ppid
 {
     int numBytes;
     @synchronized ([ProcessCache class]) {
-        numBytes = proc_listpids(PROC_ALL_PIDS, 0, NULL, 0);
+        numBytes = proc_listpids(PROC_PPID_ONLY, ppid, NULL, 0);
     }
     if (numBytes <= 0) {
         return nil;
     }
-    
-    // Put all the pids of running jobs in the pids array.
+
+    // Leave room for children forked since the size was found.
+    numBytes += 16 * sizeof(int);
     int* pids = (int*) malloc(numBytes);
     @synchronized ([ProcessCache class]) {
-        numBytes = proc_listpids(PROC_ALL_PIDS, 0, pids, numBytes);
-    }
-    if (numBytes <= 0) {
-        free(pids);
-        return nil;
+        numBytes = proc_listpids(PROC_PPID_ONLY, ppid, pids, numBytes);
     }
-    
-    int numPids = numBytes / sizeof(int);
-
     NSMutableArray *pidsArray = [NSMutableArray array];
-    for (int i = 0; i < numPids; ++i) {
-        [pidsArray addObject:[NSNumber numberWithInt:pids[i]]];
+    for (int i = 0; i < numBytes / (int)sizeof(int); ++i) {
+        if (pids[i]) {
+            [pidsArray addObject:[NSNumber numberWithInt:pids[i]]];
+        }
     }
-    
     free(pids);
-    
     return pidsArray;
 }
 
-// Returns 0 on failure. Not reliable before OS 10.7.
-+ (pid_t)ppidForPid:(pid_t)thePid
+- (void)trackPid:(pid_t)pid
 {
-    struct proc_bsdshortinfo taskShortInfo;
-    memset(&taskShortInfo, 0, sizeof(taskShortInfo));
-    int rc;
+    NSNumber *n = [NSNumber numberWithInt:pid];
     @synchronized ([ProcessCache class]) {
-      rc = proc_pidinfo(thePid,
-                        PROC_PIDT_SHORTBSDINFO,
-                        0,
-                        &taskShortInfo,
-                        sizeof(taskShortInfo));
-    }
-    if (rc <= 0) {
-      return 0;
-    } else {
-      return taskShortInfo.pbsi_ppid;
+        [roots_ addObject:n];
+        [rootsNeedingRescan_ addObject:n];
     }
+    [self _wake];
 }
 
-- (NSDictionary *)dictionaryOfTaskInfoForPid:(pid_t)thePid
+- (void)untrackPid:(pid_t)pid
 {
-    BOOL isForeground = NO;
-    NSString* name = [self getNameOfPid:thePid isForeground:&isForeground];
-    return [NSDictionary dictionaryWithObjectsAndKeys:
-            [NSNumber numberWithBool:isForeground], PID_INFO_IS_FOREGROUND,
-            name, PID_INFO_NAME,
-            nil];
+    NSNumber *n = [NSNumber numberWithInt:pid];
+    @synchronized ([ProcessCache class]) {
+        [roots_ removeObject:n];
+        [rootsNeedingRescan_ removeObject:n];
+    }
+    [self _wake];
 }
 
-+ (void)augmentClosure:(NSMutableSet *)closure
-              withTree:(NSDictionary *)tree
-                atNode:(NSNumber *)node
-                  skip:(int)skip
+- (void)notifyNewOutputForPid:(pid_t)pid
 {
-    if (skip <= 0) {
-        [closure addObject:node];
-    }
-    NSSet *children = [tree objectForKey:node];
-    if (children) {
-        for (NSNumber *n in children) {
-            if (![closure containsObject:n]) {
-                [ProcessCache augmentClosure:closure withTree:tree atNode:n skip:skip-1];
-            }
+    NSNumber *n = [NSNumber numberWithInt:pid];
+    @synchronized ([ProcessCache class]) {
+        if ([roots_ containsObject:n]) {
+            [rootsNeedingRescan_ addObject:n];
         }
     }
 }
 
-- (NSSet *)childrenOfPid:(pid_t)thePid levelsToSkip:(int)skip
+// Makes the cache's thread look at roots now instead of when its wait times out.
+- (void)_wake
 {
-    NSArray *allPids = [ProcessCache allPids];
-    NSMutableDictionary *parentage = [NSMutableDictionary dictionary];
-    
-    // parentage maps ppid -> {pid, pid, ...}
-    for (NSNumber *n in allPids) {
-        pid_t parentPid = [ProcessCache ppidForPid:[n intValue]];
-        if (parentPid) {
-            NSNumber *ppid = [NSNumber numberWithInt:parentPid];
-            NSMutableSet *children = [parentage objectForKey:ppid];
-            if (!children) {
-                children = [NSMutableSet set];
-                [parentage setObject:children forKey:ppid];
-            }
-            [children addObject:n];
-        }
-    }
-    
-    // Return the transitive closure of children of thePid.
-    NSMutableSet *closure = [NSMutableSet set];
-    NSNumber *n = [NSNumber numberWithInt:thePid];
-    [ProcessCache augmentClosure:closure
-                        withTree:parentage
-                          atNode:n
-                            skip:skip+1];
-    return closure;
+    struct kevent kev;
+    EV_SET(&kev, 0, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    kevent(kq_, &kev, 1, NULL, 0, NULL);
 }
 
-// Constructs a map of pid -> name of tty controller where pid is the tty
-// controller or any ancestor of the tty controller.
-- (void)_refreshProcessCache:(NSMutableDictionary*)cache
-{    
-    [cache removeAllObjects];
-    // Add a mapping to 'temp' of pid->job name for all foreground jobs.
-    // Add a mapping to 'ancestry' of of pid->ppid for all pid's.
-    
-    NSArray *allPids = [ProcessCache allPids];
-    int numPids = [allPids count];
-    
-    NSMutableDictionary* temp = [NSMutableDictionary dictionaryWithCapacity:numPids];
-    NSMutableDictionary* ancestry = [NSMutableDictionary dictionaryWithCapacity:numPids];
-    for (NSNumber *n in allPids) {
-        pid_t thePid = [n intValue];
-
-        pid_t ppid = [ProcessCache ppidForPid:thePid];
-        if (!ppid) {
-            continue;
-        }
+// Starts getting events for |pid|. Returns NO if it's already gone.
+- (BOOL)_watchPid:(NSNumber *)pid parent:(NSNumber *)parent
+{
+    if ([trackedParents_ objectForKey:pid]) {
+        return YES;
+    }
+    struct kevent kev;
+    EV_SET(&kev,
+           [pid intValue],
+           EVFILT_PROC,
+           EV_ADD | EV_CLEAR,
+           NOTE_FORK | NOTE_EXEC | NOTE_EXIT,
+           0,
+           NULL);
+    if (kevent(kq_, &kev, 1, NULL, 0, NULL) < 0) {
+        return NO;
+    }
+    [trackedParents_ setObject:parent forKey:pid];
+    return YES;
+}
 
-        BOOL isForeground;
-        NSString* name = [self getNameOfPid:thePid isForeground:&isForeground];
-        if (isForeground && name != nil) {
-            [temp setObject:name forKey:[NSNumber numberWithInt:thePid]];
+// Returns the root whose tree |pid| is in, or nil.
+- (NSNumber *)_rootOfPid:(NSNumber *)pid roots:(NSSet *)roots
+{
+    // The limit guards against a cycle in case a pid is reused while still in trackedParents_.
+    for (int i = 0; i < 1000 && pid; i++) {
+        if ([roots containsObject:pid]) {
+            return pid;
         }
-        [ancestry setObject:[NSNumber numberWithInt:ppid] forKey:n];
+        pid = [trackedParents_ objectForKey:pid];
     }
+    return nil;
+}
 
-    // For each pid in 'temp', follow the parent pid chain in 'ancestry' and add a map of
-    // ancestorPid->job name to 'cache' for all ancestors of the job with that name.
-    for (NSNumber* tempPid in temp) {
-        NSString* value = [temp objectForKey:tempPid];
-        [cache setObject:value forKey:tempPid];
-        
-        NSNumber* parent = [ancestry objectForKey:tempPid];
-        NSNumber* cycleFinder = parent;
-        while (parent != nil) {
-            [cache setObject:value forKey:parent];
-            
-            // cycleFinder moves through the chain of ancestry at twice the
-            // rate of parent. If it ever catches up to parent then there is a cycle.
-            // A cycle can occur because there's a race in getting each process's
-            // ppid. See bug 771 for details.
-            if (cycleFinder) {
-                cycleFinder = [ancestry objectForKey:cycleFinder];
-                if (cycleFinder && [cycleFinder isEqualToNumber:parent]) {
-                    break;
-                }
+// Walks the tree under |root| breadth first, watching processes not seen before. The job name is
+// that of the first foreground process found. Returns nil if the root is gone.
+- (ProcessTree *)_scanTreeAtRoot:(NSNumber *)root
+{
+    if (![self _watchPid:root parent:[NSNumber numberWithInt:0]]) {
+        return nil;
+    }
+    NSString *jobName = nil;
+    NSMutableDictionary *names = [NSMutableDictionary dictionary];
+    NSMutableDictionary *parents = [NSMutableDictionary dictionary];
+    long long oldestTime = 0;
+    pid_t oldestChild = -1;
+    NSMutableArray *queue = [NSMutableArray arrayWithObject:root];
+    for (int i = 0; i < [queue count]; i++) {
+        NSNumber *pid = [queue objectAtIndex:i];
+        BOOL isForeground = NO;
+        long long startTime = 0;
+        NSString *name = [self _getNameOfPid:[pid intValue]
+                                isForeground:&isForeground
+                                   startTime:&startTime];
+        if (name) {
+            [names setObject:name forKey:pid];
+            if (isForeground && !jobName) {
+                jobName = name;
             }
-            if (cycleFinder) {
-                cycleFinder = [ancestry objectForKey:cycleFinder];
-                if (cycleFinder && [cycleFinder isEqualToNumber:parent]) {
-                    break;
-                }
+        }
+        if (i > 0 &&
+            [[parents objectForKey:pid] isEqualToNumber:root] &&
+            (oldestChild < 0 || startTime < oldestTime)) {
+            oldestTime = startTime;
+            oldestChild = [pid intValue];
+        }
+        for (NSNumber *child in [ProcessCache childPidsOfPid:[pid intValue]]) {
+            if (![parents objectForKey:child] &&
+                ![child isEqualToNumber:root] &&
+                [self _watchPid:child parent:pid]) {
+                [parents setObject:pid forKey:child];
+                [queue addObject:child];
             }
-            
-            parent = [ancestry objectForKey:parent];
         }
     }
+
+    ProcessTree *tree = [[[ProcessTree alloc] init] autorelease];
+    tree->jobName = [jobName retain];
+    tree->descendants = [[[parents allKeys] sortedArrayUsingSelector:@selector(compare:)] retain];
+    tree->names = [names copy];
+    tree->parents = [parents copy];
+    tree->oldestChild = oldestChild;
+    return tree;
 }
 
-- (void)_update
+// Rescans the trees that |dirtyPids| are in, plus those of roots that are new or had output, and
+// publishes a new snapshot if any changed.
+- (void)_rescanTreesOfPids:(NSSet *)dirtyPids
 {
-    // Calculate a new ancestorPid->jobName dict.
-    NSMutableDictionary* temp = [NSMutableDictionary dictionaryWithCapacity:100];
-    [self _refreshProcessCache:temp];
-
-    // Quickly swap the pointer to minimize lock time, and then free the old cache.
-    NSMutableDictionary* old = pidInfoCache_;
-    [temp retain];
-   
+    NSSet *roots;
+    NSMutableSet *rootsToScan;
     @synchronized ([ProcessCache class]) {
-        pidInfoCache_ = temp;
+        roots = [[roots_ copy] autorelease];
+        rootsToScan = [[rootsNeedingRescan_ mutableCopy] autorelease];
+        [rootsNeedingRescan_ removeAllObjects];
+    }
+    for (NSNumber *pid in dirtyPids) {
+        NSNumber *root = [self _rootOfPid:pid roots:roots];
+        if (root) {
+            [rootsToScan addObject:root];
+        }
     }
-    
-    [old release];
-}
 
-- (BOOL)testAndClearNewOutput
-{
-    BOOL v;
-    @synchronized ([ProcessCache class]) {
-        v = newOutput_;
-        newOutput_ = NO;
+    BOOL changed = NO;
+    for (NSNumber *root in [trees_ allKeys]) {
+        if (![roots containsObject:root]) {
+            [trees_ removeObjectForKey:root];
+            changed = YES;
+        }
+    }
+    for (NSNumber *root in rootsToScan) {
+        ProcessTree *tree = [self _scanTreeAtRoot:root];
+        ProcessTree *oldTree = [trees_ objectForKey:root];
+        if (tree == oldTree || [tree isEqualToTree:oldTree]) {
+            continue;
+        }
+        if (tree) {
+            [trees_ setObject:tree forKey:root];
+        } else {
+            [trees_ removeObjectForKey:root];
+        }
+        changed = YES;
+    }
+    if (!changed) {
+        return;
     }
-    return v;
-}
 
-- (void)notifyNewOutput
-{
+    // Quickly swap the pointer to minimize lock time, and then free the old snapshot.
+    ProcessTreeSnapshot *old = snapshot_;
+    ProcessTreeSnapshot *snapshot = [[ProcessTreeSnapshot alloc] initWithVersion:++version_
+                                                                           trees:trees_];
     @synchronized ([ProcessCache class]) {
-        newOutput_ = YES;
+        snapshot_ = snapshot;
     }
+    [old release];
 }
 
 - (void)_run
 {
+    const int kMaxEvents = 64;
+    struct kevent events[kMaxEvents];
     while (1) {
         NSAutoreleasePool* pool = [[NSAutoreleasePool alloc] init];
-        [self _update];
-        // As long as there's no output, don't update the process cache. Otherwise the CPU usage
-        // appears to spike periodically.
-        while (![self testAndClearNewOutput]) {
-            [NSThread sleepForTimeInterval:[NSApp isActive] ? 0.5 : 5];
+        // Output is only looked at this often. Otherwise the CPU usage appears to spike
+        // periodically.
+        NSTimeInterval interval = [NSApp isActive] ? 0.5 : 5;
+        struct timespec timeout = {
+            (time_t)interval,
+            (long)((interval - (time_t)interval) * 1000000000)
+        };
+        NSMutableSet *dirtyPids = [NSMutableSet set];
+        int n = kevent(kq_, NULL, 0, events, kMaxEvents, &timeout);
+        for (int i = 0; i < n; i++) {
+            if (events[i].filter != EVFILT_PROC) {
+                continue;
+            }
+            NSNumber *pid = [NSNumber numberWithInt:(pid_t)events[i].ident];
+            if (events[i].fflags & NOTE_EXIT) {
+                // The kqueue drops the watch itself. The parent's tree has lost a process.
+                NSNumber *parent = [trackedParents_ objectForKey:pid];
+                if ([parent intValue]) {
+                    [dirtyPids addObject:parent];
+                }
+                [trackedParents_ removeObjectForKey:pid];
+            } else {
+                // A fork adds a child to find; an exec changes the name.
+                [dirtyPids addObject:pid];
+            }
         }
+        [self _rescanTreesOfPids:dirtyPids];
         [pool release];
     }
 }
 
-- (NSString*)jobNameWithPid:(int)pid
+- (ProcessTreeSnapshot *)snapshot
 {
-    NSString* jobName;
+    ProcessTreeSnapshot *snapshot;
     @synchronized ([ProcessCache class]) {
-        jobName = [pidInfoCache_ objectForKey:[NSNumber numberWithInt:pid]];
-        // Move jobName into this thread's autorelease pool so it will survive until we return to
-        // mainloop.
-        [[jobName retain] autorelease];
+        // Move the snapshot into this thread's autorelease pool so it will survive until we return
+        // to mainloop.
+        snapshot = [[snapshot_ retain] autorelease];
     }
-    
-    return jobName;
+    return snapshot;
 }
 
+- (NSString*)jobNameWithPid:(int)pid
+{
+    return [[self snapshot] jobNameForRoot:pid];
+}
 
 @end
@@ -26,6 +26,8 @@
 
 #define BMKEY_BOOKMARKS_ARRAY @"Bookmarks Array"
 
+@class ProfileSearchIndex;
+
 typedef NSDictionary Profile;
 typedef struct {
     SEL selector;                  // normal action
@@ -44,6 +46,21 @@ typedef struct {
     NSMutableArray* journal_;
     NSUserDefaults* prefs_;
     BOOL postChanges_;              // should change notifications be posted?
+
+    // Built when first needed after the profiles change.
+    ProfileSearchIndex *searchIndex_;
+    // Filter -> NSArray of the indices of the profiles that match it, since the profiles changed.
+    NSMutableDictionary *filterCache_;
+    // The last filter that wasn't cached and its matches. A filter made by typing more after it
+    // only has to check these.
+    NSString *lastFilter_;
+    NSIndexSet *lastFilterMatches_;
+
+    // Guid -> profile, built when first needed after the profiles change.
+    NSMutableDictionary *profilesByGuid_;
+    // Guid -> NSNumber with the index of each profile as of the last journal entry that added it
+    // to the menus. Lets -rebuildMenus replace only the items of profiles that moved.
+    NSMutableDictionary *menuIndices_;
 }
 
 + (ProfileModel*)sharedInstance;
@@ -78,6 +95,7 @@ typedef struct {
 - (Profile*)setObject:(id)object forKey:(NSString*)key inBookmark:(Profile*)bookmark;
 - (void)setDefaultByGuid:(NSString*)guid;
 - (void)moveGuid:(NSString*)guid toRow:(int)row;
+// Brings the menus up to date with the order of the profiles after they were moved.
 - (void)rebuildMenus;
 // Return the absolute index of a bookmark given its index with the filter applied.
 - (int)convertFilteredIndex:(int)theIndex withFilter:(NSString*)filter;
@@ -25,12 +25,130 @@
 #import "ITAddressBookMgr.h"
 #import "ProfileModel.h"
 #import "PreferencePanel.h"
+#import "ProfileSearchIndex.h"
 
 id gAltOpenAllRepresentedObject;
 // Set to true if a bookmark was changed automatically due to migration to a new
 // standard.
 int gMigrated;
 
+// The filter cache is emptied when it gets this big.
+static const int kMaxCachedFilters = 64;
+
+// A filter made by typing more after |previous| matches a subset of what |previous| does. The
+// exception is when |previous| ends with a lone "*", which matches nothing.
+static BOOL ProfileModelFilterRefinesFilter(NSString *filter, NSString *previous) {
+    if (!previous || ![filter hasPrefix:previous]) {
+        return NO;
+    }
+    NSArray *previousTokens =
+        [previous componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+    return ![[previousTokens lastObject] isEqualToString:@"*"];
+}
+
+// A submenu for a tag that gets its items for profiles when it's first about to open, so that
+// profiles with large numbers of tags don't make every change to the menus slow. Profiles with a
+// keyboard shortcut are added right away so that the key equivalent works before then.
+@interface ProfileTagSubmenu : NSMenu <NSMenuDelegate> {
+    ProfileModel *model_;
+    JournalParams params_;
+    // Dictionaries with a profile and its index, in the order they were added.
+    NSMutableArray *pendingProfiles_;
+}
+
+// The submenu for a tag in |menu| or nil if it doesn't defer its items.
++ (ProfileTagSubmenu *)lazySubmenu:(NSMenu *)menu;
+
+- (id)initWithParams:(JournalParams *)params;
+
+// Returns NO if it's too late to defer |profile|, and it should be added as usual.
+- (BOOL)deferProfile:(Profile *)profile atIndex:(int)theIndex model:(ProfileModel *)model;
+- (void)removeDeferredProfileWithGuid:(NSString *)guid;
+- (BOOL)hasDeferredProfiles;
+
+@end
+
+@implementation ProfileTagSubmenu
+
++ (ProfileTagSubmenu *)lazySubmenu:(NSMenu *)menu
+{
+    return [menu isKindOfClass:[ProfileTagSubmenu class]] ? (ProfileTagSubmenu *)menu : nil;
+}
+
+- (id)initWithParams:(JournalParams *)params
+{
+    self = [super init];
+    if (self) {
+        params_ = *params;
+        pendingProfiles_ = [[NSMutableArray alloc] init];
+        [self setDelegate:self];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self setDelegate:nil];
+    [pendingProfiles_ release];
+    [super dealloc];
+}
+
+- (BOOL)deferProfile:(Profile *)profile atIndex:(int)theIndex model:(ProfileModel *)model
+{
+    if (!pendingProfiles_ || [[profile objectForKey:KEY_SHORTCUT] length]) {
+        return NO;
+    }
+    model_ = model;
+    [pendingProfiles_ addObject:[NSDictionary dictionaryWithObjectsAndKeys:
+                                    profile, @"profile",
+                                    [NSNumber numberWithInt:theIndex], @"index",
+                                    nil]];
+    return YES;
+}
+
+- (void)removeDeferredProfileWithGuid:(NSString *)guid
+{
+    for (int i = [pendingProfiles_ count] - 1; i >= 0; i--) {
+        Profile *profile = [[pendingProfiles_ objectAtIndex:i] objectForKey:@"profile"];
+        if ([[profile objectForKey:KEY_GUID] isEqualToString:guid]) {
+            [pendingProfiles_ removeObjectAtIndex:i];
+        }
+    }
+}
+
+- (BOOL)hasDeferredProfiles
+{
+    return [pendingProfiles_ count] > 0;
+}
+
+- (void)menuNeedsUpdate:(NSMenu *)menu
+{
+    if (!pendingProfiles_) {
+        return;
+    }
+    NSArray *pending = [pendingProfiles_ sortedArrayUsingComparator:^NSComparisonResult(id a, id b) {
+        NSComparisonResult order = [[a objectForKey:@"index"] compare:[b objectForKey:@"index"]];
+        if (order == NSOrderedSame) {
+            order = [[[a objectForKey:@"profile"] objectForKey:KEY_NAME] caseInsensitiveCompare:
+                        [[b objectForKey:@"profile"] objectForKey:KEY_NAME]];
+        }
+        return order;
+    }];
+    // From now on profiles are added directly.
+    [pendingProfiles_ release];
+    pendingProfiles_ = nil;
+    for (NSDictionary *entry in pending) {
+        [model_ addBookmark:[entry objectForKey:@"profile"]
+                     toMenu:self
+             startingAtItem:0
+                   withTags:nil
+                     params:&params_
+                      atPos:[[entry objectForKey:@"index"] intValue]];
+    }
+}
+
+@end
+
 @implementation ProfileModel
 
 + (void)initialize
@@ -50,6 +168,8 @@ int gMigrated;
         bookmarks_ = [[NSMutableArray alloc] init];
         defaultBookmarkGuid_ = @"";
         journal_ = [[NSMutableArray alloc] init];
+        filterCache_ = [[NSMutableDictionary alloc] init];
+        menuIndices_ = [[NSMutableDictionary alloc] init];
     }
     return self;
 }
@@ -82,6 +202,12 @@ int gMigrated;
 
 - (void)dealloc
 {
+    [searchIndex_ release];
+    [filterCache_ release];
+    [lastFilter_ release];
+    [lastFilterMatches_ release];
+    [profilesByGuid_ release];
+    [menuIndices_ release];
     [super dealloc];
     [journal_ release];
     NSLog(@"Deallocating bookmark model!");
@@ -92,81 +218,63 @@ int gMigrated;
     return [bookmarks_ count];
 }
 
-- (BOOL)_document:(NSArray *)nameWords containsToken:(NSString *)token
+// Must be called after any change to bookmarks_.
+- (void)_profilesDidChange
 {
-    for (int k = 0; k < [nameWords count]; ++k) {
-        NSString* tagPart = [nameWords objectAtIndex:k];
-        NSRange range;
-        if ([token length] && [token characterAtIndex:0] == '*') {
-            range = [tagPart rangeOfString:[token substringFromIndex:1] options:NSCaseInsensitiveSearch];
-        } else {
-            range = [tagPart rangeOfString:token options:(NSCaseInsensitiveSearch | NSAnchoredSearch)];
-        }
-        if (range.location != NSNotFound) {
-            return YES;
-        }
-    }
-    return NO;
+    [searchIndex_ release];
+    searchIndex_ = nil;
+    [filterCache_ removeAllObjects];
+    [lastFilter_ release];
+    lastFilter_ = nil;
+    [lastFilterMatches_ release];
+    lastFilterMatches_ = nil;
+    [profilesByGuid_ release];
+    profilesByGuid_ = nil;
 }
-- (BOOL)doesBookmarkAtIndex:(int)theIndex matchFilter:(NSArray*)tokens
-{
-    Profile* bookmark = [self profileAtIndex:theIndex];
-    NSArray* tags = [bookmark objectForKey:KEY_TAGS];
-    NSArray* nameWords = [[bookmark objectForKey:KEY_NAME] componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
-    for (int i = 0; i < [tokens count]; ++i) {
-        NSString* token = [tokens objectAtIndex:i];
-        if (![token length]) {
-            continue;
-        }
-        // Search each word in tag until one has this token as a prefix.
-        bool found;
 
-        // First see if this token occurs in the title
-        found = [self _document:nameWords containsToken:token];
+- (NSArray*)bookmarkIndicesMatchingFilter:(NSString*)filter
+{
+    if (!filter) {
+        filter = @"";
+    }
+    NSArray *cached = [filterCache_ objectForKey:filter];
+    if (cached) {
+        return cached;
+    }
 
-        // If not try each tag.
-        for (int j = 0; !found && j < [tags count]; ++j) {
-            // Expand the jth tag into an array of the words in the tag
-            NSArray* tagWords = [[tags objectAtIndex:j] componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
-            found = [self _document:tagWords containsToken:token];
+    NSIndexSet *matches;
+    NSArray *tokens = [ProfileSearchIndex tokensInFilter:filter];
+    if (![tokens count]) {
+        matches = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, [bookmarks_ count])];
+    } else {
+        if (!searchIndex_) {
+            searchIndex_ = [[ProfileSearchIndex alloc] initWithProfiles:bookmarks_];
         }
-        if (!found) {
-            // No tag had token i as a prefix.
-            return NO;
+        if (ProfileModelFilterRefinesFilter(filter, lastFilter_)) {
+            matches = [searchIndex_ indicesMatchingTokens:tokens amongIndices:lastFilterMatches_];
+        } else {
+            matches = [searchIndex_ indicesMatchingTokens:tokens];
         }
+        [lastFilter_ release];
+        lastFilter_ = [filter copy];
+        [lastFilterMatches_ release];
+        lastFilterMatches_ = [matches copy];
     }
-    return YES;
-}
-
-- (NSArray*)parseFilter:(NSString*)filter
-{
-    return [filter componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
-}
 
-- (NSArray*)bookmarkIndicesMatchingFilter:(NSString*)filter
-{
-    NSMutableArray* result = [NSMutableArray arrayWithCapacity:[bookmarks_ count]];
-    NSArray* tokens = [self parseFilter:filter];
-    int count = [bookmarks_ count];
-    for (int i = 0; i < count; ++i) {
-        if ([self doesBookmarkAtIndex:i matchFilter:tokens]) {
-            [result addObject:[NSNumber numberWithInt:i]];
-        }
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity:[matches count]];
+    [matches enumerateIndexesUsingBlock:^(NSUInteger i, BOOL *stop) {
+        [result addObject:[NSNumber numberWithInt:(int)i]];
+    }];
+    if ([filterCache_ count] >= kMaxCachedFilters) {
+        [filterCache_ removeAllObjects];
     }
+    [filterCache_ setObject:result forKey:filter];
     return result;
 }
 
 - (int)numberOfBookmarksWithFilter:(NSString*)filter
 {
-    NSArray* tokens = [self parseFilter:filter];
-    int count = [bookmarks_ count];
-    int n = 0;
-    for (int i = 0; i < count; ++i) {
-        if ([self doesBookmarkAtIndex:i matchFilter:tokens]) {
-            ++n;
-        }
-    }
-    return n;
+    return [[self bookmarkIndicesMatchingFilter:filter] count];
 }
 
 - (Profile*)profileAtIndex:(int)i
@@ -179,18 +287,7 @@ int gMigrated;
 
 - (Profile*)profileAtIndex:(int)theIndex withFilter:(NSString*)filter
 {
-    NSArray* tokens = [self parseFilter:filter];
-    int count = [bookmarks_ count];
-    int n = 0;
-    for (int i = 0; i < count; ++i) {
-        if ([self doesBookmarkAtIndex:i matchFilter:tokens]) {
-            if (n == theIndex) {
-                return [self profileAtIndex:i];
-            }
-            ++n;
-        }
-    }
-    return nil;
+    return [self profileAtIndex:[self convertFilteredIndex:theIndex withFilter:filter]];
 }
 
 - (void)addBookmark:(Profile*)bookmark
@@ -306,6 +403,7 @@ int gMigrated;
         theIndex = [bookmarks_ count];
         [bookmarks_ addObject:[NSDictionary dictionaryWithDictionary:bookmark]];
     }
+    [self _profilesDidChange];
     NSString* isDeprecatedDefaultBookmark = [bookmark objectForKey:KEY_DEFAULT_BOOKMARK];
 
     // The call to setDefaultByGuid may add a journal entry so make sure this one comes first.
@@ -327,18 +425,11 @@ int gMigrated;
 
 - (int)convertFilteredIndex:(int)theIndex withFilter:(NSString*)filter
 {
-    NSArray* tokens = [self parseFilter:filter];
-    int count = [bookmarks_ count];
-    int n = 0;
-    for (int i = 0; i < count; ++i) {
-        if ([self doesBookmarkAtIndex:i matchFilter:tokens]) {
-            if (n == theIndex) {
-                return i;
-            }
-            ++n;
-        }
+    NSArray *indices = [self bookmarkIndicesMatchingFilter:filter];
+    if (theIndex < 0 || theIndex >= [indices count]) {
+        return -1;
     }
-    return -1;
+    return [[indices objectAtIndex:theIndex] intValue];
 }
 
 - (void)removeBookmarksAtIndices:(NSArray*)indices
@@ -350,6 +441,7 @@ int gMigrated;
 
         [journal_ addObject:[BookmarkJournalEntry journalWithAction:JOURNAL_REMOVE bookmark:[bookmarks_ objectAtIndex:i] model:self]];
         [bookmarks_ removeObjectAtIndex:i];
+        [self _profilesDidChange];
         if (![self defaultBookmark] && [bookmarks_ count]) {
             [self setDefaultByGuid:[[bookmarks_ objectAtIndex:0] objectForKey:KEY_GUID]];
         }
@@ -362,6 +454,7 @@ int gMigrated;
     assert(i >= 0);
     [journal_ addObject:[BookmarkJournalEntry journalWithAction:JOURNAL_REMOVE bookmark:[bookmarks_ objectAtIndex:i] model:self]];
     [bookmarks_ removeObjectAtIndex:i];
+    [self _profilesDidChange];
     if (![self defaultBookmark] && [bookmarks_ count]) {
         [self setDefaultByGuid:[[bookmarks_ objectAtIndex:0] objectForKey:KEY_GUID]];
     }
@@ -412,6 +505,7 @@ int gMigrated;
         [journal_ addObject:[BookmarkJournalEntry journalWithAction:JOURNAL_REMOVE bookmark:[bookmarks_ objectAtIndex:i] model:self]];
     }
     [bookmarks_ replaceObjectAtIndex:i withObject:bookmark];
+    [self _profilesDidChange];
     if (needJournal) {
         BookmarkJournalEntry* e = [BookmarkJournalEntry journalWithAction:JOURNAL_ADD bookmark:bookmark model:self];
         e->index = i;
@@ -436,6 +530,7 @@ int gMigrated;
 - (void)removeAllBookmarks
 {
     [bookmarks_ removeAllObjects];
+    [self _profilesDidChange];
     defaultBookmarkGuid_ = @"";
     [journal_ addObject:[BookmarkJournalEntry journalWithAction:JOURNAL_REMOVE_ALL bookmark:nil model:self]];
     [self postChangeNotification];
@@ -449,6 +544,7 @@ int gMigrated;
 - (void)load:(NSArray*)prefs
 {
     [bookmarks_ removeAllObjects];
+    [self _profilesDidChange];
     for (int i = 0; i < [prefs count]; ++i) {
         Profile* bookmark = [prefs objectAtIndex:i];
         NSArray* tags = [bookmark objectForKey:KEY_TAGS];
@@ -470,22 +566,24 @@ int gMigrated;
 
 - (int)indexOfProfileWithGuid:(NSString*)guid
 {
-    return [self indexOfProfileWithGuid:guid withFilter:@""];
+    int count = [bookmarks_ count];
+    for (int i = 0; i < count; ++i) {
+        if ([[[bookmarks_ objectAtIndex:i] objectForKey:KEY_GUID] isEqualToString:guid]) {
+            return i;
+        }
+    }
+    return -1;
 }
 
 - (int)indexOfProfileWithGuid:(NSString*)guid withFilter:(NSString*)filter
 {
-    NSArray* tokens = [self parseFilter:filter];
-    int count = [bookmarks_ count];
-    int n = 0;
-    for (int i = 0; i < count; ++i) {
-        if (![self doesBookmarkAtIndex:i matchFilter:tokens]) {
-            continue;
-        }
+    NSArray *indices = [self bookmarkIndicesMatchingFilter:filter];
+    int count = [indices count];
+    for (int n = 0; n < count; ++n) {
+        const int i = [[indices objectAtIndex:n] intValue];
         if ([[[bookmarks_ objectAtIndex:i] objectForKey:KEY_GUID] isEqualToString:guid]) {
             return n;
         }
-        ++n;
     }
     return -1;
 }
@@ -508,13 +606,21 @@ int gMigrated;
 
 - (Profile*)bookmarkWithGuid:(NSString*)guid
 {
-    int count = [bookmarks_ count];
-    for (int i = 0; i < count; ++i) {
-        if ([[[bookmarks_ objectAtIndex:i] objectForKey:KEY_GUID] isEqualToString:guid]) {
-            return [bookmarks_ objectAtIndex:i];
+    if (!guid) {
+        return nil;
+    }
+    if (!profilesByGuid_) {
+        profilesByGuid_ = [[NSMutableDictionary alloc] initWithCapacity:[bookmarks_ count]];
+        // Go backwards so the first of any profiles with the same guid wins, as with a scan.
+        for (int i = [bookmarks_ count] - 1; i >= 0; --i) {
+            Profile* bookmark = [bookmarks_ objectAtIndex:i];
+            NSString* bookmarkGuid = [bookmark objectForKey:KEY_GUID];
+            if (bookmarkGuid) {
+                [profilesByGuid_ setObject:bookmark forKey:bookmarkGuid];
+            }
         }
     }
-    return nil;
+    return [profilesByGuid_ objectForKey:guid];
 }
 
 - (int)indexOfBookmarkWithName:(NSString*)name
@@ -590,24 +696,50 @@ int gMigrated;
         destinationRow--;
     }
     [bookmarks_ insertObject:bookmark atIndex:destinationRow];
+    [self _profilesDidChange];
     [bookmark release];
 }
 
 - (void)rebuildMenus
 {
-    [journal_ addObject:[BookmarkJournalEntry journalWithAction:JOURNAL_REMOVE_ALL bookmark:nil model:self]];
+    // Only profiles whose index changed get their items replaced. They are all removed before any
+    // is added back so that the items they're placed among have up-to-date indices.
+    NSMutableArray* moved = [NSMutableArray array];
     int i = 0;
     for (Profile* b in bookmarks_) {
-        BookmarkJournalEntry* e = [BookmarkJournalEntry journalWithAction:JOURNAL_ADD bookmark:b model:self];
-        e->index = i++;
-        [journal_ addObject:e];
+        NSNumber* menuIndex = [menuIndices_ objectForKey:[b objectForKey:KEY_GUID]];
+        if (!menuIndex || [menuIndex intValue] != i) {
+            if (menuIndex) {
+                [journal_ addObject:[BookmarkJournalEntry journalWithAction:JOURNAL_REMOVE bookmark:b model:self]];
+            }
+            BookmarkJournalEntry* e = [BookmarkJournalEntry journalWithAction:JOURNAL_ADD bookmark:b model:self];
+            e->index = i;
+            [moved addObject:e];
+        }
+        i++;
     }
+    [journal_ addObjectsFromArray:moved];
     [self postChangeNotification];
 }
 
 - (void)postChangeNotification
 {
     if (postChanges_) {
+        for (BookmarkJournalEntry* e in journal_) {
+            switch (e->action) {
+                case JOURNAL_ADD:
+                    [menuIndices_ setObject:[NSNumber numberWithInt:e->index] forKey:e->guid];
+                    break;
+                case JOURNAL_REMOVE:
+                    [menuIndices_ removeObjectForKey:e->guid];
+                    break;
+                case JOURNAL_REMOVE_ALL:
+                    [menuIndices_ removeAllObjects];
+                    break;
+                case JOURNAL_SET_DEFAULT:
+                    break;
+            }
+        }
         [[NSNotificationCenter defaultCenter] postNotificationName:@"iTermReloadAddressBook"
                                                             object:nil
                                                           userInfo:[NSDictionary dictionaryWithObject:journal_ forKey:@"array"]];
@@ -689,7 +821,7 @@ int gMigrated;
         NSMenuItem* newItem = [[[NSMenuItem alloc] initWithTitle:name
                                                           action:nil
                                                    keyEquivalent:@""] autorelease];
-        [newItem setSubmenu:[[[NSMenu alloc] init] autorelease]];
+        [newItem setSubmenu:[[[ProfileTagSubmenu alloc] initWithParams:params] autorelease]];
         [menu insertItem:newItem atIndex:pos];
         submenu = [newItem submenu];
     }
@@ -845,7 +977,9 @@ int gMigrated;
                                                           startingAtItem:skip
                                                                 withName:tag
                                                                   params:params];
-        [self addBookmark:b toMenu:tagSubMenu startingAtItem:0 withTags:nil params:params atPos:theIndex];
+        if (![[ProfileTagSubmenu lazySubmenu:tagSubMenu] deferProfile:b atIndex:theIndex model:self]) {
+            [self addBookmark:b toMenu:tagSubMenu startingAtItem:0 withTags:nil params:params atPos:theIndex];
+        }
     }
 
     if ([[self class] menuHasMultipleItemsExcludingAlternates:menu fromIndex:skip] &&
@@ -882,6 +1016,7 @@ int gMigrated;
 
 + (void)applyRemoveJournalEntry:(BookmarkJournalEntry*)e toMenu:(NSMenu*)menu startingAtItem:(int)skip params:(JournalParams*)params
 {
+    [[ProfileTagSubmenu lazySubmenu:menu] removeDeferredProfileWithGuid:e->guid];
     int pos = [menu indexOfItemWithRepresentedObject:e->guid];
     if (pos != -1) {
         [menu removeItemAtIndex:pos];
@@ -898,7 +1033,8 @@ int gMigrated;
                 if (i == items.count - 1) {
                     [self applyRemoveJournalEntry:e toMenu:submenu startingAtItem:0 params:params];
                 }
-                if ([submenu numberOfItems] == 0) {
+                if ([submenu numberOfItems] == 0 &&
+                    ![[ProfileTagSubmenu lazySubmenu:submenu] hasDeferredProfiles]) {
                     [[[item parentItem] submenu] removeItem:item];
                     
                     // Remove "open all" (not at first level)
@@ -0,0 +1,36 @@
+//
+//  ProfileSearchIndex.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+// Finds profiles matching a filter typed in a profile list's search field. The names and tags of
+// the profiles are split into words once, case folded, and kept in a sorted list so that the
+// profiles with a word starting with some prefix are found with a binary search.
+//
+// A filter is a list of whitespace-separated tokens, all of which must match. A token matches a
+// profile if one of the words of its name or tags starts with it, ignoring case. A token that
+// begins with * instead matches a word that contains the rest of it anywhere.
+//
+// An index is immutable, so it must be made again after the profiles change.
+@interface ProfileSearchIndex : NSObject {
+    // Sorted, unique, case-folded words.
+    NSArray *words_;
+    // NSIndexSet of the indices of the profiles containing each word.
+    NSArray *profilesForWord_;
+    int numberOfProfiles_;
+}
+
+- (id)initWithProfiles:(NSArray *)profiles;
+
+// Splits a filter into tokens.
++ (NSArray *)tokensInFilter:(NSString *)filter;
+
+// Indices of profiles matching every token.
+- (NSIndexSet *)indicesMatchingTokens:(NSArray *)tokens;
+
+// Indices from |candidates| of profiles matching every token.
+- (NSIndexSet *)indicesMatchingTokens:(NSArray *)tokens amongIndices:(NSIndexSet *)candidates;
+
+@end
@@ -0,0 +1,138 @@
+//
+//  ProfileSearchIndex.m
+//  iTerm
+//
+
+#import "ProfileSearchIndex.h"
+#import "ITAddressBookMgr.h"
+
+static NSString *ProfileSearchIndexFold(NSString *string) {
+    return [string stringByFoldingWithOptions:NSCaseInsensitiveSearch locale:nil];
+}
+
+@implementation ProfileSearchIndex
+
+- (id)initWithProfiles:(NSArray *)profiles
+{
+    self = [super init];
+    if (self) {
+        numberOfProfiles_ = [profiles count];
+        NSCharacterSet *whitespace = [NSCharacterSet whitespaceCharacterSet];
+        NSMutableDictionary *profilesForWord = [NSMutableDictionary dictionary];
+        for (int i = 0; i < numberOfProfiles_; i++) {
+            NSDictionary *profile = [profiles objectAtIndex:i];
+            NSMutableArray *phrases = [NSMutableArray arrayWithArray:[profile objectForKey:KEY_TAGS]];
+            if ([profile objectForKey:KEY_NAME]) {
+                [phrases addObject:[profile objectForKey:KEY_NAME]];
+            }
+            for (NSString *phrase in phrases) {
+                for (NSString *word in [phrase componentsSeparatedByCharactersInSet:whitespace]) {
+                    if (![word length]) {
+                        continue;
+                    }
+                    NSString *folded = ProfileSearchIndexFold(word);
+                    NSMutableIndexSet *indices = [profilesForWord objectForKey:folded];
+                    if (!indices) {
+                        indices = [NSMutableIndexSet indexSet];
+                        [profilesForWord setObject:indices forKey:folded];
+                    }
+                    [indices addIndex:i];
+                }
+            }
+        }
+        // Literal order keeps all words with the same prefix next to each other.
+        words_ = [[[profilesForWord allKeys] sortedArrayUsingComparator:^NSComparisonResult(id a, id b) {
+            return [a compare:b options:NSLiteralSearch];
+        }] retain];
+        NSMutableArray *sets = [NSMutableArray arrayWithCapacity:[words_ count]];
+        for (NSString *word in words_) {
+            [sets addObject:[profilesForWord objectForKey:word]];
+        }
+        profilesForWord_ = [sets retain];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [words_ release];
+    [profilesForWord_ release];
+    [super dealloc];
+}
+
++ (NSArray *)tokensInFilter:(NSString *)filter
+{
+    NSMutableArray *tokens = [NSMutableArray array];
+    for (NSString *token in [filter componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceCharacterSet]]) {
+        if ([token length]) {
+            [tokens addObject:token];
+        }
+    }
+    return tokens;
+}
+
+- (NSIndexSet *)indicesMatchingTokens:(NSArray *)tokens
+{
+    return [self indicesMatchingTokens:tokens
+                          amongIndices:[NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, numberOfProfiles_)]];
+}
+
+- (NSIndexSet *)indicesMatchingTokens:(NSArray *)tokens amongIndices:(NSIndexSet *)candidates
+{
+    NSMutableIndexSet *result = [[candidates mutableCopy] autorelease];
+    for (NSString *token in tokens) {
+        if (![result count]) {
+            break;
+        }
+        NSIndexSet *matches;
+        if ([token characterAtIndex:0] == '*') {
+            matches = [self _indicesOfWordsContaining:ProfileSearchIndexFold([token substringFromIndex:1])];
+        } else {
+            matches = [self _indicesOfWordsWithPrefix:ProfileSearchIndexFold(token)];
+        }
+        // Keep only the indices in both sets.
+        NSMutableIndexSet *missing = [[result mutableCopy] autorelease];
+        [missing removeIndexes:matches];
+        [result removeIndexes:missing];
+    }
+    return result;
+}
+
+#pragma mark - Private
+
+- (NSIndexSet *)_indicesOfWordsWithPrefix:(NSString *)prefix
+{
+    // Find the first word not less than |prefix|.
+    int lo = 0;
+    int hi = [words_ count];
+    while (lo < hi) {
+        const int mid = lo + (hi - lo) / 2;
+        if ([[words_ objectAtIndex:mid] compare:prefix options:NSLiteralSearch] == NSOrderedAscending) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    NSMutableIndexSet *indices = [NSMutableIndexSet indexSet];
+    for (int i = lo; i < [words_ count] && [[words_ objectAtIndex:i] hasPrefix:prefix]; i++) {
+        [indices addIndexes:[profilesForWord_ objectAtIndex:i]];
+    }
+    return indices;
+}
+
+- (NSIndexSet *)_indicesOfWordsContaining:(NSString *)substring
+{
+    NSMutableIndexSet *indices = [NSMutableIndexSet indexSet];
+    if (![substring length]) {
+        // Like -rangeOfString: with an empty string, this never matches.
+        return indices;
+    }
+    for (int i = 0; i < [words_ count]; i++) {
+        if ([[words_ objectAtIndex:i] rangeOfString:substring options:NSLiteralSearch].location != NSNotFound) {
+            [indices addIndexes:[profilesForWord_ objectAtIndex:i]];
+        }
+    }
+    return indices;
+}
+
+@end
@@ -143,6 +143,14 @@
 // Move backward/forward in time by one frame.
 - (void)irAdvance:(int)dir;
 
+// Enter instant replay in the current session, playing back a file recorded by a DVR instead of
+// the session's own history. Returns NO if the file can't be read or is empty.
+- (BOOL)replayRecordingAtPath:(NSString *)path;
+
+// Opens a tab that runs nothing and replays a pty recording (see PTYRecorder.h) in it, with the
+// current session's profile. Returns NO if the file isn't a recording.
+- (BOOL)replayPtyRecordingAtPath:(NSString *)path atOriginalSpeed:(BOOL)originalSpeed;
+
 // Does any session want to be prompted for closing?
 - (BOOL)promptOnClose;
 
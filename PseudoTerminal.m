@@ -3,6 +3,7 @@
 #import "BottomBarView.h"
 #import "ColorsMenuItemView.h"
 #import "Coprocess.h"
+#import "DVR.h"
 #import "FakeWindow.h"
 #import "FindViewController.h"
 #import "FutureMethods.h"
@@ -14,6 +15,7 @@
 #import "PSMTabBarControl.h"
 #import "PSMTabStyle.h"
 #import "PTToolbarController.h"
+#import "PTYRecorder.h"
 #import "PTYScrollView.h"
 #import "PTYSession.h"
 #import "PTYSession.h"
@@ -28,6 +30,7 @@
 #import "ProfilesWindow.h"
 #import "PseudoTerminal.h"
 #import "PseudoTerminalRestorer.h"
+#import "SessionActivity.h"
 #import "SessionView.h"
 #import "SplitPanel.h"
 #import "TemporaryNumberAllocator.h"
@@ -47,6 +50,10 @@
 
 static NSString *const kWindowNameFormat = @"iTerm Window %d";
 
+// How long a new window title waits before it's shown. Titles that change again meanwhile (for
+// example, from a shell that sets it at every prompt) are shown only once.
+static const NSTimeInterval kWindowTitleUpdateDelay = 0.1;
+
 #define PtyLog DLog
 
 // Constants for saved window arrangement key names.
@@ -168,6 +175,11 @@ NSString *kSessionsKVCKey = @"sessions";
     // size during resizing).
     BOOL tempTitle;
 
+    // Window title changes are applied at most once per kWindowTitleUpdateDelay. This is the title
+    // to apply, or nil to use the current session's name at that time.
+    NSString *pendingWindowTitle_;
+    BOOL windowTitleUpdatePending_;
+
     // When sending input to all sessions we temporarily change the background
     // color. This stores the normal background color so we can restore to it.
     NSColor *normalBackgroundColor;
@@ -266,6 +278,7 @@ NSString *kSessionsKVCKey = @"sessions";
 
     BOOL liveResize_;
     BOOL postponedTmuxTabLayoutChange_;
+    BOOL tmuxResizePending_;  // tmux hasn't been told about a size change during a live resize.
 
     // A unique string for this window. Used for tmux to remember which window
     // a tmux window should be opened in as a tab. A window restored from a
@@ -652,6 +665,7 @@ NSString *kSessionsKVCKey = @"sessions";
     }
     [broadcastViewIds_ release];
     [commandField release];
+    [pendingWindowTitle_ release];
     [bottomBar release];
     [_toolbarController release];
     [autocompleteView shutdown];
@@ -736,6 +750,26 @@ NSString *kSessionsKVCKey = @"sessions";
 
 - (void)notifyTmuxOfWindowResize
 {
+    if (liveResize_) {
+        // Each client size change makes tmux redraw every pane, so during a drag it's only sent
+        // every kLiveResizeUpdateInterval, and once more when the drag ends.
+        if (!tmuxResizePending_) {
+            tmuxResizePending_ = YES;
+            [self performSelector:@selector(notifyTmuxOfPendingWindowResize)
+                       withObject:nil
+                       afterDelay:kLiveResizeUpdateInterval];
+        }
+        return;
+    }
+    [self notifyTmuxOfPendingWindowResize];
+}
+
+- (void)notifyTmuxOfPendingWindowResize
+{
+    [NSObject cancelPreviousPerformRequestsWithTarget:self
+                                             selector:@selector(notifyTmuxOfPendingWindowResize)
+                                               object:nil];
+    tmuxResizePending_ = NO;
     NSArray *tmuxControllers = [self uniqueTmuxControllers];
     if (tmuxControllers.count && !tmuxOriginatedResizeInProgress_) {
         for (TmuxController *controller in tmuxControllers) {
@@ -1247,7 +1281,10 @@ NSString *kSessionsKVCKey = @"sessions";
 
 - (void)setWindowTitle
 {
-    [self setWindowTitle:[self currentSessionName]];
+    // The session's name is formatted when the title is applied.
+    [pendingWindowTitle_ release];
+    pendingWindowTitle_ = nil;
+    [self _scheduleWindowTitleUpdate];
 }
 
 - (void)setWindowTitle:(NSString *)title
@@ -1256,16 +1293,43 @@ NSString *kSessionsKVCKey = @"sessions";
         // title can be nil during loadWindowArrangement
         title = @"";
     }
+    [pendingWindowTitle_ release];
+    pendingWindowTitle_ = [title copy];
+    [self _scheduleWindowTitleUpdate];
+}
 
-    if ([[PreferencePanel sharedInstance] windowNumber]) {
-        title = [NSString stringWithFormat:@"%d. %@", number_+1, title];
+- (void)_scheduleWindowTitleUpdate
+{
+    if (windowTitleUpdatePending_) {
+        return;
     }
-    
+    windowTitleUpdatePending_ = YES;
     // In bug 2593, we see a crazy thing where setting the window title right
     // after a window is created causes it to have the wrong background color.
     // A delay of 0 doesn't fix it. I'm at wit's end here, so this will have to
     // do until a better explanation comes along.
-    [[self window] performSelector:@selector(setTitle:) withObject:title afterDelay:0.1];
+    [self performSelector:@selector(_updateWindowTitle)
+               withObject:nil
+               afterDelay:kWindowTitleUpdateDelay];
+}
+
+- (void)_updateWindowTitle
+{
+    windowTitleUpdatePending_ = NO;
+    NSString *title = pendingWindowTitle_ ? [[pendingWindowTitle_ retain] autorelease]
+                                          : [self currentSessionName];
+    [pendingWindowTitle_ release];
+    pendingWindowTitle_ = nil;
+    if (title == nil) {
+        title = @"";
+    }
+
+    if ([[PreferencePanel sharedInstance] windowNumber]) {
+        title = [NSString stringWithFormat:@"%d. %@", number_+1, title];
+    }
+    if (![[[self window] title] isEqualToString:title]) {
+        [[self window] setTitle:title];
+    }
 }
 
 - (BOOL)tempTitle
@@ -1323,13 +1387,15 @@ NSString *kSessionsKVCKey = @"sessions";
 
 - (void)sendInputToAllSessions:(NSData *)data
 {
+    NSMutableArray *tasks = [NSMutableArray array];
     for (PTYSession *aSession in [self broadcastSessions]) {
         if ([aSession isTmuxClient]) {
             [aSession writeTaskNoBroadcast:data];
         } else if (![aSession isTmuxGateway]) {
-            [[aSession SHELL] writeTask:data];
+            [tasks addObject:[aSession SHELL]];
         }
     }
+    [PTYTask writeData:data toTasks:tasks];
 }
 
 - (BOOL)broadcastInputToSession:(PTYSession *)session
@@ -1633,6 +1699,16 @@ NSString *kSessionsKVCKey = @"sessions";
         [TABVIEW selectTabViewItemAtIndex:tabIndex];
     }
 
+    // Restored sessions in other tabs start their commands when their tab is first selected. With
+    // the hidden LaunchRestoredSessionsInBackground preference they start one at a time instead,
+    // after the window is up and between events.
+    for (PTYSession *aSession in [[self currentTab] sessions]) {
+        [aSession launchDeferredProgramIfNeeded];
+    }
+    if ([[NSUserDefaults standardUserDefaults] boolForKey:@"LaunchRestoredSessionsInBackground"]) {
+        [self performSelector:@selector(_launchNextDeferredSession) withObject:nil afterDelay:0];
+    }
+
     Profile* addressbookEntry = [[[[[self tabs] objectAtIndex:0] sessions] objectAtIndex:0] addressBookEntry];
     if ([addressbookEntry objectForKey:KEY_SPACE] &&
         [[addressbookEntry objectForKey:KEY_SPACE] intValue] == -1) {
@@ -1647,6 +1723,17 @@ NSString *kSessionsKVCKey = @"sessions";
     [self fitTabsToWindow];
 }
 
+- (void)_launchNextDeferredSession
+{
+    for (PTYSession *aSession in [self sessions]) {
+        if ([aSession hasDeferredLaunch]) {
+            [aSession launchDeferredProgramIfNeeded];
+            [self performSelector:@selector(_launchNextDeferredSession) withObject:nil afterDelay:0];
+            return;
+        }
+    }
+}
+
 - (NSDictionary *)arrangementExcludingTmuxTabs:(BOOL)excludeTmux
 {
     NSMutableDictionary* result = [NSMutableDictionary dictionaryWithCapacity:7];
@@ -1733,6 +1820,18 @@ NSString *kSessionsKVCKey = @"sessions";
     [[NSNotificationCenter defaultCenter] postNotificationName:@"iTermWindowDidDeminiaturize"
                                                         object:self
                                                       userInfo:nil];
+    for (PTYSession *aSession in [self sessions]) {
+        [aSession updateDisplay];
+    }
+}
+
+- (void)windowDidChangeOcclusionState:(NSNotification *)notification
+{
+    // Sessions stop updating while their window is covered, so bring them up to date once it's
+    // uncovered.
+    for (PTYSession *aSession in [self sessions]) {
+        [aSession updateDisplay];
+    }
 }
 
 - (BOOL)promptOnClose
@@ -2735,6 +2834,9 @@ NSString *kSessionsKVCKey = @"sessions";
 - (void)windowDidEndLiveResize:(NSNotification *)notification
 {
     liveResize_ = NO;
+    if (tmuxResizePending_) {
+        [self notifyTmuxOfPendingWindowResize];
+    }
     BOOL wasZooming = zooming_;
     zooming_ = NO;
     if (wasZooming) {
@@ -3080,6 +3182,7 @@ NSString *kSessionsKVCKey = @"sessions";
 - (void)tabView:(NSTabView *)tabView didSelectTabViewItem:(NSTabViewItem *)tabViewItem
 {
     for (PTYSession* aSession in [[tabViewItem identifier] sessions]) {
+        [aSession launchDeferredProgramIfNeeded];
         [aSession setNewOutput:NO];
 
         // Background tabs' timers run infrequently so make sure the display is
@@ -3510,9 +3613,10 @@ NSString *kSessionsKVCKey = @"sessions";
 - (NSString *)tabView:(NSTabView *)aTabView toolTipForTabViewItem:(NSTabViewItem *)aTabViewItem
 {
         PTYSession *session = [[aTabViewItem identifier] activeSession];
-        return  [NSString stringWithFormat:@"Profile: %@\nCommand: %@",
+        return  [NSString stringWithFormat:@"Profile: %@\nCommand: %@\nActivity: %@",
                                 [[session addressBookEntry] objectForKey:KEY_NAME],
-                                [[session SHELL] command]];
+                                [[session SHELL] command],
+                                [[session activity] shortDescription]];
 }
 
 - (void)tabView:(NSTabView *)tabView doubleClickTabViewItem:(NSTabViewItem *)tabViewItem
@@ -3664,6 +3768,14 @@ NSString *kSessionsKVCKey = @"sessions";
     [earliestTime sizeToFit];
     [latestTime setStringValue:@"Now"];
 
+    // Buffers share a budget, so how far back this one goes depends on the other sessions too.
+    const long long seconds = ([dvr lastTimeStamp] - [dvr firstTimeStamp]) / 1000000;
+    [irSlider setToolTip:[NSString stringWithFormat:@"%lld:%02lld of history in %.1f of %.0f MB",
+                             seconds / 60,
+                             seconds % 60,
+                             [dvr bufferUsedBytes] / 1048576.0,
+                             [dvr maximumBufferCapacity] / 1048576.0]];
+
     // Align the currentTime with the slider
     NSRect f = [currentTime frame];
     NSRect sf = [irSlider frame];
@@ -3771,16 +3883,57 @@ NSString *kSessionsKVCKey = @"sessions";
 }
 
 -(void)replaySession:(PTYSession *)oldSession
+{
+    [self replaySession:oldSession withDvr:[[oldSession SCREEN] dvr]];
+}
+
+- (BOOL)replayRecordingAtPath:(NSString *)path
+{
+    DVR *dvr = [[[DVR alloc] initWithContentsOfFile:path] autorelease];
+    if (!dvr || [dvr lastTimeStamp] == 0) {
+        return NO;
+    }
+    PTYSession *session = [self currentSession];
+    if ([session liveSession]) {
+        [self showLiveSession:[session liveSession] inPlaceOf:session];
+        session = [self currentSession];
+    }
+    [self replaySession:session withDvr:dvr];
+    return YES;
+}
+
+- (BOOL)replayPtyRecordingAtPath:(NSString *)path atOriginalSpeed:(BOOL)originalSpeed
+{
+    PTYRecording *recording = [[[PTYRecording alloc] initWithPath:path] autorelease];
+    NSDictionary *profile = [[self currentSession] addressBookEntry];
+    if (!recording || !profile) {
+        return NO;
+    }
+    PTYSession *session = [[[PTYSession alloc] init] autorelease];
+    [[session SCREEN] setUnlimitedScrollback:[[profile objectForKey:KEY_UNLIMITED_SCROLLBACK] boolValue]];
+    [[session SCREEN] setMaxScrollbackLines:[[profile objectForKey:KEY_SCROLLBACK_LINES] intValue]];
+    [session setAddressBookEntry:profile];
+    [self appendSession:session];
+    if (![session SCREEN]) {
+        return NO;
+    }
+    [session setName:[[path lastPathComponent] stringByDeletingPathExtension]];
+    [session replayPtyRecording:recording atOriginalSpeed:originalSpeed];
+    return YES;
+}
+
+- (void)replaySession:(PTYSession *)oldSession withDvr:(DVR *)dvr
 {
     // NSLog(@"Enter instant replay. Live session is %@", oldSession);
     NSTabViewItem* oldTabViewItem = [TABVIEW selectedTabViewItem];
     if (!oldTabViewItem) {
         return;
     }
-    if ([[[oldSession SCREEN] dvr] lastTimeStamp] == 0) {
+    if ([dvr lastTimeStamp] == 0) {
         // Nothing recorded (not enough memory for one frame, perhaps?).
         return;
     }
+    DLog(@"Instant replay DVR: %@", [dvr statisticsDescription]);
     PTYSession *newSession;
 
     // Initialize a new session
@@ -3796,7 +3949,7 @@ NSString *kSessionsKVCKey = @"sessions";
     // Add this session to our term and make it current
     PTYTab* theTab = [oldTabViewItem identifier];
     [newSession setTab:theTab];
-    [theTab setDvrInSession:newSession];
+    [theTab setDvr:dvr inSession:newSession];
     [newSession release];
     if ([bottomBar isHidden]) {
         [self showHideInstantReplay];
@@ -5953,9 +6106,10 @@ NSString *kSessionsKVCKey = @"sessions";
         if (!newBookmark) {
             newBookmark = [[ProfileModel sessionsInstance] bookmarkWithGuid:guid];
         }
-        if (newBookmark && newBookmark != oldBookmark) {
-            // Same guid but different pointer means it has changed.
-            // The test can have false positives but it should be harmless.
+        if (newBookmark && newBookmark != oldBookmark && ![newBookmark isEqualToDictionary:oldBookmark]) {
+            // Same guid but different pointer means it may have changed. Sessions keep a copy, so
+            // compare the contents to avoid reapplying every setting to every session whenever any
+            // profile is edited.
             [session setPreferencesFromAddressBookEntry:newBookmark];
             [session setAddressBookEntry:newBookmark];
             [[session tab] recheckBlur];
@@ -16,6 +16,10 @@ static NSString *const kPrivateKeyPath = @"~/.ssh/id_rsa";
 
 static NSString *const kSCPFileErrorDomain = @"com.googlecode.iterm2.SCPFile";
 
+// Size of the channel's buffers. NMSSH's default of 16k means a round trip through libssh2 for
+// every 16k of a file.
+static const NSUInteger kSCPFileBufferSize = 256 * 1024;
+
 static NSError *SCPFileError(NSString *description) {
     return [NSError errorWithDomain:kSCPFileErrorDomain
                                code:1
@@ -23,52 +27,26 @@ static NSError *SCPFileError(NSString *description) {
 }
 
 @interface SCPFile () <NMSSHSessionDelegate>
-@property(atomic, assign) NMSSHSession *session;
+@property(atomic, retain) NMSSHSession *session;
 @property(atomic, assign) BOOL stopped;
 @property(atomic, copy) NSString *error;
 @property(atomic, copy) NSString *destination;
-@property(nonatomic, assign) dispatch_queue_t queue;
 @end
 
 @implementation SCPFile {
     BOOL _okToAdd;
     BOOL _downloading;
-    dispatch_queue_t _queue;
-}
-
-- (id)init {
-    self = [super init];
-    if (self) {
-        _queue = dispatch_queue_create("com.googlecode.iterm2.SCPFile", NULL);
-    }
-    return self;
+    BOOL _promptedUser;  // The user answered a prompt while the session connected or authenticated.
+    BOOL _sessionReusable;  // The session may be checked in for the next transfer.
 }
 
 - (void)dealloc {
+    [_session release];
     [_error release];
     [_destination release];
-    dispatch_release(_queue);
     [super dealloc];
 }
 
-- (void)setQueue:(dispatch_queue_t)queue {
-    @synchronized(self) {
-        if (queue != _queue) {
-            dispatch_release(_queue);
-            _queue = queue;
-            if (queue) {
-                dispatch_retain(queue);
-            }
-        }
-    }
-}
-
-- (dispatch_queue_t)queue {
-    @synchronized(self) {
-        return _queue;
-    }
-}
-
 - (NSString *)displayName {
     return [NSString stringWithFormat:@"scp %@@%@:%@", _path.username, _path.hostname, _path.path];
 }
@@ -97,12 +75,23 @@ static NSError *SCPFileError(NSString *description) {
 // This runs in a thread.
 - (void)performTransferWrapper:(BOOL)isDownload {
     [self performTransfer:isDownload];
-    if (self.session && self.session.isConnected) {
-        [self.session disconnect];
+    NMSSHSession *session = self.session;
+    if (session) {
+        session.delegate = nil;
+        if (_sessionReusable && !self.stopped && session.isConnected && session.isAuthorized) {
+            [[FileTransferManager sharedInstance] checkInSession:session forHost:[self sessionKey]];
+        } else if (session.isConnected) {
+            [session disconnect];
+        }
     }
     self.session = nil;
 }
 
+// Transfers with the same key can share a session.
+- (NSString *)sessionKey {
+    return [NSString stringWithFormat:@"%@@%@:%d", self.path.username, [self hostname], [self port]];
+}
+
 - (NSString *)hostname {
     NSArray *hostComponents = [self.path.hostname componentsSeparatedByString:@":"];
     NSInteger components = [hostComponents count];
@@ -157,10 +146,23 @@ static NSError *SCPFileError(NSString *description) {
         });
         return;
     }
+    if (self.stopped) {
+        NSLog(@"Stopped before starting");
+        dispatch_sync(dispatch_get_main_queue(), ^() {
+            [[FileTransferManager sharedInstance] transferrableFileDidStopTransfer:self];
+        });
+        return;
+    }
     _okToAdd = NO;
-    if (self.session) {
+    _promptedUser = NO;
+    _sessionReusable = NO;
+    NMSSHSession *pooledSession = [[FileTransferManager sharedInstance] checkOutSessionForHost:[self sessionKey]];
+    if (pooledSession.isConnected && pooledSession.isAuthorized) {
+        self.session = pooledSession;
         self.session.delegate = self;
     } else {
+        // The server may have closed a session that sat idle.
+        [pooledSession disconnect];
         self.session = [[[NMSSHSession alloc] initWithHost:[self hostname]
                                                       port:[self port]
                                                andUsername:self.path.username] autorelease];
@@ -184,7 +186,8 @@ static NSError *SCPFileError(NSString *description) {
         return;
     }
     
-    if (!self.session.isAuthorized) {
+    const BOOL wasAuthorized = self.session.isAuthorized;
+    if (!wasAuthorized) {
         NSArray *authTypes = [self.session supportedAuthenticationMethods];
         if (!authTypes) {
             authTypes = @[ @"password" ];
@@ -196,6 +199,7 @@ static NSError *SCPFileError(NSString *description) {
             }
             if ([authType isEqualToString:@"password"]) {
                 __block NSString *password;
+                _promptedUser = YES;
                 dispatch_sync(dispatch_get_main_queue(), ^() {
                     password = [[FileTransferManager sharedInstance] transferrableFile:self
                                                              keyboardInteractivePrompt:@"Password:"];
@@ -210,6 +214,7 @@ static NSError *SCPFileError(NSString *description) {
             } else if ([authType isEqualToString:@"keyboard-interactive"]) {
                 [self.session authenticateByKeyboardInteractiveUsingBlock:^NSString *(NSString *request) {
                     __block NSString *response;
+                    _promptedUser = YES;
                     dispatch_sync(dispatch_get_main_queue(), ^() {
                         response = [[FileTransferManager sharedInstance] transferrableFile:self
                                                                  keyboardInteractivePrompt:request];
@@ -227,6 +232,7 @@ static NSError *SCPFileError(NSString *description) {
                                            privateKey:[kPrivateKeyPath stringByExpandingTildeInPath]
                                 optionalPasswordBlock:^NSString *() {
                                     __block NSString *password;
+                                    _promptedUser = YES;
                                     dispatch_sync(dispatch_get_main_queue(), ^() {
                                         password = [[FileTransferManager sharedInstance] transferrableFile:self
                                                                                  keyboardInteractivePrompt:@"Passphrase for private key:"];
@@ -264,6 +270,12 @@ static NSError *SCPFileError(NSString *description) {
     if (_okToAdd) {
         [self.session addCurrentHostToKnownHostsUnhashed];
     }
+    if (!wasAuthorized) {
+        [[FileTransferManager sharedInstance] sessionDidAuthenticateForHost:[self sessionKey]
+                                                              interactively:_promptedUser];
+    }
+    _sessionReusable = YES;
+    self.session.channel.bufferSize = kSCPFileBufferSize;
 
     if (isDownload) {
         NSArray* paths = NSSearchPathForDirectoriesInDomains(NSDownloadsDirectory,
@@ -295,11 +307,7 @@ static NSError *SCPFileError(NSString *description) {
                                             progress:^BOOL (NSUInteger bytes, NSUInteger fileSize) {
                                                 self.bytesTransferred = bytes;
                                                 self.fileSize = fileSize;
-                                                dispatch_sync(dispatch_get_main_queue(), ^() {
-                                                    if (!self.stopped) {
-                                                        [[FileTransferManager sharedInstance] transferrableFileProgressDidChange:self];
-                                                    }
-                                                });
+                                                [[FileTransferManager sharedInstance] transferrableFileProgressDidChangeInBackground:self];
                                                 if (self.stopped) {
                                                     NSLog(@"Stopping mid-download");
                                                 }
@@ -325,6 +333,7 @@ static NSError *SCPFileError(NSString *description) {
             [[NSFileManager defaultManager] removeItemAtPath:tempfile error:NULL];
             self.destination = [finalDestination autorelease];
         } else {
+            _sessionReusable = NO;
             [[NSFileManager defaultManager] removeItemAtPath:tempfile error:NULL];
             if (self.stopped) {
                 dispatch_sync(dispatch_get_main_queue(), ^() {
@@ -348,31 +357,20 @@ static NSError *SCPFileError(NSString *description) {
             [[FileTransferManager sharedInstance] transferrableFile:self
                                      didFinishTransmissionWithError:error];
         });
-        if (!error && self.successor) {
-            SCPFile *scpSuccessor = (SCPFile *)self.successor;
-            scpSuccessor.session = self.session;
-            scpSuccessor.queue = _queue;
-            self.session = nil;
-            self.queue = nil;
-            [scpSuccessor performTransferWrapper:isDownload];
-        }
     } else {
         self.status = kTransferrableFileStatusTransferring;
         BOOL ok = [self.session.channel uploadFile:[self localPath]
                                                 to:self.path.path
                                           progress:^BOOL (NSUInteger bytes) {
                                               self.bytesTransferred = bytes;
-                                              dispatch_sync(dispatch_get_main_queue(), ^() {
-                                                  if (!self.stopped) {
-                                                      [[FileTransferManager sharedInstance] transferrableFileProgressDidChange:self];
-                                                  }
-                                              });
+                                              [[FileTransferManager sharedInstance] transferrableFileProgressDidChangeInBackground:self];
                                               return !self.stopped;
                                           }];
         NSError *error;
         if (ok) {
             error = nil;
         } else {
+            _sessionReusable = NO;
             if (self.stopped) {
                 dispatch_sync(dispatch_get_main_queue(), ^() {
                     [[FileTransferManager sharedInstance] transferrableFileDidStopTransfer:self];
@@ -392,14 +390,6 @@ static NSError *SCPFileError(NSString *description) {
             [[FileTransferManager sharedInstance] transferrableFile:self
                                      didFinishTransmissionWithError:error];
         });
-        if (!error && self.successor) {
-            SCPFile *scpSuccessor = (SCPFile *)self.successor;
-            scpSuccessor.session = self.session;
-            scpSuccessor.queue = _queue;
-            self.session = nil;
-            self.queue = nil;
-            [scpSuccessor performTransferWrapper:isDownload];
-        }
     }
 }
 
@@ -424,11 +414,9 @@ static NSError *SCPFileError(NSString *description) {
     [[[FileTransferManager sharedInstance] files] addObject:self];
     [[FileTransferManager sharedInstance] transferrableFileDidStartTransfer:self];
 
-    if (!self.hasPredecessor) {
-        dispatch_async(_queue, ^() {
-            [self performTransferWrapper:YES];
-        });
-    }
+    [[FileTransferManager sharedInstance] scheduleTransferToHost:[self sessionKey] block:^() {
+        [self performTransferWrapper:YES];
+    }];
 }
 
 - (void)upload {
@@ -437,12 +425,10 @@ static NSError *SCPFileError(NSString *description) {
     self.fileSize = [[[NSFileManager defaultManager] attributesOfItemAtPath:self.localPath error:nil] fileSize];
     [[[FileTransferManager sharedInstance] files] addObject:self];
     [[FileTransferManager sharedInstance] transferrableFileDidStartTransfer:self];
-    
-    if (!self.hasPredecessor) {
-        dispatch_async(_queue, ^() {
-            [self performTransferWrapper:NO];
-        });
-    }
+
+    [[FileTransferManager sharedInstance] scheduleTransferToHost:[self sessionKey] block:^() {
+        [self performTransferWrapper:NO];
+    }];
 }
 
 - (BOOL)isDownloading {
@@ -489,6 +475,7 @@ static NSError *SCPFileError(NSString *description) {
                 break;
         }
         if (message) {
+            _promptedUser = YES;
             result = [[FileTransferManager sharedInstance] transferrableFile:self
                                                               confirmMessage:message];
         }
@@ -498,6 +485,7 @@ static NSError *SCPFileError(NSString *description) {
 
 - (NSString *)session:(NMSSHSession *)session keyboardInteractiveRequest:(NSString *)request {
     __block NSString *string;
+    _promptedUser = YES;
     dispatch_sync(dispatch_get_main_queue(), ^() {
         string = [[FileTransferManager sharedInstance] transferrableFile:self
                                                keyboardInteractivePrompt:request];
@@ -0,0 +1,33 @@
+//
+//  SPSCQueue.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+// A bounded ring of pointers with one producer thread and one consumer thread, which never lock
+// or wait for each other. Each side only writes its own index, and a memory barrier publishes a
+// slot before the index that hands it over. Several producers may share a queue if something
+// else serializes them.
+typedef struct {
+    void **slots;
+    int32_t capacity;  // A power of two.
+    volatile int64_t head;  // Next slot to pop. Written only by the consumer.
+    volatile int64_t tail;  // Next slot to push. Written only by the producer.
+    int32_t maxDepth;  // The most items it has held, for tuning. Written only by the producer.
+} SPSCQueue;
+
+// |capacity| is rounded up to a power of two.
+void SPSCQueueInit(SPSCQueue *queue, int32_t capacity);
+
+// The queue must be empty, or hold nothing that needs freeing.
+void SPSCQueueFree(SPSCQueue *queue);
+
+// Producer only. Returns NO, leaving the queue unchanged, if it's full.
+BOOL SPSCQueuePush(SPSCQueue *queue, void *item);
+
+// Consumer only. Returns NULL if the queue is empty.
+void *SPSCQueuePop(SPSCQueue *queue);
+
+// May be called on any thread, though the answer may be out of date by the time it returns.
+int32_t SPSCQueueDepth(const SPSCQueue *queue);
@@ -0,0 +1,61 @@
+//
+//  SPSCQueue.m
+//  iTerm
+//
+
+#import "SPSCQueue.h"
+#include <libkern/OSAtomic.h>
+
+void SPSCQueueInit(SPSCQueue *queue, int32_t capacity) {
+    int32_t size = 1;
+    while (size < capacity) {
+        size *= 2;
+    }
+    queue->slots = calloc(size, sizeof(void *));
+    queue->capacity = size;
+    queue->head = 0;
+    queue->tail = 0;
+    queue->maxDepth = 0;
+}
+
+void SPSCQueueFree(SPSCQueue *queue) {
+    free(queue->slots);
+    queue->slots = NULL;
+    queue->capacity = 0;
+}
+
+BOOL SPSCQueuePush(SPSCQueue *queue, void *item) {
+    const int64_t tail = queue->tail;
+    const int32_t depth = (int32_t)(tail - queue->head);
+    if (depth >= queue->capacity) {
+        return NO;
+    }
+    queue->slots[tail & (queue->capacity - 1)] = item;
+    // The slot must be visible before the consumer can see the new tail.
+    OSMemoryBarrier();
+    queue->tail = tail + 1;
+    if (depth + 1 > queue->maxDepth) {
+        queue->maxDepth = depth + 1;
+    }
+    return YES;
+}
+
+void *SPSCQueuePop(SPSCQueue *queue) {
+    const int64_t head = queue->head;
+    if (head == queue->tail) {
+        return NULL;
+    }
+    // Don't read the slot before the tail that published it.
+    OSMemoryBarrier();
+    void *item = queue->slots[head & (queue->capacity - 1)];
+    // The slot must be read before the producer can see it's free.
+    OSMemoryBarrier();
+    queue->head = head + 1;
+    return item;
+}
+
+int32_t SPSCQueueDepth(const SPSCQueue *queue) {
+    const int64_t head = queue->head;
+    const int64_t tail = queue->tail;
+    return (int32_t)(tail - head);
+}
@@ -130,8 +130,9 @@ typedef struct screen_char_t
 
     // If set, the 'code' field does not give a utf-16 value but is intead a
     // key into a string table of more complex chars (combined, surrogate pairs,
-    // etc.). Valid 'code' values for a complex char are in [1, 0xefff] and will
-    // be recycled as needed.
+    // etc.). Valid 'code' values for a complex char are in [1, 0xefff]. Those
+    // in [0xe000, 0xefff] are U+1F000-U+1FFFF, offset from 0xe000, and need no
+    // string table lookup. The rest will be recycled as needed.
     unsigned int complexChar : 1;
 
     // Various bits affecting text appearance. The bold flag here is semantic
@@ -159,6 +160,17 @@ typedef struct screen_char_t
 @property (nonatomic, assign) int eol;
 @end
 
+// A read-only view of a line of |width| cells that points at its chars where they're stored
+// instead of copying them. The first |length| cells are at |chars| and the rest are |padding|,
+// except that when eol is EOL_DWC the last cell is a DWC_SKIP. The pointer is good until the
+// screen or scrollback next changes.
+typedef struct {
+    const screen_char_t *chars;
+    int length;
+    int eol;  // EOL_SOFT, EOL_HARD, or EOL_DWC
+    screen_char_t padding;
+} ScreenCharLineView;
+
 // Standard unicode replacement string. Is a double-width character.
 static inline NSString* ReplacementString()
 {
@@ -166,6 +178,58 @@ static inline NSString* ReplacementString()
     return [NSString stringWithCharacters:&kReplacementCharacter length:1];
 }
 
+// Sets |count| chars starting at |buffer| to |template|. The copied region doubles each step, so
+// this is a handful of large memcpys rather than one bitfield-by-bitfield copy per char.
+static inline void FillScreenChars(screen_char_t *buffer, int count, const screen_char_t template)
+{
+    if (count <= 0) {
+        return;
+    }
+    buffer[0] = template;
+    int filled = 1;
+    while (filled < count) {
+        int n = MIN(filled, count - filled);
+        memcpy(buffer + filled, buffer, n * sizeof(screen_char_t));
+        filled += n;
+    }
+}
+
+// Sets the bits of |count| chars starting at |buffer| that are set in |mask| to those of |template|
+// and leaves the rest alone. The template and mask are repeated to fill a block of whole chars that
+// is a multiple of 8 bytes long, so the merge goes a word (or vector) at a time instead of a
+// bitfield at a time.
+static inline void MergeScreenChars(screen_char_t *buffer,
+                                    int count,
+                                    const screen_char_t template,
+                                    const screen_char_t mask)
+{
+    enum {
+        kBlockChars = 16,
+        kBlockWords = kBlockChars * sizeof(screen_char_t) / sizeof(uint64_t)
+    };
+    uint64_t templateWords[kBlockWords];
+    uint64_t maskWords[kBlockWords];
+    FillScreenChars((screen_char_t *)templateWords, kBlockChars, template);
+    FillScreenChars((screen_char_t *)maskWords, kBlockChars, mask);
+    int i = 0;
+    for (; i + kBlockChars <= count; i += kBlockChars) {
+        uint64_t words[kBlockWords];
+        memcpy(words, buffer + i, sizeof(words));
+        for (int j = 0; j < kBlockWords; j++) {
+            words[j] = (words[j] & ~maskWords[j]) | (templateWords[j] & maskWords[j]);
+        }
+        memcpy(buffer + i, words, sizeof(words));
+    }
+    const unsigned char *templateBytes = (const unsigned char *)&template;
+    const unsigned char *maskBytes = (const unsigned char *)&mask;
+    for (; i < count; i++) {
+        unsigned char *bytes = (unsigned char *)(buffer + i);
+        for (int j = 0; j < (int)sizeof(screen_char_t); j++) {
+            bytes[j] = (bytes[j] & ~maskBytes[j]) | (templateBytes[j] & maskBytes[j]);
+        }
+    }
+}
+
 // Copy foreground color from one char to another.
 static inline void CopyForegroundColor(screen_char_t* to, const screen_char_t from)
 {
@@ -271,6 +335,10 @@ int BeginComplexChar(unichar initialCodePoint, unichar combiningChar);
 // Create or lookup & return the code for a complex char.
 int GetOrSetComplexChar(NSString* str);
 
+// Returns the bytes allocated for the complex char table and sets *numberOfKeysInUse to the number
+// of keys that currently hold a string, if it's not NULL.
+long long ComplexCharTableBytes(int *numberOfKeysInUse);
+
 // Returns true if the given character is a combining mark, per chapter 3 of
 // the Unicode 6.0 spec, D52.
 BOOL IsCombiningMark(UTF32Char c);
@@ -327,6 +395,18 @@ void StringToScreenChars(NSString *s,
                          BOOL ambiguousIsDoubleWidth,
                          int* cursorIndex);
 
+// Like StringToScreenChars, but converts |length| UTF-16 code units from |chars|. The code units
+// are classified with a table built on first use, and runs of chars that each take one cell are
+// copied without further checks.
+void UnicharsToScreenChars(const unichar *chars,
+                           int length,
+                           screen_char_t *buf,
+                           screen_char_t fg,
+                           screen_char_t bg,
+                           int *len,
+                           BOOL ambiguousIsDoubleWidth,
+                           int *cursorIndex);
+
 // Translates normal characters into graphics characters, as defined in charsets.h. Must not contain
 // complex characters.
 void ConvertCharsToGraphicsCharset(screen_char_t *s, int len);
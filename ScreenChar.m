@@ -31,16 +31,49 @@
 
 #import "ScreenChar.h"
 #import "charmaps.h"
-
-// Maps codes to strings
-static NSMutableDictionary* complexCharMap;
-// Maps strings to codes.
-static NSMutableDictionary* inverseComplexCharMap;
-// Next available code.
-static int ccmNextKey = 1;
-// If ccmNextKey has wrapped then this is set to true and we have to delete old
-// strings before creating a new one with a recycled code.
-static BOOL hasWrapped = NO;
+#import <libkern/OSAtomic.h>
+
+// The complex char table. Each key below kNumComplexCharKeys indexes an entry holding the
+// string's UTF-16 chars, stored in pages that are allocated as needed and never freed. Looking up
+// a key takes no lock: a reader that races with a key being reused may see a mix of old and new
+// chars, but never freed memory. Interning a string takes complexCharLock and goes through an
+// open-addressed hash of keys.
+//
+// Keys are handed out in order and then reused from a free list. When both run out, the least
+// recently used eighth of the keys is reclaimed. Every lookup stamps the entry with the current
+// epoch, so chars that are still being drawn, searched, or written keep their keys; only strings
+// that haven't been touched in a long time (typically ones whose lines have left the scrollback)
+// give theirs up.
+typedef struct {
+    uint32_t lastUse;  // complexCharEpoch when last looked up or interned.
+    uint8_t length;  // 0 if the key isn't in use.
+    unichar chars[kMaxParts];
+} ComplexCharEntry;
+
+// Keys from kFirstDirectComplexCharKey up to the special codes at DWC_SKIP aren't in the table.
+// Each one stands for a code point in U+1F000-U+1FFFF, the planes' worth of emoji, mahjong and
+// playing card symbols, as the key's offset from kFirstDirectComplexCharKey. Such a char is
+// stored, drawn, and searched with arithmetic alone and never uses up a table key.
+static const int kFirstDirectComplexCharKey = 0xe000;
+static const UTF32Char kFirstDirectComplexChar = 0x1f000;
+static const int kNumDirectComplexChars = DWC_SKIP - kFirstDirectComplexCharKey;
+
+static const int kNumComplexCharKeys = kFirstDirectComplexCharKey;
+static const int kComplexCharPageSizeLog2 = 8;
+static const int kComplexCharPageSize = 1 << kComplexCharPageSizeLog2;
+static const int kNumComplexCharPages = kNumComplexCharKeys / kComplexCharPageSize;
+static ComplexCharEntry *volatile complexCharPages[kNumComplexCharPages];
+
+// Hash of string to key. 0 marks an empty slot. Kept under half full.
+static const int kComplexCharHashSize = 1 << 17;
+static uint16_t *complexCharHash;
+
+static volatile uint32_t complexCharEpoch;
+static int complexCharNextKey = 1;  // Next key that has never been used.
+static uint16_t *complexCharFreeKeys;
+static int complexCharNumFreeKeys;
+
+static OSSpinLock complexCharLock = OS_SPINLOCK_INIT;
 
 @implementation ScreenCharArray
 @synthesize line = _line;
@@ -48,29 +81,213 @@ static BOOL hasWrapped = NO;
 @synthesize eol = _eol;
 @end
 
-static void CreateComplexCharMapIfNeeded() {
-    if (!complexCharMap) {
-        complexCharMap = [[NSMutableDictionary alloc] initWithCapacity:1000];
+// Returns the entry for a key, or NULL if its page was never allocated. Takes no lock.
+static ComplexCharEntry *ComplexCharEntryForKey(int key) {
+    if (key <= 0 || key >= kNumComplexCharKeys) {
+        return NULL;
+    }
+    ComplexCharEntry *page = complexCharPages[key >> kComplexCharPageSizeLog2];
+    if (!page) {
+        return NULL;
+    }
+    return page + (key & (kComplexCharPageSize - 1));
+}
+
+// Must be called with complexCharLock held, or before the table is shared.
+static ComplexCharEntry *ComplexCharEntryCreatingPage(int key) {
+    ComplexCharEntry *entry = ComplexCharEntryForKey(key);
+    if (!entry) {
+        ComplexCharEntry *page = calloc(kComplexCharPageSize, sizeof(ComplexCharEntry));
+        // Make the zeroed page visible before the pointer to it.
+        OSMemoryBarrier();
+        complexCharPages[key >> kComplexCharPageSizeLog2] = page;
+        entry = page + (key & (kComplexCharPageSize - 1));
+    }
+    return entry;
+}
+
+static BOOL ComplexCharKeyIsReserved(int k);
+
+static void CreateComplexCharTableIfNeeded() {
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        complexCharHash = calloc(kComplexCharHashSize, sizeof(uint16_t));
+        complexCharFreeKeys = malloc(kNumComplexCharKeys * sizeof(uint16_t));
         // Add box-drawing chars, which are reserved. They are drawn using
         // bezier paths but it's important that the keys refer to an existing
-        // string for general correctness.
+        // string for general correctness. They are never hashed or reclaimed.
         for (int i = 0; i < 256; i++) {
             if (lineDrawingCharFlags[i]) {
-                complexCharMap[@(charmap[i])] = [NSString stringWithFormat:@"%C", charmap[i]];
+                ComplexCharEntry *entry = ComplexCharEntryCreatingPage(charmap[i]);
+                entry->chars[0] = charmap[i];
+                entry->length = 1;
             }
         }
-        inverseComplexCharMap = [[NSMutableDictionary alloc] initWithCapacity:1000];
+    });
+}
+
+static uint32_t ComplexCharHashOf(const unichar *chars, int length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash = (hash ^ chars[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Returns the hash slot holding the key for these chars, or the empty slot where it belongs. Must
+// be called with complexCharLock held.
+static int ComplexCharHashSlot(const unichar *chars, int length) {
+    int slot = ComplexCharHashOf(chars, length) & (kComplexCharHashSize - 1);
+    while (complexCharHash[slot]) {
+        ComplexCharEntry *entry = ComplexCharEntryForKey(complexCharHash[slot]);
+        if (entry->length == length && !memcmp(entry->chars, chars, length * sizeof(unichar))) {
+            break;
+        }
+        slot = (slot + 1) & (kComplexCharHashSize - 1);
+    }
+    return slot;
+}
+
+// Removes a key from the hash, shifting later keys in its probe run back so lookups still find
+// them. Must be called with complexCharLock held.
+static void ComplexCharHashRemove(int key) {
+    ComplexCharEntry *entry = ComplexCharEntryForKey(key);
+    int hole = ComplexCharHashSlot(entry->chars, entry->length);
+    int slot = hole;
+    while (1) {
+        slot = (slot + 1) & (kComplexCharHashSize - 1);
+        int other = complexCharHash[slot];
+        if (!other) {
+            break;
+        }
+        ComplexCharEntry *otherEntry = ComplexCharEntryForKey(other);
+        int home = ComplexCharHashOf(otherEntry->chars, otherEntry->length) & (kComplexCharHashSize - 1);
+        // Move |other| into the hole unless its home lies cyclically in (hole, slot].
+        BOOL homeBetween = (hole <= slot) ? (home > hole && home <= slot)
+                                          : (home > hole || home <= slot);
+        if (!homeBetween) {
+            complexCharHash[hole] = other;
+            hole = slot;
+        }
+    }
+    complexCharHash[hole] = 0;
+}
+
+static int CompareEpochs(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Frees the least recently used eighth of the keys. Must be called with complexCharLock held.
+static void ReclaimComplexCharKeys() {
+    uint32_t *ages = malloc(kNumComplexCharKeys * sizeof(uint32_t));
+    int n = 0;
+    for (int key = 1; key < kNumComplexCharKeys; key++) {
+        ComplexCharEntry *entry = ComplexCharEntryForKey(key);
+        if (entry && entry->length && !ComplexCharKeyIsReserved(key)) {
+            // Age rather than raw epoch so the epoch wrapping around doesn't matter.
+            ages[n++] = complexCharEpoch - entry->lastUse;
+        }
+    }
+    qsort(ages, n, sizeof(uint32_t), CompareEpochs);
+    const uint32_t minAge = ages[n - n / 8 - 1];
+    free(ages);
+
+    for (int key = 1; key < kNumComplexCharKeys; key++) {
+        ComplexCharEntry *entry = ComplexCharEntryForKey(key);
+        if (entry && entry->length && !ComplexCharKeyIsReserved(key) &&
+            complexCharEpoch - entry->lastUse >= minAge) {
+            ComplexCharHashRemove(key);
+            // The chars are left in place in case a line still refers to the key.
+            complexCharFreeKeys[complexCharNumFreeKeys++] = key;
+        }
     }
 }
 
+// Returns the direct key for a surrogate pair in U+1F000-U+1FFFF, or 0 if the chars aren't one.
+static int DirectComplexCharKey(const unichar *chars, int length) {
+    if (length != 2 || !IsHighSurrogate(chars[0]) || !IsLowSurrogate(chars[1])) {
+        return 0;
+    }
+    UTF32Char c = DecodeSurrogatePair(chars[0], chars[1]);
+    if (c < kFirstDirectComplexChar || c >= kFirstDirectComplexChar + kNumDirectComplexChars) {
+        return 0;
+    }
+    return kFirstDirectComplexCharKey + (c - kFirstDirectComplexChar);
+}
+
+// Returns the key for a string, adding it if needed. Must be called with complexCharLock held.
+static int InternComplexChar(const unichar *chars, int length) {
+    CreateComplexCharTableIfNeeded();
+    length = MIN(length, kMaxParts);
+    const uint32_t epoch = ++complexCharEpoch;
+    int slot = ComplexCharHashSlot(chars, length);
+    if (complexCharHash[slot]) {
+        int key = complexCharHash[slot];
+        ComplexCharEntryForKey(key)->lastUse = epoch;
+        return key;
+    }
+
+    int key;
+    if (complexCharNumFreeKeys == 0) {
+        while (complexCharNextKey < kNumComplexCharKeys &&
+               ComplexCharKeyIsReserved(complexCharNextKey)) {
+            complexCharNextKey++;
+        }
+        if (complexCharNextKey == kNumComplexCharKeys) {
+            ReclaimComplexCharKeys();
+            // Reclaiming may have moved keys around in the hash.
+            slot = ComplexCharHashSlot(chars, length);
+        }
+    }
+    if (complexCharNumFreeKeys > 0) {
+        key = complexCharFreeKeys[--complexCharNumFreeKeys];
+    } else {
+        key = complexCharNextKey++;
+    }
+
+    ComplexCharEntry *entry = ComplexCharEntryCreatingPage(key);
+    memcpy(entry->chars, chars, length * sizeof(unichar));
+    entry->length = length;
+    entry->lastUse = epoch;
+    complexCharHash[slot] = key;
+    return key;
+}
+
+// Copies a complex char's chars to dest, which must have room for kMaxParts, and returns how
+// many there are. Returns 0 for an unknown key. Takes no lock.
+static int CopyComplexChar(int key, unichar *dest) {
+    if (key >= kFirstDirectComplexCharKey && key < DWC_SKIP) {
+        UTF32Char c = kFirstDirectComplexChar + (key - kFirstDirectComplexCharKey) - 0x10000;
+        dest[0] = 0xd800 + (c >> 10);
+        dest[1] = 0xdc00 + (c & 0x3ff);
+        return 2;
+    }
+    CreateComplexCharTableIfNeeded();
+    ComplexCharEntry *entry = ComplexCharEntryForKey(key);
+    if (!entry) {
+        return 0;
+    }
+    entry->lastUse = complexCharEpoch;
+    int length = MIN(entry->length, kMaxParts);
+    memcpy(dest, entry->chars, length * sizeof(unichar));
+    return length;
+}
+
 NSString* ComplexCharToStr(int key)
 {
     if (key == UNICODE_REPLACEMENT_CHAR) {
         return ReplacementString();
     }
 
-    CreateComplexCharMapIfNeeded();
-    return [complexCharMap objectForKey:[NSNumber numberWithInt:key]];
+    unichar chars[kMaxParts];
+    int length = CopyComplexChar(key, chars);
+    if (!length) {
+        return nil;
+    }
+    return [NSString stringWithCharacters:chars length:length];
 }
 
 NSString* ScreenCharToStr(screen_char_t* sct)
@@ -92,29 +309,31 @@ NSString* CharToStr(unichar code, BOOL isComplex)
 }
 
 int ExpandScreenChar(screen_char_t* sct, unichar* dest) {
-    NSString* value = nil;
     if (sct->code == UNICODE_REPLACEMENT_CHAR) {
-        value = ReplacementString();
+        NSString* value = ReplacementString();
+        [value getCharacters:dest];
+        return (int)[value length];
     } else if (sct->complexChar) {
-        value = ComplexCharToStr(sct->code);
+        int length = CopyComplexChar(sct->code, dest);
+        assert(length);
+        return length;
     } else {
         *dest = sct->code;
         return 1;
     }
-    assert(value);
-    [value getCharacters:dest];
-    return (int)[value length];
 }
 
 UTF32Char CharToLongChar(unichar code, BOOL isComplex)
 {
-    NSString* aString = CharToStr(code, isComplex);
-    unichar firstChar = [aString characterAtIndex:0];
-    if (IsHighSurrogate(firstChar) && [aString length] >= 2) {
-        unichar secondChar = [aString characterAtIndex:0];
-        return DecodeSurrogatePair(firstChar, secondChar);
+    if (!isComplex || code == UNICODE_REPLACEMENT_CHAR) {
+        return code;
+    }
+    unichar chars[kMaxParts];
+    int length = CopyComplexChar(code, chars);
+    if (length >= 2 && IsHighSurrogate(chars[0])) {
+        return DecodeSurrogatePair(chars[0], chars[1]);
     } else {
-        return firstChar;
+        return length ? chars[0] : 0;
     }
 }
 
@@ -138,33 +357,39 @@ static BOOL ComplexCharKeyIsReserved(int k) {
     }
 }
 
-int GetOrSetComplexChar(NSString* str)
+long long ComplexCharTableBytes(int *numberOfKeysInUse)
 {
-    CreateComplexCharMapIfNeeded();
-    NSNumber* number = [inverseComplexCharMap objectForKey:str];
-    if (number) {
-        return [number intValue];
-    }
-
-    int newKey;
-    do {
-        newKey = ccmNextKey++;
-    } while (ComplexCharKeyIsReserved(newKey));
-
-    number = @(newKey);
-    if (hasWrapped) {
-        NSString* oldStr = complexCharMap[number];
-        if (oldStr) {
-            [inverseComplexCharMap removeObjectForKey:oldStr];
+    long long total = 0;
+    OSSpinLockLock(&complexCharLock);
+    for (int i = 0; i < kNumComplexCharPages; i++) {
+        if (complexCharPages[i]) {
+            total += kComplexCharPageSize * sizeof(ComplexCharEntry);
         }
     }
-    complexCharMap[number] = str;
-    inverseComplexCharMap[str] = number;
-    if (ccmNextKey == 0xf000) {
-        ccmNextKey = 1;
-        hasWrapped = YES;
+    if (complexCharHash) {
+        total += kComplexCharHashSize * sizeof(uint16_t);
+        total += kNumComplexCharKeys * sizeof(uint16_t);  // complexCharFreeKeys
     }
-    return newKey;
+    if (numberOfKeysInUse) {
+        *numberOfKeysInUse = complexCharNextKey - 1 - complexCharNumFreeKeys;
+    }
+    OSSpinLockUnlock(&complexCharLock);
+    return total;
+}
+
+int GetOrSetComplexChar(NSString* str)
+{
+    unichar chars[kMaxParts];
+    const int length = MIN((int)[str length], kMaxParts);
+    [str getCharacters:chars range:NSMakeRange(0, length)];
+    int directKey = DirectComplexCharKey(chars, length);
+    if (directKey) {
+        return directKey;
+    }
+    OSSpinLockLock(&complexCharLock);
+    int key = InternComplexChar(chars, length);
+    OSSpinLockUnlock(&complexCharLock);
+    return key;
 }
 
 int AppendToComplexChar(int key, unichar codePoint)
@@ -173,17 +398,24 @@ int AppendToComplexChar(int key, unichar codePoint)
         return UNICODE_REPLACEMENT_CHAR;
     }
 
-    NSString* str = [complexCharMap objectForKey:[NSNumber numberWithInt:key]];
-    if ([str length] == kMaxParts) {
-        NSLog(@"Warning: char <<%@>> with key %d reached max length %d", str,
-              key, kMaxParts);
+    unichar chars[kMaxParts];
+    int length = CopyComplexChar(key, chars);
+    assert(length);
+    if (length == kMaxParts) {
+        NSLog(@"Warning: char <<%@>> with key %d reached max length %d",
+              [NSString stringWithCharacters:chars length:length], key, kMaxParts);
         return key;
     }
-    assert(str);
-    NSMutableString* temp = [NSMutableString stringWithString:str];
-    [temp appendString:[NSString stringWithCharacters:&codePoint length:1]];
+    chars[length++] = codePoint;
+    int directKey = DirectComplexCharKey(chars, length);
+    if (directKey) {
+        return directKey;
+    }
 
-    return GetOrSetComplexChar(temp);
+    OSSpinLockLock(&complexCharLock);
+    int newKey = InternComplexChar(chars, length);
+    OSSpinLockUnlock(&complexCharLock);
+    return newKey;
 }
 
 int BeginComplexChar(unichar initialCodePoint, unichar combiningChar)
@@ -195,7 +427,14 @@ int BeginComplexChar(unichar initialCodePoint, unichar combiningChar)
     unichar temp[2];
     temp[0] = initialCodePoint;
     temp[1] = combiningChar;
-    return GetOrSetComplexChar([NSString stringWithCharacters:temp length:2]);
+    int directKey = DirectComplexCharKey(temp, 2);
+    if (directKey) {
+        return directKey;
+    }
+    OSSpinLockLock(&complexCharLock);
+    int key = InternComplexChar(temp, 2);
+    OSSpinLockUnlock(&complexCharLock);
+    return key;
 }
 
 BOOL StringContainsCombiningMark(NSString *s)
@@ -435,156 +674,158 @@ int EffectiveLineLength(screen_char_t* theLine, int totalLength) {
     return 0;
 }
 
-// Convert a string into an array of screen characters, dealing with surrogate
-// pairs, combining marks, nonspacing marks, and double-width characters.
-void StringToScreenChars(NSString *s,
-                         screen_char_t *buf,
-                         screen_char_t fg,
-                         screen_char_t bg,
-                         int *len,
-                         BOOL ambiguousIsDoubleWidth,
-                         int* cursorIndex) {
-    unichar *sc;
-    int l = [s length];
-    int i;
-    int j;
-
-    const int kBufferElements = 1024;
-    unichar staticBuffer[kBufferElements];
-    unichar* dynamicBuffer = 0;
-    if ([s length] > kBufferElements) {
-        sc = dynamicBuffer = (unichar *) calloc(l, sizeof(unichar));
-    } else {
-        sc = staticBuffer;
+// Properties of a UTF-16 code unit that keep it from simply taking one cell of its own.
+enum {
+    kCodeUnitPropertyWide = 1 << 0,
+    kCodeUnitPropertyAmbiguousWidth = 1 << 1,  // Double-width only if ambiguous chars are.
+    kCodeUnitPropertyCombiningMark = 1 << 2,
+    kCodeUnitPropertyHighSurrogate = 1 << 3,
+    kCodeUnitPropertyLowSurrogate = 1 << 4,
+    kCodeUnitPropertyZeroWidth = 1 << 5,
+    kCodeUnitPropertyPrivate = 1 << 6  // One of iTerm2's private codes.
+};
+
+static unsigned char codeUnitProperties[65536];
+
+static void BuildCodeUnitProperties(void) {
+    for (int c = 0xa1; c < 65536; c++) {
+        unsigned char properties = 0;
+        if (IsCombiningMark(c)) {
+            properties |= kCodeUnitPropertyCombiningMark;
+        }
+        if ([NSString isDoubleWidthCharacter:c ambiguousIsDoubleWidth:NO]) {
+            properties |= kCodeUnitPropertyWide;
+        } else if ([NSString isDoubleWidthCharacter:c ambiguousIsDoubleWidth:YES]) {
+            properties |= kCodeUnitPropertyAmbiguousWidth;
+        }
+        codeUnitProperties[c] = properties;
+    }
+    for (int c = 0xd800; c <= 0xdbff; c++) {
+        codeUnitProperties[c] |= kCodeUnitPropertyHighSurrogate;
     }
+    for (int c = 0xdc00; c <= 0xdfff; c++) {
+        codeUnitProperties[c] |= kCodeUnitPropertyLowSurrogate;
+    }
+    codeUnitProperties[0xfeff] |= kCodeUnitPropertyZeroWidth;  // zero width no-break space
+    codeUnitProperties[0x200b] |= kCodeUnitPropertyZeroWidth;  // zero width space
+    codeUnitProperties[0x200c] |= kCodeUnitPropertyZeroWidth;  // zero width non-joiner
+    codeUnitProperties[0x200d] |= kCodeUnitPropertyZeroWidth;  // zero width joiner
+    for (int c = ITERM2_PRIVATE_BEGIN; c <= ITERM2_PRIVATE_END; c++) {
+        codeUnitProperties[c] |= kCodeUnitPropertyPrivate;
+    }
+}
 
-    [s getCharacters:sc];
-    int lastInitializedChar = -1;
+void UnicharsToScreenChars(const unichar *sc,
+                           int l,
+                           screen_char_t *buf,
+                           screen_char_t fg,
+                           screen_char_t bg,
+                           int *len,
+                           BOOL ambiguousIsDoubleWidth,
+                           int *cursorIndex) {
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        BuildCodeUnitProperties();
+    });
+
+    // Every cell starts as a copy of this.
+    screen_char_t prototype;
+    memset(&prototype, 0, sizeof(prototype));
+    prototype.foregroundColor = fg.foregroundColor;
+    prototype.fgGreen = fg.fgGreen;
+    prototype.fgBlue = fg.fgBlue;
+    prototype.backgroundColor = bg.backgroundColor;
+    prototype.bgGreen = bg.bgGreen;
+    prototype.bgBlue = bg.bgBlue;
+    prototype.foregroundColorMode = fg.foregroundColorMode;
+    prototype.backgroundColorMode = bg.backgroundColorMode;
+    prototype.bold = fg.bold;
+    prototype.italic = fg.italic;
+    prototype.blink = fg.blink;
+    prototype.underline = fg.underline;
+
+    // Ambiguous-width chars are ordinary unless they're double-width.
+    const unsigned char wideMask =
+        kCodeUnitPropertyWide | (ambiguousIsDoubleWidth ? kCodeUnitPropertyAmbiguousWidth : 0);
+    const unsigned char specialMask =
+        ambiguousIsDoubleWidth ? 0xff : (unsigned char)~kCodeUnitPropertyAmbiguousWidth;
+
+    int i = 0;
+    int j = 0;
     BOOL foundCursor = NO;
-    for (i = j = 0; i < l; i++, j++) {
-        // j may repeat in consecutive iterations of the loop but i increases
-        // monotonically, so initialize complexChar with i instead of j.
-        buf[i].complexChar = NO;
+    while (i < l) {
+        // Copy the run of chars that each take one cell of their own. This is nearly all text.
+        int runEnd = i;
+        while (runEnd < l && !(codeUnitProperties[sc[runEnd]] & specialMask)) {
+            runEnd++;
+        }
+        if (cursorIndex && !foundCursor && *cursorIndex >= i && *cursorIndex < runEnd) {
+            foundCursor = YES;
+            *cursorIndex = j + *cursorIndex - i;
+        }
+        const int runLength = runEnd - i;
+        for (int k = 0; k < runLength; k++) {
+            buf[j + k] = prototype;
+            buf[j + k].code = sc[i + k];
+        }
+        i = runEnd;
+        j += runLength;
+        if (i == l) {
+            break;
+        }
 
         if (cursorIndex && !foundCursor && *cursorIndex == i) {
             foundCursor = YES;
             *cursorIndex = j;
         }
-        if (j > lastInitializedChar) {
-            buf[j].code = sc[i];
-            buf[j].complexChar = NO;
-
-            buf[j].foregroundColor = fg.foregroundColor;
-            buf[j].fgGreen = fg.fgGreen;
-            buf[j].fgBlue = fg.fgBlue;
-
-            buf[j].backgroundColor = bg.backgroundColor;
-            buf[j].bgGreen = bg.bgGreen;
-            buf[j].bgBlue = bg.bgBlue;
-
-            buf[j].foregroundColorMode = fg.foregroundColorMode;
-            buf[j].backgroundColorMode = bg.backgroundColorMode;
-
-            buf[j].bold = fg.bold;
-            buf[j].italic = fg.italic;
-            buf[j].blink = fg.blink;
-            buf[j].underline = fg.underline;
-
-            buf[j].unused = 0;
-            lastInitializedChar = j;
-        }
-
-        if (sc[i] >= ITERM2_PRIVATE_BEGIN && sc[i] <= ITERM2_PRIVATE_END) {
+        const unichar c = sc[i++];
+        const unsigned char properties = codeUnitProperties[c];
+        if (properties & kCodeUnitPropertyPrivate) {
             // Translate iTerm2's private-use characters into a "?". Although the replacement
             // character renders as a double-width char in a single-width char's space and is ugly,
             // some fonts use dwc's to add extra glyphs. It's kinda sketch, but it's better form to
             // render what you get than to try to be clever and break such edge cases.
-            buf[j].code = '?';
-        } else if (sc[i] > 0xa0 &&
-                   !IsCombiningMark(sc[i]) &&
-                   !IsLowSurrogate(sc[i]) &&
-                   !IsHighSurrogate(sc[i]) &&
-                   [NSString isDoubleWidthCharacter:sc[i]
-                             ambiguousIsDoubleWidth:ambiguousIsDoubleWidth]) {
+            buf[j] = prototype;
+            buf[j++].code = '?';
+        } else if ((properties & wideMask) &&
+                   !(properties & (kCodeUnitPropertyCombiningMark |
+                                   kCodeUnitPropertyHighSurrogate |
+                                   kCodeUnitPropertyLowSurrogate))) {
             // This code path is for double-width characters in BMP only.
-            j++;
-            buf[j].code = DWC_RIGHT;
-            buf[j].complexChar = NO;
-
-            buf[j].foregroundColor = fg.foregroundColor;
-            buf[j].fgGreen = fg.fgGreen;
-            buf[j].fgBlue = fg.fgBlue;
-
-            buf[j].backgroundColor = bg.backgroundColor;
-            buf[j].bgGreen = bg.fgGreen;
-            buf[j].bgBlue = bg.fgBlue;
-
-            buf[j].foregroundColorMode = fg.foregroundColorMode;
-            buf[j].backgroundColorMode = bg.backgroundColorMode;
-
-            buf[j].bold = fg.bold;
-            buf[j].italic = fg.italic;
-            buf[j].blink = fg.blink;
-            buf[j].underline = fg.underline;
-
-            buf[j].unused = 0;
-        } else if (sc[i] == 0xfeff ||  // zero width no-break space
-                   sc[i] == 0x200b ||  // zero width space
-                   sc[i] == 0x200c ||  // zero width non-joiner
-                   sc[i] == 0x200d) {  // zero width joiner
-            j--;
-            lastInitializedChar--;
-        } else if (IsCombiningMark(sc[i]) || IsLowSurrogate(sc[i])) {
-            if (j > 0) {
-                BOOL movedBackOverDwcRight = NO;
-                j--;
-                if (buf[j].code == DWC_RIGHT && j > 0 && IsCombiningMark(sc[i])) {
-                    // This happens easily with ambiguous-width characters, where something like
-                    // á is treated as double-width and a subsequent combining mark needs to modify
-                    // at the real code, not the DWC_RIGHT.
-                    j--;
-                    movedBackOverDwcRight = YES;
-                }
-                lastInitializedChar--;
-                if (buf[j].complexChar) {
-                    // Adding a combining mark to a char that already has one or was
-                    // built by surrogates.
-                    buf[j].code = AppendToComplexChar(buf[j].code, sc[i]);
-                } else {
-                    buf[j].code = BeginComplexChar(buf[j].code, sc[i]);
-                    buf[j].complexChar = YES;
-                }
-                if (movedBackOverDwcRight) {
-                    j++;
-                }
-                if (IsLowSurrogate(sc[i])) {
-                    NSString* str = ComplexCharToStr(buf[j].code);
-                    if ([NSString isDoubleWidthCharacter:DecodeSurrogatePair([str characterAtIndex:0], [str characterAtIndex:1])
-                                  ambiguousIsDoubleWidth:ambiguousIsDoubleWidth]) {
-                        j++;
-                        buf[j].code = DWC_RIGHT;
-                        buf[j].complexChar = NO;
-
-                        buf[j].foregroundColor = fg.foregroundColor;
-                        buf[j].fgGreen = fg.fgGreen;
-                        buf[j].fgBlue = fg.fgBlue;
-
-                        buf[j].backgroundColor = bg.backgroundColor;
-                        buf[j].bgGreen = bg.fgGreen;
-                        buf[j].bgBlue = bg.fgBlue;
-
-                        buf[j].foregroundColorMode = fg.foregroundColorMode;
-                        buf[j].backgroundColorMode = bg.backgroundColorMode;
-
-                        buf[j].bold = fg.bold;
-                        buf[j].italic = fg.italic;
-                        buf[j].blink = fg.blink;
-                        buf[j].underline = fg.underline;
-
-                        buf[j].unused = 0;
-                    }
-                }
+            buf[j] = prototype;
+            buf[j++].code = c;
+            buf[j] = prototype;
+            buf[j++].code = DWC_RIGHT;
+        } else if (properties & kCodeUnitPropertyZeroWidth) {
+            // Swallow it.
+        } else if ((properties & (kCodeUnitPropertyCombiningMark | kCodeUnitPropertyLowSurrogate)) &&
+                   j > 0) {
+            int k = j - 1;
+            if (buf[k].code == DWC_RIGHT && k > 0 && (properties & kCodeUnitPropertyCombiningMark)) {
+                // This happens easily with ambiguous-width characters, where something like
+                //  is treated as double-width and a subsequent combining mark needs to modify
+                // at the real code, not the DWC_RIGHT.
+                k--;
+            }
+            if (buf[k].complexChar) {
+                // Adding a combining mark to a char that already has one or was
+                // built by surrogates.
+                buf[k].code = AppendToComplexChar(buf[k].code, c);
+            } else {
+                buf[k].code = BeginComplexChar(buf[k].code, c);
+                buf[k].complexChar = YES;
             }
+            if ((properties & kCodeUnitPropertyLowSurrogate) &&
+                [NSString isDoubleWidthCharacter:CharToLongChar(buf[k].code, YES)
+                          ambiguousIsDoubleWidth:ambiguousIsDoubleWidth]) {
+                buf[j] = prototype;
+                buf[j++].code = DWC_RIGHT;
+            }
+        } else {
+            // A high surrogate waiting for its low surrogate, or a combining mark with nothing
+            // to combine with.
+            buf[j] = prototype;
+            buf[j++].code = c;
         }
     }
     *len = j;
@@ -593,6 +834,31 @@ void StringToScreenChars(NSString *s,
         // of the last character.
         *cursorIndex = j;
     }
+}
+
+void StringToScreenChars(NSString *s,
+                         screen_char_t *buf,
+                         screen_char_t fg,
+                         screen_char_t bg,
+                         int *len,
+                         BOOL ambiguousIsDoubleWidth,
+                         int* cursorIndex) {
+    const int l = [s length];
+    const unichar *sc = CFStringGetCharactersPtr((CFStringRef)s);
+    unichar *dynamicBuffer = NULL;
+    const int kBufferElements = 1024;
+    unichar staticBuffer[kBufferElements];
+    if (!sc) {
+        unichar *chars;
+        if (l > kBufferElements) {
+            chars = dynamicBuffer = (unichar *) malloc(l * sizeof(unichar));
+        } else {
+            chars = staticBuffer;
+        }
+        [s getCharacters:chars range:NSMakeRange(0, l)];
+        sc = chars;
+    }
+    UnicharsToScreenChars(sc, l, buf, fg, bg, len, ambiguousIsDoubleWidth, cursorIndex);
     if (dynamicBuffer) {
         free(dynamicBuffer);
     }
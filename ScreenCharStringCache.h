@@ -0,0 +1,40 @@
+//
+//  ScreenCharStringCache.h
+//  iTerm
+//
+//  A small cache of lines converted by ScreenCharArrayToString.
+//
+
+#import <Foundation/Foundation.h>
+#import "ScreenChar.h"
+
+// Remembers the last few lines converted to strings, keyed by absolute line number and validated
+// against a copy of the line's chars, so callers that repeatedly look at the same window of text
+// (smart selection, URL hover) don't expand and allocate it again. Not thread-safe.
+@interface ScreenCharStringCache : NSObject {
+    struct ScreenCharStringCacheEntry *entries_;
+    int capacity_;
+    unsigned int clock_;  // Incremented on each lookup. An entry's lastUse is its value then.
+    BOOL comparesTextOnly_;
+}
+
+// If set, a cached line is still valid after its chars' colors and other attributes change, as
+// long as their text is the same. Highlighting uses this, since it recolors the lines it reads.
+@property(nonatomic, assign) BOOL comparesTextOnly;
+
+- (id)initWithCapacity:(int)capacity;
+
+// Returns the same string as ScreenCharArrayToString(line, start, end, ...) and sets *deltasPtr to
+// its deltas array. The deltas belong to the cache and are valid until the next call.
+- (NSString *)stringForLine:(screen_char_t *)line
+         absoluteLineNumber:(long long)absoluteLineNumber
+                      start:(int)start
+                        end:(int)end
+                     deltas:(const int **)deltasPtr;
+
+- (void)removeAllObjects;
+
+// Bytes held by the cached chars, strings and deltas.
+- (long long)estimatedBytes;
+
+@end
@@ -0,0 +1,121 @@
+#import "ScreenCharStringCache.h"
+
+struct ScreenCharStringCacheEntry {
+    long long absoluteLineNumber;
+    int start;
+    int end;
+    screen_char_t *chars;  // Copy of line[start, end) when it was converted. NULL if unused.
+    NSString *string;
+    int *deltas;
+    unsigned int lastUse;
+};
+
+static void FreeEntry(struct ScreenCharStringCacheEntry *entry) {
+    free(entry->chars);
+    entry->chars = NULL;
+    [entry->string release];
+    entry->string = nil;
+    free(entry->deltas);
+    entry->deltas = NULL;
+}
+
+// Whether two runs of chars convert to the same string.
+static BOOL SameText(const screen_char_t *a, const screen_char_t *b, int length) {
+    for (int i = 0; i < length; i++) {
+        if (a[i].code != b[i].code || a[i].complexChar != b[i].complexChar) {
+            return NO;
+        }
+    }
+    return YES;
+}
+
+@implementation ScreenCharStringCache
+
+@synthesize comparesTextOnly = comparesTextOnly_;
+
+- (id)initWithCapacity:(int)capacity
+{
+    self = [super init];
+    if (self) {
+        capacity_ = capacity;
+        entries_ = calloc(capacity, sizeof(struct ScreenCharStringCacheEntry));
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self removeAllObjects];
+    free(entries_);
+    [super dealloc];
+}
+
+- (void)removeAllObjects
+{
+    for (int i = 0; i < capacity_; i++) {
+        FreeEntry(&entries_[i]);
+    }
+}
+
+- (long long)estimatedBytes
+{
+    long long total = capacity_ * sizeof(struct ScreenCharStringCacheEntry);
+    for (int i = 0; i < capacity_; i++) {
+        const struct ScreenCharStringCacheEntry *entry = &entries_[i];
+        if (entry->chars) {
+            const int length = MAX(0, entry->end - entry->start);
+            total += length * sizeof(screen_char_t);
+            total += [entry->string length] * sizeof(unichar);
+            total += (length * kMaxParts + 1) * sizeof(int);
+        }
+    }
+    return total;
+}
+
+- (NSString *)stringForLine:(screen_char_t *)line
+         absoluteLineNumber:(long long)absoluteLineNumber
+                      start:(int)start
+                        end:(int)end
+                     deltas:(const int **)deltasPtr
+{
+    const int length = MAX(0, end - start);
+    ++clock_;
+    struct ScreenCharStringCacheEntry *victim = &entries_[0];
+    for (int i = 0; i < capacity_; i++) {
+        struct ScreenCharStringCacheEntry *entry = &entries_[i];
+        if (entry->chars &&
+            entry->absoluteLineNumber == absoluteLineNumber &&
+            entry->start == start &&
+            entry->end == end &&
+            (comparesTextOnly_ ? SameText(entry->chars, line + start, length)
+                               : !memcmp(entry->chars, line + start, length * sizeof(screen_char_t)))) {
+            entry->lastUse = clock_;
+            *deltasPtr = entry->deltas;
+            return [[entry->string retain] autorelease];
+        }
+        if (!entry->chars) {
+            victim = entry;
+        } else if (victim->chars && clock_ - entry->lastUse > clock_ - victim->lastUse) {
+            victim = entry;
+        }
+    }
+
+    FreeEntry(victim);
+    unichar *backingStore;
+    int *deltas;
+    NSString *string = ScreenCharArrayToString(line, start, end, &backingStore, &deltas);
+    // The string doesn't own its backing store, so keep a copy that does.
+    victim->string = [[NSString alloc] initWithCharacters:backingStore length:[string length]];
+    free(backingStore);
+    victim->deltas = deltas;
+    victim->chars = malloc(MAX(1, length) * sizeof(screen_char_t));
+    memcpy(victim->chars, line + start, length * sizeof(screen_char_t));
+    victim->absoluteLineNumber = absoluteLineNumber;
+    victim->start = start;
+    victim->end = end;
+    victim->lastUse = clock_;
+    *deltasPtr = victim->deltas;
+    return [[victim->string retain] autorelease];
+}
+
+@end
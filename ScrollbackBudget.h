@@ -0,0 +1,46 @@
+//
+//  ScrollbackBudget.h
+//  iTerm
+//
+//  Keeps the scrollback of all sessions within one app-wide memory budget. Each LineBuffer has its
+//  own max lines and resident budget, but those don't add up to anything when there are dozens of
+//  sessions with unlimited scrollback. When the total goes over the ScrollbackGlobalBudgetMB user
+//  default, or the system reports memory pressure, blocks are compressed (or spilled, for buffers
+//  that spill to disk) starting with the sessions whose scrollback was read longest ago. Lines are
+//  dropped only as a last resort: on critical memory pressure or when compression can't meet the
+//  budget, and only if the ScrollbackBudgetDropsLines user default is set.
+//
+
+#import <Foundation/Foundation.h>
+
+@class LineBuffer;
+@class MemoryReport;
+
+@protocol ScrollbackBudgetClient <NSObject>
+- (LineBuffer *)lineBufferForScrollbackBudget;
+
+// Drops the oldest scrollback until about |bytes| of memory have been freed.
+- (void)dropScrollbackToFreeBytes:(long long)bytes;
+@end
+
+@interface ScrollbackBudget : NSObject
+
++ (instancetype)sharedInstance;
+
+// Clients aren't retained, so they must remove themselves before they're freed. Main thread only.
+- (void)addClient:(id<ScrollbackBudgetClient>)client;
+- (void)removeClient:(id<ScrollbackBudgetClient>)client;
+
+// Bytes of scrollback held in memory by all clients, compressed or not.
+- (long long)totalBytes;
+
+// The ScrollbackGlobalBudgetMB user default in bytes, or 0 if there's no budget.
+- (long long)budget;
+
+// Frees memory until clients hold at most |bytes|, coldest clients first. Returns the bytes still
+// held.
+- (long long)reduceUsageTo:(long long)bytes droppingLines:(BOOL)dropLines;
+
+- (void)addToMemoryReport:(MemoryReport *)report;
+
+@end
@@ -0,0 +1,175 @@
+//
+//  ScrollbackBudget.m
+//  iTerm
+//
+
+#import "ScrollbackBudget.h"
+#import "DebugLogging.h"
+#import "LineBuffer.h"
+#import "MemoryReport.h"
+#import "TimerWheel.h"
+
+// How often to check the total against the budget.
+static const NSTimeInterval kScrollbackBudgetCheckInterval = 5;
+
+static long long MemoryUsageOfLineBuffer(LineBuffer *lineBuffer) {
+    return [lineBuffer residentBytes] + [lineBuffer compressedBytes];
+}
+
+@interface ScrollbackBudget ()
+- (void)checkBudget;
+- (void)memoryPressureDidChange:(unsigned long)pressure;
+@end
+
+@implementation ScrollbackBudget {
+    NSHashTable *clients_;  // id<ScrollbackBudgetClient>, not retained
+    TimerWheelTimer *timer_;
+    dispatch_source_t memoryPressureSource_;
+    long long budget_;
+    BOOL dropsLines_;
+}
+
++ (instancetype)sharedInstance {
+    static id instance;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        instance = [[self alloc] init];
+    });
+    return instance;
+}
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        clients_ = [[NSHashTable alloc] initWithOptions:(NSPointerFunctionsOpaqueMemory |
+                                                         NSPointerFunctionsObjectPointerPersonality)
+                                               capacity:0];
+        NSUserDefaults *userDefaults = [NSUserDefaults standardUserDefaults];
+        budget_ = MAX(0, [userDefaults integerForKey:@"ScrollbackGlobalBudgetMB"]) * 1024LL * 1024LL;
+        dropsLines_ = [userDefaults boolForKey:@"ScrollbackBudgetDropsLines"];
+        if (budget_ > 0) {
+            timer_ = [[TimerWheel scheduledTimerWithTimeInterval:kScrollbackBudgetCheckInterval
+                                                          leeway:1
+                                                          target:self
+                                                        selector:@selector(checkBudget)
+                                                        userInfo:nil
+                                                         repeats:YES
+                                                        category:@"ScrollbackBudget"] retain];
+        }
+#ifdef DISPATCH_SOURCE_TYPE_MEMORYPRESSURE
+        if (DISPATCH_SOURCE_TYPE_MEMORYPRESSURE) {
+            memoryPressureSource_ =
+                dispatch_source_create(DISPATCH_SOURCE_TYPE_MEMORYPRESSURE,
+                                       0,
+                                       DISPATCH_MEMORYPRESSURE_WARN | DISPATCH_MEMORYPRESSURE_CRITICAL,
+                                       dispatch_get_main_queue());
+        }
+        if (memoryPressureSource_) {
+            dispatch_source_set_event_handler(memoryPressureSource_, ^{
+                [self memoryPressureDidChange:dispatch_source_get_data(memoryPressureSource_)];
+            });
+            dispatch_resume(memoryPressureSource_);
+        }
+#endif
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [timer_ invalidate];
+    [timer_ release];
+    if (memoryPressureSource_) {
+        dispatch_source_cancel(memoryPressureSource_);
+        dispatch_release(memoryPressureSource_);
+    }
+    [clients_ release];
+    [super dealloc];
+}
+
+- (void)addClient:(id<ScrollbackBudgetClient>)client {
+    [clients_ addObject:client];
+}
+
+- (void)removeClient:(id<ScrollbackBudgetClient>)client {
+    [clients_ removeObject:client];
+}
+
+- (long long)budget {
+    return budget_;
+}
+
+- (long long)totalBytes {
+    long long total = 0;
+    for (id<ScrollbackBudgetClient> client in clients_) {
+        total += MemoryUsageOfLineBuffer([client lineBufferForScrollbackBudget]);
+    }
+    return total;
+}
+
+// Clients whose scrollback was read longest ago come first.
+- (NSArray *)clientsByLastReadTime {
+    return [[clients_ allObjects] sortedArrayUsingComparator:^NSComparisonResult(id obj1, id obj2) {
+        NSTimeInterval t1 = [[obj1 lineBufferForScrollbackBudget] lastReadTime];
+        NSTimeInterval t2 = [[obj2 lineBufferForScrollbackBudget] lastReadTime];
+        return t1 < t2 ? NSOrderedAscending : (t1 > t2 ? NSOrderedDescending : NSOrderedSame);
+    }];
+}
+
+- (long long)reduceUsageTo:(long long)bytes droppingLines:(BOOL)dropLines {
+    NSArray *clients = [self clientsByLastReadTime];
+    const long long initialTotal = [self totalBytes];
+    long long total = initialTotal;
+    for (id<ScrollbackBudgetClient> client in clients) {
+        if (total <= bytes) {
+            break;
+        }
+        LineBuffer *lineBuffer = [client lineBufferForScrollbackBudget];
+        const long long before = MemoryUsageOfLineBuffer(lineBuffer);
+        const long long after = [lineBuffer reduceMemoryUsageTo:MAX(0, before - (total - bytes))];
+        total -= before - after;
+    }
+    if (dropLines) {
+        for (id<ScrollbackBudgetClient> client in clients) {
+            if (total <= bytes) {
+                break;
+            }
+            LineBuffer *lineBuffer = [client lineBufferForScrollbackBudget];
+            const long long before = MemoryUsageOfLineBuffer(lineBuffer);
+            [client dropScrollbackToFreeBytes:total - bytes];
+            total -= before - MemoryUsageOfLineBuffer([client lineBufferForScrollbackBudget]);
+        }
+    }
+    DLog(@"Reduced scrollback of %d sessions from %lld to %lld bytes (goal %lld)",
+         (int)[clients count], initialTotal, total, bytes);
+    return total;
+}
+
+- (void)checkBudget {
+    if (budget_ > 0 && [self totalBytes] > budget_) {
+        [self reduceUsageTo:budget_ droppingLines:dropsLines_];
+    }
+}
+
+- (void)memoryPressureDidChange:(unsigned long)pressure {
+    const long long total = [self totalBytes];
+    const long long goal = budget_ > 0 ? MIN(budget_, total) : total;
+#ifdef DISPATCH_SOURCE_TYPE_MEMORYPRESSURE
+    if (pressure & DISPATCH_MEMORYPRESSURE_CRITICAL) {
+        DLog(@"Critical memory pressure with %lld bytes of scrollback", total);
+        [self reduceUsageTo:goal / 4 droppingLines:dropsLines_];
+        return;
+    }
+#endif
+    DLog(@"Memory pressure %lu with %lld bytes of scrollback", pressure, total);
+    [self reduceUsageTo:goal / 2 droppingLines:NO];
+}
+
+- (void)addToMemoryReport:(MemoryReport *)report {
+    // Each session's scrollback is already in its own section.
+    [report addUncountedBytes:[self totalBytes] forCategory:@"Scrollback (all sessions)"];
+    if (budget_ > 0) {
+        [report addUncountedBytes:budget_ forCategory:@"Scrollback budget"];
+    }
+}
+
+@end
@@ -0,0 +1,69 @@
+//
+//  SelectionTextWriter.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+#import "ScreenChar.h"
+#import "VT100GridTypes.h"
+
+@class LineBuffer;
+
+// Writes the text of a range of a session's lines on a background queue, a chunk at a time, so
+// that copying or saving a huge selection doesn't block the main thread or build the whole text
+// as one string. The lines come from a snapshot made on the main thread: scrollback from
+// -[LineBuffer newAppendOnlyCopy], whose blocks are read directly, and a copy of the screen's
+// lines. The text is the same as -[PTYTextView contentFromX:Y:ToX:Y:pad:includeLastNewline:
+// trimTrailingWhitespace:] would give for the range.
+@interface SelectionTextWriter : NSObject {
+    LineBuffer *scrollback_;
+    NSArray *blocks_;
+    int numScrollbackLines_;
+    NSData *screenLines_;  // screen_char_t[width_ + 1] for each line of the screen.
+    int numberOfLines_;
+    int width_;
+    VT100GridCoordRange range_;  // range_.end.x is exclusive.
+    BOOL pad_;
+    BOOL includeLastNewline_;
+    BOOL trimTrailingWhitespace_;
+
+    dispatch_queue_t queue_;
+    dispatch_group_t group_;
+    volatile int32_t cancelled_;
+    NSMutableData *data_;  // Output of -writeToDataWithCompletion:.
+
+    // Used on queue_ to read scrollback lines in order without searching for each one's block.
+    int nextLine_;
+    int blockIndex_;
+    int lineInBlock_;
+}
+
+// |snapshot| must not be modified afterwards. |screenLines| has width + 1 screen chars for each
+// line of the screen, which follow the scrollback. |range| is in the same coordinates as the
+// session's lines; its end x is exclusive.
+- (id)initWithScrollback:(LineBuffer *)snapshot
+             screenLines:(NSData *)screenLines
+                   width:(int)width
+                   range:(VT100GridCoordRange)range
+                     pad:(BOOL)pad
+      includeLastNewline:(BOOL)includeLastNewline
+  trimTrailingWhitespace:(BOOL)trimTrailingWhitespace;
+
+// Writes to a temporary file beside |path| and renames it to |path| when done. Chars that
+// |encoding| can't represent are converted lossily. |completion| is called on the main queue.
+- (void)writeToFile:(NSString *)path
+           encoding:(NSStringEncoding)encoding
+         completion:(void (^)(BOOL ok))completion;
+
+// Collects the text as UTF-8. |completion| is called on the main queue with the data, or with nil
+// if writing was cancelled.
+- (void)writeToDataWithCompletion:(void (^)(NSData *data))completion;
+
+// Waits for -writeToDataWithCompletion: to finish and returns its data, or nil if it was
+// cancelled.
+- (NSData *)waitForData;
+
+// Stops writing as soon as possible. A partly written file is removed.
+- (void)cancel;
+
+@end
@@ -0,0 +1,364 @@
+//
+//  SelectionTextWriter.m
+//  iTerm
+//
+
+#import "SelectionTextWriter.h"
+#import "DebugLogging.h"
+#import "LineBlock.h"
+#import "LineBuffer.h"
+#include <libkern/OSAtomic.h>
+
+// Text is encoded and written once this many chars are pending.
+static const NSUInteger kSelectionTextWriterChunkLength = 64 * 1024;
+
+// Returns the length of |string| without its trailing spaces and tabs, as
+// -[PTYTextView trimTrailingWhitespaceFromString:] would leave it.
+static NSUInteger SelectionTextWriterTrimmedLength(NSString *string) {
+    NSCharacterSet *nonWhitespaceSet = [[NSCharacterSet whitespaceCharacterSet] invertedSet];
+    NSRange range = [string rangeOfCharacterFromSet:nonWhitespaceSet options:NSBackwardsSearch];
+    return range.location == NSNotFound ? 0 : NSMaxRange(range);
+}
+
+@implementation SelectionTextWriter
+
+- (id)initWithScrollback:(LineBuffer *)snapshot
+             screenLines:(NSData *)screenLines
+                   width:(int)width
+                   range:(VT100GridCoordRange)range
+                     pad:(BOOL)pad
+      includeLastNewline:(BOOL)includeLastNewline
+  trimTrailingWhitespace:(BOOL)trimTrailingWhitespace
+{
+    self = [super init];
+    if (self) {
+        scrollback_ = [snapshot retain];
+        blocks_ = [[snapshot blocksForSearch] copy];
+        numScrollbackLines_ = [snapshot numLinesWithWidth:width];
+        screenLines_ = [screenLines copy];
+        width_ = width;
+        numberOfLines_ = numScrollbackLines_ + [screenLines length] / ((width + 1) * sizeof(screen_char_t));
+        range_ = range;
+        range_.end.y = MIN(range_.end.y, numberOfLines_ - 1);
+        pad_ = pad;
+        includeLastNewline_ = includeLastNewline;
+        trimTrailingWhitespace_ = trimTrailingWhitespace;
+        queue_ = dispatch_queue_create("com.googlecode.iterm2.selection-text-writer",
+                                       DISPATCH_QUEUE_SERIAL);
+        group_ = dispatch_group_create();
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [scrollback_ release];
+    [blocks_ release];
+    [screenLines_ release];
+    [data_ release];
+    dispatch_release(queue_);
+    dispatch_release(group_);
+    [super dealloc];
+}
+
+- (void)writeToFile:(NSString *)path
+           encoding:(NSStringEncoding)encoding
+         completion:(void (^)(BOOL ok))completion
+{
+    completion = [[completion copy] autorelease];
+    dispatch_group_async(group_, queue_, ^{
+        NSString *directory = [path stringByDeletingLastPathComponent];
+        NSString *template = [directory stringByAppendingPathComponent:@".iTerm2-save-XXXXXX"];
+        char *tempPath = strdup([template fileSystemRepresentation]);
+        int fd = mkstemp(tempPath);
+        BOOL ok = (fd >= 0);
+        if (ok) {
+            ok = [self _writeUsingBlock:^BOOL(NSString *text) {
+                NSUInteger capacity = [text maximumLengthOfBytesUsingEncoding:encoding];
+                char *bytes = malloc(MAX(1, capacity));
+                NSUInteger length = 0;
+                [text getBytes:bytes
+                     maxLength:capacity
+                    usedLength:&length
+                      encoding:encoding
+                       options:NSStringEncodingConversionAllowLossy
+                         range:NSMakeRange(0, [text length])
+                remainingRange:NULL];
+                BOOL written = YES;
+                for (NSUInteger offset = 0; offset < length && written; ) {
+                    ssize_t n = write(fd, bytes + offset, length - offset);
+                    if (n < 0 && errno != EINTR) {
+                        written = NO;
+                    } else if (n > 0) {
+                        offset += n;
+                    }
+                }
+                free(bytes);
+                return written;
+            }];
+            ok = (close(fd) == 0) && ok;
+            if (ok) {
+                ok = (rename(tempPath, [path fileSystemRepresentation]) == 0);
+            }
+            if (!ok) {
+                unlink(tempPath);
+            }
+        }
+        DLog(@"Finished writing selection to %@, ok=%d", path, (int)ok);
+        free(tempPath);
+        dispatch_async(dispatch_get_main_queue(), ^{
+            completion(ok);
+        });
+    });
+}
+
+- (void)writeToDataWithCompletion:(void (^)(NSData *data))completion
+{
+    completion = [[completion copy] autorelease];
+    dispatch_group_async(group_, queue_, ^{
+        NSMutableData *data = [NSMutableData data];
+        BOOL ok = [self _writeUsingBlock:^BOOL(NSString *text) {
+            [data appendData:[text dataUsingEncoding:NSUTF8StringEncoding]];
+            return YES;
+        }];
+        if (ok) {
+            data_ = [data retain];
+        }
+        dispatch_async(dispatch_get_main_queue(), ^{
+            completion(data_);
+        });
+    });
+}
+
+- (NSData *)waitForData
+{
+    dispatch_group_wait(group_, DISPATCH_TIME_FOREVER);
+    return data_;
+}
+
+- (void)cancel
+{
+    OSAtomicCompareAndSwap32Barrier(0, 1, &cancelled_);
+}
+
+#pragma mark - Private
+
+// Runs on queue_. Passes the text to |output| a chunk at a time. Returns NO if |output| failed or
+// writing was cancelled.
+- (BOOL)_writeUsingBlock:(BOOL (^)(NSString *text))output
+{
+    const int width = width_;
+    const int endx = range_.end.x - 1;
+    screen_char_t *line = malloc(sizeof(screen_char_t) * (width + 1));
+    // Room for every cell to be a complex char, a newline, and padding.
+    unichar *chars = malloc(sizeof(unichar) * (width * kMaxParts + 1));
+    NSMutableString *pending = [NSMutableString string];
+    BOOL ok = YES;
+
+    [self _seekToLine:range_.start.y];
+    for (int y = range_.start.y; y <= range_.end.y && ok; y++) {
+        if (cancelled_) {
+            ok = NO;
+            break;
+        }
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        [self _copyLine:y toBuffer:line];
+        int n = 0;
+        BOOL hardBreak = NO;
+        BOOL newline = NO;
+        int x1 = (y == range_.start.y) ? range_.start.x : 0;
+        const int x2 = (y == range_.end.y) ? endx : width - 1;
+        for ( ; x1 <= x2; x1++) {
+            if (line[x1].code == TAB_FILLER) {
+                // Convert orphan tab fillers (those without a subsequent
+                // tab character) into spaces.
+                if ([self _isTabFillerOrphanAtX:x1 Y:y]) {
+                    chars[n++] = ' ';
+                }
+            } else if (line[x1].code != DWC_RIGHT &&
+                       line[x1].code != DWC_SKIP) {
+                if (line[x1].code == 0) { // end of line?
+                    // If there is no text after this, insert a hard line break.
+                    BOOL endOfLine = YES;
+                    for (int i = x1 + 1; i <= x2 && endOfLine; i++) {
+                        if (line[i].code != 0) {
+                            endOfLine = NO;
+                        }
+                    }
+                    if (endOfLine) {
+                        if (pad_) {
+                            for (int i = x1; i <= x2; i++) {
+                                chars[n++] = ' ';
+                            }
+                        }
+                        if (line[width].code == EOL_HARD) {
+                            hardBreak = YES;
+                            newline = (includeLastNewline_ || y < range_.end.y);
+                        }
+                        break;
+                    } else {
+                        chars[n++] = ' ';  // replace mid-line null char with space
+                    }
+                } else if (x1 == x2 &&
+                           y < range_.end.y &&
+                           line[width].code == EOL_HARD) {
+                    // Hard line break
+                    n += ExpandScreenChar(&line[x1], chars + n);
+                    hardBreak = YES;
+                    newline = YES;
+                } else {
+                    // Normal character
+                    n += ExpandScreenChar(&line[x1], chars + n);
+                }
+            }
+        }
+        CFStringAppendCharacters((CFMutableStringRef)pending, chars, n);
+        if (hardBreak) {
+            if (trimTrailingWhitespace_) {
+                const NSUInteger trimmedLength = SelectionTextWriterTrimmedLength(pending);
+                [pending deleteCharactersInRange:NSMakeRange(trimmedLength,
+                                                             [pending length] - trimmedLength)];
+            }
+            if (newline) {
+                [pending appendString:@"\n"];
+            }
+        }
+        if ([pending length] >= kSelectionTextWriterChunkLength) {
+            ok = [self _flush:pending final:NO usingBlock:output];
+        }
+        [pool drain];
+    }
+    if (ok) {
+        ok = [self _flush:pending final:YES usingBlock:output];
+    }
+    free(chars);
+    free(line);
+    return ok && !cancelled_;
+}
+
+// Outputs the pending text. Until the end, trailing whitespace is held back in case it is trimmed
+// by a later hard line break.
+- (BOOL)_flush:(NSMutableString *)pending
+         final:(BOOL)final
+    usingBlock:(BOOL (^)(NSString *text))output
+{
+    NSUInteger length = [pending length];
+    if (trimTrailingWhitespace_) {
+        length = SelectionTextWriterTrimmedLength(pending);
+    }
+    BOOL ok = YES;
+    if (length > 0) {
+        ok = output([pending substringToIndex:length]);
+    }
+    [pending deleteCharactersInRange:NSMakeRange(0, final ? [pending length] : length)];
+    return ok;
+}
+
+// Positions the scrollback cursor at |y|.
+- (void)_seekToLine:(int)y
+{
+    blockIndex_ = 0;
+    lineInBlock_ = MAX(0, y);
+    while (blockIndex_ < [blocks_ count]) {
+        const int numLines = [[blocks_ objectAtIndex:blockIndex_] getNumLinesWithWrapWidth:width_];
+        if (lineInBlock_ < numLines) {
+            break;
+        }
+        lineInBlock_ -= numLines;
+        blockIndex_++;
+    }
+    nextLine_ = MAX(0, y);
+}
+
+// Copies the next scrollback line into |buffer| and returns its end-of-line code.
+- (int)_copyNextScrollbackLineToBuffer:(screen_char_t *)buffer
+{
+    LineBlock *block = [blocks_ objectAtIndex:blockIndex_];
+    while (lineInBlock_ >= [block getNumLinesWithWrapWidth:width_]) {
+        lineInBlock_ = 0;
+        block = [blocks_ objectAtIndex:++blockIndex_];
+    }
+    int lineNum = lineInBlock_;
+    int length;
+    int eol;
+    screen_char_t *chars = [block getWrappedLineWithWrapWidth:width_
+                                                      lineNum:&lineNum
+                                                   lineLength:&length
+                                            includesEndOfLine:&eol];
+    memcpy(buffer, chars, length * sizeof(screen_char_t));
+    lineInBlock_++;
+    nextLine_++;
+    return eol;
+}
+
+// Copies line |y| into |buffer|, which holds width_ + 1 chars, the way
+// -[VT100Screen getLineAtIndex:withBuffer:] does.
+- (void)_copyLine:(int)y toBuffer:(screen_char_t *)buffer
+{
+    const int width = width_;
+    if (y >= numScrollbackLines_) {
+        const screen_char_t *screenLines = [screenLines_ bytes];
+        memcpy(buffer,
+               screenLines + (y - numScrollbackLines_) * (width + 1),
+               sizeof(screen_char_t) * (width + 1));
+        return;
+    }
+
+    memset(buffer, 0, sizeof(screen_char_t) * width);
+    int cont;
+    if (y == nextLine_) {
+        cont = [self _copyNextScrollbackLineToBuffer:buffer];
+    } else {
+        cont = [scrollback_ copyLineToBuffer:buffer width:width lineNum:y];
+    }
+    const screen_char_t *firstScreenLine = [screenLines_ bytes];
+    if (cont == EOL_SOFT &&
+        y == numScrollbackLines_ - 1 &&
+        [screenLines_ length] &&
+        firstScreenLine[1].code == DWC_RIGHT &&
+        buffer[width - 1].code == 0) {
+        // The last line in the scrollback buffer is actually a split DWC
+        // if the first char on the screen is double-width and the buffer is soft-wrapped without
+        // a last char.
+        cont = EOL_DWC;
+    }
+    if (cont == EOL_DWC) {
+        buffer[width - 1].code = DWC_SKIP;
+        buffer[width - 1].complexChar = NO;
+    }
+    buffer[width].code = cont;
+}
+
+// Like -[PTYTextView isTabFillerOrphanAtX:Y:].
+- (BOOL)_isTabFillerOrphanAtX:(int)x Y:(int)y
+{
+    screen_char_t buffer[width_ + 1];
+    [self _copyLineWithoutMovingCursor:y toBuffer:buffer];
+    int maxSearch = width_;
+    while (maxSearch > 0) {
+        if (x == width_) {
+            x = 0;
+            ++y;
+            if (y == numberOfLines_) {
+                return YES;
+            }
+            [self _copyLineWithoutMovingCursor:y toBuffer:buffer];
+        }
+        if (buffer[x].code != TAB_FILLER) {
+            return buffer[x].code != '\t';
+        }
+        ++x;
+        --maxSearch;
+    }
+    return YES;
+}
+
+- (void)_copyLineWithoutMovingCursor:(int)y toBuffer:(screen_char_t *)buffer
+{
+    const int nextLine = nextLine_;
+    nextLine_ = -1;
+    [self _copyLine:y toBuffer:buffer];
+    nextLine_ = nextLine;
+}
+
+@end
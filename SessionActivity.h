@@ -0,0 +1,71 @@
+//
+//  SessionActivity.h
+//  iTerm
+//
+//  How much work a session causes, so the one making the machine hot can be found.
+//
+
+#import <Foundation/Foundation.h>
+#include <libkern/OSAtomic.h>
+
+typedef enum {
+    kSessionActivityStageParse,     // Tokenizing output. When output is parsed on the main thread
+                                    // tokens are executed as they're parsed, and that counts here.
+    kSessionActivityStageApply,     // Executing tokens parsed by the VT100ParseQueue.
+    kSessionActivityStageRender,    // -[PTYTextView drawRect:]
+    kSessionActivityStageTriggers,  // Matching triggers and performing their actions.
+    kSessionActivityNumberOfStages
+} SessionActivityStage;
+
+// Counts bytes read, tokens parsed, redraws and the time spent in each stage for one session.
+// Counting may be done on any thread. The rates are main thread only: when they're read, and at
+// most once a second, what was counted since the last sample is folded into a MovingAverage so they
+// cover the last few seconds.
+@interface SessionActivity : NSObject {
+    volatile int64_t bytes_;
+    volatile int64_t tokens_;
+    volatile int64_t redraws_;
+    volatile int64_t stageNanoseconds_[kSessionActivityNumberOfStages];
+
+    // Totals as of the last sample.
+    int64_t sampledBytes_;
+    int64_t sampledTokens_;
+    int64_t sampledRedraws_;
+    int64_t sampledStageNanoseconds_[kSessionActivityNumberOfStages];
+    NSTimeInterval lastSampleTime_;
+
+    NSArray *rateAverages_;   // MovingAverage for bytes, tokens and redraws per second.
+    NSArray *stageAverages_;  // MovingAverage per stage, as a fraction of one CPU.
+}
+
+// Totals since the session began.
+@property(nonatomic, readonly) long long totalBytes;
+@property(nonatomic, readonly) long long totalTokens;
+
+@property(nonatomic, readonly) double bytesPerSecond;
+@property(nonatomic, readonly) double tokensPerSecond;
+@property(nonatomic, readonly) double redrawsPerSecond;
+
+// Fraction of one CPU used by all the stages together. 1 means a core is kept busy.
+@property(nonatomic, readonly) double cpuFraction;
+
+- (void)addBytes:(int)count;
+- (void)addTokens:(int)count;
+- (void)addRedraw;
+- (void)addDuration:(NSTimeInterval)duration toStage:(SessionActivityStage)stage;
+
+- (double)cpuFractionOfStage:(SessionActivityStage)stage;
+
+// Short name of |stage| for the UI.
++ (NSString *)nameOfStage:(SessionActivityStage)stage;
+
+// "3.4 MB/s" or similar.
++ (NSString *)stringForBytesPerSecond:(double)rate;
+
+// "12% CPU, 3.4 MB/s" or similar, for labels and scripts.
+- (NSString *)shortDescription;
+
+// One line per reading, for tool tips.
+- (NSString *)summary;
+
+@end
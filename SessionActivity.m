@@ -0,0 +1,200 @@
+//
+//  SessionActivity.m
+//  iTerm
+//
+
+#import "SessionActivity.h"
+#import "MovingAverage.h"
+
+// Samples closer together than this are merged, so readings don't jump around.
+static const NSTimeInterval kMinimumSampleInterval = 1;
+
+// Each sample keeps this much of the old average, which makes the readings cover about the last
+// five seconds.
+static const double kAlpha = 0.7;
+
+enum {
+    kRateBytes,
+    kRateTokens,
+    kRateRedraws,
+    kNumberOfRates
+};
+
+@interface SessionActivity ()
+- (void)sampleIfNeeded;
+@end
+
+@implementation SessionActivity
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        NSMutableArray *rateAverages = [NSMutableArray array];
+        for (int i = 0; i < kNumberOfRates; i++) {
+            MovingAverage *average = [[[MovingAverage alloc] init] autorelease];
+            average.alpha = kAlpha;
+            [rateAverages addObject:average];
+        }
+        rateAverages_ = [rateAverages retain];
+
+        NSMutableArray *stageAverages = [NSMutableArray array];
+        for (int i = 0; i < kSessionActivityNumberOfStages; i++) {
+            MovingAverage *average = [[[MovingAverage alloc] init] autorelease];
+            average.alpha = kAlpha;
+            [stageAverages addObject:average];
+        }
+        stageAverages_ = [stageAverages retain];
+        lastSampleTime_ = [NSDate timeIntervalSinceReferenceDate];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [rateAverages_ release];
+    [stageAverages_ release];
+    [super dealloc];
+}
+
++ (NSString *)nameOfStage:(SessionActivityStage)stage
+{
+    switch (stage) {
+        case kSessionActivityStageParse:
+            return @"Parse";
+        case kSessionActivityStageApply:
+            return @"Apply";
+        case kSessionActivityStageRender:
+            return @"Render";
+        case kSessionActivityStageTriggers:
+            return @"Triggers";
+        case kSessionActivityNumberOfStages:
+            break;
+    }
+    return @"";
+}
+
++ (NSString *)stringForBytesPerSecond:(double)rate
+{
+    if (rate < 1024) {
+        return [NSString stringWithFormat:@"%.0f B/s", rate];
+    } else if (rate < 1024 * 1024) {
+        return [NSString stringWithFormat:@"%.1f KB/s", rate / 1024];
+    } else {
+        return [NSString stringWithFormat:@"%.1f MB/s", rate / (1024 * 1024)];
+    }
+}
+
+#pragma mark - Counting
+
+- (void)addBytes:(int)count
+{
+    OSAtomicAdd64Barrier(count, &bytes_);
+}
+
+- (void)addTokens:(int)count
+{
+    OSAtomicAdd64Barrier(count, &tokens_);
+}
+
+- (void)addRedraw
+{
+    OSAtomicIncrement64Barrier(&redraws_);
+}
+
+- (void)addDuration:(NSTimeInterval)duration toStage:(SessionActivityStage)stage
+{
+    OSAtomicAdd64Barrier((int64_t)(duration * 1000000000.0), &stageNanoseconds_[stage]);
+}
+
+#pragma mark - Readings
+
+- (void)sampleIfNeeded
+{
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    const NSTimeInterval elapsed = now - lastSampleTime_;
+    if (elapsed < kMinimumSampleInterval) {
+        return;
+    }
+    lastSampleTime_ = now;
+
+    // Each counter is read once here so that what's added while sampling goes in the next sample.
+    const int64_t totals[kNumberOfRates] = { bytes_, tokens_, redraws_ };
+    int64_t *sampled[kNumberOfRates] = { &sampledBytes_, &sampledTokens_, &sampledRedraws_ };
+    for (int i = 0; i < kNumberOfRates; i++) {
+        [[rateAverages_ objectAtIndex:i] addValue:(totals[i] - *sampled[i]) / elapsed];
+        *sampled[i] = totals[i];
+    }
+    for (int i = 0; i < kSessionActivityNumberOfStages; i++) {
+        const int64_t total = stageNanoseconds_[i];
+        const double seconds = (total - sampledStageNanoseconds_[i]) / 1000000000.0;
+        [[stageAverages_ objectAtIndex:i] addValue:seconds / elapsed];
+        sampledStageNanoseconds_[i] = total;
+    }
+}
+
+- (long long)totalBytes
+{
+    return bytes_;
+}
+
+- (long long)totalTokens
+{
+    return tokens_;
+}
+
+- (double)bytesPerSecond
+{
+    [self sampleIfNeeded];
+    return [[rateAverages_ objectAtIndex:kRateBytes] value];
+}
+
+- (double)tokensPerSecond
+{
+    [self sampleIfNeeded];
+    return [[rateAverages_ objectAtIndex:kRateTokens] value];
+}
+
+- (double)redrawsPerSecond
+{
+    [self sampleIfNeeded];
+    return [[rateAverages_ objectAtIndex:kRateRedraws] value];
+}
+
+- (double)cpuFractionOfStage:(SessionActivityStage)stage
+{
+    [self sampleIfNeeded];
+    return [[stageAverages_ objectAtIndex:stage] value];
+}
+
+- (double)cpuFraction
+{
+    double sum = 0;
+    for (int i = 0; i < kSessionActivityNumberOfStages; i++) {
+        sum += [self cpuFractionOfStage:i];
+    }
+    return sum;
+}
+
+- (NSString *)shortDescription
+{
+    return [NSString stringWithFormat:@"%.0f%% CPU, %@",
+               self.cpuFraction * 100,
+               [SessionActivity stringForBytesPerSecond:self.bytesPerSecond]];
+}
+
+- (NSString *)summary
+{
+    NSMutableString *summary = [NSMutableString string];
+    [summary appendFormat:@"%.0f%% CPU", self.cpuFraction * 100];
+    for (int i = 0; i < kSessionActivityNumberOfStages; i++) {
+        [summary appendFormat:@"\n  %@: %.1f%%",
+            [SessionActivity nameOfStage:i], [self cpuFractionOfStage:i] * 100];
+    }
+    [summary appendFormat:@"\nOutput: %@, %.0f tokens/s",
+        [SessionActivity stringForBytesPerSecond:self.bytesPerSecond], self.tokensPerSecond];
+    [summary appendFormat:@"\nRedraws: %.1f/s", self.redrawsPerSecond];
+    return summary;
+}
+
+@end
@@ -0,0 +1,60 @@
+//
+//  SessionLogger.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+#include <libkern/OSAtomic.h>
+
+// Writes a session log from its own queue so a slow disk can't hold up the thread that reads every
+// task's output. Appended bytes wait in a bounded buffer and go to disk in large writes. Once the
+// writer falls so far behind that the buffer is full, further bytes are dropped (and counted) until
+// it catches up.
+//
+// If the path ends in .gz the log is gzip-compressed. If the "SessionLogMaxSize" user default is set
+// to a number of bytes, a log that grows past that is renamed to end in .1 (older ones move to .2
+// and so on, keeping "SessionLogMaxRotatedFiles" of them, 3 if unset) and a new one started.
+//
+// -appendData: may be called from any thread.
+@interface SessionLogger : NSObject {
+    NSString *path_;
+    BOOL compressed_;
+    long long maxFileLength_;
+    int maxRotatedFiles_;
+
+    // Protects pending_, flushScheduled_, and closed_.
+    OSSpinLock lock_;
+    NSMutableData *pending_;
+    BOOL flushScheduled_;
+    BOOL closed_;
+
+    // The rest are only used on queue_.
+    dispatch_queue_t queue_;
+    int fd_;
+    struct gzFile_s *gzFile_;
+    long long fileLength_;  // Bytes logged to the current file, before compression.
+
+    volatile int64_t bytesDropped_;
+    volatile int64_t bytesFlushed_;
+}
+
+@property(nonatomic, readonly) NSString *path;
+
+// Bytes waiting to be written.
+@property(nonatomic, readonly) long long bytesQueued;
+
+// Bytes discarded because too many were waiting.
+@property(nonatomic, readonly) long long bytesDropped;
+
+// Bytes written to disk, before compression.
+@property(nonatomic, readonly) long long bytesFlushed;
+
+// Opens |path| for appending, creating it if needed. Returns nil if it can't be opened.
+- (id)initWithPath:(NSString *)path;
+
+- (void)appendData:(NSData *)data;
+
+// Writes what's queued and closes the file in the background. Later appends are ignored.
+- (void)close;
+
+@end
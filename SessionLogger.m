@@ -0,0 +1,235 @@
+//
+//  SessionLogger.m
+//  iTerm
+//
+
+#import "SessionLogger.h"
+#import <zlib.h>
+#import "DebugLogging.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Appends beyond this many unwritten bytes are dropped.
+static const NSUInteger kSessionLoggerMaxQueuedBytes = 8 * 1024 * 1024;
+
+// How long appended bytes may wait so that more can be written with them.
+static const NSTimeInterval kSessionLoggerFlushDelay = 0.1;
+
+@implementation SessionLogger
+
+@synthesize path = path_;
+
+- (id)initWithPath:(NSString *)path
+{
+    self = [super init];
+    if (self) {
+        path_ = [[path stringByStandardizingPath] copy];
+        compressed_ = [[[path_ pathExtension] lowercaseString] isEqualToString:@"gz"];
+        NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+        maxFileLength_ = [[defaults objectForKey:@"SessionLogMaxSize"] longLongValue];
+        maxRotatedFiles_ = [defaults objectForKey:@"SessionLogMaxRotatedFiles"] ?
+            (int)[defaults integerForKey:@"SessionLogMaxRotatedFiles"] : 3;
+        lock_ = OS_SPINLOCK_INIT;
+        pending_ = [[NSMutableData alloc] init];
+        fd_ = -1;
+        if (![self _openFile]) {
+            [self release];
+            return nil;
+        }
+        queue_ = dispatch_queue_create("com.googlecode.iterm2.session-log", DISPATCH_QUEUE_SERIAL);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [self _closeFile];
+    if (queue_) {
+        dispatch_release(queue_);
+    }
+    [path_ release];
+    [pending_ release];
+    [super dealloc];
+}
+
+- (long long)bytesQueued
+{
+    OSSpinLockLock(&lock_);
+    long long length = [pending_ length];
+    OSSpinLockUnlock(&lock_);
+    return length;
+}
+
+- (long long)bytesDropped
+{
+    return bytesDropped_;
+}
+
+- (long long)bytesFlushed
+{
+    return bytesFlushed_;
+}
+
+- (void)appendData:(NSData *)data
+{
+    const NSUInteger length = [data length];
+    if (!length) {
+        return;
+    }
+    BOOL accepted = NO;
+    BOOL schedule = NO;
+    OSSpinLockLock(&lock_);
+    if (!closed_ && [pending_ length] + length <= kSessionLoggerMaxQueuedBytes) {
+        [pending_ appendData:data];
+        accepted = YES;
+        schedule = !flushScheduled_;
+        flushScheduled_ = YES;
+    }
+    OSSpinLockUnlock(&lock_);
+
+    if (!accepted) {
+        OSAtomicAdd64(length, &bytesDropped_);
+    }
+    if (schedule) {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, kSessionLoggerFlushDelay * NSEC_PER_SEC),
+                       queue_,
+                       ^{
+                           [self _flush];
+                       });
+    }
+}
+
+- (void)close
+{
+    OSSpinLockLock(&lock_);
+    closed_ = YES;
+    OSSpinLockUnlock(&lock_);
+    dispatch_async(queue_, ^{
+        [self _flush];
+        [self _closeFile];
+        DLog(@"Closed session log %@: %lld bytes written, %lld dropped",
+             path_, bytesFlushed_, bytesDropped_);
+    });
+}
+
+#pragma mark - Private
+
+// Runs on queue_ except while initializing.
+- (BOOL)_openFile
+{
+    fd_ = open([path_ fileSystemRepresentation], O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+        DLog(@"Can't open session log %@: %s", path_, strerror(errno));
+        return NO;
+    }
+    struct stat sb;
+    fileLength_ = fstat(fd_, &sb) == 0 ? sb.st_size : 0;
+    if (compressed_) {
+        gzFile_ = gzdopen(fd_, "ab");
+        if (!gzFile_) {
+            close(fd_);
+            fd_ = -1;
+            return NO;
+        }
+    }
+    return YES;
+}
+
+- (void)_closeFile
+{
+    if (gzFile_) {
+        // Also closes fd_.
+        gzclose(gzFile_);
+        gzFile_ = NULL;
+    } else if (fd_ >= 0) {
+        close(fd_);
+    }
+    fd_ = -1;
+}
+
+// The path of the |n|th most recently rotated log.
+- (NSString *)_pathForRotation:(int)n
+{
+    if (compressed_) {
+        return [[path_ stringByDeletingPathExtension] stringByAppendingFormat:@".%d.gz", n];
+    } else {
+        return [path_ stringByAppendingFormat:@".%d", n];
+    }
+}
+
+- (void)_rotate
+{
+    [self _closeFile];
+    NSFileManager *fileManager = [NSFileManager defaultManager];
+    [fileManager removeItemAtPath:[self _pathForRotation:maxRotatedFiles_] error:NULL];
+    for (int i = maxRotatedFiles_ - 1; i >= 1; i--) {
+        rename([[self _pathForRotation:i] fileSystemRepresentation],
+               [[self _pathForRotation:i + 1] fileSystemRepresentation]);
+    }
+    if (maxRotatedFiles_ > 0) {
+        rename([path_ fileSystemRepresentation], [[self _pathForRotation:1] fileSystemRepresentation]);
+    } else {
+        unlink([path_ fileSystemRepresentation]);
+    }
+    [self _openFile];
+}
+
+// Runs on queue_. Writes everything that's waiting in one go.
+- (void)_flush
+{
+    OSSpinLockLock(&lock_);
+    NSMutableData *data = pending_;
+    pending_ = [[NSMutableData alloc] init];
+    flushScheduled_ = NO;
+    OSSpinLockUnlock(&lock_);
+
+    [self _writeBytes:[data bytes] length:[data length]];
+    [data release];
+}
+
+// Runs on queue_. On failure the log is closed and later bytes are dropped.
+- (void)_writeBytes:(const char *)bytes length:(NSUInteger)length
+{
+    if (!length) {
+        return;
+    }
+    if (fd_ < 0) {
+        OSAtomicAdd64(length, &bytesDropped_);
+        return;
+    }
+    if (maxFileLength_ > 0 && fileLength_ > 0 && fileLength_ + length > maxFileLength_) {
+        [self _rotate];
+        if (fd_ < 0) {
+            OSAtomicAdd64(length, &bytesDropped_);
+            return;
+        }
+    }
+    BOOL ok = YES;
+    if (gzFile_) {
+        ok = (gzwrite(gzFile_, bytes, (unsigned)length) == length);
+    } else {
+        NSUInteger offset = 0;
+        while (offset < length) {
+            ssize_t written = write(fd_, bytes + offset, length - offset);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                ok = NO;
+                break;
+            }
+            offset += written;
+        }
+    }
+    if (!ok) {
+        DLog(@"Write to session log %@ failed: %s", path_, strerror(errno));
+        [self _closeFile];
+        OSAtomicAdd64(length, &bytesDropped_);
+        return;
+    }
+    fileLength_ += length;
+    OSAtomicAdd64(length, &bytesFlushed_);
+}
+
+@end
@@ -30,6 +30,7 @@
 #import "PTYSession.h"
 #import "SessionTitleView.h"
 
+@class DimmingOverlayView;
 @class PTYSession;
 @class SplitSelectionView;
 @class SessionTitleView;
@@ -46,6 +47,9 @@
     NSTimer* timer_;
     BOOL shuttingDown_;
 
+    // Dims the scrollview unless only text is dimmed, which the text view does itself.
+    DimmingOverlayView *dimmingOverlay_;
+
     // Find window
     FindViewController* findView_;
 
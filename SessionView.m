@@ -2,6 +2,7 @@
 
 #import "SessionView.h"
 #import "DebugLogging.h"
+#import "DimmingOverlayView.h"
 #import "FutureMethods.h"
 #import "MovePaneController.h"
 #import "PSMTabDragAssistant.h"
@@ -64,6 +65,10 @@ static NSDate* lastResizeDate_;
         findView_ = [[FindViewController alloc] initWithNibName:@"FindView" bundle:nil];
         [[findView_ view] setHidden:YES];
         [self addSubview:[findView_ view]];
+        // The find view has a layer too so it stays above the overlay.
+        [[findView_ view] setWantsLayer:YES];
+        dimmingOverlay_ = [[DimmingOverlayView alloc] initWithFrame:NSZeroRect];
+        [super addSubview:dimmingOverlay_ positioned:NSWindowBelow relativeTo:[findView_ view]];
         NSRect aRect = [self frame];
         [findView_ setFrameOrigin:NSMakePoint(aRect.size.width - [[findView_ view] frame].size.width - 30,
                                                      aRect.size.height - [[findView_ view] frame].size.height)];
@@ -87,7 +92,9 @@ static NSDate* lastResizeDate_;
     static BOOL running;
     BOOL wasRunning = running;
     running = YES;
-    if (!wasRunning && findView_ && aView != [findView_ view]) {
+    if (!wasRunning && dimmingOverlay_) {
+        [super addSubview:aView positioned:NSWindowBelow relativeTo:dimmingOverlay_];
+    } else if (!wasRunning && findView_ && aView != [findView_ view]) {
         [super addSubview:aView positioned:NSWindowBelow relativeTo:[findView_ view]];
     } else {
         [super addSubview:aView];
@@ -95,8 +102,35 @@ static NSDate* lastResizeDate_;
     running = NO;
 }
 
+- (void)didAddSubview:(NSView *)subview
+{
+    [super didAddSubview:subview];
+    if (subview == (NSView *)[session_ SCROLLVIEW]) {
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(_scrollViewFrameDidChange:)
+                                                     name:NSViewFrameDidChangeNotification
+                                                   object:subview];
+        [self _scrollViewFrameDidChange:nil];
+    }
+}
+
+- (void)willRemoveSubview:(NSView *)subview
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:self
+                                                    name:NSViewFrameDidChangeNotification
+                                                  object:subview];
+    [super willRemoveSubview:subview];
+}
+
+- (void)_scrollViewFrameDidChange:(NSNotification *)notification
+{
+    [dimmingOverlay_ setFrame:[[session_ SCROLLVIEW] frame]];
+}
+
 - (void)dealloc
 {
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    [dimmingOverlay_ release];
     [previousUpdate_ release];
     [title_ removeFromSuperview];
     [self unregisterDraggedTypes];
@@ -113,7 +147,12 @@ static NSDate* lastResizeDate_;
 {
     [session_ autorelease];
     session_ = [session retain];
-    [[session_ TEXTVIEW] setDimmingAmount:currentDimmingAmount_];
+    if ([[PreferencePanel sharedInstance] dimOnlyText]) {
+        [[session_ TEXTVIEW] setDimmingAmount:currentDimmingAmount_];
+    } else {
+        [[session_ TEXTVIEW] setDimmingAmount:0];
+        [dimmingOverlay_ setDimmingAmount:currentDimmingAmount_ animated:NO];
+    }
 }
 
 - (void)fadeAnimation
@@ -141,6 +180,18 @@ static NSDate* lastResizeDate_;
 - (void)_dimShadeToDimmingAmount:(float)newDimmingAmount
 {
     targetDimmingAmount_ = newDimmingAmount;
+    if (![[PreferencePanel sharedInstance] dimOnlyText]) {
+        // Fading the overlay changes one layer property per frame instead of recoloring and
+        // redrawing every cell.
+        [timer_ invalidate];
+        timer_ = nil;
+        currentDimmingAmount_ = newDimmingAmount;
+        [[session_ TEXTVIEW] setDimmingAmount:0];
+        [dimmingOverlay_ setDimmingAmount:newDimmingAmount
+                                 animated:[[PreferencePanel sharedInstance] animateDimming]];
+        return;
+    }
+    [dimmingOverlay_ setDimmingAmount:0 animated:NO];
     [self markUpdateTime];
     const double kAnimationDuration = 0.1;
     if ([[PreferencePanel sharedInstance] animateDimming]) {
@@ -327,6 +378,7 @@ static NSDate* lastResizeDate_;
 {
     [lastResizeDate_ release];
     lastResizeDate_ = [[NSDate date] retain];
+    [session_ applyDeferredResize];
 }
 
 - (void)saveFrameSize
@@ -350,7 +402,7 @@ static NSDate* lastResizeDate_;
                                                               delegate:[MovePaneController sharedInstance]];
     [splitSelectionView_ setFrameOrigin:NSMakePoint(0, 0)];
     [splitSelectionView_ setAutoresizingMask:NSViewWidthSizable|NSViewHeightSizable];
-    [self addSubview:splitSelectionView_];
+    [super addSubview:splitSelectionView_ positioned:NSWindowAbove relativeTo:dimmingOverlay_];
     [splitSelectionView_ release];
 }
 
@@ -0,0 +1,43 @@
+//
+//  ShellLaunchPool.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+@class PTYTask;
+
+// Keeps shells running ahead of time so a new session doesn't wait for its shell to start up. For
+// each of the most recently launched configurations (program, arguments, environment and
+// encoding), up to ShellLaunchPoolSize shells are started with -[PTYTask prelaunchWithPath:...];
+// their first output waits in the pty until a session claims one. The environment's
+// ITERM_SESSION_ID is ignored when matching, and pooled shells don't have it.
+//
+// Off unless the ShellLaunchPoolSize user default is positive. Main thread only.
+@interface ShellLaunchPool : NSObject {
+    // Configuration key -> NSMutableArray of PTYTask, oldest first.
+    NSMutableDictionary *tasks_;
+    // Configuration keys, most recently used first.
+    NSMutableArray *keys_;
+    BOOL refillScheduled_;
+}
+
++ (ShellLaunchPool *)sharedInstance;
+
+// Shells to keep for each configuration. 0 if the pool is off.
+- (int)size;
+
+// Returns a running task launched with this configuration and sized to |width|x|height|, or nil if
+// there isn't one. Call -startIO on it after setting its delegate. In either case, the pool starts
+// more shells for this configuration soon after.
+- (PTYTask *)taskForPath:(NSString *)path
+               arguments:(NSArray *)arguments
+             environment:(NSDictionary *)environment
+                   width:(int)width
+                  height:(int)height
+                  isUTF8:(BOOL)isUTF8;
+
+// Ends every pooled shell.
+- (void)removeAllTasks;
+
+@end
@@ -0,0 +1,162 @@
+//
+//  ShellLaunchPool.m
+//  iTerm
+//
+
+#import "ShellLaunchPool.h"
+#import "DebugLogging.h"
+#import "PTYTask.h"
+#include <sys/wait.h>
+
+// Configurations to keep shells for. The least recently used one's shells are ended first.
+static const int kShellLaunchPoolMaxConfigurations = 4;
+
+// Most shells to keep for one configuration, whatever the user default says.
+static const int kShellLaunchPoolMaxSize = 4;
+
+// How long after a launch to start replacement shells, so they don't compete with the session
+// that was just opened.
+static const NSTimeInterval kShellLaunchPoolRefillDelay = 1;
+
+// Size of the pty a pooled shell starts with. It's resized when claimed.
+static const int kShellLaunchPoolWidth = 80;
+static const int kShellLaunchPoolHeight = 25;
+
+static NSString *const kShellLaunchPoolPathKey = @"Path";
+static NSString *const kShellLaunchPoolArgumentsKey = @"Arguments";
+static NSString *const kShellLaunchPoolEnvironmentKey = @"Environment";
+static NSString *const kShellLaunchPoolUTF8Key = @"UTF8";
+
+@implementation ShellLaunchPool
+
++ (ShellLaunchPool *)sharedInstance
+{
+    static ShellLaunchPool *instance;
+    if (!instance) {
+        instance = [[ShellLaunchPool alloc] init];
+    }
+    return instance;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        tasks_ = [[NSMutableDictionary alloc] init];
+        keys_ = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [tasks_ release];
+    [keys_ release];
+    [super dealloc];
+}
+
+- (int)size
+{
+    NSInteger size = [[NSUserDefaults standardUserDefaults] integerForKey:@"ShellLaunchPoolSize"];
+    return (int)MAX(0, MIN(size, kShellLaunchPoolMaxSize));
+}
+
+- (PTYTask *)taskForPath:(NSString *)path
+               arguments:(NSArray *)arguments
+             environment:(NSDictionary *)environment
+                   width:(int)width
+                  height:(int)height
+                  isUTF8:(BOOL)isUTF8
+{
+    if ([self size] == 0) {
+        if ([keys_ count]) {
+            [self removeAllTasks];
+        }
+        return nil;
+    }
+
+    NSMutableDictionary *pooledEnvironment = [[environment mutableCopy] autorelease];
+    [pooledEnvironment removeObjectForKey:@"ITERM_SESSION_ID"];
+    NSDictionary *key = @{ kShellLaunchPoolPathKey: path,
+                           kShellLaunchPoolArgumentsKey: arguments ?: @[],
+                           kShellLaunchPoolEnvironmentKey: pooledEnvironment,
+                           kShellLaunchPoolUTF8Key: @(isUTF8) };
+
+    [keys_ removeObject:key];
+    [keys_ insertObject:key atIndex:0];
+    while ([keys_ count] > kShellLaunchPoolMaxConfigurations) {
+        [tasks_ removeObjectForKey:[keys_ lastObject]];
+        [keys_ removeLastObject];
+    }
+    [self scheduleRefill];
+
+    NSMutableArray *tasks = [tasks_ objectForKey:key];
+    while ([tasks count]) {
+        PTYTask *task = [[[tasks objectAtIndex:0] retain] autorelease];
+        [tasks removeObjectAtIndex:0];
+        int status;
+        if (waitpid([task pid], &status, WNOHANG) != 0) {
+            // It exited (or was already reaped) while it waited.
+            DLog(@"Pooled shell %d is gone", (int)[task pid]);
+            continue;
+        }
+        DLog(@"Use pooled shell %d for %@", (int)[task pid], path);
+        [task setWidth:width height:height];
+        return task;
+    }
+    return nil;
+}
+
+- (void)removeAllTasks
+{
+    // Released tasks hang up their shells, and the TaskNotifier reaps them.
+    [tasks_ removeAllObjects];
+    [keys_ removeAllObjects];
+}
+
+#pragma mark - Private
+
+- (void)scheduleRefill
+{
+    if (refillScheduled_) {
+        return;
+    }
+    refillScheduled_ = YES;
+    [self performSelector:@selector(refill) withObject:nil afterDelay:kShellLaunchPoolRefillDelay];
+}
+
+- (void)refill
+{
+    refillScheduled_ = NO;
+    const int size = [self size];
+    if (size == 0) {
+        [self removeAllTasks];
+        return;
+    }
+    for (NSDictionary *key in keys_) {
+        NSMutableArray *tasks = [tasks_ objectForKey:key];
+        if (!tasks) {
+            tasks = [NSMutableArray array];
+            [tasks_ setObject:tasks forKey:key];
+        }
+        while ([tasks count] > size) {
+            [tasks removeLastObject];
+        }
+        while ([tasks count] < size) {
+            PTYTask *task = [[[PTYTask alloc] init] autorelease];
+            if (![task prelaunchWithPath:[key objectForKey:kShellLaunchPoolPathKey]
+                               arguments:[key objectForKey:kShellLaunchPoolArgumentsKey]
+                             environment:[key objectForKey:kShellLaunchPoolEnvironmentKey]
+                                   width:kShellLaunchPoolWidth
+                                  height:kShellLaunchPoolHeight
+                                  isUTF8:[[key objectForKey:kShellLaunchPoolUTF8Key] boolValue]]) {
+                DLog(@"Couldn't prelaunch %@", [key objectForKey:kShellLaunchPoolPathKey]);
+                return;
+            }
+            DLog(@"Prelaunched shell %d", (int)[task pid]);
+            [tasks addObject:task];
+        }
+    }
+}
+
+@end
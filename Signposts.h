@@ -0,0 +1,39 @@
+//
+//  Signposts.h
+//  iTerm
+//
+//  Marks the stages of getting output from the pty to the screen so Instruments or dtrace(1) can
+//  show where time goes, on any machine and in release builds.
+//
+
+#import <Foundation/Foundation.h>
+#import "iTermProbes.h"  // Generated from iTermProbes.d
+
+// Each stage is an interval between SignpostBegin and SignpostEnd, which fire the iterm provider's
+// interval-begin and interval-end USDT probes. Until something enables them, a probe costs a
+// no-op instruction and its arguments aren't evaluated, so they stay compiled in. |name| is a C
+// string literal, |session| an NSString identifying the session (its tty) or nil, and |count| is
+// reported with the probe. Stages that don't know their session (the screen, line buffer, DVR) run
+// nested in one that does on the same thread. For example, to total time per stage:
+//
+//   sudo dtrace -n 'iterm*:::interval-begin { self->t[copyinstr(arg0)] = timestamp; }
+//                   iterm*:::interval-end /self->t[copyinstr(arg0)]/ {
+//                       @[copyinstr(arg0)] = sum(timestamp - self->t[copyinstr(arg0)]); }'
+
+static inline char *SignpostSessionName(NSString *session) {
+    return session ? (char *)[session UTF8String] : "";
+}
+
+#define SignpostBegin(name, session, count) \
+    do { \
+        if (ITERM_INTERVAL_BEGIN_ENABLED()) { \
+            ITERM_INTERVAL_BEGIN((char *)(name), SignpostSessionName(session), (long long)(count)); \
+        } \
+    } while (0)
+
+#define SignpostEnd(name, session, count) \
+    do { \
+        if (ITERM_INTERVAL_END_ENABLED()) { \
+            ITERM_INTERVAL_END((char *)(name), SignpostSessionName(session), (long long)(count)); \
+        } \
+    } while (0)
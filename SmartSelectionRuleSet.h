@@ -0,0 +1,37 @@
+//
+//  SmartSelectionRuleSet.h
+//  iTerm
+//
+//  Smart selection rules with their regexes compiled once.
+//
+
+#import <Foundation/Foundation.h>
+
+// Holds a list of smart selection rules (see SmartSelectionController) with each regex compiled
+// when the rules are set rather than looked up on every evaluation. Matches found in a piece of
+// text are remembered until a different text is examined, so moving the pointer around the same
+// lines doesn't search them again. Not thread-safe.
+@interface SmartSelectionRuleSet : NSObject {
+    NSArray *rules_;
+    NSArray *regexes_;  // CompiledRegex, or NSNull for a rule whose regex doesn't compile.
+    double *precisions_;
+    BOOL *hasActions_;
+
+    // Matches of each rule in lastText_. See -rangeOfRule:inText:containingOffset:.
+    NSString *lastText_;
+    struct SmartSelectionMatchChain *chains_;
+}
+
+- (id)initWithRules:(NSArray *)rules;
+
+- (NSArray *)rules;
+- (int)count;
+- (NSDictionary *)ruleAtIndex:(int)i;
+- (double)precisionOfRuleAtIndex:(int)i;
+- (BOOL)ruleHasActionsAtIndex:(int)i;
+
+// Returns the range in text of the first match of rule i, trying start positions from the
+// beginning of text, that contains offset. Returns {NSNotFound, 0} if there is none.
+- (NSRange)rangeOfRule:(int)i inText:(NSString *)text containingOffset:(int)offset;
+
+@end
@@ -0,0 +1,152 @@
+//
+//  SmartSelectionRuleSet.m
+//  iTerm
+//
+
+#import "SmartSelectionRuleSet.h"
+#import "CompiledRegex.h"
+#import "SmartSelectionController.h"
+
+// Matches of one rule in lastText_, in the order the search visits them: each search begins one
+// past the start of the previous match. Filled in only as far as queries have needed.
+struct SmartSelectionMatchChain {
+    NSRange *ranges;
+    int count;
+    int capacity;
+    NSUInteger nextStart;
+    BOOL done;
+};
+
+@implementation SmartSelectionRuleSet
+
+- (id)initWithRules:(NSArray *)rules
+{
+    self = [super init];
+    if (self) {
+        rules_ = [rules copy];
+        int n = [rules_ count];
+        NSMutableArray *regexes = [NSMutableArray arrayWithCapacity:n];
+        precisions_ = calloc(MAX(1, n), sizeof(double));
+        hasActions_ = calloc(MAX(1, n), sizeof(BOOL));
+        chains_ = calloc(MAX(1, n), sizeof(struct SmartSelectionMatchChain));
+        for (int i = 0; i < n; i++) {
+            NSDictionary *rule = [rules_ objectAtIndex:i];
+            NSString *pattern = [SmartSelectionController regexInRule:rule];
+            CompiledRegex *regex = nil;
+            if ([pattern length]) {
+                regex = [CompiledRegex regexWithPattern:pattern caseInsensitive:NO];
+            }
+            [regexes addObject:regex ? (id)regex : (id)[NSNull null]];
+            precisions_[i] = [SmartSelectionController precisionInRule:rule];
+            hasActions_[i] = [[SmartSelectionController actionsInRule:rule] count] > 0;
+        }
+        regexes_ = [regexes retain];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    int n = [rules_ count];
+    for (int i = 0; i < n; i++) {
+        free(chains_[i].ranges);
+    }
+    free(chains_);
+    free(precisions_);
+    free(hasActions_);
+    [rules_ release];
+    [regexes_ release];
+    [lastText_ release];
+    [super dealloc];
+}
+
+- (NSArray *)rules
+{
+    return rules_;
+}
+
+- (int)count
+{
+    return [rules_ count];
+}
+
+- (NSDictionary *)ruleAtIndex:(int)i
+{
+    return [rules_ objectAtIndex:i];
+}
+
+- (double)precisionOfRuleAtIndex:(int)i
+{
+    return precisions_[i];
+}
+
+- (BOOL)ruleHasActionsAtIndex:(int)i
+{
+    return hasActions_[i];
+}
+
+- (void)_setText:(NSString *)text
+{
+    if (lastText_ == text || [lastText_ isEqualToString:text]) {
+        return;
+    }
+    [lastText_ release];
+    lastText_ = [text copy];
+    int n = [rules_ count];
+    for (int i = 0; i < n; i++) {
+        chains_[i].count = 0;
+        chains_[i].nextStart = 0;
+        chains_[i].done = NO;
+    }
+}
+
+// Finds the next match in rule i's chain. Returns NO if there are no more.
+- (BOOL)_extendChain:(struct SmartSelectionMatchChain *)chain ofRule:(int)i
+{
+    if (chain->done) {
+        return NO;
+    }
+    id regex = [regexes_ objectAtIndex:i];
+    NSUInteger length = [lastText_ length];
+    if (regex == [NSNull null] || chain->nextStart > length) {
+        chain->done = YES;
+        return NO;
+    }
+    // Searching a range with anchoring bounds and opaque bounds behaves like searching a substring
+    // starting at nextStart, without making one.
+    NSRange range = [regex rangeOfFirstMatchInString:lastText_
+                                               range:NSMakeRange(chain->nextStart,
+                                                                 length - chain->nextStart)];
+    if (range.location == NSNotFound) {
+        chain->done = YES;
+        return NO;
+    }
+    if (chain->count == chain->capacity) {
+        chain->capacity = MAX(8, chain->capacity * 2);
+        chain->ranges = realloc(chain->ranges, chain->capacity * sizeof(NSRange));
+    }
+    chain->ranges[chain->count++] = range;
+    chain->nextStart = range.location + 1;
+    return YES;
+}
+
+- (NSRange)rangeOfRule:(int)i inText:(NSString *)text containingOffset:(int)offset
+{
+    if (offset < 0) {
+        return NSMakeRange(NSNotFound, 0);
+    }
+    [self _setText:text];
+    struct SmartSelectionMatchChain *chain = &chains_[i];
+    for (int j = 0; j < chain->count || [self _extendChain:chain ofRule:i]; j++) {
+        NSRange range = chain->ranges[j];
+        if (range.location > offset) {
+            break;
+        }
+        if (range.location + range.length > offset) {
+            return range;
+        }
+    }
+    return NSMakeRange(NSNotFound, 0);
+}
+
+@end
@@ -27,6 +27,50 @@
 
 @end
 
+// One line of a TSVReader's input. Fields are ranges of the reader's characters, and a string is
+// only made for a field when it's asked for. The reader reuses a single record for every line, so
+// don't keep it past the block it was passed to.
+@interface TSVRecord : NSObject {
+    const unichar *characters_;
+    NSRange *fields_;
+    int count_;
+    int capacity_;
+}
+
+// Number of fields in this line, which may be more than the reader was told about.
+@property(nonatomic, readonly) int count;
+
+// Returns nil if |index| is out of range.
+- (NSString *)stringAtIndex:(int)index;
+
+// The number at the start of a field after |prefix|, which is skipped (as in tmux's "@1" window
+// ids). Pass 0 if there's no prefix. Returns -1 if the field is missing, doesn't start with
+// |prefix|, or has no digits.
+- (int)intValueAtIndex:(int)index afterPrefix:(unichar)prefix;
+
+@end
+
+// Reads TSV a line at a time without splitting the whole document into arrays of strings first,
+// for responses (such as list-windows on a busy server) with thousands of lines. Lines with fewer
+// fields than the reader was given are skipped, as in TSVParser.
+@interface TSVReader : NSObject {
+    NSString *string_;
+    NSArray *fields_;
+    unichar *buffer_;  // Copy of string_'s characters, if it doesn't store them contiguously.
+    const unichar *characters_;
+    int length_;
+}
+
+- (id)initWithString:(NSString *)string fields:(NSArray *)fields;
+
+// The column of a field, to look up once before enumerating. Returns -1 if it isn't one of the
+// fields.
+- (int)indexOfField:(NSString *)fieldName;
+
+- (void)enumerateRecordsUsingBlock:(void (^)(TSVRecord *record, BOOL *stop))block;
+
+@end
+
 @interface NSString (TSV)
 
 - (TSVDocument *)tsvDocumentWithFields:(NSArray *)fields;
@@ -72,6 +72,127 @@
 
 @end
 
+@implementation TSVRecord
+
+- (void)dealloc
+{
+    free(fields_);
+    [super dealloc];
+}
+
+- (int)count
+{
+    return count_;
+}
+
+- (void)resetWithCharacters:(const unichar *)characters
+{
+    characters_ = characters;
+    count_ = 0;
+}
+
+- (void)addFieldWithRange:(NSRange)range
+{
+    if (count_ == capacity_) {
+        capacity_ = MAX(8, capacity_ * 2);
+        fields_ = realloc(fields_, capacity_ * sizeof(NSRange));
+    }
+    fields_[count_++] = range;
+}
+
+- (NSString *)stringAtIndex:(int)index
+{
+    if (index < 0 || index >= count_) {
+        return nil;
+    }
+    return [NSString stringWithCharacters:characters_ + fields_[index].location
+                                   length:fields_[index].length];
+}
+
+- (int)intValueAtIndex:(int)index afterPrefix:(unichar)prefix
+{
+    if (index < 0 || index >= count_) {
+        return -1;
+    }
+    const unichar *c = characters_ + fields_[index].location;
+    const unichar *end = c + fields_[index].length;
+    if (prefix) {
+        if (c == end || *c != prefix) {
+            return -1;
+        }
+        c++;
+    }
+    if (c == end || *c < '0' || *c > '9') {
+        return -1;
+    }
+    int value = 0;
+    for (; c < end && *c >= '0' && *c <= '9'; c++) {
+        value = value * 10 + (*c - '0');
+    }
+    return value;
+}
+
+@end
+
+@implementation TSVReader
+
+- (id)initWithString:(NSString *)string fields:(NSArray *)fields
+{
+    self = [super init];
+    if (self) {
+        string_ = [string copy];
+        fields_ = [fields copy];
+        length_ = [string_ length];
+        characters_ = CFStringGetCharactersPtr((CFStringRef)string_);
+        if (!characters_) {
+            buffer_ = malloc(MAX(1, length_) * sizeof(unichar));
+            [string_ getCharacters:buffer_ range:NSMakeRange(0, length_)];
+            characters_ = buffer_;
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [string_ release];
+    [fields_ release];
+    free(buffer_);
+    [super dealloc];
+}
+
+- (int)indexOfField:(NSString *)fieldName
+{
+    NSUInteger index = [fields_ indexOfObject:fieldName];
+    return index == NSNotFound ? -1 : (int)index;
+}
+
+- (void)enumerateRecordsUsingBlock:(void (^)(TSVRecord *record, BOOL *stop))block
+{
+    TSVRecord *record = [[[TSVRecord alloc] init] autorelease];
+    const int minimumCount = [fields_ count];
+    BOOL stop = NO;
+    int lineStart = 0;
+    while (!stop && lineStart <= length_) {
+        [record resetWithCharacters:characters_];
+        int fieldStart = lineStart;
+        int i;
+        for (i = lineStart; i < length_ && characters_[i] != '\n'; i++) {
+            if (characters_[i] == '\t') {
+                [record addFieldWithRange:NSMakeRange(fieldStart, i - fieldStart)];
+                fieldStart = i + 1;
+            }
+        }
+        [record addFieldWithRange:NSMakeRange(fieldStart, i - fieldStart)];
+        if (record.count >= minimumCount) {
+            block(record, &stop);
+        }
+        lineStart = i + 1;
+    }
+}
+
+@end
+
 @implementation NSString (TSV)
 
 - (TSVDocument *)tsvDocumentWithFields:(NSArray *)fields
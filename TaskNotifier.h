@@ -1,4 +1,7 @@
-// This implements a select loop that runs in a special thread.
+// This implements kqueue event loops that run in special threads. Tasks are spread over
+// several threads so sessions producing a lot of output can use more than one core. The number
+// of threads is the TaskNotifierThreads preference, or a quarter of the cores by default. A task
+// stays on the thread it is registered on.
 
 #import <Foundation/Foundation.h>
 
@@ -11,12 +14,24 @@
 - (id)init;
 - (void)dealloc;
 
+// Assigns the task to the thread with the fewest tasks, preferring the least busy one on a tie.
 - (void)registerTask:(PTYTask*)task;
 - (void)deregisterTask:(PTYTask*)task;
 
-- (void)unblock;
-- (void)run;
+// Wakes the task's thread so it notices that the task wants to read or write.
+- (void)unblockTask:(PTYTask *)task;
 
 - (void)waitForPid:(pid_t)pid;
 
+// One line per thread with its task count and how busy it has been. Each thread also logs its line
+// with DLog every ten seconds while it's active.
+- (NSString *)summary;
+
+// Totals over all threads of the time spent handling events and the number of times kevent()
+// returned, so busyTime / wakeups is the average loop latency, and the utilization of the busiest
+// thread.
+- (void)getBusyTime:(NSTimeInterval *)busyTime
+            wakeups:(long long *)wakeups
+ highestUtilization:(double *)highestUtilization;
+
 @end
@@ -9,47 +9,125 @@
 #import "TaskNotifier.h"
 #import "Coprocess.h"
 #import "DebugLogging.h"
+#import "ParseWorkerPool.h"
 #import "PTYTask.h"
+#import "Signposts.h"
+#include <libkern/OSAtomic.h>
+#include <sys/event.h>
 
 #define PtyTaskDebugLog DLog
 
-@implementation TaskNotifier
+// Max number of events fetched by a single call to kevent().
+static const int kMaxEventsPerWakeup = 64;
+
+// Upper limit on the TaskNotifierThreads preference.
+static const int kMaxShards = 64;
+
+// How often each shard measures how busy it has been, and logs it.
+static const NSTimeInterval kUtilizationInterval = 10;
+
+// One kqueue filter (read or write) on a single file descriptor.
+typedef struct {
+    int fd;  // -1 if the filter is not associated with a file descriptor.
+    BOOL enabled;  // Is the filter currently registered with the kqueue?
+} TaskNotifierFilter;
+
+// Everything the kqueue knows about one PTYTask. The task is not retained; the tasks array owns it.
+typedef struct {
+    PTYTask *task;
+    TaskNotifierFilter ptyRead;
+    TaskNotifierFilter ptyWrite;
+    TaskNotifierFilter coprocessRead;
+    TaskNotifierFilter coprocessWrite;
+} TaskNotifierRegistration;
+
+// One kqueue event loop on its own thread, handling the I/O of the tasks TaskNotifier assigns to it.
+@interface TaskNotifierShard : NSObject
+
+@property(nonatomic, readonly) int index;
+
+// Fraction of the last kUtilizationInterval spent handling events rather than waiting for them.
+@property(nonatomic, readonly) double recentUtilization;
+
+// Totals since the thread started. Read without a lock, so they may be slightly stale.
+@property(nonatomic, readonly) NSTimeInterval busyTime;
+@property(nonatomic, readonly) long long numWakeups;
+
+- (id)initWithIndex:(int)index;
+- (void)registerTask:(PTYTask*)task;
+- (void)deregisterTask:(PTYTask*)task;
+- (void)unblock;
+- (void)run;
+- (void)waitForPid:(pid_t)pid;
+
+// One line about the shard's tasks and utilization.
+- (NSString *)summary;
+
+@end
+
+@implementation TaskNotifierShard
 {
+    int index_;
     NSMutableArray* tasks;
-    // Set to true when an element of 'tasks' was modified
-    BOOL tasksChanged;
-    // Protects 'tasks' and 'tasksChanged'.
+    // Protects 'tasks', 'registrations_', and 'fdOwners_'.
     NSRecursiveLock* tasksLock;
-    
+
     // A set of NSNumber*s holding pids of tasks that need to be wait()ed on
     NSMutableSet* deadpool;
     int unblockPipeR;
     int unblockPipeW;
-}
 
+    int kq_;
 
-+ (instancetype)sharedInstance {
-    static id instance;
-    static dispatch_once_t once;
-    dispatch_once(&once, ^{
-        instance = [[self alloc] init];
-        [NSThread detachNewThreadSelector:@selector(run)
-                                 toTarget:instance
-                               withObject:nil];
-    });
-    return instance;
+    // PTYTask* -> TaskNotifierRegistration*. Keys are not retained; values are malloc()ed.
+    CFMutableDictionaryRef registrations_;
+
+    // Maps a file descriptor to the registration that most recently claimed it. Used to find the
+    // task that an event belongs to without walking all tasks.
+    TaskNotifierRegistration **fdOwners_;
+    int fdOwnersCapacity_;
+
+    // Set when some task's wantsRead/wantsWrite may have changed from another thread. Causes the
+    // next iteration of the run loop to re-examine every task. This is not protected by tasksLock
+    // so that -unblock never has to wait for the notifier thread.
+    volatile BOOL interestChanged_;
+
+    // Pending kqueue changes. Only accessed on the notifier thread.
+    struct kevent *changes_;
+    int numChanges_;
+    int changesCapacity_;
+
+    // Utilization. Written only on the notifier thread.
+    NSTimeInterval startTime_;
+    NSTimeInterval busyTime_;  // Total time spent between returns from kevent() and the next call.
+    volatile long long numWakeups_;
+    volatile long long numEvents_;
+    NSTimeInterval windowStartTime_;
+    NSTimeInterval windowStartBusyTime_;
+    volatile double recentUtilization_;
 }
 
-- (id)init
+@synthesize index = index_;
+@synthesize recentUtilization = recentUtilization_;
+@synthesize busyTime = busyTime_;
+@synthesize numWakeups = numWakeups_;
+
+- (id)initWithIndex:(int)index
 {
     self = [super init];
     if (self) {
+        index_ = index;
         deadpool = [[NSMutableSet alloc] init];
         tasks = [[NSMutableArray alloc] init];
         tasksLock = [[NSRecursiveLock alloc] init];
-        tasksChanged = NO;
-        
+        registrations_ = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+
         int unblockPipe[2];
+        kq_ = kqueue();
+        if (kq_ < 0) {
+            [self release];
+            return nil;
+        }
         if (pipe(unblockPipe) != 0) {
             [self release];
             return nil;
@@ -58,15 +136,28 @@
         fcntl(unblockPipe[1], F_SETFL, O_NONBLOCK);
         unblockPipeR = unblockPipe[0];
         unblockPipeW = unblockPipe[1];
+
+        // The unblock pipe interrupts kevent() whenever a PTYTask registers/unregisters or when
+        // its interest in reading or writing may have changed.
+        [self addChangeForIdent:unblockPipeR filter:EVFILT_READ flags:EV_ADD fflags:0];
     }
     return self;
 }
 
 - (void)dealloc
 {
+    if (registrations_) {
+        [self removeAllRegistrations];
+        CFRelease(registrations_);
+    }
     [tasks release];
     [tasksLock release];
     [deadpool release];
+    free(fdOwners_);
+    free(changes_);
+    if (kq_ >= 0) {
+        close(kq_);
+    }
     close(unblockPipeR);
     close(unblockPipeW);
     [super dealloc];
@@ -78,8 +169,17 @@
     [tasksLock lock];
     PtyTaskDebugLog(@"Add task at %p\n", (void*)task);
     [tasks addObject:task];
+    if (!CFDictionaryGetValue(registrations_, task)) {
+        TaskNotifierRegistration *registration = calloc(1, sizeof(TaskNotifierRegistration));
+        registration->task = task;
+        registration->ptyRead.fd = -1;
+        registration->ptyWrite.fd = -1;
+        registration->coprocessRead.fd = -1;
+        registration->coprocessWrite.fd = -1;
+        CFDictionarySetValue(registrations_, task, registration);
+    }
     PtyTaskDebugLog(@"There are now %lu tasks\n", (unsigned long)[tasks count]);
-    tasksChanged = YES;
+    interestChanged_ = YES;
     PtyTaskDebugLog(@"registerTask: unlock\n");
     [tasksLock unlock];
     [self unblock];
@@ -95,8 +195,8 @@
     if ([task hasCoprocess]) {
         [deadpool addObject:[NSNumber numberWithInt:[[task coprocess] pid]]];
     }
+    [self removeRegistrationForTask:task];
     [tasks removeObject:task];
-    tasksChanged = YES;
     PtyTaskDebugLog(@"End remove task %p. There are now %lu tasks.\n",
                     (void*)task, (unsigned long)[tasks count]);
     PtyTaskDebugLog(@"deregisterTask: unlock\n");
@@ -114,33 +214,328 @@
 
 - (void)unblock
 {
+    interestChanged_ = YES;
+    OSMemoryBarrier();
+
     char dummy = 0;
     write(unblockPipeW, &dummy, 1);
 }
 
+#pragma mark - Registrations
+
+// Must be called with tasksLock held.
+- (void)removeRegistrationForTask:(PTYTask *)task
+{
+    TaskNotifierRegistration *registration =
+        (TaskNotifierRegistration *)CFDictionaryGetValue(registrations_, task);
+    if (!registration) {
+        return;
+    }
+    // The filters are not deleted from the kqueue here because the fd may already have been
+    // closed and reused. Events for fds with no owner are deleted as they arrive.
+    [self releaseOwnershipOfFd:registration->ptyRead.fd byRegistration:registration];
+    [self releaseOwnershipOfFd:registration->ptyWrite.fd byRegistration:registration];
+    [self releaseOwnershipOfFd:registration->coprocessRead.fd byRegistration:registration];
+    [self releaseOwnershipOfFd:registration->coprocessWrite.fd byRegistration:registration];
+    CFDictionaryRemoveValue(registrations_, task);
+    free(registration);
+}
+
+- (void)removeAllRegistrations
+{
+    for (PTYTask *task in [[tasks copy] autorelease]) {
+        [self removeRegistrationForTask:task];
+    }
+}
+
+- (void)claimFd:(int)fd forRegistration:(TaskNotifierRegistration *)registration
+{
+    if (fd >= fdOwnersCapacity_) {
+        int newCapacity = MAX(fd + 1, MAX(64, fdOwnersCapacity_ * 2));
+        fdOwners_ = realloc(fdOwners_, newCapacity * sizeof(TaskNotifierRegistration *));
+        memset(fdOwners_ + fdOwnersCapacity_,
+               0,
+               (newCapacity - fdOwnersCapacity_) * sizeof(TaskNotifierRegistration *));
+        fdOwnersCapacity_ = newCapacity;
+    }
+    fdOwners_[fd] = registration;
+}
+
+- (void)releaseOwnershipOfFd:(int)fd byRegistration:(TaskNotifierRegistration *)registration
+{
+    if (fd >= 0 && fd < fdOwnersCapacity_ && fdOwners_[fd] == registration) {
+        fdOwners_[fd] = NULL;
+    }
+}
+
+- (TaskNotifierRegistration *)ownerOfFd:(int)fd
+{
+    if (fd < 0 || fd >= fdOwnersCapacity_) {
+        return NULL;
+    }
+    return fdOwners_[fd];
+}
+
+// Only called on the notifier thread.
+- (void)addChangeForIdent:(uintptr_t)ident
+                   filter:(int16_t)filter
+                    flags:(uint16_t)flags
+                   fflags:(uint32_t)fflags
+{
+    if (numChanges_ == changesCapacity_) {
+        changesCapacity_ = MAX(16, changesCapacity_ * 2);
+        changes_ = realloc(changes_, changesCapacity_ * sizeof(struct kevent));
+    }
+    EV_SET(&changes_[numChanges_], ident, filter, flags, fflags, 0, NULL);
+    numChanges_++;
+}
+
+// Brings one filter of a registration in sync with what the task wants. A kqueue change is
+// queued only if the registered state differs from the desired state. Must be called with
+// tasksLock held.
+- (void)updateFilter:(TaskNotifierFilter *)taskFilter
+          kqueueType:(int16_t)type
+                  fd:(int)fd
+                want:(BOOL)want
+        registration:(TaskNotifierRegistration *)registration
+{
+    if (taskFilter->fd != fd) {
+        // The old fd was closed (or is being replaced). The kernel removes filters on close, so
+        // just forget about it.
+        [self releaseOwnershipOfFd:taskFilter->fd byRegistration:registration];
+        taskFilter->fd = fd;
+        taskFilter->enabled = NO;
+    }
+    if (fd < 0 || want == taskFilter->enabled) {
+        return;
+    }
+    if (want) {
+        [self claimFd:fd forRegistration:registration];
+        [self addChangeForIdent:fd filter:type flags:EV_ADD | EV_ENABLE fflags:0];
+    } else {
+        [self addChangeForIdent:fd filter:type flags:EV_DELETE fflags:0];
+    }
+    taskFilter->enabled = want;
+}
+
+// Must be called with tasksLock held.
+- (void)updateInterestForTask:(PTYTask *)task
+{
+    TaskNotifierRegistration *registration =
+        (TaskNotifierRegistration *)CFDictionaryGetValue(registrations_, task);
+    if (!registration) {
+        return;
+    }
+    int fd = [task fd];
+    [self updateFilter:&registration->ptyRead
+            kqueueType:EVFILT_READ
+                    fd:fd
+                  want:[task wantsRead]
+          registration:registration];
+    [self updateFilter:&registration->ptyWrite
+            kqueueType:EVFILT_WRITE
+                    fd:fd
+                  want:[task wantsWrite]
+          registration:registration];
+
+    @synchronized (task) {
+        Coprocess *coprocess = [task coprocess];
+        int rfd = -1;
+        int wfd = -1;
+        BOOL wantCoprocessRead = NO;
+        BOOL wantCoprocessWrite = NO;
+        if (coprocess) {
+            rfd = [coprocess readFileDescriptor];
+            wfd = [coprocess writeFileDescriptor];
+            wantCoprocessRead = [coprocess wantToRead] && [task writeBufferHasRoom];
+            wantCoprocessWrite = [coprocess wantToWrite];
+        }
+        [self updateFilter:&registration->coprocessRead
+                kqueueType:EVFILT_READ
+                        fd:rfd
+                      want:wantCoprocessRead
+              registration:registration];
+        [self updateFilter:&registration->coprocessWrite
+                kqueueType:EVFILT_WRITE
+                        fd:wfd
+                      want:wantCoprocessWrite
+              registration:registration];
+    }
+}
+
+#pragma mark - Run loop
+
+// Must be called with tasksLock held.
+- (void)reapDeadpool
+{
+    if ([deadpool count] == 0) {
+        return;
+    }
+    // waitpid() on pids that we think are dead or will be dead soon.
+    NSMutableSet* newDeadpool = [NSMutableSet setWithCapacity:[deadpool count]];
+    for (NSNumber* pid in deadpool) {
+        int statLoc;
+        PtyTaskDebugLog(@"wait on %d", [pid intValue]);
+        pid_t rc = waitpid([pid intValue], &statLoc, WNOHANG);
+        if (rc < 0) {
+            if (errno != ECHILD) {
+                PtyTaskDebugLog(@"  wait failed with %d (%s), adding back to deadpool", errno, strerror(errno));
+                [newDeadpool addObject:pid];
+            } else {
+                PtyTaskDebugLog(@"  wait failed with ECHILD, I guess we already waited on it.");
+            }
+        } else if (rc == 0 && [pid intValue] > 0) {
+            // Still running. Let the kqueue tell us when it exits instead of polling.
+            PtyTaskDebugLog(@"  %d still running, watching for its exit", [pid intValue]);
+            [self addChangeForIdent:[pid intValue]
+                             filter:EVFILT_PROC
+                              flags:EV_ADD | EV_ONESHOT
+                             fflags:NOTE_EXIT];
+        }
+    }
+    [deadpool release];
+    deadpool = [newDeadpool retain];
+}
+
+- (void)drainUnblockPipe
+{
+    char dummy[32];
+    do {
+        read(unblockPipeR, dummy, sizeof(dummy));
+    } while (errno != EAGAIN);
+}
+
+// Handles a single event from the kqueue. Returns YES if the coprocess status changed.
+- (BOOL)handleEvent:(struct kevent *)event
+{
+    int fd = (int)event->ident;
+    PtyTaskDebugLog(@"run2: lock");
+    [tasksLock lock];
+    TaskNotifierRegistration *registration = [self ownerOfFd:fd];
+    if (!registration) {
+        // Nobody owns this fd anymore (e.g., the task was deregistered after a broken pipe but
+        // has not closed its fd yet). Stop watching it.
+        PtyTaskDebugLog(@"Event for unowned fd %d", fd);
+        [self addChangeForIdent:fd filter:event->filter flags:EV_DELETE fflags:0];
+        [tasksLock unlock];
+        return NO;
+    }
+    PTYTask *task = [[registration->task retain] autorelease];
+    BOOL isPty = NO;
+    BOOL isCoprocess = NO;
+    if (event->filter == EVFILT_READ) {
+        isPty = (registration->ptyRead.fd == fd && registration->ptyRead.enabled);
+        isCoprocess = (!isPty &&
+                       registration->coprocessRead.fd == fd &&
+                       registration->coprocessRead.enabled);
+    } else {
+        isPty = (registration->ptyWrite.fd == fd && registration->ptyWrite.enabled);
+        isCoprocess = (!isPty &&
+                       registration->coprocessWrite.fd == fd &&
+                       registration->coprocessWrite.enabled);
+    }
+    PtyTaskDebugLog(@"run2: unlock");
+    [tasksLock unlock];
+
+    BOOL eof = (event->flags & EV_EOF) && event->data == 0;
+    BOOL notifyOfCoprocessChange = NO;
+    if (isPty) {
+        if (event->filter == EVFILT_READ) {
+            [task processRead];
+            if (eof && ![task hasBrokenPipe]) {
+                // brokenPipe will call deregisterTask and add the pid to deadpool.
+                [task brokenPipe];
+            }
+        } else if (eof) {
+            if (![task hasBrokenPipe]) {
+                [task brokenPipe];
+            }
+        } else {
+            [task processWrite];
+        }
+    } else if (isCoprocess && [task fd] >= 0 && ![task hasBrokenPipe]) {
+        // Move input around between coprocess and main process.
+        @synchronized (task) {
+            Coprocess *coprocess = [task coprocess];
+            if (coprocess) {
+                if (event->filter == EVFILT_READ &&
+                    fd == [coprocess readFileDescriptor]) {
+                    if (![coprocess eof]) {
+                        [task readFromCoprocess:coprocess];
+                    }
+                    if (eof) {
+                        coprocess.eof = YES;
+                    }
+                } else if (event->filter == EVFILT_WRITE &&
+                           fd == [coprocess writeFileDescriptor]) {
+                    if (event->flags & EV_EOF) {
+                        coprocess.eof = YES;
+                    } else if (![coprocess eof]) {
+                        [coprocess write];
+                    }
+                }
+
+                if ([coprocess eof]) {
+                    [tasksLock lock];
+                    [deadpool addObject:[NSNumber numberWithInt:[coprocess pid]]];
+                    [tasksLock unlock];
+                    [coprocess terminate];
+                    [task setCoprocess:nil];
+                    notifyOfCoprocessChange = YES;
+                }
+            }
+        }
+    }
+
+    // Only the task that just did I/O can have changed its interest on this thread.
+    [tasksLock lock];
+    [self updateInterestForTask:task];
+    [tasksLock unlock];
+
+    return notifyOfCoprocessChange;
+}
+
+- (NSString *)summary
+{
+    [tasksLock lock];
+    int numTasks = [tasks count];
+    [tasksLock unlock];
+    const NSTimeInterval elapsed = [NSDate timeIntervalSinceReferenceDate] - startTime_;
+    return [NSString stringWithFormat:@"Notifier thread %d: %d tasks, %.1f%% busy recently, "
+                                      @"%.1f%% busy overall, %lld wakeups, %lld events",
+            index_,
+            numTasks,
+            recentUtilization_ * 100,
+            elapsed > 0 ? busyTime_ * 100 / elapsed : 0,
+            numWakeups_,
+            numEvents_];
+}
+
+// Called after handling each batch of events, from when kevent() returned.
+- (void)addBusyTimeSince:(NSTimeInterval)wakeTime numEvents:(int)numEvents
+{
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    busyTime_ += now - wakeTime;
+    numWakeups_++;
+    numEvents_ += numEvents;
+    if (now - windowStartTime_ >= kUtilizationInterval) {
+        recentUtilization_ = (busyTime_ - windowStartBusyTime_) / (now - windowStartTime_);
+        windowStartTime_ = now;
+        windowStartBusyTime_ = busyTime_;
+        DLog(@"%@", [self summary]);
+    }
+}
+
 - (void)run
 {
-    fd_set rfds;
-    fd_set wfds;
-    fd_set efds;
-    int highfd;
-    NSEnumerator* iter;
-    PTYTask* task;
+    struct kevent events[kMaxEventsPerWakeup];
     NSAutoreleasePool* autoreleasePool = [[NSAutoreleasePool alloc] init];
-    
-    // FIXME: replace this with something better...
+    [[NSThread currentThread] setName:[NSString stringWithFormat:@"TaskNotifier %d", index_]];
+    // Output read here is parsed on the same worker when it's free.
+    [ParseWorkerPool setPreferredWorkerForCurrentThread:index_];
+    startTime_ = windowStartTime_ = [NSDate timeIntervalSinceReferenceDate];
+
     for(;;) {
-        
-        FD_ZERO(&rfds);
-        FD_ZERO(&wfds);
-        FD_ZERO(&efds);
-        
-        // Unblock pipe to interrupt select() whenever a PTYTask register/unregisters
-        highfd = unblockPipeR;
-        FD_SET(unblockPipeR, &rfds);
-        NSMutableSet* handledFds = [[NSMutableSet alloc] initWithCapacity:[tasks count]];
-        
-        // Add all the PTYTask pipes
         PtyTaskDebugLog(@"run1: lock");
         [tasksLock lock];
         PtyTaskDebugLog(@"Begin cleaning out dead tasks");
@@ -149,233 +544,232 @@
             PTYTask* theTask = [tasks objectAtIndex:j];
             if ([theTask fd] < 0) {
                 PtyTaskDebugLog(@"Deregister dead task %d\n", j);
-                [self deregisterTask:theTask];
+                [[TaskNotifier sharedInstance] deregisterTask:theTask];
             }
         }
-        
-        if ([deadpool count] > 0) {
-            // waitpid() on pids that we think are dead or will be dead soon.
-            NSMutableSet* newDeadpool = [NSMutableSet setWithCapacity:[deadpool count]];
-            for (NSNumber* pid in deadpool) {
-                int statLoc;
-                PtyTaskDebugLog(@"wait on %d", [pid intValue]);
-                if (waitpid([pid intValue], &statLoc, WNOHANG) < 0) {
-                    if (errno != ECHILD) {
-                        PtyTaskDebugLog(@"  wait failed with %d (%s), adding back to deadpool", errno, strerror(errno));
-                        [newDeadpool addObject:pid];
-                    } else {
-                        PtyTaskDebugLog(@"  wait failed with ECHILD, I guess we already waited on it.");
-                    }
-                }
-            }
-            [deadpool release];
-            deadpool = [newDeadpool retain];
-        }
-        
-        PtyTaskDebugLog(@"Begin enumeration over %lu tasks\n", (unsigned long)[tasks count]);
-        iter = [tasks objectEnumerator];
-        int i = 0;
-        // FIXME: this can be converted to ObjC 2.0.
-        while ((task = [iter nextObject])) {
-            PtyTaskDebugLog(@"Got task %d\n", i);
-            int fd = [task fd];
-            if (fd < 0) {
-                PtyTaskDebugLog(@"Task has fd of %d\n", fd);
-            } else {
-                // PtyTaskDebugLog(@"Select on fd %d\n", fd);
-                if (fd > highfd)
-                    highfd = fd;
-                if ([task wantsRead])
-                    FD_SET(fd, &rfds);
-                if ([task wantsWrite])
-                    FD_SET(fd, &wfds);
-                FD_SET(fd, &efds);
-            }
-            @synchronized (task) {
-                Coprocess *coprocess = [task coprocess];
-                if (coprocess) {
-                    if ([coprocess wantToRead] && [task writeBufferHasRoom]) {
-                        int rfd = [coprocess readFileDescriptor];
-                        if (rfd > highfd) {
-                            highfd = rfd;
-                        }
-                        FD_SET(rfd, &rfds);
-                    }
-                    if ([coprocess wantToWrite]) {
-                        int wfd = [coprocess writeFileDescriptor];
-                        if (wfd > highfd) {
-                            highfd = wfd;
-                        }
-                        FD_SET(wfd, &wfds);
-                    }
-                    if (![coprocess eof]) {
-                        int rfd = [coprocess readFileDescriptor];
-                        if (rfd > highfd) {
-                            highfd = rfd;
-                        }
-                        FD_SET(rfd, &efds);
-                        
-                        int wfd = [coprocess writeFileDescriptor];
-                        if (wfd > highfd) {
-                            highfd = wfd;
-                        }
-                        FD_SET(wfd, &efds);
-                    }
-                }
+
+        [self reapDeadpool];
+
+        if (interestChanged_) {
+            // Another thread may have changed what some task wants. The kqueue is only told about
+            // filters whose state actually flipped.
+            PtyTaskDebugLog(@"Re-examining interest of %lu tasks\n", (unsigned long)[tasks count]);
+            interestChanged_ = NO;
+            for (PTYTask *task in tasks) {
+                [self updateInterestForTask:task];
             }
-            ++i;
-            PtyTaskDebugLog(@"About to get task %d\n", i);
         }
         PtyTaskDebugLog(@"run1: unlock");
         [tasksLock unlock];
-        
-        // Poll...
-        if (select(highfd+1, &rfds, &wfds, &efds, NULL) <= 0) {
-            switch(errno) {
-                case EAGAIN:
-                case EINTR:
-                default:
-                    goto breakloop;
-                    // If the file descriptor is closed in the main thread there's a race where sometimes you'll get an EBADF.
-            }
-        }
-        
-        // Interrupted?
-        if (FD_ISSET(unblockPipeR, &rfds)) {
-            char dummy[32];
-            do {
-                read(unblockPipeR, dummy, sizeof(dummy));
-            } while (errno != EAGAIN);
+
+        // Submit pending changes and wait for events.
+        int numChanges = numChanges_;
+        numChanges_ = 0;
+        SignpostBegin("TaskNotifier wait", nil, numChanges);
+        int numEvents = kevent(kq_, changes_, numChanges, events, kMaxEventsPerWakeup, NULL);
+        SignpostEnd("TaskNotifier wait", nil, numEvents);
+        const NSTimeInterval wakeTime = [NSDate timeIntervalSinceReferenceDate];
+        if (numEvents < 0) {
+            // EINTR, or EBADF if a file descriptor was closed in the main thread while its change
+            // was pending. In either case the next iteration rebuilds state.
+            PtyTaskDebugLog(@"kevent failed with %d (%s)", errno, strerror(errno));
+            interestChanged_ = YES;
+            goto breakloop;
         }
-        
-        // Check for read events on PTYTask pipes
-        PtyTaskDebugLog(@"run2: lock");
-        [tasksLock lock];
-        PtyTaskDebugLog(@"Iterating over %lu tasks\n", (unsigned long)[tasks count]);
-        iter = [tasks objectEnumerator];
-        i = 0;
+
+        SignpostBegin("TaskNotifier dispatch", nil, numEvents);
         BOOL notifyOfCoprocessChange = NO;
-        
-        while ((task = [iter nextObject])) {
-            PtyTaskDebugLog(@"Got task %d\n", i);
-            int fd = [task fd];
-            if (fd >= 0) {
-                // This is mostly paranoia, but if two threads
-                // end up with the same fd (because one closed
-                // and there was a race condition) then trying
-                // to read twice would hang.
-                
-                if ([handledFds containsObject:[NSNumber numberWithInt:fd]]) {
-                    PtyTaskDebugLog(@"Duplicate fd %d", fd);
-                    continue;
-                }
-                [task retain];
-                [handledFds addObject:[NSNumber numberWithInt:fd]];
-                
-                if (FD_ISSET(fd, &rfds)) {
-                    PtyTaskDebugLog(@"run/processRead: unlock");
-                    [tasksLock unlock];
-                    [task processRead];
-                    PtyTaskDebugLog(@"run/processRead: lock");
-                    [tasksLock lock];
-                    if (tasksChanged) {
-                        PtyTaskDebugLog(@"Restart iteration\n");
-                        tasksChanged = NO;
-                        iter = [tasks objectEnumerator];
-                    }
-                }
-                if (FD_ISSET(fd, &wfds)) {
-                    PtyTaskDebugLog(@"run/processWrite: unlock");
-                    [tasksLock unlock];
-                    [task processWrite];
-                    PtyTaskDebugLog(@"run/processWrite: lock");
-                    [tasksLock lock];
-                    if (tasksChanged) {
-                        PtyTaskDebugLog(@"Restart iteration\n");
-                        tasksChanged = NO;
-                        iter = [tasks objectEnumerator];
-                    }
+        for (int i = 0; i < numEvents; i++) {
+            struct kevent *event = &events[i];
+            if (event->flags & EV_ERROR) {
+                // A change could not be applied. The usual cause is a pid that exited before we
+                // could watch it, or an fd that was closed before its registration went through.
+                PtyTaskDebugLog(@"kevent error %d for ident %lu filter %d", (int)event->data,
+                                (unsigned long)event->ident, (int)event->filter);
+                if (event->filter == EVFILT_PROC) {
+                    [self waitForPid:(pid_t)event->ident];
                 }
-                if (FD_ISSET(fd, &efds)) {
-                    PtyTaskDebugLog(@"run/brokenPipe: unlock");
-                    [tasksLock unlock];
-                    // brokenPipe will call deregisterTask and add the pid to
-                    // deadpool.
-                    [task brokenPipe];
-                    PtyTaskDebugLog(@"run/brokenPipe: lock");
-                    [tasksLock lock];
-                    if (tasksChanged) {
-                        PtyTaskDebugLog(@"Restart iteration\n");
-                        tasksChanged = NO;
-                        iter = [tasks objectEnumerator];
-                    }
-                }
-                
-                // Move input around between coprocess and main process.
-                if ([task fd] >= 0 && ![task hasBrokenPipe]) {  // Make sure the pipe wasn't just broken.
-                    @synchronized (task) {
-                        Coprocess *coprocess = [task coprocess];
-                        if (coprocess) {
-                            fd = [coprocess readFileDescriptor];
-                            if ([handledFds containsObject:[NSNumber numberWithInt:fd]]) {
-                                NSLog(@"Duplicate fd %d", fd);
-                                continue;
-                            }
-                            [handledFds addObject:[NSNumber numberWithInt:fd]];
-                            if (![coprocess eof] && FD_ISSET(fd, &rfds)) {
-                                [coprocess read];
-                                [task writeTask:coprocess.inputBuffer];
-                                [coprocess.inputBuffer setLength:0];
-                            }
-                            if (FD_ISSET(fd, &efds)) {
-                                coprocess.eof = YES;
-                            }
-                            
-                            fd = [coprocess writeFileDescriptor];
-                            if ([handledFds containsObject:[NSNumber numberWithInt:fd]]) {
-                                NSLog(@"Duplicate fd %d", fd);
-                                continue;
-                            }
-                            [handledFds addObject:[NSNumber numberWithInt:fd]];
-                            if (FD_ISSET(fd, &efds)) {
-                                coprocess.eof = YES;
-                            }
-                            if (FD_ISSET(fd, &wfds)) {
-                                if (![coprocess eof]) {
-                                    [coprocess write];
-                                }
-                            }
-                            
-                            if ([coprocess eof]) {
-                                [deadpool addObject:[NSNumber numberWithInt:[coprocess pid]]];
-                                [coprocess terminate];
-                                [task setCoprocess:nil];
-                                notifyOfCoprocessChange = YES;
-                            }
-                        }
-                    }
-                }
-                [task release];
+                continue;
+            }
+            if (event->filter == EVFILT_PROC) {
+                int statLoc;
+                PtyTaskDebugLog(@"Process %lu exited", (unsigned long)event->ident);
+                waitpid((pid_t)event->ident, &statLoc, WNOHANG);
+                continue;
+            }
+            if (event->ident == unblockPipeR) {
+                [self drainUnblockPipe];
+                continue;
+            }
+            if ([self handleEvent:event]) {
+                notifyOfCoprocessChange = YES;
             }
-            ++i;
-            PtyTaskDebugLog(@"About to get task %d\n", i);
         }
-        PtyTaskDebugLog(@"run3: unlock");
-        [tasksLock unlock];
+
         if (notifyOfCoprocessChange) {
-            [self performSelectorOnMainThread:@selector(notifyCoprocessChange)
-                                   withObject:nil
-                                waitUntilDone:YES];
+            [[TaskNotifier sharedInstance] performSelectorOnMainThread:@selector(notifyCoprocessChange)
+                                                            withObject:nil
+                                                         waitUntilDone:YES];
         }
-        
+        [self addBusyTimeSince:wakeTime numEvents:numEvents];
+        SignpostEnd("TaskNotifier dispatch", nil, numEvents);
+
     breakloop:
-        [handledFds release];
         [autoreleasePool drain];
         autoreleasePool = [[NSAutoreleasePool alloc] init];
     }
     assert(false);  // Must never get here or the autorelease pool would leak.
 }
 
+@end
+
+@implementation TaskNotifier
+{
+    NSArray *shards_;
+
+    // Protects shardOfTask_ and numTasksInShard_.
+    OSSpinLock lock_;
+
+    // PTYTask* -> TaskNotifierShard* for each registered task. Neither is retained.
+    CFMutableDictionaryRef shardOfTask_;
+    int *numTasksInShard_;
+}
+
++ (instancetype)sharedInstance {
+    static id instance;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        instance = [[self alloc] init];
+    });
+    return instance;
+}
+
+// The TaskNotifierThreads preference, or a quarter of the cores if it isn't set.
++ (int)numberOfShards
+{
+    NSInteger count = [[NSUserDefaults standardUserDefaults] integerForKey:@"TaskNotifierThreads"];
+    if (count <= 0) {
+        count = [[NSProcessInfo processInfo] activeProcessorCount] / 4;
+    }
+    return MAX(1, MIN(kMaxShards, count));
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        lock_ = OS_SPINLOCK_INIT;
+        shardOfTask_ = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
+        const int numShards = [TaskNotifier numberOfShards];
+        NSMutableArray *shards = [NSMutableArray arrayWithCapacity:numShards];
+        for (int i = 0; i < numShards; i++) {
+            TaskNotifierShard *shard = [[[TaskNotifierShard alloc] initWithIndex:i] autorelease];
+            if (!shard) {
+                break;
+            }
+            [shards addObject:shard];
+        }
+        if (![shards count]) {
+            [self release];
+            return nil;
+        }
+        shards_ = [shards copy];
+        numTasksInShard_ = calloc([shards_ count], sizeof(int));
+        DLog(@"Starting %d TaskNotifier threads", (int)[shards_ count]);
+        for (TaskNotifierShard *shard in shards_) {
+            [NSThread detachNewThreadSelector:@selector(run)
+                                     toTarget:shard
+                                   withObject:nil];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [shards_ release];
+    if (shardOfTask_) {
+        CFRelease(shardOfTask_);
+    }
+    free(numTasksInShard_);
+    [super dealloc];
+}
+
+- (TaskNotifierShard *)shardForTask:(PTYTask *)task
+{
+    OSSpinLockLock(&lock_);
+    TaskNotifierShard *shard = (TaskNotifierShard *)CFDictionaryGetValue(shardOfTask_, task);
+    OSSpinLockUnlock(&lock_);
+    return shard;
+}
+
+- (void)registerTask:(PTYTask*)task
+{
+    OSSpinLockLock(&lock_);
+    TaskNotifierShard *shard = (TaskNotifierShard *)CFDictionaryGetValue(shardOfTask_, task);
+    if (!shard) {
+        // The shard with the fewest tasks, or the least busy one of those.
+        for (TaskNotifierShard *candidate in shards_) {
+            if (!shard ||
+                numTasksInShard_[candidate.index] < numTasksInShard_[shard.index] ||
+                (numTasksInShard_[candidate.index] == numTasksInShard_[shard.index] &&
+                 candidate.recentUtilization < shard.recentUtilization)) {
+                shard = candidate;
+            }
+        }
+        CFDictionarySetValue(shardOfTask_, task, shard);
+        numTasksInShard_[shard.index]++;
+    }
+    OSSpinLockUnlock(&lock_);
+    [shard registerTask:task];
+}
+
+- (void)deregisterTask:(PTYTask*)task
+{
+    OSSpinLockLock(&lock_);
+    TaskNotifierShard *shard = (TaskNotifierShard *)CFDictionaryGetValue(shardOfTask_, task);
+    if (shard) {
+        CFDictionaryRemoveValue(shardOfTask_, task);
+        numTasksInShard_[shard.index]--;
+    }
+    OSSpinLockUnlock(&lock_);
+    // A task that was never registered, or was already deregistered, still has pids to reap.
+    [shard ? shard : [shards_ objectAtIndex:0] deregisterTask:task];
+}
+
+- (void)unblockTask:(PTYTask *)task
+{
+    [[self shardForTask:task] unblock];
+}
+
+- (void)waitForPid:(pid_t)pid
+{
+    [[shards_ objectAtIndex:(unsigned int)pid % [shards_ count]] waitForPid:pid];
+}
+
+- (NSString *)summary
+{
+    NSMutableArray *lines = [NSMutableArray arrayWithCapacity:[shards_ count]];
+    for (TaskNotifierShard *shard in shards_) {
+        [lines addObject:[shard summary]];
+    }
+    return [lines componentsJoinedByString:@"\n"];
+}
+
+- (void)getBusyTime:(NSTimeInterval *)busyTime
+            wakeups:(long long *)wakeups
+ highestUtilization:(double *)highestUtilization
+{
+    *busyTime = 0;
+    *wakeups = 0;
+    *highestUtilization = 0;
+    for (TaskNotifierShard *shard in shards_) {
+        *busyTime += shard.busyTime;
+        *wakeups += shard.numWakeups;
+        *highestUtilization = MAX(*highestUtilization, shard.recentUtilization);
+    }
+}
+
 // This is run in the main thread.
 - (void)notifyCoprocessChange
 {
@@ -18,11 +18,11 @@
 // A size of -1 means the size is unknown.
 - (id)initWithName:(NSString *)name size:(int)size;
 
-// Appends data to a file in transferring status. Enters transferring status.
+// Decodes a chunk of base64 and writes it to localPath. Enters transferring status.
 - (void)appendData:(NSString *)data;
 
-// Marks the end of data, at which time the file is decoded and saved. If -stop
-// was called, the cancelled state is entered.
+// Marks the end of data, at which time the file is closed. If -stop was called, or the data
+// wasn't valid, the partly written file is removed.
 - (void)endOfData;
 
 @end
@@ -7,17 +7,22 @@
 //
 
 #import "TerminalFile.h"
+#import "Base64StreamDecoder.h"
 #import "FileTransferManager.h"
 #import "FutureMethods.h"
-#import <apr-1/apr_base64.h>
 
 @interface TerminalFile ()
-@property(nonatomic, retain) NSMutableString *data;
+// Non-nil while receiving. Decodes each chunk as it arrives.
+@property(nonatomic, retain) Base64StreamDecoder *decoder;
 @property(nonatomic, copy) NSString *filename;  // No path, just a name.
 @property(nonatomic, retain) NSString *error;
 @end
 
-@implementation TerminalFile
+@implementation TerminalFile {
+    FILE *_file;  // localPath, opened when the first chunk arrives.
+    NSMutableData *_decodedChunk;  // Reused for each chunk so memory use doesn't grow.
+    BOOL _failed;
+}
 
 - (id)initWithName:(NSString *)name size:(int)size {
     self = [super init];
@@ -40,8 +45,12 @@
 }
 
 - (void)dealloc {
+    if (_file) {
+        fclose(_file);
+    }
+    [_decodedChunk release];
     [_localPath release];
-    [_data release];
+    [_decoder release];
     [_filename release];
     [_error release];
     [super dealloc];
@@ -74,7 +83,11 @@
     self.error = [error localizedDescription];
     [[FileTransferManager sharedInstance] transferrableFile:self
                              didFinishTransmissionWithError:error];
-    self.data = [NSMutableString string];
+    if (self.localPath) {
+        self.decoder = [[[Base64StreamDecoder alloc] init] autorelease];
+        [_decodedChunk release];
+        _decodedChunk = [[NSMutableData alloc] init];
+    }
 }
 
 - (void)upload {
@@ -84,7 +97,8 @@
 - (void)stop {
     self.status = kTransferrableFileStatusCancelling;
     [[FileTransferManager sharedInstance] transferrableFileWillStop:self];
-    self.data = nil;
+    self.decoder = nil;
+    [self closeAndRemoveFile];
 }
 
 - (NSString *)destination  {
@@ -98,52 +112,97 @@
 #pragma mark - APIs
 
 - (void)appendData:(NSString *)data {
-    if (self.data) {
-        self.status = kTransferrableFileStatusTransferring;
-        [self.data appendString:data];
-        self.bytesTransferred = apr_base64_decode_len([self.data UTF8String]);
-        if (self.fileSize >= 0) {
-            self.bytesTransferred = MIN(self.fileSize, self.bytesTransferred);
-        }
-        [[FileTransferManager sharedInstance] transferrableFileProgressDidChange:self];
+    if (!self.decoder || _failed) {
+        return;
+    }
+    self.status = kTransferrableFileStatusTransferring;
+    const char *chars = [data UTF8String] ?: "";
+    [_decodedChunk setLength:0];
+    if (![self.decoder decodeChars:chars length:strlen(chars) intoData:_decodedChunk]) {
+        [self failWithDescription:@"File corrupted (not valid base64)."];
+        return;
     }
+    if (![self writeDecodedChunk]) {
+        return;
+    }
+    self.bytesTransferred = self.decoder.decodedLength;
+    if (self.fileSize >= 0) {
+        self.bytesTransferred = MIN(self.fileSize, self.bytesTransferred);
+    }
+    [[FileTransferManager sharedInstance] transferrableFileProgressDidChange:self];
 }
 
 - (void)endOfData {
-    if (!self.data) {
+    if (!self.decoder) {
         self.status = kTransferrableFileStatusCancelled;
         [[FileTransferManager sharedInstance] transferrableFileDidStopTransfer:self];
         return;
     }
-    const char *buffer = [self.data UTF8String];
-    int destLength = apr_base64_decode_len(buffer);
-    if (destLength < 1) {
-        [[FileTransferManager sharedInstance] transferrableFile:self
-                                 didFinishTransmissionWithError:[self errorWithDescription:@"No data received."]];
+    if (_failed) {
         return;
     }
-    NSMutableData *data = [NSMutableData dataWithLength:destLength];
-    char *decodedBuffer = [data mutableBytes];
-    int resultLength = apr_base64_decode(decodedBuffer, buffer);
-    if (resultLength < 0) {
-        [[FileTransferManager sharedInstance] transferrableFile:self
-                                 didFinishTransmissionWithError:[self errorWithDescription:@"File corrupted (not valid base64)."]];
+    [_decodedChunk setLength:0];
+    if (![self.decoder finishIntoData:_decodedChunk]) {
+        [self failWithDescription:@"File corrupted (not valid base64)."];
         return;
     }
-   
-    if (![data writeToFile:self.localPath atomically:NO]) {
-        [[FileTransferManager sharedInstance] transferrableFile:self
-                                 didFinishTransmissionWithError:[self errorWithDescription:@"Failed to write file to disk."]];
+    if (![self writeDecodedChunk]) {
         return;
     }
-    
-    [[FileTransferManager sharedInstance] transferrableFile:self didFinishTransmissionWithError:nil];
-    return;
+    if (self.decoder.decodedLength < 1) {
+        [self failWithDescription:@"No data received."];
+        return;
+    }
+    const int closeResult = fclose(_file);
+    _file = NULL;
+    if (closeResult) {
+        unlink([self.localPath fileSystemRepresentation]);
+        [self failWithDescription:@"Failed to write file to disk."];
+        return;
+    }
+    self.decoder = nil;
+    [_decodedChunk release];
+    _decodedChunk = nil;
 
+    [[FileTransferManager sharedInstance] transferrableFile:self didFinishTransmissionWithError:nil];
 }
 
 #pragma mark - Private
 
+// Writes _decodedChunk to the file, opening it first if needed. Fails the transfer and returns NO
+// on error.
+- (BOOL)writeDecodedChunk {
+    if (!_file) {
+        _file = fopen([self.localPath fileSystemRepresentation], "wb");
+        if (!_file) {
+            [self failWithDescription:@"Failed to write file to disk."];
+            return NO;
+        }
+    }
+    const size_t length = [_decodedChunk length];
+    if (length && fwrite([_decodedChunk bytes], 1, length, _file) != length) {
+        [self failWithDescription:@"Failed to write file to disk."];
+        return NO;
+    }
+    return YES;
+}
+
+// Removes the partly written file and reports the error. Later data is ignored.
+- (void)failWithDescription:(NSString *)description {
+    _failed = YES;
+    [self closeAndRemoveFile];
+    [[FileTransferManager sharedInstance] transferrableFile:self
+                             didFinishTransmissionWithError:[self errorWithDescription:description]];
+}
+
+- (void)closeAndRemoveFile {
+    if (_file) {
+        fclose(_file);
+        _file = NULL;
+        unlink([self.localPath fileSystemRepresentation]);
+    }
+}
+
 - (NSError *)errorWithDescription:(NSString *)description {
     return [NSError errorWithDomain:@"com.googlecode.iterm2.TerminalFile"
                                code:1
@@ -0,0 +1,53 @@
+//
+//  TimerWheel.h
+//  iTerm
+//
+//  One main-thread timer for the app's periodic and delayed work, so that a hundred sessions each
+//  with their own timers don't wake the app up thousands of times a minute, which also keeps App
+//  Nap and the OS's timer coalescing from working.
+//
+//  Timers are kept in a hierarchical timing wheel with a 10ms tick: 256 slots for the next 2.56
+//  seconds, then 64 slots of 2.56 seconds and 64 of 164 seconds; timers further out wait in the
+//  last slot. A dispatch timer on the main queue wakes the wheel only at the earliest deadline, and
+//  then also fires every other timer whose window has opened. Each timer has a leeway, which is
+//  how late it may fire so it can share a wakeup with other timers.
+//
+//  Unlike NSTimer, timers run in every run loop mode, since they're driven by the main queue.
+//
+
+#import <Foundation/Foundation.h>
+
+@interface TimerWheelTimer : NSObject
+
+@property(nonatomic, readonly) id userInfo;
+@property(nonatomic, readonly) NSString *category;
+@property(nonatomic, readonly) BOOL isValid;
+
+// Like -[NSTimer invalidate]: the timer won't fire again and its target is released.
+- (void)invalidate;
+
+@end
+
+@interface TimerWheel : NSObject
+
++ (TimerWheel *)sharedInstance;
+
+// Like +[NSTimer scheduledTimerWithTimeInterval:target:selector:userInfo:repeats:], and likewise
+// the target is retained until the timer is invalidated or, if it doesn't repeat, fires. The
+// selector is passed the TimerWheelTimer. It fires between |interval| and |interval| + |leeway|
+// from now (leeway is capped at a second). |category| groups timers in the statistics. Main thread
+// only.
++ (TimerWheelTimer *)scheduledTimerWithTimeInterval:(NSTimeInterval)interval
+                                             leeway:(NSTimeInterval)leeway
+                                             target:(id)target
+                                           selector:(SEL)selector
+                                           userInfo:(id)userInfo
+                                            repeats:(BOOL)repeats
+                                           category:(NSString *)category;
+
+// Wakeups per second over the last ten seconds, by the category of the timer that caused each,
+// and how many timers of each category fired. Also logged with DLog every ten seconds while timers
+// are firing.
+- (NSString *)statistics;
+
+@end
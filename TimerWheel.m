@@ -0,0 +1,432 @@
+//
+//  TimerWheel.m
+//  iTerm
+//
+
+#import "TimerWheel.h"
+#import "DebugLogging.h"
+
+static const NSTimeInterval kTick = 0.01;
+static const NSTimeInterval kMaxLeeway = 1;
+static const NSTimeInterval kStatisticsInterval = 10;
+
+// Level 0 has a slot per tick. Each slot of level n + 1 spans all of level n.
+enum {
+    kNumLevels = 3,
+    kLevel0Bits = 8,
+    kLevelBits = 6,
+    kLevel0Slots = 1 << kLevel0Bits,
+    kLevelSlots = 1 << kLevelBits,
+};
+
+// Ticks covered by levels up to and including |level|.
+static int64_t TimerWheelSpan(int level) {
+    return 1LL << (kLevel0Bits + level * kLevelBits);
+}
+
+// Bits of a tick below the slot index of |level|.
+static int TimerWheelShift(int level) {
+    return level ? kLevel0Bits + (level - 1) * kLevelBits : 0;
+}
+
+static int TimerWheelNumSlots(int level) {
+    return level ? kLevelSlots : kLevel0Slots;
+}
+
+static int64_t TimerWheelTickForTime(NSTimeInterval time) {
+    return (int64_t)floor(time / kTick);
+}
+
+@interface TimerWheelTimer () {
+  @public
+    id target_;
+    SEL selector_;
+    id userInfo_;
+    NSString *category_;
+    NSTimeInterval interval_;
+    NSTimeInterval leeway_;
+    BOOL repeats_;
+    BOOL valid_;
+
+    // Owned by TimerWheel.
+    NSTimeInterval fireTime_;  // The earliest it may fire.
+    int64_t deadlineTick_;  // The latest it may fire.
+    TimerWheelTimer *prev_;
+    TimerWheelTimer *next_;
+    TimerWheelTimer **slot_;  // Head of the list it's in, or NULL.
+    int level_;
+}
+@end
+
+@interface TimerWheel ()
+- (void)scheduleTimer:(TimerWheelTimer *)timer;
+- (void)invalidateTimer:(TimerWheelTimer *)timer;
+@end
+
+@implementation TimerWheelTimer
+
+@synthesize userInfo = userInfo_;
+@synthesize category = category_;
+@synthesize isValid = valid_;
+
+- (void)dealloc
+{
+    [target_ release];
+    [userInfo_ release];
+    [category_ release];
+    [super dealloc];
+}
+
+- (void)invalidate
+{
+    [[TimerWheel sharedInstance] invalidateTimer:self];
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"<%@: %p %@ %@ interval=%0.3f%@>",
+               [self class], self, category_, NSStringFromSelector(selector_), interval_,
+               valid_ ? @"" : @" invalid"];
+}
+
+@end
+
+@implementation TimerWheel {
+    TimerWheelTimer *slots_[kNumLevels][kLevel0Slots];
+    int counts_[kNumLevels];  // Timers in each level.
+    int64_t currentTick_;  // Every slot up to this tick has been fired.
+    dispatch_source_t source_;
+    int64_t armedTick_;  // When source_ will fire, or INT64_MAX if it won't.
+    BOOL firing_;
+
+    // Statistics for the current window.
+    NSTimeInterval windowStart_;
+    int windowWakeups_;
+    NSMutableDictionary *windowWakeupsByCategory_;  // NSString -> NSNumber
+    NSMutableDictionary *windowFiresByCategory_;  // NSString -> NSNumber
+    NSString *lastStatistics_;
+}
+
++ (TimerWheel *)sharedInstance
+{
+    static id instance;
+    static dispatch_once_t once;
+    dispatch_once(&once, ^{
+        instance = [[self alloc] init];
+    });
+    return instance;
+}
+
++ (TimerWheelTimer *)scheduledTimerWithTimeInterval:(NSTimeInterval)interval
+                                             leeway:(NSTimeInterval)leeway
+                                             target:(id)target
+                                           selector:(SEL)selector
+                                           userInfo:(id)userInfo
+                                            repeats:(BOOL)repeats
+                                           category:(NSString *)category
+{
+    TimerWheelTimer *timer = [[[TimerWheelTimer alloc] init] autorelease];
+    timer->target_ = [target retain];
+    timer->selector_ = selector;
+    timer->userInfo_ = [userInfo retain];
+    timer->category_ = [category copy];
+    timer->interval_ = MAX(0, interval);
+    timer->leeway_ = MIN(kMaxLeeway, MAX(0, leeway));
+    timer->repeats_ = repeats;
+    timer->valid_ = YES;
+    timer->fireTime_ = [NSDate timeIntervalSinceReferenceDate] + timer->interval_;
+    [[self sharedInstance] scheduleTimer:timer];
+    return timer;
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        windowWakeupsByCategory_ = [[NSMutableDictionary alloc] init];
+        windowFiresByCategory_ = [[NSMutableDictionary alloc] init];
+        windowStart_ = [NSDate timeIntervalSinceReferenceDate];
+        currentTick_ = TimerWheelTickForTime(windowStart_);
+        armedTick_ = INT64_MAX;
+        source_ = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, dispatch_get_main_queue());
+        dispatch_source_set_timer(source_, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        dispatch_source_set_event_handler(source_, ^{
+            [self fire];
+        });
+        dispatch_resume(source_);
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    dispatch_source_cancel(source_);
+    dispatch_release(source_);
+    [windowWakeupsByCategory_ release];
+    [windowFiresByCategory_ release];
+    [lastStatistics_ release];
+    [super dealloc];
+}
+
+- (NSString *)statistics
+{
+    return lastStatistics_ ? lastStatistics_ : [self statisticsForCurrentWindow];
+}
+
+#pragma mark - Lists
+
+- (void)addTimer:(TimerWheelTimer *)timer
+{
+    // Measured from the first tick that hasn't been fired, so a timer cascaded into level 0 at a
+    // slot boundary can't land back in the slot being cascaded.
+    const int64_t first = currentTick_ + 1;
+    const int64_t tick = MAX(timer->deadlineTick_, first);
+    int level = 0;
+    while (level < kNumLevels - 1 && tick - first >= TimerWheelSpan(level)) {
+        level++;
+    }
+    // Past the end of the wheel it goes in the last slot, and is put back in its right place when
+    // that slot is cascaded.
+    const int64_t slotTick = MIN(tick, first + TimerWheelSpan(kNumLevels - 1) - 1);
+    const int index = (slotTick >> TimerWheelShift(level)) & (TimerWheelNumSlots(level) - 1);
+    TimerWheelTimer **head = &slots_[level][index];
+    timer->prev_ = nil;
+    timer->next_ = *head;
+    if (*head) {
+        (*head)->prev_ = timer;
+    }
+    *head = timer;
+    timer->slot_ = head;
+    timer->level_ = level;
+    counts_[level]++;
+}
+
+- (void)removeTimer:(TimerWheelTimer *)timer
+{
+    if (timer->prev_) {
+        timer->prev_->next_ = timer->next_;
+    } else {
+        *timer->slot_ = timer->next_;
+    }
+    if (timer->next_) {
+        timer->next_->prev_ = timer->prev_;
+    }
+    timer->prev_ = nil;
+    timer->next_ = nil;
+    timer->slot_ = NULL;
+    counts_[timer->level_]--;
+}
+
+// Moves the timers in a slot of a higher level down to where they belong now.
+- (void)cascadeLevel:(int)level index:(int)index
+{
+    TimerWheelTimer *timer = slots_[level][index];
+    slots_[level][index] = nil;
+    while (timer) {
+        TimerWheelTimer *next = timer->next_;
+        counts_[level]--;
+        [self addTimer:timer];
+        timer = next;
+    }
+}
+
+#pragma mark - Scheduling
+
+- (void)scheduleTimer:(TimerWheelTimer *)timer
+{
+    timer->deadlineTick_ = TimerWheelTickForTime(timer->fireTime_ + timer->leeway_);
+    [timer retain];  // Released when it's invalidated.
+    [self addTimer:timer];
+    if (!firing_) {
+        [self arm];
+    }
+}
+
+- (void)invalidateTimer:(TimerWheelTimer *)timer
+{
+    if (!timer->valid_) {
+        return;
+    }
+    timer->valid_ = NO;
+    if (timer->slot_) {
+        [self removeTimer:timer];
+    }
+    [timer->target_ release];
+    timer->target_ = nil;
+    [timer autorelease];
+}
+
+// The tick of the earliest deadline, or INT64_MAX if there are no timers.
+- (int64_t)nextDeadline
+{
+    int64_t earliest = INT64_MAX;
+    for (int level = 0; level < kNumLevels; level++) {
+        if (!counts_[level]) {
+            continue;
+        }
+        // The first non-empty slot after the current tick holds the level's earliest deadlines.
+        const int shift = TimerWheelShift(level);
+        const int numSlots = TimerWheelNumSlots(level);
+        for (int i = 1; i <= numSlots; i++) {
+            const int index = ((currentTick_ >> shift) + i) & (numSlots - 1);
+            if (!slots_[level][index]) {
+                continue;
+            }
+            for (TimerWheelTimer *timer = slots_[level][index]; timer; timer = timer->next_) {
+                earliest = MIN(earliest, timer->deadlineTick_);
+            }
+            break;
+        }
+    }
+    return earliest;
+}
+
+- (void)arm
+{
+    const int64_t deadline = [self nextDeadline];
+    if (deadline == armedTick_) {
+        return;
+    }
+    armedTick_ = deadline;
+    if (deadline == INT64_MAX) {
+        dispatch_source_set_timer(source_, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+        return;
+    }
+    const NSTimeInterval delay =
+        MAX(0, (deadline + 1) * kTick - [NSDate timeIntervalSinceReferenceDate]);
+    dispatch_source_set_timer(source_,
+                              dispatch_time(DISPATCH_TIME_NOW, delay * NSEC_PER_SEC),
+                              DISPATCH_TIME_FOREVER,
+                              kTick * NSEC_PER_SEC);
+}
+
+#pragma mark - Firing
+
+// Advances the wheel to |tick|, adding the timers whose deadlines passed to |due|.
+- (void)advanceToTick:(int64_t)tick due:(NSMutableArray *)due
+{
+    while (currentTick_ < tick) {
+        if (!counts_[0]) {
+            if (!counts_[1] && !counts_[2]) {
+                currentTick_ = tick;
+                break;
+            }
+            // Nothing can fire before the next cascade.
+            const int64_t boundary = ((currentTick_ >> kLevel0Bits) + 1) << kLevel0Bits;
+            if (boundary > tick) {
+                currentTick_ = tick;
+                break;
+            }
+            currentTick_ = boundary - 1;
+        }
+        const int64_t next = currentTick_ + 1;
+        for (int level = kNumLevels - 1; level > 0; level--) {
+            const int shift = TimerWheelShift(level);
+            if ((next & ((1LL << shift) - 1)) == 0) {
+                [self cascadeLevel:level index:(next >> shift) & (kLevelSlots - 1)];
+            }
+        }
+        TimerWheelTimer **head = &slots_[0][next & (kLevel0Slots - 1)];
+        while (*head) {
+            TimerWheelTimer *timer = *head;
+            [due addObject:timer];
+            [self removeTimer:timer];
+        }
+        currentTick_ = next;
+    }
+}
+
+// Adds the timers that are due soon but could fire now to |due|, so they share this wakeup.
+- (void)coalesceTimersAtTime:(NSTimeInterval)now due:(NSMutableArray *)due
+{
+    const int64_t maxLeewayTicks = (int64_t)ceil(kMaxLeeway / kTick);
+    for (int64_t i = 1; i <= maxLeewayTicks && counts_[0]; i++) {
+        TimerWheelTimer *timer = slots_[0][(currentTick_ + i) & (kLevel0Slots - 1)];
+        while (timer) {
+            TimerWheelTimer *next = timer->next_;
+            if (timer->fireTime_ <= now) {
+                [due addObject:timer];
+                [self removeTimer:timer];
+            }
+            timer = next;
+        }
+    }
+}
+
+- (void)fire
+{
+    armedTick_ = INT64_MAX;
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    NSMutableArray *due = [NSMutableArray array];
+    [self advanceToTick:TimerWheelTickForTime(now) due:due];
+    if ([due count]) {
+        TimerWheelTimer *cause = [due objectAtIndex:0];
+        windowWakeups_++;
+        [self incrementCategory:cause->category_ in:windowWakeupsByCategory_];
+        [self coalesceTimersAtTime:now due:due];
+    }
+
+    firing_ = YES;
+    for (TimerWheelTimer *timer in due) {
+        if (!timer->valid_) {
+            // A timer that fired earlier in this pass invalidated it.
+            continue;
+        }
+        [self incrementCategory:timer->category_ in:windowFiresByCategory_];
+        id target = [[timer->target_ retain] autorelease];
+        if (timer->repeats_) {
+            timer->fireTime_ += timer->interval_;
+            if (timer->fireTime_ <= now) {
+                // Skip the times that were missed, like NSTimer.
+                timer->fireTime_ = now + timer->interval_;
+            }
+            timer->deadlineTick_ = TimerWheelTickForTime(timer->fireTime_ + timer->leeway_);
+            [self addTimer:timer];
+        } else {
+            [[timer retain] autorelease];
+            [self invalidateTimer:timer];
+        }
+        [target performSelector:timer->selector_ withObject:timer];
+    }
+    firing_ = NO;
+
+    if (now - windowStart_ >= kStatisticsInterval) {
+        [lastStatistics_ release];
+        lastStatistics_ = [[self statisticsForCurrentWindow] retain];
+        DLog(@"%@", lastStatistics_);
+        windowStart_ = now;
+        windowWakeups_ = 0;
+        [windowWakeupsByCategory_ removeAllObjects];
+        [windowFiresByCategory_ removeAllObjects];
+    }
+    [self arm];
+}
+
+#pragma mark - Statistics
+
+- (void)incrementCategory:(NSString *)category in:(NSMutableDictionary *)counts
+{
+    NSString *key = category ? category : @"Other";
+    [counts setObject:[NSNumber numberWithInt:[[counts objectForKey:key] intValue] + 1] forKey:key];
+}
+
+- (NSString *)statisticsForCurrentWindow
+{
+    const NSTimeInterval duration =
+        MAX(kTick, [NSDate timeIntervalSinceReferenceDate] - windowStart_);
+    NSMutableArray *parts = [NSMutableArray array];
+    NSArray *categories =
+        [[windowFiresByCategory_ allKeys] sortedArrayUsingSelector:@selector(compare:)];
+    for (NSString *category in categories) {
+        [parts addObject:[NSString stringWithFormat:@"%@ %0.2f wakeups/s, %0.2f fires/s",
+                             category,
+                             [[windowWakeupsByCategory_ objectForKey:category] intValue] / duration,
+                             [[windowFiresByCategory_ objectForKey:category] intValue] / duration]];
+    }
+    return [NSString stringWithFormat:@"Timer wheel: %0.2f wakeups/s, %d timers. %@",
+               windowWakeups_ / duration,
+               counts_[0] + counts_[1] + counts_[2],
+               [parts componentsJoinedByString:@"; "]];
+}
+
+@end
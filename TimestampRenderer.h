@@ -0,0 +1,55 @@
+//
+//  TimestampRenderer.h
+//  iTerm
+//
+//  Draws the column of timestamps shown by -[PTYTextView toggleShowTimestamps].
+//
+
+#import <Cocoa/Cocoa.h>
+
+// How much of a date a timestamp shows, which depends on how long ago it was.
+typedef enum {
+    kTimestampGranularityTime,       // In the last day
+    kTimestampGranularityWeekday,    // In the last week
+    kTimestampGranularityDate,       // In the last year
+    kTimestampGranularityYear,       // Longer ago
+    kTimestampGranularityCount
+} TimestampGranularity;
+
+// There's one date formatter for each granularity, made when it's first needed and dropped when
+// the locale changes. The string and size of each line's timestamp are cached by absolute line
+// number, so while scrolling only lines coming into view are formatted. Main thread only.
+@interface TimestampRenderer : NSObject {
+    NSDateFormatter *formatters_[kTimestampGranularityCount];
+    NSFont *font_;
+
+    NSColor *backgroundColor_;
+    NSColor *textColor_;
+    NSColor *shadowColor_;
+    NSDictionary *attributes_;  // For drawing, made from the colors.
+    NSGradient *gradient_;      // Fades the text in on the left of the column.
+
+    struct TimestampRendererCacheEntry *cache_;  // Direct mapped by absolute line number.
+    int cacheCapacity_;
+}
+
+// Changes the colors. Cheap if they're the same as before.
+- (void)setBackgroundColor:(NSColor *)backgroundColor
+                 textColor:(NSColor *)textColor
+               shadowColor:(NSColor *)shadowColor;
+
+// Draws the timestamps of consecutive lines, flush against |rightEdge|. |timestamps| holds an
+// NSDate or NSNull per line, the first of which is at |y| and has absolute line number
+// |absoluteLine|.
+- (void)drawTimestamps:(NSArray *)timestamps
+     firstAbsoluteLine:(long long)absoluteLine
+                   atY:(CGFloat)y
+            lineHeight:(CGFloat)lineHeight
+             rightEdge:(CGFloat)rightEdge
+                margin:(CGFloat)margin;
+
+// The granularity used for |timestamp| if it's drawn at |now|.
++ (TimestampGranularity)granularityOfTimestamp:(NSTimeInterval)timestamp
+                                         atTime:(NSTimeInterval)now;
+
+@end
@@ -0,0 +1,276 @@
+//
+//  TimestampRenderer.m
+//  iTerm
+//
+
+#import "TimestampRenderer.h"
+
+// Width of the gradient that fades the text in to the left of the timestamps.
+static const CGFloat kTimestampGradientWidth = 20;
+
+// How opaque the background behind the timestamps is.
+static const CGFloat kTimestampBackgroundAlpha = 0.75;
+
+struct TimestampRendererCacheEntry {
+    long long absoluteLine;  // -1 if the entry is empty.
+    NSTimeInterval timestamp;
+    TimestampGranularity granularity;
+    NSString *string;
+    NSSize size;
+};
+
+@implementation TimestampRenderer
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        font_ = [[NSFont systemFontOfSize:10] retain];
+        NSNotificationCenter *center = [NSNotificationCenter defaultCenter];
+        [center addObserver:self
+                   selector:@selector(localeDidChange:)
+                       name:NSCurrentLocaleDidChangeNotification
+                     object:nil];
+        [center addObserver:self
+                   selector:@selector(localeDidChange:)
+                       name:NSSystemTimeZoneDidChangeNotification
+                     object:nil];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    [self discardFormatters];
+    [self emptyCache];
+    free(cache_);
+    [font_ release];
+    [backgroundColor_ release];
+    [textColor_ release];
+    [shadowColor_ release];
+    [attributes_ release];
+    [gradient_ release];
+    [super dealloc];
+}
+
++ (TimestampGranularity)granularityOfTimestamp:(NSTimeInterval)timestamp
+                                         atTime:(NSTimeInterval)now
+{
+    const NSTimeInterval kDay = 86400;
+    const NSTimeInterval age = now - timestamp;
+    if (age > kDay * 365) {
+        return kTimestampGranularityYear;
+    } else if (age > kDay * 7) {
+        return kTimestampGranularityDate;
+    } else if (age > kDay) {
+        return kTimestampGranularityWeekday;
+    } else {
+        return kTimestampGranularityTime;
+    }
+}
+
+- (void)setBackgroundColor:(NSColor *)backgroundColor
+                 textColor:(NSColor *)textColor
+               shadowColor:(NSColor *)shadowColor
+{
+    if (attributes_ &&
+        [backgroundColor isEqual:backgroundColor_] &&
+        [textColor isEqual:textColor_] &&
+        [shadowColor isEqual:shadowColor_]) {
+        return;
+    }
+    [backgroundColor_ autorelease];
+    backgroundColor_ = [backgroundColor retain];
+    [textColor_ autorelease];
+    textColor_ = [textColor retain];
+    [shadowColor_ autorelease];
+    shadowColor_ = [shadowColor retain];
+
+    NSShadow *shadow = [[[NSShadow alloc] init] autorelease];
+    shadow.shadowColor = shadowColor;
+    shadow.shadowBlurRadius = 0.2f;
+    shadow.shadowOffset = CGSizeMake(0.5, -0.5);
+    [attributes_ release];
+    attributes_ = [@{ NSFontAttributeName: font_,
+                      NSForegroundColorAttributeName: textColor,
+                      NSShadowAttributeName: shadow } retain];
+
+    [gradient_ release];
+    gradient_ = [[NSGradient alloc] initWithStartingColor:[backgroundColor colorWithAlphaComponent:0]
+                                              endingColor:[backgroundColor colorWithAlphaComponent:kTimestampBackgroundAlpha]];
+}
+
+- (void)drawTimestamps:(NSArray *)timestamps
+     firstAbsoluteLine:(long long)absoluteLine
+                   atY:(CGFloat)y
+            lineHeight:(CGFloat)lineHeight
+             rightEdge:(CGFloat)rightEdge
+                margin:(CGFloat)margin
+{
+    const int count = [timestamps count];
+    if (!count) {
+        return;
+    }
+    [self reserveCacheCapacity:count];
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+    // Work out what goes where first so each kind of drawing can be done for the whole column at
+    // once.
+    NSString *strings[count];
+    NSRect backgrounds[count];
+    CGFloat offsets[count];
+    struct TimestampRendererCacheEntry *previous = NULL;
+    for (int i = 0; i < count; i++) {
+        id timestamp = [timestamps objectAtIndex:i];
+        struct TimestampRendererCacheEntry *entry = [self entryForLine:absoluteLine + i
+                                                             timestamp:timestamp
+                                                                   now:now
+                                                              previous:previous];
+        previous = entry;
+        strings[i] = entry->string;
+        const CGFloat w = entry->size.width + margin;
+        const CGFloat x = MAX(0, rightEdge - w);
+        backgrounds[i] = NSMakeRect(x, y + i * lineHeight, w, lineHeight);
+        offsets[i] = (lineHeight - entry->size.height) / 2;
+    }
+
+    [[NSGraphicsContext currentContext] setCompositingOperation:NSCompositeSourceOver];
+
+    // Lines whose timestamps are as wide share a gradient.
+    int start = 0;
+    for (int i = 1; i <= count; i++) {
+        if (i == count || backgrounds[i].origin.x != backgrounds[start].origin.x) {
+            [gradient_ drawInRect:NSMakeRect(backgrounds[start].origin.x - kTimestampGradientWidth,
+                                             backgrounds[start].origin.y,
+                                             kTimestampGradientWidth,
+                                             (i - start) * lineHeight)
+                            angle:0];
+            start = i;
+        }
+    }
+
+    [[backgroundColor_ colorWithAlphaComponent:kTimestampBackgroundAlpha] set];
+    NSRectFillListUsingOperation(backgrounds, count, NSCompositeSourceOver);
+
+    for (int i = 0; i < count; i++) {
+        [strings[i] drawAtPoint:NSMakePoint(backgrounds[i].origin.x, backgrounds[i].origin.y + offsets[i])
+                 withAttributes:attributes_];
+    }
+}
+
+#pragma mark - Private
+
+// Finds the cached string for |timestamp| on |line|, formatting it if it's not there. Lines
+// usually come in bunches printed within the same second, so if |previous| (the line before)
+// would look the same its string is reused.
+- (struct TimestampRendererCacheEntry *)entryForLine:(long long)line
+                                           timestamp:(id)timestamp
+                                                 now:(NSTimeInterval)now
+                                            previous:(struct TimestampRendererCacheEntry *)previous
+{
+    const NSTimeInterval time =
+        [timestamp isKindOfClass:[NSDate class]] ? [timestamp timeIntervalSinceReferenceDate] : 0;
+    const TimestampGranularity granularity = [TimestampRenderer granularityOfTimestamp:time
+                                                                                atTime:now];
+    struct TimestampRendererCacheEntry *entry = &cache_[line & (cacheCapacity_ - 1)];
+    if (entry->absoluteLine == line &&
+        entry->timestamp == time &&
+        entry->granularity == granularity) {
+        return entry;
+    }
+
+    NSString *string;
+    NSSize size;
+    if (previous &&
+        previous->granularity == granularity &&
+        time && previous->timestamp &&
+        floor(previous->timestamp) == floor(time)) {
+        string = previous->string;
+        size = previous->size;
+    } else if (!time) {
+        string = @"";
+        size = NSZeroSize;
+    } else {
+        string = [[self formatterForGranularity:granularity] stringFromDate:timestamp];
+        size = [string sizeWithAttributes:@{ NSFontAttributeName: font_ }];
+    }
+    [string retain];
+    [entry->string release];
+    entry->absoluteLine = line;
+    entry->timestamp = time;
+    entry->granularity = granularity;
+    entry->string = string;
+    entry->size = size;
+    return entry;
+}
+
+- (NSDateFormatter *)formatterForGranularity:(TimestampGranularity)granularity
+{
+    if (!formatters_[granularity]) {
+        NSString *template;
+        switch (granularity) {
+            case kTimestampGranularityYear:
+                template = @"yyyyMMMd hh:mm:ss";
+                break;
+            case kTimestampGranularityDate:
+                template = @"MMMd hh:mm:ss";
+                break;
+            case kTimestampGranularityWeekday:
+                template = @"EEE hh:mm:ss";
+                break;
+            default:
+                template = @"hh:mm:ss";
+                break;
+        }
+        NSDateFormatter *formatter = [[NSDateFormatter alloc] init];
+        [formatter setDateFormat:[NSDateFormatter dateFormatFromTemplate:template
+                                                                 options:0
+                                                                  locale:[NSLocale currentLocale]]];
+        formatters_[granularity] = formatter;
+    }
+    return formatters_[granularity];
+}
+
+// The cache holds at least twice as many lines as are drawn, so a screenful scrolled back and
+// forth stays cached.
+- (void)reserveCacheCapacity:(int)count
+{
+    if (cacheCapacity_ >= 2 * count) {
+        return;
+    }
+    [self emptyCache];
+    int capacity = 64;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+    free(cache_);
+    cache_ = calloc(capacity, sizeof(*cache_));
+    cacheCapacity_ = capacity;
+    [self emptyCache];
+}
+
+- (void)emptyCache
+{
+    for (int i = 0; i < cacheCapacity_; i++) {
+        [cache_[i].string release];
+        cache_[i].string = nil;
+        cache_[i].absoluteLine = -1;
+    }
+}
+
+- (void)discardFormatters
+{
+    for (int i = 0; i < kTimestampGranularityCount; i++) {
+        [formatters_[i] release];
+        formatters_[i] = nil;
+    }
+}
+
+- (void)localeDidChange:(NSNotification *)notification
+{
+    [self discardFormatters];
+    [self emptyCache];
+}
+
+@end
@@ -10,6 +10,7 @@
 #import "WindowControllerInterface.h"
 
 @class PTYSession;
+@class TimerWheelTimer;
 @class PTYTab;
 @class PseudoTerminal;
 @class EquivalenceClassSet;
@@ -33,7 +34,7 @@ extern NSString *kTmuxControllerSessionWasRenamed;
 
 @interface TmuxController : NSObject {
     TmuxGateway *gateway_;
-    NSMutableDictionary *windowPanes_;  // paneId -> PTYSession *
+    NSMutableArray *windowPanes_;  // PTYSession * (or NSNull) indexed by paneId
     NSMutableDictionary *windows_;      // window -> [PTYTab *, refcount]
     NSArray *sessions_;
     int numOutstandingWindowResizes_;
@@ -52,8 +53,8 @@ extern NSString *kTmuxControllerSessionWasRenamed;
     BOOL haveOutstandingSaveWindowOrigins_;
     NSMutableDictionary *origins_;  // window id -> NSValue(Point) window origin
     NSMutableSet *hiddenWindows_;
-    NSTimer *listSessionsTimer_;  // Used to do a cancelable delayed perform of listSessions.
-    NSTimer *listWindowsTimer_;  // Used to do a cancelable delayed perform of listWindows.
+    TimerWheelTimer *listSessionsTimer_;  // Used to do a cancelable delayed perform of listSessions.
+    TimerWheelTimer *listWindowsTimer_;  // Used to do a cancelable delayed perform of listWindows.
     BOOL ambiguousIsDoubleWidth_;
 }
 
@@ -81,6 +82,12 @@ extern NSString *kTmuxControllerSessionWasRenamed;
 - (void)windowWasRenamedWithId:(int)id to:(NSString *)newName;
 
 - (PTYSession *)sessionForWindowPane:(int)windowPane;
+
+// Captures the visible screen of |windowPane| and calls |completion| with output that clears the
+// screen and redraws it, leaving the cursor where tmux has it. Output for the pane that arrives
+// before |completion| is called is already part of the capture. |completion| gets nil if the pane
+// couldn't be captured.
+- (void)captureRepaintOfWindowPane:(int)windowPane completion:(void (^)(NSData *repaint))completion;
 - (PTYTab *)window:(int)window;
 - (void)registerSession:(PTYSession *)aSession
                withPane:(int)windowPane
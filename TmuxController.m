@@ -21,6 +21,7 @@
 #import "TmuxDashboardController.h"
 #import "PreferencePanel.h"
 #import "iTermApplicationDelegate.h"
+#import "TimerWheel.h"
 
 NSString *kTmuxControllerSessionsDidChange = @"kTmuxControllerSessionsDidChange";
 NSString *kTmuxControllerDetachedNotification = @"kTmuxControllerDetachedNotification";
@@ -42,7 +43,6 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
 
 @interface TmuxController ()
 
-- (int)windowIdFromString:(NSString *)s;
 - (void)retainWindow:(int)window withTab:(PTYTab *)tab;
 - (void)releaseWindow:(int)window;
 - (void)closeAllPanes;
@@ -64,7 +64,7 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
     self = [super init];
     if (self) {
         gateway_ = [gateway retain];
-        windowPanes_ = [[NSMutableDictionary alloc] init];
+        windowPanes_ = [[NSMutableArray alloc] init];
         windows_ = [[NSMutableDictionary alloc] init];
         windowPositions_ = [[NSMutableDictionary alloc] init];
         origins_ = [[NSMutableDictionary alloc] init];
@@ -165,11 +165,13 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
     // if there is an exit notification coming down the pipe.
     const CGFloat kListSessionsDelay = 1.5;
     [listSessionsTimer_ invalidate];
-    listSessionsTimer_ = [NSTimer scheduledTimerWithTimeInterval:kListSessionsDelay
-                                                          target:self
-                                                        selector:@selector(listSessions)
-                                                        userInfo:nil
-                                                         repeats:NO];
+    listSessionsTimer_ = [TimerWheel scheduledTimerWithTimeInterval:kListSessionsDelay
+                                                             leeway:0.5
+                                                             target:self
+                                                           selector:@selector(listSessions)
+                                                           userInfo:nil
+                                                            repeats:NO
+                                                           category:@"Tmux"];
 }
 
 - (void)session:(int)sessionId renamedTo:(NSString *)newName
@@ -214,23 +216,25 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
 
 - (void)initialListWindowsResponse:(NSString *)response
 {
-    TSVDocument *doc = [response tsvDocumentWithFields:[self listWindowFields]];
-    if (!doc) {
+    if (!response) {
         [gateway_ abortWithErrorMessage:[NSString stringWithFormat:@"Bad response for initial list windows request: %@", response]];
         return;
     }
-    NSMutableArray *windowsToOpen = [NSMutableArray array];
-    BOOL haveHidden = NO;
-    NSNumber *newWindowAffinity = nil;
+    TSVReader *reader = [[[TSVReader alloc] initWithString:response
+                                                    fields:[self listWindowFields]] autorelease];
+    const int windowIdField = [reader indexOfField:@"window_id"];
+    NSMutableSet *windowsToOpen = [NSMutableSet set];
+    __block BOOL haveHidden = NO;
+    __block NSNumber *newWindowAffinity = nil;
     BOOL newWindowsInTabs =
         [[PreferencePanel sharedInstance] openTmuxWindowsIn] == OPEN_TMUX_WINDOWS_IN_TABS;
-    for (NSArray *record in doc.records) {
-        int wid = [self windowIdFromString:[doc valueInRecord:record forField:@"window_id"]];
+    [reader enumerateRecordsUsingBlock:^(TSVRecord *record, BOOL *stop) {
+        int wid = [record intValueAtIndex:windowIdField afterPrefix:'@'];
         if (hiddenWindows_ && [hiddenWindows_ containsObject:[NSNumber numberWithInt:wid]]) {
             NSLog(@"Don't open window %d because it was saved hidden.", wid);
             haveHidden = YES;
             // Let the user know something is up.
-            continue;
+            return;
         }
         NSNumber *n = [NSNumber numberWithInt:wid];
         if (![affinities_ valuesEqualTo:[n stringValue]] && newWindowsInTabs) {
@@ -242,8 +246,8 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
                          equalToValue:[newWindowAffinity stringValue]];
             }
         }
-        [windowsToOpen addObject:record];
-    }
+        [windowsToOpen addObject:n];
+    }];
     if (windowsToOpen.count > [[PreferencePanel sharedInstance] tmuxDashboardLimit]) {
         haveHidden = YES;
         [windowsToOpen removeAllObjects];
@@ -252,15 +256,32 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
         [[TmuxDashboardController sharedInstance] showWindow:nil];
         [[[TmuxDashboardController sharedInstance] window] makeKeyAndOrderFront:nil];
     }
-    for (NSArray *record in windowsToOpen) {
-        int wid = [self windowIdFromString:[doc valueInRecord:record forField:@"window_id"]];
-        [self openWindowWithIndex:wid
-                             name:[doc valueInRecord:record forField:@"window_name"]
-                             size:NSMakeSize([[doc valueInRecord:record forField:@"window_width"] intValue],
-                                             [[doc valueInRecord:record forField:@"window_height"] intValue])
-                           layout:[doc valueInRecord:record forField:@"window_layout"]
-                       affinities:[self savedAffinitiesForWindow:wid]];
+    if (!windowsToOpen.count) {
+        return;
     }
+    // The rest of a window's fields are only made into strings for windows that get opened.
+    [reader enumerateRecordsUsingBlock:^(TSVRecord *record, BOOL *stop) {
+        int wid = [record intValueAtIndex:windowIdField afterPrefix:'@'];
+        if ([windowsToOpen containsObject:[NSNumber numberWithInt:wid]]) {
+            [self openWindowFromRecord:record
+                                reader:reader
+                            affinities:[self savedAffinitiesForWindow:wid]];
+        }
+    }];
+}
+
+// |record| is a line of a list-windows response with |listWindowFields|.
+- (void)openWindowFromRecord:(TSVRecord *)record
+                      reader:(TSVReader *)reader
+                  affinities:(NSArray *)affinities
+{
+    int width = [record intValueAtIndex:[reader indexOfField:@"window_width"] afterPrefix:0];
+    int height = [record intValueAtIndex:[reader indexOfField:@"window_height"] afterPrefix:0];
+    [self openWindowWithIndex:[record intValueAtIndex:[reader indexOfField:@"window_id"] afterPrefix:'@']
+                         name:[record stringAtIndex:[reader indexOfField:@"window_name"]]
+                         size:NSMakeSize(width, height)
+                       layout:[record stringAtIndex:[reader indexOfField:@"window_layout"]]
+                   affinities:affinities];
 }
 
 - (void)openWindowsInitial
@@ -305,17 +326,18 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
                                          responseObject:nil
                                                   flags:0],
                          nil];
-    [gateway_ sendCommandList:commands];
-}
-
-- (NSNumber *)_keyForWindowPane:(int)windowPane
-{
-    return [NSNumber numberWithInt:windowPane];
+    [gateway_ sendPipelinedCommands:commands initial:NO completion:nil];
 }
 
+// This is called for every %output line, so panes are looked up by index rather than by key. tmux
+// numbers panes from 0 for the life of the server, so the array stays small.
 - (PTYSession *)sessionForWindowPane:(int)windowPane
 {
-    return [windowPanes_ objectForKey:[self _keyForWindowPane:windowPane]];
+    if (windowPane < 0 || windowPane >= [windowPanes_ count]) {
+        return nil;
+    }
+    id session = [windowPanes_ objectAtIndex:windowPane];
+    return session == [NSNull null] ? nil : session;
 }
 
 - (void)registerSession:(PTYSession *)aSession
@@ -323,13 +345,21 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
                inWindow:(int)window
 {
     [self retainWindow:window withTab:[aSession tab]];
-    [windowPanes_ setObject:aSession forKey:[self _keyForWindowPane:windowPane]];
+    if (windowPane < 0) {
+        return;
+    }
+    while ([windowPanes_ count] <= windowPane) {
+        [windowPanes_ addObject:[NSNull null]];
+    }
+    [windowPanes_ replaceObjectAtIndex:windowPane withObject:aSession];
 }
 
 - (void)deregisterWindow:(int)window windowPane:(int)windowPane
 {
     [self releaseWindow:window];
-    [windowPanes_ removeObjectForKey:[self _keyForWindowPane:windowPane]];
+    if (windowPane >= 0 && windowPane < [windowPanes_ count]) {
+        [windowPanes_ replaceObjectAtIndex:windowPane withObject:[NSNull null]];
+    }
 }
 
 - (PTYTab *)window:(int)window
@@ -421,14 +451,64 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
     [gateway_ sendCommandList:commands];
 }
 
+- (void)captureRepaintOfWindowPane:(int)windowPane completion:(void (^)(NSData *repaint))completion
+{
+    completion = [[completion copy] autorelease];
+    NSMutableData *repaint = [NSMutableData dataWithBytes:"\e[0m\e[H\e[2J" length:11];
+    __block BOOL failed = NO;
+    NSString *capture = [NSString stringWithFormat:@"capture-pane -peq -t %%%d", windowPane];
+    NSString *cursor = [NSString stringWithFormat:@"display -p -t %%%d \"#{cursor_x} #{cursor_y}\"",
+                        windowPane];
+    NSArray *commands = @[ [gateway_ dictionaryForCommand:capture
+                                                    flags:kTmuxGatewayCommandShouldTolerateErrors
+                                            responseBlock:^(NSString *response, NSData *data) {
+                                                if (!data) {
+                                                    failed = YES;
+                                                    return;
+                                                }
+                                                // Each row ends with an attribute reset so colors
+                                                // don't bleed into the next.
+                                                NSData *newline = [NSData dataWithBytes:"\e[0m\r\n" length:6];
+                                                NSArray *rows = [response componentsSeparatedByString:@"\n"];
+                                                for (int i = 0; i < rows.count; i++) {
+                                                    if (i > 0) {
+                                                        [repaint appendData:newline];
+                                                    }
+                                                    [repaint appendData:[rows[i] dataUsingEncoding:NSUTF8StringEncoding]];
+                                                }
+                                                [repaint appendBytes:"\e[0m" length:4];
+                                            }],
+                           [gateway_ dictionaryForCommand:cursor
+                                                    flags:kTmuxGatewayCommandShouldTolerateErrors
+                                            responseBlock:^(NSString *response, NSData *data) {
+                                                NSArray *parts = [response componentsSeparatedByString:@" "];
+                                                if (parts.count == 2) {
+                                                    NSString *move = [NSString stringWithFormat:@"\e[%d;%dH",
+                                                                      [parts[1] intValue] + 1,
+                                                                      [parts[0] intValue] + 1];
+                                                    [repaint appendData:[move dataUsingEncoding:NSUTF8StringEncoding]];
+                                                }
+                                            }] ];
+    [gateway_ sendPipelinedCommands:commands
+                            initial:NO
+                         completion:^{
+                             completion(failed ? nil : repaint);
+                         }];
+}
+
 // Make sure that current tmux options are compatible with iTerm.
 - (void)validateOptions
 {
+    NSMutableArray *commands = [NSMutableArray array];
     for (NSString *option in [self unsupportedGlobalOptions]) {
-        [gateway_ sendCommand:[NSString stringWithFormat:@"show-window-options -g %@", option]
-               responseTarget:self
-             responseSelector:@selector(showWindowOptionsResponse:)];
+        NSString *command = [NSString stringWithFormat:@"show-window-options -g %@", option];
+        [commands addObject:[gateway_ dictionaryForCommand:command
+                                                     flags:0
+                                             responseBlock:^(NSString *response, NSData *data) {
+                                                 [self showWindowOptionsResponse:response];
+                                             }]];
     }
+    [gateway_ sendPipelinedCommands:commands initial:NO completion:nil];
 }
 
 // Show an error and terminate the connection because tmux has an unsupported option turned on.
@@ -730,14 +810,16 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
     // if there is an exit notification coming down the pipe.
     const CGFloat kListWindowsDelay = 1.5;
     [listWindowsTimer_ invalidate];
-    listWindowsTimer_ = [NSTimer scheduledTimerWithTimeInterval:kListWindowsDelay
-                                                         target:self
-                                                       selector:@selector(listWindowsTimerFired:)
-                                                       userInfo:[NSArray arrayWithObjects:listWindowsCommand, object, target, NSStringFromSelector(selector), nil]
-                                                        repeats:NO];
+    listWindowsTimer_ = [TimerWheel scheduledTimerWithTimeInterval:kListWindowsDelay
+                                                            leeway:0.5
+                                                            target:self
+                                                          selector:@selector(listWindowsTimerFired:)
+                                                          userInfo:[NSArray arrayWithObjects:listWindowsCommand, object, target, NSStringFromSelector(selector), nil]
+                                                           repeats:NO
+                                                          category:@"Tmux"];
 }
 
-- (void)listWindowsTimerFired:(NSTimer *)timer
+- (void)listWindowsTimerFired:(TimerWheelTimer *)timer
 {
     NSArray *array = [timer userInfo];
     NSString *command = [array objectAtIndex:0];
@@ -944,25 +1026,18 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
   }
 }
 
-- (int)windowIdFromString:(NSString *)s
-{
-    if (s.length < 2 || [s characterAtIndex:0] != '@') {
-        return -1;
-    }
-    return [[s substringFromIndex:1] intValue];
-}
-
 - (void)didListWindows:(NSString *)response userData:(NSArray *)userData
 {
     if (!response) {
         // In case of error.
         response = @"";
     }
-    TSVDocument *doc = [response tsvDocumentWithFields:[self listWindowFields]];
+    TSVReader *reader = [[[TSVReader alloc] initWithString:response
+                                                    fields:[self listWindowFields]] autorelease];
     id object = [userData objectAtIndex:0];
     SEL selector = NSSelectorFromString([userData objectAtIndex:1]);
     id target = [userData objectAtIndex:2];
-    [target performSelector:selector withObject:doc withObject:object];
+    [target performSelector:selector withObject:reader withObject:object];
 }
 
 - (void)getHiddenWindowsResponse:(NSString *)response
@@ -1012,7 +1087,7 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
 
 - (void)listSessionsResponse:(NSString *)result
 {
-    self.sessions = [result componentsSeparatedByRegex:@"\n"];
+    self.sessions = [result componentsSeparatedByString:@"\n"];
     [[NSNotificationCenter defaultCenter] postNotificationName:kTmuxControllerSessionsDidChange
                                                         object:self.sessions];
 }
@@ -1021,23 +1096,19 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
 {
     NSNumber *windowId = [values objectAtIndex:0];
     NSArray *affinities = [values objectAtIndex:1];
-    TSVDocument *doc = [response tsvDocumentWithFields:[self listWindowFields]];
-    if (!doc) {
+    if (!response) {
         [gateway_ abortWithErrorMessage:[NSString stringWithFormat:@"Bad response for list windows request: %@",
                                          response]];
         return;
     }
-    for (NSArray *record in doc.records) {
-        NSString *recordWindowId = [doc valueInRecord:record forField:@"window_id"];
-        if ([self windowIdFromString:recordWindowId] == [windowId intValue]) {
-            [self openWindowWithIndex:[self windowIdFromString:[doc valueInRecord:record forField:@"window_id"]]
-                                 name:[doc valueInRecord:record forField:@"window_name"]
-                                 size:NSMakeSize([[doc valueInRecord:record forField:@"window_width"] intValue],
-                                                 [[doc valueInRecord:record forField:@"window_height"] intValue])
-                               layout:[doc valueInRecord:record forField:@"window_layout"]
-                           affinities:affinities];
+    TSVReader *reader = [[[TSVReader alloc] initWithString:response
+                                                    fields:[self listWindowFields]] autorelease];
+    const int windowIdField = [reader indexOfField:@"window_id"];
+    [reader enumerateRecordsUsingBlock:^(TSVRecord *record, BOOL *stop) {
+        if ([record intValueAtIndex:windowIdField afterPrefix:'@'] == [windowId intValue]) {
+            [self openWindowFromRecord:record reader:reader affinities:affinities];
         }
-    }
+    }];
 }
 
 // When an iTerm2 window is resized, a control -s client-size w,h
@@ -1121,9 +1192,10 @@ static NSString *kListWindowsFormat = @"\"#{session_name}\t#{window_id}\t"
 {
     // Close all sessions. Iterate over a copy of windowPanes_ because the loop
     // body modifies it by closing sessions.
-    for (NSString *key in [[windowPanes_ copy] autorelease]) {
-        PTYSession *session = [windowPanes_ objectForKey:key];
-        [[[session tab] realParentWindow] softCloseSession:session];
+    for (PTYSession *session in [[windowPanes_ copy] autorelease]) {
+        if (session != (id)[NSNull null]) {
+            [[[session tab] realParentWindow] softCloseSession:session];
+        }
     }
 
     // Clean up all state to avoid trying to reuse it.
@@ -158,17 +158,20 @@
                                          object:[sessionsTable_ selectedSessionName]];
 }
 
-- (void)setWindows:(TSVDocument *)doc forSession:(NSString *)sessionName
+- (void)setWindows:(TSVReader *)reader forSession:(NSString *)sessionName
 {
     if ([sessionName isEqualToString:[sessionsTable_ selectedSessionName]]) {
+        const int nameField = [reader indexOfField:@"window_name"];
+        const int windowIdField = [reader indexOfField:@"window_id"];
         NSMutableArray *windows = [NSMutableArray array];
-        for (NSArray *record in doc.records) {
+        [reader enumerateRecordsUsingBlock:^(TSVRecord *record, BOOL *stop) {
+            int wid = [record intValueAtIndex:windowIdField afterPrefix:'@'];
             [windows addObject:[NSMutableArray arrayWithObjects:
-                                [doc valueInRecord:record forField:@"window_name"],
-                                [[doc valueInRecord:record forField:@"window_id"] substringFromIndex:1],
+                                [record stringAtIndex:nameField],
+                                [NSString stringWithFormat:@"%d", wid],
                                 nil]];
-        }
-        [windowsTable_ setWindows:windows];
+        }];
+        [windowsTable_ updateWindows:windows];
     }
 }
 
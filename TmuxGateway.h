@@ -22,6 +22,17 @@ extern const int kTmuxGatewayCommandHasEndGuardBug;
 
 extern NSString * const kTmuxGatewayErrorDomain;
 
+// Keys in the dictionaries returned by -commandMetrics. Values are NSNumbers; times are in seconds.
+extern NSString * const kTmuxGatewayMetricCount;
+extern NSString * const kTmuxGatewayMetricTotalLatency;  // From sending to %begin
+extern NSString * const kTmuxGatewayMetricTotalTurnaround;  // From sending to %end
+extern NSString * const kTmuxGatewayMetricMaxTurnaround;
+
+// Called with the response to a command. |response| and |responseData| hold the same output as
+// a string and as raw bytes. Both are nil if the command failed with
+// kTmuxGatewayCommandShouldTolerateErrors.
+typedef void (^TmuxGatewayResponseBlock)(NSString *response, NSData *responseData);
+
 @protocol TmuxGatewayDelegate
 
 - (TmuxController *)tmuxController;
@@ -60,7 +71,12 @@ typedef enum {
 @interface TmuxGateway : NSObject {
     NSObject<TmuxGatewayDelegate> *delegate_;  // weak
     ControlState state_;
-    NSMutableData *stream_;
+    NSMutableData *stream_;  // The incomplete line at the end of the last read, if any.
+    BOOL readAborted_;  // Set when a protocol error discards the rest of the current read.
+
+    // %output data is decoded into this and handed to the pane's session, which must be done with
+    // it before returning.
+    NSMutableData *decodedOutput_;
 
     // Data from parsing an incoming command
     ControlCommand command_;
@@ -73,6 +89,16 @@ typedef enum {
     BOOL detachSent_;
     BOOL acceptNotifications_;  // Initially NO. When YES, respond to notifications.
     NSMutableString *strayMessages_;
+
+    // Command type (the first word of the command) -> NSMutableDictionary with kTmuxGatewayMetric
+    // keys.
+    NSMutableDictionary *commandMetrics_;
+
+    // Keys from -sendKeys:toWindowPane: not yet sent, all for pendingKeysPane_. They're sent on
+    // the next pass through the run loop so a burst of keystrokes goes in one command, or sooner
+    // if another command is sent, they're for another pane, or there are a lot of them.
+    NSMutableData *pendingKeys_;
+    int pendingKeysPane_;
 }
 
 - (id)initWithDelegate:(NSObject<TmuxGatewayDelegate> *)delegate;
@@ -94,6 +120,15 @@ typedef enum {
 // Set initial to YES when notifications should be accepted after the last
 // command gets a response.
 - (void)sendCommandList:(NSArray *)commandDicts initial:(BOOL)initial;
+
+// Writes each command on its own line in a single write, so they reach tmux back to back and share
+// one round trip. Unlike a command list, each is a separate tmux command: one failing doesn't stop
+// the rest, and tmux's limit on command length applies to each on its own. |completion| (which may
+// be nil) is called after the last response is handled; send commands that depend on the group's
+// responses from there. Set initial to YES as for sendCommandList:initial:.
+- (void)sendPipelinedCommands:(NSArray *)commandDicts
+                      initial:(BOOL)initial
+                   completion:(void (^)(void))completion;
 - (void)abortWithErrorMessage:(NSString *)message title:(NSString *)title;
 - (void)abortWithErrorMessage:(NSString *)message;
 
@@ -105,7 +140,19 @@ typedef enum {
                         responseObject:(id)obj
                                  flags:(int)flags;
 
+// Like the above, but the response goes to |block| instead of a target and selector.
+- (NSDictionary *)dictionaryForCommand:(NSString *)command
+                                 flags:(int)flags
+                         responseBlock:(TmuxGatewayResponseBlock)block;
+
+// Latency and turnaround of the commands sent so far, keyed by command type (e.g.,
+// @"capture-pane").
+- (NSDictionary *)commandMetrics;
+
 - (void)sendKeys:(NSData *)data toWindowPane:(int)windowPane;
+
+// Sends any keys that -sendKeys:toWindowPane: is holding on to now.
+- (void)flushPendingKeys;
 - (void)detach;
 - (NSObject<TmuxGatewayDelegate> *)delegate;
 
@@ -6,6 +6,7 @@
 //
 
 #import "TmuxGateway.h"
+#import "PTYSession.h"
 #import "RegexKitLite.h"
 #import "TmuxController.h"
 #import "iTermApplicationDelegate.h"
@@ -16,6 +17,11 @@ const int kTmuxGatewayCommandShouldTolerateErrors = (1 << 0);
 const int kTmuxGatewayCommandWantsData = (1 << 1);
 const int kTmuxGatewayCommandHasEndGuardBug = (1 << 2);
 
+NSString * const kTmuxGatewayMetricCount = @"count";
+NSString * const kTmuxGatewayMetricTotalLatency = @"totalLatency";
+NSString * const kTmuxGatewayMetricTotalTurnaround = @"totalTurnaround";
+NSString * const kTmuxGatewayMetricMaxTurnaround = @"maxTurnaround";
+
 #define NEWLINE @"\r"
 
 //#define TMUX_VERBOSE_LOGGING
@@ -39,6 +45,41 @@ static NSString *kCommandFlags = @"flags";
 static NSString *kCommandId = @"id";
 static NSString *kCommandIsInList = @"inList";
 static NSString *kCommandIsLastInList = @"lastInList";
+static NSString *kCommandBlock = @"block";
+static NSString *kCommandCompletion = @"completion";
+static NSString *kCommandSendTime = @"sendTime";
+static NSString *kCommandBeginTime = @"beginTime";
+
+// tmux 1.8 has a bug where commands longer than 1024 characters crash the server, so each
+// send-keys command is kept safely under that.
+static const int kMaxSendKeysCommandLength = 1000;
+
+// Most characters TmuxEncodeKey() writes for one byte.
+static const int kMaxEncodedKeyLength = 5;
+
+// Pending keys are sent right away once there are this many bytes of them.
+static const int kMaxPendingKeysLength = 16 * 1024;
+
+// Writes the send-keys argument for |byte| followed by a space and returns the number of chars
+// written. Letters, digits and punctuation that neither tmux's command parser nor its key name
+// lookup give a meaning to are sent as themselves, which is less than half the size of hex.
+static int TmuxEncodeKey(unsigned char byte, char *out) {
+    static const char kHexDigits[] = "0123456789abcdef";
+    if ((byte >= 'a' && byte <= 'z') ||
+        (byte >= 'A' && byte <= 'Z') ||
+        (byte >= '0' && byte <= '9') ||
+        (byte && strchr("._,/:=+@", byte))) {
+        out[0] = byte;
+        out[1] = ' ';
+        return 2;
+    }
+    out[0] = '0';
+    out[1] = 'x';
+    out[2] = kHexDigits[byte >> 4];
+    out[3] = kHexDigits[byte & 0xf];
+    out[4] = ' ';
+    return kMaxEncodedKeyLength;
+}
 
 @implementation TmuxGateway
 
@@ -50,7 +91,10 @@ static NSString *kCommandIsLastInList = @"lastInList";
         state_ = CONTROL_STATE_READY;
         commandQueue_ = [[NSMutableArray alloc] init];
         stream_ = [[NSMutableData alloc] init];
+        decodedOutput_ = [[NSMutableData alloc] init];
         strayMessages_ = [[NSMutableString alloc] init];
+        commandMetrics_ = [[NSMutableDictionary alloc] init];
+        pendingKeys_ = [[NSMutableData alloc] init];
     }
     return self;
 }
@@ -59,10 +103,13 @@ static NSString *kCommandIsLastInList = @"lastInList";
 {
     [commandQueue_ release];
     [stream_ release];
+    [decodedOutput_ release];
     [currentCommand_ release];
     [currentCommandResponse_ release];
     [currentCommandData_ release];
     [strayMessages_ release];
+    [commandMetrics_ release];
+    [pendingKeys_ release];
 
     [super dealloc];
 }
@@ -83,82 +130,108 @@ static NSString *kCommandIsLastInList = @"lastInList";
          informativeTextWithFormat:@"%@", message] runModal];
     [self detach];
     [delegate_ tmuxHostDisconnected];  // Force the client to quit
-    [stream_ replaceBytesInRange:NSMakeRange(0, stream_.length) withBytes:"" length:0];
+    [stream_ setLength:0];
+    readAborted_ = YES;
 }
 
-- (NSData *)decodeEscapedOutput:(const char *)bytes
+// Skips \r's, which the line driver sprinkles in at its pleasure. Returns the index of the first
+// byte at or after |i| that isn't one.
+static int SkipCarriageReturns(const char *bytes, int length, int i)
 {
-    NSMutableData *data = [NSMutableData data];
-    unsigned char c;
-    for (int i = 0; bytes[i]; i++) {
-        c = bytes[i];
+    while (i < length && bytes[i] == '\r') {
+        i++;
+    }
+    return i;
+}
+
+// Returns YES if the line (without its newline) begins with |prefix|, ignoring \r's. If so, *end is
+// set to the index just after the prefix.
+static BOOL LineHasPrefix(const char *bytes, int length, const char *prefix, int *end)
+{
+    int i = 0;
+    for (int j = 0; prefix[j]; j++) {
+        i = SkipCarriageReturns(bytes, length, i);
+        if (i == length || bytes[i] != prefix[j]) {
+            return NO;
+        }
+        i++;
+    }
+    *end = i;
+    return YES;
+}
+
+// Decodes the data of an %output line into decodedOutput_, which is reused from line to line.
+// Control characters (including \r's) are dropped and each backslash must be followed by exactly
+// three octal digits; if it isn't, it becomes a '?'.
+- (NSData *)decodeEscapedOutput:(const char *)bytes length:(int)length
+{
+    // Decoding never makes the data longer.
+    [decodedOutput_ setLength:length];
+    unsigned char *decoded = [decodedOutput_ mutableBytes];
+    int n = 0;
+    int i = 0;
+    while (i < length) {
+        unsigned char c = bytes[i++];
         if (c < ' ') {
             continue;
         }
         if (c == '\\') {
-            // Read exactly three bytes of octal values, or else set c to '?'.
             c = 0;
             for (int j = 0; j < 3; j++) {
-                i++;
-                if (bytes[i] == '\r') {
-                    // Ignore \r's that the line driver sprinkles in at its pleasure.
-                    continue;
-                }
-                if (bytes[i] < '0' || bytes[i] > '7') {
+                i = SkipCarriageReturns(bytes, length, i);
+                if (i == length || bytes[i] < '0' || bytes[i] > '7') {
+                    // Leave bytes[i] to be decoded on its own.
                     c = '?';
-                    i--;  // Back up in case bytes[i] is a null; we don't want to go off the end.
                     break;
                 }
-                c *= 8;
-                c += bytes[i] - '0';
+                c = c * 8 + (bytes[i++] - '0');
             }
         }
-        [data appendBytes:&c length:1];
+        decoded[n++] = c;
     }
-    return data;
+    [decodedOutput_ setLength:n];
+    return decodedOutput_;
 }
 
-- (void)parseOutputCommandData:(NSData *)input
+// %output %<pane id> <data...>
+// This is parsed straight out of the bytes read since the data may not be valid UTF-8, and because
+// it's by far the most common line.
+- (void)parseOutputCommand:(const char *)bytes length:(int)length start:(int)start
 {
-    // Null terminate so we can do some string parsing without too much pain.
-    NSMutableData *data = [NSMutableData dataWithData:input];
-    [data appendBytes:"" length:1];
-
-    // This one is tricky to parse because the string version of the command could have bogus UTF-8.
-    // %output %<pane id> <data...><newline>
-    const char *command = [data bytes];
-    char *space = strchr(command, ' ');
-    if (!space) {
-        goto error;
-    }
-    const char *outputCommand = "%output";
-    if (strncmp(outputCommand, command, strlen(outputCommand))) {
+    int i = SkipCarriageReturns(bytes, length, start);
+    if (i == length || bytes[i] != '%') {
         goto error;
     }
-    const char *paneId = space + 1;
-    if (*paneId != '%') {
-        goto error;
-    }
-    paneId++;
-    space = strchr(paneId, ' ');
-    if (!space) {
-        goto error;
+    i++;
+    int windowPane = 0;
+    int digits = 0;
+    for (i = SkipCarriageReturns(bytes, length, i);
+         i < length && bytes[i] >= '0' && bytes[i] <= '9' && digits < 9;
+         i = SkipCarriageReturns(bytes, length, i + 1)) {
+        windowPane = windowPane * 10 + (bytes[i] - '0');
+        digits++;
     }
-    char *endptr = NULL;
-    int windowPane = strtol(paneId, &endptr, 10);
-    if (windowPane < 0 || endptr != space) {
+    if (digits == 0 || i == length || bytes[i] != ' ') {
         goto error;
     }
+    i++;
 
-    NSData *decodedData = [self decodeEscapedOutput:space + 1];
-
+    // Output for a pane in a hidden window has nowhere to go, so don't bother decoding it. The
+    // window's panes are captured afresh when it's opened again.
+    PTYSession *session = [[delegate_ tmuxController] sessionForWindowPane:windowPane];
+    if (!session) {
+        state_ = CONTROL_STATE_READY;
+        return;
+    }
+    NSData *decodedData = [self decodeEscapedOutput:bytes + i length:length - i];
     TmuxLog(@"Run tmux command: \"%%output %%%d %.*s", windowPane, (int)[decodedData length], [decodedData bytes]);
-    [[[delegate_ tmuxController] sessionForWindowPane:windowPane]  tmuxReadTask:decodedData];
+    [session tmuxReadTask:decodedData];
     state_ = CONTROL_STATE_READY;
-
     return;
+
 error:
-    [self abortWithErrorMessage:[NSString stringWithFormat:@"Malformed command (expected %%num data): \"%s\"", command]];
+    [self abortWithErrorMessage:[NSString stringWithFormat:@"Malformed command (expected %%num data): \"%.*s\"",
+                                 length, bytes]];
 }
 
 - (void)parseLayoutChangeCommand:(NSString *)command
@@ -253,6 +326,10 @@ error:
 {
   [delegate_ tmuxHostDisconnected];
   [commandQueue_ removeAllObjects];
+  [pendingKeys_ setLength:0];
+  [NSObject cancelPreviousPerformRequestsWithTarget:self
+                                           selector:@selector(flushPendingKeys)
+                                             object:nil];
   state_ = CONTROL_STATE_DETACHED;
 }
 
@@ -291,10 +368,56 @@ error:
                                             forKey:kCommandFlags] intValue];
 }
 
+// Adds the current command's latency and turnaround to the metrics for its type. Commands that
+// tmux sent on its own aren't counted.
+- (void)recordMetricsForCurrentCommand
+{
+    NSNumber *sendTime = [currentCommand_ objectForKey:kCommandSendTime];
+    NSNumber *beginTime = [currentCommand_ objectForKey:kCommandBeginTime];
+    NSString *command = [currentCommand_ objectForKey:kCommandString];
+    if (!sendTime || !beginTime || !command) {
+        return;
+    }
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    NSTimeInterval latency = [beginTime doubleValue] - [sendTime doubleValue];
+    NSTimeInterval turnaround = now - [sendTime doubleValue];
+    NSString *trimmed =
+        [command stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
+    NSString *type = [[trimmed componentsSeparatedByString:@" "] objectAtIndex:0];
+
+    NSMutableDictionary *metrics = [commandMetrics_ objectForKey:type];
+    if (!metrics) {
+        metrics = [NSMutableDictionary dictionary];
+        [commandMetrics_ setObject:metrics forKey:type];
+    }
+    [metrics setObject:@([[metrics objectForKey:kTmuxGatewayMetricCount] intValue] + 1)
+                forKey:kTmuxGatewayMetricCount];
+    [metrics setObject:@([[metrics objectForKey:kTmuxGatewayMetricTotalLatency] doubleValue] + latency)
+                forKey:kTmuxGatewayMetricTotalLatency];
+    [metrics setObject:@([[metrics objectForKey:kTmuxGatewayMetricTotalTurnaround] doubleValue] + turnaround)
+                forKey:kTmuxGatewayMetricTotalTurnaround];
+    [metrics setObject:@(MAX([[metrics objectForKey:kTmuxGatewayMetricMaxTurnaround] doubleValue], turnaround))
+                forKey:kTmuxGatewayMetricMaxTurnaround];
+    TmuxLog(@"%@ latency %0.1fms turnaround %0.1fms", type, latency * 1000, turnaround * 1000);
+}
+
 - (void)currentCommandResponseFinishedWithError:(BOOL)withError
 {
     id target = [self currentCommandTarget];
-    if (target) {
+    TmuxGatewayResponseBlock block = [self objectConvertingNullInDictionary:currentCommand_
+                                                                     forKey:kCommandBlock];
+    if (block) {
+        if (withError) {
+            if ([self currentCommandFlags] & kTmuxGatewayCommandShouldTolerateErrors) {
+                block(nil, nil);
+            } else {
+                [self abortWithErrorMessage:[NSString stringWithFormat:@"Error: %@", currentCommand_]];
+                return;
+            }
+        } else {
+            block(currentCommandResponse_, currentCommandData_);
+        }
+    } else if (target) {
         SEL selector = [self currentCommandSelector];
         id obj = [self currentCommandObject];
         if (withError) {
@@ -321,12 +444,17 @@ error:
     if ([[currentCommand_ objectForKey:kCommandIsInitial] boolValue]) {
         acceptNotifications_ = YES;
     }
+    [self recordMetricsForCurrentCommand];
+    void (^completion)(void) = [[[currentCommand_ objectForKey:kCommandCompletion] retain] autorelease];
     [currentCommand_ release];
     currentCommand_ = nil;
     [currentCommandResponse_ release];
     currentCommandResponse_ = nil;
     [currentCommandData_ release];
     currentCommandData_ = nil;
+    if (completion) {
+        completion();
+    }
 }
 
 - (void)parseBegin:(NSString *)command
@@ -359,6 +487,7 @@ error:
         currentCommand_ = [[commandQueue_ objectAtIndex:0] retain];
         NSString *commandId = [components objectAtIndex:1];
         [currentCommand_ setObject:commandId forKey:kCommandId];
+        [currentCommand_ setObject:@([NSDate timeIntervalSinceReferenceDate]) forKey:kCommandBeginTime];
         TmuxLog(@"Begin response to %@", [currentCommand_ objectForKey:kCommandString]);
         [currentCommandResponse_ release];
         [currentCommandData_ release];
@@ -378,39 +507,40 @@ error:
     }
 }
 
-- (BOOL)parseCommand
+// Handles one line, not including its newline. |bytes| is only valid until this returns.
+- (void)parseLine:(const char *)bytes length:(int)length
 {
-    NSRange newlineRange = NSMakeRange(NSNotFound, 0);
-    unsigned char *streamBytes = [stream_ mutableBytes];
-    for (int i = 0; i < stream_.length; i++) {
-        if (streamBytes[i] == '\n') {
-            newlineRange.location = i;
-            newlineRange.length = 1;
-            break;
+    int outputStart;
+    if (!currentCommand_ && LineHasPrefix(bytes, length, "%output ", &outputStart)) {
+        if (acceptNotifications_) {
+            [self parseOutputCommand:bytes length:length start:outputStart];
         }
+        return;
+    }
+
+    // Remove carriage returns. Line drivers randomly add them. Usually there's just one at the end.
+    NSData *data;
+    while (length > 0 && bytes[length - 1] == '\r') {
+        length--;
     }
-    if (newlineRange.location == NSNotFound) {
-        return NO;
-    }
-    NSRange commandRange;
-    commandRange.location = 0;
-    commandRange.length = newlineRange.location; // Command range doesn't include the newline.
-
-    // Make a temp copy of the data, and remove linefeeds. Line drivers randomly add linefeeds.
-    NSMutableData *data = [NSMutableData dataWithCapacity:commandRange.length];
-    const char *bytes = [stream_ bytes] + commandRange.location;
-    int lastIndex = 0;
-    int i;
-    for (i = 0; i < commandRange.length; i++) {
-        if (bytes[i] == '\r') {
-            if (i > lastIndex) {
-                [data appendBytes:bytes + lastIndex length:i - lastIndex];
+    if (memchr(bytes, '\r', length)) {
+        NSMutableData *stripped = [NSMutableData dataWithCapacity:length];
+        int lastIndex = 0;
+        int i;
+        for (i = 0; i < length; i++) {
+            if (bytes[i] == '\r') {
+                if (i > lastIndex) {
+                    [stripped appendBytes:bytes + lastIndex length:i - lastIndex];
+                }
+                lastIndex = i + 1;
             }
-            lastIndex = i + 1;
         }
-    }
-    if (i > lastIndex) {
-        [data appendBytes:bytes + lastIndex length:i - lastIndex];
+        if (i > lastIndex) {
+            [stripped appendBytes:bytes + lastIndex length:i - lastIndex];
+        }
+        data = stripped;
+    } else {
+        data = [NSData dataWithBytesNoCopy:(void *)bytes length:length freeWhenDone:NO];
     }
 
     NSString *command = [[[NSString alloc] initWithData:data
@@ -420,17 +550,11 @@ error:
         // character in a pane, it will just output it in capture-pane.
         command = [[[NSString alloc] initWithUTF8DataIgnoringErrors:data] autorelease];
     }
-    // At least on osx, the terminal driver adds \r at random places, sometimes adding two of them in a row!
-    // We split on \n, which is safe, and just throw out any \r's that we see.
-    command = [command stringByReplacingOccurrencesOfString:@"\r" withString:@""];
-    if (![command hasPrefix:@"%output "] &&
-        !currentCommand_) {
+    if (!currentCommand_) {
         TmuxLog(@"Read tmux command: \"%@\"", command);
-    } else if (currentCommand_) {
+    } else {
         TmuxLog(@"Read command response: \"%@\"", command);
     }
-    // Advance range to include newline so we can chop it off
-    commandRange.length += newlineRange.length;
 
     // Work around a bug in tmux 1.8: if unlink-window causes the current
     // session to be destroyed, no end guard is printed but %exit may be
@@ -463,8 +587,6 @@ error:
         [currentCommandResponse_ appendString:@"\n"];
         [currentCommandData_ appendData:data];
         [currentCommandData_ appendBytes:"\n" length:1];
-    } else if ([command hasPrefix:@"%output "]) {
-        if (acceptNotifications_) [self parseOutputCommandData:data];
     } else if ([command hasPrefix:@"%layout-change "]) {
         if (acceptNotifications_) [self parseLayoutChangeCommand:command];
     } else if ([command hasPrefix:@"%window-add"]) {
@@ -514,79 +636,112 @@ error:
         NSLog(@"Unrecognized command \"%@\"", command);
         [strayMessages_ appendFormat:@"%@\n", command];
     }
-
-    // Erase the just-handled command from the stream.
-    if (stream_.length > 0) {  // length could be 0 if abortWtihErrorMessage: was called.
-        [stream_ replaceBytesInRange:commandRange withBytes:"" length:0];
-    }
-
-    return YES;
 }
 
+// Lines are parsed in place in |data|. Only an incomplete line at the end is copied, into stream_,
+// to be finished by the next read.
 - (NSData *)readTask:(NSData *)data
 {
-    [stream_ appendData:data];
-
-    while ([stream_ length] > 0) {
-        switch (state_) {
-            case CONTROL_STATE_READY:
-                if (![self parseCommand]) {
-                    // Don't have a full command yet, need to read more.
-                    return nil;
-                }
-                break;
-
-            case CONTROL_STATE_DETACHED:
-                data = [[stream_ copy] autorelease];
-                [stream_ setLength:0];
-                return data;
+    const char *bytes = [data bytes];
+    int length = [data length];
+    readAborted_ = NO;
+
+    if ([stream_ length] > 0) {
+        const char *newline = memchr(bytes, '\n', length);
+        if (!newline) {
+            [stream_ appendData:data];
+            return nil;
+        }
+        const int n = newline - bytes + 1;
+        [stream_ appendBytes:bytes length:n - 1];
+        bytes += n;
+        length -= n;
+        [self parseLine:[stream_ bytes] length:[stream_ length]];
+        [stream_ setLength:0];
+    }
+
+    while (length > 0 && !readAborted_) {
+        if (state_ == CONTROL_STATE_DETACHED) {
+            // Whatever follows belongs to the shell tmux was started from.
+            return [NSData dataWithBytes:bytes length:length];
         }
+        const char *newline = memchr(bytes, '\n', length);
+        if (!newline) {
+            // Don't have a full line yet, need to read more.
+            [stream_ appendBytes:bytes length:length];
+            return nil;
+        }
+        const int n = newline - bytes + 1;
+        [self parseLine:bytes length:n - 1];
+        bytes += n;
+        length -= n;
     }
     return nil;
 }
 
-- (NSString *)keyEncodedByte:(char)byte
+// Encodes |data| into as few send-keys commands as fit under kMaxSendKeysCommandLength, building
+// each in a fixed buffer.
+- (NSArray *)sendKeysCommandsForData:(NSData *)data windowPane:(int)windowPane
 {
-    return [NSString stringWithFormat:@"0x%02x", (((int)byte) & 0xff)];
+    NSMutableArray *commands = [NSMutableArray array];
+    char buffer[kMaxSendKeysCommandLength];
+    const int prefixLength = snprintf(buffer, sizeof(buffer), "send-keys -t %%%d ", windowPane);
+    const unsigned char *bytes = [data bytes];
+    const int length = [data length];
+    int used = prefixLength;
+    for (int i = 0; i <= length; i++) {
+        if (used > prefixLength &&
+            (i == length || used + kMaxEncodedKeyLength > kMaxSendKeysCommandLength)) {
+            // Leave off the trailing space.
+            NSString *command = [[[NSString alloc] initWithBytes:buffer
+                                                          length:used - 1
+                                                        encoding:NSASCIIStringEncoding] autorelease];
+            [commands addObject:[self dictionaryForCommand:command
+                                            responseTarget:self
+                                          responseSelector:@selector(noopResponseSelector:)
+                                            responseObject:nil
+                                                     flags:0]];
+            used = prefixLength;
+        }
+        if (i < length) {
+            used += TmuxEncodeKey(bytes[i], buffer + used);
+        }
+    }
+    return commands;
 }
 
-- (NSString *)stringForKeyEncodedData:(NSData *)data
+- (void)sendKeys:(NSData *)data toWindowPane:(int)windowPane
 {
-    NSMutableString *encoded = [NSMutableString string];
-    const char *bytes = [data bytes];
-    for (int i = 0; i < data.length; i++) {
-        if (i > 0) {
-            [encoded appendString:@" "];
-        }
-        [encoded appendString:[self keyEncodedByte:bytes[i]]];
+    if (![data length]) {
+        return;
+    }
+    if ([pendingKeys_ length] && pendingKeysPane_ != windowPane) {
+        [self flushPendingKeys];
+    }
+    if (![pendingKeys_ length]) {
+        [self performSelector:@selector(flushPendingKeys) withObject:nil afterDelay:0];
+    }
+    pendingKeysPane_ = windowPane;
+    [pendingKeys_ appendData:data];
+    if ([pendingKeys_ length] >= kMaxPendingKeysLength) {
+        [self flushPendingKeys];
     }
-    return encoded;
 }
 
-- (void)sendKeys:(NSData *)data toWindowPane:(int)windowPane
+- (void)flushPendingKeys
 {
-    // tmux 1.8 has a bug where commands longer than 1024 characters crash the server.
-    // This is the only place I've found where we send such a long command, so split it up into
-    // multiple parts.
-    const int kMaxChunkSize = 180;  // This is safely under the limit.
-    NSMutableArray *commands = [NSMutableArray array];
-    int offset = 0;
-    while (offset < data.length) {
-        NSRange range = NSMakeRange(offset, MIN(kMaxChunkSize, data.length - offset));
-        offset += range.length;
-        NSString *encoded = [self stringForKeyEncodedData:[data subdataWithRange:range]];
-        NSString *command = [NSString stringWithFormat:@"send-keys -t %%%d %@",
-                             windowPane, encoded];
-        NSDictionary *dict = [self dictionaryForCommand:command
-                                         responseTarget:self
-                                       responseSelector:@selector(noopResponseSelector:)
-                                         responseObject:nil
-                                                  flags:0];
-        [commands addObject:dict];
+    if (![pendingKeys_ length]) {
+        return;
     }
+    [NSObject cancelPreviousPerformRequestsWithTarget:self
+                                             selector:@selector(flushPendingKeys)
+                                               object:nil];
+    NSArray *commands = [self sendKeysCommandsForData:pendingKeys_ windowPane:pendingKeysPane_];
+    [pendingKeys_ setLength:0];
 
+    // Each command is on its own line so none exceeds tmux's limit.
     [delegate_ tmuxSetSecureLogging:YES];
-    [self sendCommandList:commands];
+    [self sendPipelinedCommands:commands initial:NO completion:nil];
     [delegate_ tmuxSetSecureLogging:NO];
 }
 
@@ -622,9 +777,30 @@ error:
             nil];
 }
 
+- (NSDictionary *)dictionaryForCommand:(NSString *)command
+                                 flags:(int)flags
+                         responseBlock:(TmuxGatewayResponseBlock)block
+{
+    return [NSDictionary dictionaryWithObjectsAndKeys:
+            command, kCommandString,
+            [NSNull null], kCommandTarget,
+            [NSNull null], kCommandSelector,
+            [NSNull null], kCommandObject,
+            [NSNumber numberWithInt:flags], kCommandFlags,
+            block ? (id)[[block copy] autorelease] : (id)[NSNull null], kCommandBlock,
+            nil];
+}
+
+- (NSDictionary *)commandMetrics
+{
+    return commandMetrics_;
+}
+
 - (void)enqueueCommandDict:(NSDictionary *)dict
 {
-    [commandQueue_ addObject:[NSMutableDictionary dictionaryWithDictionary:dict]];
+    NSMutableDictionary *amended = [NSMutableDictionary dictionaryWithDictionary:dict];
+    [amended setObject:@([NSDate timeIntervalSinceReferenceDate]) forKey:kCommandSendTime];
+    [commandQueue_ addObject:amended];
 }
 
 - (void)sendCommand:(NSString *)command responseTarget:(id)target responseSelector:(SEL)selector
@@ -642,6 +818,8 @@ error:
      responseObject:(id)obj
               flags:(int)flags
 {
+    // Keys typed before this command must reach tmux before it does.
+    [self flushPendingKeys];
     if (detachSent_ || state_ == CONTROL_STATE_DETACHED) {
         return;
     }
@@ -663,6 +841,7 @@ error:
 
 - (void)sendCommandList:(NSArray *)commandDicts initial:(BOOL)initial
 {
+    [self flushPendingKeys];
     if (detachSent_ || state_ == CONTROL_STATE_DETACHED) {
         return;
     }
@@ -690,4 +869,40 @@ error:
     [delegate_ tmuxWriteData:[cmd dataUsingEncoding:NSUTF8StringEncoding]];
 }
 
+- (void)sendPipelinedCommands:(NSArray *)commandDicts
+                      initial:(BOOL)initial
+                   completion:(void (^)(void))completion
+{
+    [self flushPendingKeys];
+    if (detachSent_ || state_ == CONTROL_STATE_DETACHED) {
+        return;
+    }
+    if (![commandDicts count]) {
+        if (completion) {
+            completion();
+        }
+        return;
+    }
+    NSMutableString *lines = [NSMutableString string];
+    TmuxLog(@"-- Begin pipelined commands --");
+    for (int i = 0; i < [commandDicts count]; i++) {
+        NSDictionary *dict = [commandDicts objectAtIndex:i];
+        NSMutableDictionary *amended = [NSMutableDictionary dictionaryWithDictionary:dict];
+        if (i == [commandDicts count] - 1) {
+            if (initial) {
+                [amended setObject:[NSNumber numberWithBool:YES] forKey:kCommandIsInitial];
+            }
+            if (completion) {
+                [amended setObject:[[completion copy] autorelease] forKey:kCommandCompletion];
+            }
+        }
+        [self enqueueCommandDict:amended];
+        [lines appendString:[dict objectForKey:kCommandString]];
+        [lines appendString:NEWLINE];
+        TmuxLog(@"Send command: %@", [dict objectForKey:kCommandString]);
+    }
+    TmuxLog(@"-- End pipelined commands --");
+    [delegate_ tmuxWriteData:[lines dataUsingEncoding:NSUTF8StringEncoding]];
+}
+
 @end
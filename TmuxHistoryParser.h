@@ -7,10 +7,18 @@
 
 #import <Foundation/Foundation.h>
 
+@class LineBuffer;
+
 @interface TmuxHistoryParser : NSObject
 
 + (TmuxHistoryParser *)sharedInstance;
 - (NSArray *)parseDumpHistoryResponse:(NSString *)response
                ambiguousIsDoubleWidth:(BOOL)ambiguousIsDoubleWidth;
 
+// Parses the response to capture-pane -peqJ in one pass, appending each line straight to a new
+// LineBuffer with unlimited lines. Unlike -parseDumpHistoryResponse:ambiguousIsDoubleWidth:, no
+// object is made per line. Safe to call on any thread.
+- (LineBuffer *)lineBufferFromDumpHistoryResponse:(NSData *)response
+                           ambiguousIsDoubleWidth:(BOOL)ambiguousIsDoubleWidth;
+
 @end
@@ -6,6 +6,7 @@
 //
 
 #import "TmuxHistoryParser.h"
+#import "LineBuffer.h"
 #import "ScreenChar.h"
 #import "VT100Terminal.h"
 
@@ -20,39 +21,52 @@
     return instance;
 }
 
-// Returns nil on error
+// Runs every token of |response| through a private terminal, calling |block| with the chars of each
+// line. The last line needs no newline. The chars passed to |block| are only valid until it returns.
 // TODO: Test with italics
-- (NSData *)dataForHistoryLine:(NSString *)hist
-                  withTerminal:(VT100Terminal *)terminal
-        ambiguousIsDoubleWidth:(BOOL)ambiguousIsDoubleWidth
+- (void)enumerateLinesOfDumpHistoryResponse:(NSData *)response
+                     ambiguousIsDoubleWidth:(BOOL)ambiguousIsDoubleWidth
+                                 usingBlock:(void (^)(screen_char_t *line, int length))block
 {
-    screen_char_t *screenChars;
-    NSMutableData *result = [NSMutableData data];
-    [terminal putStreamData:[hist dataUsingEncoding:NSUTF8StringEncoding]];
+    VT100Terminal *terminal = [[[VT100Terminal alloc] init] autorelease];
+    [terminal setEncoding:NSUTF8StringEncoding];
+    [terminal putStreamDataWithoutCopying:response];
 
+    int capacity = 256;
+    int length = 0;
+    screen_char_t *line = malloc(sizeof(screen_char_t) * capacity);
     while ([terminal parseNextToken]) {
+        if ([terminal lastTokenWasLinefeed]) {
+            block(line, length);
+            length = 0;
+            continue;
+        }
         NSString *string = [terminal lastTokenString];
-        if (string) {
-            // Allocate double space in case they're all double-width characters.
-            screenChars = malloc(sizeof(screen_char_t) * 2 * string.length);
-            int len = 0;
-            StringToScreenChars(string,
-                                screenChars,
-                                [terminal foregroundColorCode],
-                                [terminal backgroundColorCode],
-                                &len,
-                                ambiguousIsDoubleWidth,
-                                NULL);
-            if ([terminal lastTokenWasASCII] && [terminal charset]) {
-                ConvertCharsToGraphicsCharset(screenChars, len);
-            }
-            [result appendBytes:screenChars
-                         length:sizeof(screen_char_t) * len];
-            free(screenChars);
+        if (!string) {
+            continue;
+        }
+        // Leave double space in case they're all double-width characters.
+        const int needed = length + 2 * string.length;
+        if (needed > capacity) {
+            capacity = MAX(needed, capacity * 2);
+            line = realloc(line, sizeof(screen_char_t) * capacity);
         }
+        int len = 0;
+        StringToScreenChars(string,
+                            line + length,
+                            [terminal foregroundColorCode],
+                            [terminal backgroundColorCode],
+                            &len,
+                            ambiguousIsDoubleWidth,
+                            NULL);
+        if ([terminal lastTokenWasASCII] && [terminal charset]) {
+            ConvertCharsToGraphicsCharset(line + length, len);
+        }
+        length += len;
     }
-
-    return result;
+    block(line, length);
+    [terminal stopBorrowingStreamData];
+    free(line);
 }
 
 // Return an NSArray of NSData's. Each NSData is an array of screen_char_t's,
@@ -63,21 +77,36 @@
     if (![response length]) {
         return [NSArray array];
     }
-    NSArray *lines = [response componentsSeparatedByString:@"\n"];
     NSMutableArray *screenLines = [NSMutableArray array];
-    VT100Terminal *terminal = [[[VT100Terminal alloc] init] autorelease];
-    [terminal setEncoding:NSUTF8StringEncoding];
-    for (NSString *line in lines) {
-        NSData *data = [self dataForHistoryLine:line
-                                   withTerminal:terminal
-                         ambiguousIsDoubleWidth:ambiguousIsDoubleWidth];
-        if (!data) {
-            return nil;
-        }
-        [screenLines addObject:data];
-    }
-
+    [self enumerateLinesOfDumpHistoryResponse:[response dataUsingEncoding:NSUTF8StringEncoding]
+                       ambiguousIsDoubleWidth:ambiguousIsDoubleWidth
+                                   usingBlock:^(screen_char_t *line, int length) {
+                                       [screenLines addObject:[NSData dataWithBytes:line
+                                                                             length:sizeof(screen_char_t) * length]];
+                                   }];
     return screenLines;
 }
 
+- (LineBuffer *)lineBufferFromDumpHistoryResponse:(NSData *)response
+                           ambiguousIsDoubleWidth:(BOOL)ambiguousIsDoubleWidth
+{
+    LineBuffer *lineBuffer = [[[LineBuffer alloc] init] autorelease];
+    if (![response length]) {
+        return lineBuffer;
+    }
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    // The width only matters for caching wrapped line counts, which nobody asks for here.
+    const int width = 80;
+    [self enumerateLinesOfDumpHistoryResponse:response
+                       ambiguousIsDoubleWidth:ambiguousIsDoubleWidth
+                                   usingBlock:^(screen_char_t *line, int length) {
+                                       [lineBuffer appendLine:line
+                                                       length:length
+                                                      partial:NO
+                                                        width:width
+                                                    timestamp:now];
+                                   }];
+    return lineBuffer;
+}
+
 @end
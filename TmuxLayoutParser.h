@@ -24,8 +24,8 @@ extern NSString *kLayoutDictWindowPaneKey;  // window pane number (leaf nodes on
 // These values are filled in by other classes:
 extern NSString *kLayoutDictPixelWidthKey;
 extern NSString *kLayoutDictPixelHeightKey;
-extern NSString *kLayoutDictHistoryKey;       // Array of screen_char_t-filled NSData
-extern NSString *kLayoutDictAltHistoryKey;    // Alternate screen history
+extern NSString *kLayoutDictHistoryKey;       // LineBuffer
+extern NSString *kLayoutDictAltHistoryKey;    // Alternate screen: array of screen_char_t-filled NSData
 extern NSString *kLayoutDictStateKey;         // see TmuxStateParser
 
 typedef enum {
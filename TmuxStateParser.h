@@ -27,6 +27,7 @@ extern NSString *kStateDictMouseStandardMode;
 extern NSString *kStateDictMouseButtonMode;
 extern NSString *kStateDictMouseAnyMode;
 extern NSString *kStateDictMouseUTF8Mode;
+extern NSString *kStateDictHistorySize;
 
 @interface TmuxStateParser : NSObject
 
@@ -53,6 +53,9 @@ NSString *kStateDictMouseButtonMode = @"mouse_button_flag";
 NSString *kStateDictMouseAnyMode = @"mouse_any_flag";
 NSString *kStateDictMouseUTF8Mode = @"mouse_utf8_flag";
 
+// Number of lines of history above the screen.
+NSString *kStateDictHistorySize = @"history_size";
+
 @interface NSString (TmuxStateParser)
 - (NSArray *)intlistValue;
 - (NSNumber *)numberValue;
@@ -100,7 +103,7 @@ NSString *kStateDictMouseUTF8Mode = @"mouse_utf8_flag";
                          kStateDictInsertMode,
                          kStateDictKCursorMode, kStateDictKKeypadMode, kStateDictWrapMode,
                          kStateDictMouseStandardMode, kStateDictMouseButtonMode,
-                         kStateDictMouseAnyMode, kStateDictMouseUTF8Mode, nil];
+                         kStateDictMouseAnyMode, kStateDictMouseUTF8Mode, kStateDictHistorySize, nil];
     for (NSString *value in theModes) {
         [format appendFormat:@"%@=#{%@}", value, value];
         if (value != [theModes lastObject]) {
@@ -150,6 +153,7 @@ NSString *kStateDictMouseUTF8Mode = @"mouse_utf8_flag";
                                 uintType, kStateDictWrapMode,
                                 uintType, kStateDictScrollRegionUpper,
                                 uintType, kStateDictScrollRegionLower,
+                                uintType, kStateDictHistorySize,
                                 paneIdNumberType, kStateDictPaneId,
                                 intlistType, kStateDictTabstops,
                                 nil];
@@ -28,6 +28,12 @@ extern NSString * const kTmuxWindowOpenerStatePendingOutput;
     NSMutableDictionary *histories_;
     NSMutableDictionary *altHistories_;
     NSMutableDictionary *states_;
+    // Each pane's history above its screen, when it's parsed before the window opens.
+    NSMutableDictionary *scrollbacks_;
+    BOOL windowOpened_;
+    // When the requests were sent and, for each pane, how long after that its screen was parsed.
+    NSTimeInterval startTime_;
+    NSMutableDictionary *screenTimes_;
     PTYTab *tabToUpdate_;
     id target_;
     SEL selector_;
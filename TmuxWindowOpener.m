@@ -6,12 +6,17 @@
 //
 
 #import "TmuxWindowOpener.h"
+#import "DebugLogging.h"
+#import "LineBuffer.h"
+#import "PTYSession.h"
 #import "PTYTab.h"
 #import "PseudoTerminal.h"
 #import "ScreenChar.h"
+#import "TmuxController.h"
 #import "TmuxHistoryParser.h"
 #import "TmuxLayoutParser.h"
 #import "TmuxStateParser.h"
+#import "VT100Screen.h"
 #import "iTermController.h"
 
 NSString * const kTmuxWindowOpenerStatePendingOutput = @"pending_output";
@@ -25,12 +30,17 @@ NSString * const kTmuxWindowOpenerStatePendingOutput = @"pending_output";
 - (void)requestDidComplete;
 - (void)dumpHistoryResponse:(NSString *)response
            paneAndAlternate:(NSArray *)info;
+- (void)dumpPrimaryHistoryResponse:(NSData *)response
+                              pane:(NSNumber *)wp;
 - (NSDictionary *)dictForDumpStateForWindowPane:(NSNumber *)wp;
 - (NSDictionary *)dictForRequestHistoryForWindowPane:(NSNumber *)wp
                                                  alt:(BOOL)alternate;
 - (NSDictionary *)dictForGetPendingOutputForWindowPane:(NSNumber *)wp;
 - (void)appendRequestsForWindowPane:(NSNumber *)wp
                             toArray:(NSMutableArray *)cmdList;
+- (void)appendScrollbackRequestsForWindowPanes:(NSArray *)panes
+                                       toArray:(NSMutableArray *)cmdList;
+- (void)addScrollback:(LineBuffer *)scrollback toWindowPane:(NSNumber *)wp;
 
 @end
 
@@ -60,6 +70,8 @@ NSString * const kTmuxWindowOpenerStatePendingOutput = @"pending_output";
         histories_ = [[NSMutableDictionary alloc] init];
         altHistories_ = [[NSMutableDictionary alloc] init];
         states_ = [[NSMutableDictionary alloc] init];
+        scrollbacks_ = [[NSMutableDictionary alloc] init];
+        screenTimes_ = [[NSMutableDictionary alloc] init];
     }
     return self;
 }
@@ -74,6 +86,8 @@ NSString * const kTmuxWindowOpenerStatePendingOutput = @"pending_output";
     [histories_ release];
     [altHistories_ release];
     [states_ release];
+    [scrollbacks_ release];
+    [screenTimes_ release];
     [tabToUpdate_ release];
     [super dealloc];
 }
@@ -94,7 +108,12 @@ NSString * const kTmuxWindowOpenerStatePendingOutput = @"pending_output";
                                                  callingSelector:@selector(appendRequestsForNode:toArray:)
                                                         onTarget:self
                                                       withObject:cmdList];
-    [gateway_ sendCommandList:cmdList initial:initial];
+    [self appendScrollbackRequestsForWindowPanes:[[TmuxLayoutParser sharedInstance] windowPanesInParseTree:self.parseTree]
+                                         toArray:cmdList];
+    // Every pane needs five commands, which is too long for one command list when there are many
+    // panes.
+    startTime_ = [NSDate timeIntervalSinceReferenceDate];
+    [gateway_ sendPipelinedCommands:cmdList initial:initial completion:nil];
 }
 
 - (void)updateLayoutInTab:(PTYTab *)tab;
@@ -120,15 +139,19 @@ NSString * const kTmuxWindowOpenerStatePendingOutput = @"pending_output";
     }
     NSSet *oldPanes = [NSSet setWithArray:[tab windowPanes]];
     NSMutableArray *cmdList = [NSMutableArray array];
+    NSMutableArray *addedPanes = [NSMutableArray array];
     for (NSNumber *addedPane in [parser windowPanesInParseTree:self.parseTree]) {
         if (![oldPanes containsObject:addedPane]) {
             [self appendRequestsForWindowPane:addedPane
                                       toArray:cmdList];
+            [addedPanes addObject:addedPane];
         }
     }
     if (cmdList.count) {
+        [self appendScrollbackRequestsForWindowPanes:addedPanes toArray:cmdList];
         tabToUpdate_ = [tab retain];
-        [gateway_ sendCommandList:cmdList];
+        startTime_ = [NSDate timeIntervalSinceReferenceDate];
+        [gateway_ sendPipelinedCommands:cmdList initial:NO completion:nil];
     } else {
         [tab setTmuxLayout:self.parseTree
              tmuxController:controller_];
@@ -161,6 +184,8 @@ NSString * const kTmuxWindowOpenerStatePendingOutput = @"pending_output";
     return nil;  // returning nil means keep going with the DFS
 }
 
+// The window opens once these requests have completed for every pane, so they ask only for what
+// the panes need to show their screens.
 - (void)appendRequestsForWindowPane:(NSNumber *)wp
                             toArray:(NSMutableArray *)cmdList
 {
@@ -170,6 +195,26 @@ NSString * const kTmuxWindowOpenerStatePendingOutput = @"pending_output";
     [cmdList addObject:[self dictForGetPendingOutputForWindowPane:wp]];
 }
 
+// The history above each pane's screen, which can be huge, is requested after every pane's screen
+// so it doesn't hold up opening the window. It's added above the pane's scrollback when it
+// arrives.
+- (void)appendScrollbackRequestsForWindowPanes:(NSArray *)panes
+                                       toArray:(NSMutableArray *)cmdList
+{
+    if (self.maxHistory <= 0) {
+        return;
+    }
+    for (NSNumber *wp in panes) {
+        NSString *command = [NSString stringWithFormat:@"capture-pane -peqJ -t %%%d -S -%d -E -1",
+                             [wp intValue], self.maxHistory];
+        [cmdList addObject:[gateway_ dictionaryForCommand:command
+                                           responseTarget:self
+                                         responseSelector:@selector(dumpScrollbackResponse:pane:)
+                                           responseObject:wp
+                                                    flags:kTmuxGatewayCommandWantsData]];
+    }
+}
+
 - (NSDictionary *)dictForGetPendingOutputForWindowPane:(NSNumber *)wp
 {
     ++pendingRequests_;
@@ -197,8 +242,22 @@ NSString * const kTmuxWindowOpenerStatePendingOutput = @"pending_output";
                         alt:(BOOL)alternate
 {
     ++pendingRequests_;
-    NSString *command = [NSString stringWithFormat:@"capture-pane -peqJ %@-t %%%d -S -%d",
-                         (alternate ? @"-a " : @""), [wp intValue], self.maxHistory];
+    NSString *command;
+    if (alternate) {
+        command = [NSString stringWithFormat:@"capture-pane -peqJ -a -t %%%d -S -%d",
+                   [wp intValue], self.maxHistory];
+    } else {
+        // Just the screen. The history above it is requested separately.
+        command = [NSString stringWithFormat:@"capture-pane -peqJ -t %%%d", [wp intValue]];
+    }
+    if (!alternate) {
+        // Parsed from the raw response off the main thread, like the history.
+        return [gateway_ dictionaryForCommand:command
+                               responseTarget:self
+                             responseSelector:@selector(dumpPrimaryHistoryResponse:pane:)
+                               responseObject:wp
+                                        flags:kTmuxGatewayCommandWantsData];
+    }
     return [gateway_ dictionaryForCommand:command
                            responseTarget:self
                          responseSelector:@selector(dumpHistoryResponse:paneAndAlternate:)
@@ -209,7 +268,71 @@ NSString * const kTmuxWindowOpenerStatePendingOutput = @"pending_output";
                                     flags:0];
 }
 
-// Command response handler for dump-history
+// Command response handler for the primary screen's dump-history. Each pane's screen is parsed
+// on a concurrent queue, so panes are imported in parallel, and the request completes once it's
+// done.
+- (void)dumpPrimaryHistoryResponse:(NSData *)response
+                              pane:(NSNumber *)wp
+{
+    BOOL ambiguousIsDoubleWidth = ambiguousIsDoubleWidth_;
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        LineBuffer *history =
+            [[[TmuxHistoryParser sharedInstance] lineBufferFromDumpHistoryResponse:response
+                                                            ambiguousIsDoubleWidth:ambiguousIsDoubleWidth] retain];
+        [pool drain];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            [histories_ setObject:history forKey:wp];
+            [history release];
+            [screenTimes_ setObject:@([NSDate timeIntervalSinceReferenceDate] - startTime_) forKey:wp];
+            [self requestDidComplete];
+        });
+    });
+}
+
+// Command response handler for the history above a pane's screen. It's parsed on a concurrent
+// queue and then added to the pane, or saved until the window opens.
+- (void)dumpScrollbackResponse:(NSData *)response pane:(NSNumber *)wp
+{
+    BOOL ambiguousIsDoubleWidth = ambiguousIsDoubleWidth_;
+    [self retain];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        LineBuffer *scrollback =
+            [[[TmuxHistoryParser sharedInstance] lineBufferFromDumpHistoryResponse:response
+                                                            ambiguousIsDoubleWidth:ambiguousIsDoubleWidth] retain];
+        [pool drain];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            // With no history, tmux clamps the range to the screen's first line.
+            NSNumber *historySize = [[states_ objectForKey:wp] objectForKey:kStateDictHistorySize];
+            if (scrollback && (!historySize || [historySize intValue] > 0)) {
+                if (windowOpened_) {
+                    [self addScrollback:scrollback toWindowPane:wp];
+                } else {
+                    [scrollbacks_ setObject:scrollback forKey:wp];
+                }
+            }
+            [scrollback release];
+            [self release];
+        });
+    });
+}
+
+- (void)addScrollback:(LineBuffer *)scrollback toWindowPane:(NSNumber *)wp
+{
+    PTYSession *session = [controller_ sessionForWindowPane:[wp intValue]];
+    if (!session) {
+        return;
+    }
+    [[session SCREEN] prependHistoryFromLineBuffer:scrollback];
+    DLog(@"tmux pane %@: screen after %.0f ms, %d lines of history after %.0f ms",
+         wp,
+         [[screenTimes_ objectForKey:wp] doubleValue] * 1000,
+         [scrollback numLinesWithWidth:[[session SCREEN] width]],
+         ([NSDate timeIntervalSinceReferenceDate] - startTime_) * 1000);
+}
+
+// Command response handler for dump-history of the alternate screen
 // info is an array: [window pane number, isAlternate flag]
 - (void)dumpHistoryResponse:(NSString *)response
            paneAndAlternate:(NSArray *)info
@@ -297,6 +420,7 @@ NSString * const kTmuxWindowOpenerStatePendingOutput = @"pending_output";
             return;
         }
         [self decorateParseTree:parseTree];
+        windowOpened_ = YES;
         if (tabToUpdate_) {
             [tabToUpdate_ setTmuxLayout:parseTree
                          tmuxController:controller_];
@@ -324,6 +448,14 @@ NSString * const kTmuxWindowOpenerStatePendingOutput = @"pending_output";
                 [controller_ windowDidResize:term];
             }
         }
+        DLog(@"tmux window %d: %d panes shown after %.0f ms",
+             windowIndex_,
+             (int)[screenTimes_ count],
+             ([NSDate timeIntervalSinceReferenceDate] - startTime_) * 1000);
+        for (NSNumber *wp in scrollbacks_) {
+            [self addScrollback:[scrollbacks_ objectForKey:wp] toWindowPane:wp];
+        }
+        [scrollbacks_ removeAllObjects];
         if (self.target) {
             [self.target performSelector:self.selector
                               withObject:[NSNumber numberWithInt:windowIndex_]];
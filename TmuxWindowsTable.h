@@ -43,6 +43,10 @@ extern NSString *kWindowPasteboardType;
 @property (nonatomic, assign) NSObject<TmuxWindowsTableProtocol> *delegate;
 
 - (void)setWindows:(NSArray *)windows;
+
+// Like setWindows:, but matches windows to the rows already shown by window id. When only names
+// changed just those rows are redrawn, and selected windows stay selected.
+- (void)updateWindows:(NSArray *)windows;
 - (void)setNameOfWindowWithId:(int)wid to:(NSString *)newName;
 - (NSArray *)names;
 - (void)updateEnabledStateOfButtons;
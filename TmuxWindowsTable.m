@@ -64,6 +64,55 @@ NSString *kWindowPasteboardType = @"kWindowPasteboardType";
     [self updateEnabledStateOfButtons];
 }
 
+- (void)updateWindows:(NSArray *)windows
+{
+    BOOL sameWindows = (windows.count == model_.count);
+    for (int i = 0; sameWindows && i < windows.count; i++) {
+        sameWindows = [[[windows objectAtIndex:i] objectAtIndex:1] isEqualToString:
+                          [[model_ objectAtIndex:i] objectAtIndex:1]];
+    }
+    if (sameWindows) {
+        NSMutableIndexSet *renamedRows = [NSMutableIndexSet indexSet];
+        for (int i = 0; i < windows.count; i++) {
+            NSMutableArray *tuple = [model_ objectAtIndex:i];
+            NSString *name = [[windows objectAtIndex:i] objectAtIndex:0];
+            if (![name isEqualToString:[tuple objectAtIndex:0]]) {
+                [tuple replaceObjectAtIndex:0 withObject:name];
+                NSUInteger row = [[self filteredModel] indexOfObjectIdenticalTo:tuple];
+                if (row != NSNotFound) {
+                    [renamedRows addIndex:row];
+                }
+            }
+        }
+        if (renamedRows.count) {
+            // A new name may not match the search field anymore, or may start to. If the filtered
+            // rows change, everything after them moves and it's simplest to reload.
+            NSArray *oldFilteredModel = [[[self filteredModel] retain] autorelease];
+            [self resetFilteredModel];
+            if ([[self filteredModel] isEqualToArray:oldFilteredModel]) {
+                [tableView_ reloadDataForRowIndexes:renamedRows
+                                      columnIndexes:[NSIndexSet indexSetWithIndexesInRange:
+                                                        NSMakeRange(0, [tableView_ numberOfColumns])]];
+            } else {
+                [tableView_ reloadData];
+            }
+        }
+        return;
+    }
+
+    NSSet *selectedIds = [NSSet setWithArray:[self selectedWindowIdsAsStrings]];
+    [self setWindows:windows];
+    NSMutableIndexSet *rows = [NSMutableIndexSet indexSet];
+    NSArray *filteredModel = [self filteredModel];
+    for (int i = 0; i < filteredModel.count; i++) {
+        if ([selectedIds containsObject:[[filteredModel objectAtIndex:i] objectAtIndex:1]]) {
+            [rows addIndex:i];
+        }
+    }
+    [tableView_ selectRowIndexes:rows byExtendingSelection:NO];
+    [self updateEnabledStateOfButtons];
+}
+
 - (void)setNameOfWindowWithId:(int)wid to:(NSString *)newName
 {
     for (int i = 0; i < model_.count; i++) {
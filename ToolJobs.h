@@ -10,17 +10,23 @@
 #import "ToolWrapper.h"
 #import "FutureMethods.h"
 
+@class TimerWheelTimer;
+
 @interface ToolJobs : NSView <ToolbeltTool, NSTableViewDelegate, NSTableViewDataSource> {
     NSScrollView *scrollView_;
     NSTableView *tableView_;
     NSButton *kill_;
     NSPopUpButton *signal_;
-    NSTimer *timer_;
+    TimerWheelTimer *timer_;
     NSMutableArray *names_;
     NSArray *pids_;
     BOOL hasSelection;
     BOOL shutdown_;
     NSTimeInterval timerInterval_;
+
+    // What the table was last built from.
+    long long snapshotVersion_;
+    pid_t rootPid_;
 }
 
 @property (nonatomic, assign) BOOL hasSelection;
@@ -12,6 +12,7 @@
 #import "PTYSession.h"
 #import "PTYTask.h"
 #import "ProcessCache.h"
+#import "TimerWheel.h"
 
 static const int kMaxJobs = 20;
 static const CGFloat kButtonHeight = 23;
@@ -177,37 +178,41 @@ static const CGFloat kMargin = 4;
     }
     ToolWrapper *wrapper = (ToolWrapper *)[[self superview] superview];
     pid_t rootPid = [[[wrapper.term currentSession] SHELL] pid];
-    NSSet *pids = [[ProcessCache sharedInstance] childrenOfPid:rootPid levelsToSkip:0];
-    if (![pids isEqualToSet:[NSSet setWithArray:pids_]]) {
-        // Something changed. Get job names, which is expensive.
-        [pids_ release];
-        NSArray *sortedArray = [[pids allObjects] sortedArrayUsingSelector:@selector(compare:)];
-        pids_ = [[NSMutableArray arrayWithArray:sortedArray] retain];
-        [names_ removeAllObjects];
-        int i = 0;
-        for (NSNumber *pid in pids_) {
-            BOOL fg;
-            NSString *pidName;
-            pidName = [[ProcessCache sharedInstance] getNameOfPid:[pid intValue]
-                                                     isForeground:&fg];
+    ProcessTreeSnapshot *snapshot = [[ProcessCache sharedInstance] snapshot];
+    // The snapshot's version only changes when some process tree does.
+    if (snapshot.version != snapshotVersion_ || rootPid != rootPid_) {
+        snapshotVersion_ = snapshot.version;
+        rootPid_ = rootPid;
+
+        NSMutableArray *pids = [NSMutableArray array];
+        NSMutableArray *names = [NSMutableArray array];
+        for (NSNumber *pid in [snapshot descendantsOfRoot:rootPid]) {
+            NSString *pidName = [snapshot nameOfPid:[pid intValue] inTreeOfRoot:rootPid];
             if (pidName) {
-                [names_ addObject:pidName];
-                i++;
-                if (i > kMaxJobs) {
+                [pids addObject:pid];
+                [names addObject:pidName];
+                if (names.count > kMaxJobs) {
                     break;
                 }
             }
         }
-        [tableView_ reloadData];
+        if (![pids isEqualToArray:pids_] || ![names isEqualToArray:names_]) {
+            [pids_ release];
+            pids_ = [pids retain];
+            [names_ setArray:names];
+            [tableView_ reloadData];
 
-        // Updating the table data causes the cursor to change into an arrow!
-        [self performSelector:@selector(fixCursor) withObject:nil afterDelay:0];
+            // Updating the table data causes the cursor to change into an arrow!
+            [self performSelector:@selector(fixCursor) withObject:nil afterDelay:0];
+        }
     }
-    timer_ = [NSTimer scheduledTimerWithTimeInterval:timerInterval_
-                                              target:self
-                                            selector:@selector(updateTimer:)
-                                            userInfo:nil
-                                             repeats:NO];
+    timer_ = [TimerWheel scheduledTimerWithTimeInterval:timerInterval_
+                                                 leeway:timerInterval_ / 4
+                                                 target:self
+                                               selector:@selector(updateTimer:)
+                                               userInfo:nil
+                                                repeats:NO
+                                               category:@"ToolJobs"];
 }
 
 - (void)fixCursor
@@ -0,0 +1,23 @@
+//
+//  ToolSessionActivity.h
+//  iTerm
+//
+//  Lists every session with what its output costs, so the busy ones can be found.
+//
+
+#import <Cocoa/Cocoa.h>
+#import "ToolWrapper.h"
+#import "FutureMethods.h"
+
+@class TimerWheelTimer;
+
+@interface ToolSessionActivity : NSView <ToolbeltTool, NSTableViewDelegate, NSTableViewDataSource> {
+    NSScrollView *scrollView_;
+    NSTableView *tableView_;
+    TimerWheelTimer *timer_;
+    NSArray *rows_;  // ToolSessionActivityRow, in the table's sort order.
+    BOOL shutdown_;
+    NSTimeInterval timerInterval_;
+}
+
+@end
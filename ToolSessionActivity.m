@@ -0,0 +1,280 @@
+//
+//  ToolSessionActivity.m
+//  iTerm
+//
+
+#import "ToolSessionActivity.h"
+#import "PseudoTerminal.h"
+#import "PTYSession.h"
+#import "SessionActivity.h"
+#import "TimerWheel.h"
+#import "iTermController.h"
+
+// One session's readings, taken when the table was last updated so sorting doesn't see them
+// change.
+@interface ToolSessionActivityRow : NSObject {
+@public
+    PTYSession *session;  // Weak. Only dereferenced after checking it still exists.
+    NSString *name;
+    double cpuFraction;
+    double bytesPerSecond;
+    double redrawsPerSecond;
+}
+@end
+
+@implementation ToolSessionActivityRow
+
+- (void)dealloc
+{
+    [name release];
+    [super dealloc];
+}
+
+- (NSString *)name
+{
+    return name;
+}
+
+- (double)cpuFraction
+{
+    return cpuFraction;
+}
+
+- (double)bytesPerSecond
+{
+    return bytesPerSecond;
+}
+
+- (double)redrawsPerSecond
+{
+    return redrawsPerSecond;
+}
+
+@end
+
+@interface ToolSessionActivity ()
+- (void)updateTimer:(id)sender;
+@end
+
+@implementation ToolSessionActivity
+
+- (NSTableColumn *)addColumnWithIdentifier:(NSString *)identifier
+                                     title:(NSString *)title
+                                 ascending:(BOOL)ascending
+                                      font:(NSFont *)font
+{
+    NSTableColumn *col = [[[NSTableColumn alloc] initWithIdentifier:identifier] autorelease];
+    [col setEditable:NO];
+    [[col headerCell] setStringValue:title];
+    [[col dataCell] setFont:font];
+    [col setSortDescriptorPrototype:[NSSortDescriptor sortDescriptorWithKey:identifier
+                                                                  ascending:ascending]];
+    [tableView_ addTableColumn:col];
+    return col;
+}
+
+- (id)initWithFrame:(NSRect)frame {
+    self = [super initWithFrame:frame];
+    if (self) {
+        rows_ = [[NSArray alloc] init];
+
+        scrollView_ = [[NSScrollView alloc] initWithFrame:NSMakeRect(0, 0, frame.size.width, frame.size.height)];
+        [scrollView_ setHasVerticalScroller:YES];
+        [scrollView_ setHasHorizontalScroller:NO];
+        NSSize contentSize = [scrollView_ contentSize];
+        [scrollView_ setAutoresizingMask:NSViewWidthSizable | NSViewHeightSizable];
+
+        tableView_ = [[NSTableView alloc] initWithFrame:NSMakeRect(0, 0, contentSize.width, contentSize.height)];
+        NSFont *theFont = [NSFont systemFontOfSize:[NSFont smallSystemFontSize]];
+        [tableView_ setRowHeight:[[[[NSLayoutManager alloc] init] autorelease] defaultLineHeightForFont:theFont]];
+
+        [self addColumnWithIdentifier:@"name" title:@"Session" ascending:YES font:theFont];
+        NSTableColumn *col;
+        col = [self addColumnWithIdentifier:@"cpuFraction" title:@"CPU" ascending:NO font:theFont];
+        [col setWidth:40];
+        [col setMinWidth:40];
+        col = [self addColumnWithIdentifier:@"bytesPerSecond" title:@"Output" ascending:NO font:theFont];
+        [col setWidth:70];
+        [col setMinWidth:50];
+        col = [self addColumnWithIdentifier:@"redrawsPerSecond" title:@"Draws/s" ascending:NO font:theFont];
+        [col setWidth:50];
+        [col setMinWidth:40];
+
+        // Busiest first.
+        [tableView_ setSortDescriptors:@[ [NSSortDescriptor sortDescriptorWithKey:@"cpuFraction"
+                                                                        ascending:NO] ]];
+        [tableView_ setDataSource:self];
+        [tableView_ setDelegate:self];
+        [tableView_ setTarget:self];
+        [tableView_ setDoubleAction:@selector(revealSelectedSession:)];
+
+        [tableView_ setAutoresizingMask:NSViewWidthSizable | NSViewHeightSizable];
+
+        [scrollView_ setDocumentView:tableView_];
+        [self addSubview:scrollView_];
+
+        [tableView_ sizeToFit];
+        [tableView_ setColumnAutoresizingStyle:NSTableViewSequentialColumnAutoresizingStyle];
+
+        timerInterval_ = 1;
+
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(setSlowTimer)
+                                                     name:NSWindowDidResignMainNotification
+                                                   object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(setFastTimer)
+                                                     name:NSWindowDidBecomeKeyNotification
+                                                   object:nil];
+
+        [self updateTimer:nil];
+    }
+    return self;
+}
+
+- (void)relayout
+{
+    NSRect frame = self.frame;
+    scrollView_.frame = NSMakeRect(0, 0, frame.size.width, frame.size.height);
+}
+
+// When not key, check much less often to avoid burning the battery.
+- (void)setSlowTimer
+{
+    timerInterval_ = 10;
+}
+
+- (void)setFastTimer
+{
+    timerInterval_ = 1;
+    [timer_ invalidate];
+    timer_ = nil;
+    [self updateTimer:nil];
+}
+
+- (void)dealloc
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    [tableView_ release];
+    [scrollView_ release];
+    [timer_ invalidate];
+    timer_ = nil;
+    [rows_ release];
+    [super dealloc];
+}
+
+- (void)shutdown
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    shutdown_ = YES;
+    [timer_ invalidate];
+    timer_ = nil;
+}
+
+- (NSArray *)allSessions
+{
+    NSMutableArray *sessions = [NSMutableArray array];
+    for (PseudoTerminal *term in [[iTermController sharedInstance] terminals]) {
+        [sessions addObjectsFromArray:[term allSessions]];
+    }
+    return sessions;
+}
+
+- (void)reloadRows
+{
+    NSMutableArray *rows = [NSMutableArray array];
+    for (PTYSession *session in [self allSessions]) {
+        SessionActivity *activity = [session activity];
+        ToolSessionActivityRow *row = [[[ToolSessionActivityRow alloc] init] autorelease];
+        row->session = session;
+        row->name = [[session name] copy];
+        row->cpuFraction = activity.cpuFraction;
+        row->bytesPerSecond = activity.bytesPerSecond;
+        row->redrawsPerSecond = activity.redrawsPerSecond;
+        [rows addObject:row];
+    }
+    [rows sortUsingDescriptors:[tableView_ sortDescriptors]];
+
+    // Keep the same session selected as rows move around.
+    NSInteger selectedRow = [tableView_ selectedRow];
+    PTYSession *selectedSession = nil;
+    if (selectedRow >= 0 && selectedRow < [rows_ count]) {
+        selectedSession = ((ToolSessionActivityRow *)[rows_ objectAtIndex:selectedRow])->session;
+    }
+
+    [rows_ release];
+    rows_ = [rows retain];
+    [tableView_ reloadData];
+
+    for (NSUInteger i = 0; selectedSession && i < [rows_ count]; i++) {
+        if (((ToolSessionActivityRow *)[rows_ objectAtIndex:i])->session == selectedSession) {
+            [tableView_ selectRowIndexes:[NSIndexSet indexSetWithIndex:i] byExtendingSelection:NO];
+            break;
+        }
+    }
+}
+
+- (void)updateTimer:(id)sender
+{
+    timer_ = nil;
+    if (shutdown_) {
+        return;
+    }
+    [self reloadRows];
+    timer_ = [TimerWheel scheduledTimerWithTimeInterval:timerInterval_
+                                                 leeway:timerInterval_ / 4
+                                                 target:self
+                                               selector:@selector(updateTimer:)
+                                               userInfo:nil
+                                                repeats:NO
+                                               category:@"ToolSessionActivity"];
+}
+
+- (void)revealSelectedSession:(id)sender
+{
+    NSInteger selectedRow = [tableView_ clickedRow];
+    if (selectedRow < 0 || selectedRow >= [rows_ count]) {
+        return;
+    }
+    PTYSession *session = ((ToolSessionActivityRow *)[rows_ objectAtIndex:selectedRow])->session;
+    // The session may have closed since the table was updated.
+    if ([[self allSessions] indexOfObjectIdenticalTo:session] != NSNotFound) {
+        [session reveal];
+    }
+}
+
+- (BOOL)isFlipped
+{
+    return YES;
+}
+
+- (NSInteger)numberOfRowsInTableView:(NSTableView *)aTableView
+{
+    return [rows_ count];
+}
+
+- (id)tableView:(NSTableView *)aTableView objectValueForTableColumn:(NSTableColumn *)aTableColumn row:(NSInteger)rowIndex
+{
+    ToolSessionActivityRow *row = [rows_ objectAtIndex:rowIndex];
+    NSString *identifier = [aTableColumn identifier];
+    if ([identifier isEqualToString:@"name"]) {
+        return row->name;
+    } else if ([identifier isEqualToString:@"cpuFraction"]) {
+        return [NSString stringWithFormat:@"%.0f%%", row->cpuFraction * 100];
+    } else if ([identifier isEqualToString:@"bytesPerSecond"]) {
+        return [SessionActivity stringForBytesPerSecond:row->bytesPerSecond];
+    } else {
+        return [NSString stringWithFormat:@"%.1f", row->redrawsPerSecond];
+    }
+}
+
+- (void)tableView:(NSTableView *)aTableView sortDescriptorsDidChange:(NSArray *)oldDescriptors
+{
+    NSMutableArray *rows = [[rows_ mutableCopy] autorelease];
+    [rows sortUsingDescriptors:[tableView_ sortDescriptors]];
+    [rows_ release];
+    rows_ = [rows copy];
+    [tableView_ reloadData];
+}
+
+@end
@@ -11,6 +11,7 @@
 #import "ToolPasteHistory.h"
 #import "ToolWrapper.h"
 #import "ToolJobs.h"
+#import "ToolSessionActivity.h"
 #import "ToolNotes.h"
 #import "iTermApplicationDelegate.h"
 #import "iTermApplication.h"
@@ -64,6 +65,7 @@ static NSString *kToolbeltPrefKey = @"ToolbeltTools";
     [ToolbeltView registerToolWithName:@"Notes" withClass:[ToolNotes class]];
     [ToolbeltView registerToolWithName:@"Paste History" withClass:[ToolPasteHistory class]];
     [ToolbeltView registerToolWithName:@"Profiles" withClass:[ToolProfiles class]];
+    [ToolbeltView registerToolWithName:@"Session Activity" withClass:[ToolSessionActivity class]];
 }
 
 + (NSArray *)defaultTools
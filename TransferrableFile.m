@@ -12,7 +12,6 @@
 @implementation TransferrableFile {
     NSTimeInterval _timeOfLastStatusChange;
     TransferrableFileStatus _status;
-    TransferrableFile *_successor;
 }
 
 - (id)init {
@@ -98,20 +97,6 @@
     return directory;
 }
 
-- (void)setSuccessor:(TransferrableFile *)successor {
-    @synchronized(self) {
-        [_successor autorelease];
-        _successor = [successor retain];
-        successor.hasPredecessor = YES;
-    }
-}
-
-- (TransferrableFile *)successor {
-    @synchronized(self) {
-        return _successor;
-    }
-}
-
 - (void)setStatus:(TransferrableFileStatus)status {
     @synchronized(self) {
         if (status != _status) {
@@ -17,13 +17,22 @@ extern NSString * const kTriggerParameterKey;
     NSString *regex_;
     NSString *action_;
     NSString *param_;
+    NSString *profileKey_;
 }
 
 @property (nonatomic, copy) NSString *regex;
 @property (nonatomic, copy) NSString *action;
 @property (nonatomic, copy) NSString *param;
+// Identifies the trigger to TriggerProfiler. Nil unless made by +triggerFromDict:.
+@property (nonatomic, readonly) NSString *profileKey;
 
 + (Trigger *)triggerFromDict:(NSDictionary *)dict;
+
+// Returns the longest run of literal characters that every match of |regex| must contain, or nil
+// if none can be found. This errs toward nil: regexes with alternation or (? constructs never have
+// one.
++ (NSString *)requiredLiteralInRegex:(NSString *)regex;
+
 - (NSString *)action;
 // Subclasses should implement:
 - (NSString *)title;
@@ -47,9 +56,14 @@ extern NSString * const kTriggerParameterKey;
 - (NSString *)paramWithBackreferencesReplacedWithValues:(NSArray *)values;
 - (void)tryString:(NSString *)s inSession:(PTYSession *)aSession;
 
-// Subclasses must override this.
+// Subclasses must override this. Always called on the main thread.
 - (void)performActionWithValues:(NSArray *)values inSession:(PTYSession *)aSession;
 
+// Returns YES if performing the action once has the same effect as performing it for each of
+// several matches, as when it doesn't use the match. Such a trigger's action is performed once for
+// a batch of matches. Defaults to NO.
+- (BOOL)isIdempotent;
+
 - (NSComparisonResult)compareTitle:(Trigger *)other;
 
 @end
@@ -6,8 +6,9 @@
 //
 
 #import "Trigger.h"
-#import "RegexKitLite.h"
+#import "CompiledRegex.h"
 #import "NSStringITerm.h"
+#import "TriggerProfiler.h"
 
 NSString * const kTriggerRegexKey = @"regex";
 NSString * const kTriggerActionKey = @"action";
@@ -18,17 +19,146 @@ NSString * const kTriggerParameterKey = @"parameter";
 @synthesize regex = regex_;
 @synthesize action = action_;
 @synthesize param = param_;
+@synthesize profileKey = profileKey_;
 
 + (Trigger *)triggerFromDict:(NSDictionary *)dict
 {
     NSString *className = [dict objectForKey:kTriggerActionKey];
     Class class = NSClassFromString(className);
     Trigger *trigger = [[[class alloc] init] autorelease];
+    if (!trigger) {
+        return nil;
+    }
     trigger.regex = [dict objectForKey:kTriggerRegexKey];
     trigger.param = [dict objectForKey:kTriggerParameterKey];
+    trigger->profileKey_ = [[TriggerProfiler keyForTriggerDictionary:dict] retain];
     return trigger;
 }
 
++ (NSString *)requiredLiteralInRegex:(NSString *)regex
+{
+    if (![regex length] ||
+        [regex rangeOfString:@"|"].location != NSNotFound ||
+        [regex rangeOfString:@"(?"].location != NSNotFound ||
+        [regex rangeOfString:@"\\Q"].location != NSNotFound) {
+        return nil;
+    }
+    NSMutableString *best = [NSMutableString string];
+    NSMutableString *run = [NSMutableString string];
+    // Whether the last atom is the last character of |run|, so a quantifier after it applies to it.
+    BOOL lastAtomInRun = NO;
+    int depth = 0;
+    const int length = [regex length];
+    int i = 0;
+    while (i < length) {
+        unichar c = [regex characterAtIndex:i++];
+        BOOL isLiteral = NO;
+        switch (c) {
+            case '\\':
+                if (i == length) {
+                    return nil;
+                }
+                c = [regex characterAtIndex:i++];
+                // \d, \b, \1, \x41, etc. aren't literals. Escaped punctuation is.
+                isLiteral = !([[NSCharacterSet alphanumericCharacterSet] characterIsMember:c]);
+                // Skip the digits of escapes that take them so they aren't taken for literals.
+                // Braced operands like \x{41} and \p{L} are skipped like a {n,m} quantifier.
+                if (c == 'x' && (i == length || [regex characterAtIndex:i] != '{')) {
+                    i = MIN(length, i + 2);
+                } else if (c == 'u') {
+                    i = MIN(length, i + 4);
+                } else if (c == 'U') {
+                    i = MIN(length, i + 8);
+                } else if (c == 'c') {
+                    i = MIN(length, i + 1);
+                } else if (c >= '0' && c <= '9') {
+                    while (i < length &&
+                           [regex characterAtIndex:i] >= '0' &&
+                           [regex characterAtIndex:i] <= '9') {
+                        i++;
+                    }
+                }
+                break;
+
+            case '[': {
+                // Skip the set, which may nest.
+                int setDepth = 1;
+                if (i < length && [regex characterAtIndex:i] == '^') {
+                    i++;
+                }
+                if (i < length && [regex characterAtIndex:i] == ']') {
+                    i++;
+                }
+                while (i < length && setDepth > 0) {
+                    unichar d = [regex characterAtIndex:i++];
+                    if (d == '\\') {
+                        i++;
+                    } else if (d == '[') {
+                        setDepth++;
+                    } else if (d == ']') {
+                        setDepth--;
+                    }
+                }
+                break;
+            }
+
+            case '(':
+                depth++;
+                break;
+
+            case ')':
+                depth--;
+                break;
+
+            case '*':
+            case '?':
+            case '{':
+            case '+':
+                if (lastAtomInRun) {
+                    if (c != '+') {
+                        // The character may not appear at all.
+                        [run deleteCharactersInRange:NSMakeRange([run length] - 1, 1)];
+                    }
+                    if ([run length] > [best length]) {
+                        [best setString:run];
+                    }
+                    [run setString:@""];
+                }
+                if (c == '{') {
+                    while (i < length && [regex characterAtIndex:i] != '}') {
+                        i++;
+                    }
+                    i++;
+                }
+                // Lazy and possessive quantifiers.
+                if (i < length && ([regex characterAtIndex:i] == '?' ||
+                                   [regex characterAtIndex:i] == '+')) {
+                    i++;
+                }
+                lastAtomInRun = NO;
+                continue;
+
+            default:
+                isLiteral = (c != '.' && c != '^' && c != '$');
+                break;
+        }
+        if (isLiteral && depth == 0) {
+            [run appendFormat:@"%C", c];
+            lastAtomInRun = YES;
+        } else {
+            if ([run length] > [best length]) {
+                [best setString:run];
+            }
+            [run setString:@""];
+            lastAtomInRun = NO;
+        }
+    }
+    if ([run length] > [best length]) {
+        [best setString:run];
+    }
+    return [best length] ? best : nil;
+}
+
 - (NSString *)action
 {
     return NSStringFromClass([self class]);
@@ -73,6 +203,7 @@ NSString * const kTriggerParameterKey = @"parameter";
     [regex_ release];
     [action_ release];
     [param_ release];
+    [profileKey_ release];
 
     [super dealloc];
 }
@@ -82,14 +213,31 @@ NSString * const kTriggerParameterKey = @"parameter";
     assert(false);
 }
 
+- (BOOL)isIdempotent
+{
+    return NO;
+}
+
 - (void)tryString:(NSString *)s inSession:(PTYSession *)aSession
 {
-    NSRange range = [s rangeOfRegex:regex_];
-    if (range.location != NSNotFound) {
-        NSArray *captures = [s arrayOfCaptureComponentsMatchedByRegex:regex_];
-        for (NSArray *matches in captures) {
-            [self performActionWithValues:matches
-                                inSession:aSession];
+    // There are no captures if there's no match, so this evaluates the regex just once.
+    TriggerProfiler *profiler = [TriggerProfiler sharedInstance];
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    NSArray *captures = [[CompiledRegex regexWithPattern:regex_ caseInsensitive:NO]
+                            arrayOfCaptureComponentsInString:s];
+    NSTimeInterval end = [NSDate timeIntervalSinceReferenceDate];
+    if (profileKey_) {
+        [profiler recordEvaluationOfTriggerWithKey:profileKey_
+                                          duration:end - start
+                                        numMatches:[captures count]];
+    }
+    for (NSArray *matches in captures) {
+        start = [NSDate timeIntervalSinceReferenceDate];
+        [self performActionWithValues:matches
+                            inSession:aSession];
+        if (profileKey_) {
+            [profiler recordActionOfTriggerWithKey:profileKey_
+                                          duration:[NSDate timeIntervalSinceReferenceDate] - start];
         }
     }
 }
@@ -18,6 +18,8 @@
 #import "CoprocessTrigger.h"
 #import "SendTextTrigger.h"
 #import "FutureMethods.h"
+#import "TriggerProfiler.h"
+#import "CompiledRegex.h"
 
 static NSMutableArray *gTriggerClasses;
 
@@ -312,6 +314,62 @@ static NSMutableArray *gTriggerClasses;
     return nil;
 }
 
+// Slow triggers are drawn in red.
+- (void)tableView:(NSTableView *)aTableView
+  willDisplayCell:(id)aCell
+   forTableColumn:(NSTableColumn *)aTableColumn
+              row:(NSInteger)rowIndex
+{
+    if (aTableColumn != regexColumn_ || rowIndex >= [[self triggers] count]) {
+        return;
+    }
+    NSString *key = [TriggerProfiler keyForTriggerDictionary:[[self triggers] objectAtIndex:rowIndex]];
+    if ([[TriggerProfiler sharedInstance] triggerWithKeyIsSlow:key]) {
+        [aCell setTextColor:[NSColor redColor]];
+    } else {
+        [aCell setTextColor:[NSColor controlTextColor]];
+    }
+}
+
+- (NSString *)tableView:(NSTableView *)aTableView
+         toolTipForCell:(NSCell *)aCell
+                   rect:(NSRectPointer)rect
+            tableColumn:(NSTableColumn *)aTableColumn
+                    row:(NSInteger)row
+          mouseLocation:(NSPoint)mouseLocation
+{
+    if (row >= [[self triggers] count]) {
+        return nil;
+    }
+    NSDictionary *trigger = [[self triggers] objectAtIndex:row];
+    NSString *engine = [CompiledRegex engineDescriptionForPattern:[trigger objectForKey:kTriggerRegexKey]
+                                                  caseInsensitive:NO];
+    TriggerProfiler *profiler = [TriggerProfiler sharedInstance];
+    NSString *key = [TriggerProfiler keyForTriggerDictionary:trigger];
+    TriggerProfile profile;
+    if (![profiler getProfile:&profile forTriggerWithKey:key]) {
+        return [NSString stringWithFormat:@"This trigger hasn't run since iTerm2 started.\n%@", engine];
+    }
+    NSMutableString *tip = [NSMutableString stringWithFormat:
+        @"Evaluated %lld times with %lld matches.\n"
+        @"Matching: %0.1f ms total, 99th percentile under %0.3f ms.\n"
+        @"Actions: %lld taking %0.1f ms total.",
+        profile.evaluations,
+        profile.matches,
+        profile.totalMatchTime * 1000,
+        profile.p99MatchTime * 1000,
+        profile.actions,
+        profile.totalActionTime * 1000];
+    if (profile.evaluationsOverBudget) {
+        [tip appendFormat:@"\nExceeded its %0.0f ms budget %lld times%@.",
+            profiler.budget * 1000,
+            profile.evaluationsOverBudget,
+            [profiler triggerWithKeyIsDisabled:key] ? @" and is disabled" : @""];
+    }
+    [tip appendFormat:@"\n%@", engine];
+    return tip;
+}
+
 - (void)tableViewSelectionDidChange:(NSNotification *)notification
 {
     self.hasSelection = [tableView_ numberOfSelectedRows] > 0;
@@ -0,0 +1,57 @@
+//
+//  TriggerProfiler.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+#include <libkern/OSAtomic.h>
+
+// Numbers for one trigger, summed over every session that has it.
+typedef struct {
+    long long evaluations;  // Times its regex was run on a line.
+    long long matches;
+    NSTimeInterval totalMatchTime;
+    NSTimeInterval p99MatchTime;  // Rounded up to a power of two microseconds.
+    long long actions;
+    NSTimeInterval totalActionTime;
+    long long evaluationsOverBudget;
+} TriggerProfile;
+
+// Collects how long triggers take so the one responsible for slow output can be found. A trigger
+// is identified by a key made from its profile dictionary, so editing it starts its numbers over.
+//
+// A trigger is slow once one evaluation takes longer than the budget, which is the
+// "TriggerTimeBudget" user default in seconds (0.05 if unset). Slow triggers are logged, and if the
+// "DisableSlowTriggers" user default is set they stop being evaluated until the app restarts.
+//
+// May be used from any thread.
+@interface TriggerProfiler : NSObject {
+    OSSpinLock lock_;
+    NSMutableDictionary *entries_;  // Key -> TriggerProfilerEntry
+    NSTimeInterval budget_;
+    BOOL disableSlowTriggers_;
+}
+
+@property(nonatomic, readonly) NSTimeInterval budget;
+
++ (TriggerProfiler *)sharedInstance;
+
+// The key identifying the trigger made from |dict|, a profile trigger dictionary.
++ (NSString *)keyForTriggerDictionary:(NSDictionary *)dict;
+
+// Records one run of the trigger's regex over a line.
+- (void)recordEvaluationOfTriggerWithKey:(NSString *)key
+                                duration:(NSTimeInterval)duration
+                              numMatches:(int)numMatches;
+
+- (void)recordActionOfTriggerWithKey:(NSString *)key duration:(NSTimeInterval)duration;
+
+// Returns YES and fills in |profile| if the trigger has been evaluated or performed.
+- (BOOL)getProfile:(TriggerProfile *)profile forTriggerWithKey:(NSString *)key;
+
+- (BOOL)triggerWithKeyIsSlow:(NSString *)key;
+
+// Returns YES if the trigger is slow and slow triggers are disabled. Cheap when they aren't.
+- (BOOL)triggerWithKeyIsDisabled:(NSString *)key;
+
+@end
@@ -0,0 +1,158 @@
+//
+//  TriggerProfiler.m
+//  iTerm
+//
+
+#import "TriggerProfiler.h"
+#import "DebugLogging.h"
+#import "Trigger.h"
+
+// Bucket i of the histogram of match times holds times under 2^i microseconds (and at least
+// 2^(i-1) for i > 0). The last bucket also holds everything longer.
+#define kTriggerProfilerNumBuckets 32
+
+@interface TriggerProfilerEntry : NSObject {
+@public
+    TriggerProfile profile;
+    long long histogram[kTriggerProfilerNumBuckets];
+    BOOL slow;
+}
+@end
+
+@implementation TriggerProfilerEntry
+@end
+
+static int TriggerProfilerBucket(NSTimeInterval duration) {
+    long long micros = (long long)(duration * 1000000);
+    int bucket = 0;
+    while (bucket < kTriggerProfilerNumBuckets - 1 && (1LL << bucket) <= micros) {
+        bucket++;
+    }
+    return bucket;
+}
+
+@implementation TriggerProfiler
+
+@synthesize budget = budget_;
+
++ (TriggerProfiler *)sharedInstance
+{
+    static TriggerProfiler *instance;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        instance = [[TriggerProfiler alloc] init];
+    });
+    return instance;
+}
+
++ (NSString *)keyForTriggerDictionary:(NSDictionary *)dict
+{
+    return [NSString stringWithFormat:@"%@\n%@\n%@",
+            [dict objectForKey:kTriggerActionKey],
+            [dict objectForKey:kTriggerRegexKey],
+            [dict objectForKey:kTriggerParameterKey]];
+}
+
+- (id)init
+{
+    self = [super init];
+    if (self) {
+        lock_ = OS_SPINLOCK_INIT;
+        entries_ = [[NSMutableDictionary alloc] init];
+        NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+        budget_ = [defaults objectForKey:@"TriggerTimeBudget"] ?
+            [defaults doubleForKey:@"TriggerTimeBudget"] : 0.05;
+        disableSlowTriggers_ = [defaults boolForKey:@"DisableSlowTriggers"];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [entries_ release];
+    [super dealloc];
+}
+
+// Must be called with lock_ held.
+- (TriggerProfilerEntry *)_entryForKey:(NSString *)key
+{
+    TriggerProfilerEntry *entry = [entries_ objectForKey:key];
+    if (!entry) {
+        entry = [[[TriggerProfilerEntry alloc] init] autorelease];
+        [entries_ setObject:entry forKey:key];
+    }
+    return entry;
+}
+
+- (void)recordEvaluationOfTriggerWithKey:(NSString *)key
+                                duration:(NSTimeInterval)duration
+                              numMatches:(int)numMatches
+{
+    BOOL becameSlow = NO;
+    OSSpinLockLock(&lock_);
+    TriggerProfilerEntry *entry = [self _entryForKey:key];
+    entry->profile.evaluations++;
+    entry->profile.matches += numMatches;
+    entry->profile.totalMatchTime += duration;
+    entry->histogram[TriggerProfilerBucket(duration)]++;
+    if (duration > budget_) {
+        entry->profile.evaluationsOverBudget++;
+        becameSlow = !entry->slow;
+        entry->slow = YES;
+    }
+    OSSpinLockUnlock(&lock_);
+
+    if (becameSlow) {
+        DLog(@"Trigger took %0.3fs, over its budget of %0.3fs%@: %@",
+             duration,
+             budget_,
+             disableSlowTriggers_ ? @", and is disabled" : @"",
+             key);
+    }
+}
+
+- (void)recordActionOfTriggerWithKey:(NSString *)key duration:(NSTimeInterval)duration
+{
+    OSSpinLockLock(&lock_);
+    TriggerProfilerEntry *entry = [self _entryForKey:key];
+    entry->profile.actions++;
+    entry->profile.totalActionTime += duration;
+    OSSpinLockUnlock(&lock_);
+}
+
+- (BOOL)getProfile:(TriggerProfile *)profile forTriggerWithKey:(NSString *)key
+{
+    OSSpinLockLock(&lock_);
+    TriggerProfilerEntry *entry = [entries_ objectForKey:key];
+    if (entry) {
+        *profile = entry->profile;
+        const long long threshold = (entry->profile.evaluations * 99 + 99) / 100;
+        long long count = 0;
+        profile->p99MatchTime = 0;
+        for (int i = 0; i < kTriggerProfilerNumBuckets; i++) {
+            count += entry->histogram[i];
+            if (count >= threshold && count > 0) {
+                profile->p99MatchTime = (1LL << i) / 1000000.0;
+                break;
+            }
+        }
+    }
+    OSSpinLockUnlock(&lock_);
+    return entry != nil;
+}
+
+- (BOOL)triggerWithKeyIsSlow:(NSString *)key
+{
+    OSSpinLockLock(&lock_);
+    TriggerProfilerEntry *entry = [entries_ objectForKey:key];
+    BOOL slow = entry ? entry->slow : NO;
+    OSSpinLockUnlock(&lock_);
+    return slow;
+}
+
+- (BOOL)triggerWithKeyIsDisabled:(NSString *)key
+{
+    return disableSlowTriggers_ && [self triggerWithKeyIsSlow:key];
+}
+
+@end
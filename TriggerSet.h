@@ -0,0 +1,52 @@
+//
+//  TriggerSet.h
+//  iTerm
+//
+
+#import <Foundation/Foundation.h>
+
+@class Trigger;
+
+// A session's triggers, compiled so a line is checked against all of them in one pass. Each
+// trigger whose regex has a literal that every match must contain (see +[Trigger
+// requiredLiteralInRegex:]) contributes it to an Aho-Corasick automaton. A line is scanned once
+// with the automaton and only the triggers whose literal turned up, plus those that have no
+// literal, get their regex evaluated.
+//
+// Regexes are compiled with CompiledRegex, so most take time linear in the line's length. A trigger
+// that takes longer than a fixed budget on one line is stopped there anyway, so a regex that falls
+// back to ICU and backtracks badly on a long line can't hold up the lines after it. Matches found
+// before the budget ran out are still reported.
+//
+// A set is immutable once created, so it may be used from any thread.
+@interface TriggerSet : NSObject {
+    NSArray *dictionaries_;
+    NSArray *triggers_;
+
+    // Compiled regex for each trigger, or NSNull if it isn't valid.
+    NSArray *regexes_;
+
+    // Index into literals for each trigger, or -1 if it has none.
+    int *literalIndexes_;
+    int numLiterals_;
+
+    // The automaton. Node 0 is the root.
+    struct TriggerSetNode *nodes_;
+    int numNodes_;
+    struct TriggerSetEdge *edges_;
+    int numEdges_;
+}
+
+// The dictionaries the triggers were made from, as stored in the profile.
+@property(nonatomic, readonly) NSArray *dictionaries;
+@property(nonatomic, readonly) NSArray *triggers;
+
+// |dictionaries| holds profile trigger dictionaries. Ones that don't make a trigger are skipped.
+- (id)initWithDictionaries:(NSArray *)dictionaries;
+
+// Calls |block| with the capture components of each match of each trigger in |string|, in trigger
+// order.
+- (void)enumerateMatchesInString:(NSString *)string
+                      usingBlock:(void (^)(Trigger *trigger, NSArray *values))block;
+
+@end
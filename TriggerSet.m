@@ -0,0 +1,258 @@
+//
+//  TriggerSet.m
+//  iTerm
+//
+
+#import "TriggerSet.h"
+#import "CompiledRegex.h"
+#import "DebugLogging.h"
+#import "Trigger.h"
+#import "TriggerProfiler.h"
+
+// The longest one trigger may spend matching one line.
+static const NSTimeInterval kTriggerSetTimeBudget = 0.1;
+
+struct TriggerSetEdge {
+    unichar c;
+    int target;
+    int next;  // Next edge out of the same node, or -1.
+};
+
+struct TriggerSetNode {
+    int firstEdge;  // -1 if none
+    int failure;
+
+    // Index of the literal that ends here, or -1.
+    int literal;
+
+    // Nearest node along the failure chain that ends a literal, or -1.
+    int nextOutput;
+};
+
+static int TriggerSetTarget(struct TriggerSetNode *nodes,
+                            struct TriggerSetEdge *edges,
+                            int node,
+                            unichar c) {
+    for (int e = nodes[node].firstEdge; e >= 0; e = edges[e].next) {
+        if (edges[e].c == c) {
+            return edges[e].target;
+        }
+    }
+    return -1;
+}
+
+@implementation TriggerSet
+
+@synthesize dictionaries = dictionaries_;
+@synthesize triggers = triggers_;
+
+- (id)initWithDictionaries:(NSArray *)dictionaries
+{
+    self = [super init];
+    if (self) {
+        dictionaries_ = [dictionaries copy];
+        NSMutableArray *triggers = [NSMutableArray array];
+        for (NSDictionary *dict in dictionaries) {
+            Trigger *trigger = [Trigger triggerFromDict:dict];
+            if (trigger) {
+                [triggers addObject:trigger];
+            }
+        }
+        triggers_ = [triggers copy];
+        NSMutableArray *regexes = [NSMutableArray array];
+        for (Trigger *trigger in triggers_) {
+            CompiledRegex *regex = [CompiledRegex regexWithPattern:trigger.regex caseInsensitive:NO];
+            [regexes addObject:regex ? (id)regex : (id)[NSNull null]];
+        }
+        regexes_ = [regexes copy];
+        [self _buildAutomaton];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [dictionaries_ release];
+    [triggers_ release];
+    [regexes_ release];
+    free(literalIndexes_);
+    free(nodes_);
+    free(edges_);
+    [super dealloc];
+}
+
+- (void)enumerateMatchesInString:(NSString *)string
+                      usingBlock:(void (^)(Trigger *trigger, NSArray *values))block
+{
+    const int numTriggers = [triggers_ count];
+    if (!numTriggers) {
+        return;
+    }
+    BOOL *found = NULL;
+    if (numLiterals_) {
+        found = calloc(numLiterals_, sizeof(BOOL));
+        [self _findLiteralsInString:string found:found];
+    }
+    TriggerProfiler *profiler = [TriggerProfiler sharedInstance];
+    for (int i = 0; i < numTriggers; i++) {
+        const int literal = literalIndexes_[i];
+        if (literal >= 0 && !found[literal]) {
+            continue;
+        }
+        CompiledRegex *regex = [regexes_ objectAtIndex:i];
+        if ((id)regex == [NSNull null]) {
+            continue;
+        }
+        Trigger *trigger = [triggers_ objectAtIndex:i];
+        if ([profiler triggerWithKeyIsDisabled:trigger.profileKey]) {
+            continue;
+        }
+        const NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+        __block int numMatches = 0;
+        const BOOL finished =
+            [regex enumerateMatchesInString:string
+                                      range:NSMakeRange(0, [string length])
+                                   deadline:start + kTriggerSetTimeBudget
+                                 usingBlock:^(const NSRange *ranges, int count, BOOL *stop) {
+                                     numMatches++;
+                                     block(trigger, [self _valuesForRanges:ranges
+                                                                     count:count
+                                                                  inString:string]);
+                                 }];
+        if (!finished) {
+            DLog(@"Trigger %@ ran out of time on a line of length %d",
+                 trigger.regex, (int)[string length]);
+        }
+        [profiler recordEvaluationOfTriggerWithKey:trigger.profileKey
+                                          duration:[NSDate timeIntervalSinceReferenceDate] - start
+                                        numMatches:numMatches];
+    }
+    free(found);
+}
+
+#pragma mark - Private
+
+// Returns the capture components of a match, with @"" for groups that didn't participate.
+- (NSArray *)_valuesForRanges:(const NSRange *)ranges count:(int)count inString:(NSString *)string
+{
+    NSMutableArray *values = [NSMutableArray arrayWithCapacity:count];
+    for (int i = 0; i < count; i++) {
+        NSRange range = ranges[i];
+        if (range.location == NSNotFound) {
+            [values addObject:@""];
+        } else {
+            [values addObject:[string substringWithRange:range]];
+        }
+    }
+    return values;
+}
+
+- (int)_addNode
+{
+    nodes_ = realloc(nodes_, (numNodes_ + 1) * sizeof(*nodes_));
+    nodes_[numNodes_].firstEdge = -1;
+    nodes_[numNodes_].failure = 0;
+    nodes_[numNodes_].literal = -1;
+    nodes_[numNodes_].nextOutput = -1;
+    return numNodes_++;
+}
+
+- (void)_addEdgeFromNode:(int)node character:(unichar)c target:(int)target
+{
+    edges_ = realloc(edges_, (numEdges_ + 1) * sizeof(*edges_));
+    edges_[numEdges_].c = c;
+    edges_[numEdges_].target = target;
+    edges_[numEdges_].next = nodes_[node].firstEdge;
+    nodes_[node].firstEdge = numEdges_++;
+}
+
+- (void)_buildAutomaton
+{
+    const int numTriggers = [triggers_ count];
+    literalIndexes_ = malloc(MAX(1, numTriggers) * sizeof(int));
+    [self _addNode];
+
+    // Build a trie of the literals. Triggers with the same literal share it.
+    NSMutableDictionary *literalNumbers = [NSMutableDictionary dictionary];
+    for (int i = 0; i < numTriggers; i++) {
+        Trigger *trigger = [triggers_ objectAtIndex:i];
+        NSString *literal = [Trigger requiredLiteralInRegex:trigger.regex];
+        if (!literal) {
+            literalIndexes_[i] = -1;
+            continue;
+        }
+        NSNumber *number = [literalNumbers objectForKey:literal];
+        if (number) {
+            literalIndexes_[i] = [number intValue];
+            continue;
+        }
+        literalIndexes_[i] = numLiterals_;
+        [literalNumbers setObject:[NSNumber numberWithInt:numLiterals_] forKey:literal];
+
+        int node = 0;
+        for (int j = 0; j < [literal length]; j++) {
+            unichar c = [literal characterAtIndex:j];
+            int target = TriggerSetTarget(nodes_, edges_, node, c);
+            if (target < 0) {
+                target = [self _addNode];
+                [self _addEdgeFromNode:node character:c target:target];
+            }
+            node = target;
+        }
+        nodes_[node].literal = numLiterals_++;
+    }
+
+    // Set failure links breadth first, so a node's failure is done before its children's.
+    int *queue = malloc(numNodes_ * sizeof(int));
+    int head = 0;
+    int tail = 0;
+    for (int e = nodes_[0].firstEdge; e >= 0; e = edges_[e].next) {
+        queue[tail++] = edges_[e].target;
+    }
+    while (head < tail) {
+        const int node = queue[head++];
+        for (int e = nodes_[node].firstEdge; e >= 0; e = edges_[e].next) {
+            const unichar c = edges_[e].c;
+            const int child = edges_[e].target;
+            int failure = nodes_[node].failure;
+            int target;
+            while ((target = TriggerSetTarget(nodes_, edges_, failure, c)) < 0 && failure != 0) {
+                failure = nodes_[failure].failure;
+            }
+            nodes_[child].failure = target >= 0 ? target : 0;
+            const int f = nodes_[child].failure;
+            nodes_[child].nextOutput = nodes_[f].literal >= 0 ? f : nodes_[f].nextOutput;
+            queue[tail++] = child;
+        }
+    }
+    free(queue);
+}
+
+// Sets found[i] for each literal i that occurs in |string|.
+- (void)_findLiteralsInString:(NSString *)string found:(BOOL *)found
+{
+    CFStringInlineBuffer buffer;
+    const CFIndex length = CFStringGetLength((CFStringRef)string);
+    CFStringInitInlineBuffer((CFStringRef)string, &buffer, CFRangeMake(0, length));
+    int numFound = 0;
+    int node = 0;
+    for (CFIndex i = 0; i < length && numFound < numLiterals_; i++) {
+        const unichar c = CFStringGetCharacterFromInlineBuffer(&buffer, i);
+        int target;
+        while ((target = TriggerSetTarget(nodes_, edges_, node, c)) < 0 && node != 0) {
+            node = nodes_[node].failure;
+        }
+        node = target >= 0 ? target : 0;
+        int output = nodes_[node].literal >= 0 ? node : nodes_[node].nextOutput;
+        while (output >= 0) {
+            const int literal = nodes_[output].literal;
+            if (!found[literal]) {
+                found[literal] = YES;
+                numFound++;
+            }
+            output = nodes_[output].nextOutput;
+        }
+    }
+}
+
+@end
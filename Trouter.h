@@ -46,6 +46,12 @@
 - (BOOL)file:(NSString *)path conformsToUTI:(NSString *)uti;
 - (BOOL)isDirectory:(NSString *)path;
 - (NSFileManager *)fileManager;
+
+// Like -[NSFileManager fileExistsAtPath:] but remembers the answer for a couple of seconds, for all
+// Trouters. Thread-safe, as are -getFullPath:workingDirectory:lineNumber: and -canOpenPath:
+// workingDirectory:, which use it.
+- (BOOL)cachedFileExistsAtPath:(NSString *)path;
+
 - (NSString *)getFullPath:(NSString *)path
          workingDirectory:(NSString *)workingDirectory
                lineNumber:(NSString **)lineNumber;
@@ -29,6 +29,24 @@
 #import "RegexKitLite/RegexKitLite.h"
 #import "TrouterPrefsController.h"
 #import "NSStringITerm.h"
+#include <sys/stat.h>
+
+// How long -cachedFileExistsAtPath: trusts what it found. Hovering over a filename checks dozens
+// of candidate paths, and stat can take hundreds of milliseconds on a network filesystem.
+static const NSTimeInterval kTrouterPathCacheTimeToLive = 2;
+
+// The cache is emptied of expired entries when it grows past this.
+static const NSUInteger kTrouterPathCacheMaxEntries = 1000;
+
+@interface TrouterPathCacheEntry : NSObject {
+@public
+    BOOL exists;
+    NSTimeInterval expiration;
+}
+@end
+
+@implementation TrouterPathCacheEntry
+@end
 
 @implementation Trouter
 
@@ -55,6 +73,46 @@
     return fileManager;
 }
 
+- (BOOL)cachedFileExistsAtPath:(NSString *)path
+{
+    static NSMutableDictionary *cache;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        cache = [[NSMutableDictionary alloc] init];
+    });
+    if (!path) {
+        return NO;
+    }
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    @synchronized(cache) {
+        TrouterPathCacheEntry *entry = [cache objectForKey:path];
+        if (entry && entry->expiration > now) {
+            return entry->exists;
+        }
+    }
+
+    struct stat buffer;
+    TrouterPathCacheEntry *entry = [[[TrouterPathCacheEntry alloc] init] autorelease];
+    entry->exists = (stat([path fileSystemRepresentation], &buffer) == 0);
+    entry->expiration = now + kTrouterPathCacheTimeToLive;
+    @synchronized(cache) {
+        if ([cache count] >= kTrouterPathCacheMaxEntries) {
+            NSMutableArray *expiredPaths = [NSMutableArray array];
+            for (NSString *key in cache) {
+                if (((TrouterPathCacheEntry *)[cache objectForKey:key])->expiration <= now) {
+                    [expiredPaths addObject:key];
+                }
+            }
+            [cache removeObjectsForKeys:expiredPaths];
+            if ([cache count] >= kTrouterPathCacheMaxEntries) {
+                [cache removeAllObjects];
+            }
+        }
+        [cache setObject:entry forKey:path];
+    }
+    return entry->exists;
+}
+
 - (BOOL) isDirectory:(NSString *)path
 {
     BOOL ret;
@@ -138,7 +196,7 @@
     // Resolve path by removing ./ and ../ etc
     path = [[url standardizedURL] path];
 
-    if ([fileManager fileExistsAtPath:path]) {
+    if ([self cachedFileExistsAtPath:path]) {
         return path;
     }
 
@@ -223,7 +281,7 @@
     NSString *fullPath = [self getFullPath:path
                           workingDirectory:workingDirectory
                                 lineNumber:NULL];
-    return [fileManager fileExistsAtPath:fullPath];
+    return [self cachedFileExistsAtPath:fullPath];
 }
 
 - (BOOL)openPath:(NSString *)path
@@ -12,6 +12,7 @@
 #import "VT100GridTypes.h"
 
 @class LineBuffer;
+@class ScreenCharStringCache;
 @class VT100Terminal;
 
 @protocol VT100GridDelegate <NSObject>
@@ -24,18 +25,28 @@
 
 @interface VT100Grid : NSObject <NSCopying> {
     VT100GridSize size_;
-    int screenTop_;  // Index into lines_ and dirty_ of first line visible in the grid.
-    NSMutableArray *lines_;  // Array of NSMutableData. Each data has size_.width+1 screen_char_t's.
-    NSMutableArray *lineInfos_;  // Array of VT100LineInfo.
+    int screenTop_;  // Index into rowMap_ of the top of the grid. rowMap_ is a ring starting here.
+    // One contiguous slab of size_.height rows, each with size_.width+1 screen_char_t's (the last
+    // holds the EOL mark).
+    screen_char_t *chars_;
+    int *rowMap_;  // Maps ring slots to rows in chars_, dirty_, and timestamps_.
+    uint64_t *dirty_;  // Bitmap with dirtyWordsPerRow_ words per row, indexed like chars_.
+    int dirtyWordsPerRow_;
+    NSTimeInterval *timestamps_;  // Last-modified time of each row, indexed like chars_.
     id<VT100GridDelegate> delegate_;
     VT100GridCoord cursor_;
     VT100GridRange scrollRegionRows_;
     VT100GridRange scrollRegionCols_;
     BOOL useScrollRegionCols_;
 
+    // A prefilled row that cleared rows are copied from. See -templateLineOfWidth:filledWithChar:.
     NSMutableData *cachedDefaultLine_;
     NSMutableData *resultLine_;
     screen_char_t savedDefaultChar_;
+
+    VT100GridRect scrollDamageRect_;
+    int scrollDamageDistance_;
+    BOOL scrollDamageIsComplex_;
 }
 
 // Changing the size erases grid contents.
@@ -54,6 +65,14 @@
 @property(nonatomic, assign) screen_char_t savedDefaultChar;
 @property(nonatomic, assign) id<VT100GridDelegate> delegate;
 
+// Vertical scrolls since the last call to -resetScrollDamage. If scrollDamageDistance is nonzero, the
+// contents of scrollDamageRect moved down by that many lines (up, if negative) and those lines were
+// not marked dirty; a renderer must move its pixels to match. If scrollDamageIsComplex is set, the
+// scrolls couldn't be described by a single rect and distance and were marked dirty instead.
+@property(nonatomic, readonly) VT100GridRect scrollDamageRect;
+@property(nonatomic, readonly) int scrollDamageDistance;
+@property(nonatomic, readonly) BOOL scrollDamageIsComplex;
+
 - (id)initWithSize:(VT100GridSize)size delegate:(id<VT100GridDelegate>)delegate;
 
 - (screen_char_t *)screenCharsAtLineNumber:(int)lineNumber;
@@ -73,6 +92,16 @@
 - (BOOL)isAnyCharDirty;
 - (VT100GridRange)dirtyRangeForLine:(int)y;
 
+// Returns an array of NSValue-wrapped VT100GridRects that together cover every dirty char. Adjacent
+// lines whose dirty ranges have the same extent are coalesced into a single rect.
+- (NSArray *)dirtyRects;
+
+- (void)resetScrollDamage;
+
+// Marks the lines covered by the scroll damage dirty and describes no further scrolls until the next
+// -resetScrollDamage. Use this when the moved pixels can't be reused.
+- (void)markScrollDamageDirty;
+
 // Returns the count of lines excluding totally empty lines at the bottom, and always including the
 // line the cursor is on.
 - (int)numberOfLinesUsed;
@@ -177,6 +206,18 @@
 // Returns runs (as NSValue*s with gridRunValue) on screen that match a regex.
 - (NSArray *)runsMatchingRegex:(NSString *)regex;
 
+// Like -runsMatchingRegex:, but skips wrapped lines that are the same as when |signatures| was
+// made by -signaturesOfWrappedLinesWithFirstAbsoluteLine:, and gets the strings of the other lines
+// from |cache|. The first line of the grid has absolute line number |firstAbsoluteLine|.
+- (NSArray *)runsMatchingRegex:(NSString *)regex
+        skippingUnchangedLines:(NSDictionary *)signatures
+             firstAbsoluteLine:(long long)firstAbsoluteLine
+                   stringCache:(ScreenCharStringCache *)cache;
+
+// Maps the absolute line number of the first line of each wrapped line to a hash of its chars,
+// colors included.
+- (NSMutableDictionary *)signaturesOfWrappedLinesWithFirstAbsoluteLine:(long long)firstAbsoluteLine;
+
 // Pop lines out of the line buffer and on to the screen. Up to maxLines will be restored. Before
 // popping, lines to be modified will first be filled with defaultChar.
 - (void)restoreScreenFromLineBuffer:(LineBuffer *)lineBuffer
@@ -189,6 +230,9 @@
 // Returns temp storage for one line.
 - (screen_char_t *)resultLine;
 
+// Bytes allocated for the grid's rows, dirty bits, timestamps and scratch lines.
+- (long long)memoryUsage;
+
 // Returns a human-readable string with the screen contents and dirty lines interspersed.
 - (NSString *)debugString;
 
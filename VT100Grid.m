@@ -8,17 +8,13 @@
 
 #import "VT100Grid.h"
 
+#import "CompiledRegex.h"
 #import "DebugLogging.h"
 #import "LineBuffer.h"
-#import "RegexKitLite.h"
+#import "ScreenCharStringCache.h"
 #import "VT100GridTypes.h"
-#import "VT100LineInfo.h"
 #import "VT100Terminal.h"
 
-@interface VT100Grid ()
-@property(nonatomic, readonly) NSArray *lines;  // Warning: not in order found on screen!
-@end
-
 @implementation VT100Grid
 
 @synthesize size = size_;
@@ -26,10 +22,12 @@
 @synthesize scrollRegionCols = scrollRegionCols_;
 @synthesize useScrollRegionCols = useScrollRegionCols_;
 @synthesize allDirty = allDirty_;
-@synthesize lines = lines_;
 @synthesize savedDefaultChar = savedDefaultChar_;
 @synthesize cursor = cursor_;
 @synthesize delegate = delegate_;
+@synthesize scrollDamageRect = scrollDamageRect_;
+@synthesize scrollDamageDistance = scrollDamageDistance_;
+@synthesize scrollDamageIsComplex = scrollDamageIsComplex_;
 
 - (id)initWithSize:(VT100GridSize)size delegate:(id<VT100GridDelegate>)delegate {
     self = [super init];
@@ -43,30 +41,89 @@
 }
 
 - (void)dealloc {
-    [lines_ release];
-    [lineInfos_ release];
+    free(chars_);
+    free(rowMap_);
+    free(dirty_);
+    free(timestamps_);
     [cachedDefaultLine_ release];
+    [resultLine_ release];
     [super dealloc];
 }
 
-- (NSMutableData *)lineDataAtLineNumber:(int)lineNumber {
-    if (lineNumber >= 0 && lineNumber < size_.height) {
-        return [lines_ objectAtIndex:(screenTop_ + lineNumber) % size_.height];
-    } else {
-        return nil;
+// Index of a line's row in chars_, dirty_, and timestamps_. The line number must be valid.
+static inline int RowIndex(VT100Grid *grid, int lineNumber) {
+    return grid->rowMap_[(grid->screenTop_ + lineNumber) % grid->size_.height];
+}
+
+// Reverses the order of the rows for lines in [first, last].
+static void ReverseRows(VT100Grid *grid, int first, int last) {
+    const int height = grid->size_.height;
+    int *map = grid->rowMap_;
+    while (first < last) {
+        int a = (grid->screenTop_ + first) % height;
+        int b = (grid->screenTop_ + last) % height;
+        int temp = map[a];
+        map[a] = map[b];
+        map[b] = temp;
+        first++;
+        last--;
+    }
+}
+
+// Moves the rows for lines in [first, last] down by distance, wrapping around within the range. Only
+// the row map changes; no character data is copied.
+static void RotateRows(VT100Grid *grid, int first, int last, int distance) {
+    const int n = last - first + 1;
+    int shift = distance % n;
+    if (shift < 0) {
+        shift += n;
+    }
+    if (shift == 0) {
+        return;
     }
+    ReverseRows(grid, first, last);
+    ReverseRows(grid, first, first + shift - 1);
+    ReverseRows(grid, first + shift, last);
 }
 
 - (screen_char_t *)screenCharsAtLineNumber:(int)lineNumber {
     assert(lineNumber >= 0);
-    return [[lines_ objectAtIndex:(screenTop_ + lineNumber) % size_.height] mutableBytes];
+    return chars_ + RowIndex(self, lineNumber) * (size_.width + 1);
 }
 
-- (VT100LineInfo *)lineInfoAtLineNumber:(int)lineNumber {
+// Returns a line's dirty bits, or NULL if the line number is out of range.
+- (uint64_t *)dirtyBitsAtLineNumber:(int)lineNumber {
     if (lineNumber >= 0 && lineNumber < size_.height) {
-        return [lineInfos_ objectAtIndex:(screenTop_ + lineNumber) % size_.height];
+        return dirty_ + RowIndex(self, lineNumber) * dirtyWordsPerRow_;
     } else {
-        return nil;
+        return NULL;
+    }
+}
+
+- (void)setDirty:(BOOL)dirty
+         inRange:(VT100GridRange)range
+    atLineNumber:(int)lineNumber
+ updateTimestamp:(BOOL)updateTimestamp {
+    uint64_t *bits = [self dirtyBitsAtLineNumber:lineNumber];
+    if (!bits) {
+        return;
+    }
+    if (dirty && updateTimestamp) {
+        timestamps_[RowIndex(self, lineNumber)] = [NSDate timeIntervalSinceReferenceDate];
+    }
+    int start = MAX(0, range.location);
+    int end = MIN(size_.width, range.location + range.length);  // Exclusive
+    while (start < end) {
+        int word = start / 64;
+        int bit = start % 64;
+        int n = MIN(64 - bit, end - start);
+        uint64_t mask = (n == 64) ? ~0ULL : (((1ULL << n) - 1) << bit);
+        if (dirty) {
+            bits[word] |= mask;
+        } else {
+            bits[word] &= ~mask;
+        }
+        start += n;
     }
 }
 
@@ -74,21 +131,26 @@
     if (!dirty) {
         allDirty_ = NO;
     }
-    VT100LineInfo *lineInfo = [self lineInfoAtLineNumber:coord.y];
-    [lineInfo setDirty:dirty
-               inRange:VT100GridRangeMake(coord.x, 1)
-       updateTimestamp:updateTimestamp];
+    [self setDirty:dirty
+           inRange:VT100GridRangeMake(coord.x, 1)
+      atLineNumber:coord.y
+   updateTimestamp:updateTimestamp];
 }
 
 - (void)markCharsDirty:(BOOL)dirty inRectFrom:(VT100GridCoord)from to:(VT100GridCoord)to {
     if (!dirty) {
         allDirty_ = NO;
     }
+    // Every row gets the same timestamp, so the clock is read once rather than once per row.
+    const NSTimeInterval now = dirty ? [NSDate timeIntervalSinceReferenceDate] : 0;
     for (int y = from.y; y <= to.y; y++) {
-        VT100LineInfo *lineInfo = [self lineInfoAtLineNumber:y];
-        [lineInfo setDirty:dirty
-                   inRange:VT100GridRangeMake(from.x, to.x - from.x + 1)
-           updateTimestamp:YES];
+        [self setDirty:dirty
+               inRange:VT100GridRangeMake(from.x, to.x - from.x + 1)
+          atLineNumber:y
+       updateTimestamp:NO];
+        if (dirty && y >= 0 && y < size_.height) {
+            timestamps_[RowIndex(self, y)] = now;
+        }
     }
 }
 
@@ -113,17 +175,21 @@
     if (allDirty_) {
         return YES;
     }
-    VT100LineInfo *lineInfo = [self lineInfoAtLineNumber:coord.y];
-    return [lineInfo isDirtyAtOffset:coord.x];
+    uint64_t *bits = [self dirtyBitsAtLineNumber:coord.y];
+    if (!bits) {
+        return NO;
+    }
+    int x = MIN(size_.width - 1, MAX(0, coord.x));
+    return (bits[x / 64] >> (x % 64)) & 1;
 }
 
 - (BOOL)isAnyCharDirty {
     if (allDirty_) {
         return YES;
     }
-    for (int y = 0; y < size_.height; y++) {
-        VT100LineInfo *lineInfo = [self lineInfoAtLineNumber:y];
-        if ([lineInfo anyCharIsDirty]) {
+    const int n = size_.height * dirtyWordsPerRow_;
+    for (int i = 0; i < n; i++) {
+        if (dirty_[i]) {
             return YES;
         }
     }
@@ -131,8 +197,93 @@
 }
 
 - (VT100GridRange)dirtyRangeForLine:(int)y {
-    VT100LineInfo *lineInfo = [self lineInfoAtLineNumber:y];
-    return [lineInfo dirtyRange];
+    VT100GridRange range = VT100GridRangeMake(-1, 0);
+    uint64_t *bits = [self dirtyBitsAtLineNumber:y];
+    if (!bits) {
+        return range;
+    }
+    for (int i = 0; i < dirtyWordsPerRow_; i++) {
+        if (bits[i]) {
+            range.location = i * 64 + __builtin_ctzll(bits[i]);
+            break;
+        }
+    }
+    if (range.location >= 0) {
+        for (int i = dirtyWordsPerRow_ - 1; i >= 0; i--) {
+            if (bits[i]) {
+                range.length = i * 64 + 63 - __builtin_clzll(bits[i]) - range.location + 1;
+                break;
+            }
+        }
+    }
+    return range;
+}
+
+// Records that the lines in rect were rotated by distance. Returns YES if the scroll damage
+// describes it, in which case only the lines that scrolled into the rect need to be marked dirty.
+// Returns NO if the caller must mark the whole rect dirty.
+- (BOOL)recordScrollOfRect:(VT100GridRect)rect by:(int)distance {
+    if (scrollDamageIsComplex_) {
+        return NO;
+    }
+    if (scrollDamageDistance_ != 0 && !VT100GridRectEquals(rect, scrollDamageRect_)) {
+        [self markScrollDamageDirty];
+        return NO;
+    }
+    int total = scrollDamageDistance_ + distance;
+    if (total == 0 || abs(total) >= rect.size.height) {
+        // Either every line was replaced, or lines went out of the rect and came back blank.
+        [self markScrollDamageDirty];
+        return NO;
+    }
+    scrollDamageRect_ = rect;
+    scrollDamageDistance_ = total;
+    return YES;
+}
+
+- (void)markScrollDamageDirty {
+    if (!scrollDamageIsComplex_ && scrollDamageDistance_ != 0) {
+        [self markCharsDirty:YES
+                  inRectFrom:scrollDamageRect_.origin
+                          to:VT100GridRectMax(scrollDamageRect_)];
+    }
+    scrollDamageIsComplex_ = YES;
+}
+
+- (void)resetScrollDamage {
+    scrollDamageRect_ = VT100GridRectMake(0, 0, 0, 0);
+    scrollDamageDistance_ = 0;
+    scrollDamageIsComplex_ = NO;
+}
+
+- (NSArray *)dirtyRects {
+    NSMutableArray *rects = [NSMutableArray array];
+    if (allDirty_) {
+        [rects addObject:[NSValue valueWithGridRect:VT100GridRectMake(0, 0, size_.width, size_.height)]];
+        return rects;
+    }
+    VT100GridRect pending = VT100GridRectMake(0, 0, 0, 0);
+    for (int y = 0; y < size_.height; y++) {
+        VT100GridRange range = [self dirtyRangeForLine:y];
+        if (pending.size.height > 0 &&
+            range.location == pending.origin.x &&
+            range.length == pending.size.width) {
+            pending.size.height++;
+            continue;
+        }
+        if (pending.size.height > 0) {
+            [rects addObject:[NSValue valueWithGridRect:pending]];
+        }
+        if (range.length > 0) {
+            pending = VT100GridRectMake(range.location, y, range.length, 1);
+        } else {
+            pending.size.height = 0;
+        }
+    }
+    if (pending.size.height > 0) {
+        [rects addObject:[NSValue valueWithGridRect:pending]];
+    }
+    return rects;
 }
 
 - (int)cursorX {
@@ -215,7 +366,7 @@
                         length:currentLineLength
                        partial:(continuation != EOL_HARD)
                          width:size_.width
-                     timestamp:[[self lineInfoAtLineNumber:i] timestamp]];
+                     timestamp:[self timestampForLine:i]];
 #ifdef DEBUG_RESIZEDWIDTH
         NSLog(@"Appended a line. now have %d lines for width %d\n",
               [lineBuffer numLinesWithWidth:size_.width], size_.width);
@@ -226,7 +377,11 @@
 }
 
 - (NSTimeInterval)timestampForLine:(int)y {
-    return [[self lineInfoAtLineNumber:y] timestamp];
+    if (y >= 0 && y < size_.height) {
+        return timestamps_[RowIndex(self, y)];
+    } else {
+        return 0;
+    }
 }
 
 - (int)lengthOfLineNumber:(int)lineNumber {
@@ -273,6 +428,14 @@
       [self markCharDirty:YES at:cursor_ updateTimestamp:YES];
     }
 
+    if (lineBuffer) {
+        // The grid's position in the document is about to move, so pending scroll damage would be
+        // applied to the wrong lines.
+        if (scrollDamageDistance_ != 0) {
+            [self markScrollDamageDirty];
+        }
+    }
+
     // Add the top line to the scrollback
     int numLinesDropped = [self appendLineToLineBuffer:lineBuffer
                                    unlimitedScrollback:unlimitedScrollback];
@@ -281,10 +444,12 @@
     screenTop_ = (screenTop_ + 1) % size_.height;
 
     // Empty contents of last line on screen.
-    [self clearLineData:[self lineDataAtLineNumber:(size_.height - 1)]];
+    [self clearLine:[self screenCharsAtLineNumber:(size_.height - 1)]];
 
-    if (lineBuffer) {
-        // Mark new line at bottom of screen dirty.
+    if (lineBuffer ||
+        [self recordScrollOfRect:VT100GridRectMake(0, 0, size_.width, size_.height) by:-1]) {
+        // Either the screen's position in the document moved down with its contents, or the move
+        // is described by the scroll damage. Only the new line at the bottom needs to be drawn.
         [self markCharsDirty:YES
                   inRectFrom:VT100GridCoordMake(0, size_.height - 1)
                           to:VT100GridCoordMake(size_.width - 1, size_.height - 1)];
@@ -324,6 +489,9 @@
             // the scrollback buffer.
             numLinesDropped = [self appendLineToLineBuffer:lineBuffer
                                        unlimitedScrollback:unlimitedScrollback];
+            // The grid's position in the scrollback moved too, so lines below the region also
+            // shifted relative to the document.
+            [self markScrollDamageDirty];
         }
         // TODO: formerly, scrollTop==scrollBottom was a no-op but I think that's wrong. See what other terms do.
         [self scrollRect:VT100GridRectMake(scrollLeft,
@@ -437,12 +605,15 @@
     if (from.x > to.x || from.y > to.y) {
         return;
     }
+    const screen_char_t *filledLine = [self templateLineOfWidth:size_.width filledWithChar:c];
+    const int startX = MAX(0, from.x);
+    const int endX = MIN(to.x, size_.width - 1);
     for (int y = MAX(0, from.y); y <= MIN(to.y, size_.height - 1); y++) {
         screen_char_t *line = [self screenCharsAtLineNumber:y];
         [self erasePossibleDoubleWidthCharInLineNumber:y startingAtOffset:from.x - 1 withChar:c];
         [self erasePossibleDoubleWidthCharInLineNumber:y startingAtOffset:to.x withChar:c];
-        for (int x = MAX(0, from.x); x <= MIN(to.x, size_.width - 1); x++) {
-            line[x] = c;
+        if (endX >= startX) {
+            memcpy(line + startX, filledLine + startX, (endX - startX + 1) * sizeof(screen_char_t));
         }
         if (c.code == 0 && to.x == size_.width - 1) {
             line[size_.width].code = EOL_HARD;
@@ -487,20 +658,27 @@
            foregroundColor:(screen_char_t)fg
                 inRectFrom:(VT100GridCoord)from
                         to:(VT100GridCoord)to {
+    // Build one char holding the colors to copy and a mask of their bits, and merge them into each
+    // row at once.
+    screen_char_t template;
+    screen_char_t mask;
+    screen_char_t ones;
+    memset(&template, 0, sizeof(template));
+    memset(&mask, 0, sizeof(mask));
+    memset(&ones, 0xff, sizeof(ones));
+    if (fg.foregroundColorMode != ColorModeInvalid) {
+        CopyForegroundColor(&template, fg);
+        CopyForegroundColor(&mask, ones);
+    }
+    if (bg.backgroundColorMode != ColorModeInvalid) {
+        CopyBackgroundColor(&template, bg);
+        CopyBackgroundColor(&mask, ones);
+    }
     for (int y = from.y; y <= to.y; y++) {
         screen_char_t *line = [self screenCharsAtLineNumber:y];
-        for (int x = from.x; x <= to.x; x++) {
-            if (fg.foregroundColorMode != ColorModeInvalid) {
-                CopyForegroundColor(&line[x], fg);
-            }
-            if (bg.backgroundColorMode != ColorModeInvalid) {
-                CopyBackgroundColor(&line[x], bg);
-            }
-        }
-        [self markCharsDirty:YES
-                  inRectFrom:VT100GridCoordMake(from.x, y)
-                          to:VT100GridCoordMake(to.x, y)];
+        MergeScreenChars(line + from.x, to.x - from.x + 1, template, mask);
     }
+    [self markCharsDirty:YES inRectFrom:from to:to];
 }
 
 - (void)copyCharsFromGrid:(VT100Grid *)otherGrid {
@@ -526,13 +704,192 @@
     return VT100GridRangeMax(scrollRegionCols_);
 }
 
+static BOOL ScreenCharsContainDoubleWidthChars(screen_char_t *buffer, int len) {
+    for (int i = 0; i < len; i++) {
+        if (buffer[i].code == DWC_RIGHT || buffer[i].code == DWC_SKIP) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+// Returns YES if the state of the grid allows -appendCharsInBulk:... to append len chars. The caller
+// must also check that the chars contain no double-width characters.
+- (BOOL)canAppendCharsInBulkWithLength:(int)len lineBuffer:(LineBuffer *)lineBuffer {
+    if (!lineBuffer ||
+        cursor_.y != size_.height - 1 ||
+        cursor_.x > size_.width ||
+        len - (size_.width - cursor_.x) <= size_.width) {
+        // Must wrap at least one full line past the last line of the screen.
+        return NO;
+    }
+    if ([self haveScrollRegion] || ![delegate_ wraparoundMode] || [delegate_ insertMode]) {
+        return NO;
+    }
+    // The cursor may be just past the last column, waiting to wrap.
+    return (cursor_.x == size_.width ||
+            [self screenCharsAtLineNumber:cursor_.y][cursor_.x].code != DWC_RIGHT);
+}
+
+// Appends chars that wrap past the bottom of the screen as though each wrap scrolled the whole
+// screen into the line buffer, but writes lines that would scroll off the top straight to the line
+// buffer in one piece. Only lines that remain on screen are written to the grid. Stops before the
+// last line of chars, leaving the cursor at the start of an empty last line. Returns the number of
+// chars appended.
+- (int)appendCharsInBulk:(screen_char_t *)buffer
+                  length:(int)len
+ scrollingIntoLineBuffer:(LineBuffer *)lineBuffer
+     unlimitedScrollback:(BOOL)unlimitedScrollback
+         numLinesDropped:(int *)numDropped {
+    const int width = size_.width;
+    const int height = size_.height;
+    const int charsOnCursorLine = width - cursor_.x;
+    // Leave at least one char for the caller so it handles wrapping at the end.
+    const int fullLines = (len - charsOnCursorLine - 1) / width;
+    const int scrolls = fullLines + 1;
+    const int gridLinesToScroll = MIN(scrolls, height);
+    const NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+
+    if (scrollDamageDistance_ != 0) {
+        // The grid's position in the document is about to move.
+        [self markScrollDamageDirty];
+    }
+
+    // Fill out the cursor's line. If the cursor is waiting to wrap there's nothing to add to it.
+    screen_char_t *line = [self screenCharsAtLineNumber:cursor_.y];
+    memcpy(line + cursor_.x, buffer, charsOnCursorLine * sizeof(screen_char_t));
+    line[width].code = EOL_SOFT;
+    timestamps_[RowIndex(self, cursor_.y)] = now;
+
+    // Scroll lines already on the grid into the line buffer.
+    for (int i = 0; i < gridLinesToScroll; i++) {
+        *numDropped += [self appendLineToLineBuffer:lineBuffer
+                                unlimitedScrollback:unlimitedScrollback];
+        screenTop_ = (screenTop_ + 1) % height;
+    }
+
+    // Lines of chars that would scroll off the top of the screen go directly to the line buffer.
+    screen_char_t *next = buffer + charsOnCursorLine;
+    const int linesBypassingGrid = scrolls - gridLinesToScroll;
+    if (linesBypassingGrid > 0) {
+        [lineBuffer appendLine:next
+                        length:linesBypassingGrid * width
+                       partial:YES
+                         width:width
+                     timestamp:now];
+        if (!unlimitedScrollback) {
+            *numDropped += [lineBuffer dropExcessLinesWithWidth:width];
+        }
+        next += linesBypassingGrid * width;
+    }
+
+    // The rest of the full lines stay on screen above the new last line.
+    const int visibleLines = fullLines - linesBypassingGrid;
+    for (int i = 0; i < visibleLines; i++) {
+        screen_char_t *dest = [self screenCharsAtLineNumber:height - 1 - visibleLines + i];
+        memcpy(dest, next, width * sizeof(screen_char_t));
+        dest[width].code = EOL_SOFT;
+        next += width;
+    }
+    [self clearLine:[self screenCharsAtLineNumber:height - 1]];
+
+    // Everything from the former cursor line down changed.
+    [self markCharsDirty:YES
+              inRectFrom:VT100GridCoordMake(0, MAX(0, height - 1 - gridLinesToScroll))
+                      to:VT100GridCoordMake(width - 1, height - 1)];
+    self.cursorX = 0;
+    DLog(@"appended %d lines in bulk", scrolls);
+    return charsOnCursorLine + fullLines * width;
+}
+
+// -appendCharsAtCursor:... for the usual case, which the caller must check: no double-width
+// chars, no column scroll region, wraparound on and insert mode off. Each line is one memcpy with
+// none of the checks for the other cases.
+- (int)appendSingleWidthCharsAtCursor:(screen_char_t *)buffer
+                               length:(int)len
+              scrollingIntoLineBuffer:(LineBuffer *)lineBuffer
+                  unlimitedScrollback:(BOOL)unlimitedScrollback
+              useScrollbackWithRegion:(BOOL)useScrollbackWithRegion {
+    int numDropped = 0;
+    const int width = size_.width;
+    const BOOL isAnsi = [delegate_ isAnsi];
+    int idx = 0;
+    while (idx < len) {
+        if ([self canAppendCharsInBulkWithLength:len - idx lineBuffer:lineBuffer]) {
+            idx += [self appendCharsInBulk:buffer + idx
+                                    length:len - idx
+                   scrollingIntoLineBuffer:lineBuffer
+                       unlimitedScrollback:unlimitedScrollback
+                           numLinesDropped:&numDropped];
+        }
+        if (cursor_.x >= width) {
+            [self screenCharsAtLineNumber:cursor_.y][width].code = EOL_SOFT;
+            self.cursorX = 0;
+            numDropped += [self moveCursorDownOneLineScrollingIntoLineBuffer:lineBuffer
+                                                         unlimitedScrollback:unlimitedScrollback
+                                                     useScrollbackWithRegion:useScrollbackWithRegion];
+        }
+        const int x = cursor_.x;
+        const int lineNumber = cursor_.y;
+        const int charsToInsert = MIN(width - x, len - idx);
+        screen_char_t *aLine = [self screenCharsAtLineNumber:lineNumber];
+
+        // Overwriting the second half of a double-width character, so turn it into spaces.
+        if (aLine[x].code == DWC_RIGHT) {
+            aLine[x].code = 0;
+            aLine[x].complexChar = NO;
+            aLine[x - 1].code = 0;
+            aLine[x - 1].complexChar = NO;
+            [self markCharDirty:YES at:VT100GridCoordMake(x, lineNumber) updateTimestamp:YES];
+            [self markCharDirty:YES at:VT100GridCoordMake(x - 1, lineNumber) updateTimestamp:YES];
+        }
+        // As in -appendCharsAtCursor:..., a single char that changes nothing isn't marked dirty.
+        if (charsToInsert > 1 ||
+            memcmp(aLine + x, buffer + idx, charsToInsert * sizeof(screen_char_t))) {
+            memcpy(aLine + x, buffer + idx, charsToInsert * sizeof(screen_char_t));
+            [self markCharsDirty:YES
+                      inRectFrom:VT100GridCoordMake(x, lineNumber)
+                              to:VT100GridCoordMake(x + charsToInsert - 1, lineNumber)];
+        }
+        self.cursorX = x + charsToInsert;
+        idx += charsToInsert;
+
+        // Overwrote the first half of a double-width character.
+        if (cursor_.x < width - 1 && aLine[cursor_.x].code == DWC_RIGHT) {
+            aLine[cursor_.x].code = 0;
+            aLine[cursor_.x].complexChar = NO;
+        }
+
+        // ANSI terminals go to a new line after displaying a character at the rightmost column.
+        if (cursor_.x >= width && isAnsi) {
+            aLine[width].code = EOL_SOFT;
+            self.cursorX = 0;
+            numDropped += [self moveCursorDownOneLineScrollingIntoLineBuffer:lineBuffer
+                                                         unlimitedScrollback:unlimitedScrollback
+                                                     useScrollbackWithRegion:useScrollbackWithRegion];
+        }
+    }
+    return numDropped;
+}
+
 - (int)appendCharsAtCursor:(screen_char_t *)buffer
                     length:(int)len
    scrollingIntoLineBuffer:(LineBuffer *)lineBuffer
        unlimitedScrollback:(BOOL)unlimitedScrollback
    useScrollbackWithRegion:(BOOL)useScrollbackWithRegion {
-    int numDropped = 0;
     assert(buffer);
+    if (!useScrollRegionCols_ &&
+        self.scrollRight == size_.width - 1 &&
+        [delegate_ wraparoundMode] &&
+        ![delegate_ insertMode] &&
+        !ScreenCharsContainDoubleWidthChars(buffer, len)) {
+        return [self appendSingleWidthCharsAtCursor:buffer
+                                             length:len
+                            scrollingIntoLineBuffer:lineBuffer
+                                unlimitedScrollback:unlimitedScrollback
+                            useScrollbackWithRegion:useScrollbackWithRegion];
+    }
+    int numDropped = 0;
     int idx;  // Index into buffer
     int charsToInsert;
     int newx;
@@ -540,11 +897,26 @@
     screen_char_t *aLine;
     const int scrollLeft = self.scrollLeft;
     const int scrollRight = self.scrollRight;
+    BOOL mayAppendInBulk = YES;  // Cleared once the chars are known to contain DWCs.
 
     // Iterate over each character in the buffer and copy/insert into screen.
     // Grab a block of consecutive characters up to the remaining length in the
     // line and append them at once.
     for (idx = 0; idx < len; )  {
+        if (mayAppendInBulk &&
+            [self canAppendCharsInBulkWithLength:len - idx lineBuffer:lineBuffer]) {
+            if (ScreenCharsContainDoubleWidthChars(buffer + idx, len - idx)) {
+                mayAppendInBulk = NO;
+            } else {
+                // A long line is wrapping off the bottom of the screen. Skip the per-line scrolling
+                // and append everything but its last line at once.
+                idx += [self appendCharsInBulk:buffer + idx
+                                        length:len - idx
+                       scrollingIntoLineBuffer:lineBuffer
+                           unlimitedScrollback:unlimitedScrollback
+                               numLinesDropped:&numDropped];
+            }
+        }
         int startIdx = idx;
 #ifdef VERBOSE_STRING
         NSLog(@"Begin inserting line. cursor_.x=%d, WIDTH=%d", cursor_.x, WIDTH);
@@ -936,6 +1308,19 @@
             di -= direction;
         }
 
+        BOOL rotated = NO;
+        if (sourceHeight > 0 &&
+            rect.origin.x == 0 &&
+            rect.size.width == size_.width &&
+            rect.origin.y >= 0 &&
+            bottomIndex < size_.height) {
+            // Whole lines are moving, so rotate them in the row map instead of copying their
+            // contents. The lines that wrap around to the other end get cleared below.
+            RotateRows(self, rect.origin.y, bottomIndex, distance);
+            sourceHeight = 0;
+            rotated = YES;
+        }
+
         // Move lines.
         for (int iteration = 0; (iteration < sourceHeight &&
                                  sourceIndex < size_.height &&
@@ -954,9 +1339,14 @@
             destIndex -= direction;
         }
 
-        [self markCharsDirty:YES
-                  inRectFrom:rect.origin
-                          to:VT100GridCoordMake(rightIndex, bottomIndex)];
+        if (rotated && [self recordScrollOfRect:rect by:distance]) {
+            // Lines that moved keep their dirty bits. Those that scrolled in are marked dirty when
+            // they're cleared below.
+        } else {
+            [self markCharsDirty:YES
+                      inRectFrom:rect.origin
+                              to:VT100GridCoordMake(rightIndex, bottomIndex)];
+        }
 
         int lineNumberAboveScrollRegion = rect.origin.y - 1;
         // Fix up broken soft or dwc_skip continuation marks. It could occur on line just above
@@ -1067,6 +1457,16 @@
     self.cursorY = MIN(size_.height - 1, MAX(0, info.cursorY - yOffset));
 }
 
+- (long long)memoryUsage {
+    const long long rows = MAX(1, size_.height);
+    return (rows * (size_.width + 1) * sizeof(screen_char_t) +
+            rows * sizeof(int) +
+            rows * dirtyWordsPerRow_ * sizeof(uint64_t) +
+            rows * sizeof(NSTimeInterval) +
+            [cachedDefaultLine_ length] +
+            [resultLine_ length]);
+}
+
 - (NSString*)debugString
 {
     NSMutableString* result = [NSMutableString stringWithString:@""];
@@ -1118,26 +1518,100 @@
 }
 
 - (NSArray *)runsMatchingRegex:(NSString *)regex {
+    return [self runsMatchingRegex:regex
+            skippingUnchangedLines:nil
+                 firstAbsoluteLine:0
+                       stringCache:nil];
+}
+
+// Number of lines in the wrapped line that begins at |startScreenY|.
+- (int)numberOfLinesInWrappedLineAtLineNumber:(int)startScreenY {
+    int limitY;
+    for (limitY = startScreenY; limitY < size_.height - 1; limitY++) {
+        screen_char_t *screenLine = [self screenCharsAtLineNumber:limitY];
+        if (screenLine[size_.width].code == EOL_HARD) {
+            break;
+        }
+    }
+    return limitY - startScreenY + 1;
+}
+
+// FNV-1a hash of the chars, including attributes and EOL marks, of |numLines| lines.
+- (uint64_t)signatureOfLines:(int)startScreenY count:(int)numLines {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int y = startScreenY; y < startScreenY + numLines; y++) {
+        const unsigned char *bytes = (const unsigned char *)[self screenCharsAtLineNumber:y];
+        const size_t length = (size_.width + 1) * sizeof(screen_char_t);
+        for (size_t i = 0; i < length; i++) {
+            hash = (hash ^ bytes[i]) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+- (NSMutableDictionary *)signaturesOfWrappedLinesWithFirstAbsoluteLine:(long long)firstAbsoluteLine {
+    NSMutableDictionary *signatures = [NSMutableDictionary dictionary];
+    int y = 0;
+    while (y < size_.height) {
+        const int numLines = [self numberOfLinesInWrappedLineAtLineNumber:y];
+        [signatures setObject:@([self signatureOfLines:y count:numLines])
+                       forKey:@(firstAbsoluteLine + y)];
+        y += numLines;
+    }
+    return signatures;
+}
+
+- (NSArray *)runsMatchingRegex:(NSString *)regex
+        skippingUnchangedLines:(NSDictionary *)signatures
+             firstAbsoluteLine:(long long)firstAbsoluteLine
+                   stringCache:(ScreenCharStringCache *)cache {
     NSMutableArray *runs = [NSMutableArray array];
+    CompiledRegex *compiledRegex = [CompiledRegex regexWithPattern:regex caseInsensitive:NO];
+    if (!compiledRegex) {
+        return runs;
+    }
 
     int y = 0;
     while (y < size_.height) {
-        int numLines;
-        unichar *backingStore;
-        int *deltas;
-
-        NSString *joinedLine = [self joinedLineBeginningAtLineNumber:y
-                                                         numLinesPtr:&numLines
-                                                     backingStorePtr:&backingStore
-                                                           deltasPtr:&deltas];
+        int numLines = [self numberOfLinesInWrappedLineAtLineNumber:y];
+        if (signatures) {
+            NSNumber *signature = [signatures objectForKey:@(firstAbsoluteLine + y)];
+            if (signature && [signature unsignedLongLongValue] == [self signatureOfLines:y
+                                                                                    count:numLines]) {
+                y += numLines;
+                continue;
+            }
+        }
+
+        unichar *backingStore = NULL;
+        int *ownDeltas = NULL;
+        const int *deltas;
+        NSString *joinedLine;
+        if (cache) {
+            NSMutableData *tempData =
+                [NSMutableData dataWithLength:sizeof(screen_char_t) * size_.width * numLines];
+            screen_char_t *temp = (screen_char_t *)[tempData mutableBytes];
+            for (int i = 0; i < numLines; i++) {
+                memcpy(temp + size_.width * i,
+                       [self screenCharsAtLineNumber:y + i],
+                       size_.width * sizeof(screen_char_t));
+            }
+            joinedLine = [cache stringForLine:temp
+                           absoluteLineNumber:firstAbsoluteLine + y
+                                        start:0
+                                          end:size_.width * numLines
+                                       deltas:&deltas];
+        } else {
+            joinedLine = [self joinedLineBeginningAtLineNumber:y
+                                                   numLinesPtr:&numLines
+                                               backingStorePtr:&backingStore
+                                                     deltasPtr:&ownDeltas];
+            deltas = ownDeltas;
+        }
         NSRange searchRange = NSMakeRange(0, joinedLine.length);
         NSRange range;
         while (1) {
-            range = [joinedLine rangeOfRegex:regex
-                                     options:0
-                                     inRange:searchRange
-                                     capture:0
-                                       error:nil];
+            range = [compiledRegex rangeOfFirstMatchInString:joinedLine range:searchRange];
             if (range.location == NSNotFound || range.length == 0) {
                 break;
             }
@@ -1169,7 +1643,7 @@
         }
         y += numLines;
         free(backingStore);
-        free(deltas);
+        free(ownDeltas);
     }
 
     return runs;
@@ -1189,8 +1663,8 @@
     }
     destLineNumber = MIN(destLineNumber, maxLines - 1);
 
-    screen_char_t *defaultLine = [[self lineOfWidth:size_.width
-                                     filledWithChar:defaultChar] mutableBytes];
+    const screen_char_t *defaultLine = [self templateLineOfWidth:size_.width
+                                                  filledWithChar:defaultChar];
 
     BOOL foundCursor = NO;
     BOOL prevLineStartsWithDoubleWidth = NO;
@@ -1213,7 +1687,7 @@
                                             width:size_.width
                                 includesEndOfLine:&cont
                                         timestamp:&timestamp]);
-        [[self lineInfoAtLineNumber:destLineNumber] setTimestamp:timestamp];
+        timestamps_[RowIndex(self, destLineNumber)] = timestamp;
         if (cont && dest[size_.width - 1].code == 0 && prevLineStartsWithDoubleWidth) {
             // If you pop a soft-wrapped line that's a character short and the
             // line below it starts with a DWC, it's safe to conclude that a DWC
@@ -1344,7 +1818,7 @@
             if (line[x].complexChar) c = 'U';
             [dump appendFormat:@"%c", c];
         }
-        NSDate* date = [NSDate dateWithTimeIntervalSinceReferenceDate:[[self lineInfoAtLineNumber:y] timestamp]];
+        NSDate* date = [NSDate dateWithTimeIntervalSinceReferenceDate:[self timestampForLine:y]];
         [dump appendFormat:@"  | %@", [fmt stringFromDate:date]];
         if (y != size_.height - 1) {
             [dump appendString:@"\n"];
@@ -1466,27 +1940,45 @@
 - (NSArray *)orderedLines {
     NSMutableArray *array = [NSMutableArray array];
     for (int i = 0; i < size_.height; i++) {
-        [array addObject:[self lineDataAtLineNumber:i]];
+        [array addObject:[NSData dataWithBytesNoCopy:[self screenCharsAtLineNumber:i]
+                                              length:(size_.width + 1) * sizeof(screen_char_t)
+                                        freeWhenDone:NO]];
     }
     return array;
 }
 
 #pragma mark - Private
 
-- (NSMutableArray *)linesWithSize:(VT100GridSize)size {
-    NSMutableArray *lines = [[[NSMutableArray alloc] init] autorelease];
-    for (int i = 0; i < size.height; i++) {
-        [lines addObject:[[[self defaultLineOfWidth:size.width] mutableCopy] autorelease]];
+// Allocates storage for the current size, filled with empty, clean lines.
+- (void)allocateStorage {
+    free(chars_);
+    free(rowMap_);
+    free(dirty_);
+    free(timestamps_);
+
+    const int rowLength = size_.width + 1;
+    chars_ = malloc(MAX(1, size_.height * rowLength) * sizeof(screen_char_t));
+    screen_char_t *defaultLine = [[self defaultLineOfWidth:size_.width] mutableBytes];
+    for (int i = 0; i < size_.height; i++) {
+        memcpy(chars_ + i * rowLength, defaultLine, rowLength * sizeof(screen_char_t));
     }
-    return lines;
-}
 
-- (NSMutableArray *)lineInfosWithSize:(VT100GridSize)size {
-    NSMutableArray *dirty = [NSMutableArray array];
-    for (int i = 0; i < size.height; i++) {
-        [dirty addObject:[[[VT100LineInfo alloc] initWithWidth:size_.width] autorelease]];
+    rowMap_ = malloc(MAX(1, size_.height) * sizeof(int));
+    for (int i = 0; i < size_.height; i++) {
+        rowMap_[i] = i;
+    }
+
+    dirtyWordsPerRow_ = MAX(1, (size_.width + 63) / 64);
+    dirty_ = calloc(MAX(1, size_.height) * dirtyWordsPerRow_, sizeof(uint64_t));
+
+    timestamps_ = malloc(MAX(1, size_.height) * sizeof(NSTimeInterval));
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    for (int i = 0; i < size_.height; i++) {
+        timestamps_[i] = now;
     }
-    return dirty;
+    screenTop_ = 0;
+    [self resetScrollDamage];
+    scrollDamageIsComplex_ = YES;
 }
 
 - (screen_char_t)defaultChar {
@@ -1503,52 +1995,39 @@
     return c;
 }
 
-- (NSMutableData *)lineOfWidth:(int)width filledWithChar:(screen_char_t)c {
-    NSMutableData *data = [NSMutableData dataWithLength:sizeof(screen_char_t) * (width + 1)];
-    screen_char_t *line = data.mutableBytes;
-    for (int i = 0; i < width + 1; i++) {
-        line[i] = c;
-    }
-    return data;
-}
-
-- (NSMutableData *)defaultLineOfWidth:(int)width {
-    size_t length = (width + 1) * sizeof(screen_char_t);
-
-    screen_char_t *existingCache = (screen_char_t *)[cachedDefaultLine_ mutableBytes];
-    screen_char_t currentDefaultChar = [self defaultChar];
+// Returns a line of |width| copies of |c| followed by an EOL_HARD mark. Rows are cleared by copying
+// from it rather than storing one char at a time. It's kept in cachedDefaultLine_ and rebuilt only
+// when the width or char changes, which for clears is as rare as a resize or a change of SGR colors.
+- (const screen_char_t *)templateLineOfWidth:(int)width filledWithChar:(screen_char_t)c {
+    const size_t length = (width + 1) * sizeof(screen_char_t);
+    screen_char_t *line = (screen_char_t *)[cachedDefaultLine_ mutableBytes];
     if (cachedDefaultLine_ &&
         [cachedDefaultLine_ length] == length &&
-        length > 0 &&
-        !memcmp(existingCache, &currentDefaultChar, sizeof(screen_char_t))) {
-        return cachedDefaultLine_;
+        !memcmp(line, &c, sizeof(screen_char_t))) {
+        return line;
     }
 
-    NSMutableData *line = [NSMutableData dataWithLength:length];
-
-    [self clearLineData:line];
-
-    [cachedDefaultLine_ release];
-    cachedDefaultLine_ = [line retain];
-
+    if (!cachedDefaultLine_) {
+        cachedDefaultLine_ = [[NSMutableData alloc] initWithLength:length];
+    } else {
+        [cachedDefaultLine_ setLength:length];
+    }
+    line = (screen_char_t *)[cachedDefaultLine_ mutableBytes];
+    FillScreenChars(line, width + 1, c);
+    line[width].code = EOL_HARD;
     return line;
 }
 
-// Not double-width char safe.
-- (void)clearScreenChars:(screen_char_t *)chars inRange:(VT100GridRange)range {
-    screen_char_t c = [self defaultChar];
-
-    for (int i = range.location; i < range.location + range.length; i++) {
-        chars[i] = c;
-    }
+- (NSMutableData *)defaultLineOfWidth:(int)width {
+    [self templateLineOfWidth:width filledWithChar:[self defaultChar]];
+    return cachedDefaultLine_;
 }
 
-- (void)clearLineData:(NSMutableData *)line {
-    int length = (int)([line length] / sizeof(screen_char_t));
-    [self clearScreenChars:[line mutableBytes] inRange:VT100GridRangeMake(0, length)];
-    screen_char_t *chars = (screen_char_t *)[line mutableBytes];
-    int width = [line length] / sizeof(screen_char_t) - 1;
-    chars[width].code = EOL_HARD;
+// Clears a row of the grid. Not double-width char safe.
+- (void)clearLine:(screen_char_t *)line {
+    memcpy(line,
+           [self templateLineOfWidth:size_.width filledWithChar:[self defaultChar]],
+           (size_.width + 1) * sizeof(screen_char_t));
 }
 
 // Returns number of lines dropped from line buffer because it exceeded its size (always 0 or 1).
@@ -1567,7 +2046,7 @@
                     length:len
                    partial:(continuationMark != EOL_HARD)
                      width:size_.width
-                 timestamp:[[self lineInfoAtLineNumber:0] timestamp]];
+                 timestamp:[self timestampForLine:0]];
     int dropped;
     if (!unlimitedScrollback) {
         dropped = [lineBuffer dropExcessLinesWithWidth:size_.width];
@@ -1613,10 +2092,7 @@
 - (void)setSize:(VT100GridSize)newSize {
     if (newSize.width != size_.width || newSize.height != size_.height) {
         size_ = newSize;
-        [lines_ release];
-        [lineInfos_ release];
-        lines_ = [[self linesWithSize:newSize] retain];
-        lineInfos_ = [[self lineInfosWithSize:newSize] retain];
+        [self allocateStorage];
         scrollRegionRows_.location = MIN(scrollRegionRows_.location, size_.width - 1);
         scrollRegionRows_.length = MIN(scrollRegionRows_.length,
                                        size_.width - scrollRegionRows_.location);
@@ -1842,16 +2318,14 @@ void DumpBuf(screen_char_t* p, int n) {
 - (id)copyWithZone:(NSZone *)zone {
     VT100Grid *theCopy = [[VT100Grid alloc] initWithSize:size_
                                                 delegate:delegate_];
-    [theCopy->lines_ release];
-    theCopy->lines_ = [[NSMutableArray alloc] init];
-    for (NSObject *line in lines_) {
-        [theCopy->lines_ addObject:[[line mutableCopy] autorelease]];
-    }
-    theCopy->lineInfos_ = [[NSMutableArray alloc] init];
-    for (VT100LineInfo *line in lineInfos_) {
-        [theCopy->lineInfos_ addObject:[[line copy] autorelease]];
-    }
+    memcpy(theCopy->chars_, chars_, size_.height * (size_.width + 1) * sizeof(screen_char_t));
+    memcpy(theCopy->rowMap_, rowMap_, size_.height * sizeof(int));
+    memcpy(theCopy->dirty_, dirty_, size_.height * dirtyWordsPerRow_ * sizeof(uint64_t));
+    memcpy(theCopy->timestamps_, timestamps_, size_.height * sizeof(NSTimeInterval));
     theCopy->screenTop_ = screenTop_;
+    theCopy->scrollDamageRect_ = scrollDamageRect_;
+    theCopy->scrollDamageDistance_ = scrollDamageDistance_;
+    theCopy->scrollDamageIsComplex_ = scrollDamageIsComplex_;
     theCopy.cursor = cursor_;
     theCopy.scrollRegionRows = scrollRegionRows_;
     theCopy.scrollRegionCols = scrollRegionCols_;
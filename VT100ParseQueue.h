@@ -0,0 +1,62 @@
+//
+//  VT100ParseQueue.h
+//  iTerm
+//
+//  Moves a session's output through three stages so that a noisy session doesn't spend
+//  main-thread time in the parser:
+//
+//    1. Read: the thread that read the data (the TaskNotifier thread, or the main thread for a
+//       tmux pane) calls -addData:.
+//    2. Parse: a job in the shared ParseWorkerPool turns each chunk into a VT100TokenBatch. The
+//       job runs on one worker at a time, so chunks are parsed in order.
+//    3. Apply: the delegate executes the batches on the main thread.
+//
+//  The stages are connected by bounded SPSCQueues, so no stage takes a lock the next one holds and
+//  no stage can get unboundedly far ahead of the next. When the apply stage falls behind, the
+//  delegate is told to stop reading right away, from the thread that noticed, instead of after
+//  a trip through the main queue.
+//
+//  Once the stream is handed over to tmux, the queue stops tokenizing and forwards raw data to the
+//  delegate, which parses it the old-fashioned way from then on.
+//
+
+#import <Foundation/Foundation.h>
+
+@class VT100ParseQueue;
+@class VT100Terminal;
+@class VT100TokenBatch;
+
+@protocol VT100ParseQueueDelegate <NSObject>
+
+// These are called on the main thread, in the order the input arrived.
+- (void)parseQueue:(VT100ParseQueue *)parseQueue didProduceTokenBatch:(VT100TokenBatch *)batch;
+- (void)parseQueue:(VT100ParseQueue *)parseQueue didReceiveUnparsedData:(NSData *)data;
+
+// Too much input is waiting to be parsed or applied (or enough of it has been). The delegate
+// should stop (or resume) reading from the pty. This may be called on any stage's thread, with a
+// lock held that keeps pauses and resumes in order, so it must be quick. It is never called after
+// -invalidate returns.
+- (void)parseQueue:(VT100ParseQueue *)parseQueue setReadingPaused:(BOOL)paused;
+
+@end
+
+@interface VT100ParseQueue : NSObject
+
+@property(nonatomic, assign) id<VT100ParseQueueDelegate> delegate;
+
+// How full the queues are and how often each stage has had to wait, for tuning. Safe to call from
+// any thread.
+@property(nonatomic, readonly) NSString *statistics;
+
+- (id)initWithTerminal:(VT100Terminal *)terminal;
+
+// May be called on any thread. |data| is copied.
+- (void)addData:(NSData *)data;
+
+// The tokenizer can't ask the screen for these, so the main thread keeps it up to date.
+- (void)setTerminalHeight:(int)height useColumnScrollRegion:(BOOL)useColumnScrollRegion;
+
+// Stops delivering anything to the delegate. Main thread only.
+- (void)invalidate;
+
+@end
@@ -0,0 +1,339 @@
+//
+//  VT100ParseQueue.m
+//  iTerm
+//
+
+#import "VT100ParseQueue.h"
+#import "DebugLogging.h"
+#import "ParseWorkerPool.h"
+#import "SPSCQueue.h"
+#import "VT100Terminal.h"
+#include <libkern/OSAtomic.h>
+
+// Chunks of input that may wait to be parsed, and batches that may wait to be applied. Input that
+// doesn't fit is held by the read stage until there's room; reading pauses long before then.
+static const int32_t kInputCapacity = 256;
+static const int32_t kOutputCapacity = 64;
+
+// Reading from the pty is paused when this many chunks are waiting to be parsed or this many
+// tokens have been decoded but not yet applied...
+static const int32_t kMaxUnparsedChunks = 32;
+static const int32_t kMaxUnappliedTokens = 20000;
+// ...and resumes when the later stages catch up to these.
+static const int32_t kResumeUnparsedChunks = 8;
+static const int32_t kResumeUnappliedTokens = 5000;
+
+// A parse job yields its worker after this many chunks so other sessions' jobs get a turn, and so
+// an idle worker can steal the rest.
+static const int kMaxChunksPerParse = 8;
+
+// The apply stage returns to the run loop after this long so a flood of output can't starve
+// drawing and input.
+static const NSTimeInterval kMaxApplyTime = 0.01;
+
+@interface VT100ParseQueue () <ParseWorkerJob>
+@end
+
+@implementation VT100ParseQueue {
+    VT100Terminal *terminal_;
+
+    // Read -> parse. Holds retained NSDatas.
+    SPSCQueue input_;
+    // Parse -> apply. Holds retained VT100TokenBatches, and NSDatas that bypass the parser.
+    SPSCQueue output_;
+
+    // Serializes producers of input_. The parse stage only takes it when there's overflow to move.
+    OSSpinLock producerLock_;
+    NSMutableArray *overflow_;  // Input that didn't fit in input_, oldest first.
+    volatile int32_t overflowCount_;
+
+    // Only accessed by the parse job, which never runs on two workers at once.
+    NSMutableData *partialToken_;  // Bytes at the end of the last chunk that didn't make a token.
+    BOOL passthrough_;  // Set once tmux takes over the stream.
+    id pendingOutput_;  // Parsed, but output_ was full.
+
+    // Set from when the parse job is submitted until its run ends, so it runs serially.
+    volatile int32_t parseScheduled_;
+    // Set while the apply stage has been woken and hasn't started draining yet, so the parser only
+    // wakes it when there might be nothing left for it to do.
+    volatile int32_t applyScheduled_;
+    volatile int32_t parseStalled_;  // The parse stage is waiting for room in output_.
+
+    volatile int32_t unappliedTokens_;
+
+    // Guards readingPaused_ and invalid_ so pauses and resumes reach the delegate in order.
+    OSSpinLock pauseLock_;
+    BOOL readingPaused_;
+
+    // Statistics.
+    volatile int32_t inputStalls_;
+    volatile int32_t parseStalls_;
+    volatile int32_t pauses_;
+
+    volatile int terminalHeight_;
+    volatile BOOL useColumnScrollRegion_;
+    volatile BOOL invalid_;
+}
+
+@synthesize delegate = delegate_;
+
+- (id)initWithTerminal:(VT100Terminal *)terminal {
+    self = [super init];
+    if (self) {
+        terminal_ = [terminal retain];
+        SPSCQueueInit(&input_, kInputCapacity);
+        SPSCQueueInit(&output_, kOutputCapacity);
+        producerLock_ = OS_SPINLOCK_INIT;
+        pauseLock_ = OS_SPINLOCK_INIT;
+        overflow_ = [[NSMutableArray alloc] init];
+        partialToken_ = [[NSMutableData alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    // A submitted job and every dispatched block retain self, so the stages are all idle by now.
+    id item;
+    while ((item = SPSCQueuePop(&input_))) {
+        [item release];
+    }
+    while ((item = SPSCQueuePop(&output_))) {
+        [item release];
+    }
+    SPSCQueueFree(&input_);
+    SPSCQueueFree(&output_);
+    [terminal_ release];
+    [overflow_ release];
+    [partialToken_ release];
+    [pendingOutput_ release];
+    [super dealloc];
+}
+
+- (void)setTerminalHeight:(int)height useColumnScrollRegion:(BOOL)useColumnScrollRegion {
+    terminalHeight_ = height;
+    useColumnScrollRegion_ = useColumnScrollRegion;
+}
+
+- (void)invalidate {
+    OSSpinLockLock(&pauseLock_);
+    invalid_ = YES;
+    delegate_ = nil;
+    OSSpinLockUnlock(&pauseLock_);
+    DLog(@"Parse queue invalidated: %@", self.statistics);
+}
+
+- (NSString *)statistics {
+    return [NSString stringWithFormat:@"input %d/%d chunks (max %d, %d overflowed), "
+                                      @"output %d/%d batches (max %d, parser stalled %d times), "
+                                      @"%d unapplied tokens, reading paused %d times",
+               (int)SPSCQueueDepth(&input_), (int)input_.capacity, (int)input_.maxDepth,
+               (int)inputStalls_,
+               (int)SPSCQueueDepth(&output_), (int)output_.capacity, (int)output_.maxDepth,
+               (int)parseStalls_,
+               (int)unappliedTokens_, (int)pauses_];
+}
+
+#pragma mark - Read stage
+
+- (void)addData:(NSData *)data {
+    NSData *copy = [data copy];
+    OSSpinLockLock(&producerLock_);
+    // Older input that's waiting for room has to go first.
+    [self moveOverflowToInput];
+    if (overflowCount_ || !SPSCQueuePush(&input_, copy)) {
+        [overflow_ addObject:copy];
+        [copy release];
+        OSAtomicIncrement32Barrier(&overflowCount_);
+        OSAtomicIncrement32(&inputStalls_);
+    }
+    OSSpinLockUnlock(&producerLock_);
+
+    [self scheduleParse];
+    [self updateReadingPaused];
+}
+
+// Called with producerLock_ held.
+- (void)moveOverflowToInput {
+    while (overflowCount_) {
+        id data = [overflow_ objectAtIndex:0];
+        if (!SPSCQueuePush(&input_, data)) {
+            return;
+        }
+        [data retain];
+        [overflow_ removeObjectAtIndex:0];
+        OSAtomicDecrement32Barrier(&overflowCount_);
+    }
+}
+
+#pragma mark - Parse stage
+
+- (void)scheduleParse {
+    if (OSAtomicCompareAndSwap32Barrier(0, 1, &parseScheduled_)) {
+        [[ParseWorkerPool sharedInstance] submitJob:self];
+    }
+}
+
+// Runs on a parse worker.
+- (void)runParseWorkerJob {
+    if ([self parse]) {
+        // Go to the back of the line, still scheduled.
+        [[ParseWorkerPool sharedInstance] submitJob:self];
+        return;
+    }
+    const BOOL pending = (pendingOutput_ != nil);
+    OSAtomicCompareAndSwap32Barrier(1, 0, &parseScheduled_);
+    // Input that arrived before the flag was cleared couldn't schedule another run.
+    if (!invalid_ &&
+        (SPSCQueueDepth(&input_) > 0 || overflowCount_ || (pending && !parseStalled_))) {
+        [self scheduleParse];
+    }
+}
+
+// Runs on a parse worker. Returns YES if it stopped to let other jobs run.
+- (BOOL)parse {
+    int numChunks = 0;
+    BOOL yielded = NO;
+    while (!invalid_) {
+        if (pendingOutput_) {
+            if (!SPSCQueuePush(&output_, pendingOutput_)) {
+                // Ask the apply stage to wake this one when it makes room, then check that it
+                // didn't make room in between.
+                OSAtomicCompareAndSwap32Barrier(0, 1, &parseStalled_);
+                if (!SPSCQueuePush(&output_, pendingOutput_)) {
+                    OSAtomicIncrement32(&parseStalls_);
+                    break;
+                }
+                OSAtomicCompareAndSwap32Barrier(1, 0, &parseStalled_);
+            }
+            pendingOutput_ = nil;
+            [self scheduleApply];
+        }
+
+        if (overflowCount_) {
+            OSSpinLockLock(&producerLock_);
+            [self moveOverflowToInput];
+            OSSpinLockUnlock(&producerLock_);
+        }
+        if (numChunks == kMaxChunksPerParse) {
+            yielded = (SPSCQueueDepth(&input_) > 0);
+            break;
+        }
+        NSData *data = SPSCQueuePop(&input_);
+        if (!data) {
+            break;
+        }
+        pendingOutput_ = [self newOutputForData:data];
+        [data release];
+        numChunks++;
+    }
+    [self updateReadingPaused];
+    return yielded;
+}
+
+// Runs on a parse worker. Returns a retained batch or NSData for the apply stage, or nil if
+// |data| only held the start of a token.
+- (id)newOutputForData:(NSData *)data {
+    if (passthrough_) {
+        return [data retain];
+    }
+
+    NSData *input = data;
+    if ([partialToken_ length]) {
+        [partialToken_ appendData:data];
+        input = [[partialToken_ copy] autorelease];
+        [partialToken_ setLength:0];
+    }
+
+    VT100TokenBatch *batch = [terminal_ tokenBatchFromData:input
+                                            terminalHeight:terminalHeight_
+                                     useColumnScrollRegion:useColumnScrollRegion_];
+    int consumed = batch.numberOfBytesConsumed;
+    if (consumed < [input length]) {
+        [partialToken_ appendBytes:(const char *)[input bytes] + consumed
+                            length:[input length] - consumed];
+    }
+    if (batch.unparsedData) {
+        DLog(@"Parse queue switching to passthrough for tmux");
+        passthrough_ = YES;
+    }
+    if (batch.numberOfTokens == 0 && !batch.unparsedData) {
+        return nil;
+    }
+    OSAtomicAdd32Barrier(batch.numberOfTokens, &unappliedTokens_);
+    return [batch retain];
+}
+
+#pragma mark - Apply stage
+
+- (void)scheduleApply {
+    if (!OSAtomicCompareAndSwap32Barrier(0, 1, &applyScheduled_)) {
+        return;
+    }
+    [self retain];
+    dispatch_async(dispatch_get_main_queue(), ^{
+        [self apply];
+        [self release];
+    });
+}
+
+// Runs on the main thread.
+- (void)apply {
+    OSAtomicCompareAndSwap32Barrier(1, 0, &applyScheduled_);
+    const NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    id item;
+    while ((item = SPSCQueuePop(&output_))) {
+        if (OSAtomicCompareAndSwap32Barrier(1, 0, &parseStalled_)) {
+            // There's room now, so let the parser work on the next batch while this one applies.
+            [self scheduleParse];
+        }
+        const BOOL isBatch = [item isKindOfClass:[VT100TokenBatch class]];
+        if (!invalid_) {
+            if (isBatch) {
+                [delegate_ parseQueue:self didProduceTokenBatch:item];
+            } else {
+                [delegate_ parseQueue:self didReceiveUnparsedData:item];
+            }
+        }
+        if (isBatch) {
+            OSAtomicAdd32Barrier(-[(VT100TokenBatch *)item numberOfTokens], &unappliedTokens_);
+        }
+        [item release];
+        [self updateReadingPaused];
+
+        if ([NSDate timeIntervalSinceReferenceDate] - start > kMaxApplyTime) {
+            [self scheduleApply];
+            break;
+        }
+    }
+}
+
+#pragma mark - Backpressure
+
+// Called by each stage after it changes how much is waiting. The levels are read with the lock
+// held, so whichever stage updates last decides, and reading can't be left paused with nothing
+// waiting.
+- (void)updateReadingPaused {
+    OSSpinLockLock(&pauseLock_);
+    const int32_t chunks = SPSCQueueDepth(&input_) + overflowCount_;
+    const int32_t tokens = unappliedTokens_;
+    BOOL paused = readingPaused_;
+    if (!paused && (chunks >= kMaxUnparsedChunks || tokens > kMaxUnappliedTokens)) {
+        paused = YES;
+    } else if (paused && chunks <= kResumeUnparsedChunks && tokens < kResumeUnappliedTokens) {
+        paused = NO;
+    }
+    const BOOL changed = (paused != readingPaused_ && !invalid_);
+    if (changed) {
+        readingPaused_ = paused;
+        if (paused) {
+            OSAtomicIncrement32(&pauses_);
+        }
+        [delegate_ parseQueue:self setReadingPaused:paused];
+    }
+    OSSpinLockUnlock(&pauseLock_);
+    if (changed) {
+        DLog(@"Parse queue %@ reads: %@", paused ? @"pausing" : @"resuming", self.statistics);
+    }
+}
+
+@end
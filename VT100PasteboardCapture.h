@@ -0,0 +1,59 @@
+//
+//  VT100PasteboardCapture.h
+//  iTerm
+//
+//  Collects a clipboard payload straight out of the input stream, without tokenizing it.
+//
+
+#import <Foundation/Foundation.h>
+
+@class Base64StreamDecoder;
+
+typedef enum {
+    // The base64 payload of an OSC 52, ended by BEL or ST. It's decoded as it arrives.
+    kVT100PasteboardCaptureBase64,
+
+    // Everything between OSC 50 ; CopyToClipboard and OSC 50 ; EndCopy, byte for byte. The EndCopy
+    // sequence itself is left in the stream to be parsed as usual.
+    kVT100PasteboardCaptureRaw
+} VT100PasteboardCaptureType;
+
+// A program copying megabytes to the clipboard would otherwise send them through the parser a
+// token at a time, or (for OSC 52) have the whole unfinished sequence rescanned on every read.
+// Past |maximumLength| bytes of output the rest is counted and dropped. Not thread safe; the
+// terminal's tokenizer owns it.
+@interface VT100PasteboardCapture : NSObject {
+    VT100PasteboardCaptureType type_;
+    Base64StreamDecoder *decoder_;
+    NSMutableData *data_;
+    NSUInteger maximumLength_;
+    long long bytesDropped_;
+    BOOL invalid_;
+    BOOL finished_;
+    BOOL canceled_;
+}
+
+@property(nonatomic, readonly) VT100PasteboardCaptureType type;
+
+// The payload so far, decoded. Complete once |finished| is set.
+@property(nonatomic, readonly) NSMutableData *data;
+
+// Bytes that didn't fit.
+@property(nonatomic, readonly) long long bytesDropped;
+
+// Set when the end of the payload has been consumed.
+@property(nonatomic, readonly) BOOL finished;
+
+// Set if the sequence was cancelled (by CAN, SUB, or an ESC that doesn't start ST) or its base64
+// was malformed. The payload should be discarded.
+@property(nonatomic, readonly) BOOL canceled;
+
+- (id)initWithType:(VT100PasteboardCaptureType)type maximumLength:(NSUInteger)maximumLength;
+
+// Consumes payload from the start of |bytes| and returns how many bytes it took. That is fewer
+// than |length| if the end of the payload was found (when |finished| or |canceled| gets set, and
+// what follows belongs to the parser) or if the last few bytes might be the start of the
+// terminator; those must be passed in again with more after them.
+- (int)consumeBytes:(const unsigned char *)bytes length:(int)length;
+
+@end
@@ -0,0 +1,170 @@
+//
+//  VT100PasteboardCapture.m
+//  iTerm
+//
+
+#import "VT100PasteboardCapture.h"
+#import "Base64StreamDecoder.h"
+
+enum {
+    kCaptureBEL = 7,
+    kCaptureCAN = 24,
+    kCaptureSUB = 26,
+    kCaptureESC = 27
+};
+
+// Ends a raw capture when followed by BEL, ESC (of ST), or the = of an argument.
+static const char kEndCopyPrefix[] = "\033]50;EndCopy";
+
+@implementation VT100PasteboardCapture
+
+@synthesize type = type_;
+@synthesize data = data_;
+@synthesize bytesDropped = bytesDropped_;
+@synthesize finished = finished_;
+@synthesize canceled = canceled_;
+
+- (id)initWithType:(VT100PasteboardCaptureType)type maximumLength:(NSUInteger)maximumLength
+{
+    self = [super init];
+    if (self) {
+        type_ = type;
+        maximumLength_ = maximumLength;
+        data_ = [[NSMutableData alloc] init];
+        if (type == kVT100PasteboardCaptureBase64) {
+            decoder_ = [[Base64StreamDecoder alloc] init];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [decoder_ release];
+    [data_ release];
+    [super dealloc];
+}
+
+- (int)consumeBytes:(const unsigned char *)bytes length:(int)length
+{
+    if (finished_ || canceled_) {
+        return 0;
+    }
+    if (type_ == kVT100PasteboardCaptureBase64) {
+        return [self consumeBase64:bytes length:length];
+    } else {
+        return [self consumeRaw:bytes length:length];
+    }
+}
+
+#pragma mark - Private
+
+- (void)appendDecodedChars:(const unsigned char *)chars length:(int)length
+{
+    if (length == 0 || invalid_) {
+        return;
+    }
+    if (![decoder_ decodeChars:(const char *)chars length:length intoData:data_]) {
+        invalid_ = YES;
+    }
+    [self dropExcess];
+}
+
+- (void)appendBytes:(const unsigned char *)bytes length:(int)length
+{
+    const NSUInteger room = maximumLength_ - MIN(maximumLength_, [data_ length]);
+    const NSUInteger n = MIN(room, (NSUInteger)length);
+    [data_ appendBytes:bytes length:n];
+    bytesDropped_ += length - n;
+}
+
+- (void)dropExcess
+{
+    if ([data_ length] > maximumLength_) {
+        bytesDropped_ += [data_ length] - maximumLength_;
+        [data_ setLength:maximumLength_];
+    }
+}
+
+- (int)consumeBase64:(const unsigned char *)bytes length:(int)length
+{
+    int i;
+    for (i = 0; i < length; i++) {
+        const unsigned char c = bytes[i];
+        if (c == kCaptureBEL || c == kCaptureESC || c == kCaptureCAN || c == kCaptureSUB) {
+            break;
+        }
+    }
+    [self appendDecodedChars:bytes length:i];
+    if (i == length) {
+        return length;
+    }
+
+    switch (bytes[i]) {
+        case kCaptureBEL:
+            [self finish];
+            return i + 1;
+
+        case kCaptureESC:
+            if (i + 1 == length) {
+                // Wait to see if it's ST.
+                return i;
+            }
+            if (bytes[i + 1] == '\\') {
+                [self finish];
+                return i + 2;
+            }
+            // Some other sequence interrupts this one; it's left for the parser.
+            canceled_ = YES;
+            return i;
+
+        default:
+            // CAN and SUB abort the sequence and are themselves discarded.
+            canceled_ = YES;
+            return i + 1;
+    }
+}
+
+- (void)finish
+{
+    if (invalid_ || ![decoder_ finishIntoData:data_]) {
+        canceled_ = YES;
+        return;
+    }
+    [self dropExcess];
+    finished_ = YES;
+}
+
+- (int)consumeRaw:(const unsigned char *)bytes length:(int)length
+{
+    const int prefixLength = sizeof(kEndCopyPrefix) - 1;
+    const unsigned char *end = bytes + length;
+    const unsigned char *p = bytes;
+    while (p < end) {
+        const unsigned char *esc = memchr(p, kCaptureESC, end - p);
+        if (!esc) {
+            p = end;
+            break;
+        }
+        const int available = (int)(end - esc);
+        if (available <= prefixLength) {
+            if (!memcmp(esc, kEndCopyPrefix, available)) {
+                // Could be the start of EndCopy. Leave it until the rest arrives.
+                p = esc;
+                break;
+            }
+        } else if (!memcmp(esc, kEndCopyPrefix, prefixLength)) {
+            const unsigned char next = esc[prefixLength];
+            if (next == kCaptureBEL || next == kCaptureESC || next == '=') {
+                [self appendBytes:bytes length:(int)(esc - bytes)];
+                finished_ = YES;
+                return (int)(esc - bytes);
+            }
+        }
+        p = esc + 1;
+    }
+    [self appendBytes:bytes length:(int)(p - bytes)];
+    return (int)(p - bytes);
+}
+
+@end
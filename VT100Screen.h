@@ -2,19 +2,26 @@
 #import "PTYNoteViewController.h"
 #import "PTYTextViewDataSource.h"
 #import "SCPPath.h"
+#import "ScrollbackBudget.h"
 #import "VT100ScreenDelegate.h"
 #import "VT100Terminal.h"
 
+@class AutocompleteIndex;
 @class DVR;
 @class iTermGrowlDelegate;
 @class LineBuffer;
+@class LineBufferArchive;
+@class LineObjectIndex;
 @class IntervalTree;
+@class MemoryReport;
 @class PTYTask;
 @class VT100Grid;
 @class VT100RemoteHost;
 @class VT100ScreenMark;
 @class VT100Terminal;
 
+@class ScreenCharStringCache;
+
 // Dictionary keys for -highlightTextMatchingRegex:
 extern NSString * const kHighlightForegroundColor;
 extern NSString * const kHighlightBackgroundColor;
@@ -24,6 +31,7 @@ extern int kVT100ScreenMinRows;
 @interface VT100Screen : NSObject <
     PTYNoteViewControllerDelegate,
     PTYTextViewDataSource,
+    ScrollbackBudgetClient,
     VT100TerminalDelegate>
 {
     NSMutableSet* tabStops_;
@@ -66,6 +74,14 @@ extern int kVT100ScreenMinRows;
     // Scrollback buffer
     LineBuffer* linebuffer_;
 
+    // If set, the scrollback is saved here as it fills up so it can be restored after a restart.
+    LineBufferArchive *scrollbackArchive_;
+    BOOL scrollbackArchiveFlushed_;  // Closed and complete, so keep the file.
+
+    // Words of the scrollback for autocomplete, or nil if the AutocompleteIndexesScrollback user
+    // default is off.
+    AutocompleteIndex *autocompleteIndex_;
+
     // Current find context.
     FindContext *findContext_;
 
@@ -74,6 +90,19 @@ extern int kVT100ScreenMinRows;
 
     // Used for recording instant replay.
     DVR* dvr_;
+
+    // Chars changed since the last DVR frame, one range per line. Changes pile up here while frames
+    // are throttled. The ranges refer to a grid of dvrPendingWidth_ x dvrPendingHeight_.
+    NSRange *dvrPendingRanges_;
+    int dvrPendingWidth_;
+    int dvrPendingHeight_;
+    BOOL dvrHasPendingChanges_;
+    NSTimeInterval lastDvrFrameTime_;
+
+    // Where the cursor was in the last DVR frame. Moving it doesn't dirty any chars but still
+    // needs a frame.
+    VT100GridCoord dvrCursor_;
+    double maxDvrFramesPerSecond_;
     BOOL saveToScrollbackInAlternateScreen_;
 
     // OK to report window title?
@@ -89,7 +118,35 @@ extern int kVT100ScreenMinRows;
     IntervalTree *intervalTree_;
 
     NSMutableSet *markCache_;  // Maps an absolute line number to a VT100ScreenMark.
+
+    // The VT100WorkingDirectory and VT100RemoteHost objects in intervalTree_ by absolute line, so
+    // finding the one before a line doesn't enumerate the tree. Rebuilt with markCache_.
+    LineObjectIndex *workingDirectoryIndex_;
+    LineObjectIndex *remoteHostIndex_;
     VT100GridCoordRange markCacheRange_;
+
+    // The note ranges and marks on the lines last drawn, so redrawing them doesn't search the
+    // interval tree again. They're found again when the tree changes or other lines are drawn.
+    NSArray *cachedNoteRanges_;
+    NSIndexSet *cachedMarkLines_;  // Offsets from the first line
+    long long cachedAnnotationsFirstLine_;  // Absolute
+    int cachedAnnotationsNumLines_;
+    int cachedAnnotationsWidth_;
+    long long cachedAnnotationsGeneration_;
+
+    // Counts the times the contents were changed and then drawn. See -contentGeneration.
+    long long contentGeneration_;
+
+    // For each regex and colors given to -highlightTextMatchingRegex:colors:, the signatures of the
+    // wrapped lines after they were last highlighted, so unchanged lines aren't searched again.
+    NSMutableDictionary *highlightSignatures_;
+    // Strings of the lines searched for highlighting, shared by all the regexes.
+    ScreenCharStringCache *highlightStringCache_;
+
+    // The line being fast-forwarded (see -terminalFastForwardAsciiBytes:length:).
+    screen_char_t *fastForwardLine_;
+    int fastForwardLineLength_;
+    int fastForwardLineCapacity_;
 }
 
 @property(nonatomic, retain) VT100Terminal *terminal;
@@ -105,6 +162,9 @@ extern int kVT100ScreenMinRows;
 @property(nonatomic, assign) BOOL useColumnScrollRegion;
 @property(nonatomic, assign) BOOL saveToScrollbackInAlternateScreen;
 @property(nonatomic, retain) DVR *dvr;
+// saveToDvr records at most this many frames per second. 0 means no limit. Defaults to the
+// InstantReplayMaxFramesPerSecond user default, or 30.
+@property(nonatomic, assign) double maxDvrFramesPerSecond;
 @property(nonatomic, readonly) VT100GridCoord savedCursor;
 
 // Designated initializer.
@@ -136,6 +196,9 @@ extern int kVT100ScreenMinRows;
 // buffer may change.
 - (void)appendStringAtCursor:(NSString *)s ascii:(BOOL)ascii;
 
+// Like appendStringAtCursor:ascii: for |length| printable ASCII chars.
+- (void)appendAsciiBytesAtCursor:(const unsigned char *)bytes length:(int)length;
+
 // This is a hacky thing that moves the cursor to the next line, not respecting scroll regions.
 // It's used for the tmux status screen.
 - (void)crlf;
@@ -147,6 +210,14 @@ extern int kVT100ScreenMinRows;
 // containing screen_char_t's. It contains a bizarre workaround for tmux bugs.
 - (void)setHistory:(NSArray *)history;
 
+// Like setHistory:, but takes the lines of history in a LineBuffer, which is left unchanged.
+- (void)setHistoryFromLineBuffer:(LineBuffer *)history;
+
+// Puts the lines of |history| above the scrollback, leaving the screen alone. Used to fill in a
+// tmux pane's older history after its screen is already showing. Marks and notes stay on their
+// lines.
+- (void)prependHistoryFromLineBuffer:(LineBuffer *)history;
+
 // Sets the alt grid's contents. |lines| is NSData with screen_char_t's.
 - (void)setAltScreen:(NSArray *)lines;
 
@@ -158,6 +229,28 @@ extern int kVT100ScreenMinRows;
 - (void)highlightTextMatchingRegex:(NSString *)regex
                             colors:(NSDictionary *)colors;
 
+// Keeps an archive of the scrollback at |path| that's updated in the background as the scrollback
+// grows. Returns NO if the file can't be created.
+- (BOOL)startArchivingScrollbackToFile:(NSString *)path;
+
+// The path of the scrollback archive, or nil if there isn't one.
+- (NSString *)scrollbackArchivePath;
+
+// Index of the words that have scrolled into the scrollback, or nil if it's disabled.
+- (AutocompleteIndex *)autocompleteIndex;
+
+// Writes what the archive is missing (the last lines of scrollback, the screen, and the marks and
+// notes) and closes it, leaving the file for -restoreScrollbackFromArchiveAtPath:. The path is
+// still reported by -scrollbackArchivePath.
+- (void)flushScrollbackArchive;
+
+// Stops archiving and deletes the archive unless it was flushed.
+- (void)discardScrollbackArchive;
+
+// Loads the scrollback and marks from an archive. The archived screen's lines become the last lines
+// of scrollback. Chars are read from the file lazily. Returns NO if nothing could be restored.
+- (BOOL)restoreScrollbackFromArchiveAtPath:(NSString *)path;
+
 // Load a frame from a dvr decoder.
 - (void)setFromFrame:(screen_char_t*)s len:(int)len info:(DVRFrameInfo)info;
 
@@ -168,6 +261,28 @@ extern int kVT100ScreenMinRows;
 // storeLastPositionInLineBufferAsFindContextSavedPosition).
 - (void)restoreSavedPositionToFindContext:(FindContext *)context;
 
+// Searches the scrollback from the saved position to the end of the screen for the query that
+// |context| was prepared with, adding results to |results|, and then saves the end of the scrollback
+// as the place to start next time. |context| must have been positioned with
+// restoreSavedPositionToFindContext:. It is kept prepared so later calls only search output added
+// since. Returns YES if context.maxTime passed first, in which case the next call continues.
+- (BOOL)continueTailFindResults:(NSMutableArray *)results inContext:(FindContext *)context;
+
+// Adds the memory held by the scrollback, the grids, the instant replay buffer and the marks and
+// notes to the current section of |report|.
+- (void)addToMemoryReport:(MemoryReport *)report;
+
+// A number that changes whenever the screen or scrollback does, so a caller that polls the
+// contents can skip a session that hasn't changed since its last look. It's cheap: the dirty bits
+// are checked but no text is read.
+- (long long)contentGeneration;
+
+// The text of the wrapped lines numbered |first| through |last|, counting from the first line ever
+// added to scrollback like -totalScrollbackOverflow, clamped to the lines that still exist. Soft
+// wrapped lines are joined and hard line breaks become newlines. Lines are read from the line
+// buffer and grid directly, so the cost is proportional to the range, not the scrollback.
+- (NSString *)contentsOfAbsoluteLinesFrom:(long long)first to:(long long)last;
+
 - (NSString *)compactLineDump;
 - (NSString *)compactLineDumpWithHistory;
 - (NSString *)compactLineDumpWithHistoryAndContinuationMarks;
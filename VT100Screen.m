@@ -1,13 +1,21 @@
 #import "VT100Screen.h"
 
+#import "AutocompleteIndex.h"
 #import "DebugLogging.h"
 #import "DVR.h"
 #import "IntervalTree.h"
+#import "LineBufferArchive.h"
+#import "LineBufferSearch.h"
+#import "LineObjectIndex.h"
+#import "MemoryReport.h"
 #import "NSArray+iTerm.h"
 #import "PTYNoteViewController.h"
 #import "PTYTextView.h"
+#import "PowerManager.h"
 #import "RegexKitLite.h"
+#import "ScreenCharStringCache.h"
 #import "SearchResult.h"
+#import "Signposts.h"
 #import "TmuxStateParser.h"
 #import "VT100RemoteHost.h"
 #import "VT100ScreenMark.h"
@@ -32,6 +40,43 @@ NSString * const kHighlightBackgroundColor = @"kHighlightBackgroundColor";
 // Wait this long between calls to NSBeep().
 static const double kInterBellQuietPeriod = 0.1;
 
+// Lines whose strings are kept for highlighting. Only lines that changed are searched, so this
+// needs to hold about as many as change between evaluations.
+static const int kHighlightStringCacheSize = 32;
+
+// Most regex and color combinations whose highlighted lines are remembered. When there are more,
+// they're all forgotten, which just means every line gets searched again.
+static const int kMaxHighlightSignatureSets = 64;
+
+// Keys for marks and notes in a scrollback archive. Positions are LineBuffer absolute positions.
+static NSString *const kArchivedMarkClass = @"Class";
+static NSString *const kArchivedMarkStart = @"Start";
+static NSString *const kArchivedMarkStartYOffset = @"Start Y Offset";
+static NSString *const kArchivedMarkEnd = @"End";
+static NSString *const kArchivedMarkEndYOffset = @"End Y Offset";
+static NSString *const kArchivedMarkEndExtends = @"End Extends";
+static NSString *const kArchivedMarkString = @"String";
+static NSString *const kArchivedMarkHostname = @"Hostname";
+static NSString *const kArchivedMarkUsername = @"Username";
+
+// Values of kArchivedMarkClass.
+static NSString *const kArchivedMarkClassMark = @"Mark";
+static NSString *const kArchivedMarkClassNote = @"Note";
+static NSString *const kArchivedMarkClassWorkingDirectory = @"Working Directory";
+static NSString *const kArchivedMarkClassRemoteHost = @"Remote Host";
+
+// Returns a new line buffer for scrollback. The ScrollbackResidentBudgetMB user default limits how
+// much of it is kept uncompressed, and with ScrollbackSpillsToDisk the rest goes to a scratch file.
+static LineBuffer *NewScrollbackLineBuffer(void) {
+    LineBuffer *lineBuffer = [[LineBuffer alloc] init];
+    NSUserDefaults *userDefaults = [NSUserDefaults standardUserDefaults];
+    NSInteger megabytes = [userDefaults integerForKey:@"ScrollbackResidentBudgetMB"];
+    [lineBuffer setResidentBudget:MAX(0, megabytes) * 1024LL * 1024LL];
+    [lineBuffer setSpillsToDisk:[userDefaults boolForKey:@"ScrollbackSpillsToDisk"]];
+    [lineBuffer setUsesNgramIndex:[userDefaults boolForKey:@"ScrollbackNgramIndex"]];
+    return lineBuffer;
+}
+
 @implementation VT100Screen
 
 @synthesize terminal = terminal_;
@@ -45,6 +90,7 @@ static const double kInterBellQuietPeriod = 0.1;
 @synthesize unlimitedScrollback = unlimitedScrollback_;
 @synthesize saveToScrollbackInAlternateScreen = saveToScrollbackInAlternateScreen_;
 @synthesize dvr = dvr_;
+@synthesize maxDvrFramesPerSecond = maxDvrFramesPerSecond_;
 @synthesize delegate = delegate_;
 @synthesize savedCursor = savedCursor_;
 
@@ -62,12 +108,24 @@ static const double kInterBellQuietPeriod = 0.1;
         maxScrollbackLines_ = kDefaultMaxScrollbackLines;
         tabStops_ = [[NSMutableSet alloc] init];
         [self setInitialTabStops];
-        linebuffer_ = [[LineBuffer alloc] init];
+        linebuffer_ = NewScrollbackLineBuffer();
+        NSUserDefaults *userDefaults = [NSUserDefaults standardUserDefaults];
+        if (![userDefaults objectForKey:@"AutocompleteIndexesScrollback"] ||
+            [userDefaults boolForKey:@"AutocompleteIndexesScrollback"]) {
+            autocompleteIndex_ = [[AutocompleteIndex alloc] initWithWordChars:[[PreferencePanel sharedInstance] wordChars]];
+            [linebuffer_ setAutocompleteIndex:autocompleteIndex_];
+        }
 
         [iTermGrowlDelegate sharedInstance];
+        [[ScrollbackBudget sharedInstance] addClient:self];
 
         dvr_ = [DVR alloc];
         [dvr_ initWithBufferCapacity:[[PreferencePanel sharedInstance] irMemory] * 1024 * 1024];
+        maxDvrFramesPerSecond_ =
+            [[NSUserDefaults standardUserDefaults] doubleForKey:@"InstantReplayMaxFramesPerSecond"];
+        if (maxDvrFramesPerSecond_ <= 0) {
+            maxDvrFramesPerSecond_ = 30;
+        }
 
         charsetUsesLineDrawingMode_ = [[NSMutableArray alloc] init];
         savedCharsetUsesLineDrawingMode_ = [[NSMutableArray alloc] init];
@@ -80,23 +138,39 @@ static const double kInterBellQuietPeriod = 0.1;
         savedIntervalTree_ = [[IntervalTree alloc] init];
         intervalTree_ = [[IntervalTree alloc] init];
         markCache_ = [[NSMutableSet alloc] init];
+        workingDirectoryIndex_ = [[LineObjectIndex alloc] init];
+        remoteHostIndex_ = [[LineObjectIndex alloc] init];
+        highlightSignatures_ = [[NSMutableDictionary alloc] init];
+        highlightStringCache_ = [[ScreenCharStringCache alloc] initWithCapacity:kHighlightStringCacheSize];
+        highlightStringCache_.comparesTextOnly = YES;
     }
     return self;
 }
 
 - (void)dealloc
 {
+    [[ScrollbackBudget sharedInstance] removeClient:self];
     [primaryGrid_ release];
     [altGrid_ release];
     [tabStops_ release];
     [printBuffer_ release];
     [linebuffer_ release];
+    [scrollbackArchive_ release];
+    [autocompleteIndex_ release];
     [dvr_ release];
+    free(dvrPendingRanges_);
     [terminal_ release];
     [charsetUsesLineDrawingMode_ release];
     [findContext_ release];
     [intervalTree_ release];
     [markCache_ release];
+    [workingDirectoryIndex_ release];
+    [remoteHostIndex_ release];
+    [cachedNoteRanges_ release];
+    [cachedMarkLines_ release];
+    [highlightSignatures_ release];
+    [highlightStringCache_ release];
+    free(fastForwardLine_);
     [super dealloc];
 }
 
@@ -636,14 +710,36 @@ static const double kInterBellQuietPeriod = 0.1;
 - (void)reloadMarkCache {
     long long totalScrollbackOverflow = [self totalScrollbackOverflow];
     [markCache_ removeAllObjects];
+    [workingDirectoryIndex_ removeAllObjects];
+    [remoteHostIndex_ removeAllObjects];
+    [self invalidateAnnotationCache];
     for (id<IntervalTreeObject> obj in [intervalTree_ allObjects]) {
         if ([obj isKindOfClass:[VT100ScreenMark class]]) {
             VT100GridCoordRange range = [self coordRangeForInterval:obj.entry.interval];
             [markCache_ addObject:@(totalScrollbackOverflow + range.end.y)];
+        } else {
+            [[self lineObjectIndexForObject:obj] addObject:obj onLine:[self indexedLineOfObject:obj]];
         }
     }
 }
 
+// The index that keeps objects of |obj|'s class, or nil if they aren't indexed.
+- (LineObjectIndex *)lineObjectIndexForObject:(id<IntervalTreeObject>)obj {
+    if ([obj isKindOfClass:[VT100WorkingDirectory class]]) {
+        return workingDirectoryIndex_;
+    } else if ([obj isKindOfClass:[VT100RemoteHost class]]) {
+        return remoteHostIndex_;
+    } else {
+        return nil;
+    }
+}
+
+// The absolute line holding the limit of |obj|'s interval. An object is before line L in the
+// index exactly when its limit is before the start of L in the tree.
+- (long long)indexedLineOfObject:(id<IntervalTreeObject>)obj {
+    return obj.entry.interval.limit / (self.width + 1);
+}
+
 - (BOOL)allCharacterSetPropertiesHaveDefaultValues {
     for (int i = 0; i < NUM_CHARSETS; i++) {
         if ([[charsetUsesLineDrawingMode_ objectAtIndex:i] boolValue]) {
@@ -683,8 +779,13 @@ static const double kInterBellQuietPeriod = 0.1;
 - (void)clearScrollbackBuffer
 {
     [linebuffer_ release];
-    linebuffer_ = [[LineBuffer alloc] init];
+    linebuffer_ = NewScrollbackLineBuffer();
     [linebuffer_ setMaxLines:maxScrollbackLines_];
+    [linebuffer_ setAutocompleteIndex:autocompleteIndex_];
+    [autocompleteIndex_ removeAllWords];
+    if (!scrollbackArchiveFlushed_) {
+        [linebuffer_ setArchive:scrollbackArchive_];
+    }
     [delegate_ screenClearHighlights];
     [currentGrid_ markAllCharsDirty:YES];
 
@@ -712,117 +813,83 @@ static const double kInterBellQuietPeriod = 0.1;
         return;
     }
 
+    if (ascii) {
+        // Only Unicode code points 0 through 127 occur in the string, so its
+        // bytes are its chars.
+        const char *sc = CFStringGetCStringPtr((CFStringRef)string, kCFStringEncodingUTF8);
+        if (sc) {
+            [self appendAsciiBytesAtCursor:(const unsigned char *)sc length:len];
+        } else {
+            NSData *data = [string dataUsingEncoding:NSASCIIStringEncoding];
+            [self appendAsciiBytesAtCursor:[data bytes] length:[data length]];
+        }
+        return;
+    }
+
     // Allocate a buffer of screen_char_t and place the new string in it.
     const int kStaticBufferElements = 1024;
     screen_char_t staticBuffer[kStaticBufferElements];
     screen_char_t *dynamicBuffer = 0;
     screen_char_t *buffer;
-    if (ascii) {
-        // Only Unicode code points 0 through 127 occur in the string.
-        const int kStaticTempElements = kStaticBufferElements;
-        unichar staticTemp[kStaticTempElements];
-        unichar* dynamicTemp = 0;
-        unichar *sc;
-        if ([string length] > kStaticTempElements) {
-            dynamicTemp = sc = (unichar *) calloc(len, sizeof(unichar));
-            assert(dynamicTemp);
-        } else {
-            sc = staticTemp;
-        }
-        assert(terminal_);
-        screen_char_t fg = [terminal_ foregroundColorCode];
-        screen_char_t bg = [terminal_ backgroundColorCode];
-
-        if ([string length] > kStaticBufferElements) {
-            buffer = dynamicBuffer = (screen_char_t *) calloc([string length],
-                                                              sizeof(screen_char_t));
-            assert(dynamicBuffer);
-            if (!buffer) {
-                NSLog(@"%s: Out of memory", __PRETTY_FUNCTION__);
-                return;
-            }
-        } else {
-            buffer = staticBuffer;
-        }
-
-        [string getCharacters:sc];
-        for (int i = 0; i < len; i++) {
-            buffer[i].code = sc[i];
-            buffer[i].complexChar = NO;
-            CopyForegroundColor(&buffer[i], fg);
-            CopyBackgroundColor(&buffer[i], bg);
-            buffer[i].unused = 0;
-        }
-
-        // If a graphics character set was selected then translate buffer
-        // characters into graphics charaters.
-        if ([[charsetUsesLineDrawingMode_ objectAtIndex:[terminal_ charset]] boolValue]) {
-            ConvertCharsToGraphicsCharset(buffer, len);
-        }
-        if (dynamicTemp) {
-            free(dynamicTemp);
+    string = [string precomposedStringWithCanonicalMapping];
+    len = [string length];
+    if (2 * len > kStaticBufferElements) {
+        buffer = dynamicBuffer = (screen_char_t *) calloc(2 * len,
+                                                          sizeof(screen_char_t));
+        assert(buffer);
+        if (!buffer) {
+            NSLog(@"%s: Out of memory", __PRETTY_FUNCTION__);
+            return;
         }
     } else {
-        string = [string precomposedStringWithCanonicalMapping];
-        len = [string length];
-        if (2 * len > kStaticBufferElements) {
-            buffer = dynamicBuffer = (screen_char_t *) calloc(2 * len,
-                                                              sizeof(screen_char_t));
-            assert(buffer);
-            if (!buffer) {
-                NSLog(@"%s: Out of memory", __PRETTY_FUNCTION__);
-                return;
-            }
-        } else {
-            buffer = staticBuffer;
-        }
-
-        // Pick off leading combining marks and low surrogates and modify the
-        // character at the cursor position with them.
-        unichar firstChar = [string characterAtIndex:0];
-        while ([string length] > 0 &&
-               (IsCombiningMark(firstChar) || IsLowSurrogate(firstChar))) {
-            VT100GridCoord pred = [currentGrid_ coordinateBefore:currentGrid_.cursor];
-            if (pred.x < 0 ||
-                ![currentGrid_ addCombiningChar:firstChar toCoord:pred]) {
-                // Combining mark will need to stand alone rather than combine
-                // because nothing precedes it.
-                if (IsCombiningMark(firstChar)) {
-                    // Prepend a space to it so the combining mark has something
-                    // to combine with.
-                    string = [NSString stringWithFormat:@" %@", string];
-                } else {
-                    // Got a low surrogate but can't find the matching high
-                    // surrogate. Turn the low surrogate into a replacement
-                    // char. This should never happen because decode_string
-                    // ought to detect the broken unicode and substitute a
-                    // replacement char.
-                    string = [NSString stringWithFormat:@"%@%@",
-                              ReplacementString(),
-                              [string substringFromIndex:1]];
-                }
-                len = [string length];
-                break;
-            }
-            string = [string substringFromIndex:1];
-            if ([string length] > 0) {
-                firstChar = [string characterAtIndex:0];
+        buffer = staticBuffer;
+    }
+
+    // Pick off leading combining marks and low surrogates and modify the
+    // character at the cursor position with them.
+    unichar firstChar = [string characterAtIndex:0];
+    while ([string length] > 0 &&
+           (IsCombiningMark(firstChar) || IsLowSurrogate(firstChar))) {
+        VT100GridCoord pred = [currentGrid_ coordinateBefore:currentGrid_.cursor];
+        if (pred.x < 0 ||
+            ![currentGrid_ addCombiningChar:firstChar toCoord:pred]) {
+            // Combining mark will need to stand alone rather than combine
+            // because nothing precedes it.
+            if (IsCombiningMark(firstChar)) {
+                // Prepend a space to it so the combining mark has something
+                // to combine with.
+                string = [NSString stringWithFormat:@" %@", string];
+            } else {
+                // Got a low surrogate but can't find the matching high
+                // surrogate. Turn the low surrogate into a replacement
+                // char. This should never happen because decode_string
+                // ought to detect the broken unicode and substitute a
+                // replacement char.
+                string = [NSString stringWithFormat:@"%@%@",
+                          ReplacementString(),
+                          [string substringFromIndex:1]];
             }
+            len = [string length];
+            break;
+        }
+        string = [string substringFromIndex:1];
+        if ([string length] > 0) {
+            firstChar = [string characterAtIndex:0];
         }
-
-        assert(terminal_);
-        // Add DWC_RIGHT after each double-byte character, build complex characters out of surrogates
-        // and combining marks, replace private codes with replacement characters, swallow zero-
-        // width spaces, and set fg/bg colors and attributes.
-        StringToScreenChars(string,
-                            buffer,
-                            [terminal_ foregroundColorCode],
-                            [terminal_ backgroundColorCode],
-                            &len,
-                            [delegate_ screenShouldTreatAmbiguousCharsAsDoubleWidth],
-                            NULL);
     }
 
+    assert(terminal_);
+    // Add DWC_RIGHT after each double-byte character, build complex characters out of surrogates
+    // and combining marks, replace private codes with replacement characters, swallow zero-
+    // width spaces, and set fg/bg colors and attributes.
+    StringToScreenChars(string,
+                        buffer,
+                        [terminal_ foregroundColorCode],
+                        [terminal_ backgroundColorCode],
+                        &len,
+                        [delegate_ screenShouldTreatAmbiguousCharsAsDoubleWidth],
+                        NULL);
+
     if (len < 1) {
         // The string is empty so do nothing.
         if (dynamicBuffer) {
@@ -843,6 +910,51 @@ static const double kInterBellQuietPeriod = 0.1;
     }
 }
 
+- (void)appendAsciiBytesAtCursor:(const unsigned char *)bytes length:(int)len
+{
+    if (len < 1) {
+        return;
+    }
+    assert(terminal_);
+
+    const int kStaticBufferElements = 1024;
+    screen_char_t staticBuffer[kStaticBufferElements];
+    screen_char_t *dynamicBuffer = NULL;
+    screen_char_t *buffer;
+    if (len > kStaticBufferElements) {
+        buffer = dynamicBuffer = (screen_char_t *) malloc(len * sizeof(screen_char_t));
+        assert(dynamicBuffer);
+        if (!buffer) {
+            NSLog(@"%s: Out of memory", __PRETTY_FUNCTION__);
+            return;
+        }
+    } else {
+        buffer = staticBuffer;
+    }
+
+    // Stamp out the current attributes, then drop in the characters.
+    FillScreenChars(buffer, len, [terminal_ characterTemplate]);
+    for (int i = 0; i < len; i++) {
+        buffer[i].code = bytes[i];
+    }
+
+    // If a graphics character set was selected then translate buffer
+    // characters into graphics charaters.
+    if ([[charsetUsesLineDrawingMode_ objectAtIndex:[terminal_ charset]] boolValue]) {
+        ConvertCharsToGraphicsCharset(buffer, len);
+    }
+
+    [self incrementOverflowBy:[currentGrid_ appendCharsAtCursor:buffer
+                                                         length:len
+                                        scrollingIntoLineBuffer:linebuffer_
+                                            unlimitedScrollback:unlimitedScrollback_
+                                        useScrollbackWithRegion:[self useScrollbackWithRegion]]];
+
+    if (dynamicBuffer) {
+        free(dynamicBuffer);
+    }
+}
+
 - (void)crlf
 {
     [self linefeed];
@@ -921,7 +1033,6 @@ static const double kInterBellQuietPeriod = 0.1;
     // screen contents around on resize. So we take the history from tmux, append it to a temporary
     // line buffer, grab each wrapped line and trim spaces from it, and then append those modified
     // line (excluding empty ones at the end) to the real line buffer.
-    [self clearBuffer];
     LineBuffer *temp = [[[LineBuffer alloc] init] autorelease];
     NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
     for (NSData *chars in history) {
@@ -933,25 +1044,33 @@ static const double kInterBellQuietPeriod = 0.1;
                    width:currentGrid_.size.width
                timestamp:now];
     }
-    NSMutableArray *wrappedLines = [NSMutableArray array];
-    int n = [temp numLinesWithWidth:currentGrid_.size.width];
+    [self setHistoryFromLineBuffer:temp];
+}
+
+- (void)setHistoryFromLineBuffer:(LineBuffer *)temp
+{
+    [self clearBuffer];
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    const int n = [temp numLinesWithWidth:currentGrid_.size.width];
+
+    // Count the empty lines at the end first so the wrapped lines needn't be kept around.
     int numberOfConsecutiveEmptyLines = 0;
-    for (int i = 0; i < n; i++) {
+    for (int i = n - 1; i >= 0; i--) {
         ScreenCharArray *line = [temp wrappedLineAtIndex:i width:currentGrid_.size.width];
-        if (line.eol == EOL_HARD) {
-            [self stripTrailingSpaceFromLine:line];
-            if (line.length == 0) {
-                ++numberOfConsecutiveEmptyLines;
-            } else {
-                numberOfConsecutiveEmptyLines = 0;
-            }
-        } else {
-            numberOfConsecutiveEmptyLines = 0;
+        if (line.eol != EOL_HARD) {
+            break;
+        }
+        [self stripTrailingSpaceFromLine:line];
+        if (line.length > 0) {
+            break;
         }
-        [wrappedLines addObject:line];
+        ++numberOfConsecutiveEmptyLines;
     }
     for (int i = 0; i < n - numberOfConsecutiveEmptyLines; i++) {
-        ScreenCharArray *line = [wrappedLines objectAtIndex:i];
+        ScreenCharArray *line = [temp wrappedLineAtIndex:i width:currentGrid_.size.width];
+        if (line.eol == EOL_HARD) {
+            [self stripTrailingSpaceFromLine:line];
+        }
         [linebuffer_ appendLine:line.line
                          length:line.length
                         partial:(line.eol != EOL_HARD)
@@ -971,6 +1090,69 @@ static const double kInterBellQuietPeriod = 0.1;
                                                   currentGrid_.size.height - numberOfConsecutiveEmptyLines)];
 }
 
+- (void)prependHistoryFromLineBuffer:(LineBuffer *)history
+{
+    const int width = currentGrid_.size.width;
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    LineBuffer *oldLineBuffer = linebuffer_;
+    const int oldNumberOfLines = [oldLineBuffer numLinesWithWidth:width];
+
+    linebuffer_ = NewScrollbackLineBuffer();
+    [linebuffer_ setMaxLines:maxScrollbackLines_];
+    [linebuffer_ setAutocompleteIndex:autocompleteIndex_];
+    const int n = [history numLinesWithWidth:width];
+    for (int i = 0; i < n; i++) {
+        ScreenCharArray *line = [history wrappedLineAtIndex:i width:width];
+        if (line.eol == EOL_HARD) {
+            [self stripTrailingSpaceFromLine:line];
+        }
+        [linebuffer_ appendLine:line.line
+                         length:line.length
+                        partial:(line.eol != EOL_HARD)
+                          width:width
+                      timestamp:now];
+    }
+    for (int i = 0; i < oldNumberOfLines; i++) {
+        ScreenCharArray *line = [oldLineBuffer wrappedLineAtIndex:i width:width];
+        [linebuffer_ appendLine:line.line
+                         length:line.length
+                        partial:(line.eol != EOL_HARD)
+                          width:width
+                      timestamp:[oldLineBuffer timestampForLineNumber:i width:width]];
+    }
+    [oldLineBuffer release];
+    if (!unlimitedScrollback_) {
+        [linebuffer_ dropExcessLinesWithWidth:width];
+    }
+    if (!scrollbackArchiveFlushed_) {
+        [linebuffer_ setArchive:scrollbackArchive_];
+    }
+
+    // Everything that was in the scrollback or on screen moved down by the number of lines added.
+    const int delta = [linebuffer_ numLinesWithWidth:width] - oldNumberOfLines;
+    if (delta) {
+        const long long offset = (long long)delta * (width + 1);
+        IntervalTree *tree = [[IntervalTree alloc] init];
+        for (id<IntervalTreeObject> object in [intervalTree_ allObjects]) {
+            const long long location = object.entry.interval.location;
+            const long long length = object.entry.interval.length;
+            [[object retain] autorelease];
+            [intervalTree_ removeObject:object];
+            [tree addObject:object
+               withInterval:[Interval intervalWithLocation:location + offset length:length]];
+        }
+        [intervalTree_ release];
+        intervalTree_ = tree;
+        [self invalidateAnnotationCache];
+        [self reloadMarkCache];
+    }
+
+    savedFindContextAbsPos_ = 0;
+    [delegate_ screenRemoveSelection];
+    [currentGrid_ markAllCharsDirty:YES];
+    [delegate_ screenNeedsRedraw];
+}
+
 - (void)setAltScreen:(NSArray *)lines
 {
     if (!altGrid_) {
@@ -1093,12 +1275,23 @@ static const double kInterBellQuietPeriod = 0.1;
 - (void)highlightTextMatchingRegex:(NSString *)regex
                             colors:(NSDictionary *)colors
 {
-    NSArray *runs = [currentGrid_ runsMatchingRegex:regex];
-    for (NSValue *run in runs) {
-        [self highlightRun:[run gridRunValue]
-       withForegroundColor:[colors objectForKey:kHighlightForegroundColor]
-           backgroundColor:[colors objectForKey:kHighlightBackgroundColor]];
-    }
+    // Lines that haven't changed since they were last highlighted with these colors already
+    // have them.
+    NSArray *key = @[ regex, colors ?: @{} ];
+    if (![highlightSignatures_ objectForKey:key] &&
+        [highlightSignatures_ count] >= kMaxHighlightSignatureSets) {
+        [highlightSignatures_ removeAllObjects];
+    }
+    const long long firstAbsoluteLine = [self totalScrollbackOverflow] + [self numberOfScrollbackLines];
+    NSArray *runs = [currentGrid_ runsMatchingRegex:regex
+                             skippingUnchangedLines:[highlightSignatures_ objectForKey:key]
+                                  firstAbsoluteLine:firstAbsoluteLine
+                                        stringCache:highlightStringCache_];
+    [self highlightRuns:runs
+    withForegroundColor:[colors objectForKey:kHighlightForegroundColor]
+        backgroundColor:[colors objectForKey:kHighlightBackgroundColor]];
+    [highlightSignatures_ setObject:[currentGrid_ signaturesOfWrappedLinesWithFirstAbsoluteLine:firstAbsoluteLine]
+                             forKey:key];
 }
 
 - (void)setFromFrame:(screen_char_t*)s len:(int)len info:(DVRFrameInfo)info
@@ -1129,6 +1322,72 @@ static const double kInterBellQuietPeriod = 0.1;
     [self popScrollbackLines:linesPushed];
 }
 
+- (BOOL)startArchivingScrollbackToFile:(NSString *)path
+{
+    [self discardScrollbackArchive];
+    scrollbackArchive_ = [[LineBufferArchive alloc] initWithPath:path];
+    scrollbackArchiveFlushed_ = NO;
+    [linebuffer_ setArchive:scrollbackArchive_];
+    return scrollbackArchive_ != nil;
+}
+
+- (NSString *)scrollbackArchivePath
+{
+    return [scrollbackArchive_ path];
+}
+
+- (AutocompleteIndex *)autocompleteIndex
+{
+    return autocompleteIndex_;
+}
+
+- (void)flushScrollbackArchive
+{
+    if (!scrollbackArchive_ || scrollbackArchiveFlushed_) {
+        return;
+    }
+    // The archive has every full block already, so this writes only the last block and the screen.
+    LineBuffer *snapshot = [[linebuffer_ newAppendOnlyCopy] autorelease];
+    [primaryGrid_ appendLines:[primaryGrid_ numberOfLinesUsed] toLineBuffer:snapshot];
+    [snapshot writeSnapshotToArchive:scrollbackArchive_];
+    [scrollbackArchive_ appendMarks:[self archivedMarksInLineBuffer:snapshot]];
+    [linebuffer_ setArchive:nil];
+    [scrollbackArchive_ close];
+    scrollbackArchiveFlushed_ = YES;
+}
+
+- (void)discardScrollbackArchive
+{
+    if (!scrollbackArchive_) {
+        return;
+    }
+    [linebuffer_ setArchive:nil];
+    [scrollbackArchive_ close];
+    if (!scrollbackArchiveFlushed_) {
+        unlink([[scrollbackArchive_ path] fileSystemRepresentation]);
+    }
+    [scrollbackArchive_ release];
+    scrollbackArchive_ = nil;
+}
+
+- (BOOL)restoreScrollbackFromArchiveAtPath:(NSString *)path
+{
+    LineBufferArchiveReader *reader =
+        [[[LineBufferArchiveReader alloc] initWithPath:path] autorelease];
+    if (!reader || ![linebuffer_ loadArchive:reader]) {
+        return NO;
+    }
+    [self restoreMarks:[reader marks]
+          droppedChars:[reader state].droppedChars];
+    if (!unlimitedScrollback_) {
+        [self incrementOverflowBy:[linebuffer_ dropExcessLinesWithWidth:currentGrid_.size.width]];
+    }
+    [self reloadMarkCache];
+    [delegate_ screenDidChangeNumberOfScrollbackLines];
+    [delegate_ screenNeedsRedraw];
+    return YES;
+}
+
 - (void)resetCharset {
     [charsetUsesLineDrawingMode_ removeAllObjects];
     for (int i = 0; i < NUM_CHARSETS; i++) {
@@ -1187,30 +1446,49 @@ static const double kInterBellQuietPeriod = 0.1;
         return [currentGrid_ screenCharsAtLineNumber:(theIndex - numLinesInLineBuffer)];
     } else {
         // Get a line from the scrollback buffer.
-        screen_char_t *defaultLine = [[currentGrid_ defaultLineOfWidth:currentGrid_.size.width] mutableBytes];
-        memcpy(buffer, defaultLine, sizeof(screen_char_t) * currentGrid_.size.width);
-        int cont = [linebuffer_ copyLineToBuffer:buffer
-                                           width:currentGrid_.size.width
-                                         lineNum:theIndex];
-        if (cont == EOL_SOFT &&
-            theIndex == numLinesInLineBuffer - 1 &&
-            [currentGrid_ screenCharsAtLineNumber:0][1].code == DWC_RIGHT &&
-            buffer[currentGrid_.size.width - 1].code == 0) {
-            // The last line in the scrollback buffer is actually a split DWC
-            // if the first char on the screen is double-width and the buffer is soft-wrapped without
-            // a last char.
-            cont = EOL_DWC;
-        }
-        if (cont == EOL_DWC) {
-            buffer[currentGrid_.size.width - 1].code = DWC_SKIP;
-            buffer[currentGrid_.size.width - 1].complexChar = NO;
-        }
-        buffer[currentGrid_.size.width].code = cont;
+        const int width = currentGrid_.size.width;
+        ScreenCharLineView view = [self lineViewAtIndex:theIndex];
+        screen_char_t *defaultLine = [[currentGrid_ defaultLineOfWidth:width] mutableBytes];
+        memcpy(buffer, defaultLine, sizeof(screen_char_t) * width);
+        memcpy(buffer, view.chars, sizeof(screen_char_t) * view.length);
+        if (view.eol == EOL_DWC) {
+            buffer[width - 1].code = DWC_SKIP;
+            buffer[width - 1].complexChar = NO;
+        }
+        buffer[width].code = view.eol;
 
         return buffer;
     }
 }
 
+- (ScreenCharLineView)lineViewAtIndex:(int)theIndex
+{
+    const int width = currentGrid_.size.width;
+    int numLinesInLineBuffer = [linebuffer_ numLinesWithWidth:width];
+    ScreenCharLineView view;
+    view.padding = [currentGrid_ defaultChar];
+    if (theIndex >= numLinesInLineBuffer) {
+        view.chars = [currentGrid_ screenCharsAtLineNumber:(theIndex - numLinesInLineBuffer)];
+        view.length = width;
+        view.eol = view.chars[width].code;
+        return view;
+    }
+    view.chars = [linebuffer_ charsOfWrappedLineAtIndex:theIndex
+                                                   width:width
+                                                  length:&view.length
+                                                     eol:&view.eol];
+    if (view.eol == EOL_SOFT &&
+        theIndex == numLinesInLineBuffer - 1 &&
+        [currentGrid_ screenCharsAtLineNumber:0][1].code == DWC_RIGHT &&
+        (view.length < width || view.chars[width - 1].code == 0)) {
+        // The last line in the scrollback buffer is actually a split DWC
+        // if the first char on the screen is double-width and the buffer is soft-wrapped without
+        // a last char.
+        view.eol = EOL_DWC;
+    }
+    return view;
+}
+
 // Gets a line on the screen (0 = top of screen)
 - (screen_char_t *)getLineAtScreenIndex:(int)theIndex
 {
@@ -1222,6 +1500,11 @@ static const double kInterBellQuietPeriod = 0.1;
     return [linebuffer_ numLinesWithWidth:currentGrid_.size.width];
 }
 
+- (LineBuffer *)newScrollbackSnapshot
+{
+    return [linebuffer_ newAppendOnlyCopy];
+}
+
 - (int)scrollbackOverflow
 {
     return scrollbackOverflow_;
@@ -1242,6 +1525,51 @@ static const double kInterBellQuietPeriod = 0.1;
     return [self totalScrollbackOverflow] + [self numberOfLines] - [self height] + currentGrid_.cursorY;
 }
 
+- (NSString *)contentsOfAbsoluteLinesFrom:(long long)first to:(long long)last
+{
+    const long long overflow = [self totalScrollbackOverflow];
+    const int start = MAX(0, first - overflow);
+    const int end = MIN((long long)[self numberOfLines] - 1, last - overflow);
+    const int width = currentGrid_.size.width;
+    NSMutableString *result = [NSMutableString string];
+    unichar *chars = malloc(sizeof(unichar) * (width * kMaxParts + 1));
+    for (int y = start; y <= end; y++) {
+        ScreenCharLineView view = [self lineViewAtIndex:y];
+        int length = view.length;
+        if (view.eol == EOL_HARD) {
+            while (length > 0 && view.chars[length - 1].code == 0) {
+                length--;
+            }
+        }
+        int o = 0;
+        for (int x = 0; x < length; x++) {
+            screen_char_t c = view.chars[x];
+            if (c.code == TAB_FILLER && !c.complexChar) {
+                // Fillers before a tab are dropped and orphans become spaces, as in copied text.
+                int next = x + 1;
+                while (next < length && view.chars[next].code == TAB_FILLER) {
+                    next++;
+                }
+                if (next == length || view.chars[next].code != '\t') {
+                    chars[o++] = ' ';
+                }
+            } else if ((c.code == DWC_RIGHT || c.code == DWC_SKIP) && !c.complexChar) {
+                continue;
+            } else if (c.code == 0) {
+                chars[o++] = ' ';
+            } else {
+                o += ExpandScreenChar(&c, chars + o);
+            }
+        }
+        CFStringAppendCharacters((CFMutableStringRef)result, chars, o);
+        if (view.eol == EOL_HARD) {
+            [result appendString:@"\n"];
+        }
+    }
+    free(chars);
+    return result;
+}
+
 - (int)lineNumberOfCursor
 {
     return [self numberOfLines] - [self height] + currentGrid_.cursorY;
@@ -1250,6 +1578,9 @@ static const double kInterBellQuietPeriod = 0.1;
 - (BOOL)continueFindAllResults:(NSMutableArray*)results
                      inContext:(FindContext*)context
 {
+    if (context.options & FindMultipleResults) {
+        return [self continueBackgroundFindAllResults:results inContext:context];
+    }
     context.hasWrapped = YES;
     NSDate* start = [NSDate date];
     BOOL keepSearching;
@@ -1335,6 +1666,7 @@ static const double kInterBellQuietPeriod = 0.1;
     if (multipleResults) {
         opts |= FindMultipleResults;
     }
+    context.backgroundSearch = nil;
     [linebuffer_ prepareToSearchFor:aString startingAt:startPos options:opts withContext:context];
     context.hasWrapped = NO;
     [self popScrollbackLines:linesPushed];
@@ -1354,6 +1686,24 @@ static const double kInterBellQuietPeriod = 0.1;
     return [currentGrid_ debugString];
 }
 
+- (void)addToMemoryReport:(MemoryReport *)report {
+    [report addBytes:[linebuffer_ residentBytes]
+               count:[linebuffer_ numberOfBlocks]
+         forCategory:@"Scrollback blocks (resident)"];
+    [report addUncountedBytes:[linebuffer_ usedBytes] forCategory:@"Scrollback chars (used)"];
+    [report addBytes:[linebuffer_ compressedBytes] forCategory:@"Scrollback blocks (compressed)"];
+    [report addUncountedBytes:[linebuffer_ spilledBytes]
+                  forCategory:@"Scrollback blocks (spilled to disk)"];
+    [report addBytes:[linebuffer_ ngramIndexBytes] forCategory:@"Scrollback trigram indexes"];
+    [report addBytes:[primaryGrid_ memoryUsage] forCategory:@"Grid"];
+    [report addBytes:[altGrid_ memoryUsage] forCategory:@"Alternate grid"];
+    [report addBytes:[dvr_ bufferCapacity] forCategory:@"Instant replay buffer (capacity)"];
+    [report addUncountedBytes:[dvr_ bufferUsedBytes] forCategory:@"Instant replay buffer (used)"];
+    [report addCount:[intervalTree_ count] + [savedIntervalTree_ count]
+         forCategory:@"Marks, notes and directories"];
+    [report addBytes:[highlightStringCache_ estimatedBytes] forCategory:@"Highlight line strings"];
+}
+
 - (NSString *)compactLineDumpWithHistory {
     NSMutableString *string = [NSMutableString stringWithString:[linebuffer_ compactLineDumpWithWidth:[self width]]];
     if ([string length]) {
@@ -1416,9 +1766,86 @@ static const double kInterBellQuietPeriod = 0.1;
     return [currentGrid_ isCharDirtyAt:VT100GridCoordMake(x, y)];
 }
 
+// Changes that haven't been drawn yet, and so haven't been counted in contentGeneration_.
+- (BOOL)hasUncountedChanges
+{
+    return ([currentGrid_ isAnyCharDirty] ||
+            currentGrid_.scrollDamageDistance != 0 ||
+            currentGrid_.scrollDamageIsComplex);
+}
+
+- (long long)contentGeneration
+{
+    return contentGeneration_ + ([self hasUncountedChanges] ? 1 : 0);
+}
+
 - (void)resetDirty
 {
+    if ([self hasUncountedChanges]) {
+        contentGeneration_++;
+    }
     [currentGrid_ markAllCharsDirty:NO];
+    [currentGrid_ resetScrollDamage];
+}
+
+// Adds the chars that are dirty now to dvrPendingRanges_.
+- (void)accumulateDvrChanges
+{
+    const int width = currentGrid_.size.width;
+    const int height = currentGrid_.size.height;
+    if (width != dvrPendingWidth_ || height != dvrPendingHeight_ || !dvrPendingRanges_) {
+        // The DVR starts over with a key frame after a resize, so send everything.
+        free(dvrPendingRanges_);
+        dvrPendingRanges_ = malloc(MAX(1, height) * sizeof(NSRange));
+        for (int y = 0; y < height; y++) {
+            dvrPendingRanges_[y] = NSMakeRange(0, width + 1);
+        }
+        dvrPendingWidth_ = width;
+        dvrPendingHeight_ = height;
+        dvrHasPendingChanges_ = YES;
+        return;
+    }
+
+    if (currentGrid_.cursorX != dvrCursor_.x || currentGrid_.cursorY != dvrCursor_.y) {
+        dvrHasPendingChanges_ = YES;
+    }
+
+    // Dirty chars, and whole lines that scrolled without being marked dirty, could have changed.
+    VT100GridRect scrollDamage = currentGrid_.scrollDamageRect;
+    const BOOL hasScrollDamage = (currentGrid_.scrollDamageDistance != 0);
+    for (int y = 0; y < height; y++) {
+        NSRange range;
+        if (hasScrollDamage && y >= scrollDamage.origin.y && y < scrollDamage.origin.y + scrollDamage.size.height) {
+            range = NSMakeRange(0, width + 1);
+        } else {
+            VT100GridRange dirty = [currentGrid_ dirtyRangeForLine:y];
+            if (dirty.length <= 0) {
+                continue;
+            }
+            range = NSMakeRange(dirty.location, width + 1 - dirty.location);
+        }
+        if (dvrPendingRanges_[y].length) {
+            range = NSUnionRange(range, dvrPendingRanges_[y]);
+        }
+        dvrPendingRanges_[y] = range;
+        dvrHasPendingChanges_ = YES;
+    }
+}
+
+- (void)setDvr:(DVR *)dvr
+{
+    [dvr retain];
+    [dvr_ release];
+    dvr_ = dvr;
+    // A new DVR hasn't seen any of the screen, so its first frame must include everything.
+    free(dvrPendingRanges_);
+    dvrPendingRanges_ = NULL;
+    dvrHasPendingChanges_ = NO;
+}
+
+- (BOOL)hasPendingDvrFrame
+{
+    return dvrHasPendingChanges_;
 }
 
 - (void)saveToDvr
@@ -1426,16 +1853,56 @@ static const double kInterBellQuietPeriod = 0.1;
     if (!dvr_ || ![[PreferencePanel sharedInstance] instantReplay]) {
         return;
     }
+    if ([[PowerManager sharedInstance] lowPowerModeEnabled]) {
+        // Nothing is recorded in low power mode. What changed meanwhile isn't tracked, so the
+        // first frame afterwards gets everything, as for a new DVR.
+        free(dvrPendingRanges_);
+        dvrPendingRanges_ = NULL;
+        dvrHasPendingChanges_ = NO;
+        return;
+    }
+    [self accumulateDvrChanges];
+    if (!dvrHasPendingChanges_) {
+        return;
+    }
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    if (maxDvrFramesPerSecond_ > 0 && now - lastDvrFrameTime_ < 1.0 / maxDvrFramesPerSecond_) {
+        // Over the frame rate budget. The changes are kept for the next frame.
+        return;
+    }
+    lastDvrFrameTime_ = now;
 
     DVRFrameInfo info;
     info.cursorX = currentGrid_.cursorX;
     info.cursorY = currentGrid_.cursorY;
     info.height = currentGrid_.size.height;
     info.width = currentGrid_.size.width;
+    info.timestamp = (now + NSTimeIntervalSince1970) * 1000000;
+    info.frameType = DVRFrameTypeDiffFrame;
+
+    // Hand off just the chars that changed. The end-of-line marker after the last column isn't
+    // tracked by the dirty bits, so it's always included.
+    const int width = currentGrid_.size.width;
+    const int height = currentGrid_.size.height;
+    NSArray *lines = [currentGrid_ orderedLines];
+    NSMutableArray *changedLines = [NSMutableArray arrayWithCapacity:height];
+    for (int y = 0; y < height; y++) {
+        if (!dvrPendingRanges_[y].length) {
+            dvrPendingRanges_[y] = NSMakeRange(width, 1);
+        }
+        NSRange range = dvrPendingRanges_[y];
+        NSData *line = [lines objectAtIndex:y];
+        [changedLines addObject:[line subdataWithRange:NSMakeRange(range.location * sizeof(screen_char_t),
+                                                                   range.length * sizeof(screen_char_t))]];
+    }
+
+    [dvr_ appendChangedLines:changedLines ranges:dvrPendingRanges_ info:&info];
+    dvrCursor_ = VT100GridCoordMake(info.cursorX, info.cursorY);
 
-    [dvr_ appendFrame:[currentGrid_ orderedLines]
-               length:sizeof(screen_char_t) * (currentGrid_.size.width + 1) * (currentGrid_.size.height)
-                 info:&info];
+    for (int y = 0; y < height; y++) {
+        dvrPendingRanges_[y] = NSMakeRange(0, 0);
+    }
+    dvrHasPendingChanges_ = NO;
 }
 
 - (BOOL)shouldSendContentsChangedNotification
@@ -1448,6 +1915,22 @@ static const double kInterBellQuietPeriod = 0.1;
     return [currentGrid_ dirtyRangeForLine:y];
 }
 
+- (NSArray *)dirtyRects {
+    return [currentGrid_ dirtyRects];
+}
+
+- (VT100GridRect)scrollDamageRect {
+    return currentGrid_.scrollDamageRect;
+}
+
+- (int)scrollDamageDistance {
+    return currentGrid_.scrollDamageIsComplex ? 0 : currentGrid_.scrollDamageDistance;
+}
+
+- (void)markScrollDamageDirty {
+    [currentGrid_ markScrollDamageDirty];
+}
+
 - (NSDate *)timestampForLine:(int)y {
     int numLinesInLineBuffer = [linebuffer_ numLinesWithWidth:currentGrid_.size.width];
     NSTimeInterval interval;
@@ -1525,6 +2008,8 @@ static const double kInterBellQuietPeriod = 0.1;
         VT100GridCoordRange range = VT100GridCoordRangeMake(0, line, self.width, line);
         [intervalTree_ addObject:workingDirectoryObj
                     withInterval:[self intervalForGridCoordRange:range]];
+        [workingDirectoryIndex_ addObject:workingDirectoryObj
+                                   onLine:[self indexedLineOfObject:workingDirectoryObj]];
     }
 }
 
@@ -1535,28 +2020,11 @@ static const double kInterBellQuietPeriod = 0.1;
     VT100GridCoordRange range = VT100GridCoordRangeMake(0, line, self.width, line);
     [intervalTree_ addObject:remoteHostObj
                 withInterval:[self intervalForGridCoordRange:range]];
-}
-
-- (id)objectOnOrBeforeLine:(int)line ofClass:(Class)cls {
-    long long pos = [self intervalForGridCoordRange:VT100GridCoordRangeMake(0,
-                                                                            line,
-                                                                            0,
-                                                                            line)].limit;
-    NSEnumerator *enumerator = [intervalTree_ reverseLimitEnumeratorAt:pos];
-    NSArray *objects;
-    do {
-        objects = [enumerator nextObject];
-        objects = [objects objectsOfClasses:@[ cls ]];
-    } while (objects && !objects.count);
-    if (objects.count) {
-        return objects[0];
-    } else {
-        return nil;
-    }
+    [remoteHostIndex_ addObject:remoteHostObj onLine:[self indexedLineOfObject:remoteHostObj]];
 }
 
 - (VT100RemoteHost *)remoteHostOnLine:(int)line {
-    return (VT100RemoteHost *)[self objectOnOrBeforeLine:line ofClass:[VT100RemoteHost class]];
+    return [remoteHostIndex_ objectBeforeLine:[self totalScrollbackOverflow] + line];
 }
 
 - (SCPPath *)scpPathForFile:(NSString *)filename onLine:(int)line {
@@ -1583,7 +2051,7 @@ static const double kInterBellQuietPeriod = 0.1;
 
 - (NSString *)workingDirectoryOnLine:(int)line {
     VT100WorkingDirectory *workingDirectory =
-        [self objectOnOrBeforeLine:line ofClass:[VT100WorkingDirectory class]];
+        [workingDirectoryIndex_ objectBeforeLine:[self totalScrollbackOverflow] + line];
     return workingDirectory.workingDirectory;
 }
 
@@ -1599,13 +2067,12 @@ static const double kInterBellQuietPeriod = 0.1;
     long long lastDeadLocation = [self totalScrollbackOverflow] * (self.width + 1);
     long long totalScrollbackOverflow = [self totalScrollbackOverflow];
     if (lastDeadLocation > 0) {
-        Interval *deadInterval = [Interval intervalWithLocation:0 length:lastDeadLocation + 1];
-        for (id<IntervalTreeObject> obj in [intervalTree_ objectsInInterval:deadInterval]) {
-            if ([obj.entry.interval limit] <= lastDeadLocation) {
-                if ([obj isKindOfClass:[VT100ScreenMark class]]) {
-                    [markCache_ removeObject:@(totalScrollbackOverflow + [self coordRangeForInterval:obj.entry.interval].end.y)];
-                }
-                [intervalTree_ removeObject:obj];
+        for (IntervalTreeEntry *entry in [intervalTree_ removeObjectsBefore:lastDeadLocation]) {
+            if ([entry.object isKindOfClass:[VT100ScreenMark class]]) {
+                [markCache_ removeObject:@(totalScrollbackOverflow + [self coordRangeForInterval:entry.interval].end.y)];
+            } else {
+                [[self lineObjectIndexForObject:entry.object] removeObject:entry.object
+                                                                    onLine:entry.interval.limit / (self.width + 1)];
             }
         }
     }
@@ -1643,15 +2110,76 @@ static const double kInterBellQuietPeriod = 0.1;
 }
 
 - (NSArray *)charactersWithNotesOnLine:(int)line {
-    NSMutableArray *result = [NSMutableArray array];
+    return [self findCharactersWithNotesOnLines:VT100GridRangeMake(line, 1)][0];
+}
+
+- (NSArray *)charactersWithNotesOnLines:(VT100GridRange)lines {
+    [self updateAnnotationCacheForLines:lines];
+    return cachedNoteRanges_;
+}
+
+- (NSIndexSet *)linesWithMarksInRange:(VT100GridRange)lines {
+    [self updateAnnotationCacheForLines:lines];
+    return cachedMarkLines_;
+}
+
+- (void)invalidateAnnotationCache {
+    [cachedNoteRanges_ release];
+    cachedNoteRanges_ = nil;
+    [cachedMarkLines_ release];
+    cachedMarkLines_ = nil;
+}
+
+- (void)updateAnnotationCacheForLines:(VT100GridRange)lines {
+    const long long firstLine = [self totalScrollbackOverflow] + lines.location;
+    if (cachedNoteRanges_ &&
+        cachedAnnotationsFirstLine_ == firstLine &&
+        cachedAnnotationsNumLines_ == lines.length &&
+        cachedAnnotationsWidth_ == self.width &&
+        cachedAnnotationsGeneration_ == intervalTree_.generation) {
+        return;
+    }
+    [self invalidateAnnotationCache];
+    cachedNoteRanges_ = [[self findCharactersWithNotesOnLines:lines] retain];
+    NSMutableIndexSet *markLines = [NSMutableIndexSet indexSet];
+    for (int i = 0; i < lines.length; i++) {
+        if ([markCache_ containsObject:@(firstLine + i)]) {
+            [markLines addIndex:i];
+        }
+    }
+    cachedMarkLines_ = [markLines retain];
+    cachedAnnotationsFirstLine_ = firstLine;
+    cachedAnnotationsNumLines_ = lines.length;
+    cachedAnnotationsWidth_ = self.width;
+    cachedAnnotationsGeneration_ = intervalTree_.generation;
+}
+
+- (NSArray *)findCharactersWithNotesOnLines:(VT100GridRange)lines {
+    // Lines without notes share one empty array.
+    NSArray *none = [NSArray array];
+    NSMutableArray *result = [NSMutableArray arrayWithCapacity:MAX(0, lines.length)];
+    for (int i = 0; i < lines.length; i++) {
+        [result addObject:none];
+    }
+    if (lines.length <= 0) {
+        return result;
+    }
+    const int lastLine = VT100GridRangeMax(lines);
     Interval *interval = [self intervalForGridCoordRange:VT100GridCoordRangeMake(0,
-                                                                                 line,
+                                                                                 lines.location,
                                                                                  0,
-                                                                                 line + 1)];
-    NSArray *objects = [intervalTree_ objectsInInterval:interval];
-    for (id<IntervalTreeObject> note in objects) {
-        if ([note isKindOfClass:[PTYNoteViewController class]]) {
-            VT100GridCoordRange range = [self coordRangeForInterval:note.entry.interval];
+                                                                                 lastLine + 1)];
+    Class noteClass = [PTYNoteViewController class];
+    const int width = self.width;
+    [intervalTree_ enumerateObjectsInInterval:interval
+                                   usingBlock:^(id<IntervalTreeObject> note, BOOL *stop) {
+        if (![note isKindOfClass:noteClass]) {
+            return;
+        }
+        VT100GridCoordRange range = [self coordRangeForInterval:note.entry.interval];
+        for (int line = MAX(range.start.y, lines.location);
+             line <= MIN(range.end.y, lastLine);
+             line++) {
             VT100GridRange gridRange;
             if (range.start.y < line) {
                 gridRange.location = 0;
@@ -1659,13 +2187,22 @@ static const double kInterBellQuietPeriod = 0.1;
                 gridRange.location = range.start.x;
             }
             if (range.end.y > line) {
-                gridRange.length = self.width + 1 - gridRange.location;
+                gridRange.length = width + 1 - gridRange.location;
             } else {
                 gridRange.length = range.end.x - gridRange.location;
             }
-            [result addObject:[NSValue valueWithGridRange:gridRange]];
+            if (gridRange.length <= 0) {
+                // Ends at the start of this line.
+                continue;
+            }
+            NSMutableArray *ranges = result[line - lines.location];
+            if (ranges == (id)none) {
+                ranges = [NSMutableArray array];
+                result[line - lines.location] = ranges;
+            }
+            [ranges addObject:[NSValue valueWithGridRange:gridRange]];
         }
-    }
+    }];
     return result;
 }
 
@@ -1748,6 +2285,24 @@ static const double kInterBellQuietPeriod = 0.1;
     return VT100GridRangeMake(range.start.y, range.end.y - range.start.y + 1);
 }
 
+#pragma mark - ScrollbackBudgetClient
+
+- (LineBuffer *)lineBufferForScrollbackBudget {
+    return linebuffer_;
+}
+
+- (void)dropScrollbackToFreeBytes:(long long)bytes {
+    int dropped = [linebuffer_ dropOldestBlocksToFreeBytes:bytes width:currentGrid_.size.width];
+    if (!dropped) {
+        return;
+    }
+    DLog(@"Dropped %d lines of scrollback to free memory", dropped);
+    [self incrementOverflowBy:dropped];
+    [self reloadMarkCache];
+    [delegate_ screenDidChangeNumberOfScrollbackLines];
+    [delegate_ screenNeedsRedraw];
+}
+
 #pragma mark - VT100TerminalDelegate
 
 - (void)terminalAppendString:(NSString *)string isAscii:(BOOL)isAscii
@@ -1756,11 +2311,29 @@ static const double kInterBellQuietPeriod = 0.1;
         [printBuffer_ appendString:string];
     } else {
         // else display string on screen
+        SignpostBegin("screen apply", nil, [string length]);
         [self appendStringAtCursor:string ascii:isAscii];
+        SignpostEnd("screen apply", nil, [string length]);
     }
     [delegate_ screenDidAppendStringToCurrentLine:string];
 }
 
+- (void)terminalAppendAsciiBytes:(const unsigned char *)bytes length:(int)length
+{
+    if (collectInputForPrinting_) {
+        NSString *string = [[NSString alloc] initWithBytes:bytes
+                                                    length:length
+                                                  encoding:NSASCIIStringEncoding];
+        [printBuffer_ appendString:string];
+        [string release];
+    } else {
+        SignpostBegin("screen apply", nil, length);
+        [self appendAsciiBytesAtCursor:bytes length:length];
+        SignpostEnd("screen apply", nil, length);
+    }
+    [delegate_ screenDidAppendAsciiBytesToCurrentLine:bytes length:length];
+}
+
 - (void)terminalRingBell {
     [delegate_ screenDidAppendStringToCurrentLine:@"\a"];
     [self activateBell];
@@ -1881,6 +2454,68 @@ static const double kInterBellQuietPeriod = 0.1;
     [delegate_ screenTriggerableChangeDidOccur];
 }
 
+- (BOOL)terminalCanFastForwardWithWidth:(int *)width height:(int *)height
+{
+    const int cursorY = currentGrid_.cursorY;
+    if (collectInputForPrinting_ ||
+        currentGrid_ != primaryGrid_ ||
+        currentGrid_.topMargin != 0 ||
+        currentGrid_.bottomMargin != currentGrid_.size.height - 1 ||
+        currentGrid_.useScrollRegionCols ||
+        currentGrid_.cursorX != 0 ||
+        cursorY != currentGrid_.size.height - 1 ||
+        [currentGrid_ lengthOfLineNumber:cursorY] != 0 ||
+        [[charsetUsesLineDrawingMode_ objectAtIndex:[terminal_ charset]] boolValue]) {
+        return NO;
+    }
+    *width = currentGrid_.size.width;
+    *height = currentGrid_.size.height;
+    return YES;
+}
+
+- (void)terminalBeginFastForward
+{
+    const int height = currentGrid_.size.height;
+    for (int i = 0; i < height - 1; i++) {
+        [self incrementOverflowBy:[currentGrid_ scrollWholeScreenUpIntoLineBuffer:linebuffer_
+                                                              unlimitedScrollback:unlimitedScrollback_]];
+    }
+    currentGrid_.cursor = VT100GridCoordMake(0, 0);
+    [currentGrid_ markAllCharsDirty:YES];
+    fastForwardLineLength_ = 0;
+}
+
+- (void)terminalFastForwardAsciiBytes:(const unsigned char *)bytes length:(int)length
+{
+    if (fastForwardLineLength_ + length > fastForwardLineCapacity_) {
+        fastForwardLineCapacity_ = MAX(fastForwardLineLength_ + length,
+                                       fastForwardLineCapacity_ * 2);
+        fastForwardLine_ = realloc(fastForwardLine_,
+                                   fastForwardLineCapacity_ * sizeof(screen_char_t));
+    }
+    screen_char_t *buffer = fastForwardLine_ + fastForwardLineLength_;
+    FillScreenChars(buffer, length, [terminal_ characterTemplate]);
+    for (int i = 0; i < length; i++) {
+        buffer[i].code = bytes[i];
+    }
+    fastForwardLineLength_ += length;
+    [delegate_ screenDidAppendAsciiBytesToCurrentLine:bytes length:length];
+}
+
+- (void)terminalFastForwardNewline
+{
+    [linebuffer_ appendLine:fastForwardLine_
+                     length:fastForwardLineLength_
+                    partial:NO
+                      width:currentGrid_.size.width
+                  timestamp:[NSDate timeIntervalSinceReferenceDate]];
+    if (!unlimitedScrollback_) {
+        [self incrementOverflowBy:[linebuffer_ dropExcessLinesWithWidth:currentGrid_.size.width]];
+    }
+    fastForwardLineLength_ = 0;
+    [delegate_ screenTriggerableChangeDidOccur];
+}
+
 - (void)terminalCursorLeft:(int)n
 {
     [currentGrid_ moveCursorLeft:n];
@@ -2562,7 +3197,7 @@ static const double kInterBellQuietPeriod = 0.1;
     [self reloadMarkCache];
 
     [currentGrid_ markAllCharsDirty:YES];
-    [delegate_ screenNeedsRedraw];
+    [delegate_ screenDidSwitchGrids];
 }
 
 - (void)hideOnScreenNotesAndTruncateSpanners
@@ -2576,8 +3211,15 @@ static const double kInterBellQuietPeriod = 0.1;
     Interval *screenInterval = [self intervalForGridCoordRange:screenRange];
     for (id<IntervalTreeObject> note in [intervalTree_ objectsInInterval:screenInterval]) {
         if (note.entry.interval.location < screenInterval.location) {
-            // Truncate note so that it ends just before screen.
-            note.entry.interval.length = screenInterval.location - note.entry.interval.location;
+            // Truncate note so that it ends just before screen. The tree keeps its own copy of each
+            // interval's bounds, so it has to be re-added rather than changed in place.
+            Interval *interval = note.entry.interval;
+            Interval *truncated =
+                [Interval intervalWithLocation:interval.location
+                                        length:screenInterval.location - interval.location];
+            [[note retain] autorelease];
+            [intervalTree_ removeObject:note];
+            [intervalTree_ addObject:note withInterval:truncated];
         }
         if ([note isKindOfClass:[PTYNoteViewController class]]) {
             [(PTYNoteViewController *)note setNoteHidden:YES];
@@ -2597,7 +3239,7 @@ static const double kInterBellQuietPeriod = 0.1;
             // Don't restore the cursor; instead, continue using the cursor position of the alt grid.
             currentGrid_.cursor = altGrid_.cursor;
         }
-        [delegate_ screenNeedsRedraw];
+        [delegate_ screenDidSwitchGrids];
     }
 }
 
@@ -2864,9 +3506,9 @@ static const double kInterBellQuietPeriod = 0.1;
 }
 
 // Set the color of prototypechar to all chars between startPoint and endPoint on the screen.
-- (void)highlightRun:(VT100GridRun)run
-    withForegroundColor:(NSColor *)fgColor
-        backgroundColor:(NSColor *)bgColor
+- (void)highlightRuns:(NSArray *)runs
+   withForegroundColor:(NSColor *)fgColor
+       backgroundColor:(NSColor *)bgColor
 {
     int fgColorCode = [self colorCodeForColor:fgColor];
     int bgColorCode = [self colorCodeForColor:bgColor];
@@ -2879,12 +3521,14 @@ static const double kInterBellQuietPeriod = 0.1;
     bg.backgroundColor = bgColorCode;
     bg.backgroundColorMode = bgColor ? ColorModeNormal : ColorModeInvalid;
 
-    for (NSValue *value in [currentGrid_ rectsForRun:run]) {
-        VT100GridRect rect = [value gridRectValue];
-        [currentGrid_ setBackgroundColor:bg
-                         foregroundColor:fg
-                              inRectFrom:rect.origin
-                                      to:VT100GridRectMax(rect)];
+    for (NSValue *run in runs) {
+        for (NSValue *value in [currentGrid_ rectsForRun:[run gridRunValue]]) {
+            VT100GridRect rect = [value gridRectValue];
+            [currentGrid_ setBackgroundColor:bg
+                             foregroundColor:fg
+                                  inRectFrom:rect.origin
+                                          to:VT100GridRectMax(rect)];
+        }
     }
 }
 
@@ -3285,6 +3929,103 @@ static void SwapInt(int *a, int *b) {
     return [linebuffer_ absPositionOfFindContext:findContext_];
 }
 
+// Converts ResultRanges in the line buffer (with the screen appended) to SearchResults.
+- (void)addSearchResultsForRanges:(NSData *)ranges toArray:(NSMutableArray *)results
+{
+    const int count = ResultRangeCount(ranges);
+    if (!count) {
+        return;
+    }
+    XYRange *xyRanges = malloc(sizeof(XYRange) * count);
+    const int numConverted = [linebuffer_ convertResultRanges:[ranges bytes]
+                                                        count:count
+                                                    withWidth:currentGrid_.size.width
+                                                   toXYRanges:xyRanges];
+    const long long totalScrollbackOverflow = [self totalScrollbackOverflow];
+    for (int i = 0; i < numConverted; i++) {
+        SearchResult* result = [[SearchResult alloc] init];
+
+        result->startX = xyRanges[i].xStart;
+        result->endX = xyRanges[i].xEnd;
+        result->absStartY = xyRanges[i].yStart + totalScrollbackOverflow;
+        result->absEndY = xyRanges[i].yEnd + totalScrollbackOverflow;
+
+        [results addObject:result];
+        [result release];
+    }
+    free(xyRanges);
+}
+
+// Multiple-results searches run on background threads against a snapshot of the line buffer with
+// the screen appended. Each call reports the results found since the last one.
+- (BOOL)continueBackgroundFindAllResults:(NSMutableArray*)results
+                               inContext:(FindContext*)context
+{
+    if (!context.substring) {
+        return NO;
+    }
+    int linesPushed = [currentGrid_ appendLines:[currentGrid_ numberOfLinesUsed]
+                                   toLineBuffer:linebuffer_];
+    LineBufferSearch *search = context.backgroundSearch;
+    if (!search) {
+        LineBuffer *snapshot = [[linebuffer_ newAppendOnlyCopy] autorelease];
+        search = [[[LineBufferSearch alloc] initWithLineBuffer:snapshot
+                                                       context:context] autorelease];
+        context.backgroundSearch = search;
+        [search start];
+    }
+
+    NSMutableData *ranges = [NSMutableData data];
+    BOOL more = [search collectResults:ranges
+                         forLineBuffer:linebuffer_
+                               maxTime:context.maxTime];
+    [self addSearchResultsForRanges:ranges toArray:results];
+    [self popScrollbackLines:linesPushed];
+
+    if (!more) {
+        [context reset];
+    }
+    return more;
+}
+
+- (BOOL)continueTailFindResults:(NSMutableArray *)results
+                      inContext:(FindContext *)context
+{
+    if (!context.substring) {
+        return NO;
+    }
+    int linesPushed = [currentGrid_ appendLines:[currentGrid_ numberOfLinesUsed]
+                                   toLineBuffer:linebuffer_];
+    if (context.status != Searching) {
+        // The last pass got to the end. Pick up at the saved position, which is before the
+        // screen since lines on the screen may have changed since they were searched.
+        [linebuffer_ storeLocationOfAbsPos:savedFindContextAbsPos_ inContext:context];
+        context.status = Searching;
+    }
+
+    const int stopAt = [linebuffer_ lastPos];
+    const NSTimeInterval deadline = [NSDate timeIntervalSinceReferenceDate] + context.maxTime;
+    while (context.status == Searching) {
+        [linebuffer_ findSubstring:context stopAt:stopAt];
+        if (context.status == Matched) {
+            [self addSearchResultsForRanges:context.results toArray:results];
+            [context.results setLength:0];
+            context.status = Searching;
+        }
+        if (context.status == Searching &&
+            [NSDate timeIntervalSinceReferenceDate] > deadline) {
+            break;
+        }
+    }
+    [self popScrollbackLines:linesPushed];
+
+    if (context.status == NotFound) {
+        [self storeLastPositionInLineBufferAsFindContextSavedPosition];
+        return NO;
+    }
+    return YES;
+}
+
 - (BOOL)continueFindResultsInContext:(FindContext*)context
                              toArray:(NSMutableArray*)results
 {
@@ -3316,30 +4057,15 @@ static void SwapInt(int *a, int *b) {
             case Matched: {
                 // NSLog(@"matched");
                 // Found a match in the text.
-                NSArray *allPositions = [linebuffer_ convertPositions:context.results
-                                                            withWidth:currentGrid_.size.width];
-                int k = 0;
-                for (ResultRange* currentResultRange in context.results) {
-                    SearchResult* result = [[SearchResult alloc] init];
-
-                    XYRange* xyrange = [allPositions objectAtIndex:k++];
-
-                    result->startX = xyrange->xStart;
-                    result->endX = xyrange->xEnd;
-                    result->absStartY = xyrange->yStart + [self totalScrollbackOverflow];
-                    result->absEndY = xyrange->yEnd + [self totalScrollbackOverflow];
-
-                    [results addObject:result];
-                    [result release];
-                    if (!(context.options & FindMultipleResults)) {
-                        assert([context.results count] == 1);
-                        [context reset];
-                        keepSearching = NO;
-                    } else {
-                        keepSearching = YES;
-                    }
+                [self addSearchResultsForRanges:context.results toArray:results];
+                if (!(context.options & FindMultipleResults)) {
+                    assert(ResultRangeCount(context.results) == 1);
+                    [context reset];
+                    keepSearching = NO;
+                } else {
+                    keepSearching = YES;
                 }
-                [context.results removeAllObjects];
+                [context.results setLength:0];
                 break;
             }
 
@@ -3390,6 +4116,127 @@ static void SwapInt(int *a, int *b) {
     return keepSearching;
 }
 
+// Returns a property list describing each mark and note in |lineBuffer|, which holds the
+// scrollback and then the primary grid.
+- (NSArray *)archivedMarksInLineBuffer:(LineBuffer *)lineBuffer
+{
+    NSMutableArray *marks = [NSMutableArray array];
+    // Objects on the alt screen don't refer to lines in |lineBuffer|.
+    int limit = [self numberOfScrollbackLines];
+    if (currentGrid_ == primaryGrid_) {
+        limit += currentGrid_.size.height;
+    }
+    for (id<IntervalTreeObject> obj in [intervalTree_ allObjects]) {
+        NSMutableDictionary *dict = [NSMutableDictionary dictionary];
+        if ([obj isKindOfClass:[VT100ScreenMark class]]) {
+            dict[kArchivedMarkClass] = kArchivedMarkClassMark;
+        } else if ([obj isKindOfClass:[PTYNoteViewController class]]) {
+            dict[kArchivedMarkClass] = kArchivedMarkClassNote;
+            NSString *string = [(PTYNoteViewController *)obj string];
+            dict[kArchivedMarkString] = string ?: @"";
+        } else if ([obj isKindOfClass:[VT100WorkingDirectory class]]) {
+            dict[kArchivedMarkClass] = kArchivedMarkClassWorkingDirectory;
+            dict[kArchivedMarkString] = [(VT100WorkingDirectory *)obj workingDirectory];
+        } else if ([obj isKindOfClass:[VT100RemoteHost class]]) {
+            VT100RemoteHost *remoteHost = (VT100RemoteHost *)obj;
+            dict[kArchivedMarkClass] = kArchivedMarkClassRemoteHost;
+            if (remoteHost.hostname) {
+                dict[kArchivedMarkHostname] = remoteHost.hostname;
+            }
+            if (remoteHost.username) {
+                dict[kArchivedMarkUsername] = remoteHost.username;
+            }
+        } else {
+            continue;
+        }
+
+        VT100GridCoordRange range = [self coordRangeForInterval:obj.entry.interval];
+        VT100GridCoord last = [self predecessorOfCoord:range.end];
+        if (range.start.y < 0 || last.y >= limit) {
+            continue;
+        }
+        LineBufferPosition *start = [lineBuffer positionForCoordinate:range.start
+                                                                width:self.width
+                                                               offset:0];
+        LineBufferPosition *end = [lineBuffer positionForCoordinate:last
+                                                              width:self.width
+                                                             offset:0];
+        if (!start || !end) {
+            continue;
+        }
+        dict[kArchivedMarkStart] = @(start.absolutePosition);
+        dict[kArchivedMarkStartYOffset] = @(start.yOffset);
+        dict[kArchivedMarkEnd] = @(end.absolutePosition);
+        dict[kArchivedMarkEndYOffset] = @(end.yOffset);
+        dict[kArchivedMarkEndExtends] = @(range.end.x == self.width);
+        [marks addObject:dict];
+    }
+    return marks;
+}
+
+// Adds marks and notes from -archivedMarksInLineBuffer: to the interval tree. Their positions are
+// relative to |droppedChars|, which was the start of the archived line buffer.
+- (void)restoreMarks:(NSArray *)marks droppedChars:(long long)droppedChars
+{
+    const long long base = [[linebuffer_ firstPosition] absolutePosition] - droppedChars;
+    const int width = self.width;
+    for (NSDictionary *dict in marks) {
+        if (![dict isKindOfClass:[NSDictionary class]]) {
+            continue;
+        }
+        LineBufferPosition *start = [LineBufferPosition position];
+        start.absolutePosition = [dict[kArchivedMarkStart] longLongValue] + base;
+        start.yOffset = [dict[kArchivedMarkStartYOffset] intValue];
+        LineBufferPosition *end = [LineBufferPosition position];
+        end.absolutePosition = [dict[kArchivedMarkEnd] longLongValue] + base;
+        end.yOffset = [dict[kArchivedMarkEndYOffset] intValue];
+        if (start.absolutePosition < [[linebuffer_ firstPosition] absolutePosition]) {
+            continue;
+        }
+        BOOL startOk, endOk;
+        VT100GridCoordRange range;
+        range.start = [linebuffer_ coordinateForPosition:start width:width ok:&startOk];
+        range.end = [linebuffer_ coordinateForPosition:end width:width ok:&endOk];
+        if (!startOk || !endOk) {
+            continue;
+        }
+        // The end position is the last char in the range.
+        range.end.x++;
+        if (range.end.x > width) {
+            range.end.y++;
+            range.end.x -= width;
+        }
+        if ([dict[kArchivedMarkEndExtends] boolValue]) {
+            range.end.x = width;
+        }
+
+        NSString *className = dict[kArchivedMarkClass];
+        if ([className isEqualToString:kArchivedMarkClassNote]) {
+            PTYNoteViewController *note = [[[PTYNoteViewController alloc] init] autorelease];
+            [note setString:dict[kArchivedMarkString] ?: @""];
+            [note sizeToFit];
+            [self addNote:note inRange:range];
+            continue;
+        }
+        id<IntervalTreeObject> obj;
+        if ([className isEqualToString:kArchivedMarkClassMark]) {
+            obj = [[[VT100ScreenMark alloc] init] autorelease];
+        } else if ([className isEqualToString:kArchivedMarkClassWorkingDirectory]) {
+            VT100WorkingDirectory *workingDirectory = [[[VT100WorkingDirectory alloc] init] autorelease];
+            workingDirectory.workingDirectory = dict[kArchivedMarkString];
+            obj = workingDirectory;
+        } else if ([className isEqualToString:kArchivedMarkClassRemoteHost]) {
+            VT100RemoteHost *remoteHost = [[[VT100RemoteHost alloc] init] autorelease];
+            remoteHost.hostname = dict[kArchivedMarkHostname];
+            remoteHost.username = dict[kArchivedMarkUsername];
+            obj = remoteHost;
+        } else {
+            continue;
+        }
+        [intervalTree_ addObject:obj withInterval:[self intervalForGridCoordRange:range]];
+    }
+}
+
 #pragma mark - PTYNoteViewControllerDelegate
 
 - (void)noteDidRequestRemoval:(PTYNoteViewController *)note {
@@ -6,6 +6,10 @@
 // Screen contents have become dirty and should be redrawn right away.
 - (void)screenNeedsRedraw;
 
+// The screen switched between its primary and alternate grids. Like -screenNeedsRedraw, except
+// that what was drawn for the grid now showing, the last time it was shown, may be reused.
+- (void)screenDidSwitchGrids;
+
 // Update window title, tab colors, and redraw view.
 - (void)screenUpdateDisplay;
 
@@ -24,6 +28,10 @@
 // Called after text was added to the current line. Can be used to check triggers.
 - (void)screenDidAppendStringToCurrentLine:(NSString *)string;
 
+// Like screenDidAppendStringToCurrentLine: for |length| ASCII chars, which are only made into a
+// string if something needs one.
+- (void)screenDidAppendAsciiBytesToCurrentLine:(const unsigned char *)bytes length:(int)length;
+
 // Change the cursor's appearance.
 - (void)screenSetCursorBlinking:(BOOL)blink;
 - (void)screenSetCursorType:(ITermCursorType)type;
@@ -129,7 +137,7 @@
 // Request that the currently visible area of the screen be sent for printing.
 - (void)screenPrintVisibleArea;
 
-// Returns if iTermTabContentsChanged notifications should be published when the view is updated.
+// Returns if changes should be reported to the ContentsChangeFeed when the view is updated.
 - (BOOL)screenShouldSendContentsChangedNotification;
 
 // PTYTextView deselect
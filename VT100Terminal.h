@@ -7,7 +7,10 @@
 #import "VT100Grid.h"
 #import "VT100TerminalDelegate.h"
 
+@class VT100PasteboardCapture;
+
 typedef struct VT100TCC VT100TCC;
+typedef struct VT100CSIParser VT100CSIParser;
 
 typedef enum {
     MOUSE_FORMAT_XTERM = 0,       // Regular 1000 mode
@@ -47,6 +50,25 @@ typedef enum {
 #define NUM_CHARSETS 4  // G0...G3. Values returned from -charset go from 0 to this.
 #define NUM_MODIFIABLE_RESOURCES 5
 
+// A run of tokens decoded by -tokenBatchFromData:... (possibly off the main thread), to be applied
+// on the main thread with -executeTokenAtIndex:inBatch:.
+@interface VT100TokenBatch : NSObject
+
+@property(nonatomic, readonly) int numberOfTokens;
+
+// Number of bytes at the start of the input that the tokens cover. Anything after that is an
+// incomplete token.
+@property(nonatomic, readonly) int numberOfBytesConsumed;
+
+// If a token hands the stream over to tmux, tokenization stops after it and the rest of the input
+// goes here. It must not be parsed as terminal output.
+@property(nonatomic, readonly) NSData *unparsedData;
+
+// How long tokenizing took.
+@property(nonatomic, readonly) NSTimeInterval parseDuration;
+
+@end
+
 @interface VT100Terminal : NSObject <VT100GridDelegate>
 {
     NSString          *termType;
@@ -85,6 +107,10 @@ typedef enum {
     ColorMode bgColorMode_;
     BOOL bold_, italic_, under_, blink_, reversed_;
 
+    // Cached result of -characterTemplate. Cleared whenever any of the above change.
+    screen_char_t characterTemplate_;
+    BOOL characterTemplateValid_;
+
     BOOL saveBold_, saveItalic_, saveUnder_, saveBlink_, saveReversed_;
     int saveCharset_;
     int saveForeground_;
@@ -103,6 +129,12 @@ typedef enum {
 
     int streamOffset_;
 
+    // While non-nil, stream_ points into this object's bytes instead of an owned buffer. See
+    // -putStreamDataWithoutCopying:.
+    NSData *borrowedStreamData_;
+    unsigned char *ownedStream_;
+    int ownedStreamLength_;
+
     BOOL isAnsi_;
     BOOL disableSmcupRmcup_;
     BOOL useCanonicalParser_;
@@ -115,6 +147,13 @@ typedef enum {
     int sendModifiers_[NUM_MODIFIABLE_RESOURCES];
 
     VT100TCC *lastToken_;
+
+    // Saved state of the CSI parser while a sequence is split across reads.
+    VT100CSIParser *csiParser_;
+
+    // The OSC 52 or CopyToClipboard payload being read, if any. Belongs to whichever thread is
+    // tokenizing: the parse queue's worker, or the main thread in -parseNextToken.
+    VT100PasteboardCapture *pasteboardCapture_;
 }
 
 @property(nonatomic, assign) id<VT100TerminalDelegate> delegate;
@@ -126,6 +165,30 @@ typedef enum {
 
 - (void)putStreamData:(NSData*)data;
 
+// Like putStreamData:, but parses directly out of |data| when there is no partially parsed token
+// left over from earlier input. |data| is retained until -stopBorrowingStreamData is called, which
+// copies whatever was not parsed yet into the terminal's own buffer. Callers must call
+// -stopBorrowingStreamData before the bytes in |data| change.
+- (void)putStreamDataWithoutCopying:(NSData *)data;
+- (void)stopBorrowingStreamData;
+
+// Decodes as many complete tokens from |data| as possible without changing any terminal state, so
+// it may be called on any thread. Values that the parser would normally ask the delegate for are
+// passed in, and control characters embedded in escape sequences become tokens of their own.
+- (VT100TokenBatch *)tokenBatchFromData:(NSData *)data
+                         terminalHeight:(int)terminalHeight
+                  useColumnScrollRegion:(BOOL)useColumnScrollRegion;
+
+// Makes the |index|th token of |batch| the last token, updates modes and attributes from it as
+// -parseNextToken would have, and executes it. Main thread only.
+- (void)executeTokenAtIndex:(int)index inBatch:(VT100TokenBatch *)batch;
+
+// Flood mode. Lines of plain text and colors starting at the |index|th token of |batch| that would
+// scroll off the screen before the batch is done go straight to the scrollback, never touching the
+// screen. Triggers still see them. Returns the index of the first token left for
+// -executeTokenAtIndex:inBatch:, which is |index| if nothing could be skipped.
+- (int)fastForwardTokensInBatch:(VT100TokenBatch *)batch fromIndex:(int)index;
+
 // Returns true if a new token was parsed, false if there was nothing left to do.
 - (BOOL)parseNextToken;
 - (NSData *)streamData;
@@ -171,6 +234,11 @@ typedef enum {
 - (screen_char_t)foregroundColorCodeReal;
 - (screen_char_t)backgroundColorCodeReal;
 
+// A character with no code whose colors and attributes are the ones new text should get; the
+// combination of -foregroundColorCode and -backgroundColorCode. It's recomputed only after the
+// attributes change, so it's cheap to call for every string appended.
+- (screen_char_t)characterTemplate;
+
 - (NSData *)reportActivePositionWithX:(int)x Y:(int)y withQuestion:(BOOL)q;
 
 - (void)setDisableSmcupRmcup:(BOOL)value;
@@ -191,6 +259,7 @@ typedef enum {
 
 // Inspect previous parsed token. Can use after -parseNextToken returns YES.
 - (BOOL)lastTokenWasASCII;
+- (BOOL)lastTokenWasLinefeed;
 - (NSString *)lastTokenString;
 
 @end
@@ -1,11 +1,53 @@
 #import "VT100Terminal.h"
+#import "BinaryLog.h"
 #import "DebugLogging.h"
+#import "LegacyEncodingTable.h"
+#import "VT100PasteboardCapture.h"
 #import <apr-1/apr_base64.h>  // for xterm's base64 decoding (paste64)
 #include <term.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define STANDARD_STREAM_SIZE 100000
 #define MAX_XTERM_TEMP_BUFFER_LENGTH 1024
 
+// Clipboard payloads are cut off here, as PTYSession does for CopyToClipboard.
+static const NSUInteger kMaxPasteboardCaptureBytes = 100 * 1024 * 1024;
+
+@interface VT100TokenBatch ()
+- (id)initWithData:(NSData *)data;
+- (void)appendToken:(VT100TCC *)token isControl:(BOOL)isControl;
+- (VT100TCC *)tokenAtIndex:(int)index;
+- (BOOL)tokenAtIndexIsControl:(int)index;
+- (void)setNumberOfBytesConsumed:(int)numberOfBytesConsumed;
+- (void)setUnparsedData:(NSData *)unparsedData;
+- (void)setParseDuration:(NSTimeInterval)parseDuration;
+@end
+
+// Stands in for the terminal's delegate while tokenizing off the main thread. The parser calls the
+// delegate for control characters embedded in escape sequences; this turns those calls into tokens
+// that are replayed in order on the main thread. Embedded tokens are held until the containing token
+// turns out to be complete, since an incomplete token gets re-parsed once more data arrives.
+@interface VT100DeferredTerminalDelegate : NSObject {
+    VT100TokenBatch *batch_;
+    unsigned char *position_;
+    VT100TCC *pending_;
+    int numPending_;
+    int pendingCapacity_;
+    int terminalHeight_;
+    BOOL useColumnScrollRegion_;
+}
+- (id)initWithBatch:(VT100TokenBatch *)batch
+     terminalHeight:(int)terminalHeight
+useColumnScrollRegion:(BOOL)useColumnScrollRegion;
+- (void)beginTokenAt:(unsigned char *)position;
+- (void)commitPendingTokens;
+- (void)discardPendingTokens;
+@end
+
 @implementation VT100Terminal {
     // True if between BeginFile and EndFile codes.
     BOOL receivingFile_;
@@ -40,6 +82,7 @@
 #define isSJISEncoding(e)   ((e)==0x80000628 || (e)==0x80000a01)
 #define isKREncoding(e)     ((e)==0x80000422 || (e)==0x80000003|| \
                              (e)==0x80000840 || (e)==0x80000940)
+#define kGB18030Encoding    0x80000632
 #define ESC  0x1b
 #define DEL  0x7f
 
@@ -336,6 +379,8 @@ typedef enum {
 
     // iTerm extension
     ITERM_GROWL,
+    ITERM_CAPTURED_PASTE64,      // The decoded payload of an OSC 52, read by a VT100PasteboardCapture.
+    ITERM_CAPTURED_COPY_TEXT,    // Everything between CopyToClipboard and EndCopy.
     DCS_TMUX,
 } VT100TerminalTokenType;
 
@@ -345,9 +390,10 @@ struct VT100TCC {
     unsigned char *position;  // Pointer into stream of where this token's data began.
     int length;  // Length of parsed data in stream.
     union {
-        NSString *string;  // For VT100_STRING, VT100_ASCIISTRING
+        NSString *string;  // For VT100_STRING. VT100_ASCIISTRING's chars are its bytes in the stream.
         unsigned char code;  // For VT100_UNKNOWNCHAR and VT100CSI_SCS0...SCS3.
         CSIParam csi;  // 'cmd' not used here.
+        NSMutableData *data;  // For ITERM_CAPTURED_PASTE64 and ITERM_CAPTURED_COPY_TEXT.
     } u;
 };
 
@@ -356,17 +402,13 @@ struct VT100TCC {
 static BOOL isCSI(unsigned char *, int);
 static BOOL isXTERM(unsigned char *, int);
 static BOOL isString(unsigned char *, NSStringEncoding);
-static int getCSIParam(unsigned char *, int, CSIParam *, id<VT100TerminalDelegate>);
-static int getCSIParamCanonically(unsigned char *, int, CSIParam *, id<VT100TerminalDelegate>);
-static VT100TCC decode_csi(unsigned char *, int, int *, id<VT100TerminalDelegate>);
-static VT100TCC decode_csi_canonically(unsigned char *, int, int *, id<VT100TerminalDelegate>);
+static VT100TCC decode_csi(unsigned char *, int, int *, VT100CSIParser *, id<VT100TerminalDelegate>);
+static VT100TCC decode_csi_canonically(unsigned char *, int, int *, VT100CSIParser *, id<VT100TerminalDelegate>);
 static VT100TCC decode_xterm(unsigned char *, int, int *,NSStringEncoding);
 static VT100TCC decode_ansi(unsigned char *,int, int *, id<VT100TerminalDelegate>);
 static VT100TCC decode_other(unsigned char *, int, int *, NSStringEncoding);
-static VT100TCC decode_control(unsigned char *, int, int *, NSStringEncoding, id<VT100TerminalDelegate>, BOOL);
+static VT100TCC decode_control(unsigned char *, int, int *, NSStringEncoding, VT100CSIParser *, id<VT100TerminalDelegate>, BOOL);
 static VT100TCC decode_utf8(unsigned char *, int, int *);
-static VT100TCC decode_euccn(unsigned char *, int, int *);
-static VT100TCC decode_big5(unsigned char *,int, int *);
 static VT100TCC decode_string(unsigned char *, int, int *,
                               NSStringEncoding);
 
@@ -437,539 +479,328 @@ static BOOL isString(unsigned char *code,
     return result;
 }
 
-static int advanceAndEatControlChars(unsigned char **ppdata,
-                                     int *pdatalen,
-                                     id<VT100TerminalDelegate> delegate)
-{
-    // return value represent "continuous" state.
-    // If it is YES, current control sequence parsing process was not canceled.
-    // If it is NO, current control sequence parsing process was canceled by CAN, SUB, or ESC.
-    while (*pdatalen > 0) {
-        ++*ppdata;
-        --*pdatalen;
-        switch (**ppdata) {
-            case VT100CC_ENQ:
-                // TODO: send answerback if it is needed
-                break;
-            case VT100CC_BEL:
-                [delegate terminalRingBell];
-                break;
-            case VT100CC_BS:
-                [delegate terminalBackspace];
-                break;
-            case VT100CC_HT:
-                [delegate terminalAppendTabAtCursor];
-                break;
-            case VT100CC_LF:
-            case VT100CC_VT:
-            case VT100CC_FF:
-                [delegate terminalLineFeed];
-                break;
-            case VT100CC_CR:
-                [delegate terminalCarriageReturn];
-                break;
-            case VT100CC_SO:
-                // TODO: ISO-2022 mode terminal should implement SO
-                break;
-            case VT100CC_SI:
-                // TODO: ISO-2022 mode terminal should implement SI
-                break;
-            case VT100CC_DC1:
-                break;
-            case VT100CC_DC3:
-                break;
-            case VT100CC_CAN:
-            case VT100CC_SUB:
-            case VT100CC_ESC:
-                return NO;
-            case VT100CC_DEL:
-                [delegate terminalDeleteCharactersAtCursor:1];
-                break;
-            default:
-                if (**ppdata >= 0x20)
-                    return YES;
-                break;
-        }
-    }
-    return YES;
-}
+// CSI sequences are parsed by a table-driven state machine modeled on the DEC parser states
+// described at http://www.vt100.net/emu/dec_ansi_parser. Every byte is mapped to a class and
+// the (state, class) pair picks an action and the next state. The machine's state lives in a
+// VT100CSIParser, so when a sequence is split across reads parsing resumes where it left off
+// instead of starting over at the ESC (which also kept executing embedded control characters
+// once per attempt).
+//
+// ECMA-48 5.4 describes the bytes of a control sequence:
+//
+// CSI P...P I...I F
+//
+// Parameter bytes are 0x30-0x3f. In DEC VT-series and derived emulators the first of them may
+// be a private prefix ('<', '=', '>', or '?'; ECMA-48 5.4.2 (d) reserves 03/12 to 03/15 except
+// as the first byte of the parameter string), as in "CSI ? Ps h" or "CSI > Ps c". Parameters
+// are separated by ';' and may have ':'-separated sub-parameters, as in "CSI 38 : 2 : R : G : B m".
+// Intermediate bytes are 0x20-0x2f and the final byte is 0x40-0x7e.
+//
+// The command is packed into CSIParam.cmd from the prefix byte, the intermediate bytes, and the
+// final byte. For example, DECRQM "ESC [ ? 3 6 $ p" has prefix '?', parameters [ 36 ],
+// intermediate '$', and final 'p', giving (((0x3f << 8) | 0x24) << 8) | 0x70. This value is
+// unique for each control function.
+//
+// Like xterm, rxvt, PuTTY, MinTTY, mlterm, and TeraTerm, we skip "garbage" bytes before the final
+// byte, but a sequence that contains any is unrecognized. C0 controls in the middle of a sequence
+// are executed in place; CAN, SUB, and ESC cancel it.
 
-static int getCSIParam(unsigned char *datap,
-                       int datalen,
-                       CSIParam *param, id<VT100TerminalDelegate> delegate)
-{
-    int i;
-    BOOL unrecognized=NO;
-    unsigned char *orgp = datap;
-    BOOL readNumericParameter = NO;
+typedef enum {
+    kCSIClassExecute,       // C0 controls and DEL, which are acted on immediately
+    kCSIClassCancel,        // CAN, SUB, and ESC
+    kCSIClassDigit,         // 0-9
+    kCSIClassColon,         // Separates sub-parameters
+    kCSIClassSemicolon,     // Separates parameters
+    kCSIClassPrefix,        // < = > ?
+    kCSIClassIntermediate,  // 0x20-0x2f
+    kCSIClassFinal,         // 0x40-0x7e
+    kCSIClassHigh,          // 0x80-0xff
+    kCSINumberOfClasses
+} CSIByteClass;
 
-    NSCParameterAssert(datap != NULL);
-    NSCParameterAssert(datalen >= 2);
-    NSCParameterAssert(param != NULL);
+typedef enum {
+    kCSIStateEntry,         // Just after "ESC ["
+    kCSIStateParam,         // Reading parameters
+    kCSIStateIntermediate,  // Reading intermediate bytes
+    kCSIStateIgnore,        // Malformed; skipping to the final byte
+    kCSINumberOfStates
+} CSIParserState;
 
-    param->count = 0;
-    param->cmd = 0;
-    for (i = 0; i < VT100CSIPARAM_MAX; ++i )
-        param->p[i] = -1;
+typedef enum {
+    kCSIActionExecute,
+    kCSIActionCancel,
+    kCSIActionDigit,
+    kCSIActionSubParameter,
+    kCSIActionSeparator,
+    kCSIActionPrefix,
+    kCSIActionIntermediate,
+    kCSIActionFinal,
+    kCSIActionMalformed,  // Mark the sequence unrecognized and keep going.
+} CSIParserAction;
 
-    NSCParameterAssert(datap[0] == ESC);
-    NSCParameterAssert(datap[1] == '[');
-    datap += 2;
-    datalen -= 2;
+typedef struct {
+    unsigned char action;
+    unsigned char nextState;
+} CSITransition;
+
+struct VT100CSIParser {
+    BOOL active;  // A sequence has been partially parsed.
+    CSIParserState state;
+    int consumed;  // Bytes of the sequence parsed so far, including "ESC [".
+    CSIParam param;
+    int number;  // Value of the parameter being read, valid if inNumber.
+    BOOL inNumber;
+    BOOL readNumericParameter;
+    BOOL isSub;
+    BOOL sawSubParameter;
+    BOOL unrecognized;
+    int commandBytesCount;  // Number of intermediate and final bytes in cmd.
+    unsigned char prefix;  // Private prefix byte, or 0.
+    int unprefixedCmd;  // Same as param.cmd but without the prefix.
+};
 
-    if (datalen > 0 && *datap == '?') {
-        param->question = YES;
-        datap ++;
-        datalen --;
-    } else if (datalen > 0 && *datap == '>') {
-        // check for secondary device attribute modifier
-        param->modifier = '>';
-        param->question = NO;
-        datap++;
-        datalen--;
-    } else {
-        param->question = NO;
-    }
+static const unsigned char kCSIByteClasses[256] = {
+    [0x00 ... 0x17] = kCSIClassExecute,
+    [0x18] = kCSIClassCancel,
+    [0x19] = kCSIClassExecute,
+    [0x1a ... 0x1b] = kCSIClassCancel,
+    [0x1c ... 0x1f] = kCSIClassExecute,
+    [0x20 ... 0x2f] = kCSIClassIntermediate,
+    [0x30 ... 0x39] = kCSIClassDigit,
+    [0x3a] = kCSIClassColon,
+    [0x3b] = kCSIClassSemicolon,
+    [0x3c ... 0x3f] = kCSIClassPrefix,
+    [0x40 ... 0x7e] = kCSIClassFinal,
+    [0x7f] = kCSIClassExecute,
+    [0x80 ... 0xff] = kCSIClassHigh,
+};
 
-    while (datalen > 0) {
-        if (isdigit(*datap)) {
-            int n = *datap - '0';
-            datap++;
-            datalen--;
+#define CSI_TRANSITION(action, state) { kCSIAction##action, kCSIState##state }
+
+static const CSITransition kCSITransitions[kCSINumberOfStates][kCSINumberOfClasses] = {
+    [kCSIStateEntry] = {
+        [kCSIClassExecute] = CSI_TRANSITION(Execute, Entry),
+        [kCSIClassCancel] = CSI_TRANSITION(Cancel, Entry),
+        [kCSIClassDigit] = CSI_TRANSITION(Digit, Param),
+        [kCSIClassColon] = CSI_TRANSITION(SubParameter, Param),
+        [kCSIClassSemicolon] = CSI_TRANSITION(Separator, Param),
+        [kCSIClassPrefix] = CSI_TRANSITION(Prefix, Param),
+        [kCSIClassIntermediate] = CSI_TRANSITION(Intermediate, Intermediate),
+        [kCSIClassFinal] = CSI_TRANSITION(Final, Entry),
+        [kCSIClassHigh] = CSI_TRANSITION(Malformed, Ignore),
+    },
+    [kCSIStateParam] = {
+        [kCSIClassExecute] = CSI_TRANSITION(Execute, Param),
+        [kCSIClassCancel] = CSI_TRANSITION(Cancel, Entry),
+        [kCSIClassDigit] = CSI_TRANSITION(Digit, Param),
+        [kCSIClassColon] = CSI_TRANSITION(SubParameter, Param),
+        [kCSIClassSemicolon] = CSI_TRANSITION(Separator, Param),
+        [kCSIClassPrefix] = CSI_TRANSITION(Malformed, Param),
+        [kCSIClassIntermediate] = CSI_TRANSITION(Intermediate, Intermediate),
+        [kCSIClassFinal] = CSI_TRANSITION(Final, Entry),
+        [kCSIClassHigh] = CSI_TRANSITION(Malformed, Ignore),
+    },
+    [kCSIStateIntermediate] = {
+        [kCSIClassExecute] = CSI_TRANSITION(Execute, Intermediate),
+        [kCSIClassCancel] = CSI_TRANSITION(Cancel, Entry),
+        [kCSIClassDigit] = CSI_TRANSITION(Malformed, Ignore),
+        [kCSIClassColon] = CSI_TRANSITION(Malformed, Ignore),
+        [kCSIClassSemicolon] = CSI_TRANSITION(Malformed, Ignore),
+        [kCSIClassPrefix] = CSI_TRANSITION(Malformed, Ignore),
+        [kCSIClassIntermediate] = CSI_TRANSITION(Intermediate, Intermediate),
+        [kCSIClassFinal] = CSI_TRANSITION(Final, Entry),
+        [kCSIClassHigh] = CSI_TRANSITION(Malformed, Ignore),
+    },
+    [kCSIStateIgnore] = {
+        [kCSIClassExecute] = CSI_TRANSITION(Execute, Ignore),
+        [kCSIClassCancel] = CSI_TRANSITION(Cancel, Entry),
+        [kCSIClassDigit] = CSI_TRANSITION(Malformed, Ignore),
+        [kCSIClassColon] = CSI_TRANSITION(Malformed, Ignore),
+        [kCSIClassSemicolon] = CSI_TRANSITION(Malformed, Ignore),
+        [kCSIClassPrefix] = CSI_TRANSITION(Malformed, Ignore),
+        [kCSIClassIntermediate] = CSI_TRANSITION(Malformed, Ignore),
+        [kCSIClassFinal] = CSI_TRANSITION(Final, Entry),
+        [kCSIClassHigh] = CSI_TRANSITION(Malformed, Ignore),
+    },
+};
 
-            while (datalen > 0 && isdigit(*datap)) {
-                if (n > (INT_MAX - 10) / 10) {
-                    param->cmd = 0xff;
-                    unrecognized = YES;
-                }
-                n = n * 10 + *datap - '0';
+static void ResetCSIParser(VT100CSIParser *parser)
+{
+    memset(parser, 0, sizeof(*parser));
+    for (int i = 0; i < VT100CSIPARAM_MAX; ++i) {
+        parser->param.p[i] = -1;
+    }
+}
 
-                datap++;
-                datalen--;
-            }
-            if (param->count < VT100CSIPARAM_MAX) {
-                param->p[param->count] = n;
-            }
-            // increment the parameter count
-            param->count++;
-
-            // set the numeric parameter flag
-            readNumericParameter = YES;
-        } else if (*datap == ';') {
-            datap++;
-            datalen--;
-
-            // If we got an implied (blank) parameter, increment the parameter count again
-            if (readNumericParameter == NO)
-                param->count++;
-            // reset the parameter flag
-            readNumericParameter = NO;
-        } else if (isalpha(*datap)||*datap=='@') {
-            datalen--;
-            param->cmd = unrecognized?0xff:*datap;
-            datap++;
-            break;
-        } else if (*datap == ' ') {
-            datap++;
-            datalen--;
-            switch (*datap) {
-                case 'q':
-                    param->cmd = MAKE_CSI_COMMAND(' ', 'q');
-                    datap++;
-                    datalen--;
-                    return datap - orgp;
-                default:
-                    //NSLog(@"Unrecognized sequence: CSI SP %c (0x%x)", *datap, *datap);
-                    datap++;
-                    datalen--;
-                    param->cmd = 0xff;
-                    break;
-            }
-        } else if (*datap=='\'') {
-            datap++;
-            datalen--;
-            switch (*datap) {
-                case 'z':
-                case '|':
-                case 'w':
-                    //NSLog(@"Unsupported locator sequence");
-                    param->cmd=0xff;
-                    datap++;
-                    datalen--;
-                    break;
-                default:
-                    //NSLog(@"Unrecognized locator sequence");
-                    datap++;
-                    datalen--;
-                    param->cmd=0xff;
-                    break;
-            }
+static void ExecuteCSIControlCharacter(unsigned char c, id<VT100TerminalDelegate> delegate)
+{
+    switch (c) {
+        case VT100CC_ENQ:
+            // TODO: send answerback if it is needed
             break;
-        } else if (*datap=='&') {
-            datap++;
-            datalen--;
-            switch (*datap) {
-                case 'w':
-                    //NSLog(@"Unsupported locator sequence");
-                    param->cmd=0xff;
-                    datap++;
-                    datalen--;
-                    break;
-                default:
-                    //NSLog(@"Unrecognized locator sequence");
-                    datap++;
-                    datalen--;
-                    param->cmd=0xff;
-                    break;
-            }
+        case VT100CC_BEL:
+            [delegate terminalRingBell];
             break;
-        } else if (*datap == '!') {
-            datap++;
-            datalen--;
-            if (datalen == 0) {
-                return -1;
-            }
-            switch (*datap) {
-                case 'p':
-                    param->cmd = MAKE_CSI_COMMAND('!', 'p');
-                    datap++;
-                    datalen--;
-                    return datap - orgp;
-                default:
-                    datap++;
-                    datalen--;
-                    param->cmd=0xff;
-                    break;
-            }
-        } else {
-            switch (*datap) {
-                case VT100CC_ENQ:
-                    break;
-                case VT100CC_BEL:
-                    [delegate terminalRingBell];
-                    break;
-                case VT100CC_BS:
-                    [delegate terminalBackspace];
-                    break;
-                case VT100CC_HT:
-                    [delegate terminalAppendTabAtCursor];
-                    break;
-                case VT100CC_LF:
-                case VT100CC_VT:
-                case VT100CC_FF:
-                    [delegate terminalLineFeed];
-                    break;
-                case VT100CC_CR:
-                    [delegate terminalCarriageReturn];
-                    break;
-                case VT100CC_SO:
-                case VT100CC_SI:
-                case VT100CC_DC1:
-                case VT100CC_DC3:
-                case VT100CC_CAN:
-                case VT100CC_SUB:
-                    break;
-                case VT100CC_DEL:
-                    [delegate terminalDeleteCharactersAtCursor:1];
-                    break;
-                default:
-                    // Unrecognized escape sequence.
-                    param->cmd = 0xff;
-                    unrecognized = YES;
-                    break;
-            }
-            if (unrecognized == NO) {
-                datalen--;
-                datap++;
-            }
-        }
-        if (unrecognized) {
+        case VT100CC_BS:
+            [delegate terminalBackspace];
+            break;
+        case VT100CC_HT:
+            [delegate terminalAppendTabAtCursor];
+            break;
+        case VT100CC_LF:
+        case VT100CC_VT:
+        case VT100CC_FF:
+            [delegate terminalLineFeed];
+            break;
+        case VT100CC_CR:
+            [delegate terminalCarriageReturn];
+            break;
+        case VT100CC_SO:
+            // TODO: ISO-2022 mode terminal should implement SO
+            break;
+        case VT100CC_SI:
+            // TODO: ISO-2022 mode terminal should implement SI
+            break;
+        case VT100CC_DEL:
+            [delegate terminalDeleteCharactersAtCursor:1];
+            break;
+        default:
             break;
-        }
     }
-    return datap - orgp;
 }
 
-static int getCSIParamCanonically(unsigned char *datap,
-                                  int datalen,
-                                  CSIParam *param,
-                                  id<VT100TerminalDelegate> delegate)
+// Stores the number that was being read, if any, as a parameter or sub-parameter.
+static void FinishCSINumber(VT100CSIParser *parser)
 {
-    int i;
-    BOOL unrecognized = NO;
-    unsigned char *orgp = datap;
-    BOOL readNumericParameter = NO;
-    size_t commandBytesCount = 0;
+    if (!parser->inNumber) {
+        return;
+    }
+    parser->inNumber = NO;
+    CSIParam *param = &parser->param;
+    if (parser->isSub) {
+        const int paramNum = param->count - 1;
+        if (paramNum >= 0 &&
+            paramNum < VT100CSIPARAM_MAX &&
+            param->subCount[paramNum] < VT100CSISUBPARAM_MAX) {
+            param->sub[paramNum][param->subCount[paramNum]++] = parser->number;
+        }
+    } else if (param->count < VT100CSIPARAM_MAX) {
+        param->p[param->count++] = parser->number;
+    }
+    parser->readNumericParameter = YES;
+}
 
+// Parses the CSI sequence at |datap|, which begins with "ESC [", resuming from |parser|'s saved
+// state if it was left waiting on an earlier call. Returns the number of bytes consumed and
+// fills in |paramOut|. Its cmd is 0 if more data is needed and 0xff if the sequence was
+// malformed or canceled.
+static int parse_csi(unsigned char *datap,
+                     int datalen,
+                     VT100CSIParser *parser,
+                     CSIParam *paramOut,
+                     id<VT100TerminalDelegate> delegate)
+{
     NSCParameterAssert(datap != NULL);
     NSCParameterAssert(datalen >= 2);
-    NSCParameterAssert(param != NULL);
-
-    param->count = 0;
-
-    // 2013/1/10 H.Saito
-    //
-    // The dispatching method for control functions becomes more simply and efficiently.
-    // VT100TCC.u.csi.modifier and VT100TCC.u.csi.question flags are dropped.
-    // Now they are aggregated with VT100TCC.u.csi.cmd parameter.
-    //
-    // cmd parameter consists of following bytes:
-    // - Parameter Prefix Byte (if present, range: \x3a-\x3f)
-    // - Intermediate Bytes (if present, range: \x20-\x2f)
-    // - Final byte (range: \x40-\x3e)
-    //
-    // Example: DECRQM sequence
-    // http://www.vt100.net/docs/vt510-rm/DECRQM
-    //
-    // ESC [ ? 3 6 $ p
-    //
-    // it can be parsed as...
-    //
-    // Parameter Prefix Byte --> '?' (\x3c)
-    // Parameters            --> [ 36 ]
-    // Intermediate Bytes    --> '$' (\x24)
-    // Final Byte            --> 'p' (\x70)
-    //
-    // With this case, packed cmd value is calculated as follows:
-    //
-    // (((0x3c << 8) | 0x24) << 8) | 0x70 = 3941488
-    //
-    // This value is always unique for each command functions.
-    //
-    const size_t COMMAND_BYTES_MAX = sizeof(param->cmd) / sizeof(*datap) + 1;
-    param->cmd = 0;
-
-    for (i = 0; i < VT100CSIPARAM_MAX; ++i ) {
-        param->p[i] = -1;
-    }
-
-    NSCParameterAssert(*datap == ESC);
-    datap++;
-    datalen--;
-
-    NSCParameterAssert(*datap == '[');
+    NSCParameterAssert(datap[0] == ESC);
+    NSCParameterAssert(datap[1] == '[');
 
-    if (!advanceAndEatControlChars(&datap, &datalen, delegate)) {
-        goto cancel;
+    if (!parser->active || parser->consumed > datalen) {
+        ResetCSIParser(parser);
+        parser->active = YES;
+        parser->consumed = 2;
     }
 
-    // Now we parse Parameter Bytes (ECMA-48, 5.4 - (b))
-    //
-    // CSI P...P I...I F
-    //     ^
-    //
-    // Parameter Bytes, which, if present, consist of bit combinations from \x30 to \x3f;
-    //
-    //     1. In DEC VT-series and some derived emulators,
-    //        the first 1 byte of P-bytes is sometimes treated as prefix.
-    //
-    //        ECMA-48, 5.4.2 - (d) says that;
-    //
-    //          > Bit combinations 03/12 to 03/15 are reserved for future
-    //          > standardization except when used as the first bit combination
-    //          > of the parameter string.
-    //
-    //          note: ECMA-48 is to write ascii codes as (decimal top nibble)/(decimal lower nibble),
-    //                and that a value like 03/15 = 0x3f (see ECMA-48, 4.1).
-    //
-    //        This description suggests that if the first byte of parameter bytes is one of
-    //        '<', '=', '>', '?' (\x3c-\x3f), it's well-formed and could be considered
-    //        as private CSI extention.
-    //
-    //        Example:
-    //
-    //          In DEC VT-series, '?' prefix is commonly used by such as DEC specific private modes.
-    //          "CSI > Ps c" is interpreted as the request of Secondary Device attributes(DA2).
-    //          In some highter version of VT treats "CSI = Ps c" as the request of Tirnary Device attributes(DA3).
-    //          The terminal emulator Tera Term and RLogin use '<'-prefixed extensions for IME support.
-    //          "CSI < Ps t" means "change the IME open/close state".
-    //          ref: supported control functions by Tera Term
-    //          http://ttssh2.sourceforge.jp/manual/en/about/ctrlseq.html
-    //
-    if (datalen > 0) {
-        switch (*datap) {
-            case '<':
-            case '=':
-            case '>':
-            case '?':
-                param->cmd = *datap;
-                if (!advanceAndEatControlChars(&datap, &datalen, delegate))
-                    goto cancel;
-                break;
-            default:
-                break;
-        }
-    }
-
-    //     2. parse parameters
-    //        Typically, it consists of '0'-'9' or ';'. If there are sub parameters, they'll
-    //        be colon-delimited. <parameter>:<sub 1>:<sub 2>:<sub 3>...:<sub N>
-    //        '<', '=', '>', '?' should be ignored, but if current sequence contains them,
-    //        this sequence should be mark as unrecognized.
-    BOOL isSub = NO;
-    while (datalen > 0 && *datap >= 0x30 && *datap <= 0x3f) {
-        switch (*datap) {
-            case '0':
-            case '1':
-            case '2':
-            case '3':
-            case '4':
-            case '5':
-            case '6':
-            case '7':
-            case '8':
-            case '9':
-            {
-                int n = 0;
-                while (datalen > 0 && *datap >= '0' && *datap <= '9') {
-                    if (n > (INT_MAX - 10) / 10) {
-                        unrecognized = YES;
-                    }
-                    n = n * 10 + *datap - '0';
-                    if (!advanceAndEatControlChars(&datap, &datalen, delegate)) {
-                        goto cancel;
-                    }
+    const int kCommandBytesMax = sizeof(parser->param.cmd) / sizeof(*datap) + 1;
+    CSIParam *param = &parser->param;
+    CSIParserState state = parser->state;
+    int i = parser->consumed;
+    while (i < datalen) {
+        const unsigned char c = datap[i];
+        const CSITransition transition = kCSITransitions[state][kCSIByteClasses[c]];
+        state = transition.nextState;
+        switch (transition.action) {
+            case kCSIActionDigit:
+                if (!parser->inNumber) {
+                    parser->inNumber = YES;
+                    parser->number = 0;
                 }
-                
-                if (isSub) {
-                    const int paramNum = param->count - 1;
-                    assert(paramNum >= 0 && paramNum < VT100CSIPARAM_MAX);
-                    int subParamNum = param->subCount[paramNum];
-                    if (subParamNum < VT100CSISUBPARAM_MAX) {
-                        param->sub[paramNum][subParamNum] = n;
-                        param->subCount[paramNum]++;
-                    }
-                } else if (param->count < VT100CSIPARAM_MAX) {
-                    param->p[param->count] = n;
-                    // increment the parameter count
-                    param->count++;
+                if (parser->number > (INT_MAX - 10) / 10) {
+                    parser->unrecognized = YES;
+                } else {
+                    parser->number = parser->number * 10 + c - '0';
                 }
-
-                // set the numeric parameter flag
-                readNumericParameter = YES;
-
                 break;
-            }
 
-            case ';':
+            case kCSIActionSeparator:
+                FinishCSINumber(parser);
                 // If we got an implied (blank) parameter, increment the parameter count again
-                if (param->count < VT100CSIPARAM_MAX && readNumericParameter == NO) {
+                if (param->count < VT100CSIPARAM_MAX && !parser->readNumericParameter) {
                     param->count++;
                 }
-                // reset the parameter flag
-                readNumericParameter = NO;
+                parser->readNumericParameter = NO;
+                parser->isSub = NO;
+                break;
 
-                if (!advanceAndEatControlChars(&datap, &datalen, delegate)) {
-                    goto cancel;
-                }
+            case kCSIActionSubParameter:
+                FinishCSINumber(parser);
+                parser->isSub = YES;
+                parser->sawSubParameter = YES;
                 break;
 
-            case ':':
-                // 2013/1/10 H. Saito
-                // TODO: Now colon separator(":") used in SGR sequence by few terminals
-                // (xterm #282, TeraTerm, RLogin, mlterm, tanasinn).
-                // ECMA-48 suggests it may be used as a separator in a parameter sub-string (5.4.2 - (b)),
-                // but it seems the usage of ":" around SGR is confused a little.
-                //
-                // 1. Konsole's 3-byte color mode style:
-                //    CSI 38 ; 2 ; R ; G ; B m (Konsole, xterm, TeraTerm)
-                //
-                // 2. ITU-T T-416 like style:
-                //    CSI 38 ; 2 : R : G : B m (xterm, TeraTerm, RLogin)
-                //    CSI 38 ; 2 ; R : G : B m (xterm, TeraTerm, RLogin)
-                //    CSI 38 ; 2 ; R ; G : B m (xterm, RLogin)
-                //    CSI 38 ; 2 ; R : G ; B m (xterm, TeraTerm)
-                //    CSI 38 : 2 : R : G : B m (xterm, TeraTerm, RLogin)
-                //
-                // (* It seems mlterm/tanasinn don't distinguish ":" from ";")
-                //
-                // In other case, yaft proposes GWREPT(glyph width report, OSC 8900)
-                //
-                //   > OSC 8900 ; Ps ; Pt ; width : from : to ; width : from : to ; ... ST
-                //   http://uobikiemukot.github.io/yaft/glyph_width_report.html
-                //
-                // In this usage, ":" are certainly treated as sub-parameter separators.
-                isSub = YES;
-                if (!advanceAndEatControlChars(&datap, &datalen, delegate)) {
-                    goto cancel;
-                }
+            case kCSIActionPrefix:
+                parser->prefix = c;
+                param->cmd = c;
                 break;
 
-            default:
-                // '<', '=', '>', or '?'
-                unrecognized = YES;
-                if (!advanceAndEatControlChars(&datap, &datalen, delegate)) {
-                    goto cancel;
+            case kCSIActionIntermediate:
+                FinishCSINumber(parser);
+                if (parser->commandBytesCount < kCommandBytesMax) {
+                    param->cmd = PACK_CSI_COMMAND(param->cmd, c);
+                    parser->unprefixedCmd = PACK_CSI_COMMAND(parser->unprefixedCmd, c);
+                } else {
+                    parser->unrecognized = YES;
                 }
+                parser->commandBytesCount++;
                 break;
-        }
-    }
 
-    // Now we parse intermediate bytes (ECMA-48, 5.4 - (c))
-    //
-    // CSI P...P I...I F
-    //           ^
-    // Intermediate Bytes, if present, consist of bit combinations from 02/00 to 02/15.
-    //
-    while (datalen > 0 && *datap >= 0x20 && *datap <= 0x2f) {
-        if (commandBytesCount < COMMAND_BYTES_MAX) {
-            param->cmd = PACK_CSI_COMMAND(param->cmd, *datap);
-        } else {
-            unrecognized = YES;
-        }
-        commandBytesCount++;
-        if (!advanceAndEatControlChars(&datap, &datalen, delegate)) {
-            goto cancel;
-        }
-    }
-
-    // compatibility HACK:
-    //
-    // CSI P...P I...I (G...G) F
-    //                  ^
-    // xterm allows "garbage bytes" before final byte.
-    // rxvt, urxvt, PuTTY, MinTTY, mlterm, TeraTerm also does so.
-    // We skip them, too.
-    //
-    while (datalen > 0) {
-        if (*datap >= 0x40 && *datap <= 0x7e) { // final byte
-            break;
-        } else {
-            if (*datap > 0x1f && *datap != 0x7f) {
-                // if "garbage bytes" contains non-control character,
-                // mark current sequence as "unrecognized".
-                unrecognized = YES;
-            }
-            if (!advanceAndEatControlChars(&datap, &datalen, delegate)) {
-                goto cancel;
-            }
-        }
-    }
+            case kCSIActionMalformed:
+                FinishCSINumber(parser);
+                parser->unrecognized = YES;
+                break;
 
-    // Now we parse final byte (ECMA-48, 5.4 - (d))
-    //
-    // CSI P...P I...I F
-    //                 ^
-    // Final Byte consists of a bit combination from 04/00 to 07/14.
-    //
-    if (datalen > 0) {
-        if (commandBytesCount < COMMAND_BYTES_MAX) {
-            param->cmd = PACK_CSI_COMMAND(param->cmd, *datap);
-        }
-        datap++;
-        datalen--;
+            case kCSIActionExecute:
+                ExecuteCSIControlCharacter(c, delegate);
+                break;
 
-        if (unrecognized) {
-            param->cmd = 0xff;
+            case kCSIActionCancel:
+                parser->active = NO;
+                *paramOut = *param;
+                paramOut->cmd = 0xff;
+                return i;
+
+            case kCSIActionFinal:
+                FinishCSINumber(parser);
+                if (parser->commandBytesCount < kCommandBytesMax) {
+                    param->cmd = PACK_CSI_COMMAND(param->cmd, c);
+                    parser->unprefixedCmd = PACK_CSI_COMMAND(parser->unprefixedCmd, c);
+                }
+                if (parser->unrecognized) {
+                    param->cmd = 0xff;
+                }
+                parser->active = NO;
+                *paramOut = *param;
+                return i + 1;
         }
-    } else {
-        param->cmd = 0x00;
+        i++;
     }
-    return datap - orgp;
 
-cancel:
-    param->cmd = 0xff;
-    return datap - orgp;
+    // Out of data. Remember where we are so the next call doesn't start over.
+    parser->state = state;
+    parser->consumed = i;
+    *paramOut = *param;
+    paramOut->cmd = 0;
+    return i;
 }
 
 static VT100TCC decode_ansi(unsigned char *datap,
@@ -994,16 +825,31 @@ static VT100TCC decode_ansi(unsigned char *datap,
 static VT100TCC decode_csi(unsigned char *datap,
                            int datalen,
                            int *rmlen,
+                           VT100CSIParser *parser,
                            id<VT100TerminalDelegate> delegate)
 {
     VT100TCC result;
     CSIParam param;
-    memset(&param, 0, sizeof(param));
     memset(&result, 0, sizeof(result));
     int paramlen;
     int i;
 
-    paramlen = getCSIParam(datap, datalen, &param, delegate);
+    paramlen = parse_csi(datap, datalen, parser, &param, delegate);
+    if (param.cmd != 0 && param.cmd != 0xff) {
+        // This dispatcher predates packed commands. It understands a leading '?' or '>' (kept in
+        // the question and modifier fields), no sub-parameters, and only two intermediates.
+        int cmd = parser->unprefixedCmd;
+        unsigned char finalByte = cmd & 0xff;
+        param.question = (parser->prefix == '?');
+        param.modifier = (parser->prefix == '>') ? '>' : 0;
+        if ((parser->prefix && !param.question && !param.modifier) ||
+            parser->sawSubParameter ||
+            !(isalpha(finalByte) || finalByte == '@') ||
+            (cmd > 0xff && cmd != MAKE_CSI_COMMAND(' ', 'q') && cmd != MAKE_CSI_COMMAND('!', 'p'))) {
+            cmd = 0xff;
+        }
+        param.cmd = cmd;
+    }
     result.type = VT100_WAIT;
 
     // Check for unkown
@@ -1304,16 +1150,16 @@ static VT100TCC decode_csi(unsigned char *datap,
 static VT100TCC decode_csi_canonically(unsigned char *datap,
                                        int datalen,
                                        int *rmlen,
+                                       VT100CSIParser *parser,
                                        id<VT100TerminalDelegate> delegate)
 {
     VT100TCC result;
     CSIParam param;
-    memset(&param, 0, sizeof(param));
     memset(&result, 0, sizeof(result));
     int paramlen;
     int i;
 
-    paramlen = getCSIParamCanonically(datap, datalen, &param, delegate);
+    paramlen = parse_csi(datap, datalen, parser, &param, delegate);
     result.type = VT100_WAIT;
 
     // Check for unkown
@@ -2037,6 +1883,7 @@ static VT100TCC decode_control(unsigned char *datap,
                                int datalen,
                                int *rmlen,
                                NSStringEncoding enc,
+                               VT100CSIParser *csiParser,
                                id<VT100TerminalDelegate> delegate,
                                BOOL canonical)
 {
@@ -2044,9 +1891,9 @@ static VT100TCC decode_control(unsigned char *datap,
 
     if (isCSI(datap, datalen)) {
         if (canonical) {
-            result = decode_csi_canonically(datap, datalen, rmlen, delegate);
+            result = decode_csi_canonically(datap, datalen, rmlen, csiParser, delegate);
         } else {
-            result = decode_csi(datap, datalen, rmlen, delegate);
+            result = decode_csi(datap, datalen, rmlen, csiParser, delegate);
         }
     } else if (isXTERM(datap, datalen)) {
         result = decode_xterm(datap, datalen, rmlen, enc);
@@ -2085,73 +1932,200 @@ static VT100TCC decode_control(unsigned char *datap,
     return result;
 }
 
+// Returns the number of leading bytes that are >= 0x80. A non-ASCII UTF-8
+// sequence never contains a byte below 0x80, so this bounds the run that
+// decode_utf8 has to look at.
+static int non_ascii_run_length(const unsigned char *datap, int datalen)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    while (i + 16 <= datalen) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(datap + i));
+        int mask = ~_mm_movemask_epi8(chunk) & 0xffff;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    while (i + 16 <= datalen) {
+        uint8x16_t chunk = vld1q_u8(datap + i);
+        if (vminvq_u8(chunk) < 0x80) {
+            break;
+        }
+        i += 16;
+    }
+#endif
+    while (i < datalen && datap[i] >= 0x80) {
+        i++;
+    }
+    return i;
+}
+
+// Validates and transcodes a run of non-ASCII UTF-8 to UTF-16 in a single
+// pass. Malformed subsequences become one replacement character each, right
+// where they occur, so the result never needs to be re-validated by
+// NSString. Stops at the first ASCII byte (those are processed separately,
+// e.g. they might get converted into line drawing characters) or at an
+// unfinished sequence at the end of the stream.
 static VT100TCC decode_utf8(unsigned char *datap,
                             int datalen,
                             int *rmlen)
 {
     VT100TCC result;
-    unsigned char *p = datap;
-    int len = datalen;
-    int utf8DecodeResult;
-    int theChar = 0;
+    int runLength = non_ascii_run_length(datap, datalen);
+
+    // Every UTF-16 code unit emitted consumes at least one byte.
+    const int kStaticBufferElements = 1024;
+    unichar staticBuffer[kStaticBufferElements];
+    unichar *characters = staticBuffer;
+    if (runLength > kStaticBufferElements) {
+        characters = (unichar *) malloc(runLength * sizeof(unichar));
+    }
 
-    while (true) {
-        utf8DecodeResult = decode_utf8_char(p, len, &theChar);
-        // Stop on error or end of stream.
-        if (utf8DecodeResult <= 0) {
-            break;
+    unsigned char *p = datap;
+    unsigned char *end = datap + runLength;
+    int n = 0;
+    while (p < end) {
+        unsigned char c = p[0];
+        // Fast path for three-byte sequences, which is what CJK text is made of.
+        if ((c & 0xf0) == 0xe0 &&
+            end - p >= 3 &&
+            (p[1] & 0xc0) == 0x80 &&
+            (p[2] & 0xc0) == 0x80) {
+            unichar theChar = ((c & 0x0f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+            if (theChar >= 0x800 && (theChar < 0xd800 || theChar > 0xdfff)) {
+                characters[n++] = theChar;
+                p += 3;
+                continue;
+            }
         }
-        // Intentionally break out at ASCII characters. They are
-        // processed separately, e.g. they might get converted into
-        // line drawing characters.
-        if (theChar < 0x80) {
-            break;
+
+        int theChar = 0;
+        int utf8DecodeResult = decode_utf8_char(p, datalen - (p - datap), &theChar);
+        if (utf8DecodeResult == 0) {
+            // Unfinished sequence; wait for more input.
+            break;
+        } else if (utf8DecodeResult < 0) {
+            characters[n++] = UNICODE_REPLACEMENT_CHAR;
+            p += -utf8DecodeResult;
+        } else if (theChar > 0xffff) {
+            // Convert to surrogate pair.
+            characters[n++] = ((theChar - 0x10000) >> 10) + 0xd800;
+            characters[n++] = (theChar & 0x3ff) + 0xdc00;
+            p += utf8DecodeResult;
+        } else {
+            characters[n++] = theChar;
+            p += utf8DecodeResult;
         }
-        p += utf8DecodeResult;
-        len -= utf8DecodeResult;
     }
 
-    if (p > datap) {
-        // If some characters were successfully decoded, just return them
-        // and ignore the error or end of stream for now.
-        *rmlen = p - datap;
-        assert(p >= datap);
+    *rmlen = p - datap;
+    if (n > 0) {
         result.type = VT100_STRING;
+        result.u.string = [[[NSString alloc] initWithCharacters:characters
+                                                         length:n] autorelease];
     } else {
-        // Report error or waiting state.
-        if (utf8DecodeResult == 0) {
-            result.type = VT100_WAIT;
-        } else {
-            *rmlen = -utf8DecodeResult;
-            result.type = VT100_INVALID_SEQUENCE;
-        }
+        result.type = VT100_WAIT;
+    }
+    if (characters != staticBuffer) {
+        free(characters);
     }
     return result;
 }
 
 
+// The table to decode |encoding| with, or nil if decode_string should leave it to NSString.
+static LegacyEncodingTable *legacy_table_for_encoding(NSStringEncoding encoding)
+{
+    if (isGBEncoding(encoding) ||
+        isBig5Encoding(encoding) ||
+        isSJISEncoding(encoding) ||
+        isKREncoding(encoding) ||
+        encoding == NSJapaneseEUCStringEncoding) {
+        return [LegacyEncodingTable tableForEncoding:encoding];
+    }
+    if (isJPEncoding(encoding)) {
+        // The other Japanese encodings are split with EUC-JP's rules, which don't find their
+        // characters' boundaries; decoding the whole token at once still gets them right.
+        return nil;
+    }
+    // ISO-2022, UTF-16 and the like can't be decoded a byte at a time.
+    LegacyEncodingTable *table = [LegacyEncodingTable tableForEncoding:encoding];
+    return table->singleByte_ ? table : nil;
+}
+
+// Where the decoders for legacy encodings put the characters they find. When |characters| is
+// NULL they only find where the characters end, and decode_string makes the string afterwards.
+typedef struct {
+    LegacyEncodingTable *table;
+    unichar *characters;  // Room for two code units per byte decoded.
+    int length;
+} LegacyDecoderOutput;
+
+// Most bytes decoded into one token by a table, so the characters fit in a buffer on the stack.
+static const int kMaxLegacyDecoderBytes = 512;
+
+// Appends the character made of the |length| bytes at |p| and returns |length|. If they aren't a
+// character, appends ONECHAR_UNKNOWN instead and returns 1, so the bytes after the first are
+// decoded again.
+static int append_legacy_character(LegacyDecoderOutput *output, unsigned char *p, int length)
+{
+    if (!output->characters) {
+        return length;
+    }
+    uint32_t entry;
+    if (length == 1) {
+        entry = LegacyEncodingTableSingleByte(output->table, p[0]);
+    } else if (length == 2) {
+        entry = LegacyEncodingTableDoubleByte(output->table, p[0], p[1]);
+    } else {
+        entry = [output->table entryForBytes:p length:length];
+    }
+    if (entry == kLegacyEncodingInvalid) {
+        output->characters[output->length++] = ONECHAR_UNKNOWN;
+        return 1;
+    }
+    output->length += LegacyEncodingTableAppendEntry(entry, output->characters + output->length);
+    return length;
+}
+
 static VT100TCC decode_euccn(unsigned char *datap,
                              int datalen,
-                             int *rmlen)
+                             int *rmlen,
+                             LegacyDecoderOutput *output)
 {
     VT100TCC result;
     unsigned char *p = datap;
     int len = datalen;
-
+    const BOOL isGB18030 = (output->table && output->table->encoding_ == kGB18030Encoding);
 
     while (len > 0) {
         if (iseuccn(*p) && len > 1) {
+            int n;
             if ((*(p+1) >= 0x40 &&
                  *(p+1) <= 0x7e) ||
                 (*(p+1) >= 0x80 &&
                  *(p+1) <= 0xfe)) {
-                p += 2;
-                len -= 2;
+                n = append_legacy_character(output, p, 2);
+            } else if (isGB18030 && *(p+1) >= 0x30 && *(p+1) <= 0x39) {
+                // Four bytes: lead, digit, lead, digit.
+                if (len < 4) {
+                    break;
+                }
+                if (iseuccn(*(p+2)) && *(p+3) >= 0x30 && *(p+3) <= 0x39) {
+                    n = append_legacy_character(output, p, 4);
+                } else {
+                    n = append_legacy_character(output, p, 1);
+                }
             } else {
-                *p = ONECHAR_UNKNOWN;
-                p++;
-                len--;
+                if (!output->characters) {
+                    *p = ONECHAR_UNKNOWN;
+                }
+                n = append_legacy_character(output, p, 1);
             }
+            p += n;
+            len -= n;
         } else {
             break;
         }
@@ -2169,7 +2143,8 @@ static VT100TCC decode_euccn(unsigned char *datap,
 
 static VT100TCC decode_big5(unsigned char *datap,
                             int datalen,
-                            int *rmlen)
+                            int *rmlen,
+                            LegacyDecoderOutput *output)
 {
     VT100TCC result;
     unsigned char *p = datap;
@@ -2177,17 +2152,20 @@ static VT100TCC decode_big5(unsigned char *datap,
 
     while (len > 0) {
         if (isbig5(*p) && len > 1) {
+            int n;
             if ((*(p+1) >= 0x40 &&
                  *(p+1) <= 0x7e) ||
                 (*(p+1) >= 0xa1 &&
                  *(p+1)<=0xfe)) {
-                p += 2;
-                len -= 2;
+                n = append_legacy_character(output, p, 2);
             } else {
-                *p = ONECHAR_UNKNOWN;
-                p++;
-                len--;
+                if (!output->characters) {
+                    *p = ONECHAR_UNKNOWN;
+                }
+                n = append_legacy_character(output, p, 1);
             }
+            p += n;
+            len -= n;
         } else {
             break;
         }
@@ -2205,25 +2183,26 @@ static VT100TCC decode_big5(unsigned char *datap,
 
 static VT100TCC decode_euc_jp(unsigned char *datap,
                               int datalen ,
-                              int *rmlen)
+                              int *rmlen,
+                              LegacyDecoderOutput *output)
 {
     VT100TCC result;
     unsigned char *p = datap;
     int len = datalen;
 
     while (len > 0) {
+        int n;
         if  (len > 1 && *p == 0x8e) {
-            p += 2;
-            len -= 2;
+            n = append_legacy_character(output, p, 2);
         } else if (len > 2  && *p == 0x8f ) {
-            p += 3;
-            len -= 3;
+            n = append_legacy_character(output, p, 3);
         } else if (len > 1 && *p >= 0xa1 && *p <= 0xfe ) {
-            p += 2;
-            len -= 2;
+            n = append_legacy_character(output, p, 2);
         } else {
             break;
         }
+        p += n;
+        len -= n;
     }
     if (len == datalen) {
         *rmlen = 0;
@@ -2239,22 +2218,24 @@ static VT100TCC decode_euc_jp(unsigned char *datap,
 
 static VT100TCC decode_sjis(unsigned char *datap,
                             int datalen ,
-                            int *rmlen)
+                            int *rmlen,
+                            LegacyDecoderOutput *output)
 {
     VT100TCC result;
     unsigned char *p = datap;
     int len = datalen;
 
     while (len > 0) {
+        int n;
         if (issjiskanji(*p) && len > 1) {
-            p += 2;
-            len -= 2;
-        } else if (*p>=0x80) {
-            p++;
-            len--;
+            n = append_legacy_character(output, p, 2);
+        } else if (*p>=0x80) {
+            n = append_legacy_character(output, p, 1);
         } else {
             break;
         }
+        p += n;
+        len -= n;
     }
 
     if (len == datalen) {
@@ -2272,7 +2253,8 @@ static VT100TCC decode_sjis(unsigned char *datap,
 
 static VT100TCC decode_euckr(unsigned char *datap,
                              int datalen,
-                             int *rmlen)
+                             int *rmlen,
+                             LegacyDecoderOutput *output)
 {
     VT100TCC result;
     unsigned char *p = datap;
@@ -2280,8 +2262,9 @@ static VT100TCC decode_euckr(unsigned char *datap,
 
     while (len > 0) {
         if (iseuckr(*p) && len > 1) {
-            p += 2;
-            len -= 2;
+            const int n = append_legacy_character(output, p, 2);
+            p += n;
+            len -= n;
         } else {
             break;
         }
@@ -2299,7 +2282,8 @@ static VT100TCC decode_euckr(unsigned char *datap,
 
 static VT100TCC decode_other_enc(unsigned char *datap,
                                  int datalen,
-                                 int *rmlen)
+                                 int *rmlen,
+                                 LegacyDecoderOutput *output)
 {
     VT100TCC result;
     unsigned char *p = datap;
@@ -2307,6 +2291,7 @@ static VT100TCC decode_other_enc(unsigned char *datap,
 
     while (len > 0) {
         if (*p >= 0x80) {
+            append_legacy_character(output, p, 1);
             p++;
             len--;
         } else {
@@ -2324,22 +2309,55 @@ static VT100TCC decode_other_enc(unsigned char *datap,
     return result;
 }
 
+// Returns the number of leading bytes in [0x20, 0x7f]. Output is usually
+// dominated by long runs of printable ASCII, so they're scanned 16 bytes at a
+// time. Viewed as signed chars, exactly the bytes in that range are >= 0x20,
+// so a single signed compare flags both control characters and high bytes.
+static int printable_ascii_run_length(const unsigned char *datap, int datalen)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i space = _mm_set1_epi8(0x20);
+    while (i + 16 <= datalen) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(datap + i));
+        int mask = _mm_movemask_epi8(_mm_cmplt_epi8(chunk, space));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const int8x16_t space = vdupq_n_s8(0x20);
+    while (i + 16 <= datalen) {
+        int8x16_t chunk = vld1q_s8((const int8_t *)(datap + i));
+        if (vmaxvq_u8(vcltq_s8(chunk, space))) {
+            // Let the scalar loop find the exact position within this block.
+            break;
+        }
+        i += 16;
+    }
+#endif
+    while (i < datalen && datap[i] >= 0x20 && datap[i] <= 0x7f) {
+        i++;
+    }
+    return i;
+}
+
+// Makes the string for a VT100_ASCIISTRING token, for the few consumers that want one.
+static NSString *StringForAsciiToken(VT100TCC *token)
+{
+    return [[[NSString alloc] initWithBytes:token->position
+                                     length:token->length
+                                   encoding:NSASCIIStringEncoding] autorelease];
+}
+
 static VT100TCC decode_ascii_string(unsigned char *datap,
                                  int datalen,
                                  int *rmlen)
 {
     VT100TCC result;
-    unsigned char *p = datap;
-    int len = datalen;
+    int len = datalen - printable_ascii_run_length(datap, datalen);
 
-    while (len > 0) {
-        if (*p >= 0x20 && *p <= 0x7f) {
-            p++;
-            len--;
-        } else {
-          break;
-        }
-    }
     if (len == datalen) {
         *rmlen = 0;
         result.type = VT100_WAIT;
@@ -2349,38 +2367,11 @@ static VT100TCC decode_ascii_string(unsigned char *datap,
         result.type = VT100_ASCIISTRING;
     }
 
-    result.u.string = [[[NSString alloc] initWithBytes:datap
-                                                length:*rmlen
-                                              encoding:NSASCIIStringEncoding] autorelease];
-
-    if (result.u.string == nil) {
-        *rmlen = 0;
-        result.type = VT100_UNKNOWNCHAR;
-        result.u.code = datap[0];
-    }
-
+    // No string is made: the chars are printable ASCII, and are read straight from the token's
+    // bytes by whoever needs them (see StringForAsciiToken).
     return result;
 }
 
-// The datap buffer must be two bytes larger than *lenPtr.
-// Returns a string or nil if the array is not well formed UTF-8.
-static NSString* SetReplacementCharInArray(unsigned char* datap, int* lenPtr, int badIndex)
-{
-    // Example: "q?x" with badIndex==1.
-    // 01234
-    // q?x
-    memmove(datap + badIndex + 3, datap + badIndex + 1, *lenPtr - badIndex - 1);
-    // 01234
-    // q?  x
-    const char kUtf8Replacement[] = { 0xEF, 0xBF, 0xBD };
-    memmove(datap + badIndex, kUtf8Replacement, 3);
-    // q###x
-    *lenPtr += 2;
-    return [[[NSString alloc] initWithBytes:datap
-                                     length:*lenPtr
-                                   encoding:NSUTF8StringEncoding] autorelease];
-}
-
 static VT100TCC decode_string(unsigned char *datap,
                               int datalen,
                               int *rmlen,
@@ -2392,23 +2383,33 @@ static VT100TCC decode_string(unsigned char *datap,
     result.type = VT100_UNKNOWNCHAR;
     result.u.code = datap[0];
 
+    unichar characters[kMaxLegacyDecoderBytes * 2];
+    LegacyDecoderOutput output = { nil, NULL, 0 };
+    if (encoding != NSUTF8StringEncoding) {
+        output.table = legacy_table_for_encoding(encoding);
+        if (output.table) {
+            output.characters = characters;
+            datalen = MIN(datalen, kMaxLegacyDecoderBytes);
+        }
+    }
+
     //    NSLog(@"data: %@",[NSData dataWithBytes:datap length:datalen]);
     if (encoding == NSUTF8StringEncoding) {
         result = decode_utf8(datap, datalen, rmlen);
     } else if (isGBEncoding(encoding)) {
         // Chinese-GB
-        result = decode_euccn(datap, datalen, rmlen);
+        result = decode_euccn(datap, datalen, rmlen, &output);
     } else if (isBig5Encoding(encoding)) {
-        result = decode_big5(datap, datalen, rmlen);
+        result = decode_big5(datap, datalen, rmlen, &output);
     } else if (isJPEncoding(encoding)) {
-        result = decode_euc_jp(datap, datalen, rmlen);
+        result = decode_euc_jp(datap, datalen, rmlen, &output);
     } else if (isSJISEncoding(encoding)) {
-        result = decode_sjis(datap, datalen, rmlen);
+        result = decode_sjis(datap, datalen, rmlen, &output);
     } else if (isKREncoding(encoding)) {
         // korean
-        result = decode_euckr(datap, datalen, rmlen);
+        result = decode_euckr(datap, datalen, rmlen, &output);
     } else {
-        result = decode_other_enc(datap, datalen, rmlen);
+        result = decode_other_enc(datap, datalen, rmlen, &output);
     }
 
     if (result.type == VT100_INVALID_SEQUENCE) {
@@ -2416,28 +2417,21 @@ static VT100TCC decode_string(unsigned char *datap,
         datap[0] = ONECHAR_UNKNOWN;
         result.u.string = ReplacementString();
         result.type = VT100_STRING;
-    } else if (result.type != VT100_WAIT) {
+    } else if (result.type != VT100_WAIT && output.characters) {
+        result.u.string = [[[NSString alloc] initWithCharacters:output.characters
+                                                         length:output.length] autorelease];
+    } else if (result.type != VT100_WAIT && encoding != NSUTF8StringEncoding) {
+        // decode_utf8 produces its own string.
         result.u.string = [[[NSString alloc] initWithBytes:datap
                                                     length:*rmlen
                                                   encoding:encoding] autorelease];
 
         if (result.u.string == nil) {
             // Invalid bytes, can't encode.
-            int i;
-            if (encoding == NSUTF8StringEncoding) {
-                unsigned char temp[*rmlen * 3];
-                memcpy(temp, datap, *rmlen);
-                int length = *rmlen;
-                // Replace every byte with unicode replacement char <?>.
-                for (i = *rmlen - 1; i >= 0 && !result.u.string; i--) {
-                    result.u.string = SetReplacementCharInArray(temp, &length, i);
-                }
-            } else {
-                // Repalce every byte with ?, the replacement char for non-unicode encodings.
-                for (i = *rmlen - 1; i >= 0 && !result.u.string; i--) {
-                    datap[i] = ONECHAR_UNKNOWN;
-                    result.u.string = [[[NSString alloc] initWithBytes:datap length:*rmlen encoding:encoding] autorelease];
-                }
+            // Repalce every byte with ?, the replacement char for non-unicode encodings.
+            for (int i = *rmlen - 1; i >= 0 && !result.u.string; i--) {
+                datap[i] = ONECHAR_UNKNOWN;
+                result.u.string = [[[NSString alloc] initWithBytes:datap length:*rmlen encoding:encoding] autorelease];
             }
         }
     }
@@ -2497,12 +2491,15 @@ static VT100TCC decode_string(unsigned char *datap,
 
         numLock_ = YES;
         lastToken_ = malloc(sizeof(VT100TCC));
+        csiParser_ = malloc(sizeof(VT100CSIParser));
+        ResetCSIParser(csiParser_);
     }
     return self;
 }
 
 - (void)dealloc
 {
+    [self stopBorrowingStreamData];
     free(stream_);
     [termType release];
 
@@ -2513,6 +2510,8 @@ static VT100TCC decode_string(unsigned char *datap,
         keyStrings_[i] = NULL;
     }
     free(lastToken_);
+    free(csiParser_);
+    [pasteboardCapture_ release];
 
     [super dealloc];
 }
@@ -2593,6 +2592,7 @@ static VT100TCC decode_string(unsigned char *datap,
 
 - (void)restoreTextAttributes
 {
+    characterTemplateValid_ = NO;
     bold_ = saveBold_;
     italic_ = saveItalic_;
     under_ = saveUnder_;
@@ -2611,12 +2611,14 @@ static VT100TCC decode_string(unsigned char *datap,
 
 - (void)setForegroundColor:(int)fgColorCode alternateSemantics:(BOOL)altsem
 {
+    characterTemplateValid_ = NO;
     fgColorCode_ = fgColorCode;
     fgColorMode_ = (altsem ? ColorModeAlternate : ColorModeNormal);
 }
 
 - (void)setBackgroundColor:(int)bgColorCode alternateSemantics:(BOOL)altsem
 {
+    characterTemplateValid_ = NO;
     bgColorCode_ = bgColorCode;
     bgColorMode_ = (altsem ? ColorModeAlternate : ColorModeNormal);
 }
@@ -2643,6 +2645,7 @@ static VT100TCC decode_string(unsigned char *datap,
     bracketedPasteMode_ = NO;
     saveCharset_ = charset_ = NO;
     xon_ = YES;
+    characterTemplateValid_ = NO;
     bold_ = italic_ = blink_ = reversed_ = under_ = NO;
     saveBold_ = saveItalic_ = saveBlink_ = saveReversed_ = saveUnder_ = NO;
     fgColorCode_ = ALTSEM_FG_DEFAULT;
@@ -2697,6 +2700,9 @@ static VT100TCC decode_string(unsigned char *datap,
 
 - (void)putStreamData:(NSData *)data
 {
+    // Can't append to bytes we don't own.
+    [self stopBorrowingStreamData];
+
     if (current_stream_length + [data length] > total_stream_length) {
         // Grow the stream if needed.
         int n = ([data length] + current_stream_length) / STANDARD_STREAM_SIZE;
@@ -2713,6 +2719,49 @@ static VT100TCC decode_string(unsigned char *datap,
     }
 }
 
+- (void)putStreamDataWithoutCopying:(NSData *)data
+{
+    if (borrowedStreamData_ || current_stream_length > streamOffset_) {
+        // There's an incomplete token in the stream that |data| has to be appended to.
+        [self putStreamData:data];
+        return;
+    }
+    borrowedStreamData_ = [data retain];
+    ownedStream_ = stream_;
+    ownedStreamLength_ = total_stream_length;
+
+    stream_ = (unsigned char *)[data bytes];
+    total_stream_length = [data length];
+    current_stream_length = [data length];
+    streamOffset_ = 0;
+}
+
+- (void)stopBorrowingStreamData
+{
+    if (!borrowedStreamData_) {
+        return;
+    }
+    unsigned char *remainder = stream_ + streamOffset_;
+    int remainderLength = current_stream_length - streamOffset_;
+
+    stream_ = ownedStream_;
+    total_stream_length = ownedStreamLength_;
+    ownedStream_ = NULL;
+    ownedStreamLength_ = 0;
+    streamOffset_ = 0;
+    current_stream_length = 0;
+    if (remainderLength > 0) {
+        if (remainderLength > total_stream_length) {
+            total_stream_length = (remainderLength / STANDARD_STREAM_SIZE + 1) * STANDARD_STREAM_SIZE;
+            stream_ = reallocf(stream_, total_stream_length);
+        }
+        memcpy(stream_, remainder, remainderLength);
+        current_stream_length = remainderLength;
+    }
+    [borrowedStreamData_ release];
+    borrowedStreamData_ = nil;
+}
+
 - (NSData *)streamData
 {
     return [NSData dataWithBytes:stream_ + streamOffset_
@@ -2721,10 +2770,322 @@ static VT100TCC decode_string(unsigned char *datap,
 
 - (void)clearStream
 {
+    // Any partially parsed sequence is being thrown away.
+    ResetCSIParser(csiParser_);
+    [pasteboardCapture_ release];
+    pasteboardCapture_ = nil;
     streamOffset_ = current_stream_length;
     assert(streamOffset_ >= 0);
 }
 
+// Decodes one token from the start of |datap|. This does not touch any terminal state, but the
+// parser may call |delegate| for control characters embedded in escape sequences. If a CSI
+// sequence is incomplete, |csiParser| remembers how far it got so the next call on the same
+// bytes picks up from there.
+static VT100TCC decode_token(unsigned char *datap,
+                             int datalen,
+                             int *rmlen,
+                             NSStringEncoding encoding,
+                             VT100CSIParser *csiParser,
+                             id<VT100TerminalDelegate> delegate,
+                             BOOL useCanonicalParser)
+{
+    VT100TCC token;
+    if (*datap >= 0x20 && *datap <= 0x7f) {
+        token = decode_ascii_string(datap, datalen, rmlen);
+    } else if (iscontrol(datap[0])) {
+        token = decode_control(datap, datalen, rmlen, encoding, csiParser, delegate, useCanonicalParser);
+    } else {
+        if (isString(datap, encoding)) {
+            // If the encoding is UTF-8 then you get here only if *datap >= 0x80.
+            token = decode_string(datap, datalen, rmlen, encoding);
+            if (token.type != VT100_WAIT && *rmlen == 0) {
+                token.type = VT100_UNKNOWNCHAR;
+                token.u.code = datap[0];
+                *rmlen = 1;
+            }
+        } else {
+            // If the encoding is UTF-8 you shouldn't get here.
+            token.type = VT100_UNKNOWNCHAR;
+            token.u.code = datap[0];
+            *rmlen = 1;
+        }
+    }
+    token.length = *rmlen;
+    token.position = datap;
+    return token;
+}
+
+// Tokens whose u.string (or u.data) is set by the parser. Batches retain these objects.
+static BOOL VT100TokenTypeHasString(VT100TerminalTokenType type)
+{
+    switch (type) {
+        case VT100_STRING:
+        case XTERMCC_WIN_TITLE:
+        case XTERMCC_ICON_TITLE:
+        case XTERMCC_WINICON_TITLE:
+        case XTERMCC_SET_RGB:
+        case XTERMCC_PROPRIETARY_ETERM_EXT:
+        case XTERMCC_SET_PALETTE:
+        case XTERMCC_SET_KVP:
+        case XTERMCC_PASTE64:
+        case ITERM_GROWL:
+        case ITERM_CAPTURED_PASTE64:
+        case ITERM_CAPTURED_COPY_TEXT:
+            return YES;
+        default:
+            return NO;
+    }
+}
+
+// If |datap| starts an OSC 52 that sets the clipboard, returns the offset of its base64 payload.
+// Returns 0 for anything else, including an OSC 52 whose header hasn't all arrived; the parser
+// waits for that as usual and it's looked at again with more data.
+static int OSC52PayloadOffset(unsigned char *datap, int datalen)
+{
+    static const char kPrefix[] = "\033]52;";
+    const int prefixLength = sizeof(kPrefix) - 1;
+    if (datalen <= prefixLength || memcmp(datap, kPrefix, prefixLength)) {
+        return 0;
+    }
+    int i = prefixLength;
+    while (i < datalen && datap[i] && strchr("psc01234567", datap[i])) {
+        i++;
+    }
+    if (i + 1 >= datalen || datap[i] != ';' || datap[i + 1] == '?') {
+        // Too short to tell, malformed, or a read request; decode_xterm handles these.
+        return 0;
+    }
+    return i + 1;
+}
+
+// Feeds |datap| to the pasteboard capture in progress, or starts one for an OSC 52. Returns NO if
+// there's no capture and the bytes should be tokenized normally. Otherwise *rmlen is set to the
+// number of bytes consumed and *token to either a captured paste token, once the payload is
+// complete, or VT100_WAIT.
+- (BOOL)continuePasteboardCaptureAt:(unsigned char *)datap
+                             length:(int)datalen
+                              token:(VT100TCC *)token
+                              rmlen:(int *)rmlen
+{
+    int consumed = 0;
+    if (!pasteboardCapture_) {
+        consumed = OSC52PayloadOffset(datap, datalen);
+        if (!consumed) {
+            return NO;
+        }
+        pasteboardCapture_ =
+            [[VT100PasteboardCapture alloc] initWithType:kVT100PasteboardCaptureBase64
+                                           maximumLength:kMaxPasteboardCaptureBytes];
+    }
+    consumed += [pasteboardCapture_ consumeBytes:datap + consumed length:datalen - consumed];
+
+    VT100PasteboardCapture *capture = pasteboardCapture_;
+    if (capture.finished || capture.canceled) {
+        [[capture retain] autorelease];
+        [pasteboardCapture_ release];
+        pasteboardCapture_ = nil;
+        if (capture.bytesDropped) {
+            DLog(@"Clipboard payload too large; dropped %lld bytes", capture.bytesDropped);
+        }
+    }
+    if (capture.canceled) {
+        if (!consumed) {
+            // It was interrupted right at the start of this data. Let the interruption be parsed.
+            return NO;
+        }
+        token->type = VT100_NOTSUPPORT;
+    } else if (capture.finished) {
+        token->type = (capture.type == kVT100PasteboardCaptureBase64) ? ITERM_CAPTURED_PASTE64
+                                                                      : ITERM_CAPTURED_COPY_TEXT;
+        token->u.data = capture.data;
+    } else {
+        token->type = VT100_WAIT;
+    }
+    token->position = datap;
+    token->length = consumed;
+    *rmlen = consumed;
+    return YES;
+}
+
+// Text sent after CopyToClipboard goes to the pasteboard rather than the screen, so it's captured
+// without being parsed.
+- (void)startPasteboardCaptureAfterToken:(VT100TCC *)token
+{
+    if (token->type == XTERMCC_SET_KVP && [token->u.string hasPrefix:@"CopyToClipboard"]) {
+        [pasteboardCapture_ release];
+        pasteboardCapture_ =
+            [[VT100PasteboardCapture alloc] initWithType:kVT100PasteboardCaptureRaw
+                                           maximumLength:kMaxPasteboardCaptureBytes];
+    }
+}
+
+- (void)updateStateFromControlToken:(VT100TCC *)token
+{
+    [self updateModesFromToken:*token];
+    [self updateCharacterAttributesFromToken:*token];
+    [self handleProprietaryToken:*token];
+}
+
+- (VT100TokenBatch *)tokenBatchFromData:(NSData *)data
+                         terminalHeight:(int)terminalHeight
+                  useColumnScrollRegion:(BOOL)useColumnScrollRegion
+{
+    const NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    VT100TokenBatch *batch = [[[VT100TokenBatch alloc] initWithData:data] autorelease];
+    VT100DeferredTerminalDelegate *deferredDelegate =
+        [[[VT100DeferredTerminalDelegate alloc] initWithBatch:batch
+                                               terminalHeight:terminalHeight
+                                        useColumnScrollRegion:useColumnScrollRegion] autorelease];
+    // These are only changed on the main thread; take one consistent look at them.
+    NSStringEncoding encoding = encoding_;
+    BOOL useCanonicalParser = useCanonicalParser_;
+    // Incomplete sequences are re-parsed along with the next batch's data (their embedded control
+    // characters are discarded below), so this parser never needs to resume.
+    VT100CSIParser csiParser;
+    ResetCSIParser(&csiParser);
+
+    unsigned char *bytes = (unsigned char *)[data bytes];
+    int length = [data length];
+    int offset = 0;
+    while (offset < length) {
+        int rmlen = 0;
+        VT100TCC token;
+        if ([self continuePasteboardCaptureAt:bytes + offset
+                                       length:length - offset
+                                        token:&token
+                                        rmlen:&rmlen]) {
+            offset += rmlen;
+            if (token.type == VT100_WAIT) {
+                break;
+            }
+            [batch appendToken:&token isControl:NO];
+            continue;
+        }
+        [deferredDelegate beginTokenAt:bytes + offset];
+        token = decode_token(bytes + offset,
+                                      length - offset,
+                                      &rmlen,
+                                      encoding,
+                                      &csiParser,
+                                      (id<VT100TerminalDelegate>)deferredDelegate,
+                                      useCanonicalParser);
+        if (token.type == VT100_WAIT || rmlen == 0) {
+            [deferredDelegate discardPendingTokens];
+            break;
+        }
+        [deferredDelegate commitPendingTokens];
+        [batch appendToken:&token isControl:iscontrol(bytes[offset])];
+        [self startPasteboardCaptureAfterToken:&token];
+        offset += rmlen;
+        if (token.type == DCS_TMUX) {
+            // Everything after this belongs to the tmux gateway.
+            if (offset < length) {
+                [batch setUnparsedData:[data subdataWithRange:NSMakeRange(offset, length - offset)]];
+            }
+            offset = length;
+            break;
+        }
+    }
+    [batch setNumberOfBytesConsumed:offset];
+    [batch setParseDuration:[NSDate timeIntervalSinceReferenceDate] - start];
+    return batch;
+}
+
+- (void)executeTokenAtIndex:(int)index inBatch:(VT100TokenBatch *)batch
+{
+    *lastToken_ = *[batch tokenAtIndex:index];
+    if ([batch tokenAtIndexIsControl:index]) {
+        [self updateStateFromControlToken:lastToken_];
+    }
+    [self executeToken];
+}
+
+- (int)fastForwardTokensInBatch:(VT100TokenBatch *)batch fromIndex:(int)index
+{
+    int width;
+    int height;
+    if (receivingFile_ || !wraparoundMode_ || insertMode_ ||
+        ![delegate_ terminalCanFastForwardWithWidth:&width height:&height]) {
+        return index;
+    }
+
+    // Find the lines ahead that hold only ASCII text and SGR codes and end in CR LF, and how many
+    // rows each one wraps to.
+    const int numberOfTokens = batch.numberOfTokens;
+    int numberOfLines = 0;
+    int capacity = 0;
+    int *lineEnds = NULL;  // Index of the token after each line's LF.
+    int *lineRows = NULL;
+    int lineLength = 0;
+    int i = index;
+    while (i < numberOfTokens) {
+        VT100TCC *token = [batch tokenAtIndex:i];
+        if (token->type == VT100_ASCIISTRING) {
+            lineLength += token->length;
+            i++;
+            continue;
+        }
+        if (token->type == VT100CSI_SGR) {
+            i++;
+            continue;
+        }
+        if (token->type != VT100CC_CR ||
+            i + 1 == numberOfTokens ||
+            [batch tokenAtIndex:i + 1]->type != VT100CC_LF) {
+            break;
+        }
+        i += 2;
+        if (numberOfLines == capacity) {
+            capacity = MAX(64, capacity * 2);
+            lineEnds = realloc(lineEnds, capacity * sizeof(int));
+            lineRows = realloc(lineRows, capacity * sizeof(int));
+        }
+        lineEnds[numberOfLines] = i;
+        lineRows[numberOfLines] = MAX(1, (lineLength + width - 1) / width);
+        numberOfLines++;
+        lineLength = 0;
+    }
+
+    // The lines that follow the skipped ones must fill all but the cursor's row, so the screen ends
+    // up as it would have. Skipping less than a screenful isn't worth the trouble.
+    int numberToSkip = 0;
+    int rowsAfter = 0;
+    for (int j = numberOfLines - 1; j >= 0; j--) {
+        rowsAfter += lineRows[j];
+        if (rowsAfter >= height - 1) {
+            numberToSkip = j;
+            break;
+        }
+    }
+    const int end = numberToSkip ? lineEnds[numberToSkip - 1] : index;
+    free(lineEnds);
+    free(lineRows);
+    if (numberToSkip < height) {
+        return index;
+    }
+
+    [delegate_ terminalBeginFastForward];
+    for (i = index; i < end; i++) {
+        VT100TCC *token = [batch tokenAtIndex:i];
+        switch (token->type) {
+            case VT100_ASCIISTRING:
+                [delegate_ terminalFastForwardAsciiBytes:token->position length:token->length];
+                break;
+            case VT100CSI_SGR:
+                [self executeTokenAtIndex:i inBatch:batch];
+                break;
+            case VT100CC_LF:
+                [delegate_ terminalFastForwardNewline];
+                break;
+            default:
+                // CR
+                break;
+        }
+    }
+    return end;
+}
+
 - (BOOL)parseNextToken
 {
     unsigned char *datap;
@@ -2740,7 +3101,7 @@ static VT100TCC decode_string(unsigned char *datap,
         streamOffset_ = 0;
         current_stream_length = 0;
 
-        if (total_stream_length >= STANDARD_STREAM_SIZE * 2) {
+        if (!borrowedStreamData_ && total_stream_length >= STANDARD_STREAM_SIZE * 2) {
             // We are done with this stream. Get rid of it and allocate a new one
             // to avoid allowing this to grow too big.
             free(stream_);
@@ -2749,37 +3110,23 @@ static VT100TCC decode_string(unsigned char *datap,
         }
     } else {
         int rmlen = 0;
-        if (*datap >= 0x20 && *datap <= 0x7f) {
-            *lastToken_ = decode_ascii_string(datap, datalen, &rmlen);
-            lastToken_->length = rmlen;
-            lastToken_->position = datap;
-        } else if (iscontrol(datap[0])) {
-            *lastToken_ = decode_control(datap, datalen, &rmlen, encoding_, delegate_, useCanonicalParser_);
-            lastToken_->length = rmlen;
-            lastToken_->position = datap;
-            [self updateModesFromToken:*lastToken_];
-            [self updateCharacterAttributesFromToken:*lastToken_];
-            [self handleProprietaryToken:*lastToken_];
-        } else {
-            if (isString(datap, encoding_)) {
-                // If the encoding is UTF-8 then you get here only if *datap >= 0x80.
-                *lastToken_ = decode_string(datap, datalen, &rmlen, encoding_);
-                if (lastToken_->type != VT100_WAIT && rmlen == 0) {
-                    lastToken_->type = VT100_UNKNOWNCHAR;
-                    lastToken_->u.code = datap[0];
-                    rmlen = 1;
-                }
-            } else {
-                // If the encoding is UTF-8 you shouldn't get here.
-                lastToken_->type = VT100_UNKNOWNCHAR;
-                lastToken_->u.code = datap[0];
-                rmlen = 1;
+        if (![self continuePasteboardCaptureAt:datap
+                                        length:datalen
+                                         token:lastToken_
+                                         rmlen:&rmlen]) {
+            *lastToken_ = decode_token(datap,
+                                       datalen,
+                                       &rmlen,
+                                       encoding_,
+                                       csiParser_,
+                                       delegate_,
+                                       useCanonicalParser_);
+            if (iscontrol(datap[0])) {
+                [self updateStateFromControlToken:lastToken_];
             }
-            lastToken_->length = rmlen;
-            lastToken_->position = datap;
+            [self startPasteboardCaptureAfterToken:lastToken_];
         }
 
-
         if (rmlen > 0) {
             NSParameterAssert(current_stream_length >= streamOffset_ + rmlen);
             // mark our current position in the stream
@@ -2788,22 +3135,29 @@ static VT100TCC decode_string(unsigned char *datap,
         }
     }
 
+    BLog(kBinaryLogCategoryParser, "Token type %d, %d bytes starting with %02x",
+         (int)lastToken_->type, (int)lastToken_->length, lastToken_->length > 0 ? datap[0] : 0);
     if (gDebugLogging) {
-        NSMutableString *loginfo = [NSMutableString string];
-        NSMutableString *ascii = [NSMutableString string];
-        int i = 0;
+        // Log 20 bytes per line in hex and ASCII.
+        static const char hexDigits[] = "0123456789abcdef";
+        char hex[20 * 3 + 1];
+        char ascii[20 + 1];
+        int n = 0;
         int start = 0;
-        while (i < lastToken_->length) {
-            unsigned char c = datap[i];
-            [loginfo appendFormat:@"%02x ", (int)c];
-            [ascii appendFormat:@"%c", (c>=32 && c<128) ? c : '.'];
-            if (i == lastToken_->length - 1 || loginfo.length > 60) {
-                DebugLog([NSString stringWithFormat:@"Bytes %d-%d of %d: %@ (%@)", start, i, (int)lastToken_->length, loginfo, ascii]);
-                [loginfo setString:@""];
-                [ascii setString:@""];
-                start = i;
+        for (int i = 0; i < lastToken_->length; i++) {
+            const unsigned char c = datap[i];
+            hex[n * 3] = hexDigits[c >> 4];
+            hex[n * 3 + 1] = hexDigits[c & 0xf];
+            hex[n * 3 + 2] = ' ';
+            ascii[n] = (c >= 32 && c < 128) ? c : '.';
+            n++;
+            if (i == lastToken_->length - 1 || n == 20) {
+                hex[n * 3] = '\0';
+                ascii[n] = '\0';
+                DebugLog([NSString stringWithFormat:@"Bytes %d-%d of %d: %s (%s)", start, i, (int)lastToken_->length, hex, ascii]);
+                n = 0;
+                start = i + 1;
             }
-            i++;
         }
     }
 
@@ -3377,6 +3731,18 @@ static VT100TCC decode_string(unsigned char *datap,
     return result;
 }
 
+- (screen_char_t)characterTemplate
+{
+    if (!characterTemplateValid_) {
+        screen_char_t template = { 0 };
+        CopyForegroundColor(&template, [self foregroundColorCode]);
+        CopyBackgroundColor(&template, [self backgroundColorCode]);
+        characterTemplate_ = template;
+        characterTemplateValid_ = YES;
+    }
+    return characterTemplate_;
+}
+
 - (NSData *)reportActivePositionWithX:(int)x Y:(int)y withQuestion:(BOOL)q
 {
     char buf[64];
@@ -3630,6 +3996,7 @@ static VT100TCC decode_string(unsigned char *datap,
 }
 
 - (void)resetSGR {
+    characterTemplateValid_ = NO;
     // all attributes off
     bold_ = italic_ = under_ = blink_ = reversed_ = NO;
     fgColorCode_ = ALTSEM_FG_DEFAULT;
@@ -3645,6 +4012,7 @@ static VT100TCC decode_string(unsigned char *datap,
 - (void)updateCharacterAttributesFromToken:(VT100TCC)token
 {
     if (token.type == VT100CSI_SGR) {
+        characterTemplateValid_ = NO;
         if (token.u.csi.count == 0) {
             [self resetSGR];
         } else {
@@ -4170,29 +4538,25 @@ static VT100TCC decode_string(unsigned char *datap,
     if (resultLength < 0) {
         return nil;
     }
+    [data setLength:resultLength];
+    return [self pasteStringFromDecodedData:data];
+}
 
-    // sanitize buffer
-    const char *inputIterator = decodedBuffer;
-    char *outputIterator = decodedBuffer;
+// Removes control characters other than TAB, LF and CR from decoded paste64 data, in place, and
+// ends it at the first NUL.
+- (NSString *)pasteStringFromDecodedData:(NSMutableData *)data {
+    unsigned char *bytes = [data mutableBytes];
+    const int length = [data length];
     int outputLength = 0;
-    for (int i = 0; i < resultLength + 1; ++i) {
-        char c = *inputIterator;
+    for (int i = 0; i < length; ++i) {
+        const unsigned char c = bytes[i];
         if (c == 0x00) {
-            *outputIterator = 0; // terminate string with NULL
             break;
         }
-        if (c > 0 && c < 0x20) { // if c is control character
-            // check if c is TAB/LF/CR
-            if (c != 0x9 && c != 0xa && c != 0xd) {
-                // skip it
-                ++inputIterator;
-                continue;
-            }
+        if (c < 0x20 && c != 0x9 && c != 0xa && c != 0xd) {
+            continue;
         }
-        *outputIterator = c;
-        ++inputIterator;
-        ++outputIterator;
-        ++outputLength;
+        bytes[outputLength++] = c;
     }
     [data setLength:outputLength];
 
@@ -4206,7 +4570,7 @@ static VT100TCC decode_string(unsigned char *datap,
     // First, handle sending input to pasteboard/receving files.
     if (receivingFile_) {
         if (token.type == VT100_ASCIISTRING) {
-            [delegate_ terminalDidReceiveBase64FileData:token.u.string];
+            [delegate_ terminalDidReceiveBase64FileData:StringForAsciiToken(&token)];
             return;
         } else if (token.type == VT100CC_CR ||
                    token.type == VT100CC_LF ||
@@ -4220,10 +4584,14 @@ static VT100TCC decode_string(unsigned char *datap,
     if (token.type != VT100_SKIP) {  // VT100_SKIP = there was no data to read
         if ([delegate_ terminalIsAppendingToPasteboard]) {
             // We are probably copying text to the clipboard until esc]50;EndCopy^G is received.
-            if (token.type != XTERMCC_SET_KVP ||
-                ![token.u.string hasPrefix:@"CopyToClipboard"]) {
-                // Append text to clipboard except for initial command that turns on copying to
-                // the clipboard.
+            // Text captured without being parsed is added below.
+            if (token.type != ITERM_CAPTURED_COPY_TEXT &&
+                token.type != ITERM_CAPTURED_PASTE64 &&
+                (token.type != XTERMCC_SET_KVP ||
+                 (![token.u.string hasPrefix:@"CopyToClipboard"] &&
+                  ![token.u.string hasPrefix:@"EndCopy"]))) {
+                // Append text to clipboard except for the commands that turn copying to the
+                // clipboard on and off.
                 [delegate_ terminalAppendDataToPasteboard:[NSData dataWithBytes:token.position
                                                                          length:token.length]];
             }
@@ -4233,8 +4601,10 @@ static VT100TCC decode_string(unsigned char *datap,
     switch (token.type) {
             // our special code
         case VT100_STRING:
+            [delegate_ terminalAppendString:token.u.string isAscii:NO];
+            break;
         case VT100_ASCIISTRING:
-            [delegate_ terminalAppendString:token.u.string isAscii:lastToken_->type == VT100_ASCIISTRING];
+            [delegate_ terminalAppendAsciiBytes:token.position length:token.length];
             break;
 
         case VT100_UNKNOWNCHAR:
@@ -4567,6 +4937,18 @@ static VT100TCC decode_string(unsigned char *datap,
             }
         }
             break;
+        case ITERM_CAPTURED_PASTE64: {
+            NSString *decoded = [self pasteStringFromDecodedData:token.u.data];
+            if (decoded) {
+                [delegate_ terminalPasteString:decoded];
+            }
+        }
+            break;
+        case ITERM_CAPTURED_COPY_TEXT:
+            if ([delegate_ terminalIsAppendingToPasteboard]) {
+                [delegate_ terminalAppendDataToPasteboard:token.u.data];
+            }
+            break;
         case XTERMCC_ICON_TITLE:
             [delegate_ terminalSetIconTitle:token.u.string];
             break;
@@ -4740,13 +5122,192 @@ static VT100TCC decode_string(unsigned char *datap,
     return lastToken_->type == VT100_ASCIISTRING;
 }
 
+- (BOOL)lastTokenWasLinefeed {
+    return lastToken_->type == VT100CC_LF;
+}
+
 - (NSString *)lastTokenString {
-    if (lastToken_->type == VT100_STRING ||
-        lastToken_->type == VT100_ASCIISTRING) {
+    if (lastToken_->type == VT100_STRING) {
         return lastToken_->u.string;
+    } else if (lastToken_->type == VT100_ASCIISTRING) {
+        return StringForAsciiToken(lastToken_);
     } else {
         return nil;
     }
 }
 
 @end
+
+@implementation VT100TokenBatch {
+    NSData *data_;  // Tokens' positions point into this.
+    VT100TCC *tokens_;
+    BOOL *isControl_;
+    int capacity_;
+    NSMutableArray *strings_;  // Keeps tokens' strings alive.
+}
+
+@synthesize numberOfTokens = numberOfTokens_;
+@synthesize numberOfBytesConsumed = numberOfBytesConsumed_;
+@synthesize unparsedData = unparsedData_;
+@synthesize parseDuration = parseDuration_;
+
+- (id)initWithData:(NSData *)data
+{
+    self = [super init];
+    if (self) {
+        data_ = [data retain];
+        strings_ = [[NSMutableArray alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [data_ release];
+    [strings_ release];
+    [unparsedData_ release];
+    free(tokens_);
+    free(isControl_);
+    [super dealloc];
+}
+
+- (void)appendToken:(VT100TCC *)token isControl:(BOOL)isControl
+{
+    if (numberOfTokens_ == capacity_) {
+        capacity_ = MAX(64, capacity_ * 2);
+        tokens_ = realloc(tokens_, capacity_ * sizeof(VT100TCC));
+        isControl_ = realloc(isControl_, capacity_ * sizeof(BOOL));
+    }
+    if (VT100TokenTypeHasString(token->type) && token->u.string) {
+        [strings_ addObject:token->u.string];
+    }
+    tokens_[numberOfTokens_] = *token;
+    isControl_[numberOfTokens_] = isControl;
+    numberOfTokens_++;
+}
+
+- (VT100TCC *)tokenAtIndex:(int)index
+{
+    assert(index >= 0 && index < numberOfTokens_);
+    return &tokens_[index];
+}
+
+- (BOOL)tokenAtIndexIsControl:(int)index
+{
+    return isControl_[index];
+}
+
+- (void)setNumberOfBytesConsumed:(int)numberOfBytesConsumed
+{
+    numberOfBytesConsumed_ = numberOfBytesConsumed;
+}
+
+- (void)setUnparsedData:(NSData *)unparsedData
+{
+    [unparsedData_ autorelease];
+    unparsedData_ = [unparsedData retain];
+}
+
+- (void)setParseDuration:(NSTimeInterval)parseDuration
+{
+    parseDuration_ = parseDuration;
+}
+
+@end
+
+@implementation VT100DeferredTerminalDelegate
+
+- (id)initWithBatch:(VT100TokenBatch *)batch
+     terminalHeight:(int)terminalHeight
+useColumnScrollRegion:(BOOL)useColumnScrollRegion
+{
+    self = [super init];
+    if (self) {
+        batch_ = batch;
+        terminalHeight_ = terminalHeight;
+        useColumnScrollRegion_ = useColumnScrollRegion;
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    free(pending_);
+    [super dealloc];
+}
+
+- (void)beginTokenAt:(unsigned char *)position
+{
+    position_ = position;
+    numPending_ = 0;
+}
+
+- (void)addToken:(VT100TerminalTokenType)type
+{
+    if (numPending_ == pendingCapacity_) {
+        pendingCapacity_ = MAX(4, pendingCapacity_ * 2);
+        pending_ = realloc(pending_, pendingCapacity_ * sizeof(VT100TCC));
+    }
+    VT100TCC *token = &pending_[numPending_++];
+    memset(token, 0, sizeof(*token));
+    token->type = type;
+    token->position = position_;
+    token->length = 0;
+}
+
+- (void)commitPendingTokens
+{
+    for (int i = 0; i < numPending_; i++) {
+        [batch_ appendToken:&pending_[i] isControl:YES];
+    }
+    numPending_ = 0;
+}
+
+- (void)discardPendingTokens
+{
+    numPending_ = 0;
+}
+
+- (void)terminalRingBell
+{
+    [self addToken:VT100CC_BEL];
+}
+
+- (void)terminalBackspace
+{
+    [self addToken:VT100CC_BS];
+}
+
+- (void)terminalAppendTabAtCursor
+{
+    [self addToken:VT100CC_HT];
+}
+
+- (void)terminalLineFeed
+{
+    [self addToken:VT100CC_LF];
+}
+
+- (void)terminalCarriageReturn
+{
+    [self addToken:VT100CC_CR];
+}
+
+- (void)terminalDeleteCharactersAtCursor:(int)n
+{
+    for (int i = 0; i < n; i++) {
+        [self addToken:VT100CC_DEL];
+    }
+}
+
+- (int)terminalHeight
+{
+    return terminalHeight_;
+}
+
+- (BOOL)terminalUseColumnScrollRegion
+{
+    return useColumnScrollRegion_;
+}
+
+@end
@@ -21,6 +21,10 @@ typedef enum {
 // |ascii| is set then the string contains only ascii characters.
 - (void)terminalAppendString:(NSString *)string isAscii:(BOOL)isAscii;
 
+// Like terminalAppendString:isAscii: with |isAscii| set, for |length| printable ASCII chars read
+// straight from the parser's input, so no string has to be made for them.
+- (void)terminalAppendAsciiBytes:(const unsigned char *)bytes length:(int)length;
+
 // Play/display the bell.
 - (void)terminalRingBell;
 
@@ -313,4 +317,20 @@ typedef enum {
 // Shows/hides the cursor.
 - (void)terminalSetCursorVisible:(BOOL)visible;
 
+// Flood mode; see -[VT100Terminal fastForwardTokensInBatch:fromIndex:]. Returns YES if the cursor
+// is at the start of an empty last line and nothing (scroll regions, the alternate screen, line
+// drawing, printing) would make lines printed from there do more than scroll into the scrollback.
+// Gives the size of the screen.
+- (BOOL)terminalCanFastForwardWithWidth:(int *)width height:(int *)height;
+
+// Moves everything above the cursor into the scrollback and leaves the cursor at the top left of
+// an empty screen.
+- (void)terminalBeginFastForward;
+
+// Adds |length| printable ASCII characters to the line being fast-forwarded.
+- (void)terminalFastForwardAsciiBytes:(const unsigned char *)bytes length:(int)length;
+
+// Appends the line being fast-forwarded to the scrollback, never having put it on the screen.
+- (void)terminalFastForwardNewline;
+
 @end
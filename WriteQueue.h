@@ -0,0 +1,37 @@
+//
+//  WriteQueue.h
+//  iTerm
+//
+//  A queue of bytes waiting to be written to a file descriptor. Bytes are stored in a linked list
+//  of fixed-size chunks so a huge paste never needs one contiguous allocation and never has to be
+//  memmove()d as it drains.
+//
+//  The consumer side (-writeToFileDescriptor:, -consumeLength:) must only ever be used from one
+//  thread. It never takes a lock. Producers are serialized with a spinlock that the consumer never
+//  touches, since both the main thread and the TaskNotifier thread (for coprocess input) append.
+//
+
+#import <Foundation/Foundation.h>
+
+@interface WriteQueue : NSObject
+
+// Number of bytes appended but not yet consumed. Safe to call from any thread.
+@property(nonatomic, readonly) size_t length;
+
+// Producer side.
+- (void)appendBytes:(const void *)bytes length:(size_t)length;
+- (void)appendData:(NSData *)data;
+
+// Like -appendData:, but a large |data| is kept by reference instead of being copied, so the same
+// bytes can be queued for many file descriptors at the cost of one. |data| must not be mutated.
+- (void)appendSharedData:(NSData *)data;
+
+// Reads up to |maxLength| bytes from |fd| straight into the queue with one readv(), so they don't
+// have to be copied in from another buffer. Returns the result of readv().
+- (ssize_t)appendFromFileDescriptor:(int)fd maxLength:(size_t)maxLength;
+
+// Consumer side. Writes as much as possible with a single writev() over the queued chunks and
+// removes whatever was written. Returns the result of writev().
+- (ssize_t)writeToFileDescriptor:(int)fd;
+
+@end
@@ -0,0 +1,231 @@
+//
+//  WriteQueue.m
+//  iTerm
+//
+
+#import "WriteQueue.h"
+#include <libkern/OSAtomic.h>
+#include <sys/uio.h>
+
+// Size of each chunk's buffer.
+static const size_t kWriteQueueChunkSize = 16 * 1024;
+
+// Max number of chunks handed to a single writev().
+static const int kWriteQueueMaxIovecs = 16;
+
+// Shared data at least this long is queued by reference instead of being copied.
+static const size_t kWriteQueueMinimumSharedLength = 4 * 1024;
+
+typedef struct WriteQueueChunk {
+    // Written only by the producer. Once |next| is non-NULL, the producer is done with this chunk.
+    struct WriteQueueChunk *volatile next;
+    // Number of valid bytes. Written by the producer (after the bytes), read by the consumer.
+    volatile size_t writeOffset;
+    // The chunk is done once writeOffset reaches this. The producer lowers it (after linking
+    // |next|) to close the tail early so a shared chunk can follow.
+    volatile size_t capacity;
+    // Number of bytes already consumed. Only touched by the consumer.
+    size_t readOffset;
+    // Points at inlineBytes, or into sharedData.
+    char *bytes;
+    CFDataRef sharedData;
+    char inlineBytes[];
+} WriteQueueChunk;
+
+static WriteQueueChunk *WriteQueueChunkCreate(void) {
+    WriteQueueChunk *chunk = malloc(sizeof(WriteQueueChunk) + kWriteQueueChunkSize);
+    chunk->next = NULL;
+    chunk->writeOffset = 0;
+    chunk->capacity = kWriteQueueChunkSize;
+    chunk->readOffset = 0;
+    chunk->bytes = chunk->inlineBytes;
+    chunk->sharedData = NULL;
+    return chunk;
+}
+
+// A full chunk holding a reference to |data|.
+static WriteQueueChunk *WriteQueueChunkCreateShared(NSData *data) {
+    WriteQueueChunk *chunk = malloc(sizeof(WriteQueueChunk));
+    chunk->next = NULL;
+    chunk->writeOffset = [data length];
+    chunk->capacity = [data length];
+    chunk->readOffset = 0;
+    chunk->sharedData = CFRetain((CFDataRef)data);
+    chunk->bytes = (char *)CFDataGetBytePtr(chunk->sharedData);
+    return chunk;
+}
+
+static void WriteQueueChunkFree(WriteQueueChunk *chunk) {
+    if (chunk->sharedData) {
+        CFRelease(chunk->sharedData);
+    }
+    free(chunk);
+}
+
+@implementation WriteQueue {
+    WriteQueueChunk *head_;  // Consumer only.
+    WriteQueueChunk *tail_;  // Producers only.
+    volatile int64_t length_;
+    OSSpinLock producerLock_;
+}
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        head_ = tail_ = WriteQueueChunkCreate();
+        producerLock_ = OS_SPINLOCK_INIT;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    WriteQueueChunk *chunk = head_;
+    while (chunk) {
+        WriteQueueChunk *next = chunk->next;
+        WriteQueueChunkFree(chunk);
+        chunk = next;
+    }
+    [super dealloc];
+}
+
+- (size_t)length {
+    return (size_t)OSAtomicAdd64Barrier(0, &length_);
+}
+
+- (void)appendData:(NSData *)data {
+    [self appendBytes:[data bytes] length:[data length]];
+}
+
+- (void)appendSharedData:(NSData *)data {
+    const size_t length = [data length];
+    if (length < kWriteQueueMinimumSharedLength) {
+        [self appendData:data];
+        return;
+    }
+    WriteQueueChunk *shared = WriteQueueChunkCreateShared(data);
+    WriteQueueChunk *next = WriteQueueChunkCreate();
+    shared->next = next;
+    OSSpinLockLock(&producerLock_);
+    // Close the tail where it is. Nothing more goes into it, so its writeOffset is final.
+    WriteQueueChunk *chunk = tail_;
+    OSMemoryBarrier();
+    chunk->next = shared;
+    OSMemoryBarrier();
+    chunk->capacity = chunk->writeOffset;
+    tail_ = next;
+    OSSpinLockUnlock(&producerLock_);
+    OSAtomicAdd64Barrier(length, &length_);
+}
+
+- (void)appendBytes:(const void *)bytes length:(size_t)length {
+    const char *source = bytes;
+    size_t remaining = length;
+    OSSpinLockLock(&producerLock_);
+    while (remaining > 0) {
+        WriteQueueChunk *chunk = tail_;
+        size_t offset = chunk->writeOffset;
+        size_t n = MIN(remaining, kWriteQueueChunkSize - offset);
+        memcpy(chunk->bytes + offset, source, n);
+        source += n;
+        remaining -= n;
+        if (offset + n == kWriteQueueChunkSize) {
+            // Link the next chunk before publishing that this one is full so the consumer can
+            // always move on from a full chunk.
+            WriteQueueChunk *next = WriteQueueChunkCreate();
+            OSMemoryBarrier();
+            chunk->next = next;
+            tail_ = next;
+        }
+        // Publish the bytes only after they're in place.
+        OSMemoryBarrier();
+        chunk->writeOffset = offset + n;
+    }
+    OSSpinLockUnlock(&producerLock_);
+    OSAtomicAdd64Barrier(length, &length_);
+}
+
+- (ssize_t)appendFromFileDescriptor:(int)fd maxLength:(size_t)maxLength {
+    OSSpinLockLock(&producerLock_);
+    // The tail is never full, so there's always room in it. Whatever doesn't fit goes into a fresh
+    // chunk, which is linked in only if it's needed. That one is kept short of full so it can
+    // become the tail.
+    WriteQueueChunk *chunk = tail_;
+    const size_t offset = chunk->writeOffset;
+    const size_t room = MIN(maxLength, kWriteQueueChunkSize - offset);
+    WriteQueueChunk *next = WriteQueueChunkCreate();
+    struct iovec iov[2] = {
+        { chunk->bytes + offset, room },
+        { next->bytes, MIN(maxLength - room, kWriteQueueChunkSize - 1) }
+    };
+    const ssize_t n = readv(fd, iov, 2);
+    if (n > 0) {
+        const size_t inChunk = MIN((size_t)n, room);
+        if (offset + inChunk == kWriteQueueChunkSize) {
+            // Fill in |next| before the consumer can see it, as -appendBytes:length: does.
+            next->writeOffset = n - inChunk;
+            OSMemoryBarrier();
+            chunk->next = next;
+            tail_ = next;
+            next = NULL;
+        }
+        OSMemoryBarrier();
+        chunk->writeOffset = offset + inChunk;
+    }
+    OSSpinLockUnlock(&producerLock_);
+    free(next);
+    if (n > 0) {
+        OSAtomicAdd64Barrier(n, &length_);
+    }
+    return n;
+}
+
+- (void)consumeLength:(size_t)length {
+    OSAtomicAdd64Barrier(-(int64_t)length, &length_);
+    while (length > 0) {
+        WriteQueueChunk *chunk = head_;
+        size_t available = chunk->writeOffset - chunk->readOffset;
+        size_t n = MIN(length, available);
+        chunk->readOffset += n;
+        length -= n;
+        if (chunk->readOffset == chunk->capacity) {
+            // The producer linked |next| before marking this chunk full or closing it.
+            OSMemoryBarrier();
+            head_ = chunk->next;
+            WriteQueueChunkFree(chunk);
+        } else {
+            assert(length == 0);
+        }
+    }
+}
+
+- (ssize_t)writeToFileDescriptor:(int)fd {
+    struct iovec iov[kWriteQueueMaxIovecs];
+    int count = 0;
+    WriteQueueChunk *chunk = head_;
+    while (chunk && count < kWriteQueueMaxIovecs) {
+        size_t writeOffset = chunk->writeOffset;
+        size_t capacity = chunk->capacity;
+        OSMemoryBarrier();
+        if (writeOffset > chunk->readOffset) {
+            iov[count].iov_base = chunk->bytes + chunk->readOffset;
+            iov[count].iov_len = writeOffset - chunk->readOffset;
+            count++;
+        }
+        if (writeOffset < capacity) {
+            // The producer may still be appending to this chunk; nothing after it is ready.
+            break;
+        }
+        // A closed chunk may be empty, which consumeLength: skips over.
+        chunk = chunk->next;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    ssize_t written = writev(fd, iov, count);
+    if (written > 0) {
+        [self consumeLength:written];
+    }
+    return written;
+}
+
+@end
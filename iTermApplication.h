@@ -32,11 +32,25 @@
 
 @class iTermApplicationDelegate;
 
+// What -sendEvent: needs from the preferences to route a key press, so they aren't asked for on every
+// key down. Rebuilt after the keyboard preferences change.
+typedef struct {
+    BOOL valid;
+    BOOL anyModifierRemapped;
+    NSUInteger switchWindowMask;  // Control, command and option flags that switch windows.
+    NSUInteger switchTabMask;     // Shift, control, command and option flags that switch tabs.
+} iTermKeyDispatchSnapshot;
+
 @interface iTermApplication : NSApplication {
+    iTermKeyDispatchSnapshot keyDispatch_;
+    BOOL observingKeyboardSettings_;
 }
 
 + (BOOL)isTextFieldInFocus:(NSTextField *)textField;
 - (void)sendEvent:(NSEvent *)anEvent;
 - (iTermApplicationDelegate *)delegate;
 
+// A memory report for every session, as text. Used by AppleScript.
+- (NSString *)memoryReport;
+
 @end
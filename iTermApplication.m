@@ -30,6 +30,7 @@
 
 #import "iTermApplication.h"
 #import "HotkeyWindowController.h"
+#import "MemoryReport.h"
 #import "PTYSession.h"
 #import "PTYTextView.h"
 #import "PTYWindow.h"
@@ -77,24 +78,56 @@
     }
 }
 
+- (void)keyboardSettingsDidChange:(NSNotification *)notification
+{
+    keyDispatch_.valid = NO;
+}
+
+- (void)updateKeyDispatchSnapshot
+{
+    if (!observingKeyboardSettings_) {
+        [[NSNotificationCenter defaultCenter] addObserver:self
+                                                 selector:@selector(keyboardSettingsDidChange:)
+                                                     name:kPreferencePanelKeyboardSettingsDidChangeNotification
+                                                   object:nil];
+        observingKeyboardSettings_ = YES;
+    }
+    PreferencePanel* prefPanel = [PreferencePanel sharedInstance];
+    keyDispatch_.anyModifierRemapped = [prefPanel isAnyModifierRemapped];
+    keyDispatch_.switchWindowMask = [prefPanel modifierTagToMask:[prefPanel switchWindowModifier]];
+    keyDispatch_.switchTabMask = [prefPanel modifierTagToMask:[prefPanel switchTabModifier]];
+    keyDispatch_.valid = YES;
+}
+
+// The digit typed with the modifiers that switch tabs or windows, or 0 if it isn't one.
+- (int)_digitOfEvent:(NSEvent *)event
+{
+    int digit = [[event charactersIgnoringModifiers] intValue];
+    if (!digit) {
+        digit = [[event characters] intValue];
+    }
+    return digit;
+}
+
 // override to catch key press events very early on
 - (void)sendEvent:(NSEvent*)event
 {
     if ([event type] == NSKeyDown) {
-        iTermController* cont = [iTermController sharedInstance];
 #ifdef FAKE_EVENT_TAP
-        event = [cont runEventTapHandler:event];
+        event = [[iTermController sharedInstance] runEventTapHandler:event];
         if (!event) {
             return;
         }
 #endif
-        PreferencePanel* prefPanel = [PreferencePanel sharedInstance];
-        if ([prefPanel isAnyModifierRemapped] &&
+        if (!keyDispatch_.valid) {
+            [self updateKeyDispatchSnapshot];
+        }
+        if (keyDispatch_.anyModifierRemapped &&
             (IsSecureEventInputEnabled() || ![[HotkeyWindowController sharedInstance] haveEventTap])) {
             // The event tap is not working, but we can still remap modifiers for non-system
             // keys. Only things like cmd-tab will not be remapped in this case. Otherwise,
             // the event tap performs the remapping.
-            event = [iTermKeyBindingMgr remapModifiers:event prefPanel:prefPanel];
+            event = [iTermKeyBindingMgr remapModifiers:event prefPanel:[PreferencePanel sharedInstance]];
         }
         if (IsSecureEventInputEnabled() &&
             [[HotkeyWindowController sharedInstance] eventIsHotkey:event]) {
@@ -103,20 +136,13 @@
             OnHotKeyEvent();
             return;
         }
-        PreferencePanel* privatePrefPanel = [PreferencePanel sessionsInstance];
-        PseudoTerminal* currentTerminal = [cont currentTerminal];
-        PTYTabView* tabView = [currentTerminal tabView];
-        PTYSession* currentSession = [currentTerminal currentSession];
-        NSResponder *responder;
+        const NSUInteger modifierFlags = [event modifierFlags];
 
-        if (([event modifierFlags] & (NSControlKeyMask | NSCommandKeyMask | NSAlternateKeyMask)) == [prefPanel modifierTagToMask:[prefPanel switchWindowModifier]]) {
+        if ((modifierFlags & (NSControlKeyMask | NSCommandKeyMask | NSAlternateKeyMask)) == keyDispatch_.switchWindowMask) {
             // Command-Alt (or selected modifier) + number: Switch to window by number.
-            int digit = [[event charactersIgnoringModifiers] intValue];
-            if (!digit) {
-                digit = [[event characters] intValue];
-            }
+            int digit = [self _digitOfEvent:event];
             if (digit >= 1 && digit <= 9) {
-                PseudoTerminal* termWithNumber = [cont terminalWithNumber:(digit - 1)];
+                PseudoTerminal* termWithNumber = [[iTermController sharedInstance] terminalWithNumber:(digit - 1)];
                 if (termWithNumber) {
                     if ([termWithNumber isHotKeyWindow] && [[termWithNumber window] alphaValue] < 1) {
                         [[HotkeyWindowController sharedInstance] showHotKeyWindow];
@@ -127,26 +153,13 @@
                 return;
             }
         }
-        if ([prefPanel keySheet] == [self keyWindow] &&
-            [prefPanel keySheetIsOpen] &&
-            [iTermApplication isTextFieldInFocus:[prefPanel shortcutKeyTextField]]) {
-            // Focus is in the shortcut field in prefspanel. Pass events directly to it.
-            [prefPanel shortcutKeyDown:event];
-            return;
-        } else if ([privatePrefPanel keySheet] == [self keyWindow] &&
-                   [privatePrefPanel keySheetIsOpen] &&
-                   [iTermApplication isTextFieldInFocus:[privatePrefPanel shortcutKeyTextField]]) {
-            // Focus is in the shortcut field in sessions prefspanel. Pass events directly to it.
-            [privatePrefPanel shortcutKeyDown:event];
-            return;
-        } else if ([prefPanel window] == [self keyWindow] &&
-                   [iTermApplication isTextFieldInFocus:[prefPanel hotkeyField]]) {
-            // Focus is in the hotkey field in prefspanel. Pass events directly to it.
-            [prefPanel hotkeyKeyDown:event];
-            return;
-        } else if ([[self keyWindow] isKindOfClass:[PTYWindow class]]) {
+
+        NSWindow *keyWindow = [self keyWindow];
+        // Checked first since it's the usual case. The preference panels' windows and sheets
+        // aren't PTYWindows, so none of the cases below could apply.
+        if ([keyWindow isKindOfClass:[PTYWindow class]]) {
             // Focus is in a terminal window.
-            responder = [[self keyWindow] firstResponder];
+            NSResponder *responder = [keyWindow firstResponder];
             bool inTextView = [responder isKindOfClass:[PTYTextView class]];
 
             if (inTextView &&
@@ -156,12 +169,11 @@
                 return;
             }
 
+            PseudoTerminal* currentTerminal = [[iTermController sharedInstance] currentTerminal];
             const int mask = NSShiftKeyMask | NSControlKeyMask | NSAlternateKeyMask | NSCommandKeyMask;
-            if (([event modifierFlags] & mask) == [prefPanel modifierTagToMask:[prefPanel switchTabModifier]]) {
-                int digit = [[event charactersIgnoringModifiers] intValue];
-                if (!digit) {
-                    digit = [[event characters] intValue];
-                }
+            if ((modifierFlags & mask) == keyDispatch_.switchTabMask) {
+                PTYTabView* tabView = [currentTerminal tabView];
+                int digit = [self _digitOfEvent:event];
                 if (digit == 9 && [tabView numberOfTabViewItems] > 0) {
                     // Command (or selected modifier)+9: Switch to last tab if there are fewer than 9.
                     [tabView selectTabViewItemAtIndex:[tabView numberOfTabViewItems]-1];
@@ -174,6 +186,7 @@
                 }
             }
 
+            PTYSession* currentSession = [currentTerminal currentSession];
             BOOL okToRemap = YES;
             if ([responder isKindOfClass:[NSTextView class]]) {
                 // Disable keymaps that send text
@@ -191,6 +204,26 @@
                 return;
             }
         } else {
+            PreferencePanel* prefPanel = [PreferencePanel sharedInstance];
+            PreferencePanel* privatePrefPanel = [PreferencePanel sessionsInstance];
+            if ([prefPanel keySheet] == keyWindow &&
+                [prefPanel keySheetIsOpen] &&
+                [iTermApplication isTextFieldInFocus:[prefPanel shortcutKeyTextField]]) {
+                // Focus is in the shortcut field in prefspanel. Pass events directly to it.
+                [prefPanel shortcutKeyDown:event];
+                return;
+            } else if ([privatePrefPanel keySheet] == keyWindow &&
+                       [privatePrefPanel keySheetIsOpen] &&
+                       [iTermApplication isTextFieldInFocus:[privatePrefPanel shortcutKeyTextField]]) {
+                // Focus is in the shortcut field in sessions prefspanel. Pass events directly to it.
+                [privatePrefPanel shortcutKeyDown:event];
+                return;
+            } else if ([prefPanel window] == keyWindow &&
+                       [iTermApplication isTextFieldInFocus:[prefPanel hotkeyField]]) {
+                // Focus is in the hotkey field in prefspanel. Pass events directly to it.
+                [prefPanel hotkeyKeyDown:event];
+                return;
+            }
             // Focus not in terminal window.
             if ([PTYSession handleShortcutWithoutTerminal:event]) {
                 return;
@@ -206,6 +239,11 @@
     return [[self delegate] uriToken];
 }
 
+- (NSString *)memoryReport
+{
+    return [[[iTermController sharedInstance] memoryReport] formattedReport];
+}
+
 - (iTermApplicationDelegate *)delegate
 {
     return (iTermApplicationDelegate *)[super delegate];
@@ -123,6 +123,7 @@ int DebugLogImpl(const char *file, int line, const char *function, NSString* val
 - (IBAction)buildScriptMenu:(id)sender;
 
 - (IBAction)debugLogging:(id)sender;
+- (IBAction)showMemoryReport:(id)sender;
 
 - (void)updateMaximizePaneMenuItem;
 - (void)updateUseTransparencyMenuItem;
@@ -140,6 +141,9 @@ int DebugLogImpl(const char *file, int line, const char *function, NSString* val
 - (IBAction)showBookmarkWindow:(id)sender;
 - (IBAction)instantReplayPrev:(id)sender;
 - (IBAction)instantReplayNext:(id)sender;
+- (IBAction)openInstantReplayRecording:(id)sender;
+- (IBAction)openPtyRecording:(id)sender;
+- (IBAction)openPtyRecordingAtFullSpeed:(id)sender;
 
     // navigation
 - (IBAction)previousTerminal: (id) sender;
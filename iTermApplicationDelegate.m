@@ -26,10 +26,16 @@
  */
 
 #import "iTermApplicationDelegate.h"
+#import "BinaryLog.h"
 
 #import "ColorsMenuItemView.h"
 #import "HotkeyWindowController.h"
 #import "ITAddressBookMgr.h"
+#import "LaunchScheduler.h"
+#import "LineBlock.h"
+#import "MetricsExporter.h"
+#import "PTYServerClient.h"
+#import "MemoryReportWindowController.h"
 #import "NSStringITerm.h"
 #import "NSView+RecursiveDescription.h"
 #import "PTYSession.h"
@@ -40,7 +46,9 @@
 #import "ProfilesWindow.h"
 #import "PseudoTerminal.h"
 #import "PseudoTerminalRestorer.h"
+#import "ShellLaunchPool.h"
 #import "ToastWindowController.h"
+#import "UKCrashReporter/UKCrashReporter.h"
 #import "VT100Terminal.h"
 #import "iTermController.h"
 #import "iTermExpose.h"
@@ -86,15 +94,37 @@ static BOOL hasBecomeActive = NO;
 // NSApplication delegate methods
 - (void)applicationWillFinishLaunching:(NSNotification *)aNotification
 {
+    // Only what the first window needs is done now. See LaunchScheduler.
+    LaunchScheduler *scheduler = [LaunchScheduler sharedInstance];
+    [scheduler addTaskNamed:@"Binary log" phase:kLaunchPhaseBeforeFirstWindow block:^{
+        BinaryLogInitialize();
+    }];
+
     // set the TERM_PROGRAM environment variable
     putenv("TERM_PROGRAM=iTerm.app");
 
-    [self buildScriptMenu:nil];
+    // Scans the scripts folder, which could be big.
+    [scheduler addTaskNamed:@"Script menu" phase:kLaunchPhaseAfterFirstWindow block:^{
+        [self buildScriptMenu:nil];
+    }];
 
     // read preferences
-    [PreferencePanel migratePreferences];
-    [PreferencePanel sharedInstance];
-    [ITAddressBookMgr sharedInstance];
+    [scheduler addTaskNamed:@"Preferences" phase:kLaunchPhaseBeforeFirstWindow block:^{
+        [PreferencePanel migratePreferences];
+        [PreferencePanel sharedInstance];
+    }];
+    [scheduler addTaskNamed:@"Profiles" phase:kLaunchPhaseBeforeFirstWindow block:^{
+        [ITAddressBookMgr sharedInstance];
+    }];
+    if ([PTYServerClient isEnabled]) {
+        // Restored sessions look for their shells among these.
+        [scheduler addTaskNamed:@"PTY server" phase:kLaunchPhaseBeforeFirstWindow block:^{
+            [[PTYServerClient sharedInstance] claimChildren];
+        }];
+        [scheduler addTaskNamed:@"Unclaimed PTY server children" phase:kLaunchPhaseAfterFirstWindow block:^{
+            [[PTYServerClient sharedInstance] endUnclaimedChildren];
+        }];
+    }
 
     [ToolbeltView populateMenu:toolbeltMenu];
     [self _updateToolbeltMenuItem];
@@ -252,8 +282,23 @@ static BOOL hasBecomeActive = NO;
     [iTermFontPanel makeDefault];
 
     finishedLaunching_ = YES;
+    LaunchScheduler *scheduler = [LaunchScheduler sharedInstance];
     // Create the app support directory
-    [self _createFlag];
+    [scheduler addTaskNamed:@"Version flag" phase:kLaunchPhaseBackground block:^{
+        [self _createFlag];
+    }];
+    [scheduler addTaskNamed:@"Search tables" phase:kLaunchPhaseBackground block:^{
+        LineBlockPrepareSearchTables();
+    }];
+    if ([MetricsExporter isEnabled]) {
+        [scheduler addTaskNamed:@"Metrics exporter" phase:kLaunchPhaseAfterFirstWindow block:^{
+            [[MetricsExporter sharedInstance] start];
+        }];
+    }
+    // Shows a window if the last run crashed, so wait for the first window.
+    [scheduler addTaskNamed:@"Crash reporter" phase:kLaunchPhaseAfterFirstWindow block:^{
+        UKCrashReporterCheckForCrash();
+    }];
 
     // Prevent the input manager from swallowing control-q. See explanation here:
     // http://b4winckler.wordpress.com/2009/07/19/coercing-the-cocoa-text-system/
@@ -268,7 +313,14 @@ static BOOL hasBecomeActive = NO;
     PreferencePanel* ppanel = [PreferencePanel sharedInstance];
     // Code could be 0 (e.g., A on an American keyboard) and char is also sometimes 0 (seen in bug 2501).
     if ([ppanel hotkey] && ([ppanel hotkeyCode] || [ppanel hotkeyChar])) {
-        [[HotkeyWindowController sharedInstance] registerHotkey:[ppanel hotkeyCode] modifiers:[ppanel hotkeyModifiers]];
+        [scheduler addTaskNamed:@"Hotkey" phase:kLaunchPhaseBeforeFirstWindow block:^{
+            [[HotkeyWindowController sharedInstance] registerHotkey:[ppanel hotkeyCode]
+                                                          modifiers:[ppanel hotkeyModifiers]];
+        }];
+        // After restored windows have opened, so they stay in front.
+        [[HotkeyWindowController sharedInstance] performSelector:@selector(prewarmHotkeyWindowIfNeeded)
+                                                      withObject:nil
+                                                      afterDelay:0.5];
     }
     if ([ppanel isAnyModifierRemapped]) {
         // Use a brief delay so windows have a chance to open before the dialog is shown.
@@ -279,14 +331,20 @@ static BOOL hasBecomeActive = NO;
     [self _updateArrangementsMenu:windowArrangements_];
 
     // register for services
-    [NSApp registerServicesMenuSendTypes:[NSArray arrayWithObjects:NSStringPboardType, nil]
-                                                       returnTypes:[NSArray arrayWithObjects:NSFilenamesPboardType, NSStringPboardType, nil]];
+    [scheduler addTaskNamed:@"Services" phase:kLaunchPhaseAfterFirstWindow block:^{
+        [NSApp registerServicesMenuSendTypes:[NSArray arrayWithObjects:NSStringPboardType, nil]
+                                 returnTypes:[NSArray arrayWithObjects:NSFilenamesPboardType, NSStringPboardType, nil]];
+    }];
     // Sometimes, open untitled doc isn't called in Lion. We need to give application:openFile:
     // a chance to run because a "special" filename cancels _performStartupActivities.
     [self checkForQuietMode];
     [self performSelector:@selector(_performStartupActivities)
                withObject:nil
                afterDelay:0];
+    // Runs right after the startup activities have opened the first windows.
+    [scheduler performSelector:@selector(firstWindowDidAppear)
+                    withObject:nil
+                    afterDelay:0];
     [[NSNotificationCenter defaultCenter] postNotificationName:kApplicationDidFinishLaunchingNotification
                                                         object:nil];
     
@@ -421,6 +479,21 @@ static BOOL hasBecomeActive = NO;
 - (void)applicationWillTerminate:(NSNotification *)aNotification
 {
     [[HotkeyWindowController sharedInstance] stopEventTap];
+    [[ShellLaunchPool sharedInstance] removeAllTasks];
+    // Archived scrollback is nearly up to date; this writes the last few lines of each session so
+    // window restoration can bring it back.
+    for (PseudoTerminal *term in [[iTermController sharedInstance] terminals]) {
+        for (PTYSession *session in [term sessions]) {
+            [[session SCREEN] flushScrollbackArchive];
+        }
+    }
+    if ([PTYServerClient isEnabled]) {
+        NSMutableArray *sessions = [NSMutableArray array];
+        for (PseudoTerminal *term in [[iTermController sharedInstance] terminals]) {
+            [sessions addObjectsFromArray:[term sessions]];
+        }
+        [[PTYServerClient sharedInstance] handOffSessions:sessions];
+    }
 }
 
 - (PseudoTerminal *)terminalToOpenFileIn
@@ -842,6 +915,53 @@ static BOOL hasBecomeActive = NO;
     [[iTermController sharedInstance] irAdvance:1];
 }
 
+- (IBAction)openInstantReplayRecording:(id)sender
+{
+    PseudoTerminal *term = [[iTermController sharedInstance] currentTerminal];
+    if (!term) {
+        return;
+    }
+    NSOpenPanel *panel = [NSOpenPanel openPanel];
+    [panel setAllowedFileTypes:[NSArray arrayWithObjects:@"itermdvr", @"1", nil]];
+    NSString *directory =
+        [[NSUserDefaults standardUserDefaults] stringForKey:@"InstantReplayRecordingDirectory"];
+    if (directory) {
+        [panel setDirectoryURL:[NSURL fileURLWithPath:[directory stringByExpandingTildeInPath]]];
+    }
+    if ([panel runModal] == NSOKButton && ![term replayRecordingAtPath:[[panel URL] path]]) {
+        NSBeep();
+    }
+}
+
+- (IBAction)openPtyRecording:(id)sender
+{
+    [self _openPtyRecordingAtOriginalSpeed:YES];
+}
+
+- (IBAction)openPtyRecordingAtFullSpeed:(id)sender
+{
+    [self _openPtyRecordingAtOriginalSpeed:NO];
+}
+
+- (void)_openPtyRecordingAtOriginalSpeed:(BOOL)originalSpeed
+{
+    PseudoTerminal *term = [[iTermController sharedInstance] currentTerminal];
+    if (!term) {
+        return;
+    }
+    NSOpenPanel *panel = [NSOpenPanel openPanel];
+    [panel setAllowedFileTypes:[NSArray arrayWithObject:@"itermrec"]];
+    NSString *directory =
+        [[NSUserDefaults standardUserDefaults] stringForKey:@"PTYRecordingDirectory"];
+    if (directory) {
+        [panel setDirectoryURL:[NSURL fileURLWithPath:[directory stringByExpandingTildeInPath]]];
+    }
+    if ([panel runModal] == NSOKButton &&
+        ![term replayPtyRecordingAtPath:[[panel URL] path] atOriginalSpeed:originalSpeed]) {
+        NSBeep();
+    }
+}
+
 - (void)_newSessionMenu:(NSMenu*)superMenu title:(NSString*)title target:(id)aTarget selector:(SEL)selector openAllSelector:(SEL)openAllSelector
 {
     //new window menu
@@ -1086,6 +1206,11 @@ static BOOL hasBecomeActive = NO;
   ToggleDebugLogging();
 }
 
+- (IBAction)showMemoryReport:(id)sender
+{
+    [[MemoryReportWindowController sharedInstance] showWindow:nil];
+}
+
 // About window
 - (NSAttributedString *)_linkTo:(NSString *)urlString title:(NSString *)title
 {
@@ -38,6 +38,7 @@
 @class PasteboardHistory;
 @class GTMCarbonHotKey;
 @class PTYSession;
+@class MemoryReport;
 @class PTYTab;
 
 @interface iTermController : NSObject
@@ -122,6 +123,9 @@
 - (PseudoTerminal *)terminalWithTab:(PTYTab *)tab;
 - (PseudoTerminal *)terminalWithSession:(PTYSession *)session;
 
+// Returns a report with a section for each session and one for memory they share.
+- (MemoryReport *)memoryReport;
+
 
 @end
 
@@ -36,6 +36,8 @@
 #import "FutureMethods.h"
 #import "HotkeyWindowController.h"
 #import "ITAddressBookMgr.h"
+#import "LineBlockPayloadStore.h"
+#import "MemoryReport.h"
 #import "NSStringITerm.h"
 #import "NSView+RecursiveDescription.h"
 #import "PTYSession.h"
@@ -43,6 +45,7 @@
 #import "PasteboardHistory.h"
 #import "PreferencePanel.h"
 #import "PseudoTerminal.h"
+#import "ScrollbackBudget.h"
 #import "UKCrashReporter/UKCrashReporter.h"
 #import "VT100Screen.h"
 #import "WindowArrangements.h"
@@ -144,8 +147,7 @@ static BOOL initDone = NO;
     self = [super init];
 
     if (self) {
-        UKCrashReporterCheckForCrash();
-
+        // The crash reporter is checked by iTermApplicationDelegate once the first window is up.
         runningApplicationClass_ = NSClassFromString(@"NSRunningApplication"); // 10.6
         // create the iTerm directory if it does not exist
         NSFileManager *fileManager = [NSFileManager defaultManager];
@@ -814,6 +816,23 @@ static BOOL initDone = NO;
     return nil;
 }
 
+- (MemoryReport *)memoryReport
+{
+    MemoryReport *report = [[[MemoryReport alloc] init] autorelease];
+    for (PseudoTerminal *term in [self terminals]) {
+        for (PTYSession *session in [term allSessions]) {
+            [session addToMemoryReport:report];
+        }
+    }
+    [report beginSectionWithName:@"Shared"];
+    int numberOfComplexChars;
+    long long complexCharBytes = ComplexCharTableBytes(&numberOfComplexChars);
+    [report addBytes:complexCharBytes count:numberOfComplexChars forCategory:@"Complex char table"];
+    [[ScrollbackBudget sharedInstance] addToMemoryReport:report];
+    [[LineBlockPayloadStore sharedInstance] addToMemoryReport:report];
+    return report;
+}
+
 - (PseudoTerminal *)_openNewSessionsFromMenu:(NSMenu*)parent
                                  inNewWindow:(BOOL)newWindow
                                    usedGuids:(NSMutableSet*)usedGuids
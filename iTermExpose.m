@@ -26,6 +26,7 @@
  */
 
 #import "iTermExpose.h"
+#import "ContentsChangeFeed.h"
 #import "FutureMethods.h"
 #import "GlobalSearch.h"
 #import "HotkeyWindowController.h"
@@ -34,6 +35,18 @@
 #import "iTermController.h"
 
 static const float THUMB_MARGIN = 25;
+
+// With more tabs than this their pictures are too small to read, so they're drawn from session
+// thumbnails instead of by drawing their text.
+static const int kMaxTabsWithText = 4;
+
+static NSImage *ExposeImageOfTab(PTYTab *tab) {
+    int numTabs = 0;
+    for (PseudoTerminal *term in [[iTermController sharedInstance] terminals]) {
+        numTabs += [[term tabs] count];
+    }
+    return [tab image:NO thumbnails:numTabs > kMaxTabsWithText];
+}
 /*
 static NSString* FormatRect(NSRect r) {
     return [NSString stringWithFormat:@"%lf,%lf %lfx%lf", r.origin.x, r.origin.y,
@@ -174,7 +187,7 @@ static NSString* FormatRect(NSRect r) {
            screenFrame:(NSRect)screenFrame
                 frames:(NSRect*)frames;
 
-- (void)tabChangedSinceLastExpose;
+- (void)tabsChanged:(ContentsChangeSummary *)summary;
 
 @end
 
@@ -892,7 +905,7 @@ static NSScreen *ExposeScreen() {
         if ([aView isKindOfClass:[iTermExposeTabView class]]) {
             if ([aView tabIndex] == tabIndex &&
                 [aView windowIndex] == windowIndex) {
-                [aView setImage:[theTab image:NO]];
+                [aView setImage:ExposeImageOfTab(theTab)];
                 [aView setLabel:[iTermExpose labelForTab:theTab
                                             windowNumber:[aView windowIndex] + 1
                                                tabNumber:[aView tabIndex] + 1]];
@@ -1124,7 +1137,7 @@ static NSScreen *ExposeScreen() {
             i++;
             if ([tabView tabObject]) {
                 [images replaceObjectAtIndex:[tabView index]
-                                  withObject:[[tabView tabObject] image:NO]];
+                                  withObject:ExposeImageOfTab([tabView tabObject])];
             } else {
                 // TODO: test this
                 [images replaceObjectAtIndex:[tabView index]
@@ -1211,10 +1224,10 @@ static NSScreen *ExposeScreen() {
     if (self) {
         // If anything changes, we exit because there isn't yet code to
         // rearrange thumbnails.
-        [[NSNotificationCenter defaultCenter] addObserver:self
-                                                 selector:@selector(tabChangedSinceLastExpose)
-                                                     name:@"iTermTabContentsChanged"
-                                                   object:nil];
+        // Redrawing thumbnails is slow, so not more than 10 times a second.
+        [[ContentsChangeFeed sharedInstance] addSubscriber:self
+                                                  selector:@selector(tabsChanged:)
+                                               maximumRate:10];
         [[NSNotificationCenter defaultCenter] addObserver:self
                                                  selector:@selector(recomputeIndices:)
                                                      name:@"iTermNumberOfSessionsDidChange"
@@ -1249,6 +1262,7 @@ static NSScreen *ExposeScreen() {
     [window_ close];
     [view_ release];
     [[NSNotificationCenter defaultCenter] removeObserver:self];
+    [[ContentsChangeFeed sharedInstance] removeSubscriber:self];
     [super dealloc];
 }
 
@@ -1639,7 +1653,7 @@ static BOOL AdvanceCell(float* x, float* y, NSRect screenFrame, NSSize size) {
             if ([aTab hasMaximizedPane]) {
                 [aTab unmaximize];
             }
-            [images addObject:[aTab image:NO]];
+            [images addObject:ExposeImageOfTab(aTab)];
             [tabs addObject:aTab];
             NSString* label = [iTermExpose labelForTab:aTab windowNumber:i+1 tabNumber:j+1];
             [labels addObject:label];
@@ -1652,13 +1666,12 @@ static BOOL AdvanceCell(float* x, float* y, NSRect screenFrame, NSSize size) {
     return selectedIndex;
 }
 
-- (void)tabChangedSinceLastExpose
+- (void)tabsChanged:(ContentsChangeSummary *)summary
 {
     for (PseudoTerminal* term in [[iTermController sharedInstance] terminals]) {
         for (PTYTab* aTab in [term tabs]) {
             for (PTYSession* aSession in [aTab sessions]) {
-                PTYTextView* aTextView = [aSession TEXTVIEW];
-                if ([aTextView getAndResetChangedSinceLastExpose]) {
+                if ([summary containsSession:aSession]) {
                     [self updateTab:aTab];
                     break;
                 }
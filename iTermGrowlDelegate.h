@@ -56,6 +56,7 @@
 
 #import <Cocoa/Cocoa.h>
 #import "Growl.framework/Headers/GrowlApplicationBridge.h"
+#import "NotificationBatcher.h"
 
 
 #define OURGROWLAPPNAME  @"iTerm"
@@ -69,9 +70,12 @@
 
 @interface iTermGrowlDelegate : NSObject <
   GrowlApplicationBridgeDelegate,
+  NotificationBatcherDelegate,
   NSUserNotificationCenterDelegate> {
     BOOL enabled;
     NSArray * notifications;
+    NotificationBatcher *batcher_;
+    dispatch_queue_t deliveryQueue_;  // Growl and Notification Center are called on this.
 }
 
 + (id) sharedInstance;
@@ -89,6 +93,11 @@
    **/
 - (void) setEnabled: (BOOL) newState;
 
+  /**
+   **  Counts of messages that were combined with others or dropped.
+   **/
+- (NotificationBatcher *)batcher;
+
   /**
    **  Generate a Growl message with no description and a notification type
    **  of "Miscellaneous".
@@ -111,6 +120,10 @@
    **  Generate a 'full' Growl message with a specified notification type,
    **  associated with a particular window/tab/view.
    **
+   **  Bursts of messages of the same type from the same view are combined,
+   **  and there's a limit on how many are shown at once. See
+   **  NotificationBatcher.
+   **
    **  Retrns YES if the notification was posted.
    **/
 - (BOOL)growlNotify:(NSString *)title
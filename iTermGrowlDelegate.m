@@ -82,6 +82,10 @@
         [self registrationDictionaryForGrowl];
         [self setEnabled:YES];
 
+        batcher_ = [[NotificationBatcher alloc] init];
+        batcher_.delegate = self;
+        deliveryQueue_ = dispatch_queue_create("com.googlecode.iterm2.notifications", NULL);
+
         return self;
     } else {
         return nil;
@@ -91,6 +95,9 @@
 - (void)dealloc
 {
     [notifications release];
+    batcher_.delegate = nil;
+    [batcher_ release];
+    dispatch_release(deliveryQueue_);
     [super dealloc];
 }
 
@@ -108,6 +115,11 @@
     enabled = newState;
 }
 
+- (NotificationBatcher *)batcher
+{
+    return batcher_;
+}
+
 - (void)growlNotify:(NSString *)title
 {
     [self growlNotify:title withDescription:nil];
@@ -148,8 +160,31 @@
                      @"view": @(viewIndex) };
     }
 
-    if ([[PreferencePanel sharedInstance] enableGrowl]) {
-        if ([self isEnabled]) {
+    if ([[PreferencePanel sharedInstance] enableGrowl] &&
+        ([self isEnabled] || IsMountainLionOrLater())) {
+        NSString *key = [NSString stringWithFormat:@"%@ %d/%d/%d",
+                            notification, windowIndex, tabIndex, viewIndex];
+        [batcher_ addNotificationWithTitle:title
+                               description:description
+                              notification:notification
+                                   context:context
+                                       key:key];
+        return YES;
+    }
+
+    return NO;
+}
+
+#pragma mark - NotificationBatcherDelegate
+
+- (void)notificationBatcherDeliverTitle:(NSString *)title
+                            description:(NSString *)description
+                           notification:(NSString *)notification
+                                context:(NSDictionary *)context
+{
+    // Posting can block for a while when a lot are shown, so do it off the main thread.
+    if ([self isEnabled]) {
+        dispatch_async(deliveryQueue_, ^{
             [GrowlApplicationBridge notifyWithTitle:title
                                         description:description
                                    notificationName:notification
@@ -157,20 +192,18 @@
                                            priority:0
                                            isSticky:NO
                                        clickContext:context];
-            return YES;
-        } else if (IsMountainLionOrLater()) {
-            // Fall back to notification center.
-            NSUserNotification *notification = [[[NSUserNotification alloc] init] autorelease];
-            notification.title = title;
-            notification.informativeText = description;
-            notification.soundName = nil;
-            notification.userInfo = context;
-            [[NSUserNotificationCenter defaultUserNotificationCenter] deliverNotification:notification];
-            return YES;
-        }
+        });
+    } else if (IsMountainLionOrLater()) {
+        // Fall back to notification center.
+        NSUserNotification *userNotification = [[[NSUserNotification alloc] init] autorelease];
+        userNotification.title = title;
+        userNotification.informativeText = description;
+        userNotification.soundName = nil;
+        userNotification.userInfo = context;
+        dispatch_async(deliveryQueue_, ^{
+            [[NSUserNotificationCenter defaultUserNotificationCenter] deliverNotification:userNotification];
+        });
     }
-
-    return NO;
 }
 
 - (void)growlNotificationWasClicked:(id)clickContext
@@ -78,8 +78,163 @@
 
 static NSDictionary* globalKeyMap;
 
+// How many compiled key maps to keep. There's one for the global map and one for each distinct
+// profile map that's been used to look up a key, and few people have more than a handful.
+#define kKeyBindingTableCacheSize 8
+
+// Marks a used slot in a KeyBindingTable, so that keycode 0 with no modifiers is a valid key.
+static const uint64_t kKeyBindingTableKeyUsed = 1ULL << 63;
+
+static uint64_t KeyBindingTablePackKey(unichar keyCode, unsigned int modifiers) {
+    return kKeyBindingTableKeyUsed | ((uint64_t)keyCode << 32) | modifiers;
+}
+
+// A key map ("0xKeycode-0xModifiers" -> {Action, Text}) compiled into an open-addressed hash
+// table keyed by packed keycode and modifiers, so looking up a keystroke formats no strings and
+// allocates nothing.
+@interface KeyBindingTable : NSObject {
+@public
+    // Retained so its address can't be reused by a different map while the table is cached.
+    NSDictionary *keyMappings_;
+    NSUInteger numberOfMappings_;  // [keyMappings_ count] when compiled, to catch mutation.
+    uint64_t *keys_;
+    int *actions_;
+    NSString **texts_;  // Owned by keyMappings_.
+    NSUInteger mask_;  // Capacity - 1. The capacity is a power of two at least twice the count.
+}
+- (id)initWithKeyMappings:(NSDictionary *)keyMappings;
+- (BOOL)getAction:(int *)action
+             text:(NSString **)text
+       forKeyCode:(unichar)keyCode
+        modifiers:(unsigned int)modifiers;
+@end
+
+@implementation KeyBindingTable
+
+// Returns the slot holding |key|, or the empty slot where it belongs.
+- (NSUInteger)slotForKey:(uint64_t)key
+{
+    uint64_t hash = key * 0x9e3779b97f4a7c15ULL;
+    NSUInteger i = (hash >> 32) & mask_;
+    while (keys_[i] && keys_[i] != key) {
+        i = (i + 1) & mask_;
+    }
+    return i;
+}
+
+- (id)initWithKeyMappings:(NSDictionary *)keyMappings
+{
+    self = [super init];
+    if (self) {
+        keyMappings_ = [keyMappings retain];
+        numberOfMappings_ = [keyMappings count];
+        NSUInteger capacity = 16;
+        while (capacity < numberOfMappings_ * 2) {
+            capacity *= 2;
+        }
+        mask_ = capacity - 1;
+        keys_ = calloc(capacity, sizeof(uint64_t));
+        actions_ = calloc(capacity, sizeof(int));
+        texts_ = calloc(capacity, sizeof(NSString *));
+
+        for (NSString *keyString in keyMappings) {
+            unsigned int keyCode;
+            unsigned int modifiers;
+            if (![keyString isKindOfClass:[NSString class]] ||
+                sscanf([keyString UTF8String], "0x%x-0x%x", &keyCode, &modifiers) != 2 ||
+                keyCode > 0xffff) {
+                continue;
+            }
+            // Lookups used to format the key and compare strings, so a key written any other way
+            // (say, with uppercase hex digits) never matched. Keep it that way.
+            if (![keyString isEqualToString:[NSString stringWithFormat:@"0x%x-0x%x", keyCode, modifiers]]) {
+                continue;
+            }
+            NSDictionary *mapping = [keyMappings objectForKey:keyString];
+            const uint64_t key = KeyBindingTablePackKey(keyCode, modifiers);
+            NSUInteger i = [self slotForKey:key];
+            keys_[i] = key;
+            actions_[i] = [[mapping objectForKey:@"Action"] intValue];
+            texts_[i] = [mapping objectForKey:@"Text"];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    free(keys_);
+    free(actions_);
+    free(texts_);
+    [keyMappings_ release];
+    [super dealloc];
+}
+
+- (BOOL)getAction:(int *)action
+             text:(NSString **)text
+       forKeyCode:(unichar)keyCode
+        modifiers:(unsigned int)modifiers
+{
+    const uint64_t key = KeyBindingTablePackKey(keyCode, modifiers);
+    const NSUInteger i = [self slotForKey:key];
+    if (!keys_[i]) {
+        return NO;
+    }
+    *action = actions_[i];
+    *text = texts_[i];
+    return YES;
+}
+
+@end
+
+// Most recently used first.
+static KeyBindingTable *gKeyBindingTables[kKeyBindingTableCacheSize];
+
 @implementation iTermKeyBindingMgr
 
+// Returns the compiled table for |keyMappings|, compiling it if it isn't cached. Main thread only.
++ (KeyBindingTable *)_tableForKeyMappings:(NSDictionary *)keyMappings
+{
+    int i;
+    for (i = 0; i < kKeyBindingTableCacheSize && gKeyBindingTables[i]; i++) {
+        KeyBindingTable *table = gKeyBindingTables[i];
+        if (table->keyMappings_ == keyMappings) {
+            if (table->numberOfMappings_ == [keyMappings count]) {
+                break;
+            }
+            // It was mutated behind our back.
+            [table release];
+            memmove(gKeyBindingTables + i,
+                    gKeyBindingTables + i + 1,
+                    (kKeyBindingTableCacheSize - i - 1) * sizeof(KeyBindingTable *));
+            gKeyBindingTables[kKeyBindingTableCacheSize - 1] = nil;
+            i = kKeyBindingTableCacheSize;
+            break;
+        }
+    }
+
+    KeyBindingTable *table;
+    if (i < kKeyBindingTableCacheSize && gKeyBindingTables[i]) {
+        table = gKeyBindingTables[i];
+    } else {
+        table = [[KeyBindingTable alloc] initWithKeyMappings:keyMappings];
+        i = kKeyBindingTableCacheSize - 1;
+        [gKeyBindingTables[i] release];
+    }
+    memmove(gKeyBindingTables + 1, gKeyBindingTables, i * sizeof(KeyBindingTable *));
+    gKeyBindingTables[0] = table;
+    return table;
+}
+
+// Call after changing a key map in place. Unchanged maps are compiled again when next used.
++ (void)_keyMappingsDidChange
+{
+    for (int i = 0; i < kKeyBindingTableCacheSize; i++) {
+        [gKeyBindingTables[i] release];
+        gKeyBindingTables[i] = nil;
+    }
+}
+
 + (NSString *)formatKeyCombination:(NSString *)theKeyCombination
 {
     unsigned int keyMods;
@@ -482,9 +637,6 @@ static NSDictionary* globalKeyMap;
                         text:(NSString **) text
                  keyMappings:(NSDictionary *)keyMappings
 {
-    NSString *keyString;
-    NSDictionary *theKeyMapping;
-    int retCode = -1;
     unsigned int theModifiers;
 
     // turn off all the other modifier bits we don't care about
@@ -495,21 +647,23 @@ static NSDictionary* globalKeyMap;
         theModifiers |= NSNumericPadKeyMask;
     }
 
-    keyString = [NSString stringWithFormat: @"0x%x-0x%x", keyCode, theModifiers];
-    theKeyMapping = [keyMappings objectForKey: keyString];
-    if (theKeyMapping == nil) {
+    int retCode;
+    NSString *theText;
+    if (!keyMappings ||
+        ![[self _tableForKeyMappings:keyMappings] getAction:&retCode
+                                                       text:&theText
+                                                 forKeyCode:keyCode
+                                                  modifiers:theModifiers]) {
         if (text) {
             *text = nil;
         }
         return -1;
     }
 
-    // parse the mapping
-    retCode = [[theKeyMapping objectForKey: @"Action"] intValue];
-    if(text != nil)
-        *text = [theKeyMapping objectForKey: @"Text"];
-
-    return (retCode);
+    if (text != nil) {
+        *text = theText;
+    }
+    return retCode;
 }
 
 + (void)_loadGlobalKeyMap
@@ -535,6 +689,7 @@ static NSDictionary* globalKeyMap;
     [globalKeyMap release];
     globalKeyMap = [src copy];
     [[NSUserDefaults standardUserDefaults] setObject:globalKeyMap forKey:@"GlobalKeyMap"];
+    [self _keyMappingsDidChange];
 }
 
 + (int)actionForKeyCode:(unichar)keyCode
@@ -583,6 +738,7 @@ static NSDictionary* globalKeyMap;
         [[NSUserDefaults standardUserDefaults] removeObjectForKey:@"GlobalKeyMap"];
     }
     [self _loadGlobalKeyMap];
+    [self _keyMappingsDidChange];
 }
 
 + (NSDictionary*)readPresetKeyMappingsFromPlist:(NSString *)thePlist {
@@ -604,6 +760,7 @@ static NSDictionary* globalKeyMap;
     [km setDictionary:settings];
 
     [bookmark setObject:km forKey:KEY_KEYBOARD_MAP];
+    [self _keyMappingsDidChange];
 }
 
 + (NSArray *)presetKeyMappingsNames
@@ -648,6 +805,8 @@ static NSDictionary* globalKeyMap;
         [km removeObjectForKey:origKeyCombo];
     }
     [km setObject:keyBinding forKey:keyString];
+    // |km| was changed in place, so its compiled table is stale even if its count isn't.
+    [self _keyMappingsDidChange];
 }
 
 + (void)setMappingAtIndex:(int)rowIndex
@@ -0,0 +1,33 @@
+#import "iTermTests.h"
+#import "AutocompleteIndexTest.h"
+#import "AutocompleteIndex.h"
+
+@implementation AutocompleteIndexTest
+
+- (void)testWordsWithPrefix {
+    AutocompleteIndex *index = [[[AutocompleteIndex alloc] initWithWordChars:@"-"] autorelease];
+    [index addText:@"deploy Deployment\nde deployer:deploy re-deploy"];
+    [index flush];
+
+    // The most frequent word comes first, and the prefix itself and short words are left out.
+    NSArray *words = [index wordsWithPrefix:@"DEP" maxWords:10];
+    assert([words count] == 3);
+    assert([[words objectAtIndex:0] isEqualToString:@"deploy"]);
+    assert([words containsObject:@"Deployment"]);
+    assert([words containsObject:@"deployer"]);
+    assert([[index wordsWithPrefix:@"deploy" maxWords:10] count] == 2);
+    assert([[index wordsWithPrefix:@"dep" maxWords:1] count] == 1);
+    assert([[index wordsWithPrefix:@"re-" maxWords:10] isEqualToArray:@[ @"re-deploy" ]]);
+    assert([[index wordsWithPrefix:@"de" maxWords:10] count] == 3);
+
+    // Recent words beat ones that were seen as often earlier.
+    [index addText:@"deployer"];
+    [index flush];
+    assert([[[index wordsWithPrefix:@"dep" maxWords:10] objectAtIndex:0] isEqualToString:@"deployer"]);
+
+    [index removeAllWords];
+    [index flush];
+    assert([[index wordsWithPrefix:@"dep" maxWords:10] count] == 0);
+}
+
+@end
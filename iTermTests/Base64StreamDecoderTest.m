@@ -0,0 +1,54 @@
+#import "iTermTests.h"
+#import "Base64StreamDecoderTest.h"
+#import "Base64StreamDecoder.h"
+
+@implementation Base64StreamDecoderTest
+
+// Decodes |encoded| split into pieces of |pieceLength| chars.
+- (NSData *)decode:(NSString *)encoded inPiecesOfLength:(int)pieceLength ok:(BOOL *)ok {
+    Base64StreamDecoder *decoder = [[[Base64StreamDecoder alloc] init] autorelease];
+    NSMutableData *output = [NSMutableData data];
+    const char *chars = [encoded UTF8String];
+    const int length = strlen(chars);
+    *ok = YES;
+    for (int i = 0; i < length && *ok; i += pieceLength) {
+        *ok = [decoder decodeChars:chars + i length:MIN(pieceLength, length - i) intoData:output];
+    }
+    if (*ok) {
+        *ok = [decoder finishIntoData:output];
+    }
+    assert(!*ok || decoder.decodedLength == [output length]);
+    return output;
+}
+
+- (void)testDecodesAcrossChunkBoundaries {
+    NSString *expected = @"The quick brown fox jumps over the lazy dog.";
+    NSString *padded = @"VGhlIHF1aWNrIGJyb3duIGZveCBqdW1w\r\ncyBvdmVyIHRoZSBsYXp5IGRvZy4=";
+    NSString *unpadded = @"VGhlIHF1aWNrIGJyb3duIGZveCBqdW1wcyBvdmVyIHRoZSBsYXp5IGRvZy4";
+    for (int pieceLength = 1; pieceLength <= 9; pieceLength++) {
+        BOOL ok;
+        NSData *data = [self decode:padded inPiecesOfLength:pieceLength ok:&ok];
+        assert(ok);
+        assert([data isEqualToData:[expected dataUsingEncoding:NSUTF8StringEncoding]]);
+
+        data = [self decode:unpadded inPiecesOfLength:pieceLength ok:&ok];
+        assert(ok);
+        assert([data isEqualToData:[expected dataUsingEncoding:NSUTF8StringEncoding]]);
+    }
+}
+
+- (void)testRejectsInvalidInput {
+    BOOL ok;
+    [self decode:@"YWJj*GVm" inPiecesOfLength:100 ok:&ok];
+    assert(!ok);
+    [self decode:@"YWI=YWJj" inPiecesOfLength:3 ok:&ok];
+    assert(!ok);
+    [self decode:@"YWJjZ" inPiecesOfLength:2 ok:&ok];
+    assert(!ok);
+
+    NSData *data = [self decode:@"YWI=\n" inPiecesOfLength:1 ok:&ok];
+    assert(ok);
+    assert([data isEqualToData:[@"ab" dataUsingEncoding:NSUTF8StringEncoding]]);
+}
+
+@end
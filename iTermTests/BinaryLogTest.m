@@ -0,0 +1,40 @@
+#import "iTermTests.h"
+#import "BinaryLogTest.h"
+#import "BinaryLog.h"
+
+@implementation BinaryLogTest
+
+- (void)teardown {
+    BinaryLogSetCategories(0);
+}
+
+- (void)testFormattedRecords {
+    BinaryLogSetCategories(kBinaryLogCategoryParser);
+    BLog(kBinaryLogCategoryParser, "no arguments");
+    BLog(kBinaryLogCategoryParser, "ints %d %05u %lx %c%%", -3, 42, 0xbeefL, 'z');
+    BLog(kBinaryLogCategoryParser, "missing %d and string %s", 7, "unsafe");
+    BLog(kBinaryLogCategoryScreen, "not recorded");
+
+    NSString *log = BinaryLogFormattedRecords();
+    NSRange none = [log rangeOfString:@"): no arguments\n"];
+    NSRange ints = [log rangeOfString:@"): ints -3 00042 beef z%\n"];
+    assert(none.location != NSNotFound);
+    assert(ints.location != NSNotFound);
+    assert(none.location < ints.location);
+    assert([log rangeOfString:@"): missing 7 and string ?\n"].location != NSNotFound);
+    assert([log rangeOfString:@"not recorded"].location == NSNotFound);
+}
+
+- (void)testRingKeepsNewestRecords {
+    BinaryLogSetCategories(kBinaryLogAllCategories);
+    for (int i = 0; i < kBinaryLogRecordsPerThread + 10; i++) {
+        BLog(kBinaryLogCategoryScreen, "wrap %d", i);
+    }
+    NSString *log = BinaryLogFormattedRecords();
+    assert([log rangeOfString:@"): wrap 9\n"].location == NSNotFound);
+    assert([log rangeOfString:@"): wrap 10\n"].location != NSNotFound);
+    NSString *last = [NSString stringWithFormat:@"): wrap %d\n", kBinaryLogRecordsPerThread + 9];
+    assert([log rangeOfString:last].location != NSNotFound);
+}
+
+@end
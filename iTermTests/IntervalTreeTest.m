@@ -353,4 +353,72 @@ static Interval *MakeInterval(long long location, long long length) {
     [tree_ removeObject:obj3_];
     [tree_ sanityCheck];
 }
+
+- (void)testEnumerateObjectsInIntervalInLocationOrder {
+    tree_ = [[[IntervalTree alloc] init] autorelease];
+    [tree_ addObject:obj3_ withInterval:MakeInterval(30, 5)];
+    [tree_ addObject:obj1_ withInterval:MakeInterval(10, 50)];
+    [tree_ addObject:obj2_ withInterval:MakeInterval(20, 5)];
+    [tree_ addObject:obj4_ withInterval:MakeInterval(40, 0)];
+    NSMutableArray *found = [NSMutableArray array];
+    [tree_ enumerateObjectsInInterval:MakeInterval(22, 20)
+                           usingBlock:^(id<IntervalTreeObject> object, BOOL *stop) {
+                               [found addObject:object];
+                           }];
+    assert([found isEqualToArray:(@[ obj1_, obj2_, obj3_ ])]);
+
+    [found removeAllObjects];
+    [tree_ enumerateObjectsInInterval:MakeInterval(0, 100)
+                           usingBlock:^(id<IntervalTreeObject> object, BOOL *stop) {
+                               [found addObject:object];
+                               *stop = YES;
+                           }];
+    assert([found isEqualToArray:(@[ obj1_ ])]);
+}
+
+// Appends and removals from either end take different paths to keep the max limits current.
+- (void)testAppendAndRemoveAtEnds {
+    tree_ = [[[IntervalTree alloc] init] autorelease];
+    NSMutableArray *objects = [NSMutableArray array];
+    for (int i = 0; i < 40; i++) {
+        ITObject *object = [[[ITObject alloc] init] autorelease];
+        [objects addObject:object];
+        [tree_ addObject:object withInterval:MakeInterval(i * 10, 5)];
+        [self assertEntriesInInterval:MakeInterval(i * 10 + 4, 1) equal:@[ object ]];
+        [tree_ sanityCheck];
+    }
+    [tree_ removeObject:objects[0]];
+    [tree_ removeObject:[objects lastObject]];
+    [tree_ sanityCheck];
+    assert(tree_.count == 38);
+    [self assertEntriesInInterval:MakeInterval(0, 5) equal:@[]];
+    [self assertEntriesInInterval:MakeInterval(390, 5) equal:@[]];
+    [self assertEntriesInInterval:MakeInterval(0, 25) equal:(@[ objects[1], objects[2] ])];
+    assert([tree_ containsObject:objects[1]]);
+    assert(![tree_ containsObject:objects[0]]);
+    assert(((ITObject *)objects[0]).entry == nil);
+    assert([[tree_ objectsWithSmallestLimit] isEqualToArray:@[ objects[1] ]]);
+    assert([[tree_ objectsWithLargestLimit] isEqualToArray:@[ objects[38] ]]);
+    assert([[tree_ objectsWithLargestLimitBefore:25] isEqualToArray:@[ objects[1] ]]);
+    assert([[tree_ objectsWithSmallestLimitAfter:25] isEqualToArray:@[ objects[3] ]]);
+}
+
+- (void)testRemoveObjectsBefore {
+    tree_ = [[[IntervalTree alloc] init] autorelease];
+    [tree_ addObject:obj1_ withInterval:MakeInterval(0, 10)];   // [0, 10)
+    [tree_ addObject:obj2_ withInterval:MakeInterval(5, 100)];  // [5, 105)
+    [tree_ addObject:obj3_ withInterval:MakeInterval(8, 12)];   // [8, 20)
+    [tree_ addObject:obj4_ withInterval:MakeInterval(20, 5)];   // [20, 25)
+    [tree_ addObject:obj5_ withInterval:MakeInterval(30, 5)];   // [30, 35)
+    NSArray *removed = [tree_ removeObjectsBefore:20];
+    assert(removed.count == 2);
+    assert([[removed[0] object] isEqual:obj1_]);
+    assert([[removed[1] object] isEqual:obj3_]);
+    assert(obj1_.entry == nil);
+    assert(obj3_.entry == nil);
+    assert(tree_.count == 3);
+    [tree_ sanityCheck];
+    [self assertEntriesInInterval:MakeInterval(0, 100) equal:(@[ obj2_, obj4_, obj5_ ])];
+    assert([[tree_ removeObjectsBefore:20] count] == 0);
+}
 @end
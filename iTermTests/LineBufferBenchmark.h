@@ -0,0 +1,26 @@
+//
+//  LineBufferBenchmark.h
+//  iTerm
+//
+//  Times LineBuffer operations on generated scrollback and reports ns/op and the bytes each line
+//  costs, so changes to how scrollback is stored can be compared. Run the iTermTests binary with
+//  ITERM_BENCHMARK_LINEBUFFER=1 in the environment.
+//
+//  Environment:
+//    ITERM_BENCHMARK_LINES      Comma-separated numbers of lines to fill the buffer with
+//                               (default 10000,1000000). 10000000 needs several GB.
+//    ITERM_BENCHMARK_BASELINE   Plist of ns/op results to compare against
+//                               (default tests/benchmarks/linebuffer-baseline.plist).
+//    ITERM_BENCHMARK_RECORD     If set, write the results to the baseline file instead of
+//                               comparing against it.
+//
+
+#import <Foundation/Foundation.h>
+
+@interface LineBufferBenchmark : NSObject
+
+// Runs all benchmarks and logs a report. Returns NO if any operation is slower than its baseline
+// by more than the allowed tolerance.
+- (BOOL)run;
+
+@end
@@ -0,0 +1,322 @@
+//
+//  LineBufferBenchmark.m
+//  iTerm
+//
+//  Lines are generated with a fixed seed for each distribution so runs are comparable.
+//
+
+#import "LineBufferBenchmark.h"
+#import "FindContext.h"
+#import "LineBlock.h"
+#import "LineBuffer.h"
+#import "LineBufferHelpers.h"
+#import "LineBufferPosition.h"
+#include <mach/mach_time.h>
+
+static NSString *const kDefaultLineCounts = @"10000,1000000";
+static NSString *const kDefaultBaselinePath = @"tests/benchmarks/linebuffer-baseline.plist";
+static const int kWidth = 80;
+static const int kMaxLineLength = 2000;
+static const int kMaxLookups = 1000000;  // Lookups timed for copyLineToBuffer and convertPositions.
+static const int kWidthChanges = 10;
+static const int kPops = 10000;
+static const double kTolerance = 0.10;  // Fraction slower than baseline that counts as a regression.
+
+typedef enum {
+    kLineLengthsShort,    // 0-20 chars, like ls output.
+    kLineLengthsTypical,  // 0-100, like tests/spam.cc.
+    kLineLengthsLong,     // 200-2000, each wrapping over many rows, like minified JSON.
+    kNumberOfLineLengthDistributions
+} LineLengthDistribution;
+
+static NSString *const kDistributionNames[] = { @"short", @"typical", @"long" };
+
+static double NanosecondsSince(uint64_t start) {
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return (double)(mach_absolute_time() - start) * timebase.numer / timebase.denom;
+}
+
+static int LineLength(LineLengthDistribution distribution) {
+    switch (distribution) {
+        case kLineLengthsShort:
+            return random() % 21;
+        case kLineLengthsTypical:
+            return random() % 101;
+        case kLineLengthsLong:
+        case kNumberOfLineLengthDistributions:
+            break;
+    }
+    return 200 + random() % (kMaxLineLength - 199);
+}
+
+@implementation LineBufferBenchmark {
+    NSMutableDictionary *results_;  // "lines.distribution.operation" -> ns/op
+}
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        results_ = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [results_ release];
+    [super dealloc];
+}
+
+- (NSArray *)lineCounts {
+    const char *counts = getenv("ITERM_BENCHMARK_LINES");
+    NSString *string = counts ? [NSString stringWithUTF8String:counts] : kDefaultLineCounts;
+    NSMutableArray *result = [NSMutableArray array];
+    for (NSString *count in [string componentsSeparatedByString:@","]) {
+        if ([count intValue] > 0) {
+            [result addObject:@([count intValue])];
+        }
+    }
+    return result;
+}
+
+#pragma mark - Reporting
+
+- (void)recordKey:(NSString *)key operation:(NSString *)operation nanoseconds:(double)ns ops:(int)ops {
+    const double nsPerOp = ns / MAX(1, ops);
+    NSLog(@"  %-24s %-20s %12.1f ns/op (%d ops)",
+          [key UTF8String], [operation UTF8String], nsPerOp, ops);
+    results_[[NSString stringWithFormat:@"%@.%@", key, operation]] = @(nsPerOp);
+}
+
+- (NSString *)baselinePath {
+    const char *path = getenv("ITERM_BENCHMARK_BASELINE");
+    return path ? [NSString stringWithUTF8String:path] : kDefaultBaselinePath;
+}
+
+// Returns NO if any result regressed beyond kTolerance.
+- (BOOL)compareWithBaseline {
+    NSString *path = [self baselinePath];
+    if (getenv("ITERM_BENCHMARK_RECORD")) {
+        [[NSFileManager defaultManager] createDirectoryAtPath:[path stringByDeletingLastPathComponent]
+                                  withIntermediateDirectories:YES
+                                                   attributes:nil
+                                                        error:NULL];
+        [results_ writeToFile:path atomically:YES];
+        NSLog(@"Recorded baseline in %@", path);
+        return YES;
+    }
+
+    NSDictionary *baseline = [NSDictionary dictionaryWithContentsOfFile:path];
+    if (!baseline) {
+        NSLog(@"No baseline at %@. Set ITERM_BENCHMARK_RECORD=1 to create one.", path);
+        return YES;
+    }
+
+    BOOL ok = YES;
+    for (NSString *key in [[results_ allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+        NSNumber *expected = baseline[key];
+        if (!expected || [key hasSuffix:@".bytesPerLine"]) {
+            continue;
+        }
+        double change = [results_[key] doubleValue] / [expected doubleValue] - 1;
+        if (change > kTolerance) {
+            NSLog(@"REGRESSION %@: %.1f ns/op vs baseline %.1f (%+.0f%%)",
+                  key, [results_[key] doubleValue], [expected doubleValue], change * 100);
+            ok = NO;
+        } else if (change < -kTolerance) {
+            NSLog(@"Improved %@: %.1f ns/op vs baseline %.1f (%+.0f%%)",
+                  key, [results_[key] doubleValue], [expected doubleValue], change * 100);
+        }
+    }
+    return ok;
+}
+
+#pragma mark - Operations
+
+// Fills a new buffer with |count| lines, timing the appends. Every tenth line has "needle" in
+// it for the searches to find.
+- (LineBuffer *)newBufferWithLines:(int)count
+                      distribution:(LineLengthDistribution)distribution
+                               key:(NSString *)key {
+    srandom(distribution + 1);
+    screen_char_t *line = calloc(kMaxLineLength, sizeof(screen_char_t));
+    LineBuffer *buffer = [[LineBuffer alloc] init];
+    double ns = 0;
+    for (int i = 0; i < count; i++) {
+        const int length = LineLength(distribution);
+        for (int x = 0; x < length; x++) {
+            line[x].code = 'a' + random() % 26;
+        }
+        if (i % 10 == 0 && length >= 6) {
+            memcpy(line, (screen_char_t[]){ {'n'}, {'e'}, {'e'}, {'d'}, {'l'}, {'e'} },
+                   6 * sizeof(screen_char_t));
+        }
+        uint64_t start = mach_absolute_time();
+        [buffer appendLine:line length:length partial:NO width:kWidth timestamp:0];
+        ns += NanosecondsSince(start);
+    }
+    free(line);
+    [self recordKey:key operation:@"appendLine" nanoseconds:ns ops:count];
+    const double bytesPerLine = (double)[buffer usedBytes] / count;
+    NSLog(@"  %-24s %-20s %12.1f bytes/line (%lld resident)",
+          [key UTF8String], "memory", bytesPerLine, [buffer residentBytes]);
+    results_[[key stringByAppendingString:@".bytesPerLine"]] = @(bytesPerLine);
+    return buffer;
+}
+
+- (void)timeCopyLinesInBuffer:(LineBuffer *)buffer key:(NSString *)key {
+    const int numberOfLines = [buffer numLinesWithWidth:kWidth];
+    const int ops = MIN(numberOfLines, kMaxLookups);
+    screen_char_t *line = malloc((kWidth + 1) * sizeof(screen_char_t));
+
+    uint64_t start = mach_absolute_time();
+    for (int i = 0; i < ops; i++) {
+        [buffer copyLineToBuffer:line width:kWidth lineNum:i];
+    }
+    [self recordKey:key operation:@"copyLine.sequential" nanoseconds:NanosecondsSince(start) ops:ops];
+
+    srandom(7);
+    int *lineNumbers = malloc(ops * sizeof(int));
+    for (int i = 0; i < ops; i++) {
+        lineNumbers[i] = random() % numberOfLines;
+    }
+    start = mach_absolute_time();
+    for (int i = 0; i < ops; i++) {
+        [buffer copyLineToBuffer:line width:kWidth lineNum:lineNumbers[i]];
+    }
+    [self recordKey:key operation:@"copyLine.random" nanoseconds:NanosecondsSince(start) ops:ops];
+    free(lineNumbers);
+    free(line);
+}
+
+// Each width is new, so every call rewraps the cached counts.
+- (void)timeWidthChangesInBuffer:(LineBuffer *)buffer key:(NSString *)key {
+    int total = 0;
+    uint64_t start = mach_absolute_time();
+    for (int i = 0; i < kWidthChanges; i++) {
+        total += [buffer numLinesWithWidth:kWidth + 1 + i];
+    }
+    [self recordKey:key
+          operation:@"numLines.newWidth"
+        nanoseconds:NanosecondsSince(start)
+                ops:kWidthChanges];
+    [buffer numLinesWithWidth:kWidth];
+    assert(total > 0);
+}
+
+// Searches the whole buffer forward for every match. Returns the matches.
+- (NSData *)timeSearchFor:(NSString *)pattern
+                  options:(int)options
+                 inBuffer:(LineBuffer *)buffer
+                operation:(NSString *)operation
+                      key:(NSString *)key {
+    FindContext *context = [[[FindContext alloc] init] autorelease];
+    NSMutableData *matches = [NSMutableData data];
+    uint64_t start = mach_absolute_time();
+    [buffer prepareToSearchFor:pattern
+                    startingAt:[buffer firstPosition]
+                       options:options | FindMultipleResults
+                   withContext:context];
+    const int stopAt = [buffer lastPos];
+    while (context.status == Searching || context.status == Matched) {
+        if (context.status == Matched) {
+            [matches appendData:context.results];
+            [context.results setLength:0];
+            context.status = Searching;
+        }
+        [buffer findSubstring:context stopAt:stopAt];
+    }
+    const int lines = [buffer numLinesWithWidth:kWidth];
+    [self recordKey:key
+          operation:[NSString stringWithFormat:@"find.%@/line", operation]
+        nanoseconds:NanosecondsSince(start)
+                ops:lines];
+    return matches;
+}
+
+- (void)timeConvertPositions:(NSData *)matches inBuffer:(LineBuffer *)buffer key:(NSString *)key {
+    const int count = MIN(ResultRangeCount(matches), kMaxLookups);
+    if (!count) {
+        return;
+    }
+    XYRange *xyRanges = malloc(count * sizeof(XYRange));
+    uint64_t start = mach_absolute_time();
+    const int converted = [buffer convertResultRanges:matches.bytes
+                                                count:count
+                                            withWidth:kWidth
+                                           toXYRanges:xyRanges];
+    [self recordKey:key operation:@"convertPositions" nanoseconds:NanosecondsSince(start) ops:count];
+    assert(converted <= count);
+    free(xyRanges);
+}
+
+// Destroys the end of the buffer.
+- (void)timePopsFromBuffer:(LineBuffer *)buffer key:(NSString *)key {
+    screen_char_t *line = malloc((kWidth + 1) * sizeof(screen_char_t));
+    const int ops = MIN(kPops, [buffer numLinesWithWidth:kWidth] / 2);
+    int eol;
+    uint64_t start = mach_absolute_time();
+    for (int i = 0; i < ops; i++) {
+        [buffer popAndCopyLastLineInto:line width:kWidth includesEndOfLine:&eol timestamp:NULL];
+    }
+    [self recordKey:key operation:@"popAndCopyLastLine" nanoseconds:NanosecondsSince(start) ops:ops];
+    free(line);
+}
+
+// Drops the older half of the buffer.
+- (void)timeDropFromBuffer:(LineBuffer *)buffer key:(NSString *)key {
+    const int lines = [buffer numLinesWithWidth:kWidth];
+    [buffer setMaxLines:lines / 2];
+    uint64_t start = mach_absolute_time();
+    const int dropped = [buffer dropExcessLinesWithWidth:kWidth];
+    [self recordKey:key operation:@"dropExcessLines/line" nanoseconds:NanosecondsSince(start) ops:dropped];
+}
+
+- (BOOL)run {
+    NSLog(@"-- Begin LineBuffer benchmark --");
+    // So the first search isn't charged for them.
+    LineBlockPrepareSearchTables();
+    for (NSNumber *lineCount in [self lineCounts]) {
+        for (int distribution = 0; distribution < kNumberOfLineLengthDistributions; distribution++) {
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            NSString *key = [NSString stringWithFormat:@"%@.%@",
+                                lineCount, kDistributionNames[distribution]];
+            LineBuffer *buffer = [self newBufferWithLines:[lineCount intValue]
+                                             distribution:distribution
+                                                      key:key];
+            [self timeCopyLinesInBuffer:buffer key:key];
+            [self timeWidthChangesInBuffer:buffer key:key];
+            NSData *matches = [self timeSearchFor:@"needle"
+                                          options:0
+                                         inBuffer:buffer
+                                        operation:@"literal"
+                                              key:key];
+            [self timeSearchFor:@"NEEDLE"
+                        options:FindOptCaseInsensitive
+                       inBuffer:buffer
+                      operation:@"caseInsensitive"
+                            key:key];
+            [self timeSearchFor:@"N\u00c9EDLE"
+                        options:FindOptCaseInsensitive
+                       inBuffer:buffer
+                      operation:@"diacriticInsensitive"
+                            key:key];
+            [self timeSearchFor:@"ne+dl[aeiou]"
+                        options:FindOptRegex
+                       inBuffer:buffer
+                      operation:@"regex"
+                            key:key];
+            [self timeConvertPositions:matches inBuffer:buffer key:key];
+            [self timePopsFromBuffer:buffer key:key];
+            [self timeDropFromBuffer:buffer key:key];
+            [buffer release];
+            [pool drain];
+        }
+    }
+    NSLog(@"-- Finished LineBuffer benchmark --");
+    return [self compareWithBaseline];
+}
+
+@end
@@ -0,0 +1,42 @@
+#import "iTermTests.h"
+#import "MemoryReportTest.h"
+#import "MemoryReport.h"
+
+@implementation MemoryReportTest
+
+- (void)testTotalsAcrossSections {
+    MemoryReport *report = [[[MemoryReport alloc] init] autorelease];
+    [report beginSectionWithName:@"one"];
+    [report addBytes:1000 count:2 forCategory:@"Scrollback"];
+    [report addBytes:300 forCategory:@"Grid"];
+    [report addCount:5 forCategory:@"Marks"];
+    [report beginSectionWithName:@"two"];
+    [report addBytes:24 forCategory:@"Scrollback"];
+    [report addUncountedBytes:900 forCategory:@"Scrollback (used)"];
+
+    assert([report totalBytesForCategory:@"Scrollback"] == 1024);
+    assert([report totalBytesForCategory:@"Grid"] == 300);
+    assert([report totalBytesForCategory:@"Scrollback (used)"] == 900);
+    assert([report totalBytesForCategory:@"Missing"] == 0);
+    assert([report totalBytes] == 1324);
+}
+
+- (void)testFormattedReport {
+    MemoryReport *report = [[[MemoryReport alloc] init] autorelease];
+    [report beginSectionWithName:@"session"];
+    [report addBytes:2048 count:3 forCategory:@"Scrollback"];
+    [report addCount:7 forCategory:@"Marks"];
+    [report addUncountedBytes:3 * 1024 * 1024 forCategory:@"Spilled"];
+
+    NSString *text = [report formattedReport];
+    NSArray *lines = [text componentsSeparatedByString:@"\n"];
+    assert([[lines objectAtIndex:0] isEqualToString:@"session"]);
+    assert([[lines objectAtIndex:1] hasPrefix:@"  Scrollback "]);
+    assert([[lines objectAtIndex:1] hasSuffix:@" 2.0 KB (3)"]);
+    assert([[lines objectAtIndex:2] hasSuffix:@" 7"]);
+    assert([[lines objectAtIndex:3] hasSuffix:@" 3.0 MB *"]);
+    assert([[lines objectAtIndex:4] hasSuffix:@" 2.0 KB"]);
+    assert([text rangeOfString:@"\nAll sessions\n"].location != NSNotFound);
+}
+
+@end
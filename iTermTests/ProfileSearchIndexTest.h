@@ -0,0 +1,4 @@
+#import <Foundation/Foundation.h>
+
+@interface ProfileSearchIndexTest : NSObject
+@end
@@ -0,0 +1,38 @@
+#import "iTermTests.h"
+#import "ProfileSearchIndexTest.h"
+#import "ITAddressBookMgr.h"
+#import "ProfileSearchIndex.h"
+
+@implementation ProfileSearchIndexTest
+
+- (NSIndexSet *)indicesIn:(ProfileSearchIndex *)index matching:(NSString *)filter {
+    return [index indicesMatchingTokens:[ProfileSearchIndex tokensInFilter:filter]];
+}
+
+- (void)testFilters {
+    NSArray *profiles = @[ @{ KEY_NAME: @"Web Server", KEY_TAGS: @[ @"prod east" ] },
+                           @{ KEY_NAME: @"webmail", KEY_TAGS: @[] },
+                           @{ KEY_NAME: @"Database", KEY_TAGS: @[ @"Prod", @"west" ] } ];
+    ProfileSearchIndex *index = [[[ProfileSearchIndex alloc] initWithProfiles:profiles] autorelease];
+
+    NSMutableIndexSet *expected = [NSMutableIndexSet indexSet];
+    [expected addIndex:0];
+    [expected addIndex:1];
+    assert([[self indicesIn:index matching:@"WEB"] isEqualToIndexSet:expected]);
+    assert([[self indicesIn:index matching:@"  web  "] isEqualToIndexSet:expected]);
+
+    // Every token has to match, in the name or a tag.
+    assert([[self indicesIn:index matching:@"web prod"] isEqualToIndexSet:[NSIndexSet indexSetWithIndex:0]]);
+    assert([[self indicesIn:index matching:@"east"] isEqualToIndexSet:[NSIndexSet indexSetWithIndex:0]]);
+
+    // Tokens match the start of a word unless they begin with *.
+    assert([[self indicesIn:index matching:@"base"] count] == 0);
+    assert([[self indicesIn:index matching:@"*BASE"] isEqualToIndexSet:[NSIndexSet indexSetWithIndex:2]]);
+    assert([[self indicesIn:index matching:@"*"] count] == 0);
+
+    assert([[self indicesIn:index matching:@""] count] == 3);
+    assert([[index indicesMatchingTokens:@[ @"prod" ]
+                            amongIndices:[NSIndexSet indexSetWithIndex:2]] isEqualToIndexSet:[NSIndexSet indexSetWithIndex:2]]);
+}
+
+@end
@@ -0,0 +1,35 @@
+//
+//  RenderBenchmark.h
+//  iTerm
+//
+//  Replays output through VT100Screen and an offscreen PTYTextView at fixed sizes and settings and
+//  reports the distribution of frame times, in total and for each FrameProfiler stage. Each
+//  replay runs twice and every frame's pixels are hashed, so a renderer change can be checked to
+//  be both faster and pixel-identical. Run the iTermTests binary with ITERM_BENCHMARK_RENDER=1 in
+//  the environment.
+//
+//  Environment:
+//    ITERM_BENCHMARK_FRAMES     Maximum frames drawn per replay (default 200).
+//    ITERM_BENCHMARK_CAPTURES   Directory of captured output to replay in addition to the
+//                               generated streams, as for VT100ThroughputBenchmark.
+//    ITERM_BENCHMARK_DVR        Directory of .dvr files (saved instant replay) to replay. These are
+//                               drawn at the size they were recorded at.
+//    ITERM_BENCHMARK_BASELINE   Plist of results to compare against
+//                               (default tests/benchmarks/render-baseline.plist).
+//    ITERM_BENCHMARK_RECORD     If set, write the results to the baseline file instead of
+//                               comparing against it.
+//
+//  Image hashes depend on the OS's font rendering, so a baseline is only meaningful on the machine
+//  and OS version that recorded it.
+//
+
+#import <Foundation/Foundation.h>
+
+@interface RenderBenchmark : NSObject
+
+// Runs all replays and logs a report. Returns NO if drawing wasn't deterministic, if any frame's
+// pixels differ from the baseline, or if a frame time is slower than its baseline by more than
+// the allowed tolerance.
+- (BOOL)run;
+
+@end
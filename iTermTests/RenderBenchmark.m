@@ -0,0 +1,518 @@
+//
+//  RenderBenchmark.m
+//  iTerm
+//
+//  Views are never put in a window, so nothing appears on screen and drawing doesn't depend on
+//  the display's backing scale. Blinking is off so the same output always draws the same pixels.
+//
+
+#import "RenderBenchmark.h"
+#import "DVR.h"
+#import "DVRDecoder.h"
+#import "FrameProfiler.h"
+#import "PTYScrollView.h"
+#import "PTYTextView.h"
+#import "TextViewWrapper.h"
+#import "VT100Screen.h"
+#import "VT100Terminal.h"
+#import "VT100ThroughputBenchmark.h"
+#include <mach/mach_time.h>
+#include <objc/runtime.h>
+
+static NSString *const kDefaultBaselinePath = @"tests/benchmarks/render-baseline.plist";
+static const int kDefaultMaxFrames = 200;
+static const int kReadSize = 4096;  // Bytes of output between frames, like one read().
+static const int kRuns = 2;  // Each replay is drawn this many times to check determinism.
+static const double kTolerance = 0.10;  // Fraction slower than baseline that counts as a regression.
+static const double kFontSize = 12;
+
+typedef struct {
+    NSString *name;
+    double transparency;
+    BOOL backgroundImage;
+    BOOL nonAsciiFont;
+} RenderConfiguration;
+
+// Menlo has no ligatures, so none of these depend on ligature shaping.
+static const RenderConfiguration kConfigurations[] = {
+    { @"plain", 0, NO, NO },
+    { @"transparent", 0.3, NO, NO },
+    { @"bgimage", 0, YES, NO },
+    { @"nonascii", 0, NO, YES },
+};
+
+static const VT100GridSize kSizes[] = { { 80, 25 }, { 200, 60 } };
+
+// The stages of a frame that are reported. Parsing happens between frames and isn't timed.
+static const FrameProfilerStage kReportedStages[] = {
+    kFrameProfilerStageRefresh,
+    kFrameProfilerStageDrawRect,
+    kFrameProfilerStageConstructRuns,
+    kFrameProfilerStageSimpleRuns,
+    kFrameProfilerStageAdvancedRuns,
+    kFrameProfilerStageBackground,
+    kFrameProfilerStageCursor,
+};
+static const int kNumberOfReportedStages = sizeof(kReportedStages) / sizeof(*kReportedStages);
+
+// The xterm colors, so output doesn't depend on the user's presets.
+static const int kAnsiColors[16] = {
+    0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5,
+    0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff
+};
+
+static double NanosecondsSince(uint64_t start) {
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return (double)(mach_absolute_time() - start) * timebase.numer / timebase.denom;
+}
+
+static NSColor *ColorWithRGB(int rgb) {
+    return [NSColor colorWithCalibratedRed:((rgb >> 16) & 0xff) / 255.0
+                                     green:((rgb >> 8) & 0xff) / 255.0
+                                      blue:(rgb & 0xff) / 255.0
+                                     alpha:1];
+}
+
+// FNV-1a, continued from |hash|.
+static uint64_t HashBytes(uint64_t hash, const unsigned char *bytes, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Stands in for PTYSession. It says whether the window is transparent and otherwise acts like a
+// nil delegate: every other PTYTextViewDelegate method does nothing and returns zero.
+@interface RenderBenchmarkTextViewDelegate : NSObject {
+@public
+    BOOL usesTransparency_;
+}
+@end
+
+@implementation RenderBenchmarkTextViewDelegate
+
+- (BOOL)textViewWindowUsesTransparency {
+    return usesTransparency_;
+}
+
+- (NSMethodSignature *)methodSignatureForSelector:(SEL)selector {
+    NSMethodSignature *signature = [super methodSignatureForSelector:selector];
+    if (signature) {
+        return signature;
+    }
+    for (int required = 1; required >= 0; required--) {
+        struct objc_method_description description =
+            protocol_getMethodDescription(@protocol(PTYTextViewDelegate), selector, required, YES);
+        if (description.types) {
+            return [NSMethodSignature signatureWithObjCTypes:description.types];
+        }
+    }
+    return nil;
+}
+
+- (void)forwardInvocation:(NSInvocation *)invocation {
+    const NSUInteger length = [[invocation methodSignature] methodReturnLength];
+    if (length) {
+        void *zero = calloc(1, length);
+        [invocation setReturnValue:zero];
+        free(zero);
+    }
+}
+
+@end
+
+// One replay being drawn: the model, the views, and what's been measured so far.
+@interface RenderBenchmarkReplay : NSObject {
+@public
+    VT100Terminal *terminal_;
+    VT100Screen *screen_;
+    PTYScrollView *scrollView_;
+    PTYTextView *textView_;
+    RenderBenchmarkTextViewDelegate *delegate_;
+    FrameProfiler *profiler_;
+    NSBitmapImageRep *rep_;
+    uint64_t hash_;
+    NSMutableData *frameTimes_;  // double ms per frame
+    NSMutableData *stageTimes_[kNumberOfReportedStages];  // double ms per frame
+}
+@end
+
+@implementation RenderBenchmarkReplay
+
+- (id)initWithSize:(VT100GridSize)size configuration:(RenderConfiguration)configuration {
+    self = [super init];
+    if (self) {
+        terminal_ = [[VT100Terminal alloc] init];
+        [terminal_ setEncoding:NSUTF8StringEncoding];
+        screen_ = [[VT100Screen alloc] initWithTerminal:terminal_];
+        terminal_.delegate = screen_;
+        screen_.unlimitedScrollback = YES;
+        [screen_ destructivelySetScreenWidth:size.width height:size.height];
+
+        NSFont *font = [NSFont fontWithName:@"Menlo" size:kFontSize];
+        if (!font) {
+            font = [NSFont userFixedPitchFontOfSize:kFontSize];
+        }
+        NSFont *nonAsciiFont = font;
+        if (configuration.nonAsciiFont) {
+            nonAsciiFont = [NSFont fontWithName:@"Hiragino Kaku Gothic ProN" size:kFontSize];
+            if (!nonAsciiFont) {
+                nonAsciiFont = [NSFont fontWithName:@"Courier" size:kFontSize];
+            }
+        }
+        const NSSize charSize = [PTYTextView charSizeForFont:font
+                                           horizontalSpacing:1.0
+                                             verticalSpacing:1.0];
+        const NSSize contentSize = NSMakeSize(ceil(charSize.width) * size.width + MARGIN * 2,
+                                              ceil(charSize.height) * size.height + VMARGIN * 2);
+        scrollView_ = [[PTYScrollView alloc] initWithFrame:NSMakeRect(0, 0, contentSize.width,
+                                                                      contentSize.height)
+                                       hasVerticalScroller:NO];
+        TextViewWrapper *wrapper =
+            [[[TextViewWrapper alloc] initWithFrame:NSMakeRect(0, 0, contentSize.width,
+                                                               contentSize.height)] autorelease];
+        textView_ = [[PTYTextView alloc] initWithFrame:NSMakeRect(0, VMARGIN, contentSize.width,
+                                                                  contentSize.height - VMARGIN)];
+        [textView_ setFont:font nafont:nonAsciiFont horizontalSpacing:1.0 verticalSpacing:1.0];
+        [textView_ setUseNonAsciiFont:configuration.nonAsciiFont];
+        [textView_ setAntiAlias:YES nonAscii:YES];
+        [textView_ setBlinkAllowed:NO];
+        [textView_ setBlinkingCursor:NO];
+        [textView_ setFGColor:ColorWithRGB(0xe5e5e5)];
+        [textView_ setBGColor:ColorWithRGB(0x000000)];
+        [textView_ setBoldColor:ColorWithRGB(0xffffff)];
+        [textView_ setSelectionColor:ColorWithRGB(0xb5d5ff)];
+        [textView_ setSelectedTextColor:ColorWithRGB(0x000000)];
+        [textView_ setCursorColor:ColorWithRGB(0xe5e5e5)];
+        [textView_ setCursorTextColor:ColorWithRGB(0x000000)];
+        for (int i = 0; i < 16; i++) {
+            [textView_ setColorTable:i color:ColorWithRGB(kAnsiColors[i])];
+        }
+
+        delegate_ = [[RenderBenchmarkTextViewDelegate alloc] init];
+        delegate_->usesTransparency_ = configuration.transparency > 0;
+        [textView_ setTransparency:configuration.transparency];
+        [scrollView_ setTransparency:configuration.transparency];
+        if (configuration.backgroundImage) {
+            [scrollView_ setBackgroundImage:[self backgroundImage]];
+        }
+
+        [wrapper addSubview:textView_];
+        [textView_ setFrame:NSMakeRect(0, VMARGIN, contentSize.width, contentSize.height - VMARGIN)];
+        [textView_ setDataSource:screen_];
+        [textView_ setDelegate:delegate_];
+        [scrollView_ setDocumentView:wrapper];
+
+        profiler_ = [[FrameProfiler alloc] initWithLogPath:nil];
+        [textView_ setFrameProfiler:profiler_];
+
+        hash_ = 0xcbf29ce484222325ULL;
+        frameTimes_ = [[NSMutableData alloc] init];
+        for (int i = 0; i < kNumberOfReportedStages; i++) {
+            stageTimes_[i] = [[NSMutableData alloc] init];
+        }
+    }
+    return self;
+}
+
+- (void)dealloc {
+    terminal_.delegate = nil;
+    [textView_ setDataSource:nil];
+    [textView_ setDelegate:nil];
+    [textView_ release];
+    [scrollView_ release];
+    [delegate_ release];
+    [screen_ release];
+    [terminal_ release];
+    [profiler_ release];
+    [rep_ release];
+    [frameTimes_ release];
+    for (int i = 0; i < kNumberOfReportedStages; i++) {
+        [stageTimes_[i] release];
+    }
+    [super dealloc];
+}
+
+// A gradient, so every cell of a background image fill is different.
+- (NSImage *)backgroundImage {
+    NSImage *image = [[[NSImage alloc] initWithSize:NSMakeSize(256, 256)] autorelease];
+    [image lockFocus];
+    NSGradient *gradient = [[[NSGradient alloc] initWithStartingColor:ColorWithRGB(0x203040)
+                                                          endingColor:ColorWithRGB(0x806020)] autorelease];
+    [gradient drawInRect:NSMakeRect(0, 0, 256, 256) angle:45];
+    [image unlockFocus];
+    return image;
+}
+
+// Refreshes and redraws everything visible, timing it, then hashes the pixels.
+- (void)drawFrame {
+    uint64_t start = mach_absolute_time();
+    [textView_ refresh];
+    [textView_ scrollEnd];
+    const NSRect rect = [textView_ visibleRect];
+    if (!rep_ || rep_.pixelsWide != (NSInteger)rect.size.width ||
+        rep_.pixelsHigh != (NSInteger)rect.size.height) {
+        [rep_ release];
+        rep_ = [[textView_ bitmapImageRepForCachingDisplayInRect:rect] retain];
+    }
+    [textView_ cacheDisplayInRect:rect toBitmapImageRep:rep_];
+    const double ms = NanosecondsSince(start) / 1000000.0;
+
+    [frameTimes_ appendBytes:&ms length:sizeof(ms)];
+    for (int i = 0; i < kNumberOfReportedStages; i++) {
+        const double stageMs = [profiler_ millisecondsInLastFrameForStage:kReportedStages[i]];
+        [stageTimes_[i] appendBytes:&stageMs length:sizeof(stageMs)];
+    }
+    hash_ = HashBytes(hash_, [rep_ bitmapData], [rep_ bytesPerRow] * [rep_ pixelsHigh]);
+    // Clear it so a frame that fails to draw something can't inherit the last frame's pixels.
+    memset([rep_ bitmapData], 0, [rep_ bytesPerRow] * [rep_ pixelsHigh]);
+}
+
+- (void)replayOutput:(NSData *)data maxFrames:(int)maxFrames {
+    const unsigned char *bytes = data.bytes;
+    const int length = data.length;
+    int frames = 0;
+    for (int offset = 0; offset < length && frames < maxFrames; offset += kReadSize, frames++) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        NSData *chunk = [NSData dataWithBytesNoCopy:(void *)(bytes + offset)
+                                             length:MIN(kReadSize, length - offset)
+                                       freeWhenDone:NO];
+        [terminal_ putStreamData:chunk];
+        while ([terminal_ parseNextToken]) {
+            [terminal_ executeToken];
+        }
+        [self drawFrame];
+        [pool drain];
+    }
+}
+
+- (void)replayDVR:(DVR *)dvr maxFrames:(int)maxFrames {
+    DVRDecoder *decoder = [dvr getDecoder];
+    if ([decoder seek:[dvr firstTimeStamp]]) {
+        int frames = 0;
+        do {
+            NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+            const DVRFrameInfo info = [decoder info];
+            if (info.width != [screen_ width] || info.height != [screen_ height]) {
+                [screen_ destructivelySetScreenWidth:info.width height:info.height];
+            }
+            [screen_ setFromFrame:(screen_char_t *)[decoder decodedFrame]
+                              len:[decoder length]
+                             info:info];
+            [self drawFrame];
+            [pool drain];
+        } while (++frames < maxFrames && [decoder next]);
+    }
+    [dvr releaseDecoder:decoder];
+}
+
+@end
+
+@implementation RenderBenchmark {
+    NSMutableDictionary *results_;  // "input.size.config.stage.percentile" -> ms, "....hash" -> hex
+    BOOL deterministic_;
+}
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        results_ = [[NSMutableDictionary alloc] init];
+        deterministic_ = YES;
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [results_ release];
+    [super dealloc];
+}
+
+- (int)maxFrames {
+    const char *frames = getenv("ITERM_BENCHMARK_FRAMES");
+    return frames ? MAX(1, atoi(frames)) : kDefaultMaxFrames;
+}
+
+// Returns name -> DVR for each file in ITERM_BENCHMARK_DVR.
+- (NSDictionary *)dvrs {
+    NSMutableDictionary *dvrs = [NSMutableDictionary dictionary];
+    const char *directory = getenv("ITERM_BENCHMARK_DVR");
+    if (!directory) {
+        return dvrs;
+    }
+    NSString *path = [NSString stringWithUTF8String:directory];
+    for (NSString *name in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:path error:NULL]) {
+        DVR *dvr = [[[DVR alloc] initWithContentsOfFile:[path stringByAppendingPathComponent:name]] autorelease];
+        if (dvr) {
+            dvrs[[@"dvr-" stringByAppendingString:[name stringByDeletingPathExtension]]] = dvr;
+        } else {
+            NSLog(@"Couldn't read DVR file %@", name);
+        }
+    }
+    return dvrs;
+}
+
+#pragma mark - Reporting
+
+- (void)recordKey:(NSString *)key stage:(NSString *)stage frameTimes:(NSMutableData *)times {
+    const int count = times.length / sizeof(double);
+    if (!count) {
+        return;
+    }
+    double *ms = times.mutableBytes;
+    qsort(ms, count, sizeof(double), CompareDoubles);
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += ms[i];
+    }
+    const double p50 = ms[count / 2];
+    const double p90 = ms[count * 9 / 10];
+    const double p99 = ms[count * 99 / 100];
+    NSLog(@"  %-36s %-14s mean %7.3f p50 %7.3f p90 %7.3f p99 %7.3f max %7.3f ms",
+          [key UTF8String], [stage UTF8String], sum / count, p50, p90, p99, ms[count - 1]);
+    results_[[NSString stringWithFormat:@"%@.%@.p50", key, stage]] = @(p50);
+    results_[[NSString stringWithFormat:@"%@.%@.p90", key, stage]] = @(p90);
+}
+
+// Draws with fresh views kRuns times, checks that every run drew the same pixels, and records the
+// frame times of all runs together.
+- (void)measureKey:(NSString *)key
+              size:(VT100GridSize)size
+     configuration:(RenderConfiguration)configuration
+            replay:(void (^)(RenderBenchmarkReplay *replay))block {
+    NSMutableData *frameTimes = [NSMutableData data];
+    NSMutableData *stageTimes[kNumberOfReportedStages];
+    for (int i = 0; i < kNumberOfReportedStages; i++) {
+        stageTimes[i] = [NSMutableData data];
+    }
+    uint64_t firstHash = 0;
+    for (int run = 0; run < kRuns; run++) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        RenderBenchmarkReplay *replay =
+            [[RenderBenchmarkReplay alloc] initWithSize:size configuration:configuration];
+        block(replay);
+        [frameTimes appendData:replay->frameTimes_];
+        for (int i = 0; i < kNumberOfReportedStages; i++) {
+            [stageTimes[i] appendData:replay->stageTimes_[i]];
+        }
+        if (run == 0) {
+            firstHash = replay->hash_;
+        } else if (replay->hash_ != firstHash) {
+            NSLog(@"NONDETERMINISTIC %@: run %d drew different pixels than run 1", key, run + 1);
+            deterministic_ = NO;
+        }
+        [replay release];
+        [pool drain];
+    }
+    [self recordKey:key stage:@"frame" frameTimes:frameTimes];
+    for (int i = 0; i < kNumberOfReportedStages; i++) {
+        [self recordKey:key
+                  stage:[FrameProfiler nameOfStage:kReportedStages[i]]
+             frameTimes:stageTimes[i]];
+    }
+    results_[[key stringByAppendingString:@".hash"]] =
+        [NSString stringWithFormat:@"%016llx", firstHash];
+}
+
+- (NSString *)baselinePath {
+    const char *path = getenv("ITERM_BENCHMARK_BASELINE");
+    return path ? [NSString stringWithUTF8String:path] : kDefaultBaselinePath;
+}
+
+// Returns NO if any image changed or any time regressed beyond kTolerance.
+- (BOOL)compareWithBaseline {
+    NSString *path = [self baselinePath];
+    if (getenv("ITERM_BENCHMARK_RECORD")) {
+        [[NSFileManager defaultManager] createDirectoryAtPath:[path stringByDeletingLastPathComponent]
+                                  withIntermediateDirectories:YES
+                                                   attributes:nil
+                                                        error:NULL];
+        [results_ writeToFile:path atomically:YES];
+        NSLog(@"Recorded baseline in %@", path);
+        return YES;
+    }
+
+    NSDictionary *baseline = [NSDictionary dictionaryWithContentsOfFile:path];
+    if (!baseline) {
+        NSLog(@"No baseline at %@. Set ITERM_BENCHMARK_RECORD=1 to create one.", path);
+        return YES;
+    }
+
+    BOOL ok = YES;
+    for (NSString *key in [[results_ allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+        id expected = baseline[key];
+        if (!expected) {
+            continue;
+        }
+        if ([key hasSuffix:@".hash"]) {
+            if (![expected isEqual:results_[key]]) {
+                NSLog(@"PIXELS CHANGED %@: %@ vs baseline %@", key, results_[key], expected);
+                ok = NO;
+            }
+            continue;
+        }
+        if ([expected doubleValue] <= 0) {
+            continue;
+        }
+        double change = [results_[key] doubleValue] / [expected doubleValue] - 1;
+        if (change > kTolerance) {
+            NSLog(@"REGRESSION %@: %.3f ms vs baseline %.3f (%+.0f%%)",
+                  key, [results_[key] doubleValue], [expected doubleValue], change * 100);
+            ok = NO;
+        } else if (change < -kTolerance) {
+            NSLog(@"Improved %@: %.3f ms vs baseline %.3f (%+.0f%%)",
+                  key, [results_[key] doubleValue], [expected doubleValue], change * 100);
+        }
+    }
+    return ok;
+}
+
+- (BOOL)run {
+    const int maxFrames = [self maxFrames];
+    NSDictionary *streams = [[[[VT100ThroughputBenchmark alloc] init] autorelease] streams];
+    NSDictionary *dvrs = [self dvrs];
+    const int numberOfConfigurations = sizeof(kConfigurations) / sizeof(*kConfigurations);
+    const int numberOfSizes = sizeof(kSizes) / sizeof(*kSizes);
+
+    NSLog(@"-- Begin render benchmark (up to %d frames, %d runs each) --", maxFrames, kRuns);
+    for (int c = 0; c < numberOfConfigurations; c++) {
+        const RenderConfiguration configuration = kConfigurations[c];
+        for (NSString *name in [[streams allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+            NSData *data = streams[name];
+            for (int s = 0; s < numberOfSizes; s++) {
+                NSString *key = [NSString stringWithFormat:@"%@.%dx%d.%@",
+                                    name, kSizes[s].width, kSizes[s].height, configuration.name];
+                [self measureKey:key
+                            size:kSizes[s]
+                   configuration:configuration
+                          replay:^(RenderBenchmarkReplay *replay) {
+                              [replay replayOutput:data maxFrames:maxFrames];
+                          }];
+            }
+        }
+        for (NSString *name in [[dvrs allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+            DVR *dvr = dvrs[name];
+            NSString *key = [NSString stringWithFormat:@"%@.%@", name, configuration.name];
+            [self measureKey:key
+                        size:kSizes[0]
+               configuration:configuration
+                      replay:^(RenderBenchmarkReplay *replay) {
+                          [replay replayDVR:dvr maxFrames:maxFrames];
+                      }];
+        }
+    }
+    NSLog(@"-- Finished render benchmark --");
+    const BOOL matchesBaseline = [self compareWithBaseline];
+    return deterministic_ && matchesBaseline;
+}
+
+@end
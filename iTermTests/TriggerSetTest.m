@@ -0,0 +1,60 @@
+#import "iTermTests.h"
+#import "TriggerSetTest.h"
+#import "Trigger.h"
+#import "TriggerSet.h"
+
+static NSDictionary *TriggerDict(NSString *regex) {
+    return @{ kTriggerRegexKey: regex,
+              kTriggerActionKey: @"BellTrigger",
+              kTriggerParameterKey: @"" };
+}
+
+@implementation TriggerSetTest
+
+- (void)testRequiredLiteralInRegex {
+    assert([[Trigger requiredLiteralInRegex:@"error"] isEqualToString:@"error"]);
+    assert([[Trigger requiredLiteralInRegex:@"^\\[(\\d+)\\] warning: .*$"] isEqualToString:@"] warning: "]);
+    assert([[Trigger requiredLiteralInRegex:@"colou?r"] isEqualToString:@"colo"]);
+    assert([[Trigger requiredLiteralInRegex:@"ab+cd"] isEqualToString:@"ab"]);
+    assert([[Trigger requiredLiteralInRegex:@"\\x41BC"] isEqualToString:@"BC"]);
+    assert([[Trigger requiredLiteralInRegex:@"[abc]xy{2}"] isEqualToString:@"x"]);
+    assert([Trigger requiredLiteralInRegex:@"foo|bar"] == nil);
+    assert([Trigger requiredLiteralInRegex:@"(?i)error"] == nil);
+    assert([Trigger requiredLiteralInRegex:@"\\d+"] == nil);
+    assert([Trigger requiredLiteralInRegex:@"(error)"] == nil);
+}
+
+- (void)testEnumerateMatches {
+    TriggerSet *set = [[[TriggerSet alloc] initWithDictionaries:@[ TriggerDict(@"err(or)"),
+                                                                   TriggerDict(@"warn"),
+                                                                   TriggerDict(@"\\d+"),
+                                                                   TriggerDict(@"rror") ]] autorelease];
+    assert(set.triggers.count == 4);
+    NSMutableArray *matches = [NSMutableArray array];
+    [set enumerateMatchesInString:@"an error at 12 and 34"
+                       usingBlock:^(Trigger *trigger, NSArray *values) {
+                           [matches addObject:[values objectAtIndex:0]];
+                       }];
+    assert([matches isEqualToArray:(@[ @"error", @"12", @"34", @"rror" ])]);
+
+    [matches removeAllObjects];
+    [set enumerateMatchesInString:@"nothing"
+                       usingBlock:^(Trigger *trigger, NSArray *values) {
+                           [matches addObject:[values objectAtIndex:0]];
+                       }];
+    assert(matches.count == 0);
+}
+
+- (void)testMatchesInLongLine {
+    TriggerSet *set = [[[TriggerSet alloc] initWithDictionaries:@[ TriggerDict(@"end(x)?$") ]] autorelease];
+    NSString *line = [[@"" stringByPaddingToLength:100000 withString:@"{\"k\":1}," startingAtIndex:0]
+                         stringByAppendingString:@"end"];
+    __block NSArray *found = nil;
+    [set enumerateMatchesInString:line
+                       usingBlock:^(Trigger *trigger, NSArray *values) {
+                           found = [[values retain] autorelease];
+                       }];
+    assert([found isEqualToArray:(@[ @"end", @"" ])]);
+}
+
+@end
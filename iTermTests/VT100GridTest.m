@@ -7,8 +7,15 @@
 //
 
 #import <Cocoa/Cocoa.h>
+#import "CompiledRegex.h"
 #import "DVRBuffer.h"
+#import "FindContext.h"
+#import "FindHighlights.h"
+#import "LineBlock.h"
 #import "LineBuffer.h"
+#import "LineBufferArchive.h"
+#import "PasteStream.h"
+#import "SPSCQueue.h"
 #import "VT100GridTest.h"
 #import "VT100Grid.h"
 
@@ -219,6 +226,27 @@ do { \
     assert([[grid compactDirtyDump] isEqualToString:@"cc\ncc"]);
 }
 
+- (void)testDirtyRects {
+    VT100Grid *grid = [self mediumGrid];
+    assert([[grid dirtyRects] count] == 0);
+
+    // Lines 0 and 1 share an extent so they coalesce; line 3 differs.
+    [grid markCharsDirty:YES inRectFrom:VT100GridCoordMake(1, 0) to:VT100GridCoordMake(2, 1)];
+    [grid markCharDirty:YES at:VT100GridCoordMake(3, 3) updateTimestamp:NO];
+    NSArray *rects = [grid dirtyRects];
+    assert([rects count] == 2);
+    assert(VT100GridRectEquals([[rects objectAtIndex:0] gridRectValue],
+                               VT100GridRectMake(1, 0, 2, 2)));
+    assert(VT100GridRectEquals([[rects objectAtIndex:1] gridRectValue],
+                               VT100GridRectMake(3, 3, 1, 1)));
+
+    [grid markAllCharsDirty:YES];
+    rects = [grid dirtyRects];
+    assert([rects count] == 1);
+    assert(VT100GridRectEquals([[rects objectAtIndex:0] gridRectValue],
+                               VT100GridRectMake(0, 0, 4, 4)));
+}
+
 - (VT100Grid *)gridFromCompactLines:(NSString *)compact {
     NSArray *lines = [compact componentsSeparatedByString:@"\n"];
     VT100Grid *grid = [[VT100Grid alloc] initWithSize:VT100GridSizeMake([[lines objectAtIndex:0] length],
@@ -322,6 +350,436 @@ do { \
     assert(x == 4);
 }
 
+- (void)testCompactLineBlocks {
+    // A block size of one line makes every block but the first and last get compacted.
+    VT100Grid *grid = [self gridFromCompactLines:@"abcd\nefgh\nijkl\n...."];
+    screen_char_t *line = [grid screenCharsAtLineNumber:1];
+    line[1].code = 0xe9;
+    line[2].foregroundColor = 3;
+    LineBuffer *lineBuffer = [[[LineBuffer alloc] initWithBlockSize:4] autorelease];
+    [grid appendLines:3 toLineBuffer:lineBuffer];
+    assert([lineBuffer numLinesWithWidth:2] == 6);
+
+    ScreenCharArray *array = [lineBuffer wrappedLineAtIndex:1 width:4];
+    assert(array.length == 4);
+    assert(array.line[0].code == 'e');
+    assert(array.line[1].code == 0xe9);
+    assert(array.line[2].code == 'g');
+    assert(array.line[2].foregroundColor == 3);
+    assert(array.line[3].foregroundColor == line[3].foregroundColor);
+    assert([[lineBuffer compactLineDumpWithWidth:4] isEqualToString:
+            [NSString stringWithFormat:@"abcd\ne%Cgh\nijkl", (unichar)0xe9]]);
+}
+
+- (void)testCompressedLineBlocks {
+    const int length = 200;
+    screen_char_t line[length];
+    memset(line, 0, sizeof(line));
+    LineBuffer *lineBuffer = [[[LineBuffer alloc] initWithBlockSize:length] autorelease];
+    [lineBuffer setResidentBudget:1];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < length; j++) {
+            line[j].code = 'a' + i;
+        }
+        [lineBuffer appendLine:line length:length partial:NO width:80 timestamp:0];
+    }
+    assert([lineBuffer compressedBytes] > 0);
+    assert([lineBuffer compressedBytes] < length);
+    assert([lineBuffer numLinesWithWidth:80] == 9);
+
+    ScreenCharArray *array = [lineBuffer wrappedLineAtIndex:4 width:80];
+    assert(array.length == 80);
+    assert(array.line[0].code == 'b');
+    assert(array.line[79].code == 'b');
+    assert([lineBuffer compressedBytes] == 0);
+}
+
+- (void)testReducingLineBufferMemory {
+    const int length = 200;
+    screen_char_t line[length];
+    memset(line, 0, sizeof(line));
+    LineBuffer *lineBuffer = [[[LineBuffer alloc] initWithBlockSize:length] autorelease];
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < length; j++) {
+            line[j].code = 'a' + i;
+        }
+        [lineBuffer appendLine:line length:length partial:NO width:80 timestamp:0];
+    }
+    assert([lineBuffer compressedBytes] == 0);
+    const long long before = [lineBuffer residentBytes];
+
+    // The first and last blocks are left alone.
+    long long after = [lineBuffer reduceMemoryUsageTo:0];
+    assert(after < before);
+    assert(after == [lineBuffer residentBytes] + [lineBuffer compressedBytes]);
+    assert([lineBuffer compressedBytes] > 0);
+    assert([lineBuffer numLinesWithWidth:80] == 15);
+
+    // Dropping whole blocks starts with the oldest.
+    assert([lineBuffer dropOldestBlocksToFreeBytes:1 width:80] == 3);
+    assert([lineBuffer numLinesWithWidth:80] == 12);
+    assert([lineBuffer wrappedLineAtIndex:0 width:80].line[0].code == 'b');
+    assert([lineBuffer dropOldestBlocksToFreeBytes:LLONG_MAX width:80] == 9);
+    assert([lineBuffer wrappedLineAtIndex:0 width:80].line[0].code == 'e');
+}
+
+- (void)testSpilledLineBlocks {
+    const int length = 200;
+    screen_char_t line[length];
+    memset(line, 0, sizeof(line));
+    LineBuffer *lineBuffer = [[[LineBuffer alloc] initWithBlockSize:length] autorelease];
+    [lineBuffer setResidentBudget:1];
+    [lineBuffer setSpillsToDisk:YES];
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < length; j++) {
+            line[j].code = 'a' + i;
+        }
+        [lineBuffer appendLine:line length:length partial:NO width:80 timestamp:0];
+    }
+    assert([lineBuffer spilledBytes] > 0);
+    assert([lineBuffer compressedBytes] == 0);
+    assert([lineBuffer numLinesWithWidth:80] == 12);
+
+    long long spilled = [lineBuffer spilledBytes];
+    ScreenCharArray *array = [lineBuffer wrappedLineAtIndex:7 width:80];
+    assert(array.line[0].code == 'c');
+    assert([lineBuffer spilledBytes] < spilled);
+}
+
+- (void)testLineBufferArchive {
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                      [NSString stringWithFormat:@"%d.testLineBufferArchive", getpid()]];
+    LineBufferArchive *archive = [[[LineBufferArchive alloc] initWithPath:path] autorelease];
+    assert(archive);
+
+    // Blocks of two lines, some dropped off the top, with the last block still filling.
+    LineBuffer *lineBuffer = [[[LineBuffer alloc] initWithBlockSize:8] autorelease];
+    [lineBuffer setMaxLines:7];
+    [lineBuffer setArchive:archive];
+    screen_char_t line[4];
+    memset(line, 0, sizeof(line));
+    for (int i = 0; i < 11; i++) {
+        for (int j = 0; j < 4; j++) {
+            line[j].code = 'a' + i;
+        }
+        [lineBuffer appendLine:line length:4 partial:NO width:4 timestamp:i];
+        [lineBuffer dropExcessLinesWithWidth:4];
+    }
+    assert([archive numArchivedBlocks] > 0);
+    LineBuffer *snapshot = [lineBuffer newAppendOnlyCopy];
+    [snapshot writeSnapshotToArchive:archive];
+    [snapshot release];
+    [archive close];
+
+    LineBufferArchiveReader *reader = [[[LineBufferArchiveReader alloc] initWithPath:path] autorelease];
+    unlink([path fileSystemRepresentation]);
+    assert(reader);
+    LineBuffer *restored = [[[LineBuffer alloc] initWithBlockSize:8] autorelease];
+    assert([restored loadArchive:reader]);
+    assert([restored numLinesWithWidth:4] == 7);
+    assert([[restored compactLineDumpWithWidth:4] isEqualToString:
+            [lineBuffer compactLineDumpWithWidth:4]]);
+    assert([restored timestampForLineNumber:6 width:4] == 10);
+}
+
+- (void)testLineBufferBlockIndex {
+    // Lines of 1 to 3 wrapped lines at width 2 in blocks that hold one or two lines each.
+    LineBuffer *lineBuffer = [[[LineBuffer alloc] initWithBlockSize:6] autorelease];
+    [lineBuffer setMaxLines:20];
+    screen_char_t line[6];
+    memset(line, 0, sizeof(line));
+    NSMutableString *expected = [NSMutableString string];
+    for (int i = 0; i < 20; i++) {
+        const int length = 2 * (i % 3 + 1);
+        for (int j = 0; j < length; j++) {
+            line[j].code = 'a' + i;
+            [expected appendFormat:@"%c", 'a' + i];
+        }
+        [lineBuffer appendLine:line length:length partial:NO width:2 timestamp:i];
+        [lineBuffer dropExcessLinesWithWidth:2];
+    }
+    assert([lineBuffer numLinesWithWidth:2] == 20);
+
+    // The last 40 chars appended are the 20 lines left after dropping.
+    NSString *tail = [expected substringFromIndex:expected.length - 40];
+    for (int i = 19; i >= 0; i--) {
+        ScreenCharArray *array = [lineBuffer wrappedLineAtIndex:i width:2];
+        assert(array.length == 2);
+        assert(array.line[0].code == [tail characterAtIndex:i * 2]);
+    }
+    assert([lineBuffer timestampForLineNumber:19 width:2] == 19);
+    assert([lineBuffer timestampForLineNumber:0 width:2] ==
+           [tail characterAtIndex:0] - 'a');
+
+    // A different width rebuilds the index.
+    ScreenCharArray *array = [lineBuffer wrappedLineAtIndex:[lineBuffer numLinesWithWidth:6] - 1
+                                                      width:6];
+    assert(array.line[0].code == 't');
+}
+
+- (void)testLineBlockCopySharesChars {
+    LineBlock *block = [[[LineBlock alloc] initWithRawBufferSize:16] autorelease];
+    screen_char_t line[4];
+    memset(line, 0, sizeof(line));
+    for (int i = 0; i < 4; i++) {
+        line[i].code = 'a' + i;
+    }
+    [block appendLine:line length:4 partial:NO width:80 timestamp:0];
+    LineBlock *theCopy = [[block copy] autorelease];
+    assert([block rawLine:0] == [theCopy rawLine:0]);
+
+    // Appending to the original gives it its own chars and leaves the copy alone.
+    line[0].code = 'z';
+    [block appendLine:line length:4 partial:NO width:80 timestamp:0];
+    assert([block rawLine:0] != [theCopy rawLine:0]);
+    assert([block numRawLines] == 2);
+    assert([theCopy numRawLines] == 1);
+    assert([theCopy rawLine:0][0].code == 'a');
+    assert([block rawLine:1][0].code == 'z');
+
+    // The copy can append too.
+    [theCopy appendLine:line length:4 partial:NO width:80 timestamp:0];
+    assert([theCopy numRawLines] == 2);
+    assert([block rawLine:0][0].code == 'a');
+}
+
+- (void)testLineBlockNgramIndex {
+    LineBlock *block = [[[LineBlock alloc] initWithRawBufferSize:16] autorelease];
+    screen_char_t line[8];
+    memset(line, 0, sizeof(line));
+    for (int i = 0; i < 8; i++) {
+        line[i].code = [@"an ERROR" characterAtIndex:i];
+    }
+    [block appendLine:line length:8 partial:NO width:80 timestamp:0];
+    [block buildNgramIndex];
+    assert([block ngramIndexBytes] > 0);
+
+    NSMutableData *results = [NSMutableData data];
+    [block findSubstring:@"error"
+                 options:FindOptCaseInsensitive
+                atOffset:0
+                 results:results
+         multipleResults:NO];
+    assert(ResultRangeCount(results) == 1);
+    [results setLength:0];
+    [block findSubstring:@"errors"
+                 options:FindOptCaseInsensitive
+                atOffset:0
+                 results:results
+         multipleResults:NO];
+    assert(ResultRangeCount(results) == 0);
+
+    // Appending a line discards the index, so text that wasn't indexed can still be found.
+    for (int i = 0; i < 8; i++) {
+        line[i].code = [@"errors.." characterAtIndex:i];
+    }
+    [block appendLine:line length:8 partial:NO width:80 timestamp:0];
+    assert([block ngramIndexBytes] == 0);
+    [block findSubstring:@"errors"
+                 options:0
+                atOffset:0
+                 results:results
+         multipleResults:NO];
+    assert(ResultRangeCount(results) == 1);
+}
+
+- (void)testFindHighlights {
+    FindHighlights highlights;
+    memset(&highlights, 0, sizeof(highlights));
+    // Arrives in reverse, as a backward search finds them, and then again.
+    const FindHighlight added[] = {
+        { 7, 7, 0, 2 },
+        { 4, 5, 8, 1 },
+        { 2, 2, 3, 4 },
+    };
+    FindHighlightsAdd(&highlights, added, 3);
+    FindHighlightsAdd(&highlights, added, 3);
+    assert(highlights.count == 3);
+    assert(highlights.highlights[0].absStartY == 2);
+    assert(highlights.highlights[2].absStartY == 7);
+
+    unsigned char bitmap[2] = { 0, 0 };
+    assert(FindHighlightsGetBitmap(&highlights, 5, 10, bitmap));
+    assert(bitmap[0] == 0x03 && bitmap[1] == 0);
+    assert(FindHighlightsTouchLine(&highlights, 4));
+    assert(!FindHighlightsTouchLine(&highlights, 6));
+
+    // Changing the highlight's second line removes all of it.
+    FindHighlightsRemoveLines(&highlights, 5, 6);
+    assert(highlights.count == 2);
+    assert(!FindHighlightsTouchLine(&highlights, 4));
+    assert(FindHighlightsTouchLine(&highlights, 7));
+    FindHighlightsFree(&highlights);
+}
+
+- (void)testPasteStream {
+    PasteStream *stream = [[[PasteStream alloc] initWithEncoding:NSUTF8StringEncoding] autorelease];
+    [stream appendString:@"a b\r\nc\nd\x01" escapingShellCharacters:NO];
+    [stream appendString:@"e f" escapingShellCharacters:YES];
+    assert([stream remainingLength] == 12);
+
+    // Reads can be smaller than a chunk, and the stages apply across them.
+    NSMutableData *output = [NSMutableData data];
+    NSData *data;
+    while ([(data = [stream readDataOfMaxLength:2]) length]) {
+        assert([data length] <= 2);
+        [output appendData:data];
+    }
+    NSString *string = [[[NSString alloc] initWithData:output encoding:NSUTF8StringEncoding] autorelease];
+    assert([string isEqualToString:@"a b\rc\rde\\ f"]);
+    assert([stream remainingLength] == 0);
+}
+
+- (void)testSPSCQueue {
+    SPSCQueue queue;
+    SPSCQueueInit(&queue, 3);
+    assert(queue.capacity == 4);
+    assert(SPSCQueuePop(&queue) == NULL);
+
+    // Go around the ring a few times, filling it each time.
+    static int values[4];
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 4; i++) {
+            assert(SPSCQueuePush(&queue, &values[i]));
+        }
+        assert(!SPSCQueuePush(&queue, &values[0]));
+        assert(SPSCQueueDepth(&queue) == 4);
+        for (int i = 0; i < 4; i++) {
+            assert(SPSCQueuePop(&queue) == &values[i]);
+        }
+        assert(SPSCQueuePop(&queue) == NULL);
+        assert(SPSCQueuePush(&queue, &values[0]));
+        assert(SPSCQueuePop(&queue) == &values[0]);
+    }
+    assert(queue.maxDepth == 4);
+    SPSCQueueFree(&queue);
+}
+
+- (void)testLineBlockWrappedLineIndex {
+    LineBlock *block = [[[LineBlock alloc] initWithRawBufferSize:64] autorelease];
+    screen_char_t line[10];
+    memset(line, 0, sizeof(line));
+    // Raw lines of length 10, 0, and 3 wrap to 3, 1, and 1 lines at width 4.
+    for (int i = 0; i < 10; i++) {
+        line[i].code = 'a' + i;
+    }
+    [block appendLine:line length:10 partial:NO width:4 timestamp:1];
+    [block appendLine:line length:0 partial:NO width:4 timestamp:2];
+    [block appendLine:line length:3 partial:YES width:4 timestamp:3];
+
+    int lineNum = 4;
+    int length;
+    int eol;
+    int yOffset;
+    screen_char_t *p = [block getWrappedLineWithWrapWidth:4
+                                                  lineNum:&lineNum
+                                               lineLength:&length
+                                        includesEndOfLine:&eol
+                                                  yOffset:&yOffset];
+    assert(p[0].code == 'a' && length == 3 && eol == EOL_SOFT && yOffset == 0);
+    assert([block timestampForLineNumber:3 width:4] == 2);
+
+    // Rows read in either order, including from the middle of a raw line.
+    lineNum = 2;
+    p = [block getWrappedLineWithWrapWidth:4 lineNum:&lineNum lineLength:&length includesEndOfLine:&eol];
+    assert(p[0].code == 'i' && length == 2 && eol == EOL_HARD);
+    lineNum = 3;
+    p = [block getWrappedLineWithWrapWidth:4
+                                   lineNum:&lineNum
+                                lineLength:&length
+                         includesEndOfLine:&eol
+                                   yOffset:&yOffset];
+    assert(length == 0 && yOffset == 1);
+
+    // Growing the last line and adding one are seen by the next lookup.
+    [block appendLine:line length:3 partial:NO width:4 timestamp:4];
+    [block appendLine:line + 5 length:2 partial:NO width:4 timestamp:5];
+    lineNum = 6;
+    p = [block getWrappedLineWithWrapWidth:4 lineNum:&lineNum lineLength:&length includesEndOfLine:&eol];
+    assert(p[0].code == 'f' && length == 2);
+
+    // Past the end, lineNum drops by the number of wrapped lines in the block.
+    lineNum = 10;
+    assert(![block getWrappedLineWithWrapWidth:4 lineNum:&lineNum lineLength:&length includesEndOfLine:&eol]);
+    assert(lineNum == 3);
+    assert([block getNumLinesWithWrapWidth:4] == 7);
+
+    // Another width rebuilds the index.
+    lineNum = 1;
+    p = [block getWrappedLineWithWrapWidth:10 lineNum:&lineNum lineLength:&length includesEndOfLine:&eol];
+    assert(length == 0);
+}
+
+- (void)testLineBlockTimestamps {
+    LineBlockTimestamps timestamps;
+    memset(&timestamps, 0, sizeof(timestamps));
+    NSTimeInterval expected[200];
+    for (int i = 0; i < 200; i++) {
+        // Mostly small steps, with some long gaps, some going backwards, and some lines without
+        // a time.
+        expected[i] = (i % 17 == 0) ? 0 : 400000000 + i * 3 - (i % 5 == 0 ? 1000000 : 0);
+        LineBlockTimestampsAppend(&timestamps, expected[i] + 0.25);
+    }
+    LineBlockTimestampsSetLast(&timestamps, 12.75);
+    expected[199] = 13;
+    assert(timestamps.deltasLength < 200 * sizeof(NSTimeInterval));
+    for (int i = 0; i < 200; i++) {
+        assert(LineBlockTimestampsGet(&timestamps, i) == expected[i]);
+    }
+
+    // Removing lines, including checkpointed ones, leaves the rest as they were.
+    for (int count = 200; count > 120; count--) {
+        LineBlockTimestampsRemoveLast(&timestamps);
+        assert(timestamps.count == count - 1);
+        for (int i = count - 3; i >= 0 && i < count - 1; i++) {
+            assert(LineBlockTimestampsGet(&timestamps, i) == expected[i]);
+        }
+    }
+    LineBlockTimestampsAppend(&timestamps, 5);
+    expected[120] = 5;
+
+    LineBlockTimestamps copy;
+    LineBlockTimestampsCopy(&copy, &timestamps);
+    NSTimeInterval all[121];
+    LineBlockTimestampsGetAll(&copy, all);
+    for (int i = 0; i < 121; i++) {
+        assert(all[i] == expected[i]);
+    }
+    LineBlockTimestampsFree(&copy);
+    LineBlockTimestampsRemoveAll(&timestamps);
+    assert(timestamps.count == 0);
+    LineBlockTimestampsFree(&timestamps);
+}
+
+- (void)testComplexCharTable {
+    int key = BeginComplexChar('e', 0x301);
+    assert(BeginComplexChar('e', 0x301) == key);
+    assert([ComplexCharToStr(key) isEqualToString:@"e\u0301"]);
+    assert(GetOrSetComplexChar(@"e\u0301") == key);
+
+    int longerKey = AppendToComplexChar(key, 0x327);
+    assert(longerKey != key);
+    assert([ComplexCharToStr(longerKey) isEqualToString:@"e\u0301\u0327"]);
+    assert([ComplexCharToStr(key) isEqualToString:@"e\u0301"]);
+
+    screen_char_t c;
+    memset(&c, 0, sizeof(c));
+    c.code = longerKey;
+    c.complexChar = YES;
+    unichar chars[kMaxParts];
+    assert(ExpandScreenChar(&c, chars) == 3);
+    assert(chars[0] == 'e' && chars[1] == 0x301 && chars[2] == 0x327);
+
+    // Emoji are keyed by code point rather than stored in the table.
+    int emojiKey = BeginComplexChar(0xd83d, 0xde00);  // U+1F600
+    assert(emojiKey == 0xe600);
+    assert([ComplexCharToStr(emojiKey) isEqualToString:@"\U0001F600"]);
+    assert(CharToLongChar(emojiKey, YES) == 0x1f600);
+    int variantKey = AppendToComplexChar(emojiKey, 0xfe0f);
+    assert(variantKey < 0xe000);
+    assert([ComplexCharToStr(variantKey) isEqualToString:@"\U0001F600\uFE0F"]);
+}
+
 - (void)testLengthOfLineNumber {
     VT100Grid *grid = [self gridFromCompactLines:@"abcd\nefg.\n....\n...."];
     assert([grid lengthOfLineNumber:0] == 4);
@@ -1144,6 +1602,34 @@ do { \
 
 }
 
+- (void)testScrollDamage {
+    VT100Grid *grid = [self gridFromCompactLines:@"abcd\nefgh\nijkl\nmnop"];
+    [grid resetScrollDamage];
+    assert(grid.scrollDamageDistance == 0);
+    assert(!grid.scrollDamageIsComplex);
+
+    // Full-width scrolls of the same rect accumulate.
+    VT100GridRect rect = VT100GridRectMake(0, 1, 4, 3);
+    [grid scrollRect:rect downBy:-1];
+    [grid scrollRect:rect downBy:-1];
+    assert([[grid compactLineDump] isEqualToString:@"abcd\nmnop\n....\n...."]);
+    assert(VT100GridRectEquals(grid.scrollDamageRect, rect));
+    assert(grid.scrollDamageDistance == -2);
+    assert(!grid.scrollDamageIsComplex);
+
+    // Lines that moved keep their dirty bits; only the lines that scrolled in are dirty.
+    assert([[grid compactDirtyDump] isEqualToString:@"cccc\ncccc\ndddd\ndddd"]);
+
+    // A different rect can't be described by the same damage, so both get marked dirty.
+    [grid scrollRect:VT100GridRectMake(0, 0, 4, 2) downBy:1];
+    assert(grid.scrollDamageIsComplex);
+    assert([[grid compactDirtyDump] isEqualToString:@"dddd\ndddd\ndddd\ndddd"]);
+
+    [grid resetScrollDamage];
+    assert(grid.scrollDamageDistance == 0);
+    assert(!grid.scrollDamageIsComplex);
+}
+
 - (void)testSetContentsFromDVRFrame {
     NSString *compactLines = @"abcd\nefgh\nijkl\nmnop";
     VT100Grid *grid = [self gridFromCompactLines:compactLines];
@@ -1344,6 +1830,48 @@ do { \
     assert([[coverage compactLineDump] isEqualToString:expectedCoverage]);
 }
 
+- (void)testCompiledRegexMatchesICU {
+    assert([CompiledRegex regexWithPattern:@"(a)\\1" caseInsensitive:NO].engine ==
+           kCompiledRegexEngineICU);
+    assert(![CompiledRegex regexWithPattern:@"(a" caseInsensitive:NO]);
+
+    NSString *string = @"abcd foo fooo xyxy z9a ABC a\nc y";
+    NSArray *patterns = @[ @"(a|ab)(c|bcd)(d*)", @"\\bfo+\\b", @"^a|y$", @"[^\\d\\s]{2,3}?",
+                           @"(?:x(y)?)+", @"a.c", @"(abc)|b" ];
+    for (NSString *pattern in patterns) {
+        for (int caseInsensitive = 0; caseInsensitive < 2; caseInsensitive++) {
+            NSRegularExpressionOptions options =
+                caseInsensitive ? NSRegularExpressionCaseInsensitive : 0;
+            NSRegularExpression *icu = [NSRegularExpression regularExpressionWithPattern:pattern
+                                                                                 options:options
+                                                                                   error:NULL];
+            NSMutableArray *expected = [NSMutableArray array];
+            for (NSTextCheckingResult *result in [icu matchesInString:string
+                                                              options:0
+                                                                range:NSMakeRange(0, string.length)]) {
+                NSMutableArray *components = [NSMutableArray array];
+                for (int i = 0; i < result.numberOfRanges; i++) {
+                    NSRange range = [result rangeAtIndex:i];
+                    [components addObject:range.location == NSNotFound ? @"" :
+                                              [string substringWithRange:range]];
+                }
+                [expected addObject:components];
+            }
+            CompiledRegex *regex = [CompiledRegex regexWithPattern:pattern
+                                                   caseInsensitive:caseInsensitive];
+            assert(regex.engine == kCompiledRegexEngineLinear);
+            assert([[regex arrayOfCaptureComponentsInString:string] isEqualToArray:expected]);
+        }
+    }
+
+    // This takes ICU exponential time.
+    NSString *xs = [@"" stringByPaddingToLength:5000 withString:@"x" startingAtIndex:0];
+    NSTimeInterval start = [NSDate timeIntervalSinceReferenceDate];
+    CompiledRegex *regex = [CompiledRegex regexWithPattern:@"(x+x+)+y" caseInsensitive:NO];
+    assert([[regex captureComponentsInString:xs] count] == 0);
+    assert([NSDate timeIntervalSinceReferenceDate] - start < 1);
+}
+
 // - is a DWC_RIGHT
 // . is null
 // All other chars are taken literally
@@ -1505,6 +2033,28 @@ do { \
     assert(rect.size.height == 1);
 }
 
+- (void)testClearedLinesFollowDefaultChar {
+    VT100Grid *grid = [self gridFromCompactLines:@"abcd\nefgh\nijkl\nmnop"];
+    screen_char_t x = [grid defaultChar];
+    x.code = 'x';
+    [grid setCharsFrom:VT100GridCoordMake(1, 0) to:VT100GridCoordMake(2, 1) toChar:x];
+    assert([[grid compactLineDump] isEqualToString:@"axxd\nexxh\nijkl\nmnop"]);
+
+    // Changing the background color must not leave a stale cached line behind.
+    backgroundColor_.backgroundColor = 3;
+    backgroundColor_.backgroundColorMode = ColorModeNormal;
+    [grid scrollUpIntoLineBuffer:nil unlimitedScrollback:NO useScrollbackWithRegion:NO];
+    assert([[grid compactLineDump] isEqualToString:@"exxh\nijkl\nmnop\n...."]);
+    screen_char_t *line = [grid screenCharsAtLineNumber:3];
+    for (int i = 0; i < 4; i++) {
+        assert(line[i].code == 0);
+        assert(line[i].backgroundColor == 3);
+        assert(line[i].backgroundColorMode == ColorModeNormal);
+    }
+    assert(line[4].code == EOL_HARD);
+    assert([grid screenCharsAtLineNumber:0][0].backgroundColor == ALTSEM_BG_DEFAULT);
+}
+
 - (void)testResetScrollRegions {
     VT100Grid *grid = [self largeGrid];
     grid.scrollRegionRows = VT100GridRangeMake(1, 2);
@@ -1949,6 +2499,19 @@ do { \
                                         expectCursor:VT100GridCoordMake(2, 1)
                                     expectLineBuffer:@"ab!\ncdefghij+"
                                        expectDropped:0];
+    // long line wrapping past the bottom starting mid-line
+    [self doAppendCharsAtCursorTestWithInitialBuffer:@"abc!\n"
+                                                     @"d..!"
+                                        scrollRegion:VT100GridRectMake(0, 0, -1, -1)
+                             useScrollbackWithRegion:YES
+                                 unlimitedScrollback:NO
+                                           appending:@"efghijklmnop"
+                                                  at:VT100GridCoordMake(1, 1)
+                                              expect:@"mno+\n"
+                                                     @"p..!"
+                                        expectCursor:VT100GridCoordMake(1, 1)
+                                    expectLineBuffer:@"abc!\ndefghijkl+"
+                                       expectDropped:0];
     // DWC
     [self doAppendCharsAtCursorTestWithInitialBuffer:@"...!\n"
                                                      @"...!"
@@ -7,13 +7,19 @@
 //
 
 #import "iTermTests.h"
+#import "AccessibilityTextModel.h"
+#import "BlinkingCellIndex.h"
 #import "DVR.h"
 #import "DVRDecoder.h"
+#import "NSStringITerm.h"
 #import "PTYNoteViewController.h"
 #import "SearchResult.h"
+#import "SelectionTextWriter.h"
+#import "TmuxHistoryParser.h"
 #import "TmuxStateParser.h"
 #import "VT100ScreenTest.h"
 #import "VT100Screen.h"
+#import "VT100RemoteHost.h"
 
 @interface VT100Screen (Testing)
 // It's only safe to use this on a newly created screen.
@@ -31,6 +37,7 @@
     VT100Terminal *terminal_;
     int startX_, endX_, startY_, endY_;
     int needsRedraw_;
+    int gridSwitches_;
     int sizeDidChange_;
     BOOL cursorVisible_;
     int triggers_;
@@ -59,6 +66,7 @@
     terminal_ = [[[VT100Terminal alloc] init] autorelease];
     startX_ = endX_ = startY_ = endY_ = -1;
     needsRedraw_ = 0;
+    gridSwitches_ = 0;
     sizeDidChange_ = 0;
     cursorVisible_ = YES;
     triggers_ = 0;
@@ -308,6 +316,10 @@
     needsRedraw_++;
 }
 
+- (void)screenDidSwitchGrids {
+    gridSwitches_++;
+}
+
 - (void)screenSizeDidChange {
     sizeDidChange_++;
 }
@@ -415,6 +427,13 @@
     [triggerLine_ appendString:string];
 }
 
+- (void)screenDidAppendAsciiBytesToCurrentLine:(const unsigned char *)bytes length:(int)length {
+    NSString *string = [[[NSString alloc] initWithBytes:bytes
+                                                 length:length
+                                               encoding:NSASCIIStringEncoding] autorelease];
+    [triggerLine_ appendString:string];
+}
+
 - (void)screenDidReset {
 }
 
@@ -1309,6 +1328,120 @@
     assert([screen allCharacterSetPropertiesHaveDefaultValues]);
 }
 
+- (void)testDoubleWidthTableMatchesRangeSearch {
+    for (int c = 0; c < 0x110000; c++) {
+        assert([NSString isDoubleWidthCharacter:c ambiguousIsDoubleWidth:NO] ==
+               IsDoubleWidthCharacterBySearching(c, NO));
+        assert([NSString isDoubleWidthCharacter:c ambiguousIsDoubleWidth:YES] ==
+               IsDoubleWidthCharacterBySearching(c, YES));
+    }
+    assert([NSString isDoubleWidthCharacter:0x4e00 ambiguousIsDoubleWidth:NO]);
+    assert(![NSString isDoubleWidthCharacter:0xa1 ambiguousIsDoubleWidth:NO]);
+    assert([NSString isDoubleWidthCharacter:0xa1 ambiguousIsDoubleWidth:YES]);
+    assert(![NSString isDoubleWidthCharacter:0x110000 ambiguousIsDoubleWidth:YES]);
+}
+
+- (void)testStringToScreenChars {
+    screen_char_t fg = [terminal_ foregroundColorCode];
+    screen_char_t bg = [terminal_ backgroundColorCode];
+    bg.bgGreen = 7;
+    // a, wide char, e + combining acute, zero width space, U+20000 (a wide surrogate pair), b
+    NSString *s = [NSString stringWithFormat:@"a%Ce%C%C%C%Cb",
+                   (unichar)0x4e00, (unichar)0x301, (unichar)0x200b, (unichar)0xd840,
+                   (unichar)0xdc00];
+    screen_char_t buf[16];
+    int len;
+    int cursorIndex = 7;  // At the b
+    StringToScreenChars(s, buf, fg, bg, &len, NO, &cursorIndex);
+    assert(len == 7);
+    assert(cursorIndex == 6);
+    assert(buf[0].code == 'a' && !buf[0].complexChar);
+    assert(buf[1].code == 0x4e00);
+    assert(buf[2].code == DWC_RIGHT);
+    assert(buf[2].bgGreen == 7);
+    assert(buf[3].complexChar);
+    assert([ScreenCharToStr(&buf[3]) isEqualToString:[s substringWithRange:NSMakeRange(2, 2)]]);
+    assert(buf[4].complexChar);
+    assert(CharToLongChar(buf[4].code, YES) == 0x20000);
+    assert(buf[5].code == DWC_RIGHT);
+    assert(buf[6].code == 'b');
+
+    // Ambiguous-width chars are double-width only when asked for.
+    NSString *ambiguous = [NSString stringWithFormat:@"%Cx", (unichar)0xa1];
+    StringToScreenChars(ambiguous, buf, fg, bg, &len, NO, NULL);
+    assert(len == 2);
+    StringToScreenChars(ambiguous, buf, fg, bg, &len, YES, NULL);
+    assert(len == 3);
+    assert(buf[1].code == DWC_RIGHT);
+}
+
+- (NSString *)textWrittenFromScreen:(VT100Screen *)screen range:(VT100GridCoordRange)range {
+    const int width = [screen width];
+    NSMutableData *screenLines =
+        [NSMutableData dataWithLength:[screen height] * (width + 1) * sizeof(screen_char_t)];
+    for (int i = 0; i < [screen height]; i++) {
+        memcpy((screen_char_t *)[screenLines mutableBytes] + i * (width + 1),
+               [screen getLineAtScreenIndex:i],
+               (width + 1) * sizeof(screen_char_t));
+    }
+    LineBuffer *snapshot = [screen newScrollbackSnapshot];
+    SelectionTextWriter *writer =
+        [[[SelectionTextWriter alloc] initWithScrollback:snapshot
+                                             screenLines:screenLines
+                                                   width:width
+                                                   range:range
+                                                     pad:NO
+                                      includeLastNewline:NO
+                                  trimTrailingWhitespace:YES] autorelease];
+    [snapshot release];
+    [writer writeToDataWithCompletion:^(NSData *data) {}];
+    return [[[NSString alloc] initWithData:[writer waitForData]
+                                  encoding:NSUTF8StringEncoding] autorelease];
+}
+
+- (void)testWorkingDirectoryAndRemoteHostOnLine {
+    VT100Screen *screen = [self screenWithWidth:5 height:4];
+    [self appendLines:@[ @"abc", @"def", @"ghi" ] toScreen:screen];
+    [screen setWorkingDirectory:@"/a" onLine:0];
+    [screen setWorkingDirectory:@"/b" onLine:2];
+    [screen setRemoteHost:@"host" user:@"user" onLine:1];
+
+    // Objects apply to the lines after the one they're on.
+    assert([screen workingDirectoryOnLine:0] == nil);
+    assert([[screen workingDirectoryOnLine:1] isEqualToString:@"/a"]);
+    assert([[screen workingDirectoryOnLine:2] isEqualToString:@"/a"]);
+    assert([[screen workingDirectoryOnLine:3] isEqualToString:@"/b"]);
+    assert([screen remoteHostOnLine:1] == nil);
+    assert([[[screen remoteHostOnLine:3] hostname] isEqualToString:@"host"]);
+
+    // Added out of order, and a later one on the same line wins.
+    [screen setWorkingDirectory:@"/c" onLine:1];
+    [screen setWorkingDirectory:@"/d" onLine:1];
+    assert([[screen workingDirectoryOnLine:2] isEqualToString:@"/d"]);
+    assert([[screen workingDirectoryOnLine:3] isEqualToString:@"/b"]);
+
+    // The index is rebuilt from the interval tree after a resize.
+    [screen resizeWidth:6 height:4];
+    assert([[screen workingDirectoryOnLine:2] isEqualToString:@"/d"]);
+    assert([[screen workingDirectoryOnLine:3] isEqualToString:@"/b"]);
+}
+
+- (void)testSelectionTextWriter {
+    VT100Screen *screen = [self screenWithWidth:4 height:3];
+    [self appendLines:@[@"abcdefgh", @"ijkl", @"mnopqrst", @"uvwxyz"] toScreen:screen];
+    assert([screen numberOfScrollbackLines] == 5);
+
+    // All in scrollback.
+    assert([[self textWrittenFromScreen:screen range:VT100GridCoordRangeMake(1, 0, 4, 3)]
+            isEqualToString:@"bcdefgh\nijkl\nmnop"]);
+    // From scrollback onto the screen.
+    assert([[self textWrittenFromScreen:screen range:VT100GridCoordRangeMake(0, 4, 4, 6)]
+            isEqualToString:@"qrst\nuvwxyz"]);
+    // Only the screen.
+    assert([[self textWrittenFromScreen:screen range:VT100GridCoordRangeMake(0, 5, 2, 6)]
+            isEqualToString:@"uvwxyz"]);
+}
+
 - (void)testClearBuffer {
     VT100Screen *screen;
     screen = [self screenWithWidth:5 height:4];
@@ -1427,6 +1560,16 @@
     assert(line[0].underline);
     assert(line[0].backgroundColor == 6);
     assert(line[0].backgroundColorMode == ColorModeNormal);
+
+    // Changing attributes takes effect for the next string.
+    [self sendEscapeCodes:@"^[[0m"];
+    [screen appendStringAtCursor:@"x" ascii:YES];
+    line = [screen getLineAtScreenIndex:2];
+    assert(line[1].code == 'x');
+    assert(!line[1].bold);
+    assert(!line[1].underline);
+    assert(line[1].foregroundColorMode == ColorModeAlternate);
+    assert(line[1].backgroundColorMode == ColorModeAlternate);
 }
 
 - (void)testAppendStringAtCursorNonAscii {
@@ -1575,6 +1718,106 @@
     assert([a isEqualToString:e]);
 }
 
+- (void)testUtf8Decoding {
+    VT100Screen *screen = [self screenWithWidth:20 height:2];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    [terminal_ setEncoding:NSUTF8StringEncoding];
+
+    // "a", U+4E2D (double width), a bad byte, "b", and the first two bytes of U+4E2D.
+    const unsigned char bytes[] = { 'a', 0xe4, 0xb8, 0xad, 0xff, 'b', 0xe4, 0xb8 };
+    [terminal_ putStreamData:[NSData dataWithBytes:bytes length:sizeof(bytes)]];
+    while ([terminal_ parseNextToken]) {
+        [terminal_ executeToken];
+    }
+    screen_char_t *line = [screen getLineAtScreenIndex:0];
+    assert(line[0].code == 'a');
+    assert(line[1].code == 0x4e2d);
+    assert(line[2].code == DWC_RIGHT);
+    assert(line[3].code == UNICODE_REPLACEMENT_CHAR);
+    assert(line[4].code == 'b');
+    assert(line[5].code == 0);
+
+    // Finish the split sequence.
+    const unsigned char lastByte = 0xad;
+    [terminal_ putStreamData:[NSData dataWithBytes:&lastByte length:1]];
+    while ([terminal_ parseNextToken]) {
+        [terminal_ executeToken];
+    }
+    line = [screen getLineAtScreenIndex:0];
+    assert(line[5].code == 0x4e2d);
+    assert(line[6].code == DWC_RIGHT);
+}
+
+- (void)testLegacyEncodingDecoding {
+    VT100Screen *screen = [self screenWithWidth:20 height:2];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    [terminal_ setEncoding:0x80000632];  // GB18030
+
+    // "a", U+4E2D (double width), a lead byte without a trail byte, " b", and the first half of
+    // U+10000's four bytes.
+    const unsigned char gbBytes[] = { 'a', 0xd6, 0xd0, 0xd6, ' ', 'b', 0x90, 0x30 };
+    [terminal_ putStreamData:[NSData dataWithBytes:gbBytes length:sizeof(gbBytes)]];
+    while ([terminal_ parseNextToken]) {
+        [terminal_ executeToken];
+    }
+    screen_char_t *line = [screen getLineAtScreenIndex:0];
+    assert(line[0].code == 'a');
+    assert(line[1].code == 0x4e2d);
+    assert(line[2].code == DWC_RIGHT);
+    assert(line[3].code == ONECHAR_UNKNOWN);
+    assert(line[4].code == ' ');
+    assert(line[5].code == 'b');
+    assert(line[6].code == 0);
+
+    // Finish U+10000 and split U+4E2D between reads.
+    const unsigned char moreGbBytes[] = { 0x81, 0x30, 0xd6 };
+    [terminal_ putStreamData:[NSData dataWithBytes:moreGbBytes length:sizeof(moreGbBytes)]];
+    while ([terminal_ parseNextToken]) {
+        [terminal_ executeToken];
+    }
+    const unsigned char lastGbByte = 0xd0;
+    [terminal_ putStreamData:[NSData dataWithBytes:&lastGbByte length:1]];
+    while ([terminal_ parseNextToken]) {
+        [terminal_ executeToken];
+    }
+    line = [screen getLineAtScreenIndex:0];
+    NSString *s = ScreenCharToStr(line + 6);
+    assert([s length] == 2 && [s characterAtIndex:0] == 0xd800 && [s characterAtIndex:1] == 0xdc00);
+    assert(line[7].code == 0x4e2d);
+    assert(line[8].code == DWC_RIGHT);
+
+    // Shift-JIS: U+65E5 (double width), halfwidth katakana U+FF71, and "c".
+    [terminal_ setEncoding:0x80000a01];
+    const unsigned char sjisBytes[] = { '\r', '\n', 0x93, 0xfa, 0xb1, 'c' };
+    [terminal_ putStreamData:[NSData dataWithBytes:sjisBytes length:sizeof(sjisBytes)]];
+    while ([terminal_ parseNextToken]) {
+        [terminal_ executeToken];
+    }
+    line = [screen getLineAtScreenIndex:1];
+    assert(line[0].code == 0x65e5);
+    assert(line[1].code == DWC_RIGHT);
+    assert(line[2].code == 0xff71);
+    assert(line[3].code == 'c');
+}
+
+- (void)testSplitCSIResumesParsing {
+    VT100Screen *screen = [self screenWithWidth:20 height:2];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+
+    // A backspace embedded in a CSI sequence is executed in place. When the sequence arrives in
+    // two pieces the first backspace must not be executed again.
+    [self sendEscapeCodes:@"abcd^[[\b"];
+    assert([screen cursorX] == 4);
+    [self sendEscapeCodes:@"\b1C"];
+    assert([screen cursorX] == 4);
+    [self sendEscapeCodes:@"^[[1;3"];
+    [self sendEscapeCodes:@"1mx"];
+    screen_char_t *line = [screen getLineAtScreenIndex:0];
+    assert(line[3].code == 'x');
+    assert(line[3].bold);
+    assert(line[3].foregroundColor == 1);
+}
+
 - (void)testLinefeed {
     // The guts of linefeed is tested in VT100GridTest.
     VT100Screen *screen = [self screenWithWidth:5 height:5];
@@ -1666,6 +1909,27 @@
             @"MNOP..!"]);
 }
 
+- (void)testLineBufferFromDumpHistoryResponse {
+    // Attributes carry over from one line to the next.
+    NSData *response = [@"abc\x1b[31mdef\nghi\x1b[0m jk\n" dataUsingEncoding:NSUTF8StringEncoding];
+    LineBuffer *history =
+        [[TmuxHistoryParser sharedInstance] lineBufferFromDumpHistoryResponse:response
+                                                       ambiguousIsDoubleWidth:NO];
+    assert([history numLinesWithWidth:6] == 3);
+    assert([[history compactLineDumpWithWidth:6] isEqualToString:@"abcdef\nghi jk\n......"]);
+    ScreenCharArray *line = [history wrappedLineAtIndex:1 width:6];
+    assert(line.line[0].foregroundColor == 1);
+    assert(line.line[3].foregroundColor != 1);
+
+    VT100Screen *screen = [self screenWithWidth:6 height:4];
+    [screen setHistoryFromLineBuffer:history];
+    assert([[screen compactLineDumpWithHistoryAndContinuationMarks] isEqualToString:
+            @"abcdef!\n"
+            @"ghi jk!\n"
+            @"......!\n"
+            @"......!"]);
+}
+
 - (void)testSetAltScreen {
     NSArray *lines = @[[self screenCharLineForString:@"abcdefghijkl"],
                        [self screenCharLineForString:@"mnop"],
@@ -1796,6 +2060,43 @@
        highlightBgMode:ColorModeAlternate];
 }
 
+- (void)testHighlightTextMatchingRegexOnlySearchesChangedLines {
+    VT100Screen *screen = [self screenWithWidth:5 height:4];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    NSDictionary *colors = @{ kHighlightForegroundColor: [NSColor blueColor],
+                              kHighlightBackgroundColor: [NSColor redColor] };
+    int blue = 16 + 5;
+    int red = 16 + 5 * 36;
+    [self appendLines:@[ @"rerex" ] toScreen:screen];
+    [screen highlightTextMatchingRegex:@"re" colors:colors];
+
+    // A new line is highlighted and the old one keeps its colors.
+    [self appendLines:@[ @"xxre" ] toScreen:screen];
+    [screen highlightTextMatchingRegex:@"re" colors:colors];
+    [self assertScreen:screen
+     matchesHighlights:@[ @"hhhh.", @"..hh.", @".....", @"....." ]
+           highlightFg:blue
+       highlightFgMode:ColorModeNormal
+           highlightBg:red
+       highlightBgMode:ColorModeNormal];
+
+    // A line whose colors were changed after it was highlighted is highlighted again.
+    screen_char_t *line = [screen getLineAtScreenIndex:0];
+    for (int x = 0; x < 5; x++) {
+        line[x].foregroundColor = [terminal_ foregroundColorCode].foregroundColor;
+        line[x].foregroundColorMode = ColorModeAlternate;
+        line[x].backgroundColor = [terminal_ foregroundColorCode].backgroundColor;
+        line[x].backgroundColorMode = ColorModeAlternate;
+    }
+    [screen highlightTextMatchingRegex:@"re" colors:colors];
+    [self assertScreen:screen
+     matchesHighlights:@[ @"hhhh.", @"..hh.", @".....", @"....." ]
+           highlightFg:blue
+       highlightFgMode:ColorModeNormal
+           highlightBg:red
+       highlightBgMode:ColorModeNormal];
+}
+
 - (void)testSetFromFrame {
     VT100Screen *source = [self fiveByFourScreenWithThreeLinesOneWrapped];
     NSMutableData *data = [NSMutableData data];
@@ -1980,6 +2281,49 @@
     assert([actualResult isEqualToSearchResult:expectedResult]);
 }
 
+// Each pass of a tail find searches only what was appended since the last one, and the screen.
+- (void)testContinueTailFindSearchesNewOutput {
+    VT100Screen *screen = [self screenWithWidth:5 height:2];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    [self appendLines:@[@"abc", @"rst", @"xyz", @"012"] toScreen:screen];
+    [screen storeLastPositionInLineBufferAsFindContextSavedPosition];
+
+    FindContext *ctx = [[[FindContext alloc] init] autorelease];
+    [screen setFindString:@"rst"
+         forwardDirection:YES
+             ignoringCase:NO
+                    regex:NO
+              startingAtX:0
+              startingAtY:0
+               withOffset:0
+                inContext:ctx
+          multipleResults:YES];
+    [screen restoreSavedPositionToFindContext:ctx];
+    NSMutableArray *results = [NSMutableArray array];
+    assert(![screen continueTailFindResults:results inContext:ctx]);
+    assert(results.count == 0);
+
+    [self appendLines:@[@"rst", @"000"] toScreen:screen];
+    assert(![screen continueTailFindResults:results inContext:ctx]);
+    assert(results.count == 1);
+    assert([results[0] isEqualToSearchResult:[SearchResult searchResultFromX:0 y:4 toX:2 y:4]]);
+
+    // Nothing new was appended.
+    [results removeAllObjects];
+    assert(![screen continueTailFindResults:results inContext:ctx]);
+    assert(results.count == 0);
+
+    // Lines still on the screen are searched by every pass since they can change.
+    [self appendLines:@[@"rst"] toScreen:screen];
+    for (int i = 0; i < 2; i++) {
+        [results removeAllObjects];
+        assert(![screen continueTailFindResults:results inContext:ctx]);
+        assert(results.count == 1);
+        assert([results[0] isEqualToSearchResult:[SearchResult searchResultFromX:0 y:6 toX:2 y:6]]);
+    }
+    assert([ctx.substring isEqualToString:@"rst"]);
+}
+
 #pragma mark - Tests for PTYTextViewDataSource methods
 
 - (void)testNumberOfLines {
@@ -2056,6 +2400,41 @@
     assert([screen totalScrollbackOverflow] == 3);
 }
 
+- (void)testFastForwardLeavesScreenAsExecutingWould {
+    NSMutableString *output = [NSMutableString string];
+    for (int i = 0; i < 12; i++) {
+        [output appendFormat:@"\x1b[%dm%d%@\r\n", 31 + i % 7, i, (i % 3) ? @"" : @" wraps"];
+    }
+    [output appendString:@"$ "];
+    NSData *data = [output dataUsingEncoding:NSUTF8StringEncoding];
+
+    VT100Screen *screen = [self fiveByFourScreenWithThreeLinesOneWrapped];
+    VT100TokenBatch *batch = [terminal_ tokenBatchFromData:data
+                                            terminalHeight:4
+                                     useColumnScrollRegion:NO];
+    for (int i = 0; i < batch.numberOfTokens; i++) {
+        [terminal_ executeTokenAtIndex:i inBatch:batch];
+    }
+
+    VT100Terminal *terminal = [[[VT100Terminal alloc] init] autorelease];
+    VT100Screen *fastScreen = [[[VT100Screen alloc] initWithTerminal:terminal] autorelease];
+    terminal.delegate = fastScreen;
+    [fastScreen destructivelySetScreenWidth:5 height:4];
+    [self appendLines:@[@"abcdefgh", @"ijkl"] toScreen:fastScreen];
+    const int index = [terminal fastForwardTokensInBatch:batch fromIndex:0];
+    assert(index > 0);
+    for (int i = index; i < batch.numberOfTokens; i++) {
+        [terminal executeTokenAtIndex:i inBatch:batch];
+    }
+
+    assert([[fastScreen compactLineDumpWithHistory] isEqualToString:
+            [screen compactLineDumpWithHistory]]);
+    assert([fastScreen cursorX] == [screen cursorX]);
+    assert([fastScreen cursorY] == [screen cursorY]);
+    assert([fastScreen getLineAtScreenIndex:0][0].foregroundColor ==
+           [screen getLineAtScreenIndex:0][0].foregroundColor);
+}
+
 - (void)testAbsoluteLineNumberOfCursor {
     VT100Screen *screen = [self fiveByFourScreenWithThreeLinesOneWrapped];
     assert([screen cursorY] == 4);
@@ -2373,9 +2752,52 @@
     }];
 }
 
+- (void)testFindFoldsNonASCII {
+    NSString *lines =
+        @"Un caf\u00e9...!\n"
+        @"\uff23-\uff21-\uff26-\uff25-..!\n"
+        @"\u65e5-\u672c-cafe..!";
+
+    // Case, diacritics, and width are all ignored, and a match's double-width characters include
+    // their right halves.
+    [self assertSearchInScreenLines:lines
+                         forPattern:@"CAF\u00c9"
+                   forwardDirection:YES
+                       ignoringCase:YES
+                              regex:NO
+                        startingAtX:0
+                        startingAtY:0
+                         withOffset:0
+                     matchesResults:@[ [SearchResult searchResultFromX:3 y:0 toX:6 y:0],
+                                       [SearchResult searchResultFromX:0 y:1 toX:7 y:1],
+                                       [SearchResult searchResultFromX:4 y:2 toX:7 y:2] ]];
+
+    // Case sensitive only matches exactly.
+    [self assertSearchInScreenLines:lines
+                         forPattern:@"caf\u00e9"
+                   forwardDirection:YES
+                       ignoringCase:NO
+                              regex:NO
+                        startingAtX:0
+                        startingAtY:0
+                         withOffset:0
+                     matchesResults:@[ [SearchResult searchResultFromX:3 y:0 toX:6 y:0] ]];
+
+    // Across double-width characters, searching backward.
+    [self assertSearchInScreenLines:lines
+                         forPattern:@"\u65e5\u672cc"
+                   forwardDirection:NO
+                       ignoringCase:NO
+                              regex:NO
+                        startingAtX:9
+                        startingAtY:2
+                         withOffset:0
+                     matchesResults:@[ [SearchResult searchResultFromX:0 y:2 toX:4 y:2] ]];
+}
+
 - (void)testScrollingInAltScreen {
-    // When in alt screen and scrolling and !saveToScrollbackInAlternateScreen_, then the whole
-    // screen must be marked dirty.
+    // When in alt screen and scrolling and !saveToScrollbackInAlternateScreen_, then the screen's
+    // contents move up, which is reported as scroll damage with only the new bottom line dirty.
     VT100Screen *screen = [self screenWithWidth:2 height:3];
     screen.delegate = (id<VT100ScreenDelegate>)self;
     [screen setMaxScrollbackLines:3];
@@ -2415,15 +2837,45 @@
             @"..\n"
             @"..\n"
             @".."]);
-    assert([[[screen currentGrid] compactDirtyDump] isEqualToString:
-            @"dd\n"
-            @"dd\n"
-            @"dd"]);
+    assert([[[[[screen currentGrid] compactDirtyDump] componentsSeparatedByString:@"\n"] lastObject]
+               isEqualToString:@"dd"]);
+    assert([screen currentGrid].scrollDamageDistance == -1);
+    assert(![screen currentGrid].scrollDamageIsComplex);
     ITERM_TEST_KNOWN_BUG(startY_ == 4, startY_ == -1);  // See comment in -linefeed about why this happens
     // When this bug is fixed, also test truncation with and without scroll regions, as well
     // as deselection because the whole selection scrolled off the top of the scroll region.
 }
 
+- (void)testSwitchingGridsReusesThem {
+    VT100Screen *screen = [self fiveByFourScreenWithThreeLinesOneWrapped];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    VT100Grid *primary = [screen currentGrid];
+    [self showAltAndUppercase:screen];
+    VT100Grid *alternate = [screen currentGrid];
+    assert(alternate != primary);
+    for (int i = 0; i < 3; i++) {
+        [screen terminalShowPrimaryBufferRestoringCursor:YES];
+        assert([screen currentGrid] == primary);
+        assert([[screen compactLineDump] isEqualToString:
+                @"abcde\n"
+                @"fgh..\n"
+                @"ijkl.\n"
+                @"....."]);
+        [screen terminalShowAltBuffer];
+        assert([screen currentGrid] == alternate);
+        assert([[screen compactLineDump] isEqualToString:
+                @"ABCDE\n"
+                @"FGH..\n"
+                @"IJKL.\n"
+                @"....."]);
+    }
+    assert(gridSwitches_ == 7);
+
+    // Showing the grid that's already showing isn't a switch.
+    [screen terminalShowAltBuffer];
+    assert(gridSwitches_ == 7);
+}
+
 - (void)testAllDirty {
     // This is not a great test.
     VT100Screen *screen = [self screenWithWidth:2 height:3];
@@ -2479,6 +2931,7 @@
 - (void)testSaveToDvr {
     VT100Screen *screen = [self screenWithWidth:20 height:3];
     screen.delegate = (id<VT100ScreenDelegate>)self;
+    screen.maxDvrFramesPerSecond = 0;
     [self appendLines:@[ @"Line 1", @"Line 2"] toScreen:screen];
     [screen saveToDvr];
     
@@ -2501,6 +2954,90 @@
     assert([s isEqualToString:@"Line 2"]);
 }
 
+- (void)testDvrSeekBackAndForth {
+    VT100Screen *screen = [self screenWithWidth:20 height:3];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    screen.maxDvrFramesPerSecond = 0;
+    NSMutableArray *expected = [NSMutableArray array];
+    for (int i = 0; i < 20; i++) {
+        [self appendLines:@[ [NSString stringWithFormat:@"Line %d", i] ] toScreen:screen];
+        [screen saveToDvr];
+        [expected addObject:ScreenCharArrayToStringDebug([screen getLineAtScreenIndex:0],
+                                                         [screen width])];
+    }
+
+    // Visit frames out of order so some come from the current frame, some from the cache, and
+    // some from a key frame. This is a new DVR so frame i has key i.
+    DVRDecoder *decoder = [screen.dvr getDecoder];
+    int order[] = { 19, 3, 12, 11, 18, 0, 12, 13, 4, 19 };
+    for (int i = 0; i < sizeof(order) / sizeof(*order); i++) {
+        [decoder _seekToEntryWithKey:order[i]];
+        NSString *s = ScreenCharArrayToStringDebug((screen_char_t *)[decoder decodedFrame],
+                                                   [screen width]);
+        assert([s isEqualToString:[expected objectAtIndex:order[i]]]);
+    }
+    [screen.dvr releaseDecoder:decoder];
+}
+
+- (void)testDvrFileRoundTrip {
+    NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:@"testDvrFileRoundTrip.itermdvr"];
+    VT100Screen *screen = [self screenWithWidth:20 height:3];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    screen.maxDvrFramesPerSecond = 0;
+    assert([screen.dvr startRecordingToFile:path]);
+    NSMutableArray *expected = [NSMutableArray array];
+    for (int i = 0; i < 5; i++) {
+        [self appendLines:@[ [NSString stringWithFormat:@"Line %d", i] ] toScreen:screen];
+        [screen saveToDvr];
+        [expected addObject:ScreenCharArrayToStringDebug([screen getLineAtScreenIndex:0],
+                                                         [screen width])];
+    }
+    // Releasing the DVR finishes the file.
+    screen.dvr = nil;
+
+    DVR *dvr = [[[DVR alloc] initWithContentsOfFile:path] autorelease];
+    assert(dvr);
+    DVRDecoder *decoder = [dvr getDecoder];
+    assert([decoder seek:0]);
+    for (int i = 0; i < 5; i++) {
+        NSString *s = ScreenCharArrayToStringDebug((screen_char_t *)[decoder decodedFrame],
+                                                   [screen width]);
+        assert([s isEqualToString:[expected objectAtIndex:i]]);
+        assert([decoder next] == (i < 4));
+    }
+    [dvr releaseDecoder:decoder];
+    unlink([path fileSystemRepresentation]);
+}
+
+- (void)testDvrFrameRateLimit {
+    VT100Screen *screen = [self screenWithWidth:20 height:3];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    screen.maxDvrFramesPerSecond = 0.001;
+    [self appendLines:@[ @"Line 1" ] toScreen:screen];
+    [screen saveToDvr];
+    assert(![screen hasPendingDvrFrame]);
+
+    // The second frame is over budget, so its changes wait.
+    [self appendLines:@[ @"Line 2" ] toScreen:screen];
+    [screen saveToDvr];
+    assert([screen hasPendingDvrFrame]);
+
+    // Once the limit is lifted they're recorded even though nothing new is dirty.
+    screen.maxDvrFramesPerSecond = 0;
+    [screen resetDirty];
+    [screen saveToDvr];
+    assert(![screen hasPendingDvrFrame]);
+
+    DVRDecoder *decoder = [screen.dvr getDecoder];
+    [decoder seek:0];
+    assert([decoder next]);
+    NSString *s = ScreenCharArrayToStringDebug((screen_char_t *)[decoder decodedFrame] + 21,
+                                               [screen width]);
+    assert([s isEqualToString:@"Line 2"]);
+    assert(![decoder next]);
+    [screen.dvr releaseDecoder:decoder];
+}
+
 - (void)testContentsChangedNotification {
     shouldSendContentsChangedNotification_ = NO;
     VT100Screen *screen = [self screenWithWidth:20 height:3];
@@ -2512,6 +3049,23 @@
 
 #pragma mark - Test for VT100TerminalDelegate methods
 
+- (void)testAsciiTokensAreAppendedFromTheirBytes {
+    VT100Screen *screen = [self screenWithWidth:20 height:3];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    NSData *data = [@"abc\x1b[1mdef" dataUsingEncoding:NSASCIIStringEncoding];
+    VT100TokenBatch *batch = [terminal_ tokenBatchFromData:data
+                                            terminalHeight:3
+                                     useColumnScrollRegion:NO];
+    for (int i = 0; i < batch.numberOfTokens; i++) {
+        [terminal_ executeTokenAtIndex:i inBatch:batch];
+    }
+    assert([ScreenCharArrayToStringDebug([screen getLineAtScreenIndex:0],
+                                         screen.width) isEqualToString:@"abcdef"]);
+    assert(![screen getLineAtScreenIndex:0][2].bold);
+    assert([screen getLineAtScreenIndex:0][3].bold);
+    assert([triggerLine_ isEqualToString:@"abcdef"]);
+}
+
 - (void)testPrinting {
     VT100Screen *screen = [self screenWithWidth:20 height:3];
     screen.delegate = (id<VT100ScreenDelegate>)self;
@@ -3647,6 +4201,19 @@
     assert(pasted_);
 }
 
+- (void)testPastingCapturesTextSplitAcrossReads {
+    VT100Screen *screen = [self screenWithWidth:5 height:2];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    [self sendEscapeCodes:@"^[]50;CopyToClipboard=general^GHel"];
+    [self sendEscapeCodes:@"lo ^[[1mworld^[]50;End"];
+    [self sendEscapeCodes:@"Copy^G$"];
+    assert(pasted_);
+    assert([pbData_ isEqualToData:[@"Hello \033[1mworld" dataUsingEncoding:NSUTF8StringEncoding]]);
+    assert([[screen compactLineDump] isEqualToString:
+            @"$....\n"
+            @"....."]);
+}
+
 - (void)testCursorReporting {
     VT100Screen *screen = [self screenWithWidth:20 height:20];
     screen.delegate = (id<VT100ScreenDelegate>)self;
@@ -3858,4 +4425,144 @@
   assert(range.end.y == 6);
 }
 
+- (void)testAccessibilityTextModel {
+    VT100Screen *screen = [self screenWithWidth:5 height:4];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    [screen setMaxScrollbackLines:1];
+    [self appendLinesNoNewline:@[@"abcdefgh", @"ijkl"] toScreen:screen];
+    AccessibilityTextModel *model = [[[AccessibilityTextModel alloc] init] autorelease];
+    [model updateWithDataSource:screen];
+    assert([[model text] hasPrefix:@"abcdefgh\nijkl"]);
+    assert([model numberOfLines] == [screen numberOfLines]);
+    assert(NSEqualRanges([model rangeOfLine:1], NSMakeRange(5, 4)));
+    assert([model lineNumberOfOffset:0] == 0);
+    assert([model lineNumberOfOffset:5] == 1);
+    assert([model lineNumberOfOffset:9] == 2);
+
+    // Nothing is re-read until the model is told it's out of date.
+    [screen appendStringAtCursor:@"m" ascii:YES];
+    [model updateWithDataSource:screen];
+    assert(![[model text] hasPrefix:@"abcdefgh\nijklm"]);
+    [model setNeedsUpdate];
+    [model updateWithDataSource:screen];
+    assert([[model text] hasPrefix:@"abcdefgh\nijklm"]);
+
+    // Push the first line out of the scrollback.
+    [screen terminalCarriageReturn];
+    [screen terminalLineFeed];
+    [self appendLinesNoNewline:@[@"nop", @"qrs", @"tuv"] toScreen:screen];
+    assert([screen totalScrollbackOverflow] > 0);
+    [model setNeedsUpdate];
+    [model updateWithDataSource:screen];
+    assert([model numberOfLines] == [screen numberOfLines]);
+    NSMutableString *expected = [NSMutableString string];
+    for (int i = 0; i < [screen numberOfLines]; i++) {
+        [expected appendString:[[model text] substringWithRange:[model rangeOfLine:i]]];
+    }
+    assert([expected isEqualToString:[model text]]);
+    assert([[model text] rangeOfString:@"qrs\ntuv"].location != NSNotFound);
+    assert([model lineNumberOfOffset:[[model text] length]] == [model numberOfLines]);
+}
+
+- (void)testBlinkingCellIndex {
+    VT100Screen *screen = [self screenWithWidth:5 height:3];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    BlinkingCellIndex *index = [[[BlinkingCellIndex alloc] init] autorelease];
+    [screen appendStringAtCursor:@"ab" ascii:YES];
+    [index updateWithDataSource:screen visibleLines:VT100GridRangeMake(0, 3)];
+    assert(![index hasBlinkingCells]);
+
+    [self sendEscapeCodes:@"^[[5m"];  // Blink
+    [screen appendStringAtCursor:@"c" ascii:YES];
+
+    // Lines that were already scanned are only looked at again once they're dirty.
+    [index updateWithDataSource:screen visibleLines:VT100GridRangeMake(0, 3)];
+    assert(![index hasBlinkingCells]);
+    [index setLineDirty:[screen totalScrollbackOverflow]];
+    [index updateWithDataSource:screen visibleLines:VT100GridRangeMake(0, 3)];
+    assert([index hasBlinkingCells]);
+    NSArray *rects = [index blinkingCellRectsWithTotalScrollbackOverflow:[screen totalScrollbackOverflow]];
+    assert(rects.count == 1);
+    VT100GridRect rect = [[rects objectAtIndex:0] gridRectValue];
+    assert(rect.origin.x == 2);
+    assert(rect.origin.y == 0);
+    assert(rect.size.height == 1);
+
+    // Lines that scroll out of view are dropped.
+    [index updateWithDataSource:screen visibleLines:VT100GridRangeMake(1, 2)];
+    assert(![index hasBlinkingCells]);
+}
+
+- (void)testAnnotationsOnLinesFollowNewNotes {
+    VT100Screen *screen = [self fiveByFourScreenWithThreeLinesOneWrapped];
+    const VT100GridRange lines = VT100GridRangeMake(0, 3);
+    NSArray *ranges = [screen charactersWithNotesOnLines:lines];
+    assert(ranges.count == 3);
+    assert([ranges[1] count] == 0);
+    assert([screen charactersWithNotesOnLines:lines] == ranges);
+
+    PTYNoteViewController *note = [[[PTYNoteViewController alloc] init] autorelease];
+    [screen addNote:note inRange:VT100GridCoordRangeMake(1, 1, 3, 2)];
+    ranges = [screen charactersWithNotesOnLines:lines];
+    assert([ranges[0] count] == 0);
+    assert([ranges[1] count] == 1);
+    VT100GridRange range = [ranges[1][0] gridRangeValue];
+    assert(range.location == 1);
+    assert(range.length == 5);
+    range = [ranges[2][0] gridRangeValue];
+    assert(range.location == 0);
+    assert(range.length == 3);
+    assert([[screen linesWithMarksInRange:lines] count] == 0);
+}
+
+
+- (void)testLineViewMatchesCopiedLine {
+    VT100Screen *screen = [self screenWithWidth:5 height:2];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    [self appendLines:@[ @"abcdefg", @"hij", @"k" ] toScreen:screen];
+    assert([screen numberOfScrollbackLines] == 3);
+
+    // Scrollback lines point into the line buffer and leave the rest of the row as padding.
+    ScreenCharLineView view = [screen lineViewAtIndex:1];
+    assert(view.length == 2 && view.eol == EOL_HARD);
+    assert(view.chars[0].code == 'f' && view.chars[1].code == 'g');
+
+    screen_char_t buffer[6];
+    for (int y = 0; y < [screen numberOfLines]; y++) {
+        view = [screen lineViewAtIndex:y];
+        screen_char_t *line = [screen getLineAtIndex:y withBuffer:buffer];
+        for (int x = 0; x < 5; x++) {
+            screen_char_t c = x < view.length ? view.chars[x] : view.padding;
+            assert(line[x].code == c.code);
+        }
+        assert(line[5].code == view.eol);
+    }
+}
+
+- (void)testContentsOfAbsoluteLines {
+    VT100Screen *screen = [self screenWithWidth:5 height:2];
+    screen.delegate = (id<VT100ScreenDelegate>)self;
+    [self appendLines:@[ @"abcdefg", @"hij", @"k" ] toScreen:screen];
+
+    // Soft wrapped lines are joined.
+    assert([[screen contentsOfAbsoluteLinesFrom:0 to:2] isEqualToString:@"abcdefg\nhij\n"]);
+    assert([[screen contentsOfAbsoluteLinesFrom:2 to:2] isEqualToString:@"hij\n"]);
+
+    // The range is clamped to the lines that exist.
+    assert([[screen contentsOfAbsoluteLinesFrom:-10 to:1] isEqualToString:@"abcdefg\n"]);
+    assert([[screen contentsOfAbsoluteLinesFrom:100 to:200] isEqualToString:@""]);
+
+    // The generation holds still until something changes.
+    [screen resetDirty];
+    long long generation = [screen contentGeneration];
+    [screen resetDirty];
+    assert([screen contentGeneration] == generation);
+    [self appendLines:@[ @"l" ] toScreen:screen];
+    assert([screen contentGeneration] != generation);
+    generation = [screen contentGeneration];
+    [screen resetDirty];
+    assert([screen contentGeneration] == generation);
+}
+
 @end
+
@@ -0,0 +1,31 @@
+//
+//  VT100ThroughputBenchmark.h
+//  iTerm
+//
+//  Replays byte streams through VT100Terminal and VT100Screen headlessly and reports how fast
+//  each stage runs. Run the iTermTests binary with ITERM_BENCHMARK=1 in the environment.
+//
+//  Environment:
+//    ITERM_BENCHMARK_SIZE       Approximate size in bytes of each generated stream (default 4MB).
+//    ITERM_BENCHMARK_CAPTURES   Directory of captured streams to replay in addition to the
+//                               generated ones (e.g., recorded with `script` or `tmux pipe-pane`).
+//                               Files ending in .itermrec are pty recordings (see PTYRecorder.h)
+//                               and their output is replayed.
+//    ITERM_BENCHMARK_BASELINE   Plist of ns/byte results to compare against
+//                               (default tests/benchmarks/baseline.plist).
+//    ITERM_BENCHMARK_RECORD     If set, write the results to the baseline file instead of
+//                               comparing against it.
+//
+
+#import <Foundation/Foundation.h>
+
+@interface VT100ThroughputBenchmark : NSObject
+
+// Runs all benchmarks and logs a report. Returns NO if any stage is slower than its baseline by
+// more than the allowed tolerance.
+- (BOOL)run;
+
+// Returns stream name -> data for the generated streams and any captures.
+- (NSDictionary *)streams;
+
+@end
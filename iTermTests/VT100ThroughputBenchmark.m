@@ -0,0 +1,500 @@
+//
+//  VT100ThroughputBenchmark.m
+//  iTerm
+//
+//  The generated streams mirror the ad-hoc generators in tests/ (spam.cc and friends) so the
+//  numbers are reproducible from run to run.
+//
+
+#import "VT100ThroughputBenchmark.h"
+#import "LineBuffer.h"
+#import "NSStringITerm.h"
+#import "PTYRecorder.h"
+#import "VT100Screen.h"
+#import "VT100Terminal.h"
+#include <mach/mach_time.h>
+
+static const int kDefaultStreamSize = 4 * 1024 * 1024;
+static const int kReadSize = 4096;  // Bytes handed to the terminal at a time, like one read().
+static const int kIterations = 3;  // Best of this many runs is reported.
+static const int kScreenWidth = 80;
+static const int kScreenHeight = 25;
+static const double kTolerance = 0.10;  // Fraction slower than baseline that counts as a regression.
+
+static NSString *const kDefaultBaselinePath = @"tests/benchmarks/baseline.plist";
+
+static double NanosecondsSince(uint64_t start) {
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return (double)(mach_absolute_time() - start) * timebase.numer / timebase.denom;
+}
+
+@implementation VT100ThroughputBenchmark {
+    NSMutableDictionary *results_;  // "stream.stage" -> ns/byte
+}
+
+- (id)init {
+    self = [super init];
+    if (self) {
+        results_ = [[NSMutableDictionary alloc] init];
+    }
+    return self;
+}
+
+- (void)dealloc {
+    [results_ release];
+    [super dealloc];
+}
+
+#pragma mark - Streams
+
+- (int)streamSize {
+    const char *size = getenv("ITERM_BENCHMARK_SIZE");
+    return size ? MAX(1024, atoi(size)) : kDefaultStreamSize;
+}
+
+// Appends |codePoint| as UTF-8.
+- (void)appendCodePoint:(int)codePoint toData:(NSMutableData *)data {
+    unsigned char bytes[4];
+    int length;
+    if (codePoint < 0x80) {
+        bytes[0] = codePoint;
+        length = 1;
+    } else if (codePoint < 0x800) {
+        bytes[0] = 0xc0 | (codePoint >> 6);
+        bytes[1] = 0x80 | (codePoint & 0x3f);
+        length = 2;
+    } else {
+        bytes[0] = 0xe0 | (codePoint >> 12);
+        bytes[1] = 0x80 | ((codePoint >> 6) & 0x3f);
+        bytes[2] = 0x80 | (codePoint & 0x3f);
+        length = 3;
+    }
+    [data appendBytes:bytes length:length];
+}
+
+- (void)appendString:(NSString *)string toData:(NSMutableData *)data {
+    [data appendData:[string dataUsingEncoding:NSUTF8StringEncoding]];
+}
+
+// Random lines of printable ASCII, like tests/spam.cc.
+- (NSData *)asciiStream {
+    NSMutableData *data = [NSMutableData data];
+    srandom(1);
+    while (data.length < [self streamSize]) {
+        int length = random() % 100;
+        for (int i = 0; i < length; i++) {
+            char c = 'A' + (random() % 60);
+            [data appendBytes:&c length:1];
+        }
+        [data appendBytes:"\r\n" length:2];
+    }
+    return data;
+}
+
+// Lines of double-width CJK ideographs.
+- (NSData *)cjkStream {
+    NSMutableData *data = [NSMutableData data];
+    srandom(2);
+    while (data.length < [self streamSize]) {
+        int length = random() % 40;
+        for (int i = 0; i < length; i++) {
+            [self appendCodePoint:0x4e00 + random() % 0x5000 toData:data];
+        }
+        [data appendBytes:"\r\n" length:2];
+    }
+    return data;
+}
+
+// Thai letters followed by combining marks, like spam.cc's combining-mark mode.
+- (NSData *)combiningMarkStream {
+    NSMutableData *data = [NSMutableData data];
+    srandom(3);
+    while (data.length < [self streamSize]) {
+        int length = random() % 60;
+        for (int i = 0; i < length; i++) {
+            [self appendCodePoint:0xe00 + random() % 30 + 1 toData:data];
+            [self appendCodePoint:0x300 toData:data];
+        }
+        [data appendBytes:"\r\n" length:2];
+    }
+    return data;
+}
+
+// Short colored runs, like grep --color, ls -G, or a syntax-highlighted diff.
+- (NSData *)sgrStream {
+    NSMutableData *data = [NSMutableData data];
+    srandom(4);
+    while (data.length < [self streamSize]) {
+        int words = random() % 12;
+        for (int i = 0; i < words; i++) {
+            [self appendString:[NSString stringWithFormat:@"\e[%d;%ldm", (int)(random() % 2),
+                                30 + random() % 8]
+                        toData:data];
+            int length = 1 + random() % 10;
+            for (int j = 0; j < length; j++) {
+                char c = 'a' + (random() % 26);
+                [data appendBytes:&c length:1];
+            }
+            [self appendString:@"\e[0m " toData:data];
+        }
+        [data appendBytes:"\r\n" length:2];
+    }
+    return data;
+}
+
+// Cursor-addressed updates in the style of top or a full-screen editor.
+- (NSData *)tuiStream {
+    NSMutableData *data = [NSMutableData data];
+    srandom(5);
+    while (data.length < [self streamSize]) {
+        if (random() % 50 == 0) {
+            [self appendString:@"\e[H\e[2J" toData:data];
+        }
+        [self appendString:[NSString stringWithFormat:@"\e[%ld;%ldH\e[7m%6ld\e[27m \e[K",
+                            1 + random() % kScreenHeight,
+                            1 + random() % (kScreenWidth / 2),
+                            random() % 100000]
+                    toData:data];
+        int length = random() % 30;
+        for (int i = 0; i < length; i++) {
+            char c = ' ' + (random() % 95);
+            [data appendBytes:&c length:1];
+        }
+    }
+    return data;
+}
+
+// Erases and fills in the style of a TUI repainting colored panes: EL and ECH over colored
+// backgrounds, ED, and the occasional DECALN.
+- (NSData *)eraseStream {
+    NSMutableData *data = [NSMutableData data];
+    srandom(7);
+    while (data.length < [self streamSize]) {
+        switch (random() % 40) {
+            case 0:
+                [self appendString:@"\e#8" toData:data];
+                break;
+            case 1:
+                [self appendString:[NSString stringWithFormat:@"\e[%ldJ", random() % 3]
+                            toData:data];
+                break;
+            default:
+                break;
+        }
+        [self appendString:[NSString stringWithFormat:@"\e[%ld;%ldH\e[%ldm\e[%ldK\e[%ldX",
+                            1 + random() % kScreenHeight,
+                            1 + random() % kScreenWidth,
+                            40 + random() % 8,
+                            random() % 3,
+                            1 + random() % kScreenWidth]
+                    toData:data];
+    }
+    return data;
+}
+
+// tmux control-mode %output notifications, with octal-escaped payloads.
+- (NSData *)tmuxOutputStream {
+    NSMutableData *data = [NSMutableData data];
+    srandom(6);
+    while (data.length < [self streamSize]) {
+        [self appendString:@"%output %1 " toData:data];
+        int length = random() % 80;
+        for (int i = 0; i < length; i++) {
+            if (random() % 20 == 0) {
+                [self appendString:@"\\033[1m" toData:data];
+            } else {
+                char c = 'A' + (random() % 60);
+                [data appendBytes:&c length:1];
+            }
+        }
+        [self appendString:@"\\015\\012\r\n" toData:data];
+    }
+    return data;
+}
+
+// Returns stream name -> data.
+- (NSDictionary *)streams {
+    NSMutableDictionary *streams = [NSMutableDictionary dictionary];
+    streams[@"ascii"] = [self asciiStream];
+    streams[@"cjk"] = [self cjkStream];
+    streams[@"combining"] = [self combiningMarkStream];
+    streams[@"sgr"] = [self sgrStream];
+    streams[@"tui"] = [self tuiStream];
+    streams[@"tmux"] = [self tmuxOutputStream];
+    streams[@"erase"] = [self eraseStream];
+
+    const char *captures = getenv("ITERM_BENCHMARK_CAPTURES");
+    if (captures) {
+        NSString *directory = [NSString stringWithUTF8String:captures];
+        NSFileManager *fileManager = [NSFileManager defaultManager];
+        for (NSString *name in [fileManager contentsOfDirectoryAtPath:directory error:NULL]) {
+            NSString *path = [directory stringByAppendingPathComponent:name];
+            NSData *data;
+            if ([[name pathExtension] isEqualToString:@"itermrec"]) {
+                data = [[[[PTYRecording alloc] initWithPath:path] autorelease] allData];
+            } else {
+                data = [NSData dataWithContentsOfFile:path];
+            }
+            if (data.length) {
+                streams[[@"capture-" stringByAppendingString:[name stringByDeletingPathExtension]]] = data;
+            }
+        }
+    }
+    return streams;
+}
+
+#pragma mark - Stages
+
+- (VT100Terminal *)newTerminal {
+    VT100Terminal *terminal = [[VT100Terminal alloc] init];
+    [terminal setEncoding:NSUTF8StringEncoding];
+    return terminal;
+}
+
+- (VT100Screen *)newScreenWithTerminal:(VT100Terminal *)terminal {
+    VT100Screen *screen = [[VT100Screen alloc] initWithTerminal:terminal];
+    terminal.delegate = screen;
+    screen.unlimitedScrollback = YES;
+    [screen destructivelySetScreenWidth:kScreenWidth height:kScreenHeight];
+    return screen;
+}
+
+// Feeds |data| to |terminal| one read at a time. Tokens are executed only if |execute| is set.
+// Returns elapsed nanoseconds.
+- (double)feed:(NSData *)data toTerminal:(VT100Terminal *)terminal execute:(BOOL)execute {
+    const unsigned char *bytes = data.bytes;
+    const int length = data.length;
+    uint64_t start = mach_absolute_time();
+    for (int offset = 0; offset < length; offset += kReadSize) {
+        NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+        NSData *chunk = [NSData dataWithBytesNoCopy:(void *)(bytes + offset)
+                                             length:MIN(kReadSize, length - offset)
+                                       freeWhenDone:NO];
+        [terminal putStreamData:chunk];
+        while ([terminal parseNextToken]) {
+            if (execute) {
+                [terminal executeToken];
+            }
+        }
+        [pool drain];
+    }
+    return NanosecondsSince(start);
+}
+
+// Tokenizing only. There is no delegate, so nothing is applied to a screen.
+- (double)parseTime:(NSData *)data {
+    VT100Terminal *terminal = [self newTerminal];
+    double ns = [self feed:data toTerminal:terminal execute:NO];
+    [terminal release];
+    return ns;
+}
+
+// Parsing plus executing tokens against a screen. Lines that scroll off go to the line buffer,
+// so this includes appending to it. If |linesOut| is given, it gets the screen's scrollback and
+// visible lines (each kScreenWidth + 1 chars, with the EOL marker last).
+- (double)applyTime:(NSData *)data lines:(NSMutableData *)linesOut {
+    VT100Terminal *terminal = [self newTerminal];
+    VT100Screen *screen = [self newScreenWithTerminal:terminal];
+    double ns = [self feed:data toTerminal:terminal execute:YES];
+    if (linesOut) {
+        const int numberOfLines = [screen numberOfLines];
+        [linesOut setLength:numberOfLines * (kScreenWidth + 1) * sizeof(screen_char_t)];
+        screen_char_t *lines = linesOut.mutableBytes;
+        for (int i = 0; i < numberOfLines; i++) {
+            [screen getLineAtIndex:i withBuffer:lines + i * (kScreenWidth + 1)];
+        }
+    }
+    terminal.delegate = nil;
+    [screen release];
+    [terminal release];
+    return ns;
+}
+
+// Appends every line in |lines| to a fresh LineBuffer.
+- (double)lineBufferTime:(NSData *)lines {
+    const screen_char_t *chars = lines.bytes;
+    const int numberOfLines = lines.length / ((kScreenWidth + 1) * sizeof(screen_char_t));
+    LineBuffer *lineBuffer = [[LineBuffer alloc] init];
+    uint64_t start = mach_absolute_time();
+    for (int i = 0; i < numberOfLines; i++) {
+        screen_char_t *line = (screen_char_t *)chars + i * (kScreenWidth + 1);
+        int length = kScreenWidth;
+        while (length > 0 && line[length - 1].code == 0) {
+            length--;
+        }
+        [lineBuffer appendLine:line
+                        length:length
+                       partial:(line[kScreenWidth].code == EOL_SOFT)
+                         width:kScreenWidth
+                     timestamp:0];
+    }
+    double ns = NanosecondsSince(start);
+    [lineBuffer release];
+    return ns;
+}
+
+// Looks up the width of every code point in |data| with the East Asian width table or, if
+// |searching| is set, with the range search the table replaced. Decoding isn't timed.
+- (double)widthTime:(NSData *)data searching:(BOOL)searching {
+    NSString *string = [[[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding] autorelease];
+    NSData *utf32 = [string dataUsingEncoding:NSUTF32LittleEndianStringEncoding];
+    const uint32_t *codePoints = utf32.bytes;
+    const int count = utf32.length / sizeof(uint32_t);
+    // Warm up the table so building it isn't counted.
+    [NSString isDoubleWidthCharacter:0x4e00 ambiguousIsDoubleWidth:NO];
+    int wide = 0;
+    uint64_t start = mach_absolute_time();
+    for (int i = 0; i < count; i++) {
+        if (searching) {
+            wide += IsDoubleWidthCharacterBySearching(codePoints[i], YES);
+        } else {
+            wide += [NSString isDoubleWidthCharacter:codePoints[i] ambiguousIsDoubleWidth:YES];
+        }
+    }
+    double ns = NanosecondsSince(start);
+    assert(wide <= count);
+    return ns;
+}
+
+// Recolors rows the way -[VT100Grid setBackgroundColor:...] does for highlighting, with
+// MergeScreenChars or, if |perChar| is set, by copying the colors into one char at a time as it
+// used to. Returns elapsed nanoseconds; |bytes| gets the size of the chars recolored.
+- (double)colorFillTime:(BOOL)perChar bytes:(NSUInteger *)bytes {
+    const int width = kScreenWidth + 1;
+    const int rows = MAX(1, [self streamSize] / (width * (int)sizeof(screen_char_t)));
+    NSMutableData *data = [NSMutableData dataWithLength:rows * width * sizeof(screen_char_t)];
+    screen_char_t *chars = data.mutableBytes;
+    screen_char_t fg;
+    screen_char_t bg;
+    screen_char_t ones;
+    memset(&fg, 0, sizeof(fg));
+    memset(&bg, 0, sizeof(bg));
+    memset(&ones, 0xff, sizeof(ones));
+    fg.foregroundColor = 3;
+    fg.foregroundColorMode = ColorModeNormal;
+    bg.backgroundColor = 4;
+    bg.backgroundColorMode = ColorModeNormal;
+    screen_char_t template = fg;
+    screen_char_t mask;
+    memset(&mask, 0, sizeof(mask));
+    CopyBackgroundColor(&template, bg);
+    CopyForegroundColor(&mask, ones);
+    CopyBackgroundColor(&mask, ones);
+
+    uint64_t start = mach_absolute_time();
+    for (int y = 0; y < rows; y++) {
+        screen_char_t *line = chars + y * width;
+        if (perChar) {
+            for (int x = 0; x < kScreenWidth; x++) {
+                CopyForegroundColor(&line[x], fg);
+                CopyBackgroundColor(&line[x], bg);
+            }
+        } else {
+            MergeScreenChars(line, kScreenWidth, template, mask);
+        }
+    }
+    double ns = NanosecondsSince(start);
+    assert(chars[0].backgroundColor == 4 && chars[0].foregroundColor == 3);
+    *bytes = rows * kScreenWidth * sizeof(screen_char_t);
+    return ns;
+}
+
+#pragma mark - Reporting
+
+- (void)recordStream:(NSString *)stream
+               stage:(NSString *)stage
+         nanoseconds:(double)ns
+               bytes:(NSUInteger)bytes {
+    double nsPerByte = ns / bytes;
+    double megabytesPerSecond = (bytes / (1024.0 * 1024.0)) / (ns / 1e9);
+    NSLog(@"  %-16s %-12s %9.2f MB/s %8.2f ns/byte",
+          [stream UTF8String], [stage UTF8String], megabytesPerSecond, nsPerByte);
+    results_[[NSString stringWithFormat:@"%@.%@", stream, stage]] = @(nsPerByte);
+}
+
+- (NSString *)baselinePath {
+    const char *path = getenv("ITERM_BENCHMARK_BASELINE");
+    return path ? [NSString stringWithUTF8String:path] : kDefaultBaselinePath;
+}
+
+// Returns NO if any result regressed beyond kTolerance.
+- (BOOL)compareWithBaseline {
+    NSString *path = [self baselinePath];
+    if (getenv("ITERM_BENCHMARK_RECORD")) {
+        [[NSFileManager defaultManager] createDirectoryAtPath:[path stringByDeletingLastPathComponent]
+                                  withIntermediateDirectories:YES
+                                                   attributes:nil
+                                                        error:NULL];
+        [results_ writeToFile:path atomically:YES];
+        NSLog(@"Recorded baseline in %@", path);
+        return YES;
+    }
+
+    NSDictionary *baseline = [NSDictionary dictionaryWithContentsOfFile:path];
+    if (!baseline) {
+        NSLog(@"No baseline at %@. Set ITERM_BENCHMARK_RECORD=1 to create one.", path);
+        return YES;
+    }
+
+    BOOL ok = YES;
+    for (NSString *key in [[results_ allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+        NSNumber *expected = baseline[key];
+        if (!expected) {
+            continue;
+        }
+        double change = [results_[key] doubleValue] / [expected doubleValue] - 1;
+        if (change > kTolerance) {
+            NSLog(@"REGRESSION %@: %.2f ns/byte vs baseline %.2f (%+.0f%%)",
+                  key, [results_[key] doubleValue], [expected doubleValue], change * 100);
+            ok = NO;
+        } else if (change < -kTolerance) {
+            NSLog(@"Improved %@: %.2f ns/byte vs baseline %.2f (%+.0f%%)",
+                  key, [results_[key] doubleValue], [expected doubleValue], change * 100);
+        }
+    }
+    return ok;
+}
+
+- (BOOL)run {
+    NSDictionary *streams = [self streams];
+    NSLog(@"-- Begin throughput benchmark (best of %d) --", kIterations);
+    for (NSString *name in [[streams allKeys] sortedArrayUsingSelector:@selector(compare:)]) {
+        NSData *data = streams[name];
+        double parse = INFINITY;
+        double apply = INFINITY;
+        double lineBuffer = INFINITY;
+        double width = INFINITY;
+        double widthSearch = INFINITY;
+        NSMutableData *lines = [NSMutableData data];
+        for (int i = 0; i < kIterations; i++) {
+            parse = MIN(parse, [self parseTime:data]);
+            apply = MIN(apply, [self applyTime:data lines:(i == 0 ? lines : nil)]);
+            lineBuffer = MIN(lineBuffer, [self lineBufferTime:lines]);
+            width = MIN(width, [self widthTime:data searching:NO]);
+            widthSearch = MIN(widthSearch, [self widthTime:data searching:YES]);
+        }
+        [self recordStream:name stage:@"parse" nanoseconds:parse bytes:data.length];
+        // Screen time is what executing tokens added on top of parsing them.
+        [self recordStream:name stage:@"screen" nanoseconds:MAX(0, apply - parse) bytes:data.length];
+        [self recordStream:name stage:@"linebuffer" nanoseconds:lineBuffer bytes:data.length];
+        [self recordStream:name stage:@"width" nanoseconds:width bytes:data.length];
+        [self recordStream:name stage:@"width-search" nanoseconds:widthSearch bytes:data.length];
+    }
+    double merge = INFINITY;
+    double perChar = INFINITY;
+    NSUInteger fillBytes = 0;
+    for (int i = 0; i < kIterations; i++) {
+        merge = MIN(merge, [self colorFillTime:NO bytes:&fillBytes]);
+        perChar = MIN(perChar, [self colorFillTime:YES bytes:&fillBytes]);
+    }
+    [self recordStream:@"color-fill" stage:@"merge" nanoseconds:merge bytes:fillBytes];
+    [self recordStream:@"color-fill" stage:@"per-char" nanoseconds:perChar bytes:fillBytes];
+    // Drawing is measured by RenderBenchmark.
+    NSLog(@"-- Finished throughput benchmark --");
+    return [self compareWithBaseline];
+}
+
+@end
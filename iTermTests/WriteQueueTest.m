@@ -0,0 +1,46 @@
+#import "iTermTests.h"
+#import "WriteQueueTest.h"
+#import "WriteQueue.h"
+
+@implementation WriteQueueTest
+
+// Writes everything in |queue| to a file and returns its contents.
+- (NSData *)drainQueue:(WriteQueue *)queue {
+    char path[] = "/tmp/WriteQueueTest.XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    while (queue.length > 0) {
+        assert([queue writeToFileDescriptor:fd] > 0);
+    }
+    close(fd);
+    NSData *contents = [NSData dataWithContentsOfFile:[NSString stringWithUTF8String:path]];
+    unlink(path);
+    return contents;
+}
+
+- (void)testSharedDataKeepsOrder {
+    NSMutableData *big = [NSMutableData dataWithLength:20000];
+    unsigned char *bytes = big.mutableBytes;
+    for (int i = 0; i < big.length; i++) {
+        bytes[i] = i % 251;
+    }
+    NSData *small = [@"0123456789" dataUsingEncoding:NSUTF8StringEncoding];
+
+    WriteQueue *queue = [[[WriteQueue alloc] init] autorelease];
+    NSMutableData *expected = [NSMutableData data];
+    // The first shared data closes an empty tail.
+    [queue appendSharedData:big];
+    [expected appendData:big];
+    [queue appendData:small];
+    [expected appendData:small];
+    [queue appendSharedData:big];
+    [expected appendData:big];
+    // Too short to share, so it's copied.
+    [queue appendSharedData:small];
+    [expected appendData:small];
+    assert(queue.length == expected.length);
+
+    assert([[self drainQueue:queue] isEqualToData:expected]);
+}
+
+@end
@@ -7,6 +7,9 @@
 //
 
 #import "iTermTests.h"
+#import "LineBufferBenchmark.h"
+#import "RenderBenchmark.h"
+#import "VT100ThroughputBenchmark.h"
 #import <objc/runtime.h>
 
 @implementation iTermTest
@@ -19,6 +22,13 @@
 DECLARE_TEST(VT100GridTest)
 DECLARE_TEST(VT100ScreenTest)
 DECLARE_TEST(IntervalTreeTest)
+DECLARE_TEST(TriggerSetTest)
+DECLARE_TEST(WriteQueueTest)
+DECLARE_TEST(ProfileSearchIndexTest)
+DECLARE_TEST(AutocompleteIndexTest)
+DECLARE_TEST(BinaryLogTest)
+DECLARE_TEST(MemoryReportTest)
+DECLARE_TEST(Base64StreamDecoderTest)
 
 static void RunTestsInObject(iTermTest *test) {
     NSLog(@"-- Begin tests in %@ --", [test class]);
@@ -47,7 +57,36 @@ int main(int argc, const char * argv[]) {
     RunTestsInObject([[VT100GridTest new] autorelease]);
     RunTestsInObject([[VT100ScreenTest new] autorelease]);
     RunTestsInObject([[IntervalTreeTest new] autorelease]);
+    RunTestsInObject([[TriggerSetTest new] autorelease]);
+    RunTestsInObject([[WriteQueueTest new] autorelease]);
+    RunTestsInObject([[ProfileSearchIndexTest new] autorelease]);
+    RunTestsInObject([[AutocompleteIndexTest new] autorelease]);
+    RunTestsInObject([[BinaryLogTest new] autorelease]);
+    RunTestsInObject([[MemoryReportTest new] autorelease]);
+    RunTestsInObject([[Base64StreamDecoderTest new] autorelease]);
     NSLog(@"All tests passed");
+
+    if (getenv("ITERM_BENCHMARK")) {
+        VT100ThroughputBenchmark *benchmark = [[VT100ThroughputBenchmark new] autorelease];
+        if (![benchmark run]) {
+            NSLog(@"Benchmark regressed");
+            return 1;
+        }
+    }
+    if (getenv("ITERM_BENCHMARK_LINEBUFFER")) {
+        LineBufferBenchmark *benchmark = [[LineBufferBenchmark new] autorelease];
+        if (![benchmark run]) {
+            NSLog(@"LineBuffer benchmark regressed");
+            return 1;
+        }
+    }
+    if (getenv("ITERM_BENCHMARK_RENDER")) {
+        RenderBenchmark *benchmark = [[RenderBenchmark new] autorelease];
+        if (![benchmark run]) {
+            NSLog(@"Render benchmark regressed");
+            return 1;
+        }
+    }
     return 0;
 }
 
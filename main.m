@@ -13,6 +13,7 @@
 #import <signal.h>
 #import "FutureMethods.h"
 #import "shell_launcher.h"
+#import "pty_server.h"
 
 int main(int argc, const char *argv[])
 {
@@ -21,6 +22,9 @@ int main(int argc, const char *argv[])
             launch_shell();
             return 1;
         }
+        if (!strcmp(argv[i], "--pty_server") && i + 1 < argc) {
+            return pty_server_main(argv[i + 1]);
+        }
     }
     signal(SIGPIPE, SIG_IGN);
     sigset_t signals;
@@ -0,0 +1,330 @@
+// The server side of pty_server.h. It runs as `iTerm.app --pty_server <socket path>`, started by
+// the app as it quits. Everything here is plain C so nothing from the app is loaded.
+
+#include "pty_server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Output beyond this much per session is dropped, oldest first.
+#define PTY_SERVER_MAX_BUFFER (1024 * 1024)
+
+// If the app hasn't handed over a session this long after the server starts, give up.
+#define PTY_SERVER_ADOPTION_TIMEOUT 10
+
+// Sessions held at once.
+#define PTY_SERVER_MAX_CHILDREN 256
+
+typedef struct {
+    int fd;
+    pid_t pid;
+    char tty[64];
+    char key[128];
+    char *buffer;   // Ring buffer of output read while the app was away.
+    int start;      // Index of the oldest byte in buffer.
+    int length;     // Bytes used in buffer.
+} PTYServerChild;
+
+static PTYServerChild children[PTY_SERVER_MAX_CHILDREN];
+static int numChildren;
+
+int pty_server_read_fully(int fd, void *buffer, size_t length)
+{
+    char *p = buffer;
+    while (length > 0) {
+        ssize_t n = read(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+int pty_server_write_fully(int fd, const void *buffer, size_t length)
+{
+    const char *p = buffer;
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+int pty_server_send_message(int socket_fd, const PTYServerMessage *message, int fd)
+{
+    struct iovec iov;
+    iov.iov_base = (void *)message;
+    iov.iov_len = sizeof(*message);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t n;
+    do {
+        n = sendmsg(socket_fd, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+    return n == sizeof(*message) ? 0 : -1;
+}
+
+int pty_server_receive_message(int socket_fd, PTYServerMessage *message, int *fd_ptr)
+{
+    *fd_ptr = -1;
+    struct iovec iov;
+    iov.iov_base = message;
+    iov.iov_len = sizeof(*message);
+
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(socket_fd, &msg, MSG_WAITALL);
+    } while (n < 0 && errno == EINTR);
+    if (n != sizeof(*message)) {
+        return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(fd_ptr, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    // Strings come from the other side; don't trust them to be terminated.
+    message->tty[sizeof(message->tty) - 1] = '\0';
+    message->key[sizeof(message->key) - 1] = '\0';
+    return 0;
+}
+
+static void remove_child(int i)
+{
+    close(children[i].fd);
+    free(children[i].buffer);
+    children[i] = children[--numChildren];
+}
+
+// Appends output to a child's buffer, overwriting the oldest bytes once it's full.
+static void append_output(PTYServerChild *child, const char *bytes, int length)
+{
+    if (length >= PTY_SERVER_MAX_BUFFER) {
+        bytes += length - PTY_SERVER_MAX_BUFFER;
+        length = PTY_SERVER_MAX_BUFFER;
+    }
+    for (int i = 0; i < length; i++) {
+        child->buffer[(child->start + child->length) % PTY_SERVER_MAX_BUFFER] = bytes[i];
+        if (child->length < PTY_SERVER_MAX_BUFFER) {
+            child->length++;
+        } else {
+            child->start = (child->start + 1) % PTY_SERVER_MAX_BUFFER;
+        }
+    }
+}
+
+// Reads everything a child has written so far. Returns 0 if it's gone.
+static int drain_child(PTYServerChild *child)
+{
+    char bytes[4096];
+    for (;;) {
+        ssize_t n = read(child->fd, bytes, sizeof(bytes));
+        if (n > 0) {
+            append_output(child, bytes, n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno == EAGAIN) {
+            return 1;
+        } else {
+            // EOF, or EIO once the slave side is closed.
+            return 0;
+        }
+    }
+}
+
+static void adopt_child(const PTYServerMessage *message, int fd)
+{
+    if (fd < 0) {
+        return;
+    }
+    if (numChildren == PTY_SERVER_MAX_CHILDREN) {
+        close(fd);
+        return;
+    }
+    PTYServerChild *child = &children[numChildren++];
+    memset(child, 0, sizeof(*child));
+    child->fd = fd;
+    child->pid = message->pid;
+    strlcpy(child->tty, message->tty, sizeof(child->tty));
+    strlcpy(child->key, message->key, sizeof(child->key));
+    child->buffer = malloc(PTY_SERVER_MAX_BUFFER);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Sends every child that's still alive back to the app and forgets about it.
+static void hand_back_children(int connection)
+{
+    for (int i = numChildren - 1; i >= 0; i--) {
+        PTYServerChild *child = &children[i];
+        // Pick up anything written since the last pass through select.
+        if (drain_child(child) && kill(child->pid, 0) == 0) {
+            PTYServerMessage message;
+            memset(&message, 0, sizeof(message));
+            message.type = kPTYServerMessageChild;
+            message.pid = child->pid;
+            message.length = child->length;
+            strlcpy(message.tty, child->tty, sizeof(message.tty));
+            strlcpy(message.key, child->key, sizeof(message.key));
+            if (pty_server_send_message(connection, &message, child->fd) == 0) {
+                int firstPart = child->length;
+                if (child->start + firstPart > PTY_SERVER_MAX_BUFFER) {
+                    firstPart = PTY_SERVER_MAX_BUFFER - child->start;
+                }
+                pty_server_write_fully(connection, child->buffer + child->start, firstPart);
+                pty_server_write_fully(connection, child->buffer, child->length - firstPart);
+            }
+        }
+        remove_child(i);
+    }
+    PTYServerMessage done;
+    memset(&done, 0, sizeof(done));
+    done.type = kPTYServerMessageDone;
+    pty_server_send_message(connection, &done, -1);
+}
+
+// Handles messages on a connection until the app closes it.
+static void serve_connection(int connection)
+{
+    PTYServerMessage message;
+    int fd;
+    while (pty_server_receive_message(connection, &message, &fd) == 0) {
+        switch (message.type) {
+            case kPTYServerMessageAdopt:
+                adopt_child(&message, fd);
+                break;
+            case kPTYServerMessageClaim:
+                hand_back_children(connection);
+                break;
+            default:
+                if (fd >= 0) {
+                    close(fd);
+                }
+                break;
+        }
+    }
+    close(connection);
+}
+
+int pty_server_main(const char *socket_path)
+{
+    // Outlive the app and its terminal.
+    setsid();
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        return 1;
+    }
+    strlcpy(address.sun_path, socket_path, sizeof(address.sun_path));
+    unlink(socket_path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        return 1;
+    }
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(listener, 4) < 0) {
+        close(listener);
+        return 1;
+    }
+    chmod(socket_path, 0600);
+
+    const time_t startTime = time(NULL);
+    int everAdopted = 0;
+    for (;;) {
+        if (everAdopted && numChildren == 0) {
+            break;
+        }
+        if (!everAdopted && time(NULL) - startTime > PTY_SERVER_ADOPTION_TIMEOUT) {
+            break;
+        }
+
+        fd_set readSet;
+        FD_ZERO(&readSet);
+        FD_SET(listener, &readSet);
+        int maxFd = listener;
+        for (int i = 0; i < numChildren; i++) {
+            FD_SET(children[i].fd, &readSet);
+            if (children[i].fd > maxFd) {
+                maxFd = children[i].fd;
+            }
+        }
+        // Wake up now and then to notice children that exited without closing the pty.
+        struct timeval timeout = { 1, 0 };
+        int n = select(maxFd + 1, &readSet, NULL, NULL, &timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        for (int i = numChildren - 1; i >= 0; i--) {
+            if (FD_ISSET(children[i].fd, &readSet) && !drain_child(&children[i])) {
+                remove_child(i);
+            } else if (kill(children[i].pid, 0) != 0 && errno == ESRCH) {
+                remove_child(i);
+            }
+        }
+
+        if (FD_ISSET(listener, &readSet)) {
+            int connection = accept(listener, NULL, NULL);
+            if (connection >= 0) {
+                serve_connection(connection);
+                everAdopted = everAdopted || numChildren > 0;
+            }
+        }
+    }
+
+    close(listener);
+    unlink(socket_path);
+    return 0;
+}
@@ -0,0 +1,50 @@
+//
+//  pty_server.h
+//  iTerm
+//
+//  A helper process that keeps sessions' shells alive while the app restarts. On quit the app runs
+//  itself with --pty_server, passes the master fd of each session's pty to it over a Unix domain
+//  socket (SCM_RIGHTS), and exits without hanging up the shells. The server drains and buffers
+//  their output so they don't block. When the app starts again it claims the fds and buffered
+//  output back, and the server exits once it has nothing left to hold.
+//
+
+#ifndef iTerm_pty_server_h
+#define iTerm_pty_server_h
+
+#include <sys/types.h>
+
+typedef enum {
+    // App to server, with a pty master fd: keep this session alive.
+    kPTYServerMessageAdopt = 1,
+    // App to server: send back all sessions.
+    kPTYServerMessageClaim,
+    // Server to app, with a pty master fd, followed by |length| bytes of buffered output.
+    kPTYServerMessageChild,
+    // Server to app: no more sessions follow.
+    kPTYServerMessageDone
+} PTYServerMessageType;
+
+typedef struct {
+    int type;         // PTYServerMessageType
+    pid_t pid;        // The shell's process id.
+    int length;       // For kPTYServerMessageChild, the number of bytes of output that follow.
+    char tty[64];     // e.g., /dev/ttys003
+    char key[128];    // Identifies the session in the app's saved window arrangements.
+} PTYServerMessage;
+
+// Runs the server, listening on |socket_path|. Returns when no sessions are left.
+int pty_server_main(const char *socket_path);
+
+// Sends |message| with |fd| attached, or no fd if it's negative. Returns 0 on success.
+int pty_server_send_message(int socket_fd, const PTYServerMessage *message, int fd);
+
+// Receives one message into |message|, storing an attached fd in *fd_ptr (or -1 if there wasn't
+// one). Returns 0 on success.
+int pty_server_receive_message(int socket_fd, PTYServerMessage *message, int *fd_ptr);
+
+// Reads or writes exactly |length| bytes, retrying as needed. Return 0 on success.
+int pty_server_read_fully(int fd, void *buffer, size_t length);
+int pty_server_write_fully(int fd, const void *buffer, size_t length);
+
+#endif